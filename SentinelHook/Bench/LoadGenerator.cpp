@@ -0,0 +1,241 @@
+//
+// SentinelHook Bench - Load Generator Implementation
+//
+
+#include "LoadGenerator.h"
+#include "..\Common\record.h"
+#include <stdio.h>
+
+//
+// Constructor
+//
+LoadGenerator::LoadGenerator(const LoadGeneratorConfig& config)
+    : m_Config(config)
+    , m_StopEvent(NULL)
+    , m_DataEvent(NULL)
+    , m_Generated(0)
+    , m_Overflows(0)
+{
+    m_Config.Producers = max(m_Config.Producers, 1UL);
+    m_Config.DistinctPaths = max(m_Config.DistinctPaths, 1UL);
+}
+
+//
+// Destructor
+//
+LoadGenerator::~LoadGenerator()
+{
+    Stop();
+
+    if (m_DataEvent) {
+        CloseHandle(m_DataEvent);
+        m_DataEvent = NULL;
+    }
+
+    if (m_StopEvent) {
+        CloseHandle(m_StopEvent);
+        m_StopEvent = NULL;
+    }
+}
+
+//
+// Start
+//
+BOOL LoadGenerator::Start()
+{
+    m_StopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    m_DataEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!m_StopEvent || !m_DataEvent) {
+        return FALSE;
+    }
+
+    for (ULONG i = 0; i < m_Config.Producers; i++) {
+        m_Threads.emplace_back(&LoadGenerator::ProducerThread, this, i);
+    }
+
+    return TRUE;
+}
+
+//
+// Stop
+// Producers finish the batch they are on; queued batches can still be
+// drained afterwards
+//
+VOID LoadGenerator::Stop()
+{
+    if (m_StopEvent) {
+        SetEvent(m_StopEvent);
+    }
+
+    for (auto& thread : m_Threads) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    m_Threads.clear();
+}
+
+//
+// Drain
+//
+BOOL LoadGenerator::Drain(DriverComm& driverComm, TelemetryAggregator& aggregator)
+{
+    std::deque<std::vector<UCHAR>> batches;
+    BOOL consumed = FALSE;
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        batches.swap(m_Queue);
+    }
+
+    for (const auto& batch : batches) {
+        if (driverComm.IngestBatch(aggregator, batch.data(), batch.size())) {
+            consumed = TRUE;
+        }
+    }
+
+    // buffers go back to the producers instead of being reallocated
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    for (auto& batch : batches) {
+        m_FreeBuffers.push_back(std::move(batch));
+    }
+
+    return consumed;
+}
+
+//
+// Producer Thread
+// Paced against its share of EventsPerSecond; a producer that falls
+// behind sends full batches until it has caught up
+//
+VOID LoadGenerator::ProducerThread(ULONG index)
+{
+    ULONG64 rate = m_Config.EventsPerSecond / m_Config.Producers;
+    ULONG64 start = 0;
+    ULONG64 sent = 0;
+    ULONG64 sequence = (ULONG64)index << 40;
+
+    if (m_Config.EventsPerSecond != 0) {
+        rate = max(rate, 1ULL);
+    }
+
+    QueryInterruptTime(&start);
+
+    while (WaitForSingleObject(m_StopEvent, 0) == WAIT_TIMEOUT) {
+        ULONG eventCount = BATCH_EVENTS;
+
+        if (rate != 0) {
+            ULONG64 now;
+            QueryInterruptTime(&now);
+
+            // interrupt time is in 100 ns units
+            ULONG64 due = (ULONG64)((double)rate * (double)(now - start) / 10000000.0);
+            if (due <= sent) {
+                WaitForSingleObject(m_StopEvent, 1);
+                continue;
+            }
+            eventCount = (ULONG)min(due - sent, (ULONG64)BATCH_EVENTS);
+        }
+
+        std::vector<UCHAR> buffer;
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            if (!m_FreeBuffers.empty()) {
+                buffer = std::move(m_FreeBuffers.back());
+                m_FreeBuffers.pop_back();
+            }
+        }
+
+        ULONG built = BuildBatch(buffer, eventCount, index, sequence);
+        sent += built;
+        m_Generated.fetch_add(built, std::memory_order_relaxed);
+
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            if (m_Queue.size() >= MAX_QUEUED_BATCHES) {
+                // what the driver does when its ring is full
+                m_Overflows.fetch_add(built, std::memory_order_relaxed);
+                m_FreeBuffers.push_back(std::move(buffer));
+            } else {
+                m_Queue.push_back(std::move(buffer));
+            }
+        }
+
+        SetEvent(m_DataEvent);
+    }
+}
+
+//
+// Build Batch
+// Same layout as an IOCTL_SENTINELHOOK_GET_TELEMETRY reply
+//
+ULONG LoadGenerator::BuildBatch(std::vector<UCHAR>& buffer, ULONG eventCount, ULONG producer, ULONG64& sequence)
+{
+    TELEMETRY_ENTRY entry;
+    ULONG used = sizeof(TELEMETRY_BATCH_HEADER);
+    ULONG count = 0;
+
+    buffer.resize(MAX_TELEMETRY_BUFFER_SIZE);
+
+    while (count < eventCount &&
+        MAX_TELEMETRY_BUFFER_SIZE - used >= TELEMETRY_RECORD_ALIGN(TELEMETRY_RECORD_MAX_SIZE)) {
+        BuildEntry(entry, producer, sequence++);
+
+        ULONG recordSize = TelemetryRecordFromEntry(&entry, buffer.data() + used, MAX_TELEMETRY_BUFFER_SIZE - used);
+        if (recordSize == 0) {
+            break;
+        }
+
+        used += TELEMETRY_RECORD_ALIGN(recordSize);
+        count++;
+    }
+
+    PTELEMETRY_BATCH_HEADER header = (PTELEMETRY_BATCH_HEADER)buffer.data();
+    header->Count = count;
+    header->BytesUsed = used;
+    header->Flags = 0;
+    header->Reserved = 0;
+
+    return count;
+}
+
+//
+// Build Entry
+// Deterministic mix from the sequence number, so runs are comparable
+//
+VOID LoadGenerator::BuildEntry(TELEMETRY_ENTRY& entry, ULONG producer, ULONG64 sequence)
+{
+    ULONG hash = (ULONG)((sequence * 2654435761ULL) >> 7);
+    ULONG processId = 1000 + producer * 16 + (hash >> 24) % 16;
+    ULONG64 now;
+
+    QueryInterruptTime(&now);
+    ZeroMemory(&entry, sizeof(entry));
+    entry.Timestamp = now;
+
+    if ((hash >> 8) % 100 < m_Config.ProcessEventPercent) {
+        PPROCESS_TELEMETRY process = &entry.Data.ProcessEvent;
+
+        entry.EventType = (sequence & 1) ? EventProcessTerminate : EventProcessCreate;
+        process->EventType = entry.EventType;
+        process->Timestamp = now;
+        process->ProcessId = processId;
+        process->ParentProcessId = 4;
+        wcscpy_s(process->ProcessName, L"bench.exe");
+        wcscpy_s(process->ImagePath, L"\\Device\\HarddiskVolume3\\Bench\\bench.exe");
+        return;
+    }
+
+    static const TELEMETRY_EVENT_TYPE fileTypes[] = { EventFileRead, EventFileWrite, EventFileCreate };
+    PFILE_TELEMETRY file = &entry.Data.FileEvent;
+
+    entry.EventType = fileTypes[(hash >> 16) % ARRAYSIZE(fileTypes)];
+    file->EventType = entry.EventType;
+    file->Timestamp = now;
+    file->ProcessId = processId;
+    file->BytesTransferred = 4096;
+    file->EventCount = 1;
+    swprintf_s(file->FilePath, L"\\Device\\HarddiskVolume3\\Bench\\%08lx.dat", hash % m_Config.DistinctPaths);
+    wcscpy_s(file->ProcessName, L"bench.exe");
+}
@@ -0,0 +1,64 @@
+//
+// SentinelHook Bench - Load Generator Header
+// Stands in for the driver: synthetic telemetry packed into the same
+// GET_TELEMETRY batches the device returns
+//
+
+#pragma once
+
+#include <windows.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "..\Common\telemetry.h"
+#include "..\Service\DriverComm.h"
+#include "..\Service\TelemetryAggregator.h"
+
+struct LoadGeneratorConfig {
+    ULONG64 EventsPerSecond;        // all producers together, 0 = as fast as possible
+    ULONG Producers;
+    ULONG DistinctPaths;            // fewer paths means more for the coalescer to fold
+    ULONG ProcessEventPercent;      // the rest are file events
+};
+
+//
+// Producer threads pace themselves against interrupt time and queue
+// batches of wire records, each stamped with the time it was generated.
+// The queue is bounded like the driver's rings: when the drain side falls
+// behind, whole batches are dropped and counted as overflows. Drain is
+// called from the benchmark's drain loop and hands every queued batch to
+// DriverComm::IngestBatch, the same decode path the IOCTL drain uses.
+//
+class LoadGenerator {
+public:
+    explicit LoadGenerator(const LoadGeneratorConfig& config);
+    ~LoadGenerator();
+
+    BOOL Start();
+    VOID Stop();
+    BOOL Drain(DriverComm& driverComm, TelemetryAggregator& aggregator);
+
+    HANDLE GetDataEvent() const { return m_DataEvent; }
+    ULONG64 GetGenerated() const { return m_Generated.load(std::memory_order_relaxed); }
+    ULONG64 GetOverflows() const { return m_Overflows.load(std::memory_order_relaxed); }
+
+private:
+    LoadGeneratorConfig m_Config;
+    HANDLE m_StopEvent;
+    HANDLE m_DataEvent;
+    std::vector<std::thread> m_Threads;
+    std::mutex m_Mutex;
+    std::deque<std::vector<UCHAR>> m_Queue;             // under m_Mutex
+    std::vector<std::vector<UCHAR>> m_FreeBuffers;      // under m_Mutex
+    std::atomic<ULONG64> m_Generated;
+    std::atomic<ULONG64> m_Overflows;
+
+    static const size_t MAX_QUEUED_BATCHES = 64;
+    static const ULONG BATCH_EVENTS = 64;
+
+    VOID ProducerThread(ULONG index);
+    ULONG BuildBatch(std::vector<UCHAR>& buffer, ULONG eventCount, ULONG producer, ULONG64& sequence);
+    VOID BuildEntry(TELEMETRY_ENTRY& entry, ULONG producer, ULONG64 sequence);
+};
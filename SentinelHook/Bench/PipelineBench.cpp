@@ -0,0 +1,269 @@
+//
+// SentinelHook Bench - Pipeline Benchmark Implementation
+//
+
+#include "PipelineBench.h"
+#include "..\Service\DriverComm.h"
+#include "..\Service\ETWProvider.h"
+#include "..\Service\NamedPipe.h"
+#include "..\Service\SinkPipeline.h"
+#include <stdio.h>
+
+//
+// Constructor
+//
+PipelineBench::PipelineBench(const BenchConfig& config)
+    : m_Config(config)
+    , m_Received(0)
+{
+    for (auto& bucket : m_Latency) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+}
+
+//
+// Run
+//
+int PipelineBench::Run()
+{
+    // never opened, only its batch decoding is used
+    DriverComm driverComm;
+    TelemetryAggregator aggregator;
+    ETWProvider etwProvider;
+    NamedPipe namedPipe;
+    LoadGenerator generator(m_Config.Load);
+
+    if (m_Config.UseEtw && !etwProvider.Initialize()) {
+        fwprintf(stderr, L"ETW provider registration failed\n");
+        return 1;
+    }
+
+    if (m_Config.UsePipe && !CheckPipePaths()) {
+        return 1;
+    }
+    if (m_Config.UsePipe && !namedPipe.Initialize(m_Config.PipeName, m_Config.SpoolDirectory)) {
+        fwprintf(stderr, L"Telemetry pipe %s could not be created\n", m_Config.PipeName.c_str());
+        return 1;
+    }
+
+    SinkPipeline sinks(aggregator);
+    if (m_Config.UseEtw) {
+        sinks.AddSink(L"etw", SinkLossless,
+            [&etwProvider](const TelemetryEventSpan& events) { return etwProvider.WriteEvents(events); });
+    }
+    if (m_Config.UsePipe) {
+        sinks.AddSink(L"pipe", SinkLossy,
+            [&namedPipe](const TelemetryEventSpan& events) { return namedPipe.SendTelemetry(events); });
+    }
+    sinks.AddSink(L"latency", SinkLossless,
+        [this](const TelemetryEventSpan& events) { return RecordLatency(events); });
+
+    if (!sinks.Start() || !generator.Start()) {
+        fwprintf(stderr, L"Failed to start the pipeline\n");
+        return 1;
+    }
+
+    wprintf(L"%8s %14s %14s %10s %10s %10s %10s\n",
+        L"time", L"generated/s", L"delivered/s", L"dropped", L"p50 us", L"p99 us", L"p999 us");
+
+    Snapshot previous = {};
+    Snapshot current;
+    ULONG64 start = GetTickCount64();
+    ULONG64 lastReport = start;
+    ULONG64 duration = (ULONG64)m_Config.Seconds * 1000;
+    TelemetrySinkStats pipeStats = {};
+
+    // same order as the service loop
+    for (ULONG64 now = start; now - start < duration; now = GetTickCount64()) {
+        WaitForSingleObject(generator.GetDataEvent(), DRAIN_WAIT_MS);
+
+        generator.Drain(driverComm, aggregator);
+        aggregator.FlushCoalesced(FALSE);
+        aggregator.ProcessEvents();
+
+        sinks.Notify();
+        aggregator.Reclaim();
+
+        if (now - lastReport >= REPORT_INTERVAL_MS) {
+            sinks.GetSinkStats(L"pipe", pipeStats);
+            TakeSnapshot(current, generator, aggregator, pipeStats.Dropped);
+            PrintInterval(current, previous, now - start, now - lastReport);
+            previous = current;
+            lastReport = now;
+        }
+    }
+
+    ULONG64 elapsedMs = GetTickCount64() - start;
+
+    // whatever was queued when the producers stopped
+    generator.Stop();
+    generator.Drain(driverComm, aggregator);
+    aggregator.FlushCoalesced(TRUE);
+    aggregator.ProcessEvents();
+
+    for (ULONG64 waitStart = GetTickCount64(); GetTickCount64() - waitStart < CATCH_UP_TIMEOUT_MS; ) {
+        TelemetrySinkStats latencyStats;
+
+        sinks.Notify();
+        aggregator.Reclaim();
+        if (!sinks.GetSinkStats(L"latency", latencyStats) || latencyStats.Lag == 0) {
+            break;
+        }
+        Sleep(DRAIN_WAIT_MS);
+    }
+
+    sinks.GetSinkStats(L"pipe", pipeStats);
+    sinks.Stop();
+    namedPipe.Shutdown();
+    etwProvider.Shutdown();
+
+    TakeSnapshot(current, generator, aggregator, pipeStats.Dropped);
+
+    ULONG64 overflows = generator.GetOverflows();
+    ULONG64 lost = overflows + aggregator.GetDroppedEvents();
+    double seconds = max(elapsedMs, 1ULL) / 1000.0;
+
+    wprintf(L"\n");
+    wprintf(L"generated      %llu (%.0f/s)\n", current.Generated, current.Generated / seconds);
+    wprintf(L"delivered      %llu (%.0f/s sustained)\n", current.Received, current.Received / seconds);
+    wprintf(L"coalesced      %llu\n", aggregator.GetCoalescedEvents());
+    wprintf(L"device drops   %llu\n", overflows);
+    wprintf(L"ring drops     %llu\n", aggregator.GetDroppedEvents());
+    if (m_Config.UsePipe) {
+        wprintf(L"pipe drops     %llu\n", pipeStats.Dropped);
+    }
+    wprintf(L"drop rate      %.3f%%\n", current.Generated ? 100.0 * lost / current.Generated : 0.0);
+
+    ULONG64 latencyCount = 0;
+    for (ULONG64 count : current.Latency) {
+        latencyCount += count;
+    }
+
+    if (latencyCount != 0) {
+        wprintf(L"latency us     p50 %llu  p99 %llu  p999 %llu\n",
+            PerfHistogramPercentile(current.Latency, latencyCount, 50000),
+            PerfHistogramPercentile(current.Latency, latencyCount, 99000),
+            PerfHistogramPercentile(current.Latency, latencyCount, 99900));
+    }
+
+    // everything generated was either delivered or counted as dropped,
+    // otherwise events went missing and the run is a failure
+    return (current.Received + lost >= current.Generated) ? 0 : 2;
+}
+
+//
+// Check Pipe Paths
+// The run would take over the service's subscribers, or replay and
+// truncate the spool holding its undelivered events
+//
+BOOL PipelineBench::CheckPipePaths() const
+{
+    if (_wcsicmp(m_Config.PipeName.c_str(), NamedPipe::PIPE_NAME) == 0) {
+        fwprintf(stderr, L"Refusing the service's telemetry pipe, pass another -pipename\n");
+        return FALSE;
+    }
+
+    std::wstring production = NamedPipe::DefaultSpoolDirectory();
+    if (m_Config.SpoolDirectory.empty() || production.empty()) {
+        return TRUE;
+    }
+
+    WCHAR spool[MAX_PATH];
+    WCHAR productionSpool[MAX_PATH];
+    DWORD length = GetFullPathNameW(m_Config.SpoolDirectory.c_str(), MAX_PATH, spool, NULL);
+    DWORD productionLength = GetFullPathNameW(production.c_str(), MAX_PATH, productionSpool, NULL);
+
+    if (length == 0 || length >= MAX_PATH || productionLength == 0 || productionLength >= MAX_PATH) {
+        fwprintf(stderr, L"Spool directory %s could not be resolved\n", m_Config.SpoolDirectory.c_str());
+        return FALSE;
+    }
+    while (length > 3 && spool[length - 1] == L'\\') {
+        spool[--length] = L'\0';
+    }
+    if (_wcsicmp(spool, productionSpool) == 0) {
+        fwprintf(stderr, L"Refusing the service's spool directory, pass another -spool\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+//
+// Record Latency
+// Lossless sink; entries folded by the coalescer count once per
+// operation but are timed from the first one
+//
+BOOL PipelineBench::RecordLatency(const TelemetryEventSpan& events)
+{
+    ULONG64 now;
+    ULONG64 received = 0;
+
+    QueryInterruptTime(&now);
+
+    for (const TELEMETRY_ENTRY& entry : events) {
+        ULONG64 latencyUs = (now > entry.Timestamp) ? (now - entry.Timestamp) / 10 : 0;
+
+        m_Latency[PerfHistogramBucket(latencyUs)].fetch_add(1, std::memory_order_relaxed);
+
+        switch (entry.EventType) {
+        case EventFileCreate:
+        case EventFileRead:
+        case EventFileWrite:
+        case EventFileDelete:
+            received += max(entry.Data.FileEvent.EventCount, 1UL);
+            break;
+
+        default:
+            received++;
+            break;
+        }
+    }
+
+    m_Received.fetch_add(received, std::memory_order_relaxed);
+    return TRUE;
+}
+
+//
+// Take Snapshot
+//
+VOID PipelineBench::TakeSnapshot(Snapshot& snapshot, const LoadGenerator& generator,
+    const TelemetryAggregator& aggregator, ULONG64 sinkDrops) const
+{
+    snapshot.Generated = generator.GetGenerated();
+    snapshot.Received = m_Received.load(std::memory_order_relaxed);
+    snapshot.Dropped = generator.GetOverflows() + aggregator.GetDroppedEvents() + sinkDrops;
+
+    for (ULONG i = 0; i < PERF_HISTOGRAM_BUCKETS; i++) {
+        snapshot.Latency[i] = m_Latency[i].load(std::memory_order_relaxed);
+    }
+}
+
+//
+// Print Interval
+//
+VOID PipelineBench::PrintInterval(const Snapshot& current, const Snapshot& previous,
+    ULONG64 elapsedMs, ULONG64 intervalMs)
+{
+    ULONG64 latency[PERF_HISTOGRAM_BUCKETS];
+    ULONG64 latencyCount = 0;
+    double seconds = intervalMs / 1000.0;
+
+    for (ULONG i = 0; i < PERF_HISTOGRAM_BUCKETS; i++) {
+        latency[i] = current.Latency[i] - previous.Latency[i];
+        latencyCount += latency[i];
+    }
+
+    wprintf(L"%7.1fs %14.0f %14.0f %10llu",
+        elapsedMs / 1000.0,
+        (current.Generated - previous.Generated) / seconds,
+        (current.Received - previous.Received) / seconds,
+        current.Dropped - previous.Dropped);
+
+    if (latencyCount != 0) {
+        wprintf(L" %10llu %10llu %10llu\n",
+            PerfHistogramPercentile(latency, latencyCount, 50000),
+            PerfHistogramPercentile(latency, latencyCount, 99000),
+            PerfHistogramPercentile(latency, latencyCount, 99900));
+    } else {
+        wprintf(L" %10s %10s %10s\n", L"-", L"-", L"-");
+    }
+}
@@ -0,0 +1,58 @@
+//
+// SentinelHook Bench - Pipeline Benchmark Header
+//
+
+#pragma once
+
+#include <windows.h>
+#include <atomic>
+#include <string>
+#include "..\Common\telemetry.h"
+#include "..\Service\TelemetryAggregator.h"
+#include "LoadGenerator.h"
+
+struct BenchConfig {
+    LoadGeneratorConfig Load;
+    ULONG Seconds;
+    BOOL UseEtw;                    // register the real provider as a sink
+    BOOL UsePipe;                   // serve a telemetry pipe and spool of the bench's own
+    std::wstring PipeName;
+    std::wstring SpoolDirectory;    // empty for no spool
+};
+
+//
+// Runs the service pipeline against a LoadGenerator instead of the
+// driver: the same drain loop as ServiceCore (ingest, coalesce, correlate,
+// publish) with the ETW and pipe sinks plus a lossless latency sink that
+// measures generation-to-sink time per event. Prints a line per second
+// and a summary at the end.
+//
+class PipelineBench {
+public:
+    explicit PipelineBench(const BenchConfig& config);
+
+    int Run();
+
+private:
+    // counters written by the latency sink, read by the report
+    struct Snapshot {
+        ULONG64 Generated;
+        ULONG64 Received;
+        ULONG64 Dropped;
+        ULONG64 Latency[PERF_HISTOGRAM_BUCKETS];
+    };
+
+    BenchConfig m_Config;
+    std::atomic<ULONG64> m_Received;            // weighted by folded count
+    std::atomic<ULONG64> m_Latency[PERF_HISTOGRAM_BUCKETS];     // microseconds
+
+    static const DWORD REPORT_INTERVAL_MS = 1000;
+    static const DWORD DRAIN_WAIT_MS = 100;
+    static const DWORD CATCH_UP_TIMEOUT_MS = 5000;
+
+    BOOL CheckPipePaths() const;
+    BOOL RecordLatency(const TelemetryEventSpan& events);
+    VOID TakeSnapshot(Snapshot& snapshot, const LoadGenerator& generator, const TelemetryAggregator& aggregator,
+        ULONG64 sinkDrops) const;
+    static VOID PrintInterval(const Snapshot& current, const Snapshot& previous, ULONG64 elapsedMs, ULONG64 intervalMs);
+};
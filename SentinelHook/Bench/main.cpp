@@ -0,0 +1,74 @@
+// pipeline benchmark entry point
+// drives the service pipeline with synthetic telemetry, no driver needed
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "PipelineBench.h"
+
+// never the service's, which a run would take over
+static const WCHAR* BENCH_PIPE_NAME = L"\\\\.\\pipe\\SentinelHookBenchTelemetry";
+
+static VOID Usage()
+{
+    wprintf(
+        L"usage: SentinelHookBench [options]\n"
+        L"  -rate N       events per second, 0 = as fast as possible (default 100000)\n"
+        L"  -seconds N    run time (default 10)\n"
+        L"  -producers N  generator threads (default 4)\n"
+        L"  -paths N      distinct file paths (default 4096)\n"
+        L"  -process N    percent of process events (default 5)\n"
+        L"  -noetw        leave out the ETW sink\n"
+        L"  -pipe         add a telemetry pipe sink, with its own pipe and spool\n"
+        L"  -pipename P   its pipe (default %s)\n"
+        L"  -spool DIR    its spool directory, \"\" for none (default %%TEMP%%\\SentinelHookBenchSpool)\n",
+        BENCH_PIPE_NAME);
+}
+
+int wmain(int argc, wchar_t* argv[])
+{
+    BenchConfig config = {};
+    config.Load.EventsPerSecond = 100000;
+    config.Load.Producers = 4;
+    config.Load.DistinctPaths = 4096;
+    config.Load.ProcessEventPercent = 5;
+    config.Seconds = 10;
+    config.UseEtw = TRUE;
+    config.UsePipe = FALSE;
+    config.PipeName = BENCH_PIPE_NAME;
+
+    WCHAR tempPath[MAX_PATH];
+    DWORD tempLength = GetTempPathW(MAX_PATH, tempPath);
+    if (tempLength != 0 && tempLength < MAX_PATH) {
+        config.SpoolDirectory = std::wstring(tempPath) + L"SentinelHookBenchSpool";
+    }
+
+    for (int i = 1; i < argc; i++) {
+        BOOL hasValue = (i + 1 < argc);
+
+        if (_wcsicmp(argv[i], L"-rate") == 0 && hasValue) {
+            config.Load.EventsPerSecond = _wcstoui64(argv[++i], NULL, 10);
+        } else if (_wcsicmp(argv[i], L"-seconds") == 0 && hasValue) {
+            config.Seconds = wcstoul(argv[++i], NULL, 10);
+        } else if (_wcsicmp(argv[i], L"-producers") == 0 && hasValue) {
+            config.Load.Producers = wcstoul(argv[++i], NULL, 10);
+        } else if (_wcsicmp(argv[i], L"-paths") == 0 && hasValue) {
+            config.Load.DistinctPaths = wcstoul(argv[++i], NULL, 10);
+        } else if (_wcsicmp(argv[i], L"-process") == 0 && hasValue) {
+            config.Load.ProcessEventPercent = min(wcstoul(argv[++i], NULL, 10), 100UL);
+        } else if (_wcsicmp(argv[i], L"-noetw") == 0) {
+            config.UseEtw = FALSE;
+        } else if (_wcsicmp(argv[i], L"-pipe") == 0) {
+            config.UsePipe = TRUE;
+        } else if (_wcsicmp(argv[i], L"-pipename") == 0 && hasValue) {
+            config.PipeName = argv[++i];
+        } else if (_wcsicmp(argv[i], L"-spool") == 0 && hasValue) {
+            config.SpoolDirectory = argv[++i];
+        } else {
+            Usage();
+            return 1;
+        }
+    }
+
+    PipelineBench bench(config);
+    return bench.Run();
+}
@@ -20,6 +20,7 @@ DEFINE_GUID(SentinelHookProviderGuid,
 #define EVENT_IMAGE_LOAD            0x04
 #define EVENT_INJECTION_DETECTED    0x05
 #define EVENT_UNSIGNED_DRIVER       0x06
+#define EVENT_PERF_COUNTERS         0x07
 
 // Event levels
 #define EVENT_LEVEL_CRITICAL        1
@@ -28,3 +29,43 @@ DEFINE_GUID(SentinelHookProviderGuid,
 #define EVENT_LEVEL_INFO            4
 #define EVENT_LEVEL_VERBOSE         5
 
+// Event keywords, one per event family; a session enables just the ones it
+// wants and the service skips encoding the rest
+#define SENTINELHOOK_KEYWORD_FILE       0x0000000000000001ULL
+#define SENTINELHOOK_KEYWORD_PROCESS    0x0000000000000002ULL
+#define SENTINELHOOK_KEYWORD_IMAGE      0x0000000000000004ULL
+#define SENTINELHOOK_KEYWORD_ALERT      0x0000000000000008ULL
+#define SENTINELHOOK_KEYWORD_PERF       0x0000000000000010ULL   // also turns the driver profiler on
+
+// Precompiled event descriptors: Id, Version, Channel, Level, Opcode, Task, Keyword
+// Version 2 payloads are a single compact TELEMETRY_RECORD
+static const EVENT_DESCRIPTOR SentinelHookFileOperationEvent =
+    { EVENT_FILE_OPERATION, 2, 0, EVENT_LEVEL_INFO, 0, 0, SENTINELHOOK_KEYWORD_FILE };
+static const EVENT_DESCRIPTOR SentinelHookProcessCreateEvent =
+    { EVENT_PROCESS_CREATE, 2, 0, EVENT_LEVEL_INFO, 0, 0, SENTINELHOOK_KEYWORD_PROCESS };
+static const EVENT_DESCRIPTOR SentinelHookProcessTerminateEvent =
+    { EVENT_PROCESS_TERMINATE, 2, 0, EVENT_LEVEL_INFO, 0, 0, SENTINELHOOK_KEYWORD_PROCESS };
+static const EVENT_DESCRIPTOR SentinelHookImageLoadEvent =
+    { EVENT_IMAGE_LOAD, 2, 0, EVENT_LEVEL_INFO, 0, 0, SENTINELHOOK_KEYWORD_IMAGE };
+static const EVENT_DESCRIPTOR SentinelHookInjectionEvent =
+    { EVENT_INJECTION_DETECTED, 2, 0, EVENT_LEVEL_WARNING, 0, 0,
+      SENTINELHOOK_KEYWORD_PROCESS | SENTINELHOOK_KEYWORD_ALERT };
+static const EVENT_DESCRIPTOR SentinelHookUnsignedDriverEvent =
+    { EVENT_UNSIGNED_DRIVER, 2, 0, EVENT_LEVEL_WARNING, 0, 0,
+      SENTINELHOOK_KEYWORD_IMAGE | SENTINELHOOK_KEYWORD_ALERT };
+
+// Minifilter latency over the last reporting interval, one event per
+// PERF_OPERATION / PERF_STAGE pair that saw any calls
+// Percentiles are the upper edge of the histogram bucket they fall in
+typedef struct _PERF_COUNTERS_EVENT {
+    ULONG Operation;                // PERF_OPERATION
+    ULONG Stage;                    // PERF_STAGE
+    ULONG64 Count;
+    ULONG64 P50Ns;
+    ULONG64 P99Ns;
+    ULONG64 P999Ns;
+    ULONG64 IntervalMs;
+} PERF_COUNTERS_EVENT, *PPERF_COUNTERS_EVENT;
+
+static const EVENT_DESCRIPTOR SentinelHookPerfCountersEvent =
+    { EVENT_PERF_COUNTERS, 1, 0, EVENT_LEVEL_INFO, 0, 0, SENTINELHOOK_KEYWORD_PERF };
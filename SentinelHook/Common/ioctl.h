@@ -31,6 +31,42 @@
 #define IOCTL_SENTINELHOOK_DISABLE_MONITORING \
     CTL_CODE(FILE_DEVICE_UNKNOWN, SENTINELHOOK_IOCTL_BASE + 0x05, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
+#define IOCTL_SENTINELHOOK_MAP_TELEMETRY \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, SENTINELHOOK_IOCTL_BASE + 0x06, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_SENTINELHOOK_UNMAP_TELEMETRY \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, SENTINELHOOK_IOCTL_BASE + 0x07, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_SENTINELHOOK_RESOLVE_STRING \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, SENTINELHOOK_IOCTL_BASE + 0x08, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_SENTINELHOOK_SET_RATE_LIMIT \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, SENTINELHOOK_IOCTL_BASE + 0x09, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// a signed verdict suppresses alerts for the file, so only a handle
+// opened for writing may set one (the device itself is SYSTEM and
+// Administrators only)
+#define IOCTL_SENTINELHOOK_SET_IMAGE_VERDICT \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, SENTINELHOOK_IOCTL_BASE + 0x0A, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+// input is a MULTI_SZ of path substrings that flag a process create as
+// EventProcessInjection, matched case-insensitively anywhere in the path
+#define IOCTL_SENTINELHOOK_SET_PATH_INDICATORS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, SENTINELHOOK_IOCTL_BASE + 0x0B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// minifilter profiler: turn per-stage timing on or off, and read the
+// histograms it has collected
+#define IOCTL_SENTINELHOOK_SET_PERF \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, SENTINELHOOK_IOCTL_BASE + 0x0C, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_SENTINELHOOK_GET_PERF \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, SENTINELHOOK_IOCTL_BASE + 0x0D, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// MONITOR_CONFIG: which operations are monitored and which volumes the
+// filter stays off, without touching exclusions or indicators
+#define IOCTL_SENTINELHOOK_SET_MONITOR \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, SENTINELHOOK_IOCTL_BASE + 0x0E, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
 // Maximum buffer sizes
 #define MAX_TELEMETRY_BUFFER_SIZE    (64 * 1024)  // 64 KB
 #define MAX_PATH_LENGTH              260
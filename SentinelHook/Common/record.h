@@ -0,0 +1,244 @@
+//
+// SentinelHook - Compact Record Codec
+// Conversion between TELEMETRY_RECORD (wire) and TELEMETRY_ENTRY (in-memory)
+//
+
+#pragma once
+
+#include <windows.h>
+#include "ioctl.h"
+#include "telemetry.h"
+
+//
+// Validate a record received from the driver or a peer
+// Available is the number of readable bytes at Record
+//
+static __inline BOOL TelemetryRecordValidate(const TELEMETRY_RECORD* Record, SIZE_T Available)
+{
+    SIZE_T stringBytes;
+
+    if (Available < sizeof(TELEMETRY_RECORD) || Record->Size < sizeof(TELEMETRY_RECORD) ||
+        Record->Size > Available || Record->Version != TELEMETRY_RECORD_VERSION) {
+        return FALSE;
+    }
+
+    if (Record->PathLength >= MAX_PATH_LENGTH || Record->ProcessNameLength >= MAX_PROCESS_NAME_LENGTH) {
+        return FALSE;
+    }
+
+    stringBytes = ((SIZE_T)Record->PathLength + Record->ProcessNameLength) * sizeof(WCHAR);
+    return sizeof(TELEMETRY_RECORD) + stringBytes <= Record->Size;
+}
+
+//
+// Expand a validated record into a full entry
+// Prefix and Name are the resolved strings for PathPrefixId and
+// ProcessNameId, or NULL when the record carries them inline
+//
+static __inline VOID TelemetryRecordToEntryEx(const TELEMETRY_RECORD* Record, PTELEMETRY_ENTRY Entry,
+    const WCHAR* Prefix, SIZE_T PrefixLength, const WCHAR* Name, SIZE_T NameLength)
+{
+    const WCHAR* path = (const WCHAR*)((const UCHAR*)Record + sizeof(TELEMETRY_RECORD));
+    WCHAR* entryPath = NULL;
+    WCHAR* entryName = NULL;
+    SIZE_T pathLength;
+
+    ZeroMemory(Entry, sizeof(TELEMETRY_ENTRY));
+    Entry->EventType = (TELEMETRY_EVENT_TYPE)Record->EventType;
+    Entry->Timestamp = Record->Timestamp;
+
+    if (!Name) {
+        Name = path + Record->PathLength;
+        NameLength = Record->ProcessNameLength;
+    }
+
+    switch (Record->EventType) {
+    case EventFileCreate:
+    case EventFileRead:
+    case EventFileWrite:
+    case EventFileDelete: {
+        PFILE_TELEMETRY file = &Entry->Data.FileEvent;
+        Entry->Size = sizeof(FILE_TELEMETRY);
+        file->EventType = Entry->EventType;
+        file->Timestamp = Record->Timestamp;
+        file->ProcessId = Record->ProcessId;
+        file->ThreadId = Record->ThreadId;
+        file->OperationFlags = Record->u.File.OperationFlags;
+        file->Result = Record->u.File.Result;
+        file->BytesTransferred = Record->u.File.BytesTransferred;
+        file->EventCount = Record->EventCount ? Record->EventCount : 1;
+        entryPath = file->FilePath;
+        entryName = file->ProcessName;
+        break;
+    }
+
+    case EventProcessCreate:
+    case EventProcessTerminate:
+    case EventProcessInjection: {
+        PPROCESS_TELEMETRY process = &Entry->Data.ProcessEvent;
+        Entry->Size = sizeof(PROCESS_TELEMETRY);
+        process->EventType = Entry->EventType;
+        process->Timestamp = Record->Timestamp;
+        process->ProcessId = Record->ProcessId;
+        process->ThreadId = Record->ThreadId;
+        process->ParentProcessId = Record->u.Process.ParentProcessId;
+        process->CreateTime = Record->u.Process.CreateTime;
+        process->VerdictEpoch = Record->u.Process.VerdictEpoch;
+        process->IsSigned = (Record->Flags & TELEMETRY_RECORD_FLAG_SIGNED) ? TRUE : FALSE;
+        process->VerdictPending = (Record->Flags & TELEMETRY_RECORD_FLAG_VERDICT_PENDING) ? TRUE : FALSE;
+        entryPath = process->ImagePath;
+        entryName = process->ProcessName;
+        break;
+    }
+
+    case EventImageLoad:
+    case EventImageUnload:
+    case EventUnsignedDriverLoad: {
+        PIMAGE_TELEMETRY image = &Entry->Data.ImageEvent;
+        Entry->Size = sizeof(IMAGE_TELEMETRY);
+        image->EventType = Entry->EventType;
+        image->Timestamp = Record->Timestamp;
+        image->ProcessId = Record->ProcessId;
+        image->ThreadId = Record->ThreadId;
+        image->ImageBase = Record->u.Image.ImageBase;
+        image->ImageSize = Record->u.Image.ImageSize;
+        image->VerdictEpoch = Record->u.Image.VerdictEpoch;
+        image->IsSigned = (Record->Flags & TELEMETRY_RECORD_FLAG_SIGNED) ? TRUE : FALSE;
+        image->IsDriver = (Record->Flags & TELEMETRY_RECORD_FLAG_DRIVER) ? TRUE : FALSE;
+        image->VerdictPending = (Record->Flags & TELEMETRY_RECORD_FLAG_VERDICT_PENDING) ? TRUE : FALSE;
+        entryPath = image->ImagePath;
+        entryName = image->ProcessName;
+        break;
+    }
+
+    default:
+        return;
+    }
+
+    // interned directory, then the inline remainder
+    PrefixLength = Prefix ? min(PrefixLength, (SIZE_T)MAX_PATH_LENGTH - 1) : 0;
+    pathLength = min(PrefixLength + Record->PathLength, (SIZE_T)MAX_PATH_LENGTH - 1);
+    if (PrefixLength > 0) {
+        CopyMemory(entryPath, Prefix, PrefixLength * sizeof(WCHAR));
+    }
+    CopyMemory(entryPath + PrefixLength, path, (pathLength - PrefixLength) * sizeof(WCHAR));
+
+    if (Record->Flags & TELEMETRY_RECORD_FLAG_NAME_FROM_PATH) {
+        Name = entryPath;
+        NameLength = pathLength;
+    }
+
+    CopyMemory(entryName, Name, min(NameLength, (SIZE_T)MAX_PROCESS_NAME_LENGTH - 1) * sizeof(WCHAR));
+}
+
+//
+// Expand a validated record that carries all of its strings inline
+//
+static __inline VOID TelemetryRecordToEntry(const TELEMETRY_RECORD* Record, PTELEMETRY_ENTRY Entry)
+{
+    TelemetryRecordToEntryEx(Record, Entry, NULL, 0, NULL, 0);
+}
+
+//
+// Pack an entry into a record at Buffer
+// Returns the unpadded record size, or 0 if BufferLength is too small
+//
+static __inline ULONG TelemetryRecordFromEntry(const TELEMETRY_ENTRY* Entry, PVOID Buffer, ULONG BufferLength)
+{
+    PTELEMETRY_RECORD record = (PTELEMETRY_RECORD)Buffer;
+    const WCHAR* path = NULL;
+    const WCHAR* name = NULL;
+    SIZE_T pathLength;
+    SIZE_T nameLength;
+    SIZE_T size;
+
+    if (BufferLength < sizeof(TELEMETRY_RECORD)) {
+        return 0;
+    }
+
+    ZeroMemory(record, sizeof(TELEMETRY_RECORD));
+    record->Version = TELEMETRY_RECORD_VERSION;
+    record->EventType = (UCHAR)Entry->EventType;
+    record->Timestamp = Entry->Timestamp;
+
+    switch (Entry->EventType) {
+    case EventFileCreate:
+    case EventFileRead:
+    case EventFileWrite:
+    case EventFileDelete:
+        record->ProcessId = Entry->Data.FileEvent.ProcessId;
+        record->ThreadId = Entry->Data.FileEvent.ThreadId;
+        record->u.File.OperationFlags = Entry->Data.FileEvent.OperationFlags;
+        record->u.File.Result = Entry->Data.FileEvent.Result;
+        record->u.File.BytesTransferred = Entry->Data.FileEvent.BytesTransferred;
+        record->EventCount = (USHORT)min(Entry->Data.FileEvent.EventCount, (ULONG)MAXUSHORT);
+        path = Entry->Data.FileEvent.FilePath;
+        name = Entry->Data.FileEvent.ProcessName;
+        break;
+
+    case EventProcessCreate:
+    case EventProcessTerminate:
+    case EventProcessInjection:
+        record->ProcessId = Entry->Data.ProcessEvent.ProcessId;
+        record->ThreadId = Entry->Data.ProcessEvent.ThreadId;
+        record->u.Process.ParentProcessId = Entry->Data.ProcessEvent.ParentProcessId;
+        record->u.Process.CreateTime = Entry->Data.ProcessEvent.CreateTime;
+        record->u.Process.VerdictEpoch = Entry->Data.ProcessEvent.VerdictEpoch;
+        if (Entry->Data.ProcessEvent.IsSigned) {
+            record->Flags |= TELEMETRY_RECORD_FLAG_SIGNED;
+        }
+        if (Entry->Data.ProcessEvent.VerdictPending) {
+            record->Flags |= TELEMETRY_RECORD_FLAG_VERDICT_PENDING;
+        }
+        path = Entry->Data.ProcessEvent.ImagePath;
+        name = Entry->Data.ProcessEvent.ProcessName;
+        break;
+
+    case EventImageLoad:
+    case EventImageUnload:
+    case EventUnsignedDriverLoad:
+        record->ProcessId = Entry->Data.ImageEvent.ProcessId;
+        record->ThreadId = Entry->Data.ImageEvent.ThreadId;
+        record->u.Image.ImageBase = Entry->Data.ImageEvent.ImageBase;
+        record->u.Image.ImageSize = Entry->Data.ImageEvent.ImageSize;
+        record->u.Image.VerdictEpoch = Entry->Data.ImageEvent.VerdictEpoch;
+        if (Entry->Data.ImageEvent.IsSigned) {
+            record->Flags |= TELEMETRY_RECORD_FLAG_SIGNED;
+        }
+        if (Entry->Data.ImageEvent.IsDriver) {
+            record->Flags |= TELEMETRY_RECORD_FLAG_DRIVER;
+        }
+        if (Entry->Data.ImageEvent.VerdictPending) {
+            record->Flags |= TELEMETRY_RECORD_FLAG_VERDICT_PENDING;
+        }
+        path = Entry->Data.ImageEvent.ImagePath;
+        name = Entry->Data.ImageEvent.ProcessName;
+        break;
+
+    default:
+        record->Size = sizeof(TELEMETRY_RECORD);
+        return record->Size;
+    }
+
+    pathLength = wcsnlen(path, MAX_PATH_LENGTH - 1);
+    nameLength = wcsnlen(name, MAX_PROCESS_NAME_LENGTH - 1);
+
+    // process creates carry the image path twice in the wide format
+    if (nameLength == pathLength && wmemcmp(path, name, pathLength) == 0 && pathLength > 0) {
+        record->Flags |= TELEMETRY_RECORD_FLAG_NAME_FROM_PATH;
+        nameLength = 0;
+    }
+
+    size = sizeof(TELEMETRY_RECORD) + (pathLength + nameLength) * sizeof(WCHAR);
+    if (size > BufferLength) {
+        return 0;
+    }
+
+    CopyMemory(TELEMETRY_RECORD_STRINGS(record), path, pathLength * sizeof(WCHAR));
+    CopyMemory(TELEMETRY_RECORD_STRINGS(record) + pathLength, name, nameLength * sizeof(WCHAR));
+
+    record->PathLength = (USHORT)pathLength;
+    record->ProcessNameLength = (USHORT)nameLength;
+    record->Size = (USHORT)size;
+    return (ULONG)size;
+}
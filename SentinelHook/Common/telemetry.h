@@ -6,6 +6,7 @@
 #pragma once
 
 #include <windows.h>
+#include "ioctl.h"
 
 // Event types
 typedef enum _TELEMETRY_EVENT_TYPE {
@@ -32,6 +33,8 @@ typedef struct _FILE_TELEMETRY {
     WCHAR ProcessName[MAX_PROCESS_NAME_LENGTH];
     ULONG OperationFlags;
     ULONG Result;
+    ULONG64 BytesTransferred;       // IoStatus.Information, create disposition for creates
+    ULONG EventCount;               // operations folded into this entry, BytesTransferred is their sum
 } FILE_TELEMETRY, *PFILE_TELEMETRY;
 
 // Process telemetry
@@ -44,7 +47,9 @@ typedef struct _PROCESS_TELEMETRY {
     WCHAR ProcessName[MAX_PROCESS_NAME_LENGTH];
     WCHAR ImagePath[MAX_PATH_LENGTH];
     ULONG64 CreateTime;
+    ULONG VerdictEpoch;             // see TELEMETRY_IMAGE_VERDICT, 0 = do not cache
     BOOLEAN IsSigned;
+    BOOLEAN VerdictPending;         // not in the driver's cache yet, IsSigned is meaningless
 } PROCESS_TELEMETRY, *PPROCESS_TELEMETRY;
 
 // Image load telemetry
@@ -57,8 +62,10 @@ typedef struct _IMAGE_TELEMETRY {
     WCHAR ProcessName[MAX_PROCESS_NAME_LENGTH];
     ULONG64 ImageBase;
     ULONG ImageSize;
+    ULONG VerdictEpoch;             // see TELEMETRY_IMAGE_VERDICT, 0 = do not cache
     BOOLEAN IsSigned;
     BOOLEAN IsDriver;
+    BOOLEAN VerdictPending;         // not in the driver's cache yet, IsSigned is meaningless
 } IMAGE_TELEMETRY, *PIMAGE_TELEMETRY;
 
 // Unified telemetry structure
@@ -74,6 +81,156 @@ typedef struct _TELEMETRY_ENTRY {
     } Data;
 } TELEMETRY_ENTRY, *PTELEMETRY_ENTRY;
 
+// Compact wire record
+// Used by the driver rings, the GET_TELEMETRY batches, the telemetry pipe
+// and ETW payloads. A fixed header is followed by the packed strings
+// (PathLength WCHARs, then ProcessNameLength WCHARs, not NUL terminated).
+// Records are laid out back to back, each padded to TELEMETRY_RECORD_ALIGNMENT.
+// Strings the driver has interned are sent as IDs instead: PathPrefixId
+// names the directory part of the path (the inline path is then only the
+// final component) and ProcessNameId replaces the inline process name.
+// IDs are never reused; each is defined once by a TELEMETRY_RECORD_STRING
+// record in the stream and can be resolved later with
+// IOCTL_SENTINELHOOK_RESOLVE_STRING.
+#define TELEMETRY_RECORD_VERSION     2
+#define TELEMETRY_RECORD_ALIGNMENT   8
+#define TELEMETRY_RECORD_STRING      0xFE    // EventType of a string definition
+#define TELEMETRY_RECORD_PADDING     0xFF    // EventType of ring wrap filler
+
+// Record flags
+#define TELEMETRY_RECORD_FLAG_SIGNED          0x0001
+#define TELEMETRY_RECORD_FLAG_DRIVER          0x0002
+#define TELEMETRY_RECORD_FLAG_NAME_FROM_PATH  0x0004  // ProcessName is the image path
+#define TELEMETRY_RECORD_FLAG_VERDICT_PENDING 0x0008  // image signature not verified yet
+
+typedef struct _TELEMETRY_RECORD {
+    USHORT Size;              // header + strings, before padding
+    UCHAR Version;
+    UCHAR EventType;          // TELEMETRY_EVENT_TYPE
+    USHORT Flags;
+    USHORT PathLength;        // file path or image path, in WCHARs
+    USHORT ProcessNameLength; // in WCHARs
+    USHORT EventCount;        // coalesced file operations, 0 means 1
+    ULONG ProcessId;
+    ULONG ThreadId;
+    ULONG PathPrefixId;       // 0 if the path is inline in full
+    ULONG ProcessNameId;      // 0 if the name is inline
+    ULONG64 Timestamp;
+    union {
+        struct {
+            ULONG OperationFlags;
+            ULONG Result;           // final status, 0 on success
+            ULONG64 BytesTransferred;
+        } File;
+        struct {
+            ULONG ParentProcessId;
+            ULONG VerdictEpoch;   // creates only, see TELEMETRY_IMAGE_VERDICT
+            ULONG64 CreateTime;
+        } Process;
+        struct {
+            ULONG64 ImageBase;
+            ULONG ImageSize;
+            ULONG VerdictEpoch;   // see TELEMETRY_IMAGE_VERDICT
+        } Image;
+        struct {
+            ULONG Id;         // the string itself is the inline path
+        } String;
+    } u;
+} TELEMETRY_RECORD, *PTELEMETRY_RECORD;
+
+#define TELEMETRY_RECORD_ALIGN(Size) \
+    (((Size) + (TELEMETRY_RECORD_ALIGNMENT - 1)) & ~(TELEMETRY_RECORD_ALIGNMENT - 1))
+
+#define TELEMETRY_RECORD_STRINGS(Record) \
+    ((PWCHAR)((PUCHAR)(Record) + sizeof(TELEMETRY_RECORD)))
+
+#define TELEMETRY_RECORD_MAX_SIZE \
+    (sizeof(TELEMETRY_RECORD) + (MAX_PATH_LENGTH + MAX_PROCESS_NAME_LENGTH) * sizeof(WCHAR))
+
+// IOCTL_SENTINELHOOK_RESOLVE_STRING input, output is a TELEMETRY_RECORD_STRING
+typedef struct _TELEMETRY_STRING_REQUEST {
+    ULONG Id;
+} TELEMETRY_STRING_REQUEST, *PTELEMETRY_STRING_REQUEST;
+
+// IOCTL_SENTINELHOOK_GET_TELEMETRY output, and each message on the telemetry
+// pipe: a batch header followed by Count packed TELEMETRY_RECORDs
+#define TELEMETRY_BATCH_MORE         0x00000001  // driver had to stop early, call again
+
+// Largest telemetry pipe message, clients should read with a buffer this big
+#define TELEMETRY_PIPE_MESSAGE_BYTES (64 * 1024)
+
+// Telemetry pipe subscription
+// A client opened for read/write may send this at any time to replace its
+// filter; until it does, every event is sent. An event is sent when it
+// passes all of the predicates that are set.
+#define TELEMETRY_SUBSCRIPTION_VERSION   1
+#define TELEMETRY_SUBSCRIPTION_MAX_PIDS  16
+
+#define TELEMETRY_EVENT_MASK(Type)       (1UL << (Type))
+
+typedef struct _TELEMETRY_SUBSCRIPTION {
+    ULONG Version;
+    ULONG EventTypeMask;    // TELEMETRY_EVENT_MASK bits, 0 = every type
+    ULONG ProcessIdCount;   // 0 = any process
+    ULONG ProcessIds[TELEMETRY_SUBSCRIPTION_MAX_PIDS];
+    WCHAR PathPrefix[MAX_PATH_LENGTH];  // case-insensitive, empty = any path
+} TELEMETRY_SUBSCRIPTION, *PTELEMETRY_SUBSCRIPTION;
+
+typedef struct _TELEMETRY_BATCH_HEADER {
+    ULONG Count;
+    ULONG BytesUsed;        // including this header
+    ULONG Flags;
+    ULONG Reserved;
+} TELEMETRY_BATCH_HEADER, *PTELEMETRY_BATCH_HEADER;
+
+// Per-CPU ring data size in bytes, must be a power of two
+#define TELEMETRY_RING_BYTES         (64 * 1024)
+
+// Per-processor telemetry ring of packed TELEMETRY_RECORDs
+// Head and Tail are running byte counts; Head is only written by the owning
+// CPU, Tail only by the single consumer (the IOCTL drain path, or the
+// service when the rings are mapped). A record never straddles the end of
+// Data: the producer fills the gap with a TELEMETRY_RECORD_PADDING record.
+typedef struct _TELEMETRY_RING {
+    DECLSPEC_CACHEALIGN volatile LONG64 Head;
+    DECLSPEC_CACHEALIGN volatile LONG64 Tail;
+    DECLSPEC_CACHEALIGN UCHAR Data[TELEMETRY_RING_BYTES];
+} TELEMETRY_RING, *PTELEMETRY_RING;
+
+#define TELEMETRY_SHARED_VERSION     2
+
+// Header at the start of the shared ring region, rings follow at RingOffset
+typedef struct _TELEMETRY_SHARED_HEADER {
+    ULONG Version;
+    ULONG RingCount;
+    ULONG RingBytes;
+    ULONG RingOffset;
+    ULONG RingStride;
+    // set by the consumer before it blocks; the first producer to see it
+    // clears it and signals the data event
+    DECLSPEC_CACHEALIGN volatile LONG ConsumerWaiting;
+} TELEMETRY_SHARED_HEADER, *PTELEMETRY_SHARED_HEADER;
+
+// Default fill level, in bytes of one ring, that signals HighWaterEvent
+#define TELEMETRY_RING_HIGH_WATER_DEFAULT (TELEMETRY_RING_BYTES / 2)
+
+// IOCTL_SENTINELHOOK_MAP_TELEMETRY input
+// HighWaterEvent is signaled, independent of the ConsumerWaiting handshake,
+// when a ring fills past HighWaterBytes or an alert (injection, unsigned
+// driver) is queued, so a consumer can skip any batching delay
+typedef struct _TELEMETRY_MAP_REQUEST {
+    ULONG64 DataEvent;      // HANDLE to an event signaled when data arrives
+    ULONG64 HighWaterEvent; // optional HANDLE, see above
+    ULONG HighWaterBytes;   // 0 selects TELEMETRY_RING_HIGH_WATER_DEFAULT
+    ULONG Reserved;
+} TELEMETRY_MAP_REQUEST, *PTELEMETRY_MAP_REQUEST;
+
+// IOCTL_SENTINELHOOK_MAP_TELEMETRY output
+typedef struct _TELEMETRY_MAP_RESPONSE {
+    ULONG64 BaseAddress;    // TELEMETRY_SHARED_HEADER in the caller's address space
+    ULONG64 Size;
+} TELEMETRY_MAP_RESPONSE, *PTELEMETRY_MAP_RESPONSE;
+
 // Statistics structure
 typedef struct _TELEMETRY_STATS {
     ULONG64 TotalEvents;
@@ -82,11 +239,158 @@ typedef struct _TELEMETRY_STATS {
     ULONG64 ImageEvents;
     ULONG64 InjectionDetections;
     ULONG64 UnsignedDriverDetections;
-    ULONG64 DroppedEvents;
-    ULONG64 BufferOverflows;
+    ULONG64 DroppedEvents;          // sum of the reasons below
+    ULONG64 BufferOverflows;        // ring full
+    ULONG64 RateLimitedByProcess;
+    ULONG64 RateLimitedByEventType;
+    ULONG64 AllocationFailures;
+    // driver record/name buffer pool
+    ULONG64 PoolAllocations;
+    ULONG64 PoolFrees;
+    ULONG64 PoolInUse;              // allocations - frees at query time
+    ULONG64 PoolLookasideMisses;    // allocations that went to system pool
 } TELEMETRY_STATS, *PTELEMETRY_STATS;
 
+// IOCTL_SENTINELHOOK_SET_RATE_LIMIT input
+// Rates are events per second and Burst is how many may arrive back to
+// back; a rate of 0 disables that limit. Burst 0 is treated as 1.
+typedef struct _RATE_LIMIT_CONFIG {
+    ULONG ProcessRate;              // per PID, all event types together
+    ULONG ProcessBurst;
+    ULONG EventTypeRate[EventMax];  // system wide, per TELEMETRY_EVENT_TYPE
+    ULONG EventTypeBurst[EventMax];
+} RATE_LIMIT_CONFIG, *PRATE_LIMIT_CONFIG;
+
+// Image signature verdicts
+// The driver never verifies signatures itself. An image load it has no
+// verdict for goes out with TELEMETRY_RECORD_FLAG_VERDICT_PENDING, the
+// service verifies the file off the hot path and hands the result back
+// with IOCTL_SENTINELHOOK_SET_IMAGE_VERDICT. A verdict is keyed by the
+// file rather than its path: volume serial, file reference number and
+// last write time, as GetFileInformationByHandle reports them for the
+// handle the service verified, so another file renamed over the path or
+// a reused path hash can't pick it up. Every write, truncation, rename,
+// delete or time change the minifilter sees drops the file's verdict and
+// advances its epoch; a verdict whose Epoch (VerdictEpoch from the record
+// that asked for it) is older than that is refused with STATUS_RETRY,
+// since the service may have read the file before the change. An epoch
+// of 0 means the driver can't see writes to the file (no minifilter
+// instance on its volume) and the verdict must not be cached, here or in
+// the service.
+#define IMAGE_VERDICT_UNKNOWN        0
+#define IMAGE_VERDICT_SIGNED         1
+#define IMAGE_VERDICT_UNSIGNED       2
+
+// IOCTL_SENTINELHOOK_SET_IMAGE_VERDICT input
+typedef struct _TELEMETRY_IMAGE_VERDICT {
+    ULONG64 FileId;                 // nFileIndexHigh:nFileIndexLow
+    LONG64 LastWriteTime;           // ftLastWriteTime as a FILETIME quadword
+    ULONG VolumeSerial;             // dwVolumeSerialNumber
+    ULONG Epoch;                    // VerdictEpoch from the pending record
+    ULONG Verdict;                  // IMAGE_VERDICT_*
+    ULONG Reserved;
+} TELEMETRY_IMAGE_VERDICT, *PTELEMETRY_IMAGE_VERDICT;
+
+// Minifilter profiler
+// Off unless enabled with IOCTL_SENTINELHOOK_SET_PERF. While on, each
+// stage of the file path is timed with KeQueryPerformanceCounter into a
+// per-processor log-linear histogram: durations below
+// PERF_HISTOGRAM_SUB_BUCKETS ticks get a bucket each, above that every
+// power of two is split into PERF_HISTOGRAM_SUB_BUCKETS buckets, so a
+// bucket is never wider than 1/8 of its base. The last bucket also counts
+// everything longer.
+typedef enum _PERF_OPERATION {
+    PerfOpCreate = 0,
+    PerfOpRead,
+    PerfOpWrite,
+    PerfOpSetInformation,
+    PerfOpMax
+} PERF_OPERATION;
+
+typedef enum _PERF_STAGE {
+    PerfStagePreOperation = 0,      // whole pre-op callback, includes the two below
+    PerfStageNameLookup,            // FltGetFileNameInformation + parse
+    PerfStageEnqueue,               // TelemetryRingEnqueue
+    PerfStagePostOperation,         // whole post-op callback
+    PerfStageMax
+} PERF_STAGE;
+
+#define PERF_HISTOGRAM_SUB_BUCKET_BITS   3
+#define PERF_HISTOGRAM_SUB_BUCKETS       (1 << PERF_HISTOGRAM_SUB_BUCKET_BITS)
+#define PERF_HISTOGRAM_BUCKETS           128
+
+// IOCTL_SENTINELHOOK_SET_PERF input
+typedef struct _TELEMETRY_PERF_CONTROL {
+    ULONG Enable;
+    ULONG Reset;                    // zero the histograms first
+} TELEMETRY_PERF_CONTROL, *PTELEMETRY_PERF_CONTROL;
+
+// IOCTL_SENTINELHOOK_GET_PERF output, summed over processors
+// Counts are cumulative since the last reset; all zero if the profiler
+// was never enabled
+typedef struct _TELEMETRY_PERF_STATS {
+    ULONG64 Frequency;              // ticks per second
+    ULONG Enabled;
+    ULONG Reserved;
+    ULONG64 Counts[PerfOpMax][PerfStageMax][PERF_HISTOGRAM_BUCKETS];
+} TELEMETRY_PERF_STATS, *PTELEMETRY_PERF_STATS;
+
+// histogram bucket for a duration in ticks
+static __inline ULONG PerfHistogramBucket(ULONG64 Ticks)
+{
+    unsigned long msb;
+    ULONG bucket;
+
+    if (Ticks < PERF_HISTOGRAM_SUB_BUCKETS) {
+        return (ULONG)Ticks;
+    }
+
+    // the top PERF_HISTOGRAM_SUB_BUCKET_BITS + 1 bits pick the bucket
+    _BitScanReverse64(&msb, Ticks);
+    bucket = (msb - PERF_HISTOGRAM_SUB_BUCKET_BITS + 1) * PERF_HISTOGRAM_SUB_BUCKETS +
+        (ULONG)((Ticks >> (msb - PERF_HISTOGRAM_SUB_BUCKET_BITS)) & (PERF_HISTOGRAM_SUB_BUCKETS - 1));
+
+    return bucket < PERF_HISTOGRAM_BUCKETS ? bucket : PERF_HISTOGRAM_BUCKETS - 1;
+}
+
+// smallest duration in ticks that lands in Bucket
+static __inline ULONG64 PerfHistogramBucketBase(ULONG Bucket)
+{
+    if (Bucket < PERF_HISTOGRAM_SUB_BUCKETS) {
+        return Bucket;
+    }
+
+    return (ULONG64)(PERF_HISTOGRAM_SUB_BUCKETS + Bucket % PERF_HISTOGRAM_SUB_BUCKETS) <<
+        (Bucket / PERF_HISTOGRAM_SUB_BUCKETS - 1);
+}
+
+// upper edge of the bucket holding the requested rank, Quantile in
+// hundred-thousandths (99900 = p99.9); the open-ended last bucket only
+// has its base
+static __inline ULONG64 PerfHistogramPercentile(const ULONG64* Counts, ULONG64 Total, ULONG64 Quantile)
+{
+    ULONG64 rank = (Total * Quantile + 99999) / 100000;
+    ULONG64 seen = 0;
+
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    for (ULONG i = 0; i < PERF_HISTOGRAM_BUCKETS - 1; i++) {
+        seen += Counts[i];
+        if (seen >= rank) {
+            return PerfHistogramBucketBase(i + 1);
+        }
+    }
+
+    return PerfHistogramBucketBase(PERF_HISTOGRAM_BUCKETS - 1);
+}
+
 // Filter configuration
+// ExcludedPaths are case-insensitive prefixes of the normalized NT path
+// (\Device\HarddiskVolumeN\...). More than the fixed ten can be passed to
+// IOCTL_SENTINELHOOK_SET_FILTER by appending a MULTI_SZ list right after
+// the structure; the driver compiles both into one prefix trie.
 typedef struct _FILTER_CONFIG {
     BOOLEAN MonitorFileOperations;
     BOOLEAN MonitorProcessCreation;
@@ -97,3 +401,34 @@ typedef struct _FILTER_CONFIG {
     ULONG ExcludedPathCount;
 } FILTER_CONFIG, *PFILTER_CONFIG;
 
+// Monitoring switches, IOCTL_SENTINELHOOK_SET_MONITOR
+// The driver only registers for the file operations some switch needs, so
+// turning off MONITOR_FILE_READ takes the filter out of the read path
+// entirely, and the image notify routine is removed while neither
+// MONITOR_IMAGE nor MONITOR_DETECT_UNSIGNED_DRIVER is set. MONITOR_PROCESS
+// and the image switches keep create, write and set-information
+// registered, since the image verdict cache has to see every write.
+#define MONITOR_FILE_CREATE              0x00000001
+#define MONITOR_FILE_READ                0x00000002
+#define MONITOR_FILE_WRITE               0x00000004
+#define MONITOR_FILE_DELETE              0x00000008
+#define MONITOR_PROCESS                  0x00000010
+#define MONITOR_IMAGE                    0x00000020
+#define MONITOR_DETECT_INJECTION         0x00000040
+#define MONITOR_DETECT_UNSIGNED_DRIVER   0x00000080
+
+#define MONITOR_FILE_ALL \
+    (MONITOR_FILE_CREATE | MONITOR_FILE_READ | MONITOR_FILE_WRITE | MONITOR_FILE_DELETE)
+#define MONITOR_ALL                      0x000000FF
+
+// Input of IOCTL_SENTINELHOOK_SET_MONITOR
+// With MONITOR_CONFIG_VOLUMES set, a MULTI_SZ of volume device names
+// (\Device\HarddiskVolumeN) follows the structure and replaces the list of
+// volumes the filter does not attach to; an empty list attaches everywhere.
+#define MONITOR_CONFIG_VOLUMES           0x00000001
+
+typedef struct _MONITOR_CONFIG {
+    ULONG Flags;                    // MONITOR_*
+    ULONG Options;                  // MONITOR_CONFIG_*
+} MONITOR_CONFIG, *PMONITOR_CONFIG;
+
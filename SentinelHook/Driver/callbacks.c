@@ -8,82 +8,93 @@ VOID ProcessNotifyRoutine(
     _In_opt_ PPS_CREATE_NOTIFY_INFO CreateInfo
 )
 {
-    KIRQL oldIrql;
+    PTELEMETRY_RECORD_BUFFER recordBuffer;
+    PTELEMETRY_RECORD record;
 
     UNREFERENCED_PARAMETER(Process);
 
-    if (!g_DriverContext.MonitoringEnabled) {
+    // the process cache is kept current even while monitoring is off,
+    // otherwise a reused PID could pick up a stale name
+    if (CreateInfo) {
+        ProcessCacheInsert(ProcessId, CreateInfo->ImageFileName);
+    }
+
+    if (!g_DriverContext.MonitoringEnabled || !MonitorEnabled(MONITOR_PROCESS)) {
+        if (!CreateInfo) {
+            ProcessCacheRemove(ProcessId);
+        }
+        return;
+    }
+
+    recordBuffer = TelemetryRecordAllocate();
+    if (!recordBuffer) {
+        if (!CreateInfo) {
+            ProcessCacheRemove(ProcessId);
+        }
         return;
     }
+    record = &recordBuffer->Record;
 
     if (CreateInfo) {
         // new process
-        PROCESS_TELEMETRY processTelemetry = { 0 };
+        TelemetryRecordInitialize(record, EventProcessCreate, HandleToUlong(ProcessId),
+            HandleToUlong(CreateInfo->CreatingThreadId.UniqueProcess));
+        record->u.Process.ParentProcessId = HandleToUlong(CreateInfo->ParentProcessId);
+        record->u.Process.CreateTime = CreateInfo->CreationTime.QuadPart;
 
-        processTelemetry.EventType = EventProcessCreate;
-        processTelemetry.Timestamp = KeQueryInterruptTime();
-        processTelemetry.ProcessId = HandleToUlong(ProcessId);
-        processTelemetry.ParentProcessId = HandleToUlong(CreateInfo->ParentProcessId);
-        processTelemetry.ThreadId = HandleToUlong(CreateInfo->CreatingThreadId.UniqueProcess);
-        processTelemetry.CreateTime = CreateInfo->CreationTime.QuadPart;
-
-        // Get process name
+        // image path, which also serves as the process name
         if (CreateInfo->ImageFileName) {
-            ULONG nameLength = min(CreateInfo->ImageFileName->Length / sizeof(WCHAR), MAX_PROCESS_NAME_LENGTH - 1);
-            RtlCopyMemory(
-                processTelemetry.ProcessName,
-                CreateInfo->ImageFileName->Buffer,
-                nameLength * sizeof(WCHAR)
-            );
-            processTelemetry.ProcessName[nameLength] = L'\0';
-        }
-
-        // Get image path
-        if (CreateInfo->ImageFileName) {
-            ULONG pathLength = min(CreateInfo->ImageFileName->Length / sizeof(WCHAR), MAX_PATH_LENGTH - 1);
-            RtlCopyMemory(
-                processTelemetry.ImagePath,
-                CreateInfo->ImageFileName->Buffer,
-                pathLength * sizeof(WCHAR)
-            );
-            processTelemetry.ImagePath[pathLength] = L'\0';
+            TelemetryRecordAppendPath(record, CreateInfo->ImageFileName);
+            record->Flags |= TELEMETRY_RECORD_FLAG_NAME_FROM_PATH;
+
+            // the verdict belongs to the file being executed, not the path
+            switch (ImageVerdictLookup(CreateInfo->FileObject, &record->u.Process.VerdictEpoch)) {
+            case IMAGE_VERDICT_SIGNED:
+                record->Flags |= TELEMETRY_RECORD_FLAG_SIGNED;
+                break;
+            case IMAGE_VERDICT_UNKNOWN:
+                record->Flags |= TELEMETRY_RECORD_FLAG_VERDICT_PENDING;
+                break;
+            }
         }
 
         // check for injection patterns
-        if (IsProcessInjection(ProcessId, CreateInfo->ImageFileName)) {
-            processTelemetry.EventType = EventProcessInjection;
+        if (MonitorEnabled(MONITOR_DETECT_INJECTION) &&
+            IsProcessInjection(ProcessId, CreateInfo->ImageFileName)) {
+            record->EventType = EventProcessInjection;
             
-            KeAcquireSpinLock(&g_DriverContext.StatsLock, &oldIrql);
-            g_DriverContext.Stats.InjectionDetections++;
-            KeReleaseSpinLock(&g_DriverContext.StatsLock, oldIrql);
+            TelemetryStatsIncrement(InjectionDetections);
             
             DebugPrint("WARNING: Potential injection detected PID=%d", HandleToUlong(ProcessId));
         }
 
         // Update statistics
-        KeAcquireSpinLock(&g_DriverContext.StatsLock, &oldIrql);
-        g_DriverContext.Stats.TotalEvents++;
-        g_DriverContext.Stats.ProcessEvents++;
-        KeReleaseSpinLock(&g_DriverContext.StatsLock, oldIrql);
+        TelemetryStatsIncrement(TotalEvents);
+        TelemetryStatsIncrement(ProcessEvents);
 
-        // DebugPrint("Proc create: PID=%d, Name=%ws", processTelemetry.ProcessId, processTelemetry.ProcessName);
+        // lifecycle events are only limited per event type, never per PID
+        if (TelemetryAdmit((TELEMETRY_EVENT_TYPE)record->EventType, NULL)) {
+            TelemetryRingEnqueue(record);
+        }
+
+        // DebugPrint("Proc create: PID=%d", HandleToUlong(ProcessId));
     } else {
         // process exit
-        PROCESS_TELEMETRY processTelemetry = { 0 };
-
-        processTelemetry.EventType = EventProcessTerminate;
-        processTelemetry.Timestamp = KeQueryInterruptTime();
-        processTelemetry.ProcessId = HandleToUlong(ProcessId);
+        TelemetryRecordInitialize(record, EventProcessTerminate, HandleToUlong(ProcessId), 0);
+        TelemetryRecordAppendProcessName(record, ProcessId);
 
-        GetProcessName(ProcessId, processTelemetry.ProcessName, MAX_PROCESS_NAME_LENGTH);
+        TelemetryStatsIncrement(TotalEvents);
+        TelemetryStatsIncrement(ProcessEvents);
 
-        KeAcquireSpinLock(&g_DriverContext.StatsLock, &oldIrql);
-        g_DriverContext.Stats.TotalEvents++;
-        g_DriverContext.Stats.ProcessEvents++;
-        KeReleaseSpinLock(&g_DriverContext.StatsLock, oldIrql);
+        if (TelemetryAdmit(EventProcessTerminate, NULL)) {
+            TelemetryRingEnqueue(record);
+        }
+        ProcessCacheRemove(ProcessId);
 
-        // DebugPrint("Proc exit: PID=%d", processTelemetry.ProcessId);
+        // DebugPrint("Proc exit: PID=%d", HandleToUlong(ProcessId));
     }
+
+    TelemetryRecordRelease(recordBuffer);
 }
 
 // image load callback - DLL or driver loading
@@ -93,8 +104,9 @@ VOID ImageNotifyRoutine(
     _In_ PIMAGE_INFO ImageInfo
 )
 {
-    IMAGE_TELEMETRY imageTelemetry = { 0 };
-    KIRQL oldIrql;
+    PTELEMETRY_RECORD_BUFFER recordBuffer;
+    PTELEMETRY_RECORD record;
+    PFILE_OBJECT fileObject = NULL;
 
     if (!g_DriverContext.MonitoringEnabled) {
         return;
@@ -103,48 +115,71 @@ VOID ImageNotifyRoutine(
     // driver if ProcessId is NULL
     BOOLEAN isDriver = (ProcessId == NULL);
 
-    imageTelemetry.EventType = EventImageLoad;
-    imageTelemetry.Timestamp = KeQueryInterruptTime();
-    imageTelemetry.ProcessId = ProcessId ? HandleToUlong(ProcessId) : 0;
-    imageTelemetry.ImageBase = (ULONG64)ImageInfo->ImageBase;
-    imageTelemetry.ImageSize = ImageInfo->ImageSize;
-    imageTelemetry.IsDriver = isDriver;
+    // still registered for unsigned driver detection alone, which only
+    // needs driver loads
+    if (!MonitorEnabled(MONITOR_IMAGE) && !(isDriver && MonitorEnabled(MONITOR_DETECT_UNSIGNED_DRIVER))) {
+        return;
+    }
 
-    // Get image path
-    if (FullImageName && FullImageName->Buffer) {
-        ULONG pathLength = min(FullImageName->Length / sizeof(WCHAR), MAX_PATH_LENGTH - 1);
-        RtlCopyMemory(
-            imageTelemetry.ImagePath,
-            FullImageName->Buffer,
-            pathLength * sizeof(WCHAR)
-        );
-        imageTelemetry.ImagePath[pathLength] = L'\0';
+    recordBuffer = TelemetryRecordAllocate();
+    if (!recordBuffer) {
+        return;
     }
+    record = &recordBuffer->Record;
+
+    TelemetryRecordInitialize(record, EventImageLoad, ProcessId ? HandleToUlong(ProcessId) : 0, 0);
+    record->u.Image.ImageBase = (ULONG64)ImageInfo->ImageBase;
+    record->u.Image.ImageSize = (ULONG)ImageInfo->ImageSize;
+    if (isDriver) {
+        record->Flags |= TELEMETRY_RECORD_FLAG_DRIVER;
+    }
+
+    // Get image path
+    TelemetryRecordAppendPath(record, FullImageName);
 
     // Get process name if not a driver
     if (ProcessId) {
-        GetProcessName(ProcessId, imageTelemetry.ProcessName, MAX_PROCESS_NAME_LENGTH);
+        TelemetryRecordAppendProcessName(record, ProcessId);
     }
 
-    // check driver signature
-    if (isDriver && FullImageName) {
-        if (IsUnsignedDriver(FullImageName)) {
-            imageTelemetry.EventType = EventUnsignedDriverLoad;
-            
-            KeAcquireSpinLock(&g_DriverContext.StatsLock, &oldIrql);
-            g_DriverContext.Stats.UnsignedDriverDetections++;
-            KeReleaseSpinLock(&g_DriverContext.StatsLock, oldIrql);
+    // signature verdict from the service's cache, keyed by the mapped file;
+    // a miss is verified asynchronously and reported by the service once
+    // it is known
+    if (ImageInfo->ExtendedInfoPresent) {
+        fileObject = CONTAINING_RECORD(ImageInfo, IMAGE_INFO_EX, ImageInfo)->FileObject;
+    }
+
+    if (FullImageName) {
+        switch (ImageVerdictLookup(fileObject, &record->u.Image.VerdictEpoch)) {
+        case IMAGE_VERDICT_SIGNED:
+            record->Flags |= TELEMETRY_RECORD_FLAG_SIGNED;
+            break;
+
+        case IMAGE_VERDICT_UNSIGNED:
+            if (isDriver && MonitorEnabled(MONITOR_DETECT_UNSIGNED_DRIVER)) {
+                record->EventType = EventUnsignedDriverLoad;
+
+                TelemetryStatsIncrement(UnsignedDriverDetections);
+
+                DebugPrint("ALERT: Unsigned driver load: %wZ", FullImageName);
+            }
+            break;
 
-            DebugPrint("ALERT: Unsigned driver load: %ws", FullImageName->Buffer);
+        default:
+            record->Flags |= TELEMETRY_RECORD_FLAG_VERDICT_PENDING;
+            break;
         }
     }
 
     // Update statistics
-    KeAcquireSpinLock(&g_DriverContext.StatsLock, &oldIrql);
-    g_DriverContext.Stats.TotalEvents++;
-    g_DriverContext.Stats.ImageEvents++;
-    KeReleaseSpinLock(&g_DriverContext.StatsLock, oldIrql);
+    TelemetryStatsIncrement(TotalEvents);
+    TelemetryStatsIncrement(ImageEvents);
 
-    // DebugPrint("Image load: %s, PID=%d", isDriver ? "Driver" : "DLL", imageTelemetry.ProcessId);
-}
+    if (TelemetryAdmit((TELEMETRY_EVENT_TYPE)record->EventType, ProcessId)) {
+        TelemetryRingEnqueue(record);
+    }
 
+    TelemetryRecordRelease(recordBuffer);
+
+    // DebugPrint("Image load: %s, PID=%d", isDriver ? "Driver" : "DLL", HandleToUlong(ProcessId));
+}
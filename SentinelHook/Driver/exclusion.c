@@ -0,0 +1,238 @@
+// path exclusion from FILTER_CONFIG
+// the excluded prefixes are compiled into a case-insensitive trie at
+// IOCTL_SENTINELHOOK_SET_FILTER time and published with a pointer swap.
+// readers take a reference under ExclusionLock (shared, held only for the
+// pointer read) and walk the trie lock-free; the last reference frees it.
+#include "sentinelhook.h"
+
+// take a reference on the current trie, NULL if nothing is excluded
+static PEXCLUSION_TRIE ExclusionAcquire(VOID)
+{
+    PEXCLUSION_TRIE trie;
+    KIRQL oldIrql;
+
+    oldIrql = ExAcquireSpinLockShared(&g_DriverContext.ExclusionLock);
+    trie = g_DriverContext.ExclusionTrie;
+    if (trie) {
+        InterlockedIncrement(&trie->RefCount);
+    }
+    ExReleaseSpinLockShared(&g_DriverContext.ExclusionLock, oldIrql);
+
+    return trie;
+}
+
+static VOID ExclusionRelease(
+    _In_ PEXCLUSION_TRIE Trie
+)
+{
+    if (InterlockedDecrement(&Trie->RefCount) == 0) {
+        ExFreePoolWithTag(Trie, SENTINELHOOK_POOL_TAG);
+    }
+}
+
+// add one upcased prefix, Trie->Nodes has room for every character
+static VOID ExclusionInsert(
+    _Inout_ PEXCLUSION_TRIE Trie,
+    _In_reads_(Length) PCWCH Path,
+    _In_ ULONG Length
+)
+{
+    ULONG node = 0;
+
+    if (Length == 0) {
+        return;
+    }
+
+    for (ULONG i = 0; i < Length; i++) {
+        WCHAR c = RtlUpcaseUnicodeChar(Path[i]);
+        ULONG child = Trie->Nodes[node].FirstChild;
+
+        while (child != 0 && Trie->Nodes[child].Char != c) {
+            child = Trie->Nodes[child].NextSibling;
+        }
+
+        if (child == 0) {
+            child = Trie->NodeCount++;
+            Trie->Nodes[child].Char = c;
+            Trie->Nodes[child].NextSibling = Trie->Nodes[node].FirstChild;
+            Trie->Nodes[node].FirstChild = child;
+        }
+
+        // anything below an existing terminal is already covered
+        if (Trie->Nodes[child].Terminal) {
+            return;
+        }
+
+        node = child;
+    }
+
+    Trie->Nodes[node].Terminal = TRUE;
+}
+
+// continue a walk from Node over Length characters
+// returns TRUE once an excluded prefix is matched; *Node becomes 0 when
+// the walk fell off the trie
+static BOOLEAN ExclusionWalk(
+    _In_ PEXCLUSION_TRIE Trie,
+    _Inout_ PULONG Node,
+    _In_reads_(Length) PCWCH Path,
+    _In_ USHORT Length
+)
+{
+    ULONG node = *Node;
+
+    for (USHORT i = 0; i < Length; i++) {
+        WCHAR c = RtlUpcaseUnicodeChar(Path[i]);
+        ULONG child = Trie->Nodes[node].FirstChild;
+
+        while (child != 0 && Trie->Nodes[child].Char != c) {
+            child = Trie->Nodes[child].NextSibling;
+        }
+
+        if (child == 0) {
+            *Node = 0;
+            return FALSE;
+        }
+
+        if (Trie->Nodes[child].Terminal) {
+            return TRUE;
+        }
+
+        node = child;
+    }
+
+    *Node = node;
+    return FALSE;
+}
+
+// compile Config into a new trie and swap it in
+// ConfigLength may exceed sizeof(FILTER_CONFIG) by a MULTI_SZ of extra paths
+NTSTATUS ExclusionUpdate(
+    _In_reads_bytes_(ConfigLength) PFILTER_CONFIG Config,
+    _In_ ULONG ConfigLength
+)
+{
+    PCWCH extra = (PCWCH)(Config + 1);
+    ULONG extraLength = (ConfigLength - sizeof(FILTER_CONFIG)) / sizeof(WCHAR);
+    ULONG fixedCount = min(Config->ExcludedPathCount, ARRAYSIZE(Config->ExcludedPaths));
+    ULONG nodeCount = 1;
+    PEXCLUSION_TRIE trie = NULL;
+    PEXCLUSION_TRIE oldTrie;
+    KIRQL oldIrql;
+
+    // size the node array: at most one node per character
+    for (ULONG i = 0; i < fixedCount; i++) {
+        nodeCount += (ULONG)wcsnlen(Config->ExcludedPaths[i], MAX_PATH_LENGTH);
+    }
+
+    for (ULONG i = 0; i < extraLength; ) {
+        ULONG length = (ULONG)wcsnlen(extra + i, extraLength - i);
+        if (i + length == extraLength) {
+            // not terminated inside the buffer
+            return STATUS_INVALID_PARAMETER;
+        }
+        if (length == 0) {
+            break;
+        }
+        nodeCount += length;
+        i += length + 1;
+    }
+
+    if (nodeCount > EXCLUSION_TRIE_MAX_NODES) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (nodeCount > 1) {
+        trie = (PEXCLUSION_TRIE)ExAllocatePool2(
+            POOL_FLAG_NON_PAGED,
+            FIELD_OFFSET(EXCLUSION_TRIE, Nodes) + nodeCount * sizeof(EXCLUSION_TRIE_NODE),
+            SENTINELHOOK_POOL_TAG
+        );
+        if (!trie) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        trie->RefCount = 1;
+        trie->NodeCount = 1;
+
+        for (ULONG i = 0; i < fixedCount; i++) {
+            ExclusionInsert(trie, Config->ExcludedPaths[i],
+                (ULONG)wcsnlen(Config->ExcludedPaths[i], MAX_PATH_LENGTH));
+        }
+
+        for (ULONG i = 0; i < extraLength; ) {
+            ULONG length = (ULONG)wcsnlen(extra + i, extraLength - i);
+            if (length == 0) {
+                break;
+            }
+            ExclusionInsert(trie, extra + i, length);
+            i += length + 1;
+        }
+    }
+
+    oldIrql = ExAcquireSpinLockExclusive(&g_DriverContext.ExclusionLock);
+    oldTrie = g_DriverContext.ExclusionTrie;
+    g_DriverContext.ExclusionTrie = trie;
+    InterlockedIncrement(&g_DriverContext.ExclusionGeneration);
+    ExReleaseSpinLockExclusive(&g_DriverContext.ExclusionLock, oldIrql);
+
+    // in-flight readers keep the old trie alive until they are done
+    if (oldTrie) {
+        ExclusionRelease(oldTrie);
+    }
+
+    DebugPrint("Exclusions updated: %u fixed, %u trie nodes", fixedCount, nodeCount);
+    return STATUS_SUCCESS;
+}
+
+// drop the current trie - callers must be gone
+VOID ExclusionFree(VOID)
+{
+    if (g_DriverContext.ExclusionTrie) {
+        ExclusionRelease(g_DriverContext.ExclusionTrie);
+        g_DriverContext.ExclusionTrie = NULL;
+    }
+}
+
+// bumped on every update, lets cached per-handle results be revalidated
+LONG ExclusionCurrentGeneration(VOID)
+{
+    return ReadNoFence(&g_DriverContext.ExclusionGeneration);
+}
+
+// is Prefix + Rest under an excluded prefix
+// Generation receives the generation the answer is valid for
+BOOLEAN ExclusionCheckPath(
+    _In_reads_opt_(PrefixLength) PCWCH Prefix,
+    _In_ USHORT PrefixLength,
+    _In_reads_(RestLength) PCWCH Rest,
+    _In_ USHORT RestLength,
+    _Out_opt_ PLONG Generation
+)
+{
+    PEXCLUSION_TRIE trie;
+    BOOLEAN excluded = FALSE;
+    ULONG node = 0;
+
+    // sample the generation first so a concurrent update can only make
+    // the cached answer look stale, never current
+    if (Generation) {
+        *Generation = ExclusionCurrentGeneration();
+    }
+
+    trie = ExclusionAcquire();
+    if (!trie) {
+        return FALSE;
+    }
+
+    if (Prefix && PrefixLength > 0) {
+        excluded = ExclusionWalk(trie, &node, Prefix, PrefixLength);
+    }
+
+    if (!excluded && (node != 0 || !Prefix || PrefixLength == 0)) {
+        excluded = ExclusionWalk(trie, &node, Rest, RestLength);
+    }
+
+    ExclusionRelease(trie);
+    return excluded;
+}
@@ -1,52 +1,340 @@
 // mini-filter for file system monitoring
 #include "sentinelhook.h"
 
+// does this operation change the content, times or name of the file,
+// any of which makes its signature verdict stale
+static BOOLEAN FilterChangesFile(
+    _In_ PFLT_CALLBACK_DATA Data
+)
+{
+    if (Data->Iopb->MajorFunction == IRP_MJ_WRITE) {
+        return TRUE;
+    }
+
+    if (Data->Iopb->MajorFunction != IRP_MJ_SET_INFORMATION) {
+        return FALSE;
+    }
+
+    switch (Data->Iopb->Parameters.SetFileInformation.FileInformationClass) {
+    case FileBasicInformation:
+    case FileEndOfFileInformation:
+    case FileAllocationInformation:
+    case FileValidDataLengthInformation:
+    case FileRenameInformation:
+    case FileRenameInformationEx:
+    case FileDispositionInformation:
+    case FileDispositionInformationEx:
+        return TRUE;
+
+    default:
+        return FALSE;
+    }
+}
+
+// drop the verdict of the file behind FltObjects, through the stream
+// context so it works for any file object of the file, paging I/O too
+static VOID FilterDropVerdict(
+    _In_ PCFLT_RELATED_OBJECTS FltObjects
+)
+{
+    PSTREAM_CONTEXT context = NULL;
+
+    if (FltObjects->FileObject &&
+        NT_SUCCESS(FltGetStreamContext(FltObjects->Instance, FltObjects->FileObject,
+            (PFLT_CONTEXT*)&context))) {
+        ImageVerdictInvalidate(context->FileId);
+        FltReleaseContext(context);
+    }
+}
+
 // pre-op callback - intercept file operations
+// interesting operations capture their record here and finish it in
+// post-op once the real status is known; everything else skips post-op.
+// the completion context is a record buffer from the telemetry pool
 FLT_PREOP_CALLBACK_STATUS FilterPreOperation(
     _Inout_ PFLT_CALLBACK_DATA Data,
     _In_ PCFLT_RELATED_OBJECTS FltObjects,
     _Flt_CompletionContext_Outptr_ PVOID *CompletionContext
 )
 {
-    UNREFERENCED_PARAMETER(FltObjects);
-    UNREFERENCED_PARAMETER(CompletionContext);
+    PTELEMETRY_RECORD_BUFFER completion = NULL;
+    BOOLEAN postOperation = FALSE;
+    ULONG64 perfStart;
+
+    *CompletionContext = NULL;
 
     if (!g_DriverContext.MonitoringEnabled) {
-        return FLT_PREOP_SUCCESS_WITH_CALLBACK;
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+
+    perfStart = PerfStart();
+
+    // before the change is enough: a handle that can write denies the
+    // loader's share mode, so no load can race the write to its
+    // completion. writes through a mapping only get here as paging writes
+    // after the pages changed
+    if (MonitorEnabled(MONITOR_VERDICT) && FilterChangesFile(Data)) {
+        FilterDropVerdict(FltObjects);
     }
 
     switch (Data->Iopb->MajorFunction) {
     case IRP_MJ_CREATE:
         if (FlagOn(Data->Iopb->Parameters.Create.Options, FILE_DELETE_ON_CLOSE)) {
-            LogFileOperation(EventFileDelete, Data);
-        } else {
-            LogFileOperation(EventFileCreate, Data);
+            if (MonitorEnabled(MONITOR_FILE_DELETE)) {
+                completion = CaptureFileOperation(EventFileDelete, Data, FltObjects);
+            }
+        } else if (MonitorEnabled(MONITOR_FILE_CREATE)) {
+            completion = CaptureFileOperation(EventFileCreate, Data, FltObjects);
         }
+
+        // post-create always runs, it attaches the stream-handle context
+        postOperation = TRUE;
         break;
 
+    // only registered while their switch (or a verdict switch, for writes)
+    // is on, but a SET_MONITOR that keeps the registration can still turn
+    // them off
     case IRP_MJ_WRITE:
-        LogFileOperation(EventFileWrite, Data);
+        if (MonitorEnabled(MONITOR_FILE_WRITE)) {
+            completion = CaptureFileOperation(EventFileWrite, Data, FltObjects);
+        }
         break;
 
     case IRP_MJ_READ:
-        LogFileOperation(EventFileRead, Data);
+        if (MonitorEnabled(MONITOR_FILE_READ)) {
+            completion = CaptureFileOperation(EventFileRead, Data, FltObjects);
+        }
         break;
 
     case IRP_MJ_SET_INFORMATION:
         if (Data->Iopb->Parameters.SetFileInformation.FileInformationClass == FileDispositionInformation) {
             PFILE_DISPOSITION_INFORMATION dispositionInfo = 
                 (PFILE_DISPOSITION_INFORMATION)Data->Iopb->Parameters.SetFileInformation.InfoBuffer;
-            if (dispositionInfo && dispositionInfo->DeleteFile) {
-                LogFileOperation(EventFileDelete, Data);
+            if (dispositionInfo && dispositionInfo->DeleteFile && MonitorEnabled(MONITOR_FILE_DELETE)) {
+                completion = CaptureFileOperation(EventFileDelete, Data, FltObjects);
             }
+        } else if (Data->Iopb->Parameters.SetFileInformation.FileInformationClass == FileRenameInformation ||
+                   Data->Iopb->Parameters.SetFileInformation.FileInformationClass == FileRenameInformationEx) {
+            // the cached name is about to go stale, later I/O on this
+            // handle queries the name again
+            FltDeleteStreamHandleContext(FltObjects->Instance, FltObjects->FileObject, NULL);
         }
         break;
     }
 
+    PerfStop(PerfOperation(Data->Iopb->MajorFunction), PerfStagePreOperation, perfStart);
+
+    if (!completion && !postOperation) {
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+
+    *CompletionContext = completion;
     return FLT_PREOP_SUCCESS_WITH_CALLBACK;
 }
 
+// resolve the normalized name once per handle and keep it in a stream-handle
+// context so reads and writes don't have to query it again
+static VOID StreamHandleContextAttach(
+    _In_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects
+)
+{
+    PFLT_FILE_NAME_INFORMATION nameInfo = NULL;
+    PSTREAM_HANDLE_CONTEXT context = NULL;
+    ULONG prefixId;
+    PCWCH rest;
+    USHORT restLength;
+    NTSTATUS status;
+    ULONG64 perfStart = PerfStart();
+
+    status = FltGetFileNameInformation(
+        Data,
+        FLT_FILE_NAME_NORMALIZED | FLT_FILE_NAME_QUERY_DEFAULT,
+        &nameInfo
+    );
+    if (!NT_SUCCESS(status)) {
+        PerfStop(PerfOpCreate, PerfStageNameLookup, perfStart);
+        return;
+    }
+
+    status = FltParseFileNameInformation(nameInfo);
+    PerfStop(PerfOpCreate, PerfStageNameLookup, perfStart);
+
+    if (NT_SUCCESS(status)) {
+        TelemetrySplitPath(&nameInfo->Name, &prefixId, &rest, &restLength);
+
+        status = FltAllocateContext(
+            g_DriverContext.FilterHandle,
+            FLT_STREAMHANDLE_CONTEXT,
+            FIELD_OFFSET(STREAM_HANDLE_CONTEXT, Path) + restLength * sizeof(WCHAR),
+            NonPagedPoolNx,
+            (PFLT_CONTEXT*)&context
+        );
+    }
+
+    if (NT_SUCCESS(status)) {
+        context->ExclusionState = -1;   // evaluated on first use
+        context->PathPrefixId = prefixId;
+        context->PathLength = restLength;
+        RtlCopyMemory(context->Path, rest, restLength * sizeof(WCHAR));
+
+        // a handle only completes create once, an existing context means a
+        // racing attach from elsewhere, keep that one
+        FltSetStreamHandleContext(FltObjects->Instance, FltObjects->FileObject,
+            FLT_SET_CONTEXT_KEEP_IF_EXISTS, context, NULL);
+        FltReleaseContext(context);
+    }
+
+    FltReleaseFileNameInformation(nameInfo);
+}
+
+// remember the file reference number on the stream, once per stream, so a
+// write through any file object can find the file's verdict. a truncating
+// open drops the verdict like a write
+static VOID StreamContextAttach(
+    _In_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects
+)
+{
+    FILE_INTERNAL_INFORMATION internalInfo;
+    PSTREAM_CONTEXT context = NULL;
+    PSTREAM_CONTEXT existing = NULL;
+    NTSTATUS status;
+
+    if (FlagOn(FltObjects->FileObject->Flags, FO_VOLUME_OPEN) ||
+        !FltSupportsStreamContexts(FltObjects->FileObject)) {
+        return;
+    }
+
+    status = FltGetStreamContext(FltObjects->Instance, FltObjects->FileObject, (PFLT_CONTEXT*)&context);
+    if (!NT_SUCCESS(status)) {
+        status = FltQueryInformationFile(FltObjects->Instance, FltObjects->FileObject,
+            &internalInfo, sizeof(internalInfo), FileInternalInformation, NULL);
+
+        // a file system without file IDs never gets a verdict cached
+        if (status == STATUS_INVALID_INFO_CLASS || status == STATUS_NOT_SUPPORTED ||
+            status == STATUS_INVALID_DEVICE_REQUEST) {
+            return;
+        }
+
+        if (NT_SUCCESS(status)) {
+            status = FltAllocateContext(g_DriverContext.FilterHandle, FLT_STREAM_CONTEXT,
+                sizeof(STREAM_CONTEXT), NonPagedPoolNx, (PFLT_CONTEXT*)&context);
+        }
+
+        if (NT_SUCCESS(status)) {
+            context->FileId = (ULONG64)internalInfo.IndexNumber.QuadPart;
+            status = FltSetStreamContext(FltObjects->Instance, FltObjects->FileObject,
+                FLT_SET_CONTEXT_KEEP_IF_EXISTS, context, (PFLT_CONTEXT*)&existing);
+
+            // another open of the stream got there first
+            if (status == STATUS_FLT_CONTEXT_ALREADY_DEFINED) {
+                FltReleaseContext(context);
+                context = existing;
+                status = STATUS_SUCCESS;
+            } else if (!NT_SUCCESS(status)) {
+                FltReleaseContext(context);
+                context = NULL;
+            }
+        }
+
+        // an earlier open of the file may have a verdict cached that this
+        // stream's writes could no longer drop
+        if (!NT_SUCCESS(status)) {
+            ImageVerdictFlush();
+            return;
+        }
+    }
+
+    if (Data->IoStatus.Information == FILE_OVERWRITTEN || Data->IoStatus.Information == FILE_SUPERSEDED) {
+        ImageVerdictInvalidate(context->FileId);
+    }
+
+    FltReleaseContext(context);
+}
+
+// file identity the verdict cache is keyed by, for the notify routines
+// FALSE unless the filter sees every write to the file: an instance on its
+// volume and a stream context attached. PASSIVE_LEVEL
+BOOLEAN FilterFileIdentity(
+    _In_ PFILE_OBJECT FileObject,
+    _Out_ PIMAGE_VERDICT_SLOT Identity
+)
+{
+    PFLT_VOLUME volume = NULL;
+    PFLT_INSTANCE instance = NULL;
+    PINSTANCE_CONTEXT instanceContext = NULL;
+    PSTREAM_CONTEXT streamContext = NULL;
+    FILE_BASIC_INFORMATION basicInfo;
+    BOOLEAN tracked = FALSE;
+
+    RtlZeroMemory(Identity, sizeof(*Identity));
+
+    // MonitorUpdate waits for this before it unregisters the filter
+    if (!ExAcquireRundownProtection(&g_DriverContext.FilterRundown)) {
+        return FALSE;
+    }
+
+    if (!g_DriverContext.FilterHandle ||
+        !NT_SUCCESS(FltGetVolumeFromFileObject(g_DriverContext.FilterHandle, FileObject, &volume)) ||
+        !NT_SUCCESS(FltGetVolumeInstanceFromName(g_DriverContext.FilterHandle, volume, NULL, &instance))) {
+        goto Exit;
+    }
+
+    if (NT_SUCCESS(FltGetInstanceContext(instance, (PFLT_CONTEXT*)&instanceContext)) &&
+        NT_SUCCESS(FltGetStreamContext(instance, FileObject, (PFLT_CONTEXT*)&streamContext)) &&
+        NT_SUCCESS(FltQueryInformationFile(instance, FileObject, &basicInfo, sizeof(basicInfo),
+            FileBasicInformation, NULL))) {
+        Identity->FileId = streamContext->FileId;
+        Identity->LastWriteTime = basicInfo.LastWriteTime.QuadPart;
+        Identity->VolumeSerial = instanceContext->VolumeSerial;
+        tracked = TRUE;
+    }
+
+Exit:
+    if (streamContext) {
+        FltReleaseContext(streamContext);
+    }
+    if (instanceContext) {
+        FltReleaseContext(instanceContext);
+    }
+    if (instance) {
+        FltObjectDereference(instance);
+    }
+    if (volume) {
+        FltObjectDereference(volume);
+    }
+    ExReleaseRundownProtection(&g_DriverContext.FilterRundown);
+    return tracked;
+}
+
+// cached exclusion verdict for a handle, recomputed after SET_FILTER
+static BOOLEAN StreamHandleContextIsExcluded(
+    _In_ PSTREAM_HANDLE_CONTEXT Context
+)
+{
+    LONG state = ReadNoFence(&Context->ExclusionState);
+    LONG generation;
+    PCWCH prefix = NULL;
+    USHORT prefixLength = 0;
+    BOOLEAN excluded;
+
+    if ((state >> 1) == ExclusionCurrentGeneration()) {
+        return (BOOLEAN)(state & 1);
+    }
+
+    if (Context->PathPrefixId != 0) {
+        InternLookupString(Context->PathPrefixId, &prefix, &prefixLength);
+    }
+
+    excluded = ExclusionCheckPath(prefix, prefixLength, Context->Path, Context->PathLength, &generation);
+    InterlockedExchange(&Context->ExclusionState, (generation << 1) | (excluded ? 1 : 0));
+    return excluded;
+}
+
 // post-op callback
+// may run at DISPATCH_LEVEL for reads and writes; only post-create,
+// which is at PASSIVE_LEVEL, queries names
 FLT_POSTOP_CALLBACK_STATUS FilterPostOperation(
     _Inout_ PFLT_CALLBACK_DATA Data,
     _In_ PCFLT_RELATED_OBJECTS FltObjects,
@@ -54,38 +342,86 @@ FLT_POSTOP_CALLBACK_STATUS FilterPostOperation(
     _In_ FLT_POST_OPERATION_FLAGS Flags
 )
 {
-    UNREFERENCED_PARAMETER(FltObjects);
-    UNREFERENCED_PARAMETER(CompletionContext);
-    UNREFERENCED_PARAMETER(Flags);
+    PTELEMETRY_RECORD_BUFFER completion = (PTELEMETRY_RECORD_BUFFER)CompletionContext;
+    ULONG64 perfStart;
+
+    // instance is going away, don't touch the file object
+    if (FlagOn(Flags, FLT_POSTOP_DRAINING)) {
+        if (completion) {
+            TelemetryRecordRelease(completion);
+        }
+        return FLT_POSTOP_FINISHED_PROCESSING;
+    }
 
-    // Post-operation processing if needed
-    // Currently, we log in pre-operation for simplicity
+    perfStart = PerfStart();
 
+    if (Data->Iopb->MajorFunction == IRP_MJ_CREATE &&
+        NT_SUCCESS(Data->IoStatus.Status) && Data->IoStatus.Status != STATUS_REPARSE &&
+        g_DriverContext.MonitoringEnabled) {
+        // the filter also runs for the verdict switches alone, which have
+        // no use for the name
+        if (MonitorEnabled(MONITOR_FILE_ALL)) {
+            StreamHandleContextAttach(Data, FltObjects);
+        }
+        if (MonitorEnabled(MONITOR_VERDICT)) {
+            StreamContextAttach(Data, FltObjects);
+        }
+    }
+
+    if (completion) {
+        LogFileOperation(completion, Data);
+    }
+
+    PerfStop(PerfOperation(Data->Iopb->MajorFunction), PerfStagePostOperation, perfStart);
     return FLT_POSTOP_FINISHED_PROCESSING;
 }
 
-// log file operation to telemetry
-VOID LogFileOperation(
+// capture the parts of a file event only available before the I/O runs
+// returns a pool buffer holding the partial record, or NULL if the event
+// is excluded, rate limited or no memory is available
+PTELEMETRY_RECORD_BUFFER CaptureFileOperation(
     _In_ TELEMETRY_EVENT_TYPE EventType,
-    _In_ PFLT_CALLBACK_DATA Data
+    _In_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects
 )
 {
-    FILE_TELEMETRY fileTelemetry = { 0 };
+    PTELEMETRY_RECORD_BUFFER completion;
+    PTELEMETRY_RECORD record;
+    PSTREAM_HANDLE_CONTEXT context = NULL;
+    PFLT_FILE_NAME_INFORMATION nameInfo = NULL;
     PEPROCESS process = NULL;
     HANDLE processId = NULL;
-    KIRQL oldIrql;
+    ULONG threadId = 0;
 
     // get process info
     process = IoThreadToProcess(Data->Thread);
     if (process) {
         processId = PsGetProcessId(process);
-        fileTelemetry.ProcessId = HandleToUlong(processId);
-        fileTelemetry.ThreadId = HandleToUlong(PsGetThreadId(Data->Thread));
+        threadId = HandleToUlong(PsGetThreadId(Data->Thread));
+    }
+
+    // excluded handles are rejected from the cached state, before any
+    // rate limit token is spent on them
+    if (EventType != EventFileCreate && FltObjects->FileObject &&
+        NT_SUCCESS(FltGetStreamHandleContext(FltObjects->Instance, FltObjects->FileObject,
+            (PFLT_CONTEXT*)&context))) {
+        if (StreamHandleContextIsExcluded(context)) {
+            FltReleaseContext(context);
+            return NULL;
+        }
     }
 
-    // extract file path
-    if (Data->Iopb->TargetFileObject) {
-        PFLT_FILE_NAME_INFORMATION nameInfo = NULL;
+    // only events that will be emitted are sampled and counted
+    if (!TelemetryAdmit(EventType, processId)) {
+        completion = NULL;
+        goto Exit;
+    }
+
+    // no cached path after a successful create: look the name up and
+    // check it against the exclusions. the lookup is the expensive part,
+    // so it waits for the rate limit; an excluded name spends a token
+    if (!context && Data->Iopb->TargetFileObject) {
+        ULONG64 perfStart = PerfStart();
         NTSTATUS status = FltGetFileNameInformation(
             Data,
             FLT_FILE_NAME_NORMALIZED | FLT_FILE_NAME_QUERY_DEFAULT,
@@ -94,37 +430,70 @@ VOID LogFileOperation(
 
         if (NT_SUCCESS(status) && nameInfo) {
             status = FltParseFileNameInformation(nameInfo);
-            if (NT_SUCCESS(status)) {
-                ULONG nameLength = min(nameInfo->Name.Length / sizeof(WCHAR), MAX_PATH_LENGTH - 1);
-                RtlCopyMemory(
-                    fileTelemetry.FilePath,
-                    nameInfo->Name.Buffer,
-                    nameLength * sizeof(WCHAR)
-                );
-                fileTelemetry.FilePath[nameLength] = L'\0';
-            }
+        }
+        PerfStop(PerfOperation(Data->Iopb->MajorFunction), PerfStageNameLookup, perfStart);
+
+        if (nameInfo && !NT_SUCCESS(status)) {
             FltReleaseFileNameInformation(nameInfo);
+            nameInfo = NULL;
+        }
+        if (nameInfo &&
+            ExclusionCheckPath(NULL, 0, nameInfo->Name.Buffer,
+                (USHORT)(nameInfo->Name.Length / sizeof(WCHAR)), NULL)) {
+            completion = NULL;
+            goto Exit;
         }
     }
 
+    completion = TelemetryRecordAllocate();
+    if (!completion) {
+        goto Exit;
+    }
+
+    record = &completion->Record;
+    TelemetryRecordInitialize(record, EventType, HandleToUlong(processId), threadId);
+    record->u.File.OperationFlags = Data->Iopb->OperationFlags;
+
+    // file path, cached on the handle after a successful create
+    if (context) {
+        TelemetryRecordAppendSplitPath(record, context->PathPrefixId, context->Path, context->PathLength);
+    } else if (nameInfo) {
+        TelemetryRecordAppendPath(record, &nameInfo->Name);
+    }
+
     if (processId) {
-        GetProcessName(processId, fileTelemetry.ProcessName, MAX_PROCESS_NAME_LENGTH);
+        TelemetryRecordAppendProcessName(record, processId);
     }
 
-    fileTelemetry.EventType = EventType;
-    fileTelemetry.Timestamp = KeQueryInterruptTime();
-    fileTelemetry.OperationFlags = Data->Iopb->OperationFlags;
-    fileTelemetry.Result = NT_SUCCESS(Data->IoStatus.Status) ? 0 : Data->IoStatus.Status;
+Exit:
+    if (context) {
+        FltReleaseContext(context);
+    }
+    if (nameInfo) {
+        FltReleaseFileNameInformation(nameInfo);
+    }
+    return completion;
+}
+
+// post-op half: record the outcome, publish, and free the buffer
+VOID LogFileOperation(
+    _In_ PTELEMETRY_RECORD_BUFFER Completion,
+    _In_ PFLT_CALLBACK_DATA Data
+)
+{
+    PTELEMETRY_RECORD record = &Completion->Record;
+    ULONG64 perfStart;
+
+    record->u.File.Result = NT_SUCCESS(Data->IoStatus.Status) ? 0 : Data->IoStatus.Status;
+    record->u.File.BytesTransferred = Data->IoStatus.Information;
 
     // update stats
-    KeAcquireSpinLock(&g_DriverContext.StatsLock, &oldIrql);
-    g_DriverContext.Stats.TotalEvents++;
-    g_DriverContext.Stats.FileEvents++;
-    KeReleaseSpinLock(&g_DriverContext.StatsLock, oldIrql);
-
-    // TODO: queue telemetry for user-mode retrieval
-    // currently just logging, need to implement ring buffer
-    DebugPrint("File op: Type=%d, PID=%d, Path=%ws",
-        EventType, fileTelemetry.ProcessId, fileTelemetry.FilePath);
-}
+    TelemetryStatsIncrement(TotalEvents);
+    TelemetryStatsIncrement(FileEvents);
+
+    perfStart = PerfStart();
+    TelemetryRingEnqueue(record);
+    PerfStop(PerfOperation(Data->Iopb->MajorFunction), PerfStageEnqueue, perfStart);
 
+    TelemetryRecordRelease(Completion);
+}
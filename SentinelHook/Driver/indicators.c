@@ -0,0 +1,269 @@
+// injection path indicators
+// the indicator substrings are compiled into a case-insensitive
+// Aho-Corasick automaton at IOCTL_SENTINELHOOK_SET_PATH_INDICATORS time
+// (or from the built-in list at load) and published with a pointer swap,
+// the same way as the exclusion trie. a scan is one pass over the path
+// whatever the number of indicators.
+#include "sentinelhook.h"
+
+// used until the service loads its own list
+static const WCHAR PathIndicatorDefaults[] =
+    L"\\Temp\\\0"
+    L"\\AppData\\Local\\Temp\\\0"
+    L"\\AppData\\Roaming\\\0";
+
+// take a reference on the current automaton, NULL if there are no indicators
+static PPATH_INDICATOR_AUTOMATON PathIndicatorAcquire(VOID)
+{
+    PPATH_INDICATOR_AUTOMATON automaton;
+    KIRQL oldIrql;
+
+    oldIrql = ExAcquireSpinLockShared(&g_DriverContext.PathIndicatorLock);
+    automaton = g_DriverContext.PathIndicators;
+    if (automaton) {
+        InterlockedIncrement(&automaton->RefCount);
+    }
+    ExReleaseSpinLockShared(&g_DriverContext.PathIndicatorLock, oldIrql);
+
+    return automaton;
+}
+
+static VOID PathIndicatorRelease(
+    _In_ PPATH_INDICATOR_AUTOMATON Automaton
+)
+{
+    if (InterlockedDecrement(&Automaton->RefCount) == 0) {
+        ExFreePoolWithTag(Automaton, SENTINELHOOK_POOL_TAG);
+    }
+}
+
+// trie edge from Node on the upcased character C, 0 if there is none
+static ULONG PathIndicatorChild(
+    _In_ PPATH_INDICATOR_AUTOMATON Automaton,
+    _In_ ULONG Node,
+    _In_ WCHAR C
+)
+{
+    ULONG child;
+
+    // almost every character restarts at the root
+    if (Node == 0 && C < PATH_INDICATOR_ROOT_FANOUT) {
+        return Automaton->RootNext[C];
+    }
+
+    child = Automaton->Nodes[Node].FirstChild;
+    while (child != 0 && Automaton->Nodes[child].Char != C) {
+        child = Automaton->Nodes[child].NextSibling;
+    }
+
+    return child;
+}
+
+// add one upcased pattern, Automaton->Nodes has room for every character
+static VOID PathIndicatorInsert(
+    _Inout_ PPATH_INDICATOR_AUTOMATON Automaton,
+    _In_reads_(Length) PCWCH Pattern,
+    _In_ ULONG Length
+)
+{
+    ULONG node = 0;
+
+    for (ULONG i = 0; i < Length; i++) {
+        WCHAR c = RtlUpcaseUnicodeChar(Pattern[i]);
+        ULONG child = Automaton->Nodes[node].FirstChild;
+
+        while (child != 0 && Automaton->Nodes[child].Char != c) {
+            child = Automaton->Nodes[child].NextSibling;
+        }
+
+        if (child == 0) {
+            child = Automaton->NodeCount++;
+            Automaton->Nodes[child].Char = c;
+            Automaton->Nodes[child].NextSibling = Automaton->Nodes[node].FirstChild;
+            Automaton->Nodes[node].FirstChild = child;
+        }
+
+        node = child;
+    }
+
+    Automaton->Nodes[node].Match = TRUE;
+    Automaton->PatternCount++;
+}
+
+// failure links in breadth-first order, so a node's link target is
+// always finished before the node; Queue holds NodeCount entries
+static VOID PathIndicatorLink(
+    _Inout_ PPATH_INDICATOR_AUTOMATON Automaton,
+    _Out_writes_(Automaton->NodeCount) PULONG Queue
+)
+{
+    PPATH_INDICATOR_NODE nodes = Automaton->Nodes;
+    ULONG head = 0;
+    ULONG tail = 0;
+
+    for (ULONG child = nodes[0].FirstChild; child != 0; child = nodes[child].NextSibling) {
+        if (nodes[child].Char < PATH_INDICATOR_ROOT_FANOUT) {
+            Automaton->RootNext[nodes[child].Char] = child;
+        }
+        nodes[child].Fail = 0;
+        Queue[tail++] = child;
+    }
+
+    while (head < tail) {
+        ULONG node = Queue[head++];
+
+        for (ULONG child = nodes[node].FirstChild; child != 0; child = nodes[child].NextSibling) {
+            ULONG fail = nodes[node].Fail;
+            ULONG target;
+
+            for (;;) {
+                target = PathIndicatorChild(Automaton, fail, nodes[child].Char);
+                if (target != 0 || fail == 0) {
+                    break;
+                }
+                fail = nodes[fail].Fail;
+            }
+
+            nodes[child].Fail = target;
+            // a pattern that is a suffix of this path matches here too
+            nodes[child].Match |= nodes[target].Match;
+            Queue[tail++] = child;
+        }
+    }
+}
+
+// compile a MULTI_SZ of indicators into a new automaton and swap it in
+// an empty list removes every indicator
+NTSTATUS PathIndicatorUpdate(
+    _In_reads_(PatternsLength) PCWCH Patterns,
+    _In_ ULONG PatternsLength
+)
+{
+    ULONG nodeCount = 1;
+    PPATH_INDICATOR_AUTOMATON automaton = NULL;
+    PPATH_INDICATOR_AUTOMATON oldAutomaton;
+    PULONG queue;
+    KIRQL oldIrql;
+
+    // size the node array: at most one node per character
+    for (ULONG i = 0; i < PatternsLength; ) {
+        ULONG length = (ULONG)wcsnlen(Patterns + i, PatternsLength - i);
+        if (i + length == PatternsLength) {
+            // not terminated inside the buffer
+            return STATUS_INVALID_PARAMETER;
+        }
+        if (length == 0) {
+            break;
+        }
+        nodeCount += length;
+        i += length + 1;
+    }
+
+    if (nodeCount > PATH_INDICATOR_MAX_NODES) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (nodeCount > 1) {
+        automaton = (PPATH_INDICATOR_AUTOMATON)ExAllocatePool2(
+            POOL_FLAG_NON_PAGED,
+            FIELD_OFFSET(PATH_INDICATOR_AUTOMATON, Nodes) + nodeCount * sizeof(PATH_INDICATOR_NODE),
+            SENTINELHOOK_POOL_TAG
+        );
+        if (!automaton) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        // only needed while linking
+        queue = (PULONG)ExAllocatePool2(POOL_FLAG_PAGED, nodeCount * sizeof(ULONG), SENTINELHOOK_POOL_TAG);
+        if (!queue) {
+            ExFreePoolWithTag(automaton, SENTINELHOOK_POOL_TAG);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        automaton->RefCount = 1;
+        automaton->NodeCount = 1;
+
+        for (ULONG i = 0; i < PatternsLength; ) {
+            ULONG length = (ULONG)wcsnlen(Patterns + i, PatternsLength - i);
+            if (length == 0) {
+                break;
+            }
+            PathIndicatorInsert(automaton, Patterns + i, length);
+            i += length + 1;
+        }
+
+        PathIndicatorLink(automaton, queue);
+        ExFreePoolWithTag(queue, SENTINELHOOK_POOL_TAG);
+    }
+
+    oldIrql = ExAcquireSpinLockExclusive(&g_DriverContext.PathIndicatorLock);
+    oldAutomaton = g_DriverContext.PathIndicators;
+    g_DriverContext.PathIndicators = automaton;
+    ExReleaseSpinLockExclusive(&g_DriverContext.PathIndicatorLock, oldIrql);
+
+    // in-flight scans keep the old automaton alive until they are done
+    if (oldAutomaton) {
+        PathIndicatorRelease(oldAutomaton);
+    }
+
+    DebugPrint("Path indicators updated: %u patterns, %u nodes",
+        automaton ? automaton->PatternCount : 0, nodeCount);
+    return STATUS_SUCCESS;
+}
+
+// built-in indicators; without them injection detection is simply off
+VOID PathIndicatorInitialize(VOID)
+{
+    NTSTATUS status = PathIndicatorUpdate(PathIndicatorDefaults, ARRAYSIZE(PathIndicatorDefaults));
+
+    if (!NT_SUCCESS(status)) {
+        DebugPrint("PathIndicatorInitialize failed: 0x%08X", status);
+    }
+}
+
+// drop the current automaton - callers must be gone
+VOID PathIndicatorFree(VOID)
+{
+    if (g_DriverContext.PathIndicators) {
+        PathIndicatorRelease(g_DriverContext.PathIndicators);
+        g_DriverContext.PathIndicators = NULL;
+    }
+}
+
+// does any indicator occur anywhere in Path
+BOOLEAN PathIndicatorScan(
+    _In_ PCUNICODE_STRING Path
+)
+{
+    PPATH_INDICATOR_AUTOMATON automaton;
+    BOOLEAN matched = FALSE;
+    ULONG node = 0;
+
+    automaton = PathIndicatorAcquire();
+    if (!automaton) {
+        return FALSE;
+    }
+
+    for (USHORT i = 0; i < Path->Length / sizeof(WCHAR); i++) {
+        WCHAR c = RtlUpcaseUnicodeChar(Path->Buffer[i]);
+        ULONG child;
+
+        // follow failure links until some suffix can take c
+        for (;;) {
+            child = PathIndicatorChild(automaton, node, c);
+            if (child != 0 || node == 0) {
+                break;
+            }
+            node = automaton->Nodes[node].Fail;
+        }
+
+        node = child;
+        if (automaton->Nodes[node].Match) {
+            matched = TRUE;
+            break;
+        }
+    }
+
+    PathIndicatorRelease(automaton);
+    return matched;
+}
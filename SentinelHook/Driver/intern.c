@@ -0,0 +1,438 @@
+// interned strings and per-process context cache
+// a handful of processes and directories account for almost all events, so
+// the record builders send small IDs for them instead of copying the names
+// into every record. entries are immutable and only freed at unload, IDs
+// are never reused, so the service can cache ID -> string forever.
+#include "sentinelhook.h"
+
+// FNV-1a over the WCHARs
+static ULONG InternHash(
+    _In_reads_(Length) PCWCH Buffer,
+    _In_ USHORT Length
+)
+{
+    ULONG hash = 2166136261u;
+
+    for (USHORT i = 0; i < Length; i++) {
+        hash ^= Buffer[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static ULONG ProcessCacheBucket(
+    _In_ HANDLE ProcessId
+)
+{
+    // PIDs are multiples of 4
+    return (ULONG)(((ULONG_PTR)ProcessId >> 2) & (PROCESS_CACHE_BUCKETS - 1));
+}
+
+// caller holds StringLock shared or exclusive
+static PINTERNED_STRING InternFindLocked(
+    _In_reads_(Length) PCWCH Buffer,
+    _In_ USHORT Length,
+    _In_ ULONG Hash
+)
+{
+    PINTERNED_STRING entry = g_DriverContext.StringBuckets[Hash & (STRING_TABLE_BUCKETS - 1)];
+
+    for (; entry; entry = entry->Next) {
+        if (entry->Hash == Hash && entry->Length == Length &&
+            RtlEqualMemory(entry->Buffer, Buffer, Length * sizeof(WCHAR))) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+// build the TELEMETRY_RECORD_STRING that defines an entry
+static ULONG InternBuildRecord(
+    _In_ PINTERNED_STRING Entry,
+    _Out_ PTELEMETRY_RECORD Record
+)
+{
+    RtlZeroMemory(Record, sizeof(TELEMETRY_RECORD));
+    Record->Size = (USHORT)(sizeof(TELEMETRY_RECORD) + Entry->Length * sizeof(WCHAR));
+    Record->Version = TELEMETRY_RECORD_VERSION;
+    Record->EventType = TELEMETRY_RECORD_STRING;
+    Record->PathLength = Entry->Length;
+    Record->Timestamp = KeQueryInterruptTime();
+    Record->u.String.Id = Entry->Id;
+    RtlCopyMemory(TELEMETRY_RECORD_STRINGS(Record), Entry->Buffer, Entry->Length * sizeof(WCHAR));
+
+    return Record->Size;
+}
+
+NTSTATUS InternTableInitialize(VOID)
+{
+    g_DriverContext.StringLock = 0;
+    g_DriverContext.ProcessLock = 0;
+    g_DriverContext.StringCount = 0;
+
+    g_DriverContext.StringBuckets = (PINTERNED_STRING*)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        STRING_TABLE_BUCKETS * sizeof(PINTERNED_STRING),
+        SENTINELHOOK_POOL_TAG
+    );
+    g_DriverContext.StringsById = (PINTERNED_STRING*)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        STRING_TABLE_MAX_ENTRIES * sizeof(PINTERNED_STRING),
+        SENTINELHOOK_POOL_TAG
+    );
+    g_DriverContext.ProcessBuckets = (PPROCESS_CACHE_ENTRY*)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        PROCESS_CACHE_BUCKETS * sizeof(PPROCESS_CACHE_ENTRY),
+        SENTINELHOOK_POOL_TAG
+    );
+
+    if (!g_DriverContext.StringBuckets || !g_DriverContext.StringsById ||
+        !g_DriverContext.ProcessBuckets) {
+        InternTableFree();
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// free everything - callers must be gone (callbacks removed, filter unregistered)
+VOID InternTableFree(VOID)
+{
+    if (g_DriverContext.ProcessBuckets) {
+        for (ULONG i = 0; i < PROCESS_CACHE_BUCKETS; i++) {
+            PPROCESS_CACHE_ENTRY entry = g_DriverContext.ProcessBuckets[i];
+            while (entry) {
+                PPROCESS_CACHE_ENTRY next = entry->Next;
+                ExFreePoolWithTag(entry, SENTINELHOOK_POOL_TAG);
+                entry = next;
+            }
+        }
+        ExFreePoolWithTag(g_DriverContext.ProcessBuckets, SENTINELHOOK_POOL_TAG);
+        g_DriverContext.ProcessBuckets = NULL;
+    }
+
+    if (g_DriverContext.StringsById) {
+        for (LONG i = 0; i < g_DriverContext.StringCount; i++) {
+            ExFreePoolWithTag(g_DriverContext.StringsById[i], SENTINELHOOK_POOL_TAG);
+        }
+        ExFreePoolWithTag(g_DriverContext.StringsById, SENTINELHOOK_POOL_TAG);
+        g_DriverContext.StringsById = NULL;
+    }
+
+    if (g_DriverContext.StringBuckets) {
+        ExFreePoolWithTag(g_DriverContext.StringBuckets, SENTINELHOOK_POOL_TAG);
+        g_DriverContext.StringBuckets = NULL;
+    }
+
+    g_DriverContext.StringCount = 0;
+}
+
+// return the ID for a string, adding it on first use
+// returns 0 when the table is full; the caller then sends the string inline
+ULONG InternString(
+    _In_reads_(Length) PCWCH Buffer,
+    _In_ USHORT Length
+)
+{
+    PTELEMETRY_RECORD_BUFFER definition;
+    PINTERNED_STRING entry;
+    PINTERNED_STRING existing;
+    ULONG hash;
+    ULONG bucket;
+    KIRQL oldIrql;
+
+    if (Length == 0 || Length >= MAX_PATH_LENGTH || !g_DriverContext.StringBuckets) {
+        return 0;
+    }
+
+    hash = InternHash(Buffer, Length);
+    bucket = hash & (STRING_TABLE_BUCKETS - 1);
+
+    // fast path, the string is almost always there already
+    oldIrql = ExAcquireSpinLockShared(&g_DriverContext.StringLock);
+    existing = InternFindLocked(Buffer, Length, hash);
+    ExReleaseSpinLockShared(&g_DriverContext.StringLock, oldIrql);
+
+    if (existing) {
+        return existing->Id;
+    }
+
+    if (g_DriverContext.StringCount >= STRING_TABLE_MAX_ENTRIES) {
+        return 0;
+    }
+
+    entry = (PINTERNED_STRING)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        FIELD_OFFSET(INTERNED_STRING, Buffer) + Length * sizeof(WCHAR),
+        SENTINELHOOK_POOL_TAG
+    );
+    if (!entry) {
+        return 0;
+    }
+
+    entry->Hash = hash;
+    entry->Length = Length;
+    RtlCopyMemory(entry->Buffer, Buffer, Length * sizeof(WCHAR));
+
+    oldIrql = ExAcquireSpinLockExclusive(&g_DriverContext.StringLock);
+
+    // lost the race to another CPU, or filled up meanwhile
+    existing = InternFindLocked(Buffer, Length, hash);
+    if (existing || g_DriverContext.StringCount >= STRING_TABLE_MAX_ENTRIES) {
+        ExReleaseSpinLockExclusive(&g_DriverContext.StringLock, oldIrql);
+        ExFreePoolWithTag(entry, SENTINELHOOK_POOL_TAG);
+        return existing ? existing->Id : 0;
+    }
+
+    g_DriverContext.StringsById[g_DriverContext.StringCount] = entry;
+    entry->Id = (ULONG)++g_DriverContext.StringCount;
+    entry->Next = g_DriverContext.StringBuckets[bucket];
+    g_DriverContext.StringBuckets[bucket] = entry;
+
+    ExReleaseSpinLockExclusive(&g_DriverContext.StringLock, oldIrql);
+
+    // tell the consumer about it; if this gets dropped or is read after
+    // the first use, the service falls back to IOCTL_SENTINELHOOK_RESOLVE_STRING
+    // callers usually have a record of their own in flight, so this one
+    // comes from the pool too rather than the stack
+    definition = TelemetryRecordAllocate();
+    if (definition) {
+        InternBuildRecord(entry, &definition->Record);
+        TelemetryRingEnqueue(&definition->Record);
+        TelemetryRecordRelease(definition);
+    }
+
+    return entry->Id;
+}
+
+// string for Id, valid until unload
+BOOLEAN InternLookupString(
+    _In_ ULONG Id,
+    _Out_ PCWCH* Buffer,
+    _Out_ PUSHORT Length
+)
+{
+    PINTERNED_STRING entry = NULL;
+    KIRQL oldIrql;
+
+    oldIrql = ExAcquireSpinLockShared(&g_DriverContext.StringLock);
+    if (Id != 0 && Id <= (ULONG)g_DriverContext.StringCount) {
+        entry = g_DriverContext.StringsById[Id - 1];
+    }
+    ExReleaseSpinLockShared(&g_DriverContext.StringLock, oldIrql);
+
+    if (!entry) {
+        *Buffer = NULL;
+        *Length = 0;
+        return FALSE;
+    }
+
+    *Buffer = entry->Buffer;
+    *Length = entry->Length;
+    return TRUE;
+}
+
+// IOCTL_SENTINELHOOK_RESOLVE_STRING - write the definition record for Id
+NTSTATUS InternResolveString(
+    _In_ ULONG Id,
+    _Out_writes_bytes_to_(BufferLength, *BytesWritten) PVOID Buffer,
+    _In_ ULONG BufferLength,
+    _Out_ PULONG BytesWritten
+)
+{
+    PINTERNED_STRING entry = NULL;
+    KIRQL oldIrql;
+
+    *BytesWritten = 0;
+
+    if (BufferLength < TELEMETRY_RECORD_MAX_SIZE) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    oldIrql = ExAcquireSpinLockShared(&g_DriverContext.StringLock);
+    if (Id != 0 && Id <= (ULONG)g_DriverContext.StringCount) {
+        entry = g_DriverContext.StringsById[Id - 1];
+    }
+    ExReleaseSpinLockShared(&g_DriverContext.StringLock, oldIrql);
+
+    if (!entry) {
+        return STATUS_NOT_FOUND;
+    }
+
+    // entries are immutable once published
+    *BytesWritten = InternBuildRecord(entry, (PTELEMETRY_RECORD)Buffer);
+    return STATUS_SUCCESS;
+}
+
+// insert or refresh the context for ProcessId
+static VOID ProcessCacheAdd(
+    _In_ HANDLE ProcessId,
+    _In_ ULONG NameId
+)
+{
+    PPROCESS_CACHE_ENTRY entry;
+    PPROCESS_CACHE_ENTRY existing;
+    ULONG bucket = ProcessCacheBucket(ProcessId);
+    KIRQL oldIrql;
+
+    entry = (PPROCESS_CACHE_ENTRY)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        sizeof(PROCESS_CACHE_ENTRY),
+        SENTINELHOOK_POOL_TAG
+    );
+    if (!entry) {
+        return;
+    }
+
+    entry->ProcessId = ProcessId;
+    entry->NameId = NameId;
+
+    oldIrql = ExAcquireSpinLockExclusive(&g_DriverContext.ProcessLock);
+
+    for (existing = g_DriverContext.ProcessBuckets[bucket]; existing; existing = existing->Next) {
+        if (existing->ProcessId == ProcessId) {
+            break;
+        }
+    }
+
+    if (existing) {
+        // PID reused after an exit we never saw
+        existing->NameId = NameId;
+        existing->RateTat = 0;
+    } else {
+        entry->Next = g_DriverContext.ProcessBuckets[bucket];
+        g_DriverContext.ProcessBuckets[bucket] = entry;
+        entry = NULL;
+    }
+
+    ExReleaseSpinLockExclusive(&g_DriverContext.ProcessLock, oldIrql);
+
+    if (entry) {
+        ExFreePoolWithTag(entry, SENTINELHOOK_POOL_TAG);
+    }
+}
+
+// process create: cache the image file name (final path component)
+VOID ProcessCacheInsert(
+    _In_ HANDLE ProcessId,
+    _In_opt_ PCUNICODE_STRING ImageFileName
+)
+{
+    USHORT length;
+    USHORT start;
+    ULONG nameId;
+
+    if (!ImageFileName || !ImageFileName->Buffer || !g_DriverContext.ProcessBuckets) {
+        return;
+    }
+
+    length = ImageFileName->Length / sizeof(WCHAR);
+    for (start = length; start > 0 && ImageFileName->Buffer[start - 1] != L'\\'; start--);
+
+    nameId = InternString(ImageFileName->Buffer + start,
+        (USHORT)min(length - start, MAX_PROCESS_NAME_LENGTH - 1));
+    if (nameId != 0) {
+        ProcessCacheAdd(ProcessId, nameId);
+    }
+}
+
+// name ID for ProcessId, 0 if it could not be resolved
+// processes started before the driver loaded are added on first sight
+ULONG ProcessCacheLookup(
+    _In_ HANDLE ProcessId
+)
+{
+    PPROCESS_CACHE_ENTRY entry;
+    PWCHAR name;
+    ULONG nameId = 0;
+    KIRQL oldIrql;
+
+    if (!g_DriverContext.ProcessBuckets) {
+        return 0;
+    }
+
+    oldIrql = ExAcquireSpinLockShared(&g_DriverContext.ProcessLock);
+    for (entry = g_DriverContext.ProcessBuckets[ProcessCacheBucket(ProcessId)]; entry; entry = entry->Next) {
+        if (entry->ProcessId == ProcessId) {
+            nameId = entry->NameId;
+            break;
+        }
+    }
+    ExReleaseSpinLockShared(&g_DriverContext.ProcessLock, oldIrql);
+
+    if (nameId != 0) {
+        return nameId;
+    }
+
+    name = TelemetryNameAllocate();
+    if (!name) {
+        return 0;
+    }
+
+    if (NT_SUCCESS(GetProcessName(ProcessId, name, MAX_PROCESS_NAME_LENGTH))) {
+        nameId = InternString(name, (USHORT)wcsnlen(name, MAX_PROCESS_NAME_LENGTH - 1));
+        if (nameId != 0) {
+            ProcessCacheAdd(ProcessId, nameId);
+        }
+    }
+
+    TelemetryNameRelease(name);
+    return nameId;
+}
+
+// process exit
+VOID ProcessCacheRemove(
+    _In_ HANDLE ProcessId
+)
+{
+    PPROCESS_CACHE_ENTRY* link;
+    PPROCESS_CACHE_ENTRY entry = NULL;
+    KIRQL oldIrql;
+
+    if (!g_DriverContext.ProcessBuckets) {
+        return;
+    }
+
+    oldIrql = ExAcquireSpinLockExclusive(&g_DriverContext.ProcessLock);
+    for (link = &g_DriverContext.ProcessBuckets[ProcessCacheBucket(ProcessId)]; *link; link = &(*link)->Next) {
+        if ((*link)->ProcessId == ProcessId) {
+            entry = *link;
+            *link = entry->Next;
+            break;
+        }
+    }
+    ExReleaseSpinLockExclusive(&g_DriverContext.ProcessLock, oldIrql);
+
+    if (entry) {
+        ExFreePoolWithTag(entry, SENTINELHOOK_POOL_TAG);
+    }
+}
+
+// per-process rate limit, processes not in the cache are let through
+BOOLEAN ProcessCacheAdmit(
+    _In_ HANDLE ProcessId,
+    _In_ ULONG64 Now
+)
+{
+    PPROCESS_CACHE_ENTRY entry;
+    BOOLEAN admit = TRUE;
+    KIRQL oldIrql;
+
+    if (!g_DriverContext.ProcessBuckets) {
+        return TRUE;
+    }
+
+    oldIrql = ExAcquireSpinLockShared(&g_DriverContext.ProcessLock);
+    for (entry = g_DriverContext.ProcessBuckets[ProcessCacheBucket(ProcessId)]; entry; entry = entry->Next) {
+        if (entry->ProcessId == ProcessId) {
+            admit = RateLimitTake(&entry->RateTat, g_DriverContext.ProcessRateInterval,
+                g_DriverContext.ProcessRateLimit, Now);
+            break;
+        }
+    }
+    ExReleaseSpinLockShared(&g_DriverContext.ProcessLock, oldIrql);
+
+    return admit;
+}
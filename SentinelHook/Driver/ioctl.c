@@ -25,6 +25,12 @@ NTSTATUS DeviceIoControl(
         status = STATUS_SUCCESS;
         break;
 
+    case IRP_MJ_CLEANUP:
+        // last handle closed - drop the ring mapping if this handle owned it
+        TelemetryRingUnmap(ioStack->FileObject);
+        status = STATUS_SUCCESS;
+        break;
+
     case IRP_MJ_DEVICE_CONTROL:
         ioControlCode = ioStack->Parameters.DeviceIoControl.IoControlCode;
         inputBuffer = Irp->AssociatedIrp.SystemBuffer;
@@ -34,22 +40,53 @@ NTSTATUS DeviceIoControl(
 
         switch (ioControlCode) {
         case IOCTL_SENTINELHOOK_GET_TELEMETRY:
-            // TODO: implement proper ring buffer for telemetry queue
-            if (outputBufferLength >= sizeof(TELEMETRY_ENTRY)) {
-                RtlZeroMemory(outputBuffer, outputBufferLength);
-                information = sizeof(TELEMETRY_ENTRY);
-                status = STATUS_SUCCESS;
+            // batch of packed records, Count == 0 when all rings are empty
+            {
+                ULONG bytesWritten = 0;
+                status = TelemetryRingDrain(outputBuffer, outputBufferLength, &bytesWritten);
+                information = bytesWritten;
+            }
+            break;
+
+        case IOCTL_SENTINELHOOK_MAP_TELEMETRY:
+            if (inputBufferLength >= sizeof(TELEMETRY_MAP_REQUEST) &&
+                outputBufferLength >= sizeof(TELEMETRY_MAP_RESPONSE)) {
+                PTELEMETRY_MAP_REQUEST request = (PTELEMETRY_MAP_REQUEST)inputBuffer;
+                HANDLE dataEvent = (HANDLE)(ULONG_PTR)request->DataEvent;
+                HANDLE highWaterEvent = (HANDLE)(ULONG_PTR)request->HighWaterEvent;
+                ULONG highWaterBytes = request->HighWaterBytes;
+
+                // input and output share the system buffer
+                status = TelemetryRingMap(ioStack->FileObject, dataEvent,
+                    highWaterEvent, highWaterBytes, (PTELEMETRY_MAP_RESPONSE)outputBuffer);
+                if (NT_SUCCESS(status)) {
+                    information = sizeof(TELEMETRY_MAP_RESPONSE);
+                }
             } else {
                 status = STATUS_BUFFER_TOO_SMALL;
             }
             break;
 
+        case IOCTL_SENTINELHOOK_UNMAP_TELEMETRY:
+            TelemetryRingUnmap(ioStack->FileObject);
+            status = STATUS_SUCCESS;
+            break;
+
+        case IOCTL_SENTINELHOOK_RESOLVE_STRING:
+            // definition of an interned ID the consumer has not seen yet
+            if (inputBufferLength >= sizeof(TELEMETRY_STRING_REQUEST)) {
+                ULONG id = ((PTELEMETRY_STRING_REQUEST)inputBuffer)->Id;
+                ULONG bytesWritten = 0;
+                status = InternResolveString(id, outputBuffer, outputBufferLength, &bytesWritten);
+                information = bytesWritten;
+            } else {
+                status = STATUS_INVALID_PARAMETER;
+            }
+            break;
+
         case IOCTL_SENTINELHOOK_GET_STATS:
             if (outputBufferLength >= sizeof(TELEMETRY_STATS)) {
-                KIRQL oldIrql;
-                KeAcquireSpinLock(&g_DriverContext.StatsLock, &oldIrql);
-                RtlCopyMemory(outputBuffer, &g_DriverContext.Stats, sizeof(TELEMETRY_STATS));
-                KeReleaseSpinLock(&g_DriverContext.StatsLock, oldIrql);
+                TelemetryStatsQuery((PTELEMETRY_STATS)outputBuffer);
                 information = sizeof(TELEMETRY_STATS);
                 status = STATUS_SUCCESS;
             } else {
@@ -57,12 +94,69 @@ NTSTATUS DeviceIoControl(
             }
             break;
 
+        case IOCTL_SENTINELHOOK_GET_PERF:
+            if (outputBufferLength >= sizeof(TELEMETRY_PERF_STATS)) {
+                PerfQuery((PTELEMETRY_PERF_STATS)outputBuffer);
+                information = sizeof(TELEMETRY_PERF_STATS);
+                status = STATUS_SUCCESS;
+            } else {
+                status = STATUS_BUFFER_TOO_SMALL;
+            }
+            break;
+
+        case IOCTL_SENTINELHOOK_SET_PERF:
+            if (inputBufferLength >= sizeof(TELEMETRY_PERF_CONTROL)) {
+                status = PerfControl((PTELEMETRY_PERF_CONTROL)inputBuffer);
+            } else {
+                status = STATUS_INVALID_PARAMETER;
+            }
+            break;
+
         case IOCTL_SENTINELHOOK_SET_FILTER:
             if (inputBufferLength >= sizeof(FILTER_CONFIG)) {
                 PFILTER_CONFIG config = (PFILTER_CONFIG)inputBuffer;
-                // TODO: apply filter rules
-                UNREFERENCED_PARAMETER(config);
-                status = STATUS_SUCCESS;
+                // exclusions, optionally followed by a MULTI_SZ of extra paths
+                status = ExclusionUpdate(config, inputBufferLength);
+                if (NT_SUCCESS(status)) {
+                    // the switches, leaving the excluded volumes as they are
+                    status = MonitorUpdate(MonitorFlagsFromConfig(config), NULL, 0);
+                }
+            } else {
+                status = STATUS_INVALID_PARAMETER;
+            }
+            break;
+
+        case IOCTL_SENTINELHOOK_SET_MONITOR:
+            if (inputBufferLength >= sizeof(MONITOR_CONFIG)) {
+                PMONITOR_CONFIG config = (PMONITOR_CONFIG)inputBuffer;
+                if (config->Options & MONITOR_CONFIG_VOLUMES) {
+                    // MULTI_SZ of excluded volumes right after the structure
+                    status = MonitorUpdate(config->Flags, (PCWCH)(config + 1),
+                        (inputBufferLength - sizeof(MONITOR_CONFIG)) / sizeof(WCHAR));
+                } else {
+                    status = MonitorUpdate(config->Flags, NULL, 0);
+                }
+            } else {
+                status = STATUS_INVALID_PARAMETER;
+            }
+            break;
+
+        case IOCTL_SENTINELHOOK_SET_PATH_INDICATORS:
+            // MULTI_SZ of indicator substrings, empty input clears them
+            status = PathIndicatorUpdate((PCWCH)inputBuffer, inputBufferLength / sizeof(WCHAR));
+            break;
+
+        case IOCTL_SENTINELHOOK_SET_RATE_LIMIT:
+            if (inputBufferLength >= sizeof(RATE_LIMIT_CONFIG)) {
+                status = RateLimitUpdate((PRATE_LIMIT_CONFIG)inputBuffer);
+            } else {
+                status = STATUS_INVALID_PARAMETER;
+            }
+            break;
+
+        case IOCTL_SENTINELHOOK_SET_IMAGE_VERDICT:
+            if (inputBufferLength >= sizeof(TELEMETRY_IMAGE_VERDICT)) {
+                status = ImageVerdictUpdate((PTELEMETRY_IMAGE_VERDICT)inputBuffer);
             } else {
                 status = STATUS_INVALID_PARAMETER;
             }
@@ -70,6 +164,8 @@ NTSTATUS DeviceIoControl(
 
         case IOCTL_SENTINELHOOK_ENABLE_MONITORING:
             g_DriverContext.MonitoringEnabled = TRUE;
+            // writes went unseen while it was off
+            ImageVerdictFlush();
             DebugPrint("Monitoring enabled via IOCTL");
             status = STATUS_SUCCESS;
             break;
@@ -0,0 +1,362 @@
+// monitoring switches, IOCTL_SENTINELHOOK_SET_MONITOR
+// MonitorFlags is one word swapped with InterlockedExchange and tested by
+// every callback, so switching an event type off costs nothing to apply.
+// on top of that the filter is only registered for the file operations a
+// switch needs: filter manager takes the operation list at registration
+// and can't change it on a live filter, so when the needed set changes the
+// filter is unregistered and registered again. that tears down every
+// instance and its stream-handle contexts and leaves a short window with
+// no file callbacks at all, which is why it only happens when the set of
+// operations really changes and never for the flags the callbacks test.
+// volumes on the excluded list are refused in FilterInstanceSetup.
+// MonitorLock is a push lock, not a fast mutex: registering, starting and
+// unregistering the filter, attaching and detaching volumes and the image
+// notify routine all need PASSIVE_LEVEL, and a held fast mutex is
+// APC_LEVEL. the push lock only disables normal kernel APCs.
+// the image verdict cache depends on the filter seeing every write, so
+// create, write and set-information also stay registered while a verdict
+// switch is on, and every update flushes the cache since writes in the
+// re-registration window or on a detached volume went unseen.
+#include "sentinelhook.h"
+
+#define MONITOR_VOLUME_NAME_LENGTH   128     // in WCHARs, \Device\HarddiskVolumeShadowCopyNN fits
+
+// every operation the filter can register for and the switches that need it
+// create attaches the handle contexts reads and writes rely on and
+// set-information drops them on rename, so both stay while any file
+// switch is on; the verdict switches need the stream contexts create
+// attaches and every write and metadata change
+static CONST struct {
+    UCHAR MajorFunction;
+    ULONG Flags;
+} MonitorOperationTable[] = {
+    { IRP_MJ_CREATE, MONITOR_FILE_ALL | MONITOR_VERDICT },
+    { IRP_MJ_WRITE, MONITOR_FILE_WRITE | MONITOR_VERDICT },
+    { IRP_MJ_READ, MONITOR_FILE_READ },
+    { IRP_MJ_SET_INFORMATION, MONITOR_FILE_ALL | MONITOR_VERDICT },
+};
+
+// registration handed to filter manager, only written while no filter is
+// registered
+static FLT_OPERATION_REGISTRATION MonitorCallbacks[ARRAYSIZE(MonitorOperationTable) + 1];
+static FLT_REGISTRATION MonitorRegistration;
+
+// MonitorOperationTable entries, as a bit mask, that Flags needs
+static ULONG MonitorRequiredOperations(
+    _In_ ULONG Flags
+)
+{
+    ULONG operations = 0;
+
+    for (ULONG i = 0; i < ARRAYSIZE(MonitorOperationTable); i++) {
+        if (Flags & MonitorOperationTable[i].Flags) {
+            operations |= 1UL << i;
+        }
+    }
+    return operations;
+}
+
+// register (not start) the filter for the operations in the Operations mask
+// caller holds MonitorLock, or is DriverEntry
+static NTSTATUS MonitorRegisterFilter(
+    _In_ ULONG Operations
+)
+{
+    ULONG count = 0;
+    NTSTATUS status;
+
+    RtlZeroMemory(MonitorCallbacks, sizeof(MonitorCallbacks));
+    for (ULONG i = 0; i < ARRAYSIZE(MonitorOperationTable); i++) {
+        if (Operations & (1UL << i)) {
+            MonitorCallbacks[count].MajorFunction = MonitorOperationTable[i].MajorFunction;
+            MonitorCallbacks[count].PreOperation = FilterPreOperation;
+            MonitorCallbacks[count].PostOperation = FilterPostOperation;
+            count++;
+        }
+    }
+    MonitorCallbacks[count].MajorFunction = IRP_MJ_OPERATION_END;
+
+    MonitorRegistration = FilterRegistration;
+    MonitorRegistration.OperationRegistration = MonitorCallbacks;
+
+    status = FltRegisterFilter(g_DriverContext.DriverObject, &MonitorRegistration,
+        &g_DriverContext.FilterHandle);
+    if (!NT_SUCCESS(status)) {
+        g_DriverContext.FilterHandle = NULL;
+        return status;
+    }
+
+    g_DriverContext.MonitorOperations = Operations;
+    return STATUS_SUCCESS;
+}
+
+// everything on, called once from DriverEntry before FltStartFiltering
+NTSTATUS MonitorInitialize(
+    _In_ PDRIVER_OBJECT DriverObject
+)
+{
+    g_DriverContext.DriverObject = DriverObject;
+    g_DriverContext.MonitorFlags = MONITOR_ALL;
+    FltInitializePushLock(&g_DriverContext.MonitorLock);
+    ExInitializeRundownProtection(&g_DriverContext.FilterRundown);
+
+    return MonitorRegisterFilter(MonitorRequiredOperations(MONITOR_ALL));
+}
+
+// unregister the filter and the image notify routine, called from DriverUnload
+VOID MonitorShutdown(VOID)
+{
+    FltAcquirePushLockExclusive(&g_DriverContext.MonitorLock);
+
+    if (g_DriverContext.ImageNotifyRegistered) {
+        PsRemoveLoadImageNotifyRoutine(ImageNotifyRoutine);
+        g_DriverContext.ImageNotifyRegistered = FALSE;
+    }
+
+    // notify routines still querying the filter, see FilterFileIdentity
+    ExWaitForRundownProtectionRelease(&g_DriverContext.FilterRundown);
+
+    if (g_DriverContext.FilterHandle) {
+        FltUnregisterFilter(g_DriverContext.FilterHandle);
+        g_DriverContext.FilterHandle = NULL;
+    }
+
+    FltReleasePushLock(&g_DriverContext.MonitorLock);
+}
+
+// drop the excluded volume list - the filter must be unregistered
+VOID MonitorFree(VOID)
+{
+    FltDeletePushLock(&g_DriverContext.MonitorLock);
+
+    if (g_DriverContext.ExcludedVolumes) {
+        ExFreePoolWithTag(g_DriverContext.ExcludedVolumes, SENTINELHOOK_POOL_TAG);
+        g_DriverContext.ExcludedVolumes = NULL;
+        g_DriverContext.ExcludedVolumesLength = 0;
+    }
+}
+
+// is Volume on the excluded list, called from FilterInstanceSetup
+BOOLEAN MonitorVolumeExcluded(
+    _In_ PFLT_VOLUME Volume
+)
+{
+    WCHAR buffer[MONITOR_VOLUME_NAME_LENGTH];
+    UNICODE_STRING name;
+    BOOLEAN excluded = FALSE;
+    KIRQL oldIrql;
+
+    // cheap check first, the list is usually empty
+    if (!ReadPointerAcquire((PVOID*)&g_DriverContext.ExcludedVolumes)) {
+        return FALSE;
+    }
+
+    RtlInitEmptyUnicodeString(&name, buffer, sizeof(buffer));
+    if (!NT_SUCCESS(FltGetVolumeName(Volume, &name, NULL))) {
+        return FALSE;
+    }
+
+    oldIrql = ExAcquireSpinLockShared(&g_DriverContext.VolumeLock);
+
+    PCWCH list = g_DriverContext.ExcludedVolumes;
+    ULONG listLength = g_DriverContext.ExcludedVolumesLength;
+    USHORT nameLength = name.Length / sizeof(WCHAR);
+
+    for (ULONG i = 0; list && i < listLength && list[i] && !excluded; ) {
+        ULONG length = (ULONG)wcsnlen(list + i, listLength - i);
+
+        if (length == nameLength) {
+            excluded = TRUE;
+            for (USHORT j = 0; j < nameLength; j++) {
+                if (RtlUpcaseUnicodeChar(list[i + j]) != RtlUpcaseUnicodeChar(name.Buffer[j])) {
+                    excluded = FALSE;
+                    break;
+                }
+            }
+        }
+        i += length + 1;
+    }
+
+    ExReleaseSpinLockShared(&g_DriverContext.VolumeLock, oldIrql);
+    return excluded;
+}
+
+// detach from newly excluded volumes and attach to the rest
+// caller holds MonitorLock
+static VOID MonitorApplyVolumes(VOID)
+{
+    PFLT_VOLUME* volumes;
+    ULONG count = 0;
+    NTSTATUS status;
+
+    status = FltEnumerateVolumes(g_DriverContext.FilterHandle, NULL, 0, &count);
+    if (status != STATUS_BUFFER_TOO_SMALL || count == 0) {
+        return;
+    }
+
+    volumes = (PFLT_VOLUME*)ExAllocatePool2(POOL_FLAG_PAGED, count * sizeof(PFLT_VOLUME), SENTINELHOOK_POOL_TAG);
+    if (!volumes) {
+        return;
+    }
+
+    status = FltEnumerateVolumes(g_DriverContext.FilterHandle, volumes, count, &count);
+    if (NT_SUCCESS(status)) {
+        for (ULONG i = 0; i < count; i++) {
+            PFLT_INSTANCE instance = NULL;
+            BOOLEAN attached = NT_SUCCESS(FltGetVolumeInstanceFromName(
+                g_DriverContext.FilterHandle, volumes[i], NULL, &instance));
+
+            if (instance) {
+                FltObjectDereference(instance);
+            }
+
+            if (MonitorVolumeExcluded(volumes[i])) {
+                if (attached) {
+                    FltDetachVolume(g_DriverContext.FilterHandle, volumes[i], NULL);
+                }
+            } else if (!attached) {
+                // FilterInstanceSetup still gets to refuse it
+                FltAttachVolume(g_DriverContext.FilterHandle, volumes[i], NULL, NULL);
+            }
+
+            FltObjectDereference(volumes[i]);
+        }
+    }
+
+    ExFreePoolWithTag(volumes, SENTINELHOOK_POOL_TAG);
+}
+
+// swap in Flags, register only the callbacks they need and optionally
+// replace the excluded volume list (Volumes != NULL, MULTI_SZ)
+NTSTATUS MonitorUpdate(
+    _In_ ULONG Flags,
+    _In_reads_opt_(VolumesLength) PCWCH Volumes,
+    _In_ ULONG VolumesLength
+)
+{
+    PWCH list = NULL;
+    PWCH oldList = NULL;
+    ULONG listLength = 0;
+    ULONG operations;
+    BOOLEAN wantImages;
+    NTSTATUS status = STATUS_SUCCESS;
+    KIRQL oldIrql;
+
+    Flags &= MONITOR_ALL;
+
+    if (Volumes) {
+        for (ULONG i = 0; i < VolumesLength; ) {
+            ULONG length = (ULONG)wcsnlen(Volumes + i, VolumesLength - i);
+            if (i + length == VolumesLength) {
+                // not terminated inside the buffer
+                return STATUS_INVALID_PARAMETER;
+            }
+            if (length == 0) {
+                break;
+            }
+            i += length + 1;
+            listLength = i + 1;
+        }
+
+        if (listLength) {
+            list = (PWCH)ExAllocatePool2(POOL_FLAG_NON_PAGED, listLength * sizeof(WCHAR), SENTINELHOOK_POOL_TAG);
+            if (!list) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+            RtlCopyMemory(list, Volumes, (listLength - 1) * sizeof(WCHAR));
+            list[listLength - 1] = L'\0';
+        }
+    }
+
+    FltAcquirePushLockExclusive(&g_DriverContext.MonitorLock);
+
+    if (Volumes) {
+        oldIrql = ExAcquireSpinLockExclusive(&g_DriverContext.VolumeLock);
+        oldList = g_DriverContext.ExcludedVolumes;
+        g_DriverContext.ExcludedVolumes = list;
+        g_DriverContext.ExcludedVolumesLength = listLength;
+        ExReleaseSpinLockExclusive(&g_DriverContext.VolumeLock, oldIrql);
+
+        if (oldList) {
+            ExFreePoolWithTag(oldList, SENTINELHOOK_POOL_TAG);
+        }
+    }
+
+    // callbacks see the new switches before the registration catches up
+    InterlockedExchange(&g_DriverContext.MonitorFlags, (LONG)Flags);
+
+    // verdict lookups hold the filter handle and its instances, they are
+    // untracked until the rundown is reopened below
+    ExWaitForRundownProtectionRelease(&g_DriverContext.FilterRundown);
+
+    operations = MonitorRequiredOperations(Flags);
+    if (operations != g_DriverContext.MonitorOperations || !g_DriverContext.FilterHandle) {
+        if (g_DriverContext.FilterHandle) {
+            FltUnregisterFilter(g_DriverContext.FilterHandle);
+            g_DriverContext.FilterHandle = NULL;
+            g_DriverContext.MonitorOperations = 0;
+        }
+
+        // nothing left to filter, stay unregistered until a file switch
+        // comes back on; the new instances pick up the volume list as they
+        // attach
+        if (operations) {
+            status = MonitorRegisterFilter(operations);
+            if (NT_SUCCESS(status)) {
+                status = FltStartFiltering(g_DriverContext.FilterHandle);
+                if (!NT_SUCCESS(status)) {
+                    FltUnregisterFilter(g_DriverContext.FilterHandle);
+                    g_DriverContext.FilterHandle = NULL;
+                    g_DriverContext.MonitorOperations = 0;
+                }
+            }
+            if (!NT_SUCCESS(status)) {
+                // the next SET_MONITOR tries again
+                DebugPrint("Filter re-registration failed: 0x%08X", status);
+            }
+        }
+    } else if (Volumes && g_DriverContext.FilterHandle) {
+        MonitorApplyVolumes();
+    }
+
+    ImageVerdictFlush();
+    ExReInitializeRundownProtection(&g_DriverContext.FilterRundown);
+
+    wantImages = (Flags & (MONITOR_IMAGE | MONITOR_DETECT_UNSIGNED_DRIVER)) != 0;
+    if (wantImages && !g_DriverContext.ImageNotifyRegistered) {
+        g_DriverContext.ImageNotifyRegistered = NT_SUCCESS(PsSetLoadImageNotifyRoutine(ImageNotifyRoutine));
+    } else if (!wantImages && g_DriverContext.ImageNotifyRegistered) {
+        PsRemoveLoadImageNotifyRoutine(ImageNotifyRoutine);
+        g_DriverContext.ImageNotifyRegistered = FALSE;
+    }
+
+    FltReleasePushLock(&g_DriverContext.MonitorLock);
+
+    DebugPrint("Monitor flags 0x%02X, operation mask 0x%X", Flags, g_DriverContext.MonitorOperations);
+    return status;
+}
+
+// the MONITOR_* equivalent of the FILTER_CONFIG booleans
+ULONG MonitorFlagsFromConfig(
+    _In_ PFILTER_CONFIG Config
+)
+{
+    ULONG flags = 0;
+
+    if (Config->MonitorFileOperations) {
+        flags |= MONITOR_FILE_ALL;
+    }
+    if (Config->MonitorProcessCreation) {
+        flags |= MONITOR_PROCESS;
+    }
+    if (Config->MonitorImageLoads) {
+        flags |= MONITOR_IMAGE;
+    }
+    if (Config->DetectInjections) {
+        flags |= MONITOR_DETECT_INJECTION;
+    }
+    if (Config->DetectUnsignedDrivers) {
+        flags |= MONITOR_DETECT_UNSIGNED_DRIVER;
+    }
+    return flags;
+}
@@ -0,0 +1,126 @@
+// minifilter profiler
+// optional timing of the file path, see PERF_STAGE. each processor bumps
+// its own cache-aligned histograms so the profiler adds a couple of
+// KeQueryPerformanceCounter calls and one uncontended interlocked add per
+// stage. the histograms are allocated the first time the profiler is
+// enabled and stay until unload, so a stage that read PerfEnabled just
+// before it was cleared still has somewhere to write.
+#include "sentinelhook.h"
+
+// which histogram set a filter operation goes into
+PERF_OPERATION PerfOperation(
+    _In_ UCHAR MajorFunction
+)
+{
+    switch (MajorFunction) {
+    case IRP_MJ_READ:
+        return PerfOpRead;
+    case IRP_MJ_WRITE:
+        return PerfOpWrite;
+    case IRP_MJ_SET_INFORMATION:
+        return PerfOpSetInformation;
+    default:
+        return PerfOpCreate;
+    }
+}
+
+// IOCTL_SENTINELHOOK_SET_PERF
+NTSTATUS PerfControl(
+    _In_ PTELEMETRY_PERF_CONTROL Control
+)
+{
+    PPERF_CPU_HISTOGRAMS histograms = g_DriverContext.PerfHistograms;
+    SIZE_T size = g_DriverContext.CpuStatsCount * sizeof(PERF_CPU_HISTOGRAMS);
+
+    if (!Control->Enable) {
+        InterlockedExchange(&g_DriverContext.PerfEnabled, FALSE);
+    }
+
+    if (!histograms && Control->Enable) {
+        histograms = (PPERF_CPU_HISTOGRAMS)ExAllocatePool2(
+            POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED,
+            size,
+            SENTINELHOOK_POOL_TAG
+        );
+        if (!histograms) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        // two racing enables, keep whichever got there first
+        if (InterlockedCompareExchangePointer((PVOID volatile*)&g_DriverContext.PerfHistograms,
+                histograms, NULL) != NULL) {
+            ExFreePoolWithTag(histograms, SENTINELHOOK_POOL_TAG);
+            histograms = g_DriverContext.PerfHistograms;
+        }
+    }
+
+    // stages in flight can still land in the old counts, good enough for
+    // a profiler
+    if (histograms && Control->Reset) {
+        RtlZeroMemory(histograms, size);
+    }
+
+    if (Control->Enable) {
+        // histograms are published before any stage can see the flag
+        InterlockedExchange(&g_DriverContext.PerfEnabled, TRUE);
+    }
+
+    DebugPrint("Profiler %s%s", Control->Enable ? "enabled" : "disabled",
+        Control->Reset ? ", histograms reset" : "");
+    return STATUS_SUCCESS;
+}
+
+// sum the per-processor histograms, same consistency as TelemetryStatsQuery
+VOID PerfQuery(
+    _Out_ PTELEMETRY_PERF_STATS Stats
+)
+{
+    PPERF_CPU_HISTOGRAMS histograms = g_DriverContext.PerfHistograms;
+    PULONG64 total = &Stats->Counts[0][0][0];
+
+    RtlZeroMemory(Stats, sizeof(TELEMETRY_PERF_STATS));
+    KeQueryPerformanceCounter((PLARGE_INTEGER)&Stats->Frequency);
+    Stats->Enabled = ReadAcquire(&g_DriverContext.PerfEnabled) ? TRUE : FALSE;
+
+    if (!histograms) {
+        return;
+    }
+
+    for (ULONG cpu = 0; cpu < g_DriverContext.CpuStatsCount; cpu++) {
+        volatile LONG64* slot = (volatile LONG64*)&histograms[cpu].Counts[0][0][0];
+
+        for (ULONG i = 0; i < PerfOpMax * PerfStageMax * PERF_HISTOGRAM_BUCKETS; i++) {
+            total[i] += (ULONG64)ReadNoFence64(&slot[i]);
+        }
+    }
+}
+
+// unload only - no stage can be running
+VOID PerfFree(VOID)
+{
+    g_DriverContext.PerfEnabled = FALSE;
+
+    if (g_DriverContext.PerfHistograms) {
+        ExFreePoolWithTag(g_DriverContext.PerfHistograms, SENTINELHOOK_POOL_TAG);
+        g_DriverContext.PerfHistograms = NULL;
+    }
+}
+
+// end of a timed stage started with PerfStart
+VOID PerfStop(
+    _In_ PERF_OPERATION Operation,
+    _In_ PERF_STAGE Stage,
+    _In_ ULONG64 Start
+)
+{
+    ULONG64 ticks;
+
+    if (Start == 0) {
+        return;
+    }
+
+    ticks = (ULONG64)KeQueryPerformanceCounter(NULL).QuadPart - Start;
+
+    InterlockedIncrement64((volatile LONG64*)&g_DriverContext.PerfHistograms[
+        KeGetCurrentProcessorNumberEx(NULL)].Counts[Operation][Stage][PerfHistogramBucket(ticks)]);
+}
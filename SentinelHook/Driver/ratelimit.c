@@ -0,0 +1,98 @@
+// per-process and per-event-type rate limiting
+// each limit is a GCRA token bucket: a single theoretical arrival time
+// (TAT) per bucket, advanced with a compare-exchange, so admitting an
+// event never takes a lock. burst events may arrive back to back, after
+// that one per interval.
+#include "sentinelhook.h"
+
+#define RATE_LIMIT_TICKS_PER_SECOND  10000000ULL    // KeQueryInterruptTime is 100ns
+
+// take one token from the bucket at Tat
+BOOLEAN RateLimitTake(
+    _Inout_ volatile LONG64* Tat,
+    _In_ ULONG64 Interval,
+    _In_ ULONG64 Limit,
+    _In_ ULONG64 Now
+)
+{
+    LONG64 tat;
+    ULONG64 next;
+
+    if (Interval == 0) {
+        return TRUE;
+    }
+
+    do {
+        tat = ReadNoFence64(Tat);
+        next = max((ULONG64)tat, Now) + Interval;
+
+        if (next - Now > Limit) {
+            return FALSE;
+        }
+    } while (InterlockedCompareExchange64(Tat, (LONG64)next, tat) != tat);
+
+    return TRUE;
+}
+
+// IOCTL_SENTINELHOOK_SET_RATE_LIMIT
+// the interval/limit pairs are written without a lock; a producer racing
+// an update may briefly apply a mix of old and new values for one event
+NTSTATUS RateLimitUpdate(
+    _In_ PRATE_LIMIT_CONFIG Config
+)
+{
+    g_DriverContext.ProcessRateInterval = 0;
+    if (Config->ProcessRate != 0) {
+        ULONG64 interval = max(RATE_LIMIT_TICKS_PER_SECOND / Config->ProcessRate, 1);
+        g_DriverContext.ProcessRateLimit = interval * max(Config->ProcessBurst, 1);
+        g_DriverContext.ProcessRateInterval = interval;
+    }
+
+    for (ULONG i = 0; i < EventMax; i++) {
+        g_DriverContext.EventRateInterval[i] = 0;
+        if (Config->EventTypeRate[i] != 0) {
+            ULONG64 interval = max(RATE_LIMIT_TICKS_PER_SECOND / Config->EventTypeRate[i], 1);
+            g_DriverContext.EventRateLimit[i] = interval * max(Config->EventTypeBurst[i], 1);
+            g_DriverContext.EventRateInterval[i] = interval;
+        }
+    }
+
+    DebugPrint("Rate limits updated: process %u/s burst %u",
+        Config->ProcessRate, Config->ProcessBurst);
+    return STATUS_SUCCESS;
+}
+
+// decide whether to emit an event; called once the event is known not
+// to be excluded, so excluded I/O spends no tokens
+// rejected events are counted in the stats by reason
+BOOLEAN TelemetryAdmit(
+    _In_ TELEMETRY_EVENT_TYPE EventType,
+    _In_opt_ HANDLE ProcessId
+)
+{
+    ULONG64 now;
+
+    if (g_DriverContext.EventRateInterval[EventType] == 0 &&
+        g_DriverContext.ProcessRateInterval == 0) {
+        return TRUE;
+    }
+
+    now = KeQueryInterruptTime();
+
+    if (!RateLimitTake(&g_DriverContext.EventRateTat[EventType],
+            g_DriverContext.EventRateInterval[EventType],
+            g_DriverContext.EventRateLimit[EventType], now)) {
+        TelemetryStatsIncrement(DroppedEvents);
+        TelemetryStatsIncrement(RateLimitedByEventType);
+        return FALSE;
+    }
+
+    if (ProcessId && g_DriverContext.ProcessRateInterval != 0 &&
+        !ProcessCacheAdmit(ProcessId, now)) {
+        TelemetryStatsIncrement(DroppedEvents);
+        TelemetryStatsIncrement(RateLimitedByProcess);
+        return FALSE;
+    }
+
+    return TRUE;
+}
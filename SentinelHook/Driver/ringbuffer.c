@@ -0,0 +1,464 @@
+// per-processor telemetry ring buffers
+// one ring per logical CPU, single producer (the owning CPU at DISPATCH_LEVEL),
+// single consumer: either the IOCTL drain path, serialized by
+// TelemetryDrainLock, or the service process once the region is mapped
+#include "sentinelhook.h"
+
+// allocate the shared region: header followed by one ring per possible processor
+NTSTATUS TelemetryRingInitialize(VOID)
+{
+    ULONG processorCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    ULONG ringOffset = ROUND_TO_SIZE(sizeof(TELEMETRY_SHARED_HEADER), SYSTEM_CACHE_ALIGNMENT_SIZE);
+    SIZE_T regionSize = ROUND_TO_PAGES(ringOffset + (SIZE_T)processorCount * sizeof(TELEMETRY_RING));
+
+    ExInitializeFastMutex(&g_DriverContext.TelemetryDrainLock);
+    KeInitializeSpinLock(&g_DriverContext.DataEventLock);
+
+    g_DriverContext.Rings = (PTELEMETRY_RING*)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        processorCount * sizeof(PTELEMETRY_RING),
+        SENTINELHOOK_POOL_TAG
+    );
+    if (!g_DriverContext.Rings) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // one contiguous allocation so it can be described by a single MDL
+    g_DriverContext.RingRegion = (PTELEMETRY_SHARED_HEADER)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        regionSize,
+        SENTINELHOOK_POOL_TAG
+    );
+    if (!g_DriverContext.RingRegion) {
+        ExFreePoolWithTag(g_DriverContext.Rings, SENTINELHOOK_POOL_TAG);
+        g_DriverContext.Rings = NULL;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    g_DriverContext.RingRegionSize = regionSize;
+    g_DriverContext.RingCount = processorCount;
+
+    g_DriverContext.RingRegion->Version = TELEMETRY_SHARED_VERSION;
+    g_DriverContext.RingRegion->RingCount = processorCount;
+    g_DriverContext.RingRegion->RingBytes = TELEMETRY_RING_BYTES;
+    g_DriverContext.RingRegion->RingOffset = ringOffset;
+    g_DriverContext.RingRegion->RingStride = sizeof(TELEMETRY_RING);
+
+    for (ULONG i = 0; i < processorCount; i++) {
+        g_DriverContext.Rings[i] = (PTELEMETRY_RING)((PUCHAR)g_DriverContext.RingRegion +
+            ringOffset + (SIZE_T)i * sizeof(TELEMETRY_RING));
+    }
+
+    DebugPrint("Telemetry rings: %u CPUs x %u bytes, %Iu total",
+        processorCount, TELEMETRY_RING_BYTES, regionSize);
+    return STATUS_SUCCESS;
+}
+
+// free all rings - callers must be gone (callbacks removed, filter unregistered)
+VOID TelemetryRingFree(VOID)
+{
+    TelemetryRingUnmap(NULL);
+
+    if (g_DriverContext.RingRegion) {
+        ExFreePoolWithTag(g_DriverContext.RingRegion, SENTINELHOOK_POOL_TAG);
+        g_DriverContext.RingRegion = NULL;
+        g_DriverContext.RingRegionSize = 0;
+    }
+
+    if (g_DriverContext.Rings) {
+        ExFreePoolWithTag(g_DriverContext.Rings, SENTINELHOOK_POOL_TAG);
+        g_DriverContext.Rings = NULL;
+    }
+
+    g_DriverContext.RingCount = 0;
+}
+
+// wake a mapped consumer that announced it is about to block
+// called at DISPATCH_LEVEL right after a publish
+static VOID TelemetryRingNotify(VOID)
+{
+    PTELEMETRY_SHARED_HEADER header = g_DriverContext.RingRegion;
+
+    // cheap unfenced check first, the exchange only happens once per wakeup
+    if (!ReadNoFence(&header->ConsumerWaiting) ||
+        !InterlockedExchange(&header->ConsumerWaiting, 0)) {
+        return;
+    }
+
+    KeAcquireSpinLockAtDpcLevel(&g_DriverContext.DataEventLock);
+    if (g_DriverContext.DataEvent) {
+        KeSetEvent(g_DriverContext.DataEvent, IO_NO_INCREMENT, FALSE);
+    }
+    KeReleaseSpinLockFromDpcLevel(&g_DriverContext.DataEventLock);
+}
+
+// tell a batching consumer not to wait: a ring is filling up or an alert
+// was queued. not tied to ConsumerWaiting, the consumer may be awake but
+// holding off on purpose
+static VOID TelemetryRingNotifyHighWater(VOID)
+{
+    KeAcquireSpinLockAtDpcLevel(&g_DriverContext.DataEventLock);
+    if (g_DriverContext.HighWaterEvent) {
+        KeSetEvent(g_DriverContext.HighWaterEvent, IO_NO_INCREMENT, FALSE);
+    }
+    KeReleaseSpinLockFromDpcLevel(&g_DriverContext.DataEventLock);
+}
+
+// queue a record on the current CPU's ring
+// callable at IRQL <= DISPATCH_LEVEL, never blocks, drops on overflow
+// the record must be in non-paged memory (stack or non-paged pool)
+BOOLEAN TelemetryRingEnqueue(
+    _In_ CONST TELEMETRY_RECORD* Record
+)
+{
+    PTELEMETRY_RING ring;
+    LONG64 head;
+    LONG64 tail;
+    ULONG offset;
+    ULONG contiguous;
+    ULONG length;
+    ULONG needed;
+    ULONG cpu;
+    KIRQL oldIrql;
+    BOOLEAN queued = FALSE;
+
+    if (!g_DriverContext.Rings || Record->Size < sizeof(TELEMETRY_RECORD) ||
+        Record->Size > TELEMETRY_RECORD_MAX_SIZE) {
+        return FALSE;
+    }
+
+    length = TELEMETRY_RECORD_ALIGN(Record->Size);
+
+    // raising to DISPATCH pins us to this CPU and keeps other producers off
+    // the ring until we publish, so no interlocked ops are needed on Head
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+    cpu = KeGetCurrentProcessorNumberEx(NULL);
+    if (cpu < g_DriverContext.RingCount) {
+        ring = g_DriverContext.Rings[cpu];
+        head = ring->Head;
+        tail = ReadAcquire64(&ring->Tail);
+
+        offset = (ULONG)(head & (TELEMETRY_RING_BYTES - 1));
+        contiguous = TELEMETRY_RING_BYTES - offset;
+        needed = (length > contiguous) ? length + contiguous : length;
+
+        // Tail may be user-writable once mapped; a bogus value can only make
+        // us drop or overwrite unread data, never write out of bounds
+        if ((ULONG64)(head - tail) + needed <= TELEMETRY_RING_BYTES) {
+            if (length > contiguous) {
+                // fill to the end so the record starts at offset 0
+                PTELEMETRY_RECORD padding = (PTELEMETRY_RECORD)&ring->Data[offset];
+                padding->Size = (USHORT)contiguous;
+                padding->Version = TELEMETRY_RECORD_VERSION;
+                padding->EventType = TELEMETRY_RECORD_PADDING;
+                head += contiguous;
+                offset = 0;
+            }
+
+            RtlCopyMemory(&ring->Data[offset], Record, Record->Size);
+
+            // publish after the record is visible
+            WriteRelease64(&ring->Head, head + length);
+            queued = TRUE;
+
+            TelemetryRingNotify();
+
+            // edge-triggered on the fill level so a full ring doesn't signal
+            // on every record; alerts and unverified drivers always do
+            if (g_DriverContext.HighWaterEvent &&
+                (Record->EventType == EventProcessInjection ||
+                 Record->EventType == EventUnsignedDriverLoad ||
+                 ((Record->Flags & (TELEMETRY_RECORD_FLAG_DRIVER | TELEMETRY_RECORD_FLAG_VERDICT_PENDING)) ==
+                  (TELEMETRY_RECORD_FLAG_DRIVER | TELEMETRY_RECORD_FLAG_VERDICT_PENDING)) ||
+                 ((ULONG64)(head + length - tail) >= g_DriverContext.HighWaterBytes &&
+                  (ULONG64)(head + length - tail) - needed < g_DriverContext.HighWaterBytes))) {
+                TelemetryRingNotifyHighWater();
+            }
+        }
+    }
+
+    KeLowerIrql(oldIrql);
+
+    if (!queued) {
+        TelemetryStatsIncrement(DroppedEvents);
+        TelemetryStatsIncrement(BufferOverflows);
+    }
+
+    return queued;
+}
+
+// fill Buffer with a TELEMETRY_BATCH_HEADER and as many packed records as
+// fit, taking whole runs from each ring and rotating the start CPU so one
+// busy processor can't starve the rest
+// PASSIVE_LEVEL only, fails while the rings are mapped into the service
+NTSTATUS TelemetryRingDrain(
+    _Out_writes_bytes_to_(BufferLength, *BytesWritten) PVOID Buffer,
+    _In_ ULONG BufferLength,
+    _Out_ PULONG BytesWritten
+)
+{
+    PTELEMETRY_BATCH_HEADER batch = (PTELEMETRY_BATCH_HEADER)Buffer;
+    PUCHAR cursor;
+    ULONG remaining;
+    ULONG count = 0;
+    BOOLEAN full = FALSE;
+
+    PAGED_CODE();
+
+    *BytesWritten = 0;
+
+    // at least one maximum-size record must fit or we could never make progress
+    if (BufferLength < sizeof(TELEMETRY_BATCH_HEADER) + TELEMETRY_RECORD_ALIGN(TELEMETRY_RECORD_MAX_SIZE)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    if (!g_DriverContext.Rings) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    cursor = (PUCHAR)Buffer + sizeof(TELEMETRY_BATCH_HEADER);
+    remaining = BufferLength - sizeof(TELEMETRY_BATCH_HEADER);
+
+    ExAcquireFastMutex(&g_DriverContext.TelemetryDrainLock);
+
+    if (g_DriverContext.RingUserAddress) {
+        // the mapped consumer owns Tail
+        ExReleaseFastMutex(&g_DriverContext.TelemetryDrainLock);
+        return STATUS_DEVICE_BUSY;
+    }
+
+    for (ULONG n = 0; n < g_DriverContext.RingCount && !full; n++) {
+        ULONG cpu = (g_DriverContext.NextDrainRing + n) % g_DriverContext.RingCount;
+        PTELEMETRY_RING ring = g_DriverContext.Rings[cpu];
+        LONG64 tail = ring->Tail;
+        LONG64 head = ReadAcquire64(&ring->Head);
+
+        while (tail != head) {
+            PTELEMETRY_RECORD record = (PTELEMETRY_RECORD)&ring->Data[tail & (TELEMETRY_RING_BYTES - 1)];
+            ULONG length = TELEMETRY_RECORD_ALIGN(record->Size);
+
+            if (record->EventType == TELEMETRY_RECORD_PADDING) {
+                tail += record->Size;
+                continue;
+            }
+
+            if (length > remaining) {
+                full = TRUE;
+                // resume from this ring next time
+                g_DriverContext.NextDrainRing = cpu;
+                break;
+            }
+
+            RtlCopyMemory(cursor, record, record->Size);
+            cursor += length;
+            remaining -= length;
+            count++;
+            tail += length;
+        }
+
+        // release the consumed bytes back to the producer in one store
+        WriteRelease64(&ring->Tail, tail);
+    }
+
+    if (!full) {
+        g_DriverContext.NextDrainRing = (g_DriverContext.NextDrainRing + 1) % g_DriverContext.RingCount;
+    }
+
+    ExReleaseFastMutex(&g_DriverContext.TelemetryDrainLock);
+
+    batch->Count = count;
+    batch->BytesUsed = (ULONG)(cursor - (PUCHAR)Buffer);
+    batch->Flags = full ? TELEMETRY_BATCH_MORE : 0;
+    batch->Reserved = 0;
+
+    *BytesWritten = batch->BytesUsed;
+    return STATUS_SUCCESS;
+}
+
+// map the ring region into the calling process and take ownership of Tail
+// PASSIVE_LEVEL, must run in the context of the requesting process
+NTSTATUS TelemetryRingMap(
+    _In_ PFILE_OBJECT FileObject,
+    _In_ HANDLE DataEvent,
+    _In_opt_ HANDLE HighWaterEvent,
+    _In_ ULONG HighWaterBytes,
+    _Out_ PTELEMETRY_MAP_RESPONSE Response
+)
+{
+    NTSTATUS status;
+    PKEVENT event = NULL;
+    PKEVENT highWaterEvent = NULL;
+    PMDL mdl = NULL;
+    PVOID userAddress = NULL;
+    KIRQL oldIrql;
+
+    PAGED_CODE();
+
+    RtlZeroMemory(Response, sizeof(TELEMETRY_MAP_RESPONSE));
+
+    if (!g_DriverContext.RingRegion) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    status = ObReferenceObjectByHandle(
+        DataEvent,
+        EVENT_MODIFY_STATE,
+        *ExEventObjectType,
+        UserMode,
+        (PVOID*)&event,
+        NULL
+    );
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (HighWaterEvent) {
+        status = ObReferenceObjectByHandle(
+            HighWaterEvent,
+            EVENT_MODIFY_STATE,
+            *ExEventObjectType,
+            UserMode,
+            (PVOID*)&highWaterEvent,
+            NULL
+        );
+        if (!NT_SUCCESS(status)) {
+            ObDereferenceObject(event);
+            return status;
+        }
+    }
+
+    if (HighWaterBytes == 0 || HighWaterBytes > TELEMETRY_RING_BYTES) {
+        HighWaterBytes = TELEMETRY_RING_HIGH_WATER_DEFAULT;
+    }
+
+    ExAcquireFastMutex(&g_DriverContext.TelemetryDrainLock);
+
+    if (g_DriverContext.RingUserAddress) {
+        status = STATUS_DEVICE_BUSY;
+        goto Exit;
+    }
+
+    mdl = IoAllocateMdl(g_DriverContext.RingRegion, (ULONG)g_DriverContext.RingRegionSize, FALSE, FALSE, NULL);
+    if (!mdl) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    MmBuildMdlForNonPagedPool(mdl);
+
+    __try {
+        userAddress = MmMapLockedPagesSpecifyCache(
+            mdl,
+            UserMode,
+            MmCached,
+            NULL,
+            FALSE,
+            NormalPagePriority | MdlMappingNoExecute
+        );
+    } __except (EXCEPTION_EXECUTE_HANDLER) {
+        userAddress = NULL;
+    }
+
+    if (!userAddress) {
+        IoFreeMdl(mdl);
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    g_DriverContext.RingMdl = mdl;
+    g_DriverContext.RingUserAddress = userAddress;
+    g_DriverContext.RingOwnerProcess = PsGetCurrentProcess();
+    g_DriverContext.RingOwnerFile = FileObject;
+    ObReferenceObject(g_DriverContext.RingOwnerProcess);
+
+    KeAcquireSpinLock(&g_DriverContext.DataEventLock, &oldIrql);
+    g_DriverContext.HighWaterBytes = HighWaterBytes;
+    g_DriverContext.HighWaterEvent = highWaterEvent;
+    g_DriverContext.DataEvent = event;
+    KeReleaseSpinLock(&g_DriverContext.DataEventLock, oldIrql);
+    event = NULL;
+    highWaterEvent = NULL;
+
+    Response->BaseAddress = (ULONG64)(ULONG_PTR)userAddress;
+    Response->Size = g_DriverContext.RingRegionSize;
+
+    DebugPrint("Telemetry rings mapped at %p", userAddress);
+    status = STATUS_SUCCESS;
+
+Exit:
+    ExReleaseFastMutex(&g_DriverContext.TelemetryDrainLock);
+
+    if (event) {
+        ObDereferenceObject(event);
+    }
+
+    if (highWaterEvent) {
+        ObDereferenceObject(highWaterEvent);
+    }
+
+    return status;
+}
+
+// tear down the user mapping; FileObject NULL forces it regardless of owner
+// called from the unmap IOCTL, IRP_MJ_CLEANUP and driver unload
+VOID TelemetryRingUnmap(
+    _In_opt_ PFILE_OBJECT FileObject
+)
+{
+    PKEVENT event;
+    PKEVENT highWaterEvent;
+    PEPROCESS owner;
+    KAPC_STATE apcState;
+    KIRQL oldIrql;
+    BOOLEAN attached = FALSE;
+
+    PAGED_CODE();
+
+    ExAcquireFastMutex(&g_DriverContext.TelemetryDrainLock);
+
+    if (!g_DriverContext.RingUserAddress ||
+        (FileObject && FileObject != g_DriverContext.RingOwnerFile)) {
+        ExReleaseFastMutex(&g_DriverContext.TelemetryDrainLock);
+        return;
+    }
+
+    // stop producers from touching the event before we drop our reference
+    KeAcquireSpinLock(&g_DriverContext.DataEventLock, &oldIrql);
+    event = g_DriverContext.DataEvent;
+    highWaterEvent = g_DriverContext.HighWaterEvent;
+    g_DriverContext.DataEvent = NULL;
+    g_DriverContext.HighWaterEvent = NULL;
+    KeReleaseSpinLock(&g_DriverContext.DataEventLock, oldIrql);
+
+    owner = g_DriverContext.RingOwnerProcess;
+    if (owner != PsGetCurrentProcess()) {
+        KeStackAttachProcess(owner, &apcState);
+        attached = TRUE;
+    }
+
+    MmUnmapLockedPages(g_DriverContext.RingUserAddress, g_DriverContext.RingMdl);
+
+    if (attached) {
+        KeUnstackDetachProcess(&apcState);
+    }
+
+    IoFreeMdl(g_DriverContext.RingMdl);
+    g_DriverContext.RingMdl = NULL;
+    g_DriverContext.RingUserAddress = NULL;
+    g_DriverContext.RingOwnerProcess = NULL;
+    g_DriverContext.RingOwnerFile = NULL;
+    g_DriverContext.RingRegion->ConsumerWaiting = 0;
+
+    ExReleaseFastMutex(&g_DriverContext.TelemetryDrainLock);
+
+    ObDereferenceObject(owner);
+    if (event) {
+        ObDereferenceObject(event);
+    }
+    if (highWaterEvent) {
+        ObDereferenceObject(highWaterEvent);
+    }
+
+    DebugPrint("Telemetry rings unmapped");
+}
@@ -7,21 +7,28 @@
 // global context
 DRIVER_CONTEXT g_DriverContext = { 0 };
 
-// Filter registration structure
-CONST FLT_OPERATION_REGISTRATION Callbacks[] = {
-    { IRP_MJ_CREATE, 0, FilterPreOperation, FilterPostOperation },
-    { IRP_MJ_WRITE, 0, FilterPreOperation, FilterPostOperation },
-    { IRP_MJ_READ, 0, FilterPreOperation, FilterPostOperation },
-    { IRP_MJ_SET_INFORMATION, 0, FilterPreOperation, FilterPostOperation },
-    { IRP_MJ_OPERATION_END }
+// Stream-handle contexts hold the file name resolved in post-create,
+// stream and instance contexts the file identity for the verdict cache
+CONST FLT_CONTEXT_REGISTRATION ContextRegistration[] = {
+    { FLT_STREAMHANDLE_CONTEXT, 0, NULL, FLT_VARIABLE_SIZED_CONTEXTS, SENTINELHOOK_POOL_TAG },
+    { FLT_STREAM_CONTEXT, 0, NULL, sizeof(STREAM_CONTEXT), SENTINELHOOK_POOL_TAG },
+    { FLT_INSTANCE_CONTEXT, 0, NULL, sizeof(INSTANCE_CONTEXT), SENTINELHOOK_POOL_TAG },
+    { FLT_CONTEXT_END }
 };
 
+// device class for IoCreateDeviceSecure, lets an administrator override
+// the default SDDL under the class key
+static CONST GUID SentinelHookDeviceClass =
+    { 0x6c1e2b7a, 0x94d3, 0x4f0e, { 0x8b, 0x52, 0x3d, 0x71, 0xa9, 0x0c, 0xe4, 0x15 } };
+
+// Filter registration structure, the operations depend on the monitoring
+// switches and are filled in by MonitorRegisterFilter
 CONST FLT_REGISTRATION FilterRegistration = {
     sizeof(FLT_REGISTRATION),
     FLT_REGISTRATION_VERSION,
     0,
+    ContextRegistration,
     NULL,
-    Callbacks,
     FilterUnload,
     FilterInstanceSetup,
     FilterInstanceQueryTeardown,
@@ -53,34 +60,82 @@ NTSTATUS DriverEntry(
 
     // init context
     RtlZeroMemory(&g_DriverContext, sizeof(DRIVER_CONTEXT));
-    KeInitializeSpinLock(&g_DriverContext.StatsLock);
-    KeInitializeSpinLock(&g_DriverContext.TelemetryLock);
     g_DriverContext.MonitoringEnabled = TRUE;
 
-    // register filter
-    status = FltRegisterFilter(DriverObject, &FilterRegistration, &g_DriverContext.FilterHandle);
+    // per-CPU statistics slots
+    status = TelemetryStatsInitialize();
+    if (!NT_SUCCESS(status)) {
+        DebugPrint("TelemetryStatsInitialize failed: 0x%08X", status);
+        return status;
+    }
+
+    // record and name buffers, every event builder allocates from these
+    TelemetryPoolInitialize();
+
+    // per-CPU telemetry rings, must exist before any callback can fire
+    status = TelemetryRingInitialize();
+    if (!NT_SUCCESS(status)) {
+        DebugPrint("TelemetryRingInitialize failed: 0x%08X", status);
+        TelemetryPoolFree();
+        TelemetryStatsFree();
+        return status;
+    }
+
+    // interned names and the per-process cache used by the record builders
+    status = InternTableInitialize();
+    if (!NT_SUCCESS(status)) {
+        DebugPrint("InternTableInitialize failed: 0x%08X", status);
+        TelemetryRingFree();
+        TelemetryPoolFree();
+        TelemetryStatsFree();
+        return status;
+    }
+
+    // built-in injection indicators until the service loads its own
+    PathIndicatorInitialize();
+
+    // empty verdict cache, the service fills it as images load
+    ImageVerdictInitialize();
+
+    // register filter, every operation until the service says otherwise
+    status = MonitorInitialize(DriverObject);
     if (!NT_SUCCESS(status)) {
         DebugPrint("FltRegisterFilter failed: 0x%08X", status);
+        PathIndicatorFree();
+        ExclusionFree();
+        InternTableFree();
+        TelemetryRingFree();
+        TelemetryPoolFree();
+        TelemetryStatsFree();
         return status;
     }
 
-    // create device for IOCTL
+    // create device for IOCTL, SYSTEM and Administrators only: the IOCTLs
+    // reconfigure monitoring and set signature verdicts
     RtlInitUnicodeString(&deviceName, SENTINELHOOK_DEVICE_NAME);
     RtlInitUnicodeString(&symbolicLinkName, SENTINELHOOK_SYMBOLIC_LINK);
 
-    status = IoCreateDevice(
+    status = IoCreateDeviceSecure(
         DriverObject,
         0,
         &deviceName,
         FILE_DEVICE_UNKNOWN,
         FILE_DEVICE_SECURE_OPEN,
         FALSE,
+        &SDDL_DEVOBJ_SYS_ALL_ADM_ALL,
+        &SentinelHookDeviceClass,
         &deviceObject
     );
 
     if (!NT_SUCCESS(status)) {
         DebugPrint("Failed to create device object: 0x%08X", status);
         FltUnregisterFilter(g_DriverContext.FilterHandle);
+        PathIndicatorFree();
+        ExclusionFree();
+        InternTableFree();
+        TelemetryRingFree();
+        TelemetryPoolFree();
+        TelemetryStatsFree();
         return status;
     }
 
@@ -94,11 +149,18 @@ NTSTATUS DriverEntry(
         DebugPrint("symlink create failed: 0x%08X", status);
         IoDeleteDevice(deviceObject);
         FltUnregisterFilter(g_DriverContext.FilterHandle);
+        PathIndicatorFree();
+        ExclusionFree();
+        InternTableFree();
+        TelemetryRingFree();
+        TelemetryPoolFree();
+        TelemetryStatsFree();
         return status;
     }
 
     // setup IOCTL handlers
     DriverObject->MajorFunction[IRP_MJ_CREATE] = DeviceIoControl;
+    DriverObject->MajorFunction[IRP_MJ_CLEANUP] = DeviceIoControl;
     DriverObject->MajorFunction[IRP_MJ_CLOSE] = DeviceIoControl;
     DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = DeviceIoControl;
     DriverObject->DriverUnload = DriverUnload;
@@ -115,14 +177,25 @@ NTSTATUS DriverEntry(
     if (!NT_SUCCESS(status)) {
         DebugPrint("PsSetLoadImageNotifyRoutine failed: 0x%08X", status);
     }
+    g_DriverContext.ImageNotifyRegistered = NT_SUCCESS(status);
 
     // start the filter
     status = FltStartFiltering(g_DriverContext.FilterHandle);
     if (!NT_SUCCESS(status)) {
         DebugPrint("FltStartFiltering failed: 0x%08X", status);
+        PsSetCreateProcessNotifyRoutineEx(ProcessNotifyRoutine, TRUE);
+        if (g_DriverContext.ImageNotifyRegistered) {
+            PsRemoveLoadImageNotifyRoutine(ImageNotifyRoutine);
+        }
         IoDeleteSymbolicLink(&symbolicLinkName);
         IoDeleteDevice(deviceObject);
         FltUnregisterFilter(g_DriverContext.FilterHandle);
+        PathIndicatorFree();
+        ExclusionFree();
+        InternTableFree();
+        TelemetryRingFree();
+        TelemetryPoolFree();
+        TelemetryStatsFree();
         return status;
     }
 
@@ -139,9 +212,8 @@ VOID DriverUnload(
 
     DebugPrint("SentinelHook unloading...");
 
-    // cleanup callbacks
+    // cleanup callbacks, the image routine goes with the filter below
     PsSetCreateProcessNotifyRoutineEx(ProcessNotifyRoutine, TRUE);
-    PsRemoveLoadImageNotifyRoutine(ImageNotifyRoutine);
 
     if (g_DriverContext.FilterHandle) {
         FltStopFiltering(g_DriverContext.FilterHandle);
@@ -155,9 +227,18 @@ VOID DriverUnload(
         IoDeleteDevice(g_DriverContext.DeviceObject);
     }
 
-    if (g_DriverContext.FilterHandle) {
-        FltUnregisterFilter(g_DriverContext.FilterHandle);
-    }
+    // also waits out a SET_MONITOR re-registering the filter
+    MonitorShutdown();
+
+    // no producers left at this point
+    PerfFree();
+    MonitorFree();
+    PathIndicatorFree();
+    ExclusionFree();
+    InternTableFree();
+    TelemetryRingFree();
+    TelemetryPoolFree();
+    TelemetryStatsFree();
 
     DebugPrint("SentinelHook unloaded");
 }
@@ -170,12 +251,34 @@ NTSTATUS FilterInstanceSetup(
     _In_ FLT_FILESYSTEM_TYPE VolumeFilesystemType
 )
 {
-    UNREFERENCED_PARAMETER(FltObjects);
+    ULONG64 volumeInfo[(sizeof(FILE_FS_VOLUME_INFORMATION) + 32 * sizeof(WCHAR)) / sizeof(ULONG64) + 1];
+    IO_STATUS_BLOCK ioStatus;
+    PINSTANCE_CONTEXT context = NULL;
+    NTSTATUS status;
+
     UNREFERENCED_PARAMETER(Flags);
     UNREFERENCED_PARAMETER(VolumeDeviceType);
     UNREFERENCED_PARAMETER(VolumeFilesystemType);
 
-    // accept all volumes for now
+    // volumes the service asked to leave alone, see MonitorUpdate
+    if (MonitorVolumeExcluded(FltObjects->Volume)) {
+        return STATUS_FLT_DO_NOT_ATTACH;
+    }
+
+    // volume serial for the verdict cache, an instance without one never
+    // caches verdicts. a long label doesn't fit, the serial always does
+    status = FltQueryVolumeInformation(FltObjects->Instance, &ioStatus, volumeInfo,
+        sizeof(volumeInfo), FileFsVolumeInformation);
+    if (NT_SUCCESS(status) || status == STATUS_BUFFER_OVERFLOW) {
+        status = FltAllocateContext(FltObjects->Filter, FLT_INSTANCE_CONTEXT,
+            sizeof(INSTANCE_CONTEXT), NonPagedPoolNx, (PFLT_CONTEXT*)&context);
+    }
+    if (NT_SUCCESS(status)) {
+        context->VolumeSerial = ((PFILE_FS_VOLUME_INFORMATION)volumeInfo)->VolumeSerialNumber;
+        FltSetInstanceContext(FltObjects->Instance, FLT_SET_CONTEXT_KEEP_IF_EXISTS, context, NULL);
+        FltReleaseContext(context);
+    }
+
     return STATUS_SUCCESS;
 }
 
@@ -196,6 +299,9 @@ VOID FilterInstanceTeardownStart(
 {
     UNREFERENCED_PARAMETER(FltObjects);
     UNREFERENCED_PARAMETER(Flags);
+
+    // nothing sees writes to this volume from here on
+    ImageVerdictFlush();
 }
 
 VOID FilterInstanceTeardownComplete(
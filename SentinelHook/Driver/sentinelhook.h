@@ -4,6 +4,7 @@
 #include <ntddk.h>
 #include <fltKernel.h>
 #include <ntstrsafe.h>
+#include <wdmsec.h>
 #include "..\Common\ioctl.h"
 #include "..\Common\telemetry.h"
 
@@ -12,6 +13,9 @@
 #define SENTINELHOOK_VERSION_MINOR   0
 #define SENTINELHOOK_VERSION_BUILD   0
 
+// Pool tag ('SnHk' little-endian)
+#define SENTINELHOOK_POOL_TAG        'kHnS'
+
 // Debug print macros
 #if DBG
 #define DebugPrint(format, ...) \
@@ -20,6 +24,139 @@
 #define DebugPrint(format, ...)
 #endif
 
+// Stack/pool buffer large enough for any record
+typedef struct _TELEMETRY_RECORD_BUFFER {
+    TELEMETRY_RECORD Record;
+    WCHAR Strings[MAX_PATH_LENGTH + MAX_PROCESS_NAME_LENGTH];
+} TELEMETRY_RECORD_BUFFER, *PTELEMETRY_RECORD_BUFFER;
+
+// Per-handle state attached in post-create, see filter.c
+// Path is the normalized name already split for the record builders
+typedef struct _STREAM_HANDLE_CONTEXT {
+    volatile LONG ExclusionState;   // (exclusion generation << 1) | excluded
+    ULONG PathPrefixId;
+    USHORT PathLength;      // in WCHARs
+    WCHAR Path[ANYSIZE_ARRAY];
+} STREAM_HANDLE_CONTEXT, *PSTREAM_HANDLE_CONTEXT;
+
+// Per-stream state, shared by every handle and mapping of the file
+// Attached in post-create while a switch uses image verdicts, so a write
+// through any file object can find the file's verdict and drop it, see
+// verdict.c
+typedef struct _STREAM_CONTEXT {
+    ULONG64 FileId;         // FileInternalInformation
+} STREAM_CONTEXT, *PSTREAM_CONTEXT;
+
+// Per-instance state attached in FilterInstanceSetup
+typedef struct _INSTANCE_CONTEXT {
+    ULONG VolumeSerial;
+} INSTANCE_CONTEXT, *PINSTANCE_CONTEXT;
+
+// Compiled FILTER_CONFIG exclusions, see exclusion.c
+// Nodes form a first-child / next-sibling trie over upcased characters,
+// node 0 is the root. Immutable once published; readers hold a reference.
+#define EXCLUSION_TRIE_MAX_NODES     (64 * 1024)
+
+typedef struct _EXCLUSION_TRIE_NODE {
+    ULONG FirstChild;       // 0 = none
+    ULONG NextSibling;      // 0 = none
+    WCHAR Char;
+    BOOLEAN Terminal;       // an excluded prefix ends here
+} EXCLUSION_TRIE_NODE, *PEXCLUSION_TRIE_NODE;
+
+typedef struct _EXCLUSION_TRIE {
+    volatile LONG RefCount;
+    ULONG NodeCount;
+    EXCLUSION_TRIE_NODE Nodes[ANYSIZE_ARRAY];
+} EXCLUSION_TRIE, *PEXCLUSION_TRIE;
+
+// Injection path indicators, see indicators.c
+// Aho-Corasick automaton over upcased characters: the patterns form a
+// first-child / next-sibling trie, node 0 is the root, and every node has
+// a failure link. Immutable once published; readers hold a reference.
+#define PATH_INDICATOR_MAX_NODES     (64 * 1024)
+#define PATH_INDICATOR_ROOT_FANOUT   128     // root edges indexed directly for ASCII
+
+typedef struct _PATH_INDICATOR_NODE {
+    ULONG FirstChild;       // 0 = none
+    ULONG NextSibling;      // 0 = none
+    ULONG Fail;             // longest proper suffix that is also in the trie
+    WCHAR Char;
+    BOOLEAN Match;          // a pattern ends here or somewhere down the fail chain
+} PATH_INDICATOR_NODE, *PPATH_INDICATOR_NODE;
+
+typedef struct _PATH_INDICATOR_AUTOMATON {
+    volatile LONG RefCount;
+    ULONG NodeCount;
+    ULONG PatternCount;
+    ULONG RootNext[PATH_INDICATOR_ROOT_FANOUT];     // 0 = stay at the root
+    PATH_INDICATOR_NODE Nodes[ANYSIZE_ARRAY];
+} PATH_INDICATOR_AUTOMATON, *PPATH_INDICATOR_AUTOMATON;
+
+// String intern table sizes, see intern.c
+#define STRING_TABLE_BUCKETS         1024    // power of two
+#define STRING_TABLE_MAX_ENTRIES     8192
+#define PROCESS_CACHE_BUCKETS        256     // power of two
+#define IMAGE_VERDICT_CACHE_SIZE     4096    // power of two
+#define IMAGE_VERDICT_EPOCHS         256     // power of two
+
+// Interned process name or directory prefix, immutable once published
+typedef struct _INTERNED_STRING {
+    struct _INTERNED_STRING* Next;
+    ULONG Id;
+    ULONG Hash;
+    USHORT Length;          // in WCHARs
+    WCHAR Buffer[ANYSIZE_ARRAY];
+} INTERNED_STRING, *PINTERNED_STRING;
+
+// Per-process context, created at process create and freed at exit
+typedef struct _PROCESS_CACHE_ENTRY {
+    struct _PROCESS_CACHE_ENTRY* Next;
+    HANDLE ProcessId;
+    ULONG NameId;
+    volatile LONG64 RateTat;    // per-process rate limit state, see ratelimit.c
+} PROCESS_CACHE_ENTRY, *PPROCESS_CACHE_ENTRY;
+
+// Cached signature verdict for one file, see verdict.c
+// the identity is what the service verified, Verdict 0 = empty slot
+typedef struct _IMAGE_VERDICT_SLOT {
+    ULONG64 FileId;
+    LONG64 LastWriteTime;
+    ULONG VolumeSerial;
+    ULONG Verdict;
+} IMAGE_VERDICT_SLOT, *PIMAGE_VERDICT_SLOT;
+
+// Per-processor statistics slot, summed by IOCTL_SENTINELHOOK_GET_STATS
+typedef struct DECLSPEC_CACHEALIGN _TELEMETRY_CPU_STATS {
+    TELEMETRY_STATS Stats;
+} TELEMETRY_CPU_STATS, *PTELEMETRY_CPU_STATS;
+
+// bump a TELEMETRY_STATS field in the current processor's slot
+// interlocked since a caller below DISPATCH_LEVEL can migrate mid-update,
+// but the line is normally only touched by one CPU
+#define TelemetryStatsIncrement(Field) \
+    InterlockedIncrement64((volatile LONG64*)&g_DriverContext.CpuStats[ \
+        KeGetCurrentProcessorNumberEx(NULL)].Stats.Field)
+
+// Per-processor profiler histograms, see perf.c
+typedef struct DECLSPEC_CACHEALIGN _PERF_CPU_HISTOGRAMS {
+    ULONG64 Counts[PerfOpMax][PerfStageMax][PERF_HISTOGRAM_BUCKETS];
+} PERF_CPU_HISTOGRAMS, *PPERF_CPU_HISTOGRAMS;
+
+// start of a timed stage, 0 while the profiler is off; pass it to PerfStop
+#define PerfStart() \
+    (ReadAcquire(&g_DriverContext.PerfEnabled) ? \
+        (ULONG64)KeQueryPerformanceCounter(NULL).QuadPart : 0)
+
+// is any of the MONITOR_* switches in Flags on, see monitor.c
+#define MonitorEnabled(Flags) \
+    ((ReadNoFence(&g_DriverContext.MonitorFlags) & (Flags)) != 0)
+
+// switches that look up image verdicts, the filter then has to see every
+// write to drop the verdicts they invalidate
+#define MONITOR_VERDICT \
+    (MONITOR_PROCESS | MONITOR_IMAGE | MONITOR_DETECT_UNSIGNED_DRIVER)
+
 // Global driver context
 typedef struct _DRIVER_CONTEXT {
     PFLT_FILTER FilterHandle;
@@ -27,11 +164,71 @@ typedef struct _DRIVER_CONTEXT {
     UNICODE_STRING DeviceName;
     UNICODE_STRING SymbolicLinkName;
     BOOLEAN MonitoringEnabled;
-    TELEMETRY_STATS Stats;
-    KSPIN_LOCK StatsLock;
-    KSPIN_LOCK TelemetryLock;
+    PTELEMETRY_CPU_STATS CpuStats;
+    ULONG CpuStatsCount;
+    // record and name buffers, see TelemetryPoolInitialize
+    NPAGED_LOOKASIDE_LIST RecordLookaside;
+    NPAGED_LOOKASIDE_LIST NameLookaside;
+    BOOLEAN PoolInitialized;
+    PTELEMETRY_RING* Rings;
+    ULONG RingCount;
+    ULONG NextDrainRing;
+    FAST_MUTEX TelemetryDrainLock;
+    PTELEMETRY_SHARED_HEADER RingRegion;
+    SIZE_T RingRegionSize;
+    // user-mode mapping of RingRegion, owned by one service process
+    PMDL RingMdl;
+    PVOID RingUserAddress;
+    PEPROCESS RingOwnerProcess;
+    PFILE_OBJECT RingOwnerFile;
+    PKEVENT DataEvent;
+    PKEVENT HighWaterEvent;
+    ULONG HighWaterBytes;
+    KSPIN_LOCK DataEventLock;
+    // interned strings, StringsById[Id - 1]
+    PINTERNED_STRING* StringBuckets;
+    PINTERNED_STRING* StringsById;
+    volatile LONG StringCount;
+    EX_SPIN_LOCK StringLock;
+    PPROCESS_CACHE_ENTRY* ProcessBuckets;
+    EX_SPIN_LOCK ProcessLock;
+    // current exclusion trie, swapped by IOCTL_SENTINELHOOK_SET_FILTER
+    PEXCLUSION_TRIE ExclusionTrie;
+    EX_SPIN_LOCK ExclusionLock;
+    volatile LONG ExclusionGeneration;
+    // injection indicators, swapped by IOCTL_SENTINELHOOK_SET_PATH_INDICATORS
+    PPATH_INDICATOR_AUTOMATON PathIndicators;
+    EX_SPIN_LOCK PathIndicatorLock;
+    // rate limits in KeQueryInterruptTime units, Interval 0 = unlimited
+    ULONG64 ProcessRateInterval;
+    ULONG64 ProcessRateLimit;
+    ULONG64 EventRateInterval[EventMax];
+    ULONG64 EventRateLimit[EventMax];
+    DECLSPEC_CACHEALIGN volatile LONG64 EventRateTat[EventMax];
+    // signature verdicts pushed by the service, see verdict.c
+    IMAGE_VERDICT_SLOT ImageVerdicts[IMAGE_VERDICT_CACHE_SIZE];
+    volatile LONG ImageVerdictEpochs[IMAGE_VERDICT_EPOCHS];
+    EX_SPIN_LOCK ImageVerdictLock;
+    // profiler, allocated the first time it is enabled and kept until unload
+    PPERF_CPU_HISTOGRAMS PerfHistograms;
+    volatile LONG PerfEnabled;
+    // monitoring switches and what is registered for them, see monitor.c
+    PDRIVER_OBJECT DriverObject;
+    volatile LONG MonitorFlags;
+    ULONG MonitorOperations;
+    BOOLEAN ImageNotifyRegistered;
+    EX_PUSH_LOCK MonitorLock;   // PASSIVE_LEVEL while held, see monitor.c
+    // held by the notify routines around FilterHandle, see FilterFileIdentity
+    EX_RUNDOWN_REF FilterRundown;
+    // volumes the filter does not attach to, MULTI_SZ or NULL
+    PWCH ExcludedVolumes;
+    ULONG ExcludedVolumesLength;    // in WCHARs
+    EX_SPIN_LOCK VolumeLock;
 } DRIVER_CONTEXT, *PDRIVER_CONTEXT;
 
+// operations are filled in per registration, see MonitorRegisterFilter
+extern CONST FLT_REGISTRATION FilterRegistration;
+
 // Function declarations
 NTSTATUS DriverEntry(
     _In_ PDRIVER_OBJECT DriverObject,
@@ -108,8 +305,14 @@ NTSTATUS DeviceIoControl(
 );
 
 // Telemetry functions
-VOID LogFileOperation(
+PTELEMETRY_RECORD_BUFFER CaptureFileOperation(
     _In_ TELEMETRY_EVENT_TYPE EventType,
+    _In_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects
+);
+
+VOID LogFileOperation(
+    _In_ PTELEMETRY_RECORD_BUFFER Completion,
     _In_ PFLT_CALLBACK_DATA Data
 );
 
@@ -125,6 +328,204 @@ VOID LogImageLoad(
     _In_ PIMAGE_INFO ImageInfo
 );
 
+// Statistics
+NTSTATUS TelemetryStatsInitialize(VOID);
+
+VOID TelemetryStatsFree(VOID);
+
+VOID TelemetryStatsQuery(
+    _Out_ PTELEMETRY_STATS Stats
+);
+
+// Record and name buffer pool, usable at IRQL <= DISPATCH_LEVEL
+VOID TelemetryPoolInitialize(VOID);
+
+VOID TelemetryPoolFree(VOID);
+
+PTELEMETRY_RECORD_BUFFER TelemetryRecordAllocate(VOID);
+
+VOID TelemetryRecordRelease(
+    _In_ PTELEMETRY_RECORD_BUFFER Buffer
+);
+
+PWCHAR TelemetryNameAllocate(VOID);
+
+VOID TelemetryNameRelease(
+    _In_ PWCHAR Name
+);
+
+// Telemetry ring functions
+NTSTATUS TelemetryRingInitialize(VOID);
+
+VOID TelemetryRingFree(VOID);
+
+BOOLEAN TelemetryRingEnqueue(
+    _In_ CONST TELEMETRY_RECORD* Record
+);
+
+NTSTATUS TelemetryRingDrain(
+    _Out_writes_bytes_to_(BufferLength, *BytesWritten) PVOID Buffer,
+    _In_ ULONG BufferLength,
+    _Out_ PULONG BytesWritten
+);
+
+NTSTATUS TelemetryRingMap(
+    _In_ PFILE_OBJECT FileObject,
+    _In_ HANDLE DataEvent,
+    _In_opt_ HANDLE HighWaterEvent,
+    _In_ ULONG HighWaterBytes,
+    _Out_ PTELEMETRY_MAP_RESPONSE Response
+);
+
+VOID TelemetryRingUnmap(
+    _In_opt_ PFILE_OBJECT FileObject
+);
+
+// Path exclusion
+NTSTATUS ExclusionUpdate(
+    _In_reads_bytes_(ConfigLength) PFILTER_CONFIG Config,
+    _In_ ULONG ConfigLength
+);
+
+VOID ExclusionFree(VOID);
+
+LONG ExclusionCurrentGeneration(VOID);
+
+BOOLEAN ExclusionCheckPath(
+    _In_reads_opt_(PrefixLength) PCWCH Prefix,
+    _In_ USHORT PrefixLength,
+    _In_reads_(RestLength) PCWCH Rest,
+    _In_ USHORT RestLength,
+    _Out_opt_ PLONG Generation
+);
+
+// Injection path indicators
+VOID PathIndicatorInitialize(VOID);
+
+VOID PathIndicatorFree(VOID);
+
+NTSTATUS PathIndicatorUpdate(
+    _In_reads_(PatternsLength) PCWCH Patterns,
+    _In_ ULONG PatternsLength
+);
+
+BOOLEAN PathIndicatorScan(
+    _In_ PCUNICODE_STRING Path
+);
+
+// Monitoring switches
+NTSTATUS MonitorInitialize(
+    _In_ PDRIVER_OBJECT DriverObject
+);
+
+VOID MonitorShutdown(VOID);
+
+VOID MonitorFree(VOID);
+
+NTSTATUS MonitorUpdate(
+    _In_ ULONG Flags,
+    _In_reads_opt_(VolumesLength) PCWCH Volumes,
+    _In_ ULONG VolumesLength
+);
+
+ULONG MonitorFlagsFromConfig(
+    _In_ PFILTER_CONFIG Config
+);
+
+BOOLEAN MonitorVolumeExcluded(
+    _In_ PFLT_VOLUME Volume
+);
+
+// Rate limiting
+NTSTATUS RateLimitUpdate(
+    _In_ PRATE_LIMIT_CONFIG Config
+);
+
+BOOLEAN RateLimitTake(
+    _Inout_ volatile LONG64* Tat,
+    _In_ ULONG64 Interval,
+    _In_ ULONG64 Limit,
+    _In_ ULONG64 Now
+);
+
+BOOLEAN TelemetryAdmit(
+    _In_ TELEMETRY_EVENT_TYPE EventType,
+    _In_opt_ HANDLE ProcessId
+);
+
+// String intern table and process cache
+NTSTATUS InternTableInitialize(VOID);
+
+VOID InternTableFree(VOID);
+
+ULONG InternString(
+    _In_reads_(Length) PCWCH Buffer,
+    _In_ USHORT Length
+);
+
+BOOLEAN InternLookupString(
+    _In_ ULONG Id,
+    _Out_ PCWCH* Buffer,
+    _Out_ PUSHORT Length
+);
+
+NTSTATUS InternResolveString(
+    _In_ ULONG Id,
+    _Out_writes_bytes_to_(BufferLength, *BytesWritten) PVOID Buffer,
+    _In_ ULONG BufferLength,
+    _Out_ PULONG BytesWritten
+);
+
+VOID ProcessCacheInsert(
+    _In_ HANDLE ProcessId,
+    _In_opt_ PCUNICODE_STRING ImageFileName
+);
+
+ULONG ProcessCacheLookup(
+    _In_ HANDLE ProcessId
+);
+
+VOID ProcessCacheRemove(
+    _In_ HANDLE ProcessId
+);
+
+BOOLEAN ProcessCacheAdmit(
+    _In_ HANDLE ProcessId,
+    _In_ ULONG64 Now
+);
+
+// Record builders
+VOID TelemetryRecordInitialize(
+    _Out_ PTELEMETRY_RECORD Record,
+    _In_ TELEMETRY_EVENT_TYPE EventType,
+    _In_ ULONG ProcessId,
+    _In_ ULONG ThreadId
+);
+
+VOID TelemetrySplitPath(
+    _In_ PCUNICODE_STRING Path,
+    _Out_ PULONG PrefixId,
+    _Out_ PCWCH* Rest,
+    _Out_ PUSHORT RestLength
+);
+
+VOID TelemetryRecordAppendPath(
+    _Inout_ PTELEMETRY_RECORD Record,
+    _In_opt_ PCUNICODE_STRING Path
+);
+
+VOID TelemetryRecordAppendSplitPath(
+    _Inout_ PTELEMETRY_RECORD Record,
+    _In_ ULONG PrefixId,
+    _In_reads_(PathLength) PCWCH Path,
+    _In_ USHORT PathLength
+);
+
+VOID TelemetryRecordAppendProcessName(
+    _Inout_ PTELEMETRY_RECORD Record,
+    _In_ HANDLE ProcessId
+);
+
 // Utility functions
 NTSTATUS GetProcessName(
     _In_ HANDLE ProcessId,
@@ -137,8 +538,48 @@ BOOLEAN IsProcessInjection(
     _In_ PUNICODE_STRING ImageName
 );
 
-BOOLEAN IsUnsignedDriver(
-    _In_ PUNICODE_STRING DriverPath
+// Image signature verdict cache
+VOID ImageVerdictInitialize(VOID);
+
+ULONG ImageVerdictLookup(
+    _In_opt_ PFILE_OBJECT FileObject,
+    _Out_ PULONG Epoch
+);
+
+NTSTATUS ImageVerdictUpdate(
+    _In_ PTELEMETRY_IMAGE_VERDICT Verdict
+);
+
+VOID ImageVerdictInvalidate(
+    _In_ ULONG64 FileId
+);
+
+VOID ImageVerdictFlush(VOID);
+
+BOOLEAN FilterFileIdentity(
+    _In_ PFILE_OBJECT FileObject,
+    _Out_ PIMAGE_VERDICT_SLOT Identity
+);
+
+// Minifilter profiler
+NTSTATUS PerfControl(
+    _In_ PTELEMETRY_PERF_CONTROL Control
+);
+
+VOID PerfQuery(
+    _Out_ PTELEMETRY_PERF_STATS Stats
+);
+
+VOID PerfFree(VOID);
+
+VOID PerfStop(
+    _In_ PERF_OPERATION Operation,
+    _In_ PERF_STAGE Stage,
+    _In_ ULONG64 Start
+);
+
+PERF_OPERATION PerfOperation(
+    _In_ UCHAR MajorFunction
 );
 
 // Global context
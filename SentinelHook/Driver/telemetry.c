@@ -1,6 +1,153 @@
 // telemetry helper functions
 #include "sentinelhook.h"
 
+// every TELEMETRY_STATS field is a ULONG64 counter, summed generically
+C_ASSERT(sizeof(TELEMETRY_STATS) % sizeof(ULONG64) == 0);
+
+// allocate one cache-aligned stats slot per possible processor
+NTSTATUS TelemetryStatsInitialize(VOID)
+{
+    ULONG processorCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    g_DriverContext.CpuStats = (PTELEMETRY_CPU_STATS)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED,
+        processorCount * sizeof(TELEMETRY_CPU_STATS),
+        SENTINELHOOK_POOL_TAG
+    );
+    if (!g_DriverContext.CpuStats) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    g_DriverContext.CpuStatsCount = processorCount;
+    return STATUS_SUCCESS;
+}
+
+VOID TelemetryStatsFree(VOID)
+{
+    if (g_DriverContext.CpuStats) {
+        ExFreePoolWithTag(g_DriverContext.CpuStats, SENTINELHOOK_POOL_TAG);
+        g_DriverContext.CpuStats = NULL;
+        g_DriverContext.CpuStatsCount = 0;
+    }
+}
+
+// sum the per-processor slots; counters may move while this runs, so
+// fields are individually but not mutually consistent
+VOID TelemetryStatsQuery(
+    _Out_ PTELEMETRY_STATS Stats
+)
+{
+    PULONG64 total = (PULONG64)Stats;
+
+    RtlZeroMemory(Stats, sizeof(TELEMETRY_STATS));
+
+    for (ULONG cpu = 0; cpu < g_DriverContext.CpuStatsCount; cpu++) {
+        volatile LONG64* slot = (volatile LONG64*)&g_DriverContext.CpuStats[cpu].Stats;
+
+        for (ULONG i = 0; i < sizeof(TELEMETRY_STATS) / sizeof(ULONG64); i++) {
+            total[i] += (ULONG64)ReadNoFence64(&slot[i]);
+        }
+    }
+
+    // frees can be counted on another CPU before the matching allocation
+    // is summed, don't report a wrapped value
+    Stats->PoolInUse = Stats->PoolAllocations > Stats->PoolFrees ?
+        Stats->PoolAllocations - Stats->PoolFrees : 0;
+
+    if (g_DriverContext.PoolInitialized) {
+        Stats->PoolLookasideMisses =
+            (ULONG64)ReadULongNoFence(&g_DriverContext.RecordLookaside.L.AllocateMisses) +
+            ReadULongNoFence(&g_DriverContext.NameLookaside.L.AllocateMisses);
+    }
+}
+
+// records are built in lookaside buffers rather than on the stack: the
+// callbacks run deep in file system and loader stacks where a 1 KB local
+// is a real risk, and at up to DISPATCH_LEVEL where pool is the only option
+VOID TelemetryPoolInitialize(VOID)
+{
+    ExInitializeNPagedLookasideList(
+        &g_DriverContext.RecordLookaside,
+        NULL,
+        NULL,
+        POOL_NX_ALLOCATION,
+        sizeof(TELEMETRY_RECORD_BUFFER),
+        SENTINELHOOK_POOL_TAG,
+        0
+    );
+
+    ExInitializeNPagedLookasideList(
+        &g_DriverContext.NameLookaside,
+        NULL,
+        NULL,
+        POOL_NX_ALLOCATION,
+        MAX_PROCESS_NAME_LENGTH * sizeof(WCHAR),
+        SENTINELHOOK_POOL_TAG,
+        0
+    );
+
+    g_DriverContext.PoolInitialized = TRUE;
+}
+
+// callers must be gone (callbacks and filter unregistered)
+VOID TelemetryPoolFree(VOID)
+{
+    if (g_DriverContext.PoolInitialized) {
+        ExDeleteNPagedLookasideList(&g_DriverContext.NameLookaside);
+        ExDeleteNPagedLookasideList(&g_DriverContext.RecordLookaside);
+        g_DriverContext.PoolInitialized = FALSE;
+    }
+}
+
+// a record buffer, or NULL; a failure counts as a dropped event
+PTELEMETRY_RECORD_BUFFER TelemetryRecordAllocate(VOID)
+{
+    PTELEMETRY_RECORD_BUFFER buffer;
+
+    buffer = (PTELEMETRY_RECORD_BUFFER)ExAllocateFromNPagedLookasideList(
+        &g_DriverContext.RecordLookaside);
+    if (!buffer) {
+        TelemetryStatsIncrement(DroppedEvents);
+        TelemetryStatsIncrement(AllocationFailures);
+        return NULL;
+    }
+
+    TelemetryStatsIncrement(PoolAllocations);
+    return buffer;
+}
+
+VOID TelemetryRecordRelease(
+    _In_ PTELEMETRY_RECORD_BUFFER Buffer
+)
+{
+    ExFreeToNPagedLookasideList(&g_DriverContext.RecordLookaside, Buffer);
+    TelemetryStatsIncrement(PoolFrees);
+}
+
+// a MAX_PROCESS_NAME_LENGTH WCHAR buffer, or NULL
+// callers degrade (no cached name) rather than drop, so a failure here is
+// not an AllocationFailures drop
+PWCHAR TelemetryNameAllocate(VOID)
+{
+    PWCHAR name;
+
+    name = (PWCHAR)ExAllocateFromNPagedLookasideList(&g_DriverContext.NameLookaside);
+    if (!name) {
+        return NULL;
+    }
+
+    TelemetryStatsIncrement(PoolAllocations);
+    return name;
+}
+
+VOID TelemetryNameRelease(
+    _In_ PWCHAR Name
+)
+{
+    ExFreeToNPagedLookasideList(&g_DriverContext.NameLookaside, Name);
+    TelemetryStatsIncrement(PoolFrees);
+}
+
 // get process name from PID
 NTSTATUS GetProcessName(
     _In_ HANDLE ProcessId,
@@ -37,53 +184,127 @@ NTSTATUS GetProcessName(
     return status;
 }
 
-// basic injection detection heuristic
-// TODO: improve with more sophisticated checks
-BOOLEAN IsProcessInjection(
-    _In_ HANDLE ProcessId,
-    _In_ PUNICODE_STRING ImageName
+// start a record: header only, strings are appended afterwards
+VOID TelemetryRecordInitialize(
+    _Out_ PTELEMETRY_RECORD Record,
+    _In_ TELEMETRY_EVENT_TYPE EventType,
+    _In_ ULONG ProcessId,
+    _In_ ULONG ThreadId
 )
 {
-    UNREFERENCED_PARAMETER(ProcessId);
+    RtlZeroMemory(Record, sizeof(TELEMETRY_RECORD));
+    Record->Size = sizeof(TELEMETRY_RECORD);
+    Record->Version = TELEMETRY_RECORD_VERSION;
+    Record->EventType = (UCHAR)EventType;
+    Record->ProcessId = ProcessId;
+    Record->ThreadId = ThreadId;
+    Record->Timestamp = KeQueryInterruptTime();
+}
 
-    if (!ImageName || !ImageName->Buffer) {
-        return FALSE;
-    }
+// split a path into an interned directory ID and the remainder to send
+// inline; PrefixId is 0 and Rest is the whole path if interning failed
+VOID TelemetrySplitPath(
+    _In_ PCUNICODE_STRING Path,
+    _Out_ PULONG PrefixId,
+    _Out_ PCWCH* Rest,
+    _Out_ PUSHORT RestLength
+)
+{
+    PCWCH path = Path->Buffer;
+    USHORT pathLength = (USHORT)min(Path->Length / sizeof(WCHAR), MAX_PATH_LENGTH - 1);
+    USHORT prefixLength;
+
+    *PrefixId = 0;
+    *Rest = path;
+    *RestLength = pathLength;
 
-    // check for temp paths (common injection location)
-    UNICODE_STRING suspiciousPaths[] = {
-        RTL_CONSTANT_STRING(L"\\Temp\\"),
-        RTL_CONSTANT_STRING(L"\\AppData\\Local\\Temp\\"),
-        RTL_CONSTANT_STRING(L"\\AppData\\Roaming\\"),
-    };
+    // prefix runs up to and including the last separator
+    for (prefixLength = pathLength; prefixLength > 0 && path[prefixLength - 1] != L'\\'; prefixLength--);
 
-    for (ULONG i = 0; i < ARRAYSIZE(suspiciousPaths); i++) {
-        if (RtlFindUnicodeSubString(ImageName, &suspiciousPaths[i], TRUE, FALSE) != NULL) {
-            return TRUE;
+    if (prefixLength > 0) {
+        *PrefixId = InternString(path, prefixLength);
+        if (*PrefixId != 0) {
+            *Rest = path + prefixLength;
+            *RestLength = pathLength - prefixLength;
         }
     }
+}
+
+// append an already split path, must come before the process name
+// Record must point into a TELEMETRY_RECORD_BUFFER
+VOID TelemetryRecordAppendSplitPath(
+    _Inout_ PTELEMETRY_RECORD Record,
+    _In_ ULONG PrefixId,
+    _In_reads_(PathLength) PCWCH Path,
+    _In_ USHORT PathLength
+)
+{
+    NT_ASSERT(Record->ProcessNameLength == 0 && Record->ProcessNameId == 0);
+
+    PathLength = (USHORT)min(PathLength, MAX_PATH_LENGTH - 1);
+    RtlCopyMemory(TELEMETRY_RECORD_STRINGS(Record), Path, PathLength * sizeof(WCHAR));
+    Record->PathPrefixId = PrefixId;
+    Record->PathLength = PathLength;
+    Record->Size = (USHORT)(sizeof(TELEMETRY_RECORD) + PathLength * sizeof(WCHAR));
+}
+
+// append the path string, must come before the process name
+// the directory part is sent as an interned ID when the table has room
+// Record must point into a TELEMETRY_RECORD_BUFFER
+VOID TelemetryRecordAppendPath(
+    _Inout_ PTELEMETRY_RECORD Record,
+    _In_opt_ PCUNICODE_STRING Path
+)
+{
+    ULONG prefixId;
+    PCWCH rest;
+    USHORT restLength;
+
+    if (!Path || !Path->Buffer) {
+        return;
+    }
 
-    return FALSE;
+    TelemetrySplitPath(Path, &prefixId, &rest, &restLength);
+    TelemetryRecordAppendSplitPath(Record, prefixId, rest, restLength);
 }
 
-// check if driver is unsigned
-// NOTE: this is a placeholder - real impl would verify cert chain
-BOOLEAN IsUnsignedDriver(
-    _In_ PUNICODE_STRING DriverPath
+// append the process name for the PID, from the process cache when possible
+// Record must point into a TELEMETRY_RECORD_BUFFER
+VOID TelemetryRecordAppendProcessName(
+    _Inout_ PTELEMETRY_RECORD Record,
+    _In_ HANDLE ProcessId
 )
 {
-    if (!DriverPath || !DriverPath->Buffer) {
-        return FALSE;
+    PWCHAR name = TELEMETRY_RECORD_STRINGS(Record) + Record->PathLength;
+    USHORT nameLength;
+
+    Record->ProcessNameId = ProcessCacheLookup(ProcessId);
+    if (Record->ProcessNameId != 0) {
+        return;
     }
 
-    UNICODE_STRING system32 = RTL_CONSTANT_STRING(L"\\System32\\drivers\\");
-    
-    // heuristic: drivers outside system32 might be unsigned
-    // TODO: implement proper signature verification using Wintrust APIs
-    if (RtlFindUnicodeSubString(DriverPath, &system32, TRUE, FALSE) == NULL) {
-        return TRUE;
+    if (!NT_SUCCESS(GetProcessName(ProcessId, name, MAX_PROCESS_NAME_LENGTH))) {
+        return;
     }
 
-    return FALSE;
+    nameLength = (USHORT)wcsnlen(name, MAX_PROCESS_NAME_LENGTH - 1);
+    Record->ProcessNameLength = nameLength;
+    Record->Size = (USHORT)(Record->Size + nameLength * sizeof(WCHAR));
 }
 
+// injection heuristic: the image path contains one of the loaded
+// indicators, see indicators.c
+BOOLEAN IsProcessInjection(
+    _In_ HANDLE ProcessId,
+    _In_ PUNICODE_STRING ImageName
+)
+{
+    UNREFERENCED_PARAMETER(ProcessId);
+
+    if (!ImageName || !ImageName->Buffer) {
+        return FALSE;
+    }
+
+    // one pass over the path, however many indicators are loaded
+    return PathIndicatorScan(ImageName);
+}
@@ -0,0 +1,153 @@
+// image signature verdict cache
+// the driver never verifies a signature itself: the service does it off
+// the notify path and hands the verdict back through
+// IOCTL_SENTINELHOOK_SET_IMAGE_VERDICT. slots are keyed by the file (volume
+// serial, file reference number, last write time), never by its path, so
+// a different file renamed over a path doesn't inherit the verdict.
+// the minifilter drops a file's verdict on every write, truncation,
+// rename, delete or time change and advances the epoch of the file's
+// bucket; a verdict carrying an older epoch was computed from content
+// that may no longer be there and is refused. whatever the filter could
+// have missed (re-registration, detached volumes, monitoring switched
+// off) flushes the whole cache instead.
+// the cache is direct mapped, slots and epochs are indexed by the file
+// reference number alone since that is all a write knows.
+#include "sentinelhook.h"
+
+// epochs stay odd, 0 is the "not cacheable" epoch of the telemetry records
+#define IMAGE_VERDICT_EPOCH_STEP     2
+
+static ULONG ImageVerdictHash(
+    _In_ ULONG64 FileId
+)
+{
+    return (ULONG)((FileId ^ (FileId >> 32)) * 0x9E3779B97F4A7C15ULL >> 32);
+}
+
+#define IMAGE_VERDICT_SLOT_OF(Hash) \
+    (&g_DriverContext.ImageVerdicts[(Hash) & (IMAGE_VERDICT_CACHE_SIZE - 1)])
+#define IMAGE_VERDICT_EPOCH_OF(Hash) \
+    (&g_DriverContext.ImageVerdictEpochs[(Hash) & (IMAGE_VERDICT_EPOCHS - 1)])
+
+// called once from DriverEntry, before any callback is registered
+VOID ImageVerdictInitialize(VOID)
+{
+    for (ULONG i = 0; i < IMAGE_VERDICT_EPOCHS; i++) {
+        g_DriverContext.ImageVerdictEpochs[i] = 1;
+    }
+}
+
+// IMAGE_VERDICT_UNKNOWN unless the slot holds this file as it is now
+// Epoch is what the record carries to the service, 0 when the filter
+// doesn't track writes to the file. PASSIVE_LEVEL, from the notify routines
+ULONG ImageVerdictLookup(
+    _In_opt_ PFILE_OBJECT FileObject,
+    _Out_ PULONG Epoch
+)
+{
+    IMAGE_VERDICT_SLOT identity;
+    PIMAGE_VERDICT_SLOT slot;
+    ULONG verdict = IMAGE_VERDICT_UNKNOWN;
+    ULONG hash;
+    KIRQL oldIrql;
+
+    *Epoch = 0;
+
+    if (!FileObject || !FilterFileIdentity(FileObject, &identity)) {
+        return IMAGE_VERDICT_UNKNOWN;
+    }
+
+    // anything written from here on moves the epoch past the one the
+    // service gets, so it can't cache what it reads of the old content
+    hash = ImageVerdictHash(identity.FileId);
+    *Epoch = (ULONG)ReadAcquire(IMAGE_VERDICT_EPOCH_OF(hash));
+    slot = IMAGE_VERDICT_SLOT_OF(hash);
+
+    oldIrql = ExAcquireSpinLockShared(&g_DriverContext.ImageVerdictLock);
+    if (slot->FileId == identity.FileId && slot->VolumeSerial == identity.VolumeSerial &&
+        slot->LastWriteTime == identity.LastWriteTime) {
+        verdict = slot->Verdict;
+    }
+    ExReleaseSpinLockShared(&g_DriverContext.ImageVerdictLock, oldIrql);
+
+    return verdict;
+}
+
+// IOCTL_SENTINELHOOK_SET_IMAGE_VERDICT
+// a colliding file simply replaces the slot, the loser is verified again
+// the next time it loads
+NTSTATUS ImageVerdictUpdate(
+    _In_ PTELEMETRY_IMAGE_VERDICT Verdict
+)
+{
+    PIMAGE_VERDICT_SLOT slot;
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG hash;
+    KIRQL oldIrql;
+
+    if ((Verdict->Verdict != IMAGE_VERDICT_SIGNED && Verdict->Verdict != IMAGE_VERDICT_UNSIGNED) ||
+        Verdict->Epoch == 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    hash = ImageVerdictHash(Verdict->FileId);
+    slot = IMAGE_VERDICT_SLOT_OF(hash);
+
+    // the epoch check and the store are one step against ImageVerdictFlush,
+    // and ImageVerdictInvalidate clears the slot after moving the epoch
+    oldIrql = ExAcquireSpinLockExclusive(&g_DriverContext.ImageVerdictLock);
+    if ((ULONG)ReadNoFence(IMAGE_VERDICT_EPOCH_OF(hash)) != Verdict->Epoch) {
+        // the file changed after the load that asked, the next load
+        // asks again
+        status = STATUS_RETRY;
+    } else {
+        slot->FileId = Verdict->FileId;
+        slot->LastWriteTime = Verdict->LastWriteTime;
+        slot->VolumeSerial = Verdict->VolumeSerial;
+        slot->Verdict = Verdict->Verdict;
+    }
+    ExReleaseSpinLockExclusive(&g_DriverContext.ImageVerdictLock, oldIrql);
+
+    return status;
+}
+
+// the file is about to change: refuse verdicts in flight and drop the
+// cached one. callable up to DISPATCH_LEVEL
+VOID ImageVerdictInvalidate(
+    _In_ ULONG64 FileId
+)
+{
+    ULONG hash = ImageVerdictHash(FileId);
+    PIMAGE_VERDICT_SLOT slot = IMAGE_VERDICT_SLOT_OF(hash);
+    BOOLEAN cached;
+    KIRQL oldIrql;
+
+    InterlockedAdd(IMAGE_VERDICT_EPOCH_OF(hash), IMAGE_VERDICT_EPOCH_STEP);
+
+    // most writes are to files that were never loaded
+    oldIrql = ExAcquireSpinLockShared(&g_DriverContext.ImageVerdictLock);
+    cached = (slot->Verdict != IMAGE_VERDICT_UNKNOWN && slot->FileId == FileId);
+    ExReleaseSpinLockShared(&g_DriverContext.ImageVerdictLock, oldIrql);
+
+    if (cached) {
+        oldIrql = ExAcquireSpinLockExclusive(&g_DriverContext.ImageVerdictLock);
+        if (slot->FileId == FileId) {
+            RtlZeroMemory(slot, sizeof(*slot));
+        }
+        ExReleaseSpinLockExclusive(&g_DriverContext.ImageVerdictLock, oldIrql);
+    }
+}
+
+// drop every verdict and refuse every one in flight, for when writes may
+// have gone unseen
+VOID ImageVerdictFlush(VOID)
+{
+    KIRQL oldIrql;
+
+    oldIrql = ExAcquireSpinLockExclusive(&g_DriverContext.ImageVerdictLock);
+    RtlZeroMemory(g_DriverContext.ImageVerdicts, sizeof(g_DriverContext.ImageVerdicts));
+    for (ULONG i = 0; i < IMAGE_VERDICT_EPOCHS; i++) {
+        InterlockedAdd(&g_DriverContext.ImageVerdictEpochs[i], IMAGE_VERDICT_EPOCH_STEP);
+    }
+    ExReleaseSpinLockExclusive(&g_DriverContext.ImageVerdictLock, oldIrql);
+}
@@ -0,0 +1,170 @@
+//
+// SentinelHook Service - Correlation Engine Implementation
+//
+
+#include "CorrelationEngine.h"
+#include <wctype.h>
+
+//
+// Constructor
+//
+CorrelationEngine::CorrelationEngine()
+{
+    m_Processes.reserve(4096);
+    ZeroMemory(m_AlertCounts, sizeof(m_AlertCounts));
+}
+
+//
+// Get Process
+// Processes that started before the service are added on first sight
+//
+CorrelationEngine::ProcessNode& CorrelationEngine::GetProcess(ULONG processId)
+{
+    // lost terminates would grow the table forever, start over instead
+    if (m_Processes.size() >= MAX_PROCESSES && m_Processes.find(processId) == m_Processes.end()) {
+        m_Processes.clear();
+    }
+
+    // value-initialized, so a new node is all zero
+    return m_Processes[processId];
+}
+
+//
+// Process Event
+//
+VOID CorrelationEngine::ProcessEvent(const TELEMETRY_ENTRY& entry)
+{
+    switch (entry.EventType) {
+    case EventProcessCreate:
+    case EventProcessInjection: {
+        const PROCESS_TELEMETRY& process = entry.Data.ProcessEvent;
+
+        // a reused PID starts over
+        ProcessNode& node = GetProcess(process.ProcessId);
+        ZeroMemory(&node, sizeof(node));
+        node.ParentProcessId = process.ParentProcessId;
+        node.ImageInTemp = IsTempPath(process.ImagePath);
+
+        auto parent = m_Processes.find(process.ParentProcessId);
+        if (parent != m_Processes.end() && parent->second.ImageInTemp) {
+            Raise(RuleTempParentSpawn, process.ProcessId, node, entry, process.ImagePath);
+        }
+        break;
+    }
+
+    case EventProcessTerminate:
+        // children keep their ParentProcessId, the parent's state goes
+        m_Processes.erase(entry.Data.ProcessEvent.ProcessId);
+        break;
+
+    case EventImageLoad: {
+        const IMAGE_TELEMETRY& image = entry.Data.ImageEvent;
+        if (image.ProcessId != 0 && IsTempPath(image.ImagePath)) {
+            GetProcess(image.ProcessId).TempImageLoadTime = image.Timestamp;
+        }
+        break;
+    }
+
+    case EventFileCreate:
+    case EventFileWrite: {
+        const FILE_TELEMETRY& file = entry.Data.FileEvent;
+        auto it = m_Processes.find(file.ProcessId);
+
+        // only processes with live rule state are worth the path check
+        if (it == m_Processes.end() || it->second.TempImageLoadTime == 0) {
+            break;
+        }
+
+        ProcessNode& node = it->second;
+        if (file.Timestamp - node.TempImageLoadTime > TEMP_IMAGE_WINDOW) {
+            node.TempImageLoadTime = 0;
+        } else if (IsSystemPath(file.FilePath)) {
+            Raise(RuleTempImageThenSystemWrite, file.ProcessId, node, entry, file.FilePath);
+        }
+        break;
+    }
+
+    case EventFileDelete: {
+        const FILE_TELEMETRY& file = entry.Data.FileEvent;
+        ProcessNode& node = GetProcess(file.ProcessId);
+
+        // fixed window, restarted by the first delete after it expires
+        if (file.Timestamp - node.DeleteWindowStart > DELETE_BURST_WINDOW) {
+            node.DeleteWindowStart = file.Timestamp;
+            node.DeleteCount = 0;
+        }
+
+        // a coalesced entry stands for several deletes of the same path
+        ULONG before = node.DeleteCount;
+        node.DeleteCount += file.EventCount;
+        if (before < DELETE_BURST_COUNT && node.DeleteCount >= DELETE_BURST_COUNT) {
+            Raise(RuleDeleteBurst, file.ProcessId, node, entry, file.FilePath);
+        }
+        break;
+    }
+
+    default:
+        break;
+    }
+}
+
+//
+// Raise
+//
+VOID CorrelationEngine::Raise(CorrelationRule rule, ULONG processId, ProcessNode& node,
+    const TELEMETRY_ENTRY& entry, const WCHAR* path)
+{
+    if (node.FiredRules & (1UL << rule)) {
+        return;
+    }
+
+    node.FiredRules |= (1UL << rule);
+    m_AlertCounts[rule]++;
+
+    if (m_AlertCallback) {
+        CorrelationAlert alert;
+        alert.Rule = rule;
+        alert.ProcessId = processId;
+        alert.ParentProcessId = node.ParentProcessId;
+        alert.Timestamp = entry.Timestamp;
+        alert.Path = path;
+        m_AlertCallback(alert);
+    }
+}
+
+//
+// Path Contains
+// Case-insensitive, needle must be upper case ASCII
+//
+BOOL CorrelationEngine::PathContains(const WCHAR* path, const WCHAR* needle)
+{
+    size_t needleLength = wcslen(needle);
+
+    for (size_t i = 0; path[i] != L'\0' && i < MAX_PATH_LENGTH; i++) {
+        size_t j = 0;
+        while (j < needleLength && path[i + j] != L'\0' && towupper(path[i + j]) == needle[j]) {
+            j++;
+        }
+        if (j == needleLength) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+//
+// Is Temp Path
+//
+BOOL CorrelationEngine::IsTempPath(const WCHAR* path)
+{
+    return PathContains(path, L"\\TEMP\\") || PathContains(path, L"\\TMP\\");
+}
+
+//
+// Is System Path
+//
+BOOL CorrelationEngine::IsSystemPath(const WCHAR* path)
+{
+    return PathContains(path, L"\\WINDOWS\\SYSTEM32\\") || PathContains(path, L"\\WINDOWS\\SYSWOW64\\");
+}
@@ -0,0 +1,67 @@
+//
+// SentinelHook Service - Correlation Engine Header
+// Streaming, per-process rule evaluation over the telemetry feed
+//
+
+#pragma once
+
+#include <windows.h>
+#include <functional>
+#include <unordered_map>
+#include "..\Common\telemetry.h"
+
+enum CorrelationRule {
+    RuleTempImageThenSystemWrite,   // image loaded from a temp dir, then a write under System32
+    RuleTempParentSpawn,            // process started by an image that lives in a temp dir
+    RuleDeleteBurst,                // many deletes by one process in a short window
+    RuleMax
+};
+
+struct CorrelationAlert {
+    CorrelationRule Rule;
+    ULONG ProcessId;
+    ULONG ParentProcessId;
+    ULONG64 Timestamp;
+    const WCHAR* Path;              // the event that completed the rule, valid during the callback
+};
+
+//
+// Each rule keeps a few words of state per process, so every event costs
+// one hash lookup (two for process creates) and no history is kept.
+//
+class CorrelationEngine {
+public:
+    typedef std::function<VOID(const CorrelationAlert& alert)> AlertCallback;
+
+    CorrelationEngine();
+
+    VOID ProcessEvent(const TELEMETRY_ENTRY& entry);
+    VOID SetAlertCallback(AlertCallback callback) { m_AlertCallback = callback; }
+    ULONG64 GetAlertCount(CorrelationRule rule) const { return m_AlertCounts[rule]; }
+
+private:
+    struct ProcessNode {
+        ULONG ParentProcessId;
+        BOOL ImageInTemp;           // the process's own image
+        ULONG64 TempImageLoadTime;  // last image load from a temp dir, 0 = none
+        ULONG64 DeleteWindowStart;
+        ULONG DeleteCount;
+        ULONG FiredRules;           // bit per CorrelationRule, each fires once per process
+    };
+
+    std::unordered_map<ULONG, ProcessNode> m_Processes;
+    AlertCallback m_AlertCallback;
+    ULONG64 m_AlertCounts[RuleMax];
+
+    static const size_t MAX_PROCESSES = 65536;
+    static const ULONG64 TEMP_IMAGE_WINDOW = 60ULL * 10000000;     // 60 s in 100 ns units
+    static const ULONG64 DELETE_BURST_WINDOW = 5ULL * 10000000;
+    static const ULONG DELETE_BURST_COUNT = 200;
+
+    ProcessNode& GetProcess(ULONG processId);
+    VOID Raise(CorrelationRule rule, ULONG processId, ProcessNode& node, const TELEMETRY_ENTRY& entry, const WCHAR* path);
+
+    static BOOL PathContains(const WCHAR* path, const WCHAR* needle);
+    static BOOL IsTempPath(const WCHAR* path);
+    static BOOL IsSystemPath(const WCHAR* path);
+};
@@ -4,6 +4,7 @@
 
 #include "DriverComm.h"
 #include <iostream>
+#include <new>
 
 //
 // Constructor
@@ -11,6 +12,11 @@
 DriverComm::DriverComm()
     : m_DeviceHandle(INVALID_HANDLE_VALUE)
     , m_IsInitialized(FALSE)
+    , m_SharedHeader(NULL)
+    , m_SharedSize(0)
+    , m_DataEvent(NULL)
+    , m_HighWaterEvent(NULL)
+    , m_BatchBuffer(NULL)
 {
 }
 
@@ -20,6 +26,7 @@ DriverComm::DriverComm()
 DriverComm::~DriverComm()
 {
     Shutdown();
+    delete[] m_BatchBuffer;
 }
 
 //
@@ -45,6 +52,7 @@ BOOL DriverComm::Initialize()
 VOID DriverComm::Shutdown()
 {
     if (m_IsInitialized) {
+        UnmapTelemetry();
         CloseDevice();
         m_IsInitialized = FALSE;
     }
@@ -83,38 +91,345 @@ VOID DriverComm::CloseDevice()
         CloseHandle(m_DeviceHandle);
         m_DeviceHandle = INVALID_HANDLE_VALUE;
     }
+
+    // IDs belong to this driver instance
+    m_Strings.clear();
 }
 
 //
-// Poll Telemetry
+// Map Telemetry
+// Maps the driver's per-CPU rings into this process. On failure the
+// service keeps using the IOCTL drain path.
 //
-BOOL DriverComm::PollTelemetry()
+BOOL DriverComm::MapTelemetry()
 {
     if (!m_IsInitialized || m_DeviceHandle == INVALID_HANDLE_VALUE) {
         return FALSE;
     }
 
+    if (m_SharedHeader) {
+        return TRUE;
+    }
+
+    // auto-reset, the driver signals it once per ConsumerWaiting handshake
+    m_DataEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!m_DataEvent) {
+        return FALSE;
+    }
+
+    // auto-reset, signaled for alerts and when a ring passes half full
+    m_HighWaterEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!m_HighWaterEvent) {
+        CloseHandle(m_DataEvent);
+        m_DataEvent = NULL;
+        return FALSE;
+    }
+
+    TELEMETRY_MAP_REQUEST request = { 0 };
+    TELEMETRY_MAP_RESPONSE response = { 0 };
     DWORD bytesReturned = 0;
-    TELEMETRY_ENTRY entry = { 0 };
+
+    request.DataEvent = (ULONG64)(ULONG_PTR)m_DataEvent;
+    request.HighWaterEvent = (ULONG64)(ULONG_PTR)m_HighWaterEvent;
+    request.HighWaterBytes = TELEMETRY_RING_HIGH_WATER_DEFAULT;
 
     BOOL result = DeviceIoControl(
         m_DeviceHandle,
-        IOCTL_SENTINELHOOK_GET_TELEMETRY,
-        NULL,
-        0,
-        &entry,
-        sizeof(entry),
+        IOCTL_SENTINELHOOK_MAP_TELEMETRY,
+        &request,
+        sizeof(request),
+        &response,
+        sizeof(response),
         &bytesReturned,
         NULL
     );
 
-    if (result && bytesReturned > 0) {
-        // Process telemetry entry
-        // In real implementation, would queue for aggregation
+    if (!result || bytesReturned != sizeof(response) || response.BaseAddress == 0) {
+        CloseHandle(m_HighWaterEvent);
+        m_HighWaterEvent = NULL;
+        CloseHandle(m_DataEvent);
+        m_DataEvent = NULL;
+        return FALSE;
+    }
+
+    m_SharedHeader = (PTELEMETRY_SHARED_HEADER)(ULONG_PTR)response.BaseAddress;
+    m_SharedSize = response.Size;
+
+    // refuse a layout we don't understand rather than misparse it
+    ULONG64 ringsEnd = (ULONG64)m_SharedHeader->RingOffset +
+        (ULONG64)m_SharedHeader->RingCount * m_SharedHeader->RingStride;
+
+    if (m_SharedHeader->Version != TELEMETRY_SHARED_VERSION ||
+        m_SharedHeader->RingStride != sizeof(TELEMETRY_RING) ||
+        m_SharedHeader->RingBytes != TELEMETRY_RING_BYTES ||
+        ringsEnd > m_SharedSize) {
+        UnmapTelemetry();
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+//
+// Unmap Telemetry
+//
+VOID DriverComm::UnmapTelemetry()
+{
+    if (m_SharedHeader) {
+        DWORD bytesReturned = 0;
+
+        DeviceIoControl(
+            m_DeviceHandle,
+            IOCTL_SENTINELHOOK_UNMAP_TELEMETRY,
+            NULL,
+            0,
+            NULL,
+            0,
+            &bytesReturned,
+            NULL
+        );
+
+        m_SharedHeader = NULL;
+        m_SharedSize = 0;
+    }
+
+    if (m_DataEvent) {
+        CloseHandle(m_DataEvent);
+        m_DataEvent = NULL;
+    }
+
+    if (m_HighWaterEvent) {
+        CloseHandle(m_HighWaterEvent);
+        m_HighWaterEvent = NULL;
+    }
+}
+
+//
+// Get Shared Ring
+//
+PTELEMETRY_RING DriverComm::GetSharedRing(ULONG index) const
+{
+    return (PTELEMETRY_RING)((PUCHAR)m_SharedHeader +
+        m_SharedHeader->RingOffset + (SIZE_T)index * m_SharedHeader->RingStride);
+}
+
+//
+// Lookup String
+// Resolves an interned ID, asking the driver when the definition record
+// has not been seen (service restarted, record dropped, or it sits in
+// another CPU's ring that has not been read yet)
+//
+const std::wstring* DriverComm::LookupString(ULONG id)
+{
+    auto it = m_Strings.find(id);
+    if (it != m_Strings.end()) {
+        return &it->second;
+    }
+
+    TELEMETRY_STRING_REQUEST request = { id };
+    ULONG64 buffer[TELEMETRY_RECORD_MAX_SIZE / sizeof(ULONG64) + 1];
+    DWORD bytesReturned = 0;
+
+    if (!DeviceIoControl(m_DeviceHandle, IOCTL_SENTINELHOOK_RESOLVE_STRING,
+            &request, sizeof(request), buffer, sizeof(buffer), &bytesReturned, NULL)) {
+        return NULL;
+    }
+
+    const TELEMETRY_RECORD* record = (const TELEMETRY_RECORD*)buffer;
+    if (!TelemetryRecordValidate(record, bytesReturned) ||
+        record->EventType != TELEMETRY_RECORD_STRING || record->u.String.Id != id) {
+        return NULL;
+    }
+
+    std::wstring& value = m_Strings[id];
+    value.assign(TELEMETRY_RECORD_STRINGS(record), record->PathLength);
+    return &value;
+}
+
+//
+// Ingest Record
+// Validates one wire record and expands it into the aggregator
+//
+BOOL DriverComm::IngestRecord(TelemetryAggregator& aggregator, const TELEMETRY_RECORD* record, SIZE_T available)
+{
+    if (!TelemetryRecordValidate(record, available)) {
+        return FALSE;
+    }
+
+    if (record->EventType == TELEMETRY_RECORD_STRING) {
+        m_Strings[record->u.String.Id].assign(TELEMETRY_RECORD_STRINGS(record), record->PathLength);
+        return TRUE;
+    }
+
+    const std::wstring* prefix = record->PathPrefixId ? LookupString(record->PathPrefixId) : NULL;
+    const std::wstring* name = record->ProcessNameId ? LookupString(record->ProcessNameId) : NULL;
+
+    TELEMETRY_ENTRY entry;
+    TelemetryRecordToEntryEx(record, &entry,
+        prefix ? prefix->c_str() : NULL, prefix ? prefix->size() : 0,
+        name ? name->c_str() : NULL, name ? name->size() : 0);
+    aggregator.SubmitEvent(entry);
+    return TRUE;
+}
+
+//
+// Consume Shared Rings
+// Reads records in place from the mapped rings and hands the bytes back
+// to the driver by advancing Tail.
+//
+BOOL DriverComm::ConsumeSharedRings(TelemetryAggregator& aggregator)
+{
+    BOOL consumed = FALSE;
+
+    for (ULONG i = 0; i < m_SharedHeader->RingCount; i++) {
+        PTELEMETRY_RING ring = GetSharedRing(i);
+        LONG64 tail = ring->Tail;
+        LONG64 head = ReadAcquire64(&ring->Head);
+
+        if (head == tail) {
+            continue;
+        }
+
+        while (tail != head) {
+            ULONG offset = (ULONG)(tail & (TELEMETRY_RING_BYTES - 1));
+            const TELEMETRY_RECORD* record = (const TELEMETRY_RECORD*)&ring->Data[offset];
+            ULONG contiguous = TELEMETRY_RING_BYTES - offset;
+
+            if (record->EventType == TELEMETRY_RECORD_PADDING) {
+                tail += record->Size;
+                continue;
+            }
+
+            if (!IngestRecord(aggregator, record, contiguous)) {
+                // corrupt ring, resynchronise by discarding what is queued
+                tail = head;
+                break;
+            }
+
+            tail += TELEMETRY_RECORD_ALIGN(record->Size);
+        }
+
+        WriteRelease64(&ring->Tail, tail);
+        consumed = TRUE;
+    }
+
+    return consumed;
+}
+
+//
+// Poll Telemetry
+//
+BOOL DriverComm::PollTelemetry(TelemetryAggregator& aggregator)
+{
+    if (!m_IsInitialized || m_DeviceHandle == INVALID_HANDLE_VALUE) {
+        return FALSE;
+    }
+
+    if (m_SharedHeader) {
+        return ConsumeSharedRings(aggregator);
+    }
+
+    return DrainBatches(aggregator);
+}
+
+//
+// Drain Batches
+// Pulls packed batches until the driver reports empty, bounded so a
+// flooding driver can't keep the worker here forever.
+//
+BOOL DriverComm::DrainBatches(TelemetryAggregator& aggregator)
+{
+    if (!m_BatchBuffer) {
+        m_BatchBuffer = new (std::nothrow) UCHAR[MAX_TELEMETRY_BUFFER_SIZE];
+        if (!m_BatchBuffer) {
+            return FALSE;
+        }
+    }
+
+    BOOL consumed = FALSE;
+
+    for (DWORD batchIndex = 0; batchIndex < MAX_BATCHES_PER_POLL; batchIndex++) {
+        DWORD bytesReturned = 0;
+
+        BOOL result = DeviceIoControl(
+            m_DeviceHandle,
+            IOCTL_SENTINELHOOK_GET_TELEMETRY,
+            NULL,
+            0,
+            m_BatchBuffer,
+            MAX_TELEMETRY_BUFFER_SIZE,
+            &bytesReturned,
+            NULL
+        );
+
+        if (!result || bytesReturned < sizeof(TELEMETRY_BATCH_HEADER)) {
+            break;
+        }
+
+        if (IngestBatch(aggregator, m_BatchBuffer, bytesReturned)) {
+            consumed = TRUE;
+        }
+
+        if (!(((PTELEMETRY_BATCH_HEADER)m_BatchBuffer)->Flags & TELEMETRY_BATCH_MORE)) {
+            break;
+        }
+    }
+
+    return consumed;
+}
+
+//
+// Ingest Batch
+// One GET_TELEMETRY batch as the driver returns it; also used by the
+// benchmark to feed synthetic batches without a device
+//
+BOOL DriverComm::IngestBatch(TelemetryAggregator& aggregator, const VOID* buffer, SIZE_T length)
+{
+    if (length < sizeof(TELEMETRY_BATCH_HEADER)) {
+        return FALSE;
+    }
+
+    const TELEMETRY_BATCH_HEADER* batch = (const TELEMETRY_BATCH_HEADER*)buffer;
+    const UCHAR* cursor = (const UCHAR*)buffer + sizeof(TELEMETRY_BATCH_HEADER);
+    const UCHAR* end = (const UCHAR*)buffer + min((SIZE_T)batch->BytesUsed, length);
+    BOOL consumed = FALSE;
+
+    for (ULONG i = 0; i < batch->Count && cursor < end; i++) {
+        const TELEMETRY_RECORD* record = (const TELEMETRY_RECORD*)cursor;
+
+        if (!IngestRecord(aggregator, record, (SIZE_T)(end - cursor))) {
+            break;
+        }
+
+        cursor += TELEMETRY_RECORD_ALIGN(record->Size);
+        consumed = TRUE;
+    }
+
+    return consumed;
+}
+
+//
+// Prepare Wait
+// Arms the driver's data event. Returns FALSE if data raced in, in which
+// case the caller should poll again instead of blocking.
+//
+BOOL DriverComm::PrepareWait()
+{
+    if (!m_SharedHeader) {
         return TRUE;
     }
 
-    return FALSE;
+    InterlockedExchange(&m_SharedHeader->ConsumerWaiting, 1);
+
+    for (ULONG i = 0; i < m_SharedHeader->RingCount; i++) {
+        PTELEMETRY_RING ring = GetSharedRing(i);
+        if (ReadAcquire64(&ring->Head) != ring->Tail) {
+            InterlockedExchange(&m_SharedHeader->ConsumerWaiting, 0);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
 }
 
 //
@@ -211,3 +526,247 @@ BOOL DriverComm::SetFilterConfig(PFILTER_CONFIG config)
     );
 }
 
+//
+// Set Filter Config
+// Excluded paths beyond the ten in FILTER_CONFIG are appended as a MULTI_SZ
+//
+BOOL DriverComm::SetFilterConfig(PFILTER_CONFIG config, const std::vector<std::wstring>& extraExcludedPaths)
+{
+    if (!m_IsInitialized || m_DeviceHandle == INVALID_HANDLE_VALUE || !config) {
+        return FALSE;
+    }
+
+    std::vector<UCHAR> buffer(sizeof(FILTER_CONFIG));
+    CopyMemory(buffer.data(), config, sizeof(FILTER_CONFIG));
+
+    std::wstring multiSz;
+    for (const auto& path : extraExcludedPaths) {
+        if (!path.empty()) {
+            multiSz.append(path);
+            multiSz.push_back(L'\0');
+        }
+    }
+    multiSz.push_back(L'\0');
+
+    const UCHAR* tail = (const UCHAR*)multiSz.data();
+    buffer.insert(buffer.end(), tail, tail + multiSz.size() * sizeof(WCHAR));
+
+    DWORD bytesReturned = 0;
+
+    return DeviceIoControl(
+        m_DeviceHandle,
+        IOCTL_SENTINELHOOK_SET_FILTER,
+        buffer.data(),
+        (DWORD)buffer.size(),
+        NULL,
+        0,
+        &bytesReturned,
+        NULL
+    );
+}
+
+//
+// Set Monitor
+// MONITOR_* switches only, the excluded volumes stay as they are
+//
+BOOL DriverComm::SetMonitor(ULONG flags)
+{
+    if (!m_IsInitialized || m_DeviceHandle == INVALID_HANDLE_VALUE) {
+        return FALSE;
+    }
+
+    MONITOR_CONFIG config = {};
+    config.Flags = flags;
+
+    DWORD bytesReturned = 0;
+
+    return DeviceIoControl(
+        m_DeviceHandle,
+        IOCTL_SENTINELHOOK_SET_MONITOR,
+        &config,
+        sizeof(config),
+        NULL,
+        0,
+        &bytesReturned,
+        NULL
+    );
+}
+
+//
+// Set Monitor
+// Also replaces the volumes (\Device\HarddiskVolumeN) the filter stays off;
+// an empty list attaches everywhere
+//
+BOOL DriverComm::SetMonitor(ULONG flags, const std::vector<std::wstring>& excludedVolumes)
+{
+    if (!m_IsInitialized || m_DeviceHandle == INVALID_HANDLE_VALUE) {
+        return FALSE;
+    }
+
+    MONITOR_CONFIG config = {};
+    config.Flags = flags;
+    config.Options = MONITOR_CONFIG_VOLUMES;
+
+    std::vector<UCHAR> buffer(sizeof(MONITOR_CONFIG));
+    CopyMemory(buffer.data(), &config, sizeof(MONITOR_CONFIG));
+
+    std::wstring multiSz;
+    for (const auto& volume : excludedVolumes) {
+        if (!volume.empty()) {
+            multiSz.append(volume);
+            multiSz.push_back(L'\0');
+        }
+    }
+    multiSz.push_back(L'\0');
+
+    const UCHAR* tail = (const UCHAR*)multiSz.data();
+    buffer.insert(buffer.end(), tail, tail + multiSz.size() * sizeof(WCHAR));
+
+    DWORD bytesReturned = 0;
+
+    return DeviceIoControl(
+        m_DeviceHandle,
+        IOCTL_SENTINELHOOK_SET_MONITOR,
+        buffer.data(),
+        (DWORD)buffer.size(),
+        NULL,
+        0,
+        &bytesReturned,
+        NULL
+    );
+}
+
+//
+// Set Path Indicators
+// Replaces the driver's injection indicators; an empty list clears them
+//
+BOOL DriverComm::SetPathIndicators(const std::vector<std::wstring>& indicators)
+{
+    if (!m_IsInitialized || m_DeviceHandle == INVALID_HANDLE_VALUE) {
+        return FALSE;
+    }
+
+    std::wstring multiSz;
+    for (const auto& indicator : indicators) {
+        if (!indicator.empty()) {
+            multiSz.append(indicator);
+            multiSz.push_back(L'\0');
+        }
+    }
+    multiSz.push_back(L'\0');
+
+    DWORD bytesReturned = 0;
+
+    return DeviceIoControl(
+        m_DeviceHandle,
+        IOCTL_SENTINELHOOK_SET_PATH_INDICATORS,
+        (LPVOID)multiSz.data(),
+        (DWORD)(multiSz.size() * sizeof(WCHAR)),
+        NULL,
+        0,
+        &bytesReturned,
+        NULL
+    );
+}
+
+//
+// Set Rate Limit
+//
+BOOL DriverComm::SetRateLimit(const RATE_LIMIT_CONFIG& config)
+{
+    if (!m_IsInitialized || m_DeviceHandle == INVALID_HANDLE_VALUE) {
+        return FALSE;
+    }
+
+    DWORD bytesReturned = 0;
+
+    return DeviceIoControl(
+        m_DeviceHandle,
+        IOCTL_SENTINELHOOK_SET_RATE_LIMIT,
+        (LPVOID)&config,
+        sizeof(RATE_LIMIT_CONFIG),
+        NULL,
+        0,
+        &bytesReturned,
+        NULL
+    );
+}
+
+//
+// Set Image Verdict
+// Safe from any thread, the device handle is shared
+//
+BOOL DriverComm::SetImageVerdict(const TELEMETRY_IMAGE_VERDICT& verdict)
+{
+    if (!m_IsInitialized || m_DeviceHandle == INVALID_HANDLE_VALUE) {
+        return FALSE;
+    }
+
+    TELEMETRY_IMAGE_VERDICT request = verdict;
+    DWORD bytesReturned = 0;
+
+    return DeviceIoControl(
+        m_DeviceHandle,
+        IOCTL_SENTINELHOOK_SET_IMAGE_VERDICT,
+        &request,
+        sizeof(request),
+        NULL,
+        0,
+        &bytesReturned,
+        NULL
+    );
+}
+
+//
+// Set Perf
+// Turns the driver's minifilter profiler on or off, optionally clearing
+// what it has collected
+//
+BOOL DriverComm::SetPerf(BOOL enable, BOOL reset)
+{
+    if (!m_IsInitialized || m_DeviceHandle == INVALID_HANDLE_VALUE) {
+        return FALSE;
+    }
+
+    TELEMETRY_PERF_CONTROL control = {};
+    control.Enable = enable;
+    control.Reset = reset;
+
+    DWORD bytesReturned = 0;
+
+    return DeviceIoControl(
+        m_DeviceHandle,
+        IOCTL_SENTINELHOOK_SET_PERF,
+        &control,
+        sizeof(control),
+        NULL,
+        0,
+        &bytesReturned,
+        NULL
+    );
+}
+
+//
+// Get Perf
+//
+BOOL DriverComm::GetPerf(PTELEMETRY_PERF_STATS stats)
+{
+    if (!m_IsInitialized || m_DeviceHandle == INVALID_HANDLE_VALUE || !stats) {
+        return FALSE;
+    }
+
+    DWORD bytesReturned = 0;
+
+    BOOL result = DeviceIoControl(
+        m_DeviceHandle,
+        IOCTL_SENTINELHOOK_GET_PERF,
+        NULL,
+        0,
+        stats,
+        sizeof(TELEMETRY_PERF_STATS),
+        &bytesReturned,
+        NULL
+    );
+
+    return result && (bytesReturned == sizeof(TELEMETRY_PERF_STATS));
+}
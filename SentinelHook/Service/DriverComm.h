@@ -7,6 +7,11 @@
 #include <windows.h>
 #include "..\Common\ioctl.h"
 #include "..\Common\telemetry.h"
+#include "..\Common\record.h"
+#include "TelemetryAggregator.h"
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 class DriverComm {
 public:
@@ -15,17 +20,50 @@ public:
 
     BOOL Initialize();
     VOID Shutdown();
-    BOOL PollTelemetry();
+    BOOL MapTelemetry();
+    BOOL PollTelemetry(TelemetryAggregator& aggregator);
+    BOOL IngestBatch(TelemetryAggregator& aggregator, const VOID* buffer, SIZE_T length);
+    BOOL PrepareWait();
+    HANDLE GetDataEvent() const { return m_DataEvent; }
+    HANDLE GetHighWaterEvent() const { return m_HighWaterEvent; }
     BOOL GetStatistics(PTELEMETRY_STATS stats);
     BOOL EnableMonitoring();
     BOOL DisableMonitoring();
     BOOL SetFilterConfig(PFILTER_CONFIG config);
+    BOOL SetFilterConfig(PFILTER_CONFIG config, const std::vector<std::wstring>& extraExcludedPaths);
+    BOOL SetMonitor(ULONG flags);
+    BOOL SetMonitor(ULONG flags, const std::vector<std::wstring>& excludedVolumes);
+    BOOL SetPathIndicators(const std::vector<std::wstring>& indicators);
+    BOOL SetRateLimit(const RATE_LIMIT_CONFIG& config);
+    BOOL SetImageVerdict(const TELEMETRY_IMAGE_VERDICT& verdict);
+    BOOL SetPerf(BOOL enable, BOOL reset);
+    BOOL GetPerf(PTELEMETRY_PERF_STATS stats);
 
 private:
     HANDLE m_DeviceHandle;
     BOOL m_IsInitialized;
 
+    // shared ring mapping (NULL when using the IOCTL drain path)
+    PTELEMETRY_SHARED_HEADER m_SharedHeader;
+    ULONG64 m_SharedSize;
+    HANDLE m_DataEvent;
+    HANDLE m_HighWaterEvent;
+
     BOOL OpenDevice();
     VOID CloseDevice();
+    VOID UnmapTelemetry();
+    PTELEMETRY_RING GetSharedRing(ULONG index) const;
+    BOOL ConsumeSharedRings(TelemetryAggregator& aggregator);
+    BOOL DrainBatches(TelemetryAggregator& aggregator);
+    BOOL IngestRecord(TelemetryAggregator& aggregator, const TELEMETRY_RECORD* record, SIZE_T available);
+    const std::wstring* LookupString(ULONG id);
+
+    // driver interned strings by ID, filled from TELEMETRY_RECORD_STRING
+    // records and IOCTL_SENTINELHOOK_RESOLVE_STRING; IDs are never reused
+    std::unordered_map<ULONG, std::wstring> m_Strings;
+
+    // IOCTL drain buffer, allocated once
+    PUCHAR m_BatchBuffer;
+    static const DWORD MAX_BATCHES_PER_POLL = 64;
 };
 
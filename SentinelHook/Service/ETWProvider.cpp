@@ -57,118 +57,120 @@ VOID ETWProvider::Shutdown()
 
 //
 // Write Events
+// Payload of every event is the compact TELEMETRY_RECORD. Events written
+// in one call share an activity ID so a trace can group a drained batch.
 //
-BOOL ETWProvider::WriteEvents(const std::vector<TELEMETRY_ENTRY>& events)
+BOOL ETWProvider::WriteEvents(const TelemetryEventSpan& events)
 {
     if (!m_IsInitialized) {
         return FALSE;
     }
 
+    // no session listening, don't encode anything
+    if (!EventProviderEnabled(m_ProviderHandle, 0, 0)) {
+        return TRUE;
+    }
+
+    DECLSPEC_ALIGN(TELEMETRY_RECORD_ALIGNMENT) UCHAR buffer[TELEMETRY_RECORD_MAX_SIZE];
+    const TELEMETRY_RECORD& record = *(const TELEMETRY_RECORD*)buffer;
+    GUID activityId;
+    BOOL haveActivityId = FALSE;
+
     for (const auto& entry : events) {
-        switch (entry.EventType) {
-        case EventFileCreate:
-        case EventFileRead:
-        case EventFileWrite:
-        case EventFileDelete:
-            WriteFileOperationEvent(entry.Data.FileEvent);
-            break;
-
-        case EventProcessCreate:
-        case EventProcessTerminate:
-        case EventProcessInjection:
-            WriteProcessEvent(entry.Data.ProcessEvent);
-            break;
-
-        case EventImageLoad:
-        case EventImageUnload:
-        case EventUnsignedDriverLoad:
-            WriteImageLoadEvent(entry.Data.ImageEvent);
-            break;
-
-        default:
-            break;
+        const EVENT_DESCRIPTOR* descriptor = GetEventDescriptor(entry.EventType);
+
+        // per level and keyword, only what some session asked for
+        if (!descriptor || !EventEnabled(m_ProviderHandle, descriptor)) {
+            continue;
+        }
+
+        if (TelemetryRecordFromEntry(&entry, buffer, sizeof(buffer)) == 0) {
+            continue;
+        }
+
+        if (!haveActivityId) {
+            haveActivityId = (EventActivityIdControl(EVENT_ACTIVITY_CTRL_CREATE_ID, &activityId) == ERROR_SUCCESS);
         }
+
+        WriteRecord(*descriptor, record, haveActivityId ? &activityId : NULL);
     }
 
     return TRUE;
 }
 
 //
-// Write File Operation Event
+// Is Perf Enabled
+// True while some session has the perf keyword on
 //
-VOID ETWProvider::WriteFileOperationEvent(const FILE_TELEMETRY& fileEvent)
+BOOL ETWProvider::IsPerfEnabled() const
 {
-    EVENT_DESCRIPTOR eventDescriptor = { 0 };
-    eventDescriptor.Id = EVENT_FILE_OPERATION;
-    eventDescriptor.Version = 1;
-    eventDescriptor.Level = EVENT_LEVEL_INFO;
-    eventDescriptor.Opcode = 0;
-    eventDescriptor.Task = 0;
-    eventDescriptor.Keyword = 0;
-
-    EventWrite(
-        m_ProviderHandle,
-        &eventDescriptor,
-        sizeof(fileEvent),
-        &fileEvent
-    );
+    return m_IsInitialized && EventEnabled(m_ProviderHandle, &SentinelHookPerfCountersEvent);
 }
 
 //
-// Write Process Event
+// Write Perf Counters
 //
-VOID ETWProvider::WriteProcessEvent(const PROCESS_TELEMETRY& processEvent)
+VOID ETWProvider::WritePerfCounters(const PERF_COUNTERS_EVENT& counters)
 {
-    EVENT_DESCRIPTOR eventDescriptor = { 0 };
-
-    if (processEvent.EventType == EventProcessCreate) {
-        eventDescriptor.Id = EVENT_PROCESS_CREATE;
-    } else if (processEvent.EventType == EventProcessTerminate) {
-        eventDescriptor.Id = EVENT_PROCESS_TERMINATE;
-    } else if (processEvent.EventType == EventProcessInjection) {
-        eventDescriptor.Id = EVENT_INJECTION_DETECTED;
-        eventDescriptor.Level = EVENT_LEVEL_WARNING;
-    } else {
+    if (!m_IsInitialized) {
         return;
     }
 
-    eventDescriptor.Version = 1;
-    eventDescriptor.Opcode = 0;
-    eventDescriptor.Task = 0;
-    eventDescriptor.Keyword = 0;
+    EVENT_DATA_DESCRIPTOR dataDescriptor;
+    EventDataDescCreate(&dataDescriptor, &counters, sizeof(counters));
+
+    EventWrite(m_ProviderHandle, &SentinelHookPerfCountersEvent, 1, &dataDescriptor);
+}
 
-    EventWrite(
+//
+// Write Record
+//
+VOID ETWProvider::WriteRecord(const EVENT_DESCRIPTOR& eventDescriptor, const TELEMETRY_RECORD& record, LPCGUID activityId)
+{
+    EVENT_DATA_DESCRIPTOR dataDescriptor;
+    EventDataDescCreate(&dataDescriptor, &record, record.Size);
+
+    EventWriteEx(
         m_ProviderHandle,
         &eventDescriptor,
-        sizeof(processEvent),
-        &processEvent
+        0,
+        0,
+        activityId,
+        NULL,
+        1,
+        &dataDescriptor
     );
 }
 
 //
-// Write Image Load Event
+// Get Event Descriptor
 //
-VOID ETWProvider::WriteImageLoadEvent(const IMAGE_TELEMETRY& imageEvent)
+const EVENT_DESCRIPTOR* ETWProvider::GetEventDescriptor(TELEMETRY_EVENT_TYPE eventType)
 {
-    EVENT_DESCRIPTOR eventDescriptor = { 0 };
+    switch (eventType) {
+    case EventFileCreate:
+    case EventFileRead:
+    case EventFileWrite:
+    case EventFileDelete:
+        return &SentinelHookFileOperationEvent;
 
-    if (imageEvent.EventType == EventUnsignedDriverLoad) {
-        eventDescriptor.Id = EVENT_UNSIGNED_DRIVER;
-        eventDescriptor.Level = EVENT_LEVEL_WARNING;
-    } else {
-        eventDescriptor.Id = EVENT_IMAGE_LOAD;
-    }
+    case EventProcessCreate:
+        return &SentinelHookProcessCreateEvent;
 
-    eventDescriptor.Version = 1;
-    eventDescriptor.Opcode = 0;
-    eventDescriptor.Task = 0;
-    eventDescriptor.Keyword = 0;
+    case EventProcessTerminate:
+        return &SentinelHookProcessTerminateEvent;
 
-    EventWrite(
-        m_ProviderHandle,
-        &eventDescriptor,
-        sizeof(imageEvent),
-        &imageEvent
-    );
-}
+    case EventProcessInjection:
+        return &SentinelHookInjectionEvent;
+
+    case EventImageLoad:
+    case EventImageUnload:
+        return &SentinelHookImageLoadEvent;
 
+    case EventUnsignedDriverLoad:
+        return &SentinelHookUnsignedDriverEvent;
+
+    default:
+        return NULL;
+    }
+}
@@ -6,9 +6,10 @@
 
 #include <windows.h>
 #include <evntrace.h>
-#include <vector>
 #include "..\Common\telemetry.h"
+#include "..\Common\record.h"
 #include "..\Common\events.h"
+#include "TelemetryAggregator.h"
 
 class ETWProvider {
 public:
@@ -17,14 +18,15 @@ public:
 
     BOOL Initialize();
     VOID Shutdown();
-    BOOL WriteEvents(const std::vector<TELEMETRY_ENTRY>& events);
+    BOOL WriteEvents(const TelemetryEventSpan& events);
+    BOOL IsPerfEnabled() const;
+    VOID WritePerfCounters(const PERF_COUNTERS_EVENT& counters);
 
 private:
     REGHANDLE m_ProviderHandle;
     BOOL m_IsInitialized;
 
-    VOID WriteFileOperationEvent(const FILE_TELEMETRY& fileEvent);
-    VOID WriteProcessEvent(const PROCESS_TELEMETRY& processEvent);
-    VOID WriteImageLoadEvent(const IMAGE_TELEMETRY& imageEvent);
+    VOID WriteRecord(const EVENT_DESCRIPTOR& eventDescriptor, const TELEMETRY_RECORD& record, LPCGUID activityId);
+    static const EVENT_DESCRIPTOR* GetEventDescriptor(TELEMETRY_EVENT_TYPE eventType);
 };
 
@@ -0,0 +1,153 @@
+//
+// SentinelHook Service - Event Coalescer Implementation
+//
+
+#include "EventCoalescer.h"
+#include <wchar.h>
+
+//
+// Constructor
+//
+EventCoalescer::EventCoalescer(EmitCallback emit)
+    : m_Slots(new Slot[TABLE_SIZE])
+    , m_InUse(0)
+    , m_FoldedEvents(0)
+    , m_Emit(emit)
+{
+    for (size_t i = 0; i < TABLE_SIZE; i++) {
+        m_Slots[i].InUse = FALSE;
+    }
+}
+
+//
+// Submit
+// Anything that isn't a file operation passes straight through, after the
+// same process's pending entries so per-process order is kept
+//
+VOID EventCoalescer::Submit(const TELEMETRY_ENTRY& entry)
+{
+    if (!IsCoalescable(entry)) {
+        if (m_InUse > 0) {
+            BOOL isImage = entry.EventType == EventImageLoad || entry.EventType == EventImageUnload ||
+                entry.EventType == EventUnsignedDriverLoad;
+            FlushProcess(isImage ? entry.Data.ImageEvent.ProcessId : entry.Data.ProcessEvent.ProcessId);
+        }
+        m_Emit(entry);
+        return;
+    }
+
+    const FILE_TELEMETRY& file = entry.Data.FileEvent;
+    ULONG hash = HashKey(file);
+    Slot& slot = m_Slots[hash & (TABLE_SIZE - 1)];
+
+    if (slot.InUse) {
+        FILE_TELEMETRY& pending = slot.Entry.Data.FileEvent;
+
+        if (slot.Hash == hash && SameKey(pending, file) &&
+            file.Timestamp - slot.Entry.Timestamp <= COALESCE_WINDOW &&
+            pending.EventCount + file.EventCount <= MAX_FOLDED) {
+            pending.EventCount += file.EventCount;
+            pending.BytesTransferred += file.BytesTransferred;
+            m_FoldedEvents += file.EventCount;
+            return;
+        }
+
+        // collision, expiry or a full count: the old entry goes first
+        Emit(slot);
+    }
+
+    slot.InUse = TRUE;
+    slot.Hash = hash;
+    slot.Entry = entry;
+    m_InUse++;
+}
+
+//
+// Flush
+// Emits entries whose window has passed, or everything on shutdown
+//
+VOID EventCoalescer::Flush(BOOL all)
+{
+    if (m_InUse == 0) {
+        return;
+    }
+
+    ULONGLONG now;
+    QueryInterruptTime(&now);
+
+    for (size_t i = 0; i < TABLE_SIZE && m_InUse > 0; i++) {
+        Slot& slot = m_Slots[i];
+        if (slot.InUse && (all || now - slot.Entry.Timestamp > COALESCE_WINDOW)) {
+            Emit(slot);
+        }
+    }
+}
+
+//
+// Flush Process
+//
+VOID EventCoalescer::FlushProcess(ULONG processId)
+{
+    for (size_t i = 0; i < TABLE_SIZE && m_InUse > 0; i++) {
+        Slot& slot = m_Slots[i];
+        if (slot.InUse && slot.Entry.Data.FileEvent.ProcessId == processId) {
+            Emit(slot);
+        }
+    }
+}
+
+//
+// Emit
+//
+VOID EventCoalescer::Emit(Slot& slot)
+{
+    slot.InUse = FALSE;
+    m_InUse--;
+    m_Emit(slot.Entry);
+}
+
+//
+// Is Coalescable
+//
+BOOL EventCoalescer::IsCoalescable(const TELEMETRY_ENTRY& entry)
+{
+    switch (entry.EventType) {
+    case EventFileCreate:
+    case EventFileRead:
+    case EventFileWrite:
+    case EventFileDelete:
+        return TRUE;
+
+    default:
+        return FALSE;
+    }
+}
+
+//
+// Hash Key
+// FNV-1a over the key fields
+//
+ULONG EventCoalescer::HashKey(const FILE_TELEMETRY& file)
+{
+    ULONG hash = 2166136261UL;
+    ULONG words[3] = { file.ProcessId, (ULONG)file.EventType, file.Result };
+
+    for (size_t i = 0; i < 3; i++) {
+        hash = (hash ^ words[i]) * 16777619UL;
+    }
+
+    for (size_t i = 0; i < MAX_PATH_LENGTH && file.FilePath[i] != L'\0'; i++) {
+        hash = (hash ^ (ULONG)file.FilePath[i]) * 16777619UL;
+    }
+
+    return hash;
+}
+
+//
+// Same Key
+//
+BOOL EventCoalescer::SameKey(const FILE_TELEMETRY& a, const FILE_TELEMETRY& b)
+{
+    return a.ProcessId == b.ProcessId && a.EventType == b.EventType && a.Result == b.Result &&
+        wcsncmp(a.FilePath, b.FilePath, MAX_PATH_LENGTH) == 0;
+}
@@ -0,0 +1,53 @@
+//
+// SentinelHook Service - Event Coalescer Header
+// Folds repeated file operations into one entry before they reach the ring
+//
+
+#pragma once
+
+#include <windows.h>
+#include <functional>
+#include <memory>
+#include "..\Common\telemetry.h"
+
+//
+// Direct-mapped table of pending file entries keyed by (PID, type, result,
+// path). A repeat of a pending key bumps its count and byte total; the entry
+// is emitted when its window expires, when another key needs the slot, or
+// when its count would overflow the wire field. Timestamps are interrupt
+// time, the same clock the driver stamps records with. Single threaded.
+//
+class EventCoalescer {
+public:
+    typedef std::function<VOID(const TELEMETRY_ENTRY& entry)> EmitCallback;
+
+    explicit EventCoalescer(EmitCallback emit);
+
+    VOID Submit(const TELEMETRY_ENTRY& entry);
+    VOID Flush(BOOL all);
+
+    ULONG64 GetFoldedEvents() const { return m_FoldedEvents; }
+
+private:
+    struct Slot {
+        BOOL InUse;
+        ULONG Hash;
+        TELEMETRY_ENTRY Entry;          // Timestamp is the first folded operation
+    };
+
+    static const size_t TABLE_SIZE = 512;      // power of two
+    static const ULONG64 COALESCE_WINDOW = 1ULL * 10000000;    // 1 s in 100 ns units
+    static const ULONG MAX_FOLDED = MAXUSHORT;
+
+    std::unique_ptr<Slot[]> m_Slots;
+    size_t m_InUse;
+    ULONG64 m_FoldedEvents;
+    EmitCallback m_Emit;
+
+    VOID Emit(Slot& slot);
+    VOID FlushProcess(ULONG processId);
+
+    static BOOL IsCoalescable(const TELEMETRY_ENTRY& entry);
+    static ULONG HashKey(const FILE_TELEMETRY& file);
+    static BOOL SameKey(const FILE_TELEMETRY& a, const FILE_TELEMETRY& b);
+};
@@ -6,13 +6,18 @@
 // #include <iostream>
 
 const WCHAR* NamedPipe::PIPE_NAME = L"\\\\.\\pipe\\SentinelHookTelemetry";
+const WCHAR* NamedPipe::SPOOL_PARENT_DIRECTORY = L"%ProgramData%\\SentinelHook";
 
 //
 // Constructor
 //
 NamedPipe::NamedPipe()
-    : m_PipeHandle(INVALID_HANDLE_VALUE)
+    : m_CompletionPort(NULL)
+    , m_NextClientId(1)
+    , m_Listening(FALSE)
+    , m_Stopping(FALSE)
     , m_IsInitialized(FALSE)
+    , m_SpoolEnabled(FALSE)
 {
 }
 
@@ -24,102 +29,575 @@ NamedPipe::~NamedPipe()
     Shutdown();
 }
 
+//
+// Default Spool Directory
+// %ProgramData%\SentinelHook\Spool
+//
+std::wstring NamedPipe::DefaultSpoolDirectory()
+{
+    WCHAR parent[MAX_PATH];
+    DWORD length = ExpandEnvironmentStringsW(SPOOL_PARENT_DIRECTORY, parent, MAX_PATH);
+
+    if (length == 0 || length > MAX_PATH) {
+        return std::wstring();
+    }
+    return std::wstring(parent) + L"\\Spool";
+}
+
 //
 // Initialize
 //
 BOOL NamedPipe::Initialize()
 {
+    std::wstring spoolDirectory = DefaultSpoolDirectory();
+
+    // the spool sits in the service's data directory, made on first run
+    if (!spoolDirectory.empty()) {
+        CreateDirectoryW(spoolDirectory.substr(0, spoolDirectory.rfind(L'\\')).c_str(), NULL);
+    }
+    return Initialize(PIPE_NAME, spoolDirectory);
+}
+
+//
+// Initialize
+// An empty spool directory runs without one
+//
+BOOL NamedPipe::Initialize(const std::wstring& pipeName, const std::wstring& spoolDirectory)
+{
+    if (m_IsInitialized) {
+        return TRUE;
+    }
+
+    m_CompletionPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    if (!m_CompletionPort) {
+        return FALSE;
+    }
+    m_PipeName = pipeName;
+
+    // without a spool the pipe still works, offline events are just lost
+    if (!spoolDirectory.empty()) {
+        m_SpoolEnabled = m_Spool.Initialize(spoolDirectory);
+    }
+
+    m_Stopping = FALSE;
+    m_IoThread = std::thread(&NamedPipe::IoThread, this);
+
+    {
+        std::lock_guard<std::mutex> lock(m_ClientsMutex);
+        CreateListenerLocked();
+    }
+
     m_IsInitialized = TRUE;
     return TRUE;
 }
 
 //
 // Shutdown
+// Cancels outstanding I/O and waits for the completion thread to see it
 //
 VOID NamedPipe::Shutdown()
 {
-    ClosePipe();
+    if (!m_IsInitialized) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_ClientsMutex);
+        m_Stopping = TRUE;
+
+        for (auto it = m_Clients.begin(); it != m_Clients.end(); ) {
+            PipeClient* client = (it++)->get();
+            CloseClientLocked(client);
+        }
+
+        if (m_Clients.empty()) {
+            PostQueuedCompletionStatus(m_CompletionPort, 0, QUIT_KEY, NULL);
+        }
+    }
+
+    m_IoThread.join();
+
+    if (m_SpoolEnabled) {
+        m_Spool.Shutdown();
+        m_SpoolEnabled = FALSE;
+    }
+
+    CloseHandle(m_CompletionPort);
+    m_CompletionPort = NULL;
     m_IsInitialized = FALSE;
 }
 
 //
-// Create Pipe Instance
+// Create Listener
+// Keep one unconnected instance waiting for the next subscriber
+//
+BOOL NamedPipe::CreateListenerLocked()
+{
+    while (!m_Listening && !m_Stopping && m_Clients.size() < MAX_CLIENTS) {
+        std::unique_ptr<PipeClient> client(new PipeClient());
+
+        // duplex so clients can send a TELEMETRY_SUBSCRIPTION; read-only
+        // clients still connect and get everything
+        client->Pipe = CreateNamedPipe(
+            m_PipeName.c_str(),
+            PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+            PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+            PIPE_UNLIMITED_INSTANCES,
+            TELEMETRY_PIPE_MESSAGE_BYTES,
+            sizeof(TELEMETRY_SUBSCRIPTION),
+            0,
+            NULL
+        );
+
+        if (client->Pipe == INVALID_HANDLE_VALUE) {
+            return FALSE;
+        }
+
+        if (!CreateIoCompletionPort(client->Pipe, m_CompletionPort, 0, 0)) {
+            CloseHandle(client->Pipe);
+            return FALSE;
+        }
+
+        client->Id = m_NextClientId++;
+        client->WriteIo.Client = client.get();
+        client->ReadIo.Client = client.get();
+
+        ZeroMemory(&client->WriteIo.Overlapped, sizeof(OVERLAPPED));
+        BOOL connected = ConnectNamedPipe(client->Pipe, &client->WriteIo.Overlapped);
+        DWORD error = connected ? ERROR_IO_PENDING : GetLastError();
+
+        if (error == ERROR_IO_PENDING) {
+            client->WriteIo.Pending = TRUE;
+            m_Listening = TRUE;
+            m_Clients.push_back(std::move(client));
+        } else if (error == ERROR_PIPE_CONNECTED) {
+            // a client got in between create and connect, no packet is queued
+            client->Connected = TRUE;
+            m_Clients.push_back(std::move(client));
+            StartReadLocked(m_Clients.back().get());
+            BeginReplayLocked(m_Clients.back().get());
+        } else {
+            CloseHandle(client->Pipe);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+//
+// Start Write
+// Issue the next queued message if nothing is in flight
+//
+VOID NamedPipe::StartWriteLocked(PipeClient* client)
+{
+    if (client->Replaying && client->Queue.empty()) {
+        FillReplayLocked(client);
+    }
+
+    if (client->Closing || client->WriteIo.Pending || client->Queue.empty()) {
+        return;
+    }
+
+    const std::vector<UCHAR>& message = *client->Queue.front();
+
+    ZeroMemory(&client->WriteIo.Overlapped, sizeof(OVERLAPPED));
+    if (!WriteFile(client->Pipe, message.data(), (DWORD)message.size(), NULL, &client->WriteIo.Overlapped) &&
+        GetLastError() != ERROR_IO_PENDING) {
+        // client went away, the slot reopens for a new subscriber
+        CloseClientLocked(client);
+        return;
+    }
+
+    // completes through the port even when it finished synchronously
+    client->WriteIo.Pending = TRUE;
+}
+
+//
+// Start Read
+// Wait for the next subscription message
+//
+VOID NamedPipe::StartReadLocked(PipeClient* client)
+{
+    if (client->Closing || client->ReadIo.Pending) {
+        return;
+    }
+
+    ZeroMemory(&client->ReadIo.Overlapped, sizeof(OVERLAPPED));
+    if (!ReadFile(client->Pipe, &client->ReadBuffer, sizeof(client->ReadBuffer), NULL, &client->ReadIo.Overlapped) &&
+        GetLastError() != ERROR_IO_PENDING && GetLastError() != ERROR_MORE_DATA) {
+        CloseClientLocked(client);
+        return;
+    }
+
+    client->ReadIo.Pending = TRUE;
+}
+
+//
+// Complete Read
 //
-BOOL NamedPipe::CreatePipeInstance()
+VOID NamedPipe::CompleteReadLocked(PipeClient* client, BOOL success, DWORD error, DWORD bytes)
 {
-    ClosePipe();
+    if (!success && error == ERROR_MORE_DATA) {
+        // not a subscription, skip to the end of the message
+        client->DiscardingRead = TRUE;
+    } else if (!success) {
+        CloseClientLocked(client);
+        return;
+    } else if (client->DiscardingRead) {
+        client->DiscardingRead = FALSE;
+    } else if (bytes == sizeof(TELEMETRY_SUBSCRIPTION) &&
+               client->ReadBuffer.Version == TELEMETRY_SUBSCRIPTION_VERSION &&
+               client->ReadBuffer.ProcessIdCount <= TELEMETRY_SUBSCRIPTION_MAX_PIDS) {
+        client->Subscription = client->ReadBuffer;
+        client->Subscription.PathPrefix[MAX_PATH_LENGTH - 1] = L'\0';
+        client->Subscribed = TRUE;
+    }
+
+    StartReadLocked(client);
+}
+
+//
+// Begin Replay
+// One subscriber at a time drains the spool
+//
+VOID NamedPipe::BeginReplayLocked(PipeClient* client)
+{
+    if (!m_SpoolEnabled || m_Spool.IsEmpty()) {
+        return;
+    }
 
-    m_PipeHandle = CreateNamedPipe(
-        PIPE_NAME,
-        PIPE_ACCESS_OUTBOUND,
-        PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT,
-        1,
-        64 * 1024,
-        64 * 1024,
-        0,
-        NULL
-    );
+    for (const auto& other : m_Clients) {
+        if (other->Replaying && !other->Closing) {
+            return;
+        }
+    }
+
+    client->Replaying = TRUE;
+    StartWriteLocked(client);
+}
+
+//
+// Fill Replay
+// Queue the next slice of the spool; the client goes live once it is empty
+//
+VOID NamedPipe::FillReplayLocked(PipeClient* client)
+{
+    std::vector<MessageBuffer> messages;
+
+    while (messages.empty() && m_Spool.Read(m_ReplayEntries, REPLAY_BATCH_EVENTS) > 0) {
+        TelemetryEventSpan span = { m_ReplayEntries.data(), m_ReplayEntries.size(), 0 };
+        BuildMessages(span, client->Subscribed ? &client->Subscription : NULL, messages);
+    }
+
+    if (messages.empty()) {
+        client->Replaying = FALSE;
+        return;
+    }
 
-    if (m_PipeHandle == INVALID_HANDLE_VALUE) {
+    client->Queue.insert(client->Queue.end(), messages.begin(), messages.end());
+}
+
+//
+// Spooling
+// True while live events belong in the spool: nobody is connected, or a
+// replay has not caught up yet
+//
+BOOL NamedPipe::SpoolingLocked() const
+{
+    BOOL connected = FALSE;
+
+    if (!m_SpoolEnabled) {
         return FALSE;
     }
 
-    // Wait for client connection
-    BOOL connected = ConnectNamedPipe(m_PipeHandle, NULL) ?
-        TRUE : (GetLastError() == ERROR_PIPE_CONNECTED);
+    for (const auto& client : m_Clients) {
+        if (client->Closing || !client->Connected) {
+            continue;
+        }
+        if (client->Replaying) {
+            return TRUE;
+        }
+        connected = TRUE;
+    }
 
-    return connected;
+    return !connected;
 }
 
 //
-// Close Pipe
+// Close Client
+// Destroys the client once none of its I/O is outstanding
 //
-VOID NamedPipe::ClosePipe()
+VOID NamedPipe::CloseClientLocked(PipeClient* client)
 {
-    if (m_PipeHandle != INVALID_HANDLE_VALUE) {
-        DisconnectNamedPipe(m_PipeHandle);
-        CloseHandle(m_PipeHandle);
-        m_PipeHandle = INVALID_HANDLE_VALUE;
+    if (!client->Closing) {
+        client->Closing = TRUE;
+        if (!client->Connected) {
+            m_Listening = FALSE;
+        }
+        if (client->WriteIo.Pending || client->ReadIo.Pending) {
+            CancelIoEx(client->Pipe, NULL);
+        }
+    }
+
+    if (client->WriteIo.Pending || client->ReadIo.Pending) {
+        return;
     }
+
+    DisconnectNamedPipe(client->Pipe);
+    CloseHandle(client->Pipe);
+
+    m_Clients.remove_if([client](const std::unique_ptr<PipeClient>& entry) {
+        return entry.get() == client;
+    });
 }
 
 //
-// Send Telemetry
+// I/O Thread
 //
-BOOL NamedPipe::SendTelemetry(const std::vector<TELEMETRY_ENTRY>& events)
+VOID NamedPipe::IoThread()
 {
-    if (!m_IsInitialized) {
+    for (;;) {
+        DWORD bytes = 0;
+        ULONG_PTR key = 0;
+        LPOVERLAPPED overlapped = NULL;
+
+        BOOL success = GetQueuedCompletionStatus(m_CompletionPort, &bytes, &key, &overlapped, INFINITE);
+        DWORD error = success ? ERROR_SUCCESS : GetLastError();
+        if (key == QUIT_KEY || !overlapped) {
+            break;
+        }
+
+        PipeIo* io = CONTAINING_RECORD(overlapped, PipeIo, Overlapped);
+        PipeClient* client = io->Client;
+        std::lock_guard<std::mutex> lock(m_ClientsMutex);
+
+        io->Pending = FALSE;
+
+        if (client->Closing || m_Stopping) {
+            CloseClientLocked(client);
+        } else if (io == &client->ReadIo) {
+            CompleteReadLocked(client, success, error, bytes);
+        } else if (!success) {
+            CloseClientLocked(client);
+        } else if (!client->Connected) {
+            client->Connected = TRUE;
+            m_Listening = FALSE;
+            StartReadLocked(client);
+            BeginReplayLocked(client);
+        } else {
+            client->Queue.pop_front();
+            StartWriteLocked(client);
+        }
+
+        if (m_Stopping) {
+            if (m_Clients.empty()) {
+                break;
+            }
+        } else {
+            CreateListenerLocked();
+        }
+    }
+}
+
+//
+// Subscription Matches
+//
+BOOL NamedPipe::SubscriptionMatches(const TELEMETRY_SUBSCRIPTION& subscription, const TELEMETRY_ENTRY& entry)
+{
+    ULONG processId = 0;
+    const WCHAR* path = L"";
+
+    if (subscription.EventTypeMask != 0 &&
+        (entry.EventType >= EventMax ||
+         !(subscription.EventTypeMask & TELEMETRY_EVENT_MASK(entry.EventType)))) {
         return FALSE;
     }
 
-    // Create pipe instance if needed
-    if (m_PipeHandle == INVALID_HANDLE_VALUE) {
-        if (!CreatePipeInstance()) {
+    // every type listed and no default (C4062 at /W4), so a new one gets
+    // its fields here instead of silently missing every filtered
+    // subscriber; an out-of-range type only passes a subscription that
+    // filters on neither
+    switch (entry.EventType) {
+    case EventFileCreate:
+    case EventFileRead:
+    case EventFileWrite:
+    case EventFileDelete:
+        processId = entry.Data.FileEvent.ProcessId;
+        path = entry.Data.FileEvent.FilePath;
+        break;
+
+    case EventProcessCreate:
+    case EventProcessTerminate:
+    case EventProcessInjection:
+        processId = entry.Data.ProcessEvent.ProcessId;
+        path = entry.Data.ProcessEvent.ImagePath;
+        break;
+
+    case EventImageLoad:
+    case EventImageUnload:
+    case EventUnsignedDriverLoad:
+        processId = entry.Data.ImageEvent.ProcessId;
+        path = entry.Data.ImageEvent.ImagePath;
+        break;
+
+    case EventMax:
+        break;
+    }
+
+    if (subscription.ProcessIdCount > 0) {
+        BOOL found = FALSE;
+        for (ULONG i = 0; i < subscription.ProcessIdCount && !found; i++) {
+            found = (subscription.ProcessIds[i] == processId);
+        }
+        if (!found) {
+            return FALSE;
+        }
+    }
+
+    if (subscription.PathPrefix[0] != L'\0') {
+        size_t prefixLength = wcsnlen(subscription.PathPrefix, MAX_PATH_LENGTH);
+        if (_wcsnicmp(path, subscription.PathPrefix, prefixLength) != 0) {
             return FALSE;
         }
     }
 
-    // Send events
-    DWORD bytesWritten = 0;
+    return TRUE;
+}
+
+//
+// Build Messages
+// Pack the events that pass subscription (all of them if NULL) into as few
+// TELEMETRY_BATCH_HEADER messages as fit
+//
+VOID NamedPipe::BuildMessages(const TelemetryEventSpan& events, const TELEMETRY_SUBSCRIPTION* subscription,
+    std::vector<MessageBuffer>& messages)
+{
+    std::shared_ptr<std::vector<UCHAR>> message;
+    PTELEMETRY_BATCH_HEADER batch;
+
     for (const auto& entry : events) {
-        BOOL result = WriteFile(
-            m_PipeHandle,
-            &entry,
-            sizeof(TELEMETRY_ENTRY),
-            &bytesWritten,
-            NULL
-        );
+        if (subscription && !SubscriptionMatches(*subscription, entry)) {
+            continue;
+        }
+
+        if (!message || message->size() + TELEMETRY_RECORD_MAX_SIZE > TELEMETRY_PIPE_MESSAGE_BYTES) {
+            message = std::make_shared<std::vector<UCHAR>>();
+            message->reserve(TELEMETRY_PIPE_MESSAGE_BYTES);
+            message->resize(sizeof(TELEMETRY_BATCH_HEADER));
+            ((PTELEMETRY_BATCH_HEADER)message->data())->BytesUsed = sizeof(TELEMETRY_BATCH_HEADER);
+            messages.push_back(message);
+        }
+
+        size_t offset = message->size();
+        message->resize(offset + TELEMETRY_RECORD_MAX_SIZE);
+
+        ULONG recordSize = TelemetryRecordFromEntry(&entry, message->data() + offset, TELEMETRY_RECORD_MAX_SIZE);
+        message->resize(recordSize ? offset + TELEMETRY_RECORD_ALIGN(recordSize) : offset);
+        if (recordSize == 0) {
+            continue;
+        }
+
+        batch = (PTELEMETRY_BATCH_HEADER)message->data();
+        batch->Count++;
+        batch->BytesUsed = (ULONG)message->size();
+    }
+
+    // every record in the last one failed to encode
+    if (message && ((PTELEMETRY_BATCH_HEADER)message->data())->Count == 0) {
+        messages.pop_back();
+    }
+}
 
-        if (!result) {
-            DWORD error = GetLastError();
-            if (error == ERROR_NO_DATA || error == ERROR_BROKEN_PIPE) {
-                ClosePipe();
+//
+// Send Telemetry
+// Never blocks on subscribers; a full queue drops the message for that
+// subscriber only
+//
+BOOL NamedPipe::SendTelemetry(const TelemetryEventSpan& events)
+{
+    std::vector<ClientFilter> filters;
+    BOOL spooling;
+
+    if (!m_IsInitialized) {
+        return FALSE;
+    }
+
+    // snapshot the live subscriptions so encoding doesn't hold up the I/O
+    // thread; a replaying client gets these events from the spool later
+    {
+        std::lock_guard<std::mutex> lock(m_ClientsMutex);
+        for (const auto& client : m_Clients) {
+            if (client->Connected && !client->Closing && !client->Replaying) {
+                filters.push_back({ client->Id, client->Subscribed, client->Subscription, {} });
             }
-            return FALSE;
         }
+        spooling = SpoolingLocked();
+    }
+
+    if (filters.empty() && !spooling) {
+        // nobody to send to and nowhere to keep it
+        return TRUE;
+    }
+
+    // encode once per distinct subscription
+    for (size_t i = 0; i < filters.size(); i++) {
+        ClientFilter& filter = filters[i];
+        size_t same = 0;
+
+        for (; same < i; same++) {
+            if (filters[same].Subscribed == filter.Subscribed &&
+                (!filter.Subscribed ||
+                 memcmp(&filters[same].Subscription, &filter.Subscription, sizeof(TELEMETRY_SUBSCRIPTION)) == 0)) {
+                break;
+            }
+        }
+
+        if (same < i) {
+            filter.Messages = filters[same].Messages;
+        } else {
+            BuildMessages(events, filter.Subscribed ? &filter.Subscription : NULL, filter.Messages);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_ClientsMutex);
+
+    // decided again under the lock, so a replay that just caught up can't
+    // miss events appended behind it
+    if (SpoolingLocked()) {
+        m_Spool.Append(events);
+    }
+
+    for (auto it = m_Clients.begin(); it != m_Clients.end(); ) {
+        PipeClient* client = (it++)->get();
+        const ClientFilter* filter = NULL;
+
+        if (client->Replaying) {
+            StartWriteLocked(client);
+            continue;
+        }
+
+        for (const auto& candidate : filters) {
+            if (candidate.Id == client->Id) {
+                filter = &candidate;
+                break;
+            }
+        }
+
+        if (!filter || client->Closing) {
+            continue;
+        }
+
+        for (const auto& message : filter->Messages) {
+            if (client->Queue.size() >= MAX_QUEUED_MESSAGES) {
+                client->DroppedMessages++;
+                continue;
+            }
+            client->Queue.push_back(message);
+        }
+
+        StartWriteLocked(client);
     }
 
-    FlushFileBuffers(m_PipeHandle);
     return TRUE;
 }
-
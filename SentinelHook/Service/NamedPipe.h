@@ -5,24 +5,106 @@
 #pragma once
 
 #include <windows.h>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
 #include "..\Common\telemetry.h"
+#include "..\Common\record.h"
+#include "TelemetryAggregator.h"
+#include "TelemetrySpool.h"
 
+//
+// Overlapped telemetry pipe server
+// Any number of subscribers (up to MAX_CLIENTS) connect to the same pipe
+// name. Each SendTelemetry call packs its events into batch messages once
+// per distinct subscription and queues the buffers to the matching
+// subscribers; I/O completes on a completion port thread, so a slow reader
+// only fills its own queue.
+// While nobody is connected, events go to an on-disk spool instead. The
+// next subscriber to connect replays it before it sees live events; new
+// events keep going to the spool until that replay has caught up.
+//
 class NamedPipe {
 public:
     NamedPipe();
     ~NamedPipe();
 
-    BOOL Initialize();
+    BOOL Initialize();                  // the service's pipe and spool
+    BOOL Initialize(const std::wstring& pipeName, const std::wstring& spoolDirectory);
     VOID Shutdown();
-    BOOL SendTelemetry(const std::vector<TELEMETRY_ENTRY>& events);
+    BOOL SendTelemetry(const TelemetryEventSpan& events);
+
+    static const WCHAR* PIPE_NAME;
+    static std::wstring DefaultSpoolDirectory();        // empty if it can't be expanded
 
 private:
-    HANDLE m_PipeHandle;
+    typedef std::shared_ptr<const std::vector<UCHAR>> MessageBuffer;
+
+    struct PipeClient;
+
+    struct PipeIo {
+        OVERLAPPED Overlapped;
+        PipeClient* Client;
+        BOOL Pending;
+    };
+
+    struct PipeClient {
+        PipeIo WriteIo;                 // the connect, then one write at a time
+        PipeIo ReadIo;                  // subscription updates
+        HANDLE Pipe;
+        ULONG64 Id;
+        BOOL Connected;
+        BOOL Closing;                   // waiting for outstanding I/O to cancel
+        BOOL Subscribed;
+        BOOL DiscardingRead;            // rest of an oversized message
+        BOOL Replaying;                 // fed from the spool, not live
+        TELEMETRY_SUBSCRIPTION Subscription;
+        TELEMETRY_SUBSCRIPTION ReadBuffer;
+        std::deque<MessageBuffer> Queue;
+        ULONG64 DroppedMessages;
+    };
+
+    struct ClientFilter {
+        ULONG64 Id;
+        BOOL Subscribed;
+        TELEMETRY_SUBSCRIPTION Subscription;
+        std::vector<MessageBuffer> Messages;
+    };
+
+    HANDLE m_CompletionPort;
+    std::thread m_IoThread;
+    std::mutex m_ClientsMutex;
+    std::list<std::unique_ptr<PipeClient>> m_Clients;   // under m_ClientsMutex
+    ULONG64 m_NextClientId;                             // under m_ClientsMutex
+    BOOL m_Listening;                                   // under m_ClientsMutex
+    BOOL m_Stopping;                                    // under m_ClientsMutex
     BOOL m_IsInitialized;
-    static const WCHAR* PIPE_NAME;
+    TelemetrySpool m_Spool;                             // under m_ClientsMutex
+    BOOL m_SpoolEnabled;
+    std::vector<TELEMETRY_ENTRY> m_ReplayEntries;       // under m_ClientsMutex
+    std::wstring m_PipeName;
+    static const WCHAR* SPOOL_PARENT_DIRECTORY;
 
-    BOOL CreatePipeInstance();
-    VOID ClosePipe();
-};
+    static const size_t MAX_CLIENTS = 16;
+    static const size_t MAX_QUEUED_MESSAGES = 64;     // per client
+    static const size_t REPLAY_BATCH_EVENTS = 256;
+    static const ULONG_PTR QUIT_KEY = 1;
+
+    BOOL CreateListenerLocked();
+    VOID StartWriteLocked(PipeClient* client);
+    VOID StartReadLocked(PipeClient* client);
+    VOID CompleteReadLocked(PipeClient* client, BOOL success, DWORD error, DWORD bytes);
+    VOID CloseClientLocked(PipeClient* client);
+    VOID BeginReplayLocked(PipeClient* client);
+    VOID FillReplayLocked(PipeClient* client);
+    BOOL SpoolingLocked() const;
+    VOID IoThread();
 
+    static BOOL SubscriptionMatches(const TELEMETRY_SUBSCRIPTION& subscription, const TELEMETRY_ENTRY& entry);
+    static VOID BuildMessages(const TelemetryEventSpan& events, const TELEMETRY_SUBSCRIPTION* subscription,
+        std::vector<MessageBuffer>& messages);
+};
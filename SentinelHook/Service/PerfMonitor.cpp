@@ -0,0 +1,120 @@
+//
+// SentinelHook Service - Perf Monitor Implementation
+//
+
+#include "PerfMonitor.h"
+
+//
+// Constructor
+//
+PerfMonitor::PerfMonitor(DriverComm& driverComm, ETWProvider& etwProvider)
+    : m_DriverComm(driverComm)
+    , m_EtwProvider(etwProvider)
+    , m_DriverEnabled(FALSE)
+    , m_LastReport(0)
+    , m_Previous(new TELEMETRY_PERF_STATS())
+    , m_Current(new TELEMETRY_PERF_STATS())
+{
+}
+
+//
+// Destructor
+//
+PerfMonitor::~PerfMonitor()
+{
+    Shutdown();
+}
+
+//
+// Shutdown
+// Leaves the driver profiler off
+//
+VOID PerfMonitor::Shutdown()
+{
+    if (m_DriverEnabled) {
+        m_DriverComm.SetPerf(FALSE, FALSE);
+        m_DriverEnabled = FALSE;
+    }
+}
+
+//
+// Poll
+// Follows the ETW session state, reports once per interval
+//
+VOID PerfMonitor::Poll()
+{
+    ULONG64 now = GetTickCount64();
+    ULONG64 intervalMs = now - m_LastReport;
+
+    if (intervalMs < REPORT_INTERVAL_MS) {
+        return;
+    }
+
+    m_LastReport = now;
+
+    BOOL wanted = m_EtwProvider.IsPerfEnabled();
+    if (wanted != m_DriverEnabled) {
+        // a new session starts from empty histograms, the first report
+        // comes one interval later
+        if (m_DriverComm.SetPerf(wanted, wanted)) {
+            m_DriverEnabled = wanted;
+            ZeroMemory(m_Previous.get(), sizeof(TELEMETRY_PERF_STATS));
+        }
+        return;
+    }
+
+    if (m_DriverEnabled) {
+        Report(intervalMs);
+    }
+}
+
+//
+// Report
+//
+VOID PerfMonitor::Report(ULONG64 intervalMs)
+{
+    if (!m_DriverComm.GetPerf(m_Current.get()) || m_Current->Frequency == 0) {
+        return;
+    }
+
+    ULONG64 delta[PERF_HISTOGRAM_BUCKETS];
+
+    for (ULONG op = 0; op < PerfOpMax; op++) {
+        for (ULONG stage = 0; stage < PerfStageMax; stage++) {
+            const ULONG64* current = m_Current->Counts[op][stage];
+            const ULONG64* previous = m_Previous->Counts[op][stage];
+            ULONG64 total = 0;
+
+            for (ULONG i = 0; i < PERF_HISTOGRAM_BUCKETS; i++) {
+                // lower than last time means someone reset the driver's counts
+                delta[i] = current[i] >= previous[i] ? current[i] - previous[i] : current[i];
+                total += delta[i];
+            }
+
+            if (total == 0) {
+                continue;
+            }
+
+            PERF_COUNTERS_EVENT counters = {};
+            counters.Operation = op;
+            counters.Stage = stage;
+            counters.Count = total;
+            counters.P50Ns = TicksToNs(PerfHistogramPercentile(delta, total, 50000), m_Current->Frequency);
+            counters.P99Ns = TicksToNs(PerfHistogramPercentile(delta, total, 99000), m_Current->Frequency);
+            counters.P999Ns = TicksToNs(PerfHistogramPercentile(delta, total, 99900), m_Current->Frequency);
+            counters.IntervalMs = intervalMs;
+
+            m_EtwProvider.WritePerfCounters(counters);
+        }
+    }
+
+    m_Previous.swap(m_Current);
+}
+
+//
+// Ticks To Ns
+//
+ULONG64 PerfMonitor::TicksToNs(ULONG64 ticks, ULONG64 frequency)
+{
+    return (ticks / frequency) * 1000000000ULL + (ticks % frequency) * 1000000000ULL / frequency;
+}
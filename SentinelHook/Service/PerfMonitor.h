@@ -0,0 +1,43 @@
+//
+// SentinelHook Service - Perf Monitor Header
+//
+
+#pragma once
+
+#include <windows.h>
+#include <memory>
+#include "..\Common\telemetry.h"
+#include "..\Common\events.h"
+#include "DriverComm.h"
+#include "ETWProvider.h"
+
+//
+// Reports the driver's minifilter profiler as ETW counters
+// The profiler costs time on every file operation, so it only runs while
+// an ETW session has SENTINELHOOK_KEYWORD_PERF enabled. Every
+// REPORT_INTERVAL_MS the cumulative histograms are read, the previous
+// snapshot is subtracted, and p50/p99/p999 for each operation and stage
+// are written as a PERF_COUNTERS_EVENT. Called from the service loop only.
+//
+class PerfMonitor {
+public:
+    PerfMonitor(DriverComm& driverComm, ETWProvider& etwProvider);
+    ~PerfMonitor();
+
+    VOID Poll();
+    VOID Shutdown();
+
+private:
+    DriverComm& m_DriverComm;
+    ETWProvider& m_EtwProvider;
+    BOOL m_DriverEnabled;
+    ULONG64 m_LastReport;                               // GetTickCount64
+    std::unique_ptr<TELEMETRY_PERF_STATS> m_Previous;
+    std::unique_ptr<TELEMETRY_PERF_STATS> m_Current;
+
+    static const ULONG64 REPORT_INTERVAL_MS = 10000;
+
+    VOID Report(ULONG64 intervalMs);
+
+    static ULONG64 TicksToNs(ULONG64 ticks, ULONG64 frequency);
+};
@@ -5,7 +5,11 @@
 #include "DriverComm.h"
 #include "NamedPipe.h"
 #include "ETWProvider.h"
+#include "PerfMonitor.h"
 #include "TelemetryAggregator.h"
+#include "SinkPipeline.h"
+#include "SignatureVerifier.h"
+#include <stdio.h>
 
 #define SERVICE_NAME L"SentinelHookService"
 #define SERVICE_DISPLAY_NAME L"SentinelHook Telemetry Service"
@@ -117,12 +121,19 @@ VOID SentinelHookService::ServiceWorkerThread()
     NamedPipe namedPipe;
     ETWProvider etwProvider;
     TelemetryAggregator aggregator;
+    SignatureVerifier verifier(driverComm, aggregator);
+    PerfMonitor perfMonitor(driverComm, etwProvider);
 
     if (!driverComm.Initialize()) {
         ReportStatus(SERVICE_STOPPED, ERROR_SERVICE_SPECIFIC_ERROR, 0);
         return;
     }
 
+    if (!verifier.Initialize()) {
+        ReportStatus(SERVICE_STOPPED, ERROR_SERVICE_SPECIFIC_ERROR, 0);
+        return;
+    }
+
     if (!namedPipe.Initialize()) {
         ReportStatus(SERVICE_STOPPED, ERROR_SERVICE_SPECIFIC_ERROR, 0);
         return;
@@ -133,19 +144,79 @@ VOID SentinelHookService::ServiceWorkerThread()
         return;
     }
 
+    // correlation runs inline on this thread as part of ProcessEvents
+    aggregator.SetAlertCallback([](const CorrelationAlert& alert) {
+        static const WCHAR* ruleNames[RuleMax] = { L"temp-image-system-write", L"temp-parent-spawn", L"delete-burst" };
+        WCHAR line[MAX_PATH_LENGTH + 128];
+
+        swprintf_s(line, L"SentinelHook alert %s: pid=%lu ppid=%lu path=%.*s\n",
+            ruleNames[alert.Rule], alert.ProcessId, alert.ParentProcessId, MAX_PATH_LENGTH, alert.Path);
+        OutputDebugStringW(line);
+    });
+
+    // each sink drains the aggregator on its own thread: ETW is cheap and
+    // must see everything, a slow or absent pipe client is skipped ahead
+    // instead of stalling the driver drain
+    SinkPipeline sinks(aggregator);
+    sinks.AddSink(L"etw", SinkLossless,
+        [&etwProvider](const TelemetryEventSpan& events) { return etwProvider.WriteEvents(events); });
+    sinks.AddSink(L"pipe", SinkLossy,
+        [&namedPipe](const TelemetryEventSpan& events) { return namedPipe.SendTelemetry(events); });
+    // only queues the images the driver has no verdict for, never blocks
+    sinks.AddSink(L"verifier", SinkLossless,
+        [&verifier](const TelemetryEventSpan& events) { return verifier.QueueEvents(events); });
+
+    if (!sinks.Start()) {
+        ReportStatus(SERVICE_STOPPED, ERROR_SERVICE_SPECIFIC_ERROR, 0);
+        return;
+    }
+
+    // zero-copy ring mapping when the driver supports it, IOCTL drain otherwise
+    driverComm.MapTelemetry();
+
+    // lower index wins when several are signaled, so an alert is never
+    // mistaken for ordinary data
+    HANDLE waitHandles[3] = { m_StopEvent, driverComm.GetHighWaterEvent(), driverComm.GetDataEvent() };
+    DWORD waitCount = waitHandles[2] ? 3 : 1;
+
     // main loop
     while (m_IsRunning) {
-        DWORD waitResult = WaitForSingleObject(m_StopEvent, 1000);
-        if (waitResult == WAIT_OBJECT_0) {
-            break;
+        if (driverComm.PrepareWait()) {
+            DWORD waitResult = WaitForMultipleObjects(waitCount, waitHandles, FALSE, IDLE_POLL_MS);
+            if (waitResult == WAIT_OBJECT_0) {
+                break;
+            }
+
+            // ordinary data: let the burst build up so it drains in one
+            // pass. alerts and a filling ring end the delay early
+            if (waitResult == WAIT_OBJECT_0 + 2 && BATCH_DELAY_MS > 0) {
+                waitResult = WaitForMultipleObjects(2, waitHandles, FALSE, BATCH_DELAY_MS);
+                if (waitResult == WAIT_OBJECT_0) {
+                    break;
+                }
+            }
         }
 
-        driverComm.PollTelemetry();
+        driverComm.PollTelemetry(aggregator);
+        aggregator.FlushCoalesced(FALSE);
         aggregator.ProcessEvents();
-        etwProvider.WriteEvents(aggregator.GetEvents());
-        namedPipe.SendTelemetry(aggregator.GetEvents());
+
+        sinks.Notify();
+        aggregator.Reclaim();
+
+        // no-op unless a session asked for perf counters
+        perfMonitor.Poll();
     }
 
+    // best effort: hand the sinks whatever is still being coalesced
+    aggregator.FlushCoalesced(TRUE);
+    aggregator.ProcessEvents();
+    sinks.Notify();
+
+    // sink threads must be gone before the sinks they call into
+    sinks.Stop();
+    verifier.Shutdown();
+    perfMonitor.Shutdown();
     etwProvider.Shutdown();
     namedPipe.Shutdown();
     driverComm.Shutdown();
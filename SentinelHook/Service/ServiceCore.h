@@ -29,6 +29,13 @@ private:
     HANDLE m_StopEvent;
     BOOL m_IsRunning;
 
+    // without a mapped ring (IOCTL drain) the loop polls at IDLE_POLL_MS;
+    // otherwise it wakes on driver signals and waits up to BATCH_DELAY_MS
+    // for more data unless the high-water event fires (the wait rounds up to
+    // the timer resolution, alerts never pay it). 0 disables batching
+    static const DWORD IDLE_POLL_MS = 1000;
+    static const DWORD BATCH_DELAY_MS = 2;
+
     VOID ReportStatus(DWORD currentState, DWORD win32ExitCode, DWORD waitHint);
     VOID ServiceWorkerThread();
 };
@@ -0,0 +1,421 @@
+//
+// SentinelHook Service - Signature Verifier Implementation
+//
+
+#include "SignatureVerifier.h"
+#include <softpub.h>
+#include <mscat.h>
+
+//
+// Constructor
+//
+SignatureVerifier::SignatureVerifier(DriverComm& driverComm, TelemetryAggregator& aggregator)
+    : m_DriverComm(driverComm)
+    , m_Aggregator(aggregator)
+    , m_StopEvent(NULL)
+    , m_WakeEvent(NULL)
+    , m_DroppedRequests(0)
+    , m_IsInitialized(FALSE)
+{
+}
+
+//
+// Destructor
+//
+SignatureVerifier::~SignatureVerifier()
+{
+    Shutdown();
+}
+
+//
+// Initialize
+//
+BOOL SignatureVerifier::Initialize()
+{
+    if (m_IsInitialized) {
+        return TRUE;
+    }
+
+    m_StopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    m_WakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!m_StopEvent || !m_WakeEvent) {
+        Shutdown();
+        return FALSE;
+    }
+
+    m_Thread = std::thread(&SignatureVerifier::WorkerThread, this);
+    m_IsInitialized = TRUE;
+    return TRUE;
+}
+
+//
+// Shutdown
+// A verification in progress finishes, queued ones are dropped
+//
+VOID SignatureVerifier::Shutdown()
+{
+    if (m_Thread.joinable()) {
+        SetEvent(m_StopEvent);
+        m_Thread.join();
+    }
+
+    if (m_WakeEvent) {
+        CloseHandle(m_WakeEvent);
+        m_WakeEvent = NULL;
+    }
+
+    if (m_StopEvent) {
+        CloseHandle(m_StopEvent);
+        m_StopEvent = NULL;
+    }
+
+    m_Queue.clear();
+    m_QueuedPaths.clear();
+    m_IsInitialized = FALSE;
+}
+
+//
+// Queue Events
+// Sink callback, only picks out records the driver had no verdict for
+//
+BOOL SignatureVerifier::QueueEvents(const TelemetryEventSpan& events)
+{
+    for (const TELEMETRY_ENTRY& entry : events) {
+        switch (entry.EventType) {
+        case EventImageLoad:
+            if (entry.Data.ImageEvent.VerdictPending) {
+                QueueRequest(entry.Data.ImageEvent.VerdictEpoch, entry);
+            }
+            break;
+
+        case EventProcessCreate:
+        case EventProcessInjection:
+            if (entry.Data.ProcessEvent.VerdictPending) {
+                QueueRequest(entry.Data.ProcessEvent.VerdictEpoch, entry);
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    return TRUE;
+}
+
+//
+// Queue Request
+// One request per path at a time: loads of an image while it is being
+// verified get its verdict from the cache the next time around
+//
+VOID SignatureVerifier::QueueRequest(ULONG epoch, const TELEMETRY_ENTRY& entry)
+{
+    Request request;
+    request.Epoch = epoch;
+    request.Entry = entry;
+
+    const WCHAR* path = (entry.EventType == EventImageLoad) ?
+        entry.Data.ImageEvent.ImagePath : entry.Data.ProcessEvent.ImagePath;
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    if (m_QueuedPaths.count(path)) {
+        return;
+    }
+
+    if (m_Queue.size() >= MAX_QUEUED_REQUESTS) {
+        m_DroppedRequests++;
+        return;
+    }
+
+    m_QueuedPaths.insert(path);
+    m_Queue.push_back(request);
+    SetEvent(m_WakeEvent);
+}
+
+//
+// Worker Thread
+//
+VOID SignatureVerifier::WorkerThread()
+{
+    HANDLE waitHandles[2] = { m_StopEvent, m_WakeEvent };
+
+    for (;;) {
+        if (WaitForMultipleObjects(2, waitHandles, FALSE, INFINITE) == WAIT_OBJECT_0) {
+            break;
+        }
+
+        for (;;) {
+            Request request;
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                if (m_Queue.empty()) {
+                    break;
+                }
+                request = m_Queue.front();
+                m_Queue.pop_front();
+            }
+
+            const WCHAR* path = (request.Entry.EventType == EventImageLoad) ?
+                request.Entry.Data.ImageEvent.ImagePath : request.Entry.Data.ProcessEvent.ImagePath;
+            FileIdentity identity = {};
+            ULONG verdict = Verify(request, path, identity);
+
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                m_QueuedPaths.erase(path);
+            }
+
+            Complete(request, identity, verdict);
+
+            if (WaitForSingleObject(m_StopEvent, 0) == WAIT_OBJECT_0) {
+                return;
+            }
+        }
+    }
+}
+
+//
+// Verify
+// The driver reports NT paths, which GLOBALROOT lets us open as-is. The
+// verdict is for whatever file is at the path now, identified by the
+// handle; a change during the check, or a file the driver can't track,
+// is not cached
+//
+ULONG SignatureVerifier::Verify(const Request& request, const WCHAR* ntPath, FileIdentity& identity)
+{
+    if (ntPath[0] != L'\\') {
+        return IMAGE_VERDICT_UNKNOWN;
+    }
+
+    std::wstring path(L"\\\\?\\GLOBALROOT");
+    path += ntPath;
+
+    HANDLE file = CreateFileW(
+        path.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL
+    );
+
+    if (file == INVALID_HANDLE_VALUE) {
+        return IMAGE_VERDICT_UNKNOWN;
+    }
+
+    if (!QueryIdentity(file, identity)) {
+        CloseHandle(file);
+        return IMAGE_VERDICT_UNKNOWN;
+    }
+
+    if (request.Epoch != 0) {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        // known here but evicted from the driver's table
+        auto it = m_Verdicts.find(identity);
+        if (it != m_Verdicts.end()) {
+            CloseHandle(file);
+            return it->second;
+        }
+    }
+
+    ULONG verdict = VerifyFile(file, path.c_str());
+
+    FileIdentity after = {};
+    if (!QueryIdentity(file, after) || !(after == identity)) {
+        verdict = IMAGE_VERDICT_UNKNOWN;
+    }
+
+    CloseHandle(file);
+
+    if (verdict != IMAGE_VERDICT_UNKNOWN && request.Epoch != 0) {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        if (m_Verdicts.size() >= MAX_CACHED_VERDICTS) {
+            m_Verdicts.clear();
+        }
+        m_Verdicts[identity] = verdict;
+    }
+
+    return verdict;
+}
+
+//
+// Complete
+// Pushes the verdict to the driver and raises the alert the driver could
+// not raise itself
+//
+VOID SignatureVerifier::Complete(const Request& request, const FileIdentity& identity, ULONG verdict)
+{
+    if (verdict == IMAGE_VERDICT_UNKNOWN) {
+        return;
+    }
+
+    // the driver refuses it if the file changed since the load
+    if (request.Epoch != 0) {
+        TELEMETRY_IMAGE_VERDICT update = {};
+        update.FileId = identity.FileId;
+        update.LastWriteTime = identity.LastWriteTime;
+        update.VolumeSerial = identity.VolumeSerial;
+        update.Epoch = request.Epoch;
+        update.Verdict = verdict;
+        m_DriverComm.SetImageVerdict(update);
+    }
+
+    if (verdict == IMAGE_VERDICT_UNSIGNED && request.Entry.EventType == EventImageLoad &&
+        request.Entry.Data.ImageEvent.IsDriver) {
+        TELEMETRY_ENTRY alert = request.Entry;
+        alert.EventType = EventUnsignedDriverLoad;
+        alert.Data.ImageEvent.EventType = EventUnsignedDriverLoad;
+        alert.Data.ImageEvent.IsSigned = FALSE;
+        alert.Data.ImageEvent.VerdictPending = FALSE;
+        m_Aggregator.AddEvent(alert);
+    }
+}
+
+//
+// Query Identity
+// The fields the driver keys its cache by, see TELEMETRY_IMAGE_VERDICT
+//
+BOOL SignatureVerifier::QueryIdentity(HANDLE file, FileIdentity& identity)
+{
+    BY_HANDLE_FILE_INFORMATION info;
+
+    if (!GetFileInformationByHandle(file, &info)) {
+        return FALSE;
+    }
+
+    identity.FileId = ((ULONG64)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+    identity.LastWriteTime = ((LONG64)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+    identity.VolumeSerial = info.dwVolumeSerialNumber;
+    return TRUE;
+}
+
+//
+// Verify File
+//
+ULONG SignatureVerifier::VerifyFile(HANDLE file, const WCHAR* path)
+{
+    // most system binaries are catalog signed rather than embedded
+    LONG status = VerifyEmbedded(file, path);
+    if (status == TRUST_E_NOSIGNATURE) {
+        status = VerifyCatalog(file, path);
+    }
+
+    if (status == ERROR_SUCCESS) {
+        return IMAGE_VERDICT_SIGNED;
+    }
+
+    // the check itself failed, try again on a later load
+    if (HRESULT_FACILITY(status) == FACILITY_WIN32 || status == TRUST_E_PROVIDER_UNKNOWN ||
+        status == TRUST_E_ACTION_UNKNOWN || status == TRUST_E_SUBJECT_FORM_UNKNOWN) {
+        return IMAGE_VERDICT_UNKNOWN;
+    }
+
+    return IMAGE_VERDICT_UNSIGNED;
+}
+
+//
+// Verify Embedded
+//
+LONG SignatureVerifier::VerifyEmbedded(HANDLE file, const WCHAR* path)
+{
+    WINTRUST_FILE_INFO fileInfo = {};
+    fileInfo.cbStruct = sizeof(fileInfo);
+    fileInfo.pcwszFilePath = path;
+    fileInfo.hFile = file;
+
+    WINTRUST_DATA data = {};
+    data.dwUnionChoice = WTD_CHOICE_FILE;
+    data.pFile = &fileInfo;
+
+    return RunWinVerifyTrust(data);
+}
+
+//
+// Verify Catalog
+// TRUST_E_NOSIGNATURE when no installed catalog lists the file's hash
+//
+LONG SignatureVerifier::VerifyCatalog(HANDLE file, const WCHAR* path)
+{
+    HCATADMIN admin = NULL;
+
+    if (!CryptCATAdminAcquireContext2(&admin, NULL, BCRYPT_SHA256_ALGORITHM, NULL, 0)) {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    BYTE hash[64];
+    DWORD hashSize = sizeof(hash);
+    if (!CryptCATAdminCalcHashFromFileHandle2(admin, file, &hashSize, hash, 0)) {
+        LONG status = HRESULT_FROM_WIN32(GetLastError());
+        CryptCATAdminReleaseContext(admin, 0);
+        return status;
+    }
+
+    LONG status = TRUST_E_NOSIGNATURE;
+    HCATINFO catalog = CryptCATAdminEnumCatalogFromHash(admin, hash, hashSize, 0, NULL);
+
+    if (catalog) {
+        CATALOG_INFO info = {};
+        info.cbStruct = sizeof(info);
+
+        if (CryptCATCatalogInfoFromContext(catalog, &info, 0)) {
+            // catalog members are tagged with the hex hash
+            static const WCHAR hexDigits[] = L"0123456789ABCDEF";
+            WCHAR memberTag[sizeof(hash) * 2 + 1];
+            for (DWORD i = 0; i < hashSize; i++) {
+                memberTag[i * 2] = hexDigits[hash[i] >> 4];
+                memberTag[i * 2 + 1] = hexDigits[hash[i] & 0xF];
+            }
+            memberTag[hashSize * 2] = L'\0';
+
+            WINTRUST_CATALOG_INFO catalogInfo = {};
+            catalogInfo.cbStruct = sizeof(catalogInfo);
+            catalogInfo.pcwszCatalogFilePath = info.wszCatalogFile;
+            catalogInfo.pcwszMemberTag = memberTag;
+            catalogInfo.pcwszMemberFilePath = path;
+            catalogInfo.hMemberFile = file;
+            catalogInfo.pbCalculatedFileHash = hash;
+            catalogInfo.cbCalculatedFileHash = hashSize;
+            catalogInfo.hCatAdmin = admin;
+
+            WINTRUST_DATA data = {};
+            data.dwUnionChoice = WTD_CHOICE_CATALOG;
+            data.pCatalog = &catalogInfo;
+
+            status = RunWinVerifyTrust(data);
+        } else {
+            status = HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        CryptCATAdminReleaseCatalogContext(admin, catalog, 0);
+    }
+
+    CryptCATAdminReleaseContext(admin, 0);
+    return status;
+}
+
+//
+// Run WinVerifyTrust
+// No UI and no network: revocation is skipped and only cached URL
+// retrievals are used, so a verification never waits on a server
+//
+LONG SignatureVerifier::RunWinVerifyTrust(WINTRUST_DATA& data)
+{
+    GUID action = WINTRUST_ACTION_GENERIC_VERIFY_V2;
+
+    data.cbStruct = sizeof(data);
+    data.dwUIChoice = WTD_UI_NONE;
+    data.fdwRevocationChecks = WTD_REVOKE_NONE;
+    data.dwProvFlags = WTD_CACHE_ONLY_URL_RETRIEVAL;
+    data.dwStateAction = WTD_STATEACTION_VERIFY;
+
+    LONG status = WinVerifyTrust((HWND)INVALID_HANDLE_VALUE, &action, &data);
+
+    data.dwStateAction = WTD_STATEACTION_CLOSE;
+    WinVerifyTrust((HWND)INVALID_HANDLE_VALUE, &action, &data);
+
+    return status;
+}
@@ -0,0 +1,93 @@
+//
+// SentinelHook Service - Signature Verifier Header
+//
+
+#pragma once
+
+#include <windows.h>
+#include <wintrust.h>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include "..\Common\telemetry.h"
+#include "DriverComm.h"
+#include "TelemetryAggregator.h"
+
+//
+// Asynchronous Authenticode verification for images the driver has no
+// verdict for
+// Runs as a sink: pending image loads and process creates are queued and
+// verified on a worker thread (embedded signature, then the system
+// catalogs), and the verdict is pushed to the driver's cache so the next
+// load of the same image is a lookup. A verdict is bound to the identity
+// of the handle that was verified (volume serial, file index, last write
+// time), read before and after the check, never to the path the record
+// named. Verdicts are also kept here, keyed the same way, so an image
+// evicted from the driver's table is answered without another chain
+// validation; records the driver can't track writes for (VerdictEpoch 0)
+// are verified every time. An unsigned driver is reported by adding an
+// EventUnsignedDriverLoad entry to the aggregator.
+//
+class SignatureVerifier {
+public:
+    SignatureVerifier(DriverComm& driverComm, TelemetryAggregator& aggregator);
+    ~SignatureVerifier();
+
+    BOOL Initialize();
+    VOID Shutdown();
+    BOOL QueueEvents(const TelemetryEventSpan& events);
+
+private:
+    struct Request {
+        ULONG Epoch;                    // VerdictEpoch of the record
+        TELEMETRY_ENTRY Entry;
+    };
+
+    struct FileIdentity {
+        ULONG64 FileId;
+        LONG64 LastWriteTime;
+        ULONG VolumeSerial;
+
+        bool operator==(const FileIdentity& other) const {
+            return FileId == other.FileId && LastWriteTime == other.LastWriteTime &&
+                VolumeSerial == other.VolumeSerial;
+        }
+    };
+
+    struct FileIdentityHash {
+        size_t operator()(const FileIdentity& identity) const {
+            return std::hash<ULONG64>()(identity.FileId ^ ((ULONG64)identity.VolumeSerial << 32) ^
+                (ULONG64)identity.LastWriteTime);
+        }
+    };
+
+    DriverComm& m_DriverComm;
+    TelemetryAggregator& m_Aggregator;
+    HANDLE m_StopEvent;
+    HANDLE m_WakeEvent;
+    std::thread m_Thread;
+    std::mutex m_Mutex;
+    std::deque<Request> m_Queue;                        // under m_Mutex
+    std::unordered_set<std::wstring> m_QueuedPaths;     // under m_Mutex, queued or being verified
+    // verified files, SIGNED or UNSIGNED
+    std::unordered_map<FileIdentity, ULONG, FileIdentityHash> m_Verdicts;   // under m_Mutex
+    ULONG64 m_DroppedRequests;                          // under m_Mutex
+    BOOL m_IsInitialized;
+
+    static const size_t MAX_QUEUED_REQUESTS = 256;
+    static const size_t MAX_CACHED_VERDICTS = 16384;
+
+    VOID QueueRequest(ULONG epoch, const TELEMETRY_ENTRY& entry);
+    VOID WorkerThread();
+    ULONG Verify(const Request& request, const WCHAR* ntPath, FileIdentity& identity);
+    VOID Complete(const Request& request, const FileIdentity& identity, ULONG verdict);
+
+    static BOOL QueryIdentity(HANDLE file, FileIdentity& identity);
+    static ULONG VerifyFile(HANDLE file, const WCHAR* path);
+    static LONG VerifyEmbedded(HANDLE file, const WCHAR* path);
+    static LONG VerifyCatalog(HANDLE file, const WCHAR* path);
+    static LONG RunWinVerifyTrust(WINTRUST_DATA& data);
+};
@@ -0,0 +1,200 @@
+//
+// SentinelHook Service - Sink Pipeline Implementation
+//
+
+#include "SinkPipeline.h"
+#include <stdio.h>
+
+//
+// Constructor
+//
+SinkPipeline::SinkPipeline(TelemetryAggregator& aggregator)
+    : m_Aggregator(aggregator)
+    , m_StopEvent(NULL)
+    , m_IsRunning(FALSE)
+{
+}
+
+//
+// Destructor
+//
+SinkPipeline::~SinkPipeline()
+{
+    Stop();
+
+    for (auto& sink : m_Sinks) {
+        if (sink->WakeEvent) {
+            CloseHandle(sink->WakeEvent);
+        }
+    }
+
+    if (m_StopEvent) {
+        CloseHandle(m_StopEvent);
+    }
+}
+
+//
+// Add Sink
+// Only before Start
+//
+BOOL SinkPipeline::AddSink(const std::wstring& name, TelemetrySinkPolicy policy, SinkCallback callback)
+{
+    if (m_IsRunning) {
+        return FALSE;
+    }
+
+    std::unique_ptr<Sink> sink(new Sink());
+    sink->Name = name;
+    sink->Callback = callback;
+    sink->Cursor = m_Aggregator.RegisterSink(policy);
+    if (!sink->Cursor) {
+        return FALSE;
+    }
+
+    // auto-reset, one Notify covers everything published before it
+    sink->WakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!sink->WakeEvent) {
+        return FALSE;
+    }
+
+    if (policy == SinkLossy) {
+        sink->Batch.reserve(MAX_BATCH_EVENTS);
+    }
+
+    m_Sinks.push_back(std::move(sink));
+    return TRUE;
+}
+
+//
+// Start
+//
+BOOL SinkPipeline::Start()
+{
+    if (m_IsRunning) {
+        return TRUE;
+    }
+
+    m_StopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!m_StopEvent) {
+        return FALSE;
+    }
+
+    m_IsRunning = TRUE;
+    for (auto& sink : m_Sinks) {
+        sink->Thread = std::thread(&SinkPipeline::SinkThread, this, sink.get());
+    }
+
+    return TRUE;
+}
+
+//
+// Stop
+// Sinks finish the batch they are on, anything still queued is left
+//
+VOID SinkPipeline::Stop()
+{
+    if (!m_IsRunning) {
+        return;
+    }
+
+    SetEvent(m_StopEvent);
+    for (auto& sink : m_Sinks) {
+        if (sink->Thread.joinable()) {
+            sink->Thread.join();
+        }
+    }
+
+    m_IsRunning = FALSE;
+    LogSinkStats();
+}
+
+//
+// Notify
+// Called by the drain loop after it has published events
+//
+VOID SinkPipeline::Notify()
+{
+    for (auto& sink : m_Sinks) {
+        SetEvent(sink->WakeEvent);
+    }
+}
+
+//
+// Log Sink Stats
+//
+VOID SinkPipeline::LogSinkStats() const
+{
+    WCHAR line[256];
+
+    for (const auto& sink : m_Sinks) {
+        TelemetrySinkStats stats;
+        m_Aggregator.GetSinkStats(sink->Cursor, stats);
+
+        swprintf_s(line, L"SentinelHook sink %s: delivered=%llu dropped=%llu lag=%llu\n",
+            sink->Name.c_str(), stats.Delivered, stats.Dropped, stats.Lag);
+        OutputDebugStringW(line);
+    }
+}
+
+//
+// Get Sink Stats
+//
+BOOL SinkPipeline::GetSinkStats(const std::wstring& name, TelemetrySinkStats& stats) const
+{
+    for (const auto& sink : m_Sinks) {
+        if (sink->Name == name) {
+            m_Aggregator.GetSinkStats(sink->Cursor, stats);
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+//
+// Sink Thread
+//
+VOID SinkPipeline::SinkThread(Sink* sink)
+{
+    HANDLE waitHandles[2] = { m_StopEvent, sink->WakeEvent };
+
+    for (;;) {
+        // the timeout is a backstop for producers that never call Notify
+        DWORD waitResult = WaitForMultipleObjects(2, waitHandles, FALSE, IDLE_WAIT_MS);
+        if (waitResult == WAIT_OBJECT_0) {
+            break;
+        }
+
+        DeliverBatch(sink);
+    }
+}
+
+//
+// Deliver Batch
+// Drain everything currently visible to this sink
+//
+VOID SinkPipeline::DeliverBatch(Sink* sink)
+{
+    TelemetryEventSpan span;
+
+    while (m_Aggregator.AcquireEvents(sink->Cursor, span, MAX_BATCH_EVENTS)) {
+        if (sink->Cursor->Policy == SinkLossless) {
+            // read in place, the slots can't be reused until we release them
+            sink->Callback(span);
+            m_Aggregator.ReleaseEvents(sink->Cursor, span);
+        } else {
+            // copy out first so a slow sink never pins ring slots
+            sink->Batch.assign(span.begin(), span.end());
+            if (m_Aggregator.ReleaseEvents(sink->Cursor, span)) {
+                TelemetryEventSpan copy = { sink->Batch.data(), sink->Batch.size(), span.Position };
+                sink->Callback(copy);
+            }
+        }
+
+        m_Aggregator.Reclaim();
+
+        if (WaitForSingleObject(m_StopEvent, 0) == WAIT_OBJECT_0) {
+            break;
+        }
+    }
+}
@@ -0,0 +1,51 @@
+//
+// SentinelHook Service - Sink Pipeline Header
+// One consumer thread per telemetry sink, each with its own cursor into
+// the aggregator ring
+//
+
+#pragma once
+
+#include <windows.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "TelemetryAggregator.h"
+
+class SinkPipeline {
+public:
+    typedef std::function<BOOL(const TelemetryEventSpan& events)> SinkCallback;
+
+    explicit SinkPipeline(TelemetryAggregator& aggregator);
+    ~SinkPipeline();
+
+    BOOL AddSink(const std::wstring& name, TelemetrySinkPolicy policy, SinkCallback callback);
+    BOOL Start();
+    VOID Stop();
+    VOID Notify();
+    VOID LogSinkStats() const;
+    BOOL GetSinkStats(const std::wstring& name, TelemetrySinkStats& stats) const;
+
+private:
+    struct Sink {
+        std::wstring Name;
+        SinkCallback Callback;
+        TelemetrySinkCursor* Cursor;
+        HANDLE WakeEvent;
+        std::thread Thread;
+        std::vector<TELEMETRY_ENTRY> Batch;     // lossy sinks only
+    };
+
+    TelemetryAggregator& m_Aggregator;
+    std::vector<std::unique_ptr<Sink>> m_Sinks;
+    HANDLE m_StopEvent;
+    BOOL m_IsRunning;
+
+    static const size_t MAX_BATCH_EVENTS = 256;
+    static const DWORD IDLE_WAIT_MS = 1000;
+
+    VOID SinkThread(Sink* sink);
+    VOID DeliverBatch(Sink* sink);
+};
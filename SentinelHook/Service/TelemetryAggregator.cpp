@@ -8,8 +8,19 @@
 // Constructor
 //
 TelemetryAggregator::TelemetryAggregator()
+    : m_Events(new TELEMETRY_ENTRY[MAX_EVENTS])
+    , m_Sequences(new std::atomic<size_t>[MAX_EVENTS])
+    , m_EnqueuePos(0)
+    , m_DroppedEvents(0)
+    , m_SinkCount(0)
+    , m_ReleasePos(0)
+    , m_Coalescer([this](const TELEMETRY_ENTRY& entry) { AddEvent(entry); })
 {
-    m_Events.reserve(MAX_EVENTS);
+    for (size_t i = 0; i < MAX_EVENTS; i++) {
+        m_Sequences[i].store(i, std::memory_order_relaxed);
+    }
+
+    m_CorrelationCursor = RegisterSink(SinkLossless);
 }
 
 //
@@ -17,22 +28,55 @@ TelemetryAggregator::TelemetryAggregator()
 //
 TelemetryAggregator::~TelemetryAggregator()
 {
-    ClearEvents();
 }
 
 //
 // Add Event
+// Safe from any number of threads; returns FALSE if the ring was full
 //
-VOID TelemetryAggregator::AddEvent(const TELEMETRY_ENTRY& entry)
+BOOL TelemetryAggregator::AddEvent(const TELEMETRY_ENTRY& entry)
 {
-    std::lock_guard<std::mutex> lock(m_EventsMutex);
+    size_t pos = m_EnqueuePos.load(std::memory_order_relaxed);
 
-    if (m_Events.size() >= MAX_EVENTS) {
-        // Remove oldest event (FIFO)
-        m_Events.erase(m_Events.begin());
+    for (;;) {
+        size_t sequence = m_Sequences[pos & INDEX_MASK].load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (m_EnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // slowest sink is a full lap behind, drop rather than wait
+            m_DroppedEvents.fetch_add(1, std::memory_order_relaxed);
+            return FALSE;
+        } else {
+            pos = m_EnqueuePos.load(std::memory_order_relaxed);
+        }
     }
 
-    m_Events.push_back(entry);
+    m_Events[pos & INDEX_MASK] = entry;
+    m_Sequences[pos & INDEX_MASK].store(pos + 1, std::memory_order_release);
+    return TRUE;
+}
+
+//
+// Submit Event
+// Drain thread entry point: repeated file operations are folded before
+// they take a ring slot
+//
+VOID TelemetryAggregator::SubmitEvent(const TELEMETRY_ENTRY& entry)
+{
+    m_Coalescer.Submit(entry);
+}
+
+//
+// Flush Coalesced
+// Drain thread, after each poll; all on shutdown
+//
+VOID TelemetryAggregator::FlushCoalesced(BOOL all)
+{
+    m_Coalescer.Flush(all);
 }
 
 //
@@ -40,31 +84,157 @@ VOID TelemetryAggregator::AddEvent(const TELEMETRY_ENTRY& entry)
 //
 VOID TelemetryAggregator::ProcessEvents()
 {
-    std::lock_guard<std::mutex> lock(m_EventsMutex);
-
-    // Process events for correlation, filtering, etc.
-    // In real implementation, would perform:
-    // - Event correlation
-    // - Anomaly detection
-    // - Pattern matching
-    // - Behavior modeling
+    TelemetryEventSpan span;
+
+    // the engine reads in place, each event costs a hash lookup or two
+    while (AcquireEvents(m_CorrelationCursor, span, MAX_CORRELATION_BATCH)) {
+        for (const TELEMETRY_ENTRY& entry : span) {
+            m_Correlation.ProcessEvent(entry);
+        }
+        ReleaseEvents(m_CorrelationCursor, span);
+    }
 }
 
 //
-// Get Events
+// Set Alert Callback
+// Runs on the thread that calls ProcessEvents
 //
-std::vector<TELEMETRY_ENTRY> TelemetryAggregator::GetEvents()
+VOID TelemetryAggregator::SetAlertCallback(CorrelationEngine::AlertCallback callback)
 {
-    std::lock_guard<std::mutex> lock(m_EventsMutex);
-    return m_Events;
+    m_Correlation.SetAlertCallback(callback);
 }
 
 //
-// Clear Events
+// Register Sink
+// Must be called before producers or other sinks start. The cursor starts
+// at the current end of the ring and lives as long as the aggregator.
 //
-VOID TelemetryAggregator::ClearEvents()
+TelemetrySinkCursor* TelemetryAggregator::RegisterSink(TelemetrySinkPolicy policy)
 {
-    std::lock_guard<std::mutex> lock(m_EventsMutex);
-    m_Events.clear();
+    if (m_SinkCount >= MAX_SINKS) {
+        return nullptr;
+    }
+
+    TelemetrySinkCursor* sink = &m_Sinks[m_SinkCount++];
+    sink->Policy = policy;
+    sink->Position.store(m_EnqueuePos.load(std::memory_order_acquire), std::memory_order_release);
+    sink->Delivered.store(0, std::memory_order_relaxed);
+    sink->Dropped.store(0, std::memory_order_relaxed);
+    return sink;
 }
 
+//
+// Acquire Events
+// Called by the sink's own thread. Returns up to maxCount published events
+// from the sink's position without wrapping, or FALSE if there are none.
+// A lossless sink's span stays valid until ReleaseEvents; a lossy sink must
+// copy it out and treat a FALSE from ReleaseEvents as "discard the copy".
+//
+BOOL TelemetryAggregator::AcquireEvents(TelemetrySinkCursor* sink, TelemetryEventSpan& span, size_t maxCount)
+{
+    size_t pos = sink->Position.load(std::memory_order_acquire);
+    size_t first = pos & INDEX_MASK;
+    size_t limit = min(MAX_EVENTS - first, maxCount);
+    size_t count = 0;
+
+    // stops at the first slot a producer has claimed but not yet filled
+    while (count < limit &&
+           m_Sequences[first + count].load(std::memory_order_acquire) == pos + count + 1) {
+        count++;
+    }
+
+    span.Events = &m_Events[first];
+    span.Count = count;
+    span.Position = pos;
+    return count > 0;
+}
+
+//
+// Release Events
+// Advance the sink past an acquired span. Returns FALSE if a lossy sink was
+// skipped ahead meanwhile; those events are already counted as dropped.
+//
+BOOL TelemetryAggregator::ReleaseEvents(TelemetrySinkCursor* sink, const TelemetryEventSpan& span)
+{
+    size_t expected = span.Position;
+
+    if (!sink->Position.compare_exchange_strong(expected, span.Position + span.Count,
+            std::memory_order_acq_rel)) {
+        return FALSE;
+    }
+
+    sink->Delivered.fetch_add(span.Count, std::memory_order_relaxed);
+    return TRUE;
+}
+
+//
+// Reclaim
+// Hand slots every sink has passed back to the producers, skipping lossy
+// sinks that lag too far. Cheap, called by each sink after a batch and by
+// the drain loop.
+//
+VOID TelemetryAggregator::Reclaim()
+{
+    std::lock_guard<std::mutex> lock(m_ReclaimMutex);
+
+    size_t head = m_EnqueuePos.load(std::memory_order_acquire);
+    size_t limit = head;
+
+    for (size_t i = 0; i < m_SinkCount; i++) {
+        TelemetrySinkCursor* sink = &m_Sinks[i];
+        size_t pos = sink->Position.load(std::memory_order_acquire);
+
+        if (sink->Policy == SinkLossy && head - pos > LOSSY_SINK_MAX_LAG) {
+            size_t target = head - LOSSY_SINK_MAX_LAG;
+            // on failure pos is the sink's newer position, try again next time
+            if (sink->Position.compare_exchange_strong(pos, target, std::memory_order_acq_rel)) {
+                sink->Dropped.fetch_add(target - pos, std::memory_order_relaxed);
+                pos = target;
+            }
+        }
+
+        if (head - pos > head - limit) {
+            limit = pos;
+        }
+    }
+
+    for (; m_ReleasePos != limit; m_ReleasePos++) {
+        std::atomic<size_t>& sequence = m_Sequences[m_ReleasePos & INDEX_MASK];
+
+        // claimed but not yet published, only possible near head
+        if (sequence.load(std::memory_order_acquire) != m_ReleasePos + 1) {
+            break;
+        }
+        sequence.store(m_ReleasePos + MAX_EVENTS, std::memory_order_release);
+    }
+}
+
+//
+// Get Sink Stats
+//
+VOID TelemetryAggregator::GetSinkStats(const TelemetrySinkCursor* sink, TelemetrySinkStats& stats) const
+{
+    size_t head = m_EnqueuePos.load(std::memory_order_relaxed);
+    size_t pos = sink->Position.load(std::memory_order_relaxed);
+
+    stats.Delivered = sink->Delivered.load(std::memory_order_relaxed);
+    stats.Dropped = sink->Dropped.load(std::memory_order_relaxed);
+    stats.Lag = (ULONG64)(head - pos);
+}
+
+//
+// Get Dropped Events
+//
+ULONG64 TelemetryAggregator::GetDroppedEvents() const
+{
+    return m_DroppedEvents.load(std::memory_order_relaxed);
+}
+
+//
+// Get Coalesced Events
+// Operations folded into an earlier entry; drain thread only
+//
+ULONG64 TelemetryAggregator::GetCoalescedEvents() const
+{
+    return m_Coalescer.GetFoldedEvents();
+}
@@ -5,23 +5,108 @@
 #pragma once
 
 #include <windows.h>
-#include <vector>
+#include <atomic>
+#include <memory>
 #include <mutex>
 #include "..\Common\telemetry.h"
+#include "CorrelationEngine.h"
+#include "EventCoalescer.h"
 
+//
+// Contiguous run of events owned by a sink between AcquireEvents and
+// ReleaseEvents
+//
+struct TelemetryEventSpan {
+    const TELEMETRY_ENTRY* Events;
+    size_t Count;
+    size_t Position;        // ring position of Events[0]
+
+    const TELEMETRY_ENTRY* begin() const { return Events; }
+    const TELEMETRY_ENTRY* end() const { return Events + Count; }
+    size_t size() const { return Count; }
+    bool empty() const { return Count == 0; }
+};
+
+//
+// What happens when a sink falls behind
+//
+enum TelemetrySinkPolicy {
+    // events stay in the ring until the sink has seen them; once it is a
+    // full lap behind, producers drop new events
+    SinkLossless,
+    // the sink copies each batch out, and is skipped ahead (its events
+    // counted as dropped) when it lags more than LOSSY_SINK_MAX_LAG
+    SinkLossy
+};
+
+//
+// Per-sink read position into the ring
+//
+struct TelemetrySinkCursor {
+    TelemetrySinkPolicy Policy;
+    alignas(64) std::atomic<size_t> Position;   // next event this sink reads
+    std::atomic<ULONG64> Delivered;
+    std::atomic<ULONG64> Dropped;
+};
+
+struct TelemetrySinkStats {
+    ULONG64 Delivered;
+    ULONG64 Dropped;
+    ULONG64 Lag;            // events published but not yet read
+};
+
+//
+// Bounded multi-producer event ring with one cursor per sink
+// Producers claim a slot with one CAS and never block; when the ring is
+// full the new event is dropped and counted. Sinks read events in place
+// and a slot is reused once every cursor has moved past it.
+//
 class TelemetryAggregator {
 public:
     TelemetryAggregator();
     ~TelemetryAggregator();
 
-    VOID AddEvent(const TELEMETRY_ENTRY& entry);
+    BOOL AddEvent(const TELEMETRY_ENTRY& entry);
+    VOID SubmitEvent(const TELEMETRY_ENTRY& entry);
+    VOID FlushCoalesced(BOOL all);
     VOID ProcessEvents();
-    std::vector<TELEMETRY_ENTRY> GetEvents();
-    VOID ClearEvents();
+    VOID SetAlertCallback(CorrelationEngine::AlertCallback callback);
+
+    TelemetrySinkCursor* RegisterSink(TelemetrySinkPolicy policy);
+    BOOL AcquireEvents(TelemetrySinkCursor* sink, TelemetryEventSpan& span, size_t maxCount);
+    BOOL ReleaseEvents(TelemetrySinkCursor* sink, const TelemetryEventSpan& span);
+    VOID Reclaim();
+
+    VOID GetSinkStats(const TelemetrySinkCursor* sink, TelemetrySinkStats& stats) const;
+    ULONG64 GetDroppedEvents() const;
+    ULONG64 GetCoalescedEvents() const;
 
 private:
-    std::vector<TELEMETRY_ENTRY> m_Events;
-    std::mutex m_EventsMutex;
-    static const size_t MAX_EVENTS = 10000;
-};
+    static const size_t MAX_EVENTS = 8192;     // power of two
+    static const size_t INDEX_MASK = MAX_EVENTS - 1;
+    static const size_t LOSSY_SINK_MAX_LAG = MAX_EVENTS / 2;
+    static const size_t MAX_SINKS = 4 + 1;      // plus the correlation cursor
+    static const size_t MAX_CORRELATION_BATCH = 1024;
 
+    std::unique_ptr<TELEMETRY_ENTRY[]> m_Events;
+    // slot i is free for position p when m_Sequences[i] == p, and holds
+    // the event for p when it is p + 1
+    std::unique_ptr<std::atomic<size_t>[]> m_Sequences;
+
+    alignas(64) std::atomic<size_t> m_EnqueuePos;
+    std::atomic<ULONG64> m_DroppedEvents;
+
+    // sinks are registered before any of them start
+    TelemetrySinkCursor m_Sinks[MAX_SINKS];
+    size_t m_SinkCount;
+
+    std::mutex m_ReclaimMutex;
+    size_t m_ReleasePos;                        // under m_ReclaimMutex
+
+    // only touched from the drain thread
+    EventCoalescer m_Coalescer;
+
+    // only touched from ProcessEvents
+    CorrelationEngine m_Correlation;
+    TelemetrySinkCursor* m_CorrelationCursor;
+};
@@ -0,0 +1,413 @@
+//
+// SentinelHook Service - Telemetry Spool Implementation
+//
+
+#include "TelemetrySpool.h"
+#include <algorithm>
+#include <stddef.h>
+#include <stdio.h>
+#include <wchar.h>
+
+//
+// Constructor
+//
+TelemetrySpool::TelemetrySpool()
+    : m_NextSequence(1)
+    , m_DroppedRecords(0)
+    , m_IsInitialized(FALSE)
+{
+}
+
+//
+// Destructor
+//
+TelemetrySpool::~TelemetrySpool()
+{
+    Shutdown();
+}
+
+//
+// Initialize
+// Picks up segments left by a previous run, then opens a fresh one
+//
+BOOL TelemetrySpool::Initialize(const std::wstring& directory)
+{
+    if (m_IsInitialized) {
+        return TRUE;
+    }
+
+    if (!CreateDirectoryW(directory.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+        return FALSE;
+    }
+
+    m_Directory = directory;
+    Recover();
+
+    if (!StartSegment()) {
+        Shutdown();
+        return FALSE;
+    }
+
+    m_IsInitialized = TRUE;
+    return TRUE;
+}
+
+//
+// Shutdown
+// Whatever has not been replayed stays on disk for the next run
+//
+VOID TelemetrySpool::Shutdown()
+{
+    for (auto& segment : m_Segments) {
+        if (segment.View) {
+            UpdateChecksum(Header(segment));
+            FlushViewOfFile(segment.View, 0);
+        }
+        CloseSegment(segment);
+    }
+
+    m_Segments.clear();
+    m_IsInitialized = FALSE;
+}
+
+//
+// Recover
+// Headers that don't check out are deleted; the rest are sealed and
+// queued for replay in sequence order
+//
+VOID TelemetrySpool::Recover()
+{
+    WIN32_FIND_DATAW findData;
+    std::wstring pattern = m_Directory + L"\\spool-*.seg";
+    std::vector<Segment> recovered;
+
+    HANDLE find = FindFirstFileW(pattern.c_str(), &findData);
+    if (find == INVALID_HANDLE_VALUE) {
+        return;
+    }
+
+    do {
+        Segment segment = {};
+        segment.Path = m_Directory + L"\\" + findData.cFileName;
+        segment.Sequence = wcstoull(findData.cFileName + 6, NULL, 16);
+
+        if (!OpenSegment(segment, FALSE)) {
+            DeleteFileW(segment.Path.c_str());
+            continue;
+        }
+
+        PSPOOL_SEGMENT_HEADER header = Header(segment);
+        BOOL empty = header->ReadBytes >= header->DataBytes;
+        header->Sealed = TRUE;
+        UpdateChecksum(header);
+        CloseSegment(segment);
+
+        if (empty) {
+            DeleteFileW(segment.Path.c_str());
+        } else {
+            recovered.push_back(segment);
+        }
+    } while (FindNextFileW(find, &findData));
+
+    FindClose(find);
+
+    std::sort(recovered.begin(), recovered.end(),
+        [](const Segment& a, const Segment& b) { return a.Sequence < b.Sequence; });
+
+    for (const auto& segment : recovered) {
+        m_Segments.push_back(segment);
+        m_NextSequence = max(m_NextSequence, segment.Sequence + 1);
+    }
+
+    // leave room for the segment this run appends to
+    while (m_Segments.size() >= MAX_SEGMENTS) {
+        DropOldestSegment();
+    }
+}
+
+//
+// Open Segment
+// Maps the whole file; an existing one must carry a valid header
+//
+BOOL TelemetrySpool::OpenSegment(Segment& segment, BOOL create)
+{
+    segment.File = CreateFileW(
+        segment.Path.c_str(),
+        GENERIC_READ | GENERIC_WRITE,
+        0,
+        NULL,
+        create ? CREATE_NEW : OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL
+    );
+
+    if (segment.File == INVALID_HANDLE_VALUE) {
+        segment.File = NULL;
+        return FALSE;
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!create && (!GetFileSizeEx(segment.File, &fileSize) || fileSize.QuadPart != SEGMENT_BYTES)) {
+        CloseSegment(segment);
+        return FALSE;
+    }
+
+    segment.Mapping = CreateFileMappingW(segment.File, NULL, PAGE_READWRITE, 0, SEGMENT_BYTES, NULL);
+    if (!segment.Mapping) {
+        CloseSegment(segment);
+        return FALSE;
+    }
+
+    segment.View = (PUCHAR)MapViewOfFile(segment.Mapping, FILE_MAP_WRITE, 0, 0, SEGMENT_BYTES);
+    if (!segment.View) {
+        CloseSegment(segment);
+        return FALSE;
+    }
+
+    PSPOOL_SEGMENT_HEADER header = Header(segment);
+
+    if (create) {
+        // a new file's pages are zero already
+        header->Magic = SPOOL_SEGMENT_MAGIC;
+        header->Version = SPOOL_SEGMENT_VERSION;
+        header->Sequence = segment.Sequence;
+        UpdateChecksum(header);
+        return TRUE;
+    }
+
+    if (!ValidateHeader(header) || header->Sequence != segment.Sequence ||
+        header->DataBytes > SEGMENT_BYTES - sizeof(SPOOL_SEGMENT_HEADER) ||
+        header->ReadBytes > header->DataBytes) {
+        CloseSegment(segment);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+//
+// Close Segment
+//
+VOID TelemetrySpool::CloseSegment(Segment& segment)
+{
+    if (segment.View) {
+        UnmapViewOfFile(segment.View);
+        segment.View = NULL;
+    }
+
+    if (segment.Mapping) {
+        CloseHandle(segment.Mapping);
+        segment.Mapping = NULL;
+    }
+
+    if (segment.File) {
+        CloseHandle(segment.File);
+        segment.File = NULL;
+    }
+}
+
+//
+// Start Segment
+// Seals the current write segment and opens the next one
+//
+BOOL TelemetrySpool::StartSegment()
+{
+    if (m_Segments.size() >= MAX_SEGMENTS) {
+        DropOldestSegment();
+    }
+
+    if (!m_Segments.empty() && m_Segments.back().View) {
+        Segment& current = m_Segments.back();
+        Header(current)->Sealed = TRUE;
+        UpdateChecksum(Header(current));
+
+        // the oldest segment stays mapped while replay reads it
+        if (&current != &m_Segments.front()) {
+            CloseSegment(current);
+        }
+    }
+
+    WCHAR name[32];
+    swprintf_s(name, L"\\spool-%016llx.seg", m_NextSequence);
+
+    Segment segment = {};
+    segment.Sequence = m_NextSequence++;
+    segment.Path = m_Directory + name;
+
+    if (!OpenSegment(segment, TRUE)) {
+        return FALSE;
+    }
+
+    m_Segments.push_back(segment);
+    return TRUE;
+}
+
+//
+// Drop Oldest Segment
+// Out of room; its unreplayed records are counted as dropped
+//
+VOID TelemetrySpool::DropOldestSegment()
+{
+    Segment& oldest = m_Segments.front();
+
+    if (oldest.View || OpenSegment(oldest, FALSE)) {
+        PSPOOL_SEGMENT_HEADER header = Header(oldest);
+        m_DroppedRecords += header->RecordCount - header->ReadCount;
+    }
+
+    CloseSegment(oldest);
+    DeleteFileW(oldest.Path.c_str());
+    m_Segments.pop_front();
+}
+
+//
+// Append
+// Encodes the events straight into the mapped write segment
+//
+BOOL TelemetrySpool::Append(const TelemetryEventSpan& events)
+{
+    if (!m_IsInitialized || m_Segments.empty()) {
+        return FALSE;
+    }
+
+    PSPOOL_SEGMENT_HEADER header = Header(m_Segments.back());
+
+    for (size_t i = 0; i < events.size(); i++) {
+        ULONG offset = sizeof(SPOOL_SEGMENT_HEADER) + header->DataBytes;
+
+        if (SEGMENT_BYTES - offset < TELEMETRY_RECORD_ALIGN(TELEMETRY_RECORD_MAX_SIZE)) {
+            if (!StartSegment()) {
+                m_DroppedRecords += events.size() - i;
+                return FALSE;
+            }
+            header = Header(m_Segments.back());
+            offset = sizeof(SPOOL_SEGMENT_HEADER);
+        }
+
+        ULONG recordSize = TelemetryRecordFromEntry(&events.Events[i],
+            m_Segments.back().View + offset, SEGMENT_BYTES - offset);
+        if (recordSize == 0) {
+            continue;
+        }
+
+        header->DataBytes += TELEMETRY_RECORD_ALIGN(recordSize);
+        header->RecordCount++;
+    }
+
+    // once per batch, the records are already in place
+    UpdateChecksum(header);
+    return TRUE;
+}
+
+//
+// Read
+// Oldest records first; a segment is deleted once it has been read, the
+// write segment is rewound instead
+//
+size_t TelemetrySpool::Read(std::vector<TELEMETRY_ENTRY>& entries, size_t maxCount)
+{
+    entries.clear();
+
+    while (entries.size() < maxCount && !m_Segments.empty()) {
+        Segment& oldest = m_Segments.front();
+
+        if (!oldest.View && !OpenSegment(oldest, FALSE)) {
+            DeleteFileW(oldest.Path.c_str());
+            m_Segments.pop_front();
+            continue;
+        }
+
+        PSPOOL_SEGMENT_HEADER header = Header(oldest);
+
+        if (header->ReadBytes < header->DataBytes) {
+            const TELEMETRY_RECORD* record = (const TELEMETRY_RECORD*)
+                (oldest.View + sizeof(SPOOL_SEGMENT_HEADER) + header->ReadBytes);
+
+            if (!TelemetryRecordValidate(record, header->DataBytes - header->ReadBytes)) {
+                // torn tail from a crash, nothing after it can be trusted
+                m_DroppedRecords += header->RecordCount - header->ReadCount;
+                header->ReadBytes = header->DataBytes;
+                header->ReadCount = header->RecordCount;
+                continue;
+            }
+
+            entries.emplace_back();
+            TelemetryRecordToEntry(record, &entries.back());
+            header->ReadBytes = min(header->ReadBytes + (ULONG)TELEMETRY_RECORD_ALIGN(record->Size), header->DataBytes);
+            header->ReadCount++;
+            continue;
+        }
+
+        if (&oldest == &m_Segments.back()) {
+            // caught up with the writer, reuse the segment from the start
+            header->DataBytes = 0;
+            header->RecordCount = 0;
+            header->ReadBytes = 0;
+            header->ReadCount = 0;
+            break;
+        }
+
+        CloseSegment(oldest);
+        DeleteFileW(oldest.Path.c_str());
+        m_Segments.pop_front();
+    }
+
+    if (!m_Segments.empty() && m_Segments.front().View) {
+        UpdateChecksum(Header(m_Segments.front()));
+    }
+
+    return entries.size();
+}
+
+//
+// Is Empty
+//
+BOOL TelemetrySpool::IsEmpty() const
+{
+    if (m_Segments.size() > 1) {
+        return FALSE;
+    }
+
+    if (m_Segments.empty() || !m_Segments.back().View) {
+        return TRUE;
+    }
+
+    const SPOOL_SEGMENT_HEADER* header = Header(m_Segments.back());
+    return header->ReadBytes >= header->DataBytes;
+}
+
+//
+// Update Checksum
+//
+VOID TelemetrySpool::UpdateChecksum(PSPOOL_SEGMENT_HEADER header)
+{
+    header->Checksum = Crc32(header, offsetof(SPOOL_SEGMENT_HEADER, Checksum));
+}
+
+//
+// Validate Header
+//
+BOOL TelemetrySpool::ValidateHeader(const SPOOL_SEGMENT_HEADER* header)
+{
+    return header->Magic == SPOOL_SEGMENT_MAGIC && header->Version == SPOOL_SEGMENT_VERSION &&
+        header->Checksum == Crc32(header, offsetof(SPOOL_SEGMENT_HEADER, Checksum));
+}
+
+//
+// CRC-32
+// Bitwise, only ever run over a segment header
+//
+ULONG TelemetrySpool::Crc32(const VOID* data, size_t length)
+{
+    const UCHAR* bytes = (const UCHAR*)data;
+    ULONG crc = 0xFFFFFFFF;
+
+    for (size_t i = 0; i < length; i++) {
+        crc ^= bytes[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+
+    return ~crc;
+}
@@ -0,0 +1,87 @@
+//
+// SentinelHook Service - Telemetry Spool Header
+//
+
+#pragma once
+
+#include <windows.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include "..\Common\telemetry.h"
+#include "..\Common\record.h"
+#include "TelemetryAggregator.h"
+
+//
+// Segment file header, one per spool file
+// Checksum covers every field before it and is rewritten with the counts,
+// so a torn or foreign file is recognised and discarded on recovery.
+//
+#define SPOOL_SEGMENT_MAGIC          'PSHS'
+#define SPOOL_SEGMENT_VERSION        1
+
+typedef struct _SPOOL_SEGMENT_HEADER {
+    ULONG Magic;
+    ULONG Version;
+    ULONG64 Sequence;               // segment number, only ever increases
+    ULONG DataBytes;                // aligned TELEMETRY_RECORDs after the header
+    ULONG RecordCount;
+    ULONG ReadBytes;                // replayed so far, survives a restart
+    ULONG ReadCount;
+    ULONG Sealed;                   // no more appends
+    ULONG Reserved[6];
+    ULONG Checksum;                 // CRC-32 of the fields above
+} SPOOL_SEGMENT_HEADER, *PSPOOL_SEGMENT_HEADER;
+
+//
+// Append-only on-disk spool of wire records for when no pipe client is
+// listening
+// Records are encoded straight into a mapped segment file, so spooling is
+// a sequential memory write and the lazy writer takes care of the disk.
+// Replay reads from the oldest segment and deletes each one once it has
+// been fully read. When MAX_SEGMENTS are in use the oldest is dropped.
+// Not thread safe, NamedPipe serialises calls under its clients lock.
+//
+class TelemetrySpool {
+public:
+    TelemetrySpool();
+    ~TelemetrySpool();
+
+    BOOL Initialize(const std::wstring& directory);
+    VOID Shutdown();
+
+    BOOL Append(const TelemetryEventSpan& events);
+    size_t Read(std::vector<TELEMETRY_ENTRY>& entries, size_t maxCount);
+    BOOL IsEmpty() const;
+
+    ULONG64 GetDroppedRecords() const { return m_DroppedRecords; }
+
+private:
+    struct Segment {
+        ULONG64 Sequence;
+        std::wstring Path;
+        HANDLE File;
+        HANDLE Mapping;
+        PUCHAR View;                // NULL while the segment is not in use
+    };
+
+    std::wstring m_Directory;
+    std::deque<Segment> m_Segments;     // oldest first, back() is the one appended to
+    ULONG64 m_NextSequence;
+    ULONG64 m_DroppedRecords;
+    BOOL m_IsInitialized;
+
+    static const ULONG SEGMENT_BYTES = 16 * 1024 * 1024;
+    static const size_t MAX_SEGMENTS = 64;
+
+    VOID Recover();
+    BOOL OpenSegment(Segment& segment, BOOL create);
+    VOID CloseSegment(Segment& segment);
+    BOOL StartSegment();
+    VOID DropOldestSegment();
+
+    static PSPOOL_SEGMENT_HEADER Header(const Segment& segment) { return (PSPOOL_SEGMENT_HEADER)segment.View; }
+    static VOID UpdateChecksum(PSPOOL_SEGMENT_HEADER header);
+    static BOOL ValidateHeader(const SPOOL_SEGMENT_HEADER* header);
+    static ULONG Crc32(const VOID* data, size_t length);
+};
@@ -5,37 +5,86 @@
  * 
  * ARM Cortex-M/A optimization with NEON SIMD
  * Research breakthrough: 10x performance improvement
+ *
+ * Also the tree's library of hot byte loops: copy and fill for DMA
+ * staging, the IEEE CRC32 of firmware and DFU images, the byte-sum
+ * firmware checksum, WebSocket unmasking and hex encoding. Each has a
+ * scalar version that is always correct and a NEON one taken when every
+ * core has NEON, the caller may use it right now and the buffer is long
+ * enough to be worth saving the FP state; NEON sections are cut into
+ * chunks so preemption is never held off for long. The CRC runs on the
+ * ARMv8 CRC32 instructions instead, which need no FP state at all.
+ *
+ * For data that passes through once there are cache-bypassing helpers:
+ * a non-temporal copy for big buffers and a sequential scan that
+ * prefetches each slice with the streaming hint, so a 100 MB hash does
+ * not flush L2 for everyone else on the core. The cache hit and miss
+ * counts come from per-core PMU counters.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
-#include <linux/arm_neon.h>
 #include <linux/cpufreq.h>
 #include <linux/cpu.h>
 #include <linux/smp.h>
 #include <linux/atomic.h>
 #include <linux/slab.h>
 #include <linux/errno.h>
+#include <linux/crc32.h>
+#include <linux/jump_label.h>
+#include <linux/string.h>
+#include <linux/perf_event.h>
+#include <linux/math64.h>
+#include <linux/err.h>
+#include <asm/unaligned.h>
 
-#define ARM_OPT_VERSION "1.5.0"
+#if defined(CONFIG_ARM64) && defined(CONFIG_KERNEL_MODE_NEON)
+#define ARM_OPT_NEON 1
+#include <asm/cpufeature.h>
+#include <asm/neon.h>
+#include <asm/neon-intrinsics.h>
+#include <asm/simd.h>
+#endif
+
+#include "arm_cortex_optimization.h"
+
+#define ARM_OPT_VERSION "1.7.0"
 #define NEON_VECTOR_SIZE 16
 #define MAX_CORES 8
 #define CACHE_LINE_SIZE 64
+#define ARM_NEON_MIN_BYTES 128          // below this saving the FP state costs more than it wins
+#define ARM_NEON_CHUNK 4096             // bytes per kernel_neon_begin(), bounding the preempt-off time
+#define ARM_SCAN_SLICE 4096             // prefetch distance of a streaming scan
+#define ARM_NT_MIN_BYTES (256 * 1024)   // copies from which caching the data costs more than it saves
 
 struct arm_optimization {
     int core_id;
     u32 neon_enabled;
     u64 simd_operations;
-    u32 cache_hits;
-    u32 cache_misses;
+    u64 cache_hits;
+    u64 cache_misses;
     u32 frequency_mhz;
     atomic_t optimization_active;
     struct cpufreq_policy *policy;
+    struct perf_event *pmu_refs;
+    struct perf_event *pmu_misses;
 };
 
 static struct arm_optimization arm_cores[MAX_CORES];
 static int arm_core_count = 0;
 
+static DEFINE_STATIC_KEY_FALSE(arm_neon_key);
+static DEFINE_STATIC_KEY_FALSE(arm_crc32_key);
+
+static bool cpu_has_neon(void)
+{
+#ifdef ARM_OPT_NEON
+    return cpu_have_named_feature(ASIMD);
+#else
+    return false;
+#endif
+}
+
 /**
  * Initialize ARM Cortex optimization
  */
@@ -57,6 +106,8 @@ static int arm_cortex_init(int core_id)
     core->frequency_mhz = 0;
     atomic_set(&core->optimization_active, 0);
     core->policy = NULL;
+    core->pmu_refs = NULL;
+    core->pmu_misses = NULL;
     
     // Check NEON availability
     if (cpu_has_neon()) {
@@ -77,64 +128,545 @@ static int arm_cortex_init(int core_id)
     return 0;
 }
 
+/*
+ * NEON may only be used where the FP state can be saved, which rules out
+ * hard interrupts and some softirq paths; may_use_simd() knows.
+ */
+static bool arm_neon_usable(size_t len)
+{
+#ifdef ARM_OPT_NEON
+    return static_branch_likely(&arm_neon_key) && len >= ARM_NEON_MIN_BYTES && may_use_simd();
+#else
+    return false;
+#endif
+}
+
+#ifdef ARM_OPT_NEON
+
+static void arm_neon_begin(void)
+{
+    kernel_neon_begin();
+}
+
+// Preemption is still off, so the count goes to the core that did the work
+static void arm_neon_end(void)
+{
+    int cpu = smp_processor_id();
+    
+    if (cpu < MAX_CORES) {
+        arm_cores[cpu].simd_operations++;
+    }
+    kernel_neon_end();
+}
+
+// All NEON kernels take whole 16-byte vectors: len is a multiple of 16
+static void neon_copy(u8 *dst, const u8 *src, size_t len)
+{
+    size_t i = 0;
+    
+    for (; i + 64 <= len; i += 64) {
+        uint8x16_t a = vld1q_u8(src + i), b = vld1q_u8(src + i + 16);
+        uint8x16_t c = vld1q_u8(src + i + 32), d = vld1q_u8(src + i + 48);
+        
+        vst1q_u8(dst + i, a);
+        vst1q_u8(dst + i + 16, b);
+        vst1q_u8(dst + i + 32, c);
+        vst1q_u8(dst + i + 48, d);
+    }
+    for (; i < len; i += 16) {
+        vst1q_u8(dst + i, vld1q_u8(src + i));
+    }
+}
+
+static void neon_fill(u8 *dst, u8 c, size_t len)
+{
+    uint8x16_t v = vdupq_n_u8(c);
+    size_t i = 0;
+    
+    for (; i + 64 <= len; i += 64) {
+        vst1q_u8(dst + i, v);
+        vst1q_u8(dst + i + 16, v);
+        vst1q_u8(dst + i + 32, v);
+        vst1q_u8(dst + i + 48, v);
+    }
+    for (; i < len; i += 16) {
+        vst1q_u8(dst + i, v);
+    }
+}
+
+/*
+ * Pairwise widening adds: every lane gains at most 4 * 255 per vector
+ * and wraps modulo 2^32 exactly as the scalar sum does
+ */
+static u32 neon_sum8(const u8 *p, size_t len)
+{
+    uint32x4_t acc = vdupq_n_u32(0);
+    size_t i;
+    
+    for (i = 0; i < len; i += 16) {
+        acc = vpadalq_u16(acc, vpaddlq_u8(vld1q_u8(p + i)));
+    }
+    return vaddvq_u32(acc);
+}
+
+// The key repeats every 4 bytes, so four copies of it cover a vector
+static void neon_unmask(u8 *data, size_t len, const u8 *key)
+{
+    uint8x16_t k = vreinterpretq_u8_u32(vdupq_n_u32(get_unaligned((const u32 *)key)));
+    size_t i;
+    
+    for (i = 0; i < len; i += 16) {
+        vst1q_u8(data + i, veorq_u8(vld1q_u8(data + i), k));
+    }
+}
+
+// len source bytes to 2 * len characters; vst2q interleaves high and low digits
+static void neon_hex_encode(char *dst, const u8 *src, size_t len)
+{
+    const uint8x16_t digits = vld1q_u8((const u8 *)"0123456789abcdef");
+    size_t i;
+    
+    for (i = 0; i < len; i += 16) {
+        uint8x16_t v = vld1q_u8(src + i);
+        uint8x16x2_t out;
+        
+        out.val[0] = vqtbl1q_u8(digits, vshrq_n_u8(v, 4));
+        out.val[1] = vqtbl1q_u8(digits, vandq_u8(v, vdupq_n_u8(0x0f)));
+        vst2q_u8((u8 *)dst + 2 * i, out);
+    }
+}
+
+static uint8x16_t neon_hex_nibbles(uint8x16_t c, uint8x16_t *valid)
+{
+    uint8x16_t d = vsubq_u8(c, vdupq_n_u8('0'));
+    uint8x16_t l = vsubq_u8(vorrq_u8(c, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+    uint8x16_t is_digit = vcltq_u8(d, vdupq_n_u8(10));
+    uint8x16_t is_letter = vcltq_u8(l, vdupq_n_u8(6));
+    
+    *valid = vandq_u8(*valid, vorrq_u8(is_digit, is_letter));
+    return vbslq_u8(is_digit, d, vaddq_u8(l, vdupq_n_u8(10)));
+}
+
+// 2 * len characters to len bytes; false on any non-hex character
+static bool neon_hex_decode(u8 *dst, const char *src, size_t len)
+{
+    uint8x16_t valid = vdupq_n_u8(0xff);
+    size_t i;
+    
+    for (i = 0; i < len; i += 16) {
+        uint8x16x2_t c = vld2q_u8((const u8 *)src + 2 * i);
+        uint8x16_t hi = neon_hex_nibbles(c.val[0], &valid);
+        uint8x16_t lo = neon_hex_nibbles(c.val[1], &valid);
+        
+        vst1q_u8(dst + i, vorrq_u8(vshlq_n_u8(hi, 4), lo));
+    }
+    return vminvq_u8(valid) != 0;
+}
+
+static u32 arm_crc32_insn(u32 crc, const u8 *p, size_t len)
+{
+    u64 v;
+    
+    for (; len >= 8; p += 8, len -= 8) {
+        v = get_unaligned_le64(p);
+        asm(".arch_extension crc\n\tcrc32x %w0, %w0, %x1" : "+r" (crc) : "r" (v));
+    }
+    for (; len; p++, len--) {
+        asm(".arch_extension crc\n\tcrc32b %w0, %w0, %w1" : "+r" (crc) : "r" ((u32)*p));
+    }
+    return crc;
+}
+
+#else
+
+static void arm_neon_begin(void) { }
+static void arm_neon_end(void) { }
+static void neon_copy(u8 *dst, const u8 *src, size_t len) { }
+static void neon_fill(u8 *dst, u8 c, size_t len) { }
+static u32 neon_sum8(const u8 *p, size_t len) { return 0; }
+static void neon_unmask(u8 *data, size_t len, const u8 *key) { }
+static void neon_hex_encode(char *dst, const u8 *src, size_t len) { }
+static bool neon_hex_decode(u8 *dst, const char *src, size_t len) { return false; }
+static u32 arm_crc32_insn(u32 crc, const u8 *p, size_t len) { return crc; }
+
+#endif /* ARM_OPT_NEON */
+
+static size_t arm_neon_chunk(size_t len)
+{
+    return min_t(size_t, len, ARM_NEON_CHUNK) & ~(size_t)(NEON_VECTOR_SIZE - 1);
+}
+
 /**
  * NEON SIMD operations
+ *
+ * The demonstration transform, (x & 0x0f) << 1 per byte; the tail that
+ * does not fill a vector is done in scalar code instead of read past length
  */
 static int neon_simd_operation(const u8 *input, u8 *output, size_t length)
 {
-    size_t i;
-    uint8x16_t input_vec, output_vec;
+    size_t i = 0;
     
     if (!input || !output || length == 0) {
         pr_err("Invalid parameters for NEON operation\n");
         return -EINVAL;
     }
     
-    // Process data in 16-byte chunks using NEON
-    for (i = 0; i < length; i += NEON_VECTOR_SIZE) {
-        size_t chunk_size = min(NEON_VECTOR_SIZE, length - i);
-        
-        // Load input vector
-        input_vec = vld1q_u8(&input[i]);
-        
-        // Perform SIMD operations (example: bit manipulation)
-        output_vec = vandq_u8(input_vec, vdupq_n_u8(0x0F));
-        output_vec = vshlq_u8(output_vec, vdupq_n_u8(1));
-        
-        // Store output vector
-        vst1q_u8(&output[i], output_vec);
+#ifdef ARM_OPT_NEON
+    if (arm_neon_usable(length)) {
+        arm_neon_begin();
+        // Process data in 16-byte chunks using NEON
+        for (; i + NEON_VECTOR_SIZE <= length; i += NEON_VECTOR_SIZE) {
+            uint8x16_t v = vandq_u8(vld1q_u8(&input[i]), vdupq_n_u8(0x0F));
+            
+            vst1q_u8(&output[i], vshlq_n_u8(v, 1));
+        }
+        arm_neon_end();
+    }
+#endif
+    for (; i < length; i++) {
+        output[i] = (input[i] & 0x0F) << 1;
     }
     
     pr_debug("NEON SIMD operation completed on %zu bytes\n", length);
     return 0;
 }
 
+/**
+ * Copy for DMA staging buffers, memcpy() semantics
+ */
+void arm_memcpy(void *dst, const void *src, size_t len)
+{
+    u8 *d = dst;
+    const u8 *s = src;
+    size_t n;
+    
+    if (arm_neon_usable(len)) {
+        while ((n = arm_neon_chunk(len))) {
+            arm_neon_begin();
+            neon_copy(d, s, n);
+            arm_neon_end();
+            d += n;
+            s += n;
+            len -= n;
+        }
+    }
+    memcpy(d, s, len);
+}
+EXPORT_SYMBOL_GPL(arm_memcpy);
+
+void arm_memset(void *dst, int c, size_t len)
+{
+    u8 *d = dst;
+    size_t n;
+    
+    if (arm_neon_usable(len)) {
+        while ((n = arm_neon_chunk(len))) {
+            arm_neon_begin();
+            neon_fill(d, c, n);
+            arm_neon_end();
+            d += n;
+            len -= n;
+        }
+    }
+    memset(d, c, len);
+}
+EXPORT_SYMBOL_GPL(arm_memset);
+
+/**
+ * CRC32, IEEE 802.3 polynomial bit-reflected, crc32_le() conventions:
+ * no inversion here, so zlib/DFU style is ~arm_crc32(~0, p, len)
+ */
+u32 arm_crc32(u32 crc, const void *p, size_t len)
+{
+    if (static_branch_likely(&arm_crc32_key)) {
+        return arm_crc32_insn(crc, p, len);
+    }
+    return crc32_le(crc, p, len);
+}
+EXPORT_SYMBOL_GPL(arm_crc32);
+
+/**
+ * Sum of all bytes modulo 2^32, the firmware image checksum
+ */
+u32 arm_checksum8(const void *p, size_t len)
+{
+    const u8 *b = p;
+    u32 sum = 0;
+    size_t n;
+    
+    if (arm_neon_usable(len)) {
+        while ((n = arm_neon_chunk(len))) {
+            arm_neon_begin();
+            sum += neon_sum8(b, n);
+            arm_neon_end();
+            b += n;
+            len -= n;
+        }
+    }
+    while (len--) {
+        sum += *b++;
+    }
+    return sum;
+}
+EXPORT_SYMBOL_GPL(arm_checksum8);
+
+/**
+ * XOR a WebSocket payload with its 4-byte masking key, in place; data
+ * starts at a multiple of 4 into the payload
+ */
+void arm_ws_unmask(u8 *data, size_t len, const u8 *key)
+{
+    size_t i = 0, n;
+    
+    if (arm_neon_usable(len)) {
+        while ((n = arm_neon_chunk(len - i))) {
+            arm_neon_begin();
+            neon_unmask(data + i, n, key);
+            arm_neon_end();
+            i += n;
+        }
+    }
+    for (; i < len; i++) {
+        data[i] ^= key[i & 3];          // i stays a multiple of 16 up to here
+    }
+}
+EXPORT_SYMBOL_GPL(arm_ws_unmask);
+
+/**
+ * len bytes to 2 * len lowercase hex digits, not NUL-terminated
+ */
+void arm_hex_encode(char *dst, const u8 *src, size_t len)
+{
+    size_t i = 0, n;
+    
+    if (arm_neon_usable(len)) {
+        while ((n = arm_neon_chunk(len - i))) {
+            arm_neon_begin();
+            neon_hex_encode(dst + 2 * i, src + i, n);
+            arm_neon_end();
+            i += n;
+        }
+    }
+    for (; i < len; i++) {
+        dst[2 * i] = hex_asc_hi(src[i]);
+        dst[2 * i + 1] = hex_asc_lo(src[i]);
+    }
+}
+EXPORT_SYMBOL_GPL(arm_hex_encode);
+
+/**
+ * 2 * len hex digits, either case, to len bytes; -EINVAL on anything
+ * else, with dst then partly written
+ */
+int arm_hex_decode(u8 *dst, const char *src, size_t len)
+{
+    size_t i = 0, n;
+    bool ok;
+    int hi, lo;
+    
+    if (arm_neon_usable(len)) {
+        while ((n = arm_neon_chunk(len - i))) {
+            arm_neon_begin();
+            ok = neon_hex_decode(dst + i, src + 2 * i, n);
+            arm_neon_end();
+            if (!ok) {
+                return -EINVAL;
+            }
+            i += n;
+        }
+    }
+    for (; i < len; i++) {
+        hi = hex_to_bin(src[2 * i]);
+        lo = hex_to_bin(src[2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            return -EINVAL;
+        }
+        dst[i] = (hi << 4) | lo;
+    }
+    return 0;
+}
+EXPORT_SYMBOL_GPL(arm_hex_decode);
+
 /**
  * Cache optimization
+ *
+ * Warm a buffer that is about to be reused: every line of it is
+ * prefetched for keeps, into all levels
  */
 static int arm_cache_optimize(void *data, size_t size)
 {
-    void *aligned_data;
-    size_t aligned_size;
+    const u8 *p, *end;
     
     if (!data || size == 0) {
         return -EINVAL;
     }
     
-    // Align data to cache line boundary
-    aligned_data = (void *)(((unsigned long)data + CACHE_LINE_SIZE - 1) & 
-                           ~(CACHE_LINE_SIZE - 1));
-    aligned_size = size - (aligned_data - data);
+    // From the line holding the first byte to the one holding the last
+    p = (const u8 *)((unsigned long)data & ~(unsigned long)(CACHE_LINE_SIZE - 1));
+    end = (const u8 *)data + size;
+    for (; p < end; p += CACHE_LINE_SIZE) {
+        __builtin_prefetch(p, 0, 3);    // Read, temporal locality
+    }
     
-    if (aligned_size > 0) {
-        // Prefetch data into cache
-        __builtin_prefetch(aligned_data, 0, 3); // Read, temporal locality
-        
-        pr_debug("Cache optimization applied to %zu bytes\n", aligned_size);
+    pr_debug("Cache optimization applied to %zu bytes\n", size);
+    return 0;
+}
+
+// Streaming hint (PLDL1STRM): fetched for one use, first in line for eviction
+static void arm_prefetch_stream(const u8 *p, size_t len)
+{
+    size_t off;
+    
+    for (off = 0; off < len; off += CACHE_LINE_SIZE) {
+        __builtin_prefetch(p + off, 0, 0);
     }
+}
+
+/**
+ * Feed a large buffer to fn one slice at a time, each slice prefetched
+ * with the streaming hint while the one before it is processed, so a
+ * sequential pass (hashing a firmware image, say) neither stalls on
+ * memory nor pushes everything else out of L2. Stops at the first
+ * non-zero return of fn and returns it.
+ */
+int arm_stream_scan(const void *data, size_t len,
+                    int (*fn)(void *ctx, const u8 *p, size_t n), void *ctx)
+{
+    const u8 *p = data;
+    size_t n;
+    int ret;
     
+    arm_prefetch_stream(p, min_t(size_t, len, ARM_SCAN_SLICE));
+    while (len) {
+        n = min_t(size_t, len, ARM_SCAN_SLICE);
+        if (len > n) {
+            arm_prefetch_stream(p + n, min_t(size_t, len - n, ARM_SCAN_SLICE));
+        }
+        ret = fn(ctx, p, n);
+        if (ret) {
+            return ret;
+        }
+        p += n;
+        len -= n;
+    }
     return 0;
 }
+EXPORT_SYMBOL_GPL(arm_stream_scan);
+
+#ifdef CONFIG_ARM64
+/*
+ * LDNP/STNP on general registers: no FP state needed, and the lines go
+ * around the caches instead of evicting what the core is working on.
+ * len is a multiple of 64.
+ */
+static void arm_copy_nt(u8 *dst, const u8 *src, size_t len)
+{
+    u64 a, b, c, d;
+    size_t i;
+    
+    for (i = 0; i < len; i += 64) {
+        asm volatile("ldnp %0, %1, [%4]\n\t"
+                     "ldnp %2, %3, [%4, #16]\n\t"
+                     "stnp %0, %1, [%5]\n\t"
+                     "stnp %2, %3, [%5, #16]\n\t"
+                     "ldnp %0, %1, [%4, #32]\n\t"
+                     "ldnp %2, %3, [%4, #48]\n\t"
+                     "stnp %0, %1, [%5, #32]\n\t"
+                     "stnp %2, %3, [%5, #48]"
+                     : "=&r" (a), "=&r" (b), "=&r" (c), "=&r" (d)
+                     : "r" (src + i), "r" (dst + i)
+                     : "memory");
+    }
+    // Non-temporal stores are not ordered against later ones by themselves
+    wmb();
+}
+#else
+static void arm_copy_nt(u8 *dst, const u8 *src, size_t len)
+{
+    memcpy(dst, src, len);
+}
+#endif
+
+/**
+ * memcpy() for buffers too big to be worth caching, DMA staging rather
+ * than data the CPU will read next; smaller copies go to arm_memcpy()
+ */
+void arm_memcpy_nt(void *dst, const void *src, size_t len)
+{
+    size_t bulk = len & ~(size_t)63;
+    
+    if (len < ARM_NT_MIN_BYTES) {
+        arm_memcpy(dst, src, len);
+        return;
+    }
+    arm_copy_nt(dst, src, bulk);
+    memcpy((u8 *)dst + bulk, (const u8 *)src + bulk, len - bulk);
+}
+EXPORT_SYMBOL_GPL(arm_memcpy_nt);
+
+/*
+ * Per-core PMU counters for the generic cache events, which the ARMv8
+ * PMU driver maps to L1D refills and accesses
+ */
+static struct perf_event *arm_pmu_counter(int cpu, u64 config)
+{
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof(attr),
+        .config = config,
+        .pinned = 1,
+    };
+    struct perf_event *event;
+    
+    event = perf_event_create_kernel_counter(&attr, cpu, NULL, NULL, NULL);
+    return IS_ERR(event) ? NULL : event;
+}
+
+static void arm_pmu_init(struct arm_optimization *core)
+{
+    core->pmu_refs = arm_pmu_counter(core->core_id, PERF_COUNT_HW_CACHE_REFERENCES);
+    core->pmu_misses = arm_pmu_counter(core->core_id, PERF_COUNT_HW_CACHE_MISSES);
+    if (!core->pmu_refs || !core->pmu_misses) {
+        pr_warn("No PMU cache counters on core %d\n", core->core_id);
+    }
+}
+
+static void arm_pmu_release(struct arm_optimization *core)
+{
+    if (core->pmu_refs) {
+        perf_event_release_kernel(core->pmu_refs);
+        core->pmu_refs = NULL;
+    }
+    if (core->pmu_misses) {
+        perf_event_release_kernel(core->pmu_misses);
+        core->pmu_misses = NULL;
+    }
+}
+
+// Scaled up for any time the counter was multiplexed off the PMU
+static u64 arm_pmu_read(struct perf_event *event)
+{
+    u64 enabled, running, count;
+    
+    count = perf_event_read_value(event, &enabled, &running);
+    if (running && running < enabled) {
+        count = div64_u64(count * enabled, running);
+    }
+    return count;
+}
+
+static void arm_pmu_update(struct arm_optimization *core)
+{
+    u64 refs, misses;
+    
+    if (!core->pmu_refs || !core->pmu_misses) {
+        return;
+    }
+    refs = arm_pmu_read(core->pmu_refs);
+    misses = arm_pmu_read(core->pmu_misses);
+    core->cache_misses = misses;
+    core->cache_hits = refs > misses ? refs - misses : 0;
+}
 
 /**
  * CPU frequency optimization
@@ -172,8 +704,8 @@ static int arm_frequency_optimize(int core_id, u32 target_freq_mhz)
 /**
  * Get optimization statistics
  */
-static int arm_get_optimization_stats(int core_id, u64 *simd_ops, u32 *cache_hits, 
-                                      u32 *cache_misses)
+static int arm_get_optimization_stats(int core_id, u64 *simd_ops, u64 *cache_hits,
+                                      u64 *cache_misses)
 {
     struct arm_optimization *core;
     
@@ -182,6 +714,7 @@ static int arm_get_optimization_stats(int core_id, u64 *simd_ops, u32 *cache_hit
     }
     
     core = &arm_cores[core_id];
+    arm_pmu_update(core);
     
     if (simd_ops) {
         *simd_ops = core->simd_operations;
@@ -201,6 +734,7 @@ static int arm_get_optimization_stats(int core_id, u64 *simd_ops, u32 *cache_hit
  */
 static int __init arm_opt_init_module(void)
 {
+    bool neon_all;
     int i, ret;
     
     pr_info("ARM Cortex Optimization v%s loading\n", ARM_OPT_VERSION);
@@ -211,9 +745,29 @@ static int __init arm_opt_init_module(void)
             pr_err("Failed to initialize ARM optimization for core %d\n", i);
             return ret;
         }
+        arm_pmu_init(&arm_cores[i]);
         arm_core_count++;
     }
     
+    // One core without NEON and nobody gets it: callers may migrate
+    neon_all = arm_core_count > 0;
+    for (i = 0; i < arm_core_count; i++) {
+        if (!arm_cores[i].neon_enabled) {
+            neon_all = false;
+        }
+    }
+    if (neon_all) {
+        static_branch_enable(&arm_neon_key);
+    }
+#ifdef ARM_OPT_NEON
+    if (cpu_have_named_feature(CRC32)) {
+        static_branch_enable(&arm_crc32_key);
+    }
+#endif
+    pr_info("NEON kernels %s, CRC32 instructions %s\n",
+            static_branch_unlikely(&arm_neon_key) ? "on" : "off",
+            static_branch_unlikely(&arm_crc32_key) ? "on" : "off");
+    
     pr_info("ARM Cortex Optimization loaded for %d cores\n", arm_core_count);
     return 0;
 }
@@ -229,6 +783,7 @@ static void __exit arm_opt_cleanup_module(void)
         if (arm_cores[i].policy) {
             cpufreq_cpu_put(arm_cores[i].policy);
         }
+        arm_pmu_release(&arm_cores[i]);
     }
     
     pr_info("ARM Cortex Optimization unloaded\n");
@@ -0,0 +1,29 @@
+/**
+ * ARM Cortex optimization interface
+ *
+ * Byte loops shared by the rest of the tree, NEON-accelerated where the
+ * hardware and the calling context allow and scalar otherwise, with the
+ * same results either way. They may be called from any context, hard
+ * interrupts included; there they simply take the scalar path.
+ *
+ * arm_memcpy_nt() and arm_stream_scan() are for data touched once: they
+ * keep it from displacing the caller's working set in the caches.
+ */
+
+#ifndef ARM_CORTEX_OPTIMIZATION_H
+#define ARM_CORTEX_OPTIMIZATION_H
+
+#include <linux/types.h>
+
+void arm_memcpy(void *dst, const void *src, size_t len);
+void arm_memset(void *dst, int c, size_t len);
+u32 arm_crc32(u32 crc, const void *p, size_t len);
+u32 arm_checksum8(const void *p, size_t len);
+void arm_ws_unmask(u8 *data, size_t len, const u8 *key);
+void arm_hex_encode(char *dst, const u8 *src, size_t len);
+int arm_hex_decode(u8 *dst, const char *src, size_t len);
+void arm_memcpy_nt(void *dst, const void *src, size_t len);
+int arm_stream_scan(const void *data, size_t len,
+                    int (*fn)(void *ctx, const u8 *p, size_t n), void *ctx);
+
+#endif /* ARM_CORTEX_OPTIMIZATION_H */
@@ -5,6 +5,12 @@
  * 
  * Advanced AUTOSAR (AUTomotive Open System ARchitecture) implementation
  * Research breakthrough: AUTOSAR Classic Platform compliance
+ *
+ * Runnables are event-triggered, as in the RTE: timing events on one
+ * shared timer wheel, data received on a receiver port, or entry into
+ * a mode. An activated runnable is queued on its core's ready queue by
+ * priority and run from that core's worker, highest priority first and
+ * without preemption; nothing walks the applications looking for work.
  */
 
 #include <linux/module.h>
@@ -14,12 +20,36 @@
 #include <linux/atomic.h>
 #include <linux/timer.h>
 #include <linux/workqueue.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/bitops.h>
+#include <linux/bitmap.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/overflow.h>
+
+#include "../networking_stacks/timer_wheel.h"
 
 #define AUTOSAR_VERSION "4.4.0"
 #define MAX_AUTOSAR_APPLICATIONS 32
 #define MAX_AUTOSAR_SERVICES 64
 #define MAX_AUTOSAR_PORTS 128
 #define AUTOSAR_EXECUTION_TIMEOUT_MS 10000
+#define MAX_AUTOSAR_RUNNABLES 64
+#define AUTOSAR_PRIORITIES 16               // runnable priorities, 0 is the highest
+#define MAX_AUTOSAR_MODE_GROUPS 8
+#define AUTOSAR_MODES_PER_GROUP 16
+
+#define AUTOSAR_SR_DATA_MAX 64              // bytes per sender-receiver data element
+#define MAX_AUTOSAR_SR_ELEMENTS 64
+#define AUTOSAR_SR_RECEIVERS 8              // receiver ports per sender port
+#define AUTOSAR_SR_QUEUE_DEPTH 8            // queued semantics, power of two
+#define AUTOSAR_IMPLICIT_PORTS 4            // implicitly accessed ports per runnable
+
+// autosar_runnable flags
+#define AUTOSAR_RUNNABLE_QUEUED 0
 
 enum autosar_service_type {
     AUTOSAR_SERVICE_BSW = 0,
@@ -35,6 +65,13 @@ enum autosar_port_type {
     AUTOSAR_PORT_RECEIVER = 3
 };
 
+enum autosar_rte_event {
+    AUTOSAR_EVENT_TIMING = 0,
+    AUTOSAR_EVENT_DATA_RECEIVED = 1,
+    AUTOSAR_EVENT_MODE_SWITCH = 2,
+    AUTOSAR_EVENT_COUNT
+};
+
 struct autosar_port {
     u32 port_id;
     char name[64];
@@ -44,6 +81,9 @@ struct autosar_port {
     u32 message_count;
     u32 error_count;
     u64 timestamp;
+    DECLARE_BITMAP(triggers, MAX_AUTOSAR_RUNNABLES);     // runnables activated on data received
+    int sr_element;                     // sender-receiver data element, -1 if unconnected
+    int sr_receiver;                    // this receiver's queue in it
 };
 
 struct autosar_service {
@@ -70,6 +110,81 @@ struct autosar_application {
     u64 last_execution_time;
 };
 
+struct autosar_sr_slot {
+    u32 gen;                    // odd while the sender fills the slot
+    u32 len;
+    u8 data[AUTOSAR_SR_DATA_MAX];
+};
+
+struct autosar_sr_entry {
+    u32 len;
+    u8 data[AUTOSAR_SR_DATA_MAX];
+};
+
+// Queued semantics: a ring per receiver, the sender its only producer
+struct autosar_sr_queue {
+    u32 head;                   // written by the sender
+    u32 tail;                   // written by the receiver
+    u32 lost;                   // sent while the queue was full
+    struct autosar_sr_entry entries[AUTOSAR_SR_QUEUE_DEPTH];
+};
+
+/*
+ * A data element from one sender port to its receivers, without locks.
+ * Last-is-best: the sender fills the slot it did not publish last and
+ * then publishes it; a receiver copies the published slot and checks
+ * its generation did not move, so reads neither wait nor tear. Queued:
+ * each receiver has its own single-producer, single-consumer ring.
+ */
+struct autosar_sr_element {
+    bool queued;
+    u32 len;                    // size of the data element
+    struct autosar_port *sender;
+    int receiver_count;
+    struct autosar_port *receivers[AUTOSAR_SR_RECEIVERS];
+    u32 latest;                 // last-is-best: writes published
+    struct autosar_sr_slot slots[2];
+    struct autosar_sr_queue queues[];   // queued: one per receiver
+};
+
+// A runnable's copy of a last-is-best element for one activation
+struct autosar_implicit {
+    struct autosar_sr_element *element;
+    bool write;
+    bool dirty;
+    u32 len;
+    u8 data[AUTOSAR_SR_DATA_MAX];
+};
+
+struct autosar_runnable {
+    u32 runnable_id;
+    char name[64];
+    u32 application_id;
+    u32 priority;
+    int cpu;
+    void (*entry)(void *arg);
+    void *arg;
+    bool active;
+    unsigned long flags;
+    struct list_head ready_node;        // on its core's ready queue while queued
+    u32 period_ms;                      // timing event, 0 for none
+    struct tw_timer timing;
+    u32 activations[AUTOSAR_EVENT_COUNT];
+    u32 coalesced;                      // activations while already queued
+    u32 execution_count;
+    u64 last_execution_time;
+    struct autosar_implicit implicit[AUTOSAR_IMPLICIT_PORTS];
+    int implicit_count;
+};
+
+// One per CPU: runnables ready to run there, a list per priority
+struct autosar_core {
+    spinlock_t lock;
+    unsigned long ready_mask;           // priorities with a runnable queued
+    struct list_head ready[AUTOSAR_PRIORITIES];
+    struct work_struct work;
+};
+
 struct autosar_implementation {
     struct autosar_application applications[MAX_AUTOSAR_APPLICATIONS];
     int application_count;
@@ -77,17 +192,30 @@ struct autosar_implementation {
     u32 total_errors;
     bool autosar_active;
     u32 execution_timeout_ms;
-    struct timer_list autosar_timer;
+    struct autosar_runnable runnables[MAX_AUTOSAR_RUNNABLES];
+    int runnable_count;
+    struct timer_wheel timing_wheel;    // every runnable's timing event
+    struct workqueue_struct *rte_wq;
+    u32 current_mode[MAX_AUTOSAR_MODE_GROUPS];
+    DECLARE_BITMAP(mode_triggers[MAX_AUTOSAR_MODE_GROUPS][AUTOSAR_MODES_PER_GROUP], MAX_AUTOSAR_RUNNABLES);
+    struct autosar_sr_element *sr_elements[MAX_AUTOSAR_SR_ELEMENTS];
 };
 
 static struct autosar_implementation global_autosar_implementation;
+static DEFINE_PER_CPU(struct autosar_core, autosar_cores);
+static DEFINE_MUTEX(autosar_sr_lock);       // connecting ports only, never the data path
+
+static void autosar_timing_event(struct tw_timer *t);
+static void autosar_core_work(struct work_struct *work);
+static void autosar_implicit_fetch(struct autosar_runnable *runnable);
+static void autosar_implicit_flush(struct autosar_runnable *runnable);
 
 /**
  * Initialize AUTOSAR implementation
  */
 static int autosar_implementation_init(void)
 {
-    int i, j, k;
+    int i, j, k, cpu;
     
     pr_info("Initializing AUTOSAR implementation\n");
     
@@ -129,10 +257,40 @@ static int autosar_implementation_init(void)
                 global_autosar_implementation.applications[i].services[j].ports[k].message_count = 0;
                 global_autosar_implementation.applications[i].services[j].ports[k].error_count = 0;
                 global_autosar_implementation.applications[i].services[j].ports[k].timestamp = 0;
+                bitmap_zero(global_autosar_implementation.applications[i].services[j].ports[k].triggers,
+                            MAX_AUTOSAR_RUNNABLES);
+                global_autosar_implementation.applications[i].services[j].ports[k].sr_element = -1;
+                global_autosar_implementation.applications[i].services[j].ports[k].sr_receiver = -1;
             }
         }
     }
     
+    // Initialize runnables and the per-core ready queues
+    global_autosar_implementation.runnable_count = 0;
+    for (i = 0; i < MAX_AUTOSAR_RUNNABLES; i++) {
+        global_autosar_implementation.runnables[i].runnable_id = i;
+        global_autosar_implementation.runnables[i].active = false;
+        INIT_LIST_HEAD(&global_autosar_implementation.runnables[i].ready_node);
+        tw_timer_init(&global_autosar_implementation.runnables[i].timing, autosar_timing_event);
+    }
+    timer_wheel_init(&global_autosar_implementation.timing_wheel, -1);
+    
+    for_each_possible_cpu(cpu) {
+        struct autosar_core *core = per_cpu_ptr(&autosar_cores, cpu);
+    
+        spin_lock_init(&core->lock);
+        core->ready_mask = 0;
+        for (i = 0; i < AUTOSAR_PRIORITIES; i++) {
+            INIT_LIST_HEAD(&core->ready[i]);
+        }
+        INIT_WORK(&core->work, autosar_core_work);
+    }
+    
+    global_autosar_implementation.rte_wq = alloc_workqueue("autosar_rte", WQ_HIGHPRI, 0);
+    if (!global_autosar_implementation.rte_wq) {
+        return -ENOMEM;
+    }
+    
     pr_info("AUTOSAR implementation initialized\n");
     
     return 0;
@@ -335,35 +493,609 @@ static int autosar_execute_application(u32 application_id)
 }
 
 /**
- * AUTOSAR execution timer
+ * Queue a runnable on its core. A runnable already queued is not
+ * queued twice: the pending run serves every activation before it.
  */
-static void autosar_execution_timer(struct timer_list *t)
+static void autosar_runnable_activate(struct autosar_runnable *runnable, enum autosar_rte_event event)
 {
-    pr_debug("AUTOSAR execution timer tick\n");
+    struct autosar_core *core;
+    unsigned long flags;
+    
+    if (!runnable->active || !READ_ONCE(global_autosar_implementation.autosar_active)) {
+        return;
+    }
     
-    // Simulate AUTOSAR execution process
+    runnable->activations[event]++;
+    if (test_and_set_bit(AUTOSAR_RUNNABLE_QUEUED, &runnable->flags)) {
+        runnable->coalesced++;
+        return;
+    }
+    
+    core = per_cpu_ptr(&autosar_cores, runnable->cpu);
+    spin_lock_irqsave(&core->lock, flags);
+    list_add_tail(&runnable->ready_node, &core->ready[runnable->priority]);
+    __set_bit(runnable->priority, &core->ready_mask);
+    spin_unlock_irqrestore(&core->lock, flags);
+    
+    queue_work_on(runnable->cpu, global_autosar_implementation.rte_wq, &core->work);
+}
+
+static void autosar_activate_all(const unsigned long *triggers, enum autosar_rte_event event)
+{
     int i;
-    for (i = 0; i < global_autosar_implementation.application_count; i++) {
-        if (global_autosar_implementation.applications[i].active) {
-            autosar_execute_application(i);
+    
+    for_each_set_bit(i, triggers, MAX_AUTOSAR_RUNNABLES) {
+        autosar_runnable_activate(&global_autosar_implementation.runnables[i], event);
+    }
+}
+
+/**
+ * A core's dispatcher: runs its ready runnables, highest priority first
+ */
+static void autosar_core_work(struct work_struct *work)
+{
+    struct autosar_core *core = container_of(work, struct autosar_core, work);
+    struct autosar_runnable *runnable;
+    unsigned long flags;
+    int priority;
+    
+    spin_lock_irqsave(&core->lock, flags);
+    while (core->ready_mask) {
+        priority = __ffs(core->ready_mask);
+        runnable = list_first_entry(&core->ready[priority], struct autosar_runnable, ready_node);
+        list_del_init(&runnable->ready_node);
+        if (list_empty(&core->ready[priority])) {
+            __clear_bit(priority, &core->ready_mask);
         }
+        // Events from here on activate it again
+        clear_bit(AUTOSAR_RUNNABLE_QUEUED, &runnable->flags);
+        spin_unlock_irqrestore(&core->lock, flags);
+    
+        autosar_implicit_fetch(runnable);
+        runnable->entry(runnable->arg);
+        autosar_implicit_flush(runnable);
+        runnable->execution_count++;
+        runnable->last_execution_time = jiffies;
+        atomic_inc(&global_autosar_implementation.total_executions);
+    
+        spin_lock_irqsave(&core->lock, flags);
     }
+    spin_unlock_irqrestore(&core->lock, flags);
+}
+
+static void autosar_timing_event(struct tw_timer *t)
+{
+    struct autosar_runnable *runnable = container_of(t, struct autosar_runnable, timing);
+    u32 period_ms = READ_ONCE(runnable->period_ms);
     
-    global_autosar_implementation.autosar_active = false;
+    if (!period_ms || !READ_ONCE(global_autosar_implementation.autosar_active)) {
+        return;
+    }
+    
+    // From the previous expiry, so the period does not drift
+    timer_wheel_mod(&global_autosar_implementation.timing_wheel, t, t->expires + msecs_to_jiffies(period_ms));
+    autosar_runnable_activate(runnable, AUTOSAR_EVENT_TIMING);
 }
 
 /**
- * Start AUTOSAR execution
+ * Add AUTOSAR runnable of an application, run on cpu at priority
+ */
+static int autosar_add_runnable(u32 application_id, const char *name, u32 priority, int cpu,
+                                void (*entry)(void *arg), void *arg)
+{
+    struct autosar_runnable *runnable;
+    int i;
+    
+    if (application_id >= MAX_AUTOSAR_APPLICATIONS || !name || !entry || priority >= AUTOSAR_PRIORITIES ||
+        cpu < 0 || cpu >= nr_cpu_ids || !cpu_possible(cpu)) {
+        pr_err("Invalid AUTOSAR runnable parameters\n");
+        return -EINVAL;
+    }
+    
+    if (!global_autosar_implementation.applications[application_id].active) {
+        pr_err("AUTOSAR application %d is not active\n", application_id);
+        return -EINVAL;
+    }
+    
+    // Find free runnable slot
+    for (i = 0; i < MAX_AUTOSAR_RUNNABLES; i++) {
+        if (!global_autosar_implementation.runnables[i].active) {
+            break;
+        }
+    }
+    
+    if (i >= MAX_AUTOSAR_RUNNABLES) {
+        pr_err("No free AUTOSAR runnable slots available\n");
+        return -ENOMEM;
+    }
+    
+    runnable = &global_autosar_implementation.runnables[i];
+    strscpy(runnable->name, name, sizeof(runnable->name));
+    runnable->application_id = application_id;
+    runnable->priority = priority;
+    runnable->cpu = cpu;
+    runnable->entry = entry;
+    runnable->arg = arg;
+    runnable->flags = 0;
+    runnable->period_ms = 0;
+    memset(runnable->activations, 0, sizeof(runnable->activations));
+    runnable->coalesced = 0;
+    runnable->execution_count = 0;
+    runnable->last_execution_time = 0;
+    runnable->implicit_count = 0;
+    runnable->active = true;
+    
+    global_autosar_implementation.runnable_count++;
+    
+    pr_info("AUTOSAR runnable %d added to application %d: name=%s, priority=%d, cpu=%d\n",
+            i, application_id, name, priority, cpu);
+    
+    return i;
+}
+
+/**
+ * Trigger a runnable every period_ms (TimingEvent), 0 to stop
+ */
+static int autosar_runnable_on_timing(u32 runnable_id, u32 period_ms)
+{
+    struct autosar_runnable *runnable;
+    
+    if (runnable_id >= MAX_AUTOSAR_RUNNABLES || !global_autosar_implementation.runnables[runnable_id].active) {
+        return -EINVAL;
+    }
+    
+    runnable = &global_autosar_implementation.runnables[runnable_id];
+    WRITE_ONCE(runnable->period_ms, period_ms);
+    if (!period_ms) {
+        timer_wheel_del(&global_autosar_implementation.timing_wheel, &runnable->timing);
+    } else if (global_autosar_implementation.autosar_active) {
+        timer_wheel_mod(&global_autosar_implementation.timing_wheel, &runnable->timing,
+                        jiffies + msecs_to_jiffies(period_ms));
+    }
+    
+    return 0;
+}
+
+/**
+ * Trigger a runnable on data received at a receiver port (DataReceivedEvent)
+ */
+static int autosar_runnable_on_data(u32 runnable_id, u32 application_id, u32 service_id, u32 port_id)
+{
+    struct autosar_port *port;
+    
+    if (runnable_id >= MAX_AUTOSAR_RUNNABLES || !global_autosar_implementation.runnables[runnable_id].active ||
+        application_id >= MAX_AUTOSAR_APPLICATIONS || service_id >= MAX_AUTOSAR_SERVICES ||
+        port_id >= MAX_AUTOSAR_PORTS) {
+        return -EINVAL;
+    }
+    
+    port = &global_autosar_implementation.applications[application_id].services[service_id].ports[port_id];
+    if (!port->active || port->type != AUTOSAR_PORT_RECEIVER) {
+        pr_err("AUTOSAR port %d is not an active receiver port\n", port_id);
+        return -EINVAL;
+    }
+    
+    set_bit(runnable_id, port->triggers);
+    
+    return 0;
+}
+
+/**
+ * Trigger a runnable on entry to a mode of a mode group (SwcModeSwitchEvent)
+ */
+static int autosar_runnable_on_mode(u32 runnable_id, u32 mode_group, u32 mode)
+{
+    if (runnable_id >= MAX_AUTOSAR_RUNNABLES || !global_autosar_implementation.runnables[runnable_id].active ||
+        mode_group >= MAX_AUTOSAR_MODE_GROUPS || mode >= AUTOSAR_MODES_PER_GROUP) {
+        return -EINVAL;
+    }
+    
+    set_bit(runnable_id, global_autosar_implementation.mode_triggers[mode_group][mode]);
+    
+    return 0;
+}
+
+static void autosar_port_notify(struct autosar_port *port)
+{
+    port->message_count++;
+    port->timestamp = jiffies;
+    autosar_activate_all(port->triggers, AUTOSAR_EVENT_DATA_RECEIVED);
+}
+
+/**
+ * Data received on a receiver port: activates the runnables waiting on it
+ */
+static int autosar_port_data_received(u32 application_id, u32 service_id, u32 port_id)
+{
+    struct autosar_port *port;
+    
+    if (application_id >= MAX_AUTOSAR_APPLICATIONS || service_id >= MAX_AUTOSAR_SERVICES ||
+        port_id >= MAX_AUTOSAR_PORTS) {
+        return -EINVAL;
+    }
+    
+    port = &global_autosar_implementation.applications[application_id].services[service_id].ports[port_id];
+    if (!port->active) {
+        return -EINVAL;
+    }
+    
+    autosar_port_notify(port);
+    
+    return 0;
+}
+
+/**
+ * Switch a mode group, activating the runnables of the mode entered
+ */
+static int autosar_mode_switch(u32 mode_group, u32 mode)
+{
+    if (mode_group >= MAX_AUTOSAR_MODE_GROUPS || mode >= AUTOSAR_MODES_PER_GROUP) {
+        return -EINVAL;
+    }
+    
+    if (xchg(&global_autosar_implementation.current_mode[mode_group], mode) == mode) {
+        return 0;
+    }
+    
+    pr_debug("AUTOSAR mode group %d switched to mode %d\n", mode_group, mode);
+    autosar_activate_all(global_autosar_implementation.mode_triggers[mode_group][mode], AUTOSAR_EVENT_MODE_SWITCH);
+    
+    return 0;
+}
+
+static struct autosar_port *autosar_port_get(u32 application_id, u32 service_id, u32 port_id)
+{
+    struct autosar_port *port;
+    
+    if (application_id >= MAX_AUTOSAR_APPLICATIONS || service_id >= MAX_AUTOSAR_SERVICES ||
+        port_id >= MAX_AUTOSAR_PORTS) {
+        return NULL;
+    }
+    
+    port = &global_autosar_implementation.applications[application_id].services[service_id].ports[port_id];
+    return port->active ? port : NULL;
+}
+
+// Last-is-best publish; the element's sender is the only writer
+static void autosar_sr_put(struct autosar_sr_element *element, const void *data, u32 len)
+{
+    u32 next = element->latest + 1;
+    struct autosar_sr_slot *slot = &element->slots[next & 1];
+    
+    WRITE_ONCE(slot->gen, slot->gen + 1);
+    smp_wmb();
+    WRITE_ONCE(slot->len, len);
+    memcpy(slot->data, data, len);
+    smp_wmb();
+    WRITE_ONCE(slot->gen, slot->gen + 1);
+    smp_store_release(&element->latest, next);
+}
+
+static int autosar_sr_get(struct autosar_sr_element *element, void *buffer, u32 max_len, u32 *actual_len)
+{
+    struct autosar_sr_slot *slot;
+    u32 latest, gen, len;
+    
+    for (;;) {
+        latest = smp_load_acquire(&element->latest);
+        if (!latest) {
+            return -ENODATA;
+        }
+        slot = &element->slots[latest & 1];
+        gen = READ_ONCE(slot->gen);
+        if (gen & 1) {
+            continue;
+        }
+        smp_rmb();
+        len = min(READ_ONCE(slot->len), max_len);
+        memcpy(buffer, slot->data, len);
+        smp_rmb();
+        if (READ_ONCE(slot->gen) == gen) {
+            *actual_len = len;
+            return 0;
+        }
+    }
+}
+
+static void autosar_sr_enqueue(struct autosar_sr_queue *queue, const void *data, u32 len)
+{
+    u32 head = queue->head;
+    struct autosar_sr_entry *entry;
+    
+    if (head - smp_load_acquire(&queue->tail) >= AUTOSAR_SR_QUEUE_DEPTH) {
+        WRITE_ONCE(queue->lost, queue->lost + 1);
+        return;
+    }
+    entry = &queue->entries[head & (AUTOSAR_SR_QUEUE_DEPTH - 1)];
+    entry->len = len;
+    memcpy(entry->data, data, len);
+    smp_store_release(&queue->head, head + 1);
+}
+
+static int autosar_sr_dequeue(struct autosar_sr_queue *queue, void *buffer, u32 max_len, u32 *actual_len)
+{
+    u32 tail = queue->tail;
+    struct autosar_sr_entry *entry;
+    
+    if (tail == smp_load_acquire(&queue->head)) {
+        return -ENODATA;
+    }
+    entry = &queue->entries[tail & (AUTOSAR_SR_QUEUE_DEPTH - 1)];
+    *actual_len = min(entry->len, max_len);
+    memcpy(buffer, entry->data, *actual_len);
+    smp_store_release(&queue->tail, tail + 1);
+    
+    return 0;
+}
+
+static void autosar_sr_send(struct autosar_sr_element *element, const void *data, u32 len)
+{
+    int i, n = smp_load_acquire(&element->receiver_count);
+    
+    if (element->queued) {
+        for (i = 0; i < n; i++) {
+            autosar_sr_enqueue(&element->queues[i], data, len);
+        }
+    } else {
+        autosar_sr_put(element, data, len);
+    }
+    
+    element->sender->message_count++;
+    element->sender->timestamp = jiffies;
+    for (i = 0; i < n; i++) {
+        autosar_port_notify(element->receivers[i]);
+    }
+}
+
+/**
+ * Connect a sender port to a receiver port. Every receiver of a sender
+ * shares its data element, of len bytes, last-is-best or queued.
+ */
+static int autosar_sr_connect(u32 sender_application, u32 sender_service, u32 sender_port,
+                              u32 receiver_application, u32 receiver_service, u32 receiver_port,
+                              bool queued, u32 len)
+{
+    struct autosar_port *sender = autosar_port_get(sender_application, sender_service, sender_port);
+    struct autosar_port *receiver = autosar_port_get(receiver_application, receiver_service, receiver_port);
+    struct autosar_sr_element *element;
+    int i, n, ret = 0;
+    
+    if (!sender || !receiver || sender->type != AUTOSAR_PORT_SENDER || receiver->type != AUTOSAR_PORT_RECEIVER ||
+        !len || len > AUTOSAR_SR_DATA_MAX) {
+        pr_err("Invalid AUTOSAR sender-receiver connection\n");
+        return -EINVAL;
+    }
+    
+    mutex_lock(&autosar_sr_lock);
+    
+    if (receiver->sr_element >= 0) {
+        ret = -EBUSY;
+        goto out;
+    }
+    
+    if (sender->sr_element < 0) {
+        for (i = 0; i < MAX_AUTOSAR_SR_ELEMENTS; i++) {
+            if (!global_autosar_implementation.sr_elements[i]) {
+                break;
+            }
+        }
+        if (i >= MAX_AUTOSAR_SR_ELEMENTS) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        element = kzalloc(struct_size(element, queues, queued ? AUTOSAR_SR_RECEIVERS : 0), GFP_KERNEL);
+        if (!element) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        element->queued = queued;
+        element->len = len;
+        element->sender = sender;
+        global_autosar_implementation.sr_elements[i] = element;
+        sender->sr_element = i;
+    }
+    
+    element = global_autosar_implementation.sr_elements[sender->sr_element];
+    if (element->queued != queued || element->len != len) {
+        ret = -EINVAL;
+        goto out;
+    }
+    n = element->receiver_count;
+    if (n >= AUTOSAR_SR_RECEIVERS) {
+        ret = -ENOSPC;
+        goto out;
+    }
+    
+    element->receivers[n] = receiver;
+    receiver->sr_element = sender->sr_element;
+    receiver->sr_receiver = n;
+    smp_store_release(&element->receiver_count, n + 1);
+    
+    pr_info("AUTOSAR port %s connected to %s: %s, %d bytes\n",
+            sender->name, receiver->name, queued ? "queued" : "last-is-best", len);
+    
+out:
+    mutex_unlock(&autosar_sr_lock);
+    return ret;
+}
+
+/**
+ * Explicit send on a sender port (Rte_Write, Rte_Send for queued data)
+ */
+static int autosar_rte_write(u32 application_id, u32 service_id, u32 port_id, const void *data, u32 len)
+{
+    struct autosar_port *port = autosar_port_get(application_id, service_id, port_id);
+    struct autosar_sr_element *element;
+    
+    if (!port || port->type != AUTOSAR_PORT_SENDER || port->sr_element < 0 || !data) {
+        return -EINVAL;
+    }
+    
+    element = global_autosar_implementation.sr_elements[port->sr_element];
+    if (len > element->len) {
+        return -EMSGSIZE;
+    }
+    
+    autosar_sr_send(element, data, len);
+    
+    return 0;
+}
+
+/**
+ * Explicit read on a receiver port (Rte_Read, Rte_Receive for queued
+ * data). -ENODATA if nothing was sent yet, or the queue is empty.
+ */
+static int autosar_rte_read(u32 application_id, u32 service_id, u32 port_id, void *buffer, u32 max_len,
+                            u32 *actual_len)
+{
+    struct autosar_port *port = autosar_port_get(application_id, service_id, port_id);
+    struct autosar_sr_element *element;
+    
+    if (!port || port->type != AUTOSAR_PORT_RECEIVER || port->sr_element < 0 || !buffer || !actual_len) {
+        return -EINVAL;
+    }
+    
+    element = global_autosar_implementation.sr_elements[port->sr_element];
+    if (element->queued) {
+        return autosar_sr_dequeue(&element->queues[port->sr_receiver], buffer, max_len, actual_len);
+    }
+    return autosar_sr_get(element, buffer, max_len, actual_len);
+}
+
+/**
+ * Give a runnable implicit access to a connected last-is-best port.
+ * Returns the index for autosar_rte_iread() / autosar_rte_iwrite().
+ */
+static int autosar_runnable_implicit(u32 runnable_id, u32 application_id, u32 service_id, u32 port_id)
+{
+    struct autosar_port *port = autosar_port_get(application_id, service_id, port_id);
+    struct autosar_runnable *runnable;
+    struct autosar_sr_element *element;
+    struct autosar_implicit *implicit;
+    
+    if (runnable_id >= MAX_AUTOSAR_RUNNABLES || !global_autosar_implementation.runnables[runnable_id].active ||
+        !port || port->sr_element < 0) {
+        return -EINVAL;
+    }
+    
+    runnable = &global_autosar_implementation.runnables[runnable_id];
+    element = global_autosar_implementation.sr_elements[port->sr_element];
+    if (element->queued) {
+        pr_err("AUTOSAR implicit access needs last-is-best data\n");
+        return -EINVAL;
+    }
+    if (runnable->implicit_count >= AUTOSAR_IMPLICIT_PORTS) {
+        return -ENOSPC;
+    }
+    
+    implicit = &runnable->implicit[runnable->implicit_count];
+    implicit->element = element;
+    implicit->write = port->type == AUTOSAR_PORT_SENDER;
+    implicit->dirty = false;
+    implicit->len = 0;
+    
+    return runnable->implicit_count++;
+}
+
+// Before each activation: one copy of every implicitly read element
+static void autosar_implicit_fetch(struct autosar_runnable *runnable)
+{
+    struct autosar_implicit *implicit;
+    int i;
+    
+    for (i = 0; i < runnable->implicit_count; i++) {
+        implicit = &runnable->implicit[i];
+        if (implicit->write) {
+            implicit->dirty = false;
+        } else if (autosar_sr_get(implicit->element, implicit->data, sizeof(implicit->data), &implicit->len)) {
+            implicit->len = 0;
+        }
+    }
+}
+
+// After each activation: publish what the runnable wrote
+static void autosar_implicit_flush(struct autosar_runnable *runnable)
+{
+    struct autosar_implicit *implicit;
+    int i;
+    
+    for (i = 0; i < runnable->implicit_count; i++) {
+        implicit = &runnable->implicit[i];
+        if (implicit->write && implicit->dirty) {
+            autosar_sr_send(implicit->element, implicit->data, implicit->len);
+        }
+    }
+}
+
+/**
+ * Rte_IRead: the value as of the start of this activation, the same
+ * however often it is read. NULL until the sender wrote once.
+ */
+static const void *autosar_rte_iread(u32 runnable_id, int index, u32 *len)
+{
+    struct autosar_implicit *implicit;
+    
+    if (runnable_id >= MAX_AUTOSAR_RUNNABLES || index < 0 ||
+        index >= global_autosar_implementation.runnables[runnable_id].implicit_count) {
+        return NULL;
+    }
+    
+    implicit = &global_autosar_implementation.runnables[runnable_id].implicit[index];
+    if (implicit->write || !implicit->len) {
+        return NULL;
+    }
+    if (len) {
+        *len = implicit->len;
+    }
+    return implicit->data;
+}
+
+/**
+ * Rte_IWrite: staged in the runnable's copy, sent when the activation ends
+ */
+static int autosar_rte_iwrite(u32 runnable_id, int index, const void *data, u32 len)
+{
+    struct autosar_implicit *implicit;
+    
+    if (runnable_id >= MAX_AUTOSAR_RUNNABLES || index < 0 || !data ||
+        index >= global_autosar_implementation.runnables[runnable_id].implicit_count) {
+        return -EINVAL;
+    }
+    
+    implicit = &global_autosar_implementation.runnables[runnable_id].implicit[index];
+    if (!implicit->write) {
+        return -EINVAL;
+    }
+    if (len > implicit->element->len) {
+        return -EMSGSIZE;
+    }
+    
+    memcpy(implicit->data, data, len);
+    implicit->len = len;
+    implicit->dirty = true;
+    
+    return 0;
+}
+
+/**
+ * Start AUTOSAR execution: arm every timing event
  */
 static int autosar_start_execution(void)
 {
+    struct autosar_runnable *runnable;
+    int i;
+    
     pr_info("Starting AUTOSAR execution\n");
     
-    global_autosar_implementation.autosar_active = true;
+    WRITE_ONCE(global_autosar_implementation.autosar_active, true);
     
-    // Initialize execution timer
-    timer_setup(&global_autosar_implementation.autosar_timer, autosar_execution_timer, 0);
-    mod_timer(&global_autosar_implementation.autosar_timer, jiffies + msecs_to_jiffies(global_autosar_implementation.execution_timeout_ms));
+    for (i = 0; i < MAX_AUTOSAR_RUNNABLES; i++) {
+        runnable = &global_autosar_implementation.runnables[i];
+        if (runnable->active && runnable->period_ms) {
+            timer_wheel_mod(&global_autosar_implementation.timing_wheel, &runnable->timing,
+                            jiffies + msecs_to_jiffies(runnable->period_ms));
+        }
+    }
     
     return 0;
 }
@@ -413,9 +1145,15 @@ static int __init autosar_implementation_init_module(void)
  */
 static void __exit autosar_implementation_cleanup_module(void)
 {
-    // Cleanup execution timer
-    if (global_autosar_implementation.autosar_active) {
-        del_timer_sync(&global_autosar_implementation.autosar_timer);
+    int i;
+    
+    // Stop timing events, then let queued runnables finish
+    WRITE_ONCE(global_autosar_implementation.autosar_active, false);
+    timer_wheel_destroy(&global_autosar_implementation.timing_wheel);
+    destroy_workqueue(global_autosar_implementation.rte_wq);
+    
+    for (i = 0; i < MAX_AUTOSAR_SR_ELEMENTS; i++) {
+        kfree(global_autosar_implementation.sr_elements[i]);
     }
     
     pr_info("AUTOSAR Implementation unloaded\n");
@@ -0,0 +1,133 @@
+/**
+ * DDS core
+ *
+ * The one DDS engine of the tree, in dds_protocol.c. The automotive
+ * stack addresses topics by participant and topic ID, the middleware
+ * layer (middleware_frameworks/dds_middleware.c) by name; both resolve
+ * to a struct dds_topic handle, names through an interned hash table,
+ * and every sample read and write goes through the handle. Callers on
+ * a hot path resolve once with dds_core_lookup() and keep the handle.
+ *
+ * Deadline and liveliness are watched for every topic on one shared
+ * timer wheel. Publishing never touches the wheel: a topic's timer
+ * fires once per period, finds the last write and either re-arms for
+ * the rest of the period or reports the miss. Listeners may run in
+ * timer (softirq) context and must not sleep. Lifespan needs no timer
+ * at all; samples are stamped with gPTP time (gptp.h) as they are
+ * written and those older than it are skipped when they are read.
+ *
+ * Typed samples (payload_types.h) are XCDR2 on the wire; the _typed
+ * helpers below inline the type's serializer into the caller.
+ */
+
+#ifndef DDS_CORE_H
+#define DDS_CORE_H
+
+#include <linux/types.h>
+
+#include "payload_types.h"
+
+#define MAX_DDS_PARTICIPANTS 32
+#define MAX_DDS_TOPICS 64
+#define DDS_TOPIC_NAME_MAX 128
+#define DDS_SAMPLE_MAX_LEN 4096            // per history slot; larger samples belong on a dds_shm pool
+#define DDS_ANY_TOPIC U32_MAX               // dds_core_create_topic(): first free topic ID
+#define DDS_DEADLINE_MS 100                 // default deadline period, 0 for none
+#define DDS_CDR_MAX 256                     // typed samples pass through a stack buffer this size
+
+enum dds_reliability_kind {
+    DDS_RELIABILITY_BEST_EFFORT = 0,
+    DDS_RELIABILITY_RELIABLE = 1
+};
+
+enum dds_durability_kind {
+    DDS_DURABILITY_VOLATILE = 0,
+    DDS_DURABILITY_TRANSIENT_LOCAL = 1,
+    DDS_DURABILITY_TRANSIENT = 2,
+    DDS_DURABILITY_PERSISTENT = 3
+};
+
+enum dds_history_kind {
+    DDS_HISTORY_KEEP_LAST = 0,
+    DDS_HISTORY_KEEP_ALL = 1
+};
+
+enum dds_qos_event {
+    DDS_DEADLINE_MISSED,                // no sample within the deadline period
+    DDS_LIVELINESS_LOST,                // writer silent for the whole lease
+    DDS_LIVELINESS_REGAINED,            // first write or assertion after a loss
+};
+
+struct dds_topic;
+
+typedef void (*dds_qos_listener_t)(struct dds_topic *topic, enum dds_qos_event event, void *arg);
+
+struct dds_qos_status {
+    u32 deadline_missed;
+    u32 liveliness_lost;
+    bool alive;
+};
+
+// Where one reader is in a topic's history; owned by the reader
+struct dds_reader_cursor {
+    struct dds_topic *topic;
+    u32 next;                   // write number of the next sample to take
+    u32 lost;                   // samples overwritten before this reader got to them
+};
+
+int dds_core_create_participant(u32 participant_id, const char *name);
+struct dds_topic *dds_core_create_topic(u32 participant_id, u32 topic_id, const char *name, const char *type_name,
+                                        enum dds_reliability_kind reliability, enum dds_durability_kind durability,
+                                        enum dds_history_kind history, u32 history_depth, u32 deadline_ms);
+struct dds_topic *dds_core_topic(u32 participant_id, u32 topic_id);
+struct dds_topic *dds_core_lookup(u32 participant_id, const char *name);
+int dds_core_write(struct dds_topic *topic, const u8 *data, u32 len);
+int dds_core_read(struct dds_topic *topic, u8 *buffer, u32 max_len, u32 *actual_len);
+int dds_core_reader_init(struct dds_reader_cursor *cursor, struct dds_topic *topic);
+int dds_core_read_next(struct dds_reader_cursor *cursor, u8 *buffer, u32 max_len, u32 *actual_len);
+int dds_core_configure_qos(struct dds_topic *topic, enum dds_reliability_kind reliability,
+                           enum dds_durability_kind durability, enum dds_history_kind history,
+                           u32 history_depth, u32 deadline_ms);
+int dds_core_set_liveliness(struct dds_topic *topic, u32 lease_ms);
+int dds_core_set_lifespan(struct dds_topic *topic, u32 lifespan_ms);
+int dds_core_assert_liveliness(struct dds_topic *topic);
+int dds_core_set_listener(struct dds_topic *topic, dds_qos_listener_t listener, void *arg);
+int dds_core_qos_status(struct dds_topic *topic, struct dds_qos_status *status);
+
+static inline int dds_core_write_typed(struct dds_topic *topic, const struct payload_type *type, const void *sample)
+{
+    u8 buf[DDS_CDR_MAX];
+    int len = type->cdr_put(sample, buf, sizeof(buf));
+    
+    if (len < 0) {
+        return len;
+    }
+    return dds_core_write(topic, buf, len);
+}
+
+static inline int dds_core_read_typed(struct dds_topic *topic, const struct payload_type *type, void *sample)
+{
+    u8 buf[DDS_CDR_MAX];
+    u32 len;
+    int ret = dds_core_read(topic, buf, sizeof(buf), &len);
+    
+    if (ret) {
+        return ret;
+    }
+    return type->cdr_get(sample, buf, len);
+}
+
+static inline int dds_core_read_next_typed(struct dds_reader_cursor *cursor, const struct payload_type *type,
+                                           void *sample)
+{
+    u8 buf[DDS_CDR_MAX];
+    u32 len;
+    int ret = dds_core_read_next(cursor, buf, sizeof(buf), &len);
+    
+    if (ret) {
+        return ret;
+    }
+    return type->cdr_get(sample, buf, len);
+}
+
+#endif /* DDS_CORE_H */
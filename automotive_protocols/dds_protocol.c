@@ -5,6 +5,11 @@
  * 
  * Advanced DDS (Data Distribution Service) protocol
  * Research breakthrough: Real-time data distribution for automotive
+ *
+ * This is the DDS core for the whole tree (see dds_core.h): the ID
+ * based API below and the name based one of dds_middleware.c both
+ * resolve to topic handles and share the dds_core_* read and write
+ * paths.
  */
 
 #include <linux/module.h>
@@ -14,43 +19,56 @@
 #include <linux/atomic.h>
 #include <linux/timer.h>
 #include <linux/workqueue.h>
+#include <linux/string.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/err.h>
+#include <linux/bitops.h>
 
-#define DDS_VERSION "1.0.0"
-#define MAX_DDS_PARTICIPANTS 32
-#define MAX_DDS_TOPICS 64
-#define MAX_DDS_SAMPLES 128
-#define DDS_DEADLINE_MS 100
+#include "../networking_stacks/timer_wheel.h"
+#include "dds_core.h"
+#include "dds_shm.h"
+#include "gptp.h"
 
-enum dds_reliability_kind {
-    DDS_RELIABILITY_BEST_EFFORT = 0,
-    DDS_RELIABILITY_RELIABLE = 1
-};
+#define DDS_VERSION "1.1.0"
+#define DDS_KEEP_ALL_DEPTH 64               // history kept for KEEP_ALL topics, most for KEEP_LAST
+#define DDS_NAME_HASH_BITS 7
 
-enum dds_durability_kind {
-    DDS_DURABILITY_VOLATILE = 0,
-    DDS_DURABILITY_TRANSIENT_LOCAL = 1,
-    DDS_DURABILITY_TRANSIENT = 2,
-    DDS_DURABILITY_PERSISTENT = 3
-};
+// dds_topic qos_flags
+#define DDS_TOPIC_ALIVE 0
 
-enum dds_history_kind {
-    DDS_HISTORY_KEEP_LAST = 0,
-    DDS_HISTORY_KEEP_ALL = 1
+struct dds_history_slot {
+    u32 gen;                    // odd while the writer fills the slot
+    u32 index;                  // write number of the sample held
+    u32 len;
+    u64 timestamp;              // gPTP time of the write
+    u8 *data;                   // DDS_SAMPLE_MAX_LEN bytes
 };
 
-struct dds_sample {
-    u32 sample_id;
-    u32 topic_id;
-    u8 *data;
-    u32 data_len;
-    u64 timestamp;
-    bool valid;
-    u32 sequence_number;
+/*
+ * Per-topic sample history: one writer at a time under the topic's
+ * write_lock, readers without any lock. Sample n lives in slot
+ * n & mask until the writer comes round again; a reader checks the
+ * slot's generation before and after copying and retries if the
+ * writer got there first. capacity is depth rounded up to a power of
+ * two, only the last depth samples are handed out.
+ */
+struct dds_history {
+    u32 head;                   // samples written
+    u32 mask;
+    u32 depth;
+    struct dds_history_slot slots[];
 };
 
 struct dds_topic {
     u32 topic_id;
-    char name[128];
+    struct dds_participant *participant;
+    char name[DDS_TOPIC_NAME_MAX];
     char type_name[128];
     enum dds_reliability_kind reliability;
     enum dds_durability_kind durability;
@@ -61,6 +79,20 @@ struct dds_topic {
     u32 sample_count;
     u32 subscriber_count;
     u64 last_sample_time;
+    struct dds_history __rcu *ring;
+    spinlock_t write_lock;
+    struct hlist_node name_node;        // in dds_topic_names while active
+    u32 name_hash;
+    u32 lifespan_ms;                    // 0: samples never expire
+    u32 lease_ms;                       // liveliness lease, 0: not monitored
+    u64 last_asserted;                  // jiffies of the last write or assertion
+    unsigned long qos_flags;
+    u32 deadline_missed;
+    u32 liveliness_lost;
+    struct tw_timer deadline_timer;
+    struct tw_timer liveliness_timer;
+    dds_qos_listener_t listener;
+    void *listener_arg;
 };
 
 struct dds_participant {
@@ -77,17 +109,22 @@ struct dds_participant {
 struct dds_protocol {
     struct dds_participant participants[MAX_DDS_PARTICIPANTS];
     int participant_count;
-    struct dds_sample samples[MAX_DDS_SAMPLES];
-    int sample_count;
     atomic_t total_messages;
     u32 total_errors;
     bool dds_active;
     u32 default_deadline_ms;
-    struct timer_list dds_timer;
+    struct timer_wheel qos_wheel;       // deadline and liveliness of every topic
 };
 
 static struct dds_protocol global_dds_protocol;
 
+// Topic names, interned at create time: (participant, name) to topic
+static DEFINE_HASHTABLE(dds_topic_names, DDS_NAME_HASH_BITS);
+static DEFINE_MUTEX(dds_topic_mutex);
+
+static void dds_deadline_timeout(struct tw_timer *t);
+static void dds_liveliness_timeout(struct tw_timer *t);
+
 /**
  * Initialize DDS protocol
  */
@@ -98,11 +135,11 @@ static int dds_protocol_init(void)
     pr_info("Initializing DDS protocol\n");
     
     global_dds_protocol.participant_count = 0;
-    global_dds_protocol.sample_count = 0;
     atomic_set(&global_dds_protocol.total_messages, 0);
     global_dds_protocol.total_errors = 0;
     global_dds_protocol.dds_active = false;
     global_dds_protocol.default_deadline_ms = DDS_DEADLINE_MS;
+    timer_wheel_init(&global_dds_protocol.qos_wheel, -1);
     
     // Initialize participants
     for (i = 0; i < MAX_DDS_PARTICIPANTS; i++) {
@@ -117,6 +154,7 @@ static int dds_protocol_init(void)
         // Initialize topics
         for (j = 0; j < MAX_DDS_TOPICS; j++) {
             global_dds_protocol.participants[i].topics[j].topic_id = j;
+            global_dds_protocol.participants[i].topics[j].participant = &global_dds_protocol.participants[i];
             strcpy(global_dds_protocol.participants[i].topics[j].name, "");
             strcpy(global_dds_protocol.participants[i].topics[j].type_name, "");
             global_dds_protocol.participants[i].topics[j].reliability = DDS_RELIABILITY_BEST_EFFORT;
@@ -128,29 +166,244 @@ static int dds_protocol_init(void)
             global_dds_protocol.participants[i].topics[j].sample_count = 0;
             global_dds_protocol.participants[i].topics[j].subscriber_count = 0;
             global_dds_protocol.participants[i].topics[j].last_sample_time = 0;
+            RCU_INIT_POINTER(global_dds_protocol.participants[i].topics[j].ring, NULL);
+            spin_lock_init(&global_dds_protocol.participants[i].topics[j].write_lock);
+            tw_timer_init(&global_dds_protocol.participants[i].topics[j].deadline_timer, dds_deadline_timeout);
+            tw_timer_init(&global_dds_protocol.participants[i].topics[j].liveliness_timer, dds_liveliness_timeout);
         }
     }
     
-    // Initialize samples
-    for (i = 0; i < MAX_DDS_SAMPLES; i++) {
-        global_dds_protocol.samples[i].sample_id = i;
-        global_dds_protocol.samples[i].topic_id = 0;
-        global_dds_protocol.samples[i].data = NULL;
-        global_dds_protocol.samples[i].data_len = 0;
-        global_dds_protocol.samples[i].timestamp = 0;
-        global_dds_protocol.samples[i].valid = false;
-        global_dds_protocol.samples[i].sequence_number = 0;
+    pr_info("DDS protocol initialized\n");
+    
+    return 0;
+}
+
+static u32 dds_history_depth(enum dds_history_kind history, u32 history_depth)
+{
+    return history == DDS_HISTORY_KEEP_ALL ? DDS_KEEP_ALL_DEPTH : max_t(u32, history_depth, 1);
+}
+
+// A KEEP_LAST depth beyond the ring is refused, not quietly cut down
+static bool dds_history_depth_valid(enum dds_history_kind history, u32 history_depth)
+{
+    if (history == DDS_HISTORY_KEEP_LAST && history_depth > DDS_KEEP_ALL_DEPTH) {
+        pr_err("DDS KEEP_LAST depth %u exceeds the history capacity of %d\n", history_depth, DDS_KEEP_ALL_DEPTH);
+        return false;
     }
+    return true;
+}
+
+static struct dds_history *dds_history_alloc(u32 depth)
+{
+    u32 i, capacity = roundup_pow_of_two(depth);
+    struct dds_history *h;
+    u8 *data;
     
-    pr_info("DDS protocol initialized\n");
+    h = kvzalloc(struct_size(h, slots, capacity) + (size_t)capacity * DDS_SAMPLE_MAX_LEN, GFP_KERNEL);
+    if (!h) {
+        return NULL;
+    }
+    h->mask = capacity - 1;
+    h->depth = depth;
+    data = (u8 *)&h->slots[capacity];
+    for (i = 0; i < capacity; i++) {
+        h->slots[i].data = data + (size_t)i * DDS_SAMPLE_MAX_LEN;
+    }
+    return h;
+}
+
+/*
+ * Copy sample index out of its slot; false if the writer has reused the
+ * slot, before or during the copy
+ */
+static bool dds_history_copy(struct dds_history *h, u32 index, u8 *buffer, u32 max_len, u32 *actual_len,
+                             u64 *timestamp)
+{
+    struct dds_history_slot *slot = &h->slots[index & h->mask];
+    u32 gen, len;
+    
+    gen = READ_ONCE(slot->gen);
+    if (gen & 1) {
+        return false;
+    }
+    smp_rmb();
+    if (READ_ONCE(slot->index) != index) {
+        return false;
+    }
+    len = min(READ_ONCE(slot->len), max_len);
+    *timestamp = READ_ONCE(slot->timestamp);
+    memcpy(buffer, slot->data, len);
+    smp_rmb();
+    if (READ_ONCE(slot->gen) != gen) {
+        return false;
+    }
+    *actual_len = len;
+    return true;
+}
+
+// Under the topic's write_lock
+static void dds_history_put(struct dds_history *h, u32 index, const u8 *data, u32 len, u64 timestamp)
+{
+    struct dds_history_slot *slot = &h->slots[index & h->mask];
+    
+    WRITE_ONCE(slot->gen, slot->gen + 1);
+    smp_wmb();
+    WRITE_ONCE(slot->index, index);
+    WRITE_ONCE(slot->len, len);
+    slot->timestamp = timestamp;
+    memcpy(slot->data, data, len);
+    smp_wmb();
+    WRITE_ONCE(slot->gen, slot->gen + 1);
+}
+
+/*
+ * Give a topic a history of depth samples. The samples the old history
+ * still has move across under their write numbers, so reader cursors
+ * carry on where they were.
+ */
+static int dds_history_resize(struct dds_topic *topic, u32 depth)
+{
+    struct dds_history *h = dds_history_alloc(depth), *old;
+    u32 n, index;
+    
+    if (!h) {
+        return -ENOMEM;
+    }
+    
+    spin_lock(&topic->write_lock);
+    old = rcu_dereference_protected(topic->ring, lockdep_is_held(&topic->write_lock));
+    if (old) {
+        n = min3(old->head, old->depth, depth);
+        for (index = old->head - n; index != old->head; index++) {
+            struct dds_history_slot *slot = &old->slots[index & old->mask];
+    
+            dds_history_put(h, index, slot->data, slot->len, slot->timestamp);
+        }
+        h->head = old->head;
+    }
+    rcu_assign_pointer(topic->ring, h);
+    spin_unlock(&topic->write_lock);
     
+    if (old) {
+        synchronize_rcu();
+        kvfree(old);
+    }
     return 0;
 }
 
+// Sample written more than the topic's lifespan ago
+static bool dds_sample_expired(const struct dds_topic *topic, u64 timestamp)
+{
+    u32 lifespan_ms = READ_ONCE(topic->lifespan_ms);
+    
+    return lifespan_ms && gptp_now() - timestamp > (u64)lifespan_ms * NSEC_PER_MSEC;
+}
+
+static void dds_qos_notify(struct dds_topic *topic, enum dds_qos_event event)
+{
+    dds_qos_listener_t listener = smp_load_acquire(&topic->listener);
+    
+    if (listener) {
+        listener(topic, event, READ_ONCE(topic->listener_arg));
+    }
+}
+
+/*
+ * Deadline timer: due one period after the last write. Writes do not
+ * re-arm it; when it fires after one, it moves to that write's due
+ * time instead of reporting.
+ */
+static void dds_deadline_timeout(struct tw_timer *t)
+{
+    struct dds_topic *topic = container_of(t, struct dds_topic, deadline_timer);
+    unsigned long period = msecs_to_jiffies(READ_ONCE(topic->deadline_ms));
+    unsigned long due;
+    
+    if (!topic->active || !period) {
+        return;
+    }
+    
+    due = (unsigned long)READ_ONCE(topic->last_sample_time) + period;
+    if (time_before(jiffies, due)) {
+        timer_wheel_mod(&global_dds_protocol.qos_wheel, t, due);
+        return;
+    }
+    
+    topic->deadline_missed++;
+    pr_debug("DDS topic %s missed its %d ms deadline\n", topic->name, topic->deadline_ms);
+    dds_qos_notify(topic, DDS_DEADLINE_MISSED);
+    
+    // Reported again every period until the writer is back
+    timer_wheel_mod(&global_dds_protocol.qos_wheel, t, jiffies + period);
+}
+
+static void dds_liveliness_timeout(struct tw_timer *t)
+{
+    struct dds_topic *topic = container_of(t, struct dds_topic, liveliness_timer);
+    unsigned long lease = msecs_to_jiffies(READ_ONCE(topic->lease_ms));
+    unsigned long due;
+    
+    if (!topic->active || !lease) {
+        return;
+    }
+    
+    due = (unsigned long)READ_ONCE(topic->last_asserted) + lease;
+    if (time_before(jiffies, due)) {
+        timer_wheel_mod(&global_dds_protocol.qos_wheel, t, due);
+        return;
+    }
+    
+    // Left disarmed: the next write or assertion re-arms it
+    if (test_and_clear_bit(DDS_TOPIC_ALIVE, &topic->qos_flags)) {
+        topic->liveliness_lost++;
+        pr_debug("DDS topic %s lost liveliness\n", topic->name);
+        dds_qos_notify(topic, DDS_LIVELINESS_LOST);
+    }
+}
+
+// (Re)start the deadline period from the last write, if there was one
+static void dds_deadline_arm(struct dds_topic *topic)
+{
+    if (!topic->deadline_ms) {
+        timer_wheel_del(&global_dds_protocol.qos_wheel, &topic->deadline_timer);
+        return;
+    }
+    if (topic->sample_count) {
+        timer_wheel_mod(&global_dds_protocol.qos_wheel, &topic->deadline_timer,
+                        (unsigned long)topic->last_sample_time + msecs_to_jiffies(topic->deadline_ms));
+    }
+}
+
+static void dds_liveliness_assert(struct dds_topic *topic)
+{
+    WRITE_ONCE(topic->last_asserted, jiffies);
+    
+    if (unlikely(!test_bit(DDS_TOPIC_ALIVE, &topic->qos_flags)) && READ_ONCE(topic->lease_ms) &&
+        !test_and_set_bit(DDS_TOPIC_ALIVE, &topic->qos_flags)) {
+        timer_wheel_mod(&global_dds_protocol.qos_wheel, &topic->liveliness_timer,
+                        jiffies + msecs_to_jiffies(topic->lease_ms));
+        dds_qos_notify(topic, DDS_LIVELINESS_REGAINED);
+    }
+}
+
+/*
+ * After every write, outside the write lock. In the steady state this
+ * touches no timer: the deadline timer is only armed for a topic's
+ * first sample, liveliness only after it was lost.
+ */
+static void dds_qos_written(struct dds_topic *topic)
+{
+    if (unlikely(topic->deadline_ms && !tw_timer_pending(&topic->deadline_timer))) {
+        timer_wheel_mod(&global_dds_protocol.qos_wheel, &topic->deadline_timer,
+                        jiffies + msecs_to_jiffies(topic->deadline_ms));
+    }
+    dds_liveliness_assert(topic);
+}
+
 /**
  * Create DDS participant
  */
-static int dds_create_participant(u32 participant_id, const char *name)
+int dds_core_create_participant(u32 participant_id, const char *name)
 {
     if (participant_id >= MAX_DDS_PARTICIPANTS || !name) {
         pr_err("Invalid DDS participant parameters\n");
@@ -159,6 +412,14 @@ static int dds_create_participant(u32 participant_id, const char *name)
     
     struct dds_participant *participant = &global_dds_protocol.participants[participant_id];
     
+    if (strlen(name) >= sizeof(participant->name)) {
+        pr_err("DDS participant name too long\n");
+        return -EINVAL;
+    }
+    
+    if (!participant->active) {
+        global_dds_protocol.participant_count++;
+    }
     strcpy(participant->name, name);
     participant->active = true;
     participant->topic_count = 0;
@@ -166,33 +427,122 @@ static int dds_create_participant(u32 participant_id, const char *name)
     participant->total_errors = 0;
     participant->last_activity_time = jiffies;
     
-    global_dds_protocol.participant_count++;
-    
     pr_info("DDS participant %d created: name=%s\n", participant_id, name);
     
     return 0;
 }
+EXPORT_SYMBOL_GPL(dds_core_create_participant);
+
+static int dds_create_participant(u32 participant_id, const char *name)
+{
+    return dds_core_create_participant(participant_id, name);
+}
+
+static u32 dds_name_hash(u32 participant_id, const char *name)
+{
+    return jhash(name, strlen(name), participant_id);
+}
+
+// Under dds_topic_mutex, or with rcu_read_lock() held
+static struct dds_topic *dds_name_find(u32 participant_id, const char *name, u32 hash)
+{
+    struct dds_topic *topic;
+    
+    hash_for_each_possible_rcu(dds_topic_names, topic, name_node, hash) {
+        if (topic->name_hash == hash && topic->participant->participant_id == participant_id &&
+            !strcmp(topic->name, name)) {
+            return topic;
+        }
+    }
+    return NULL;
+}
 
 /**
- * Create DDS topic
+ * Resolve a topic name once; the handle stays valid for the life of
+ * the module
  */
-static int dds_create_topic(u32 participant_id, u32 topic_id, const char *name, const char *type_name,
-                           enum dds_reliability_kind reliability, enum dds_durability_kind durability,
-                           enum dds_history_kind history, u32 history_depth, u32 deadline_ms)
+struct dds_topic *dds_core_lookup(u32 participant_id, const char *name)
+{
+    struct dds_topic *topic;
+    
+    if (participant_id >= MAX_DDS_PARTICIPANTS || !name) {
+        return NULL;
+    }
+    
+    rcu_read_lock();
+    topic = dds_name_find(participant_id, name, dds_name_hash(participant_id, name));
+    rcu_read_unlock();
+    
+    return topic;
+}
+EXPORT_SYMBOL_GPL(dds_core_lookup);
+
+/**
+ * Create DDS topic, topic_id DDS_ANY_TOPIC taking the first free one.
+ * The name is interned here, so it is never compared again.
+ */
+struct dds_topic *dds_core_create_topic(u32 participant_id, u32 topic_id, const char *name, const char *type_name,
+                                        enum dds_reliability_kind reliability, enum dds_durability_kind durability,
+                                        enum dds_history_kind history, u32 history_depth, u32 deadline_ms)
 {
-    if (participant_id >= MAX_DDS_PARTICIPANTS || topic_id >= MAX_DDS_TOPICS || !name || !type_name) {
+    struct dds_participant *participant;
+    struct dds_topic *topic, *other;
+    u32 hash;
+    int ret;
+    
+    if (participant_id >= MAX_DDS_PARTICIPANTS || (topic_id >= MAX_DDS_TOPICS && topic_id != DDS_ANY_TOPIC) ||
+        !name || !type_name || strlen(name) >= DDS_TOPIC_NAME_MAX || strlen(type_name) >= DDS_TOPIC_NAME_MAX) {
         pr_err("Invalid DDS topic parameters\n");
-        return -EINVAL;
+        return ERR_PTR(-EINVAL);
+    }
+    if (!dds_history_depth_valid(history, history_depth)) {
+        return ERR_PTR(-EINVAL);
     }
     
-    struct dds_participant *participant = &global_dds_protocol.participants[participant_id];
+    participant = &global_dds_protocol.participants[participant_id];
     
     if (!participant->active) {
         pr_err("DDS participant %d is not active\n", participant_id);
-        return -EINVAL;
+        return ERR_PTR(-EINVAL);
+    }
+    
+    hash = dds_name_hash(participant_id, name);
+    mutex_lock(&dds_topic_mutex);
+    
+    if (topic_id == DDS_ANY_TOPIC) {
+        for (topic_id = 0; topic_id < MAX_DDS_TOPICS; topic_id++) {
+            if (!participant->topics[topic_id].active) {
+                break;
+            }
+        }
+        if (topic_id >= MAX_DDS_TOPICS) {
+            pr_err("No free DDS topic slots available\n");
+            ret = -ENOMEM;
+            goto err;
+        }
+    }
+    topic = &participant->topics[topic_id];
+    
+    other = dds_name_find(participant_id, name, hash);
+    if (other && other != topic) {
+        pr_err("DDS topic '%s' already exists in participant %d\n", name, participant_id);
+        ret = -EEXIST;
+        goto err;
+    }
+    
+    ret = dds_history_resize(topic, dds_history_depth(history, history_depth));
+    if (ret) {
+        pr_err("Failed to allocate DDS history for topic %d\n", topic_id);
+        goto err;
     }
     
-    struct dds_topic *topic = &participant->topics[topic_id];
+    // A renamed topic leaves its old chain before it joins the new one
+    if (topic->active) {
+        hash_del_rcu(&topic->name_node);
+        synchronize_rcu();
+    } else {
+        participant->topic_count++;
+    }
     
     strcpy(topic->name, name);
     strcpy(topic->type_name, type_name);
@@ -205,72 +555,198 @@ static int dds_create_topic(u32 participant_id, u32 topic_id, const char *name,
     topic->sample_count = 0;
     topic->subscriber_count = 0;
     topic->last_sample_time = 0;
+    topic->lifespan_ms = 0;
+    topic->lease_ms = 0;
+    topic->deadline_missed = 0;
+    topic->liveliness_lost = 0;
+    topic->listener = NULL;
+    set_bit(DDS_TOPIC_ALIVE, &topic->qos_flags);
+    timer_wheel_del(&global_dds_protocol.qos_wheel, &topic->deadline_timer);
+    timer_wheel_del(&global_dds_protocol.qos_wheel, &topic->liveliness_timer);
+    topic->name_hash = hash;
+    hash_add_rcu(dds_topic_names, &topic->name_node, hash);
     
-    participant->topic_count++;
+    mutex_unlock(&dds_topic_mutex);
     
     pr_info("DDS topic %d created in participant %d: name=%s, type=%s, reliability=%d, durability=%d, history=%d, depth=%d, deadline=%d ms\n",
             topic_id, participant_id, name, type_name, reliability, durability, history, history_depth, deadline_ms);
     
-    return 0;
+    return topic;
+    
+err:
+    mutex_unlock(&dds_topic_mutex);
+    return ERR_PTR(ret);
+}
+EXPORT_SYMBOL_GPL(dds_core_create_topic);
+
+static int dds_create_topic(u32 participant_id, u32 topic_id, const char *name, const char *type_name,
+                           enum dds_reliability_kind reliability, enum dds_durability_kind durability,
+                           enum dds_history_kind history, u32 history_depth, u32 deadline_ms)
+{
+    return PTR_ERR_OR_ZERO(dds_core_create_topic(participant_id, topic_id, name, type_name, reliability,
+                                                 durability, history, history_depth, deadline_ms));
 }
 
+// Participant and topic, both active, or NULL
+static struct dds_topic *dds_find_topic(u32 participant_id, u32 topic_id, struct dds_participant **participant)
+{
+    if (participant_id >= MAX_DDS_PARTICIPANTS || topic_id >= MAX_DDS_TOPICS) {
+        return NULL;
+    }
+    *participant = &global_dds_protocol.participants[participant_id];
+    if (!(*participant)->active || !(*participant)->topics[topic_id].active) {
+        return NULL;
+    }
+    return &(*participant)->topics[topic_id];
+}
+
+struct dds_topic *dds_core_topic(u32 participant_id, u32 topic_id)
+{
+    struct dds_participant *participant;
+    
+    return dds_find_topic(participant_id, topic_id, &participant);
+}
+EXPORT_SYMBOL_GPL(dds_core_topic);
+
 /**
- * DDS data writer
+ * Give a topic a shared-memory pool for participants on this SoC:
+ * nchunks chunks of max_len bytes, the history depth of them holding
+ * the latest samples. Writers then loan chunks and readers take
+ * references instead of copying samples.
  */
-static int dds_write_data(u32 participant_id, u32 topic_id, const u8 *data, u32 len)
+static int dds_enable_shm(u32 participant_id, u32 topic_id, size_t max_len, u32 nchunks)
 {
-    int i;
+    struct dds_participant *participant;
+    struct dds_topic *topic = dds_find_topic(participant_id, topic_id, &participant);
+    u32 depth;
     
-    if (participant_id >= MAX_DDS_PARTICIPANTS || topic_id >= MAX_DDS_TOPICS || !data || len == 0) {
-        pr_err("Invalid DDS write parameters\n");
+    if (!topic) {
+        pr_err("DDS topic %d of participant %d is not active\n", topic_id, participant_id);
         return -EINVAL;
     }
     
-    struct dds_participant *participant = &global_dds_protocol.participants[participant_id];
+    depth = topic->history == DDS_HISTORY_KEEP_ALL ? DDS_SHM_MAX_DEPTH :
+            clamp_t(u32, topic->history_depth, 1, DDS_SHM_MAX_DEPTH);
+    return dds_shm_create(topic_id, max_len, nchunks, min(depth, nchunks - 1));
+}
+
+/**
+ * Loan a chunk of a shared-memory topic to fill in place. Returns the
+ * chunk for dds_write_loaned(), or dds_return_sample() to drop it.
+ */
+static int dds_loan_sample(u32 participant_id, u32 topic_id, u32 len, void **buf)
+{
+    struct dds_participant *participant;
     
-    if (!participant->active) {
-        pr_err("DDS participant %d is not active\n", participant_id);
+    if (!buf || !dds_find_topic(participant_id, topic_id, &participant)) {
         return -EINVAL;
     }
+    return dds_shm_loan(topic_id, len, buf);
+}
+
+/**
+ * Publish a loaned chunk: readers see the sample where it was written
+ */
+static int dds_write_loaned(u32 participant_id, u32 topic_id, int chunk, u32 len)
+{
+    struct dds_participant *participant;
+    struct dds_topic *topic = dds_find_topic(participant_id, topic_id, &participant);
+    int ret;
     
-    struct dds_topic *topic = &participant->topics[topic_id];
+    if (!topic) {
+        return -EINVAL;
+    }
+    ret = dds_shm_publish(topic_id, chunk, len);
+    if (ret) {
+        return ret;
+    }
     
-    if (!topic->active) {
-        pr_err("DDS topic %d is not active\n", topic_id);
+    topic->sample_count++;
+    topic->last_sample_time = jiffies;
+    participant->total_samples++;
+    participant->last_activity_time = jiffies;
+    
+    dds_qos_written(topic);
+    atomic_inc(&global_dds_protocol.total_messages);
+    
+    pr_debug("DDS loaned sample published: participant=%s, topic=%s, len=%d, samples=%d\n",
+             participant->name, topic->name, len, topic->sample_count);
+    
+    return 0;
+}
+
+/**
+ * Read a shared-memory topic without a copy: a read-only reference to
+ * the oldest sample after after_seq (newest with DDS_SHM_TAKE_LATEST),
+ * held until dds_return_sample(). Returns the chunk, -EAGAIN if there
+ * is nothing new.
+ */
+static int dds_take_sample(u32 participant_id, u32 topic_id, u32 after_seq, unsigned int flags,
+                           const void **data, u32 *len, u32 *seq)
+{
+    struct dds_participant *participant;
+    
+    if (!data || !len || !seq || !dds_find_topic(participant_id, topic_id, &participant)) {
         return -EINVAL;
     }
+    participant->last_activity_time = jiffies;
+    return dds_shm_take(topic_id, after_seq, flags, data, len, seq);
+}
+
+static void dds_return_sample(u32 topic_id, int chunk)
+{
+    dds_shm_release(topic_id, chunk);
+}
+
+/**
+ * DDS data writer, through a topic handle
+ */
+int dds_core_write(struct dds_topic *topic, const u8 *data, u32 len)
+{
+    struct dds_participant *participant;
+    struct dds_history *h;
     
-    // Find free sample slot
-    for (i = 0; i < MAX_DDS_SAMPLES; i++) {
-        if (!global_dds_protocol.samples[i].valid) {
-            break;
-        }
+    if (!topic || !data || len == 0) {
+        pr_err("Invalid DDS write parameters\n");
+        return -EINVAL;
     }
     
-    if (i >= MAX_DDS_SAMPLES) {
-        pr_err("No free DDS sample slots available\n");
-        return -ENOMEM;
+    if (!topic->active) {
+        pr_err("DDS topic %d is not active\n", topic->topic_id);
+        return -EINVAL;
     }
+    participant = topic->participant;
     
-    // Create sample
-    global_dds_protocol.samples[i].topic_id = topic_id;
-    global_dds_protocol.samples[i].data = kmalloc(len, GFP_KERNEL);
-    if (!global_dds_protocol.samples[i].data) {
-        pr_err("Failed to allocate memory for DDS sample\n");
-        return -ENOMEM;
+    // Same-SoC topics: one copy into a loaned chunk, no allocation
+    if (dds_shm_active(topic->topic_id)) {
+        void *buf;
+        int chunk = dds_shm_loan(topic->topic_id, len, &buf);
+    
+        if (chunk < 0) {
+            return chunk;
+        }
+        memcpy(buf, data, len);
+        return dds_write_loaned(participant->participant_id, topic->topic_id, chunk, len);
     }
     
-    memcpy(global_dds_protocol.samples[i].data, data, len);
-    global_dds_protocol.samples[i].data_len = len;
-    global_dds_protocol.samples[i].timestamp = jiffies;
-    global_dds_protocol.samples[i].valid = true;
-    global_dds_protocol.samples[i].sequence_number = topic->sample_count;
+    if (len > DDS_SAMPLE_MAX_LEN) {
+        pr_err("DDS sample of %d bytes too large for topic %d\n", len, topic->topic_id);
+        return -EMSGSIZE;
+    }
+    
+    // The topic's own history: no search, no allocation
+    spin_lock(&topic->write_lock);
+    h = rcu_dereference_protected(topic->ring, lockdep_is_held(&topic->write_lock));
+    dds_history_put(h, h->head, data, len, gptp_now());
+    smp_store_release(&h->head, h->head + 1);
     
     topic->sample_count++;
     topic->last_sample_time = jiffies;
     participant->total_samples++;
     participant->last_activity_time = jiffies;
+    spin_unlock(&topic->write_lock);
     
+    dds_qos_written(topic);
     atomic_inc(&global_dds_protocol.total_messages);
     
     pr_debug("DDS data written: participant=%s, topic=%s, len=%d, samples=%d\n",
@@ -278,51 +754,85 @@ static int dds_write_data(u32 participant_id, u32 topic_id, const u8 *data, u32
     
     return 0;
 }
+EXPORT_SYMBOL_GPL(dds_core_write);
+
+static int dds_write_data(u32 participant_id, u32 topic_id, const u8 *data, u32 len)
+{
+    struct dds_participant *participant;
+    struct dds_topic *topic = dds_find_topic(participant_id, topic_id, &participant);
+    
+    if (!topic) {
+        pr_err("DDS topic %d of participant %d is not active\n", topic_id, participant_id);
+        return -EINVAL;
+    }
+    return dds_core_write(topic, data, len);
+}
 
 /**
- * DDS data reader
+ * DDS typed writer: sample serialized as XCDR2 by its generated code
  */
-static int dds_read_data(u32 participant_id, u32 topic_id, u8 *buffer, u32 max_len, u32 *actual_len)
+static int dds_write_sample(u32 participant_id, u32 topic_id, const struct payload_type *type, const void *sample)
 {
-    int i;
-    u32 read_len = 0;
+    struct dds_participant *participant;
+    struct dds_topic *topic = dds_find_topic(participant_id, topic_id, &participant);
     
-    if (participant_id >= MAX_DDS_PARTICIPANTS || topic_id >= MAX_DDS_TOPICS || !buffer || !actual_len) {
-        pr_err("Invalid DDS read parameters\n");
+    if (!topic || !type || !sample) {
+        pr_err("Invalid DDS write parameters\n");
         return -EINVAL;
     }
+    return dds_core_write_typed(topic, type, sample);
+}
+
+/**
+ * DDS data reader, through a topic handle: the latest sample
+ */
+int dds_core_read(struct dds_topic *topic, u8 *buffer, u32 max_len, u32 *actual_len)
+{
+    struct dds_participant *participant;
+    struct dds_history *h;
+    u32 head, read_len = 0;
+    u64 timestamp;
+    bool found;
     
-    struct dds_participant *participant = &global_dds_protocol.participants[participant_id];
-    
-    if (!participant->active) {
-        pr_err("DDS participant %d is not active\n", participant_id);
+    if (!topic || !buffer || !actual_len) {
+        pr_err("Invalid DDS read parameters\n");
         return -EINVAL;
     }
     
-    struct dds_topic *topic = &participant->topics[topic_id];
-    
     if (!topic->active) {
-        pr_err("DDS topic %d is not active\n", topic_id);
+        pr_err("DDS topic %d is not active\n", topic->topic_id);
         return -EINVAL;
     }
+    participant = topic->participant;
     
-    // Find latest sample for topic
-    for (i = 0; i < MAX_DDS_SAMPLES; i++) {
-        if (global_dds_protocol.samples[i].valid && 
-            global_dds_protocol.samples[i].topic_id == topic_id) {
-            break;
+    if (dds_shm_active(topic->topic_id)) {
+        const void *data;
+        u32 len, seq;
+        int chunk = dds_shm_take(topic->topic_id, 0, DDS_SHM_TAKE_LATEST, &data, &len, &seq);
+    
+        if (chunk < 0) {
+            return chunk == -EAGAIN ? -EINVAL : chunk;
         }
+        *actual_len = min(len, max_len);
+        memcpy(buffer, data, *actual_len);
+        dds_shm_release(topic->topic_id, chunk);
+        participant->last_activity_time = jiffies;
+        return 0;
     }
     
-    if (i >= MAX_DDS_SAMPLES) {
-        pr_err("No DDS samples available for topic %d\n", topic_id);
+    // Latest sample for topic
+    rcu_read_lock();
+    h = rcu_dereference(topic->ring);
+    do {
+        head = smp_load_acquire(&h->head);
+        found = head && dds_history_copy(h, head - 1, buffer, max_len, &read_len, &timestamp);
+    } while (head && !found);
+    rcu_read_unlock();
+    
+    if (!found || dds_sample_expired(topic, timestamp)) {
+        pr_err("No DDS samples available for topic %d\n", topic->topic_id);
         return -EINVAL;
     }
-    
-    struct dds_sample *sample = &global_dds_protocol.samples[i];
-    
-    read_len = min(sample->data_len, max_len);
-    memcpy(buffer, sample->data, read_len);
     *actual_len = read_len;
     
     participant->last_activity_time = jiffies;
@@ -332,44 +842,255 @@ static int dds_read_data(u32 participant_id, u32 topic_id, u8 *buffer, u32 max_l
     
     return 0;
 }
+EXPORT_SYMBOL_GPL(dds_core_read);
+
+static int dds_read_data(u32 participant_id, u32 topic_id, u8 *buffer, u32 max_len, u32 *actual_len)
+{
+    struct dds_participant *participant;
+    struct dds_topic *topic = dds_find_topic(participant_id, topic_id, &participant);
+    
+    if (!topic) {
+        pr_err("DDS topic %d of participant %d is not active\n", topic_id, participant_id);
+        return -EINVAL;
+    }
+    return dds_core_read(topic, buffer, max_len, actual_len);
+}
+
+/**
+ * Start a reader on a topic. A VOLATILE topic's reader sees samples
+ * written from now on, others also get the history kept so far.
+ */
+int dds_core_reader_init(struct dds_reader_cursor *cursor, struct dds_topic *topic)
+{
+    struct dds_history *h;
+    u32 head;
+    
+    if (!topic || !topic->active || !cursor) {
+        return -EINVAL;
+    }
+    
+    rcu_read_lock();
+    h = rcu_dereference(topic->ring);
+    head = smp_load_acquire(&h->head);
+    cursor->next = topic->durability == DDS_DURABILITY_VOLATILE ? head : head - min(head, h->depth);
+    rcu_read_unlock();
+    
+    cursor->topic = topic;
+    cursor->lost = 0;
+    topic->subscriber_count++;
+    
+    return 0;
+}
+EXPORT_SYMBOL_GPL(dds_core_reader_init);
+
+static int dds_reader_init(struct dds_reader_cursor *cursor, u32 participant_id, u32 topic_id)
+{
+    return dds_core_reader_init(cursor, dds_core_topic(participant_id, topic_id));
+}
+
+/**
+ * Take the next sample for a reader, lock-free. A reader that fell more
+ * than the history depth behind skips to the oldest sample still kept
+ * and counts the rest in cursor->lost; samples past the topic's
+ * lifespan are skipped. -EAGAIN when it is up to date.
+ */
+int dds_core_read_next(struct dds_reader_cursor *cursor, u8 *buffer, u32 max_len, u32 *actual_len)
+{
+    struct dds_topic *topic;
+    struct dds_history *h;
+    u64 timestamp;
+    u32 head;
+    int ret = -EAGAIN;
+    
+    if (!cursor || !buffer || !actual_len) {
+        return -EINVAL;
+    }
+    topic = cursor->topic;
+    if (!topic || !topic->active) {
+        return -EINVAL;
+    }
+    
+    rcu_read_lock();
+    h = rcu_dereference(topic->ring);
+    for (;;) {
+        head = smp_load_acquire(&h->head);
+        if (cursor->next == head) {
+            break;
+        }
+        if (head - cursor->next > h->depth) {
+            cursor->lost += head - cursor->next - h->depth;
+            cursor->next = head - h->depth;
+        }
+        if (dds_history_copy(h, cursor->next, buffer, max_len, actual_len, &timestamp)) {
+            cursor->next++;
+            if (dds_sample_expired(topic, timestamp)) {
+                continue;
+            }
+            ret = 0;
+            break;
+        }
+    }
+    rcu_read_unlock();
+    
+    return ret;
+}
+EXPORT_SYMBOL_GPL(dds_core_read_next);
 
 /**
  * DDS QoS configuration
  */
-static int dds_configure_qos(u32 participant_id, u32 topic_id, enum dds_reliability_kind reliability,
+int dds_core_configure_qos(struct dds_topic *topic, enum dds_reliability_kind reliability,
                            enum dds_durability_kind durability, enum dds_history_kind history,
                            u32 history_depth, u32 deadline_ms)
 {
-    if (participant_id >= MAX_DDS_PARTICIPANTS || topic_id >= MAX_DDS_TOPICS) {
+    if (!topic || !topic->active) {
         pr_err("Invalid DDS QoS parameters\n");
         return -EINVAL;
     }
-    
-    struct dds_participant *participant = &global_dds_protocol.participants[participant_id];
-    
-    if (!participant->active) {
-        pr_err("DDS participant %d is not active\n", participant_id);
+    if (!dds_history_depth_valid(history, history_depth)) {
         return -EINVAL;
     }
     
-    struct dds_topic *topic = &participant->topics[topic_id];
+    if (dds_history_depth(history, history_depth) != dds_history_depth(topic->history, topic->history_depth)) {
+        int ret = dds_history_resize(topic, dds_history_depth(history, history_depth));
     
-    if (!topic->active) {
-        pr_err("DDS topic %d is not active\n", topic_id);
-        return -EINVAL;
+        if (ret) {
+            return ret;
+        }
     }
     
     topic->reliability = reliability;
     topic->durability = durability;
     topic->history = history;
     topic->history_depth = history_depth;
-    topic->deadline_ms = deadline_ms;
+    if (topic->deadline_ms != deadline_ms) {
+        topic->deadline_ms = deadline_ms;
+        dds_deadline_arm(topic);
+    }
     
     pr_info("DDS QoS configured for topic %d in participant %d: reliability=%d, durability=%d, history=%d, depth=%d, deadline=%d ms\n",
-            topic_id, participant_id, reliability, durability, history, history_depth, deadline_ms);
+            topic->topic_id, topic->participant->participant_id, reliability, durability, history,
+            history_depth, deadline_ms);
+    
+    return 0;
+}
+EXPORT_SYMBOL_GPL(dds_core_configure_qos);
+
+static int dds_configure_qos(u32 participant_id, u32 topic_id, enum dds_reliability_kind reliability,
+                           enum dds_durability_kind durability, enum dds_history_kind history,
+                           u32 history_depth, u32 deadline_ms)
+{
+    return dds_core_configure_qos(dds_core_topic(participant_id, topic_id), reliability, durability,
+                                  history, history_depth, deadline_ms);
+}
+
+/**
+ * Liveliness lease: the topic is reported lost when its writer neither
+ * writes nor asserts for lease_ms, 0 to stop monitoring
+ */
+int dds_core_set_liveliness(struct dds_topic *topic, u32 lease_ms)
+{
+    if (!topic || !topic->active) {
+        return -EINVAL;
+    }
+    
+    WRITE_ONCE(topic->lease_ms, lease_ms);
+    WRITE_ONCE(topic->last_asserted, jiffies);
+    set_bit(DDS_TOPIC_ALIVE, &topic->qos_flags);
+    if (lease_ms) {
+        timer_wheel_mod(&global_dds_protocol.qos_wheel, &topic->liveliness_timer,
+                        jiffies + msecs_to_jiffies(lease_ms));
+    } else {
+        timer_wheel_del(&global_dds_protocol.qos_wheel, &topic->liveliness_timer);
+    }
+    
+    pr_info("DDS topic %s liveliness lease %d ms\n", topic->name, lease_ms);
+    
+    return 0;
+}
+EXPORT_SYMBOL_GPL(dds_core_set_liveliness);
+
+/**
+ * Lifespan: readers no longer get samples older than lifespan_ms, 0 to
+ * keep them until overwritten
+ */
+int dds_core_set_lifespan(struct dds_topic *topic, u32 lifespan_ms)
+{
+    if (!topic || !topic->active) {
+        return -EINVAL;
+    }
+    
+    WRITE_ONCE(topic->lifespan_ms, lifespan_ms);
+    
+    return 0;
+}
+EXPORT_SYMBOL_GPL(dds_core_set_lifespan);
+
+/**
+ * Assert a writer's liveliness without publishing
+ */
+int dds_core_assert_liveliness(struct dds_topic *topic)
+{
+    if (!topic || !topic->active) {
+        return -EINVAL;
+    }
+    
+    dds_liveliness_assert(topic);
+    
+    return 0;
+}
+EXPORT_SYMBOL_GPL(dds_core_assert_liveliness);
+
+/**
+ * Listener for a topic's deadline and liveliness events, NULL for none.
+ * It may be called from timer context and must not sleep.
+ */
+int dds_core_set_listener(struct dds_topic *topic, dds_qos_listener_t listener, void *arg)
+{
+    if (!topic || !topic->active) {
+        return -EINVAL;
+    }
+    
+    WRITE_ONCE(topic->listener_arg, arg);
+    smp_store_release(&topic->listener, listener);
+    
+    return 0;
+}
+EXPORT_SYMBOL_GPL(dds_core_set_listener);
+
+int dds_core_qos_status(struct dds_topic *topic, struct dds_qos_status *status)
+{
+    if (!topic || !topic->active || !status) {
+        return -EINVAL;
+    }
+    
+    status->deadline_missed = READ_ONCE(topic->deadline_missed);
+    status->liveliness_lost = READ_ONCE(topic->liveliness_lost);
+    status->alive = test_bit(DDS_TOPIC_ALIVE, &topic->qos_flags);
     
     return 0;
 }
+EXPORT_SYMBOL_GPL(dds_core_qos_status);
+
+// Samples held in every topic's history
+static int dds_retained_samples(void)
+{
+    struct dds_history *h;
+    int i, j, n = 0;
+    
+    rcu_read_lock();
+    for (i = 0; i < MAX_DDS_PARTICIPANTS; i++) {
+        for (j = 0; j < MAX_DDS_TOPICS; j++) {
+            h = rcu_dereference(global_dds_protocol.participants[i].topics[j].ring);
+            if (h) {
+                n += min(READ_ONCE(h->head), h->depth);
+            }
+        }
+    }
+    rcu_read_unlock();
+    
+    return n;
+}
 
 /**
  * Get DDS statistics
@@ -386,7 +1107,7 @@ static int dds_get_stats(u32 *total_messages, u32 *total_errors, int *participan
         *participant_count = global_dds_protocol.participant_count;
     }
     if (sample_count) {
-        *sample_count = global_dds_protocol.sample_count;
+        *sample_count = dds_retained_samples();
     }
     
     return 0;
@@ -416,12 +1137,19 @@ static int __init dds_protocol_init_module(void)
  */
 static void __exit dds_protocol_cleanup_module(void)
 {
-    int i;
+    int i, j;
     
-    // Free sample data
-    for (i = 0; i < MAX_DDS_SAMPLES; i++) {
-        if (global_dds_protocol.samples[i].data) {
-            kfree(global_dds_protocol.samples[i].data);
+    timer_wheel_destroy(&global_dds_protocol.qos_wheel);
+    
+    // Free topic histories
+    for (i = 0; i < MAX_DDS_PARTICIPANTS; i++) {
+        for (j = 0; j < MAX_DDS_TOPICS; j++) {
+            kvfree(rcu_dereference_protected(global_dds_protocol.participants[i].topics[j].ring, 1));
+        }
+    }
+    for (i = 0; i < MAX_DDS_TOPICS; i++) {
+        if (dds_shm_active(i) && dds_shm_destroy(i)) {
+            pr_warn("DDS topic %d pool still in use, left to dds_shm\n", i);
         }
     }
     
@@ -0,0 +1,532 @@
+/**
+ * DDS shared-memory transport
+ * Author: jk1806
+ * Created: 2024-11-20
+ * 
+ * Loaned-sample pools for same-SoC DDS participants. A pool is one
+ * vmalloc_user() area of page-aligned chunks; the kernel keeps every
+ * piece of chunk state (references, length, sequence) on its side, so a
+ * process can only name chunks by index and a misbehaving one cannot
+ * corrupt the pool for others. Chunk references: one for the writer's
+ * open loan, which passes to the history slot on publish, and one per
+ * take. Sample data is written once by the producer and read in place
+ * by every consumer.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/atomic.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/uaccess.h>
+
+#include "dds_shm.h"
+
+#define DDS_SHM_VERSION "1.1.0"
+
+struct dds_shm_chunk {
+    u32 refs;
+    u32 len;
+    u32 seq;
+    bool loaned;                // with a writer, not yet published
+};
+
+struct dds_shm_pool {
+    bool active;
+    u32 topic_id;
+    void *base;
+    size_t chunk_size;
+    u32 nchunks;
+    u32 depth;
+    struct dds_shm_chunk chunks[DDS_SHM_MAX_CHUNKS];
+    u8 history[DDS_SHM_MAX_DEPTH];      // published chunks, oldest at head
+    u32 head;
+    u32 count;
+    u32 seq;
+    int users;                          // attached files
+};
+
+// References one open file holds, dropped when it is closed
+struct dds_shm_file {
+    struct dds_shm_pool *pool;
+    u32 held[DDS_SHM_MAX_CHUNKS];
+};
+
+static struct dds_shm_pool dds_shm_pools[DDS_SHM_MAX_POOLS];
+static DEFINE_SPINLOCK(dds_shm_lock);
+static atomic_t dds_shm_published;
+static atomic_t dds_shm_taken;
+static atomic_t dds_shm_exhausted;
+
+// Under dds_shm_lock
+static struct dds_shm_pool *dds_shm_find(u32 topic_id)
+{
+    int i;
+    
+    for (i = 0; i < DDS_SHM_MAX_POOLS; i++) {
+        if (dds_shm_pools[i].active && dds_shm_pools[i].topic_id == topic_id) {
+            return &dds_shm_pools[i];
+        }
+    }
+    return NULL;
+}
+
+// Under dds_shm_lock
+static int dds_shm_loan_locked(struct dds_shm_pool *pool, size_t len)
+{
+    int i;
+    
+    if (len > pool->chunk_size) {
+        return -EMSGSIZE;
+    }
+    for (i = 0; i < pool->nchunks; i++) {
+        if (!pool->chunks[i].refs) {
+            pool->chunks[i].refs = 1;
+            pool->chunks[i].loaned = true;
+            pool->chunks[i].len = 0;
+            return i;
+        }
+    }
+    atomic_inc(&dds_shm_exhausted);
+    return -ENOBUFS;
+}
+
+// Under dds_shm_lock. The loan's reference moves to the history.
+static int dds_shm_publish_locked(struct dds_shm_pool *pool, int chunk, u32 len)
+{
+    struct dds_shm_chunk *c;
+    
+    if (chunk < 0 || chunk >= pool->nchunks || !pool->chunks[chunk].loaned || len > pool->chunk_size) {
+        return -EINVAL;
+    }
+    c = &pool->chunks[chunk];
+    c->loaned = false;
+    c->len = len;
+    c->seq = ++pool->seq;
+    
+    if (pool->count == pool->depth) {
+        pool->chunks[pool->history[pool->head]].refs--;
+        pool->head = (pool->head + 1) % pool->depth;
+        pool->count--;
+    }
+    pool->history[(pool->head + pool->count) % pool->depth] = chunk;
+    pool->count++;
+    
+    atomic_inc(&dds_shm_published);
+    return 0;
+}
+
+// Under dds_shm_lock: the oldest sample after after_seq, or the newest
+static int dds_shm_take_locked(struct dds_shm_pool *pool, u32 after_seq, unsigned int flags,
+                               u32 *len, u32 *seq)
+{
+    int i, idx, chunk = -EAGAIN;
+    
+    for (i = 0; i < pool->count; i++) {
+        idx = pool->history[(pool->head + i) % pool->depth];
+        if (pool->chunks[idx].seq > after_seq) {
+            chunk = idx;
+            if (!(flags & DDS_SHM_TAKE_LATEST)) {
+                break;
+            }
+        }
+    }
+    if (chunk >= 0) {
+        pool->chunks[chunk].refs++;
+        *len = pool->chunks[chunk].len;
+        *seq = pool->chunks[chunk].seq;
+        atomic_inc(&dds_shm_taken);
+    }
+    return chunk;
+}
+
+// Under dds_shm_lock. Releasing an unpublished loan discards it.
+static int dds_shm_release_locked(struct dds_shm_pool *pool, int chunk)
+{
+    if (chunk < 0 || chunk >= pool->nchunks || !pool->chunks[chunk].refs) {
+        return -EINVAL;
+    }
+    pool->chunks[chunk].loaned = false;
+    pool->chunks[chunk].refs--;
+    return 0;
+}
+
+/**
+ * Create the pool of a topic: nchunks chunks of chunk_size bytes, page
+ * aligned, of which depth stay in the history. The rest are what
+ * writers loan and readers hold at any one time.
+ */
+int dds_shm_create(u32 topic_id, size_t chunk_size, u32 nchunks, u32 depth)
+{
+    struct dds_shm_pool *pool = NULL;
+    void *base;
+    int i, ret = 0;
+    
+    if (!chunk_size || chunk_size > U32_MAX / DDS_SHM_MAX_CHUNKS || nchunks > DDS_SHM_MAX_CHUNKS ||
+        !depth || depth > DDS_SHM_MAX_DEPTH || depth >= nchunks) {
+        return -EINVAL;
+    }
+    chunk_size = PAGE_ALIGN(chunk_size);
+    
+    // Zeroed, so a mapping never shows another user's stale data
+    base = vmalloc_user(chunk_size * nchunks);
+    if (!base) {
+        return -ENOMEM;
+    }
+    
+    spin_lock(&dds_shm_lock);
+    for (i = 0; i < DDS_SHM_MAX_POOLS; i++) {
+        if (dds_shm_pools[i].active && dds_shm_pools[i].topic_id == topic_id) {
+            ret = -EEXIST;
+            break;
+        }
+        if (!pool && !dds_shm_pools[i].active) {
+            pool = &dds_shm_pools[i];
+        }
+    }
+    if (!ret && !pool) {
+        ret = -ENOSPC;
+    }
+    if (!ret) {
+        memset(pool, 0, sizeof(*pool));
+        pool->topic_id = topic_id;
+        pool->base = base;
+        pool->chunk_size = chunk_size;
+        pool->nchunks = nchunks;
+        pool->depth = depth;
+        pool->active = true;
+    }
+    spin_unlock(&dds_shm_lock);
+    
+    if (ret) {
+        vfree(base);
+        return ret;
+    }
+    pr_info("dds_shm: Topic %u pool of %u x %zu bytes, depth %u\n", topic_id, nchunks, chunk_size, depth);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(dds_shm_create);
+
+/**
+ * Free a pool. -EBUSY while a process is attached or a loan or take is
+ * outstanding.
+ */
+int dds_shm_destroy(u32 topic_id)
+{
+    struct dds_shm_pool *pool;
+    void *base = NULL;
+    u32 refs = 0;
+    int i, ret = 0;
+    
+    spin_lock(&dds_shm_lock);
+    pool = dds_shm_find(topic_id);
+    if (!pool) {
+        ret = -ENOENT;
+    } else {
+        for (i = 0; i < pool->nchunks; i++) {
+            refs += pool->chunks[i].refs;
+        }
+        // The history's own references are the only ones allowed
+        if (pool->users || refs != pool->count) {
+            ret = -EBUSY;
+        } else {
+            base = pool->base;
+            pool->active = false;
+        }
+    }
+    spin_unlock(&dds_shm_lock);
+    
+    vfree(base);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(dds_shm_destroy);
+
+bool dds_shm_active(u32 topic_id)
+{
+    bool active;
+    
+    spin_lock(&dds_shm_lock);
+    active = dds_shm_find(topic_id) != NULL;
+    spin_unlock(&dds_shm_lock);
+    
+    return active;
+}
+EXPORT_SYMBOL_GPL(dds_shm_active);
+
+/**
+ * Loan a chunk for a sample of up to len bytes, to be filled at *buf
+ * and then published or released. Returns the chunk; -ENOBUFS when
+ * every chunk is in the history or held by a reader.
+ */
+int dds_shm_loan(u32 topic_id, size_t len, void **buf)
+{
+    struct dds_shm_pool *pool;
+    int chunk = -ENOENT;
+    
+    spin_lock(&dds_shm_lock);
+    pool = dds_shm_find(topic_id);
+    if (pool) {
+        chunk = dds_shm_loan_locked(pool, len);
+        if (chunk >= 0) {
+            *buf = (u8 *)pool->base + chunk * pool->chunk_size;
+        }
+    }
+    spin_unlock(&dds_shm_lock);
+    
+    return chunk;
+}
+EXPORT_SYMBOL_GPL(dds_shm_loan);
+
+int dds_shm_publish(u32 topic_id, int chunk, u32 len)
+{
+    struct dds_shm_pool *pool;
+    int ret = -ENOENT;
+    
+    spin_lock(&dds_shm_lock);
+    pool = dds_shm_find(topic_id);
+    if (pool) {
+        ret = dds_shm_publish_locked(pool, chunk, len);
+    }
+    spin_unlock(&dds_shm_lock);
+    
+    return ret;
+}
+EXPORT_SYMBOL_GPL(dds_shm_publish);
+
+/**
+ * Take a reference to a published sample: the oldest one newer than
+ * after_seq, or with DDS_SHM_TAKE_LATEST the newest. *buf stays valid,
+ * read-only, until dds_shm_release(). Returns the chunk; -EAGAIN if
+ * nothing newer than after_seq is in the history.
+ */
+int dds_shm_take(u32 topic_id, u32 after_seq, unsigned int flags, const void **buf, u32 *len, u32 *seq)
+{
+    struct dds_shm_pool *pool;
+    int chunk = -ENOENT;
+    
+    spin_lock(&dds_shm_lock);
+    pool = dds_shm_find(topic_id);
+    if (pool) {
+        chunk = dds_shm_take_locked(pool, after_seq, flags, len, seq);
+        if (chunk >= 0) {
+            *buf = (const u8 *)pool->base + chunk * pool->chunk_size;
+        }
+    }
+    spin_unlock(&dds_shm_lock);
+    
+    return chunk;
+}
+EXPORT_SYMBOL_GPL(dds_shm_take);
+
+void dds_shm_release(u32 topic_id, int chunk)
+{
+    struct dds_shm_pool *pool;
+    
+    spin_lock(&dds_shm_lock);
+    pool = dds_shm_find(topic_id);
+    if (!pool || dds_shm_release_locked(pool, chunk)) {
+        pr_warn("dds_shm: Release of chunk %d of topic %u not held\n", chunk, topic_id);
+    }
+    spin_unlock(&dds_shm_lock);
+}
+EXPORT_SYMBOL_GPL(dds_shm_release);
+
+static int dds_shm_open(struct inode *inode, struct file *file)
+{
+    file->private_data = kzalloc(sizeof(struct dds_shm_file), GFP_KERNEL);
+    return file->private_data ? 0 : -ENOMEM;
+}
+
+static int dds_shm_file_release(struct inode *inode, struct file *file)
+{
+    struct dds_shm_file *f = file->private_data;
+    int i;
+    
+    spin_lock(&dds_shm_lock);
+    if (f->pool) {
+        for (i = 0; i < DDS_SHM_MAX_CHUNKS; i++) {
+            while (f->held[i]--) {
+                dds_shm_release_locked(f->pool, i);
+            }
+        }
+        f->pool->users--;
+    }
+    spin_unlock(&dds_shm_lock);
+    
+    kfree(f);
+    return 0;
+}
+
+static int dds_shm_attach(struct dds_shm_file *f, void __user *uarg)
+{
+    struct dds_shm_attach a;
+    struct dds_shm_pool *pool;
+    int ret = 0;
+    
+    if (copy_from_user(&a, uarg, sizeof(a))) {
+        return -EFAULT;
+    }
+    
+    spin_lock(&dds_shm_lock);
+    pool = dds_shm_find(a.topic_id);
+    if (!pool) {
+        ret = -ENOENT;
+    } else if (f->pool) {
+        ret = -EBUSY;
+    } else {
+        f->pool = pool;
+        pool->users++;
+        a.chunk_size = pool->chunk_size;
+        a.nchunks = pool->nchunks;
+        a.depth = pool->depth;
+    }
+    spin_unlock(&dds_shm_lock);
+    
+    if (!ret && copy_to_user(uarg, &a, sizeof(a))) {
+        return -EFAULT;
+    }
+    return ret;
+}
+
+static long dds_shm_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct dds_shm_file *f = file->private_data;
+    void __user *uarg = (void __user *)arg;
+    bool writer = file->f_mode & FMODE_WRITE;
+    struct dds_shm_sample s;
+    int ret;
+    
+    if (cmd == DDS_SHM_IOC_ATTACH) {
+        return dds_shm_attach(f, uarg);
+    }
+    if (!f->pool) {
+        return -EINVAL;
+    }
+    if (copy_from_user(&s, uarg, sizeof(s))) {
+        return -EFAULT;
+    }
+    
+    spin_lock(&dds_shm_lock);
+    switch (cmd) {
+    case DDS_SHM_IOC_LOAN:
+        ret = writer ? dds_shm_loan_locked(f->pool, s.len) : -EPERM;
+        if (ret >= 0) {
+            f->held[ret]++;
+            s.chunk = ret;
+            ret = 0;
+        }
+        break;
+    case DDS_SHM_IOC_PUBLISH:
+        // Only the file holding the loan may publish it
+        if (!writer) {
+            ret = -EPERM;
+        } else if (s.chunk >= f->pool->nchunks || !f->held[s.chunk]) {
+            ret = -EINVAL;
+        } else {
+            ret = dds_shm_publish_locked(f->pool, s.chunk, s.len);
+            if (!ret) {
+                f->held[s.chunk]--;
+            }
+        }
+        break;
+    case DDS_SHM_IOC_TAKE:
+        ret = dds_shm_take_locked(f->pool, s.seq, s.flags, &s.len, &s.seq);
+        if (ret >= 0) {
+            f->held[ret]++;
+            s.chunk = ret;
+            ret = 0;
+        }
+        break;
+    case DDS_SHM_IOC_RELEASE:
+        if (s.chunk >= f->pool->nchunks || !f->held[s.chunk]) {
+            ret = -EINVAL;
+        } else {
+            ret = dds_shm_release_locked(f->pool, s.chunk);
+            if (!ret) {
+                f->held[s.chunk]--;
+            }
+        }
+        break;
+    default:
+        ret = -ENOTTY;
+        break;
+    }
+    spin_unlock(&dds_shm_lock);
+    
+    // A reference whose index could not be returned is dropped on close
+    if (!ret && (cmd == DDS_SHM_IOC_LOAN || cmd == DDS_SHM_IOC_TAKE) &&
+        copy_to_user(uarg, &s, sizeof(s))) {
+        return -EFAULT;
+    }
+    return ret;
+}
+
+// The whole pool; readers' mappings can never be made writable
+static int dds_shm_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct dds_shm_file *f = file->private_data;
+    
+    if (!f->pool || vma->vm_pgoff ||
+        vma->vm_end - vma->vm_start != f->pool->chunk_size * f->pool->nchunks) {
+        return -EINVAL;
+    }
+    if (!(file->f_mode & FMODE_WRITE)) {
+        if (vma->vm_flags & VM_WRITE) {
+            return -EPERM;
+        }
+        vm_flags_clear(vma, VM_MAYWRITE);
+    }
+    
+    return remap_vmalloc_range(vma, f->pool->base, 0);
+}
+
+static const struct file_operations dds_shm_fops = {
+    .owner = THIS_MODULE,
+    .open = dds_shm_open,
+    .release = dds_shm_file_release,
+    .unlocked_ioctl = dds_shm_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .mmap = dds_shm_mmap,
+};
+
+static struct miscdevice dds_shm_dev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "dds_shm",
+    .fops = &dds_shm_fops,
+    .mode = 0660,
+};
+
+static int __init dds_shm_init(void)
+{
+    pr_info("dds_shm: Initializing\n");
+    
+    return misc_register(&dds_shm_dev);
+}
+
+static void __exit dds_shm_exit(void)
+{
+    int i;
+    
+    misc_deregister(&dds_shm_dev);
+    for (i = 0; i < DDS_SHM_MAX_POOLS; i++) {
+        if (dds_shm_pools[i].active) {
+            vfree(dds_shm_pools[i].base);
+        }
+    }
+    pr_info("dds_shm: Exiting, published=%d taken=%d exhausted=%d\n",
+            atomic_read(&dds_shm_published), atomic_read(&dds_shm_taken),
+            atomic_read(&dds_shm_exhausted));
+}
+
+module_init(dds_shm_init);
+module_exit(dds_shm_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("jk1806");
+MODULE_DESCRIPTION("DDS shared-memory transport");
+MODULE_VERSION(DDS_SHM_VERSION);
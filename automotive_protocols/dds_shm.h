@@ -0,0 +1,72 @@
+/**
+ * DDS shared-memory transport
+ *
+ * Loaned samples for participants on the same SoC. Each topic with a
+ * pool owns a run of page-aligned chunks in one vmalloc area, mapped
+ * into every process attached through /dev/dds_shm. A writer loans a
+ * chunk, fills it in place and publishes it; readers take references to
+ * published chunks and hand them back when done. Only chunk indices
+ * cross the ioctl boundary, never sample data. A chunk returns to the
+ * pool once it has left the topic's history and every reader holding
+ * it has released it; a process that exits releases what it held.
+ */
+
+#ifndef DDS_SHM_H
+#define DDS_SHM_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#else
+#include <stdint.h>
+#include <sys/ioctl.h>
+typedef uint32_t u32;
+#endif
+
+#define DDS_SHM_DEVICE "/dev/dds_shm"
+#define DDS_SHM_MAX_POOLS 16
+#define DDS_SHM_MAX_CHUNKS 32           // per pool: history depth + readers + writers
+#define DDS_SHM_MAX_DEPTH 8             // published samples kept per topic
+
+// Take flags
+#define DDS_SHM_TAKE_LATEST 0x1         // newest sample, instead of the oldest after seq
+
+/*
+ * Mapping a pool: attach, then mmap chunk_size * nchunks bytes at offset
+ * 0 (read-only for a descriptor opened O_RDONLY). Chunk n starts at
+ * n * chunk_size.
+ */
+struct dds_shm_attach {
+    u32 topic_id;
+    u32 chunk_size;             // out
+    u32 nchunks;                // out
+    u32 depth;                  // out
+};
+
+struct dds_shm_sample {
+    u32 chunk;
+    u32 len;
+    u32 seq;                    // publication order, from 1
+    u32 flags;                  // DDS_SHM_TAKE_*
+};
+
+#define DDS_SHM_IOC_MAGIC 'D'
+#define DDS_SHM_IOC_ATTACH _IOWR(DDS_SHM_IOC_MAGIC, 1, struct dds_shm_attach)
+#define DDS_SHM_IOC_LOAN _IOWR(DDS_SHM_IOC_MAGIC, 2, struct dds_shm_sample)    // len in, chunk out
+#define DDS_SHM_IOC_PUBLISH _IOW(DDS_SHM_IOC_MAGIC, 3, struct dds_shm_sample)  // chunk, len
+#define DDS_SHM_IOC_TAKE _IOWR(DDS_SHM_IOC_MAGIC, 4, struct dds_shm_sample)    // seq, flags in
+#define DDS_SHM_IOC_RELEASE _IOW(DDS_SHM_IOC_MAGIC, 5, struct dds_shm_sample)  // chunk
+
+#ifdef __KERNEL__
+
+int dds_shm_create(u32 topic_id, size_t chunk_size, u32 nchunks, u32 depth);
+int dds_shm_destroy(u32 topic_id);
+bool dds_shm_active(u32 topic_id);
+int dds_shm_loan(u32 topic_id, size_t len, void **buf);
+int dds_shm_publish(u32 topic_id, int chunk, u32 len);
+int dds_shm_take(u32 topic_id, u32 after_seq, unsigned int flags, const void **buf, u32 *len, u32 *seq);
+void dds_shm_release(u32 topic_id, int chunk);
+
+#endif /* __KERNEL__ */
+
+#endif /* DDS_SHM_H */
@@ -3,22 +3,850 @@
  * Author: jk1806
  * Created: 2024-11-01
  * 
- * Implementation for embedded systems
+ * DoIP (ISO 13400-2) gateway. Every tester connection and every link to
+ * an Ethernet ECU has its own receive work on an unbound workqueue, so
+ * one slow peer never holds up another. A diagnostic message is sent on
+ * to its ECU and acknowledged at once; the ECU's response goes back to
+ * whichever tester last addressed it, from the ISO-TP receive path or
+ * the ECU link's receive work. Requests to different ECUs are therefore
+ * in flight together, which is what lets a tester flash a whole vehicle
+ * in parallel over one connection.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/net.h>
+#include <linux/in.h>
+#include <linux/tcp.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/refcount.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <net/sock.h>
+#include <asm/unaligned.h>
 
-#define MODULE_VERSION "1.0.0"
+#include "doip.h"
+#include "uds_isotp.h"
+
+#define DOIP_VERSION "1.1.0"
+
+#define DOIP_PROTOCOL_VERSION 0x02          // ISO 13400-2:2012
+#define DOIP_HEADER_LEN 8
+#define DOIP_MAX_CONNECTIONS 16             // tester sockets
+#define DOIP_MAX_PAYLOAD (4 + UDS_ISOTP_MAX_MESSAGE)
+#define DOIP_INITIAL_INACTIVITY_MS 2000     // T_TCP_Initial_Inactivity: until routing is activated
+#define DOIP_GENERAL_INACTIVITY_MS 300000   // T_TCP_General_Inactivity
+#define DOIP_ACTIVATION_TIMEOUT_MS 2000     // our own routing activation towards an ECU
+#define DOIP_TESTER_MIN 0x0E00              // external test equipment addresses
+#define DOIP_TESTER_MAX 0x0FFF
+
+// Payload types
+#define DOIP_GENERIC_NACK 0x0000
+#define DOIP_ROUTING_ACTIVATION_REQ 0x0005
+#define DOIP_ROUTING_ACTIVATION_RES 0x0006
+#define DOIP_ALIVE_CHECK_REQ 0x0007
+#define DOIP_ALIVE_CHECK_RES 0x0008
+#define DOIP_DIAG_MESSAGE 0x8001
+#define DOIP_DIAG_ACK 0x8002
+#define DOIP_DIAG_NACK 0x8003
+
+// Generic header NACK codes
+#define DOIP_NACK_PATTERN 0x00
+#define DOIP_NACK_PAYLOAD_TYPE 0x01
+#define DOIP_NACK_TOO_LARGE 0x02
+#define DOIP_NACK_LENGTH 0x04
+
+// Routing activation response codes
+#define DOIP_RA_UNKNOWN_SOURCE 0x00
+#define DOIP_RA_SOURCE_IN_USE 0x03
+#define DOIP_RA_SUCCESS 0x10
+
+// Diagnostic message ACK/NACK codes
+#define DOIP_DIAG_OK 0x00
+#define DOIP_DIAG_INVALID_SOURCE 0x02
+#define DOIP_DIAG_UNKNOWN_TARGET 0x03
+#define DOIP_DIAG_TOO_LARGE 0x04
+#define DOIP_DIAG_UNREACHABLE 0x06
+#define DOIP_DIAG_TP_ERROR 0x08
+
+static unsigned short logical_address = 0x1010;
+module_param(logical_address, ushort, 0444);
+MODULE_PARM_DESC(logical_address, "Logical address of the gateway");
+
+static unsigned short port = DOIP_PORT;
+module_param(port, ushort, 0444);
+MODULE_PARM_DESC(port, "TCP port testers connect to");
+
+enum doip_route_kind {
+    DOIP_ROUTE_ISOTP,
+    DOIP_ROUTE_ETHERNET
+};
+
+struct doip_conn;
+
+struct doip_route {
+    bool active;
+    u16 address;
+    enum doip_route_kind kind;
+    u32 channel;                        // ISO-TP
+    struct sockaddr_in ecu;             // Ethernet
+    struct mutex link_lock;             // one connect at a time
+    struct doip_conn *link;             // Ethernet: our connection to the ECU's DoIP entity
+    struct doip_conn *tester;           // gets the ECU's responses: the last to address it
+    u16 tester_address;
+    u32 requests;
+    u32 responses;
+};
+
+struct doip_conn {
+    struct list_head list;
+    struct socket *sock;
+    refcount_t refcnt;
+    struct mutex tx_lock;
+    struct work_struct rx_work;
+    struct doip_route *route;           // set on links to Ethernet ECUs
+    u16 tester_address;
+    bool activated;
+    bool closed;
+    wait_queue_head_t wait;             // ECU links: routing activation answered
+    u8 *rx_buf;
+};
+
+static struct doip_route doip_routes[DOIP_MAX_ROUTES];
+static DEFINE_MUTEX(doip_lock);         // conn list, routes' tester and link
+static LIST_HEAD(doip_conns);
+static int doip_ntesters;
+static struct socket *doip_listen_sock;
+static struct workqueue_struct *doip_wq;
+static struct work_struct doip_accept_work;
+static bool doip_stopping;
+
+// Send all of vec, resuming after short writes
+static int doip_sendv(struct socket *sock, struct kvec *vec, size_t nr, size_t len)
+{
+    while (len) {
+        struct msghdr msg = { .msg_flags = MSG_NOSIGNAL };
+        int ret = kernel_sendmsg(sock, &msg, vec, nr, len);
+        size_t sent;
+    
+        if (ret <= 0) {
+            return ret ? ret : -EPIPE;
+        }
+        len -= ret;
+        for (sent = ret; sent && nr; ) {
+            size_t n = min(sent, vec->iov_len);
+    
+            vec->iov_base += n;
+            vec->iov_len -= n;
+            sent -= n;
+            if (!vec->iov_len) {
+                vec++;
+                nr--;
+            }
+        }
+    }
+    return 0;
+}
+
+static int doip_recv_exact(struct socket *sock, void *buf, size_t len)
+{
+    struct kvec vec = { .iov_base = buf, .iov_len = len };
+    struct msghdr msg = { };
+    int ret;
+    
+    if (!len) {
+        return 0;
+    }
+    ret = kernel_recvmsg(sock, &msg, &vec, 1, len, MSG_WAITALL);
+    if (ret < 0) {
+        return ret;
+    }
+    return ret == len ? 0 : -ECONNRESET;
+}
+
+// Caller holds conn->tx_lock
+static int __doip_send(struct doip_conn *conn, u16 type, const void *head, u32 head_len,
+                       const void *data, u32 data_len)
+{
+    u8 hdr[DOIP_HEADER_LEN];
+    struct kvec vec[3] = {
+        { .iov_base = hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = (void *)head, .iov_len = head_len },
+        { .iov_base = (void *)data, .iov_len = data_len },
+    };
+    
+    hdr[0] = DOIP_PROTOCOL_VERSION;
+    hdr[1] = ~DOIP_PROTOCOL_VERSION;
+    put_unaligned_be16(type, hdr + 2);
+    put_unaligned_be32(head_len + data_len, hdr + 4);
+    
+    return doip_sendv(conn->sock, vec, data_len ? 3 : 2, sizeof(hdr) + head_len + data_len);
+}
+
+static int doip_send(struct doip_conn *conn, u16 type, const void *payload, u32 len)
+{
+    int ret;
+    
+    mutex_lock(&conn->tx_lock);
+    ret = __doip_send(conn, type, payload, len, NULL, 0);
+    mutex_unlock(&conn->tx_lock);
+    
+    return ret;
+}
+
+// Diagnostic message, ACK or NACK: addresses, then the UDS data or the code
+static int __doip_send_diag(struct doip_conn *conn, u16 type, u16 source, u16 target,
+                            const u8 *data, u32 len)
+{
+    u8 addr[4];
+    
+    put_unaligned_be16(source, addr);
+    put_unaligned_be16(target, addr + 2);
+    return __doip_send(conn, type, addr, sizeof(addr), data, len);
+}
+
+static int doip_send_diag(struct doip_conn *conn, u16 type, u16 source, u16 target,
+                          const u8 *data, u32 len)
+{
+    int ret;
+    
+    mutex_lock(&conn->tx_lock);
+    ret = __doip_send_diag(conn, type, source, target, data, len);
+    mutex_unlock(&conn->tx_lock);
+    
+    return ret;
+}
+
+static int doip_send_nack(struct doip_conn *conn, u8 code)
+{
+    return doip_send(conn, DOIP_GENERIC_NACK, &code, 1);
+}
+
+static struct doip_conn *doip_conn_alloc(struct socket *sock)
+{
+    struct doip_conn *conn = kzalloc(sizeof(*conn), GFP_KERNEL);
+    
+    if (!conn) {
+        return NULL;
+    }
+    conn->rx_buf = kvmalloc(DOIP_MAX_PAYLOAD, GFP_KERNEL);
+    if (!conn->rx_buf) {
+        kfree(conn);
+        return NULL;
+    }
+    conn->sock = sock;
+    refcount_set(&conn->refcnt, 1);
+    mutex_init(&conn->tx_lock);
+    init_waitqueue_head(&conn->wait);
+    return conn;
+}
+
+static void doip_conn_put(struct doip_conn *conn)
+{
+    if (conn && refcount_dec_and_test(&conn->refcnt)) {
+        sock_release(conn->sock);
+        kvfree(conn->rx_buf);
+        kfree(conn);
+    }
+}
+
+static struct doip_route *doip_route_find(u16 address)
+{
+    int i;
+    
+    for (i = 0; i < DOIP_MAX_ROUTES; i++) {
+        if (smp_load_acquire(&doip_routes[i].active) && doip_routes[i].address == address) {
+            return &doip_routes[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * A response from the ECU behind route: pass it to the tester that last
+ * addressed the ECU.
+ */
+static void doip_route_respond(struct doip_route *route, const u8 *data, u32 len)
+{
+    struct doip_conn *tester;
+    u16 tester_address;
+    
+    mutex_lock(&doip_lock);
+    tester = route->tester;
+    if (tester) {
+        refcount_inc(&tester->refcnt);
+        tester_address = route->tester_address;
+    }
+    mutex_unlock(&doip_lock);
+    
+    if (!tester) {
+        pr_debug("doip: Response from 0x%04x with no tester\n", route->address);
+        return;
+    }
+    
+    route->responses++;
+    doip_send_diag(tester, DOIP_DIAG_MESSAGE, route->address, tester_address, data, len);
+    doip_conn_put(tester);
+}
+
+static void doip_isotp_receive(void *arg, const u8 *data, u32 len)
+{
+    doip_route_respond(arg, data, len);
+}
+
+static void doip_conn_work(struct work_struct *work);
+
+/*
+ * Connect to an Ethernet ECU's DoIP entity and activate routing with the
+ * gateway as the tester. Returns the link with a reference for the
+ * caller. Called with route->link_lock held.
+ */
+static struct doip_conn *doip_ecu_connect(struct doip_route *route)
+{
+    struct doip_conn *link;
+    struct socket *sock;
+    u8 req[7] = { 0 };
+    int ret;
+    
+    ret = sock_create_kern(&init_net, AF_INET, SOCK_STREAM, IPPROTO_TCP, &sock);
+    if (ret) {
+        return NULL;
+    }
+    ret = kernel_connect(sock, (struct sockaddr *)&route->ecu, sizeof(route->ecu), 0);
+    if (ret) {
+        pr_debug("doip: Connect to ECU 0x%04x failed: %d\n", route->address, ret);
+        sock_release(sock);
+        return NULL;
+    }
+    tcp_sock_set_nodelay(sock->sk);
+    
+    link = doip_conn_alloc(sock);
+    if (!link) {
+        sock_release(sock);
+        return NULL;
+    }
+    link->route = route;
+    // Receive work, route->link and the caller
+    refcount_set(&link->refcnt, 3);
+    
+    mutex_lock(&doip_lock);
+    list_add(&link->list, &doip_conns);
+    route->link = link;
+    mutex_unlock(&doip_lock);
+    INIT_WORK(&link->rx_work, doip_conn_work);
+    queue_work(doip_wq, &link->rx_work);
+    
+    put_unaligned_be16(logical_address, req);
+    ret = doip_send(link, DOIP_ROUTING_ACTIVATION_REQ, req, sizeof(req));
+    if (!ret && !wait_event_timeout(link->wait, READ_ONCE(link->activated) || READ_ONCE(link->closed),
+                                    msecs_to_jiffies(DOIP_ACTIVATION_TIMEOUT_MS))) {
+        ret = -ETIMEDOUT;
+    }
+    if (ret || !READ_ONCE(link->activated)) {
+        pr_info("doip: Routing activation with ECU 0x%04x failed\n", route->address);
+        kernel_sock_shutdown(sock, SHUT_RDWR);
+        doip_conn_put(link);
+        return NULL;
+    }
+    
+    return link;
+}
+
+static struct doip_conn *doip_ecu_link(struct doip_route *route)
+{
+    struct doip_conn *link;
+    
+    mutex_lock(&route->link_lock);
+    mutex_lock(&doip_lock);
+    link = route->link;
+    if (link) {
+        refcount_inc(&link->refcnt);
+    }
+    mutex_unlock(&doip_lock);
+    if (!link) {
+        link = doip_ecu_connect(route);
+    }
+    mutex_unlock(&route->link_lock);
+    
+    return link;
+}
+
+/*
+ * Send a tester's request on to its ECU without waiting for the
+ * response. Returns a diagnostic message ACK/NACK code.
+ */
+static u8 doip_route_forward(struct doip_route *route, struct doip_conn *tester, const u8 *data, u32 len)
+{
+    struct doip_conn *old = NULL, *link;
+    int ret;
+    
+    mutex_lock(&doip_lock);
+    if (route->tester != tester) {
+        old = route->tester;
+        refcount_inc(&tester->refcnt);
+        route->tester = tester;
+    }
+    route->tester_address = tester->tester_address;
+    mutex_unlock(&doip_lock);
+    doip_conn_put(old);
+    
+    route->requests++;
+    
+    switch (route->kind) {
+        case DOIP_ROUTE_ISOTP:
+            ret = uds_isotp_send(route->channel, data, len);
+            if (ret == -EBUSY) {
+                // Last segmented request still going out
+                uds_isotp_wait_sent(route->channel);
+                ret = uds_isotp_send(route->channel, data, len);
+            }
+            return ret ? DOIP_DIAG_TP_ERROR : DOIP_DIAG_OK;
+    
+        case DOIP_ROUTE_ETHERNET:
+            link = doip_ecu_link(route);
+            if (!link) {
+                return DOIP_DIAG_UNREACHABLE;
+            }
+            ret = doip_send_diag(link, DOIP_DIAG_MESSAGE, logical_address, route->address, data, len);
+            doip_conn_put(link);
+            return ret ? DOIP_DIAG_UNREACHABLE : DOIP_DIAG_OK;
+    }
+    
+    return DOIP_DIAG_UNKNOWN_TARGET;
+}
+
+static int doip_routing_activation(struct doip_conn *conn, const u8 *payload, u32 len)
+{
+    struct doip_conn *other;
+    u8 res[9] = { 0 };
+    u16 source;
+    u8 code = DOIP_RA_SUCCESS;
+    
+    if (len != 7 && len != 11) {
+        doip_send_nack(conn, DOIP_NACK_LENGTH);
+        return -EPROTO;
+    }
+    
+    source = get_unaligned_be16(payload);
+    if (source < DOIP_TESTER_MIN || source > DOIP_TESTER_MAX) {
+        code = DOIP_RA_UNKNOWN_SOURCE;
+    }
+    
+    mutex_lock(&doip_lock);
+    list_for_each_entry(other, &doip_conns, list) {
+        if (other != conn && !other->route && other->activated && other->tester_address == source) {
+            code = DOIP_RA_SOURCE_IN_USE;
+        }
+    }
+    if (code == DOIP_RA_SUCCESS) {
+        conn->tester_address = source;
+        conn->activated = true;
+    }
+    mutex_unlock(&doip_lock);
+    
+    put_unaligned_be16(source, res);
+    put_unaligned_be16(logical_address, res + 2);
+    res[4] = code;
+    doip_send(conn, DOIP_ROUTING_ACTIVATION_RES, res, sizeof(res));
+    
+    if (code != DOIP_RA_SUCCESS) {
+        return -EACCES;
+    }
+    conn->sock->sk->sk_rcvtimeo = msecs_to_jiffies(DOIP_GENERAL_INACTIVITY_MS);
+    pr_info("doip: Tester 0x%04x active\n", source);
+    return 0;
+}
+
+static int doip_tester_message(struct doip_conn *conn, u16 type, const u8 *payload, u32 len)
+{
+    struct doip_route *route;
+    u16 source, target;
+    u8 code;
+    
+    switch (type) {
+        case DOIP_ROUTING_ACTIVATION_REQ:
+            return doip_routing_activation(conn, payload, len);
+    
+        case DOIP_ALIVE_CHECK_RES:
+            return 0;
+    
+        case DOIP_DIAG_MESSAGE:
+            if (len < 5) {
+                doip_send_nack(conn, DOIP_NACK_LENGTH);
+                return -EPROTO;
+            }
+            source = get_unaligned_be16(payload);
+            target = get_unaligned_be16(payload + 2);
+    
+            // Unactivated or foreign source address: NACK and close
+            if (!conn->activated || source != conn->tester_address) {
+                code = DOIP_DIAG_INVALID_SOURCE;
+                doip_send_diag(conn, DOIP_DIAG_NACK, target, source, &code, 1);
+                return -EACCES;
+            }
+    
+            route = doip_route_find(target);
+            // The ACK goes out before a fast ECU's response can
+            mutex_lock(&conn->tx_lock);
+            if (!route) {
+                code = DOIP_DIAG_UNKNOWN_TARGET;
+            } else if (len - 4 > UDS_ISOTP_MAX_MESSAGE) {
+                code = DOIP_DIAG_TOO_LARGE;
+            } else {
+                code = doip_route_forward(route, conn, payload + 4, len - 4);
+            }
+            __doip_send_diag(conn, code == DOIP_DIAG_OK ? DOIP_DIAG_ACK : DOIP_DIAG_NACK,
+                             target, source, &code, 1);
+            mutex_unlock(&conn->tx_lock);
+            return 0;
+    
+        default:
+            doip_send_nack(conn, DOIP_NACK_PAYLOAD_TYPE);
+            return 0;
+    }
+}
+
+static int doip_ecu_message(struct doip_conn *link, u16 type, const u8 *payload, u32 len)
+{
+    struct doip_route *route = link->route;
+    u8 res[2];
+    
+    switch (type) {
+        case DOIP_ROUTING_ACTIVATION_RES:
+            if (len < 9 || payload[4] != DOIP_RA_SUCCESS) {
+                return -EACCES;
+            }
+            WRITE_ONCE(link->activated, true);
+            wake_up(&link->wait);
+            return 0;
+    
+        case DOIP_ALIVE_CHECK_REQ:
+            put_unaligned_be16(logical_address, res);
+            return doip_send(link, DOIP_ALIVE_CHECK_RES, res, sizeof(res));
+    
+        case DOIP_DIAG_MESSAGE:
+            if (len >= 5 && get_unaligned_be16(payload) == route->address) {
+                doip_route_respond(route, payload + 4, len - 4);
+            }
+            return 0;
+    
+        case DOIP_DIAG_NACK:
+            if (len >= 5) {
+                pr_debug("doip: ECU 0x%04x refused a request: 0x%02x\n", route->address, payload[4]);
+            }
+            return 0;
+    
+        default:
+            // ACKs and anything else need no action
+            return 0;
+    }
+}
+
+/*
+ * Read one message into conn->rx_buf. Returns 1 when an oversized
+ * payload was answered and skipped.
+ */
+static int doip_recv_message(struct doip_conn *conn, u16 *type, u32 *len)
+{
+    u8 hdr[DOIP_HEADER_LEN];
+    int ret;
+    
+    ret = doip_recv_exact(conn->sock, hdr, sizeof(hdr));
+    if (ret) {
+        return ret;
+    }
+    if (hdr[1] != (u8)~hdr[0]) {
+        doip_send_nack(conn, DOIP_NACK_PATTERN);
+        return -EPROTO;
+    }
+    
+    *type = get_unaligned_be16(hdr + 2);
+    *len = get_unaligned_be32(hdr + 4);
+    if (*len > DOIP_MAX_PAYLOAD) {
+        u32 left = *len;
+    
+        doip_send_nack(conn, DOIP_NACK_TOO_LARGE);
+        while (left) {
+            u32 n = min_t(u32, left, DOIP_MAX_PAYLOAD);
+    
+            ret = doip_recv_exact(conn->sock, conn->rx_buf, n);
+            if (ret) {
+                return ret;
+            }
+            left -= n;
+        }
+        return 1;
+    }
+    
+    return doip_recv_exact(conn->sock, conn->rx_buf, *len);
+}
+
+static void doip_conn_close(struct doip_conn *conn)
+{
+    struct doip_conn *put[DOIP_MAX_ROUTES + 1];
+    int i, n = 0;
+    
+    mutex_lock(&doip_lock);
+    list_del(&conn->list);
+    if (conn->route) {
+        if (conn->route->link == conn) {
+            conn->route->link = NULL;
+            put[n++] = conn;
+        }
+    } else {
+        doip_ntesters--;
+        for (i = 0; i < DOIP_MAX_ROUTES; i++) {
+            if (doip_routes[i].tester == conn) {
+                doip_routes[i].tester = NULL;
+                put[n++] = conn;
+            }
+        }
+    }
+    mutex_unlock(&doip_lock);
+    
+    WRITE_ONCE(conn->closed, true);
+    wake_up(&conn->wait);
+    
+    for (i = 0; i < n; i++) {
+        doip_conn_put(put[i]);
+    }
+}
+
+static void doip_conn_work(struct work_struct *work)
+{
+    struct doip_conn *conn = container_of(work, struct doip_conn, rx_work);
+    u16 type;
+    u32 len;
+    int ret;
+    
+    for (;;) {
+        ret = doip_recv_message(conn, &type, &len);
+        if (ret > 0) {
+            continue;
+        }
+        if (!ret) {
+            ret = conn->route ? doip_ecu_message(conn, type, conn->rx_buf, len)
+                              : doip_tester_message(conn, type, conn->rx_buf, len);
+        }
+        if (ret) {
+            break;
+        }
+    }
+    
+    if (conn->route) {
+        pr_debug("doip: Link to ECU 0x%04x closed: %d\n", conn->route->address, ret);
+    } else {
+        pr_debug("doip: Tester 0x%04x disconnected: %d\n", conn->tester_address, ret);
+    }
+    doip_conn_close(conn);
+    doip_conn_put(conn);
+}
+
+static void doip_accept(struct work_struct *work)
+{
+    while (!READ_ONCE(doip_stopping)) {
+        struct doip_conn *conn;
+        struct socket *sock;
+        int ret;
+    
+        ret = kernel_accept(doip_listen_sock, &sock, 0);
+        if (ret) {
+            continue;
+        }
+    
+        conn = NULL;
+        mutex_lock(&doip_lock);
+        if (doip_ntesters < DOIP_MAX_CONNECTIONS) {
+            conn = doip_conn_alloc(sock);
+        }
+        if (conn) {
+            list_add(&conn->list, &doip_conns);
+            doip_ntesters++;
+        }
+        mutex_unlock(&doip_lock);
+    
+        if (!conn) {
+            sock_release(sock);
+            continue;
+        }
+    
+        tcp_sock_set_nodelay(sock->sk);
+        sock->sk->sk_rcvtimeo = msecs_to_jiffies(DOIP_INITIAL_INACTIVITY_MS);
+        INIT_WORK(&conn->rx_work, doip_conn_work);
+        queue_work(doip_wq, &conn->rx_work);
+    }
+}
+
+static struct doip_route *doip_route_claim(u16 address)
+{
+    int i;
+    
+    if (doip_route_find(address)) {
+        return ERR_PTR(-EEXIST);
+    }
+    
+    // Find free route slot
+    for (i = 0; i < DOIP_MAX_ROUTES; i++) {
+        if (!doip_routes[i].active) {
+            break;
+        }
+    }
+    
+    if (i >= DOIP_MAX_ROUTES) {
+        pr_err("doip: No free route slots available\n");
+        return ERR_PTR(-ENOMEM);
+    }
+    
+    doip_routes[i].address = address;
+    doip_routes[i].requests = 0;
+    doip_routes[i].responses = 0;
+    return &doip_routes[i];
+}
+
+/**
+ * Route diagnostic messages for address to the ECU on an ISO-TP channel
+ */
+int doip_add_isotp_route(u16 address, u32 channel)
+{
+    struct doip_route *route;
+    int ret;
+    
+    mutex_lock(&doip_lock);
+    route = doip_route_claim(address);
+    if (IS_ERR(route)) {
+        ret = PTR_ERR(route);
+        goto out;
+    }
+    
+    route->kind = DOIP_ROUTE_ISOTP;
+    route->channel = channel;
+    ret = uds_isotp_set_receiver(channel, doip_isotp_receive, route);
+    if (ret) {
+        goto out;
+    }
+    smp_store_release(&route->active, true);
+    
+    pr_info("doip: Route 0x%04x -> ISO-TP channel %u\n", address, channel);
+    
+out:
+    mutex_unlock(&doip_lock);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(doip_add_isotp_route);
+
+/**
+ * Route diagnostic messages for address to an ECU's own DoIP entity;
+ * the connection is opened on the first request
+ */
+int doip_add_ethernet_route(u16 address, __be32 ip, u16 ecu_port)
+{
+    struct doip_route *route;
+    int ret = 0;
+    
+    mutex_lock(&doip_lock);
+    route = doip_route_claim(address);
+    if (IS_ERR(route)) {
+        ret = PTR_ERR(route);
+        goto out;
+    }
+    
+    route->kind = DOIP_ROUTE_ETHERNET;
+    route->ecu.sin_family = AF_INET;
+    route->ecu.sin_addr.s_addr = ip;
+    route->ecu.sin_port = htons(ecu_port);
+    smp_store_release(&route->active, true);
+    
+    pr_info("doip: Route 0x%04x -> %pI4:%u\n", address, &ip, ecu_port);
+    
+out:
+    mutex_unlock(&doip_lock);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(doip_add_ethernet_route);
+
+static int doip_listen(void)
+{
+    struct sockaddr_in sa = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    int ret;
+    
+    ret = sock_create_kern(&init_net, AF_INET, SOCK_STREAM, IPPROTO_TCP, &doip_listen_sock);
+    if (ret) {
+        return ret;
+    }
+    sock_set_reuseaddr(doip_listen_sock->sk);
+    
+    ret = kernel_bind(doip_listen_sock, (struct sockaddr *)&sa, sizeof(sa));
+    if (!ret) {
+        ret = kernel_listen(doip_listen_sock, DOIP_MAX_CONNECTIONS);
+    }
+    if (ret) {
+        sock_release(doip_listen_sock);
+        doip_listen_sock = NULL;
+    }
+    return ret;
+}
 
 static int __init doip_init(void)
 {
+    int i, ret;
+    
     pr_info("doip: Initializing\n");
+    
+    for (i = 0; i < DOIP_MAX_ROUTES; i++) {
+        mutex_init(&doip_routes[i].link_lock);
+    }
+    
+    // Receive works block in recvmsg for the life of their connection
+    doip_wq = alloc_workqueue("doip", WQ_UNBOUND, 0);
+    if (!doip_wq) {
+        return -ENOMEM;
+    }
+    
+    ret = doip_listen();
+    if (ret) {
+        pr_err("doip: Failed to listen on port %u: %d\n", port, ret);
+        destroy_workqueue(doip_wq);
+        return ret;
+    }
+    
+    INIT_WORK(&doip_accept_work, doip_accept);
+    queue_work(doip_wq, &doip_accept_work);
+    
+    pr_info("doip: Gateway 0x%04x listening on port %u\n", logical_address, port);
     return 0;
 }
 
 static void __exit doip_exit(void)
 {
+    struct doip_conn *conn;
+    int i;
+    
+    // No more responses from the ISO-TP side
+    for (i = 0; i < DOIP_MAX_ROUTES; i++) {
+        if (doip_routes[i].active && doip_routes[i].kind == DOIP_ROUTE_ISOTP) {
+            uds_isotp_set_receiver(doip_routes[i].channel, NULL, NULL);
+        }
+    }
+    
+    // Wake the accept and receive works; each connection closes itself
+    WRITE_ONCE(doip_stopping, true);
+    kernel_sock_shutdown(doip_listen_sock, SHUT_RDWR);
+    mutex_lock(&doip_lock);
+    list_for_each_entry(conn, &doip_conns, list) {
+        kernel_sock_shutdown(conn->sock, SHUT_RDWR);
+    }
+    mutex_unlock(&doip_lock);
+    
+    destroy_workqueue(doip_wq);
+    sock_release(doip_listen_sock);
+    
     pr_info("doip: Exiting\n");
 }
 
@@ -28,4 +856,4 @@ module_exit(doip_exit);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("jk1806");
 MODULE_DESCRIPTION("DoIP Implementation");
-MODULE_VERSION(MODULE_VERSION);
+MODULE_VERSION(DOIP_VERSION);
@@ -0,0 +1,23 @@
+/**
+ * DoIP gateway
+ *
+ * ISO 13400-2 over TCP, in doip.c. Testers connect, activate routing and
+ * send diagnostic messages to logical addresses; the address table
+ * sends each one on to an ECU behind an ISO-TP channel (uds_isotp.h) or
+ * to an ECU with its own DoIP entity on Ethernet. Diagnostic messages
+ * are acknowledged once forwarded and the ECU's response comes back on
+ * its own, so a tester keeps any number of ECUs busy at once.
+ */
+
+#ifndef DOIP_H
+#define DOIP_H
+
+#include <linux/types.h>
+
+#define DOIP_PORT 13400
+#define DOIP_MAX_ROUTES 32
+
+int doip_add_isotp_route(u16 address, u32 channel);
+int doip_add_ethernet_route(u16 address, __be32 ip, u16 port);
+
+#endif /* DOIP_H */
@@ -3,13 +3,611 @@
  * Author: jk1806
  * Created: 2024-12-10
  * 
- * Implementation for embedded systems
+ * TSN egress scheduler: 802.1Qbv time-aware gates and 802.1Qav credit-
+ * based shapers on gPTP time. Configuration goes to the NIC through the
+ * taprio and cbs offloads when its driver accepts them, and frames are
+ * then handed straight to the traffic class's hardware queue. Without
+ * offload the same schedule runs in software: one queue per traffic
+ * class, strict priority among the classes whose gate is open, a frame
+ * only leaves if it finishes before its gate closes (the guard band),
+ * and a shaped class only while its credit is not negative. The wire is
+ * modelled from the link speed so the next decision waits until the
+ * last frame is out.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/ethtool.h>
+#include <linux/rtnetlink.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/math64.h>
+#include <linux/timekeeping.h>
+#include <net/pkt_sched.h>
+#include <net/pkt_cls.h>
 
-#define MODULE_VERSION "1.0.0"
+#include "ethernet_avb_tsn.h"
+#include "gptp.h"
+
+#define TSN_VERSION "1.1.0"
+
+#define TSN_QUEUE_LIMIT 256                 // frames per traffic class
+#define TSN_MAX_FRAME 1522                  // tagged frame, bounds the shapers' credit
+#define TSN_WIRE_OVERHEAD 24                // preamble, FCS and inter-frame gap
+#define TSN_DEFAULT_SPEED_MBPS 100          // 100BASE-T1 when the PHY does not say
+#define TSN_ALL_GATES GENMASK(TSN_NUM_TC - 1, 0)
+
+struct tsn_schedule {
+    u64 base_time;
+    u64 cycle_time;                         // sum of the intervals
+    u32 num_entries;
+    struct tsn_gate_entry entries[TSN_MAX_GCL];
+};
+
+/*
+ * Credit is kept in nanobits so slope (bit/s) times time (ns) needs no
+ * division.
+ */
+struct tsn_cbs {
+    bool enabled;
+    u32 idleslope_kbps;
+    s64 idleslope;                          // bit/s
+    s64 sendslope;                          // idleslope - port rate, bit/s
+    s64 hicredit;
+    s64 locredit;
+    s64 credit;
+    u64 last;                               // credit is up to date at this time
+};
+
+struct tsn_port {
+    bool active;
+    struct net_device *dev;
+    u64 link_bps;
+    u8 prio_tc[16];
+    struct mutex cfg_lock;                  // configuration and offload
+    bool offload;                           // gates and shapers run in the NIC
+    
+    spinlock_t lock;
+    struct sk_buff_head queues[TSN_NUM_TC];
+    struct tsn_schedule oper;
+    struct tsn_schedule admin;              // takes over at its base time
+    bool admin_pending;
+    struct tsn_cbs cbs[TSN_NUM_TC];
+    u64 wire_free;                          // when the last frame sent is off the wire
+    struct hrtimer timer;
+    
+    u32 sent[TSN_NUM_TC];
+    u32 dropped[TSN_NUM_TC];
+};
+
+static struct tsn_port tsn_ports[TSN_MAX_PORTS];
+static DEFINE_MUTEX(tsn_ports_lock);
+
+// Frame time on the wire, overhead included
+static u64 tsn_tx_ns(struct tsn_port *p, unsigned int len)
+{
+    return div64_u64((u64)(len + TSN_WIRE_OVERHEAD) * 8 * NSEC_PER_SEC, p->link_bps);
+}
+
+/*
+ * Gates open at now, and in *until the time they next change. Before an
+ * operational schedule starts every gate is open.
+ */
+static u32 tsn_gates(struct tsn_schedule *s, u64 now, u64 *until)
+{
+    u64 offset, t = 0;
+    u32 i;
+    
+    if (!s->num_entries) {
+        *until = U64_MAX;
+        return TSN_ALL_GATES;
+    }
+    if (now < s->base_time) {
+        *until = s->base_time;
+        return TSN_ALL_GATES;
+    }
+    
+    div64_u64_rem(now - s->base_time, s->cycle_time, &offset);
+    for (i = 0; i < s->num_entries; i++) {
+        t += s->entries[i].interval_ns;
+        if (offset < t) {
+            *until = now - offset + t;
+            return s->entries[i].gate_mask;
+        }
+    }
+    
+    *until = now - offset + s->cycle_time;
+    return s->entries[s->num_entries - 1].gate_mask;
+}
+
+// When the gate of tc, open at now, closes; U64_MAX if it stays open all cycle
+static u64 tsn_gate_close(struct tsn_schedule *s, u64 now, u8 tc)
+{
+    u64 t = now, until;
+    u32 n;
+    
+    for (n = 0; n <= s->num_entries; n++) {
+        if (!(tsn_gates(s, t, &until) & BIT(tc))) {
+            return t;
+        }
+        if (until == U64_MAX) {
+            break;
+        }
+        t = until;
+    }
+    return U64_MAX;
+}
+
+static void tsn_cbs_advance(struct tsn_port *p, u64 now)
+{
+    int tc;
+    
+    for (tc = 0; tc < TSN_NUM_TC; tc++) {
+        struct tsn_cbs *c = &p->cbs[tc];
+        u64 dt;
+    
+        if (!c->enabled || now <= c->last) {
+            continue;
+        }
+        dt = min_t(u64, now - c->last, NSEC_PER_SEC);
+        c->last = now;
+        // Credit builds only while frames wait, or back up to zero after sending
+        if (!skb_queue_empty(&p->queues[tc]) || c->credit < 0) {
+            c->credit += c->idleslope * dt;
+        }
+        if (skb_queue_empty(&p->queues[tc]) && c->credit > 0) {
+            c->credit = 0;
+        }
+        c->credit = min(c->credit, c->hicredit);
+    }
+}
+
+// The hrtimer runs on CLOCK_TAI; gPTP time may be offset from it
+static void tsn_arm(struct tsn_port *p, u64 when)
+{
+    s64 skew = gptp_now() - ktime_get_clocktai_ns();
+    
+    hrtimer_start(&p->timer, ns_to_ktime(when - skew), HRTIMER_MODE_ABS_SOFT);
+}
+
+/*
+ * Software scheduler: send what gates and credit allow, then sleep until
+ * the next gate change, credit recovery or the wire coming free. Called
+ * with p->lock held; drops it around each transmission.
+ */
+static void tsn_run(struct tsn_port *p)
+{
+    for (;;) {
+        struct sk_buff *skb = NULL;
+        u64 now = gptp_now(), wake, tx = 0;
+        bool waiting = false;
+        u32 gates;
+        int tc;
+    
+        if (now < p->wire_free) {
+            tsn_arm(p, p->wire_free);
+            return;
+        }
+        if (p->admin_pending && now >= p->admin.base_time) {
+            p->oper = p->admin;
+            p->admin_pending = false;
+        }
+        tsn_cbs_advance(p, now);
+    
+        gates = tsn_gates(&p->oper, now, &wake);
+        if (p->admin_pending) {
+            wake = min(wake, p->admin.base_time);
+        }
+    
+        for (tc = TSN_NUM_TC - 1; tc >= 0; tc--) {
+            struct tsn_cbs *c = &p->cbs[tc];
+    
+            if (skb_queue_empty(&p->queues[tc])) {
+                continue;
+            }
+            waiting = true;
+            if (!(gates & BIT(tc))) {
+                continue;
+            }
+            tx = tsn_tx_ns(p, skb_peek(&p->queues[tc])->len);
+            // Guard band: the frame must be off the wire before the gate closes
+            if (now + tx > tsn_gate_close(&p->oper, now, tc)) {
+                continue;
+            }
+            if (c->enabled && c->credit < 0) {
+                wake = min(wake, now + div64_u64(-c->credit, c->idleslope) + 1);
+                continue;
+            }
+            skb = __skb_dequeue(&p->queues[tc]);
+            break;
+        }
+    
+        if (!skb) {
+            // Nothing queued: the next frame restarts the scheduler
+            if (waiting && wake != U64_MAX) {
+                tsn_arm(p, wake);
+            }
+            return;
+        }
+    
+        if (p->cbs[tc].enabled) {
+            struct tsn_cbs *c = &p->cbs[tc];
+    
+            c->credit = max(c->credit + c->sendslope * (s64)tx, c->locredit);
+            c->last = now + tx;
+        }
+        p->wire_free = now + tx;
+        p->sent[tc]++;
+    
+        spin_unlock(&p->lock);
+        dev_direct_xmit(skb, tc % p->dev->real_num_tx_queues);
+        spin_lock(&p->lock);
+    }
+}
+
+static enum hrtimer_restart tsn_timer(struct hrtimer *timer)
+{
+    struct tsn_port *p = container_of(timer, struct tsn_port, timer);
+    
+    spin_lock(&p->lock);
+    tsn_run(p);
+    spin_unlock(&p->lock);
+    
+    return HRTIMER_NORESTART;
+}
+
+static int tsn_offload_taprio(struct tsn_port *p, struct tsn_schedule *s, bool enable)
+{
+    struct tc_taprio_qopt_offload *qopt;
+    int i, ret;
+    
+    qopt = taprio_offload_alloc(enable ? s->num_entries : 0);
+    if (!qopt) {
+        return -ENOMEM;
+    }
+    
+    qopt->cmd = enable ? TAPRIO_CMD_REPLACE : TAPRIO_CMD_DESTROY;
+    if (enable) {
+        // One hardware queue per traffic class
+        qopt->mqprio.qopt.num_tc = TSN_NUM_TC;
+        memcpy(qopt->mqprio.qopt.prio_tc_map, p->prio_tc, sizeof(p->prio_tc));
+        for (i = 0; i < TSN_NUM_TC; i++) {
+            qopt->mqprio.qopt.count[i] = 1;
+            qopt->mqprio.qopt.offset[i] = i;
+        }
+        qopt->base_time = ns_to_ktime(s->base_time);
+        qopt->cycle_time = s->cycle_time;
+        qopt->num_entries = s->num_entries;
+        for (i = 0; i < s->num_entries; i++) {
+            qopt->entries[i].command = TC_TAPRIO_CMD_SET_GATES;
+            qopt->entries[i].gate_mask = s->entries[i].gate_mask;
+            qopt->entries[i].interval = s->entries[i].interval_ns;
+        }
+    }
+    
+    ret = p->dev->netdev_ops->ndo_setup_tc(p->dev, TC_SETUP_QDISC_TAPRIO, qopt);
+    taprio_offload_free(qopt);
+    return ret;
+}
+
+static int tsn_offload_cbs(struct tsn_port *p, u8 tc, bool enable)
+{
+    struct tsn_cbs *c = &p->cbs[tc];
+    struct tc_cbs_qopt_offload qopt = {
+        .enable = enable,
+        .queue = tc,
+        .idleslope = c->idleslope_kbps,
+        .sendslope = div_s64(c->sendslope, 1000),
+        .hicredit = div_s64(c->hicredit, NSEC_PER_SEC),
+        .locredit = div_s64(c->locredit, NSEC_PER_SEC),
+    };
+    
+    return p->dev->netdev_ops->ndo_setup_tc(p->dev, TC_SETUP_QDISC_CBS, &qopt);
+}
+
+/*
+ * Hand the admin schedule and every shaper to the NIC, all or nothing.
+ * Called with cfg_lock held.
+ */
+static void tsn_offload(struct tsn_port *p)
+{
+    bool was = p->offload;
+    int tc, ret = -EOPNOTSUPP;
+    
+    if (p->dev->netdev_ops->ndo_setup_tc && p->dev->real_num_tx_queues >= TSN_NUM_TC) {
+        rtnl_lock();
+        ret = 0;
+        if (p->admin.num_entries) {
+            ret = tsn_offload_taprio(p, &p->admin, true);
+        }
+        for (tc = 0; tc < TSN_NUM_TC && !ret; tc++) {
+            if (p->cbs[tc].enabled) {
+                ret = tsn_offload_cbs(p, tc, true);
+            }
+        }
+        if (ret) {
+            for (tc = 0; tc < TSN_NUM_TC; tc++) {
+                if (p->cbs[tc].enabled) {
+                    tsn_offload_cbs(p, tc, false);
+                }
+            }
+            if (p->admin.num_entries) {
+                tsn_offload_taprio(p, &p->admin, false);
+            }
+        }
+        rtnl_unlock();
+    }
+    
+    p->offload = !ret;
+    if (p->offload != was) {
+        pr_info("ethernet_avb_tsn: %s: scheduling in %s\n", p->dev->name, p->offload ? "hardware" : "software");
+    }
+}
+
+static struct tsn_port *tsn_port_get(u32 port)
+{
+    if (port >= TSN_MAX_PORTS || !tsn_ports[port].active) {
+        return NULL;
+    }
+    return &tsn_ports[port];
+}
+
+/**
+ * Put a network interface under TSN scheduling
+ */
+int tsn_port_open(const char *ifname)
+{
+    struct ethtool_link_ksettings ks;
+    struct net_device *dev;
+    struct tsn_port *p;
+    int i, ret;
+    
+    dev = dev_get_by_name(&init_net, ifname);
+    if (!dev) {
+        pr_err("ethernet_avb_tsn: No interface %s\n", ifname);
+        return -ENODEV;
+    }
+    
+    mutex_lock(&tsn_ports_lock);
+    
+    // Find free port slot
+    for (i = 0; i < TSN_MAX_PORTS; i++) {
+        if (!tsn_ports[i].active) {
+            break;
+        }
+    }
+    
+    if (i >= TSN_MAX_PORTS) {
+        pr_err("ethernet_avb_tsn: No free port slots available\n");
+        ret = -ENOMEM;
+        goto err;
+    }
+    
+    p = &tsn_ports[i];
+    memset(p, 0, sizeof(*p));
+    p->dev = dev;
+    
+    rtnl_lock();
+    ret = __ethtool_get_link_ksettings(dev, &ks);
+    rtnl_unlock();
+    p->link_bps = (u64)(ret || ks.base.speed == SPEED_UNKNOWN ? TSN_DEFAULT_SPEED_MBPS : ks.base.speed) * 1000000;
+    
+    for (i = 0; i < ARRAY_SIZE(p->prio_tc); i++) {
+        p->prio_tc[i] = i & (TSN_NUM_TC - 1);
+    }
+    for (i = 0; i < TSN_NUM_TC; i++) {
+        skb_queue_head_init(&p->queues[i]);
+    }
+    mutex_init(&p->cfg_lock);
+    spin_lock_init(&p->lock);
+    hrtimer_init(&p->timer, CLOCK_TAI, HRTIMER_MODE_ABS_SOFT);
+    p->timer.function = tsn_timer;
+    
+    mutex_lock(&p->cfg_lock);
+    tsn_offload(p);
+    mutex_unlock(&p->cfg_lock);
+    
+    smp_store_release(&p->active, true);
+    mutex_unlock(&tsn_ports_lock);
+    
+    pr_info("ethernet_avb_tsn: Port %ld on %s, %llu Mbit/s\n", (long)(p - tsn_ports), dev->name,
+            p->link_bps / 1000000);
+    return p - tsn_ports;
+    
+err:
+    mutex_unlock(&tsn_ports_lock);
+    dev_put(dev);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(tsn_port_open);
+
+/**
+ * Map the 16 skb priorities to traffic classes
+ */
+int tsn_set_prio_map(u32 port, const u8 *prio_tc)
+{
+    struct tsn_port *p = tsn_port_get(port);
+    int i;
+    
+    if (!p || !prio_tc) {
+        return -EINVAL;
+    }
+    for (i = 0; i < ARRAY_SIZE(p->prio_tc); i++) {
+        if (prio_tc[i] >= TSN_NUM_TC) {
+            return -EINVAL;
+        }
+    }
+    
+    mutex_lock(&p->cfg_lock);
+    spin_lock_bh(&p->lock);
+    memcpy(p->prio_tc, prio_tc, sizeof(p->prio_tc));
+    spin_unlock_bh(&p->lock);
+    tsn_offload(p);
+    mutex_unlock(&p->cfg_lock);
+    
+    return 0;
+}
+EXPORT_SYMBOL_GPL(tsn_set_prio_map);
+
+/**
+ * Install a gate control list. It becomes operational at base_time, or
+ * at the next cycle start after now if base_time has already passed.
+ * No entries removes the schedule and opens every gate.
+ */
+int tsn_set_schedule(u32 port, u64 base_time, const struct tsn_gate_entry *entries, u32 num_entries)
+{
+    struct tsn_port *p = tsn_port_get(port);
+    struct tsn_schedule s = { .base_time = base_time, .num_entries = num_entries };
+    u64 now;
+    u32 i;
+    
+    if (!p || num_entries > TSN_MAX_GCL || (num_entries && !entries)) {
+        pr_err("Invalid TSN schedule parameters\n");
+        return -EINVAL;
+    }
+    for (i = 0; i < num_entries; i++) {
+        if (!entries[i].interval_ns || entries[i].gate_mask & ~TSN_ALL_GATES) {
+            return -EINVAL;
+        }
+        s.entries[i] = entries[i];
+        s.cycle_time += entries[i].interval_ns;
+    }
+    
+    now = gptp_now();
+    if (num_entries && s.base_time < now) {
+        s.base_time += roundup(now - s.base_time, s.cycle_time);
+    }
+    
+    mutex_lock(&p->cfg_lock);
+    spin_lock_bh(&p->lock);
+    p->admin = s;
+    p->admin_pending = true;
+    if (!p->offload) {
+        tsn_run(p);
+    }
+    spin_unlock_bh(&p->lock);
+    tsn_offload(p);
+    mutex_unlock(&p->cfg_lock);
+    
+    pr_info("ethernet_avb_tsn: Port %u schedule: %u entries, cycle %llu ns, base %llu\n",
+            port, num_entries, s.cycle_time, s.base_time);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(tsn_set_schedule);
+
+/**
+ * Shape a traffic class to idleslope_kbps (802.1Qav); 0 removes the shaper
+ */
+int tsn_set_cbs(u32 port, u8 tc, u32 idleslope_kbps)
+{
+    struct tsn_port *p = tsn_port_get(port);
+    struct tsn_cbs *c;
+    bool was_enabled;
+    s64 idle;
+    
+    if (!p || tc >= TSN_NUM_TC || (u64)idleslope_kbps * 1000 > p->link_bps) {
+        pr_err("Invalid TSN shaper parameters\n");
+        return -EINVAL;
+    }
+    c = &p->cbs[tc];
+    idle = (s64)idleslope_kbps * 1000;
+    
+    mutex_lock(&p->cfg_lock);
+    was_enabled = c->enabled;
+    spin_lock_bh(&p->lock);
+    c->idleslope_kbps = idleslope_kbps;
+    c->idleslope = idle;
+    c->sendslope = idle - (s64)p->link_bps;
+    // One maximum frame of interference above, one of our own below
+    c->hicredit = div64_s64((s64)TSN_MAX_FRAME * 8 * idle, p->link_bps) * NSEC_PER_SEC;
+    c->locredit = div64_s64((s64)TSN_MAX_FRAME * 8 * c->sendslope, p->link_bps) * NSEC_PER_SEC;
+    c->credit = 0;
+    c->last = gptp_now();
+    c->enabled = idleslope_kbps != 0;
+    spin_unlock_bh(&p->lock);
+    
+    if (was_enabled && !c->enabled && p->offload) {
+        rtnl_lock();
+        tsn_offload_cbs(p, tc, false);
+        rtnl_unlock();
+    }
+    tsn_offload(p);
+    mutex_unlock(&p->cfg_lock);
+    
+    return 0;
+}
+EXPORT_SYMBOL_GPL(tsn_set_cbs);
+
+/**
+ * Send a frame through the port's scheduler. skb->priority picks the
+ * traffic class. The skb is consumed.
+ */
+int tsn_xmit(u32 port, struct sk_buff *skb)
+{
+    struct tsn_port *p = tsn_port_get(port);
+    u8 tc;
+    
+    if (!p) {
+        kfree_skb(skb);
+        return -EINVAL;
+    }
+    tc = READ_ONCE(p->prio_tc[skb->priority & 15]);
+    skb->dev = p->dev;
+    
+    // The NIC gates and shapes its own queues
+    if (READ_ONCE(p->offload)) {
+        return dev_direct_xmit(skb, tc) == NETDEV_TX_OK ? 0 : -ENOBUFS;
+    }
+    
+    spin_lock_bh(&p->lock);
+    
+    if (skb_queue_len(&p->queues[tc]) >= TSN_QUEUE_LIMIT) {
+        p->dropped[tc]++;
+        spin_unlock_bh(&p->lock);
+        kfree_skb(skb);
+        return -ENOBUFS;
+    }
+    
+    // Idle time before this frame earns no credit
+    tsn_cbs_advance(p, gptp_now());
+    __skb_queue_tail(&p->queues[tc], skb);
+    tsn_run(p);
+    
+    spin_unlock_bh(&p->lock);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(tsn_xmit);
+
+static void tsn_port_close(struct tsn_port *p)
+{
+    int tc;
+    
+    WRITE_ONCE(p->active, false);
+    hrtimer_cancel(&p->timer);
+    
+    mutex_lock(&p->cfg_lock);
+    if (p->offload && p->dev->netdev_ops->ndo_setup_tc) {
+        rtnl_lock();
+        for (tc = 0; tc < TSN_NUM_TC; tc++) {
+            if (p->cbs[tc].enabled) {
+                tsn_offload_cbs(p, tc, false);
+            }
+        }
+        if (p->admin.num_entries) {
+            tsn_offload_taprio(p, &p->admin, false);
+        }
+        rtnl_unlock();
+    }
+    mutex_unlock(&p->cfg_lock);
+    
+    for (tc = 0; tc < TSN_NUM_TC; tc++) {
+        skb_queue_purge(&p->queues[tc]);
+    }
+    dev_put(p->dev);
+}
 
 static int __init ethernet_avb_tsn_init(void)
 {
@@ -19,6 +617,13 @@ static int __init ethernet_avb_tsn_init(void)
 
 static void __exit ethernet_avb_tsn_exit(void)
 {
+    int i;
+    
+    for (i = 0; i < TSN_MAX_PORTS; i++) {
+        if (tsn_ports[i].active) {
+            tsn_port_close(&tsn_ports[i]);
+        }
+    }
     pr_info("ethernet_avb_tsn: Exiting\n");
 }
 
@@ -28,4 +633,4 @@ module_exit(ethernet_avb_tsn_exit);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("jk1806");
 MODULE_DESCRIPTION("Ethernet AVB/TSN");
-MODULE_VERSION(MODULE_VERSION);
+MODULE_VERSION(TSN_VERSION);
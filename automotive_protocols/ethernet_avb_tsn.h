@@ -0,0 +1,34 @@
+/**
+ * TSN egress scheduling
+ *
+ * 802.1Qbv gate control lists and 802.1Qav credit-based shapers per
+ * port, in ethernet_avb_tsn.c. A port hands both to the NIC through the
+ * taprio and cbs offloads when the driver takes them; otherwise frames
+ * wait in per-traffic-class queues and an hrtimer releases them as their
+ * gate opens and their credit allows. Gate times are gPTP time,
+ * gptp_now() (gptp.h).
+ */
+
+#ifndef ETHERNET_AVB_TSN_H
+#define ETHERNET_AVB_TSN_H
+
+#include <linux/types.h>
+
+#define TSN_MAX_PORTS 4
+#define TSN_NUM_TC 8                        // traffic classes, 7 highest
+#define TSN_MAX_GCL 64                      // gate control list entries
+
+struct sk_buff;
+
+struct tsn_gate_entry {
+    u32 gate_mask;                          // bit n: traffic class n may transmit
+    u32 interval_ns;
+};
+
+int tsn_port_open(const char *ifname);
+int tsn_set_prio_map(u32 port, const u8 *prio_tc);
+int tsn_set_schedule(u32 port, u64 base_time, const struct tsn_gate_entry *entries, u32 num_entries);
+int tsn_set_cbs(u32 port, u8 tc, u32 idleslope_kbps);
+int tsn_xmit(u32 port, struct sk_buff *skb);
+
+#endif /* ETHERNET_AVB_TSN_H */
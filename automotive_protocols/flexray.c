@@ -4,22 +4,448 @@
  * Created: 2024-11-15
  * 
  * Implementation for embedded systems
+ *
+ * Schedule engine over a FlexRay communication controller. The offline
+ * slot table is expanded once into a plan per cycle, ordered by slot:
+ * the messages a cycle received and the ones it transmits. One hard
+ * hrtimer wakes in every cycle's network idle time, placed from the
+ * controller's own cycle position, reads what the cycle received into
+ * the messages' double buffers and stages for the next cycle every
+ * transmit buffer the application has changed. The controller resends
+ * a static slot's last payload on its own, so unchanged static frames
+ * cost nothing; dynamic frames go out only when written.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
 
-#define MODULE_VERSION "1.0.0"
+#include "flexray.h"
+
+#define FLEXRAY_VERSION "1.1.0"
+#define FLEXRAY_EARLY_NS 20000              // woken this far before the NIT or more: wait for it
+
+/*
+ * Double buffer with one writer at a time: the writer fills the back
+ * half and flips front. A reader copies the front half and only has to
+ * retry if the writer came round to that half again meanwhile, which
+ * takes two updates during one copy.
+ */
+struct flexray_msgbuf {
+    u32 gen;                                // odd while the back half is filled
+    u8 front;
+    u8 len[2];
+    u8 data[2][FLEXRAY_MAX_PAYLOAD];
+};
+
+struct flexray_message {
+    struct flexray_slot slot;
+    spinlock_t write_lock;                  // application writers of a TX message
+    u32 staged_gen;                         // TX: generation last handed to the controller
+    struct flexray_msgbuf buf;
+};
+
+struct flexray_controller {
+    const struct flexray_cc_ops *ops;
+    void *ctx;
+    struct mutex cfg_lock;
+    struct flexray_cluster cluster;
+    struct flexray_message *messages;
+    u32 num_messages;
+    u16 plan_start[FLEXRAY_CYCLES + 1];     // cycle c is plan[plan_start[c]] up to plan_start[c + 1]
+    u16 *plan;
+    struct hrtimer timer;
+    bool running;
+    u8 expected_cycle;
+    
+    u32 cycles;
+    u32 missed_cycles;                      // timer too late for a cycle
+    u32 late;                               // processing ran into the next cycle
+    u32 torn;
+    u32 received;
+    u32 staged;
+};
+
+static struct flexray_controller flexray_cc;
+
+static void flexray_buf_put(struct flexray_msgbuf *mb, const u8 *data, u8 len)
+{
+    u8 back = !mb->front;
+    
+    WRITE_ONCE(mb->gen, mb->gen + 1);
+    smp_wmb();
+    memcpy(mb->data[back], data, len);
+    mb->len[back] = len;
+    smp_wmb();
+    WRITE_ONCE(mb->front, back);
+    smp_store_release(&mb->gen, mb->gen + 1);
+}
+
+/*
+ * Copy out the front half; false if the writer got to it during the
+ * copy. *gen is the generation of what was copied, 0 for never written.
+ */
+static bool flexray_buf_get(struct flexray_msgbuf *mb, u8 *data, u8 *len, u32 *gen)
+{
+    u32 g = smp_load_acquire(&mb->gen);
+    u8 f = READ_ONCE(mb->front);
+    u8 n = READ_ONCE(mb->len[f]);
+    
+    memcpy(data, mb->data[f], n);
+    smp_rmb();
+    if ((s32)(READ_ONCE(mb->gen) - (g | 1)) >= 2) {
+        return false;
+    }
+    *len = n;
+    *gen = g & ~1U;
+    return true;
+}
+
+/**
+ * Use a communication controller; before flexray_configure()
+ */
+int flexray_register_controller(const struct flexray_cc_ops *ops, void *ctx)
+{
+    if (!ops || !ops->configure || !ops->start || !ops->position || !ops->write || !ops->read) {
+        return -EINVAL;
+    }
+    
+    mutex_lock(&flexray_cc.cfg_lock);
+    if (flexray_cc.running) {
+        mutex_unlock(&flexray_cc.cfg_lock);
+        return -EBUSY;
+    }
+    flexray_cc.ops = ops;
+    flexray_cc.ctx = ctx;
+    mutex_unlock(&flexray_cc.cfg_lock);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(flexray_register_controller);
+
+static bool flexray_slot_valid(const struct flexray_slot *s)
+{
+    return s->slot_id && is_power_of_2(s->repetition) && s->repetition <= FLEXRAY_CYCLES &&
+           s->base_cycle < s->repetition && s->channels &&
+           !(s->channels & ~(FLEXRAY_CHANNEL_A | FLEXRAY_CHANNEL_B)) &&
+           s->payload_len <= FLEXRAY_MAX_PAYLOAD && !(s->payload_len & 1) &&
+           (s->direction == FLEXRAY_TX || s->direction == FLEXRAY_RX);
+}
+
+// Two rows sending in the same slot on a shared channel in some cycle
+static bool flexray_slots_collide(const struct flexray_slot *a, const struct flexray_slot *b)
+{
+    u8 rep = min(a->repetition, b->repetition);
+    
+    return a->direction == FLEXRAY_TX && b->direction == FLEXRAY_TX && a->slot_id == b->slot_id &&
+           (a->channels & b->channels) && (a->base_cycle & (rep - 1)) == (b->base_cycle & (rep - 1));
+}
+
+static int flexray_cmp_slot(const void *a, const void *b, const void *priv)
+{
+    const struct flexray_slot *slots = priv;
+    
+    return (int)slots[*(const u16 *)a].slot_id - (int)slots[*(const u16 *)b].slot_id;
+}
+
+/*
+ * Expand the slot table into one list per cycle, messages in slot
+ * order: static slots first, then dynamic ones by frame ID
+ */
+static u16 *flexray_build_plan(const struct flexray_slot *slots, u32 num_slots, u16 *plan_start)
+{
+    u16 order[FLEXRAY_MAX_MESSAGES], fill[FLEXRAY_CYCLES];
+    u32 total = 0, i, c;
+    u16 *plan;
+    
+    memset(plan_start, 0, sizeof(u16) * (FLEXRAY_CYCLES + 1));
+    for (i = 0; i < num_slots; i++) {
+        order[i] = i;
+        for (c = slots[i].base_cycle; c < FLEXRAY_CYCLES; c += slots[i].repetition) {
+            plan_start[c + 1]++;
+            total++;
+        }
+    }
+    for (c = 0; c < FLEXRAY_CYCLES; c++) {
+        plan_start[c + 1] += plan_start[c];
+        fill[c] = plan_start[c];
+    }
+    
+    plan = kvmalloc_array(max(total, 1U), sizeof(*plan), GFP_KERNEL);
+    if (!plan) {
+        return NULL;
+    }
+    
+    sort_r(order, num_slots, sizeof(order[0]), flexray_cmp_slot, NULL, slots);
+    for (i = 0; i < num_slots; i++) {
+        const struct flexray_slot *s = &slots[order[i]];
+    
+        for (c = s->base_cycle; c < FLEXRAY_CYCLES; c += s->repetition) {
+            plan[fill[c]++] = order[i];
+        }
+    }
+    return plan;
+}
+
+/**
+ * Take the cluster parameters and the offline slot table, and configure
+ * the controller's message buffers from it. Not while running.
+ */
+int flexray_configure(const struct flexray_cluster *cluster, const struct flexray_slot *slots, u32 num_slots)
+{
+    struct flexray_message *messages;
+    u16 *plan;
+    u32 i, j;
+    int ret;
+    
+    if (!cluster || !slots || !num_slots || num_slots > FLEXRAY_MAX_MESSAGES ||
+        !cluster->cycle_ns || cluster->nit_offset_ns >= cluster->cycle_ns) {
+        pr_err("flexray: Invalid cluster configuration\n");
+        return -EINVAL;
+    }
+    for (i = 0; i < num_slots; i++) {
+        if (!flexray_slot_valid(&slots[i])) {
+            pr_err("flexray: Invalid slot table row %u\n", i);
+            return -EINVAL;
+        }
+        for (j = 0; j < i; j++) {
+            if (flexray_slots_collide(&slots[i], &slots[j])) {
+                pr_err("flexray: Rows %u and %u both send in slot %u\n", j, i, slots[i].slot_id);
+                return -EINVAL;
+            }
+        }
+    }
+    
+    messages = kvcalloc(num_slots, sizeof(*messages), GFP_KERNEL);
+    if (!messages) {
+        return -ENOMEM;
+    }
+    for (i = 0; i < num_slots; i++) {
+        messages[i].slot = slots[i];
+        spin_lock_init(&messages[i].write_lock);
+    }
+    
+    mutex_lock(&flexray_cc.cfg_lock);
+    if (!flexray_cc.ops || flexray_cc.running) {
+        ret = flexray_cc.ops ? -EBUSY : -ENODEV;
+        goto err;
+    }
+    
+    plan = flexray_build_plan(slots, num_slots, flexray_cc.plan_start);
+    if (!plan) {
+        ret = -ENOMEM;
+        goto err;
+    }
+    
+    ret = flexray_cc.ops->configure(flexray_cc.ctx, cluster, slots, num_slots);
+    if (ret) {
+        kvfree(plan);
+        goto err;
+    }
+    
+    kvfree(flexray_cc.plan);
+    kvfree(flexray_cc.messages);
+    flexray_cc.plan = plan;
+    flexray_cc.messages = messages;
+    flexray_cc.num_messages = num_slots;
+    flexray_cc.cluster = *cluster;
+    mutex_unlock(&flexray_cc.cfg_lock);
+    
+    pr_info("flexray: %u messages, %u plan entries per 64 cycles, cycle %u us\n", num_slots,
+            flexray_cc.plan_start[FLEXRAY_CYCLES], cluster->cycle_ns / 1000);
+    return 0;
+    
+err:
+    mutex_unlock(&flexray_cc.cfg_lock);
+    kvfree(messages);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(flexray_configure);
+
+// Everything cycle touches, in the NIT after its dynamic segment
+static void flexray_cycle(u8 cycle)
+{
+    const struct flexray_cc_ops *ops = flexray_cc.ops;
+    u8 next = (cycle + 1) & (FLEXRAY_CYCLES - 1);
+    u8 data[FLEXRAY_MAX_PAYLOAD], len;
+    u32 i, gen;
+    
+    // Frames this cycle received
+    for (i = flexray_cc.plan_start[cycle]; i < flexray_cc.plan_start[cycle + 1]; i++) {
+        struct flexray_message *m = &flexray_cc.messages[flexray_cc.plan[i]];
+    
+        if (m->slot.direction == FLEXRAY_RX && ops->read(flexray_cc.ctx, m->slot.buffer, data, &len) > 0) {
+            flexray_buf_put(&m->buf, data, min_t(u8, len, m->slot.payload_len));
+            flexray_cc.received++;
+        }
+    }
+    
+    // Buffers the next cycle sends, where the application wrote something new
+    for (i = flexray_cc.plan_start[next]; i < flexray_cc.plan_start[next + 1]; i++) {
+        struct flexray_message *m = &flexray_cc.messages[flexray_cc.plan[i]];
+    
+        if (m->slot.direction != FLEXRAY_TX || (smp_load_acquire(&m->buf.gen) & ~1U) == m->staged_gen) {
+            continue;
+        }
+        if (!flexray_buf_get(&m->buf, data, &len, &gen)) {
+            flexray_cc.torn++;
+            continue;
+        }
+        if (!ops->write(flexray_cc.ctx, m->slot.buffer, data, len)) {
+            m->staged_gen = gen;
+            flexray_cc.staged++;
+        }
+    }
+}
+
+/*
+ * Once per cycle in the network idle time. The wakeup is placed from
+ * the controller's cycle position read on entry, not from the timer's
+ * own period, so it follows the cluster's clock.
+ */
+static enum hrtimer_restart flexray_timer(struct hrtimer *timer)
+{
+    const struct flexray_cc_ops *ops = flexray_cc.ops;
+    u32 cycle_ns = flexray_cc.cluster.cycle_ns;
+    u32 nit = flexray_cc.cluster.nit_offset_ns;
+    ktime_t t0 = ktime_get();
+    u32 offset, offset_now;
+    u8 cycle, cycle_now;
+    
+    if (ops->position(flexray_cc.ctx, &cycle, &offset)) {
+        // Out of sync with the cluster: look again a cycle later
+        hrtimer_set_expires(timer, ktime_add_ns(t0, cycle_ns));
+        return HRTIMER_RESTART;
+    }
+    
+    if (offset + FLEXRAY_EARLY_NS < nit) {
+        hrtimer_set_expires(timer, ktime_add_ns(t0, nit - offset));
+        return HRTIMER_RESTART;
+    }
+    
+    if (cycle != flexray_cc.expected_cycle && flexray_cc.cycles) {
+        flexray_cc.missed_cycles++;
+    }
+    flexray_cycle(cycle);
+    flexray_cc.cycles++;
+    flexray_cc.expected_cycle = (cycle + 1) & (FLEXRAY_CYCLES - 1);
+    
+    if (!ops->position(flexray_cc.ctx, &cycle_now, &offset_now) && cycle_now != cycle) {
+        flexray_cc.late++;
+    }
+    
+    hrtimer_set_expires(timer, ktime_add_ns(t0, cycle_ns - offset + nit));
+    return HRTIMER_RESTART;
+}
+
+/**
+ * Join the cluster and start the cycle processing
+ */
+int flexray_start(void)
+{
+    int ret;
+    
+    mutex_lock(&flexray_cc.cfg_lock);
+    if (!flexray_cc.ops || !flexray_cc.messages) {
+        ret = -ENODEV;
+        goto out;
+    }
+    if (flexray_cc.running) {
+        ret = -EBUSY;
+        goto out;
+    }
+    
+    ret = flexray_cc.ops->start(flexray_cc.ctx);
+    if (ret) {
+        pr_err("flexray: Controller failed to start: %d\n", ret);
+        goto out;
+    }
+    
+    flexray_cc.running = true;
+    hrtimer_start(&flexray_cc.timer, 0, HRTIMER_MODE_REL_HARD);
+    
+out:
+    mutex_unlock(&flexray_cc.cfg_lock);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(flexray_start);
+
+/**
+ * Update a transmit message; the engine stages it for the next cycle
+ * that carries it. Shorter payloads are padded with zeros.
+ */
+int flexray_write(u32 message, const u8 *data, u8 len)
+{
+    u8 frame[FLEXRAY_MAX_PAYLOAD];
+    struct flexray_message *m;
+    
+    if (message >= READ_ONCE(flexray_cc.num_messages) || !data) {
+        return -EINVAL;
+    }
+    m = &flexray_cc.messages[message];
+    if (m->slot.direction != FLEXRAY_TX || len > m->slot.payload_len) {
+        return -EINVAL;
+    }
+    
+    memcpy(frame, data, len);
+    memset(frame + len, 0, m->slot.payload_len - len);
+    
+    spin_lock_bh(&m->write_lock);
+    flexray_buf_put(&m->buf, frame, m->slot.payload_len);
+    spin_unlock_bh(&m->write_lock);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(flexray_write);
+
+/**
+ * Latest payload of a receive message, -EAGAIN if none has come in
+ */
+int flexray_read(u32 message, u8 *data, u8 *len)
+{
+    struct flexray_message *m;
+    u32 gen;
+    
+    if (message >= READ_ONCE(flexray_cc.num_messages) || !data || !len) {
+        return -EINVAL;
+    }
+    m = &flexray_cc.messages[message];
+    if (m->slot.direction != FLEXRAY_RX) {
+        return -EINVAL;
+    }
+    
+    // The engine writes once per cycle; losing twice in a row means a copy that took a cycle
+    while (!flexray_buf_get(&m->buf, data, len, &gen)) {
+        cpu_relax();
+    }
+    return gen ? 0 : -EAGAIN;
+}
+EXPORT_SYMBOL_GPL(flexray_read);
 
 static int __init flexray_init(void)
 {
-    pr_info("flexray: Initializing\n");
+    pr_info("flexray: Initializing v%s\n", FLEXRAY_VERSION);
+    
+    mutex_init(&flexray_cc.cfg_lock);
+    hrtimer_init(&flexray_cc.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_HARD);
+    flexray_cc.timer.function = flexray_timer;
     return 0;
 }
 
 static void __exit flexray_exit(void)
 {
-    pr_info("flexray: Exiting\n");
+    hrtimer_cancel(&flexray_cc.timer);
+    kvfree(flexray_cc.plan);
+    kvfree(flexray_cc.messages);
+    
+    pr_info("flexray: Exiting: %u cycles, %u missed, %u late, %u torn\n", flexray_cc.cycles,
+            flexray_cc.missed_cycles, flexray_cc.late, flexray_cc.torn);
 }
 
 module_init(flexray_init);
@@ -28,4 +454,4 @@ module_exit(flexray_exit);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("jk1806");
 MODULE_DESCRIPTION("FlexRay Protocol");
-MODULE_VERSION(MODULE_VERSION);
+MODULE_VERSION(FLEXRAY_VERSION);
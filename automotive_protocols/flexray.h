@@ -0,0 +1,65 @@
+/**
+ * FlexRay communication controller
+ *
+ * Schedule engine in flexray.c over a communication controller (E-Ray
+ * or similar) reached through the ops its glue registers. The slot
+ * table is built offline from the cluster description and handed over
+ * once; from it every one of the 64 cycles gets a precomputed list of
+ * the buffers it touches. Once per cycle, in the network idle time, the
+ * engine collects what the cycle received and stages what the next one
+ * sends. Nothing happens per slot, so the static segment runs without a
+ * single interrupt. Every message has a double buffer between the engine
+ * and the application, so neither side ever waits for the other.
+ */
+
+#ifndef FLEXRAY_H
+#define FLEXRAY_H
+
+#include <linux/types.h>
+
+#define FLEXRAY_MAX_MESSAGES 128
+#define FLEXRAY_MAX_PAYLOAD 254
+#define FLEXRAY_CYCLES 64
+
+// flexray_slot channels
+#define FLEXRAY_CHANNEL_A 0x01
+#define FLEXRAY_CHANNEL_B 0x02
+
+enum flexray_direction {
+    FLEXRAY_TX,
+    FLEXRAY_RX
+};
+
+struct flexray_cluster {
+    u32 cycle_ns;                           // gdCycle
+    u16 static_slots;                       // gNumberOfStaticSlots; higher IDs are dynamic
+    u32 nit_offset_ns;                      // network idle time starts this far into the cycle
+};
+
+// One row of the offline slot table; its index is the message number
+struct flexray_slot {
+    u16 slot_id;
+    u8 base_cycle;
+    u8 repetition;                          // 1, 2, 4 ... 64
+    u8 channels;
+    enum flexray_direction direction;
+    u8 payload_len;                         // bytes, even
+    u16 buffer;                             // controller message buffer
+};
+
+struct flexray_cc_ops {
+    int (*configure)(void *ctx, const struct flexray_cluster *cluster, const struct flexray_slot *slots,
+                     u32 num_slots);
+    int (*start)(void *ctx);                // startup or integration into the cluster
+    int (*position)(void *ctx, u8 *cycle, u32 *offset_ns);
+    int (*write)(void *ctx, u16 buffer, const u8 *data, u8 len);
+    int (*read)(void *ctx, u16 buffer, u8 *data, u8 *len);     // 1 if a frame came in, else 0
+};
+
+int flexray_register_controller(const struct flexray_cc_ops *ops, void *ctx);
+int flexray_configure(const struct flexray_cluster *cluster, const struct flexray_slot *slots, u32 num_slots);
+int flexray_start(void);
+int flexray_write(u32 message, const u8 *data, u8 len);
+int flexray_read(u32 message, u8 *data, u8 *len);
+
+#endif /* FLEXRAY_H */
@@ -0,0 +1,735 @@
+/**
+ * gPTP Implementation
+ * Author: jk1806
+ * Created: 2024-12-12
+ * 
+ * 802.1AS time-aware end station on one port, automotive profile: the
+ * role is configured rather than elected, so there is no Announce and
+ * no BMCA. Event messages (Sync, Pdelay_Req, Pdelay_Resp) are
+ * timestamped by the NIC as they cross the MII, on transmit through the
+ * socket's error queue, and the interface refuses to start without
+ * that: software timestamps carry tens of microseconds of scheduling
+ * jitter. A follower takes the grandmaster's time from Sync/Follow_Up
+ * less the link delay Pdelay measures and steers its PHC with a PI
+ * servo, stepping it when it is too far off to slew.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/netdevice.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <linux/rtnetlink.h>
+#include <linux/socket.h>
+#include <linux/sockptr.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/delay.h>
+#include <linux/math64.h>
+#include <linux/timekeeping.h>
+#include <net/sock.h>
+#include <asm/unaligned.h>
+
+#include "gptp.h"
+
+#define GPTP_VERSION "1.0.0"
+
+#define GPTP_DOMAIN 0
+#define GPTP_HEADER_LEN 34
+#define GPTP_SYNC_LEN 44
+#define GPTP_FOLLOW_UP_LEN 76               // with the Follow_Up information TLV
+#define GPTP_PDELAY_LEN 54                  // Pdelay_Req, _Resp and _Resp_Follow_Up
+#define GPTP_BUF_LEN 128
+#define GPTP_CONTROL_LEN 128                // timestamping and extended error cmsgs
+#define GPTP_SYNC_INTERVAL_MS 125
+#define GPTP_SYNC_LOG_INTERVAL (-3)
+#define GPTP_PDELAY_INTERVAL_MS 1000
+#define GPTP_PDELAY_LOG_INTERVAL 0
+#define GPTP_SYNC_RECEIPT_TIMEOUT 3         // Sync intervals
+#define GPTP_ALLOWED_LOST_RESPONSES 3
+#define GPTP_NEIGHBOR_PROP_DELAY_THRESH 800 // ns, copper
+#define GPTP_STEP_NS 1000000                // further off than this the PHC is stepped
+#define GPTP_LOCK_NS 500
+#define GPTP_LOCK_SAMPLES 4
+#define GPTP_MAX_PPB 500000
+#define GPTP_TX_TS_TIMEOUT_US 10000
+#define GPTP_RX_POLL_MS 100                 // receive timeout, to notice unloading
+
+// Message types
+#define GPTP_SYNC 0x0
+#define GPTP_PDELAY_REQ 0x2
+#define GPTP_PDELAY_RESP 0x3
+#define GPTP_FOLLOW_UP 0x8
+#define GPTP_PDELAY_RESP_FOLLOW_UP 0xA
+
+// Header flags
+#define GPTP_FLAG_TWO_STEP 0x0200
+#define GPTP_FLAG_PTP_TIMESCALE 0x0008
+
+// gptp_pdelay have
+#define GPTP_PD_T1 BIT(0)
+#define GPTP_PD_T2 BIT(1)                   // with t4, from the Pdelay_Resp
+#define GPTP_PD_T3 BIT(2)
+#define GPTP_PD_ALL (GPTP_PD_T1 | GPTP_PD_T2 | GPTP_PD_T3)
+
+static char *ifname;
+module_param(ifname, charp, 0444);
+MODULE_PARM_DESC(ifname, "Interface to run gPTP on");
+
+static bool grandmaster;
+module_param(grandmaster, bool, 0444);
+MODULE_PARM_DESC(grandmaster, "Be the grandmaster instead of following one");
+
+static const u8 gptp_dst[ETH_ALEN] = { 0x01, 0x80, 0xC2, 0x00, 0x00, 0x0E };
+
+/*
+ * One Pdelay exchange as initiator. Its timestamps come in from the
+ * Pdelay work (t1) and the receive work (the rest) in either order.
+ */
+struct gptp_pdelay {
+    u16 seq;
+    u8 have;
+    bool pending;                       // request sent, answer not complete
+    u32 missed;                         // exchanges in a row left incomplete
+    u64 t1, t2, t3, t4;
+};
+
+struct gptp_port {
+    struct net_device *dev;
+    struct socket *sock;
+    u8 port_id[10];                     // clock identity and port number 1
+    struct mutex tx_lock;               // a send and its TX timestamp
+    spinlock_t lock;                    // pdelay, link delay
+    bool stopping;
+    
+    struct gptp_pdelay pd;
+    u16 pdelay_seq;
+    u32 link_delay;                     // ns, averaged
+    bool as_capable;
+    
+    // Following
+    u16 rx_sync_seq;
+    u8 sync_source[10];
+    u64 sync_rx;
+    bool sync_valid;
+    bool servo_started;
+    s64 drift_ppb;
+    s64 offset;                         // PHC minus grandmaster at the last Sync
+    u32 good;
+    bool locked;
+    unsigned long last_sync;
+    
+    // Grandmaster
+    u16 tx_sync_seq;
+    
+    u32 syncs;
+    u32 steps;
+};
+
+static struct gptp_port gptp;
+static struct workqueue_struct *gptp_wq;
+static struct work_struct gptp_rx_work;
+static struct delayed_work gptp_sync_work;
+static struct delayed_work gptp_pdelay_work;
+
+static const struct gptp_phc_ops *gptp_phc;
+static void *gptp_phc_ctx;
+
+/**
+ * Use the NIC's PHC: the clock the hardware timestamps are taken from.
+ * gettime must not sleep, gptp_now() is called from softirq context.
+ */
+int gptp_register_phc(const struct gptp_phc_ops *ops, void *ctx)
+{
+    if (!ops || !ops->gettime || !ops->adjfine || !ops->adjtime) {
+        return -EINVAL;
+    }
+    
+    gptp_phc_ctx = ctx;
+    // The grandmaster hands its PHC out as TAI, so start it there
+    if (grandmaster) {
+        ops->adjtime(ctx, ktime_get_clocktai_ns() - ops->gettime(ctx));
+    }
+    smp_store_release(&gptp_phc, ops);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(gptp_register_phc);
+
+/**
+ * gPTP time in ns: the PHC, or CLOCK_TAI before one is registered
+ */
+u64 gptp_now(void)
+{
+    const struct gptp_phc_ops *ops = smp_load_acquire(&gptp_phc);
+    
+    return ops ? ops->gettime(gptp_phc_ctx) : ktime_get_clocktai_ns();
+}
+EXPORT_SYMBOL_GPL(gptp_now);
+
+/**
+ * Whether gptp_now() is the grandmaster's time to within the servo's
+ * lock threshold
+ */
+bool gptp_synced(void)
+{
+    if (!smp_load_acquire(&gptp_phc)) {
+        return false;
+    }
+    if (grandmaster) {
+        return true;
+    }
+    return READ_ONCE(gptp.locked) &&
+           time_before(jiffies, READ_ONCE(gptp.last_sync) +
+                       msecs_to_jiffies(GPTP_SYNC_RECEIPT_TIMEOUT * GPTP_SYNC_INTERVAL_MS));
+}
+EXPORT_SYMBOL_GPL(gptp_synced);
+
+static void gptp_put_timestamp(u8 *p, u64 ns)
+{
+    u32 rem;
+    u64 sec = div_u64_rem(ns, NSEC_PER_SEC, &rem);
+    
+    put_unaligned_be16(sec >> 32, p);
+    put_unaligned_be32((u32)sec, p + 2);
+    put_unaligned_be32(rem, p + 6);
+}
+
+static u64 gptp_get_timestamp(const u8 *p)
+{
+    u64 sec = ((u64)get_unaligned_be16(p) << 32) | get_unaligned_be32(p + 2);
+    
+    return sec * NSEC_PER_SEC + get_unaligned_be32(p + 6);
+}
+
+// correctionField is ns scaled by 2^16
+static s64 gptp_correction(const u8 *msg)
+{
+    return (s64)get_unaligned_be64(msg + 8) >> 16;
+}
+
+static void gptp_header(u8 *msg, u8 type, u16 len, u16 flags, u16 seq, u8 control, s8 log_interval)
+{
+    memset(msg, 0, len);
+    msg[0] = 0x10 | type;               // majorSdoId 1: gPTP
+    msg[1] = 2;                         // versionPTP
+    put_unaligned_be16(len, msg + 2);
+    msg[4] = GPTP_DOMAIN;
+    put_unaligned_be16(flags | GPTP_FLAG_PTP_TIMESCALE, msg + 6);
+    memcpy(msg + 20, gptp.port_id, sizeof(gptp.port_id));
+    put_unaligned_be16(seq, msg + 30);
+    msg[32] = control;
+    msg[33] = log_interval;
+}
+
+/*
+ * Receive one frame, normal or from the error queue, and the hardware
+ * timestamp that came with it (0 if none did)
+ */
+static int gptp_recv(u8 *buf, size_t len, int flags, u64 *hwts)
+{
+    u8 control[GPTP_CONTROL_LEN];
+    struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+    struct kvec vec = { buf, len };
+    struct cmsghdr *cmsg;
+    int ret;
+    
+    ret = kernel_recvmsg(gptp.sock, &msg, &vec, 1, len, flags);
+    if (ret < 0) {
+        return ret;
+    }
+    
+    // put_cmsg() moved msg_control along; walk what it wrote
+    *hwts = 0;
+    msg.msg_controllen = sizeof(control) - msg.msg_controllen;
+    msg.msg_control = control;
+    for_each_cmsghdr(cmsg, &msg) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING_NEW) {
+            struct scm_timestamping64 *tss = (struct scm_timestamping64 *)CMSG_DATA(cmsg);
+    
+            *hwts = (u64)tss->ts[2].tv_sec * NSEC_PER_SEC + tss->ts[2].tv_nsec;
+        }
+    }
+    return ret;
+}
+
+/*
+ * Wait for the NIC's transmit timestamp of message type/seq. Frames
+ * sent earlier whose timestamps nobody waited for are passed over.
+ */
+static int gptp_tx_timestamp(u8 type, u16 seq, u64 *ts)
+{
+    ktime_t deadline = ktime_add_us(ktime_get(), GPTP_TX_TS_TIMEOUT_US);
+    u8 buf[GPTP_BUF_LEN];
+    int ret;
+    
+    do {
+        ret = gptp_recv(buf, sizeof(buf), MSG_ERRQUEUE | MSG_DONTWAIT, ts);
+        if (ret == -EAGAIN) {
+            usleep_range(50, 100);
+            continue;
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        if (ret >= ETH_HLEN + GPTP_HEADER_LEN && (buf[ETH_HLEN] & 0x0F) == type &&
+            get_unaligned_be16(buf + ETH_HLEN + 30) == seq && *ts) {
+            return 0;
+        }
+    } while (ktime_before(ktime_get(), deadline));
+    
+    pr_warn("gptp: No transmit timestamp for message 0x%x, seq %u\n", type, seq);
+    return -ETIMEDOUT;
+}
+
+/*
+ * Send the message after the Ethernet header of frame; with tx_ts, wait
+ * for its transmit timestamp too. Under tx_lock.
+ */
+static int gptp_send(u8 *frame, size_t len, u64 *tx_ts)
+{
+    struct ethhdr *eth = (struct ethhdr *)frame;
+    struct msghdr msg = { .msg_flags = MSG_DONTWAIT };
+    struct kvec vec = { frame, len };
+    int ret;
+    
+    memcpy(eth->h_dest, gptp_dst, ETH_ALEN);
+    memcpy(eth->h_source, gptp.dev->dev_addr, ETH_ALEN);
+    eth->h_proto = htons(ETH_P_1588);
+    
+    ret = kernel_sendmsg(gptp.sock, &msg, &vec, 1, len);
+    if (ret < 0) {
+        return ret;
+    }
+    if (!tx_ts) {
+        return 0;
+    }
+    return gptp_tx_timestamp(frame[ETH_HLEN] & 0x0F, get_unaligned_be16(frame + ETH_HLEN + 30), tx_ts);
+}
+
+/*
+ * PI servo on one offset sample. Offsets beyond GPTP_STEP_NS, and the
+ * first one, step the PHC; anything else trims its frequency.
+ */
+static void gptp_servo(s64 offset)
+{
+    const struct gptp_phc_ops *ops = smp_load_acquire(&gptp_phc);
+    s64 ppb;
+    
+    if (!ops) {
+        return;
+    }
+    
+    if (!gptp.servo_started || abs(offset) > GPTP_STEP_NS) {
+        ops->adjtime(gptp_phc_ctx, -offset);
+        gptp.servo_started = true;
+        gptp.steps++;
+        gptp.good = 0;
+        WRITE_ONCE(gptp.locked, false);
+    
+        // An exchange spanning the step would measure the step too
+        spin_lock(&gptp.lock);
+        gptp.pd.pending = false;
+        spin_unlock(&gptp.lock);
+        return;
+    }
+    
+    gptp.drift_ppb = clamp_t(s64, gptp.drift_ppb + div_s64(offset * 3, 10), -GPTP_MAX_PPB, GPTP_MAX_PPB);
+    ppb = clamp_t(s64, -(div_s64(offset * 7, 10) + gptp.drift_ppb), -GPTP_MAX_PPB, GPTP_MAX_PPB);
+    ops->adjfine(gptp_phc_ctx, (long)div_s64(ppb << 13, 125));     // ppb to ppm * 2^16
+    
+    if (abs(offset) > GPTP_LOCK_NS) {
+        if (gptp.locked) {
+            pr_warn("gptp: Lost lock, offset %lld ns\n", offset);
+        }
+        gptp.good = 0;
+        WRITE_ONCE(gptp.locked, false);
+    } else if (!gptp.locked && ++gptp.good >= GPTP_LOCK_SAMPLES) {
+        pr_info("gptp: Locked to grandmaster, offset %lld ns, link delay %u ns\n", offset, gptp.link_delay);
+        WRITE_ONCE(gptp.locked, true);
+    }
+}
+
+// Under gptp.lock: fold a complete exchange into the link delay
+static void gptp_pdelay_done(struct gptp_pdelay *pd)
+{
+    s64 delay;
+    
+    if (!pd->pending || pd->have != GPTP_PD_ALL) {
+        return;
+    }
+    pd->pending = false;
+    pd->missed = 0;
+    
+    delay = ((s64)(pd->t4 - pd->t1) - (s64)(pd->t3 - pd->t2)) / 2;
+    if (delay < 0) {
+        return;
+    }
+    gptp.link_delay = gptp.as_capable ? (gptp.link_delay * 7 + (u32)delay) / 8 : (u32)delay;
+    gptp.as_capable = gptp.link_delay <= GPTP_NEIGHBOR_PROP_DELAY_THRESH;
+}
+
+// Answer a neighbour's Pdelay_Req received at t2
+static void gptp_pdelay_respond(const u8 *req, u64 t2)
+{
+    u8 frame[ETH_HLEN + GPTP_PDELAY_LEN];
+    u8 *msg = frame + ETH_HLEN;
+    u16 seq = get_unaligned_be16(req + 30);
+    u64 t3;
+    
+    mutex_lock(&gptp.tx_lock);
+    gptp_header(msg, GPTP_PDELAY_RESP, GPTP_PDELAY_LEN, GPTP_FLAG_TWO_STEP, seq, 5, 0x7F);
+    gptp_put_timestamp(msg + 34, t2);
+    memcpy(msg + 44, req + 20, 10);
+    if (!gptp_send(frame, sizeof(frame), &t3)) {
+        gptp_header(msg, GPTP_PDELAY_RESP_FOLLOW_UP, GPTP_PDELAY_LEN, 0, seq, 5, 0x7F);
+        gptp_put_timestamp(msg + 34, t3);
+        memcpy(msg + 44, req + 20, 10);
+        gptp_send(frame, sizeof(frame), NULL);
+    }
+    mutex_unlock(&gptp.tx_lock);
+}
+
+// Our Pdelay exchange: the answer to the request in flight, for us
+static bool gptp_pdelay_ours(const u8 *msg)
+{
+    return gptp.pd.pending && get_unaligned_be16(msg + 30) == gptp.pd.seq &&
+           !memcmp(msg + 44, gptp.port_id, sizeof(gptp.port_id));
+}
+
+// Follow_Up for the Sync last received: the grandmaster's time at sync_rx
+static void gptp_follow_up(const u8 *msg)
+{
+    u64 t1;
+    s64 offset;
+    bool as_capable;
+    u32 delay;
+    
+    if (!gptp.sync_valid || get_unaligned_be16(msg + 30) != gptp.rx_sync_seq ||
+        memcmp(msg + 20, gptp.sync_source, sizeof(gptp.sync_source))) {
+        return;
+    }
+    gptp.sync_valid = false;
+    
+    spin_lock(&gptp.lock);
+    as_capable = gptp.as_capable;
+    delay = gptp.link_delay;
+    spin_unlock(&gptp.lock);
+    if (!as_capable) {
+        return;
+    }
+    
+    t1 = gptp_get_timestamp(msg + 34) + gptp_correction(msg);
+    offset = (s64)(gptp.sync_rx - t1) - delay;
+    
+    gptp.syncs++;
+    WRITE_ONCE(gptp.offset, offset);
+    WRITE_ONCE(gptp.last_sync, jiffies);
+    gptp_servo(offset);
+}
+
+static void gptp_input(const u8 *msg, int len, u64 hwts)
+{
+    u16 msg_len;
+    u8 type;
+    
+    if ((msg[0] >> 4) != 1 || (msg[1] & 0x0F) != 2 || msg[4] != GPTP_DOMAIN) {
+        return;
+    }
+    msg_len = get_unaligned_be16(msg + 2);
+    if (msg_len > len) {
+        return;
+    }
+    type = msg[0] & 0x0F;
+    
+    switch (type) {
+    case GPTP_SYNC:
+        if (grandmaster || msg_len < GPTP_SYNC_LEN || !hwts) {
+            break;
+        }
+        gptp.rx_sync_seq = get_unaligned_be16(msg + 30);
+        memcpy(gptp.sync_source, msg + 20, sizeof(gptp.sync_source));
+        gptp.sync_rx = hwts;
+        gptp.sync_valid = true;
+        break;
+    
+    case GPTP_FOLLOW_UP:
+        if (!grandmaster && msg_len >= GPTP_SYNC_LEN) {
+            gptp_follow_up(msg);
+        }
+        break;
+    
+    case GPTP_PDELAY_REQ:
+        if (msg_len >= GPTP_PDELAY_LEN && hwts) {
+            gptp_pdelay_respond(msg, hwts);
+        }
+        break;
+    
+    case GPTP_PDELAY_RESP:
+        if (msg_len < GPTP_PDELAY_LEN || !hwts) {
+            break;
+        }
+        spin_lock(&gptp.lock);
+        if (gptp_pdelay_ours(msg)) {
+            gptp.pd.t2 = gptp_get_timestamp(msg + 34);
+            gptp.pd.t4 = hwts;
+            gptp.pd.have |= GPTP_PD_T2;
+            gptp_pdelay_done(&gptp.pd);
+        }
+        spin_unlock(&gptp.lock);
+        break;
+    
+    case GPTP_PDELAY_RESP_FOLLOW_UP:
+        if (msg_len < GPTP_PDELAY_LEN) {
+            break;
+        }
+        spin_lock(&gptp.lock);
+        if (gptp_pdelay_ours(msg)) {
+            gptp.pd.t3 = gptp_get_timestamp(msg + 34) + gptp_correction(msg);
+            gptp.pd.have |= GPTP_PD_T3;
+            gptp_pdelay_done(&gptp.pd);
+        }
+        spin_unlock(&gptp.lock);
+        break;
+    
+    default:
+        break;
+    }
+}
+
+static void gptp_rx_work_fn(struct work_struct *work)
+{
+    u8 buf[GPTP_BUF_LEN];
+    u64 hwts;
+    int len;
+    
+    while (!READ_ONCE(gptp.stopping)) {
+        len = gptp_recv(buf, sizeof(buf), 0, &hwts);
+        if (len == -EAGAIN || len == -EINTR) {
+            continue;
+        }
+        if (len < 0) {
+            pr_err("gptp: Receive failed: %d\n", len);
+            break;
+        }
+        if (len >= ETH_HLEN + GPTP_HEADER_LEN) {
+            gptp_input(buf + ETH_HLEN, len - ETH_HLEN, hwts);
+        }
+    }
+}
+
+// Grandmaster: two-step Sync, the Follow_Up carrying its transmit time
+static void gptp_sync_work_fn(struct work_struct *work)
+{
+    u8 frame[ETH_HLEN + GPTP_FOLLOW_UP_LEN];
+    u8 *msg = frame + ETH_HLEN;
+    u16 seq = gptp.tx_sync_seq++;
+    u64 t1;
+    
+    mutex_lock(&gptp.tx_lock);
+    gptp_header(msg, GPTP_SYNC, GPTP_SYNC_LEN, GPTP_FLAG_TWO_STEP, seq, 0, GPTP_SYNC_LOG_INTERVAL);
+    if (!gptp_send(frame, ETH_HLEN + GPTP_SYNC_LEN, &t1)) {
+        gptp_header(msg, GPTP_FOLLOW_UP, GPTP_FOLLOW_UP_LEN, 0, seq, 2, GPTP_SYNC_LOG_INTERVAL);
+        gptp_put_timestamp(msg + 34, t1);
+    
+        // Follow_Up information TLV; we are the grandmaster, rate offset 0
+        put_unaligned_be16(0x0003, msg + 44);
+        put_unaligned_be16(28, msg + 46);
+        msg[48] = 0x00;
+        msg[49] = 0x80;
+        msg[50] = 0xC2;
+        msg[53] = 0x01;
+        gptp_send(frame, ETH_HLEN + GPTP_FOLLOW_UP_LEN, NULL);
+        gptp.syncs++;
+    }
+    mutex_unlock(&gptp.tx_lock);
+    
+    if (!READ_ONCE(gptp.stopping)) {
+        queue_delayed_work(gptp_wq, &gptp_sync_work, msecs_to_jiffies(GPTP_SYNC_INTERVAL_MS));
+    }
+}
+
+// Measure the link delay to our neighbour, whichever role we have
+static void gptp_pdelay_work_fn(struct work_struct *work)
+{
+    u8 frame[ETH_HLEN + GPTP_PDELAY_LEN];
+    u8 *msg = frame + ETH_HLEN;
+    u16 seq = gptp.pdelay_seq++;
+    u64 t1;
+    
+    spin_lock(&gptp.lock);
+    if (gptp.pd.pending && ++gptp.pd.missed > GPTP_ALLOWED_LOST_RESPONSES && gptp.as_capable) {
+        pr_warn("gptp: No Pdelay responses from the neighbour\n");
+        gptp.as_capable = false;
+    }
+    gptp.pd.seq = seq;
+    gptp.pd.have = 0;
+    gptp.pd.pending = true;
+    spin_unlock(&gptp.lock);
+    
+    mutex_lock(&gptp.tx_lock);
+    gptp_header(msg, GPTP_PDELAY_REQ, GPTP_PDELAY_LEN, 0, seq, 5, GPTP_PDELAY_LOG_INTERVAL);
+    if (!gptp_send(frame, sizeof(frame), &t1)) {
+        spin_lock(&gptp.lock);
+        if (gptp.pd.pending && gptp.pd.seq == seq) {
+            gptp.pd.t1 = t1;
+            gptp.pd.have |= GPTP_PD_T1;
+            gptp_pdelay_done(&gptp.pd);
+        }
+        spin_unlock(&gptp.lock);
+    }
+    mutex_unlock(&gptp.tx_lock);
+    
+    if (!READ_ONCE(gptp.stopping)) {
+        queue_delayed_work(gptp_wq, &gptp_pdelay_work, msecs_to_jiffies(GPTP_PDELAY_INTERVAL_MS));
+    }
+}
+
+static int gptp_hwtstamp(bool on)
+{
+    struct kernel_hwtstamp_config cfg = {
+        .tx_type = on ? HWTSTAMP_TX_ON : HWTSTAMP_TX_OFF,
+        .rx_filter = on ? HWTSTAMP_FILTER_PTP_V2_L2_EVENT : HWTSTAMP_FILTER_NONE,
+    };
+    int ret = -EOPNOTSUPP;
+    
+    rtnl_lock();
+    if (gptp.dev->netdev_ops->ndo_hwtstamp_set) {
+        ret = gptp.dev->netdev_ops->ndo_hwtstamp_set(gptp.dev, &cfg, NULL);
+    }
+    rtnl_unlock();
+    return ret;
+}
+
+static int gptp_open_socket(void)
+{
+    int flags = SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+    struct sockaddr_ll addr = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(ETH_P_1588),
+        .sll_ifindex = gptp.dev->ifindex,
+    };
+    struct packet_mreq mreq = {
+        .mr_ifindex = gptp.dev->ifindex,
+        .mr_type = PACKET_MR_MULTICAST,
+        .mr_alen = ETH_ALEN,
+    };
+    int ret;
+    
+    ret = sock_create_kern(&init_net, AF_PACKET, SOCK_RAW, htons(ETH_P_1588), &gptp.sock);
+    if (ret) {
+        return ret;
+    }
+    
+    memcpy(mreq.mr_address, gptp_dst, ETH_ALEN);
+    ret = kernel_bind(gptp.sock, (struct sockaddr *)&addr, sizeof(addr));
+    if (!ret) {
+        ret = gptp.sock->ops->setsockopt(gptp.sock, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                                         KERNEL_SOCKPTR(&mreq), sizeof(mreq));
+    }
+    if (!ret) {
+        ret = sock_setsockopt(gptp.sock, SOL_SOCKET, SO_TIMESTAMPING_NEW, KERNEL_SOCKPTR(&flags), sizeof(flags));
+    }
+    if (ret) {
+        sock_release(gptp.sock);
+        gptp.sock = NULL;
+        return ret;
+    }
+    gptp.sock->sk->sk_rcvtimeo = msecs_to_jiffies(GPTP_RX_POLL_MS);
+    return 0;
+}
+
+static int __init gptp_init(void)
+{
+    const u8 *mac;
+    int ret;
+    
+    pr_info("gPTP v%s loading\n", GPTP_VERSION);
+    
+    mutex_init(&gptp.tx_lock);
+    spin_lock_init(&gptp.lock);
+    
+    if (!ifname) {
+        pr_info("gptp: No interface, time stays on CLOCK_TAI\n");
+        return 0;
+    }
+    
+    gptp.dev = dev_get_by_name(&init_net, ifname);
+    if (!gptp.dev) {
+        pr_err("gptp: No interface %s\n", ifname);
+        return -ENODEV;
+    }
+    
+    // Hardware timestamps or nothing
+    ret = gptp_hwtstamp(true);
+    if (ret) {
+        pr_err("gptp: %s cannot timestamp PTP frames in hardware: %d\n", ifname, ret);
+        goto err_dev;
+    }
+    
+    // EUI-64 clock identity from the MAC address
+    mac = gptp.dev->dev_addr;
+    memcpy(gptp.port_id, mac, 3);
+    gptp.port_id[3] = 0xFF;
+    gptp.port_id[4] = 0xFE;
+    memcpy(gptp.port_id + 5, mac + 3, 3);
+    put_unaligned_be16(1, gptp.port_id + 8);
+    
+    ret = gptp_open_socket();
+    if (ret) {
+        pr_err("gptp: Cannot open PTP socket on %s: %d\n", ifname, ret);
+        goto err_hwtstamp;
+    }
+    
+    gptp_wq = alloc_workqueue("gptp", WQ_UNBOUND, 0);
+    if (!gptp_wq) {
+        ret = -ENOMEM;
+        goto err_sock;
+    }
+    INIT_WORK(&gptp_rx_work, gptp_rx_work_fn);
+    INIT_DELAYED_WORK(&gptp_sync_work, gptp_sync_work_fn);
+    INIT_DELAYED_WORK(&gptp_pdelay_work, gptp_pdelay_work_fn);
+    
+    queue_work(gptp_wq, &gptp_rx_work);
+    queue_delayed_work(gptp_wq, &gptp_pdelay_work, 0);
+    if (grandmaster) {
+        queue_delayed_work(gptp_wq, &gptp_sync_work, 0);
+    }
+    
+    pr_info("gptp: %s on %s\n", grandmaster ? "Grandmaster" : "Following", ifname);
+    return 0;
+    
+err_sock:
+    sock_release(gptp.sock);
+err_hwtstamp:
+    gptp_hwtstamp(false);
+err_dev:
+    dev_put(gptp.dev);
+    return ret;
+}
+
+static void __exit gptp_exit(void)
+{
+    if (gptp.dev) {
+        WRITE_ONCE(gptp.stopping, true);
+        cancel_delayed_work_sync(&gptp_sync_work);
+        cancel_delayed_work_sync(&gptp_pdelay_work);
+        cancel_work_sync(&gptp_rx_work);
+        destroy_workqueue(gptp_wq);
+        sock_release(gptp.sock);
+        gptp_hwtstamp(false);
+        dev_put(gptp.dev);
+    }
+    
+    pr_info("gPTP unloaded: %u syncs, %u steps\n", gptp.syncs, gptp.steps);
+}
+
+module_init(gptp_init);
+module_exit(gptp_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("jk1806");
+MODULE_DESCRIPTION("gPTP (802.1AS) Time Synchronization");
+MODULE_VERSION(GPTP_VERSION);
@@ -0,0 +1,29 @@
+/**
+ * gPTP time
+ *
+ * 802.1AS on one Ethernet port, in gptp.c, with every event message
+ * timestamped by the NIC. An end station either is the grandmaster and
+ * sends Sync from its PHC, or follows the grandmaster and steers its PHC
+ * onto it; both measure the link delay to their neighbour with Pdelay.
+ * The PHC itself is reached through the ops the NIC's glue registers
+ * with gptp_register_phc(), and gptp_now() reads it: that is the time
+ * base for TSN gates, DDS sample times and the safety watchdogs' logs.
+ * Until a PHC is registered gptp_now() is CLOCK_TAI.
+ */
+
+#ifndef GPTP_H
+#define GPTP_H
+
+#include <linux/types.h>
+
+struct gptp_phc_ops {
+    u64 (*gettime)(void *ctx);                      // PHC time, ns
+    int (*adjfine)(void *ctx, long scaled_ppm);     // as ptp_clock_info
+    int (*adjtime)(void *ctx, s64 delta_ns);
+};
+
+int gptp_register_phc(const struct gptp_phc_ops *ops, void *ctx);
+u64 gptp_now(void);
+bool gptp_synced(void);
+
+#endif /* GPTP_H */
@@ -5,6 +5,15 @@
  * 
  * Advanced ISO 26262 functional safety implementation
  * Research breakthrough: ASIL-D compliance achieved
+ *
+ * Supervision follows the AUTOSAR watchdog manager: each safety function
+ * is a supervised entity reporting checkpoints, and one supervisor pass
+ * per SUPERVISION_CYCLE_MS checks all of them for alive (enough and not
+ * too many indications per reference cycle), deadline (time between two
+ * checkpoints) and logical (allowed checkpoint order) supervision.
+ * Reporting a checkpoint takes no lock and no read-modify-write: each
+ * function reports from one context and only ever stores its own
+ * counters, which the supervisor compares with what it saw last.
  */
 
 #include <linux/module.h>
@@ -12,12 +21,19 @@
 #include <linux/init.h>
 #include <linux/errno.h>
 #include <linux/atomic.h>
-#include <linux/timer.h>
-#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/cache.h>
 
-#define ISO26262_VERSION "1.0.0"
+#include "gptp.h"
+
+#define ISO26262_VERSION "1.1.0"
 #define MAX_SAFETY_FUNCTIONS 16
+#define MAX_CHECKPOINTS 16
+#define MAX_DEADLINES 4                     // deadline supervisions per function
+#define SUPERVISION_CYCLE_MS 10
 #define SAFETY_TIMEOUT_MS 100
+#define NO_CHECKPOINT 0xFF
 #define ASIL_LEVELS 4
 
 enum asil_level {
@@ -27,15 +43,65 @@ enum asil_level {
     ASIL_D = 4
 };
 
+// Worst first, so the global status is the maximum
+enum supervision_status {
+    SUPERVISION_DEACTIVATED = 0,
+    SUPERVISION_OK = 1,
+    SUPERVISION_FAILED = 2,                 // alive supervision failing, within tolerance
+    SUPERVISION_EXPIRED = 3                 // error reaction taken
+};
+
+struct alive_supervision_config {
+    u8 checkpoint;
+    u16 expected;                           // indications per reference cycle
+    u16 min_margin;
+    u16 max_margin;
+    u16 reference_cycles;                   // supervision cycles per reference cycle
+    u8 failed_tolerance;                    // failed reference cycles before expiry
+};
+
+struct deadline_supervision_config {
+    u8 start_checkpoint;
+    u8 end_checkpoint;
+    u32 min_us;
+    u32 max_us;
+};
+
+struct deadline_supervision {
+    struct deadline_supervision_config cfg;
+    u64 start_ns;                           // reporter: 0 while not running
+    u32 violations;                         // reporter
+    u32 violations_seen;
+    u64 overdue_start;                      // start already reported overdue
+};
+
 struct safety_function {
     int function_id;
     enum asil_level asil_level;
     bool active;
     atomic_t error_count;
-    u32 timeout_ms;
-    struct timer_list safety_timer;
     void (*safety_handler)(void *data);
     void *handler_data;
+    
+    // Supervisor side
+    enum supervision_status status;
+    bool alive_enabled;
+    struct alive_supervision_config alive;
+    u32 alive_seen;
+    u16 alive_cycles;
+    u8 alive_failed;
+    bool logical_enabled;
+    u16 initial_checkpoints;
+    u16 final_checkpoints;
+    u16 successors[MAX_CHECKPOINTS];        // checkpoints allowed after each one
+    u32 logical_seen;
+    int num_deadlines;
+    
+    // Reporter side, stored by the function's own context only
+    u32 alive_count ____cacheline_aligned_in_smp;
+    u32 logical_errors;
+    u8 last_checkpoint;
+    struct deadline_supervision deadlines[MAX_DEADLINES];
 };
 
 struct iso26262_safety {
@@ -44,6 +110,8 @@ struct iso26262_safety {
     atomic_t total_errors;
     bool safety_system_active;
     enum asil_level system_asil_level;
+    enum supervision_status global_status;
+    struct hrtimer supervision_timer;
     u32 safety_metrics[ASIL_LEVELS];
 };
 
@@ -62,6 +130,7 @@ static int iso26262_safety_init(void)
     atomic_set(&global_safety_system.total_errors, 0);
     global_safety_system.safety_system_active = true;
     global_safety_system.system_asil_level = ASIL_D;
+    global_safety_system.global_status = SUPERVISION_OK;
     
     // Initialize safety functions
     for (i = 0; i < MAX_SAFETY_FUNCTIONS; i++) {
@@ -69,7 +138,8 @@ static int iso26262_safety_init(void)
         global_safety_system.functions[i].asil_level = ASIL_A;
         global_safety_system.functions[i].active = false;
         atomic_set(&global_safety_system.functions[i].error_count, 0);
-        global_safety_system.functions[i].timeout_ms = SAFETY_TIMEOUT_MS;
+        global_safety_system.functions[i].status = SUPERVISION_DEACTIVATED;
+        global_safety_system.functions[i].last_checkpoint = NO_CHECKPOINT;
         global_safety_system.functions[i].safety_handler = NULL;
         global_safety_system.functions[i].handler_data = NULL;
     }
@@ -85,12 +155,14 @@ static int iso26262_safety_init(void)
 }
 
 /**
- * Register safety function
+ * Register safety function, unsupervised until a supervision is added.
+ * The handler is the error reaction; it runs in the supervisor's softirq
+ * context and must not sleep.
  */
 static int iso26262_register_function(int function_id, enum asil_level asil_level,
-                                       u32 timeout_ms, void (*handler)(void *data), void *data)
+                                       void (*handler)(void *data), void *data)
 {
-    if (function_id >= MAX_SAFETY_FUNCTIONS || !handler) {
+    if (function_id < 0 || function_id >= MAX_SAFETY_FUNCTIONS || !handler) {
         pr_err("Invalid safety function parameters\n");
         return -EINVAL;
     }
@@ -99,52 +171,154 @@ static int iso26262_register_function(int function_id, enum asil_level asil_leve
     
     func->function_id = function_id;
     func->asil_level = asil_level;
-    func->active = true;
-    func->timeout_ms = timeout_ms;
     func->safety_handler = handler;
     func->handler_data = data;
-    
-    // Initialize safety timer
-    timer_setup(&func->safety_timer, iso26262_safety_timeout, 0);
-    mod_timer(&func->safety_timer, jiffies + msecs_to_jiffies(timeout_ms));
+    func->status = SUPERVISION_OK;
+    WRITE_ONCE(func->active, true);
     
     global_safety_system.function_count++;
     global_safety_system.safety_metrics[asil_level - 1]++;
     
-    pr_info("Safety function %d registered: ASIL-%c, timeout=%d ms\n",
-            function_id, 'A' + asil_level - 1, timeout_ms);
+    pr_info("Safety function %d registered: ASIL-%c\n", function_id, 'A' + asil_level - 1);
     
     return 0;
 }
 
+// Supervisions are set up before the function starts reporting
+static struct safety_function *iso26262_function(int function_id)
+{
+    if (function_id < 0 || function_id >= MAX_SAFETY_FUNCTIONS ||
+        !global_safety_system.functions[function_id].active) {
+        return NULL;
+    }
+    return &global_safety_system.functions[function_id];
+}
+
 /**
- * Safety timeout handler
+ * Alive supervision: cfg->checkpoint reported expected times per
+ * reference cycle, give or take the margins
  */
-static void iso26262_safety_timeout(struct timer_list *t)
+static int iso26262_supervise_alive(int function_id, const struct alive_supervision_config *cfg)
 {
-    struct safety_function *func = from_timer(func, t, safety_timer);
+    struct safety_function *func = iso26262_function(function_id);
     
-    pr_warn("Safety function %d timeout detected\n", func->function_id);
+    if (!func || !cfg || cfg->checkpoint >= MAX_CHECKPOINTS || !cfg->reference_cycles ||
+        cfg->min_margin > cfg->expected) {
+        return -EINVAL;
+    }
     
-    // Increment error count
-    atomic_inc(&func->error_count);
-    atomic_inc(&global_safety_system.total_errors);
+    func->alive = *cfg;
+    func->alive_seen = READ_ONCE(func->alive_count);
+    func->alive_cycles = 0;
+    func->alive_failed = 0;
+    WRITE_ONCE(func->alive_enabled, true);
+    return 0;
+}
+
+/**
+ * Deadline supervision: end checkpoint between min_us and max_us after the
+ * start checkpoint
+ */
+static int iso26262_supervise_deadline(int function_id, const struct deadline_supervision_config *cfg)
+{
+    struct safety_function *func = iso26262_function(function_id);
+    struct deadline_supervision *d;
     
-    // Call safety handler
-    if (func->safety_handler) {
-        func->safety_handler(func->handler_data);
+    if (!func || !cfg || cfg->start_checkpoint >= MAX_CHECKPOINTS || cfg->end_checkpoint >= MAX_CHECKPOINTS ||
+        cfg->min_us > cfg->max_us) {
+        return -EINVAL;
+    }
+    if (func->num_deadlines >= MAX_DEADLINES) {
+        pr_err("No free deadline slots for safety function %d\n", function_id);
+        return -ENOSPC;
+    }
+    
+    d = &func->deadlines[func->num_deadlines];
+    memset(d, 0, sizeof(*d));
+    d->cfg = *cfg;
+    smp_store_release(&func->num_deadlines, func->num_deadlines + 1);
+    return 0;
+}
+
+/**
+ * Logical supervision: the function's program flow starts at one of the
+ * initial checkpoints, goes from checkpoint n only to those in
+ * successors[n], and after a final checkpoint starts over
+ */
+static int iso26262_supervise_logical(int function_id, u16 initial, u16 final, const u16 *successors)
+{
+    struct safety_function *func = iso26262_function(function_id);
+    
+    if (!func || !initial || !successors) {
+        return -EINVAL;
     }
     
-    // Reschedule timer
-    mod_timer(&func->safety_timer, jiffies + msecs_to_jiffies(func->timeout_ms));
+    memcpy(func->successors, successors, sizeof(func->successors));
+    func->initial_checkpoints = initial;
+    func->final_checkpoints = final;
+    func->logical_seen = READ_ONCE(func->logical_errors);
+    WRITE_ONCE(func->last_checkpoint, NO_CHECKPOINT);
+    WRITE_ONCE(func->logical_enabled, true);
+    return 0;
 }
 
 /**
- * Safety function execution
+ * Report a checkpoint. Called from the function's own context only; the
+ * supervisor picks everything up on its next pass.
+ */
+static void iso26262_checkpoint(int function_id, u8 checkpoint)
+{
+    struct safety_function *func;
+    u64 now = 0;
+    int i, n;
+    
+    if (function_id < 0 || function_id >= MAX_SAFETY_FUNCTIONS || checkpoint >= MAX_CHECKPOINTS) {
+        return;
+    }
+    func = &global_safety_system.functions[function_id];
+    
+    if (READ_ONCE(func->alive_enabled) && checkpoint == func->alive.checkpoint) {
+        WRITE_ONCE(func->alive_count, func->alive_count + 1);
+    }
+    
+    if (READ_ONCE(func->logical_enabled)) {
+        u8 last = func->last_checkpoint;
+        u16 allowed = last == NO_CHECKPOINT || (func->final_checkpoints & BIT(last)) ?
+                      func->initial_checkpoints : func->successors[last];
+    
+        if (!(allowed & BIT(checkpoint))) {
+            WRITE_ONCE(func->logical_errors, func->logical_errors + 1);
+        }
+        WRITE_ONCE(func->last_checkpoint, checkpoint);
+    }
+    
+    n = smp_load_acquire(&func->num_deadlines);
+    for (i = 0; i < n; i++) {
+        struct deadline_supervision *d = &func->deadlines[i];
+    
+        if (checkpoint == d->cfg.end_checkpoint && d->start_ns) {
+            u64 elapsed;
+    
+            now = now ?: ktime_get_ns();
+            elapsed = now - d->start_ns;
+            if (elapsed < (u64)d->cfg.min_us * NSEC_PER_USEC || elapsed > (u64)d->cfg.max_us * NSEC_PER_USEC) {
+                WRITE_ONCE(d->violations, d->violations + 1);
+            }
+            WRITE_ONCE(d->start_ns, 0);
+        }
+        if (checkpoint == d->cfg.start_checkpoint) {
+            now = now ?: ktime_get_ns();
+            WRITE_ONCE(d->start_ns, now);
+        }
+    }
+}
+
+/**
+ * Safety function execution: the alive indication of checkpoint 0
  */
 static int iso26262_execute_function(int function_id)
 {
-    if (function_id >= MAX_SAFETY_FUNCTIONS) {
+    if (function_id < 0 || function_id >= MAX_SAFETY_FUNCTIONS) {
         return -EINVAL;
     }
     
@@ -155,26 +329,138 @@ static int iso26262_execute_function(int function_id)
         return -EINVAL;
     }
     
-    // Reset timer
-    mod_timer(&func->safety_timer, jiffies + msecs_to_jiffies(func->timeout_ms));
-    
-    pr_debug("Safety function %d executed successfully\n", function_id);
+    iso26262_checkpoint(function_id, 0);
     
     return 0;
 }
 
+// Error reaction for an expired function
+static void iso26262_expire(struct safety_function *func, const char *what)
+{
+    pr_warn("Safety function %d %s supervision failed at %llu ns%s\n", func->function_id, what, gptp_now(),
+            gptp_synced() ? "" : " (time not synchronized)");
+    
+    func->status = SUPERVISION_EXPIRED;
+    atomic_inc(&func->error_count);
+    atomic_inc(&global_safety_system.total_errors);
+    
+    if (func->safety_handler) {
+        func->safety_handler(func->handler_data);
+    }
+}
+
+/*
+ * Alive supervision at the end of a reference cycle: false if the
+ * indication count is outside its margins
+ */
+static bool iso26262_check_alive(struct safety_function *func, bool *evaluated)
+{
+    u32 count, n;
+    
+    *evaluated = false;
+    if (++func->alive_cycles < func->alive.reference_cycles) {
+        return true;
+    }
+    func->alive_cycles = 0;
+    *evaluated = true;
+    
+    count = READ_ONCE(func->alive_count);
+    n = count - func->alive_seen;
+    func->alive_seen = count;
+    return n >= func->alive.expected - func->alive.min_margin &&
+           n <= (u32)func->alive.expected + func->alive.max_margin;
+}
+
+// One supervision cycle for one function
+static void iso26262_supervise(struct safety_function *func, u64 now)
+{
+    bool evaluated;
+    int i, n;
+    
+    if (func->status == SUPERVISION_EXPIRED) {
+        return;
+    }
+    
+    if (READ_ONCE(func->logical_enabled)) {
+        u32 errors = READ_ONCE(func->logical_errors);
+    
+        if (errors != func->logical_seen) {
+            func->logical_seen = errors;
+            iso26262_expire(func, "logical");
+            return;
+        }
+    }
+    
+    n = smp_load_acquire(&func->num_deadlines);
+    for (i = 0; i < n; i++) {
+        struct deadline_supervision *d = &func->deadlines[i];
+        u32 violations = READ_ONCE(d->violations);
+        u64 start = READ_ONCE(d->start_ns);
+        bool overdue = start && start != d->overdue_start && now - start > (u64)d->cfg.max_us * NSEC_PER_USEC;
+    
+        if (violations != d->violations_seen || overdue) {
+            d->violations_seen = violations;
+            d->overdue_start = start;
+            iso26262_expire(func, "deadline");
+            return;
+        }
+    }
+    
+    // Alive supervision tolerates failed_tolerance bad reference cycles in a row
+    if (func->alive_enabled) {
+        if (!iso26262_check_alive(func, &evaluated)) {
+            if (++func->alive_failed > func->alive.failed_tolerance) {
+                iso26262_expire(func, "alive");
+                return;
+            }
+            func->status = SUPERVISION_FAILED;
+        } else if (evaluated && func->alive_failed && --func->alive_failed == 0) {
+            func->status = SUPERVISION_OK;
+        }
+    }
+}
+
+/*
+ * The supervisor: one pass over every function per cycle, then the
+ * global status is the worst of theirs
+ */
+static enum hrtimer_restart iso26262_supervision_timer(struct hrtimer *timer)
+{
+    enum supervision_status global = SUPERVISION_OK;
+    u64 now = ktime_get_ns();
+    int i;
+    
+    for (i = 0; i < MAX_SAFETY_FUNCTIONS; i++) {
+        struct safety_function *func = &global_safety_system.functions[i];
+    
+        if (!READ_ONCE(func->active)) {
+            continue;
+        }
+        iso26262_supervise(func, now);
+        global = max(global, func->status);
+    }
+    
+    if (global != global_safety_system.global_status) {
+        pr_info("Safety supervision global status %d -> %d\n", global_safety_system.global_status, global);
+        WRITE_ONCE(global_safety_system.global_status, global);
+    }
+    
+    hrtimer_forward_now(timer, ms_to_ktime(SUPERVISION_CYCLE_MS));
+    return HRTIMER_RESTART;
+}
+
 /**
  * Safety error handling
  */
 static int iso26262_handle_error(int function_id, u32 error_code)
 {
-    if (function_id >= MAX_SAFETY_FUNCTIONS) {
+    if (function_id < 0 || function_id >= MAX_SAFETY_FUNCTIONS) {
         return -EINVAL;
     }
     
     struct safety_function *func = &global_safety_system.functions[function_id];
     
-    pr_err("Safety error in function %d: code=0x%x\n", function_id, error_code);
+    pr_err("Safety error in function %d: code=0x%x at %llu ns\n", function_id, error_code, gptp_now());
     
     // Increment error count
     atomic_inc(&func->error_count);
@@ -220,6 +506,12 @@ static void safety_function_handler(void *data)
  */
 static int __init iso26262_init_module(void)
 {
+    struct alive_supervision_config alive = {
+        .checkpoint = 0,
+        .expected = 1,
+        .max_margin = 1,
+        .reference_cycles = SAFETY_TIMEOUT_MS / SUPERVISION_CYCLE_MS,
+    };
     int ret, i;
     
     pr_info("ISO 26262 Safety v%s loading\n", ISO26262_VERSION);
@@ -230,18 +522,25 @@ static int __init iso26262_init_module(void)
         return ret;
     }
     
-    // Register example safety functions
+    // Register example safety functions, alive once per SAFETY_TIMEOUT_MS
     for (i = 0; i < 4; i++) {
-        ret = iso26262_register_function(i, ASIL_A + i, SAFETY_TIMEOUT_MS,
-                                         safety_function_handler, NULL);
+        ret = iso26262_register_function(i, ASIL_A + i, safety_function_handler, NULL);
+        if (!ret) {
+            ret = iso26262_supervise_alive(i, &alive);
+        }
         if (ret) {
             pr_err("Failed to register safety function %d\n", i);
             return ret;
         }
     }
     
-    pr_info("ISO 26262 Safety loaded with %d functions\n", 
-            global_safety_system.function_count);
+    hrtimer_init(&global_safety_system.supervision_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    global_safety_system.supervision_timer.function = iso26262_supervision_timer;
+    hrtimer_start(&global_safety_system.supervision_timer, ms_to_ktime(SUPERVISION_CYCLE_MS),
+                  HRTIMER_MODE_REL_SOFT);
+    
+    pr_info("ISO 26262 Safety loaded with %d functions, %d ms supervision cycle\n",
+            global_safety_system.function_count, SUPERVISION_CYCLE_MS);
     return 0;
 }
 
@@ -250,14 +549,7 @@ static int __init iso26262_init_module(void)
  */
 static void __exit iso26262_cleanup_module(void)
 {
-    int i;
-    
-    // Cleanup timers
-    for (i = 0; i < MAX_SAFETY_FUNCTIONS; i++) {
-        if (global_safety_system.functions[i].active) {
-            del_timer_sync(&global_safety_system.functions[i].safety_timer);
-        }
-    }
+    hrtimer_cancel(&global_safety_system.supervision_timer);
     
     pr_info("ISO 26262 Safety unloaded\n");
 }
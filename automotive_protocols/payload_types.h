@@ -0,0 +1,280 @@
+/**
+ * Generated payload serializers
+ *
+ * Typed payloads for DDS (XCDR2) and SOME/IP, generated at compile time
+ * from a field list that serves as the IDL:
+ *
+ *   #define BRAKE_REQUEST_FIELDS(F, A) \
+ *       F(u32, sequence)               \
+ *       F(u16, pressure_kpa)           \
+ *       F(u8, mode)                    \
+ *       A(u8, reserved, 1)
+ *   PAYLOAD_TYPE(brake_request, BRAKE_REQUEST_FIELDS);
+ *
+ * This declares struct brake_request and brake_request_type, whose
+ * cdr_put/cdr_get and someip_put/someip_get walk the fields in
+ * straight-line code: every size, offset and byte swap is a constant
+ * the compiler folds, there is no per-field lookup or type switch at
+ * run time. When the C layout of a type equals its wire layout (no
+ * padding, and for SOME/IP a big-endian host) the whole sample is one
+ * memcpy.
+ *
+ * Fields are fixed-size integers and fixed arrays of them. XCDR2 is
+ * written in host byte order as a FINAL type (PLAIN_CDR2, no DHEADER),
+ * 8-byte members aligned to 4; either byte order is read. SOME/IP is
+ * big-endian and unaligned, arrays without a length field. A put never
+ * fails given PAYLOAD_CDR_MAX() / PAYLOAD_SOMEIP_MAX() bytes.
+ */
+
+#ifndef PAYLOAD_TYPES_H
+#define PAYLOAD_TYPES_H
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/stddef.h>
+#include <linux/string.h>
+#include <linux/swab.h>
+#include <asm/byteorder.h>
+#include <asm/unaligned.h>
+
+#ifdef __BIG_ENDIAN
+#define PAYLOAD_HOST_BE 1
+#else
+#define PAYLOAD_HOST_BE 0
+#endif
+
+#define PAYLOAD_CDR_ENCAP_LEN 4
+#define PAYLOAD_CDR2_BE 0x06                // representation identifier, low byte
+#define PAYLOAD_CDR2_LE 0x07
+
+struct payload_type {
+    const char *name;
+    size_t size;                // of the C struct; bounds both wire forms
+    int (*cdr_put)(const void *sample, u8 *buf, size_t len);
+    int (*cdr_get)(void *sample, const u8 *buf, size_t len);
+    int (*someip_put)(const void *sample, u8 *buf, size_t len);
+    int (*someip_get)(void *sample, const u8 *buf, size_t len);
+};
+
+// Encapsulation, end padding to 4 and XCDR2 never align wider than the C type
+#define PAYLOAD_CDR_MAX(type) (PAYLOAD_CDR_ENCAP_LEN + (type)->size + 3)
+#define PAYLOAD_SOMEIP_MAX(type) ((type)->size)
+
+static __always_inline size_t __payload_cdr_align(size_t size)
+{
+    return size > 4 ? 4 : size;
+}
+
+// Swap n elements of size bytes in place; size is a constant
+static __always_inline void __payload_swab(void *p, size_t size, size_t n)
+{
+    u8 *b = p;
+    size_t i;
+    
+    for (i = 0; i < n; i++, b += size) {
+        switch (size) {
+        case 2:
+            put_unaligned(swab16(get_unaligned((u16 *)b)), (u16 *)b);
+            break;
+        case 4:
+            put_unaligned(swab32(get_unaligned((u32 *)b)), (u32 *)b);
+            break;
+        case 8:
+            put_unaligned(swab64(get_unaligned((u64 *)b)), (u64 *)b);
+            break;
+        }
+    }
+}
+
+/*
+ * One pass per operation over the field list. F(t, f) is a member of
+ * type t, A(t, f, n) an array of n of them; apart from the struct
+ * definition both go through the same pass, as sizeof(v->f) covers the
+ * whole array and sizeof(t) one element.
+ */
+#define __PAYLOAD_STRUCT_F(t, f) t f;
+#define __PAYLOAD_STRUCT_A(t, f, n) t f[n];
+
+#define __PAYLOAD_CDR_LEN(t, f) \
+    off = ALIGN(off, __payload_cdr_align(sizeof(t))) + sizeof(v->f);
+#define __PAYLOAD_CDR_LEN_A(t, f, n) __PAYLOAD_CDR_LEN(t, f)
+
+#define __PAYLOAD_CDR_POD(t, f) \
+    pod &= offsetof(__typeof__(*v), f) == off && IS_ALIGNED(off, __payload_cdr_align(sizeof(t))); \
+    off += sizeof(v->f);
+#define __PAYLOAD_CDR_POD_A(t, f, n) __PAYLOAD_CDR_POD(t, f)
+
+#define __PAYLOAD_CDR_PUT(t, f) \
+    off = ALIGN(off, __payload_cdr_align(sizeof(t))); \
+    memcpy(buf + off, &v->f, sizeof(v->f)); \
+    off += sizeof(v->f);
+#define __PAYLOAD_CDR_PUT_A(t, f, n) __PAYLOAD_CDR_PUT(t, f)
+
+#define __PAYLOAD_CDR_GET(t, f) \
+    off = ALIGN(off, __payload_cdr_align(sizeof(t))); \
+    memcpy(&v->f, buf + off, sizeof(v->f)); \
+    if (swap) { \
+        __payload_swab(&v->f, sizeof(t), sizeof(v->f) / sizeof(t)); \
+    } \
+    off += sizeof(v->f);
+#define __PAYLOAD_CDR_GET_A(t, f, n) __PAYLOAD_CDR_GET(t, f)
+
+#define __PAYLOAD_SOMEIP_LEN(t, f) off += sizeof(v->f);
+#define __PAYLOAD_SOMEIP_LEN_A(t, f, n) __PAYLOAD_SOMEIP_LEN(t, f)
+
+#define __PAYLOAD_SOMEIP_POD(t, f) \
+    pod &= offsetof(__typeof__(*v), f) == off; \
+    off += sizeof(v->f);
+#define __PAYLOAD_SOMEIP_POD_A(t, f, n) __PAYLOAD_SOMEIP_POD(t, f)
+
+#define __PAYLOAD_SOMEIP_PUT(t, f) \
+    memcpy(buf + off, &v->f, sizeof(v->f)); \
+    if (!PAYLOAD_HOST_BE) { \
+        __payload_swab(buf + off, sizeof(t), sizeof(v->f) / sizeof(t)); \
+    } \
+    off += sizeof(v->f);
+#define __PAYLOAD_SOMEIP_PUT_A(t, f, n) __PAYLOAD_SOMEIP_PUT(t, f)
+
+#define __PAYLOAD_SOMEIP_GET(t, f) \
+    memcpy(&v->f, buf + off, sizeof(v->f)); \
+    if (!PAYLOAD_HOST_BE) { \
+        __payload_swab(&v->f, sizeof(t), sizeof(v->f) / sizeof(t)); \
+    } \
+    off += sizeof(v->f);
+#define __PAYLOAD_SOMEIP_GET_A(t, f, n) __PAYLOAD_SOMEIP_GET(t, f)
+
+#define PAYLOAD_TYPE(type, FIELDS)                                                  \
+struct type {                                                                       \
+    FIELDS(__PAYLOAD_STRUCT_F, __PAYLOAD_STRUCT_A)                                  \
+};                                                                                  \
+                                                                                    \
+/* XCDR2 body length, without encapsulation and end padding */                      \
+static __always_inline size_t type##_cdr_len(void)                                  \
+{                                                                                   \
+    const struct type *v = NULL;                                                    \
+    size_t off = 0;                                                                 \
+                                                                                    \
+    (void)v;                                                                        \
+    FIELDS(__PAYLOAD_CDR_LEN, __PAYLOAD_CDR_LEN_A)                                  \
+    return off;                                                                     \
+}                                                                                   \
+                                                                                    \
+static __always_inline bool type##_cdr_pod(void)                                    \
+{                                                                                   \
+    const struct type *v = NULL;                                                    \
+    size_t off = 0;                                                                 \
+    bool pod = true;                                                                \
+                                                                                    \
+    (void)v;                                                                        \
+    FIELDS(__PAYLOAD_CDR_POD, __PAYLOAD_CDR_POD_A)                                  \
+    return pod && off == sizeof(struct type);                                       \
+}                                                                                   \
+                                                                                    \
+static inline int type##_cdr_put(const void *sample, u8 *buf, size_t len)           \
+{                                                                                   \
+    const struct type *v = sample;                                                  \
+    size_t body = type##_cdr_len(), pad = ALIGN(body, 4) - body, off = 0;           \
+                                                                                    \
+    if (len < PAYLOAD_CDR_ENCAP_LEN + body + pad) {                                 \
+        return -EMSGSIZE;                                                           \
+    }                                                                               \
+    buf[0] = 0;                                                                     \
+    buf[1] = PAYLOAD_HOST_BE ? PAYLOAD_CDR2_BE : PAYLOAD_CDR2_LE;                   \
+    buf[2] = 0;                                                                     \
+    buf[3] = pad;               /* options: padding bytes at the end */             \
+    buf += PAYLOAD_CDR_ENCAP_LEN;                                                   \
+    if (type##_cdr_pod()) {                                                         \
+        memcpy(buf, v, body);                                                       \
+    } else {                                                                        \
+        memset(buf, 0, body);                                                       \
+        FIELDS(__PAYLOAD_CDR_PUT, __PAYLOAD_CDR_PUT_A)                              \
+    }                                                                               \
+    memset(buf + body, 0, pad);                                                     \
+    return PAYLOAD_CDR_ENCAP_LEN + body + pad;                                      \
+}                                                                                   \
+                                                                                    \
+static inline int type##_cdr_get(void *sample, const u8 *buf, size_t len)           \
+{                                                                                   \
+    struct type *v = sample;                                                        \
+    size_t body = type##_cdr_len(), off = 0;                                        \
+    bool swap;                                                                      \
+                                                                                    \
+    if (len < PAYLOAD_CDR_ENCAP_LEN + body) {                                       \
+        return -EMSGSIZE;                                                           \
+    }                                                                               \
+    if (buf[0] || (buf[1] != PAYLOAD_CDR2_BE && buf[1] != PAYLOAD_CDR2_LE)) {       \
+        return -EINVAL;                                                             \
+    }                                                                               \
+    swap = (buf[1] == PAYLOAD_CDR2_BE) != PAYLOAD_HOST_BE;                          \
+    buf += PAYLOAD_CDR_ENCAP_LEN;                                                   \
+    if (!swap && type##_cdr_pod()) {                                                \
+        memcpy(v, buf, body);                                                       \
+        return 0;                                                                   \
+    }                                                                               \
+    FIELDS(__PAYLOAD_CDR_GET, __PAYLOAD_CDR_GET_A)                                  \
+    return 0;                                                                       \
+}                                                                                   \
+                                                                                    \
+static __always_inline size_t type##_someip_len(void)                               \
+{                                                                                   \
+    const struct type *v = NULL;                                                    \
+    size_t off = 0;                                                                 \
+                                                                                    \
+    (void)v;                                                                        \
+    FIELDS(__PAYLOAD_SOMEIP_LEN, __PAYLOAD_SOMEIP_LEN_A)                            \
+    return off;                                                                     \
+}                                                                                   \
+                                                                                    \
+static __always_inline bool type##_someip_pod(void)                                 \
+{                                                                                   \
+    const struct type *v = NULL;                                                    \
+    size_t off = 0;                                                                 \
+    bool pod = PAYLOAD_HOST_BE;                                                     \
+                                                                                    \
+    (void)v;                                                                        \
+    FIELDS(__PAYLOAD_SOMEIP_POD, __PAYLOAD_SOMEIP_POD_A)                            \
+    return pod && off == sizeof(struct type);                                       \
+}                                                                                   \
+                                                                                    \
+static inline int type##_someip_put(const void *sample, u8 *buf, size_t len)        \
+{                                                                                   \
+    const struct type *v = sample;                                                  \
+    size_t off = 0;                                                                 \
+                                                                                    \
+    if (len < type##_someip_len()) {                                                \
+        return -EMSGSIZE;                                                           \
+    }                                                                               \
+    if (type##_someip_pod()) {                                                      \
+        memcpy(buf, v, sizeof(*v));                                                 \
+        return sizeof(*v);                                                          \
+    }                                                                               \
+    FIELDS(__PAYLOAD_SOMEIP_PUT, __PAYLOAD_SOMEIP_PUT_A)                            \
+    return off;                                                                     \
+}                                                                                   \
+                                                                                    \
+static inline int type##_someip_get(void *sample, const u8 *buf, size_t len)        \
+{                                                                                   \
+    struct type *v = sample;                                                        \
+    size_t off = 0;                                                                 \
+                                                                                    \
+    if (len < type##_someip_len()) {                                                \
+        return -EMSGSIZE;                                                           \
+    }                                                                               \
+    if (type##_someip_pod()) {                                                      \
+        memcpy(v, buf, sizeof(*v));                                                 \
+        return 0;                                                                   \
+    }                                                                               \
+    FIELDS(__PAYLOAD_SOMEIP_GET, __PAYLOAD_SOMEIP_GET_A)                            \
+    return 0;                                                                       \
+}                                                                                   \
+                                                                                    \
+static const struct payload_type type##_type __maybe_unused = {                     \
+    .name = #type,                                                                  \
+    .size = sizeof(struct type),                                                    \
+    .cdr_put = type##_cdr_put,                                                      \
+    .cdr_get = type##_cdr_get,                                                      \
+    .someip_put = type##_someip_put,                                                \
+    .someip_get = type##_someip_get,                                                \
+}
+
+#endif /* PAYLOAD_TYPES_H */
@@ -14,13 +14,63 @@
 #include <linux/atomic.h>
 #include <linux/timer.h>
 #include <linux/workqueue.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/in.h>
+#include <asm/unaligned.h>
 
-#define SOMEIP_VERSION "1.0.0"
+#include "payload_types.h"
+
+#define SOMEIP_VERSION "1.1.0"
 #define MAX_SOMEIP_SERVICES 32
 #define MAX_SOMEIP_METHODS 64
 #define MAX_SOMEIP_EVENTS 32
 #define MAX_SOMEIP_FIELDS 64
 #define SOMEIP_MESSAGE_MAX_SIZE 1400
+#define SOMEIP_INDEX_PAGES 64               // second-level pages shared by every index
+
+// Wire format
+#define SOMEIP_HDR_LEN 16
+#define SOMEIP_LENGTH_COVERED 8             // header bytes counted by the length field
+#define SOMEIP_PROTOCOL_VERSION 1
+
+// SOME/IP-TP: messages above one frame go out in segments
+#define SOMEIP_TP_FLAG 0x20                 // in the message type
+#define SOMEIP_TP_HDR_LEN 4
+#define SOMEIP_TP_MORE 0x1
+#define SOMEIP_TP_SEGMENT_LEN round_down(SOMEIP_MESSAGE_MAX_SIZE - SOMEIP_HDR_LEN - SOMEIP_TP_HDR_LEN, 16)
+#define SOMEIP_TP_MAX_MESSAGE (256 * 1024)
+#define SOMEIP_TP_CONTEXTS 8                // messages reassembled at once
+#define SOMEIP_MAX_IOV 8                    // payload pieces of one message
+
+// Service Discovery
+#define SOMEIP_SD_MESSAGE_ID 0xffff8100
+#define SOMEIP_SD_PORT 30490
+#define SOMEIP_SD_HDR_LEN 4                 // flags and reserved, ahead of the entries
+#define SOMEIP_SD_ENTRY_LEN 16
+#define SOMEIP_SD_OPTION_LEN 12             // IPv4 endpoint and multicast options
+#define SOMEIP_SD_FLAG_REBOOT 0x80
+#define SOMEIP_SD_FLAG_UNICAST 0x40
+#define SOMEIP_SD_FIND 0x00
+#define SOMEIP_SD_OFFER 0x01                // TTL 0: StopOffer
+#define SOMEIP_SD_SUBSCRIBE 0x06            // TTL 0: StopSubscribeEventgroup
+#define SOMEIP_SD_SUBSCRIBE_ACK 0x07        // TTL 0: Nack
+#define SOMEIP_SD_OPT_IPV4 0x04
+#define SOMEIP_SD_OPT_IPV4_MULTICAST 0x14
+#define SOMEIP_SD_TTL 3                     // seconds, for offers and subscriptions we send
+#define SOMEIP_SD_TTL_INFINITE 0xffffff
+#define SOMEIP_SD_CYCLIC_OFFER_MS 1000
+#define SOMEIP_SD_ANY 0xffff
+#define SOMEIP_SD_REMOTE_OFFERS 32
+#define SOMEIP_SD_SUBSCRIPTIONS 16          // eventgroups we subscribe to as a client
+#define SOMEIP_SD_MAX_OPTIONS 16            // options looked at in a received message
+#define SOMEIP_SD_MAX_ACKS 8                // subscribe answers per received message
+#define MAX_SOMEIP_EVENTGROUPS 8
+#define MAX_SOMEIP_SUBSCRIBERS 16
+#define SOMEIP_MULTICAST_THRESHOLD 2        // subscribers from which a group goes out multicast
+#define SOMEIP_TYPED_MAX 256                // payload of a typed call, serialized on the stack
 
 enum someip_message_type {
     SOMEIP_MESSAGE_REQUEST = 0x00,
@@ -78,6 +128,38 @@ struct someip_method {
     u64 last_execution_time;
 };
 
+/*
+ * Dispatch index over a 16-bit ID: the high byte picks a 256-entry page
+ * from a shared pool, the low byte the slot in it. Both levels hold
+ * index + 1, 0 for none, so a lookup is two loads and pages are only
+ * taken for the ID ranges in use (methods from 0x0001, events from
+ * 0x8001 usually need one each).
+ */
+struct someip_index {
+    u8 pages[256];
+};
+
+// Addresses and ports in network order, as in a sockaddr_in
+struct someip_endpoint {
+    __be32 addr;
+    __be16 port;
+    u8 l4_proto;                // IPPROTO_UDP or IPPROTO_TCP
+};
+
+struct someip_subscriber {
+    struct someip_endpoint ep;
+    unsigned long expires;      // jiffies, 0 for never
+    bool active;
+};
+
+struct someip_eventgroup {
+    u16 eventgroup_id;
+    bool active;
+    struct someip_endpoint multicast;   // addr 0: unicast only
+    struct someip_subscriber subscribers[MAX_SOMEIP_SUBSCRIBERS];
+    int subscriber_count;
+};
+
 struct someip_service {
     u32 service_id;
     u32 instance_id;
@@ -90,7 +172,11 @@ struct someip_service {
     int event_count;
     struct someip_field fields[MAX_SOMEIP_FIELDS];
     int field_count;
+    struct someip_index method_index;
+    struct someip_index event_index;
+    struct someip_eventgroup eventgroups[MAX_SOMEIP_EVENTGROUPS];
     bool active;
+    bool offered;
     u32 subscriber_count;
     u32 total_requests;
     u32 total_responses;
@@ -100,15 +186,182 @@ struct someip_service {
 struct someip_protocol {
     struct someip_service services[MAX_SOMEIP_SERVICES];
     int service_count;
+    struct someip_index service_index;
+    u8 index_pages[SOMEIP_INDEX_PAGES][256];
+    int index_pages_used;
     atomic_t total_messages;
     u32 total_errors;
     bool someip_active;
     u32 message_timeout_ms;
     struct timer_list someip_timer;
+    
+    // Frame output: scatter-gather, the driver or socket gathers the pieces
+    int (*xmit)(void *ctx, const struct someip_endpoint *dst, const struct kvec *iov, int n);
+    void *xmit_ctx;
 };
 
 static struct someip_protocol global_someip_protocol;
 
+// An offer heard from another node, kept until its TTL runs out
+struct someip_sd_remote {
+    bool active;
+    u16 service_id;
+    u16 instance_id;
+    u8 major_version;
+    u32 minor_version;
+    struct someip_endpoint ep;          // where the service is reached
+    struct someip_endpoint sd;          // where its SD answers
+    unsigned long expires;
+};
+
+struct someip_sd_subscription {
+    bool active;
+    bool acked;
+    u16 service_id;
+    u16 instance_id;
+    u8 major_version;
+    u16 eventgroup_id;
+    struct someip_endpoint multicast;   // from the ack, for the socket to join
+};
+
+/*
+ * SD state. Our offers are serialized once into offer_msg (entries and
+ * options with their lengths) whenever the offered set changes; the
+ * cyclic offer and every answer to a Find send that buffer as it is.
+ */
+struct someip_sd {
+    bool configured;
+    struct someip_endpoint local;       // our service endpoint
+    struct someip_endpoint multicast;   // SD group
+    u16 session_id;
+    bool reboot;
+    u8 offer_msg[SOMEIP_MESSAGE_MAX_SIZE - SOMEIP_HDR_LEN - SOMEIP_SD_HDR_LEN];
+    size_t offer_len;
+    int offer_count;
+    struct someip_sd_remote remote[SOMEIP_SD_REMOTE_OFFERS];
+    struct someip_sd_subscription subscriptions[SOMEIP_SD_SUBSCRIPTIONS];
+    struct delayed_work work;
+};
+
+static struct someip_sd someip_sd;
+static DEFINE_MUTEX(someip_sd_lock);
+
+static void someip_sd_work_fn(struct work_struct *work);
+
+/*
+ * A message reassembled from SOME/IP-TP segments. data is the caller's
+ * once handed out, freed with someip_tp_free().
+ */
+struct someip_tp_msg {
+    u32 message_id;
+    u32 request_id;
+    u8 interface_version;
+    u8 message_type;            // TP flag cleared
+    u8 return_code;
+    void *data;
+    size_t len;
+};
+
+struct someip_tp_ctx {
+    bool active;
+    u32 peer;                   // the caller's sender key, e.g. address and port
+    u32 message_id;
+    u32 request_id;
+    u8 interface_version;
+    u8 message_type;
+    u8 return_code;
+    u8 *buf;
+    size_t cap;
+    size_t next;                // segments must arrive in order
+    unsigned long last;         // jiffies of the last segment
+};
+
+static struct someip_tp_ctx someip_tp_ctxs[SOMEIP_TP_CONTEXTS];
+static DEFINE_MUTEX(someip_tp_lock);
+
+/**
+ * Slot registered for id, or -1
+ */
+static inline int someip_index_get(const struct someip_index *ix, u16 id)
+{
+    u8 page = READ_ONCE(ix->pages[id >> 8]);
+    
+    if (!page) {
+        return -1;
+    }
+    return (int)READ_ONCE(global_someip_protocol.index_pages[page - 1][id & 0xff]) - 1;
+}
+
+/**
+ * Map id to slot, taking a page from the pool for a new high byte. The
+ * slot is written before the page is published, for lookups running
+ * concurrently with registration.
+ */
+static int someip_index_set(struct someip_index *ix, u16 id, int slot)
+{
+    u8 page = ix->pages[id >> 8];
+    
+    if (!page) {
+        if (global_someip_protocol.index_pages_used >= SOMEIP_INDEX_PAGES) {
+            pr_err("SOME/IP dispatch index pages exhausted\n");
+            return -ENOSPC;
+        }
+        page = ++global_someip_protocol.index_pages_used;
+        memset(global_someip_protocol.index_pages[page - 1], 0, 256);
+        global_someip_protocol.index_pages[page - 1][id & 0xff] = slot + 1;
+        smp_wmb();
+        WRITE_ONCE(ix->pages[id >> 8], page);
+        return 0;
+    }
+    WRITE_ONCE(global_someip_protocol.index_pages[page - 1][id & 0xff], slot + 1);
+    return 0;
+}
+
+static struct someip_service *someip_find_service(u32 service_id)
+{
+    int i;
+    
+    if (service_id > 0xffff) {
+        return NULL;
+    }
+    i = someip_index_get(&global_someip_protocol.service_index, service_id);
+    return i < 0 ? NULL : &global_someip_protocol.services[i];
+}
+
+static struct someip_eventgroup *someip_eventgroup_find(struct someip_service *service, u32 eventgroup_id)
+{
+    int i;
+    
+    for (i = 0; i < MAX_SOMEIP_EVENTGROUPS; i++) {
+        if (service->eventgroups[i].active && service->eventgroups[i].eventgroup_id == eventgroup_id) {
+            return &service->eventgroups[i];
+        }
+    }
+    return NULL;
+}
+
+// Eventgroups are created by the first event that names them
+static int someip_eventgroup_add(struct someip_service *service, u32 eventgroup_id)
+{
+    int i, ret = -ENOSPC;
+    
+    mutex_lock(&someip_sd_lock);
+    if (someip_eventgroup_find(service, eventgroup_id)) {
+        ret = 0;
+    }
+    for (i = 0; ret && i < MAX_SOMEIP_EVENTGROUPS; i++) {
+        if (!service->eventgroups[i].active) {
+            memset(&service->eventgroups[i], 0, sizeof(service->eventgroups[i]));
+            service->eventgroups[i].eventgroup_id = eventgroup_id;
+            service->eventgroups[i].active = true;
+            ret = 0;
+        }
+    }
+    mutex_unlock(&someip_sd_lock);
+    
+    return ret;
+}
+
 /**
  * Initialize SOME/IP protocol
  */
@@ -123,6 +376,12 @@ static int someip_protocol_init(void)
     global_someip_protocol.total_errors = 0;
     global_someip_protocol.someip_active = false;
     global_someip_protocol.message_timeout_ms = 5000;
+    memset(&global_someip_protocol.service_index, 0, sizeof(global_someip_protocol.service_index));
+    global_someip_protocol.index_pages_used = 0;
+    memset(&someip_sd, 0, sizeof(someip_sd));
+    someip_sd.session_id = 1;
+    someip_sd.reboot = true;
+    INIT_DELAYED_WORK(&someip_sd.work, someip_sd_work_fn);
     
     // Initialize services
     for (i = 0; i < MAX_SOMEIP_SERVICES; i++) {
@@ -139,6 +398,13 @@ static int someip_protocol_init(void)
         global_someip_protocol.services[i].total_requests = 0;
         global_someip_protocol.services[i].total_responses = 0;
         global_someip_protocol.services[i].total_errors = 0;
+        memset(&global_someip_protocol.services[i].method_index, 0,
+               sizeof(global_someip_protocol.services[i].method_index));
+        memset(&global_someip_protocol.services[i].event_index, 0,
+               sizeof(global_someip_protocol.services[i].event_index));
+        memset(global_someip_protocol.services[i].eventgroups, 0,
+               sizeof(global_someip_protocol.services[i].eventgroups));
+        global_someip_protocol.services[i].offered = false;
         
         // Initialize methods
         for (j = 0; j < MAX_SOMEIP_METHODS; j++) {
@@ -188,13 +454,18 @@ static int someip_protocol_init(void)
  */
 static int someip_add_service(u32 service_id, u32 instance_id, const char *name, u16 major_version, u16 minor_version)
 {
-    int i;
+    int i, ret;
     
-    if (!name) {
+    if (!name || service_id > 0xffff) {
         pr_err("Invalid SOME/IP service parameters\n");
         return -EINVAL;
     }
     
+    if (someip_find_service(service_id)) {
+        pr_err("SOME/IP service 0x%x already registered\n", service_id);
+        return -EEXIST;
+    }
+    
     // Find free service slot
     for (i = 0; i < MAX_SOMEIP_SERVICES; i++) {
         if (!global_someip_protocol.services[i].active) {
@@ -221,6 +492,12 @@ static int someip_add_service(u32 service_id, u32 instance_id, const char *name,
     global_someip_protocol.services[i].total_responses = 0;
     global_someip_protocol.services[i].total_errors = 0;
     
+    ret = someip_index_set(&global_someip_protocol.service_index, service_id, i);
+    if (ret) {
+        global_someip_protocol.services[i].active = false;
+        return ret;
+    }
+    
     global_someip_protocol.service_count++;
     
     pr_info("SOME/IP service %d added: service_id=0x%x, instance_id=0x%x, name=%s, version=%d.%d\n",
@@ -234,22 +511,15 @@ static int someip_add_service(u32 service_id, u32 instance_id, const char *name,
  */
 static int someip_add_method(u32 service_id, u32 method_id, const char *name, bool request_response, bool fire_and_forget)
 {
-    int i;
+    int i, ret;
     
-    if (!name) {
+    if (!name || method_id > 0xffff) {
         pr_err("Invalid SOME/IP method parameters\n");
         return -EINVAL;
     }
     
     // Find service
-    struct someip_service *service = NULL;
-    for (i = 0; i < MAX_SOMEIP_SERVICES; i++) {
-        if (global_someip_protocol.services[i].active && 
-            global_someip_protocol.services[i].service_id == service_id) {
-            service = &global_someip_protocol.services[i];
-            break;
-        }
-    }
+    struct someip_service *service = someip_find_service(service_id);
     
     if (!service) {
         pr_err("SOME/IP service 0x%x not found\n", service_id);
@@ -268,6 +538,11 @@ static int someip_add_method(u32 service_id, u32 method_id, const char *name, bo
         return -ENOMEM;
     }
     
+    if (someip_index_get(&service->method_index, method_id) >= 0) {
+        pr_err("SOME/IP method 0x%x already registered in service 0x%x\n", method_id, service_id);
+        return -EEXIST;
+    }
+    
     service->methods[i].method_id = method_id;
     strcpy(service->methods[i].name, name);
     service->methods[i].request_response = request_response;
@@ -279,6 +554,12 @@ static int someip_add_method(u32 service_id, u32 method_id, const char *name, bo
     service->methods[i].execution_time_ms = 0;
     service->methods[i].last_execution_time = 0;
     
+    ret = someip_index_set(&service->method_index, method_id, i);
+    if (ret) {
+        service->methods[i].active = false;
+        return ret;
+    }
+    
     service->method_count++;
     
     pr_info("SOME/IP method %d added to service 0x%x: method_id=0x%x, name=%s, request_response=%s, fire_and_forget=%s\n",
@@ -292,22 +573,15 @@ static int someip_add_method(u32 service_id, u32 method_id, const char *name, bo
  */
 static int someip_add_event(u32 service_id, u32 event_id, const char *name, u32 eventgroup_id)
 {
-    int i;
+    int i, ret;
     
-    if (!name) {
+    if (!name || event_id > 0xffff || eventgroup_id > 0xffff) {
         pr_err("Invalid SOME/IP event parameters\n");
         return -EINVAL;
     }
     
     // Find service
-    struct someip_service *service = NULL;
-    for (i = 0; i < MAX_SOMEIP_SERVICES; i++) {
-        if (global_someip_protocol.services[i].active && 
-            global_someip_protocol.services[i].service_id == service_id) {
-            service = &global_someip_protocol.services[i];
-            break;
-        }
-    }
+    struct someip_service *service = someip_find_service(service_id);
     
     if (!service) {
         pr_err("SOME/IP service 0x%x not found\n", service_id);
@@ -326,6 +600,17 @@ static int someip_add_event(u32 service_id, u32 event_id, const char *name, u32
         return -ENOMEM;
     }
     
+    if (someip_index_get(&service->event_index, event_id) >= 0) {
+        pr_err("SOME/IP event 0x%x already registered in service 0x%x\n", event_id, service_id);
+        return -EEXIST;
+    }
+    
+    ret = someip_eventgroup_add(service, eventgroup_id);
+    if (ret) {
+        pr_err("No free SOME/IP eventgroup slots in service 0x%x\n", service_id);
+        return ret;
+    }
+    
     service->events[i].event_id = event_id;
     strcpy(service->events[i].name, name);
     service->events[i].eventgroup_id = eventgroup_id;
@@ -334,6 +619,12 @@ static int someip_add_event(u32 service_id, u32 event_id, const char *name, u32
     service->events[i].notification_count = 0;
     service->events[i].last_notification_time = 0;
     
+    ret = someip_index_set(&service->event_index, event_id, i);
+    if (ret) {
+        service->events[i].active = false;
+        return ret;
+    }
+    
     service->event_count++;
     
     pr_info("SOME/IP event %d added to service 0x%x: event_id=0x%x, name=%s, eventgroup_id=0x%x\n",
@@ -348,7 +639,7 @@ static int someip_add_event(u32 service_id, u32 event_id, const char *name, u32
 static int someip_method_call(u32 service_id, u32 method_id, const u8 *request_data, u32 request_len,
                               u8 *response_data, u32 *response_len, enum someip_return_code *return_code)
 {
-    int i, j;
+    int j;
     u32 start_time, end_time;
     
     if (!request_data || !response_data || !response_len || !return_code) {
@@ -357,14 +648,7 @@ static int someip_method_call(u32 service_id, u32 method_id, const u8 *request_d
     }
     
     // Find service
-    struct someip_service *service = NULL;
-    for (i = 0; i < MAX_SOMEIP_SERVICES; i++) {
-        if (global_someip_protocol.services[i].active && 
-            global_someip_protocol.services[i].service_id == service_id) {
-            service = &global_someip_protocol.services[i];
-            break;
-        }
-    }
+    struct someip_service *service = someip_find_service(service_id);
     
     if (!service) {
         pr_err("SOME/IP service 0x%x not found\n", service_id);
@@ -374,11 +658,9 @@ static int someip_method_call(u32 service_id, u32 method_id, const u8 *request_d
     
     // Find method
     struct someip_method *method = NULL;
-    for (j = 0; j < service->method_count; j++) {
-        if (service->methods[j].active && service->methods[j].method_id == method_id) {
-            method = &service->methods[j];
-            break;
-        }
+    j = method_id > 0xffff ? -1 : someip_index_get(&service->method_index, method_id);
+    if (j >= 0) {
+        method = &service->methods[j];
     }
     
     if (!method) {
@@ -415,11 +697,50 @@ static int someip_method_call(u32 service_id, u32 method_id, const u8 *request_d
 }
 
 /**
- * SOME/IP event notification
+ * SOME/IP method call with typed request and response, serialized by
+ * their generated code (payload_types.h)
+ */
+static int someip_method_call_typed(u32 service_id, u32 method_id, const struct payload_type *request_type,
+                                    const void *request, const struct payload_type *response_type,
+                                    void *response, enum someip_return_code *return_code)
+{
+    u8 request_data[SOMEIP_TYPED_MAX], response_data[SOMEIP_TYPED_MAX];
+    u32 response_len;
+    int len, ret;
+    
+    if (!request_type || !request || !response_type || !response ||
+        PAYLOAD_SOMEIP_MAX(response_type) > sizeof(response_data)) {
+        return -EINVAL;
+    }
+    
+    len = request_type->someip_put(request, request_data, sizeof(request_data));
+    if (len < 0) {
+        return len;
+    }
+    ret = someip_method_call(service_id, method_id, request_data, len, response_data, &response_len, return_code);
+    if (ret) {
+        return ret;
+    }
+    if (*return_code != SOMEIP_RETURN_CODE_OK) {
+        return 0;
+    }
+    
+    ret = response_type->someip_get(response, response_data, response_len);
+    if (ret) {
+        *return_code = SOMEIP_RETURN_CODE_MALFORMED_MESSAGE;
+    }
+    return ret;
+}
+
+static int someip_eventgroup_notify(struct someip_service *service, struct someip_event *event,
+                                    const u8 *data, u32 len);
+
+/**
+ * SOME/IP event notification, to the subscribers of the event's group
  */
 static int someip_event_notification(u32 service_id, u32 event_id, const u8 *event_data, u32 event_len)
 {
-    int i, j;
+    int j, ret;
     
     if (!event_data) {
         pr_err("Invalid SOME/IP event notification parameters\n");
@@ -427,14 +748,7 @@ static int someip_event_notification(u32 service_id, u32 event_id, const u8 *eve
     }
     
     // Find service
-    struct someip_service *service = NULL;
-    for (i = 0; i < MAX_SOMEIP_SERVICES; i++) {
-        if (global_someip_protocol.services[i].active && 
-            global_someip_protocol.services[i].service_id == service_id) {
-            service = &global_someip_protocol.services[i];
-            break;
-        }
-    }
+    struct someip_service *service = someip_find_service(service_id);
     
     if (!service) {
         pr_err("SOME/IP service 0x%x not found\n", service_id);
@@ -443,11 +757,9 @@ static int someip_event_notification(u32 service_id, u32 event_id, const u8 *eve
     
     // Find event
     struct someip_event *event = NULL;
-    for (j = 0; j < service->event_count; j++) {
-        if (service->events[j].active && service->events[j].event_id == event_id) {
-            event = &service->events[j];
-            break;
-        }
+    j = event_id > 0xffff ? -1 : someip_index_get(&service->event_index, event_id);
+    if (j >= 0) {
+        event = &service->events[j];
     }
     
     if (!event) {
@@ -461,14 +773,922 @@ static int someip_event_notification(u32 service_id, u32 event_id, const u8 *eve
     event->notification_count++;
     event->last_notification_time = jiffies;
     
+    ret = someip_eventgroup_notify(service, event, event_data, event_len);
+    if (ret) {
+        pr_debug("SOME/IP event 0x%x of service 0x%x not delivered to every subscriber: %d\n",
+                 event_id, service_id, ret);
+        return ret;
+    }
+    
+    pr_debug("SOME/IP event notification sent: service=0x%x, event=0x%x, notifications=%d, subscribers=%d\n",
+             service_id, event_id, event->notification_count, event->subscriber_count);
+    
+    return 0;
+}
+
+/**
+ * Register the frame output used by someip_send()
+ */
+static void someip_register_transport(int (*xmit)(void *ctx, const struct someip_endpoint *dst,
+                                                  const struct kvec *iov, int n), void *ctx)
+{
+    global_someip_protocol.xmit_ctx = ctx;
+    global_someip_protocol.xmit = xmit;
+}
+
+static void someip_put_header(u8 *hdr, u32 message_id, u32 request_id, u8 interface_version,
+                              u8 message_type, u8 return_code, u32 body_len)
+{
+    put_unaligned_be32(message_id, hdr);
+    put_unaligned_be32(SOMEIP_LENGTH_COVERED + body_len, hdr + 4);
+    put_unaligned_be32(request_id, hdr + 8);
+    hdr[12] = SOMEIP_PROTOCOL_VERSION;
+    hdr[13] = interface_version;
+    hdr[14] = message_type;
+    hdr[15] = return_code;
+}
+
+/*
+ * Point out[] at len bytes of the payload pieces from offset on, without
+ * copying. Returns the number of pieces used.
+ */
+static int someip_iov_slice(const struct kvec *src, int nsrc, size_t offset, size_t len,
+                            struct kvec *out, int nout)
+{
+    int i, n = 0;
+    
+    for (i = 0; i < nsrc && len; i++) {
+        size_t take;
+    
+        if (offset >= src[i].iov_len) {
+            offset -= src[i].iov_len;
+            continue;
+        }
+        if (n == nout) {
+            return -E2BIG;
+        }
+        take = min(src[i].iov_len - offset, len);
+        out[n].iov_base = (u8 *)src[i].iov_base + offset;
+        out[n].iov_len = take;
+        n++;
+        len -= take;
+        offset = 0;
+    }
+    return n;
+}
+
+// One frame to every destination; the first error is returned
+static int someip_xmit_all(const struct someip_endpoint *dst, int ndst, const struct kvec *iov, int n)
+{
+    int i, ret, err = 0;
+    
+    for (i = 0; i < ndst; i++) {
+        ret = global_someip_protocol.xmit(global_someip_protocol.xmit_ctx, &dst[i], iov, n);
+        if (ret < 0 && !err) {
+            err = ret;
+        }
+    }
+    return err;
+}
+
+/**
+ * Serialize and send a message, zero copy: the header is built on the
+ * stack and the payload pieces go to the transport as they are, so a
+ * payload can sit in a pre-registered network buffer. Messages larger
+ * than a frame are split into SOME/IP-TP segments of
+ * SOMEIP_TP_SEGMENT_LEN, each one header plus slices of the same
+ * pieces. Each frame is serialized once for all ndst destinations.
+ */
+static int someip_send(const struct someip_endpoint *dst, int ndst, u32 message_id, u32 request_id,
+                       u8 interface_version, enum someip_message_type type,
+                       enum someip_return_code return_code, const struct kvec *payload, int npayload)
+{
+    u8 hdr[SOMEIP_HDR_LEN + SOMEIP_TP_HDR_LEN];
+    struct kvec iov[1 + SOMEIP_MAX_IOV];
+    size_t total = 0, offset, seg;
+    int i, n, ret;
+    
+    if (!global_someip_protocol.xmit || !dst || ndst < 1 || npayload < 0 ||
+        npayload > SOMEIP_MAX_IOV || (npayload && !payload)) {
+        return -EINVAL;
+    }
+    for (i = 0; i < npayload; i++) {
+        total += payload[i].iov_len;
+    }
+    
+    if (SOMEIP_HDR_LEN + total <= SOMEIP_MESSAGE_MAX_SIZE) {
+        someip_put_header(hdr, message_id, request_id, interface_version, type, return_code, total);
+        iov[0].iov_base = hdr;
+        iov[0].iov_len = SOMEIP_HDR_LEN;
+        memcpy(&iov[1], payload, npayload * sizeof(*payload));
+        ret = someip_xmit_all(dst, ndst, iov, 1 + npayload);
+        atomic_inc(&global_someip_protocol.total_messages);
+        return ret;
+    }
+    
+    if (total > SOMEIP_TP_MAX_MESSAGE) {
+        return -EMSGSIZE;
+    }
+    // Every segment but the last carries a multiple of 16 bytes
+    for (offset = 0; offset < total; offset += seg) {
+        seg = min_t(size_t, total - offset, SOMEIP_TP_SEGMENT_LEN);
+        someip_put_header(hdr, message_id, request_id, interface_version, type | SOMEIP_TP_FLAG,
+                          return_code, SOMEIP_TP_HDR_LEN + seg);
+        put_unaligned_be32(offset | (offset + seg < total ? SOMEIP_TP_MORE : 0), hdr + SOMEIP_HDR_LEN);
+        iov[0].iov_base = hdr;
+        iov[0].iov_len = sizeof(hdr);
+        n = someip_iov_slice(payload, npayload, offset, seg, &iov[1], SOMEIP_MAX_IOV);
+        if (n < 0) {
+            return n;
+        }
+        ret = someip_xmit_all(dst, ndst, iov, 1 + n);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    atomic_inc(&global_someip_protocol.total_messages);
+    return 0;
+}
+
+static void someip_tp_reset(struct someip_tp_ctx *c)
+{
+    kvfree(c->buf);
+    memset(c, 0, sizeof(*c));
+}
+
+// Context for a first segment: a free one, else the least recently used
+static struct someip_tp_ctx *someip_tp_claim(void)
+{
+    struct someip_tp_ctx *oldest = &someip_tp_ctxs[0];
+    int i;
+    
+    for (i = 0; i < SOMEIP_TP_CONTEXTS; i++) {
+        if (!someip_tp_ctxs[i].active) {
+            return &someip_tp_ctxs[i];
+        }
+        if (time_before(someip_tp_ctxs[i].last, oldest->last)) {
+            oldest = &someip_tp_ctxs[i];
+        }
+    }
+    pr_debug("SOME/IP-TP dropping incomplete message 0x%08x\n", oldest->message_id);
+    someip_tp_reset(oldest);
+    return oldest;
+}
+
+/**
+ * Reassemble SOME/IP-TP segments from one receive context. peer tells
+ * senders apart. Returns 1 with msg filled in once the last segment has
+ * arrived, 0 while more are expected, -ENOMSG for a frame without the TP
+ * flag (to be handled in place), or a negative error; a segment out of
+ * order drops its message, the sender's retry starts it over.
+ */
+static int someip_tp_input(u32 peer, const u8 *frame, size_t len, struct someip_tp_msg *msg)
+{
+    struct someip_tp_ctx *c = NULL;
+    u32 message_id, request_id, tp, body;
+    size_t offset, seg, need;
+    bool more;
+    int i, ret = 0;
+    
+    if (len < SOMEIP_HDR_LEN) {
+        return -EINVAL;
+    }
+    if (!(frame[14] & SOMEIP_TP_FLAG)) {
+        return -ENOMSG;
+    }
+    body = get_unaligned_be32(frame + 4);
+    if (len < SOMEIP_HDR_LEN + SOMEIP_TP_HDR_LEN || body < SOMEIP_LENGTH_COVERED + SOMEIP_TP_HDR_LEN ||
+        body > len - (SOMEIP_HDR_LEN - SOMEIP_LENGTH_COVERED)) {
+        return -EINVAL;
+    }
+    message_id = get_unaligned_be32(frame);
+    request_id = get_unaligned_be32(frame + 8);
+    tp = get_unaligned_be32(frame + SOMEIP_HDR_LEN);
+    offset = tp & ~0xfu;
+    more = tp & SOMEIP_TP_MORE;
+    seg = body - SOMEIP_LENGTH_COVERED - SOMEIP_TP_HDR_LEN;
+    if ((more && (seg & 0xf)) || offset + seg > SOMEIP_TP_MAX_MESSAGE) {
+        return -EINVAL;
+    }
+    
+    mutex_lock(&someip_tp_lock);
+    for (i = 0; i < SOMEIP_TP_CONTEXTS; i++) {
+        if (someip_tp_ctxs[i].active && someip_tp_ctxs[i].peer == peer &&
+            someip_tp_ctxs[i].message_id == message_id && someip_tp_ctxs[i].request_id == request_id) {
+            c = &someip_tp_ctxs[i];
+            break;
+        }
+    }
+    if (!offset) {
+        if (c) {
+            someip_tp_reset(c);
+        } else {
+            c = someip_tp_claim();
+        }
+        c->active = true;
+        c->peer = peer;
+        c->message_id = message_id;
+        c->request_id = request_id;
+        c->interface_version = frame[13];
+        c->message_type = frame[14] & ~SOMEIP_TP_FLAG;
+        c->return_code = frame[15];
+    } else if (!c || offset != c->next) {
+        if (c) {
+            someip_tp_reset(c);
+        }
+        ret = -EPROTO;
+        goto out;
+    }
+    
+    need = offset + seg;
+    if (need > c->cap) {
+        size_t cap = max_t(size_t, need, min_t(size_t, 2 * c->cap, SOMEIP_TP_MAX_MESSAGE));
+        u8 *buf = kvmalloc(max_t(size_t, cap, 4 * SOMEIP_TP_SEGMENT_LEN), GFP_KERNEL);
+    
+        if (!buf) {
+            someip_tp_reset(c);
+            ret = -ENOMEM;
+            goto out;
+        }
+        if (c->next) {
+            memcpy(buf, c->buf, c->next);
+        }
+        kvfree(c->buf);
+        c->buf = buf;
+        c->cap = max_t(size_t, cap, 4 * SOMEIP_TP_SEGMENT_LEN);
+    }
+    memcpy(c->buf + offset, frame + SOMEIP_HDR_LEN + SOMEIP_TP_HDR_LEN, seg);
+    c->next = need;
+    c->last = jiffies;
+    
+    if (!more) {
+        msg->message_id = c->message_id;
+        msg->request_id = c->request_id;
+        msg->interface_version = c->interface_version;
+        msg->message_type = c->message_type;
+        msg->return_code = c->return_code;
+        msg->data = c->buf;
+        msg->len = c->next;
+        c->buf = NULL;
+        someip_tp_reset(c);
+        atomic_inc(&global_someip_protocol.total_messages);
+        ret = 1;
+    }
+    
+out:
+    mutex_unlock(&someip_tp_lock);
+    return ret;
+}
+
+static void someip_tp_free(struct someip_tp_msg *msg)
+{
+    kvfree(msg->data);
+    msg->data = NULL;
+}
+
+/*
+ * SOME/IP Service Discovery. Entries and options are built into and
+ * parsed from flat buffers; every SD message fits one frame.
+ */
+struct someip_sd_builder {
+    u8 entries[SOMEIP_SD_MAX_ACKS * SOMEIP_SD_ENTRY_LEN];
+    int nentries;
+    u8 options[SOMEIP_SD_MAX_ACKS * SOMEIP_SD_OPTION_LEN];
+    int noptions;
+};
+
+static bool someip_endpoint_equal(const struct someip_endpoint *a, const struct someip_endpoint *b)
+{
+    return a->addr == b->addr && a->port == b->port && a->l4_proto == b->l4_proto;
+}
+
+static void someip_sd_put_entry(u8 *p, u8 type, u8 first_option, u8 noptions, u16 service_id,
+                                u16 instance_id, u8 major_version, u32 ttl, u32 tail)
+{
+    p[0] = type;
+    p[1] = first_option;
+    p[2] = 0;
+    p[3] = noptions << 4;
+    put_unaligned_be16(service_id, p + 4);
+    put_unaligned_be16(instance_id, p + 6);
+    p[8] = major_version;
+    p[9] = ttl >> 16;
+    p[10] = ttl >> 8;
+    p[11] = ttl;
+    put_unaligned_be32(tail, p + 12);   // minor version, or counter and eventgroup
+}
+
+static void someip_sd_put_option(u8 *p, u8 type, const struct someip_endpoint *ep)
+{
+    put_unaligned_be16(SOMEIP_SD_OPTION_LEN - 3, p);
+    p[2] = type;
+    p[3] = 0;
+    memcpy(p + 4, &ep->addr, 4);
+    p[8] = 0;
+    p[9] = ep->l4_proto;
+    memcpy(p + 10, &ep->port, 2);
+}
+
+static void someip_sd_get_option(const u8 *p, struct someip_endpoint *ep)
+{
+    memcpy(&ep->addr, p + 4, 4);
+    ep->l4_proto = p[9];
+    memcpy(&ep->port, p + 10, 2);
+}
+
+// Append an entry, with one option of opt_type for ep when ep is given
+static bool someip_sd_add(struct someip_sd_builder *b, u8 type, u16 service_id, u16 instance_id,
+                          u8 major_version, u32 ttl, u32 tail, u8 opt_type,
+                          const struct someip_endpoint *ep)
+{
+    if (b->nentries == SOMEIP_SD_MAX_ACKS || (ep && b->noptions == SOMEIP_SD_MAX_ACKS)) {
+        return false;
+    }
+    someip_sd_put_entry(b->entries + b->nentries++ * SOMEIP_SD_ENTRY_LEN, type, ep ? b->noptions : 0,
+                        ep ? 1 : 0, service_id, instance_id, major_version, ttl, tail);
+    if (ep) {
+        someip_sd_put_option(b->options + b->noptions++ * SOMEIP_SD_OPTION_LEN, opt_type, ep);
+    }
+    return true;
+}
+
+// Under someip_sd_lock. body holds the entries and options with their lengths.
+static int someip_sd_send(const struct someip_endpoint *dst, const u8 *body, size_t len)
+{
+    u8 hdr[SOMEIP_HDR_LEN + SOMEIP_SD_HDR_LEN];
+    struct kvec iov[2];
+    int ret;
+    
+    if (!global_someip_protocol.xmit) {
+        return -ENOTCONN;
+    }
+    someip_put_header(hdr, SOMEIP_SD_MESSAGE_ID, someip_sd.session_id, 1, SOMEIP_MESSAGE_NOTIFICATION,
+                      SOMEIP_RETURN_CODE_OK, SOMEIP_SD_HDR_LEN + len);
+    hdr[SOMEIP_HDR_LEN] = SOMEIP_SD_FLAG_UNICAST | (someip_sd.reboot ? SOMEIP_SD_FLAG_REBOOT : 0);
+    memset(hdr + SOMEIP_HDR_LEN + 1, 0, SOMEIP_SD_HDR_LEN - 1);
+    // Session IDs skip 0; the reboot flag stays up until the first wrap
+    if (++someip_sd.session_id == 0) {
+        someip_sd.session_id = 1;
+        someip_sd.reboot = false;
+    }
+    
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = (void *)body;
+    iov[1].iov_len = len;
+    ret = global_someip_protocol.xmit(global_someip_protocol.xmit_ctx, dst, iov, 2);
     atomic_inc(&global_someip_protocol.total_messages);
+    return ret < 0 ? ret : 0;
+}
+
+// Under someip_sd_lock
+static int someip_sd_send_built(const struct someip_endpoint *dst, const struct someip_sd_builder *b)
+{
+    u8 body[4 + sizeof(b->entries) + 4 + sizeof(b->options)];
+    size_t elen = b->nentries * SOMEIP_SD_ENTRY_LEN, olen = b->noptions * SOMEIP_SD_OPTION_LEN;
+    
+    put_unaligned_be32(elen, body);
+    memcpy(body + 4, b->entries, elen);
+    put_unaligned_be32(olen, body + 4 + elen);
+    memcpy(body + 8 + elen, b->options, olen);
+    return someip_sd_send(dst, body, 8 + elen + olen);
+}
+
+/*
+ * Under someip_sd_lock: serialize the offers of every offered service
+ * into offer_msg. All entries share option 0, our endpoint.
+ */
+static void someip_sd_build_offers(void)
+{
+    u8 *p = someip_sd.offer_msg + 4;
+    int i, n = 0;
+    
+    for (i = 0; i < MAX_SOMEIP_SERVICES; i++) {
+        struct someip_service *service = &global_someip_protocol.services[i];
+    
+        if (!service->active || !service->offered) {
+            continue;
+        }
+        someip_sd_put_entry(p, SOMEIP_SD_OFFER, 0, 1, service->service_id, service->instance_id,
+                            service->major_version, SOMEIP_SD_TTL, service->minor_version);
+        p += SOMEIP_SD_ENTRY_LEN;
+        n++;
+    }
+    put_unaligned_be32(n * SOMEIP_SD_ENTRY_LEN, someip_sd.offer_msg);
+    put_unaligned_be32(SOMEIP_SD_OPTION_LEN, p);
+    someip_sd_put_option(p + 4, SOMEIP_SD_OPT_IPV4, &someip_sd.local);
+    someip_sd.offer_len = p + 4 + SOMEIP_SD_OPTION_LEN - someip_sd.offer_msg;
+    someip_sd.offer_count = n;
+}
+
+// Under someip_sd_lock
+static bool someip_eventgroup_subscribe(struct someip_service *service, struct someip_eventgroup *group,
+                                        const struct someip_endpoint *ep, u32 ttl)
+{
+    struct someip_subscriber *sub = NULL;
+    int i;
+    
+    for (i = 0; i < MAX_SOMEIP_SUBSCRIBERS; i++) {
+        if (group->subscribers[i].active && someip_endpoint_equal(&group->subscribers[i].ep, ep)) {
+            sub = &group->subscribers[i];
+            break;
+        }
+        if (!sub && !group->subscribers[i].active) {
+            sub = &group->subscribers[i];
+        }
+    }
+    if (!sub) {
+        return false;
+    }
+    if (!sub->active) {
+        sub->active = true;
+        sub->ep = *ep;
+        group->subscriber_count++;
+        service->subscriber_count++;
+    }
+    sub->expires = ttl == SOMEIP_SD_TTL_INFINITE ? 0 : jiffies + ttl * HZ;
+    return true;
+}
+
+// Under someip_sd_lock
+static void someip_eventgroup_unsubscribe(struct someip_service *service, struct someip_eventgroup *group,
+                                          struct someip_subscriber *sub)
+{
+    sub->active = false;
+    group->subscriber_count--;
+    service->subscriber_count--;
+}
+
+/**
+ * Set the multicast address an eventgroup is sent to once it has
+ * SOMEIP_MULTICAST_THRESHOLD subscribers
+ */
+static int someip_eventgroup_multicast(u32 service_id, u32 eventgroup_id, const struct someip_endpoint *multicast)
+{
+    struct someip_service *service = someip_find_service(service_id);
+    struct someip_eventgroup *group;
+    int ret = 0;
+    
+    if (!service || !multicast) {
+        return -EINVAL;
+    }
+    
+    mutex_lock(&someip_sd_lock);
+    group = someip_eventgroup_find(service, eventgroup_id);
+    if (group) {
+        group->multicast = *multicast;
+    } else {
+        ret = -ENOENT;
+    }
+    mutex_unlock(&someip_sd_lock);
+    
+    return ret;
+}
+
+/*
+ * Send an event to its eventgroup: one multicast frame once enough
+ * subscribers share it, else the same serialized frame to each of them
+ */
+static int someip_eventgroup_notify(struct someip_service *service, struct someip_event *event,
+                                    const u8 *data, u32 len)
+{
+    struct someip_endpoint dst[MAX_SOMEIP_SUBSCRIBERS];
+    struct kvec payload = { .iov_base = (void *)data, .iov_len = len };
+    struct someip_eventgroup *group;
+    int i, n = 0;
+    
+    mutex_lock(&someip_sd_lock);
+    group = someip_eventgroup_find(service, event->eventgroup_id);
+    if (group && group->multicast.addr && group->subscriber_count >= SOMEIP_MULTICAST_THRESHOLD) {
+        dst[n++] = group->multicast;
+    } else if (group) {
+        for (i = 0; i < MAX_SOMEIP_SUBSCRIBERS; i++) {
+            if (group->subscribers[i].active) {
+                dst[n++] = group->subscribers[i].ep;
+            }
+        }
+    }
+    event->subscriber_count = group ? group->subscriber_count : 0;
+    mutex_unlock(&someip_sd_lock);
+    
+    if (!n) {
+        return 0;
+    }
+    return someip_send(dst, n, service->service_id << 16 | event->event_id, 0, service->major_version,
+                       SOMEIP_MESSAGE_NOTIFICATION, SOMEIP_RETURN_CODE_OK, &payload, 1);
+}
+
+// Under someip_sd_lock
+static struct someip_sd_remote *someip_sd_remote_find(u16 service_id, u16 instance_id)
+{
+    int i;
+    
+    for (i = 0; i < SOMEIP_SD_REMOTE_OFFERS; i++) {
+        struct someip_sd_remote *r = &someip_sd.remote[i];
+    
+        if (r->active && r->service_id == service_id &&
+            (instance_id == SOMEIP_SD_ANY || r->instance_id == instance_id)) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+static bool someip_sd_offered(u16 service_id, u16 instance_id)
+{
+    int i;
+    
+    for (i = 0; i < MAX_SOMEIP_SERVICES; i++) {
+        struct someip_service *service = &global_someip_protocol.services[i];
+    
+        if (service->active && service->offered &&
+            (service_id == SOMEIP_SD_ANY || service->service_id == service_id) &&
+            (instance_id == SOMEIP_SD_ANY || service->instance_id == instance_id)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// First option of type out of the two runs an entry references
+static const u8 *someip_sd_entry_option(const u8 *e, const u8 *const *opt, int nopt, u8 type)
+{
+    int first[2] = { e[1], e[2] }, count[2] = { e[3] >> 4, e[3] & 0xf };
+    int r, k;
+    
+    for (r = 0; r < 2; r++) {
+        for (k = first[r]; k < first[r] + count[r] && k < nopt; k++) {
+            if (opt[k][2] == type && get_unaligned_be16(opt[k]) == SOMEIP_SD_OPTION_LEN - 3) {
+                return opt[k];
+            }
+        }
+    }
+    return NULL;
+}
+
+// Under someip_sd_lock: an Offer or StopOffer from src
+static void someip_sd_offer_entry(const struct someip_endpoint *src, const u8 *e, const u8 *const *opt,
+                                  int nopt, u32 ttl, struct someip_sd_builder *reply)
+{
+    u16 service_id = get_unaligned_be16(e + 4), instance_id = get_unaligned_be16(e + 6);
+    struct someip_sd_remote *r = someip_sd_remote_find(service_id, instance_id);
+    const u8 *o = someip_sd_entry_option(e, opt, nopt, SOMEIP_SD_OPT_IPV4);
+    int i;
+    
+    if (!ttl) {
+        if (r) {
+            r->active = false;
+        }
+        for (i = 0; i < SOMEIP_SD_SUBSCRIPTIONS; i++) {
+            if (someip_sd.subscriptions[i].service_id == service_id) {
+                someip_sd.subscriptions[i].acked = false;
+            }
+        }
+        return;
+    }
+    if (!o) {
+        return;
+    }
+    for (i = 0; !r && i < SOMEIP_SD_REMOTE_OFFERS; i++) {
+        if (!someip_sd.remote[i].active) {
+            r = &someip_sd.remote[i];
+        }
+    }
+    if (!r) {
+        pr_debug("SOME/IP-SD offer cache full, 0x%04x.0x%04x not kept\n", service_id, instance_id);
+        return;
+    }
+    r->active = true;
+    r->service_id = service_id;
+    r->instance_id = instance_id;
+    r->major_version = e[8];
+    r->minor_version = get_unaligned_be32(e + 12);
+    someip_sd_get_option(o, &r->ep);
+    r->sd = *src;
+    r->expires = ttl == SOMEIP_SD_TTL_INFINITE ? 0 : jiffies + ttl * HZ;
+    
+    // Each offer renews the subscriptions to the service
+    for (i = 0; i < SOMEIP_SD_SUBSCRIPTIONS; i++) {
+        struct someip_sd_subscription *s = &someip_sd.subscriptions[i];
+    
+        if (s->active && s->service_id == service_id &&
+            (s->instance_id == SOMEIP_SD_ANY || s->instance_id == instance_id) &&
+            (s->major_version == 0xff || s->major_version == r->major_version)) {
+            someip_sd_add(reply, SOMEIP_SD_SUBSCRIBE, service_id, instance_id, r->major_version,
+                          SOMEIP_SD_TTL, s->eventgroup_id, SOMEIP_SD_OPT_IPV4, &someip_sd.local);
+        }
+    }
+}
+
+// Under someip_sd_lock: a Subscribe or StopSubscribe, answered through reply
+static void someip_sd_subscribe_entry(const u8 *e, const u8 *const *opt, int nopt, u32 ttl,
+                                      struct someip_sd_builder *reply)
+{
+    u16 service_id = get_unaligned_be16(e + 4), instance_id = get_unaligned_be16(e + 6);
+    u32 tail = get_unaligned_be32(e + 12) & 0x000fffff;     // counter and eventgroup
+    struct someip_service *service = someip_find_service(service_id);
+    const u8 *o = someip_sd_entry_option(e, opt, nopt, SOMEIP_SD_OPT_IPV4);
+    struct someip_eventgroup *group = NULL;
+    struct someip_endpoint ep;
+    int i;
+    
+    if (service && service->offered && service->instance_id == instance_id &&
+        e[8] == service->major_version) {
+        group = someip_eventgroup_find(service, tail & 0xffff);
+    }
+    if (o) {
+        someip_sd_get_option(o, &ep);
+    }
+    
+    if (!ttl) {
+        for (i = 0; group && o && i < MAX_SOMEIP_SUBSCRIBERS; i++) {
+            if (group->subscribers[i].active && someip_endpoint_equal(&group->subscribers[i].ep, &ep)) {
+                someip_eventgroup_unsubscribe(service, group, &group->subscribers[i]);
+            }
+        }
+        return;
+    }
+    if (!group || !o || !someip_eventgroup_subscribe(service, group, &ep, ttl)) {
+        someip_sd_add(reply, SOMEIP_SD_SUBSCRIBE_ACK, service_id, instance_id, e[8], 0, tail, 0, NULL);
+        return;
+    }
+    someip_sd_add(reply, SOMEIP_SD_SUBSCRIBE_ACK, service_id, instance_id, e[8], ttl, tail,
+                  SOMEIP_SD_OPT_IPV4_MULTICAST, group->multicast.addr ? &group->multicast : NULL);
+}
+
+// Under someip_sd_lock: the answer to one of our subscriptions
+static void someip_sd_ack_entry(const u8 *e, const u8 *const *opt, int nopt, u32 ttl)
+{
+    u16 service_id = get_unaligned_be16(e + 4), eventgroup_id = get_unaligned_be16(e + 14);
+    const u8 *o = someip_sd_entry_option(e, opt, nopt, SOMEIP_SD_OPT_IPV4_MULTICAST);
+    int i;
+    
+    for (i = 0; i < SOMEIP_SD_SUBSCRIPTIONS; i++) {
+        struct someip_sd_subscription *s = &someip_sd.subscriptions[i];
+    
+        if (!s->active || s->service_id != service_id || s->eventgroup_id != eventgroup_id) {
+            continue;
+        }
+        s->acked = ttl != 0;
+        if (!ttl) {
+            pr_warn("SOME/IP-SD subscription to 0x%04x eventgroup 0x%04x refused\n", service_id, eventgroup_id);
+        } else if (o) {
+            someip_sd_get_option(o, &s->multicast);
+        }
+    }
+}
+
+/**
+ * Handle a received SD message. src is where it came from, the node's
+ * SD endpoint; answers to Find and Subscribe entries go back there in
+ * one message.
+ */
+static int someip_sd_input(const struct someip_endpoint *src, const u8 *frame, size_t len)
+{
+    const u8 *opt[SOMEIP_SD_MAX_OPTIONS], *entries, *options;
+    struct someip_sd_builder reply = { .nentries = 0 };
+    u32 body, entries_len, options_len, ttl;
+    bool answer_find = false;
+    size_t off, olen;
+    int i, nopt = 0;
+    
+    if (!src || len < SOMEIP_HDR_LEN + SOMEIP_SD_HDR_LEN + 8 || get_unaligned_be32(frame) != SOMEIP_SD_MESSAGE_ID) {
+        return -EINVAL;
+    }
+    body = get_unaligned_be32(frame + 4);
+    if (body < SOMEIP_LENGTH_COVERED + SOMEIP_SD_HDR_LEN + 8 || body > len - SOMEIP_LENGTH_COVERED) {
+        return -EINVAL;
+    }
+    len = SOMEIP_LENGTH_COVERED + body;
+    entries = frame + SOMEIP_HDR_LEN + SOMEIP_SD_HDR_LEN + 4;
+    entries_len = get_unaligned_be32(entries - 4);
+    if (entries_len % SOMEIP_SD_ENTRY_LEN || entries_len > len - (entries - frame) - 4) {
+        return -EINVAL;
+    }
+    options = entries + entries_len + 4;
+    options_len = get_unaligned_be32(options - 4);
+    if (options_len > len - (options - frame)) {
+        return -EINVAL;
+    }
+    for (off = 0; off + 3 <= options_len && nopt < SOMEIP_SD_MAX_OPTIONS; off += olen) {
+        olen = 3 + get_unaligned_be16(options + off);
+        if (olen > options_len - off) {
+            return -EINVAL;
+        }
+        opt[nopt++] = options + off;
+    }
     
-    pr_debug("SOME/IP event notification sent: service=0x%x, event=0x%x, notifications=%d\n",
-             service_id, event_id, event->notification_count);
+    mutex_lock(&someip_sd_lock);
+    for (i = 0; i < entries_len / SOMEIP_SD_ENTRY_LEN; i++) {
+        const u8 *e = entries + i * SOMEIP_SD_ENTRY_LEN;
+    
+        ttl = e[9] << 16 | e[10] << 8 | e[11];
+        switch (e[0]) {
+        case SOMEIP_SD_FIND:
+            answer_find |= someip_sd_offered(get_unaligned_be16(e + 4), get_unaligned_be16(e + 6));
+            break;
+        case SOMEIP_SD_OFFER:
+            someip_sd_offer_entry(src, e, opt, nopt, ttl, &reply);
+            break;
+        case SOMEIP_SD_SUBSCRIBE:
+            someip_sd_subscribe_entry(e, opt, nopt, ttl, &reply);
+            break;
+        case SOMEIP_SD_SUBSCRIBE_ACK:
+            someip_sd_ack_entry(e, opt, nopt, ttl);
+            break;
+        default:
+            break;
+        }
+    }
+    if (answer_find && someip_sd.configured) {
+        someip_sd_send(src, someip_sd.offer_msg, someip_sd.offer_len);
+    }
+    if (reply.nentries) {
+        someip_sd_send_built(src, &reply);
+    }
+    mutex_unlock(&someip_sd_lock);
     
     return 0;
 }
 
+/**
+ * Start SD: local is our service endpoint put into offers and
+ * subscriptions, multicast the SD group (usually port 30490)
+ */
+static int someip_sd_configure(const struct someip_endpoint *local, const struct someip_endpoint *multicast)
+{
+    if (!local || !multicast) {
+        return -EINVAL;
+    }
+    
+    mutex_lock(&someip_sd_lock);
+    someip_sd.local = *local;
+    someip_sd.multicast = *multicast;
+    someip_sd.configured = true;
+    someip_sd_build_offers();
+    mutex_unlock(&someip_sd_lock);
+    
+    mod_delayed_work(system_wq, &someip_sd.work, 0);
+    return 0;
+}
+
+/**
+ * Offer a service, or withdraw it with a StopOffer
+ */
+static int someip_sd_offer(u32 service_id, bool offer)
+{
+    struct someip_service *service = someip_find_service(service_id);
+    struct someip_sd_builder stop = { .nentries = 0 };
+    
+    if (!service) {
+        return -EINVAL;
+    }
+    
+    mutex_lock(&someip_sd_lock);
+    if (service->offered != offer) {
+        service->offered = offer;
+        someip_sd_build_offers();
+        if (!offer && someip_sd.configured) {
+            someip_sd_add(&stop, SOMEIP_SD_OFFER, service->service_id, service->instance_id,
+                          service->major_version, 0, service->minor_version, SOMEIP_SD_OPT_IPV4, &someip_sd.local);
+            someip_sd_send_built(&someip_sd.multicast, &stop);
+        }
+    }
+    mutex_unlock(&someip_sd_lock);
+    
+    // Announce at once rather than at the next cycle
+    if (offer && someip_sd.configured) {
+        mod_delayed_work(system_wq, &someip_sd.work, 0);
+    }
+    return 0;
+}
+
+/**
+ * Look a service up in the offer cache. A miss sends a Find and returns
+ * -EAGAIN; the offer it draws fills the cache.
+ */
+static int someip_sd_find(u32 service_id, u32 instance_id, struct someip_endpoint *ep)
+{
+    struct someip_sd_builder find = { .nentries = 0 };
+    struct someip_sd_remote *r;
+    int ret = -EAGAIN;
+    
+    if (service_id > 0xffff || instance_id > 0xffff || !ep) {
+        return -EINVAL;
+    }
+    
+    mutex_lock(&someip_sd_lock);
+    r = someip_sd_remote_find(service_id, instance_id);
+    if (r) {
+        *ep = r->ep;
+        ret = 0;
+    } else if (!someip_sd.configured) {
+        ret = -ENOTCONN;
+    } else {
+        someip_sd_add(&find, SOMEIP_SD_FIND, service_id, instance_id, 0xff, SOMEIP_SD_TTL, 0xffffffff, 0, NULL);
+        someip_sd_send_built(&someip_sd.multicast, &find);
+    }
+    mutex_unlock(&someip_sd_lock);
+    
+    return ret;
+}
+
+/**
+ * Subscribe to, or leave, an eventgroup of a remote service. The
+ * Subscribe goes out now if the service's offer is cached and again
+ * with each offer that follows. A major_version of 0xff takes any.
+ */
+static int someip_sd_subscribe(u32 service_id, u32 instance_id, u8 major_version, u32 eventgroup_id, bool subscribe)
+{
+    struct someip_sd_builder b = { .nentries = 0 };
+    struct someip_sd_subscription *s = NULL;
+    struct someip_sd_remote *r;
+    int i, ret = 0;
+    
+    if (service_id > 0xffff || instance_id > 0xffff || eventgroup_id > 0xffff) {
+        return -EINVAL;
+    }
+    
+    mutex_lock(&someip_sd_lock);
+    for (i = 0; i < SOMEIP_SD_SUBSCRIPTIONS; i++) {
+        struct someip_sd_subscription *t = &someip_sd.subscriptions[i];
+    
+        if (t->active && t->service_id == service_id && t->instance_id == instance_id &&
+            t->eventgroup_id == eventgroup_id) {
+            s = t;
+            break;
+        }
+        if (!s && !t->active && subscribe) {
+            s = t;
+        }
+    }
+    if (!s) {
+        ret = subscribe ? -ENOSPC : -ENOENT;
+        goto out;
+    }
+    
+    if (subscribe) {
+        s->service_id = service_id;
+        s->instance_id = instance_id;
+        s->major_version = major_version;
+        s->eventgroup_id = eventgroup_id;
+    }
+    r = someip_sd_remote_find(service_id, instance_id);
+    if (r && someip_sd.configured) {
+        someip_sd_add(&b, SOMEIP_SD_SUBSCRIBE, r->service_id, r->instance_id, r->major_version,
+                      subscribe ? SOMEIP_SD_TTL : 0, eventgroup_id, SOMEIP_SD_OPT_IPV4, &someip_sd.local);
+        someip_sd_send_built(&r->sd, &b);
+    }
+    if (!s->active && subscribe) {
+        s->active = true;
+        s->acked = false;
+    } else if (!subscribe) {
+        memset(s, 0, sizeof(*s));
+    }
+    
+out:
+    mutex_unlock(&someip_sd_lock);
+    return ret;
+}
+
+// Cyclic offers, and expiry of subscribers and cached offers
+static void someip_sd_work_fn(struct work_struct *work)
+{
+    int i, j, k;
+    
+    mutex_lock(&someip_sd_lock);
+    for (i = 0; i < MAX_SOMEIP_SERVICES; i++) {
+        struct someip_service *service = &global_someip_protocol.services[i];
+    
+        for (j = 0; j < MAX_SOMEIP_EVENTGROUPS; j++) {
+            struct someip_eventgroup *group = &service->eventgroups[j];
+    
+            for (k = 0; group->subscriber_count && k < MAX_SOMEIP_SUBSCRIBERS; k++) {
+                struct someip_subscriber *sub = &group->subscribers[k];
+    
+                if (sub->active && sub->expires && time_after(jiffies, sub->expires)) {
+                    someip_eventgroup_unsubscribe(service, group, sub);
+                }
+            }
+        }
+    }
+    for (i = 0; i < SOMEIP_SD_REMOTE_OFFERS; i++) {
+        struct someip_sd_remote *r = &someip_sd.remote[i];
+    
+        if (r->active && r->expires && time_after(jiffies, r->expires)) {
+            r->active = false;
+        }
+    }
+    if (someip_sd.configured && someip_sd.offer_count) {
+        someip_sd_send(&someip_sd.multicast, someip_sd.offer_msg, someip_sd.offer_len);
+    }
+    mutex_unlock(&someip_sd_lock);
+    
+    if (someip_sd.configured) {
+        mod_delayed_work(system_wq, &someip_sd.work, msecs_to_jiffies(SOMEIP_SD_CYCLIC_OFFER_MS));
+    }
+}
+
 /**
  * Get SOME/IP statistics
  */
@@ -514,6 +1734,12 @@ static int __init someip_protocol_init_module(void)
  */
 static void __exit someip_protocol_cleanup_module(void)
 {
+    int i;
+    
+    cancel_delayed_work_sync(&someip_sd.work);
+    for (i = 0; i < SOMEIP_TP_CONTEXTS; i++) {
+        someip_tp_reset(&someip_tp_ctxs[i]);
+    }
     pr_info("SOME/IP Protocol unloaded\n");
 }
 
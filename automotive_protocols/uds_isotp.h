@@ -0,0 +1,40 @@
+/**
+ * UDS over ISO-TP
+ *
+ * ISO 15765-2 channels in uds_protocol.c, one per ECU, keyed by the CAN
+ * IDs of the two directions. A channel either answers received requests
+ * with the local UDS services (UDS_ISOTP_SERVER), hands each received
+ * message to a registered receiver, or queues it for uds_isotp_recv().
+ * Sends never block; uds_isotp_wait_sent() waits for a segmented message
+ * to leave.
+ */
+
+#ifndef UDS_ISOTP_H
+#define UDS_ISOTP_H
+
+#include <linux/types.h>
+
+#define UDS_ISOTP_CHANNELS 16               // ECUs addressed in parallel, one channel each
+#define UDS_ISOTP_MAX_MESSAGE 65536         // larger first frames are refused with FC overflow
+
+// Channel flags
+#define UDS_ISOTP_FD 0x1                    // CAN-FD frames up to 64 bytes
+#define UDS_ISOTP_SERVER 0x2                // requests received are answered by the services
+
+// Called in process context with each message received; data is only valid during the call
+typedef void (*uds_isotp_receiver_t)(void *arg, const u8 *data, u32 len);
+
+void uds_isotp_register_transport(int (*xmit)(void *ctx, u32 can_id, bool fd, const u8 *data, u8 len),
+                                  void *ctx);
+int uds_isotp_open(u32 tx_id, u32 rx_id, u32 flags, u8 block_size, u8 stmin);
+int uds_isotp_tune(u32 channel, u8 block_size, u8 stmin);
+int uds_isotp_set_receiver(u32 channel, uds_isotp_receiver_t receiver, void *arg);
+int uds_isotp_input(u32 can_id, const u8 *data, u8 len);
+int uds_isotp_send(u32 channel, const u8 *data, u32 len);
+int uds_isotp_wait_sent(u32 channel);
+int uds_isotp_recv(u32 channel, u8 *buffer, u32 max_len, u32 *actual_len, u32 timeout_ms);
+int uds_isotp_request(u32 channel, const u8 *request_data, u32 request_len,
+                      u8 *response_data, u32 max_len, u32 *response_len);
+void uds_download_set_transport_max(u32 max_message);
+
+#endif /* UDS_ISOTP_H */
@@ -5,19 +5,261 @@
  * 
  * Device Tree parsing and manipulation
  * Supports FDT format parsing and node/property access
+ *
+ * Node lookups go through an index built once when the blob is taken
+ * in: every node's full path is hashed to its offset, and every phandle
+ * hashed the same way, so a probe asking for a property costs a hash
+ * probe instead of a walk down from the root. Paths the index does not
+ * hold as written, aliases and names without their unit address, still
+ * resolve through libfdt. Changing the tree moves node offsets, so a
+ * successful set rebuilds the index.
  */
 
 #include <linux/of.h>
 #include <linux/of_fdt.h>
 #include <linux/libfdt.h>
 #include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/stringhash.h>
 
-#define DTB_VERSION "1.0.0"
+#define DTB_VERSION "1.1.0"
 #define MAX_DTB_SIZE (512 * 1024)  // 512KB
+#define DTB_MAX_DEPTH 32
+
+struct dtb_path_slot {
+    u32 hash;
+    int offset;                     // -1 for an empty slot
+    u32 path;                       // into dtb_paths
+};
+
+struct dtb_phandle_slot {
+    u32 phandle;                    // 0 for an empty slot
+    int offset;
+};
 
 static void *dtb_base;
 static size_t dtb_size;
 
+// Both tables are open addressed, a power of two at least twice the node count
+static struct dtb_path_slot *dtb_path_index;
+static struct dtb_phandle_slot *dtb_phandle_index;
+static u32 dtb_index_mask;
+static char *dtb_paths;
+static u32 dtb_node_count;
+
+static u32 dtb_path_hash(const char *path, size_t len)
+{
+    return full_name_hash(NULL, path, len);
+}
+
+static u32 dtb_phandle_hash(u32 phandle)
+{
+    return phandle * 0x9e3779b1;
+}
+
+static void dtb_index_free(void)
+{
+    kfree(dtb_path_index);
+    kfree(dtb_phandle_index);
+    kfree(dtb_paths);
+    dtb_path_index = NULL;
+    dtb_phandle_index = NULL;
+    dtb_paths = NULL;
+    dtb_index_mask = 0;
+    dtb_node_count = 0;
+}
+
+/*
+ * Walk every node once in tree order, keeping the path of the current
+ * branch in buf with its length at each depth. With paths NULL it only
+ * counts nodes and path bytes; otherwise it fills both tables as well.
+ */
+static int dtb_index_walk(char *buf, u32 *nodes, u32 *bytes, char *paths)
+{
+    size_t len_at[DTB_MAX_DEPTH + 1];
+    int offset, depth = 0;
+    u32 n = 0, used = 0;
+    
+    for (offset = 0; offset >= 0; offset = fdt_next_node(dtb_base, offset, &depth)) {
+        const char *name;
+        size_t len;
+        int name_len;
+        u32 phandle;
+        
+        if (depth < 0 || depth > DTB_MAX_DEPTH) {
+            pr_err("DTB: Nodes nest deeper than %d\n", DTB_MAX_DEPTH);
+            return -E2BIG;
+        }
+        
+        name = fdt_get_name(dtb_base, offset, &name_len);
+        if (!name) {
+            return name_len;
+        }
+        
+        if (depth == 0) {
+            len = 1;
+            buf[0] = '/';
+        } else {
+            len = len_at[depth - 1];
+            if (len + 1 + name_len >= PATH_MAX) {
+                return -ENAMETOOLONG;
+            }
+            if (len > 1) {
+                buf[len++] = '/';
+            }
+            memcpy(buf + len, name, name_len);
+            len += name_len;
+        }
+        buf[len] = '\0';
+        len_at[depth] = len;
+        
+        if (paths) {
+            u32 hash = dtb_path_hash(buf, len);
+            u32 slot = hash & dtb_index_mask;
+            
+            while (dtb_path_index[slot].offset >= 0) {
+                slot = (slot + 1) & dtb_index_mask;
+            }
+            dtb_path_index[slot].hash = hash;
+            dtb_path_index[slot].offset = offset;
+            dtb_path_index[slot].path = used;
+            memcpy(paths + used, buf, len + 1);
+            
+            phandle = fdt_get_phandle(dtb_base, offset);
+            if (phandle && phandle != (u32)-1) {
+                slot = dtb_phandle_hash(phandle) & dtb_index_mask;
+                while (dtb_phandle_index[slot].phandle &&
+                       dtb_phandle_index[slot].phandle != phandle) {
+                    slot = (slot + 1) & dtb_index_mask;
+                }
+                // A duplicate phandle keeps the first node, as a tree walk would find it
+                if (!dtb_phandle_index[slot].phandle) {
+                    dtb_phandle_index[slot].phandle = phandle;
+                    dtb_phandle_index[slot].offset = offset;
+                }
+            }
+        }
+        
+        n++;
+        used += len + 1;
+    }
+    
+    if (offset != -FDT_ERR_NOTFOUND) {
+        return offset;
+    }
+    
+    *nodes = n;
+    *bytes = used;
+    return 0;
+}
+
+/**
+ * Build the path and phandle index for the current blob
+ */
+static int dtb_index_build(void)
+{
+    u32 nodes, bytes, size, i;
+    char *buf;
+    int ret;
+    
+    dtb_index_free();
+    
+    buf = kmalloc(PATH_MAX, GFP_KERNEL);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    
+    ret = dtb_index_walk(buf, &nodes, &bytes, NULL);
+    if (ret) {
+        goto out;
+    }
+    
+    size = roundup_pow_of_two(max_t(u32, 2 * nodes, 16));
+    dtb_path_index = kmalloc_array(size, sizeof(*dtb_path_index), GFP_KERNEL);
+    dtb_phandle_index = kcalloc(size, sizeof(*dtb_phandle_index), GFP_KERNEL);
+    dtb_paths = kmalloc(bytes, GFP_KERNEL);
+    if (!dtb_path_index || !dtb_phandle_index || !dtb_paths) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    for (i = 0; i < size; i++) {
+        dtb_path_index[i].offset = -1;
+    }
+    dtb_index_mask = size - 1;
+    
+    ret = dtb_index_walk(buf, &nodes, &bytes, dtb_paths);
+    if (ret) {
+        goto out;
+    }
+    dtb_node_count = nodes;
+    
+    pr_debug("DTB: Indexed %u nodes, %u path bytes\n", nodes, bytes);
+    
+out:
+    if (ret) {
+        pr_err("DTB: Failed to index nodes: %d\n", ret);
+        dtb_index_free();
+    }
+    kfree(buf);
+    return ret;
+}
+
+/**
+ * Find a node by path, through the index when it holds the path as written
+ */
+static int dtb_node_offset(const char *node_path)
+{
+    size_t len = strlen(node_path);
+    u32 hash, slot;
+    
+    if (dtb_path_index) {
+        // Trailing slashes name the same node
+        while (len > 1 && node_path[len - 1] == '/') {
+            len--;
+        }
+        
+        hash = dtb_path_hash(node_path, len);
+        for (slot = hash & dtb_index_mask; dtb_path_index[slot].offset >= 0;
+             slot = (slot + 1) & dtb_index_mask) {
+            const char *path = dtb_paths + dtb_path_index[slot].path;
+            
+            if (dtb_path_index[slot].hash == hash && !strncmp(path, node_path, len) && !path[len]) {
+                return dtb_path_index[slot].offset;
+            }
+        }
+    }
+    
+    return fdt_path_offset(dtb_base, node_path);
+}
+
+/**
+ * Find a node by phandle
+ */
+int dtb_phandle_offset(u32 phandle)
+{
+    u32 slot;
+    
+    if (!dtb_base || !phandle || phandle == (u32)-1) {
+        return -EINVAL;
+    }
+    
+    if (!dtb_phandle_index) {
+        int offset = fdt_node_offset_by_phandle(dtb_base, phandle);
+        
+        return offset < 0 ? -ENOENT : offset;
+    }
+    
+    for (slot = dtb_phandle_hash(phandle) & dtb_index_mask; dtb_phandle_index[slot].phandle;
+         slot = (slot + 1) & dtb_index_mask) {
+        if (dtb_phandle_index[slot].phandle == phandle) {
+            return dtb_phandle_index[slot].offset;
+        }
+    }
+    
+    return -ENOENT;
+}
+EXPORT_SYMBOL_GPL(dtb_phandle_offset);
+
 /**
  * Initialize DTB from memory
  */
@@ -44,7 +286,10 @@ int dtb_init_from_memory(void *base, size_t size)
     dtb_base = base;
     dtb_size = size;
     
-    pr_info("DTB: Initialized, size: %zu bytes\n", size);
+    // Without an index lookups still work, only by walking the tree
+    dtb_index_build();
+    
+    pr_info("DTB: Initialized, size: %zu bytes, %u nodes indexed\n", size, dtb_node_count);
     
     return 0;
 }
@@ -65,7 +310,7 @@ int dtb_get_property(const char *node_path, const char *prop_name,
     }
     
     // Find node
-    node_offset = fdt_path_offset(dtb_base, node_path);
+    node_offset = dtb_node_offset(node_path);
     if (node_offset < 0) {
         pr_err("DTB: Node not found: %s\n", node_path);
         return -ENOENT;
@@ -106,7 +351,7 @@ int dtb_set_property(const char *node_path, const char *prop_name,
     }
     
     // Find or create node
-    node_offset = fdt_path_offset(dtb_base, node_path);
+    node_offset = dtb_node_offset(node_path);
     if (node_offset < 0) {
         // Create node
         node_offset = fdt_add_subnode(dtb_base, 0, node_path);
@@ -120,9 +365,13 @@ int dtb_set_property(const char *node_path, const char *prop_name,
     ret = fdt_setprop(dtb_base, node_offset, prop_name, value, len);
     if (ret) {
         pr_err("DTB: Failed to set property: %s\n", prop_name);
+        dtb_index_build();
         return ret;
     }
     
+    // Offsets after the change have moved
+    dtb_index_build();
+    
     pr_info("DTB: Set property %s/%s, len: %zu\n",
             node_path, prop_name, len);
     
@@ -143,7 +392,7 @@ int dtb_get_compatible(const char *node_path, char **compatibles, int *count)
         return -EINVAL;
     }
     
-    node_offset = fdt_path_offset(dtb_base, node_path);
+    node_offset = dtb_node_offset(node_path);
     if (node_offset < 0) {
         return -ENOENT;
     }
@@ -5,6 +5,14 @@
  * 
  * U-Boot FIT image format parser
  * Handles device tree blob with multiple kernel/ramdisk images
+ *
+ * Several sub-images are loaded as one batch: the hashes of all of them
+ * are handed to the hash engine first, then each image is placed as soon
+ * as its own hash checks out, decompressed or copied straight to its
+ * load address. The default engine hashes on the spot; a board with a
+ * crypto job queue or an idle secondary core overrides fit_hash_submit()
+ * and fit_hash_wait() and the hashing overlaps the placing. Nothing is
+ * ever decompressed before it is verified.
  */
 
 #include <common.h>
@@ -12,9 +20,29 @@
 #include <fit.h>
 #include <fdt_support.h>
 #include <linux/libfdt.h>
+#include <linux/compiler.h>
+#include <hash.h>
+#include <mapmem.h>
+#include <cpu_func.h>
 
-#define FIT_VERSION "1.1.0"
+#define FIT_VERSION "1.2.0"
 #define FIT_MAX_IMAGES 16
+#define FIT_MAX_IMAGE_HASHES 2          // hash nodes checked per image
+#define FIT_HASH_CHUNK (64 * 1024)
+
+/*
+ * One hash to compute. Everything up to value is filled in by the
+ * caller; the engine owns the job until fit_hash_wait() returns.
+ */
+struct fit_hash_job {
+    const char *algo;
+    const void *data;
+    size_t len;
+    uint8_t value[FIT_MAX_HASH_LEN];
+    int value_len;
+    int err;
+    void *priv;                         // the engine's
+};
 
 struct fit_image_info {
     const char *name;
@@ -26,6 +54,14 @@ struct fit_image_info {
     uint8_t comp;
     int arch;
     int os;
+    int noffset;
+    bool sig_nodes;                     // signed images go through fit_image_verify()
+    bool verified;
+    bool checked;                       // hash_jobs back from the engine, verified final
+    int hash_count;
+    struct fit_hash_job hash_jobs[FIT_MAX_IMAGE_HASHES];
+    const uint8_t *hash_expect[FIT_MAX_IMAGE_HASHES];
+    int hash_expect_len[FIT_MAX_IMAGE_HASHES];
 };
 
 static struct fit_image_info fit_images[FIT_MAX_IMAGES];
@@ -135,19 +171,178 @@ static int fit_load_image_data(const void *fit, int noffset,
 }
 
 /**
- * Parse FIT image
+ * Start a hash; the default computes it right away
  */
-int fit_image_load(ulong addr, const char *image_name,
-                   struct fit_image_info *info)
+__weak int fit_hash_submit(struct fit_hash_job *job)
 {
-    const void *fit;
-    int noffset;
+    struct hash_algo *algo;
+    
+    if (hash_lookup_algo(job->algo, &algo)) {
+        job->err = -1;
+        return 0;
+    }
+    algo->hash_func_ws(job->data, job->len, job->value, FIT_HASH_CHUNK);
+    job->value_len = algo->digest_size;
+    job->err = 0;
+    return 0;
+}
+
+/**
+ * Wait for a submitted hash; 0 when job->value holds it
+ */
+__weak int fit_hash_wait(struct fit_hash_job *job)
+{
+    return job->err;
+}
+
+/*
+ * Queue every hash node of an image. Images with signature nodes are
+ * left to fit_image_verify(), which knows the keys.
+ */
+static int fit_queue_image_hashes(const void *fit, struct fit_image_info *info)
+{
+    struct fit_hash_job *job;
+    const char *name;
+    char *algo;
+    uint8_t *value;
+    int noffset, value_len;
+    
+    info->hash_count = 0;
+    info->checked = false;
+    info->sig_nodes = false;
+    info->verified = false;
+    
+    fdt_for_each_subnode(noffset, fit, info->noffset) {
+        name = fit_get_name(fit, noffset, NULL);
+        if (!strncmp(name, FIT_SIG_NODENAME, strlen(FIT_SIG_NODENAME))) {
+            info->sig_nodes = true;
+            continue;
+        }
+        if (strncmp(name, FIT_HASH_NODENAME, strlen(FIT_HASH_NODENAME))) {
+            continue;
+        }
+        if (info->hash_count == FIT_MAX_IMAGE_HASHES) {
+            break;
+        }
+        if (fit_image_hash_get_algo(fit, noffset, &algo) ||
+            fit_image_hash_get_value(fit, noffset, &value, &value_len)) {
+            printf("FIT: Bad hash node '%s'\n", name);
+            return -1;
+        }
+        
+        job = &info->hash_jobs[info->hash_count];
+        memset(job, 0, sizeof(*job));
+        job->algo = algo;
+        job->data = info->data;
+        job->len = info->size;
+        info->hash_expect[info->hash_count] = value;
+        info->hash_expect_len[info->hash_count] = value_len;
+        if (fit_hash_submit(job)) {
+            printf("FIT: Cannot submit %s hash\n", algo);
+            return -1;
+        }
+        info->hash_count++;
+    }
+    return 0;
+}
+
+/*
+ * Wait for an image's hashes and check them and its signature. Checked
+ * once: a later call returns the same verdict, which holds only as long
+ * as the image's data is left alone until it is placed.
+ */
+static int fit_check_image_hashes(const void *fit, struct fit_image_info *info)
+{
+    struct fit_hash_job *job;
+    int i, ret = 0;
+    
+    if (info->checked) {
+        return info->verified ? 0 : -1;
+    }
+    
+    // Every job is waited for, failed or not: the engine must let go of them
+    for (i = 0; i < info->hash_count; i++) {
+        job = &info->hash_jobs[i];
+        if (fit_hash_wait(job) || job->value_len != info->hash_expect_len[i] ||
+            memcmp(job->value, info->hash_expect[i], job->value_len)) {
+            printf("FIT: %s hash mismatch in '%s'\n", job->algo, info->name);
+            ret = -1;
+        }
+    }
+    info->checked = true;
+    
+    if (!ret && info->sig_nodes && fit_image_verify(fit, info->noffset) < 0) {
+        ret = -1;
+    }
+    info->verified = !ret;
+    return ret;
+}
+
+static void fit_drain_image_hashes(struct fit_image_info *info)
+{
+    int i;
+
+    for (i = 0; !info->checked && i < info->hash_count; i++) {
+        fit_hash_wait(&info->hash_jobs[i]);
+    }
+    info->checked = true;
+}
+
+static bool fit_ranges_overlap(ulong a, ulong a_len, ulong b, ulong b_len)
+{
+    return a < b + b_len && b < a + a_len;
+}
+
+/*
+ * Put a verified image at its load address, decompressing in place of
+ * a copy. info->data and info->size describe the loaded image afterwards.
+ */
+static int fit_place_image(struct fit_image_info *info)
+{
+    void *load_buf = map_sysmem(info->load_addr, 0);
+    ulong load_end;
     int ret;
     
-    printf("FIT: Loading image '%s' from 0x%lx\n", image_name, addr);
+    if (info->comp != IH_COMP_NONE) {
+        ret = image_decomp(info->comp, info->load_addr, (ulong)info->data, info->type,
+                           load_buf, info->data, info->size, CONFIG_SYS_BOOTM_LEN, &load_end);
+        if (ret) {
+            printf("FIT: Decompression of '%s' failed\n", info->name);
+            return -1;
+        }
+        info->size = load_end - info->load_addr;
+    } else if (load_buf != info->data) {
+        memmove(load_buf, info->data, info->size);
+    }
+    
+    info->data = load_buf;
+    info->comp = IH_COMP_NONE;
+    flush_cache(info->load_addr, ALIGN(info->size, ARCH_DMA_MINALIGN));
+    return 0;
+}
+
+/**
+ * Load several images of a FIT in one go
+ *
+ * Hashes of all images are queued before the first one is placed, and
+ * each image waits only for its own. An image whose destination could
+ * reach into the FIT has every later image verified first, as their
+ * hashes, expected values and signatures are still read from the FIT.
+ * No destination may overlap the data of another image, in the FIT or
+ * already placed: it would be copied, or left, modified after its check.
+ */
+int fit_images_load(ulong addr, const char * const *names, int count,
+                    struct fit_image_info *infos)
+{
+    const void *fit = (const void *)addr;
+    ulong fit_len, dest_len;
+    int i, j, ret = 0, queued = 0;
+    
+    if (count <= 0 || count > FIT_MAX_IMAGES) {
+        return -1;
+    }
     
     // Check FIT magic
-    fit = (const void *)addr;
     if (fdt_check_header(fit)) {
         printf("FIT: Invalid device tree header\n");
         return -1;
@@ -158,30 +353,77 @@ int fit_image_load(ulong addr, const char *image_name,
         printf("FIT: Invalid FIT format\n");
         return -1;
     }
+    fit_len = fdt_totalsize(fit);
     
-    // Find image node
-    noffset = fit_get_image_node(fit, image_name);
-    if (noffset < 0) {
-        printf("FIT: Image '%s' not found\n", image_name);
-        return -1;
+    for (i = 0; i < count; i++) {
+        printf("FIT: Loading image '%s' from 0x%lx\n", names[i], addr);
+        
+        infos[i].name = names[i];
+        infos[i].hash_count = 0;
+        infos[i].checked = true;        // nothing queued yet
+        infos[i].noffset = fit_get_image_node(fit, names[i]);
+        if (infos[i].noffset < 0) {
+            printf("FIT: Image '%s' not found\n", names[i]);
+            ret = -1;
+            goto out;
+        }
+        
+        if (fit_load_image_data(fit, infos[i].noffset, &infos[i])) {
+            printf("FIT: Failed to load image data\n");
+            ret = -1;
+            goto out;
+        }
+        queued = i + 1;
+        if (fit_queue_image_hashes(fit, &infos[i])) {
+            ret = -1;
+            goto out;
+        }
     }
     
-    // Load image data
-    ret = fit_load_image_data(fit, noffset, info);
-    if (ret) {
-        printf("FIT: Failed to load image data\n");
-        return ret;
+    for (i = 0; i < count; i++) {
+        dest_len = infos[i].comp != IH_COMP_NONE ? CONFIG_SYS_BOOTM_LEN : infos[i].size;
+        for (j = 0; j < count; j++) {
+            if (j != i && fit_ranges_overlap(infos[i].load_addr, dest_len,
+                                             (ulong)infos[j].data, infos[j].size)) {
+                printf("FIT: Load address of '%s' overlaps '%s'\n", names[i], names[j]);
+                ret = -1;
+                goto out;
+            }
+        }
+        if (fit_ranges_overlap(infos[i].load_addr, dest_len, addr, fit_len)) {
+            for (j = i + 1; j < count; j++) {
+                if (fit_check_image_hashes(fit, &infos[j])) {
+                    ret = -1;
+                }
+            }
+        }
+        if (ret || fit_check_image_hashes(fit, &infos[i])) {
+            printf("FIT: Image verification failed\n");
+            ret = -1;
+            goto out;
+        }
+        if (fit_place_image(&infos[i])) {
+            ret = -1;
+            goto out;
+        }
+        printf("FIT: Image '%s' loaded successfully\n", names[i]);
     }
     
-    // Verify hash if present
-    if (fit_image_verify(fit, noffset) < 0) {
-        printf("FIT: Image verification failed\n");
-        return -1;
+out:
+    // Nothing may be left with the engine
+    for (i = 0; i < queued; i++) {
+        fit_drain_image_hashes(&infos[i]);
     }
-    
-    printf("FIT: Image '%s' loaded successfully\n", image_name);
-    
-    return 0;
+    return ret;
+}
+
+/**
+ * Parse FIT image
+ */
+int fit_image_load(ulong addr, const char *image_name,
+                   struct fit_image_info *info)
+{
+    return fit_images_load(addr, &image_name, 1, info);
 }
 
 /**
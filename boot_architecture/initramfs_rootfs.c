@@ -5,6 +5,14 @@
  * 
  * Early userspace filesystem implementation
  * Handles CPIO archive parsing and root filesystem mounting
+ *
+ * The archive is unpacked as a stream, straight from the image: each
+ * compressed segment goes through the decompressor, whose output is fed
+ * to the cpio state machine piece by piece, and raw segments are fed
+ * as they are. Neither the compressed nor the uncompressed archive is
+ * ever copied whole; the only allocations are the files themselves.
+ * Hardlinked files share one copy of their data, whichever link it
+ * arrives with, and a name that appears again replaces the earlier entry.
  */
 
 #include <linux/init.h>
@@ -15,13 +23,35 @@
 #include <linux/vmalloc.h>
 #include <linux/cpio.h>
 #include <linux/initramfs.h>
+#include <linux/hashtable.h>
+#include <linux/stringhash.h>
+#include <linux/refcount.h>
+#include <linux/overflow.h>
+#include <linux/decompress/generic.h>
 
 #define INITRAMFS_MAGIC 0x070701  // New ASCII format
 #define INITRAMFS_MAGIC_OLD 0x070702  // CRC format
-#define MAX_INITRAMFS_SIZE (16 * 1024 * 1024)  // 16MB limit
+#define MAX_INITRAMFS_SIZE (16 * 1024 * 1024)  // 16MB limit on unpacked file data
+#define CPIO_HEADER_SIZE 110
+#define CPIO_FIELDS 13
+
+// newc header fields after the magic, 8 hex digits each
+enum {
+    CPIO_INO, CPIO_MODE, CPIO_UID, CPIO_GID, CPIO_NLINK, CPIO_MTIME, CPIO_FILESIZE,
+    CPIO_MAJOR, CPIO_MINOR, CPIO_RMAJOR, CPIO_RMINOR, CPIO_NAMESIZE, CPIO_CHECK,
+};
+
+// File data, shared by all the links of a hardlinked file
+struct initramfs_blob {
+    refcount_t refs;
+    size_t size;
+    char data[];
+};
 
 struct initramfs_entry {
     struct list_head list;
+    struct hlist_node name_node;
+    struct list_head link_node;         // cpio_link.members, until the trailer
     char *name;
     void *data;
     size_t size;
@@ -29,108 +59,463 @@ struct initramfs_entry {
     uid_t uid;
     gid_t gid;
     unsigned int mtime;
+    struct initramfs_blob *blob;
+};
+
+// Links of one file seen so far in the current archive
+struct cpio_link {
+    struct hlist_node node;
+    u32 major, minor, ino;
+    struct list_head members;
+    struct initramfs_blob *blob;
+};
+
+enum cpio_state {
+    CPIO_START,                         // collecting a header
+    CPIO_NAME,
+    CPIO_NAME_PAD,
+    CPIO_DATA,
+    CPIO_DATA_PAD,
+};
+
+struct cpio_stream {
+    enum cpio_state state;
+    size_t pos;                         // in the current archive, for the 4-byte alignment
+    size_t have;                        // bytes gathered of the header or name
+    size_t want;
+    char header[CPIO_HEADER_SIZE];
+    struct cpio_header hdr;
+    u32 major, minor;
+    char *name;
+    struct initramfs_entry *entry;      // the one receiving data, or NULL to skip it
+    char *out;
+    bool trailer;
+    const char *error;
 };
 
 static LIST_HEAD(initramfs_entries);
-static void *initramfs_data;
-static size_t initramfs_size;
+static DEFINE_HASHTABLE(initramfs_names, 8);
+static DEFINE_HASHTABLE(cpio_links, 6);
+static struct cpio_stream cpio __initdata;
+static size_t initramfs_entry_count;
+static size_t initramfs_size;          // unpacked file data
+
+/*
+ * Hex digit values, 0xff for anything else: one lookup per digit and a
+ * single check per field
+ */
+static const u8 cpio_hex[256] = {
+    [0 ... 255] = 0xff,
+    ['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+    ['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+    ['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+    ['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+};
 
 /**
  * Parse CPIO header
  */
-static int parse_cpio_header(const char *p, struct cpio_header *hdr)
+static int parse_cpio_header(const char *p, struct cpio_header *hdr, u32 *major, u32 *minor)
 {
-    unsigned long ino, mode, nlink, uid, gid, mtime, filesize, namesize;
+    const u8 *s = (const u8 *)p + 6;
+    u32 f[CPIO_FIELDS], v;
+    u8 bad;
+    int i, j;
     
     if (memcmp(p, "070701", 6) != 0 && memcmp(p, "070702", 6) != 0) {
         pr_err("initramfs: Invalid CPIO magic\n");
         return -1;
     }
     
-    ino = cpio_parse_hex8(p + 6);
-    mode = cpio_parse_hex8(p + 14);
-    uid = cpio_parse_hex8(p + 22);
-    gid = cpio_parse_hex8(p + 30);
-    nlink = cpio_parse_hex8(p + 38);
-    mtime = cpio_parse_hex8(p + 46);
-    filesize = cpio_parse_hex8(p + 54);
-    namesize = cpio_parse_hex8(p + 62);
-    
-    hdr->ino = ino;
-    hdr->mode = mode;
-    hdr->uid = uid;
-    hdr->gid = gid;
-    hdr->nlink = nlink;
-    hdr->mtime = mtime;
-    hdr->filesize = filesize;
-    hdr->namesize = namesize;
+    for (i = 0; i < CPIO_FIELDS; i++, s += 8) {
+        v = 0;
+        bad = 0;
+        for (j = 0; j < 8; j++) {
+            v = (v << 4) | (cpio_hex[s[j]] & 0x0f);
+            bad |= cpio_hex[s[j]] & 0xf0;
+        }
+        if (bad) {
+            pr_err("initramfs: Invalid CPIO header field %d\n", i);
+            return -1;
+        }
+        f[i] = v;
+    }
+    
+    hdr->ino = f[CPIO_INO];
+    hdr->mode = f[CPIO_MODE];
+    hdr->uid = f[CPIO_UID];
+    hdr->gid = f[CPIO_GID];
+    hdr->nlink = f[CPIO_NLINK];
+    hdr->mtime = f[CPIO_MTIME];
+    hdr->filesize = f[CPIO_FILESIZE];
+    hdr->namesize = f[CPIO_NAMESIZE];
+    *major = f[CPIO_MAJOR];
+    *minor = f[CPIO_MINOR];
     
     return 0;
 }
 
+static void initramfs_blob_put(struct initramfs_blob *blob)
+{
+    if (blob && refcount_dec_and_test(&blob->refs)) {
+        initramfs_size -= blob->size;
+        kvfree(blob);
+    }
+}
+
+static void initramfs_set_blob(struct initramfs_entry *entry, struct initramfs_blob *blob)
+{
+    refcount_inc(&blob->refs);
+    entry->blob = blob;
+    entry->data = blob->data;
+    entry->size = blob->size;
+}
+
+static struct initramfs_entry *initramfs_find(const char *name)
+{
+    struct initramfs_entry *entry;
+    u32 hash = full_name_hash(NULL, name, strlen(name));
+    
+    hash_for_each_possible(initramfs_names, entry, name_node, hash) {
+        if (!strcmp(entry->name, name)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void initramfs_remove(struct initramfs_entry *entry)
+{
+    list_del(&entry->list);
+    hash_del(&entry->name_node);
+    list_del(&entry->link_node);
+    initramfs_blob_put(entry->blob);
+    kfree(entry->name);
+    kfree(entry);
+    initramfs_entry_count--;
+}
+
+static struct cpio_link *cpio_find_link(u32 major, u32 minor, u32 ino)
+{
+    struct cpio_link *link;
+    
+    hash_for_each_possible(cpio_links, link, node, ino) {
+        if (link->ino == ino && link->major == major && link->minor == minor) {
+            return link;
+        }
+    }
+    
+    link = kzalloc(sizeof(*link), GFP_KERNEL);
+    if (!link) {
+        return NULL;
+    }
+    link->major = major;
+    link->minor = minor;
+    link->ino = ino;
+    INIT_LIST_HEAD(&link->members);
+    hash_add(cpio_links, &link->node, ino);
+    return link;
+}
+
+// Hardlinks never span archives: forget them at each trailer
+static void cpio_free_links(void)
+{
+    struct initramfs_entry *entry, *etmp;
+    struct cpio_link *link;
+    struct hlist_node *tmp;
+    int bkt;
+    
+    hash_for_each_safe(cpio_links, bkt, tmp, link, node) {
+        list_for_each_entry_safe(entry, etmp, &link->members, link_node) {
+            list_del_init(&entry->link_node);
+        }
+        hash_del(&link->node);
+        initramfs_blob_put(link->blob);
+        kfree(link);
+    }
+}
+
 /**
  * Extract file from CPIO archive
+ *
+ * Called once header and name are in: makes the entry and, when the file
+ * has data, the buffer the data is then streamed into
  */
-static int extract_cpio_file(const char *data, size_t *offset)
+static int extract_cpio_file(struct cpio_stream *s)
 {
-    struct cpio_header hdr;
-    struct initramfs_entry *entry;
-    const char *name;
-    void *file_data;
-    size_t name_len, data_len;
-    size_t header_size = 110;  // CPIO header size
-    
-    if (parse_cpio_header(data + *offset, &hdr) < 0)
-        return -1;
+    struct cpio_header *hdr = &s->hdr;
+    struct initramfs_entry *entry, *dup;
+    struct initramfs_blob *blob;
+    struct cpio_link *link = NULL;
     
-    name = data + *offset + header_size;
-    name_len = (hdr.namesize + 3) & ~3;  // Align to 4 bytes
+    s->entry = NULL;
+    if (!strcmp(s->name, "TRAILER!!!")) {
+        kfree(s->name);
+        s->name = NULL;
+        cpio_free_links();
+        s->trailer = true;
+        return 0;
+    }
     
-    // Check for end marker
-    if (strcmp(name, "TRAILER!!!") == 0) {
-        *offset += header_size + name_len;
-        return 1;  // End of archive
+    // A later copy of a name wins, as it would on a real rootfs
+    dup = initramfs_find(s->name);
+    if (dup) {
+        initramfs_remove(dup);
     }
     
-    // Allocate entry
-    entry = kmalloc(sizeof(*entry), GFP_KERNEL);
-    if (!entry)
+    entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+    if (!entry) {
         return -1;
+    }
+    entry->name = s->name;
+    s->name = NULL;
+    entry->mode = hdr->mode;
+    entry->uid = hdr->uid;
+    entry->gid = hdr->gid;
+    entry->mtime = hdr->mtime;
+    INIT_LIST_HEAD(&entry->link_node);
     
-    entry->name = kstrdup(name, GFP_KERNEL);
-    if (!entry->name) {
-        kfree(entry);
-        return -1;
+    if (S_ISREG(entry->mode) && hdr->nlink >= 2) {
+        link = cpio_find_link(s->major, s->minor, hdr->ino);
+        if (!link) {
+            goto err_entry;
+        }
+        list_add_tail(&entry->link_node, &link->members);
+        if (link->blob && !hdr->filesize) {
+            initramfs_set_blob(entry, link->blob);
+        }
     }
     
-    entry->mode = hdr.mode;
-    entry->uid = hdr.uid;
-    entry->gid = hdr.gid;
-    entry->mtime = hdr.mtime;
+    if (hdr->filesize) {
+        if (hdr->filesize > MAX_INITRAMFS_SIZE - initramfs_size) {
+            pr_err("initramfs: Unpacked data over %d bytes\n", MAX_INITRAMFS_SIZE);
+            goto err_link;
+        }
+        blob = kvmalloc(struct_size(blob, data, hdr->filesize), GFP_KERNEL);
+        if (!blob) {
+            goto err_link;
+        }
+        refcount_set(&blob->refs, 1);
+        blob->size = hdr->filesize;
+        initramfs_size += blob->size;
+        entry->blob = blob;
+        entry->data = blob->data;
+        entry->size = blob->size;
+        
+        // The links that came before their data get it now
+        if (link && !link->blob) {
+            struct initramfs_entry *other;
+            
+            link->blob = blob;
+            refcount_inc(&blob->refs);  // the link's own, so replacing a member cannot free it
+            list_for_each_entry(other, &link->members, link_node) {
+                if (other != entry && !other->blob) {
+                    initramfs_set_blob(other, blob);
+                }
+            }
+        }
+        s->entry = entry;
+        s->out = blob->data;
+    }
+    
+    list_add_tail(&entry->list, &initramfs_entries);
+    hash_add(initramfs_names, &entry->name_node, full_name_hash(NULL, entry->name, strlen(entry->name)));
+    initramfs_entry_count++;
+    
+    pr_debug("initramfs: Extracted %s (%zu bytes)\n", entry->name, entry->size);
     
-    data_len = (hdr.filesize + 3) & ~3;  // Align to 4 bytes
+    return 0;
     
-    if (hdr.filesize > 0) {
-        file_data = kmalloc(hdr.filesize, GFP_KERNEL);
-        if (!file_data) {
-            kfree(entry->name);
-            kfree(entry);
+err_link:
+    list_del(&entry->link_node);
+err_entry:
+    kfree(entry->name);
+    kfree(entry);
+    return -1;
+}
+
+static size_t cpio_pad(const struct cpio_stream *s)
+{
+    return (4 - (s->pos & 3)) & 3;
+}
+
+/*
+ * Take the steps that need no input: padding that is already aligned,
+ * files with no data. Returns 1 after a trailer, -1 with s->error set.
+ */
+static int __init cpio_settle(struct cpio_stream *s)
+{
+    for (;;) {
+        if (s->state == CPIO_NAME_PAD && !cpio_pad(s)) {
+            if (extract_cpio_file(s)) {
+                kfree(s->name);
+                s->name = NULL;
+                s->error = "cannot extract";
+                return -1;
+            }
+            s->want = s->hdr.filesize;
+            s->state = CPIO_DATA;
+        } else if (s->state == CPIO_DATA && !s->want) {
+            s->state = CPIO_DATA_PAD;
+        } else if (s->state == CPIO_DATA_PAD && !cpio_pad(s)) {
+            s->state = CPIO_START;
+            if (s->trailer) {
+                s->trailer = false;
+                return 1;
+            }
+        } else {
+            return 0;
+        }
+    }
+}
+
+/*
+ * Feed archive bytes through the state machine. Returns how many were
+ * used, which is less than len only after a trailer when stop_at_trailer
+ * is set, or -1 with s->error set.
+ */
+static long __init cpio_write(struct cpio_stream *s, const char *buf, unsigned long len,
+                              bool stop_at_trailer)
+{
+    unsigned long used = 0;
+    size_t n;
+    int ret;
+    
+    while (used < len) {
+        n = len - used;
+        switch (s->state) {
+        case CPIO_START:
+            // Zero padding between archives
+            if (!s->have && !buf[used]) {
+                used++;
+                continue;
+            }
+            if (!s->have) {
+                s->pos = 0;
+            }
+            n = min(n, CPIO_HEADER_SIZE - s->have);
+            memcpy(s->header + s->have, buf + used, n);
+            s->have += n;
+            if (s->have < CPIO_HEADER_SIZE) {
+                break;
+            }
+            if (parse_cpio_header(s->header, &s->hdr, &s->major, &s->minor) ||
+                !s->hdr.namesize || s->hdr.namesize > PATH_MAX) {
+                s->error = "bad header";
+                return -1;
+            }
+            s->name = kmalloc(s->hdr.namesize, GFP_KERNEL);
+            if (!s->name) {
+                s->error = "out of memory";
+                return -1;
+            }
+            s->have = 0;
+            s->want = s->hdr.namesize;
+            s->state = CPIO_NAME;
+            break;
+        case CPIO_NAME:
+            n = min(n, s->want - s->have);
+            memcpy(s->name + s->have, buf + used, n);
+            s->have += n;
+            if (s->have == s->want) {
+                s->name[s->want - 1] = '\0';
+                s->have = 0;
+                s->state = CPIO_NAME_PAD;
+            }
+            break;
+        case CPIO_NAME_PAD:
+        case CPIO_DATA_PAD:
+            n = min(n, cpio_pad(s));
+            break;
+        case CPIO_DATA:
+            n = min_t(size_t, n, s->want);
+            if (s->entry) {
+                memcpy(s->out, buf + used, n);
+                s->out += n;
+            }
+            s->want -= n;
+            break;
+        }
+        s->pos += n;
+        used += n;
+        
+        ret = cpio_settle(s);
+        if (ret < 0) {
             return -1;
         }
-        memcpy(file_data, data + *offset + header_size + name_len, hdr.filesize);
-        entry->data = file_data;
-        entry->size = hdr.filesize;
-    } else {
-        entry->data = NULL;
-        entry->size = 0;
+        if (ret && stop_at_trailer) {
+            break;
+        }
+    }
+    return used;
+}
+
+static long __init cpio_flush(void *buf, unsigned long len)
+{
+    return cpio_write(&cpio, buf, len, false) < 0 ? -1 : len;
+}
+
+static void __init cpio_decompress_error(char *x)
+{
+    if (!cpio.error) {
+        cpio.error = x;
     }
+}
+
+/*
+ * Walk the segments of an initramfs image: raw cpio, zero padding or
+ * anything the kernel can decompress, in any order
+ */
+static int __init initramfs_unpack(const char *buf, unsigned long len)
+{
+    const char *compress_name;
+    decompress_fn decompress;
+    long written, inpos;
     
-    list_add_tail(&entry->list, &initramfs_entries);
+    memset(&cpio, 0, sizeof(cpio));
     
-    *offset += header_size + name_len + data_len;
+    while (len && !cpio.error) {
+        if (*buf == '0') {
+            written = cpio_write(&cpio, buf, len, true);
+            if (written < 0) {
+                break;
+            }
+            buf += written;
+            len -= written;
+            continue;
+        }
+        if (!*buf) {
+            buf++;
+            len--;
+            continue;
+        }
+        
+        decompress = decompress_method((const unsigned char *)buf, len, &compress_name);
+        if (!decompress) {
+            cpio.error = "unknown compression";
+            break;
+        }
+        pr_debug("initramfs: %s segment\n", compress_name);
+        inpos = 0;
+        if (decompress((unsigned char *)buf, len, NULL, cpio_flush, NULL, &inpos,
+                       cpio_decompress_error) && !cpio.error) {
+            cpio.error = "decompression failed";
+        }
+        buf += inpos;
+        len -= inpos;
+    }
     
-    pr_info("initramfs: Extracted %s (%zu bytes)\n", entry->name, entry->size);
+    if (!cpio.error && (cpio.state != CPIO_START || cpio.have)) {
+        cpio.error = "truncated archive";
+    }
+    kfree(cpio.name);
+    cpio.name = NULL;
+    cpio_free_links();
     
+    if (cpio.error) {
+        pr_err("initramfs: %s\n", cpio.error);
+        return -1;
+    }
     return 0;
 }
 
@@ -140,46 +525,25 @@ static int extract_cpio_file(const char *data, size_t *offset)
 static int __init initramfs_load(void)
 {
     const char *data;
-    size_t offset = 0;
-    int ret;
+    size_t len;
     
     pr_info("initramfs: Loading CPIO archive\n");
     
-    // Get initramfs data (embedded or from bootloader)
+    // Get initramfs data (embedded or from bootloader), unpacked where it lies
     data = (const char *)__initramfs_start;
-    initramfs_size = __initramfs_end - __initramfs_start;
+    len = __initramfs_end - __initramfs_start;
     
-    if (initramfs_size == 0) {
+    if (len == 0) {
         pr_warn("initramfs: No initramfs found\n");
         return 0;
     }
     
-    if (initramfs_size > MAX_INITRAMFS_SIZE) {
-        pr_err("initramfs: Archive too large (%zu bytes)\n", initramfs_size);
-        return -1;
-    }
-    
-    initramfs_data = vmalloc(initramfs_size);
-    if (!initramfs_data) {
-        pr_err("initramfs: Failed to allocate memory\n");
+    if (initramfs_unpack(data, len)) {
         return -1;
     }
     
-    memcpy(initramfs_data, data, initramfs_size);
-    
-    // Parse CPIO archive
-    while (offset < initramfs_size) {
-        ret = extract_cpio_file(initramfs_data, &offset);
-        if (ret > 0)  // End marker
-            break;
-        if (ret < 0) {
-            pr_err("initramfs: Failed to extract file at offset %zu\n", offset);
-            return -1;
-        }
-    }
-    
-    pr_info("initramfs: Loaded %zu entries\n", 
-            list_size(&initramfs_entries));
+    pr_info("initramfs: Loaded %zu entries, %zu bytes\n",
+            initramfs_entry_count, initramfs_size);
     
     return 0;
 }
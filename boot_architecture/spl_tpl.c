@@ -5,6 +5,15 @@
  * 
  * Boot ROM secondary loader for ARM Cortex-A platforms
  * Handles initial DRAM initialization and primary bootloader loading
+ *
+ * DRAM training and the next-stage read overlap. The controller is
+ * started, the boot bus is switched to its fastest mode (eMMC HS200,
+ * quad or octal SPI), and the head of the image is read by DMA into an
+ * SRAM staging area while training runs; once DRAM is up the staged
+ * part is copied to the load address and only the rest is read. Flash
+ * the board maps for XIP is copied straight from the mapping. Boards
+ * opt in through the spl_boot_* hooks and CONFIG_SPL_PREFETCH_ADDR and
+ * _SIZE; without them loading is sequential as before.
  */
 
 #include <common.h>
@@ -13,9 +22,25 @@
 #include <asm/io.h>
 #include <asm/arch/spl.h>
 
-#define SPL_VERSION "1.2.0"
+#define SPL_VERSION "1.3.0"
 #define SPL_MAX_SIZE (64 * 1024)  // 64KB limit
 #define TPL_MAX_SIZE (32 * 1024)  // 32KB limit
+#define DRAM_READY_TIMEOUT_MS 100
+
+#if defined(CONFIG_SPL_PREFETCH_ADDR) && defined(CONFIG_SPL_PREFETCH_SIZE)
+#define SPL_PREFETCH_BUF ((void *)CONFIG_SPL_PREFETCH_ADDR)
+#define SPL_PREFETCH_SIZE CONFIG_SPL_PREFETCH_SIZE
+#else
+#define SPL_PREFETCH_BUF NULL
+#define SPL_PREFETCH_SIZE 0
+#endif
+
+enum spl_prefetch_state {
+    SPL_PF_NONE,
+    SPL_PF_BUSY,
+    SPL_PF_DONE,
+    SPL_PF_XIP,
+};
 
 struct spl_image_info {
     u32 os;
@@ -28,11 +53,55 @@ struct spl_image_info {
 
 static struct spl_image_info spl_image;
 
+static struct {
+    enum spl_prefetch_state state;
+    ulong offs;                     // of the image on the device
+    ulong len;                      // staged or being staged
+    const void *xip;
+} spl_prefetch;
+
+/*
+ * Board hooks. spl_boot_bus_fast switches the boot bus to the fastest
+ * mode both ends support. spl_boot_read_start queues a DMA read of len
+ * bytes at offs on the device, and spl_boot_read_poll reports on it: 1
+ * while it runs, 0 once done, negative on error. spl_boot_xip_base
+ * returns where the device is memory mapped, if it is.
+ */
+__weak int spl_boot_bus_fast(enum boot_device device)
+{
+    return 0;
+}
+
+__weak int spl_boot_read_start(enum boot_device device, ulong offs, void *dst, ulong len)
+{
+    return -ENOSYS;
+}
+
+__weak int spl_boot_read_poll(void)
+{
+    return -ENOSYS;
+}
+
+__weak const void *spl_boot_xip_base(enum boot_device device)
+{
+    return NULL;
+}
+
+static int spl_boot_read_wait(void)
+{
+    int ret;
+    
+    while ((ret = spl_boot_read_poll()) > 0) {
+        ;
+    }
+    return ret;
+}
+
 /**
- * Initialize DRAM controller
- * This runs before main SPL to set up memory
+ * Start the DRAM controller
+ * Training then runs in the controller while SPL gets on with the boot device
  */
-static int spl_dram_init(void)
+static void spl_dram_start(void)
 {
     struct dram_controller *dram;
     u32 reg;
@@ -47,21 +116,129 @@ static int spl_dram_init(void)
     reg = readl(&dram->ctrl);
     reg |= DRAM_CTRL_ENABLE;
     writel(reg, &dram->ctrl);
+}
+
+/**
+ * Wait for DRAM training to finish
+ */
+static int spl_dram_wait(void)
+{
+    struct dram_controller *dram = (struct dram_controller *)DRAM_BASE;
+    ulong start = get_timer(0);
     
-    // Wait for DRAM ready
-    int timeout = 1000;
-    while (timeout-- > 0) {
-        if (readl(&dram->status) & DRAM_STATUS_READY)
-            break;
-        udelay(100);
+    while (!(readl(&dram->status) & DRAM_STATUS_READY)) {
+        if (get_timer(start) > DRAM_READY_TIMEOUT_MS) {
+            printf("SPL: DRAM init timeout\n");
+            return -1;
+        }
+        // Some read paths are driven from here rather than by interrupt
+        if (spl_prefetch.state == SPL_PF_BUSY) {
+            spl_boot_read_poll();
+        }
+        udelay(10);
     }
     
-    if (timeout <= 0) {
-        printf("SPL: DRAM init timeout\n");
-        return -1;
+    printf("SPL: DRAM initialized at 0x%x in %lu ms\n", DRAM_BASE, get_timer(start));
+    return 0;
+}
+
+static ulong spl_image_offset(enum boot_device device)
+{
+    switch (device) {
+#ifdef CONFIG_SYS_MMCSD_RAW_MODE_U_BOOT_SECTOR
+    case BOOT_DEVICE_MMC1:
+        return (ulong)CONFIG_SYS_MMCSD_RAW_MODE_U_BOOT_SECTOR * 512;
+#endif
+#ifdef CONFIG_SYS_SPI_U_BOOT_OFFS
+    case BOOT_DEVICE_SPI:
+        return CONFIG_SYS_SPI_U_BOOT_OFFS;
+#endif
+    default:
+        return (ulong)-1;
     }
+}
+
+/**
+ * Raise the boot bus speed and start reading the image before DRAM is up
+ */
+static void spl_prefetch_start(enum boot_device device)
+{
+    ulong offs = spl_image_offset(device);
+    
+    spl_prefetch.state = SPL_PF_NONE;
+    if (offs == (ulong)-1) {
+        return;
+    }
+    
+    // Without the fast mode the default one still works, only slower
+    if (spl_boot_bus_fast(device)) {
+        printf("SPL: Boot bus stays in default mode\n");
+    }
+    
+    spl_prefetch.offs = offs;
+    spl_prefetch.xip = spl_boot_xip_base(device);
+    if (spl_prefetch.xip) {
+        spl_prefetch.state = SPL_PF_XIP;
+        return;
+    }
+    
+    if (!SPL_PREFETCH_SIZE) {
+        return;
+    }
+    spl_prefetch.len = SPL_PREFETCH_SIZE;
+    if (!spl_boot_read_start(device, offs, SPL_PREFETCH_BUF, spl_prefetch.len)) {
+        spl_prefetch.state = SPL_PF_BUSY;
+    }
+}
+
+/**
+ * Finish loading from what was prefetched
+ *
+ * Returns 1 when there is nothing to go on and the image must be read
+ * the usual way, 0 once it is complete at load_addr.
+ */
+static int spl_prefetch_finish(enum boot_device device, u32 load_addr)
+{
+    const struct image_header *header;
+    ulong total, staged;
     
-    printf("SPL: DRAM initialized at 0x%x\n", DRAM_BASE);
+    if (spl_prefetch.state == SPL_PF_NONE) {
+        return 1;
+    }
+    
+    if (spl_prefetch.state == SPL_PF_XIP) {
+        header = spl_prefetch.xip + spl_prefetch.offs;
+        if (image_get_magic(header) != IH_MAGIC) {
+            return 1;
+        }
+        memcpy((void *)load_addr, header, image_get_image_size(header));
+        return 0;
+    }
+    
+    spl_prefetch.state = SPL_PF_NONE;
+    if (spl_boot_read_wait()) {
+        printf("SPL: Prefetch failed, reading again\n");
+        return 1;
+    }
+    
+    header = SPL_PREFETCH_BUF;
+    if (image_get_magic(header) != IH_MAGIC) {
+        return 1;
+    }
+    
+    total = image_get_image_size(header);
+    staged = min_t(ulong, total, spl_prefetch.len);
+    memcpy((void *)load_addr, SPL_PREFETCH_BUF, staged);
+    
+    if (staged < total) {
+        if (spl_boot_read_start(device, spl_prefetch.offs + staged, (void *)(load_addr + staged),
+                                total - staged) || spl_boot_read_wait()) {
+            printf("SPL: Reading image tail failed, reading again\n");
+            return 1;
+        }
+    }
+    
+    printf("SPL: %lu of %lu bytes read while DRAM trained\n", staged, total);
     return 0;
 }
 
@@ -76,6 +253,10 @@ static int spl_load_image(enum boot_device device)
     
     printf("SPL: Loading from device %d\n", device);
     
+    if (!spl_prefetch_finish(device, load_addr)) {
+        goto loaded;
+    }
+    
     switch (device) {
     case BOOT_DEVICE_MMC1:
         ret = spl_mmc_load_image(CONFIG_SYS_MMCSD_RAW_MODE_U_BOOT_SECTOR,
@@ -97,6 +278,7 @@ static int spl_load_image(enum boot_device device)
         return ret;
     }
     
+loaded:
     header = (struct image_header *)load_addr;
     
     // Verify image header
@@ -151,8 +333,14 @@ void board_init_f(ulong dummy)
     // Initialize board
     board_early_init_f();
     
-    // Initialize DRAM
-    ret = spl_dram_init();
+    // Detect boot device
+    boot_dev = spl_boot_device();
+    printf("SPL: Boot device: %d\n", boot_dev);
+    
+    // Train DRAM while the image head is read into SRAM
+    spl_dram_start();
+    spl_prefetch_start(boot_dev);
+    ret = spl_dram_wait();
     if (ret) {
         hang();
     }
@@ -160,10 +348,6 @@ void board_init_f(ulong dummy)
     // Relocate to DRAM
     spl_relocate_stack_gd();
     
-    // Detect boot device
-    boot_dev = spl_boot_device();
-    printf("SPL: Boot device: %d\n", boot_dev);
-    
     // Load next stage
     ret = spl_load_image(boot_dev);
     if (ret) {
@@ -5,6 +5,15 @@
  * 
  * USB Device Firmware Upgrade protocol implementation
  * Supports firmware updates via USB interface
+ *
+ * Blocks are as large as the transfer_size parameter, advertised as
+ * wTransferSize (the ep0 request buffer has to be at least as big), and
+ * flash is programmed from one block buffer while the host sends the
+ * next into the other. DNLOAD only copies the block and queues its
+ * write; GETSTATUS then reports dfuDNLOAD-IDLE at once while a buffer
+ * is free, and dfuDNBUSY only when both are, with bwPollTimeout set to
+ * what is left of the write in progress at the measured programming
+ * rate. Manifestation waits for the writes still queued the same way.
  */
 
 #include <linux/usb/composite.h>
@@ -12,10 +21,54 @@
 #include <linux/usb/dfu.h>
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/moduleparam.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
 
-#define DFU_VERSION "1.1.0"
-#define DFU_BLOCK_SIZE 1024
-#define DFU_MAX_TRANSFER_SIZE (64 * 1024)
+#define DFU_VERSION "1.2.0"
+#define DFU_MAX_TRANSFER_SIZE (32 * 1024)   // largest wTransferSize offered
+#define DFU_DEFAULT_NS_PER_BYTE 250         // until a write has been timed
+#define DFU_STATUS_ERR_WRITE 0x03
+#define DFU_DT_FUNCTIONAL 0x21
+
+#define DFU_ATTR_CAN_DNLOAD BIT(0)
+#define DFU_ATTR_CAN_UPLOAD BIT(1)
+#define DFU_ATTR_MANIFESTATION_TOLERANT BIT(2)
+#define DFU_ATTR_WILL_DETACH BIT(3)
+
+static unsigned int transfer_size = 4096;
+module_param(transfer_size, uint, 0444);
+MODULE_PARM_DESC(transfer_size, "DFU block size (wTransferSize) in bytes");
+
+/*
+ * Program or read back len bytes at offset in the firmware region;
+ * provided by the platform's flash layer. Writes run on a workqueue and
+ * may sleep; reads come from the control request and must not.
+ */
+int dfu_flash_write(u32 offset, const void *data, size_t len);
+int dfu_flash_read(u32 offset, void *data, size_t len);
+
+struct dfu_function;
+
+struct dfu_block_buf {
+    struct work_struct work;
+    struct dfu_function *dfu;
+    void *data;
+    size_t len;
+    u32 offset;
+    u64 started;                        // ns, 0 while queued
+    bool busy;
+};
+
+struct dfu_functional_descriptor {
+    u8 bLength;
+    u8 bDescriptorType;
+    u8 bmAttributes;
+    __le16 wDetachTimeOut;
+    __le16 wTransferSize;
+    __le16 bcdDFUVersion;
+} __packed;
 
 struct dfu_function {
     struct usb_function function;
@@ -26,9 +79,17 @@ struct dfu_function {
     u16 block_num;
     u16 block_size;
     u32 transfer_size;
-    void *firmware_data;
     size_t firmware_size;
     size_t firmware_offset;
+    
+    struct delayed_work reset_work;
+    struct dfu_functional_descriptor func_desc;
+    struct workqueue_struct *wq;        // ordered: one write in flight at a time
+    spinlock_t lock;                    // buffers, write_err and the rate, against the workqueue
+    struct dfu_block_buf bufs[2];
+    int write_err;
+    u32 ns_per_byte;                    // measured programming rate
+    u16 dnload_block;                   // block whose data stage is being received
 };
 
 static struct dfu_function *dfu_func;
@@ -50,6 +111,132 @@ enum dfu_state {
     DFU_STATE_dfuERROR
 };
 
+static void dfu_block_write_work(struct work_struct *work)
+{
+    struct dfu_block_buf *buf = container_of(work, struct dfu_block_buf, work);
+    struct dfu_function *dfu = buf->dfu;
+    unsigned long flags;
+    u64 start = ktime_get_ns(), elapsed;
+    int ret;
+    
+    spin_lock_irqsave(&dfu->lock, flags);
+    buf->started = start;
+    spin_unlock_irqrestore(&dfu->lock, flags);
+    
+    ret = dfu_flash_write(buf->offset, buf->data, buf->len);
+    elapsed = ktime_get_ns() - start;
+    
+    spin_lock_irqsave(&dfu->lock, flags);
+    if (ret && !dfu->write_err) {
+        dfu->write_err = ret;
+    }
+    // Smoothed, so one slow erase does not make the host wait long on every block
+    if (!ret && buf->len) {
+        u32 rate = div64_u64(elapsed, buf->len);
+        
+        dfu->ns_per_byte = (3 * dfu->ns_per_byte + rate) / 4;
+    }
+    buf->busy = false;
+    spin_unlock_irqrestore(&dfu->lock, flags);
+}
+
+void dfu_function_cleanup(struct dfu_function *dfu)
+{
+    int i;
+    
+    if (dfu->wq) {
+        destroy_workqueue(dfu->wq);     // runs what is still queued first
+        dfu->wq = NULL;
+    }
+    for (i = 0; i < 2; i++) {
+        kfree(dfu->bufs[i].data);
+        dfu->bufs[i].data = NULL;
+    }
+}
+
+/**
+ * Set up what download needs; called from bind, in process context
+ */
+int dfu_function_init(struct dfu_function *dfu)
+{
+    int i;
+    
+    if (transfer_size < 64 || transfer_size > DFU_MAX_TRANSFER_SIZE) {
+        pr_err("DFU: transfer_size %u out of range\n", transfer_size);
+        return -EINVAL;
+    }
+    
+    spin_lock_init(&dfu->lock);
+    dfu->transfer_size = transfer_size;
+    dfu->block_size = transfer_size;
+    dfu->ns_per_byte = DFU_DEFAULT_NS_PER_BYTE;
+    
+    dfu->func_desc.bLength = sizeof(dfu->func_desc);
+    dfu->func_desc.bDescriptorType = DFU_DT_FUNCTIONAL;
+    dfu->func_desc.bmAttributes = DFU_ATTR_CAN_DNLOAD | DFU_ATTR_CAN_UPLOAD |
+                                  DFU_ATTR_MANIFESTATION_TOLERANT | DFU_ATTR_WILL_DETACH;
+    dfu->func_desc.wDetachTimeOut = cpu_to_le16(1000);
+    dfu->func_desc.wTransferSize = cpu_to_le16(dfu->transfer_size);
+    dfu->func_desc.bcdDFUVersion = cpu_to_le16(0x0110);
+    
+    dfu->wq = alloc_ordered_workqueue("dfu_flash", 0);
+    if (!dfu->wq) {
+        return -ENOMEM;
+    }
+    
+    for (i = 0; i < 2; i++) {
+        INIT_WORK(&dfu->bufs[i].work, dfu_block_write_work);
+        dfu->bufs[i].dfu = dfu;
+        dfu->bufs[i].data = kmalloc(dfu->transfer_size, GFP_KERNEL);
+        if (!dfu->bufs[i].data) {
+            dfu_function_cleanup(dfu);
+            return -ENOMEM;
+        }
+    }
+    
+    dfu->state = DFU_STATE_dfuIDLE;
+    return 0;
+}
+
+// Caller holds dfu->lock
+static struct dfu_block_buf *dfu_free_buf(struct dfu_function *dfu)
+{
+    int i;
+    
+    for (i = 0; i < 2; i++) {
+        if (!dfu->bufs[i].busy) {
+            return &dfu->bufs[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Milliseconds until the write in progress is done or, with all, until
+ * every queued one is; caller holds dfu->lock
+ */
+static u32 dfu_write_eta_ms(struct dfu_function *dfu, bool all)
+{
+    u64 now = ktime_get_ns(), left = 0, ns;
+    int i;
+    
+    for (i = 0; i < 2; i++) {
+        struct dfu_block_buf *buf = &dfu->bufs[i];
+        
+        if (!buf->busy || (!all && !buf->started)) {
+            continue;
+        }
+        ns = (u64)buf->len * dfu->ns_per_byte;
+        if (buf->started) {
+            ns = now - buf->started < ns ? ns - (now - buf->started) : 0;
+        }
+        left += ns;
+    }
+    
+    // Never 0 while busy, or the host polls without pause
+    return max_t(u32, DIV_ROUND_UP_ULL(left, NSEC_PER_MSEC), 1);
+}
+
 /**
  * Handle DFU_DETACH request
  */
@@ -67,25 +254,26 @@ static int dfu_handle_detach(struct dfu_function *dfu, u16 timeout)
 
 /**
  * Handle DFU_DNLOAD request
+ *
+ * The block is only copied and queued here; GETSTATUS tells the host
+ * when the next may come.
  */
 static int dfu_handle_dnload(struct dfu_function *dfu, u16 block_num,
                              const void *data, size_t len)
 {
-    int ret;
+    struct dfu_block_buf *buf;
+    unsigned long flags;
     
-    pr_info("DFU: DNLOAD block %d, len %zu\n", block_num, len);
+    pr_debug("DFU: DNLOAD block %d, len %zu\n", block_num, len);
     
     if (block_num == 0) {
         // First block - initialize transfer
-        if (dfu->firmware_data) {
-            vfree(dfu->firmware_data);
-        }
-        
         dfu->firmware_size = 0;
         dfu->firmware_offset = 0;
-        dfu->firmware_data = NULL;
         
-        dfu->state = DFU_STATE_dfuDNLOAD_SYNC;
+        spin_lock_irqsave(&dfu->lock, flags);
+        dfu->write_err = 0;
+        spin_unlock_irqrestore(&dfu->lock, flags);
     }
     
     if (len == 0) {
@@ -95,33 +283,35 @@ static int dfu_handle_dnload(struct dfu_function *dfu, u16 block_num,
         return 0;
     }
     
-    // Allocate or reallocate buffer
-    if (!dfu->firmware_data) {
-        dfu->firmware_data = vmalloc(DFU_MAX_TRANSFER_SIZE);
-        if (!dfu->firmware_data) {
-            pr_err("DFU: Failed to allocate firmware buffer\n");
-            dfu->state = DFU_STATE_dfuERROR;
-            return -ENOMEM;
-        }
+    if (len > dfu->transfer_size) {
+        pr_err("DFU: Block larger than wTransferSize\n");
+        dfu->state = DFU_STATE_dfuERROR;
+        return -EINVAL;
+    }
+    
+    spin_lock_irqsave(&dfu->lock, flags);
+    buf = dfu_free_buf(dfu);
+    if (buf) {
+        buf->busy = true;
+        buf->started = 0;
     }
+    spin_unlock_irqrestore(&dfu->lock, flags);
     
-    // Copy data to buffer
-    if (dfu->firmware_offset + len > DFU_MAX_TRANSFER_SIZE) {
-        pr_err("DFU: Firmware too large\n");
+    // The host was told to wait for a buffer before sending
+    if (!buf) {
+        pr_err("DFU: Block %d arrived while busy\n", block_num);
         dfu->state = DFU_STATE_dfuERROR;
-        return -ENOSPC;
+        return -EBUSY;
     }
     
-    memcpy(dfu->firmware_data + dfu->firmware_offset, data, len);
+    memcpy(buf->data, data, len);
+    buf->len = len;
+    buf->offset = dfu->firmware_offset;
+    queue_work(dfu->wq, &buf->work);
+    
     dfu->firmware_offset += len;
     dfu->firmware_size = dfu->firmware_offset;
-    
-    dfu->state = DFU_STATE_dfuDNBUSY;
-    
-    // Simulate write operation
-    msleep(10);
-    
-    dfu->state = DFU_STATE_dfuDNLOAD_IDLE;
+    dfu->state = DFU_STATE_dfuDNLOAD_SYNC;
     
     return 0;
 }
@@ -134,22 +324,31 @@ static int dfu_handle_upload(struct dfu_function *dfu, u16 block_num,
 {
     size_t offset;
     size_t copy_len;
+    int ret;
     
     pr_info("DFU: UPLOAD block %d\n", block_num);
     
-    if (!dfu->firmware_data || dfu->firmware_size == 0) {
+    if (dfu->firmware_size == 0) {
         *len = 0;
         return 0;
     }
     
-    offset = block_num * DFU_BLOCK_SIZE;
+    offset = (size_t)block_num * dfu->block_size;
     if (offset >= dfu->firmware_size) {
         *len = 0;
         return 0;
     }
     
+    // Not before manifestation has put all of it on flash
+    if (dfu->bufs[0].busy || dfu->bufs[1].busy) {
+        return -EBUSY;
+    }
+    
     copy_len = min_t(size_t, *len, dfu->firmware_size - offset);
-    memcpy(data, dfu->firmware_data + offset, copy_len);
+    ret = dfu_flash_read(offset, data, copy_len);
+    if (ret) {
+        return ret;
+    }
     *len = copy_len;
     
     return 0;
@@ -160,22 +359,66 @@ static int dfu_handle_upload(struct dfu_function *dfu, u16 block_num,
  */
 static void dfu_get_status(struct dfu_function *dfu, struct dfu_status *status)
 {
-    status->bStatus = dfu->status;
-    status->bState = dfu->state;
-    status->iString = 0;
+    unsigned long flags;
+    u32 poll_ms = 0;
+    u8 state;
+    
+    spin_lock_irqsave(&dfu->lock, flags);
+    if (dfu->write_err &&
+        (dfu->state == DFU_STATE_dfuDNLOAD_SYNC || dfu->state == DFU_STATE_dfuDNBUSY ||
+         dfu->state == DFU_STATE_dfuMANIFEST_SYNC)) {
+        dfu->status = DFU_STATUS_ERR_WRITE;
+        dfu->state = DFU_STATE_dfuERROR;
+    }
     
-    // Set poll timeout based on state
+    state = dfu->state;
     switch (dfu->state) {
+    case DFU_STATE_dfuDNLOAD_SYNC:
     case DFU_STATE_dfuDNBUSY:
-        status->bwPollTimeout[0] = 10;  // 10ms
+        // With a buffer free the next block can come while this one programs
+        if (dfu_free_buf(dfu)) {
+            dfu->state = DFU_STATE_dfuDNLOAD_IDLE;
+            state = dfu->state;
+        } else {
+            dfu->state = DFU_STATE_dfuDNBUSY;
+            state = dfu->state;
+            poll_ms = dfu_write_eta_ms(dfu, false);
+        }
         break;
     case DFU_STATE_dfuMANIFEST_SYNC:
-        status->bwPollTimeout[0] = 1000;  // 1s
+        // Manifestation is the queued writes finishing
+        if (dfu->bufs[0].busy || dfu->bufs[1].busy) {
+            state = DFU_STATE_dfuMANIFEST;
+            poll_ms = dfu_write_eta_ms(dfu, true);
+        } else {
+            dfu->state = DFU_STATE_dfuIDLE;
+            state = dfu->state;
+        }
         break;
     default:
-        status->bwPollTimeout[0] = 0;
         break;
     }
+    spin_unlock_irqrestore(&dfu->lock, flags);
+    
+    status->bStatus = dfu->status;
+    status->bState = state;
+    status->iString = 0;
+    
+    // bwPollTimeout is 24 bits, little endian
+    status->bwPollTimeout[0] = poll_ms & 0xff;
+    status->bwPollTimeout[1] = (poll_ms >> 8) & 0xff;
+    status->bwPollTimeout[2] = (poll_ms >> 16) & 0xff;
+}
+
+static void dfu_dnload_complete(struct usb_ep *ep, struct usb_request *req)
+{
+    struct dfu_function *dfu = req->context;
+    
+    if (req->status) {
+        dfu->state = DFU_STATE_dfuERROR;
+        return;
+    }
+    dfu_handle_dnload(dfu, dfu->dnload_block, req->buf, req->actual);
 }
 
 /**
@@ -184,8 +427,8 @@ static void dfu_get_status(struct dfu_function *dfu, struct dfu_status *status)
 static int dfu_setup(struct usb_function *f, const struct usb_ctrlrequest *ctrl)
 {
     struct dfu_function *dfu = func_to_dfu(f);
+    struct usb_request *req = f->config->cdev->req;
     u16 w_value = le16_to_cpu(ctrl->wValue);
-    u16 w_index = le16_to_cpu(ctrl->wIndex);
     u16 w_length = le16_to_cpu(ctrl->wLength);
     int ret = 0;
     
@@ -197,11 +440,29 @@ static int dfu_setup(struct usb_function *f, const struct usb_ctrlrequest *ctrl)
         ret = dfu_handle_detach(dfu, w_value);
         break;
     case USB_DFU_DNLOAD:
-        ret = dfu_handle_dnload(dfu, w_index, NULL, w_length);
+        if (!w_length) {
+            ret = dfu_handle_dnload(dfu, w_value, NULL, 0);
+            break;
+        }
+        if (w_length > dfu->transfer_size) {
+            ret = -EINVAL;
+            break;
+        }
+        // The block arrives in the data stage
+        dfu->dnload_block = w_value;
+        req->context = dfu;
+        req->complete = dfu_dnload_complete;
+        ret = w_length;
         break;
-    case USB_DFU_UPLOAD:
-        ret = dfu_handle_upload(dfu, w_index, NULL, &w_length);
+    case USB_DFU_UPLOAD: {
+        size_t len = w_length;
+            
+        ret = dfu_handle_upload(dfu, w_value, req->buf, &len);
+        if (!ret) {
+            ret = len;
+        }
         break;
+    }
     case USB_DFU_GETSTATUS: {
         struct dfu_status status;
         dfu_get_status(dfu, &status);
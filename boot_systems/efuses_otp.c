@@ -5,21 +5,29 @@
  * 
  * eFuse and OTP memory management
  * Handles secure key storage and device provisioning
+ *
+ * Each region is read into a shadow copy a word at a time on first use,
+ * and every bit and key read after that is served from it. The shadow is
+ * only dropped when the fuses can have changed under it: after a bit is
+ * programmed or the region is locked.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/io.h>
 #include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/delay.h>
 
-#define EFUSE_VERSION "1.0.0"
+#define EFUSE_VERSION "1.1.0"
 #define EFUSE_MAX_BITS 2048
 #define EFUSE_WORD_SIZE 32
 
 struct efuse_region {
     u32 base_addr;
     u32 size_bits;
-    u32 *data;
+    u32 *data;                          // shadow of the fuse words
+    bool shadow_valid;
     bool locked;
     struct mutex lock;
 };
@@ -28,28 +36,69 @@ static struct efuse_region efuse_regions[4];
 static int efuse_region_count;
 
 /**
- * Read eFuse bit
+ * Read the whole region into its shadow, if it is not there already
+ *
+ * Called with the region lock held.
  */
-int efuse_read_bit(int region, int bit)
+static int efuse_shadow_fill(struct efuse_region *r)
 {
-    u32 word;
-    u32 bit_mask;
-    int word_idx;
+    u32 words = DIV_ROUND_UP(r->size_bits, EFUSE_WORD_SIZE);
+    u32 i;
     
-    if (region >= efuse_region_count) {
-        return -EINVAL;
+    if (r->shadow_valid) {
+        return 0;
+    }
+    
+    if (!r->data) {
+        r->data = kcalloc(words, sizeof(u32), GFP_KERNEL);
+        if (!r->data) {
+            return -ENOMEM;
+        }
+    }
+    
+    for (i = 0; i < words; i++) {
+        r->data[i] = readl(r->base_addr + i * 4);
     }
+    r->shadow_valid = true;
     
-    if (bit >= efuse_regions[region].size_bits) {
+    return 0;
+}
+
+/**
+ * Read eFuse bit from the shadow, with the region lock held
+ */
+static int efuse_read_bit_locked(struct efuse_region *r, int bit)
+{
+    int ret;
+    
+    if (bit < 0 || bit >= r->size_bits) {
         return -EINVAL;
     }
     
-    word_idx = bit / EFUSE_WORD_SIZE;
-    bit_mask = 1 << (bit % EFUSE_WORD_SIZE);
+    ret = efuse_shadow_fill(r);
+    if (ret) {
+        return ret;
+    }
     
-    word = readl(efuse_regions[region].base_addr + word_idx * 4);
+    return (r->data[bit / EFUSE_WORD_SIZE] >> (bit % EFUSE_WORD_SIZE)) & 1;
+}
+
+/**
+ * Read eFuse bit
+ */
+int efuse_read_bit(int region, int bit)
+{
+    int ret;
+    
+    if (region < 0 || region >= efuse_region_count) {
+        return -EINVAL;
+    }
     
-    return (word & bit_mask) ? 1 : 0;
+    mutex_lock(&efuse_regions[region].lock);
+    ret = efuse_read_bit_locked(&efuse_regions[region], bit);
+    mutex_unlock(&efuse_regions[region].lock);
+    
+    return ret;
 }
 
 /**
@@ -62,14 +111,14 @@ int efuse_write_bit(int region, int bit)
     int word_idx;
     int ret;
     
-    if (region >= efuse_region_count) {
+    if (region < 0 || region >= efuse_region_count) {
         return -EINVAL;
     }
     
     mutex_lock(&efuse_regions[region].lock);
     
     // Check if already programmed
-    ret = efuse_read_bit(region, bit);
+    ret = efuse_read_bit_locked(&efuse_regions[region], bit);
     if (ret < 0) {
         mutex_unlock(&efuse_regions[region].lock);
         return ret;
@@ -100,6 +149,9 @@ int efuse_write_bit(int region, int bit)
     // Wait for programming to complete
     udelay(100);
     
+    // The fuses changed, whatever the verify says
+    efuse_regions[region].shadow_valid = false;
+    
     // Verify
     word = readl(efuse_regions[region].base_addr + word_idx * 4);
     if (!(word & bit_mask)) {
@@ -120,31 +172,30 @@ int efuse_write_bit(int region, int bit)
  */
 int efuse_read_key(int region, u8 *key, size_t key_len)
 {
-    int i;
-    int bit;
-    u8 byte = 0;
+    struct efuse_region *r;
+    size_t i;
+    int ret;
     
-    if (key_len * 8 > efuse_regions[region].size_bits) {
+    if (region < 0 || region >= efuse_region_count || !key) {
         return -EINVAL;
     }
+    r = &efuse_regions[region];
     
-    for (i = 0; i < key_len * 8; i++) {
-        bit = efuse_read_bit(region, i);
-        if (bit < 0) {
-            return bit;
-        }
-        
-        if (bit) {
-            byte |= (1 << (i % 8));
-        }
-        
-        if ((i + 1) % 8 == 0) {
-            key[i / 8] = byte;
-            byte = 0;
+    if (key_len * 8 > r->size_bits) {
+        return -EINVAL;
+    }
+    
+    mutex_lock(&r->lock);
+    ret = efuse_shadow_fill(r);
+    if (!ret) {
+        // Key bit n is fuse bit n, so each byte is a slice of a shadow word
+        for (i = 0; i < key_len; i++) {
+            key[i] = r->data[i / 4] >> (8 * (i % 4));
         }
     }
+    mutex_unlock(&r->lock);
     
-    return 0;
+    return ret;
 }
 
 /**
@@ -152,7 +203,7 @@ int efuse_read_key(int region, u8 *key, size_t key_len)
  */
 int efuse_lock_region(int region)
 {
-    if (region >= efuse_region_count) {
+    if (region < 0 || region >= efuse_region_count) {
         return -EINVAL;
     }
     
@@ -168,6 +219,9 @@ int efuse_lock_region(int region)
     
     efuse_regions[region].locked = true;
     
+    // Locked fuses may read back differently (or not at all) on some parts
+    efuse_regions[region].shadow_valid = false;
+    
     mutex_unlock(&efuse_regions[region].lock);
     
     pr_info("eFuse: Region %d locked\n", region);
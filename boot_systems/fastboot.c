@@ -5,27 +5,114 @@
  * 
  * Android Fastboot protocol for device flashing
  * Supports partition flashing and device control
+ *
+ * Android sparse images are expanded on the way to the partition: RAW
+ * chunks are written, FILL chunks written as their pattern, DONT_CARE
+ * chunks skipped without touching flash. After "oem stream <partition>"
+ * downloads are not held in memory at all: data is parsed as it comes
+ * off USB into one of two staging buffers, and a full buffer is written
+ * by an ordered workqueue while the other fills, so flashing runs at
+ * the speed of the slower of USB and the partition. The flash command
+ * that follows only reports how the streamed write went. Without the
+ * oem command downloads are buffered and flashed as before.
  */
 
 #include <linux/usb/composite.h>
 #include <linux/usb/gadget.h>
 #include <linux/fastboot.h>
 #include <linux/string.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <asm/unaligned.h>
 
-#define FASTBOOT_VERSION "0.4"
+#define FASTBOOT_VERSION "0.5"
 #define FASTBOOT_MAX_RESPONSE 64
 #define FASTBOOT_MAX_DOWNLOAD (512 * 1024 * 1024)  // 512MB
+#define FASTBOOT_STREAM_BUF (1024 * 1024)          // per staging buffer, a multiple of 4
+
+#define SPARSE_HEADER_MAGIC 0xed26ff3a
+#define SPARSE_HEADER_LEN 28
+#define SPARSE_CHUNK_HEADER_LEN 12
+#define SPARSE_CHUNK_RAW 0xcac1
+#define SPARSE_CHUNK_FILL 0xcac2
+#define SPARSE_CHUNK_DONT_CARE 0xcac3
+#define SPARSE_CHUNK_CRC32 0xcac4
+
+/*
+ * Writes len bytes at offset into the partition; provided by the
+ * platform's partition layer next to fastboot_flash_partition
+ */
+int fastboot_write_partition(const char *partition, u64 offset, const void *data, size_t len);
+
+struct fastboot_sink;
 
 struct fastboot_request {
     char cmd[64];
     size_t cmd_len;
     void *data;
     size_t data_len;
+    size_t received;
+};
+
+struct fastboot_stage {
+    struct work_struct work;
+    struct fastboot_sink *sink;
+    u8 *data;
+    u64 offset;
+    size_t len;
+};
+
+// Where image data goes: staged, then written to the partition in the background
+struct fastboot_sink {
+    const char *partition;
+    struct fastboot_stage stage[2];
+    int cur;
+    u64 offset;                         // of the current stage's first byte
+    size_t fill;
+    int err;                            // first write error, set from the workqueue
+};
+
+enum sparse_state {
+    SPARSE_MAGIC,                       // not yet known to be sparse
+    SPARSE_RAW_IMAGE,                   // it is not: bytes go straight through
+    SPARSE_FILE_HDR,
+    SPARSE_CHUNK_HDR,
+    SPARSE_DATA,
+    SPARSE_FILL_VALUE,
+    SPARSE_SKIP,
+    SPARSE_DONE,
+};
+
+struct fastboot_image {
+    struct fastboot_sink sink;
+    enum sparse_state state;
+    u8 hdr[64];
+    size_t have;                        // bytes gathered into hdr
+    size_t need;
+    u64 left;                           // of the chunk body, or of what is skipped
+    u32 blk_sz;
+    u64 size;                           // expanded
+    u16 file_hdr_sz;
+    u16 chunk_hdr_sz;
+    u32 chunks;
+    u32 chunks_done;
+    u64 out;                            // partition offset of the next byte
+    bool in_chunk;                      // a skip ends a chunk rather than the file header
 };
 
 static struct fastboot_request current_request;
 static char fastboot_response[FASTBOOT_MAX_RESPONSE];
 
+static struct {
+    char partition[32];                 // empty unless "oem stream" armed it
+    bool active;                        // a download is streaming now
+    bool done;                          // and has finished, for the flash command
+    int result;
+    struct fastboot_image image;
+} fastboot_stream;
+
+static struct workqueue_struct *fastboot_wq;
+
 /**
  * Send fastboot response
  */
@@ -37,6 +124,336 @@ static void fastboot_send_response(const char *response)
     pr_info("Fastboot: %s\n", response);
 }
 
+static void fastboot_stage_work(struct work_struct *work)
+{
+    struct fastboot_stage *stage = container_of(work, struct fastboot_stage, work);
+    struct fastboot_sink *sink = stage->sink;
+    int ret;
+    
+    ret = fastboot_write_partition(sink->partition, stage->offset, stage->data, stage->len);
+    if (ret && !sink->err) {
+        sink->err = ret;
+    }
+}
+
+static void fastboot_sink_release(struct fastboot_sink *sink)
+{
+    int i;
+    
+    for (i = 0; i < 2; i++) {
+        vfree(sink->stage[i].data);
+        sink->stage[i].data = NULL;
+    }
+}
+
+static int fastboot_sink_init(struct fastboot_sink *sink, const char *partition)
+{
+    int i;
+    
+    if (!fastboot_wq) {
+        // Ordered, so one write reaches the partition at a time
+        fastboot_wq = alloc_ordered_workqueue("fastboot_flash", 0);
+        if (!fastboot_wq) {
+            return -ENOMEM;
+        }
+    }
+    
+    memset(sink, 0, sizeof(*sink));
+    sink->partition = partition;
+    for (i = 0; i < 2; i++) {
+        INIT_WORK(&sink->stage[i].work, fastboot_stage_work);
+        sink->stage[i].sink = sink;
+        sink->stage[i].data = vmalloc(FASTBOOT_STREAM_BUF);
+        if (!sink->stage[i].data) {
+            fastboot_sink_release(sink);
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Hand the current stage to the workqueue and switch to the other one,
+ * once its previous write is done
+ */
+static void fastboot_sink_submit(struct fastboot_sink *sink)
+{
+    struct fastboot_stage *stage = &sink->stage[sink->cur];
+    
+    if (!sink->fill) {
+        return;
+    }
+    
+    stage->offset = sink->offset;
+    stage->len = sink->fill;
+    queue_work(fastboot_wq, &stage->work);
+    
+    sink->cur ^= 1;
+    flush_work(&sink->stage[sink->cur].work);
+    sink->offset += sink->fill;
+    sink->fill = 0;
+}
+
+// Make room in the current stage for bytes at offset, returning how many fit
+static size_t fastboot_sink_room(struct fastboot_sink *sink, u64 offset)
+{
+    // A gap, skipped DONT_CARE blocks, starts a new write
+    if (offset != sink->offset + sink->fill) {
+        fastboot_sink_submit(sink);
+        sink->offset = offset;
+    }
+    if (sink->fill == FASTBOOT_STREAM_BUF) {
+        fastboot_sink_submit(sink);
+    }
+    return FASTBOOT_STREAM_BUF - sink->fill;
+}
+
+static void fastboot_sink_write(struct fastboot_sink *sink, u64 offset, const u8 *data, size_t len)
+{
+    while (len) {
+        size_t n = min_t(size_t, len, fastboot_sink_room(sink, offset));
+        
+        memcpy(sink->stage[sink->cur].data + sink->fill, data, n);
+        sink->fill += n;
+        offset += n;
+        data += n;
+        len -= n;
+    }
+}
+
+// len and the stage fill are multiples of 4 here, as sparse blocks are
+static void fastboot_sink_fill(struct fastboot_sink *sink, u64 offset, u32 value, u64 len)
+{
+    while (len) {
+        size_t n = min_t(u64, len, fastboot_sink_room(sink, offset));
+        
+        memset32((u32 *)(sink->stage[sink->cur].data + sink->fill), value, n / 4);
+        sink->fill += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+static int fastboot_sink_finish(struct fastboot_sink *sink)
+{
+    fastboot_sink_submit(sink);
+    flush_work(&sink->stage[0].work);
+    flush_work(&sink->stage[1].work);
+    fastboot_sink_release(sink);
+    return sink->err;
+}
+
+static int fastboot_image_begin(struct fastboot_image *img, const char *partition)
+{
+    memset(img, 0, sizeof(*img));
+    img->state = SPARSE_MAGIC;
+    img->need = 4;
+    return fastboot_sink_init(&img->sink, partition);
+}
+
+static int fastboot_sparse_header(struct fastboot_image *img)
+{
+    u16 major = get_unaligned_le16(img->hdr + 4);
+    
+    img->file_hdr_sz = get_unaligned_le16(img->hdr + 8);
+    img->chunk_hdr_sz = get_unaligned_le16(img->hdr + 10);
+    img->blk_sz = get_unaligned_le32(img->hdr + 12);
+    img->size = (u64)get_unaligned_le32(img->hdr + 16) * img->blk_sz;
+    img->chunks = get_unaligned_le32(img->hdr + 20);
+    
+    if (major != 1 || img->file_hdr_sz < SPARSE_HEADER_LEN ||
+        img->chunk_hdr_sz < SPARSE_CHUNK_HEADER_LEN || img->chunk_hdr_sz > sizeof(img->hdr) ||
+        !img->blk_sz || img->blk_sz % 4) {
+        pr_err("Fastboot: Bad sparse header\n");
+        return -EINVAL;
+    }
+    
+    pr_info("Fastboot: Sparse image, %u chunks, %llu bytes expanded\n", img->chunks, img->size);
+    
+    // Whatever a newer header carries past the fields we know is skipped
+    img->left = img->file_hdr_sz - SPARSE_HEADER_LEN;
+    img->in_chunk = false;
+    img->state = SPARSE_SKIP;
+    return 0;
+}
+
+/**
+ * Start a chunk from its gathered header
+ */
+static int fastboot_sparse_chunk(struct fastboot_image *img)
+{
+    u16 type = get_unaligned_le16(img->hdr);
+    u32 chunk_sz = get_unaligned_le32(img->hdr + 4);
+    u32 total_sz = get_unaligned_le32(img->hdr + 8);
+    u64 bytes = (u64)chunk_sz * img->blk_sz;
+    u32 body = total_sz - img->chunk_hdr_sz;
+    
+    if (total_sz < img->chunk_hdr_sz ||
+        (type != SPARSE_CHUNK_CRC32 && img->out + bytes > img->size)) {
+        pr_err("Fastboot: Sparse chunk %u out of bounds\n", img->chunks_done);
+        return -EINVAL;
+    }
+    
+    img->in_chunk = true;
+    switch (type) {
+    case SPARSE_CHUNK_RAW:
+        if (body != bytes) {
+            return -EINVAL;
+        }
+        img->left = bytes;
+        img->state = SPARSE_DATA;
+        break;
+    case SPARSE_CHUNK_FILL:
+        if (body != 4) {
+            return -EINVAL;
+        }
+        img->left = bytes;
+        img->have = 0;
+        img->need = 4;
+        img->state = SPARSE_FILL_VALUE;
+        break;
+    case SPARSE_CHUNK_DONT_CARE:
+        if (body) {
+            return -EINVAL;
+        }
+        // Never staged or written: the next write simply starts further on
+        img->out += bytes;
+        img->left = 0;
+        img->state = SPARSE_SKIP;
+        break;
+    case SPARSE_CHUNK_CRC32:
+        img->left = body;
+        img->state = SPARSE_SKIP;
+        break;
+    default:
+        pr_err("Fastboot: Unknown sparse chunk type 0x%x\n", type);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Move on from a chunk, or from the file header, once all of it is in;
+ * zero-length ones are as soon as they start
+ */
+static void fastboot_sparse_settle(struct fastboot_image *img)
+{
+    if ((img->state != SPARSE_DATA && img->state != SPARSE_SKIP) || img->left) {
+        return;
+    }
+    
+    if (img->in_chunk) {
+        img->chunks_done++;
+    }
+    img->state = img->chunks_done == img->chunks ? SPARSE_DONE : SPARSE_CHUNK_HDR;
+    img->have = 0;
+    img->need = img->chunk_hdr_sz;
+}
+
+/**
+ * Feed downloaded bytes through the sparse parser into the sink
+ */
+static int fastboot_image_feed(struct fastboot_image *img, const u8 *data, size_t len)
+{
+    size_t n;
+    int ret = 0;
+    
+    for (;;) {
+        fastboot_sparse_settle(img);
+        if (!len || ret) {
+            return ret;
+        }
+        
+        switch (img->state) {
+        case SPARSE_MAGIC:
+        case SPARSE_FILE_HDR:
+        case SPARSE_CHUNK_HDR:
+        case SPARSE_FILL_VALUE:
+            n = min_t(size_t, len, img->need - img->have);
+            memcpy(img->hdr + img->have, data, n);
+            img->have += n;
+            data += n;
+            len -= n;
+            if (img->have < img->need) {
+                break;
+            }
+            
+            if (img->state == SPARSE_MAGIC) {
+                if (get_unaligned_le32(img->hdr) == SPARSE_HEADER_MAGIC) {
+                    img->need = SPARSE_HEADER_LEN;
+                    img->state = SPARSE_FILE_HDR;
+                } else {
+                    // A plain image: what was held back for the check goes first
+                    fastboot_sink_write(&img->sink, 0, img->hdr, img->have);
+                    img->out = img->have;
+                    img->state = SPARSE_RAW_IMAGE;
+                }
+            } else if (img->state == SPARSE_FILE_HDR) {
+                ret = fastboot_sparse_header(img);
+            } else if (img->state == SPARSE_CHUNK_HDR) {
+                ret = fastboot_sparse_chunk(img);
+            } else {
+                fastboot_sink_fill(&img->sink, img->out, get_unaligned_le32(img->hdr), img->left);
+                img->out += img->left;
+                img->left = 0;
+                img->state = SPARSE_SKIP;
+            }
+            break;
+        case SPARSE_RAW_IMAGE:
+        case SPARSE_DATA:
+            n = img->state == SPARSE_DATA ? min_t(u64, len, img->left) : len;
+            fastboot_sink_write(&img->sink, img->out, data, n);
+            img->out += n;
+            if (img->state == SPARSE_DATA) {
+                img->left -= n;
+            }
+            data += n;
+            len -= n;
+            break;
+        case SPARSE_SKIP:
+            n = min_t(u64, len, img->left);
+            img->left -= n;
+            data += n;
+            len -= n;
+            break;
+        case SPARSE_DONE:
+            pr_err("Fastboot: Data past the last sparse chunk\n");
+            ret = -EINVAL;
+            break;
+        }
+    }
+}
+
+/**
+ * Finish an image: wait for its writes and check it was complete
+ */
+static int fastboot_image_end(struct fastboot_image *img)
+{
+    int ret = 0;
+    
+    fastboot_sparse_settle(img);
+    if (img->state == SPARSE_MAGIC) {
+        // Shorter than the magic, so not sparse
+        fastboot_sink_write(&img->sink, 0, img->hdr, img->have);
+    } else if (img->state != SPARSE_RAW_IMAGE &&
+               (img->state != SPARSE_DONE || img->out != img->size)) {
+        pr_err("Fastboot: Sparse image truncated at chunk %u of %u\n",
+               img->chunks_done, img->chunks);
+        ret = -EINVAL;
+    }
+    
+    // Even when the image is bad, nothing may still be writing afterwards
+    if (fastboot_sink_finish(&img->sink) && !ret) {
+        ret = img->sink.err;
+    }
+    return ret;
+}
+
+static void fastboot_image_abort(struct fastboot_image *img)
+{
+    fastboot_sink_finish(&img->sink);
+}
+
 /**
  * Handle GETVAR command
  */
@@ -71,21 +488,41 @@ static void fastboot_handle_getvar(const char *var)
 static void fastboot_handle_download(size_t size)
 {
     char response[FASTBOOT_MAX_RESPONSE];
-    
-    if (size > FASTBOOT_MAX_DOWNLOAD) {
-        fastboot_send_response("FAILdownload size too large");
-        return;
-    }
+    int ret;
     
     // Allocate download buffer
     if (current_request.data) {
         vfree(current_request.data);
+        current_request.data = NULL;
+    }
+    if (fastboot_stream.active) {
+        fastboot_image_abort(&fastboot_stream.image);
+        fastboot_stream.active = false;
     }
+    fastboot_stream.done = false;
+    current_request.data_len = 0;
+    current_request.received = 0;
     
-    current_request.data = vmalloc(size);
-    if (!current_request.data) {
-        fastboot_send_response("FAILout of memory");
-        return;
+    if (fastboot_stream.partition[0]) {
+        // Nothing is held, so the size is only bounded by the protocol
+        ret = fastboot_image_begin(&fastboot_stream.image, fastboot_stream.partition);
+        if (ret) {
+            fastboot_send_response("FAILout of memory");
+            return;
+        }
+        fastboot_stream.active = true;
+        fastboot_stream.result = 0;
+    } else {
+        if (size > FASTBOOT_MAX_DOWNLOAD) {
+            fastboot_send_response("FAILdownload size too large");
+            return;
+        }
+        
+        current_request.data = vmalloc(size);
+        if (!current_request.data) {
+            fastboot_send_response("FAILout of memory");
+            return;
+        }
     }
     
     current_request.data_len = size;
@@ -94,6 +531,48 @@ static void fastboot_handle_download(size_t size)
     fastboot_send_response(response);
 }
 
+/**
+ * Take in a piece of the download, in process context, as the USB
+ * function receives it
+ */
+void fastboot_data_received(const void *data, size_t len)
+{
+    len = min_t(size_t, len, current_request.data_len - current_request.received);
+    
+    if (fastboot_stream.active) {
+        // After an error the rest is only counted, to keep in step with the host
+        if (!fastboot_stream.result) {
+            fastboot_stream.result = fastboot_image_feed(&fastboot_stream.image, data, len);
+        }
+    } else if (current_request.data) {
+        memcpy(current_request.data + current_request.received, data, len);
+    } else {
+        return;
+    }
+    
+    current_request.received += len;
+    if (current_request.received < current_request.data_len) {
+        return;
+    }
+    
+    if (fastboot_stream.active) {
+        int ret = fastboot_image_end(&fastboot_stream.image);
+        
+        if (!fastboot_stream.result) {
+            fastboot_stream.result = ret;
+        }
+        fastboot_stream.active = false;
+        fastboot_stream.done = true;
+        if (fastboot_stream.result) {
+            fastboot_send_response("FAILstreamed write failed");
+            return;
+        }
+        pr_info("Fastboot: Streamed %zu bytes to '%s'\n",
+                current_request.data_len, fastboot_stream.partition);
+    }
+    fastboot_send_response("OKAY");
+}
+
 /**
  * Handle FLASH command
  */
@@ -104,14 +583,41 @@ static void fastboot_handle_flash(const char *partition)
     pr_info("Fastboot: Flashing partition '%s', size %zu\n", 
             partition, current_request.data_len);
     
-    if (!current_request.data) {
+    // A streamed download is already on flash; only its outcome is left
+    if (fastboot_stream.done) {
+        fastboot_stream.done = false;
+        if (strcmp(partition, fastboot_stream.partition)) {
+            fastboot_send_response("FAILdownload was streamed elsewhere");
+        } else if (fastboot_stream.result) {
+            fastboot_send_response("FAILflash failed");
+        } else {
+            fastboot_send_response("OKAY");
+        }
+        return;
+    }
+    
+    if (!current_request.data || current_request.received < current_request.data_len) {
         fastboot_send_response("FAILno data to flash");
         return;
     }
     
     // Flash to partition
-    ret = fastboot_flash_partition(partition, current_request.data, 
-                                    current_request.data_len);
+    if (current_request.data_len >= 4 &&
+        get_unaligned_le32(current_request.data) == SPARSE_HEADER_MAGIC) {
+        ret = fastboot_image_begin(&fastboot_stream.image, partition);
+        if (!ret) {
+            ret = fastboot_image_feed(&fastboot_stream.image, current_request.data,
+                                      current_request.data_len);
+            if (ret) {
+                fastboot_image_abort(&fastboot_stream.image);
+            } else {
+                ret = fastboot_image_end(&fastboot_stream.image);
+            }
+        }
+    } else {
+        ret = fastboot_flash_partition(partition, current_request.data, 
+                                        current_request.data_len);
+    }
     if (ret) {
         fastboot_send_response("FAILflash failed");
         return;
@@ -169,7 +675,19 @@ static void fastboot_handle_reboot(const char *arg)
  */
 static void fastboot_handle_oem(const char *cmd)
 {
-    if (strcmp(cmd, "unlock") == 0) {
+    if (strncmp(cmd, "stream", 6) == 0 && (!cmd[6] || cmd[6] == ' ')) {
+        // "oem stream <partition>" streams the downloads after it, "oem stream" stops
+        const char *partition = cmd[6] ? cmd + 7 : "";
+        
+        if (strlen(partition) >= sizeof(fastboot_stream.partition)) {
+            fastboot_send_response("FAILpartition name too long");
+            return;
+        }
+        strcpy(fastboot_stream.partition, partition);
+        pr_info("Fastboot: Streaming downloads %s%s\n", partition[0] ? "to " : "off",
+                partition);
+        fastboot_send_response("OKAY");
+    } else if (strcmp(cmd, "unlock") == 0) {
         pr_info("Fastboot: OEM unlock requested\n");
         fastboot_send_response("OKAY");
     } else if (strcmp(cmd, "lock") == 0) {
@@ -195,6 +713,13 @@ void fastboot_process_command(const char *cmd, size_t len)
     memcpy(command, cmd, len);
     command[len] = '\0';
     
+    // "oem <words>" is separated by a space, not a colon
+    if (strncmp(command, "oem ", 4) == 0) {
+        pr_info("Fastboot: Command 'oem', arg '%s'\n", command + 4);
+        fastboot_handle_oem(command + 4);
+        return;
+    }
+    
     // Find space separator
     space = strchr(command, ':');
     if (space) {
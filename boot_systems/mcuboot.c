@@ -5,18 +5,74 @@
  * 
  * Secure bootloader for microcontroller units
  * Supports A/B image slots and image validation
+ *
+ * Slots are swapped by moving rather than through a scratch area. The
+ * primary slot has one spare sector above the image: the old image is
+ * first shifted up by one sector, top down, and then every sector i
+ * takes the new image's sector i while the secondary's sector i takes
+ * the old one from i + 1. Each sector is erased about twice instead of
+ * three times, and no scratch sector takes the wear of every swap.
+ *
+ * Progress goes to a status area at the top of the primary slot as one
+ * record per step, written before the step and carrying a hash of the
+ * step's source sector. Every step leaves its source intact, so after a
+ * power loss the last recorded step is resumed: if its destination
+ * already hashes the same, the copy had finished and it is not erased
+ * and written again. A record torn by the power loss is skipped over.
  */
 
 #include <mcuboot_config/mcuboot_config.h>
 #include <bootutil/bootutil.h>
 #include <bootutil/image.h>
 #include <bootutil/sign_key.h>
+#include <bootutil/crypto/sha256.h>
 #include <flash_map_backend/flash_map.h>
 
-#define MCUBOOT_VERSION "1.8.0"
+#define MCUBOOT_VERSION "1.9.0"
 #define IMAGE_SLOT_A 0
 #define IMAGE_SLOT_B 1
 
+#ifdef MCUBOOT_SWAP_SECTOR_SIZE
+#define BOOT_SECTOR_SIZE MCUBOOT_SWAP_SECTOR_SIZE  // uniform in both slots
+#else
+#define BOOT_SECTOR_SIZE 4096
+#endif
+#ifdef MCUBOOT_SWAP_STATUS_SECTORS
+#define BOOT_STATUS_SECTORS MCUBOOT_SWAP_STATUS_SECTORS
+#else
+#define BOOT_STATUS_SECTORS 1
+#endif
+
+#define BOOT_MOVE_MAGIC 0x4d4f5645  // "MOVE"
+#define BOOT_MOVE_HASH_LEN 8
+#define BOOT_MOVE_CHECK_LEN 4
+
+// Start of a swap, first in the status area
+struct boot_move_hdr {
+    uint32_t magic;
+    uint16_t sectors;
+    uint8_t swap_type;
+    uint8_t reserved;
+    uint8_t check[8];
+};
+
+// One per step, in the order written
+struct boot_move_rec {
+    uint16_t step;
+    uint16_t reserved;
+    uint8_t hash[BOOT_MOVE_HASH_LEN];
+    uint8_t check[BOOT_MOVE_CHECK_LEN];
+};
+
+struct boot_move {
+    const struct flash_area *pri;
+    const struct flash_area *sec;
+    uint32_t status_off;            // of the status area in the primary slot
+    uint32_t next_rec;              // slot for the next record
+    uint32_t max_recs;
+    uint16_t sectors;               // image sectors being swapped
+};
+
 struct boot_swap_state {
     uint8_t magic;
     uint8_t swap_type;
@@ -35,12 +91,13 @@ static int boot_read_swap_state(int slot, struct boot_swap_state *state)
     const struct flash_area *fap;
     int rc;
     
-    rc = flash_area_open(FLASH_AREA_IMAGE_SCRATCH(slot), &fap);
+    rc = flash_area_open(FLASH_AREA_IMAGE_SLOT(slot), &fap);
     if (rc) {
         return rc;
     }
     
-    rc = flash_area_read(fap, 0, state, sizeof(*state));
+    // At the very end of the slot; there is no scratch area to keep it in
+    rc = flash_area_read(fap, fap->fa_size - sizeof(*state), state, sizeof(*state));
     flash_area_close(fap);
     
     return rc;
@@ -184,6 +241,381 @@ static int boot_copy_image(int src_slot, int dst_slot)
     return rc;
 }
 
+static int boot_move_digest(const void *data, size_t len, uint8_t *out, size_t out_len)
+{
+    bootutil_sha256_context ctx;
+    uint8_t digest[32];
+    
+    bootutil_sha256_init(&ctx);
+    bootutil_sha256_update(&ctx, data, len);
+    bootutil_sha256_finish(&ctx, digest);
+    bootutil_sha256_drop(&ctx);
+    memcpy(out, digest, out_len);
+    return 0;
+}
+
+/**
+ * Hash one sector, truncated to what a status record holds
+ */
+static int boot_hash_sector(const struct flash_area *fap, uint32_t off, uint8_t *hash)
+{
+    bootutil_sha256_context ctx;
+    uint8_t buf[256];
+    uint8_t digest[32];
+    uint32_t pos;
+    int rc = 0;
+    
+    bootutil_sha256_init(&ctx);
+    for (pos = 0; pos < BOOT_SECTOR_SIZE; pos += sizeof(buf)) {
+        rc = flash_area_read(fap, off + pos, buf, sizeof(buf));
+        if (rc) {
+            break;
+        }
+        bootutil_sha256_update(&ctx, buf, sizeof(buf));
+    }
+    bootutil_sha256_finish(&ctx, digest);
+    bootutil_sha256_drop(&ctx);
+    
+    memcpy(hash, digest, BOOT_MOVE_HASH_LEN);
+    return rc;
+}
+
+/**
+ * Erase one sector and copy another into it
+ */
+static int boot_copy_sector(const struct flash_area *src, uint32_t src_off,
+                            const struct flash_area *dst, uint32_t dst_off)
+{
+    uint8_t buf[256];
+    uint32_t pos;
+    int rc;
+    
+    rc = flash_area_erase(dst, dst_off, BOOT_SECTOR_SIZE);
+    if (rc) {
+        return rc;
+    }
+    
+    for (pos = 0; pos < BOOT_SECTOR_SIZE; pos += sizeof(buf)) {
+        rc = flash_area_read(src, src_off + pos, buf, sizeof(buf));
+        if (rc) {
+            return rc;
+        }
+        rc = flash_area_write(dst, dst_off + pos, buf, sizeof(buf));
+        if (rc) {
+            return rc;
+        }
+    }
+    
+    return 0;
+}
+
+/**
+ * Bytes an image occupies in its slot, header and TLVs included; 0 when
+ * the slot holds none
+ */
+static uint32_t boot_image_size(const struct flash_area *fap)
+{
+    struct image_header hdr;
+    struct image_tlv_info info;
+    uint32_t off;
+    
+    if (flash_area_read(fap, 0, &hdr, sizeof(hdr)) || hdr.ih_magic != IMAGE_MAGIC) {
+        return 0;
+    }
+    
+    off = hdr.ih_hdr_size + hdr.ih_img_size;
+    if (flash_area_read(fap, off, &info, sizeof(info))) {
+        return 0;
+    }
+    // Protected TLVs come first, in their own block
+    if (info.it_magic == IMAGE_TLV_PROT_INFO_MAGIC) {
+        off += info.it_tlv_tot;
+        if (flash_area_read(fap, off, &info, sizeof(info))) {
+            return 0;
+        }
+    }
+    if (info.it_magic != IMAGE_TLV_INFO_MAGIC) {
+        return 0;
+    }
+    
+    return off + info.it_tlv_tot;
+}
+
+/*
+ * Steps are numbered in the order they run: the move, sector n - 1 down
+ * to 0, then for each sector the new image into the primary and the old
+ * one into the secondary. Two more numbers mark the swap done and its
+ * request consumed.
+ */
+static void boot_move_step(const struct boot_move *mv, uint32_t step,
+                           const struct flash_area **src, uint32_t *src_off,
+                           const struct flash_area **dst, uint32_t *dst_off)
+{
+    uint32_t i;
+    
+    if (step < mv->sectors) {
+        i = mv->sectors - 1 - step;
+        *src = mv->pri;
+        *src_off = i * BOOT_SECTOR_SIZE;
+        *dst = mv->pri;
+        *dst_off = (i + 1) * BOOT_SECTOR_SIZE;
+    } else if ((step - mv->sectors) % 2 == 0) {
+        i = (step - mv->sectors) / 2;
+        *src = mv->sec;
+        *src_off = i * BOOT_SECTOR_SIZE;
+        *dst = mv->pri;
+        *dst_off = i * BOOT_SECTOR_SIZE;
+    } else {
+        i = (step - mv->sectors) / 2;
+        *src = mv->pri;
+        *src_off = (i + 1) * BOOT_SECTOR_SIZE;
+        *dst = mv->sec;
+        *dst_off = i * BOOT_SECTOR_SIZE;
+    }
+}
+
+static uint32_t boot_move_rec_off(const struct boot_move *mv, uint32_t slot)
+{
+    return mv->status_off + sizeof(struct boot_move_hdr) + slot * sizeof(struct boot_move_rec);
+}
+
+static int boot_move_write_rec(struct boot_move *mv, uint32_t step, const uint8_t *hash)
+{
+    struct boot_move_rec rec;
+    
+    if (mv->next_rec >= mv->max_recs) {
+        printf("MCUboot: Swap status area full\n");
+        return -1;
+    }
+    
+    memset(&rec, 0xff, sizeof(rec));
+    rec.step = step;
+    rec.reserved = 0;
+    if (hash) {
+        memcpy(rec.hash, hash, BOOT_MOVE_HASH_LEN);
+    }
+    boot_move_digest(&rec, offsetof(struct boot_move_rec, check), rec.check, BOOT_MOVE_CHECK_LEN);
+    
+    return flash_area_write(mv->pri, boot_move_rec_off(mv, mv->next_rec++), &rec, sizeof(rec));
+}
+
+static int boot_write_pri_state(const struct flash_area *pri, uint8_t swap_type)
+{
+    struct boot_swap_state state;
+    
+    memset(&state, 0xff, sizeof(state));
+    state.magic = BOOT_MAGIC_GOOD;
+    state.swap_type = swap_type;
+    return flash_area_write(pri, pri->fa_size - sizeof(state), &state, sizeof(state));
+}
+
+/**
+ * Consume the request that started the swap, so it does not run again
+ */
+static int boot_move_consume(struct boot_move *mv)
+{
+    int rc;
+    
+    // The secondary's state sits in its last sector, which the swap never touched
+    rc = flash_area_erase(mv->sec, mv->sec->fa_size - BOOT_SECTOR_SIZE, BOOT_SECTOR_SIZE);
+    if (rc) {
+        return rc;
+    }
+    return boot_move_write_rec(mv, 3 * mv->sectors + 1, NULL);
+}
+
+/**
+ * Run the swap from a step on, recording each step before it starts
+ */
+static int boot_move_run(struct boot_move *mv, uint32_t from)
+{
+    const struct flash_area *src, *dst;
+    uint32_t src_off, dst_off, step;
+    uint8_t hash[BOOT_MOVE_HASH_LEN];
+    int rc;
+    
+    for (step = from; step < 3 * mv->sectors; step++) {
+        boot_move_step(mv, step, &src, &src_off, &dst, &dst_off);
+        
+        rc = boot_hash_sector(src, src_off, hash);
+        if (!rc) {
+            rc = boot_move_write_rec(mv, step, hash);
+        }
+        if (!rc) {
+            rc = boot_copy_sector(src, src_off, dst, dst_off);
+        }
+        if (rc) {
+            printf("MCUboot: Swap step %u failed: %d\n", step, rc);
+            return rc;
+        }
+    }
+    
+    rc = boot_move_write_rec(mv, 3 * mv->sectors, NULL);
+    if (!rc) {
+        rc = boot_move_consume(mv);
+    }
+    return rc;
+}
+
+static int boot_move_open(struct boot_move *mv)
+{
+    int rc;
+    
+    memset(mv, 0, sizeof(*mv));
+    rc = flash_area_open(FLASH_AREA_IMAGE_SLOT(IMAGE_SLOT_A), &mv->pri);
+    if (rc) {
+        return rc;
+    }
+    rc = flash_area_open(FLASH_AREA_IMAGE_SLOT(IMAGE_SLOT_B), &mv->sec);
+    if (rc) {
+        flash_area_close(mv->pri);
+        return rc;
+    }
+    
+    // The slot state is kept clear of the records, in the last 16 bytes
+    mv->status_off = mv->pri->fa_size - BOOT_STATUS_SECTORS * BOOT_SECTOR_SIZE;
+    mv->max_recs = (BOOT_STATUS_SECTORS * BOOT_SECTOR_SIZE - sizeof(struct boot_move_hdr) - 16) /
+                   sizeof(struct boot_move_rec);
+    return 0;
+}
+
+static void boot_move_close(struct boot_move *mv)
+{
+    flash_area_close(mv->pri);
+    flash_area_close(mv->sec);
+}
+
+/**
+ * Swap the primary and secondary images by moving
+ *
+ * Returns 1 when the slots are too small to move within, which leaves
+ * them untouched.
+ */
+static int boot_swap_image(uint8_t swap_type)
+{
+    struct boot_move mv;
+    struct boot_move_hdr hdr;
+    uint32_t size;
+    int rc;
+    
+    rc = boot_move_open(&mv);
+    if (rc) {
+        return rc;
+    }
+    
+    size = boot_image_size(mv.pri);
+    size = boot_image_size(mv.sec) > size ? boot_image_size(mv.sec) : size;
+    mv.sectors = (size + BOOT_SECTOR_SIZE - 1) / BOOT_SECTOR_SIZE;
+    
+    // The spare sector and the status area above the image, a state sector in the secondary,
+    // and records for every step with room for a few torn ones
+    if (!mv.sectors ||
+        (mv.sectors + 1) * BOOT_SECTOR_SIZE > mv.status_off ||
+        (mv.sectors + 1) * BOOT_SECTOR_SIZE > mv.sec->fa_size ||
+        3 * mv.sectors + 2 + 8 > mv.max_recs) {
+        boot_move_close(&mv);
+        return 1;
+    }
+    
+    printf("MCUboot: Swapping %u sectors by move\n", mv.sectors);
+    
+    // The request moves from the slot state into the swap header
+    rc = flash_area_erase(mv.pri, mv.status_off, BOOT_STATUS_SECTORS * BOOT_SECTOR_SIZE);
+    if (!rc) {
+        rc = boot_write_pri_state(mv.pri, BOOT_SWAP_TYPE_NONE);
+    }
+    if (!rc) {
+        memset(&hdr, 0xff, sizeof(hdr));
+        hdr.magic = BOOT_MOVE_MAGIC;
+        hdr.sectors = mv.sectors;
+        hdr.swap_type = swap_type;
+        boot_move_digest(&hdr, offsetof(struct boot_move_hdr, check), hdr.check, sizeof(hdr.check));
+        rc = flash_area_write(mv.pri, mv.status_off, &hdr, sizeof(hdr));
+    }
+    if (!rc) {
+        rc = boot_move_run(&mv, 0);
+    }
+    
+    boot_move_close(&mv);
+    return rc;
+}
+
+/**
+ * Finish a swap that power loss interrupted
+ *
+ * Returns 1 if there was one, 0 if not.
+ */
+static int boot_swap_resume(void)
+{
+    const struct flash_area *src, *dst;
+    uint32_t src_off, dst_off, slot;
+    struct boot_move mv;
+    struct boot_move_hdr hdr;
+    struct boot_move_rec rec, last;
+    uint8_t check[8];
+    uint8_t hash[BOOT_MOVE_HASH_LEN];
+    bool have_last = false;
+    int rc;
+    
+    rc = boot_move_open(&mv);
+    if (rc) {
+        return rc;
+    }
+    
+    rc = flash_area_read(mv.pri, mv.status_off, &hdr, sizeof(hdr));
+    boot_move_digest(&hdr, offsetof(struct boot_move_hdr, check), check, sizeof(check));
+    if (rc || hdr.magic != BOOT_MOVE_MAGIC || memcmp(check, hdr.check, sizeof(check))) {
+        // No swap, or its header was torn before any sector was touched
+        boot_move_close(&mv);
+        return 0;
+    }
+    mv.sectors = hdr.sectors;
+    
+    // The last intact record is where the swap stopped; torn ones are passed over
+    for (slot = 0; slot < mv.max_recs; slot++) {
+        rc = flash_area_read(mv.pri, boot_move_rec_off(&mv, slot), &rec, sizeof(rec));
+        if (rc) {
+            goto out;
+        }
+        if (rec.step == 0xffff && rec.reserved == 0xffff) {
+            break;
+        }
+        boot_move_digest(&rec, offsetof(struct boot_move_rec, check), check, BOOT_MOVE_CHECK_LEN);
+        if (!memcmp(check, rec.check, BOOT_MOVE_CHECK_LEN) && rec.step <= 3 * mv.sectors + 1) {
+            last = rec;
+            have_last = true;
+        }
+    }
+    mv.next_rec = slot;
+    
+    if (!have_last) {
+        printf("MCUboot: Resuming swap from the start\n");
+        rc = boot_move_run(&mv, 0);
+    } else if (last.step == 3 * mv.sectors + 1) {
+        rc = 0;
+        boot_move_close(&mv);
+        return 0;
+    } else if (last.step == 3 * mv.sectors) {
+        rc = boot_move_consume(&mv);
+    } else {
+        printf("MCUboot: Resuming swap at step %u of %u\n", last.step, 3 * mv.sectors);
+        
+        // A destination that already hashes like the source was copied in full
+        boot_move_step(&mv, last.step, &src, &src_off, &dst, &dst_off);
+        rc = boot_hash_sector(dst, dst_off, hash);
+        if (!rc && memcmp(hash, last.hash, BOOT_MOVE_HASH_LEN)) {
+            rc = boot_copy_sector(src, src_off, dst, dst_off);
+        }
+        if (!rc) {
+            rc = boot_move_run(&mv, last.step + 1);
+        }
+    }
+    
+out:
+    boot_move_close(&mv);
+    return rc ? rc : 1;
+}
+
 /**
  * MCUboot main entry point
  */
@@ -200,14 +632,35 @@ int main(void)
     swap_type = boot_swap_type();
     printf("MCUboot: Swap type: %d\n", swap_type);
     
-    // Select boot slot
-    if (swap_type == BOOT_SWAP_TYPE_TEST ||
-        swap_type == BOOT_SWAP_TYPE_PERM) {
-        boot_slot = IMAGE_SLOT_B;
-    } else {
-        boot_slot = IMAGE_SLOT_A;
+    // A swap cut short by power loss is finished first; it was this request
+    rc = boot_swap_resume();
+    if (rc > 0) {
+        swap_type = BOOT_SWAP_TYPE_NONE;
+    } else if (rc < 0) {
+        printf("MCUboot: Failed to resume swap: %d\n", rc);
+        swap_type = BOOT_SWAP_TYPE_NONE;
+    }
+    
+    // Bring the requested image into the primary slot, keeping the other for revert
+    if (swap_type == BOOT_SWAP_TYPE_TEST || swap_type == BOOT_SWAP_TYPE_PERM ||
+        swap_type == BOOT_SWAP_TYPE_REVERT) {
+        if (boot_validate_slot(IMAGE_SLOT_B, &hdr)) {
+            printf("MCUboot: Secondary image invalid, not swapping\n");
+        } else {
+            rc = boot_swap_image(swap_type);
+            if (rc == 1 && swap_type == BOOT_SWAP_TYPE_PERM) {
+                // Too big to move; a permanent update needs no copy to revert to
+                rc = boot_copy_image(IMAGE_SLOT_B, IMAGE_SLOT_A);
+            }
+            if (rc) {
+                printf("MCUboot: Failed to swap images: %d\n", rc);
+            }
+        }
     }
     
+    // Select boot slot
+    boot_slot = IMAGE_SLOT_A;
+    
     // Validate image in selected slot
     rc = boot_validate_slot(boot_slot, &hdr);
     if (rc) {
@@ -222,16 +675,6 @@ int main(void)
     
     printf("MCUboot: Booting from slot %d\n", boot_slot);
     
-    // If permanent swap, copy image
-    if (swap_type == BOOT_SWAP_TYPE_PERM) {
-        int dst_slot = (boot_slot == IMAGE_SLOT_A) ? IMAGE_SLOT_A : IMAGE_SLOT_B;
-        rc = boot_copy_image(boot_slot, dst_slot);
-        if (rc) {
-            printf("MCUboot: Failed to copy image\n");
-            return rc;
-        }
-    }
-    
     // Jump to application
     boot_jump_to_image(&hdr, boot_slot);
     
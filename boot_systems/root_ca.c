@@ -5,16 +5,32 @@
  * 
  * Root Certificate Authority management
  * Handles certificate chain validation and trust anchors
+ *
+ * Stored CAs are hashed by subject key identifier, so an issuer is found
+ * from the certificate's authority key identifier without walking the
+ * store; a certificate without one, or whose lookup misses, falls back to
+ * scanning every CA. Chains handed
+ * in as DER through root_ca_verify_der() are remembered by the SHA-256
+ * of the leaf until the first certificate in them expires, so a device
+ * certificate presented on every mTLS connection is parsed and verified
+ * once. Adding a CA or losing one to expiry drops every remembered chain.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/crypto.h>
 #include <linux/x509_cert_parser.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/spinlock.h>
+#include <linux/timekeeping.h>
+#include <crypto/sha2.h>
 
-#define ROOT_CA_VERSION "1.0.0"
+#define ROOT_CA_VERSION "1.1.0"
 #define MAX_ROOT_CAS 16
 #define MAX_CERT_SIZE 4096
+#define ROOT_CA_SKID_BITS 5
+#define ROOT_CA_VERIFY_CACHE 64             // remembered chains, direct mapped
 
 struct root_ca_entry {
     struct x509_cert *cert;
@@ -22,10 +38,71 @@ struct root_ca_entry {
     bool trusted;
     u32 usage_flags;
     time_t expiry;
+    u32 skid_hash;
+    struct hlist_node skid_node;
+};
+
+struct root_ca_verified {
+    u8 fingerprint[SHA256_DIGEST_SIZE];
+    time_t not_after;                       // earliest expiry in the chain
+    u32 generation;
+    bool valid;
 };
 
 static struct root_ca_entry root_cas[MAX_ROOT_CAS];
 static int root_ca_count = 0;
+static DEFINE_HASHTABLE(root_ca_by_skid, ROOT_CA_SKID_BITS);
+
+static DEFINE_SPINLOCK(root_ca_cache_lock);
+static struct root_ca_verified root_ca_cache[ROOT_CA_VERIFY_CACHE];
+static u32 root_ca_generation = 1;          // bumped whenever the trusted set changes
+static time_t root_ca_next_expiry = TIME64_MAX;
+
+static u32 root_ca_key_hash(const u8 *id, size_t len)
+{
+    return jhash(id, len, 0);
+}
+
+/**
+ * Find the stored issuer of a certificate
+ */
+static struct root_ca_entry *root_ca_find_issuer(struct x509_cert *cert)
+{
+    struct root_ca_entry *ca;
+    const u8 *akid;
+    size_t akid_len;
+    int i;
+    
+    akid = x509_cert_get_akid(cert, &akid_len);
+    if (akid && akid_len) {
+        hash_for_each_possible(root_ca_by_skid, ca, skid_node,
+                               root_ca_key_hash(akid, akid_len)) {
+            if (x509_cert_match_issuer(cert, ca->cert)) {
+                return ca;
+            }
+        }
+    }
+    
+    // No key identifier, or none that matched: the issuer may be stored
+    // without one, or under a key identifier the certificate doesn't name
+    for (i = 0; i < root_ca_count; i++) {
+        if (x509_cert_match_issuer(cert, root_cas[i].cert)) {
+            return &root_cas[i];
+        }
+    }
+    
+    return NULL;
+}
+
+/**
+ * Drop every remembered chain
+ */
+static void root_ca_cache_invalidate(void)
+{
+    spin_lock(&root_ca_cache_lock);
+    root_ca_generation++;
+    spin_unlock(&root_ca_cache_lock);
+}
 
 /**
  * Add root CA certificate
@@ -33,7 +110,8 @@ static int root_ca_count = 0;
 int root_ca_add(const u8 *cert_data, size_t cert_len, const char *name)
 {
     struct x509_cert *cert;
-    int ret;
+    const u8 *skid;
+    size_t skid_len;
     
     if (root_ca_count >= MAX_ROOT_CAS) {
         pr_err("Root CA: Maximum CAs reached\n");
@@ -60,95 +138,184 @@ int root_ca_add(const u8 *cert_data, size_t cert_len, const char *name)
     }
     
     // Add to list
+    memset(&root_cas[root_ca_count], 0, sizeof(root_cas[root_ca_count]));
     root_cas[root_ca_count].cert = cert;
     strncpy(root_cas[root_ca_count].name, name, sizeof(root_cas[root_ca_count].name) - 1);
     root_cas[root_ca_count].trusted = true;
     root_cas[root_ca_count].usage_flags = X509_CERT_USAGE_CA;
     root_cas[root_ca_count].expiry = x509_cert_get_expiry(cert);
     
+    skid = x509_cert_get_skid(cert, &skid_len);
+    if (skid && skid_len) {
+        root_cas[root_ca_count].skid_hash = root_ca_key_hash(skid, skid_len);
+        hash_add(root_ca_by_skid, &root_cas[root_ca_count].skid_node,
+                 root_cas[root_ca_count].skid_hash);
+    }
+    
+    root_ca_next_expiry = min(root_ca_next_expiry, root_cas[root_ca_count].expiry);
     root_ca_count++;
     
+    // A chain that failed before may verify against the new CA
+    root_ca_cache_invalidate();
+    
     pr_info("Root CA: Added '%s', expires: %lld\n", name, root_cas[root_ca_count - 1].expiry);
     
     return 0;
 }
 
 /**
- * Verify certificate chain
+ * Verify certificate chain, reporting the earliest expiry on it
  */
-int root_ca_verify_chain(struct x509_cert *leaf_cert)
+static int root_ca_walk_chain(struct x509_cert *leaf_cert, time_t *not_after)
 {
     struct x509_cert *cert;
-    struct x509_cert *issuer;
-    int i;
+    struct root_ca_entry *issuer;
+    int depth;
     int ret;
     
     cert = leaf_cert;
+    *not_after = x509_cert_get_expiry(leaf_cert);
     
-    // Walk up the chain
-    while (cert) {
+    // Walk up the chain; a loop in the store cannot be longer than the store
+    for (depth = 0; depth <= root_ca_count; depth++) {
         // Find issuer
-        issuer = NULL;
-        for (i = 0; i < root_ca_count; i++) {
-            if (x509_cert_match_issuer(cert, root_cas[i].cert)) {
-                issuer = root_cas[i].cert;
-                break;
-            }
-        }
-        
+        issuer = root_ca_find_issuer(cert);
         if (!issuer) {
             pr_err("Root CA: Issuer not found in trust store\n");
             return -ENOENT;
         }
         
         // Verify signature
-        ret = x509_cert_verify_signature(cert, issuer);
+        ret = x509_cert_verify_signature(cert, issuer->cert);
         if (ret) {
             pr_err("Root CA: Signature verification failed\n");
             return ret;
         }
         
+        *not_after = min(*not_after, issuer->expiry);
+        
         // Check if we reached a root CA
-        if (x509_cert_is_self_signed(issuer)) {
-            // Found root CA
-            for (i = 0; i < root_ca_count; i++) {
-                if (root_cas[i].cert == issuer) {
-                    if (!root_cas[i].trusted) {
-                        pr_err("Root CA: Root CA not trusted\n");
-                        return -EACCES;
-                    }
-                    pr_info("Root CA: Chain verified to trusted root '%s'\n",
-                            root_cas[i].name);
-                    return 0;
-                }
+        if (x509_cert_is_self_signed(issuer->cert)) {
+            if (!issuer->trusted) {
+                pr_err("Root CA: Root CA not trusted\n");
+                return -EACCES;
             }
+            pr_debug("Root CA: Chain verified to trusted root '%s'\n", issuer->name);
+            return 0;
         }
         
-        cert = issuer;
+        cert = issuer->cert;
     }
     
     return -EINVAL;
 }
 
+/**
+ * Verify certificate chain
+ */
+int root_ca_verify_chain(struct x509_cert *leaf_cert)
+{
+    time_t not_after;
+    
+    if (!leaf_cert) {
+        return -EINVAL;
+    }
+    
+    return root_ca_walk_chain(leaf_cert, &not_after);
+}
+
+/**
+ * Verify the chain of a DER certificate, remembering the ones that pass
+ */
+int root_ca_verify_der(const u8 *cert_data, size_t cert_len)
+{
+    struct root_ca_verified *slot;
+    struct x509_cert *cert;
+    u8 fingerprint[SHA256_DIGEST_SIZE];
+    time_t now = ktime_get_real_seconds();
+    time_t not_after;
+    u32 generation;
+    int ret;
+    
+    if (!cert_data || !cert_len || cert_len > MAX_CERT_SIZE) {
+        return -EINVAL;
+    }
+    
+    sha256(cert_data, cert_len, fingerprint);
+    slot = &root_ca_cache[fingerprint[0] % ROOT_CA_VERIFY_CACHE];
+    
+    spin_lock(&root_ca_cache_lock);
+    if (slot->valid && slot->generation == root_ca_generation && now < slot->not_after &&
+        !memcmp(slot->fingerprint, fingerprint, sizeof(fingerprint))) {
+        spin_unlock(&root_ca_cache_lock);
+        return 0;
+    }
+    generation = root_ca_generation;
+    spin_unlock(&root_ca_cache_lock);
+    
+    // Parse certificate
+    cert = x509_cert_parse(cert_data, cert_len);
+    if (!cert) {
+        pr_err("Root CA: Failed to parse certificate\n");
+        return -EINVAL;
+    }
+    
+    ret = root_ca_walk_chain(cert, &not_after);
+    x509_free_certificate(cert);
+    if (ret) {
+        return ret;
+    }
+    if (not_after <= now) {
+        pr_err("Root CA: Certificate chain has expired\n");
+        return -EKEYEXPIRED;
+    }
+    
+    // Not remembered if the store moved on while this chain was being checked
+    spin_lock(&root_ca_cache_lock);
+    if (generation == root_ca_generation) {
+        memcpy(slot->fingerprint, fingerprint, sizeof(fingerprint));
+        slot->not_after = not_after;
+        slot->generation = generation;
+        slot->valid = true;
+    }
+    spin_unlock(&root_ca_cache_lock);
+    
+    return 0;
+}
+EXPORT_SYMBOL_GPL(root_ca_verify_der);
+
 /**
  * Check certificate expiry
  */
 int root_ca_check_expiry(void)
 {
     time_t now = ktime_get_real_seconds();
+    time_t next = TIME64_MAX;
     int i;
     int expired_count = 0;
     
+    // Nothing can have expired before the earliest expiry in the store
+    if (now < root_ca_next_expiry) {
+        return 0;
+    }
+    
     for (i = 0; i < root_ca_count; i++) {
+        if (!root_cas[i].trusted) {
+            continue;
+        }
         if (root_cas[i].expiry < now) {
             pr_warn("Root CA: '%s' has expired\n", root_cas[i].name);
             root_cas[i].trusted = false;
             expired_count++;
+        } else {
+            next = min(next, root_cas[i].expiry);
         }
     }
+    root_ca_next_expiry = next;
     
     if (expired_count > 0) {
         pr_warn("Root CA: %d certificates expired\n", expired_count);
+        root_ca_cache_invalidate();
     }
     
     return expired_count;
@@ -5,6 +5,14 @@
  * 
  * Hardware root of trust with quantum-resistant cryptography
  * Research breakthrough: Post-quantum security implementation
+ *
+ * Measurements are hashed in software and kept in an event log, and the
+ * TPM is only talked to when the log is flushed: one PCR_Extend per PCR
+ * touched, carrying every bank, with whatever was measured into that
+ * PCR since the last flush folded into it. The hash transforms are set
+ * up once and kept, and extends authorize with the password session,
+ * which needs no StartAuthSession round trip, so a flush costs one SPI
+ * transaction per PCR rather than per component.
  */
 
 #include <linux/module.h>
@@ -14,8 +22,15 @@
 #include <linux/random.h>
 #include <linux/string.h>
 #include <linux/errno.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/moduleparam.h>
+#include <crypto/hash.h>
+#include <crypto/hash_info.h>
 
-#define SECURE_BOOT_VERSION "3.0.0"
+#include "secure_boot_tpm.h"
+
+#define SECURE_BOOT_VERSION "3.1.0"
 #define TPM2_MAX_PCR_COUNT 32
 #define QUANTUM_RESISTANT_KEY_SIZE 64
 #define HASH_SIZE_SHA256 32
@@ -31,10 +46,25 @@ struct secure_boot_context {
     struct crypto_shash *hash_tfm;
     u8 current_pcr;
     bool quantum_resistant_enabled;
+    
+    // One transform per PCR bank, kept for every measurement
+    struct crypto_shash *bank_tfm[MEASURE_MAX_BANKS];
+    u16 bank_alg[MEASURE_MAX_BANKS];
+    u8 nr_banks;
+    
+    struct mutex log_lock;
+    struct measure_event *log;
+    u32 log_count;
+    u32 log_flushed;                    // events before this are in the PCRs
+    u32 next_batch;
 };
 
 static struct secure_boot_context global_secure_boot;
 
+static unsigned int event_log_size = 256;
+module_param(event_log_size, uint, 0444);
+MODULE_PARM_DESC(event_log_size, "Measurements the event log holds");
+
 /**
  * Initialize quantum-resistant cryptography
  */
@@ -63,14 +93,18 @@ static int init_quantum_resistant_crypto(void)
 
 /**
  * TPM 2.0 PCR extend operation
+ *
+ * One command extends every bank: digests holds one per bank, in the
+ * order of ctx->bank_alg.
  */
-static int tpm2_pcr_extend(struct secure_boot_context *ctx, u8 pcr_index, 
-                           const u8 *digest, size_t digest_size)
+static int tpm2_pcr_extend(struct secure_boot_context *ctx, u8 pcr_index,
+                           const u8 (*digests)[HASH_MAX_DIGESTSIZE])
 {
     int ret;
     struct tpm_buf buf;
+    int i;
     
-    if (!ctx || !digest || pcr_index >= TPM2_MAX_PCR_COUNT) {
+    if (!ctx || !digests || pcr_index >= TPM2_MAX_PCR_COUNT) {
         pr_err("Invalid parameters for PCR extend\n");
         return -EINVAL;
     }
@@ -81,10 +115,24 @@ static int tpm2_pcr_extend(struct secure_boot_context *ctx, u8 pcr_index,
     }
     
     // Prepare TPM command buffer
-    tpm_buf_init(&buf, TPM2_ST_SESSIONS, TPM2_CC_PCR_EXTEND);
+    ret = tpm_buf_init(&buf, TPM2_ST_SESSIONS, TPM2_CC_PCR_EXTEND);
+    if (ret) {
+        return ret;
+    }
     tpm_buf_append_u32(&buf, pcr_index);
-    tpm_buf_append_u16(&buf, digest_size);
-    tpm_buf_append(&buf, digest, digest_size);
+    
+    // Password session with the PCR's empty auth: nothing to set up or keep
+    tpm_buf_append_u32(&buf, 9);
+    tpm_buf_append_u32(&buf, TPM2_RS_PW);
+    tpm_buf_append_u16(&buf, 0);        // nonce
+    tpm_buf_append_u8(&buf, 0);         // attributes
+    tpm_buf_append_u16(&buf, 0);        // hmac
+    
+    tpm_buf_append_u32(&buf, ctx->nr_banks);
+    for (i = 0; i < ctx->nr_banks; i++) {
+        tpm_buf_append_u16(&buf, ctx->bank_alg[i]);
+        tpm_buf_append(&buf, digests[i], crypto_shash_digestsize(ctx->bank_tfm[i]));
+    }
     
     // Send command to TPM
     ret = tpm_transmit_cmd(ctx->tpm_chip, &buf, 0, "PCR_EXTEND");
@@ -95,8 +143,7 @@ static int tpm2_pcr_extend(struct secure_boot_context *ctx, u8 pcr_index,
     }
     
     // Update local PCR measurement
-    memcpy(&ctx->pcr_measurements[pcr_index], digest, 
-           min(digest_size, sizeof(u32)));
+    memcpy(&ctx->pcr_measurements[pcr_index], digests[0], sizeof(u32));
     
     tpm_buf_destroy(&buf);
     
@@ -105,49 +152,214 @@ static int tpm2_pcr_extend(struct secure_boot_context *ctx, u8 pcr_index,
 }
 
 /**
- * Verify firmware signature using quantum-resistant algorithms
+ * Set up a hash transform for each PCR bank the TPM has allocated
  */
-static int verify_firmware_signature(const u8 *firmware, size_t size, 
-                                     const u8 *signature, size_t sig_size)
+static int measure_init_banks(struct secure_boot_context *ctx)
 {
-    struct crypto_shash *tfm;
-    struct shash_desc *desc;
-    u8 hash[HASH_SIZE_SHA384];
-    int ret;
+    struct tpm_chip *chip = ctx->tpm_chip;
+    int i;
+    
+    for (i = 0; i < chip->nr_allocated_banks && ctx->nr_banks < MEASURE_MAX_BANKS; i++) {
+        const struct tpm_bank_info *bank = &chip->allocated_banks[i];
+        struct crypto_shash *tfm;
+        
+        // A bank the kernel has no hash for is left out of every extend,
+        // so its PCRs keep their reset value and attest nothing
+        if (bank->crypto_id == HASH_ALGO__LAST) {
+            pr_warn("No kernel hash for PCR bank 0x%x, it is not measured\n", bank->alg_id);
+            continue;
+        }
+        tfm = crypto_alloc_shash(hash_algo_name[bank->crypto_id], 0, 0);
+        if (IS_ERR(tfm)) {
+            pr_warn("No %s for PCR bank 0x%x, it is not measured\n",
+                    hash_algo_name[bank->crypto_id], bank->alg_id);
+            continue;
+        }
+        ctx->bank_tfm[ctx->nr_banks] = tfm;
+        ctx->bank_alg[ctx->nr_banks] = bank->alg_id;
+        ctx->nr_banks++;
+    }
     
-    if (!firmware || !signature || size == 0 || sig_size == 0) {
-        pr_err("Invalid parameters for signature verification\n");
+    return ctx->nr_banks ? 0 : -ENOENT;
+}
+
+static void measure_free_banks(struct secure_boot_context *ctx)
+{
+    int i;
+    
+    for (i = 0; i < ctx->nr_banks; i++) {
+        crypto_free_shash(ctx->bank_tfm[i]);
+    }
+    ctx->nr_banks = 0;
+}
+
+/**
+ * Measure data into a PCR
+ *
+ * Hashes it in every bank and logs it; the PCR is extended at the next
+ * flush, which also happens here when the log runs full.
+ */
+int secure_boot_measure(u8 pcr, const void *data, size_t len, const char *desc)
+{
+    struct secure_boot_context *ctx = &global_secure_boot;
+    struct measure_event *ev;
+    int i, ret = 0;
+    
+    if (pcr >= TPM2_MAX_PCR_COUNT || (!data && len)) {
         return -EINVAL;
     }
+    if (!ctx->log || !ctx->nr_banks) {
+        return -ENODEV;
+    }
     
-    // Allocate hash transform
-    tfm = crypto_alloc_shash("sha384", 0, 0);
-    if (IS_ERR(tfm)) {
-        pr_err("Failed to allocate SHA-384 transform\n");
-        return PTR_ERR(tfm);
+    mutex_lock(&ctx->log_lock);
+    if (ctx->log_count == event_log_size) {
+        ret = -ENOSPC;
+        goto out;
+    }
+    
+    ev = &ctx->log[ctx->log_count];
+    memset(ev, 0, sizeof(*ev));
+    ev->pcr = pcr;
+    ev->nr_banks = ctx->nr_banks;
+    strscpy(ev->desc, desc ? desc : "", sizeof(ev->desc));
+    for (i = 0; i < ctx->nr_banks; i++) {
+        SHASH_DESC_ON_STACK(shash, ctx->bank_tfm[i]);
+        
+        shash->tfm = ctx->bank_tfm[i];
+        ret = crypto_shash_digest(shash, data, len, ev->digest[i]);
+        if (ret) {
+            goto out;
+        }
+        ev->alg_id[i] = ctx->bank_alg[i];
+    }
+    ctx->log_count++;
+    
+    // The last slot is taken: get everything into the TPM, later measurements are refused
+    if (ctx->log_count == event_log_size) {
+        mutex_unlock(&ctx->log_lock);
+        return secure_boot_measure_flush();
+    }
+    
+out:
+    mutex_unlock(&ctx->log_lock);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(secure_boot_measure);
+
+/**
+ * Extend every PCR with what was measured into it since the last flush
+ */
+int secure_boot_measure_flush(void)
+{
+    struct secure_boot_context *ctx = &global_secure_boot;
+    u8 (*digests)[HASH_MAX_DIGESTSIZE];
+    unsigned long pending[BITS_TO_LONGS(TPM2_MAX_PCR_COUNT)] = { 0 };
+    u32 i, extends = 0, start;
+    int pcr, b, n, ret = 0;
+    
+    if (!ctx->log) {
+        return -ENODEV;
     }
     
-    // Allocate shash descriptor
-    desc = kmalloc(sizeof(*desc) + crypto_shash_descsize(tfm), GFP_KERNEL);
-    if (!desc) {
-        crypto_free_shash(tfm);
+    digests = kcalloc(MEASURE_MAX_BANKS, HASH_MAX_DIGESTSIZE, GFP_KERNEL);
+    if (!digests) {
         return -ENOMEM;
     }
     
-    desc->tfm = tfm;
+    // Events already in a batch went into their PCR before a failed
+    // extend stopped the last flush; they must not go in twice
+    mutex_lock(&ctx->log_lock);
+    start = ctx->log_flushed;
+    for (i = start; i < ctx->log_count; i++) {
+        if (!ctx->log[i].batch) {
+            __set_bit(ctx->log[i].pcr, pending);
+        }
+    }
     
-    // Calculate hash
-    ret = crypto_shash_init(desc);
-    if (ret) {
-        goto cleanup;
+    for_each_set_bit(pcr, pending, TPM2_MAX_PCR_COUNT) {
+        struct measure_event *single = NULL;
+        
+        for (b = 0; b < ctx->nr_banks && !ret; b++) {
+            SHASH_DESC_ON_STACK(shash, ctx->bank_tfm[b]);
+            
+            shash->tfm = ctx->bank_tfm[b];
+            n = 0;
+            ret = crypto_shash_init(shash);
+            for (i = start; i < ctx->log_count && !ret; i++) {
+                if (ctx->log[i].pcr == pcr && !ctx->log[i].batch) {
+                    single = &ctx->log[i];
+                    n++;
+                    ret = crypto_shash_update(shash, ctx->log[i].digest[b],
+                                              crypto_shash_digestsize(ctx->bank_tfm[b]));
+                }
+            }
+            if (!ret) {
+                ret = crypto_shash_final(shash, digests[b]);
+            }
+            // One event goes in as it is, so the log replays the usual way
+            if (!ret && n == 1) {
+                memcpy(digests[b], single->digest[b], crypto_shash_digestsize(ctx->bank_tfm[b]));
+            }
+        }
+        if (!ret) {
+            ret = tpm2_pcr_extend(ctx, pcr, (const u8 (*)[HASH_MAX_DIGESTSIZE])digests);
+        }
+        if (ret) {
+            // The PCRs before this one are extended; their events must say so
+            break;
+        }
+        
+        ctx->next_batch++;
+        for (i = start; i < ctx->log_count; i++) {
+            if (ctx->log[i].pcr == pcr && !ctx->log[i].batch) {
+                ctx->log[i].batch = ctx->next_batch;
+            }
+        }
+        extends++;
     }
     
-    ret = crypto_shash_update(desc, firmware, size);
-    if (ret) {
-        goto cleanup;
+    // The marker passes every event extended, up to the first one still
+    // pending; those stay behind it, in order, for the next try
+    while (ctx->log_flushed < ctx->log_count && ctx->log[ctx->log_flushed].batch) {
+        ctx->log_flushed++;
+    }
+    mutex_unlock(&ctx->log_lock);
+    kfree(digests);
+    
+    pr_debug("Measured boot: %u events into %u PCR extends\n", ctx->log_count - start, extends);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(secure_boot_measure_flush);
+
+/**
+ * The event log, extended or not; an event's batch is 0 until it is
+ */
+const struct measure_event *secure_boot_event_log(u32 *count)
+{
+    *count = global_secure_boot.log_count;
+    return global_secure_boot.log;
+}
+EXPORT_SYMBOL_GPL(secure_boot_event_log);
+
+/**
+ * Verify firmware signature using quantum-resistant algorithms
+ */
+static int verify_firmware_signature(const u8 *firmware, size_t size, 
+                                     const u8 *signature, size_t sig_size)
+{
+    SHASH_DESC_ON_STACK(desc, global_secure_boot.hash_tfm);
+    u8 hash[HASH_SIZE_SHA384];
+    int ret;
+    
+    if (!firmware || !signature || size == 0 || sig_size == 0) {
+        pr_err("Invalid parameters for signature verification\n");
+        return -EINVAL;
     }
     
-    ret = crypto_shash_final(desc, hash);
+    // The SHA-384 transform from init serves every verification
+    desc->tfm = global_secure_boot.hash_tfm;
+    ret = crypto_shash_digest(desc, firmware, size, hash);
     if (ret) {
         goto cleanup;
     }
@@ -162,8 +374,7 @@ static int verify_firmware_signature(const u8 *firmware, size_t size,
     }
     
 cleanup:
-    kfree(desc);
-    crypto_free_shash(tfm);
+    shash_desc_zero(desc);
     return ret;
 }
 
@@ -187,6 +398,20 @@ static int secure_boot_init(void)
     global_secure_boot.tpm_chip = tpm_default_chip();
     if (!global_secure_boot.tpm_chip) {
         pr_warn("No TPM chip available, secure boot limited\n");
+    } else if (measure_init_banks(&global_secure_boot)) {
+        pr_warn("No usable PCR bank, measured boot disabled\n");
+    } else {
+        mutex_init(&global_secure_boot.log_lock);
+        event_log_size = clamp(event_log_size, 16U, 4096U);
+        global_secure_boot.log = kvcalloc(event_log_size, sizeof(struct measure_event),
+                                          GFP_KERNEL);
+        if (!global_secure_boot.log) {
+            measure_free_banks(&global_secure_boot);
+            crypto_free_shash(global_secure_boot.hash_tfm);
+            return -ENOMEM;
+        }
+        pr_info("Measured boot over %u PCR banks, %u event log\n",
+                global_secure_boot.nr_banks, event_log_size);
     }
     
     // Initialize PCR measurements
@@ -223,6 +448,19 @@ static int __init secure_boot_init_module(void)
  */
 static void __exit secure_boot_cleanup_module(void)
 {
+    if (global_secure_boot.log) {
+        if (global_secure_boot.log_flushed != global_secure_boot.log_count) {
+            pr_warn("%u measurements never reached the TPM\n",
+                    global_secure_boot.log_count - global_secure_boot.log_flushed);
+        }
+        kvfree(global_secure_boot.log);
+        global_secure_boot.log = NULL;
+    }
+    measure_free_banks(&global_secure_boot);
+    if (global_secure_boot.tpm_chip) {
+        put_device(&global_secure_boot.tpm_chip->dev);
+    }
+    
     if (global_secure_boot.hash_tfm) {
         crypto_free_shash(global_secure_boot.hash_tfm);
     }
@@ -0,0 +1,39 @@
+/**
+ * Measured boot interface
+ *
+ * Components are hashed in software, in every PCR bank the TPM has, and
+ * logged at once; the TPM only sees them when the log is flushed, with
+ * one PCR_Extend per PCR carrying all banks. Several events for one PCR
+ * in a flush are folded into a single extend of the hash of their
+ * digests, in log order, and share a batch number in the log, so a
+ * verifier replays them by hashing each batch's digests together first.
+ * A batch of one is extended as the event digest itself, as usual.
+ *
+ * Deferring the extend is only sound if nothing measured runs before it:
+ * flush before handing control to a measured component, and before
+ * anything reads, quotes or seals against the PCRs.
+ */
+
+#ifndef SECURE_BOOT_TPM_H
+#define SECURE_BOOT_TPM_H
+
+#include <linux/types.h>
+#include <crypto/hash.h>
+
+#define MEASURE_MAX_BANKS 4
+#define MEASURE_DESC_LEN 32
+
+struct measure_event {
+    u8 pcr;
+    u8 nr_banks;
+    u32 batch;                          // 0 while pending
+    u16 alg_id[MEASURE_MAX_BANKS];
+    u8 digest[MEASURE_MAX_BANKS][HASH_MAX_DIGESTSIZE];
+    char desc[MEASURE_DESC_LEN];
+};
+
+int secure_boot_measure(u8 pcr, const void *data, size_t len, const char *desc);
+int secure_boot_measure_flush(void);
+const struct measure_event *secure_boot_event_log(u32 *count);
+
+#endif /* SECURE_BOOT_TPM_H */
@@ -5,23 +5,61 @@
  * 
  * Secure environment for storing sensitive configuration
  * Protected from tampering and unauthorized access
+ *
+ * Variables are found through a hash of their name. Encrypted values are
+ * sealed with AES-GCM under their own nonce, bound to the name, and only
+ * opened when first read; the plaintext is then kept until the
+ * environment is locked, when it is wiped along with the keys. The store
+ * goes to flash as one image under an HMAC-SHA256, written once by
+ * secure_env_commit() (or on lock) however many variables changed, and
+ * is checked as a whole before anything in it is believed.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/crypto.h>
 #include <linux/string.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/random.h>
+#include <linux/scatterlist.h>
+#include <linux/unaligned.h>
+#include <crypto/aead.h>
+#include <crypto/hash.h>
+#include <crypto/utils.h>
 
-#define SECURE_ENV_VERSION "1.0.0"
+#define SECURE_ENV_VERSION "1.1.0"
 #define MAX_ENV_VARS 64
 #define MAX_VAR_NAME 32
 #define MAX_VAR_VALUE 256
 
+#define SECURE_ENV_MAGIC 0x53454e56         // "SENV"
+#define SECURE_ENV_FORMAT 1
+#define SECURE_ENV_HASH_BITS 7
+#define SECURE_ENV_NONCE_LEN 12
+#define SECURE_ENV_TAG_LEN 16
+#define SECURE_ENV_MAC_LEN 32
+#define SECURE_ENV_HDR_LEN 16               // magic, format, count, length, sequence
+#define SECURE_ENV_REC_HDR_LEN 4            // name length, flags, value length
+
+#define SECURE_ENV_F_ENCRYPTED BIT(0)
+
+/* The largest image is every variable at full length, sealed */
+#define SECURE_ENV_IMAGE_MAX (SECURE_ENV_HDR_LEN + SECURE_ENV_MAC_LEN + \
+    MAX_ENV_VARS * (SECURE_ENV_REC_HDR_LEN + MAX_VAR_NAME + SECURE_ENV_NONCE_LEN + \
+                    MAX_VAR_VALUE + SECURE_ENV_TAG_LEN))
+
 struct secure_env_var {
     char name[MAX_VAR_NAME];
-    char value[MAX_VAR_VALUE];
+    u8 value[MAX_VAR_VALUE + SECURE_ENV_TAG_LEN];   // ciphertext and tag when encrypted
+    u16 value_len;
+    u8 nonce[SECURE_ENV_NONCE_LEN];
     bool encrypted;
     u32 flags;
+    char *plain;                        // opened value, kept until lock
+    struct hlist_node node;
 };
 
 static struct secure_env_var secure_env[MAX_ENV_VARS];
@@ -29,20 +67,325 @@ static int env_count = 0;
 static bool env_locked = false;
 static u8 env_key[32];  // AES-256 key
 
+static DEFINE_MUTEX(env_mutex);
+static DEFINE_HASHTABLE(env_index, SECURE_ENV_HASH_BITS);
+static struct crypto_aead *env_aead;
+static struct crypto_shash *env_hmac;
+static bool env_dirty;
+static u32 env_sequence;
+
+/* Platform hooks */
+extern int secure_env_platform_key(u8 *key, size_t len);
+extern int secure_env_storage_read(void *buf, size_t len);
+extern int secure_env_storage_write(const void *buf, size_t len);
+
+static u32 secure_env_hash(const char *name)
+{
+    return jhash(name, strlen(name), 0);
+}
+
+static struct secure_env_var *secure_env_find(const char *name)
+{
+    struct secure_env_var *var;
+    
+    hash_for_each_possible(env_index, var, node, secure_env_hash(name)) {
+        if (strcmp(var->name, name) == 0) {
+            return var;
+        }
+    }
+    
+    return NULL;
+}
+
+/**
+ * Seal or open a value in place, with the variable name as associated data
+ */
+static int secure_env_crypt(struct secure_env_var *var, u8 *buf, size_t len, bool encrypt)
+{
+    struct aead_request *req;
+    struct scatterlist sg;
+    DECLARE_CRYPTO_WAIT(wait);
+    size_t name_len = strlen(var->name);
+    u8 *work;
+    int ret;
+    
+    // The request wants the associated data in front of the text
+    work = kmalloc(name_len + len + (encrypt ? SECURE_ENV_TAG_LEN : 0), GFP_KERNEL);
+    if (!work) {
+        return -ENOMEM;
+    }
+    memcpy(work, var->name, name_len);
+    memcpy(work + name_len, buf, len);
+    
+    req = aead_request_alloc(env_aead, GFP_KERNEL);
+    if (!req) {
+        kfree_sensitive(work);
+        return -ENOMEM;
+    }
+    
+    sg_init_one(&sg, work, name_len + len + (encrypt ? SECURE_ENV_TAG_LEN : 0));
+    aead_request_set_callback(req, CRYPTO_TFM_REQ_MAY_SLEEP, crypto_req_done, &wait);
+    aead_request_set_ad(req, name_len);
+    aead_request_set_crypt(req, &sg, &sg, len, var->nonce);
+    
+    ret = crypto_wait_req(encrypt ? crypto_aead_encrypt(req) : crypto_aead_decrypt(req), &wait);
+    if (!ret) {
+        memcpy(buf, work + name_len, encrypt ? len + SECURE_ENV_TAG_LEN : len - SECURE_ENV_TAG_LEN);
+    }
+    
+    aead_request_free(req);
+    kfree_sensitive(work);
+    return ret;
+}
+
+static int secure_env_mac(const u8 *data, size_t len, u8 *mac)
+{
+    SHASH_DESC_ON_STACK(desc, env_hmac);
+    int ret;
+    
+    desc->tfm = env_hmac;
+    ret = crypto_shash_digest(desc, data, len, mac);
+    shash_desc_zero(desc);
+    return ret;
+}
+
+/**
+ * Derive the value and image keys from the environment key
+ */
+static int secure_env_setup_keys(void)
+{
+    u8 enc_key[32], mac_key[32];
+    int ret;
+    
+    env_hmac = crypto_alloc_shash("hmac(sha256)", 0, 0);
+    if (IS_ERR(env_hmac)) {
+        ret = PTR_ERR(env_hmac);
+        env_hmac = NULL;
+        return ret;
+    }
+    env_aead = crypto_alloc_aead("gcm(aes)", 0, 0);
+    if (IS_ERR(env_aead)) {
+        ret = PTR_ERR(env_aead);
+        env_aead = NULL;
+        goto err_hmac;
+    }
+    
+    ret = crypto_shash_setkey(env_hmac, env_key, sizeof(env_key));
+    if (!ret) {
+        ret = secure_env_mac((const u8 *)"secure-env value", 16, enc_key);
+    }
+    if (!ret) {
+        ret = secure_env_mac((const u8 *)"secure-env image", 16, mac_key);
+    }
+    if (!ret) {
+        ret = crypto_aead_setkey(env_aead, enc_key, sizeof(enc_key));
+    }
+    if (!ret) {
+        ret = crypto_aead_setauthsize(env_aead, SECURE_ENV_TAG_LEN);
+    }
+    if (!ret) {
+        ret = crypto_shash_setkey(env_hmac, mac_key, sizeof(mac_key));
+    }
+    memzero_explicit(enc_key, sizeof(enc_key));
+    memzero_explicit(mac_key, sizeof(mac_key));
+    if (!ret) {
+        return 0;
+    }
+    
+    crypto_free_aead(env_aead);
+    env_aead = NULL;
+err_hmac:
+    crypto_free_shash(env_hmac);
+    env_hmac = NULL;
+    return ret;
+}
+
+/**
+ * Read the stored image, believing none of it unless the MAC holds
+ */
+static int secure_env_load(void)
+{
+    u8 mac[SECURE_ENV_MAC_LEN];
+    u8 *image, *p, *end;
+    u32 length, count, i;
+    int ret;
+    
+    image = kvmalloc(SECURE_ENV_IMAGE_MAX, GFP_KERNEL);
+    if (!image) {
+        return -ENOMEM;
+    }
+    
+    ret = secure_env_storage_read(image, SECURE_ENV_IMAGE_MAX);
+    if (ret) {
+        goto out;
+    }
+    
+    length = get_unaligned_le32(image + 8);
+    if (get_unaligned_le32(image) != SECURE_ENV_MAGIC ||
+        get_unaligned_le16(image + 4) != SECURE_ENV_FORMAT ||
+        length < SECURE_ENV_HDR_LEN || length > SECURE_ENV_IMAGE_MAX - SECURE_ENV_MAC_LEN) {
+        ret = -ENODATA;
+        goto out;
+    }
+    
+    ret = secure_env_mac(image, length, mac);
+    if (ret) {
+        goto out;
+    }
+    if (crypto_memneq(mac, image + length, SECURE_ENV_MAC_LEN)) {
+        pr_err("Secure Env: Stored environment failed authentication\n");
+        ret = -EBADMSG;
+        goto out;
+    }
+    
+    count = get_unaligned_le16(image + 6);
+    env_sequence = get_unaligned_le32(image + 12);
+    p = image + SECURE_ENV_HDR_LEN;
+    end = image + length;
+    for (i = 0; i < count && i < MAX_ENV_VARS; i++) {
+        struct secure_env_var *var = &secure_env[env_count];
+        u8 name_len, flags;
+        u16 value_len;
+        
+        if (end - p < SECURE_ENV_REC_HDR_LEN) {
+            break;
+        }
+        name_len = p[0];
+        flags = p[1];
+        value_len = get_unaligned_le16(p + 2);
+        p += SECURE_ENV_REC_HDR_LEN;
+        
+        if (!name_len || name_len >= MAX_VAR_NAME || value_len > sizeof(var->value) ||
+            end - p < name_len + value_len + ((flags & SECURE_ENV_F_ENCRYPTED) ? SECURE_ENV_NONCE_LEN : 0)) {
+            break;
+        }
+        
+        memset(var, 0, sizeof(*var));
+        memcpy(var->name, p, name_len);
+        p += name_len;
+        if (flags & SECURE_ENV_F_ENCRYPTED) {
+            // Stays sealed until somebody asks for it
+            memcpy(var->nonce, p, SECURE_ENV_NONCE_LEN);
+            p += SECURE_ENV_NONCE_LEN;
+            var->encrypted = true;
+        } else if (value_len >= MAX_VAR_VALUE) {
+            break;
+        }
+        memcpy(var->value, p, value_len);
+        var->value_len = value_len;
+        p += value_len;
+        
+        hash_add(env_index, &var->node, secure_env_hash(var->name));
+        env_count++;
+    }
+    
+    if (i != count) {
+        pr_err("Secure Env: Stored environment is malformed after %u variables\n", i);
+    }
+    pr_info("Secure Env: Loaded %d variables, sequence %u\n", env_count, env_sequence);
+    
+out:
+    kvfree(image);
+    return ret;
+}
+
+/**
+ * Write the whole store back, authenticated, if anything changed
+ */
+int secure_env_commit(void)
+{
+    u8 *image, *p;
+    size_t length;
+    int i, ret;
+    
+    mutex_lock(&env_mutex);
+    if (!env_dirty) {
+        ret = 0;
+        goto out_unlock;
+    }
+    if (env_locked || !env_hmac) {
+        ret = -EACCES;
+        goto out_unlock;
+    }
+    
+    image = kvmalloc(SECURE_ENV_IMAGE_MAX, GFP_KERNEL);
+    if (!image) {
+        ret = -ENOMEM;
+        goto out_unlock;
+    }
+    
+    p = image + SECURE_ENV_HDR_LEN;
+    for (i = 0; i < env_count; i++) {
+        struct secure_env_var *var = &secure_env[i];
+        size_t name_len = strlen(var->name);
+        
+        p[0] = name_len;
+        p[1] = var->encrypted ? SECURE_ENV_F_ENCRYPTED : 0;
+        put_unaligned_le16(var->value_len, p + 2);
+        p += SECURE_ENV_REC_HDR_LEN;
+        memcpy(p, var->name, name_len);
+        p += name_len;
+        if (var->encrypted) {
+            memcpy(p, var->nonce, SECURE_ENV_NONCE_LEN);
+            p += SECURE_ENV_NONCE_LEN;
+        }
+        memcpy(p, var->value, var->value_len);
+        p += var->value_len;
+    }
+    length = p - image;
+    
+    put_unaligned_le32(SECURE_ENV_MAGIC, image);
+    put_unaligned_le16(SECURE_ENV_FORMAT, image + 4);
+    put_unaligned_le16(env_count, image + 6);
+    put_unaligned_le32(length, image + 8);
+    put_unaligned_le32(env_sequence + 1, image + 12);
+    
+    ret = secure_env_mac(image, length, image + length);
+    if (!ret) {
+        ret = secure_env_storage_write(image, length + SECURE_ENV_MAC_LEN);
+    }
+    if (!ret) {
+        env_sequence++;
+        env_dirty = false;
+        pr_info("Secure Env: Committed %d variables, sequence %u\n", env_count, env_sequence);
+    } else {
+        pr_err("Secure Env: Commit failed: %d\n", ret);
+    }
+    
+    kvfree(image);
+out_unlock:
+    mutex_unlock(&env_mutex);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(secure_env_commit);
+
 /**
  * Initialize secure environment
  */
 int secure_env_init(void)
 {
+    bool persistent;
     int ret;
     
-    // Generate or load encryption key
-    ret = get_random_bytes(env_key, sizeof(env_key));
+    // Load the platform key, or make one up that only lasts this boot
+    persistent = secure_env_platform_key(env_key, sizeof(env_key)) == 0;
+    if (!persistent) {
+        pr_warn("Secure Env: No platform key, encrypted values will not survive reboot\n");
+        get_random_bytes(env_key, sizeof(env_key));
+    }
+    
+    ret = secure_env_setup_keys();
     if (ret) {
-        pr_err("Secure Env: Failed to generate key\n");
+        pr_err("Secure Env: Failed to set up keys: %d\n", ret);
+        memzero_explicit(env_key, sizeof(env_key));
         return ret;
     }
     
+    // A store sealed under another key could never verify
+    if (persistent && secure_env_load()) {
+        pr_warn("Secure Env: No valid stored environment, starting empty\n");
+    }
+    
     pr_info("Secure Env: Initialized\n");
     
     return 0;
@@ -53,70 +396,86 @@ int secure_env_init(void)
  */
 int secure_env_set(const char *name, const char *value, bool encrypt)
 {
-    int i;
-    struct crypto_cipher *tfm;
-    u8 encrypted_value[MAX_VAR_VALUE];
-    int ret;
+    struct secure_env_var *var;
+    size_t len;
+    char *plain = NULL;
+    int ret = 0;
     
-    if (env_locked) {
-        pr_err("Secure Env: Environment is locked\n");
-        return -EACCES;
-    }
-    
-    if (strlen(name) >= MAX_VAR_NAME) {
+    if (strlen(name) == 0 || strlen(name) >= MAX_VAR_NAME) {
         return -EINVAL;
     }
     
-    if (strlen(value) >= MAX_VAR_VALUE) {
+    len = strlen(value);
+    if (len >= MAX_VAR_VALUE) {
         return -EINVAL;
     }
     
-    // Find existing or free slot
-    for (i = 0; i < env_count; i++) {
-        if (strcmp(secure_env[i].name, name) == 0) {
-            break;
+    if (encrypt) {
+        plain = kmalloc(MAX_VAR_VALUE, GFP_KERNEL);
+        if (!plain) {
+            return -ENOMEM;
         }
     }
     
-    if (i >= MAX_ENV_VARS) {
-        pr_err("Secure Env: Maximum variables reached\n");
-        return -ENOSPC;
+    mutex_lock(&env_mutex);
+    if (env_locked) {
+        pr_err("Secure Env: Environment is locked\n");
+        ret = -EACCES;
+        goto out;
+    }
+    if (encrypt && !env_aead) {
+        ret = -ENODEV;
+        goto out;
     }
     
-    if (i == env_count) {
-        env_count++;
+    // Find existing or free slot
+    var = secure_env_find(name);
+    if (!var) {
+        if (env_count >= MAX_ENV_VARS) {
+            pr_err("Secure Env: Maximum variables reached\n");
+            ret = -ENOSPC;
+            goto out;
+        }
+        var = &secure_env[env_count++];
+        memset(var, 0, sizeof(*var));
+        strscpy(var->name, name, MAX_VAR_NAME);
+        hash_add(env_index, &var->node, secure_env_hash(var->name));
     }
     
-    strncpy(secure_env[i].name, name, MAX_VAR_NAME - 1);
-    secure_env[i].name[MAX_VAR_NAME - 1] = '\0';
+    kfree_sensitive(var->plain);
+    var->plain = NULL;
     
     if (encrypt) {
-        // Encrypt value
-        tfm = crypto_alloc_cipher("aes", 0, 0);
-        if (!tfm) {
-            return -ENOMEM;
-        }
-        
-        ret = crypto_cipher_setkey(tfm, env_key, sizeof(env_key));
+        // Fresh nonce for every value sealed under the key
+        get_random_bytes(var->nonce, sizeof(var->nonce));
+        memcpy(var->value, value, len);
+        ret = secure_env_crypt(var, var->value, len, true);
         if (ret) {
-            crypto_free_cipher(tfm);
-            return ret;
+            memzero_explicit(var->value, sizeof(var->value));
+            var->value_len = 0;
+            var->encrypted = false;
+            goto out;
         }
+        var->value_len = len + SECURE_ENV_TAG_LEN;
+        var->encrypted = true;
         
-        crypto_cipher_encrypt_one(tfm, encrypted_value, value);
-        crypto_free_cipher(tfm);
-        
-        memcpy(secure_env[i].value, encrypted_value, sizeof(encrypted_value));
-        secure_env[i].encrypted = true;
+        // What was just written is the likeliest thing to be read next
+        memcpy(plain, value, len + 1);
+        var->plain = plain;
+        plain = NULL;
     } else {
-        strncpy(secure_env[i].value, value, MAX_VAR_VALUE - 1);
-        secure_env[i].value[MAX_VAR_VALUE - 1] = '\0';
-        secure_env[i].encrypted = false;
+        memcpy(var->value, value, len + 1);
+        var->value_len = len;
+        var->encrypted = false;
     }
+    env_dirty = true;
     
     pr_info("Secure Env: Set %s\n", name);
     
-    return 0;
+out:
+    mutex_unlock(&env_mutex);
+    kfree(plain);
+    return ret;
 }
 
 /**
@@ -124,45 +483,51 @@ int secure_env_set(const char *name, const char *value, bool encrypt)
  */
 int secure_env_get(const char *name, char *value, size_t value_size)
 {
-    int i;
-    struct crypto_cipher *tfm;
-    u8 decrypted_value[MAX_VAR_VALUE];
-    int ret;
+    struct secure_env_var *var;
+    char *plain;
+    int ret = 0;
     
-    for (i = 0; i < env_count; i++) {
-        if (strcmp(secure_env[i].name, name) == 0) {
-            break;
-        }
+    if (!value || value_size == 0) {
+        return -EINVAL;
     }
     
-    if (i >= env_count) {
-        return -ENOENT;
+    mutex_lock(&env_mutex);
+    var = secure_env_find(name);
+    if (!var) {
+        ret = -ENOENT;
+        goto out;
     }
     
-    if (secure_env[i].encrypted) {
-        // Decrypt value
-        tfm = crypto_alloc_cipher("aes", 0, 0);
-        if (!tfm) {
-            return -ENOMEM;
+    if (var->encrypted) {
+        if (!var->plain) {
+            // Opened on first use only, then served from RAM until lock
+            if (env_locked || var->value_len < SECURE_ENV_TAG_LEN) {
+                ret = -EACCES;
+                goto out;
+            }
+            plain = kmalloc(sizeof(var->value), GFP_KERNEL);
+            if (!plain) {
+                ret = -ENOMEM;
+                goto out;
+            }
+            memcpy(plain, var->value, var->value_len);
+            ret = secure_env_crypt(var, (u8 *)plain, var->value_len, false);
+            if (ret) {
+                pr_err("Secure Env: %s failed authentication\n", name);
+                kfree_sensitive(plain);
+                goto out;
+            }
+            plain[var->value_len - SECURE_ENV_TAG_LEN] = '\0';
+            var->plain = plain;
         }
-        
-        ret = crypto_cipher_setkey(tfm, env_key, sizeof(env_key));
-        if (ret) {
-            crypto_free_cipher(tfm);
-            return ret;
-        }
-        
-        crypto_cipher_decrypt_one(tfm, decrypted_value, secure_env[i].value);
-        crypto_free_cipher(tfm);
-        
-        strncpy(value, (char *)decrypted_value, value_size - 1);
-        value[value_size - 1] = '\0';
+        strscpy(value, var->plain, value_size);
     } else {
-        strncpy(value, secure_env[i].value, value_size - 1);
-        value[value_size - 1] = '\0';
+        strscpy(value, (const char *)var->value, value_size);
     }
     
-    return 0;
+out:
+    mutex_unlock(&env_mutex);
+    return ret;
 }
 
 /**
@@ -170,14 +535,33 @@ int secure_env_get(const char *name, char *value, size_t value_size)
  */
 int secure_env_lock(void)
 {
+    int i, ret;
+    
     if (env_locked) {
         return 0;
     }
     
+    // Last chance to get changes out while the keys still exist
+    ret = secure_env_commit();
+    if (ret) {
+        pr_warn("Secure Env: Locking with uncommitted changes\n");
+    }
+    
+    mutex_lock(&env_mutex);
+    for (i = 0; i < env_count; i++) {
+        kfree_sensitive(secure_env[i].plain);
+        secure_env[i].plain = NULL;
+    }
+    
     // Clear key from memory (if possible)
-    memset(env_key, 0, sizeof(env_key));
+    memzero_explicit(env_key, sizeof(env_key));
+    crypto_free_aead(env_aead);
+    env_aead = NULL;
+    crypto_free_shash(env_hmac);
+    env_hmac = NULL;
     
     env_locked = true;
+    mutex_unlock(&env_mutex);
     
     pr_info("Secure Env: Environment locked\n");
     
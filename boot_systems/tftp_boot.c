@@ -5,6 +5,18 @@
  * 
  * Trivial File Transfer Protocol for network booting
  * Supports kernel and initramfs loading over network
+ *
+ * The read request asks for a larger block (RFC 2348 blksize) and for
+ * a window of blocks per ACK (RFC 7440 windowsize). A server that takes
+ * them answers with an OACK, which is ACKed as block 0; one that does
+ * not just starts sending 512-byte blocks, and one that refuses them is
+ * asked again without options. Within a window only the last block is
+ * ACKed; a block out of order is answered once with an ACK of the last
+ * one received in order, which restarts the server from there. Block
+ * numbers roll over at 65535, so the load offset comes from a count of
+ * blocks rather than the number on the wire. The retransmit timeout
+ * follows the measured round trip, RFC 6298 style, doubling on each
+ * timeout and never sampled from a retransmitted packet.
  */
 
 #include <common.h>
@@ -12,10 +24,29 @@
 #include <tftp.h>
 #include <image.h>
 
-#define TFTP_VERSION "1.0"
+#define TFTP_VERSION "1.1"
 #define TFTP_BLOCK_SIZE 512
 #define TFTP_MAX_RETRIES 5
-#define TFTP_TIMEOUT_MS 5000
+#define TFTP_TIMEOUT_MS 5000            // retransmit timeout ceiling, and the first one
+#define TFTP_MIN_TIMEOUT_MS 100
+
+#ifdef CONFIG_TFTP_BLOCKSIZE
+#define TFTP_WANT_BLKSIZE CONFIG_TFTP_BLOCKSIZE
+#else
+#define TFTP_WANT_BLKSIZE 1468          // fills a 1500-byte MTU
+#endif
+#ifdef CONFIG_TFTP_WINDOWSIZE
+#define TFTP_WANT_WINDOWSIZE CONFIG_TFTP_WINDOWSIZE
+#else
+#define TFTP_WANT_WINDOWSIZE 16
+#endif
+
+#define TFTP_OP_RRQ 1
+#define TFTP_OP_DATA 3
+#define TFTP_OP_ACK 4
+#define TFTP_OP_ERROR 5
+#define TFTP_OP_OACK 6
+#define TFTP_ERR_OPTION 8
 
 struct tftp_context {
     ulong server_ip;
@@ -32,49 +63,196 @@ struct tftp_context {
         TFTP_STATE_ACK,
         TFTP_STATE_ERROR
     } state;
+    
+    bool options;                       // RRQ carries blksize/windowsize
+    u16 server_port;                    // server TID, learned from its first reply
+    u16 blksize;
+    u16 windowsize;
+    u32 blocks;                         // received in order, across rollovers
+    u16 window_count;
+    bool resync_sent;                   // this gap has been ACKed already
+    
+    ulong timer;                        // last packet sent or progress made
+    ulong rto;
+    ulong srtt;
+    ulong rttvar;
+    ulong rtt_start;
+    bool rtt_pending;                   // a reply to an unrepeated packet is awaited
 };
 
 static struct tftp_context tftp_ctx;
 
+static int tftp_send_ack(u16 block_num);
+
+static uchar *tftp_put_string(uchar *p, const char *s)
+{
+    int len = strlen(s);
+    
+    memcpy(p, s, len);
+    p += len;
+    *p++ = 0;
+    return p;
+}
+
+static void tftp_send(int len)
+{
+    net_send_udp_packet(net_server_ip, tftp_ctx.server_port, TFTP_CLIENT_PORT, len);
+    tftp_ctx.timer = get_timer(0);
+}
+
+/**
+ * Expect a reply to what was just sent, and time it unless it was a repeat
+ */
+static void tftp_rtt_arm(bool retransmit)
+{
+    tftp_ctx.rtt_start = get_timer(0);
+    tftp_ctx.rtt_pending = !retransmit;
+}
+
+/**
+ * Fold a round trip sample into the retransmit timeout
+ */
+static void tftp_rtt_sample(void)
+{
+    ulong rtt, err;
+    
+    if (!tftp_ctx.rtt_pending) {
+        return;
+    }
+    tftp_ctx.rtt_pending = false;
+    rtt = get_timer(tftp_ctx.rtt_start);
+    
+    if (!tftp_ctx.srtt) {
+        tftp_ctx.srtt = rtt ? rtt : 1;
+        tftp_ctx.rttvar = rtt / 2;
+    } else {
+        err = rtt > tftp_ctx.srtt ? rtt - tftp_ctx.srtt : tftp_ctx.srtt - rtt;
+        tftp_ctx.rttvar = (3 * tftp_ctx.rttvar + err) / 4;
+        tftp_ctx.srtt = (7 * tftp_ctx.srtt + rtt) / 8;
+    }
+    tftp_ctx.rto = clamp_t(ulong, tftp_ctx.srtt + 4 * tftp_ctx.rttvar,
+                           TFTP_MIN_TIMEOUT_MS, TFTP_TIMEOUT_MS);
+}
+
 /**
  * Send TFTP Read Request (RRQ)
  */
 static int tftp_send_rrq(const char *filename, const char *mode)
 {
     uchar *pkt;
-    int len;
-    int pkt_len;
+    uchar *p;
+    char num[8];
     
     pkt = net_tx_packet + net_eth_hdr_size() + IP_UDP_HDR_SIZE;
     p = pkt;
     
     // Opcode: RRQ (1)
     *p++ = 0;
-    *p++ = 1;
+    *p++ = TFTP_OP_RRQ;
+    
+    p = tftp_put_string(p, filename);
+    p = tftp_put_string(p, mode);
+    
+    if (tftp_ctx.options) {
+        p = tftp_put_string(p, "blksize");
+        snprintf(num, sizeof(num), "%d", TFTP_WANT_BLKSIZE);
+        p = tftp_put_string(p, num);
+        p = tftp_put_string(p, "windowsize");
+        snprintf(num, sizeof(num), "%d", TFTP_WANT_WINDOWSIZE);
+        p = tftp_put_string(p, num);
+    }
     
-    // Filename
-    len = strlen(filename);
-    memcpy(p, filename, len);
-    p += len;
-    *p++ = 0;
+    // The server answers from a new port; until then it is the well known one
+    tftp_ctx.server_port = TFTP_SERVER_PORT;
+    tftp_send(p - pkt);
+    tftp_rtt_arm(tftp_ctx.state == TFTP_STATE_RRQ);
+    
+    tftp_ctx.state = TFTP_STATE_RRQ;
+    
+    printf("TFTP: Sent RRQ for '%s'\n", filename);
+    
+    return 0;
+}
+
+/**
+ * Send a TFTP ERROR, used to turn down an OACK
+ */
+static void tftp_send_error(u16 code, const char *msg)
+{
+    uchar *pkt;
+    uchar *p;
+    
+    pkt = net_tx_packet + net_eth_hdr_size() + IP_UDP_HDR_SIZE;
+    p = pkt;
     
-    // Mode
-    len = strlen(mode);
-    memcpy(p, mode, len);
-    p += len;
     *p++ = 0;
+    *p++ = TFTP_OP_ERROR;
+    *p++ = code >> 8;
+    *p++ = code & 0xff;
+    p = tftp_put_string(p, msg);
     
-    pkt_len = p - pkt;
+    tftp_send(p - pkt);
+}
+
+/**
+ * Restart the request without options
+ */
+static void tftp_restart_plain(void)
+{
+    printf("TFTP: Server refused options, falling back to %d-byte blocks\n", TFTP_BLOCK_SIZE);
+    tftp_ctx.options = false;
+    tftp_ctx.blksize = TFTP_BLOCK_SIZE;
+    tftp_ctx.windowsize = 1;
+    tftp_ctx.state = TFTP_STATE_IDLE;
+    tftp_send_rrq(tftp_ctx.filename, "octet");
+}
+
+/**
+ * Handle TFTP Option Acknowledgement
+ *
+ * The server may lower what was asked for but not raise it, and may
+ * leave options out, which keeps their defaults.
+ */
+static int tftp_handle_oack(uchar *pkt, int len)
+{
+    char *p = (char *)pkt + 2, *end = (char *)pkt + len;
+    ulong blksize = TFTP_BLOCK_SIZE, windowsize = 1;
     
-    // Send packet
-    net_send_udp_packet(net_server_ip, TFTP_SERVER_PORT, 
-                        TFTP_CLIENT_PORT, pkt_len);
+    if (tftp_ctx.state != TFTP_STATE_RRQ || !tftp_ctx.options) {
+        return -1;
+    }
     
-    tftp_ctx.state = TFTP_STATE_RRQ;
-    tftp_ctx.retries = 0;
+    while (p < end) {
+        char *name = p, *value;
+        
+        value = memchr(name, '\0', end - name);
+        if (!value++ || value >= end || !memchr(value, '\0', end - value)) {
+            break;
+        }
+        p = value + strlen(value) + 1;
+        
+        if (!strcasecmp(name, "blksize")) {
+            blksize = simple_strtoul(value, NULL, 10);
+        } else if (!strcasecmp(name, "windowsize")) {
+            windowsize = simple_strtoul(value, NULL, 10);
+        }
+    }
     
-    printf("TFTP: Sent RRQ for '%s'\n", filename);
+    if (blksize < 8 || blksize > TFTP_WANT_BLKSIZE ||
+        windowsize < 1 || windowsize > TFTP_WANT_WINDOWSIZE) {
+        tftp_send_error(TFTP_ERR_OPTION, "bad option value");
+        tftp_restart_plain();
+        return -1;
+    }
+    
+    tftp_ctx.blksize = blksize;
+    tftp_ctx.windowsize = windowsize;
+    printf("TFTP: Server accepted blksize %u, windowsize %u\n",
+           tftp_ctx.blksize, tftp_ctx.windowsize);
     
+    // Block 0 acknowledges the options and starts the transfer
+    tftp_send_ack(0);
+    tftp_rtt_arm(false);
     return 0;
 }
 
@@ -86,9 +264,10 @@ static int tftp_handle_data(uchar *pkt, int len)
     u16 opcode, block_num;
     u16 data_len;
     uchar *data;
+    u16 expected = tftp_ctx.block_num + 1;
     
     opcode = (pkt[0] << 8) | pkt[1];
-    if (opcode != 3) {  // DATA opcode
+    if (opcode != TFTP_OP_DATA) {
         return -1;
     }
     
@@ -96,29 +275,59 @@ static int tftp_handle_data(uchar *pkt, int len)
     data = pkt + 4;
     data_len = len - 4;
     
+    // Data straight after the RRQ means the server ignored the options
+    if (tftp_ctx.state == TFTP_STATE_RRQ) {
+        tftp_ctx.blksize = TFTP_BLOCK_SIZE;
+        tftp_ctx.windowsize = 1;
+    }
+    
+    if (data_len > tftp_ctx.blksize) {
+        printf("TFTP: Oversized block %d\n", block_num);
+        return -1;
+    }
+    
     // Check if this is the expected block
-    if (block_num != tftp_ctx.block_num + 1) {
-        printf("TFTP: Unexpected block number %d (expected %d)\n",
-               block_num, tftp_ctx.block_num + 1);
+    if (block_num != expected) {
+        // Ask the server to go on from the last good block, once per gap
+        if (!tftp_ctx.resync_sent && tftp_ctx.state != TFTP_STATE_RRQ) {
+            pr_debug("TFTP: Block %d out of order (expected %d)\n", block_num, expected);
+            tftp_send_ack(tftp_ctx.block_num);
+            tftp_rtt_arm(true);
+            tftp_ctx.window_count = 0;
+            tftp_ctx.resync_sent = true;
+        }
         return -1;
     }
     
+    tftp_rtt_sample();
+    
     // Copy data to load address
-    memcpy((void *)(tftp_ctx.load_addr + (block_num - 1) * TFTP_BLOCK_SIZE),
+    memcpy((void *)(tftp_ctx.load_addr + (ulong)tftp_ctx.blocks * tftp_ctx.blksize),
            data, data_len);
     
     tftp_ctx.block_num = block_num;
+    tftp_ctx.blocks++;
+    tftp_ctx.retries = 0;
+    tftp_ctx.resync_sent = false;
+    tftp_ctx.timer = get_timer(0);
+    tftp_ctx.state = TFTP_STATE_DATA;
     
     // Check if this is the last block
-    if (data_len < TFTP_BLOCK_SIZE) {
+    if (data_len < tftp_ctx.blksize) {
         tftp_ctx.last_block = block_num;
-        tftp_ctx.file_size = (block_num - 1) * TFTP_BLOCK_SIZE + data_len;
+        tftp_ctx.file_size = (size_t)(tftp_ctx.blocks - 1) * tftp_ctx.blksize + data_len;
+        tftp_send_ack(block_num);
         tftp_ctx.state = TFTP_STATE_IDLE;
         printf("TFTP: Transfer complete, %zu bytes\n", tftp_ctx.file_size);
+        return 0;
     }
     
-    // Send ACK
-    tftp_send_ack(block_num);
+    // Send ACK at the end of each window
+    if (++tftp_ctx.window_count >= tftp_ctx.windowsize) {
+        tftp_ctx.window_count = 0;
+        tftp_send_ack(block_num);
+        tftp_rtt_arm(false);
+    }
     
     return 0;
 }
@@ -136,21 +345,62 @@ static int tftp_send_ack(u16 block_num)
     
     // Opcode: ACK (4)
     *p++ = 0;
-    *p++ = 4;
+    *p++ = TFTP_OP_ACK;
     
     // Block number
     *p++ = (block_num >> 8) & 0xff;
     *p++ = block_num & 0xff;
     
     // Send packet
-    net_send_udp_packet(net_server_ip, TFTP_SERVER_PORT,
-                        TFTP_CLIENT_PORT, p - pkt);
+    tftp_send(p - pkt);
     
     tftp_ctx.state = TFTP_STATE_ACK;
     
     return 0;
 }
 
+/**
+ * Handle one TFTP packet from the server
+ */
+static void tftp_handler(uchar *pkt, unsigned int dest, struct in_addr sip,
+                         unsigned int src, unsigned int len)
+{
+    u16 opcode;
+    
+    if (dest != TFTP_CLIENT_PORT || len < 4) {
+        return;
+    }
+    
+    // The first reply fixes the server's port; anything else is a stray
+    if (tftp_ctx.state == TFTP_STATE_RRQ) {
+        tftp_ctx.server_port = src;
+    } else if (src != tftp_ctx.server_port) {
+        return;
+    }
+    
+    opcode = (pkt[0] << 8) | pkt[1];
+    switch (opcode) {
+    case TFTP_OP_DATA:
+        tftp_handle_data(pkt, len);
+        break;
+    case TFTP_OP_OACK:
+        tftp_handle_oack(pkt, len);
+        break;
+    case TFTP_OP_ERROR:
+        if (tftp_ctx.state == TFTP_STATE_RRQ && tftp_ctx.options &&
+            ((pkt[2] << 8) | pkt[3]) == TFTP_ERR_OPTION) {
+            tftp_restart_plain();
+            break;
+        }
+        printf("TFTP: Error %d from server: %.*s\n", (pkt[2] << 8) | pkt[3],
+               (int)len - 4, pkt + 4);
+        tftp_ctx.state = TFTP_STATE_ERROR;
+        break;
+    default:
+        break;
+    }
+}
+
 /**
  * TFTP timeout handler
  */
@@ -163,13 +413,17 @@ static void tftp_timeout_handler(void)
     }
     
     tftp_ctx.retries++;
-    printf("TFTP: Timeout, retry %d\n", tftp_ctx.retries);
+    tftp_ctx.rto = min_t(ulong, tftp_ctx.rto * 2, TFTP_TIMEOUT_MS);
+    printf("TFTP: Timeout, retry %d, next in %lu ms\n", tftp_ctx.retries, tftp_ctx.rto);
     
     // Resend last packet
     if (tftp_ctx.state == TFTP_STATE_RRQ) {
         tftp_send_rrq(tftp_ctx.filename, "octet");
-    } else if (tftp_ctx.state == TFTP_STATE_ACK) {
+    } else {
+        // A window cut short is restarted from the last block that arrived
+        tftp_ctx.window_count = 0;
         tftp_send_ack(tftp_ctx.block_num);
+        tftp_rtt_arm(true);
     }
 }
 
@@ -185,15 +439,21 @@ int tftp_load_file(ulong load_addr, const char *filename, ulong server_ip)
            filename, &server_ip, load_addr);
     
     // Initialize context
+    memset(&tftp_ctx, 0, sizeof(tftp_ctx));
     tftp_ctx.server_ip = server_ip;
     tftp_ctx.filename = (char *)filename;
     tftp_ctx.load_addr = load_addr;
     tftp_ctx.block_num = 0;
     tftp_ctx.retries = 0;
     tftp_ctx.state = TFTP_STATE_IDLE;
+    tftp_ctx.options = true;
+    tftp_ctx.blksize = TFTP_BLOCK_SIZE;
+    tftp_ctx.windowsize = 1;
+    tftp_ctx.rto = TFTP_TIMEOUT_MS;
     
     // Set server IP
     net_server_ip = server_ip;
+    net_set_udp_handler(tftp_handler);
     
     // Send RRQ
     ret = tftp_send_rrq(filename, "octet");
@@ -208,9 +468,8 @@ int tftp_load_file(ulong load_addr, const char *filename, ulong server_ip)
            tftp_ctx.state != TFTP_STATE_ERROR) {
         
         // Check timeout
-        if (get_timer(start_time) > TFTP_TIMEOUT_MS) {
+        if (get_timer(tftp_ctx.timer) > tftp_ctx.rto) {
             tftp_timeout_handler();
-            start_time = get_timer(0);
         }
         
         // Process incoming packets
@@ -224,8 +483,8 @@ int tftp_load_file(ulong load_addr, const char *filename, ulong server_ip)
         return -1;
     }
     
-    printf("TFTP: File loaded successfully\n");
+    printf("TFTP: File loaded successfully in %lu ms, srtt %lu ms\n",
+           get_timer(start_time), tftp_ctx.srtt);
     
     return 0;
 }
-
@@ -5,16 +5,47 @@
  * 
  * UART-based ROM bootloader for recovery and factory programming
  * Supports XMODEM, YMODEM protocols for image transfer
+ *
+ * Option 3 is a streaming download for factory tools: after contact at
+ * 115200 the host asks for a faster rate, both sides switch and prove
+ * the link with a sync word (falling back to 115200 if it fails), and
+ * the image then arrives as a window of CRC32-checked blocks sent
+ * without waiting for each ACK. Blocks land straight at their offset in
+ * the load area. The target ACKs cumulatively every half window; on a
+ * bad or missing block it lets the line go quiet and NAKs with the
+ * block it wants, and the host goes back to it.
  */
 
 #include <common.h>
 #include <serial.h>
 #include <xmodem.h>
+#include <u-boot/crc.h>
+#include <asm/unaligned.h>
 
-#define UART_ROM_BOOT_VERSION "1.0.0"
+#define UART_ROM_BOOT_VERSION "1.1.0"
 #define UART_BAUDRATE 115200
 #define BOOT_DELAY_MS 3000
 
+#ifndef CONFIG_UART_ROM_MAX_BAUD
+#define CONFIG_UART_ROM_MAX_BAUD 3000000
+#endif
+#ifndef CONFIG_UART_ROM_MAX_SIZE
+#define CONFIG_UART_ROM_MAX_SIZE (64 << 20)
+#endif
+
+#define STREAM_BLOCK_SIZE 1024
+#define STREAM_WINDOW 16
+#define STREAM_HDR_LEN 12
+#define STREAM_FRAME_DATA 'D'
+#define STREAM_FRAME_END 'E'
+#define STREAM_ACK 'A'
+#define STREAM_NAK 'N'
+#define STREAM_SYNC_OK 'K'
+#define STREAM_SYNC_WORD 0x434e5953             // "SYNC"
+#define STREAM_BYTE_TIMEOUT_MS 1000
+#define STREAM_IDLE_MS 20
+#define STREAM_MAX_RETRIES 10
+
 /**
  * Wait for boot command from UART
  */
@@ -96,6 +127,234 @@ static int uart_rom_load_ymodem(ulong load_addr)
     return 0;
 }
 
+/**
+ * Read a byte, or -1 if none arrives in time
+ */
+static int uart_rom_getc_timeout(ulong timeout_ms)
+{
+    ulong start = get_timer(0);
+    
+    while (!serial_tstc()) {
+        if (get_timer(start) >= timeout_ms) {
+            return -1;
+        }
+    }
+    
+    return serial_getc();
+}
+
+static int uart_rom_read(u8 *buf, size_t len, ulong timeout_ms)
+{
+    size_t i;
+    int c;
+    
+    for (i = 0; i < len; i++) {
+        c = uart_rom_getc_timeout(timeout_ms);
+        if (c < 0) {
+            return -1;
+        }
+        buf[i] = c;
+    }
+    
+    return 0;
+}
+
+static void uart_rom_send_seq(char code, u16 seq)
+{
+    serial_putc(code);
+    serial_putc(seq & 0xff);
+    serial_putc(seq >> 8);
+}
+
+/**
+ * Board hook: rates the UART can really run at
+ */
+__weak bool uart_rom_baud_supported(u32 baud)
+{
+    switch (baud) {
+    case 115200:
+    case 230400:
+    case 460800:
+    case 921600:
+    case 1000000:
+    case 1500000:
+    case 2000000:
+    case 3000000:
+    case 4000000:
+        return baud <= CONFIG_UART_ROM_MAX_BAUD;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Let the host pick a faster rate
+ *
+ * The request is 'B', the rate and a CRC32 of both. The answer goes out
+ * at the old rate; after it both sides switch, the host sends the sync
+ * word and the target answers it, at the new rate. Anything going wrong
+ * leaves the link at UART_BAUDRATE, where the host will look for it.
+ */
+static u32 uart_rom_negotiate_baud(void)
+{
+    u8 req[9];
+    u8 sync[4];
+    u32 baud;
+    ulong start;
+    int c;
+    
+    if (uart_rom_read(req, sizeof(req), STREAM_BYTE_TIMEOUT_MS * 3) ||
+        req[0] != 'B' || crc32(0, req, 5) != get_unaligned_le32(req + 5)) {
+        return UART_BAUDRATE;
+    }
+    
+    baud = get_unaligned_le32(req + 1);
+    if (!uart_rom_baud_supported(baud)) {
+        serial_putc(STREAM_NAK);
+        return UART_BAUDRATE;
+    }
+    serial_putc(STREAM_ACK);
+    
+    // Let the ACK leave the shifter before the divisor changes
+    udelay(2000);
+    serial_setbrg(baud);
+    
+    memset(sync, 0, sizeof(sync));
+    start = get_timer(0);
+    while (get_timer(start) < 500) {
+        c = uart_rom_getc_timeout(50);
+        if (c < 0) {
+            continue;
+        }
+        memmove(sync, sync + 1, 3);
+        sync[3] = c;
+        if (get_unaligned_le32(sync) == STREAM_SYNC_WORD) {
+            serial_putc(STREAM_SYNC_OK);
+            return baud;
+        }
+    }
+    
+    printf("No sync at %u baud, staying at %u\n", baud, UART_BAUDRATE);
+    serial_setbrg(UART_BAUDRATE);
+    return UART_BAUDRATE;
+}
+
+/**
+ * Throw away whatever is still coming until the line goes quiet
+ */
+static void uart_rom_drain(void)
+{
+    while (uart_rom_getc_timeout(STREAM_IDLE_MS) >= 0)
+        ;
+}
+
+/**
+ * Load image via the windowed streaming protocol
+ *
+ * Frames are a 12-byte header (type, 0, sequence, offset, length or
+ * image CRC), the payload, and a CRC32 of header and payload. The end
+ * frame carries the total length in place of the offset and the CRC32
+ * of the whole image in place of the length.
+ */
+static int uart_rom_load_stream(ulong load_addr, size_t *size)
+{
+    u8 hdr[STREAM_HDR_LEN];
+    u8 crc_buf[4];
+    u8 *dst = (u8 *)load_addr;
+    u16 expected = 0;
+    u16 since_ack = 0;
+    int retries = 0;
+    u32 baud;
+    ulong start;
+    
+    printf("Waiting for streaming transfer...\n");
+    
+    baud = uart_rom_negotiate_baud();
+    
+    // Tell the host how to send: window and block size
+    serial_putc(STREAM_ACK);
+    serial_putc(STREAM_WINDOW);
+    serial_putc(STREAM_BLOCK_SIZE & 0xff);
+    serial_putc(STREAM_BLOCK_SIZE >> 8);
+    
+    start = get_timer(0);
+    for (;;) {
+        u32 offset, len, crc;
+        u16 seq;
+        bool ok;
+        
+        if (uart_rom_read(hdr, 1, STREAM_BYTE_TIMEOUT_MS * 10)) {
+            printf("Streaming transfer timed out\n");
+            goto fail;
+        }
+        ok = (hdr[0] == STREAM_FRAME_DATA || hdr[0] == STREAM_FRAME_END) &&
+             !uart_rom_read(hdr + 1, STREAM_HDR_LEN - 1, STREAM_BYTE_TIMEOUT_MS);
+        
+        if (ok && hdr[0] == STREAM_FRAME_END) {
+            ok = !uart_rom_read(crc_buf, 4, STREAM_BYTE_TIMEOUT_MS) &&
+                 crc32(0, hdr, STREAM_HDR_LEN) == get_unaligned_le32(crc_buf);
+            // Ending before every block arrived is treated as a gap
+            if (ok && get_unaligned_le16(hdr + 2) == expected) {
+                len = get_unaligned_le32(hdr + 4);
+                crc = get_unaligned_le32(hdr + 8);
+                if (len > CONFIG_UART_ROM_MAX_SIZE || crc32(0, dst, len) != crc) {
+                    uart_rom_send_seq(STREAM_NAK, 0xffff);
+                    printf("Streamed image failed its CRC\n");
+                    goto fail;
+                }
+                uart_rom_send_seq(STREAM_ACK, expected);
+                *size = len;
+                printf("Streaming transfer complete: %u bytes at %u baud in %lu ms\n",
+                       len, baud, get_timer(start));
+                serial_setbrg(UART_BAUDRATE);
+                return 0;
+            }
+        } else if (ok) {
+            offset = get_unaligned_le32(hdr + 4);
+            len = get_unaligned_le16(hdr + 8);
+            
+            // Straight into place; a bad frame only costs a rewrite later
+            ok = len && len <= STREAM_BLOCK_SIZE &&
+                 offset <= CONFIG_UART_ROM_MAX_SIZE - len &&
+                 !uart_rom_read(dst + offset, len, STREAM_BYTE_TIMEOUT_MS) &&
+                 !uart_rom_read(crc_buf, 4, STREAM_BYTE_TIMEOUT_MS) &&
+                 crc32(crc32(0, hdr, STREAM_HDR_LEN), dst + offset, len) ==
+                 get_unaligned_le32(crc_buf);
+            
+            seq = get_unaligned_le16(hdr + 2);
+            if (ok && seq == expected) {
+                expected++;
+                retries = 0;
+                if (++since_ack >= STREAM_WINDOW / 2) {
+                    uart_rom_send_seq(STREAM_ACK, expected);
+                    since_ack = 0;
+                }
+                continue;
+            }
+            if (ok && (s16)(seq - expected) < 0) {
+                // Resent after a NAK of ours; the ACK tells the host where we are
+                uart_rom_send_seq(STREAM_ACK, expected);
+                since_ack = 0;
+                continue;
+            }
+            // Ahead of us: the block in between was lost
+        }
+        
+        // Lost framing or a corrupt block: wait out the window, then go back
+        if (++retries > STREAM_MAX_RETRIES) {
+            printf("Streaming transfer: too many errors at block %u\n", expected);
+            goto fail;
+        }
+        uart_rom_drain();
+        uart_rom_send_seq(STREAM_NAK, expected);
+        since_ack = 0;
+    }
+    
+fail:
+    serial_setbrg(UART_BAUDRATE);
+    return -1;
+}
+
 /**
  * Verify loaded image
  */
@@ -151,6 +410,7 @@ void uart_rom_boot(void)
 {
     int cmd;
     ulong load_addr = CONFIG_SYS_LOAD_ADDR;
+    size_t image_size = 0;
     int ret;
     
     // Initialize UART
@@ -169,7 +429,8 @@ void uart_rom_boot(void)
     printf("\n=== UART ROM Boot Menu ===\n");
     printf("1. XMODEM download\n");
     printf("2. YMODEM download\n");
-    printf("Select protocol (1/2): ");
+    printf("3. Streaming download (high speed)\n");
+    printf("Select protocol (1/2/3): ");
     
     cmd = serial_getc();
     serial_putc(cmd);
@@ -179,6 +440,8 @@ void uart_rom_boot(void)
         ret = uart_rom_load_xmodem(load_addr);
     } else if (cmd == '2') {
         ret = uart_rom_load_ymodem(load_addr);
+    } else if (cmd == '3') {
+        ret = uart_rom_load_stream(load_addr, &image_size);
     } else {
         printf("Invalid selection\n");
         return;
@@ -190,7 +453,7 @@ void uart_rom_boot(void)
     }
     
     // Verify image
-    ret = uart_rom_verify_image(load_addr, 0);
+    ret = uart_rom_verify_image(load_addr, image_size);
     if (ret) {
         printf("Image verification failed\n");
         return;
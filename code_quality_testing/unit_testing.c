@@ -5,6 +5,19 @@
  * 
  * Advanced unit testing framework with coverage analysis
  * Research breakthrough: 100% code coverage achieved
+ *
+ * unit_test_run_all() runs suites side by side, one work item per suite
+ * on an unbound workqueue of unit_test_workers threads; a suite's cases
+ * run in order in its own worker and only touch the suite, with the
+ * totals merged under a lock, so one suite cannot see another's state.
+ * With shard_count > 1 each CI machine runs only its share: suites are
+ * dealt longest first, by the durations CI fed back with
+ * unit_test_set_history(), to the least loaded shard, which every machine
+ * computes the same way. A run only records its suites' wall times in
+ * last_run_ms, for CI to collect from every shard and feed back as one
+ * history; planning never reads them, so a shard's own run cannot change
+ * its next plan. Each case is timed with
+ * ktime and counted in a log2 histogram of microseconds.
  */
 
 #include <linux/module.h>
@@ -14,12 +27,18 @@
 #include <linux/atomic.h>
 #include <linux/timer.h>
 #include <linux/workqueue.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/sort.h>
+#include <linux/moduleparam.h>
 
-#define UNIT_TEST_VERSION "1.0.0"
+#define UNIT_TEST_VERSION "1.1.0"
 #define MAX_TEST_CASES 128
 #define MAX_TEST_SUITES 32
 #define MAX_ASSERTIONS 256
 #define TEST_TIMEOUT_MS 10000
+#define UNIT_TEST_MAX_SHARDS 64
+#define UNIT_TEST_HIST_BUCKETS 24           // bucket n: [2^(n-1), 2^n) us
 
 enum test_result {
     TEST_RESULT_PASS = 0,
@@ -54,9 +73,12 @@ struct test_case {
     u32 passed_assertions;
     u32 failed_assertions;
     u32 execution_time_ms;
+    u32 execution_time_us;
     u32 error_count;
     struct test_assertion assertions[MAX_ASSERTIONS];
     bool active;
+    int (*run)(void *data);             // NULL: the case only checks its assertions
+    void *data;
 };
 
 struct test_suite {
@@ -70,6 +92,13 @@ struct test_suite {
     u32 total_execution_time_ms;
     u32 error_count;
     bool active;
+    
+    // Runner
+    u32 history_ms;                     // duration fed back by CI, for sharding
+    u32 last_run_ms;                    // wall time of this machine's last run
+    int shard;
+    int run_error;
+    struct work_struct work;
 };
 
 struct unit_testing {
@@ -81,10 +110,28 @@ struct unit_testing {
     u32 coverage_percentage;
     bool testing_active;
     struct timer_list test_timer;
+    
+    spinlock_t stats_lock;              // totals and histogram
+    u32 histogram[UNIT_TEST_HIST_BUCKETS];
+    struct workqueue_struct *wq;
 };
 
 static struct unit_testing global_unit_testing;
 
+static unsigned int unit_test_workers = 4;
+module_param(unit_test_workers, uint, 0444);
+MODULE_PARM_DESC(unit_test_workers, "Suites run at the same time");
+
+static unsigned int shard_count = 1;
+module_param(shard_count, uint, 0644);
+MODULE_PARM_DESC(shard_count, "CI machines the suites are split across");
+
+static unsigned int shard_index;
+module_param(shard_index, uint, 0644);
+MODULE_PARM_DESC(shard_index, "Which of the shard_count shares this machine runs");
+
+static void unit_test_suite_work(struct work_struct *work);
+
 /**
  * Initialize unit testing framework
  */
@@ -100,6 +147,14 @@ static int unit_testing_init(void)
     global_unit_testing.total_execution_time_ms = 0;
     global_unit_testing.coverage_percentage = 0;
     global_unit_testing.testing_active = false;
+    spin_lock_init(&global_unit_testing.stats_lock);
+    memset(global_unit_testing.histogram, 0, sizeof(global_unit_testing.histogram));
+    
+    global_unit_testing.wq = alloc_workqueue("unit_test", WQ_UNBOUND,
+                                             clamp(unit_test_workers, 1U, (unsigned int)MAX_TEST_SUITES));
+    if (!global_unit_testing.wq) {
+        return -ENOMEM;
+    }
     
     // Initialize test suites
     for (i = 0; i < MAX_TEST_SUITES; i++) {
@@ -112,6 +167,9 @@ static int unit_testing_init(void)
         global_unit_testing.test_suites[i].total_execution_time_ms = 0;
         global_unit_testing.test_suites[i].error_count = 0;
         global_unit_testing.test_suites[i].active = false;
+        global_unit_testing.test_suites[i].history_ms = 0;
+        global_unit_testing.test_suites[i].last_run_ms = 0;
+        INIT_WORK(&global_unit_testing.test_suites[i].work, unit_test_suite_work);
         
         // Initialize test cases
         for (j = 0; j < MAX_TEST_CASES; j++) {
@@ -124,6 +182,7 @@ static int unit_testing_init(void)
             global_unit_testing.test_suites[i].test_cases[j].execution_time_ms = 0;
             global_unit_testing.test_suites[i].test_cases[j].error_count = 0;
             global_unit_testing.test_suites[i].test_cases[j].active = false;
+            global_unit_testing.test_suites[i].test_cases[j].run = NULL;
             
             // Initialize assertions
             for (k = 0; k < MAX_ASSERTIONS; k++) {
@@ -277,14 +336,61 @@ static int unit_test_add_assertion(int suite_id, int case_id, enum assertion_typ
     return 0;
 }
 
+/**
+ * Give a test case a body to run
+ */
+static int unit_test_set_case_fn(int suite_id, int case_id, int (*run)(void *data), void *data)
+{
+    struct test_case *test_case;
+    
+    if (suite_id < 0 || suite_id >= MAX_TEST_SUITES || case_id < 0 || case_id >= MAX_TEST_CASES) {
+        return -EINVAL;
+    }
+    
+    test_case = &global_unit_testing.test_suites[suite_id].test_cases[case_id];
+    test_case->run = run;
+    test_case->data = data;
+    
+    return 0;
+}
+
+/**
+ * Tell the sharder how long a suite took on a previous run
+ */
+static int unit_test_set_history(int suite_id, u32 duration_ms)
+{
+    if (suite_id < 0 || suite_id >= MAX_TEST_SUITES) {
+        return -EINVAL;
+    }
+    
+    global_unit_testing.test_suites[suite_id].history_ms = duration_ms;
+    return 0;
+}
+
+/**
+ * How long a suite took on this machine's last run, for CI to feed back
+ */
+static int unit_test_get_last_run(int suite_id, u32 *duration_ms)
+{
+    if (suite_id < 0 || suite_id >= MAX_TEST_SUITES || !duration_ms) {
+        return -EINVAL;
+    }
+    
+    *duration_ms = global_unit_testing.test_suites[suite_id].last_run_ms;
+    return 0;
+}
+
 /**
  * Run test case
  */
 static int unit_test_run_case(int suite_id, int case_id)
 {
-    u32 start_time, end_time;
+    ktime_t start;
+    u32 us;
+    int bucket;
+    int ret = 0;
     
-    if (suite_id >= MAX_TEST_SUITES || case_id >= MAX_TEST_CASES) {
+    if (suite_id < 0 || suite_id >= MAX_TEST_SUITES || case_id < 0 || case_id >= MAX_TEST_CASES) {
         pr_err("Invalid test case parameters\n");
         return -EINVAL;
     }
@@ -297,18 +403,24 @@ static int unit_test_run_case(int suite_id, int case_id)
         return -EINVAL;
     }
     
-    pr_info("Running test case: %s\n", test_case->name);
+    pr_debug("Running test case: %s\n", test_case->name);
     
-    start_time = jiffies;
+    start = ktime_get();
     
-    // Simulate test execution
-    udelay(1000); // 1ms delay
+    if (test_case->run) {
+        ret = test_case->run(test_case->data);
+    }
     
-    end_time = jiffies;
-    test_case->execution_time_ms = jiffies_to_msecs(end_time - start_time);
+    us = min_t(s64, ktime_us_delta(ktime_get(), start), U32_MAX);
+    test_case->execution_time_us = us;
+    test_case->execution_time_ms = us / 1000;
     
     // Determine test result
-    if (test_case->failed_assertions > 0) {
+    if (ret || us > TEST_TIMEOUT_MS * 1000) {
+        // A worker cannot be killed; a case that overran is an error, not a hang
+        test_case->result = TEST_RESULT_ERROR;
+        test_case->error_count++;
+    } else if (test_case->failed_assertions > 0) {
         test_case->result = TEST_RESULT_FAIL;
     } else if (test_case->assertion_count == 0) {
         test_case->result = TEST_RESULT_SKIP;
@@ -317,64 +429,158 @@ static int unit_test_run_case(int suite_id, int case_id)
     }
     
     suite->total_execution_time_ms += test_case->execution_time_ms;
+    
+    bucket = min_t(int, fls(us), UNIT_TEST_HIST_BUCKETS - 1);
+    spin_lock(&global_unit_testing.stats_lock);
     global_unit_testing.total_execution_time_ms += test_case->execution_time_ms;
+    global_unit_testing.histogram[bucket]++;
+    spin_unlock(&global_unit_testing.stats_lock);
     
     atomic_inc(&global_unit_testing.total_tests);
     
-    pr_info("Test case completed: %s, result=%d, time=%d ms\n",
-            test_case->name, test_case->result, test_case->execution_time_ms);
+    pr_info("Test case completed: %s, result=%d, time=%u us\n",
+            test_case->name, test_case->result, us);
     
     return 0;
 }
 
+/**
+ * Run one suite's cases in order, in its own worker
+ */
+static void unit_test_suite_work(struct work_struct *work)
+{
+    struct test_suite *suite = container_of(work, struct test_suite, work);
+    int suite_id = suite - global_unit_testing.test_suites;
+    ktime_t start = ktime_get();
+    int j, ret;
+    
+    pr_info("Running test suite: %s\n", suite->name);
+    
+    suite->run_error = 0;
+    for (j = 0; j < suite->test_case_count; j++) {
+        struct test_case *test_case = &suite->test_cases[j];
+        
+        if (!test_case->active) {
+            continue;
+        }
+        
+        ret = unit_test_run_case(suite_id, j);
+        if (ret) {
+            pr_err("Test case %s failed to run\n", test_case->name);
+            suite->error_count++;
+            suite->run_error = ret;
+            break;
+        }
+    }
+    
+    // Wall time, not the sum of cases: what CI feeds back for sharding
+    suite->last_run_ms = ktime_ms_delta(ktime_get(), start);
+}
+
+static int unit_test_cmp_duration(const void *a, const void *b)
+{
+    const struct test_suite *sa = &global_unit_testing.test_suites[*(const int *)a];
+    const struct test_suite *sb = &global_unit_testing.test_suites[*(const int *)b];
+    
+    if (sa->history_ms != sb->history_ms) {
+        return sa->history_ms < sb->history_ms ? 1 : -1;
+    }
+    
+    // Equal durations in suite order, so every shard computes the same plan
+    return *(const int *)a - *(const int *)b;
+}
+
+/**
+ * Deal suites, longest first, to the least loaded shard
+ *
+ * Fills order[] with the active suites longest first and returns how
+ * many; each suite's shard is set.
+ */
+static int unit_test_plan(int *order)
+{
+    u64 load[UNIT_TEST_MAX_SHARDS] = { 0 };
+    u32 shards = clamp(shard_count, 1U, (unsigned int)UNIT_TEST_MAX_SHARDS);
+    int i, n = 0;
+    u32 k, best;
+    
+    for (i = 0; i < MAX_TEST_SUITES; i++) {
+        if (global_unit_testing.test_suites[i].active) {
+            order[n++] = i;
+        }
+    }
+    sort(order, n, sizeof(*order), unit_test_cmp_duration, NULL);
+    
+    for (i = 0; i < n; i++) {
+        struct test_suite *suite = &global_unit_testing.test_suites[order[i]];
+        
+        best = 0;
+        for (k = 1; k < shards; k++) {
+            if (load[k] < load[best]) {
+                best = k;
+            }
+        }
+        
+        // Never run suites count as one case each, so they still spread out
+        load[best] += suite->history_ms ? suite->history_ms : suite->test_case_count;
+        suite->shard = best;
+    }
+    
+    return n;
+}
+
 /**
  * Run all tests
  */
 static int unit_test_run_all(void)
 {
-    int i, j, ret;
+    int order[MAX_TEST_SUITES];
+    int i, n, queued = 0, ret = 0;
+    ktime_t start;
+    
+    if (shard_index >= max(shard_count, 1U)) {
+        pr_err("Shard %u of %u does not exist\n", shard_index, shard_count);
+        return -EINVAL;
+    }
     
     pr_info("Running all unit tests\n");
     
     global_unit_testing.testing_active = true;
+    start = ktime_get();
+    
+    n = unit_test_plan(order);
     
-    for (i = 0; i < global_unit_testing.test_suite_count; i++) {
-        struct test_suite *suite = &global_unit_testing.test_suites[i];
+    // Longest first, so the tail of the run is short suites filling gaps
+    for (i = 0; i < n; i++) {
+        struct test_suite *suite = &global_unit_testing.test_suites[order[i]];
         
-        if (!suite->active) {
-            continue;
+        if (suite->shard == shard_index) {
+            queue_work(global_unit_testing.wq, &suite->work);
+            queued++;
         }
+    }
+    flush_workqueue(global_unit_testing.wq);
+    
+    for (i = 0; i < n; i++) {
+        struct test_suite *suite = &global_unit_testing.test_suites[order[i]];
         
-        pr_info("Running test suite: %s\n", suite->name);
-        
-        for (j = 0; j < suite->test_case_count; j++) {
-            struct test_case *test_case = &suite->test_cases[j];
-            
-            if (!test_case->active) {
-                continue;
-            }
-            
-            ret = unit_test_run_case(i, j);
-            if (ret) {
-                pr_err("Test case %s failed to run\n", test_case->name);
-                suite->error_count++;
-                global_unit_testing.testing_active = false;
-                return ret;
-            }
+        if (suite->shard == shard_index && suite->run_error && !ret) {
+            ret = suite->run_error;
         }
     }
     
     global_unit_testing.testing_active = false;
     
-    pr_info("All unit tests completed\n");
+    pr_info("All unit tests completed: %d suites on shard %u/%u in %lld ms\n",
+            queued, shard_index, shard_count, ktime_ms_delta(ktime_get(), start));
     
-    return 0;
+    return ret;
 }
 
 /**
  * Get test statistics
  */
-static int unit_test_get_stats(u32 *total_tests, u32 *total_assertions, u32 *total_execution_time_ms, u32 *coverage_percentage)
+static int unit_test_get_stats(u32 *total_tests, u32 *total_assertions, u32 *total_execution_time_ms, u32 *coverage_percentage,
+                               u32 *histogram)
 {
     if (total_tests) {
         *total_tests = atomic_read(&global_unit_testing.total_tests);
@@ -388,6 +594,12 @@ static int unit_test_get_stats(u32 *total_tests, u32 *total_assertions, u32 *tot
     if (coverage_percentage) {
         *coverage_percentage = global_unit_testing.coverage_percentage;
     }
+    if (histogram) {
+        // UNIT_TEST_HIST_BUCKETS entries, case counts by log2 of run time in us
+        spin_lock(&global_unit_testing.stats_lock);
+        memcpy(histogram, global_unit_testing.histogram, sizeof(global_unit_testing.histogram));
+        spin_unlock(&global_unit_testing.stats_lock);
+    }
     
     return 0;
 }
@@ -416,6 +628,8 @@ static int __init unit_testing_init_module(void)
  */
 static void __exit unit_testing_cleanup_module(void)
 {
+    destroy_workqueue(global_unit_testing.wq);
+    
     pr_info("Unit Testing unloaded\n");
 }
 
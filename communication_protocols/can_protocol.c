@@ -13,13 +13,30 @@
 #include <linux/can/dev.h>
 #include <linux/can/error.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
 #include <linux/errno.h>
 #include <linux/atomic.h>
-#include <linux/delay.h>
+#include <linux/hash.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/cache.h>
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/ethtool.h>
+#include <linux/can/skb.h>
 
-#define CAN_VERSION "2.3.0"
+#include "can_protocol.h"
+
+#define CAN_VERSION "2.5.0"
 #define CAN_MAX_DEVICES 8
-#define CAN_MAX_FILTERS 32
+#define CAN_MAX_FILTERS 128
+#define CAN_FILTER_HASH_BITS 8              // twice CAN_MAX_FILTERS, for short probes
+#define CAN_FILTER_EMPTY U32_MAX            // never a frame key: RTR and ERR bits are masked off
+#define CAN_RX_RING_SIZE 1024               // frames, power of two
+#define CAN_TX_QUEUE_LEN 64
+#define CAN_NAPI_BATCH 64                   // ring entries taken per pass in the NAPI poll
 #define CAN_FD_MAX_DATA_LEN 64
 #define CAN_CLASSIC_MAX_DATA_LEN 8
 
@@ -31,6 +48,51 @@ struct can_filter_config {
     bool active;
 };
 
+/*
+ * Compiled filters, swapped under RCU so the ISR never waits for a
+ * reconfiguration. Exact IDs are in an open addressed hash, masks are
+ * scanned. Frames from a bank below sw_bank matched a filter of their
+ * own in hardware and are not checked again.
+ */
+struct can_filter_set {
+    u32 count;
+    int sw_bank;
+    u32 num_masked;
+    struct {
+        u32 id;
+        u32 mask;
+    } masked[CAN_MAX_FILTERS];
+    u32 exact[1 << CAN_FILTER_HASH_BITS];
+    struct rcu_head rcu;
+};
+
+struct can_rx_entry {
+    struct canfd_frame frame;
+    u64 timestamp;                          // hardware receive time in ns, 0 if none
+};
+
+/*
+ * One producer (the ISR) and one reader per device: the NAPI poll while
+ * the interface is up. head and tail live on their own cache lines.
+ */
+struct can_rx_ring {
+    u32 head ____cacheline_aligned_in_smp;
+    u32 tail ____cacheline_aligned_in_smp;
+    struct can_rx_entry *entries;
+};
+
+struct can_tx_entry {
+    u32 key;                                // arbitration priority, lower wins
+    u32 seq;                                // keeps frames of equal priority in order
+    struct canfd_frame frame;
+};
+
+struct can_mailbox {
+    bool busy;
+    bool aborting;
+    struct can_tx_entry entry;
+};
+
 struct can_device_config {
     int device_id;
     u32 bitrate;
@@ -42,11 +104,53 @@ struct can_device_config {
     atomic_t rx_count;
     u32 error_count;
     bool active;
+    
+    // Controller
+    const struct can_hw_ops *ops;
+    void *ctx;
+    int filter_banks;
+    int tx_mailboxes;
+    struct mutex filter_lock;
+    struct can_filter_set __rcu *filter_set;
+    
+    struct can_rx_ring rx;
+    wait_queue_head_t rx_wait;
+    u32 rx_overflow;
+    u32 rx_rejected;
+    
+    // Transmit queue: a min-heap on key, then seq
+    spinlock_t tx_lock;
+    struct can_tx_entry tx_heap[CAN_TX_QUEUE_LEN];
+    u32 tx_queued;
+    u32 tx_seq;
+    struct can_mailbox mailboxes[CAN_MAX_MAILBOXES];
+    u32 tx_preempted;
+    
+    // SocketCAN interface, once a controller is attached
+    struct net_device *ndev;
+    bool net_up;
+};
+
+// netdev_priv() of the SocketCAN interface; struct can_priv comes first
+struct can_net_priv {
+    struct can_priv can;
+    struct can_device_config *dev;
+    struct napi_struct napi;
 };
 
 static struct can_device_config can_devices[CAN_MAX_DEVICES];
 static int can_device_count = 0;
 
+static int can_net_register(struct can_device_config *dev);
+
+static struct can_device_config *can_device(int dev_id)
+{
+    if (dev_id < 0 || dev_id >= can_device_count || !can_devices[dev_id].active) {
+        return NULL;
+    }
+    return &can_devices[dev_id];
+}
+
 /**
  * Initialize CAN device
  */
@@ -59,6 +163,18 @@ static int can_device_init(struct can_device_config *dev, int dev_id, u32 bitrat
         return -EINVAL;
     }
     
+    dev->rx.entries = kvmalloc_array(CAN_RX_RING_SIZE, sizeof(*dev->rx.entries), GFP_KERNEL);
+    if (!dev->rx.entries) {
+        return -ENOMEM;
+    }
+    dev->rx.head = 0;
+    dev->rx.tail = 0;
+    init_waitqueue_head(&dev->rx_wait);
+    mutex_init(&dev->filter_lock);
+    spin_lock_init(&dev->tx_lock);
+    RCU_INIT_POINTER(dev->filter_set, NULL);
+    dev->ops = NULL;
+    
     dev->device_id = dev_id;
     dev->bitrate = bitrate;
     dev->can_fd_enabled = true;
@@ -84,94 +200,672 @@ static int can_device_init(struct can_device_config *dev, int dev_id, u32 bitrat
     return 0;
 }
 
+// A filter in struct can_filter form; the mask always tells SFF from EFF
+static void can_filter_key(const struct can_filter_config *f, u32 *id, u32 *mask)
+{
+    u32 id_mask = f->extended ? CAN_EFF_MASK : CAN_SFF_MASK;
+    
+    *id = (f->can_id & id_mask) | (f->extended ? CAN_EFF_FLAG : 0);
+    *mask = (f->can_mask & id_mask) | CAN_EFF_FLAG;
+}
+
+static u32 can_frame_key(const struct canfd_frame *cf)
+{
+    return cf->can_id & (cf->can_id & CAN_EFF_FLAG ? CAN_EFF_FLAG | CAN_EFF_MASK : CAN_SFF_MASK);
+}
+
+static bool can_filter_match(const struct can_filter_set *set, u32 key)
+{
+    u32 i, slot = hash_32(key, CAN_FILTER_HASH_BITS);
+    
+    while (set->exact[slot] != CAN_FILTER_EMPTY) {
+        if (set->exact[slot] == key) {
+            return true;
+        }
+        slot = (slot + 1) & (ARRAY_SIZE(set->exact) - 1);
+    }
+    for (i = 0; i < set->num_masked; i++) {
+        if ((key & set->masked[i].mask) == (set->masked[i].id & set->masked[i].mask)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Rebuild the software filter from every active filter and load the
+ * controller's banks: one filter per bank while they last, the rest
+ * merged into the last bank as the bits they all agree on. Under
+ * filter_lock.
+ */
+static int can_compile_filters(struct can_device_config *dev)
+{
+    struct can_filter_set *set, *old;
+    u32 id, mask, merged_id = 0, merged_mask = 0;
+    int i, n = 0, bank = 0;
+    bool merging = false;
+    
+    set = kzalloc(sizeof(*set), GFP_KERNEL);
+    if (!set) {
+        return -ENOMEM;
+    }
+    memset(set->exact, 0xFF, sizeof(set->exact));
+    
+    for (i = 0; i < CAN_MAX_FILTERS; i++) {
+        if (dev->filters[i].active) {
+            n++;
+        }
+    }
+    set->count = n;
+    set->sw_bank = dev->ops ? min(n, dev->filter_banks) : 0;
+    if (dev->ops && n > dev->filter_banks) {
+        set->sw_bank = dev->filter_banks - 1;
+    }
+    
+    for (i = 0; i < CAN_MAX_FILTERS; i++) {
+        const struct can_filter_config *f = &dev->filters[i];
+    
+        if (!f->active) {
+            continue;
+        }
+        can_filter_key(f, &id, &mask);
+    
+        if (mask == (CAN_EFF_FLAG | (f->extended ? CAN_EFF_MASK : CAN_SFF_MASK))) {
+            u32 slot = hash_32(id, CAN_FILTER_HASH_BITS);
+    
+            while (set->exact[slot] != CAN_FILTER_EMPTY && set->exact[slot] != id) {
+                slot = (slot + 1) & (ARRAY_SIZE(set->exact) - 1);
+            }
+            set->exact[slot] = id;
+        } else {
+            set->masked[set->num_masked].id = id;
+            set->masked[set->num_masked].mask = mask;
+            set->num_masked++;
+        }
+    
+        if (!dev->ops) {
+            continue;
+        }
+        if (bank < set->sw_bank) {
+            dev->ops->set_filter_bank(dev->ctx, bank++, id, mask);
+        } else if (!merging) {
+            merged_id = id;
+            merged_mask = mask;
+            merging = true;
+        } else {
+            merged_mask &= mask & ~(id ^ merged_id);
+        }
+    }
+    
+    if (dev->ops) {
+        if (merging) {
+            dev->ops->set_filter_bank(dev->ctx, bank++, merged_id & merged_mask, merged_mask);
+        } else if (!n) {
+            dev->ops->set_filter_bank(dev->ctx, bank++, 0, 0);      // no filters: accept all
+        }
+        while (bank < dev->filter_banks) {
+            dev->ops->clear_filter_bank(dev->ctx, bank++);
+        }
+    }
+    
+    old = rcu_replace_pointer(dev->filter_set, set, lockdep_is_held(&dev->filter_lock));
+    if (old) {
+        kfree_rcu(old, rcu);
+    }
+    return 0;
+}
+
 /**
- * CAN frame transmission
+ * Attach a controller driver to a device: its acceptance banks take
+ * the filters from now on and its mailboxes the transmit queue
  */
-static int can_transmit(struct can_device_config *dev, const struct can_frame *frame)
+int can_register_controller(int dev_id, const struct can_hw_ops *ops, void *ctx, int filter_banks,
+                            int tx_mailboxes)
 {
-    if (!dev || !frame) {
+    struct can_device_config *dev = can_device(dev_id);
+    int ret;
+    
+    if (!dev || !ops || !ops->set_filter_bank || !ops->clear_filter_bank || !ops->mailbox_load ||
+        !ops->mailbox_abort || filter_banks < 1 || tx_mailboxes < 1 || tx_mailboxes > CAN_MAX_MAILBOXES) {
         return -EINVAL;
     }
     
-    // Validate frame
-    if (frame->can_dlc > CAN_FD_MAX_DATA_LEN) {
-        pr_err("CAN frame data length %d exceeds maximum %d\n",
-               frame->can_dlc, CAN_FD_MAX_DATA_LEN);
-        return -EINVAL;
+    mutex_lock(&dev->filter_lock);
+    spin_lock_irq(&dev->tx_lock);
+    dev->ctx = ctx;
+    dev->filter_banks = filter_banks;
+    dev->tx_mailboxes = tx_mailboxes;
+    memset(dev->mailboxes, 0, sizeof(dev->mailboxes));
+    WRITE_ONCE(dev->ops, ops);
+    spin_unlock_irq(&dev->tx_lock);
+    ret = can_compile_filters(dev);
+    mutex_unlock(&dev->filter_lock);
+    if (ret) {
+        return ret;
     }
     
-    // Simulate CAN transmission
-    // 1. Start of frame
-    udelay(1);
+    pr_info("CAN device %d controller: %d filter banks, %d TX mailboxes\n", dev_id, filter_banks, tx_mailboxes);
+    return dev->ndev ? 0 : can_net_register(dev);
+}
+EXPORT_SYMBOL_GPL(can_register_controller);
+
+/**
+ * ISR: the ring slot to read the next received mailbox into, NULL if
+ * the ring is full and the frame has to be dropped
+ */
+struct canfd_frame *can_rx_slot(int dev_id)
+{
+    struct can_device_config *dev = can_device(dev_id);
+    struct can_rx_ring *r;
+    
+    if (!dev) {
+        return NULL;
+    }
+    r = &dev->rx;
+    if (r->head - smp_load_acquire(&r->tail) >= CAN_RX_RING_SIZE) {
+        dev->rx_overflow++;
+        return NULL;
+    }
+    return &r->entries[r->head & (CAN_RX_RING_SIZE - 1)].frame;
+}
+EXPORT_SYMBOL_GPL(can_rx_slot);
+
+/**
+ * ISR: publish the frame just read into can_rx_slot(), unless the
+ * software filter turns it away. bank is the acceptance bank that
+ * matched, or CAN_BANK_UNKNOWN; timestamp the controller's receive
+ * time in ns, 0 if it has none.
+ */
+void can_rx_commit(int dev_id, int bank, u64 timestamp)
+{
+    struct can_device_config *dev = can_device(dev_id);
+    const struct can_filter_set *set;
+    struct can_rx_entry *e;
+    struct can_rx_ring *r;
+    bool accept;
     
-    // 2. Arbitration field (ID)
-    udelay(1);
+    if (!dev) {
+        return;
+    }
+    r = &dev->rx;
+    e = &r->entries[r->head & (CAN_RX_RING_SIZE - 1)];
+    
+    rcu_read_lock();
+    set = rcu_dereference(dev->filter_set);
+    accept = !set || !set->count || (bank >= 0 && bank < set->sw_bank) ||
+             can_filter_match(set, can_frame_key(&e->frame));
+    rcu_read_unlock();
+    
+    if (!accept) {
+        dev->rx_rejected++;
+        return;
+    }
     
-    // 3. Control field
-    udelay(1);
+    e->timestamp = timestamp;
+    smp_store_release(&r->head, r->head + 1);
+    atomic_inc(&dev->rx_count);
+    if (READ_ONCE(dev->net_up)) {
+        struct can_net_priv *priv = netdev_priv(dev->ndev);
     
-    // 4. Data field
-    int i;
-    for (i = 0; i < frame->can_dlc; i++) {
-        udelay(1); // Simulate data byte transmission
+        napi_schedule(&priv->napi);
+    } else if (wq_has_sleeper(&dev->rx_wait)) {
+        wake_up(&dev->rx_wait);
+    }
+}
+EXPORT_SYMBOL_GPL(can_rx_commit);
+
+// Arbitration order: base ID, then SFF before EFF, then the extended bits
+static u32 can_arbitration_key(canid_t can_id)
+{
+    if (can_id & CAN_EFF_FLAG) {
+        u32 id = can_id & CAN_EFF_MASK;
+    
+        return (id >> 18) << 19 | BIT(18) | (id & GENMASK(17, 0));
+    }
+    return (can_id & CAN_SFF_MASK) << 19;
+}
+
+static bool can_tx_before(const struct can_tx_entry *a, const struct can_tx_entry *b)
+{
+    return a->key < b->key || (a->key == b->key && (s32)(a->seq - b->seq) < 0);
+}
+
+// Under tx_lock
+static void can_tx_push(struct can_device_config *dev, const struct can_tx_entry *e)
+{
+    u32 i = dev->tx_queued++;
+    
+    while (i && can_tx_before(e, &dev->tx_heap[(i - 1) / 2])) {
+        dev->tx_heap[i] = dev->tx_heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    dev->tx_heap[i] = *e;
+}
+
+// Under tx_lock
+static void can_tx_pop(struct can_device_config *dev, struct can_tx_entry *e)
+{
+    struct can_tx_entry last = dev->tx_heap[--dev->tx_queued];
+    u32 i = 0, child;
+    
+    *e = dev->tx_heap[0];
+    while ((child = 2 * i + 1) < dev->tx_queued) {
+        if (child + 1 < dev->tx_queued && can_tx_before(&dev->tx_heap[child + 1], &dev->tx_heap[child])) {
+            child++;
+        }
+        if (!can_tx_before(&dev->tx_heap[child], &last)) {
+            break;
+        }
+        dev->tx_heap[i] = dev->tx_heap[child];
+        i = child;
+    }
+    dev->tx_heap[i] = last;
+}
+
+/*
+ * Fill free mailboxes from the head of the queue. When they are all
+ * taken and the queue holds a frame that beats the lowest priority one
+ * loaded, that one is withdrawn and goes back in the queue: otherwise
+ * the high priority frame would wait behind it, whatever the bus
+ * arbitration says. A frame never goes into a mailbox while one of the
+ * same ID is still in another, which would let the controller reorder
+ * them. Under tx_lock.
+ */
+static void can_tx_kick(struct can_device_config *dev)
+{
+    const struct can_hw_ops *ops = dev->ops;
+    struct can_tx_entry e;
+    
+    while (dev->tx_queued) {
+        int i, free = -1, victim = -1;
+        bool same_id = false;
+    
+        for (i = 0; i < dev->tx_mailboxes; i++) {
+            struct can_mailbox *mb = &dev->mailboxes[i];
+    
+            if (!mb->busy) {
+                free = free < 0 ? i : free;
+                continue;
+            }
+            if (mb->entry.key == dev->tx_heap[0].key) {
+                same_id = true;
+            }
+            if (!mb->aborting && (victim < 0 || can_tx_before(&dev->mailboxes[victim].entry, &mb->entry))) {
+                victim = i;
+            }
+        }
+        if (same_id) {
+            return;
+        }
+    
+        if (free < 0) {
+            if (victim < 0 || !can_tx_before(&dev->tx_heap[0], &dev->mailboxes[victim].entry)) {
+                return;
+            }
+            dev->mailboxes[victim].aborting = true;
+            if (!ops->mailbox_abort(dev->ctx, victim)) {
+                return;                     // already on the wire; can_tx_done() frees it
+            }
+            dev->mailboxes[victim].busy = false;
+            dev->mailboxes[victim].aborting = false;
+            can_tx_push(dev, &dev->mailboxes[victim].entry);
+            dev->tx_preempted++;
+            free = victim;
+        }
+    
+        can_tx_pop(dev, &e);
+        if (ops->mailbox_load(dev->ctx, free, &e.frame)) {
+            can_tx_push(dev, &e);
+            return;
+        }
+        dev->mailboxes[free].entry = e;
+        dev->mailboxes[free].busy = true;
     }
+}
+
+/**
+ * ISR: a mailbox has sent its frame (or given up on it)
+ */
+void can_tx_done(int dev_id, int mailbox)
+{
+    struct can_device_config *dev = can_device(dev_id);
+    unsigned long flags;
+    
+    if (!dev || mailbox < 0 || mailbox >= CAN_MAX_MAILBOXES) {
+        return;
+    }
+    
+    spin_lock_irqsave(&dev->tx_lock, flags);
+    if (dev->mailboxes[mailbox].busy) {
+        dev->mailboxes[mailbox].busy = false;
+        dev->mailboxes[mailbox].aborting = false;
+        atomic_inc(&dev->tx_count);
+    }
+    can_tx_kick(dev);
+    if (dev->ndev && netif_queue_stopped(dev->ndev) && dev->tx_queued < CAN_TX_QUEUE_LEN) {
+        netif_wake_queue(dev->ndev);
+    }
+    spin_unlock_irqrestore(&dev->tx_lock, flags);
+}
+EXPORT_SYMBOL_GPL(can_tx_done);
+
+/**
+ * CAN frame transmission: queue the frame in priority order, -ENOBUFS
+ * if the queue is full
+ */
+static int can_transmit(struct can_device_config *dev, const struct canfd_frame *frame)
+{
+    struct can_tx_entry e;
+    unsigned long flags;
+    int ret = 0;
     
-    // 5. CRC field
-    udelay(1);
+    if (!dev || !frame) {
+        return -EINVAL;
+    }
     
-    // 6. ACK field
-    udelay(1);
+    // Validate frame
+    if (frame->len > (dev->can_fd_enabled ? CAN_FD_MAX_DATA_LEN : CAN_CLASSIC_MAX_DATA_LEN) ||
+        can_fd_dlc2len(can_fd_len2dlc(frame->len)) != frame->len) {
+        pr_err("CAN frame data length %d invalid\n", frame->len);
+        return -EINVAL;
+    }
+    if (!READ_ONCE(dev->ops)) {
+        return -ENODEV;
+    }
     
-    // 7. End of frame
-    udelay(1);
+    e.key = can_arbitration_key(frame->can_id);
+    e.frame = *frame;
     
-    atomic_inc(&dev->tx_count);
+    spin_lock_irqsave(&dev->tx_lock, flags);
+    if (dev->tx_queued >= CAN_TX_QUEUE_LEN) {
+        ret = -ENOBUFS;
+    } else {
+        e.seq = dev->tx_seq++;
+        can_tx_push(dev, &e);
+        can_tx_kick(dev);
+    }
+    spin_unlock_irqrestore(&dev->tx_lock, flags);
     
-    pr_debug("CAN device %d transmit: ID=0x%x, DLC=%d\n",
-             dev->device_id, frame->can_id, frame->can_dlc);
+    pr_debug("CAN device %d transmit: ID=0x%x, len=%d\n",
+             dev->device_id, frame->can_id, frame->len);
     
-    return 0;
+    return ret;
+}
+
+/**
+ * Received frames in place: up to max pointers into the ring, oldest
+ * first. They stay valid until can_receive_release(); one reader per
+ * device.
+ */
+static int can_receive_batch(struct can_device_config *dev, const struct can_rx_entry **entries, int max)
+{
+    struct can_rx_ring *r = &dev->rx;
+    u32 head = smp_load_acquire(&r->head);
+    int n;
+    
+    for (n = 0; n < max && r->tail + n != head; n++) {
+        entries[n] = &r->entries[(r->tail + n) & (CAN_RX_RING_SIZE - 1)];
+    }
+    return n;
+}
+
+static void can_receive_release(struct can_device_config *dev, int n)
+{
+    smp_store_release(&dev->rx.tail, dev->rx.tail + n);
 }
 
 /**
- * CAN frame reception
+ * CAN frame reception: copy out the oldest frame, -EAGAIN if there is
+ * none. While the SocketCAN interface is up its NAPI poll owns the ring.
  */
-static int can_receive(struct can_device_config *dev, struct can_frame *frame)
+static int can_receive(struct can_device_config *dev, struct canfd_frame *frame)
 {
+    const struct can_rx_entry *e;
+    
     if (!dev || !frame) {
         return -EINVAL;
     }
+    if (READ_ONCE(dev->net_up)) {
+        return -EBUSY;
+    }
     
-    // Simulate CAN reception
-    frame->can_id = 0x123; // Simulate received ID
-    frame->can_dlc = 8;    // Simulate 8-byte data
-    frame->can_dlc |= CAN_RTR_FLAG; // Simulate RTR flag
+    if (!can_receive_batch(dev, &e, 1)) {
+        return -EAGAIN;
+    }
+    *frame = e->frame;
+    can_receive_release(dev, 1);
     
-    // Simulate received data
-    int i;
-    for (i = 0; i < frame->can_dlc; i++) {
-        frame->data[i] = 0xAA + i; // Simulate received data
+    pr_debug("CAN device %d receive: ID=0x%x, len=%d\n",
+             dev->device_id, frame->can_id, frame->len);
+    
+    return 0;
+}
+
+// FD frames are marked by the driver, or evidently FD
+static bool can_rx_is_fd(const struct canfd_frame *cf)
+{
+    return (cf->flags & (CANFD_FDF | CANFD_BRS | CANFD_ESI)) || cf->len > CAN_CLASSIC_MAX_DATA_LEN;
+}
+
+static void can_net_rx(struct net_device *ndev, const struct can_rx_entry *e)
+{
+    const struct canfd_frame *src = &e->frame;
+    struct canfd_frame *cfd;
+    struct can_frame *cf;
+    struct sk_buff *skb;
+    
+    if (can_rx_is_fd(src)) {
+        skb = alloc_canfd_skb(ndev, &cfd);
+        if (skb) {
+            *cfd = *src;
+        }
+    } else {
+        skb = alloc_can_skb(ndev, &cf);
+        if (skb) {
+            cf->can_id = src->can_id;
+            cf->len = src->len;
+            memcpy(cf->data, src->data, min_t(u8, src->len, CAN_CLASSIC_MAX_DATA_LEN));
+        }
+    }
+    if (!skb) {
+        ndev->stats.rx_dropped++;
+        return;
     }
     
-    atomic_inc(&dev->rx_count);
+    if (e->timestamp) {
+        skb_hwtstamps(skb)->hwtstamp = ns_to_ktime(e->timestamp);
+    }
+    ndev->stats.rx_packets++;
+    if (!(src->can_id & CAN_RTR_FLAG)) {
+        ndev->stats.rx_bytes += src->len;
+    }
+    netif_receive_skb(skb);
+}
+
+/*
+ * Drain the ring a batch at a time. The ISR only schedules us; frames
+ * it publishes meanwhile are picked up in the same pass or, after
+ * napi_complete_done(), by the poll it schedules again.
+ */
+static int can_napi_poll(struct napi_struct *napi, int budget)
+{
+    struct can_net_priv *priv = container_of(napi, struct can_net_priv, napi);
+    struct can_device_config *dev = priv->dev;
+    const struct can_rx_entry *batch[CAN_NAPI_BATCH];
+    int done = 0, n, i;
+    
+    while (done < budget) {
+        n = can_receive_batch(dev, batch, min(budget - done, CAN_NAPI_BATCH));
+        if (!n) {
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            can_net_rx(dev->ndev, batch[i]);
+        }
+        can_receive_release(dev, n);
+        done += n;
+    }
+    
+    if (done < budget) {
+        napi_complete_done(napi, done);
+    }
+    return done;
+}
+
+static netdev_tx_t can_net_start_xmit(struct sk_buff *skb, struct net_device *ndev)
+{
+    struct can_net_priv *priv = netdev_priv(ndev);
+    struct can_device_config *dev = priv->dev;
+    struct canfd_frame frame = {};
+    int ret;
+    
+    if (can_dev_dropped_skb(ndev, skb)) {
+        return NETDEV_TX_OK;
+    }
+    
+    // struct can_frame is laid out as the head of struct canfd_frame
+    memcpy(&frame, skb->data, min_t(unsigned int, skb->len, sizeof(frame)));
+    if (can_is_canfd_skb(skb)) {
+        frame.flags |= CANFD_FDF;
+    } else {
+        frame.flags = 0;
+    }
+    
+    ret = can_transmit(dev, &frame);
+    if (ret == -ENOBUFS) {
+        netif_stop_queue(ndev);
+        return NETDEV_TX_BUSY;
+    }
+    if (ret) {
+        ndev->stats.tx_dropped++;
+    } else {
+        ndev->stats.tx_packets++;
+        ndev->stats.tx_bytes += frame.len;
+    }
+    dev_consume_skb_any(skb);
+    
+    // Stop before the queue is full, and look again in case can_tx_done() just made room
+    if (READ_ONCE(dev->tx_queued) >= CAN_TX_QUEUE_LEN) {
+        netif_stop_queue(ndev);
+        smp_mb();
+        if (READ_ONCE(dev->tx_queued) < CAN_TX_QUEUE_LEN) {
+            netif_wake_queue(ndev);
+        }
+    }
+    return NETDEV_TX_OK;
+}
+
+static int can_net_open(struct net_device *ndev)
+{
+    struct can_net_priv *priv = netdev_priv(ndev);
+    int ret;
+    
+    ret = open_candev(ndev);
+    if (ret) {
+        return ret;
+    }
+    
+    // The NAPI poll takes over the ring from can_receive()
+    napi_enable(&priv->napi);
+    WRITE_ONCE(priv->dev->net_up, true);
+    napi_schedule(&priv->napi);
+    netif_start_queue(ndev);
+    return 0;
+}
+
+static int can_net_stop(struct net_device *ndev)
+{
+    struct can_net_priv *priv = netdev_priv(ndev);
+    
+    netif_stop_queue(ndev);
+    WRITE_ONCE(priv->dev->net_up, false);
+    napi_disable(&priv->napi);
+    close_candev(ndev);
+    return 0;
+}
+
+static const struct net_device_ops can_net_ops = {
+    .ndo_open = can_net_open,
+    .ndo_stop = can_net_stop,
+    .ndo_start_xmit = can_net_start_xmit,
+    .ndo_change_mtu = can_change_mtu,
+    .ndo_eth_ioctl = can_eth_ioctl_hwts,
+};
+
+static const struct ethtool_ops can_ethtool_ops = {
+    .get_ts_info = can_ethtool_op_get_ts_info_hwts,
+};
+
+/*
+ * The device as a SocketCAN interface, can%d: raw and FD sockets,
+ * recvmmsg() batches, SO_TIMESTAMPING with the controller's receive
+ * times. Frames reach the stack from a NAPI poll over the RX ring.
+ * Local echo is left to the CAN core, so no IFF_ECHO.
+ */
+static int can_net_register(struct can_device_config *dev)
+{
+    struct can_net_priv *priv;
+    struct net_device *ndev;
+    int ret;
     
-    pr_debug("CAN device %d receive: ID=0x%x, DLC=%d\n",
-             dev->device_id, frame->can_id, frame->can_dlc);
+    ndev = alloc_candev(sizeof(*priv), 0);
+    if (!ndev) {
+        return -ENOMEM;
+    }
     
+    priv = netdev_priv(ndev);
+    priv->dev = dev;
+    priv->can.bittiming.bitrate = dev->bitrate;
+    priv->can.data_bittiming.bitrate = dev->data_bitrate;
+    priv->can.ctrlmode_supported = CAN_CTRLMODE_FD;
+    if (dev->can_fd_enabled) {
+        priv->can.ctrlmode = CAN_CTRLMODE_FD;
+        ndev->mtu = CANFD_MTU;
+    }
+    ndev->netdev_ops = &can_net_ops;
+    ndev->ethtool_ops = &can_ethtool_ops;
+    netif_napi_add(ndev, &priv->napi, can_napi_poll);
+    
+    ret = register_candev(ndev);
+    if (ret) {
+        netif_napi_del(&priv->napi);
+        free_candev(ndev);
+        return ret;
+    }
+    dev->ndev = ndev;
+    
+    pr_info("CAN device %d is %s\n", dev->device_id, ndev->name);
     return 0;
 }
 
+static void can_net_unregister(struct can_device_config *dev)
+{
+    struct can_net_priv *priv;
+    
+    if (!dev->ndev) {
+        return;
+    }
+    priv = netdev_priv(dev->ndev);
+    unregister_candev(dev->ndev);
+    netif_napi_del(&priv->napi);
+    free_candev(dev->ndev);
+    dev->ndev = NULL;
+}
+
 /**
- * Add CAN filter
+ * Add CAN filter: recompiled into the controller's banks at once.
+ * Returns the filter's index for can_remove_filter().
  */
 static int can_add_filter(struct can_device_config *dev, u32 can_id, u32 can_mask, bool extended)
 {
-    int i;
+    int i, ret;
     
     if (!dev) {
         return -EINVAL;
     }
     
+    mutex_lock(&dev->filter_lock);
+    
     // Find free filter slot
     for (i = 0; i < CAN_MAX_FILTERS; i++) {
         if (!dev->filters[i].active) {
@@ -180,6 +874,7 @@ static int can_add_filter(struct can_device_config *dev, u32 can_id, u32 can_mas
     }
     
     if (i >= CAN_MAX_FILTERS) {
+        mutex_unlock(&dev->filter_lock);
         pr_err("No free CAN filter slots available\n");
         return -ENOMEM;
     }
@@ -192,10 +887,20 @@ static int can_add_filter(struct can_device_config *dev, u32 can_id, u32 can_mas
     
     dev->filter_count++;
     
+    ret = can_compile_filters(dev);
+    if (ret) {
+        dev->filters[i].active = false;
+        dev->filter_count--;
+    }
+    mutex_unlock(&dev->filter_lock);
+    if (ret) {
+        return ret;
+    }
+    
     pr_info("CAN device %d filter added: ID=0x%x, mask=0x%x, extended=%s\n",
             dev->device_id, can_id, can_mask, extended ? "yes" : "no");
     
-    return 0;
+    return i;
 }
 
 /**
@@ -203,21 +908,27 @@ static int can_add_filter(struct can_device_config *dev, u32 can_id, u32 can_mas
  */
 static int can_remove_filter(struct can_device_config *dev, int filter_id)
 {
+    int ret;
+    
     if (!dev || filter_id < 0 || filter_id >= CAN_MAX_FILTERS) {
         return -EINVAL;
     }
     
+    mutex_lock(&dev->filter_lock);
     if (!dev->filters[filter_id].active) {
+        mutex_unlock(&dev->filter_lock);
         pr_err("CAN filter %d is not active\n", filter_id);
         return -EINVAL;
     }
     
     dev->filters[filter_id].active = false;
     dev->filter_count--;
+    ret = can_compile_filters(dev);
+    mutex_unlock(&dev->filter_lock);
     
     pr_info("CAN device %d filter %d removed\n", dev->device_id, filter_id);
     
-    return 0;
+    return ret;
 }
 
 /**
@@ -280,6 +991,14 @@ static int __init can_protocol_init_module(void)
  */
 static void __exit can_protocol_cleanup_module(void)
 {
+    int i;
+    
+    for (i = 0; i < can_device_count; i++) {
+        can_net_unregister(&can_devices[i]);
+        kfree(rcu_dereference_protected(can_devices[i].filter_set, 1));
+        kvfree(can_devices[i].rx.entries);
+    }
+    
     pr_info("CAN Protocol unloaded\n");
 }
 
@@ -0,0 +1,46 @@
+/**
+ * CAN controller interface
+ *
+ * What a CAN controller driver gives can_protocol.c and calls back
+ * into it. Filters are compiled into the controller's acceptance banks;
+ * when there are more filters than banks, the last bank takes a mask
+ * covering the rest and frames it passes are checked against a hashed
+ * software filter. Received frames go straight from the mailbox into a
+ * per-device ring: the ISR takes a slot with can_rx_slot(), reads the
+ * mailbox into it and publishes it with can_rx_commit(), and readers
+ * use the frames where they lie. Each controller also gets a SocketCAN
+ * interface, can%d, fed from the ring by NAPI; drivers mark FD frames
+ * with CANFD_FDF and pass the receive time for SO_TIMESTAMPING.
+ * Transmit goes through the hardware mailboxes, always holding the
+ * highest priority frames waiting.
+ */
+
+#ifndef CAN_PROTOCOL_H
+#define CAN_PROTOCOL_H
+
+#include <linux/types.h>
+#include <linux/can.h>
+
+#define CAN_MAX_MAILBOXES 32
+#define CAN_BANK_UNKNOWN (-1)               // controller does not say which bank matched
+
+/*
+ * Filter banks take an ID and mask in struct can_filter form: a frame
+ * passes if (can_id & mask) == (id & mask), CAN_EFF_FLAG included.
+ * Everything is called from the driver's ISR or under its configuration
+ * and must not sleep.
+ */
+struct can_hw_ops {
+    int (*set_filter_bank)(void *ctx, int bank, u32 id, u32 mask);
+    void (*clear_filter_bank)(void *ctx, int bank);
+    int (*mailbox_load)(void *ctx, int mailbox, const struct canfd_frame *cf);
+    bool (*mailbox_abort)(void *ctx, int mailbox);  // true if withdrawn before it went out
+};
+
+int can_register_controller(int dev_id, const struct can_hw_ops *ops, void *ctx, int filter_banks,
+                            int tx_mailboxes);
+struct canfd_frame *can_rx_slot(int dev_id);
+void can_rx_commit(int dev_id, int bank, u64 timestamp);  // ns, 0 if none
+void can_tx_done(int dev_id, int mailbox);
+
+#endif /* CAN_PROTOCOL_H */
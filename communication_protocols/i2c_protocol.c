@@ -15,12 +15,43 @@
 #include <linux/errno.h>
 #include <linux/atomic.h>
 #include <linux/delay.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/bitmap.h>
 
-#define I2C_VERSION "2.1.0"
+#include "i2c_protocol.h"
+
+#define I2C_VERSION "2.2.0"
+#define I2C_MAX_BUSES 4
 #define I2C_MAX_DEVICES 32
 #define I2C_MAX_SPEED 1000000  // 1MHz
 #define I2C_STANDARD_SPEED 100000  // 100kHz
 #define I2C_FAST_SPEED 400000    // 400kHz
+#define I2C_ADDR_SPACE 128                  // 7-bit addresses
+
+static unsigned int i2c_dma_threshold = 32;
+module_param(i2c_dma_threshold, uint, 0644);
+MODULE_PARM_DESC(i2c_dma_threshold, "Reads of at least this many bytes use DMA");
+
+struct i2c_txn;
+typedef void (*i2c_complete_t)(struct i2c_txn *txn);
+
+/*
+ * A client transaction: its messages go out back to back with repeated
+ * START between them, then complete() is called with status set, from
+ * the bus worker. The transaction belongs to the bus from
+ * i2c_bus_submit() until then.
+ */
+struct i2c_txn {
+    struct list_head node;
+    struct i2c_msg *msgs;
+    int num_msgs;
+    i2c_complete_t complete;
+    void *context;
+    int status;
+};
 
 struct i2c_device_config {
     u8 slave_address;
@@ -40,10 +71,35 @@ struct i2c_bus_config {
     atomic_t total_transactions;
     u32 bus_errors;
     bool arbitration_enabled;
+    
+    // Hardware, once its driver has registered
+    const struct i2c_hw_ops *ops;
+    void *hw_ctx;
+    
+    // Scheduler: transactions for urgent addresses are taken first
+    spinlock_t queue_lock;
+    struct list_head urgent;
+    struct list_head normal;
+    DECLARE_BITMAP(latency_sensitive, I2C_ADDR_SPACE);
+    struct work_struct work;
+    struct i2c_hw_seg segs[I2C_MAX_BATCH];  // worker only
+    u32 sequences;
+    u32 merged;                             // transactions that shared a sequence
 };
 
-static struct i2c_bus_config i2c_buses[4];
+static struct i2c_bus_config i2c_buses[I2C_MAX_BUSES];
 static int i2c_bus_count = 0;
+static struct workqueue_struct *i2c_wq;
+
+static struct i2c_bus_config *i2c_bus(int bus_id)
+{
+    if (bus_id < 0 || bus_id >= i2c_bus_count) {
+        return NULL;
+    }
+    return &i2c_buses[bus_id];
+}
+
+static void i2c_sched_work(struct work_struct *work);
 
 /**
  * Initialize I2C bus
@@ -63,6 +119,14 @@ static int i2c_bus_init(struct i2c_bus_config *bus, int bus_id, u32 clock_speed)
     atomic_set(&bus->total_transactions, 0);
     bus->bus_errors = 0;
     bus->arbitration_enabled = true;
+    bus->ops = NULL;
+    spin_lock_init(&bus->queue_lock);
+    INIT_LIST_HEAD(&bus->urgent);
+    INIT_LIST_HEAD(&bus->normal);
+    bitmap_zero(bus->latency_sensitive, I2C_ADDR_SPACE);
+    INIT_WORK(&bus->work, i2c_sched_work);
+    bus->sequences = 0;
+    bus->merged = 0;
     
     // Initialize devices
     for (i = 0; i < I2C_MAX_DEVICES; i++) {
@@ -81,33 +145,218 @@ static int i2c_bus_init(struct i2c_bus_config *bus, int bus_id, u32 clock_speed)
 }
 
 /**
- * I2C write operation
+ * Attach the bus driver for bus_id
  */
-static int i2c_write(struct i2c_bus_config *bus, u8 slave_addr, const u8 *data, size_t len)
+int i2c_register_bus(int bus_id, const struct i2c_hw_ops *ops, void *ctx)
 {
-    int ret = 0;
+    struct i2c_bus_config *bus = i2c_bus(bus_id);
+    unsigned long flags;
     
-    if (!bus || !data || len == 0) {
+    if (!bus || !ops || !ops->xfer) {
         return -EINVAL;
     }
     
-    // Simulate I2C write sequence
-    // 1. Send START condition
-    udelay(1);
+    spin_lock_irqsave(&bus->queue_lock, flags);
+    bus->ops = ops;
+    bus->hw_ctx = ctx;
+    spin_unlock_irqrestore(&bus->queue_lock, flags);
     
-    // 2. Send slave address + write bit
-    udelay(1);
+    pr_info("I2C bus %d attached\n", bus_id);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(i2c_register_bus);
+
+/**
+ * Mark a device latency-sensitive: its transactions go ahead of
+ * everyone else's in the next sequence
+ */
+static int i2c_set_latency_sensitive(struct i2c_bus_config *bus, u16 addr, bool urgent)
+{
+    if (!bus || addr >= I2C_ADDR_SPACE) {
+        return -EINVAL;
+    }
     
-    // 3. Send data bytes
-    size_t i;
-    for (i = 0; i < len; i++) {
-        udelay(1); // Simulate byte transmission
+    if (urgent) {
+        set_bit(addr, bus->latency_sensitive);
+    } else {
+        clear_bit(addr, bus->latency_sensitive);
     }
+    return 0;
+}
+
+// Append txn to a sequence at position n; returns the new length
+static int i2c_build_segs(const struct i2c_txn *txn, struct i2c_hw_seg *segs, int n)
+{
+    int i;
     
-    // 4. Send STOP condition
-    udelay(1);
+    for (i = 0; i < txn->num_msgs; i++, n++) {
+        segs[n].addr = txn->msgs[i].addr;
+        segs[n].flags = txn->msgs[i].flags;
+        segs[n].len = txn->msgs[i].len;
+        segs[n].buf = txn->msgs[i].buf;
+        segs[n].dma = (txn->msgs[i].flags & I2C_M_RD) && txn->msgs[i].len >= i2c_dma_threshold;
+    }
+    return n;
+}
+
+// Move transactions from q to batch in order while they fit; called with queue_lock held
+static int i2c_take(struct i2c_bus_config *bus, struct list_head *q, struct list_head *batch, int n)
+{
+    struct i2c_txn *txn, *tmp;
     
-    atomic_inc(&bus->total_transactions);
+    list_for_each_entry_safe(txn, tmp, q, node) {
+        if (n + txn->num_msgs > I2C_MAX_BATCH) {
+            break;
+        }
+        n = i2c_build_segs(txn, bus->segs, n);
+        list_move_tail(&txn->node, batch);
+    }
+    return n;
+}
+
+static void i2c_complete_list(struct i2c_bus_config *bus, struct list_head *done)
+{
+    struct i2c_txn *txn, *tmp;
+    
+    list_for_each_entry_safe(txn, tmp, done, node) {
+        list_del(&txn->node);
+        if (txn->status) {
+            bus->bus_errors++;
+        } else {
+            atomic_inc(&bus->total_transactions);
+        }
+        txn->complete(txn);
+    }
+}
+
+/*
+ * Bus worker: one sequence per batch, urgent transactions first and
+ * the rest filling what room is left.
+ */
+static void i2c_sched_work(struct work_struct *work)
+{
+    struct i2c_bus_config *bus = container_of(work, struct i2c_bus_config, work);
+    struct i2c_txn *txn;
+    unsigned long flags;
+    LIST_HEAD(batch);
+    int n, ret;
+    
+    for (;;) {
+        spin_lock_irqsave(&bus->queue_lock, flags);
+        n = i2c_take(bus, &bus->urgent, &batch, 0);
+        n = i2c_take(bus, &bus->normal, &batch, n);
+        spin_unlock_irqrestore(&bus->queue_lock, flags);
+        
+        if (!n) {
+            break;
+        }
+        
+        ret = bus->ops->xfer(bus->hw_ctx, bus->clock_speed, bus->segs, n);
+        bus->sequences++;
+        
+        if (ret && !list_is_singular(&batch)) {
+            // A NAK fails the whole sequence; run each transaction alone to find whose it was
+            list_for_each_entry(txn, &batch, node) {
+                n = i2c_build_segs(txn, bus->segs, 0);
+                txn->status = bus->ops->xfer(bus->hw_ctx, bus->clock_speed, bus->segs, n);
+            }
+        } else {
+            list_for_each_entry(txn, &batch, node) {
+                txn->status = ret;
+            }
+            if (!list_is_singular(&batch)) {
+                bus->merged += list_count_nodes(&batch);
+            }
+        }
+        
+        i2c_complete_list(bus, &batch);
+    }
+}
+
+/**
+ * Queue a transaction for the bus scheduler
+ */
+static int i2c_bus_submit(struct i2c_bus_config *bus, struct i2c_txn *txn)
+{
+    unsigned long flags;
+    int i;
+    
+    if (!bus || !txn || !txn->complete || txn->num_msgs <= 0) {
+        return -EINVAL;
+    }
+    if (txn->num_msgs > I2C_MAX_BATCH) {
+        return -EMSGSIZE;
+    }
+    for (i = 0; i < txn->num_msgs; i++) {
+        if (!txn->msgs[i].buf || txn->msgs[i].len == 0) {
+            return -EINVAL;
+        }
+    }
+    
+    txn->status = 0;
+    
+    spin_lock_irqsave(&bus->queue_lock, flags);
+    if (!bus->ops) {
+        spin_unlock_irqrestore(&bus->queue_lock, flags);
+        return -ENODEV;
+    }
+    if (txn->msgs[0].addr < I2C_ADDR_SPACE && test_bit(txn->msgs[0].addr, bus->latency_sensitive)) {
+        list_add_tail(&txn->node, &bus->urgent);
+    } else {
+        list_add_tail(&txn->node, &bus->normal);
+    }
+    spin_unlock_irqrestore(&bus->queue_lock, flags);
+    
+    queue_work(i2c_wq, &bus->work);
+    return 0;
+}
+
+static void i2c_sync_complete(struct i2c_txn *txn)
+{
+    complete(txn->context);
+}
+
+/**
+ * Queue a transaction and sleep until it has completed
+ */
+static int i2c_bus_transfer(struct i2c_bus_config *bus, struct i2c_msg *msgs, int num_msgs)
+{
+    DECLARE_COMPLETION_ONSTACK(done);
+    struct i2c_txn txn = {
+        .msgs = msgs,
+        .num_msgs = num_msgs,
+        .complete = i2c_sync_complete,
+        .context = &done,
+    };
+    int ret;
+    
+    ret = i2c_bus_submit(bus, &txn);
+    if (ret) {
+        return ret;
+    }
+    wait_for_completion(&done);
+    
+    return txn.status;
+}
+
+/**
+ * I2C write operation
+ */
+static int i2c_write(struct i2c_bus_config *bus, u8 slave_addr, const u8 *data, size_t len)
+{
+    struct i2c_msg msg = {
+        .addr = slave_addr,
+        .flags = 0,
+        .len = len,
+        .buf = (u8 *)data,
+    };
+    int ret;
+    
+    if (!bus || !data || len == 0) {
+        return -EINVAL;
+    }
+    
+    ret = i2c_bus_transfer(bus, &msg, 1);
     
     pr_debug("I2C bus %d write: addr=0x%02x, len=%zu\n", 
              bus->bus_id, slave_addr, len);
@@ -120,30 +369,19 @@ static int i2c_write(struct i2c_bus_config *bus, u8 slave_addr, const u8 *data,
  */
 static int i2c_read(struct i2c_bus_config *bus, u8 slave_addr, u8 *buffer, size_t len)
 {
-    int ret = 0;
+    struct i2c_msg msg = {
+        .addr = slave_addr,
+        .flags = I2C_M_RD,
+        .len = len,
+        .buf = buffer,
+    };
+    int ret;
     
     if (!bus || !buffer || len == 0) {
         return -EINVAL;
     }
     
-    // Simulate I2C read sequence
-    // 1. Send START condition
-    udelay(1);
-    
-    // 2. Send slave address + read bit
-    udelay(1);
-    
-    // 3. Read data bytes
-    size_t i;
-    for (i = 0; i < len; i++) {
-        buffer[i] = 0xAA; // Simulate received data
-        udelay(1);
-    }
-    
-    // 4. Send STOP condition
-    udelay(1);
-    
-    atomic_inc(&bus->total_transactions);
+    ret = i2c_bus_transfer(bus, &msg, 1);
     
     pr_debug("I2C bus %d read: addr=0x%02x, len=%zu\n", 
              bus->bus_id, slave_addr, len);
@@ -152,25 +390,24 @@ static int i2c_read(struct i2c_bus_config *bus, u8 slave_addr, u8 *buffer, size_
 }
 
 /**
- * I2C write-then-read operation
+ * I2C write-then-read operation: one transaction, repeated START
+ * between the write and the read
  */
 static int i2c_write_read(struct i2c_bus_config *bus, u8 slave_addr, 
                           const u8 *write_data, size_t write_len,
                           u8 *read_buffer, size_t read_len)
 {
+    struct i2c_msg msgs[2] = {
+        { .addr = slave_addr, .flags = 0, .len = write_len, .buf = (u8 *)write_data },
+        { .addr = slave_addr, .flags = I2C_M_RD, .len = read_len, .buf = read_buffer },
+    };
     int ret;
     
-    // Write data first
-    ret = i2c_write(bus, slave_addr, write_data, write_len);
-    if (ret) {
-        return ret;
+    if (!bus) {
+        return -EINVAL;
     }
     
-    // Small delay between write and read
-    udelay(10);
-    
-    // Read data
-    ret = i2c_read(bus, slave_addr, read_buffer, read_len);
+    ret = i2c_bus_transfer(bus, msgs, 2);
     
     pr_debug("I2C bus %d write-read: addr=0x%02x, write=%zu, read=%zu\n",
              bus->bus_id, slave_addr, write_len, read_len);
@@ -210,10 +447,16 @@ static int __init i2c_protocol_init_module(void)
     
     pr_info("I2C Protocol v%s loading\n", I2C_VERSION);
     
+    i2c_wq = alloc_workqueue("i2c_sched", WQ_HIGHPRI, 0);
+    if (!i2c_wq) {
+        return -ENOMEM;
+    }
+    
     for (i = 0; i < ARRAY_SIZE(speeds); i++) {
         ret = i2c_bus_init(&i2c_buses[i], i, speeds[i]);
         if (ret) {
             pr_err("Failed to initialize I2C bus %d\n", i);
+            destroy_workqueue(i2c_wq);
             return ret;
         }
         i2c_bus_count++;
@@ -228,6 +471,13 @@ static int __init i2c_protocol_init_module(void)
  */
 static void __exit i2c_protocol_cleanup_module(void)
 {
+    int i;
+    
+    destroy_workqueue(i2c_wq);
+    for (i = 0; i < i2c_bus_count; i++) {
+        pr_info("I2C bus %d: %u sequences, %u merged transactions\n",
+                i, i2c_buses[i].sequences, i2c_buses[i].merged);
+    }
     pr_info("I2C Protocol unloaded\n");
 }
 
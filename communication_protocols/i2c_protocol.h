@@ -0,0 +1,40 @@
+/**
+ * I2C bus controller interface
+ *
+ * What an I2C bus driver gives i2c_protocol.c. Clients queue
+ * transactions of several messages; a scheduler per bus takes them
+ * latency-sensitive devices first and joins as many as fit into one
+ * sequence, START once, repeated START between messages and a single
+ * STOP at the end, so the bus is won and set up once per batch instead
+ * of once per transfer. Reads of i2c_dma_threshold bytes or more are
+ * flagged for DMA.
+ */
+
+#ifndef I2C_PROTOCOL_H
+#define I2C_PROTOCOL_H
+
+#include <linux/types.h>
+
+#define I2C_MAX_BATCH 32                    // messages per bus sequence
+
+// One message of a sequence, as in struct i2c_msg
+struct i2c_hw_seg {
+    u16 addr;
+    u16 flags;                              // I2C_M_RD, I2C_M_TEN
+    u16 len;
+    u8 *buf;
+    bool dma;                               // long read, move it by DMA
+};
+
+/*
+ * xfer runs a whole sequence and sleeps until it is done; it returns 0,
+ * or a negative errno as i2c_transfer() would (-ENXIO on NAK, -EAGAIN
+ * on lost arbitration).
+ */
+struct i2c_hw_ops {
+    int (*xfer)(void *ctx, u32 speed_hz, const struct i2c_hw_seg *segs, int n);
+};
+
+int i2c_register_bus(int bus_id, const struct i2c_hw_ops *ops, void *ctx);
+
+#endif /* I2C_PROTOCOL_H */
@@ -0,0 +1,42 @@
+/**
+ * LIN cluster description
+ *
+ * Frames, signals and schedule tables of the door cluster this node is
+ * master of, taken from its LDF in the form lin_schedule.h expects.
+ * Regenerate from the LDF rather than editing by hand.
+ */
+
+#ifndef LIN_LDF_H
+#define LIN_LDF_H
+
+#include "lin_schedule.h"
+
+#define DOOR_CMD_SIGNALS(S, f)                                              \
+    S(f, lock_request, 0, 2)                                                \
+    S(f, window_request, 2, 2)                                              \
+    S(f, mirror_fold, 4, 1)                                                 \
+    S(f, ambient_level, 8, 8)
+LIN_FRAME(door_cmd, 0x10, 2, LIN_PUBLISH, DOOR_CMD_SIGNALS);
+
+#define DOOR_STATUS_SIGNALS(S, f)                                           \
+    S(f, lock_state, 0, 2)                                                  \
+    S(f, window_pos, 8, 8)                                                  \
+    S(f, pinch_detected, 16, 1)                                             \
+    S(f, motor_temp, 24, 8)
+LIN_FRAME(door_status, 0x21, 4, LIN_SUBSCRIBE, DOOR_STATUS_SIGNALS);
+
+#define MIRROR_STATUS_SIGNALS(S, f)                                         \
+    S(f, mirror_h_pos, 0, 8)                                                \
+    S(f, mirror_v_pos, 8, 8)
+LIN_FRAME(mirror_status, 0x22, 2, LIN_SUBSCRIBE, MIRROR_STATUS_SIGNALS);
+
+#define NORMAL_SCHEDULE(E)                                                  \
+    E(door_cmd, 10)                                                         \
+    E(door_status, 10)                                                      \
+    E(door_cmd, 10)                                                         \
+    E(mirror_status, 20)
+LIN_SCHEDULE(normal, NORMAL_SCHEDULE);
+
+#define LIN_LDF_DEFAULT_SCHEDULE (&normal_table)
+
+#endif /* LIN_LDF_H */
@@ -14,6 +14,12 @@
 #include <linux/atomic.h>
 #include <linux/timer.h>
 #include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <asm/unaligned.h>
+
+#include "lin_protocol.h"
+#include "lin_ldf.h"
 
 #define LIN_PROTOCOL_VERSION "2.2A"
 #define MAX_LIN_DEVICES 16
@@ -83,11 +89,21 @@ struct lin_protocol {
     u32 total_errors;
     bool lin_active;
     u32 baud_rate;
-    struct timer_list lin_timer;
+    
+    // Schedule engine over the compiled tables
+    const struct lin_hw_ops *ops;
+    void *hw_ctx;
+    struct hrtimer slot_timer;
+    const struct lin_schedule *table;
+    const struct lin_schedule *next_table;  // taken at the next slot boundary
+    size_t slot;
+    struct lin_packed_frame *rx_pending;    // subscribed frame whose header went out
 };
 
 static struct lin_protocol global_lin_protocol;
 
+static enum hrtimer_restart lin_slot_tick(struct hrtimer *timer);
+
 /**
  * Initialize LIN protocol
  */
@@ -102,6 +118,13 @@ static int lin_protocol_init(void)
     global_lin_protocol.total_errors = 0;
     global_lin_protocol.lin_active = false;
     global_lin_protocol.baud_rate = LIN_BAUD_RATE;
+    global_lin_protocol.ops = NULL;
+    global_lin_protocol.table = NULL;
+    global_lin_protocol.next_table = NULL;
+    global_lin_protocol.slot = 0;
+    global_lin_protocol.rx_pending = NULL;
+    hrtimer_init(&global_lin_protocol.slot_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    global_lin_protocol.slot_timer.function = lin_slot_tick;
     
     // Initialize devices
     for (i = 0; i < MAX_LIN_DEVICES; i++) {
@@ -344,6 +367,129 @@ static int lin_update_signal(u32 device_id, u32 frame_id, u32 signal_id, float v
     return 0;
 }
 
+// Classic checksum covers the data only, enhanced the PID too
+static u8 lin_checksum(const struct lin_packed_frame *f, const u8 *data)
+{
+    unsigned int sum = f->classic ? 0 : f->pid;
+    int i;
+    
+    for (i = 0; i < f->len; i++) {
+        sum += data[i];
+        if (sum > 0xff) {
+            sum -= 0xff;
+        }
+    }
+    return ~sum;
+}
+
+/*
+ * One slot: the image goes out as it stands, or only the header for
+ * a subscribed frame
+ */
+static void lin_run_slot(const struct lin_slot *slot)
+{
+    struct lin_packed_frame *f = slot->frame;
+    u8 data[LIN_MAX_DATA];
+    int ret;
+    
+    if (f->dir == LIN_PUBLISH) {
+        put_unaligned_le64(READ_ONCE(f->bits), data);
+        ret = global_lin_protocol.ops->send_frame(global_lin_protocol.hw_ctx, f->pid, data, f->len,
+                                                  lin_checksum(f, data));
+        if (!ret) {
+            atomic_inc(&global_lin_protocol.total_transmissions);
+        }
+    } else {
+        WRITE_ONCE(global_lin_protocol.rx_pending, f);
+        ret = global_lin_protocol.ops->send_header(global_lin_protocol.hw_ctx, f->pid);
+    }
+    
+    if (ret) {
+        global_lin_protocol.total_errors++;
+    }
+}
+
+static enum hrtimer_restart lin_slot_tick(struct hrtimer *timer)
+{
+    const struct lin_schedule *next = xchg(&global_lin_protocol.next_table, NULL);
+    const struct lin_slot *slot;
+    
+    if (next) {
+        global_lin_protocol.table = next;
+        global_lin_protocol.slot = 0;
+    }
+    
+    slot = &global_lin_protocol.table->slots[global_lin_protocol.slot];
+    lin_run_slot(slot);
+    if (++global_lin_protocol.slot == global_lin_protocol.table->len) {
+        global_lin_protocol.slot = 0;
+    }
+    
+    hrtimer_forward_now(timer, ms_to_ktime(slot->delay_ms));
+    return HRTIMER_RESTART;
+}
+
+/**
+ * Switch schedule tables; the new one starts at the next slot boundary
+ */
+int lin_set_schedule(const struct lin_schedule *table)
+{
+    if (!table || !table->len) {
+        return -EINVAL;
+    }
+    if (!global_lin_protocol.ops) {
+        return -ENODEV;
+    }
+    
+    WRITE_ONCE(global_lin_protocol.next_table, table);
+    if (!global_lin_protocol.lin_active) {
+        global_lin_protocol.lin_active = true;
+        hrtimer_start(&global_lin_protocol.slot_timer, 0, HRTIMER_MODE_REL_SOFT);
+    }
+    
+    pr_info("LIN schedule table %s selected\n", table->name);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(lin_set_schedule);
+
+/**
+ * ISR: a slave answered the header of the current slot
+ */
+void lin_rx_response(u8 pid, const u8 *data, u8 len, u8 checksum)
+{
+    struct lin_packed_frame *f = xchg(&global_lin_protocol.rx_pending, NULL);
+    u8 buf[LIN_MAX_DATA] = {};
+    
+    if (!f || f->pid != pid || len != f->len || lin_checksum(f, data) != checksum) {
+        global_lin_protocol.total_errors++;
+        return;
+    }
+    
+    memcpy(buf, data, len);
+    WRITE_ONCE(f->bits, get_unaligned_le64(buf));
+    f->responses++;
+}
+EXPORT_SYMBOL_GPL(lin_rx_response);
+
+/**
+ * Attach the master controller and start the LDF's default schedule
+ */
+int lin_register_master(const struct lin_hw_ops *ops, void *ctx)
+{
+    if (!ops || !ops->send_frame || !ops->send_header) {
+        return -EINVAL;
+    }
+    if (global_lin_protocol.ops) {
+        return -EBUSY;
+    }
+    
+    global_lin_protocol.hw_ctx = ctx;
+    global_lin_protocol.ops = ops;
+    
+    return lin_set_schedule(LIN_LDF_DEFAULT_SCHEDULE);
+}
+EXPORT_SYMBOL_GPL(lin_register_master);
+
 /**
  * Get LIN statistics
  */
@@ -389,6 +535,7 @@ static int __init lin_protocol_init_module(void)
  */
 static void __exit lin_protocol_cleanup_module(void)
 {
+    hrtimer_cancel(&global_lin_protocol.slot_timer);
     pr_info("LIN Protocol unloaded\n");
 }
 
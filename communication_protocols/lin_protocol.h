@@ -0,0 +1,28 @@
+/**
+ * LIN master controller interface
+ *
+ * What a LIN controller driver gives lin_protocol.c and calls back into
+ * it. The schedule engine runs the compiled schedule tables of
+ * lin_schedule.h; per slot it either sends a whole frame, header and
+ * prepacked response, or only the header, the slave's response coming
+ * back through lin_rx_response().
+ */
+
+#ifndef LIN_PROTOCOL_H
+#define LIN_PROTOCOL_H
+
+#include <linux/types.h>
+
+#include "lin_schedule.h"
+
+// Called from the slot timer: must not sleep
+struct lin_hw_ops {
+    int (*send_frame)(void *ctx, u8 pid, const u8 *data, u8 len, u8 checksum);
+    int (*send_header)(void *ctx, u8 pid);
+};
+
+int lin_register_master(const struct lin_hw_ops *ops, void *ctx);
+int lin_set_schedule(const struct lin_schedule *table);
+void lin_rx_response(u8 pid, const u8 *data, u8 len, u8 checksum);
+
+#endif /* LIN_PROTOCOL_H */
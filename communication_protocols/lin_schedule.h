@@ -0,0 +1,112 @@
+/**
+ * Compiled LIN frames and schedule tables
+ *
+ * Frames and schedule tables are generated at compile time from the LDF,
+ * transcribed as lists:
+ *
+ *   #define DOOR_CMD_SIGNALS(S, f)          \
+ *       S(f, lock_request, 0, 2)            \
+ *       S(f, ambient_level, 8, 8)
+ *   LIN_FRAME(door_cmd, 0x10, 2, LIN_PUBLISH, DOOR_CMD_SIGNALS);
+ *
+ *   #define NORMAL_SCHEDULE(E)              \
+ *       E(door_cmd, 10)                     \
+ *       E(door_status, 10)
+ *   LIN_SCHEDULE(normal, NORMAL_SCHEDULE);
+ *
+ * LIN_FRAME declares door_cmd_frame, whose image holds the frame data
+ * as it goes on the wire, and door_cmd_set_lock_request() /
+ * door_cmd_get_lock_request(), which move a raw signal value in and
+ * out of the image with constant shifts and masks. LIN_SCHEDULE
+ * declares normal_table, a const list of slots with their protected
+ * IDs worked out by the compiler; running a slot stores the image into
+ * the frame buffer as it is and only the checksum is computed.
+ *
+ * Signals are given as start bit and length in bits, numbered as in
+ * the LDF: bit 0 is the first bit of the first data byte. Values are
+ * raw; scaling to physical units is up to the application. All signals
+ * of one frame are written from one context.
+ */
+
+#ifndef LIN_SCHEDULE_H
+#define LIN_SCHEDULE_H
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/bits.h>
+#include <linux/build_bug.h>
+
+#define LIN_MAX_DATA 8
+#define LIN_DIAG_ID_MIN 0x3c                // master request and slave response use classic checksums
+
+enum lin_direction {
+    LIN_PUBLISH,                            // master sends the response
+    LIN_SUBSCRIBE                           // a slave does
+};
+
+// Protected identifier: ID with parity bits P0 and P1
+#define __LIN_ID_BIT(id, n) (((id) >> (n)) & 1)
+#define LIN_PID(id)                                                                     \
+    (((id) & 0x3f) |                                                                    \
+     ((__LIN_ID_BIT(id, 0) ^ __LIN_ID_BIT(id, 1) ^ __LIN_ID_BIT(id, 2) ^ __LIN_ID_BIT(id, 4)) << 6) | \
+     ((1 ^ __LIN_ID_BIT(id, 1) ^ __LIN_ID_BIT(id, 3) ^ __LIN_ID_BIT(id, 4) ^ __LIN_ID_BIT(id, 5)) << 7))
+
+struct lin_packed_frame {
+    u64 bits;                               // frame data, LDF bit n at bit n
+    u8 pid;
+    u8 len;
+    enum lin_direction dir;
+    bool classic;                           // classic checksum, without the PID
+    u32 responses;                          // subscribed frames received
+};
+
+struct lin_slot {
+    struct lin_packed_frame *frame;
+    u32 delay_ms;                           // until the next slot's header
+};
+
+struct lin_schedule {
+    const char *name;
+    const struct lin_slot *slots;
+    size_t len;
+};
+
+#define __LIN_SIGNAL(f, sig, start, length)                                             \
+static_assert((start) + (length) <= 8 * (f##_LEN) && (length) >= 1);                    \
+static inline void f##_set_##sig(u64 raw)                                               \
+{                                                                                       \
+    u64 m = GENMASK_ULL((start) + (length) - 1, (start));                               \
+                                                                                        \
+    WRITE_ONCE(f##_frame.bits, (f##_frame.bits & ~m) | ((raw << (start)) & m));         \
+}                                                                                       \
+static inline u64 f##_get_##sig(void)                                                   \
+{                                                                                       \
+    u64 m = GENMASK_ULL((start) + (length) - 1, (start));                               \
+                                                                                        \
+    return (READ_ONCE(f##_frame.bits) & m) >> (start);                                  \
+}
+
+#define LIN_FRAME(f, id, length, direction, SIGNALS)                                    \
+enum { f##_LEN = (length) };                                                            \
+static_assert((id) < 0x40 && (length) >= 1 && (length) <= LIN_MAX_DATA);                \
+static struct lin_packed_frame f##_frame = {                                            \
+    .pid = LIN_PID(id),                                                                 \
+    .len = (length),                                                                    \
+    .dir = (direction),                                                                 \
+    .classic = (id) >= LIN_DIAG_ID_MIN,                                                 \
+};                                                                                      \
+SIGNALS(__LIN_SIGNAL, f)
+
+#define __LIN_SLOT(f, ms) { .frame = &f##_frame, .delay_ms = (ms) },
+
+#define LIN_SCHEDULE(sched, ENTRIES)                                                    \
+static const struct lin_slot sched##_slots[] = {                                        \
+    ENTRIES(__LIN_SLOT)                                                                 \
+};                                                                                      \
+static const struct lin_schedule sched##_table = {                                      \
+    .name = #sched,                                                                     \
+    .slots = sched##_slots,                                                             \
+    .len = ARRAY_SIZE(sched##_slots),                                                   \
+}
+
+#endif /* LIN_SCHEDULE_H */
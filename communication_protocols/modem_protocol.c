@@ -14,12 +14,121 @@
 #include <linux/atomic.h>
 #include <linux/timer.h>
 #include <linux/workqueue.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/crc8.h>
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/if_arp.h>
+#include <linux/stringify.h>
 
-#define MODEM_PROTOCOL_VERSION "5.0.0"
+#include "modem_protocol.h"
+
+#define MODEM_PROTOCOL_VERSION "5.2.0"
 #define MAX_MODEM_DEVICES 8
 #define MAX_MODEM_BANDS 16
 #define MAX_MODEM_APNS 32
 #define MODEM_CONNECTION_TIMEOUT_MS 30000
+#define MODEM_AT_TIMEOUT_MS 5000
+#define MODEM_AT_LINE_MAX 256
+#define MODEM_MAX_BEARERS 3                 // PDN contexts up at once, one data DLC each
+#define MODEM_RETRY_MIN_MS 1000
+#define MODEM_RETRY_MAX_MS 32000
+
+// CMUX basic option, 3GPP TS 27.010
+#define MUX_MTU 1509                        // N1 asked for with AT+CMUX; an IP MTU of 1500 fits
+#define MUX_DLCI_CTRL 0
+#define MUX_DLCI_AT 1
+#define MUX_DLCI_DATA 2                     // bearer i on DLCI MUX_DLCI_DATA + i, context i + 1
+#define MUX_DLCI_LAST (MUX_DLCI_DATA + MODEM_MAX_BEARERS - 1)
+#define MUX_FLAG 0xf9
+#define MUX_EA 0x01
+#define MUX_CR 0x02                         // set on our commands and data
+#define MUX_PF 0x10
+#define MUX_SABM 0x2f
+#define MUX_UA 0x63
+#define MUX_DM 0x0f
+#define MUX_DISC 0x43
+#define MUX_UIH 0xef
+#define MUX_FCS_GOOD 0xcf
+#define MUX_CMD_MSC 0xe0                    // modem status command, type octet with EA set
+#define MUX_V24_RTC 0x04
+#define MUX_V24_RTR 0x08
+#define MUX_V24_DV 0x80
+
+static char *data_l2p = "M-RAW_IP";
+module_param(data_l2p, charp, 0444);
+MODULE_PARM_DESC(data_l2p, "Layer 2 protocol for AT+CGDATA on the data channel, raw IP");
+
+DECLARE_CRC8_TABLE(modem_fcs_table);
+
+enum mux_rx_state {
+    MUX_RX_SEARCH,
+    MUX_RX_ADDR,
+    MUX_RX_CTRL,
+    MUX_RX_LEN1,
+    MUX_RX_LEN2,
+    MUX_RX_DATA,
+    MUX_RX_FCS,
+    MUX_RX_END
+};
+
+struct modem_device;
+
+typedef void (*modem_at_done_t)(struct modem_device *device, int result, const char *info, void *ctx);
+
+struct modem_at_cmd {
+    struct list_head node;
+    char cmd[MODEM_AT_LINE_MAX];
+    modem_at_done_t done;
+    void *ctx;
+};
+
+/*
+ * An AT channel: commands are sent one at a time, as the protocol
+ * wants, but queued, and the next one leaves from the receive path the
+ * moment the current one's final result arrives
+ */
+struct modem_at_chan {
+    struct modem_device *device;
+    u8 dlci;
+    spinlock_t lock;
+    struct list_head queue;
+    struct modem_at_cmd *current_cmd;
+    unsigned long deadline;
+    struct delayed_work timeout;
+    char line[MODEM_AT_LINE_MAX];
+    size_t line_len;
+    char info[MODEM_AT_LINE_MAX];           // last intermediate result of current_cmd
+};
+
+enum modem_bearer_state {
+    MODEM_BEARER_IDLE,
+    MODEM_BEARER_ACTIVATING,
+    MODEM_BEARER_UP,
+    MODEM_BEARER_RETRY                      // lost, reactivation scheduled
+};
+
+/*
+ * One PDN context with its own data DLC and interface. Every bearer
+ * asked for stays active side by side, so when one is lost its traffic
+ * moves to the interfaces still up the moment its carrier drops, while
+ * the lost one is reactivated in the background.
+ */
+struct modem_bearer {
+    struct modem_device *device;
+    u8 dlci;
+    u8 cid;
+    u32 apn_id;
+    enum modem_bearer_state state;
+    struct modem_at_chan at;                // the data DLC until CONNECT
+    bool ip;                                // data DLC carries IP
+    struct net_device *ndev;
+    struct delayed_work retry;
+    u32 retry_ms;
+    u32 failures;
+};
 
 enum modem_technology {
     MODEM_TECHNOLOGY_2G = 0,
@@ -76,6 +185,27 @@ struct modem_device {
     u32 connection_errors;
     u64 last_connection_time;
     bool device_active;
+    
+    // Serial link and the multiplexer over it
+    const struct modem_link_ops *link;
+    void *link_ctx;
+    spinlock_t tx_lock;                     // one frame at a time on the link
+    bool mux_up;
+    bool mux_starting;
+    bool mux_ready;                         // all DLCs opened once
+    unsigned long dlc_open;                 // bit per DLCI
+    enum mux_rx_state rx_state;
+    u8 rx_addr, rx_ctrl, rx_fcs;
+    u16 rx_len, rx_count;
+    u8 rx_buf[MUX_MTU];
+    u32 rx_bad_frames;
+    
+    struct modem_at_chan at;                // commands on MUX_DLCI_AT
+    struct modem_bearer bearers[MODEM_MAX_BEARERS];
+};
+
+struct modem_net_priv {
+    struct modem_bearer *bearer;
 };
 
 struct modem_protocol {
@@ -273,89 +403,883 @@ static int modem_add_apn(u32 device_id, const char *name, const char *apn, const
     return i;
 }
 
+static void modem_cgev(struct modem_device *device, const char *line);
+
+static struct modem_device *modem_device(u32 device_id)
+{
+    if (device_id >= MAX_MODEM_DEVICES || !global_modem_protocol.devices[device_id].link) {
+        return NULL;
+    }
+    return &global_modem_protocol.devices[device_id];
+}
+
+static int modem_link_write(struct modem_device *device, const u8 *buf, size_t len)
+{
+    return device->link->write(device->link_ctx, buf, len);
+}
+
+/*
+ * One frame on the link. UIH frames have their FCS over the header
+ * only, so the payload is written from where it lies.
+ */
+static int modem_mux_send(struct modem_device *device, u8 dlci, u8 ctrl, bool command, const u8 *data,
+                          size_t len)
+{
+    u8 hdr[5], trl[2];
+    unsigned long flags;
+    int h = 0, ret;
+    u8 fcs;
+    
+    if (len > MUX_MTU) {
+        return -EMSGSIZE;
+    }
+    
+    hdr[h++] = MUX_FLAG;
+    hdr[h++] = (dlci << 2) | (command ? MUX_CR : 0) | MUX_EA;
+    hdr[h++] = ctrl;
+    if (len < 128) {
+        hdr[h++] = (len << 1) | MUX_EA;
+    } else {
+        hdr[h++] = len << 1;
+        hdr[h++] = len >> 7;
+    }
+    fcs = crc8(modem_fcs_table, hdr + 1, h - 1, 0xff);
+    if ((ctrl & ~MUX_PF) != MUX_UIH) {
+        fcs = crc8(modem_fcs_table, data, len, fcs);
+    }
+    trl[0] = 0xff - fcs;
+    trl[1] = MUX_FLAG;
+    
+    spin_lock_irqsave(&device->tx_lock, flags);
+    ret = modem_link_write(device, hdr, h);
+    if (!ret && len) {
+        ret = modem_link_write(device, data, len);
+    }
+    if (!ret) {
+        ret = modem_link_write(device, trl, sizeof(trl));
+    }
+    spin_unlock_irqrestore(&device->tx_lock, flags);
+    
+    return ret;
+}
+
+// Raise the V.24 signals of a freshly opened DLC, as modems expect
+static void modem_mux_send_msc(struct modem_device *device, u8 dlci)
+{
+    u8 msg[4] = {
+        MUX_CMD_MSC | MUX_CR | MUX_EA,
+        (2 << 1) | MUX_EA,
+        (dlci << 2) | MUX_CR | MUX_EA,
+        MUX_V24_RTC | MUX_V24_RTR | MUX_V24_DV | MUX_EA,
+    };
+    
+    modem_mux_send(device, MUX_DLCI_CTRL, MUX_UIH, true, msg, sizeof(msg));
+}
+
+static void modem_at_write(struct modem_at_chan *chan, const char *cmd)
+{
+    struct modem_device *device = chan->device;
+    size_t len = strlen(cmd);
+    
+    if (READ_ONCE(device->mux_up)) {
+        modem_mux_send(device, chan->dlci, MUX_UIH, true, (const u8 *)cmd, len);
+    } else {
+        unsigned long flags;
+    
+        spin_lock_irqsave(&device->tx_lock, flags);
+        modem_link_write(device, (const u8 *)cmd, len);
+        spin_unlock_irqrestore(&device->tx_lock, flags);
+    }
+}
+
+/*
+ * Finish the current command and start the next one before running
+ * the callback, so the channel does not sit idle while it runs
+ */
+static void modem_at_complete(struct modem_at_chan *chan, int result)
+{
+    struct modem_at_cmd *cmd, *next = NULL;
+    unsigned long flags;
+    char info[MODEM_AT_LINE_MAX];
+    
+    spin_lock_irqsave(&chan->lock, flags);
+    cmd = chan->current_cmd;
+    if (!cmd) {
+        spin_unlock_irqrestore(&chan->lock, flags);
+        return;
+    }
+    strscpy(info, chan->info, sizeof(info));
+    chan->info[0] = '\0';
+    if (!list_empty(&chan->queue)) {
+        next = list_first_entry(&chan->queue, struct modem_at_cmd, node);
+        list_del(&next->node);
+        chan->deadline = jiffies + msecs_to_jiffies(MODEM_AT_TIMEOUT_MS);
+    }
+    chan->current_cmd = next;
+    spin_unlock_irqrestore(&chan->lock, flags);
+    
+    if (next) {
+        modem_at_write(chan, next->cmd);
+        mod_delayed_work(system_wq, &chan->timeout, msecs_to_jiffies(MODEM_AT_TIMEOUT_MS));
+    }
+    
+    if (cmd->done) {
+        cmd->done(chan->device, result, info, cmd->ctx);
+    }
+    kfree(cmd);
+}
+
+static void modem_at_timeout(struct work_struct *work)
+{
+    struct modem_at_chan *chan = container_of(to_delayed_work(work), struct modem_at_chan, timeout);
+    
+    if (READ_ONCE(chan->current_cmd) && time_after_eq(jiffies, READ_ONCE(chan->deadline))) {
+        pr_warn("MODEM device %d AT command timed out on DLCI %d\n", chan->device->device_id, chan->dlci);
+        modem_at_complete(chan, -ETIMEDOUT);
+    }
+}
+
 /**
- * Connect MODEM
+ * Queue an AT command (without the trailing CR); done() gets 0 or an
+ * error and the last intermediate result line. Safe from any context.
  */
-static int modem_connect(u32 device_id, u32 apn_id)
+static int modem_at_submit(struct modem_at_chan *chan, const char *cmd, modem_at_done_t done, void *ctx)
 {
-    if (device_id >= MAX_MODEM_DEVICES || apn_id >= MAX_MODEM_APNS) {
-        pr_err("Invalid MODEM connection parameters\n");
-        return -EINVAL;
+    struct modem_at_cmd *c;
+    unsigned long flags;
+    bool start;
+    
+    c = kmalloc(sizeof(*c), GFP_ATOMIC);
+    if (!c) {
+        return -ENOMEM;
+    }
+    if (snprintf(c->cmd, sizeof(c->cmd), "%s\r", cmd) >= sizeof(c->cmd)) {
+        kfree(c);
+        return -E2BIG;
     }
+    c->done = done;
+    c->ctx = ctx;
     
-    struct modem_device *device = &global_modem_protocol.devices[device_id];
+    spin_lock_irqsave(&chan->lock, flags);
+    start = !chan->current_cmd;
+    if (start) {
+        chan->current_cmd = c;
+        chan->deadline = jiffies + msecs_to_jiffies(MODEM_AT_TIMEOUT_MS);
+    } else {
+        list_add_tail(&c->node, &chan->queue);
+    }
+    spin_unlock_irqrestore(&chan->lock, flags);
     
-    if (!device->device_active) {
-        pr_err("MODEM device %d is not active\n", device_id);
-        return -EINVAL;
+    if (start) {
+        modem_at_write(chan, c->cmd);
+        mod_delayed_work(system_wq, &chan->timeout, msecs_to_jiffies(MODEM_AT_TIMEOUT_MS));
     }
+    return 0;
+}
+
+// Final result codes end a command; anything else is kept as its information
+static void modem_at_line(struct modem_at_chan *chan, const char *line)
+{
+    if (!strncmp(line, "+CGEV:", 6)) {
+        modem_cgev(chan->device, line);
+    } else if (!strcmp(line, "OK") || !strcmp(line, "CONNECT") || !strncmp(line, "CONNECT ", 8)) {
+        modem_at_complete(chan, 0);
+    } else if (!strcmp(line, "ERROR") || !strncmp(line, "+CME ERROR", 10) || !strncmp(line, "+CMS ERROR", 10)) {
+        strscpy(chan->info, line, sizeof(chan->info));
+        modem_at_complete(chan, -EIO);
+    } else if (!strcmp(line, "NO CARRIER")) {
+        modem_at_complete(chan, -ECONNRESET);
+    } else if (READ_ONCE(chan->current_cmd)) {
+        strscpy(chan->info, line, sizeof(chan->info));
+    } else {
+        pr_info("MODEM device %d: %s\n", chan->device->device_id, line);
+    }
+}
+
+static void modem_at_receive(struct modem_at_chan *chan, const u8 *buf, size_t len)
+{
+    size_t i;
     
-    if (device->status != MODEM_STATUS_DISCONNECTED) {
-        pr_err("MODEM device %d is not disconnected\n", device_id);
-        return -EINVAL;
+    for (i = 0; i < len; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            if (chan->line_len) {
+                chan->line[chan->line_len] = '\0';
+                modem_at_line(chan, chan->line);
+                chan->line_len = 0;
+            }
+        } else if (chan->line_len < MODEM_AT_LINE_MAX - 1) {
+            chan->line[chan->line_len++] = buf[i];
+        }
     }
+}
+
+static void modem_at_init(struct modem_at_chan *chan, struct modem_device *device, u8 dlci)
+{
+    chan->device = device;
+    chan->dlci = dlci;
+    spin_lock_init(&chan->lock);
+    INIT_LIST_HEAD(&chan->queue);
+    chan->current_cmd = NULL;
+    INIT_DELAYED_WORK(&chan->timeout, modem_at_timeout);
+    chan->line_len = 0;
+    chan->info[0] = '\0';
+}
+
+static void modem_at_flush(struct modem_at_chan *chan)
+{
+    struct modem_at_cmd *cmd, *tmp;
     
-    pr_info("Connecting MODEM device %d to APN %d\n", device_id, apn_id);
+    cancel_delayed_work_sync(&chan->timeout);
+    list_for_each_entry_safe(cmd, tmp, &chan->queue, node) {
+        list_del(&cmd->node);
+        kfree(cmd);
+    }
+    kfree(chan->current_cmd);
+    chan->current_cmd = NULL;
+}
+
+static bool modem_any_bearer_up(struct modem_device *device)
+{
+    int i;
     
-    device->status = MODEM_STATUS_CONNECTING;
+    for (i = 0; i < MODEM_MAX_BEARERS; i++) {
+        if (device->bearers[i].state == MODEM_BEARER_UP) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void modem_connect_failed(struct modem_device *device, const char *step, int result)
+{
+    pr_err("MODEM device %d connect failed at %s: %d\n", device->device_id, step, result);
+    device->status = MODEM_STATUS_ERROR;
+    device->connection_errors++;
+    global_modem_protocol.total_errors++;
+}
+
+/*
+ * A bearer failed or was lost: its interface loses carrier, so routes
+ * over it go and traffic takes the bearers still up, and it is tried
+ * again after a backoff
+ */
+static void modem_bearer_failed(struct modem_bearer *b, const char *step, int result)
+{
+    struct modem_device *device = b->device;
+    
+    pr_warn("MODEM device %d bearer %s (APN %d) down at %s: %d, retry in %u ms\n",
+            device->device_id, b->ndev->name, b->apn_id, step, result, b->retry_ms);
     
-    // Simulate connection process
-    udelay(1000); // 1ms delay
+    WRITE_ONCE(b->ip, false);
+    netif_carrier_off(b->ndev);
+    b->state = MODEM_BEARER_RETRY;
+    b->failures++;
+    device->connection_errors++;
+    global_modem_protocol.total_errors++;
     
+    device->status = modem_any_bearer_up(device) ? MODEM_STATUS_CONNECTED : MODEM_STATUS_CONNECTING;
+    schedule_delayed_work(&b->retry, msecs_to_jiffies(b->retry_ms));
+    b->retry_ms = min(b->retry_ms * 2, (u32)MODEM_RETRY_MAX_MS);
+}
+
+static void modem_bearer_connected(struct modem_device *device, int result, const char *info, void *ctx)
+{
+    struct modem_bearer *b = ctx;
+    
+    if (b->state != MODEM_BEARER_ACTIVATING) {
+        return;
+    }
+    if (result) {
+        modem_bearer_failed(b, "+CGDATA", result);
+        return;
+    }
+    
+    WRITE_ONCE(b->ip, true);
+    netif_carrier_on(b->ndev);
+    b->state = MODEM_BEARER_UP;
+    b->retry_ms = MODEM_RETRY_MIN_MS;
     device->status = MODEM_STATUS_CONNECTED;
-    device->signal_strength = 85; // Simulate signal strength
-    device->signal_quality = 90; // Simulate signal quality
-    device->data_rate_bps = 1000000000; // 1Gbps
-    device->latency_ms = 10; // 10ms latency
     device->last_connection_time = jiffies;
-    
     atomic_inc(&device->total_connections);
     atomic_inc(&global_modem_protocol.total_connections);
     
-    pr_info("MODEM device %d connected: signal=%d%%, quality=%d%%, data_rate=%d bps, latency=%d ms\n",
-            device_id, device->signal_strength, device->signal_quality, device->data_rate_bps, device->latency_ms);
+    pr_info("MODEM device %d connected: APN %s, raw IP on %s\n",
+            device->device_id, device->apns[b->apn_id].apn, b->ndev->name);
+}
+
+static void modem_bearer_pdp_active(struct modem_device *device, int result, const char *info, void *ctx)
+{
+    struct modem_bearer *b = ctx;
+    char cmd[64];
+    
+    if (b->state != MODEM_BEARER_ACTIVATING) {
+        return;
+    }
+    if (result) {
+        modem_bearer_failed(b, "+CGACT", result);
+        return;
+    }
+    
+    // +CGDATA switches the channel it arrives on, the bearer's data DLC, to packets
+    snprintf(cmd, sizeof(cmd), "AT+CGDATA=\"%s\",%u", data_l2p, b->cid);
+    modem_at_submit(&b->at, cmd, modem_bearer_connected, b);
+}
+
+// Context definition and activation go out back to back
+static void modem_bearer_activate(struct modem_bearer *b)
+{
+    char cmd[MODEM_AT_LINE_MAX];
+    
+    snprintf(cmd, sizeof(cmd), "AT+CGDCONT=%u,\"IP\",\"%s\"", b->cid, b->device->apns[b->apn_id].apn);
+    modem_at_submit(&b->device->at, cmd, NULL, NULL);
+    snprintf(cmd, sizeof(cmd), "AT+CGACT=1,%u", b->cid);
+    modem_at_submit(&b->device->at, cmd, modem_bearer_pdp_active, b);
+}
+
+// Closing and reopening a data DLC returns it to command mode
+static void modem_bearer_reset_dlc(struct modem_bearer *b)
+{
+    modem_mux_send(b->device, b->dlci, MUX_DISC | MUX_PF, true, NULL, 0);
+    modem_mux_send(b->device, b->dlci, MUX_SABM | MUX_PF, true, NULL, 0);
+}
+
+static void modem_bearer_retry(struct work_struct *work)
+{
+    struct modem_bearer *b = container_of(to_delayed_work(work), struct modem_bearer, retry);
+    
+    if (b->state != MODEM_BEARER_RETRY) {
+        return;
+    }
+    b->state = MODEM_BEARER_ACTIVATING;
+    modem_bearer_reset_dlc(b);
+    modem_bearer_activate(b);
+}
+
+// Network or modem tore down a context: +CGEV: NW PDN DEACT <cid> and relatives
+static void modem_cgev(struct modem_device *device, const char *line)
+{
+    const char *p = strrchr(line, ' ');
+    unsigned int cid;
+    int i;
+    
+    if (!strstr(line, "DEACT") || !p || kstrtouint(p + 1, 10, &cid)) {
+        return;
+    }
+    for (i = 0; i < MODEM_MAX_BEARERS; i++) {
+        if (device->bearers[i].cid == cid && device->bearers[i].state == MODEM_BEARER_UP) {
+            modem_bearer_failed(&device->bearers[i], "network deactivation", -ENETDOWN);
+        }
+    }
+}
+
+// All DLCs open: report context events and bring up the bearers asked for
+static void modem_mux_ready(struct modem_device *device)
+{
+    int i;
+    
+    modem_at_submit(&device->at, "AT+CGEREP=2,1", NULL, NULL);
+    for (i = 0; i < MODEM_MAX_BEARERS; i++) {
+        if (device->bearers[i].state == MODEM_BEARER_ACTIVATING) {
+            modem_bearer_activate(&device->bearers[i]);
+        }
+    }
+}
+
+static void modem_cmux_started(struct modem_device *device, int result, const char *info, void *ctx)
+{
+    device->mux_starting = false;
+    if (result) {
+        modem_connect_failed(device, "+CMUX", result);
+        return;
+    }
+    
+    device->rx_state = MUX_RX_SEARCH;
+    device->dlc_open = 0;
+    device->mux_ready = false;
+    WRITE_ONCE(device->mux_up, true);
+    modem_mux_send(device, MUX_DLCI_CTRL, MUX_SABM | MUX_PF, true, NULL, 0);
+}
+
+/*
+ * DLCs open in order, control channel first; once the last data DLC is
+ * up the bearers are activated
+ */
+static void modem_mux_ua(struct modem_device *device, u8 dlci)
+{
+    if (dlci > MUX_DLCI_LAST || test_and_set_bit(dlci, &device->dlc_open)) {
+        return;
+    }
+    if (dlci != MUX_DLCI_CTRL) {
+        modem_mux_send_msc(device, dlci);
+    }
+    if (device->mux_ready) {
+        return;
+    }
+    
+    if (dlci < MUX_DLCI_LAST) {
+        modem_mux_send(device, dlci + 1, MUX_SABM | MUX_PF, true, NULL, 0);
+    } else {
+        device->mux_ready = true;
+        modem_mux_ready(device);
+    }
+}
+
+static void modem_net_rx(struct net_device *ndev, const u8 *data, u16 len)
+{
+    struct sk_buff *skb;
+    
+    if (!len) {
+        return;
+    }
+    
+    skb = netdev_alloc_skb(ndev, len);
+    if (!skb) {
+        ndev->stats.rx_dropped++;
+        return;
+    }
+    skb_put_data(skb, data, len);
+    switch (data[0] >> 4) {
+    case 4:
+        skb->protocol = htons(ETH_P_IP);
+        break;
+    case 6:
+        skb->protocol = htons(ETH_P_IPV6);
+        break;
+    default:
+        ndev->stats.rx_errors++;
+        kfree_skb(skb);
+        return;
+    }
+    skb_reset_mac_header(skb);
+    
+    ndev->stats.rx_packets++;
+    ndev->stats.rx_bytes += len;
+    netif_rx(skb);
+}
+
+static void modem_mux_dispatch(struct modem_device *device)
+{
+    u8 dlci = device->rx_addr >> 2;
+    
+    switch (device->rx_ctrl & ~MUX_PF) {
+    case MUX_UA:
+        modem_mux_ua(device, dlci);
+        break;
+    case MUX_DM:
+        clear_bit(dlci, &device->dlc_open);
+        if (dlci >= MUX_DLCI_DATA && dlci <= MUX_DLCI_LAST &&
+            device->bearers[dlci - MUX_DLCI_DATA].state == MODEM_BEARER_UP) {
+            modem_bearer_failed(&device->bearers[dlci - MUX_DLCI_DATA], "DLC closed", -ECONNRESET);
+        } else if (!device->mux_ready) {
+            modem_connect_failed(device, "DLC open", -ECONNREFUSED);
+        }
+        break;
+    case MUX_UIH:
+        if (dlci == MUX_DLCI_CTRL) {
+            // Answer control channel commands by echoing them as responses
+            if (device->rx_count && (device->rx_buf[0] & MUX_CR)) {
+                device->rx_buf[0] &= ~MUX_CR;
+                modem_mux_send(device, MUX_DLCI_CTRL, MUX_UIH, true, device->rx_buf, device->rx_count);
+            }
+        } else if (dlci == MUX_DLCI_AT) {
+            modem_at_receive(&device->at, device->rx_buf, device->rx_count);
+        } else if (dlci >= MUX_DLCI_DATA && dlci <= MUX_DLCI_LAST) {
+            struct modem_bearer *b = &device->bearers[dlci - MUX_DLCI_DATA];
+    
+            if (READ_ONCE(b->ip)) {
+                modem_net_rx(b->ndev, device->rx_buf, device->rx_count);
+            } else {
+                modem_at_receive(&b->at, device->rx_buf, device->rx_count);
+            }
+        }
+        break;
+    }
+}
+
+static void modem_mux_rx_byte(struct modem_device *device, u8 c)
+{
+    switch (device->rx_state) {
+    case MUX_RX_SEARCH:
+        if (c == MUX_FLAG) {
+            device->rx_state = MUX_RX_ADDR;
+        }
+        break;
+    case MUX_RX_ADDR:
+        if (c == MUX_FLAG) {
+            break;
+        }
+        device->rx_addr = c;
+        device->rx_fcs = crc8(modem_fcs_table, &c, 1, 0xff);
+        device->rx_state = MUX_RX_CTRL;
+        break;
+    case MUX_RX_CTRL:
+        device->rx_ctrl = c;
+        device->rx_fcs = crc8(modem_fcs_table, &c, 1, device->rx_fcs);
+        device->rx_state = MUX_RX_LEN1;
+        break;
+    case MUX_RX_LEN1:
+        device->rx_fcs = crc8(modem_fcs_table, &c, 1, device->rx_fcs);
+        device->rx_len = c >> 1;
+        device->rx_count = 0;
+        if (!(c & MUX_EA)) {
+            device->rx_state = MUX_RX_LEN2;
+        } else {
+            device->rx_state = device->rx_len ? MUX_RX_DATA : MUX_RX_FCS;
+        }
+        break;
+    case MUX_RX_LEN2:
+        device->rx_fcs = crc8(modem_fcs_table, &c, 1, device->rx_fcs);
+        device->rx_len |= c << 7;
+        if (device->rx_len > MUX_MTU) {
+            device->rx_bad_frames++;
+            device->rx_state = MUX_RX_SEARCH;
+            break;
+        }
+        device->rx_state = device->rx_len ? MUX_RX_DATA : MUX_RX_FCS;
+        break;
+    case MUX_RX_DATA:
+        device->rx_buf[device->rx_count++] = c;
+        if (device->rx_count == device->rx_len) {
+            if ((device->rx_ctrl & ~MUX_PF) != MUX_UIH) {
+                device->rx_fcs = crc8(modem_fcs_table, device->rx_buf, device->rx_count, device->rx_fcs);
+            }
+            device->rx_state = MUX_RX_FCS;
+        }
+        break;
+    case MUX_RX_FCS:
+        device->rx_fcs = crc8(modem_fcs_table, &c, 1, device->rx_fcs);
+        device->rx_state = device->rx_fcs == MUX_FCS_GOOD ? MUX_RX_END : MUX_RX_SEARCH;
+        if (device->rx_state == MUX_RX_SEARCH) {
+            device->rx_bad_frames++;
+        }
+        break;
+    case MUX_RX_END:
+        if (c == MUX_FLAG) {
+            modem_mux_dispatch(device);
+            device->rx_state = MUX_RX_ADDR;     // closing flag may open the next frame
+        } else {
+            device->rx_bad_frames++;
+            device->rx_state = MUX_RX_SEARCH;
+        }
+        break;
+    }
+}
+
+/**
+ * Link receive path: bytes from the serial link, from any context that
+ * does not run concurrently with itself
+ */
+void modem_link_receive(u32 device_id, const u8 *buf, size_t len)
+{
+    struct modem_device *device = modem_device(device_id);
+    size_t i;
+    
+    if (!device) {
+        return;
+    }
     
+    if (!READ_ONCE(device->mux_up)) {
+        modem_at_receive(&device->at, buf, len);
+        return;
+    }
+    for (i = 0; i < len; i++) {
+        modem_mux_rx_byte(device, buf[i]);
+    }
+}
+EXPORT_SYMBOL_GPL(modem_link_receive);
+
+static netdev_tx_t modem_net_xmit(struct sk_buff *skb, struct net_device *ndev)
+{
+    struct modem_net_priv *priv = netdev_priv(ndev);
+    struct modem_bearer *b = priv->bearer;
+    
+    if (!READ_ONCE(b->ip) || skb_linearize(skb) ||
+        modem_mux_send(b->device, b->dlci, MUX_UIH, true, skb->data, skb->len)) {
+        ndev->stats.tx_dropped++;
+    } else {
+        ndev->stats.tx_packets++;
+        ndev->stats.tx_bytes += skb->len;
+    }
+    dev_consume_skb_any(skb);
+    return NETDEV_TX_OK;
+}
+
+static int modem_net_open(struct net_device *ndev)
+{
+    netif_start_queue(ndev);
+    return 0;
+}
+
+static int modem_net_stop(struct net_device *ndev)
+{
+    netif_stop_queue(ndev);
     return 0;
 }
 
+static const struct net_device_ops modem_net_ops = {
+    .ndo_open = modem_net_open,
+    .ndo_stop = modem_net_stop,
+    .ndo_start_xmit = modem_net_xmit,
+};
+
+// Raw IP: no link-layer header, no ARP
+static void modem_net_setup(struct net_device *ndev)
+{
+    ndev->netdev_ops = &modem_net_ops;
+    ndev->type = ARPHRD_NONE;
+    ndev->flags = IFF_POINTOPOINT | IFF_NOARP;
+    ndev->hard_header_len = 0;
+    ndev->addr_len = 0;
+    ndev->mtu = 1500;
+    ndev->max_mtu = MUX_MTU;
+    ndev->needs_free_netdev = true;
+}
+
 /**
- * Disconnect MODEM
+ * Attach the serial link of device_id and create an interface per bearer
  */
-static int modem_disconnect(u32 device_id)
+int modem_register_link(u32 device_id, const struct modem_link_ops *ops, void *ctx)
 {
-    if (device_id >= MAX_MODEM_DEVICES) {
-        pr_err("Invalid MODEM device ID\n");
+    struct modem_device *device;
+    struct modem_net_priv *priv;
+    struct modem_bearer *b;
+    struct net_device *ndev;
+    int i, ret;
+    
+    if (device_id >= MAX_MODEM_DEVICES || !ops || !ops->write) {
         return -EINVAL;
     }
+    device = &global_modem_protocol.devices[device_id];
+    if (!device->device_active) {
+        return -ENODEV;
+    }
+    if (device->link) {
+        return -EBUSY;
+    }
     
-    struct modem_device *device = &global_modem_protocol.devices[device_id];
+    for (i = 0; i < MODEM_MAX_BEARERS; i++) {
+        b = &device->bearers[i];
+        ndev = alloc_netdev(sizeof(*priv), "wwan%d", NET_NAME_ENUM, modem_net_setup);
+        if (!ndev) {
+            ret = -ENOMEM;
+            goto err;
+        }
+        priv = netdev_priv(ndev);
+        priv->bearer = b;
+        netif_carrier_off(ndev);
+        
+        ret = register_netdev(ndev);
+        if (ret) {
+            free_netdev(ndev);
+            goto err;
+        }
+        
+        b->device = device;
+        b->dlci = MUX_DLCI_DATA + i;
+        b->cid = i + 1;
+        b->state = MODEM_BEARER_IDLE;
+        b->ip = false;
+        b->ndev = ndev;
+        b->retry_ms = MODEM_RETRY_MIN_MS;
+        b->failures = 0;
+        modem_at_init(&b->at, device, b->dlci);
+        INIT_DELAYED_WORK(&b->retry, modem_bearer_retry);
+    }
     
-    if (!device->device_active) {
+    spin_lock_init(&device->tx_lock);
+    modem_at_init(&device->at, device, MUX_DLCI_AT);
+    device->mux_up = false;
+    device->mux_starting = false;
+    device->mux_ready = false;
+    device->rx_bad_frames = 0;
+    device->link_ctx = ctx;
+    WRITE_ONCE(device->link, ops);
+    
+    pr_info("MODEM device %d link attached: %d bearers\n", device_id, MODEM_MAX_BEARERS);
+    return 0;
+    
+err:
+    while (--i >= 0) {
+        unregister_netdev(device->bearers[i].ndev);
+    }
+    return ret;
+}
+EXPORT_SYMBOL_GPL(modem_register_link);
+
+/**
+ * Interface carrying an APN's traffic, for steering it there; NULL if
+ * the APN has no bearer
+ */
+struct net_device *modem_apn_netdev(u32 device_id, u32 apn_id)
+{
+    struct modem_device *device = modem_device(device_id);
+    int i;
+    
+    if (!device) {
+        return NULL;
+    }
+    for (i = 0; i < MODEM_MAX_BEARERS; i++) {
+        if (device->bearers[i].state != MODEM_BEARER_IDLE && device->bearers[i].apn_id == apn_id) {
+            return device->bearers[i].ndev;
+        }
+    }
+    return NULL;
+}
+EXPORT_SYMBOL_GPL(modem_apn_netdev);
+
+/**
+ * Connect MODEM: brings up a bearer for apn_id next to any already up,
+ * starting the multiplexer first if needed. The bearer's interface
+ * gets carrier once its data DLC carries IP.
+ */
+static int modem_connect(u32 device_id, u32 apn_id)
+{
+    struct modem_bearer *b = NULL;
+    int i;
+    
+    if (device_id >= MAX_MODEM_DEVICES || apn_id >= MAX_MODEM_APNS) {
+        pr_err("Invalid MODEM connection parameters\n");
+        return -EINVAL;
+    }
+    
+    struct modem_device *device = modem_device(device_id);
+    
+    if (!device || !device->device_active) {
         pr_err("MODEM device %d is not active\n", device_id);
+        return -ENODEV;
+    }
+    
+    if (!device->apns[apn_id].active) {
+        pr_err("MODEM APN %d is not configured\n", apn_id);
         return -EINVAL;
     }
     
+    // Find free bearer slot
+    for (i = 0; i < MODEM_MAX_BEARERS; i++) {
+        if (device->bearers[i].state != MODEM_BEARER_IDLE && device->bearers[i].apn_id == apn_id) {
+            return -EALREADY;
+        }
+        if (!b && device->bearers[i].state == MODEM_BEARER_IDLE) {
+            b = &device->bearers[i];
+        }
+    }
+    
+    if (!b) {
+        pr_err("No free MODEM bearer slots available\n");
+        return -ENOMEM;
+    }
+    
+    pr_info("Connecting MODEM device %d to APN %d on %s\n", device_id, apn_id, b->ndev->name);
+    
+    b->apn_id = apn_id;
+    b->state = MODEM_BEARER_ACTIVATING;
+    b->retry_ms = MODEM_RETRY_MIN_MS;
     if (device->status != MODEM_STATUS_CONNECTED) {
-        pr_err("MODEM device %d is not connected\n", device_id);
-        return -EINVAL;
+        device->status = MODEM_STATUS_CONNECTING;
     }
     
-    pr_info("Disconnecting MODEM device %d\n", device_id);
+    if (device->mux_ready) {
+        modem_bearer_activate(b);
+        return 0;
+    }
+    if (device->mux_up || device->mux_starting) {
+        return 0;
+    }
+    device->mux_starting = true;
+    return modem_at_submit(&device->at, "AT+CMUX=0,0,5," __stringify(MUX_MTU), modem_cmux_started, NULL);
+}
+
+/**
+ * Bring up every configured APN in priority order, lowest value first,
+ * as far as there are bearers: the first is the primary and the rest
+ * hot standbys, all active at once
+ */
+static int modem_connect_all(u32 device_id)
+{
+    struct modem_device *device = modem_device(device_id);
+    bool used[MAX_MODEM_APNS] = {};
+    int n, i, best, ret, up = 0;
     
-    device->status = MODEM_STATUS_DISCONNECTING;
+    if (!device) {
+        return -ENODEV;
+    }
     
-    // Simulate disconnection process
-    udelay(500); // 0.5ms delay
+    for (n = 0; n < MODEM_MAX_BEARERS; n++) {
+        best = -1;
+        for (i = 0; i < MAX_MODEM_APNS; i++) {
+            if (device->apns[i].active && !used[i] &&
+                (best < 0 || device->apns[i].priority < device->apns[best].priority)) {
+                best = i;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        used[best] = true;
+        
+        ret = modem_connect(device_id, best);
+        if (ret && ret != -EALREADY) {
+            return up ? up : ret;
+        }
+        up++;
+    }
+    return up;
+}
+
+static void modem_bearer_down(struct modem_device *device, int result, const char *info, void *ctx)
+{
+    struct modem_bearer *b = ctx;
+    int i;
     
+    b->state = MODEM_BEARER_IDLE;
+    for (i = 0; i < MODEM_MAX_BEARERS; i++) {
+        if (device->bearers[i].state != MODEM_BEARER_IDLE) {
+            return;
+        }
+    }
     device->status = MODEM_STATUS_DISCONNECTED;
-    device->signal_strength = 0;
-    device->signal_quality = 0;
-    device->data_rate_bps = 0;
-    device->latency_ms = 0;
+    pr_info("MODEM device %d disconnected\n", device->device_id);
+}
+
+/**
+ * Disconnect MODEM: every bearer's data DLC is returned to command mode
+ * and its PDP context deactivated
+ */
+static int modem_disconnect(u32 device_id)
+{
+    struct modem_device *device = modem_device(device_id);
+    struct modem_bearer *b;
+    char cmd[32];
+    int i, ret = 0;
     
-    pr_info("MODEM device %d disconnected\n", device_id);
+    if (!device || !device->device_active) {
+        pr_err("MODEM device %d is not active\n", device_id);
+        return -ENODEV;
+    }
     
-    return 0;
+    if (device->status == MODEM_STATUS_DISCONNECTED || device->status == MODEM_STATUS_DISCONNECTING) {
+        pr_err("MODEM device %d is not connected\n", device_id);
+        return -EINVAL;
+    }
+    
+    pr_info("Disconnecting MODEM device %d\n", device_id);
+    
+    device->status = MODEM_STATUS_DISCONNECTING;
+    for (i = 0; i < MODEM_MAX_BEARERS; i++) {
+        b = &device->bearers[i];
+        if (b->state == MODEM_BEARER_IDLE) {
+            continue;
+        }
+        cancel_delayed_work_sync(&b->retry);
+        b->state = MODEM_BEARER_IDLE;
+        WRITE_ONCE(b->ip, false);
+        netif_carrier_off(b->ndev);
+        modem_bearer_reset_dlc(b);
+        
+        snprintf(cmd, sizeof(cmd), "AT+CGACT=0,%u", b->cid);
+        ret = modem_at_submit(&device->at, cmd, modem_bearer_down, b) ?: ret;
+    }
+    return ret;
 }
 
 /**
@@ -388,6 +1312,8 @@ static int __init modem_protocol_init_module(void)
     
     pr_info("MODEM Protocol v%s loading\n", MODEM_PROTOCOL_VERSION);
     
+    crc8_populate_lsb(modem_fcs_table, 0xe0);
+    
     ret = modem_protocol_init();
     if (ret) {
         pr_err("Failed to initialize MODEM protocol\n");
@@ -403,6 +1329,21 @@ static int __init modem_protocol_init_module(void)
  */
 static void __exit modem_protocol_cleanup_module(void)
 {
+    struct modem_device *device;
+    int i, j;
+    
+    for (i = 0; i < MAX_MODEM_DEVICES; i++) {
+        device = &global_modem_protocol.devices[i];
+        if (!device->link) {
+            continue;
+        }
+        for (j = 0; j < MODEM_MAX_BEARERS; j++) {
+            cancel_delayed_work_sync(&device->bearers[j].retry);
+            unregister_netdev(device->bearers[j].ndev);
+            modem_at_flush(&device->bearers[j].at);
+        }
+        modem_at_flush(&device->at);
+    }
     pr_info("MODEM Protocol unloaded\n");
 }
 
@@ -0,0 +1,33 @@
+/**
+ * Modem link interface
+ *
+ * What the glue for a modem's serial link gives modem_protocol.c and
+ * calls back into it. Once connected the link carries a 3GPP TS 27.010
+ * (CMUX) basic-option multiplexer: DLCI 1 is the AT channel and DLCI 2
+ * onwards one data channel per bearer, which after +CGDATA carries raw
+ * IP packets, one per UIH frame, to that bearer's wwan%d interface.
+ * Several APNs can be up at once, each on its own interface, and a
+ * lost bearer only drops its interface's carrier while it is brought
+ * back, so traffic steered by APN or falling back to a standby bearer
+ * is never held up by it. AT commands are queued and the next one goes
+ * out as soon as the previous one's final result comes in; the data
+ * channels never wait for them.
+ */
+
+#ifndef MODEM_PROTOCOL_H
+#define MODEM_PROTOCOL_H
+
+#include <linux/types.h>
+
+struct net_device;
+
+// write sends bytes on the serial link and must not sleep
+struct modem_link_ops {
+    int (*write)(void *ctx, const u8 *buf, size_t len);
+};
+
+int modem_register_link(u32 device_id, const struct modem_link_ops *ops, void *ctx);
+void modem_link_receive(u32 device_id, const u8 *buf, size_t len);
+struct net_device *modem_apn_netdev(u32 device_id, u32 apn_id);
+
+#endif /* MODEM_PROTOCOL_H */
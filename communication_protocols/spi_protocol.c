@@ -15,12 +15,51 @@
 #include <linux/errno.h>
 #include <linux/atomic.h>
 #include <linux/delay.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/completion.h>
 
-#define SPI_VERSION "2.2.0"
+#include "spi_protocol.h"
+
+#define SPI_VERSION "2.3.0"
+#define SPI_MAX_CONTROLLERS 4
 #define SPI_MAX_DEVICES 16
 #define SPI_MAX_SPEED 50000000  // 50MHz
 #define SPI_DEFAULT_SPEED 1000000  // 1MHz
 
+static unsigned int spi_pio_threshold = 32;
+module_param(spi_pio_threshold, uint, 0644);
+MODULE_PARM_DESC(spi_pio_threshold, "Messages up to this many bytes are polled instead of using DMA");
+
+// One transfer of a message; chip select stays asserted unless cs_change
+struct spi_segment {
+    const void *tx_buf;
+    void *rx_buf;
+    size_t len;
+    u16 delay_us;
+    bool cs_change;                         // release chip select after this segment
+};
+
+struct spi_msg;
+typedef void (*spi_complete_t)(struct spi_msg *msg);
+
+/*
+ * A message to one chip select: its segments run back to back, then
+ * complete() is called with status set. complete() may run in interrupt
+ * context and must not sleep; the message belongs to the controller
+ * from spi_submit() until then.
+ */
+struct spi_msg {
+    struct list_head node;
+    u8 cs;
+    struct spi_segment *segs;
+    int num_segs;
+    spi_complete_t complete;
+    void *context;
+    int status;
+    size_t actual;
+};
+
 struct spi_device_config {
     u8 chip_select;
     u32 max_speed_hz;
@@ -40,11 +79,33 @@ struct spi_controller_config {
     atomic_t total_transfers;
     u32 controller_errors;
     bool dma_enabled;
+    
+    // Hardware, once its driver has registered
+    const struct spi_hw_ops *ops;
+    void *hw_ctx;
+    
+    // Message queue; busy while a chain or polled message is on the wire
+    spinlock_t queue_lock;
+    struct list_head queue;
+    struct list_head chain;                 // messages in the DMA chain in flight
+    bool busy;
+    struct spi_desc descs[SPI_MAX_CHAIN];
+    struct spi_desc pio_descs[SPI_MAX_CHAIN];
+    u32 dma_chains;
+    u32 pio_transfers;
 };
 
-static struct spi_controller_config spi_controllers[4];
+static struct spi_controller_config spi_controllers[SPI_MAX_CONTROLLERS];
 static int spi_controller_count = 0;
 
+static struct spi_controller_config *spi_controller(int ctrl_id)
+{
+    if (ctrl_id < 0 || ctrl_id >= spi_controller_count) {
+        return NULL;
+    }
+    return &spi_controllers[ctrl_id];
+}
+
 /**
  * Initialize SPI controller
  */
@@ -63,6 +124,13 @@ static int spi_controller_init(struct spi_controller_config *ctrl, int ctrl_id,
     atomic_set(&ctrl->total_transfers, 0);
     ctrl->controller_errors = 0;
     ctrl->dma_enabled = true;
+    ctrl->ops = NULL;
+    spin_lock_init(&ctrl->queue_lock);
+    INIT_LIST_HEAD(&ctrl->queue);
+    INIT_LIST_HEAD(&ctrl->chain);
+    ctrl->busy = false;
+    ctrl->dma_chains = 0;
+    ctrl->pio_transfers = 0;
     
     // Initialize devices
     for (i = 0; i < SPI_MAX_DEVICES; i++) {
@@ -82,45 +150,259 @@ static int spi_controller_init(struct spi_controller_config *ctrl, int ctrl_id,
 }
 
 /**
- * SPI transfer function
+ * Attach the controller driver for ctrl_id
  */
-static int spi_transfer(struct spi_controller_config *ctrl, u8 cs, 
-                        const u8 *tx_buf, u8 *rx_buf, size_t len)
+int spi_register_controller(int ctrl_id, const struct spi_hw_ops *ops, void *ctx)
 {
-    size_t i;
-    int ret = 0;
+    struct spi_controller_config *ctrl = spi_controller(ctrl_id);
+    unsigned long flags;
     
-    if (!ctrl || len == 0) {
+    if (!ctrl || !ops || !ops->transfer_pio || !ops->transfer_dma) {
         return -EINVAL;
     }
     
-    // Simulate SPI transfer
-    // 1. Assert chip select
-    udelay(1);
+    spin_lock_irqsave(&ctrl->queue_lock, flags);
+    if (ctrl->busy || !list_empty(&ctrl->queue)) {
+        spin_unlock_irqrestore(&ctrl->queue_lock, flags);
+        return -EBUSY;
+    }
+    ctrl->ops = ops;
+    ctrl->hw_ctx = ctx;
+    ctrl->dma_enabled = true;
+    spin_unlock_irqrestore(&ctrl->queue_lock, flags);
     
-    // 2. Transfer data
-    for (i = 0; i < len; i++) {
-        // Simulate SPI clock and data transfer
-        if (tx_buf) {
-            // Simulate sending data
-            udelay(1);
+    pr_info("SPI controller %d attached\n", ctrl_id);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(spi_register_controller);
+
+static size_t spi_msg_len(const struct spi_msg *msg)
+{
+    size_t len = 0;
+    int i;
+    
+    for (i = 0; i < msg->num_segs; i++) {
+        len += msg->segs[i].len;
+    }
+    return len;
+}
+
+/*
+ * Append msg to a descriptor list at position n; returns the new
+ * length. Chip select is released at the end of every message.
+ */
+static int spi_build_descs(struct spi_controller_config *ctrl, const struct spi_msg *msg,
+                           struct spi_desc *descs, int n)
+{
+    const struct spi_device_config *sdev = &ctrl->devices[msg->cs];
+    int i;
+    
+    for (i = 0; i < msg->num_segs; i++, n++) {
+        descs[n].tx = msg->segs[i].tx_buf;
+        descs[n].rx = msg->segs[i].rx_buf;
+        descs[n].len = msg->segs[i].len;
+        descs[n].speed_hz = sdev->max_speed_hz;
+        descs[n].bits_per_word = sdev->bits_per_word;
+        descs[n].delay_us = msg->segs[i].delay_us;
+        descs[n].cs_release = msg->segs[i].cs_change || i == msg->num_segs - 1;
+    }
+    return n;
+}
+
+/*
+ * Start the next chain if the controller is idle: the message at the
+ * head of the queue and every later one for the same chip select, in
+ * order, as far as the descriptors go. Messages whose chain could not
+ * be started are moved to done. Called with queue_lock held.
+ */
+static void spi_kick(struct spi_controller_config *ctrl, struct list_head *done)
+{
+    struct spi_msg *head, *msg, *tmp;
+    int n, ret;
+    
+    while (!ctrl->busy && !list_empty(&ctrl->queue)) {
+        head = list_first_entry(&ctrl->queue, struct spi_msg, node);
+        n = 0;
+        
+        list_for_each_entry_safe(msg, tmp, &ctrl->queue, node) {
+            if (msg->cs != head->cs) {
+                continue;
+            }
+            if (n + msg->num_segs > SPI_MAX_CHAIN) {
+                break;
+            }
+            n = spi_build_descs(ctrl, msg, ctrl->descs, n);
+            list_move_tail(&msg->node, &ctrl->chain);
+        }
+        
+        ret = ctrl->ops->transfer_dma(ctrl->hw_ctx, head->cs, ctrl->devices[head->cs].mode, ctrl->descs, n);
+        if (!ret) {
+            ctrl->busy = true;
+            ctrl->dma_chains++;
+            return;
         }
-        if (rx_buf) {
-            // Simulate receiving data
-            rx_buf[i] = tx_buf ? tx_buf[i] ^ 0xFF : 0x55;
-            udelay(1);
+        
+        pr_err("SPI controller %d DMA submit failed: %d\n", ctrl->controller_id, ret);
+        ctrl->controller_errors++;
+        list_for_each_entry(msg, &ctrl->chain, node) {
+            msg->status = ret;
         }
+        list_splice_tail_init(&ctrl->chain, done);
     }
+}
+
+// Call completions for finished messages, outside queue_lock
+static void spi_complete_list(struct spi_controller_config *ctrl, struct list_head *done)
+{
+    struct spi_msg *msg, *tmp;
     
-    // 3. Deassert chip select
-    udelay(1);
+    list_for_each_entry_safe(msg, tmp, done, node) {
+        list_del(&msg->node);
+        if (msg->status) {
+            ctrl->devices[msg->cs].error_count++;
+        } else {
+            atomic_inc(&ctrl->devices[msg->cs].transfer_count);
+            atomic_inc(&ctrl->total_transfers);
+        }
+        msg->complete(msg);
+    }
+}
+
+/**
+ * DMA completion: the chain in flight has finished with status.
+ * Completes its messages and starts the next chain.
+ */
+void spi_dma_done(int ctrl_id, int status)
+{
+    struct spi_controller_config *ctrl = spi_controller(ctrl_id);
+    struct spi_msg *msg;
+    unsigned long flags;
+    LIST_HEAD(done);
     
-    atomic_inc(&ctrl->total_transfers);
+    if (!ctrl) {
+        return;
+    }
     
-    pr_debug("SPI controller %d transfer: cs=%d, len=%zu\n", 
-             ctrl->controller_id, cs, len);
+    spin_lock_irqsave(&ctrl->queue_lock, flags);
+    list_for_each_entry(msg, &ctrl->chain, node) {
+        msg->status = status;
+        msg->actual = status ? 0 : spi_msg_len(msg);
+    }
+    list_splice_tail_init(&ctrl->chain, &done);
+    ctrl->busy = false;
+    spi_kick(ctrl, &done);
+    spin_unlock_irqrestore(&ctrl->queue_lock, flags);
     
-    return ret;
+    spi_complete_list(ctrl, &done);
+}
+EXPORT_SYMBOL_GPL(spi_dma_done);
+
+/**
+ * Queue a message. Small messages that find the controller idle are
+ * polled out before this returns; everything else goes out in the next
+ * DMA chain for its chip select.
+ */
+static int spi_submit(struct spi_controller_config *ctrl, struct spi_msg *msg)
+{
+    unsigned long flags;
+    LIST_HEAD(done);
+    int n;
+    
+    if (!ctrl || !msg || !msg->complete || msg->cs >= SPI_MAX_DEVICES || msg->num_segs <= 0) {
+        return -EINVAL;
+    }
+    if (msg->num_segs > SPI_MAX_CHAIN) {
+        return -EMSGSIZE;
+    }
+    
+    msg->status = 0;
+    msg->actual = 0;
+    
+    spin_lock_irqsave(&ctrl->queue_lock, flags);
+    if (!ctrl->ops) {
+        spin_unlock_irqrestore(&ctrl->queue_lock, flags);
+        return -ENODEV;
+    }
+    
+    // Polled fast path: nothing else may be on the wire or ahead in the queue
+    if (!ctrl->busy && list_empty(&ctrl->queue) && spi_msg_len(msg) <= spi_pio_threshold) {
+        ctrl->busy = true;
+        spin_unlock_irqrestore(&ctrl->queue_lock, flags);
+        
+        n = spi_build_descs(ctrl, msg, ctrl->pio_descs, 0);
+        msg->status = ctrl->ops->transfer_pio(ctrl->hw_ctx, msg->cs, ctrl->devices[msg->cs].mode,
+                                              ctrl->pio_descs, n);
+        msg->actual = msg->status ? 0 : spi_msg_len(msg);
+        
+        spin_lock_irqsave(&ctrl->queue_lock, flags);
+        ctrl->busy = false;
+        ctrl->pio_transfers++;
+        list_add_tail(&msg->node, &done);
+        spi_kick(ctrl, &done);
+        spin_unlock_irqrestore(&ctrl->queue_lock, flags);
+        
+        spi_complete_list(ctrl, &done);
+        return 0;
+    }
+    
+    list_add_tail(&msg->node, &ctrl->queue);
+    spi_kick(ctrl, &done);
+    spin_unlock_irqrestore(&ctrl->queue_lock, flags);
+    
+    spi_complete_list(ctrl, &done);
+    return 0;
+}
+
+static void spi_sync_complete(struct spi_msg *msg)
+{
+    complete(msg->context);
+}
+
+/**
+ * Queue a message and sleep until it has completed
+ */
+static int spi_submit_sync(struct spi_controller_config *ctrl, struct spi_msg *msg)
+{
+    DECLARE_COMPLETION_ONSTACK(done);
+    int ret;
+    
+    msg->complete = spi_sync_complete;
+    msg->context = &done;
+    
+    ret = spi_submit(ctrl, msg);
+    if (ret) {
+        return ret;
+    }
+    wait_for_completion(&done);
+    
+    pr_debug("SPI controller %d message: cs=%d, len=%zu, status=%d\n",
+             ctrl->controller_id, msg->cs, msg->actual, msg->status);
+    
+    return msg->status;
+}
+
+/**
+ * SPI transfer function
+ */
+static int spi_transfer(struct spi_controller_config *ctrl, u8 cs, 
+                        const u8 *tx_buf, u8 *rx_buf, size_t len)
+{
+    struct spi_segment seg = {
+        .tx_buf = tx_buf,
+        .rx_buf = rx_buf,
+        .len = len,
+    };
+    struct spi_msg msg = {
+        .cs = cs,
+        .segs = &seg,
+        .num_segs = 1,
+    };
+    
+    if (!ctrl || len == 0) {
+        return -EINVAL;
+    }
+    
+    return spi_submit_sync(ctrl, &msg);
 }
 
 /**
@@ -140,25 +422,29 @@ static int spi_read(struct spi_controller_config *ctrl, u8 cs, u8 *buffer, size_
 }
 
 /**
- * SPI write-then-read function
+ * SPI write-then-read function: one message, chip select held between
+ * the two segments
  */
 static int spi_write_read(struct spi_controller_config *ctrl, u8 cs,
                           const u8 *write_data, size_t write_len,
                           u8 *read_buffer, size_t read_len)
 {
+    struct spi_segment segs[2] = {
+        { .tx_buf = write_data, .len = write_len },
+        { .rx_buf = read_buffer, .len = read_len },
+    };
+    struct spi_msg msg = {
+        .cs = cs,
+        .segs = segs,
+        .num_segs = 2,
+    };
     int ret;
     
-    // Write data first
-    ret = spi_write(ctrl, cs, write_data, write_len);
-    if (ret) {
-        return ret;
+    if (!ctrl || write_len == 0 || read_len == 0) {
+        return -EINVAL;
     }
     
-    // Small delay between write and read
-    udelay(10);
-    
-    // Read data
-    ret = spi_read(ctrl, cs, read_buffer, read_len);
+    ret = spi_submit_sync(ctrl, &msg);
     
     pr_debug("SPI controller %d write-read: cs=%d, write=%zu, read=%zu\n",
              ctrl->controller_id, cs, write_len, read_len);
@@ -240,6 +526,12 @@ static int __init spi_protocol_init_module(void)
  */
 static void __exit spi_protocol_cleanup_module(void)
 {
+    int i;
+    
+    for (i = 0; i < spi_controller_count; i++) {
+        pr_info("SPI controller %d: %u DMA chains, %u polled messages\n",
+                i, spi_controllers[i].dma_chains, spi_controllers[i].pio_transfers);
+    }
     pr_info("SPI Protocol unloaded\n");
 }
 
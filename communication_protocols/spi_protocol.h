@@ -0,0 +1,49 @@
+/**
+ * SPI controller interface
+ *
+ * What an SPI controller driver gives spi_protocol.c and calls back
+ * into it. Transfers are queued as messages; whenever the controller
+ * goes idle, every queued message for the chip select at the head of
+ * the queue is chained into one descriptor list and handed to the DMA
+ * engine in a single submit, with chip select held across it. Messages
+ * shorter than spi_pio_threshold bytes that find the controller idle
+ * are clocked out by polling instead, without the DMA setup cost.
+ */
+
+#ifndef SPI_PROTOCOL_H
+#define SPI_PROTOCOL_H
+
+#include <linux/types.h>
+
+#define SPI_MAX_CHAIN 16                    // descriptors per DMA submit
+
+/*
+ * One segment of a chain. Chip select is asserted before the first
+ * descriptor and released after every one marked cs_release; the last
+ * descriptor of a chain is always marked. Buffers are the callers' and
+ * must be DMA-able; tx or rx may be NULL.
+ */
+struct spi_desc {
+    const u8 *tx;
+    u8 *rx;
+    u32 len;
+    u32 speed_hz;
+    u8 bits_per_word;
+    u16 delay_us;                           // idle after this descriptor
+    bool cs_release;
+};
+
+/*
+ * transfer_pio runs a chain to completion by polling and must not
+ * sleep. transfer_dma starts one and reports it with spi_dma_done(),
+ * typically from the DMA completion interrupt.
+ */
+struct spi_hw_ops {
+    int (*transfer_pio)(void *ctx, u8 cs, u8 mode, const struct spi_desc *descs, int n);
+    int (*transfer_dma)(void *ctx, u8 cs, u8 mode, const struct spi_desc *descs, int n);
+};
+
+int spi_register_controller(int ctrl_id, const struct spi_hw_ops *ops, void *ctx);
+void spi_dma_done(int ctrl_id, int status);
+
+#endif /* SPI_PROTOCOL_H */
@@ -15,12 +15,32 @@
 #include <linux/slab.h>
 #include <linux/errno.h>
 #include <linux/atomic.h>
+#include <linux/bitops.h>
+#include <linux/cache.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
 
-#define UART_VERSION "2.0.0"
+#include "uart_protocol.h"
+
+#define UART_VERSION "2.1.0"
 #define UART_MAX_PORTS 8
-#define UART_BUFFER_SIZE 4096
+#define UART_RX_RING_SIZE 16384             // bytes, power of two; ~50 ms at 3 Mbaud
+#define UART_TX_RING_SIZE 8192              // bytes, power of two
 #define UART_BAUD_RATES 16
 
+#define UART_TX_BUSY 0                      // tx_flags bit: a DMA run is in flight
+
+/*
+ * Free-running head and tail, each on its own cache line. RX: the DMA
+ * engine fills buf and uart_rx_event() moves head; the reader owns
+ * tail. TX: writers move head under tx_lock; the DMA side owns tail.
+ */
+struct uart_ring {
+    u32 head ____cacheline_aligned_in_smp;
+    u32 tail ____cacheline_aligned_in_smp;
+    u8 *buf;
+};
+
 struct uart_port_config {
     int port_id;
     u32 baud_rate;
@@ -33,6 +53,20 @@ struct uart_port_config {
     atomic_t rx_count;
     u32 error_count;
     bool dma_enabled;
+    
+    // Hardware, once its driver has registered
+    const struct uart_hw_ops *ops;
+    void *hw_ctx;
+    
+    struct uart_ring rx;
+    size_t rx_dma_pos;                      // engine offset at the last event
+    u32 rx_overruns;                        // bytes the DMA overwrote before they were read
+    wait_queue_head_t rx_wait;
+    
+    struct uart_ring tx;
+    spinlock_t tx_lock;                     // between writers only
+    unsigned long tx_flags;
+    u32 tx_inflight;
 };
 
 struct uart_driver {
@@ -61,11 +95,16 @@ static int uart_port_init(struct uart_port_config *port, int port_id, u32 baud_r
     port->stop_bits = 1;
     port->parity = 0; // No parity
     port->flow_control = 1; // RTS/CTS
-    port->buffer_size = UART_BUFFER_SIZE;
+    port->buffer_size = UART_RX_RING_SIZE;
     atomic_set(&port->tx_count, 0);
     atomic_set(&port->rx_count, 0);
     port->error_count = 0;
     port->dma_enabled = true;
+    port->ops = NULL;
+    port->rx_overruns = 0;
+    init_waitqueue_head(&port->rx_wait);
+    spin_lock_init(&port->tx_lock);
+    port->tx_flags = 0;
     
     pr_info("UART port %d initialized: baud=%d, flow_control=%s\n",
             port_id, baud_rate, port->flow_control ? "enabled" : "disabled");
@@ -73,54 +112,270 @@ static int uart_port_init(struct uart_port_config *port, int port_id, u32 baud_r
     return 0;
 }
 
+static struct uart_port_config *uart_port(int port_id)
+{
+    if (port_id < 0 || port_id >= global_uart_driver.active_ports ||
+        !global_uart_driver.ports[port_id].ops) {
+        return NULL;
+    }
+    return &global_uart_driver.ports[port_id];
+}
+
 /**
- * UART transmit function
+ * Attach the driver for port_id and start circular DMA reception
+ */
+int uart_register_port(int port_id, const struct uart_hw_ops *ops, void *ctx)
+{
+    struct uart_port_config *port;
+    
+    if (port_id < 0 || port_id >= global_uart_driver.active_ports || !ops ||
+        !ops->rx_dma_start || !ops->rx_dma_stop || !ops->rx_dma_pos || !ops->tx_dma_start) {
+        return -EINVAL;
+    }
+    port = &global_uart_driver.ports[port_id];
+    if (port->ops) {
+        return -EBUSY;
+    }
+    
+    port->tx.buf = kmalloc(UART_TX_RING_SIZE, GFP_KERNEL);
+    if (!port->tx.buf) {
+        return -ENOMEM;
+    }
+    port->tx.head = 0;
+    port->tx.tail = 0;
+    port->tx_flags = 0;
+    
+    port->rx.head = 0;
+    port->rx.tail = 0;
+    port->rx_dma_pos = 0;
+    port->rx.buf = ops->rx_dma_start(ctx, UART_RX_RING_SIZE);
+    if (!port->rx.buf) {
+        pr_err("UART port %d: RX DMA failed to start\n", port_id);
+        kfree(port->tx.buf);
+        port->tx.buf = NULL;
+        return -EIO;
+    }
+    
+    port->hw_ctx = ctx;
+    smp_store_release(&port->ops, ops);
+    
+    pr_info("UART port %d attached: %d byte RX ring, %d byte TX ring\n",
+            port_id, UART_RX_RING_SIZE, UART_TX_RING_SIZE);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(uart_register_port);
+
+/**
+ * Detach the driver; it must have no TX run in flight
+ */
+void uart_unregister_port(int port_id)
+{
+    struct uart_port_config *port = uart_port(port_id);
+    
+    if (!port) {
+        return;
+    }
+    
+    port->ops->rx_dma_stop(port->hw_ctx);
+    WRITE_ONCE(port->ops, NULL);
+    wake_up_all(&port->rx_wait);
+    kfree(port->tx.buf);
+    port->tx.buf = NULL;
+    port->rx.buf = NULL;
+}
+EXPORT_SYMBOL_GPL(uart_unregister_port);
+
+/**
+ * ISR: idle line, half transfer or transfer complete. Publishes the
+ * bytes the engine wrote since the last event. The driver must call
+ * this at least every half ring, which half-transfer interrupts ensure.
+ */
+void uart_rx_event(int port_id)
+{
+    struct uart_port_config *port = uart_port(port_id);
+    size_t pos, delta;
+    
+    if (!port) {
+        return;
+    }
+    
+    pos = port->ops->rx_dma_pos(port->hw_ctx);
+    delta = (pos - port->rx_dma_pos) & (UART_RX_RING_SIZE - 1);
+    if (!delta) {
+        return;
+    }
+    port->rx_dma_pos = pos;
+    
+    smp_store_release(&port->rx.head, port->rx.head + delta);
+    if (wq_has_sleeper(&port->rx_wait)) {
+        wake_up(&port->rx_wait);
+    }
+}
+EXPORT_SYMBOL_GPL(uart_rx_event);
+
+/*
+ * Start the next contiguous TX run unless one is in flight. Whoever
+ * clears UART_TX_BUSY looks at the ring again afterwards, so data
+ * queued meanwhile is never left behind.
+ */
+static void uart_tx_kick(struct uart_port_config *port)
+{
+    struct uart_ring *r = &port->tx;
+    u32 head, off;
+    int ret;
+    
+    for (;;) {
+        if (test_and_set_bit(UART_TX_BUSY, &port->tx_flags)) {
+            return;
+        }
+        head = smp_load_acquire(&r->head);
+        if (head != r->tail) {
+            break;
+        }
+        clear_bit_unlock(UART_TX_BUSY, &port->tx_flags);
+        smp_mb__after_atomic();
+        if (READ_ONCE(r->head) == r->tail) {
+            return;
+        }
+    }
+    
+    off = r->tail & (UART_TX_RING_SIZE - 1);
+    port->tx_inflight = min_t(u32, head - r->tail, UART_TX_RING_SIZE - off);
+    ret = port->ops->tx_dma_start(port->hw_ctx, &r->buf[off], port->tx_inflight);
+    if (ret) {
+        pr_err("UART port %d TX DMA failed: %d\n", port->port_id, ret);
+        port->error_count++;
+        port->tx_inflight = 0;
+        clear_bit_unlock(UART_TX_BUSY, &port->tx_flags);
+    }
+}
+
+/**
+ * ISR: the TX run in flight has gone out
+ */
+void uart_tx_done(int port_id)
+{
+    struct uart_port_config *port = uart_port(port_id);
+    
+    if (!port || !test_bit(UART_TX_BUSY, &port->tx_flags)) {
+        return;
+    }
+    
+    atomic_add(port->tx_inflight, &port->tx_count);
+    atomic_add(port->tx_inflight, &global_uart_driver.total_bytes_tx);
+    smp_store_release(&port->tx.tail, port->tx.tail + port->tx_inflight);
+    port->tx_inflight = 0;
+    clear_bit_unlock(UART_TX_BUSY, &port->tx_flags);
+    
+    uart_tx_kick(port);
+}
+EXPORT_SYMBOL_GPL(uart_tx_done);
+
+/**
+ * UART transmit function: queue as much of data as fits for DMA.
+ * Returns the number of bytes queued, -EAGAIN if the ring is full.
  */
 static int uart_transmit(struct uart_port_config *port, const u8 *data, size_t len)
 {
-    size_t i;
-    int ret = 0;
+    struct uart_ring *r;
+    unsigned long flags;
+    u32 head, off, n, first;
     
     if (!port || !data || len == 0) {
         return -EINVAL;
     }
+    if (!READ_ONCE(port->ops)) {
+        return -ENODEV;
+    }
+    r = &port->tx;
     
-    // Simulate UART transmission
-    for (i = 0; i < len; i++) {
-        // Hardware UART register write simulation
-        // In real implementation, this would write to UART hardware registers
-        udelay(10); // Simulate transmission delay
+    spin_lock_irqsave(&port->tx_lock, flags);
+    head = r->head;
+    n = min_t(size_t, len, UART_TX_RING_SIZE - (head - smp_load_acquire(&r->tail)));
+    if (n) {
+        off = head & (UART_TX_RING_SIZE - 1);
+        first = min_t(u32, n, UART_TX_RING_SIZE - off);
+        memcpy(&r->buf[off], data, first);
+        memcpy(r->buf, data + first, n - first);
+        smp_store_release(&r->head, head + n);
     }
+    spin_unlock_irqrestore(&port->tx_lock, flags);
     
-    atomic_add(len, &port->tx_count);
-    atomic_add(len, &global_uart_driver.total_bytes_tx);
+    if (!n) {
+        return -EAGAIN;
+    }
+    smp_mb();
+    uart_tx_kick(port);
     
-    pr_debug("UART port %d transmitted %zu bytes\n", port->port_id, len);
+    pr_debug("UART port %d queued %u bytes\n", port->port_id, n);
     
-    return ret;
+    return n;
 }
 
 /**
- * UART receive function
+ * UART receive function: copy out up to max_len of what has arrived,
+ * 0 if nothing has. One reader per port. If the reader fell a whole
+ * ring behind, the oldest bytes are gone and counted as overruns.
  */
 static int uart_receive(struct uart_port_config *port, u8 *buffer, size_t max_len)
 {
-    size_t received = 0;
+    struct uart_ring *r;
+    u32 head, tail, off, n, first;
     
     if (!port || !buffer || max_len == 0) {
         return -EINVAL;
     }
+    if (!READ_ONCE(port->ops)) {
+        return -ENODEV;
+    }
+    r = &port->rx;
+    
+    head = smp_load_acquire(&r->head);
+    tail = r->tail;
+    if (head - tail > UART_RX_RING_SIZE) {
+        port->rx_overruns += head - tail - UART_RX_RING_SIZE;
+        port->error_count++;
+        tail = head - UART_RX_RING_SIZE;
+    }
+    
+    n = min_t(size_t, max_len, head - tail);
+    if (n) {
+        off = tail & (UART_RX_RING_SIZE - 1);
+        first = min_t(u32, n, UART_RX_RING_SIZE - off);
+        memcpy(buffer, &r->buf[off], first);
+        memcpy(buffer + first, r->buf, n - first);
+    }
+    smp_store_release(&r->tail, tail + n);
+    
+    atomic_add(n, &port->rx_count);
+    atomic_add(n, &global_uart_driver.total_bytes_rx);
     
-    // Simulate UART reception
-    // In real implementation, this would read from UART hardware registers
-    received = min(max_len, (size_t)64); // Simulate received data
+    pr_debug("UART port %d received %u bytes\n", port->port_id, n);
     
-    atomic_add(received, &port->rx_count);
-    atomic_add(received, &global_uart_driver.total_bytes_rx);
+    return n;
+}
+
+/**
+ * Receive, sleeping up to timeout_ms for the next burst if none is
+ * waiting
+ */
+static int uart_receive_timeout(struct uart_port_config *port, u8 *buffer, size_t max_len,
+                                unsigned int timeout_ms)
+{
+    long ret;
     
-    pr_debug("UART port %d received %zu bytes\n", port->port_id, received);
+    if (!port) {
+        return -EINVAL;
+    }
     
-    return received;
+    ret = wait_event_interruptible_timeout(port->rx_wait,
+                                           smp_load_acquire(&port->rx.head) != port->rx.tail ||
+                                           !READ_ONCE(port->ops),
+                                           msecs_to_jiffies(timeout_ms));
+    if (ret < 0) {
+        return ret;
+    }
+    return uart_receive(port, buffer, max_len);
 }
 
 /**
@@ -189,6 +444,11 @@ static int __init uart_protocol_init_module(void)
  */
 static void __exit uart_protocol_cleanup_module(void)
 {
+    int i;
+    
+    for (i = 0; i < global_uart_driver.active_ports; i++) {
+        uart_unregister_port(i);
+    }
     pr_info("UART Protocol unloaded\n");
 }
 
@@ -0,0 +1,36 @@
+/**
+ * UART port interface
+ *
+ * What a UART driver gives uart_protocol.c and calls back into it.
+ * Receive runs as circular DMA into a ring that never stops: the driver
+ * reports progress from its idle-line, half-transfer and
+ * transfer-complete interrupts with uart_rx_event(), which publishes
+ * whatever burst has arrived without copying it. Transmit is a second
+ * ring that writers append to and the DMA engine drains a contiguous
+ * run at a time, each finished run reported with uart_tx_done().
+ */
+
+#ifndef UART_PROTOCOL_H
+#define UART_PROTOCOL_H
+
+#include <linux/types.h>
+
+/*
+ * rx_dma_start hands back the circular buffer it set up, len bytes of
+ * DMA-coherent memory, and rx_dma_pos the offset the engine will write
+ * next. tx_dma_start sends len bytes from buf, mapping them itself.
+ * None of them may sleep except rx_dma_start and rx_dma_stop.
+ */
+struct uart_hw_ops {
+    u8 *(*rx_dma_start)(void *ctx, size_t len);
+    void (*rx_dma_stop)(void *ctx);
+    size_t (*rx_dma_pos)(void *ctx);
+    int (*tx_dma_start)(void *ctx, const u8 *buf, size_t len);
+};
+
+int uart_register_port(int port_id, const struct uart_hw_ops *ops, void *ctx);
+void uart_unregister_port(int port_id);
+void uart_rx_event(int port_id);
+void uart_tx_done(int port_id);
+
+#endif /* UART_PROTOCOL_H */
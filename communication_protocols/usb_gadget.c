@@ -13,11 +13,42 @@
 #include <linux/usb/gadget.h>
 #include <linux/errno.h>
 #include <linux/atomic.h>
+#include <linux/mm.h>
+#include <linux/scatterlist.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
 
-#define USB_GADGET_VERSION "3.0.0"
+#include "usb_gadget.h"
+
+#define USB_GADGET_VERSION "3.1.0"
 #define MAX_USB_FUNCTIONS 16
 #define MAX_USB_ENDPOINTS 8
 #define MAX_USB_DESCRIPTORS 32
+#define USB_GADGET_MAX_XFER (1024 * 1024)   // bytes per transfer from user memory
+
+typedef void (*usb_gadget_complete_t)(void *ctx, int status, u32 actual);
+
+struct usb_gadget_endpoint;
+
+// One ring slot: a preallocated request and what it was queued with
+struct usb_gadget_xfer {
+    struct usb_gadget_endpoint *endpoint;
+    struct usb_request *req;
+    bool done;                              // set by the request completion
+    int status;
+    u32 actual;
+    
+    // Pinned user memory, released when the slot is reaped
+    struct page **pages;
+    int npages;
+    bool dirty;
+    struct sg_table sgt;
+    
+    usb_gadget_complete_t complete;
+    void *ctx;
+};
 
 enum usb_gadget_function {
     USB_GADGET_FUNCTION_MASS_STORAGE = 0,
@@ -38,6 +69,17 @@ struct usb_gadget_endpoint {
     bool active;
     atomic_t transfer_count;
     u32 error_count;
+    
+    // Request ring, once a function driver has bound the endpoint
+    struct usb_ep *ep;
+    bool sg_supported;
+    spinlock_t ring_lock;
+    u32 head;                               // next slot to reserve
+    u32 tail;                               // next slot to reap, advanced by reap_work only
+    struct usb_gadget_xfer ring[USB_EP_RING_SIZE];
+    struct work_struct reap_work;
+    wait_queue_head_t ring_wait;
+    u64 bytes;
 };
 
 struct usb_gadget_function {
@@ -66,6 +108,8 @@ struct usb_gadget {
 
 static struct usb_gadget global_usb_gadget;
 
+static void usb_gadget_reap(struct work_struct *work);
+
 /**
  * Initialize USB Gadget
  */
@@ -106,6 +150,10 @@ static int usb_gadget_init(void)
             global_usb_gadget.functions[i].endpoints[j].active = false;
             atomic_set(&global_usb_gadget.functions[i].endpoints[j].transfer_count, 0);
             global_usb_gadget.functions[i].endpoints[j].error_count = 0;
+            global_usb_gadget.functions[i].endpoints[j].ep = NULL;
+            spin_lock_init(&global_usb_gadget.functions[i].endpoints[j].ring_lock);
+            INIT_WORK(&global_usb_gadget.functions[i].endpoints[j].reap_work, usb_gadget_reap);
+            init_waitqueue_head(&global_usb_gadget.functions[i].endpoints[j].ring_wait);
         }
     }
     
@@ -199,33 +247,343 @@ static int usb_gadget_add_endpoint(u32 function_id, u8 address, u8 direction, u8
     return i;
 }
 
+static struct usb_gadget_endpoint *usb_gadget_endpoint(u32 function_id, u32 endpoint_id)
+{
+    struct usb_gadget_function *func;
+    
+    if (function_id >= MAX_USB_FUNCTIONS || endpoint_id >= MAX_USB_ENDPOINTS) {
+        return NULL;
+    }
+    func = &global_usb_gadget.functions[function_id];
+    if (!func->active || !func->endpoints[endpoint_id].active) {
+        return NULL;
+    }
+    return &func->endpoints[endpoint_id];
+}
+
+static void usb_gadget_req_complete(struct usb_ep *ep, struct usb_request *req)
+{
+    struct usb_gadget_xfer *x = req->context;
+    
+    x->status = req->status;
+    x->actual = req->actual;
+    smp_store_release(&x->done, true);
+    queue_work(system_highpri_wq, &x->endpoint->reap_work);
+}
+
+/*
+ * Hand finished slots back in ring order: unpin user pages, which may
+ * sleep and so is not done from the request completion, then call the
+ * submitter's callback.
+ */
+static void usb_gadget_reap(struct work_struct *work)
+{
+    struct usb_gadget_endpoint *endpoint = container_of(work, struct usb_gadget_endpoint, reap_work);
+    struct usb_gadget_xfer *x;
+    
+    while (endpoint->tail != READ_ONCE(endpoint->head)) {
+        x = &endpoint->ring[endpoint->tail & (USB_EP_RING_SIZE - 1)];
+        if (!smp_load_acquire(&x->done)) {
+            break;
+        }
+        
+        if (x->npages) {
+            sg_free_table(&x->sgt);
+            unpin_user_pages_dirty_lock(x->pages, x->npages, x->dirty && !x->status);
+            kvfree(x->pages);
+            x->npages = 0;
+        }
+        
+        if (x->status) {
+            endpoint->error_count++;
+        } else {
+            endpoint->bytes += x->actual;
+            atomic_inc(&endpoint->transfer_count);
+            atomic_inc(&global_usb_gadget.total_transfers);
+        }
+        if (x->complete) {
+            x->complete(x->ctx, x->status, x->actual);
+        }
+        
+        smp_store_release(&endpoint->tail, endpoint->tail + 1);
+        wake_up(&endpoint->ring_wait);
+    }
+}
+
 /**
- * USB Gadget transfer
+ * Give an endpoint the function driver has enabled its request ring
  */
-static int usb_gadget_transfer(u32 function_id, u32 endpoint_id, const u8 *data, u32 len)
+int usb_gadget_bind_endpoint(u32 function_id, u32 endpoint_id, struct usb_ep *ep, bool sg_supported)
 {
-    if (function_id >= MAX_USB_FUNCTIONS || endpoint_id >= MAX_USB_ENDPOINTS || !data || len == 0) {
-        pr_err("Invalid USB Gadget transfer parameters\n");
+    struct usb_gadget_endpoint *endpoint = usb_gadget_endpoint(function_id, endpoint_id);
+    int i;
+    
+    if (!endpoint || !ep) {
         return -EINVAL;
     }
+    if (endpoint->ep) {
+        return -EBUSY;
+    }
     
-    struct usb_gadget_function *func = &global_usb_gadget.functions[function_id];
-    struct usb_gadget_endpoint *endpoint = &func->endpoints[endpoint_id];
+    for (i = 0; i < USB_EP_RING_SIZE; i++) {
+        endpoint->ring[i].req = usb_ep_alloc_request(ep, GFP_KERNEL);
+        if (!endpoint->ring[i].req) {
+            while (--i >= 0) {
+                usb_ep_free_request(ep, endpoint->ring[i].req);
+            }
+            return -ENOMEM;
+        }
+        endpoint->ring[i].req->complete = usb_gadget_req_complete;
+        endpoint->ring[i].req->context = &endpoint->ring[i];
+        endpoint->ring[i].endpoint = endpoint;
+        endpoint->ring[i].npages = 0;
+    }
+    
+    endpoint->head = 0;
+    endpoint->tail = 0;
+    endpoint->bytes = 0;
+    endpoint->sg_supported = sg_supported;
+    WRITE_ONCE(endpoint->ep, ep);
+    
+    pr_info("USB Gadget endpoint 0x%x bound: %d requests, sg=%s\n",
+            endpoint->address, USB_EP_RING_SIZE, sg_supported ? "yes" : "no");
+    return 0;
+}
+EXPORT_SYMBOL_GPL(usb_gadget_bind_endpoint);
+
+/**
+ * Cancel whatever is in flight and free the ring, once the function
+ * has stopped submitting. The callbacks of cancelled transfers run
+ * with -ECONNRESET before this returns.
+ */
+void usb_gadget_unbind_endpoint(u32 function_id, u32 endpoint_id)
+{
+    struct usb_gadget_endpoint *endpoint = usb_gadget_endpoint(function_id, endpoint_id);
+    struct usb_ep *ep;
+    unsigned long flags;
+    u32 i;
+    
+    if (!endpoint || !endpoint->ep) {
+        return;
+    }
+    
+    spin_lock_irqsave(&endpoint->ring_lock, flags);
+    ep = endpoint->ep;
+    WRITE_ONCE(endpoint->ep, NULL);
+    spin_unlock_irqrestore(&endpoint->ring_lock, flags);
+    
+    for (i = endpoint->tail; i != endpoint->head; i++) {
+        usb_ep_dequeue(ep, endpoint->ring[i & (USB_EP_RING_SIZE - 1)].req);
+    }
+    wait_event(endpoint->ring_wait, smp_load_acquire(&endpoint->tail) == READ_ONCE(endpoint->head));
+    flush_work(&endpoint->reap_work);
+    
+    for (i = 0; i < USB_EP_RING_SIZE; i++) {
+        usb_ep_free_request(ep, endpoint->ring[i].req);
+        endpoint->ring[i].req = NULL;
+    }
+}
+EXPORT_SYMBOL_GPL(usb_gadget_unbind_endpoint);
+
+// Take the next ring slot, -EAGAIN if all requests are in flight
+static struct usb_gadget_xfer *usb_gadget_reserve(struct usb_gadget_endpoint *endpoint)
+{
+    struct usb_gadget_xfer *x;
+    unsigned long flags;
+    
+    spin_lock_irqsave(&endpoint->ring_lock, flags);
+    if (!endpoint->ep) {
+        spin_unlock_irqrestore(&endpoint->ring_lock, flags);
+        return ERR_PTR(-ENODEV);
+    }
+    if (endpoint->head - smp_load_acquire(&endpoint->tail) == USB_EP_RING_SIZE) {
+        spin_unlock_irqrestore(&endpoint->ring_lock, flags);
+        return ERR_PTR(-EAGAIN);
+    }
+    x = &endpoint->ring[endpoint->head & (USB_EP_RING_SIZE - 1)];
+    x->done = false;
+    x->complete = NULL;
+    endpoint->head++;
+    spin_unlock_irqrestore(&endpoint->ring_lock, flags);
+    
+    return x;
+}
+
+/*
+ * Queue a reserved slot on the UDC. On failure the slot is retired
+ * without a callback and the error returned to the submitter.
+ */
+static int usb_gadget_fire(struct usb_gadget_endpoint *endpoint, struct usb_gadget_xfer *x,
+                           usb_gadget_complete_t complete, void *ctx)
+{
+    int ret;
+    
+    x->complete = complete;
+    x->ctx = ctx;
+    
+    ret = usb_ep_queue(endpoint->ep, x->req, GFP_KERNEL);
+    if (ret) {
+        x->complete = NULL;
+        x->status = ret;
+        smp_store_release(&x->done, true);
+        queue_work(system_highpri_wq, &endpoint->reap_work);
+    }
+    return ret;
+}
+
+// Retire a reserved slot that never reached the UDC
+static void usb_gadget_cancel(struct usb_gadget_endpoint *endpoint, struct usb_gadget_xfer *x, int err)
+{
+    x->status = err;
+    smp_store_release(&x->done, true);
+    queue_work(system_highpri_wq, &endpoint->reap_work);
+}
+
+/**
+ * Queue a bulk transfer over a scatterlist; sg must stay valid until
+ * complete() runs. Needs a UDC with scatter-gather support.
+ */
+static int usb_gadget_submit_sg(u32 function_id, u32 endpoint_id, struct scatterlist *sg, int nents,
+                                u32 len, usb_gadget_complete_t complete, void *ctx)
+{
+    struct usb_gadget_endpoint *endpoint = usb_gadget_endpoint(function_id, endpoint_id);
+    struct usb_gadget_xfer *x;
+    
+    if (!endpoint || !sg || nents <= 0 || len == 0 || !complete) {
+        return -EINVAL;
+    }
+    if (!endpoint->sg_supported) {
+        return -EOPNOTSUPP;
+    }
+    
+    x = usb_gadget_reserve(endpoint);
+    if (IS_ERR(x)) {
+        return PTR_ERR(x);
+    }
+    x->req->buf = NULL;
+    x->req->sg = sg;
+    x->req->num_sgs = nents;
+    x->req->length = len;
     
-    if (!func->active || !endpoint->active) {
-        pr_err("USB Gadget function or endpoint is not active\n");
+    return usb_gadget_fire(endpoint, x, complete, ctx);
+}
+
+/**
+ * Queue a bulk transfer straight from or into user memory: the pages
+ * are pinned and handed to the UDC as a scatterlist, without copying,
+ * and released before complete() runs. AIO-style submission for
+ * function drivers exposing an endpoint file.
+ */
+static int usb_gadget_submit_user(u32 function_id, u32 endpoint_id, void __user *buf, size_t len,
+                                  usb_gadget_complete_t complete, void *ctx)
+{
+    struct usb_gadget_endpoint *endpoint = usb_gadget_endpoint(function_id, endpoint_id);
+    unsigned long start = (unsigned long)buf;
+    unsigned int off = offset_in_page(start);
+    struct usb_gadget_xfer *x;
+    bool dev_to_host;
+    int n, pinned, ret;
+    
+    if (!endpoint || !buf || len == 0 || !complete) {
         return -EINVAL;
     }
+    if (len > USB_GADGET_MAX_XFER) {
+        return -EMSGSIZE;
+    }
+    if (!endpoint->sg_supported) {
+        return -EOPNOTSUPP;
+    }
+    dev_to_host = endpoint->address & USB_DIR_IN;
     
-    // Simulate USB transfer
-    pr_debug("USB Gadget transfer: function=%s, endpoint=0x%x, len=%d\n",
-             func->name, endpoint->address, len);
+    x = usb_gadget_reserve(endpoint);
+    if (IS_ERR(x)) {
+        return PTR_ERR(x);
+    }
     
-    atomic_inc(&endpoint->transfer_count);
-    atomic_inc(&func->total_transfers);
-    atomic_inc(&global_usb_gadget.total_transfers);
+    n = DIV_ROUND_UP(off + len, PAGE_SIZE);
+    x->pages = kvmalloc_array(n, sizeof(*x->pages), GFP_KERNEL);
+    if (!x->pages) {
+        ret = -ENOMEM;
+        goto cancel;
+    }
     
-    return 0;
+    // OUT transfers write into the pages
+    pinned = pin_user_pages_fast(start, n, dev_to_host ? 0 : FOLL_WRITE, x->pages);
+    if (pinned != n) {
+        if (pinned > 0) {
+            unpin_user_pages(x->pages, pinned);
+        }
+        ret = pinned < 0 ? pinned : -EFAULT;
+        goto free_pages;
+    }
+    
+    ret = sg_alloc_table_from_pages(&x->sgt, x->pages, n, off, len, GFP_KERNEL);
+    if (ret) {
+        unpin_user_pages(x->pages, n);
+        goto free_pages;
+    }
+    x->npages = n;
+    x->dirty = !dev_to_host;
+    
+    x->req->buf = NULL;
+    x->req->sg = x->sgt.sgl;
+    x->req->num_sgs = x->sgt.nents;
+    x->req->length = len;
+    
+    return usb_gadget_fire(endpoint, x, complete, ctx);
+    
+free_pages:
+    kvfree(x->pages);
+cancel:
+    usb_gadget_cancel(endpoint, x, ret);
+    return ret;
+}
+
+static void usb_gadget_sync_complete(void *ctx, int status, u32 actual)
+{
+    complete(ctx);
+}
+
+/**
+ * USB Gadget transfer: from a kernel buffer, sleeping until it is done.
+ * Other transfers on the endpoint stay queued meanwhile.
+ */
+static int usb_gadget_transfer(u32 function_id, u32 endpoint_id, const u8 *data, u32 len)
+{
+    struct usb_gadget_endpoint *endpoint = usb_gadget_endpoint(function_id, endpoint_id);
+    DECLARE_COMPLETION_ONSTACK(done);
+    struct usb_gadget_xfer *x;
+    int ret;
+    
+    if (!endpoint || !data || len == 0) {
+        pr_err("Invalid USB Gadget transfer parameters\n");
+        return -EINVAL;
+    }
+    
+    ret = wait_event_interruptible(endpoint->ring_wait,
+                                   !IS_ERR(x = usb_gadget_reserve(endpoint)) || PTR_ERR(x) != -EAGAIN);
+    if (ret) {
+        return ret;
+    }
+    if (IS_ERR(x)) {
+        return PTR_ERR(x);
+    }
+    
+    x->req->buf = (void *)data;
+    x->req->sg = NULL;
+    x->req->num_sgs = 0;
+    x->req->length = len;
+    
+    ret = usb_gadget_fire(endpoint, x, usb_gadget_sync_complete, &done);
+    if (ret) {
+        return ret;
+    }
+    wait_for_completion(&done);
+    
+    pr_debug("USB Gadget transfer: endpoint=0x%x, len=%u, status=%d\n",
+             endpoint->address, x->actual, x->status);
+    
+    return x->status;
 }
 
 /**
@@ -0,0 +1,23 @@
+/**
+ * USB gadget endpoint rings
+ *
+ * What a function driver gives usb_gadget.c once its endpoints are
+ * claimed. Every bound endpoint gets a ring of preallocated requests,
+ * so up to USB_EP_RING_SIZE transfers are queued on the UDC at once and
+ * the controller never idles between them. Transfers come from kernel
+ * buffers, scatterlists or pinned user memory, and complete in order
+ * through a callback.
+ */
+
+#ifndef USB_GADGET_H
+#define USB_GADGET_H
+
+#include <linux/types.h>
+#include <linux/usb/gadget.h>
+
+#define USB_EP_RING_SIZE 16                 // requests in flight per endpoint, power of two
+
+int usb_gadget_bind_endpoint(u32 function_id, u32 endpoint_id, struct usb_ep *ep, bool sg_supported);
+void usb_gadget_unbind_endpoint(u32 function_id, u32 endpoint_id);
+
+#endif /* USB_GADGET_H */
@@ -4,12 +4,680 @@
  * Created: 2025-01-12
  * 
  * Implementation for embedded systems
+ *
+ * Symbolizes addresses against the ELF images loaded with
+ * elf_sym_load(). Only the ELF and section headers, the build ID note,
+ * and the symbol and string tables are read from an image. The symbols
+ * go into an address table sorted by start, which is binary-searched,
+ * and an open-addressed hash index by name. Both live in one blob with
+ * the string table, and the blob is written as-is to elf_sym_cache_dir
+ * under the image's build ID. Loading the same image again, or another
+ * copy with the same build ID, reads the index back in one read instead
+ * of parsing and sorting the symbol table.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/elf.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/sort.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/moduleparam.h>
 
-#define MODULE_VERSION "1.0.0"
+#define MODULE_VERSION "1.1.0"
+
+#define ELF_SYM_BUILD_ID_MAX 20
+#define ELF_SYM_CACHE_MAGIC 0x43595345      // "ESYC"
+#define ELF_SYM_CACHE_VERSION 1
+#define ELF_SYM_MAX_SECTIONS 4096
+#define ELF_SYM_NOTE_MAX 4096
+#define ELF_SYM_OVERLAP_SCAN 8              // earlier symbols checked for nesting
+
+/* One symbol; names are offsets into the image's string table */
+struct elf_sym_entry {
+    u64 addr;
+    u32 size;
+    u32 name;
+};
+
+struct elf_sym_cache_hdr {
+    u32 magic;
+    u32 version;
+    u8 build_id[ELF_SYM_BUILD_ID_MAX];
+    u32 build_id_len;
+    u32 count;
+    u32 hash_size;
+    u32 strtab_size;
+};
+
+struct elf_sym_table {
+    struct list_head list;
+    char path[128];
+    u64 bias;                           // load address minus link address
+    u64 lo, hi;                         // link addresses covered
+    u8 build_id[ELF_SYM_BUILD_ID_MAX];
+    u32 build_id_len;
+    u32 count;
+    u32 hash_size;                      // power of two
+    void *blob;                         // entries, hash, strtab
+    size_t blob_size;
+    struct elf_sym_entry *entries;
+    u32 *hash;                          // entry index + 1, 0 for empty
+    const char *strtab;
+    u32 strtab_size;
+};
+
+/* Section header, whichever ELF class it came from */
+struct elf_sym_shdr {
+    u32 type;
+    u32 link;
+    u64 offset;
+    u64 size;
+    u64 entsize;
+};
+
+static LIST_HEAD(elf_sym_tables);
+static DEFINE_MUTEX(elf_sym_lock);
+
+static char *elf_sym_cache_dir;
+module_param(elf_sym_cache_dir, charp, 0644);
+MODULE_PARM_DESC(elf_sym_cache_dir, "Directory for symbol index caches, by build ID");
+
+static int elf_read_at(struct file *f, u64 offset, void *buf, size_t len)
+{
+    loff_t pos = offset;
+    ssize_t n;
+    
+    n = kernel_read(f, buf, len, &pos);
+    if (n < 0) {
+        return n;
+    }
+    
+    return n == len ? 0 : -ENOEXEC;
+}
+
+static void *elf_read_alloc(struct file *f, u64 offset, u64 len)
+{
+    void *buf;
+    
+    if (!len || len > INT_MAX) {
+        return NULL;
+    }
+    
+    buf = kvmalloc(len, GFP_KERNEL);
+    if (buf && elf_read_at(f, offset, buf, len)) {
+        kvfree(buf);
+        return NULL;
+    }
+    
+    return buf;
+}
+
+static int elf_read_shdrs(struct file *f, bool is64, struct elf_sym_shdr **out, u32 *count)
+{
+    struct elf_sym_shdr *sh;
+    u64 shoff;
+    u32 shnum, shentsize, i;
+    void *raw;
+    int ret;
+    
+    if (is64) {
+        Elf64_Ehdr eh;
+        
+        ret = elf_read_at(f, 0, &eh, sizeof(eh));
+        if (ret) {
+            return ret;
+        }
+        shoff = eh.e_shoff;
+        shnum = eh.e_shnum;
+        shentsize = eh.e_shentsize;
+        if (shentsize != sizeof(Elf64_Shdr)) {
+            return -ENOEXEC;
+        }
+    } else {
+        Elf32_Ehdr eh;
+        
+        ret = elf_read_at(f, 0, &eh, sizeof(eh));
+        if (ret) {
+            return ret;
+        }
+        shoff = eh.e_shoff;
+        shnum = eh.e_shnum;
+        shentsize = eh.e_shentsize;
+        if (shentsize != sizeof(Elf32_Shdr)) {
+            return -ENOEXEC;
+        }
+    }
+    
+    if (!shoff || !shnum || shnum > ELF_SYM_MAX_SECTIONS) {
+        return -ENOEXEC;
+    }
+    
+    raw = elf_read_alloc(f, shoff, (u64)shnum * shentsize);
+    sh = kcalloc(shnum, sizeof(*sh), GFP_KERNEL);
+    if (!raw || !sh) {
+        kvfree(raw);
+        kfree(sh);
+        return -ENOMEM;
+    }
+    
+    for (i = 0; i < shnum; i++) {
+        if (is64) {
+            Elf64_Shdr *s = (Elf64_Shdr *)raw + i;
+            
+            sh[i] = (struct elf_sym_shdr){ s->sh_type, s->sh_link, s->sh_offset, s->sh_size, s->sh_entsize };
+        } else {
+            Elf32_Shdr *s = (Elf32_Shdr *)raw + i;
+            
+            sh[i] = (struct elf_sym_shdr){ s->sh_type, s->sh_link, s->sh_offset, s->sh_size, s->sh_entsize };
+        }
+    }
+    
+    kvfree(raw);
+    *out = sh;
+    *count = shnum;
+    return 0;
+}
+
+/* NT_GNU_BUILD_ID from any note section, or 0 if there is none */
+static u32 elf_read_build_id(struct file *f, const struct elf_sym_shdr *sh, u32 shnum, u8 *id)
+{
+    struct elf64_note *nh;
+    u32 i, off, namesz, descsz;
+    u8 *note;
+    
+    for (i = 0; i < shnum; i++) {
+        if (sh[i].type != SHT_NOTE || sh[i].size > ELF_SYM_NOTE_MAX) {
+            continue;
+        }
+        note = elf_read_alloc(f, sh[i].offset, sh[i].size);
+        if (!note) {
+            continue;
+        }
+        
+        // Elf32 and Elf64 notes share the layout
+        for (off = 0; off + sizeof(*nh) <= sh[i].size; off += sizeof(*nh) + namesz + descsz) {
+            nh = (struct elf64_note *)(note + off);
+            namesz = ALIGN(nh->n_namesz, 4);
+            descsz = ALIGN(nh->n_descsz, 4);
+            if (off + sizeof(*nh) + namesz + descsz > sh[i].size) {
+                break;
+            }
+            if (nh->n_type == NT_GNU_BUILD_ID && nh->n_namesz == 4 &&
+                !memcmp(nh + 1, "GNU", 4) && nh->n_descsz &&
+                nh->n_descsz <= ELF_SYM_BUILD_ID_MAX) {
+                memcpy(id, (u8 *)(nh + 1) + namesz, nh->n_descsz);
+                descsz = nh->n_descsz;
+                kvfree(note);
+                return descsz;
+            }
+        }
+        kvfree(note);
+    }
+    
+    return 0;
+}
+
+static int elf_sym_cmp(const void *a, const void *b)
+{
+    const struct elf_sym_entry *x = a, *y = b;
+    
+    if (x->addr != y->addr) {
+        return x->addr < y->addr ? -1 : 1;
+    }
+    // Sized symbols first, so a label at a function's start loses
+    return x->size > y->size ? -1 : x->size < y->size;
+}
+
+static u32 elf_sym_name_hash(const char *name)
+{
+    return jhash(name, strlen(name), 0);
+}
+
+/* Lay the table out in one blob and point into it */
+static int elf_sym_alloc_blob(struct elf_sym_table *tbl, u32 count, u32 strtab_size)
+{
+    tbl->count = count;
+    tbl->hash_size = roundup_pow_of_two(max(2 * count, 16u));
+    tbl->strtab_size = strtab_size;
+    tbl->blob_size = (size_t)count * sizeof(struct elf_sym_entry) +
+                     (size_t)tbl->hash_size * sizeof(u32) + strtab_size;
+    
+    tbl->blob = kvzalloc(tbl->blob_size, GFP_KERNEL);
+    if (!tbl->blob) {
+        return -ENOMEM;
+    }
+    
+    tbl->entries = tbl->blob;
+    tbl->hash = (u32 *)(tbl->entries + count);
+    tbl->strtab = (const char *)(tbl->hash + tbl->hash_size);
+    return 0;
+}
+
+static void elf_sym_set_range(struct elf_sym_table *tbl)
+{
+    struct elf_sym_entry *last;
+    
+    if (!tbl->count) {
+        tbl->lo = tbl->hi = 0;
+        return;
+    }
+    last = &tbl->entries[tbl->count - 1];
+    tbl->lo = tbl->entries[0].addr;
+    tbl->hi = last->addr + max(last->size, 1u);
+}
+
+static int elf_sym_parse(struct file *f, bool is64, const struct elf_sym_shdr *sh, u32 shnum,
+                         struct elf_sym_table *tbl)
+{
+    const struct elf_sym_shdr *symsh = NULL, *strsh;
+    size_t entsize = is64 ? sizeof(Elf64_Sym) : sizeof(Elf32_Sym);
+    struct elf_sym_entry *entries = NULL, *e;
+    u32 i, n, nsyms, slot;
+    u8 *syms;
+    char *strtab;
+    int ret = 0;
+    
+    // The full symbol table if it was not stripped, else the dynamic one
+    for (i = 0; i < shnum; i++) {
+        if (sh[i].type == SHT_SYMTAB) {
+            symsh = &sh[i];
+            break;
+        }
+        if (sh[i].type == SHT_DYNSYM && !symsh) {
+            symsh = &sh[i];
+        }
+    }
+    if (!symsh || symsh->entsize != entsize || symsh->link >= shnum) {
+        return -ENOENT;
+    }
+    strsh = &sh[symsh->link];
+    if (strsh->type != SHT_STRTAB || !strsh->size || strsh->size > U32_MAX) {
+        return -ENOEXEC;
+    }
+    
+    nsyms = symsh->size / entsize;
+    syms = elf_read_alloc(f, symsh->offset, (u64)nsyms * entsize);
+    strtab = elf_read_alloc(f, strsh->offset, strsh->size);
+    entries = kvmalloc_array(max(nsyms, 1u), sizeof(*entries), GFP_KERNEL);
+    if (!syms || !strtab || !entries) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    strtab[strsh->size - 1] = '\0';
+    
+    for (i = 0, n = 0; i < nsyms; i++) {
+        u64 value, size;
+        u32 name;
+        u16 shndx;
+        u8 type;
+        
+        if (is64) {
+            Elf64_Sym *s = (Elf64_Sym *)syms + i;
+            
+            value = s->st_value;
+            size = s->st_size;
+            name = s->st_name;
+            shndx = s->st_shndx;
+            type = ELF64_ST_TYPE(s->st_info);
+        } else {
+            Elf32_Sym *s = (Elf32_Sym *)syms + i;
+            
+            value = s->st_value;
+            size = s->st_size;
+            name = s->st_name;
+            shndx = s->st_shndx;
+            type = ELF32_ST_TYPE(s->st_info);
+        }
+        
+        if (shndx == SHN_UNDEF || shndx >= SHN_LORESERVE || !name || name >= strsh->size ||
+            !strtab[name] || (type != STT_FUNC && type != STT_OBJECT && type != STT_NOTYPE)) {
+            continue;
+        }
+        
+        entries[n].addr = value;
+        entries[n].size = min_t(u64, size, U32_MAX);
+        entries[n].name = name;
+        n++;
+    }
+    
+    sort(entries, n, sizeof(*entries), elf_sym_cmp, NULL);
+    
+    // Unsized symbols (assembly labels) run to the next symbol
+    for (i = 0; i + 1 < n; i++) {
+        e = &entries[i];
+        if (!e->size) {
+            e->size = min_t(u64, entries[i + 1].addr - e->addr, U32_MAX);
+        }
+    }
+    
+    ret = elf_sym_alloc_blob(tbl, n, strsh->size);
+    if (ret) {
+        goto out;
+    }
+    memcpy(tbl->entries, entries, (size_t)n * sizeof(*entries));
+    memcpy((char *)tbl->strtab, strtab, strsh->size);
+    
+    for (i = 0; i < n; i++) {
+        slot = elf_sym_name_hash(tbl->strtab + tbl->entries[i].name) & (tbl->hash_size - 1);
+        while (tbl->hash[slot]) {
+            slot = (slot + 1) & (tbl->hash_size - 1);
+        }
+        tbl->hash[slot] = i + 1;
+    }
+    
+    elf_sym_set_range(tbl);
+    
+out:
+    kvfree(entries);
+    kvfree(strtab);
+    kvfree(syms);
+    return ret;
+}
+
+static void elf_sym_cache_path(const struct elf_sym_table *tbl, char *buf, size_t len)
+{
+    snprintf(buf, len, "%s/%*phN.symidx", elf_sym_cache_dir, tbl->build_id_len, tbl->build_id);
+}
+
+static int elf_sym_cache_load(struct elf_sym_table *tbl)
+{
+    struct elf_sym_cache_hdr hdr;
+    char path[256];
+    struct file *f;
+    int ret;
+    
+    elf_sym_cache_path(tbl, path, sizeof(path));
+    f = filp_open(path, O_RDONLY, 0);
+    if (IS_ERR(f)) {
+        return PTR_ERR(f);
+    }
+    
+    ret = elf_read_at(f, 0, &hdr, sizeof(hdr));
+    if (ret) {
+        goto out;
+    }
+    
+    if (hdr.magic != ELF_SYM_CACHE_MAGIC || hdr.version != ELF_SYM_CACHE_VERSION ||
+        hdr.build_id_len != tbl->build_id_len ||
+        memcmp(hdr.build_id, tbl->build_id, tbl->build_id_len) ||
+        !is_power_of_2(hdr.hash_size) || hdr.hash_size < hdr.count || !hdr.strtab_size) {
+        ret = -ESTALE;
+        goto out;
+    }
+    
+    // hash_size follows from count, so a mismatch means a corrupt file
+    ret = elf_sym_alloc_blob(tbl, hdr.count, hdr.strtab_size);
+    if (ret) {
+        goto out;
+    }
+    if (tbl->hash_size != hdr.hash_size) {
+        ret = -ESTALE;
+        goto out_free;
+    }
+    
+    ret = elf_read_at(f, sizeof(hdr), tbl->blob, tbl->blob_size);
+    if (ret || tbl->strtab[tbl->strtab_size - 1]) {
+        ret = -ESTALE;
+        goto out_free;
+    }
+    
+    elf_sym_set_range(tbl);
+    goto out;
+    
+out_free:
+    kvfree(tbl->blob);
+    tbl->blob = NULL;
+out:
+    filp_close(f, NULL);
+    return ret;
+}
+
+static void elf_sym_cache_save(const struct elf_sym_table *tbl)
+{
+    struct elf_sym_cache_hdr hdr = {
+        .magic = ELF_SYM_CACHE_MAGIC,
+        .version = ELF_SYM_CACHE_VERSION,
+        .build_id_len = tbl->build_id_len,
+        .count = tbl->count,
+        .hash_size = tbl->hash_size,
+        .strtab_size = tbl->strtab_size,
+    };
+    size_t entries = (size_t)tbl->count * sizeof(struct elf_sym_entry);
+    char path[256];
+    struct file *f;
+    loff_t pos = 0;
+    
+    memcpy(hdr.build_id, tbl->build_id, tbl->build_id_len);
+    
+    elf_sym_cache_path(tbl, path, sizeof(path));
+    f = filp_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (IS_ERR(f)) {
+        pr_warn("elf_symbols: cannot write cache %s: %ld\n", path, PTR_ERR(f));
+        return;
+    }
+    
+    kernel_write(f, &hdr, sizeof(hdr), &pos);
+    kernel_write(f, tbl->entries, entries, &pos);
+    kernel_write(f, tbl->hash, (size_t)tbl->hash_size * sizeof(u32), &pos);
+    kernel_write(f, tbl->strtab, tbl->strtab_size, &pos);
+    
+    filp_close(f, NULL);
+}
+
+/**
+ * Load the symbols of an ELF image loaded at bias from its link address
+ */
+struct elf_sym_table *elf_sym_load(const char *path, u64 bias)
+{
+    struct elf_sym_shdr *sh = NULL;
+    struct elf_sym_table *tbl;
+    unsigned char ident[EI_NIDENT];
+    struct file *f;
+    u32 shnum;
+    bool is64;
+    int ret;
+    
+    if (!path) {
+        return ERR_PTR(-EINVAL);
+    }
+    
+    tbl = kzalloc(sizeof(*tbl), GFP_KERNEL);
+    if (!tbl) {
+        return ERR_PTR(-ENOMEM);
+    }
+    strscpy(tbl->path, path, sizeof(tbl->path));
+    tbl->bias = bias;
+    
+    f = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+    if (IS_ERR(f)) {
+        kfree(tbl);
+        return ERR_CAST(f);
+    }
+    
+    ret = elf_read_at(f, 0, ident, sizeof(ident));
+    if (ret || memcmp(ident, ELFMAG, SELFMAG) || ident[EI_DATA] != ELFDATA2LSB ||
+        (ident[EI_CLASS] != ELFCLASS32 && ident[EI_CLASS] != ELFCLASS64)) {
+        ret = -ENOEXEC;                 // little-endian targets only
+        goto out;
+    }
+    is64 = ident[EI_CLASS] == ELFCLASS64;
+    
+    ret = elf_read_shdrs(f, is64, &sh, &shnum);
+    if (ret) {
+        goto out;
+    }
+    
+    tbl->build_id_len = elf_read_build_id(f, sh, shnum, tbl->build_id);
+    
+    if (elf_sym_cache_dir && tbl->build_id_len && !elf_sym_cache_load(tbl)) {
+        pr_info("elf_symbols: %s: %u symbols from cache\n", path, tbl->count);
+        goto out;
+    }
+    
+    ret = elf_sym_parse(f, is64, sh, shnum, tbl);
+    if (ret) {
+        goto out;
+    }
+    
+    if (elf_sym_cache_dir && tbl->build_id_len) {
+        elf_sym_cache_save(tbl);
+    }
+    
+    pr_info("elf_symbols: %s: %u symbols\n", path, tbl->count);
+    
+out:
+    kfree(sh);
+    filp_close(f, NULL);
+    
+    if (ret) {
+        kvfree(tbl->blob);
+        kfree(tbl);
+        return ERR_PTR(ret);
+    }
+    
+    mutex_lock(&elf_sym_lock);
+    list_add_tail(&tbl->list, &elf_sym_tables);
+    mutex_unlock(&elf_sym_lock);
+    
+    return tbl;
+}
+EXPORT_SYMBOL_GPL(elf_sym_load);
+
+/**
+ * Drop an image's symbols
+ */
+void elf_sym_unload(struct elf_sym_table *tbl)
+{
+    if (IS_ERR_OR_NULL(tbl)) {
+        return;
+    }
+    
+    mutex_lock(&elf_sym_lock);
+    list_del(&tbl->list);
+    mutex_unlock(&elf_sym_lock);
+    
+    kvfree(tbl->blob);
+    kfree(tbl);
+}
+EXPORT_SYMBOL_GPL(elf_sym_unload);
+
+/* Innermost symbol covering a link address, or NULL */
+static const struct elf_sym_entry *elf_sym_find(const struct elf_sym_table *tbl, u64 addr)
+{
+    const struct elf_sym_entry *e;
+    u32 lo = 0, hi = tbl->count, i;
+    
+    // Last entry starting at or below addr
+    while (lo < hi) {
+        u32 mid = lo + (hi - lo) / 2;
+        
+        if (tbl->entries[mid].addr <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    
+    // A few back, for symbols nested inside a larger one
+    for (i = lo; i > 0 && lo - i < ELF_SYM_OVERLAP_SCAN; i--) {
+        e = &tbl->entries[i - 1];
+        if (addr - e->addr < max(e->size, 1u)) {
+            return e;
+        }
+    }
+    
+    return NULL;
+}
+
+/**
+ * Resolve a runtime address in one image to a symbol and offset
+ */
+const char *elf_sym_addr2name(const struct elf_sym_table *tbl, u64 addr, u64 *offset)
+{
+    const struct elf_sym_entry *e;
+    
+    if (!tbl || addr < tbl->bias) {
+        return NULL;
+    }
+    
+    e = elf_sym_find(tbl, addr - tbl->bias);
+    if (!e) {
+        return NULL;
+    }
+    
+    if (offset) {
+        *offset = addr - tbl->bias - e->addr;
+    }
+    return tbl->strtab + e->name;
+}
+EXPORT_SYMBOL_GPL(elf_sym_addr2name);
+
+/**
+ * Look a symbol up by name; returns its runtime address
+ */
+int elf_sym_name2addr(const struct elf_sym_table *tbl, const char *name, u64 *addr, u32 *size)
+{
+    u32 slot, idx;
+    
+    if (!tbl || !name || !addr || !tbl->count) {
+        return -EINVAL;
+    }
+    
+    slot = elf_sym_name_hash(name) & (tbl->hash_size - 1);
+    while ((idx = tbl->hash[slot])) {
+        const struct elf_sym_entry *e = &tbl->entries[idx - 1];
+        
+        if (!strcmp(tbl->strtab + e->name, name)) {
+            *addr = e->addr + tbl->bias;
+            if (size) {
+                *size = e->size;
+            }
+            return 0;
+        }
+        slot = (slot + 1) & (tbl->hash_size - 1);
+    }
+    
+    return -ENOENT;
+}
+EXPORT_SYMBOL_GPL(elf_sym_name2addr);
+
+/**
+ * Format an address as "symbol+0xoff [image]" across all loaded images
+ */
+int elf_sym_symbolize(u64 addr, char *buf, size_t len)
+{
+    struct elf_sym_table *tbl;
+    const char *name;
+    u64 offset;
+    int ret = -ENOENT;
+    
+    mutex_lock(&elf_sym_lock);
+    
+    list_for_each_entry(tbl, &elf_sym_tables, list) {
+        if (addr < tbl->lo + tbl->bias || addr >= tbl->hi + tbl->bias) {
+            continue;
+        }
+        name = elf_sym_addr2name(tbl, addr, &offset);
+        if (name) {
+            ret = scnprintf(buf, len, "%s+0x%llx [%s]", name, offset, kbasename(tbl->path));
+            break;
+        }
+    }
+    
+    mutex_unlock(&elf_sym_lock);
+    
+    if (ret < 0) {
+        ret = scnprintf(buf, len, "0x%llx", addr);
+    }
+    return ret;
+}
+EXPORT_SYMBOL_GPL(elf_sym_symbolize);
 
 static int __init elf_symbols_init(void)
 {
@@ -19,6 +687,14 @@ static int __init elf_symbols_init(void)
 
 static void __exit elf_symbols_exit(void)
 {
+    struct elf_sym_table *tbl, *tmp;
+    
+    list_for_each_entry_safe(tbl, tmp, &elf_sym_tables, list) {
+        list_del(&tbl->list);
+        kvfree(tbl->blob);
+        kfree(tbl);
+    }
+    
     pr_info("elf_symbols: Exiting\n");
 }
 
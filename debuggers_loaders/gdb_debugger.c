@@ -5,6 +5,17 @@
  * 
  * Advanced GDB debugger with remote debugging
  * Research breakthrough: Real-time debugging capabilities
+ *
+ * gdb talks to the target through a remote serial protocol stub: bytes
+ * from the debug link go to gdb_rsp_input(), and replies go out through
+ * gdb_transport_write(), each one a single write together with its ack.
+ * The stub offers a 16 KiB PacketSize, binary X writes and no-ack mode,
+ * so a memory read or write moves up to 16 KiB per round trip and not
+ * a few hundred bytes. It serves the target's memory map through qXfer
+ * so gdb uses vFlash for flash. Contiguous vFlashWrite data is gathered
+ * and programmed in 64 KiB runs. Stops reach gdb through
+ * gdb_target_stopped(), as a stop reply in all-stop mode or as a %Stop
+ * notification in non-stop mode.
  */
 
 #include <linux/module.h>
@@ -14,12 +25,24 @@
 #include <linux/atomic.h>
 #include <linux/timer.h>
 #include <linux/workqueue.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
 
-#define GDB_VERSION "12.1"
+#define GDB_VERSION "12.2"
 #define GDB_MAX_BREAKPOINTS 64
 #define GDB_MAX_WATCHPOINTS 32
 #define GDB_MAX_THREADS 16
 #define GDB_DEBUG_TIMEOUT_MS 5000
+#define GDB_MAX_MEM_REGIONS 16
+#define GDB_RSP_PACKET_SIZE 0x4000
+#define GDB_RSP_TX_SIZE (GDB_RSP_PACKET_SIZE + 8)
+#define GDB_RSP_MEM_MAX ((GDB_RSP_PACKET_SIZE - 32) / 2)    // bytes per m reply
+#define GDB_FLASH_BUF_SIZE (64 * 1024)
+#define GDB_SIGTRAP 5
+#define GDB_ARM_CORE_REGS 16
+#define GDB_ARM_FPA_BYTES (8 * 12)
 
 enum gdb_breakpoint_type {
     GDB_BREAKPOINT_SOFTWARE = 0,
@@ -64,6 +87,67 @@ struct gdb_debugger {
 
 static struct gdb_debugger global_gdb_debugger;
 
+enum gdb_mem_type {
+    GDB_MEM_RAM = 0,
+    GDB_MEM_ROM = 1,
+    GDB_MEM_FLASH = 2
+};
+
+struct gdb_mem_region {
+    u32 start;
+    u32 length;
+    enum gdb_mem_type type;
+    u32 blocksize;                      // erase block, flash only
+};
+
+enum gdb_rx_state {
+    GDB_RX_IDLE = 0,
+    GDB_RX_DATA,
+    GDB_RX_CSUM1,
+    GDB_RX_CSUM2
+};
+
+struct gdb_rsp_state {
+    struct mutex lock;
+    enum gdb_rx_state rx_state;
+    u8 *rx;
+    size_t rx_len;
+    u8 rx_sum;
+    u8 rx_csum;
+    u8 *tx;                             // last reply, kept for '-' resends
+    size_t tx_len;
+    size_t tx_pkt;                      // where the packet starts, after any ack
+    u8 tx_sum;
+    u8 *scratch;
+    u8 *flash_buf;
+    u32 flash_addr;
+    u32 flash_len;
+    bool no_ack;
+    bool non_stop;
+    bool running;
+    bool notify_inflight;               // %Stop sent, vStopped not done yet
+    int g_thread;
+    spinlock_t stop_lock;
+    u32 stop_pending;                   // threads with an unreported stop
+    u8 stop_signal[GDB_MAX_THREADS];
+    struct work_struct stop_work;
+    struct gdb_mem_region regions[GDB_MAX_MEM_REGIONS];
+    int region_count;
+};
+
+static struct gdb_rsp_state gdb_rsp;
+
+/* Platform hooks */
+extern int gdb_transport_write(const u8 *data, size_t len);
+extern int gdb_target_halt(int thread_id);  // -1: all threads
+extern int gdb_flash_erase(u32 address, u32 length);
+extern int gdb_flash_write(u32 address, const u8 *data, u32 length);
+extern int gdb_flash_done(void);
+
+void gdb_target_stopped(int thread_id, u8 signal);
+static void gdb_rsp_next_stop(void);
+static void gdb_rsp_stop_work(struct work_struct *work);
+
 /**
  * Initialize GDB debugger
  */
@@ -302,6 +386,811 @@ static int gdb_write_memory(u32 address, const u8 *data, u32 size)
     return size;
 }
 
+/**
+ * Register a target memory region for the memory map
+ */
+static int gdb_add_memory_region(u32 start, u32 length, enum gdb_mem_type type, u32 blocksize)
+{
+    struct gdb_mem_region *region;
+    
+    if (!length || (type == GDB_MEM_FLASH && !blocksize)) {
+        return -EINVAL;
+    }
+    
+    mutex_lock(&gdb_rsp.lock);
+    
+    if (gdb_rsp.region_count >= GDB_MAX_MEM_REGIONS) {
+        mutex_unlock(&gdb_rsp.lock);
+        return -ENOSPC;
+    }
+    
+    region = &gdb_rsp.regions[gdb_rsp.region_count++];
+    region->start = start;
+    region->length = length;
+    region->type = type;
+    region->blocksize = blocksize;
+    
+    mutex_unlock(&gdb_rsp.lock);
+    
+    return 0;
+}
+
+static bool gdb_parse_hex(const char **p, const char *end, u32 *val)
+{
+    const char *s = *p;
+    u32 v = 0;
+    int d;
+    
+    while (s < end && (d = hex_to_bin(*s)) >= 0) {
+        v = (v << 4) | d;
+        s++;
+    }
+    if (s == *p) {
+        return false;
+    }
+    
+    *p = s;
+    *val = v;
+    return true;
+}
+
+/* "addr,len" followed by term (or the end of the packet if term is 0) */
+static bool gdb_parse_range(const char **p, const char *end, u32 *addr, u32 *len, char term)
+{
+    if (!gdb_parse_hex(p, end, addr) || *p >= end || **p != ',') {
+        return false;
+    }
+    (*p)++;
+    if (!gdb_parse_hex(p, end, len)) {
+        return false;
+    }
+    if (!term) {
+        return *p == end;
+    }
+    if (*p >= end || **p != term) {
+        return false;
+    }
+    (*p)++;
+    return true;
+}
+
+static void gdb_tx_begin(char lead)
+{
+    gdb_rsp.tx_len = 0;
+    
+    // The ack for the packet being answered goes out in the same write
+    if (lead == '$' && !gdb_rsp.no_ack) {
+        gdb_rsp.tx[gdb_rsp.tx_len++] = '+';
+    }
+    gdb_rsp.tx_pkt = gdb_rsp.tx_len;
+    gdb_rsp.tx[gdb_rsp.tx_len++] = lead;
+    gdb_rsp.tx_sum = 0;
+}
+
+static void gdb_tx_byte(u8 c)
+{
+    if (gdb_rsp.tx_len < GDB_RSP_TX_SIZE - 3) {
+        gdb_rsp.tx[gdb_rsp.tx_len++] = c;
+        gdb_rsp.tx_sum += c;
+    }
+}
+
+static void gdb_tx_str(const char *s)
+{
+    while (*s) {
+        gdb_tx_byte(*s++);
+    }
+}
+
+static __printf(1, 2) void gdb_tx_fmt(const char *fmt, ...)
+{
+    char buf[64];
+    va_list args;
+    
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    
+    gdb_tx_str(buf);
+}
+
+static void gdb_tx_hex(const u8 *data, u32 len)
+{
+    u32 i;
+    
+    for (i = 0; i < len; i++) {
+        gdb_tx_byte(hex_asc_hi(data[i]));
+        gdb_tx_byte(hex_asc_lo(data[i]));
+    }
+}
+
+static void gdb_tx_binary(const u8 *data, u32 len)
+{
+    u32 i;
+    
+    for (i = 0; i < len; i++) {
+        if (data[i] == '#' || data[i] == '$' || data[i] == '}' || data[i] == '*') {
+            gdb_tx_byte('}');
+            gdb_tx_byte(data[i] ^ 0x20);
+        } else {
+            gdb_tx_byte(data[i]);
+        }
+    }
+}
+
+static void gdb_tx_end(void)
+{
+    u8 sum = gdb_rsp.tx_sum;
+    
+    gdb_rsp.tx[gdb_rsp.tx_len++] = '#';
+    gdb_rsp.tx[gdb_rsp.tx_len++] = hex_asc_hi(sum);
+    gdb_rsp.tx[gdb_rsp.tx_len++] = hex_asc_lo(sum);
+    
+    gdb_transport_write(gdb_rsp.tx, gdb_rsp.tx_len);
+}
+
+static void gdb_reply(const char *s)
+{
+    gdb_tx_begin('$');
+    gdb_tx_str(s);
+    gdb_tx_end();
+}
+
+static void gdb_reply_error(int err)
+{
+    gdb_tx_begin('$');
+    gdb_tx_fmt("E%02x", min(-err, 0xff));
+    gdb_tx_end();
+}
+
+static int gdb_rsp_thread(void)
+{
+    int tid = gdb_rsp.g_thread > 0 ? gdb_rsp.g_thread - 1 : 0;
+    
+    return tid < GDB_MAX_THREADS ? tid : 0;
+}
+
+/* Stop reply for one thread; RSP thread IDs start at 1 */
+static void gdb_tx_stop(int thread_id, u8 signal)
+{
+    gdb_tx_fmt("T%02xthread:%x;", signal, thread_id + 1);
+}
+
+/*
+ * Registers in GDB's default ARM layout: r0-r15, eight FPA registers and
+ * fps, then cpsr. Only the ones the debugger tracks are non-zero.
+ */
+static void gdb_handle_read_regs(void)
+{
+    struct gdb_thread *thread = &global_gdb_debugger.threads[gdb_rsp_thread()];
+    __le32 regs[GDB_ARM_CORE_REGS] = { 0 };
+    __le32 cpsr = cpu_to_le32(thread->cpsr);
+    u8 fpa[GDB_ARM_FPA_BYTES] = { 0 };
+    
+    regs[13] = cpu_to_le32(thread->sp);
+    regs[14] = cpu_to_le32(thread->lr);
+    regs[15] = cpu_to_le32(thread->pc);
+    
+    gdb_tx_begin('$');
+    gdb_tx_hex((u8 *)regs, sizeof(regs));
+    gdb_tx_hex(fpa, sizeof(fpa));
+    gdb_tx_hex(fpa, 4);
+    gdb_tx_hex((u8 *)&cpsr, sizeof(cpsr));
+    gdb_tx_end();
+}
+
+static void gdb_handle_read_mem(const char *p, const char *end)
+{
+    u32 addr, len;
+    int ret;
+    
+    if (!gdb_parse_range(&p, end, &addr, &len, 0)) {
+        gdb_reply_error(-EINVAL);
+        return;
+    }
+    
+    // gdb sizes its requests to PacketSize, so one read fills one reply
+    len = min_t(u32, len, GDB_RSP_MEM_MAX);
+    ret = gdb_read_memory(addr, gdb_rsp.scratch, len);
+    if (ret < 0) {
+        gdb_reply_error(ret);
+        return;
+    }
+    
+    gdb_tx_begin('$');
+    gdb_tx_hex(gdb_rsp.scratch, ret);
+    gdb_tx_end();
+}
+
+static void gdb_handle_write_mem(const char *p, const char *end, bool binary)
+{
+    u32 addr, len, i;
+    int ret;
+    
+    if (!gdb_parse_range(&p, end, &addr, &len, ':')) {
+        gdb_reply_error(-EINVAL);
+        return;
+    }
+    
+    // X with zero length only probes for binary support
+    if (!len) {
+        gdb_reply("OK");
+        return;
+    }
+    
+    if (binary) {
+        if (end - p != len) {
+            gdb_reply_error(-EINVAL);
+            return;
+        }
+        ret = gdb_write_memory(addr, (const u8 *)p, len);
+    } else {
+        if (end - p != 2 * len || len > GDB_RSP_MEM_MAX) {
+            gdb_reply_error(-EINVAL);
+            return;
+        }
+        for (i = 0; i < len; i++) {
+            if (hex2bin(&gdb_rsp.scratch[i], p + 2 * i, 1)) {
+                gdb_reply_error(-EINVAL);
+                return;
+            }
+        }
+        ret = gdb_write_memory(addr, gdb_rsp.scratch, len);
+    }
+    
+    if (ret < 0) {
+        gdb_reply_error(ret);
+    } else {
+        gdb_reply("OK");
+    }
+}
+
+static int gdb_find_breakpoint(u32 address, enum gdb_breakpoint_type type)
+{
+    int i;
+    
+    for (i = 0; i < GDB_MAX_BREAKPOINTS; i++) {
+        if (global_gdb_debugger.breakpoints[i].active &&
+            global_gdb_debugger.breakpoints[i].address == address &&
+            global_gdb_debugger.breakpoints[i].type == type) {
+            return i;
+        }
+    }
+    
+    return -ENOENT;
+}
+
+/* Z/z: type 0 software, 1 hardware, 2-4 watchpoints */
+static void gdb_handle_breakpoint(const char *p, const char *end, bool insert)
+{
+    enum gdb_breakpoint_type type;
+    u32 kind, addr, len;
+    int ret;
+    
+    if (!gdb_parse_hex(&p, end, &kind) || kind > 4 || p >= end || *p++ != ',' ||
+        !gdb_parse_hex(&p, end, &addr) || p >= end || *p++ != ',' ||
+        !gdb_parse_hex(&p, end, &len)) {
+        gdb_reply_error(-EINVAL);
+        return;
+    }
+    
+    type = kind == 0 ? GDB_BREAKPOINT_SOFTWARE :
+           kind == 1 ? GDB_BREAKPOINT_HARDWARE : GDB_BREAKPOINT_WATCHPOINT;
+    
+    if (insert) {
+        ret = gdb_find_breakpoint(addr, type) >= 0 ? 0 : gdb_set_breakpoint(addr, type, NULL);
+    } else {
+        ret = gdb_find_breakpoint(addr, type);
+        if (ret >= 0) {
+            ret = gdb_remove_breakpoint(ret);
+        }
+    }
+    
+    if (ret < 0) {
+        gdb_reply_error(ret);
+    } else {
+        gdb_reply("OK");
+    }
+}
+
+static int gdb_memory_map(char *buf, size_t size)
+{
+    static const char * const names[] = { "ram", "rom", "flash" };
+    struct gdb_mem_region *region;
+    int len, i;
+    
+    len = scnprintf(buf, size,
+                    "<?xml version=\"1.0\"?>\n"
+                    "<!DOCTYPE memory-map PUBLIC \"+//IDN gnu.org//DTD GDB Memory Map V1.0//EN\" "
+                    "\"http://sourceware.org/gdb/gdb-memory-map.dtd\">\n<memory-map>\n");
+    
+    for (i = 0; i < gdb_rsp.region_count; i++) {
+        region = &gdb_rsp.regions[i];
+        len += scnprintf(buf + len, size - len, "<memory type=\"%s\" start=\"0x%x\" length=\"0x%x\"",
+                         names[region->type], region->start, region->length);
+        if (region->type == GDB_MEM_FLASH) {
+            len += scnprintf(buf + len, size - len,
+                             "><property name=\"blocksize\">0x%x</property></memory>\n",
+                             region->blocksize);
+        } else {
+            len += scnprintf(buf + len, size - len, "/>\n");
+        }
+    }
+    
+    len += scnprintf(buf + len, size - len, "</memory-map>\n");
+    
+    return len;
+}
+
+/* qXfer:memory-map:read::offset,length */
+static void gdb_handle_xfer_memory_map(const char *p, const char *end)
+{
+    u32 offset, len;
+    int total;
+    
+    if (!gdb_parse_range(&p, end, &offset, &len, 0)) {
+        gdb_reply_error(-EINVAL);
+        return;
+    }
+    
+    total = gdb_memory_map((char *)gdb_rsp.scratch, GDB_RSP_MEM_MAX);
+    
+    gdb_tx_begin('$');
+    if (offset >= total) {
+        gdb_tx_byte('l');
+    } else {
+        // Escaping can double the data, so only send what is sure to fit
+        len = min3(len, (u32)(total - offset), (u32)GDB_RSP_MEM_MAX / 2);
+        gdb_tx_byte(offset + len >= total ? 'l' : 'm');
+        gdb_tx_binary(gdb_rsp.scratch + offset, len);
+    }
+    gdb_tx_end();
+}
+
+static int gdb_flash_flush(void)
+{
+    int ret;
+    
+    if (!gdb_rsp.flash_len) {
+        return 0;
+    }
+    
+    ret = gdb_flash_write(gdb_rsp.flash_addr, gdb_rsp.flash_buf, gdb_rsp.flash_len);
+    gdb_rsp.flash_len = 0;
+    
+    return ret;
+}
+
+/*
+ * vFlashWrite:addr:data. gdb writes a flash image in PacketSize pieces;
+ * contiguous ones are gathered so the target programs whole runs of
+ * sectors at once instead of a page per packet.
+ */
+static void gdb_handle_flash_write(const char *p, const char *end)
+{
+    u32 addr, len;
+    int ret = 0;
+    
+    if (!gdb_parse_hex(&p, end, &addr) || p >= end || *p++ != ':') {
+        gdb_reply_error(-EINVAL);
+        return;
+    }
+    len = end - p;
+    
+    if (gdb_rsp.flash_len &&
+        (addr != gdb_rsp.flash_addr + gdb_rsp.flash_len ||
+         gdb_rsp.flash_len + len > GDB_FLASH_BUF_SIZE)) {
+        ret = gdb_flash_flush();
+    }
+    if (!ret && len > GDB_FLASH_BUF_SIZE) {
+        ret = gdb_flash_write(addr, (const u8 *)p, len);
+    } else if (!ret) {
+        if (!gdb_rsp.flash_len) {
+            gdb_rsp.flash_addr = addr;
+        }
+        memcpy(gdb_rsp.flash_buf + gdb_rsp.flash_len, p, len);
+        gdb_rsp.flash_len += len;
+    }
+    
+    if (ret < 0) {
+        gdb_reply("E.flash write failed");
+    } else {
+        gdb_reply("OK");
+    }
+}
+
+static void gdb_handle_flash(const char *p, const char *end)
+{
+    u32 addr, len;
+    int ret;
+    
+    if (end - p > 11 && !memcmp(p, "FlashErase:", 11)) {
+        p += 11;
+        if (!gdb_parse_range(&p, end, &addr, &len, 0)) {
+            gdb_reply_error(-EINVAL);
+            return;
+        }
+        ret = gdb_flash_flush();
+        if (!ret) {
+            ret = gdb_flash_erase(addr, len);
+        }
+        gdb_reply(ret < 0 ? "E.flash erase failed" : "OK");
+    } else if (end - p > 11 && !memcmp(p, "FlashWrite:", 11)) {
+        gdb_handle_flash_write(p + 11, end);
+    } else if (end - p == 9 && !memcmp(p, "FlashDone", 9)) {
+        ret = gdb_flash_flush();
+        if (!ret) {
+            ret = gdb_flash_done();
+        }
+        gdb_reply(ret < 0 ? "E.flash programming failed" : "OK");
+    } else {
+        gdb_reply("");
+    }
+}
+
+/* Resume threads: all of them, or in non-stop mode only tid */
+static void gdb_resume(int tid, bool step)
+{
+    int i;
+    
+    for (i = 0; i < GDB_MAX_THREADS; i++) {
+        if (!global_gdb_debugger.threads[i].active || (tid > 0 && i != tid - 1)) {
+            continue;
+        }
+        if (step && (tid > 0 || i == gdb_rsp_thread())) {
+            gdb_step_execution(i);
+            gdb_target_stopped(i, GDB_SIGTRAP);
+        } else if (!step) {
+            gdb_continue_execution(i);
+        }
+    }
+    
+    gdb_rsp.running = true;
+}
+
+/* vCont;action[:tid]... - one action applied to the threads named */
+static void gdb_handle_vcont(const char *p, const char *end)
+{
+    u32 tid = 0;
+    char action;
+    
+    if (p < end && *p == '?') {
+        gdb_reply("vCont;c;C;s;S;t");
+        return;
+    }
+    
+    while (p < end && *p == ';') {
+        p++;
+        if (p >= end) {
+            break;
+        }
+        action = *p++;
+        if ((action == 'C' || action == 'S') && !gdb_parse_hex(&p, end, &tid)) {
+            break;
+        }
+        tid = 0;
+        if (p < end && *p == ':') {
+            p++;
+            if (p < end && *p == '-') {
+                p += 2;                 // -1: all threads
+            } else if (!gdb_parse_hex(&p, end, &tid)) {
+                break;
+            }
+        }
+        
+        if (action == 't') {
+            gdb_target_halt(tid ? tid - 1 : -1);
+        } else {
+            gdb_resume(tid, action == 's' || action == 'S');
+        }
+    }
+    
+    // Non-stop replies at once and reports stops as notifications
+    if (gdb_rsp.non_stop) {
+        gdb_reply("OK");
+    }
+}
+
+static void gdb_handle_query(const char *p, const char *end)
+{
+    bool first;
+    int i;
+    
+    if (end - p >= 10 && !memcmp(p, "qSupported", 10)) {
+        gdb_tx_begin('$');
+        gdb_tx_fmt("PacketSize=%x;QStartNoAckMode+;QNonStop+;qXfer:memory-map:read+;"
+                   "vContSupported+;swbreak+;hwbreak+", GDB_RSP_PACKET_SIZE);
+        gdb_tx_end();
+    } else if (end - p > 24 && !memcmp(p, "qXfer:memory-map:read::", 23)) {
+        gdb_handle_xfer_memory_map(p + 23, end);
+    } else if (end - p == 12 && (!memcmp(p, "qfThreadInfo", 12) || !memcmp(p, "qsThreadInfo", 12))) {
+        // The whole list fits the first reply
+        gdb_tx_begin('$');
+        if (p[1] == 's') {
+            gdb_tx_byte('l');
+        } else {
+            first = true;
+            for (i = 0; i < GDB_MAX_THREADS; i++) {
+                if (global_gdb_debugger.threads[i].active) {
+                    gdb_tx_fmt("%s%x", first ? "m" : ",", i + 1);
+                    first = false;
+                }
+            }
+            if (first) {
+                gdb_tx_byte('l');
+            }
+        }
+        gdb_tx_end();
+    } else if (end - p == 2 && !memcmp(p, "qC", 2)) {
+        gdb_tx_begin('$');
+        gdb_tx_fmt("QC%x", gdb_rsp_thread() + 1);
+        gdb_tx_end();
+    } else if (end - p == 9 && !memcmp(p, "qAttached", 9)) {
+        gdb_reply("1");
+    } else if (end - p == 15 && !memcmp(p, "QStartNoAckMode", 15)) {
+        gdb_reply("OK");
+        gdb_rsp.no_ack = true;          // from the next packet on
+    } else if (end - p == 10 && !memcmp(p, "QNonStop:", 9)) {
+        gdb_rsp.non_stop = p[9] == '1';
+        gdb_reply("OK");
+    } else {
+        gdb_reply("");
+    }
+}
+
+static void gdb_handle_packet(char *pkt, size_t len)
+{
+    const char *end = pkt + len;
+    u32 tid;
+    
+    switch (pkt[0]) {
+    case '?':
+        gdb_tx_begin('$');
+        if (gdb_rsp.non_stop && !gdb_rsp.running) {
+            gdb_tx_str("OK");
+        } else {
+            gdb_tx_stop(gdb_rsp_thread(), GDB_SIGTRAP);
+        }
+        gdb_tx_end();
+        break;
+    case 'g':
+        gdb_handle_read_regs();
+        break;
+    case 'm':
+        gdb_handle_read_mem(pkt + 1, end);
+        break;
+    case 'M':
+        gdb_handle_write_mem(pkt + 1, end, false);
+        break;
+    case 'X':
+        gdb_handle_write_mem(pkt + 1, end, true);
+        break;
+    case 'Z':
+    case 'z':
+        gdb_handle_breakpoint(pkt + 1, end, pkt[0] == 'Z');
+        break;
+    case 'H':
+        if (len >= 3 && pkt[2] == '-') {
+            gdb_rsp.g_thread = 0;
+        } else if (len >= 3) {
+            const char *p = pkt + 2;
+    
+            gdb_rsp.g_thread = gdb_parse_hex(&p, end, &tid) ? tid : 0;
+        }
+        gdb_reply("OK");
+        break;
+    case 'T': {
+        const char *p = pkt + 1;
+    
+        if (gdb_parse_hex(&p, end, &tid) && tid && tid <= GDB_MAX_THREADS &&
+            global_gdb_debugger.threads[tid - 1].active) {
+            gdb_reply("OK");
+        } else {
+            gdb_reply_error(-ESRCH);
+        }
+        break;
+    }
+    case 'c':
+        gdb_resume(0, false);
+        break;
+    case 's':
+        gdb_resume(0, true);
+        break;
+    case 'v':
+        if (len >= 5 && !memcmp(pkt, "vCont", 5)) {
+            gdb_handle_vcont(pkt + 5, end);
+        } else if (len >= 6 && !memcmp(pkt, "vFlash", 6)) {
+            gdb_handle_flash(pkt + 1, end);
+        } else if (len == 8 && !memcmp(pkt, "vStopped", 8)) {
+            gdb_rsp_next_stop();
+        } else {
+            gdb_reply("");
+        }
+        break;
+    case 'q':
+    case 'Q':
+        gdb_handle_query(pkt, end);
+        break;
+    case 'D':
+        gdb_reply("OK");
+        gdb_rsp.running = false;
+        break;
+    default:
+        gdb_reply("");
+        break;
+    }
+}
+
+/* Undo the RSP binary escape in place; text packets never contain it */
+static size_t gdb_unescape(u8 *buf, size_t len)
+{
+    size_t i, o = 0;
+    
+    for (i = 0; i < len; i++) {
+        if (buf[i] == '}' && i + 1 < len) {
+            buf[o++] = buf[++i] ^ 0x20;
+        } else {
+            buf[o++] = buf[i];
+        }
+    }
+    
+    return o;
+}
+
+/**
+ * Feed bytes received from the debug link into the stub
+ *
+ * Any number of bytes, including several packets at once; each packet
+ * is answered as soon as it is complete.
+ */
+int gdb_rsp_input(const u8 *data, size_t len)
+{
+    size_t i;
+    u8 c;
+    
+    mutex_lock(&gdb_rsp.lock);
+    
+    for (i = 0; i < len; i++) {
+        c = data[i];
+        
+        switch (gdb_rsp.rx_state) {
+        case GDB_RX_IDLE:
+            if (c == '$') {
+                gdb_rsp.rx_len = 0;
+                gdb_rsp.rx_sum = 0;
+                gdb_rsp.rx_state = GDB_RX_DATA;
+            } else if (c == 0x03) {
+                gdb_target_halt(-1);    // Ctrl-C
+            } else if (c == '-' && !gdb_rsp.no_ack && gdb_rsp.tx_len) {
+                gdb_transport_write(gdb_rsp.tx + gdb_rsp.tx_pkt, gdb_rsp.tx_len - gdb_rsp.tx_pkt);
+            }
+            break;
+        case GDB_RX_DATA:
+            if (c == '#') {
+                gdb_rsp.rx_state = GDB_RX_CSUM1;
+            } else if (gdb_rsp.rx_len < GDB_RSP_PACKET_SIZE) {
+                gdb_rsp.rx[gdb_rsp.rx_len++] = c;
+                gdb_rsp.rx_sum += c;
+            } else {
+                gdb_rsp.rx_state = GDB_RX_IDLE;   // overlong: drop, gdb resends
+            }
+            break;
+        case GDB_RX_CSUM1:
+            gdb_rsp.rx_csum = hex_to_bin(c) << 4;
+            gdb_rsp.rx_state = GDB_RX_CSUM2;
+            break;
+        case GDB_RX_CSUM2:
+            gdb_rsp.rx_csum |= hex_to_bin(c);
+            gdb_rsp.rx_state = GDB_RX_IDLE;
+            if (!gdb_rsp.no_ack && gdb_rsp.rx_csum != gdb_rsp.rx_sum) {
+                gdb_transport_write((const u8 *)"-", 1);
+                global_gdb_debugger.debug_errors++;
+                break;
+            }
+            if (gdb_rsp.rx_len) {
+                gdb_handle_packet((char *)gdb_rsp.rx, gdb_unescape(gdb_rsp.rx, gdb_rsp.rx_len));
+            }
+            break;
+        }
+    }
+    
+    mutex_unlock(&gdb_rsp.lock);
+    
+    return 0;
+}
+EXPORT_SYMBOL_GPL(gdb_rsp_input);
+
+/* Next queued stop, as the reply to vStopped; OK once there are none */
+static void gdb_rsp_next_stop(void)
+{
+    unsigned long flags;
+    int tid = -1;
+    u8 signal = 0;
+    
+    spin_lock_irqsave(&gdb_rsp.stop_lock, flags);
+    if (gdb_rsp.stop_pending) {
+        tid = __ffs(gdb_rsp.stop_pending);
+        signal = gdb_rsp.stop_signal[tid];
+        gdb_rsp.stop_pending &= ~BIT(tid);
+    }
+    spin_unlock_irqrestore(&gdb_rsp.stop_lock, flags);
+    
+    gdb_tx_begin('$');
+    if (tid < 0) {
+        gdb_tx_str("OK");
+        gdb_rsp.notify_inflight = false;
+    } else {
+        gdb_tx_stop(tid, signal);
+    }
+    gdb_tx_end();
+}
+
+static void gdb_rsp_stop_work(struct work_struct *work)
+{
+    unsigned long flags;
+    int tid = -1;
+    u8 signal = 0;
+    
+    mutex_lock(&gdb_rsp.lock);
+    
+    // In non-stop mode the rest are fetched with vStopped
+    if (gdb_rsp.notify_inflight || (!gdb_rsp.non_stop && !gdb_rsp.running)) {
+        goto out;
+    }
+    
+    spin_lock_irqsave(&gdb_rsp.stop_lock, flags);
+    if (gdb_rsp.stop_pending) {
+        tid = __ffs(gdb_rsp.stop_pending);
+        signal = gdb_rsp.stop_signal[tid];
+        gdb_rsp.stop_pending &= ~BIT(tid);
+        if (!gdb_rsp.non_stop) {
+            gdb_rsp.stop_pending = 0;   // all-stop: one stop stops everything
+        }
+    }
+    spin_unlock_irqrestore(&gdb_rsp.stop_lock, flags);
+    
+    if (tid < 0) {
+        goto out;
+    }
+    
+    if (gdb_rsp.non_stop) {
+        gdb_tx_begin('%');
+        gdb_tx_str("Stop:");
+        gdb_tx_stop(tid, signal);
+        gdb_tx_end();
+        gdb_rsp.notify_inflight = true;
+    } else {
+        gdb_tx_begin('$');
+        gdb_tx_stop(tid, signal);
+        gdb_tx_end();
+        gdb_rsp.running = false;
+    }
+    
+out:
+    mutex_unlock(&gdb_rsp.lock);
+}
+
+/**
+ * Report that a target thread stopped, from any context
+ */
+void gdb_target_stopped(int thread_id, u8 signal)
+{
+    unsigned long flags;
+    
+    if (thread_id < 0 || thread_id >= GDB_MAX_THREADS) {
+        return;
+    }
+    
+    spin_lock_irqsave(&gdb_rsp.stop_lock, flags);
+    gdb_rsp.stop_pending |= BIT(thread_id);
+    gdb_rsp.stop_signal[thread_id] = signal;
+    spin_unlock_irqrestore(&gdb_rsp.stop_lock, flags);
+    
+    atomic_inc(&global_gdb_debugger.total_breaks);
+    schedule_work(&gdb_rsp.stop_work);
+}
+EXPORT_SYMBOL_GPL(gdb_target_stopped);
+
 /**
  * Get GDB statistics
  */
@@ -338,6 +1227,22 @@ static int __init gdb_debugger_init_module(void)
         return ret;
     }
     
+    mutex_init(&gdb_rsp.lock);
+    spin_lock_init(&gdb_rsp.stop_lock);
+    INIT_WORK(&gdb_rsp.stop_work, gdb_rsp_stop_work);
+    
+    gdb_rsp.rx = kmalloc(GDB_RSP_PACKET_SIZE, GFP_KERNEL);
+    gdb_rsp.tx = kmalloc(GDB_RSP_TX_SIZE, GFP_KERNEL);
+    gdb_rsp.scratch = kmalloc(GDB_RSP_MEM_MAX, GFP_KERNEL);
+    gdb_rsp.flash_buf = kvmalloc(GDB_FLASH_BUF_SIZE, GFP_KERNEL);
+    if (!gdb_rsp.rx || !gdb_rsp.tx || !gdb_rsp.scratch || !gdb_rsp.flash_buf) {
+        kvfree(gdb_rsp.flash_buf);
+        kfree(gdb_rsp.scratch);
+        kfree(gdb_rsp.tx);
+        kfree(gdb_rsp.rx);
+        return -ENOMEM;
+    }
+    
     pr_info("GDB Debugger loaded successfully\n");
     return 0;
 }
@@ -352,6 +1257,12 @@ static void __exit gdb_debugger_cleanup_module(void)
         del_timer_sync(&global_gdb_debugger.debug_timer);
     }
     
+    cancel_work_sync(&gdb_rsp.stop_work);
+    kvfree(gdb_rsp.flash_buf);
+    kfree(gdb_rsp.scratch);
+    kfree(gdb_rsp.tx);
+    kfree(gdb_rsp.rx);
+    
     pr_info("GDB Debugger unloaded\n");
 }
 
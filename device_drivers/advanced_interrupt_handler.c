@@ -5,16 +5,56 @@
  * 
  * Advanced interrupt handling and coalescing algorithms
  * Research breakthrough: Novel interrupt optimization
+ *
+ * Interrupts are moderated per line in two ways. Under load they turn
+ * into polling: the handler masks the source and an irq_poll instance
+ * drains it with a budget, staying in polled mode while the budget is
+ * used up. Between bursts, the event rate measured over each window
+ * picks a moderation profile, a hold-off time and frame count, moving
+ * one step at a time and only once two windows agree; the hold-off is
+ * programmed into the device when it can coalesce, or else applied by
+ * keeping the source masked that long after a poll completes.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/interrupt.h>
 #include <linux/irq.h>
+#include <linux/irq_poll.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
 
-#define IRQ_HANDLER_VERSION "1.5.0"
+#include "advanced_interrupt_handler.h"
+
+#define IRQ_HANDLER_VERSION "1.6.0"
 #define MAX_IRQ_COUNT 256
-#define IRQ_COALESCING_THRESHOLD 10
+#define IRQ_COALESCING_THRESHOLD 10     // interrupts a window needs before it is judged
+#define IRQ_MOD_WINDOW_NS (4 * NSEC_PER_MSEC)
+
+struct irq_mod_profile {
+    u32 usecs;
+    u32 frames;
+    u32 up_rate;                        // events/s from which the next profile is wanted
+};
+
+// The last profile's up_rate is never reached
+static const struct irq_mod_profile irq_mod_profiles[] = {
+    { 0, 1, 10000 },
+    { 8, 4, 40000 },
+    { 16, 8, 100000 },
+    { 32, 16, 200000 },
+    { 64, 32, 400000 },
+    { 128, 64, U32_MAX },
+};
+
+#define IRQ_MOD_PROFILES ARRAY_SIZE(irq_mod_profiles)
+
+static int poll_budget = 64;
+module_param(poll_budget, int, 0444);
+MODULE_PARM_DESC(poll_budget, "Events a poll may process before yielding the softirq");
 
 struct interrupt_handler {
     int irq_number;
@@ -23,9 +63,24 @@ struct interrupt_handler {
     atomic_t interrupt_count;
     u64 total_processing_time;
     u32 coalescing_enabled;
+    
+    bool used;
+    const struct irq_mod_ops *ops;
+    void *ctx;
+    struct irq_poll iop;
+    struct hrtimer holdoff;             // software coalescing
+    u32 profile;
+    int pending_step;                   // step the previous window asked for
+    u64 window_start;
+    u32 window_irqs;
+    u64 window_events;
+    u64 events;
+    u64 polls;
+    u32 profile_changes;
 };
 
 static struct interrupt_handler irq_handlers[MAX_IRQ_COUNT];
+static DEFINE_MUTEX(irq_handlers_lock);
 
 /**
  * Initialize interrupt handler
@@ -36,26 +91,219 @@ static int irq_handler_init(struct interrupt_handler *handler, int irq_num)
     atomic_set(&handler->interrupt_count, 0);
     handler->total_processing_time = 0;
     handler->coalescing_enabled = 1;
+    handler->profile = 0;
+    handler->pending_step = 0;
+    handler->window_start = ktime_get_ns();
+    handler->window_irqs = 0;
+    handler->window_events = 0;
+    handler->events = 0;
+    handler->polls = 0;
+    handler->profile_changes = 0;
     
     return 0;
 }
 
+static void irq_mod_apply(struct interrupt_handler *handler)
+{
+    const struct irq_mod_profile *p = &irq_mod_profiles[handler->profile];
+    
+    if (handler->ops->set_coalesce) {
+        handler->ops->set_coalesce(handler->ctx, p->usecs, p->frames);
+    }
+}
+
 /**
  * Advanced interrupt coalescing
+ *
+ * At the end of a window, move the profile one step towards the one the
+ * measured event rate calls for, but only when the previous window asked
+ * for the same step. Returns 1 when the profile changed.
  */
 static int irq_coalescing_optimize(struct interrupt_handler *handler)
 {
-    // Advanced coalescing algorithm
-    // Research innovation: Novel interrupt optimization
+    u64 now = ktime_get_ns(), elapsed = now - handler->window_start;
+    u64 rate;
+    int step = 0;
+    
+    if (elapsed < IRQ_MOD_WINDOW_NS || handler->window_irqs < IRQ_COALESCING_THRESHOLD) {
+        // Unless the window has gone on so long that its quiet is a rate in itself
+        if (elapsed < 4 * IRQ_MOD_WINDOW_NS) {
+            return 0;
+        }
+    }
+    
+    rate = div64_u64(handler->window_events * NSEC_PER_SEC, elapsed);
+    if (handler->profile + 1 < IRQ_MOD_PROFILES && rate >= irq_mod_profiles[handler->profile].up_rate) {
+        step = 1;
+    } else if (handler->profile > 0 && rate < irq_mod_profiles[handler->profile - 1].up_rate / 2) {
+        step = -1;                      // half the rate that brought us here, not just under it
+    }
+    
+    handler->window_start = now;
+    handler->window_irqs = 0;
+    handler->window_events = 0;
+    
+    if (!step || step != handler->pending_step) {
+        handler->pending_step = step;
+        return 0;
+    }
+    
+    handler->pending_step = 0;
+    handler->profile += step;
+    handler->profile_changes++;
+    irq_mod_apply(handler);
+    pr_debug("IRQ %d: %llu events/s, moderation %u us / %u frames\n", handler->irq_number, rate,
+             irq_mod_profiles[handler->profile].usecs, irq_mod_profiles[handler->profile].frames);
+    return 1;
+}
+
+static enum hrtimer_restart irq_mod_holdoff_expired(struct hrtimer *timer)
+{
+    struct interrupt_handler *handler = container_of(timer, struct interrupt_handler, holdoff);
     
-    if (atomic_read(&handler->interrupt_count) > IRQ_COALESCING_THRESHOLD) {
-        // Process multiple interrupts together
-        return 1;
+    handler->ops->irq_enable(handler->ctx);
+    return HRTIMER_NORESTART;
+}
+
+static int irq_mod_poll(struct irq_poll *iop, int budget)
+{
+    struct interrupt_handler *handler = container_of(iop, struct interrupt_handler, iop);
+    u64 start = ktime_get_ns();
+    u32 usecs;
+    int done;
+    
+    done = handler->ops->poll(handler->ctx, budget);
+    handler->total_processing_time += ktime_get_ns() - start;
+    handler->events += done;
+    handler->window_events += done;
+    handler->polls++;
+    
+    // A full budget means more is waiting: stay polled, the softirq comes back
+    if (done >= budget) {
+        return budget;
     }
     
+    irq_poll_complete(iop);
+    irq_coalescing_optimize(handler);
+    
+    // Without hardware coalescing, hold the source masked for the hold-off instead
+    usecs = irq_mod_profiles[handler->profile].usecs;
+    if (usecs && !handler->ops->set_coalesce && handler->coalescing_enabled) {
+        hrtimer_start(&handler->holdoff, us_to_ktime(usecs), HRTIMER_MODE_REL_HARD);
+    } else {
+        handler->ops->irq_enable(handler->ctx);
+    }
+    return done;
+}
+
+static irqreturn_t irq_mod_interrupt(int irq, void *data)
+{
+    struct interrupt_handler *handler = data;
+    
+    atomic_inc(&handler->interrupt_count);
+    handler->window_irqs++;
+    handler->ops->irq_disable(handler->ctx);
+    irq_poll_sched(&handler->iop);
+    return IRQ_HANDLED;
+}
+
+static struct interrupt_handler *irq_mod_find(int irq)
+{
+    int i;
+    
+    for (i = 0; i < MAX_IRQ_COUNT; i++) {
+        if (irq_handlers[i].used && irq_handlers[i].irq_number == irq) {
+            return &irq_handlers[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Take over irq for a device: its events are processed through ops->poll
+ * under moderation from here on
+ */
+int irq_mod_register(int irq, unsigned long irqflags, const char *name, const struct irq_mod_ops *ops, void *ctx)
+{
+    struct interrupt_handler *handler = NULL;
+    int i, ret;
+    
+    if (!ops || !ops->poll || !ops->irq_disable || !ops->irq_enable || poll_budget <= 0) {
+        return -EINVAL;
+    }
+    
+    mutex_lock(&irq_handlers_lock);
+    if (irq_mod_find(irq)) {
+        ret = -EBUSY;
+        goto out;
+    }
+    for (i = 0; i < MAX_IRQ_COUNT && !handler; i++) {
+        if (!irq_handlers[i].used) {
+            handler = &irq_handlers[i];
+        }
+    }
+    if (!handler) {
+        ret = -ENOSPC;
+        goto out;
+    }
+    
+    irq_handler_init(handler, irq);
+    handler->handler = irq_mod_interrupt;
+    handler->flags = irqflags;
+    handler->ops = ops;
+    handler->ctx = ctx;
+    irq_poll_init(&handler->iop, poll_budget, irq_mod_poll);
+    hrtimer_init(&handler->holdoff, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+    handler->holdoff.function = irq_mod_holdoff_expired;
+    irq_mod_apply(handler);
+    
+    ret = request_irq(irq, irq_mod_interrupt, irqflags, name, handler);
+    if (ret) {
+        irq_poll_disable(&handler->iop);
+        goto out;
+    }
+    handler->used = true;
+    
+out:
+    mutex_unlock(&irq_handlers_lock);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(irq_mod_register);
+
+void irq_mod_unregister(int irq)
+{
+    struct interrupt_handler *handler;
+    
+    mutex_lock(&irq_handlers_lock);
+    handler = irq_mod_find(irq);
+    if (handler) {
+        // No interrupt, then no poll, then no hold-off can call the driver after this
+        free_irq(irq, handler);
+        irq_poll_disable(&handler->iop);
+        hrtimer_cancel(&handler->holdoff);
+        handler->used = false;
+        pr_info("IRQ %d: %d interrupts, %llu events in %llu polls, %u moderation changes\n", irq,
+                atomic_read(&handler->interrupt_count), handler->events, handler->polls,
+                handler->profile_changes);
+    }
+    mutex_unlock(&irq_handlers_lock);
+}
+EXPORT_SYMBOL_GPL(irq_mod_unregister);
+
+static int __init irq_handler_module_init(void)
+{
+    pr_info("Advanced Interrupt Handler v%s, poll budget %d\n", IRQ_HANDLER_VERSION, poll_budget);
     return 0;
 }
 
+static void __exit irq_handler_module_exit(void)
+{
+    pr_info("Advanced Interrupt Handler unloaded\n");
+}
+
+module_init(irq_handler_module_init);
+module_exit(irq_handler_module_exit);
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("jk1806");
 MODULE_DESCRIPTION("Advanced Interrupt Handler");
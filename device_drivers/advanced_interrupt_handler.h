@@ -0,0 +1,37 @@
+/**
+ * Advanced interrupt handler interface
+ *
+ * What a driver gives advanced_interrupt_handler.c to have its interrupt
+ * moderated. The interrupt only masks the source and schedules a poll;
+ * events are then processed in softirq context up to a budget at a time
+ * and, while every poll uses its whole budget, polling carries on with
+ * the source left masked, so a storm costs one interrupt rather than one
+ * per event. Once a poll comes up short the source is unmasked again,
+ * after a hold-off that follows the measured event rate: none when
+ * events are sparse, up to a few hundred microseconds when they stream.
+ * Hardware that coalesces by itself is given the time and count instead.
+ */
+
+#ifndef ADVANCED_INTERRUPT_HANDLER_H
+#define ADVANCED_INTERRUPT_HANDLER_H
+
+#include <linux/types.h>
+
+/*
+ * poll processes up to budget events and returns how many it did, from
+ * softirq context. irq_disable and irq_enable mask and unmask the source
+ * in the device, from hard interrupt context; events arriving while it
+ * is masked must raise the interrupt once it is unmasked. set_coalesce
+ * is optional.
+ */
+struct irq_mod_ops {
+    int (*poll)(void *ctx, int budget);
+    void (*irq_disable)(void *ctx);
+    void (*irq_enable)(void *ctx);
+    int (*set_coalesce)(void *ctx, u32 usecs, u32 frames);
+};
+
+int irq_mod_register(int irq, unsigned long irqflags, const char *name, const struct irq_mod_ops *ops, void *ctx);
+void irq_mod_unregister(int irq);
+
+#endif /* ADVANCED_INTERRUPT_HANDLER_H */
@@ -5,6 +5,17 @@
  * 
  * Advanced zero-copy DMA engine with 40Gbps throughput
  * Research breakthrough: 99.9% efficiency achieved
+ *
+ * Transfers complete asynchronously: the DMA callback only queues the
+ * finished transfer, and a work item unmaps everything finished since it
+ * last ran in one go before telling the submitters. Small repeated
+ * transfers should use the pool instead: buffers mapped once at init, a
+ * pool per direction so every cache sync is the minimal one, and nothing
+ * to map, unmap or invalidate in the IOMMU per transfer.
+ *
+ * Callers that do not care which channel they get go through
+ * dma_dispatch(), which sends work to the least loaded channel and cuts
+ * long scatterlists into parts that run on several channels in parallel.
  */
 
 #include <linux/module.h>
@@ -16,11 +27,50 @@
 #include <linux/atomic.h>
 #include <linux/slab.h>
 #include <linux/errno.h>
+#include <linux/bitmap.h>
+#include <linux/llist.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/moduleparam.h>
 
-#define DMA_ENGINE_VERSION "2.1.0"
-#define MAX_DMA_CHANNELS 8
+#include "zero_copy_dma.h"
+
+#define DMA_ENGINE_VERSION "2.3.0"
+#define MAX_DMA_CHANNELS DMA_DISPATCH_CHANNELS
 #define DMA_BUFFER_SIZE 4096
 #define DMA_MAX_SG_ENTRIES 256
+#define DMA_MAX_INFLIGHT 128
+#define DMA_POOL_BUFS 32                // per direction and channel
+#define DMA_MAX_JOBS 256
+
+static int dma_split_bytes = 256 * 1024;
+module_param(dma_split_bytes, int, 0644);
+MODULE_PARM_DESC(dma_split_bytes, "Length from which a dispatched transfer is split across channels, 0 never");
+
+struct dma_engine;
+
+struct dma_pool_buf {
+    void *virt;
+    dma_addr_t dma;
+    enum dma_data_direction dir;
+    int index;
+};
+
+// An in-flight transfer, from a fixed table so submission never allocates
+struct dma_xfer {
+    struct dma_engine *engine;
+    struct llist_node done_node;
+    struct scatterlist *sg;             // NULL for a pool buffer
+    int nents;
+    struct dma_pool_buf *buf;
+    enum dma_data_direction dir;
+    size_t bytes;
+    int result;
+    dma_done_fn done;
+    void *param;
+};
 
 struct dma_engine {
     int channel_id;
@@ -33,12 +83,195 @@ struct dma_engine {
     struct dma_chan *chan;
     struct dma_async_tx_descriptor *tx_desc;
     dma_cookie_t cookie;
-    struct completion transfer_complete;
+    struct completion transfer_complete;    // active_transfers reached 0
+    
+    spinlock_t lock;                    // the free bitmaps
+    struct dma_xfer xfers[DMA_MAX_INFLIGHT];
+    DECLARE_BITMAP(xfer_used, DMA_MAX_INFLIGHT);
+    struct dma_pool_buf pool[2][DMA_POOL_BUFS];     // [0] to device, [1] from device
+    DECLARE_BITMAP(pool_used[2], DMA_POOL_BUFS);
+    struct llist_head completed;
+    struct work_struct complete_work;
+    u32 batches;
+    u32 max_depth;
 };
 
 static struct dma_engine dma_engines[MAX_DMA_CHANNELS];
 static int dma_engine_count = 0;
 
+static struct device *dma_engine_dev(struct dma_engine *engine)
+{
+    return engine->chan->device->dev;
+}
+
+static int dma_pool_index(enum dma_data_direction dir)
+{
+    return dir == DMA_FROM_DEVICE;
+}
+
+// Memory-side mapping direction for a slave transfer
+static enum dma_data_direction dma_map_dir(enum dma_transfer_direction dir)
+{
+    return dir == DMA_DEV_TO_MEM ? DMA_FROM_DEVICE : DMA_TO_DEVICE;
+}
+
+static void dma_pool_free(struct dma_engine *engine)
+{
+    struct dma_pool_buf *buf;
+    int d, i;
+    
+    for (d = 0; d < 2; d++) {
+        for (i = 0; i < DMA_POOL_BUFS; i++) {
+            buf = &engine->pool[d][i];
+            if (buf->virt) {
+                dma_unmap_single(dma_engine_dev(engine), buf->dma, DMA_BUFFER_SIZE, buf->dir);
+                kfree(buf->virt);
+                buf->virt = NULL;
+            }
+        }
+    }
+}
+
+// Map the pool buffers once, for the whole life of the channel
+static int dma_pool_init(struct dma_engine *engine)
+{
+    struct dma_pool_buf *buf;
+    int d, i;
+    
+    for (d = 0; d < 2; d++) {
+        for (i = 0; i < DMA_POOL_BUFS; i++) {
+            buf = &engine->pool[d][i];
+            buf->dir = d ? DMA_FROM_DEVICE : DMA_TO_DEVICE;
+            buf->index = i;
+            buf->virt = kmalloc(DMA_BUFFER_SIZE, GFP_KERNEL);
+            if (!buf->virt) {
+                goto fail;
+            }
+            buf->dma = dma_map_single(dma_engine_dev(engine), buf->virt, DMA_BUFFER_SIZE, buf->dir);
+            if (dma_mapping_error(dma_engine_dev(engine), buf->dma)) {
+                kfree(buf->virt);
+                buf->virt = NULL;
+                goto fail;
+            }
+        }
+        bitmap_zero(engine->pool_used[d], DMA_POOL_BUFS);
+    }
+    return 0;
+    
+fail:
+    dma_pool_free(engine);
+    return -ENOMEM;
+}
+
+static struct dma_xfer *dma_xfer_get(struct dma_engine *engine)
+{
+    unsigned long flags;
+    int i;
+    
+    spin_lock_irqsave(&engine->lock, flags);
+    i = find_first_zero_bit(engine->xfer_used, DMA_MAX_INFLIGHT);
+    if (i < DMA_MAX_INFLIGHT) {
+        __set_bit(i, engine->xfer_used);
+    }
+    spin_unlock_irqrestore(&engine->lock, flags);
+    
+    return i < DMA_MAX_INFLIGHT ? &engine->xfers[i] : NULL;
+}
+
+static void dma_xfer_put(struct dma_engine *engine, struct dma_xfer *xfer)
+{
+    unsigned long flags;
+    
+    spin_lock_irqsave(&engine->lock, flags);
+    __clear_bit(xfer - engine->xfers, engine->xfer_used);
+    spin_unlock_irqrestore(&engine->lock, flags);
+}
+
+// Give the memory back to the CPU and the transfer back to its submitter
+static void dma_xfer_finish(struct dma_engine *engine, struct dma_xfer *xfer)
+{
+    dma_done_fn done = xfer->done;
+    void *param = xfer->param;
+    int result = xfer->result;
+    
+    if (xfer->sg) {
+        dma_unmap_sg(dma_engine_dev(engine), xfer->sg, xfer->nents, xfer->dir);
+    } else {
+        dma_sync_single_for_cpu(dma_engine_dev(engine), xfer->buf->dma, xfer->bytes, xfer->dir);
+    }
+    
+    if (result) {
+        engine->error_count++;
+    } else {
+        engine->total_bytes_transferred += xfer->bytes;
+    }
+    dma_xfer_put(engine, xfer);
+    
+    if (done) {
+        done(param, result);
+    }
+    if (atomic_dec_and_test(&engine->active_transfers)) {
+        complete_all(&engine->transfer_complete);
+    }
+}
+
+// Everything finished since the last run is unmapped in one pass
+static void dma_complete_work(struct work_struct *work)
+{
+    struct dma_engine *engine = container_of(work, struct dma_engine, complete_work);
+    struct dma_xfer *xfer, *tmp;
+    struct llist_node *done;
+    
+    done = llist_reverse_order(llist_del_all(&engine->completed));
+    if (!done) {
+        return;
+    }
+    llist_for_each_entry_safe(xfer, tmp, done, done_node) {
+        dma_xfer_finish(engine, xfer);
+    }
+    engine->batches++;
+}
+
+// DMA completion, from the channel's tasklet: only queue it
+static void dma_transfer_callback(void *param, const struct dmaengine_result *result)
+{
+    struct dma_xfer *xfer = param;
+    struct dma_engine *engine = xfer->engine;
+    
+    xfer->result = result && result->result != DMA_TRANS_NOERROR ? -EIO : 0;
+    if (llist_add(&xfer->done_node, &engine->completed)) {
+        schedule_work(&engine->complete_work);
+    }
+}
+
+static int dma_submit(struct dma_engine *engine, struct dma_async_tx_descriptor *desc, struct dma_xfer *xfer)
+{
+    int depth;
+    
+    desc->callback = NULL;
+    desc->callback_result = dma_transfer_callback;
+    desc->callback_param = xfer;
+    
+    // Counted first so the callback never sees it go below zero
+    depth = atomic_inc_return(&engine->active_transfers);
+    if (depth == 1) {
+        reinit_completion(&engine->transfer_complete);
+    }
+    if (depth > engine->max_depth) {
+        engine->max_depth = depth;
+    }
+    engine->cookie = dmaengine_submit(desc);
+    if (dma_submit_error(engine->cookie)) {
+        atomic_dec(&engine->active_transfers);
+        return -EIO;
+    }
+    engine->tx_desc = desc;
+    
+    // Start DMA
+    dma_async_issue_pending(engine->chan);
+    return 0;
+}
+
 /**
  * Initialize DMA engine
  */
@@ -56,103 +289,460 @@ static int dma_engine_init(struct dma_engine *engine, int channel_id)
     atomic_set(&engine->active_transfers, 0);
     engine->total_bytes_transferred = 0;
     engine->error_count = 0;
-    
-    // Allocate DMA buffer
-    engine->virt_addr = dma_alloc_coherent(NULL, engine->buffer_size,
-                                         &engine->dma_addr, GFP_KERNEL);
-    if (!engine->virt_addr) {
-        pr_err("Failed to allocate DMA buffer for channel %d\n", channel_id);
-        return -ENOMEM;
-    }
+    spin_lock_init(&engine->lock);
+    bitmap_zero(engine->xfer_used, DMA_MAX_INFLIGHT);
+    init_llist_head(&engine->completed);
+    INIT_WORK(&engine->complete_work, dma_complete_work);
+    engine->batches = 0;
+    engine->max_depth = 0;
+    init_completion(&engine->transfer_complete);
+    complete_all(&engine->transfer_complete);
     
     // Request DMA channel
     engine->chan = dma_request_chan(NULL, "dma_engine");
     if (IS_ERR(engine->chan)) {
         pr_err("Failed to request DMA channel for engine %d\n", channel_id);
-        dma_free_coherent(NULL, engine->buffer_size, engine->virt_addr, engine->dma_addr);
-        return PTR_ERR(engine->chan);
+        ret = PTR_ERR(engine->chan);
+        engine->chan = NULL;
+        return ret;
     }
     
-    init_completion(&engine->transfer_complete);
+    // Allocate DMA buffer, for the device that does the DMA
+    engine->virt_addr = dma_alloc_coherent(dma_engine_dev(engine), engine->buffer_size,
+                                         &engine->dma_addr, GFP_KERNEL);
+    if (!engine->virt_addr) {
+        pr_err("Failed to allocate DMA buffer for channel %d\n", channel_id);
+        ret = -ENOMEM;
+        goto err_chan;
+    }
+    
+    ret = dma_pool_init(engine);
+    if (ret) {
+        pr_err("Failed to map the buffer pool for channel %d\n", channel_id);
+        goto err_coherent;
+    }
     
     pr_info("DMA engine %d initialized successfully\n", channel_id);
     return 0;
+    
+err_coherent:
+    dma_free_coherent(dma_engine_dev(engine), engine->buffer_size, engine->virt_addr, engine->dma_addr);
+    engine->virt_addr = NULL;
+err_chan:
+    dma_release_channel(engine->chan);
+    engine->chan = NULL;
+    return ret;
 }
 
 /**
- * Zero-copy DMA transfer
+ * Zero-copy DMA transfer between the scatterlist and the channel's
+ * device, in direction dir; done is called from process context once
+ * the list is unmapped again, err 0 on success
  */
-static int dma_zero_copy_transfer(struct dma_engine *engine, 
-                                  struct scatterlist *sg, int nents)
+static int dma_zero_copy_transfer(struct dma_engine *engine,
+                                  struct scatterlist *sg, int nents,
+                                  enum dma_transfer_direction dir,
+                                  dma_done_fn done, void *param)
 {
-    dma_addr_t dma_addr;
-    int ret;
+    struct dma_async_tx_descriptor *desc;
+    struct scatterlist *s;
+    struct dma_xfer *xfer;
+    enum dma_data_direction map_dir = dma_map_dir(dir);
+    int mapped, i, ret;
     
-    if (!engine || !sg || nents <= 0) {
+    if (!engine || !sg || nents <= 0 || nents > DMA_MAX_SG_ENTRIES ||
+        (dir != DMA_MEM_TO_DEV && dir != DMA_DEV_TO_MEM)) {
         pr_err("Invalid parameters for DMA transfer\n");
         return -EINVAL;
     }
     
-    // Map scatter-gather list
-    dma_addr = dma_map_sg(engine->chan->device->dev, sg, nents, DMA_BIDIRECTIONAL);
-    if (!dma_addr) {
+    xfer = dma_xfer_get(engine);
+    if (!xfer) {
+        return -EBUSY;
+    }
+    
+    // Map scatter-gather list; entries may merge, the mapped count is what the channel gets
+    mapped = dma_map_sg(dma_engine_dev(engine), sg, nents, map_dir);
+    if (!mapped) {
         engine->error_count++;
         pr_err("Failed to map scatter-gather list\n");
-        return -ENOMEM;
+        ret = -ENOMEM;
+        goto err_xfer;
     }
     
     // Prepare DMA transaction
-    engine->tx_desc = dmaengine_prep_slave_sg(engine->chan, sg, nents,
-                                              DMA_MEM_TO_MEM, DMA_CTRL_ACK);
-    if (!engine->tx_desc) {
+    desc = dmaengine_prep_slave_sg(engine->chan, sg, mapped, dir, DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+    if (!desc) {
         pr_err("Failed to prepare DMA transaction\n");
-        dma_unmap_sg(engine->chan->device->dev, sg, nents, DMA_BIDIRECTIONAL);
-        return -EIO;
+        ret = -EIO;
+        goto err_unmap;
     }
     
-    // Set callback
-    engine->tx_desc->callback = NULL;
-    engine->tx_desc->callback_param = NULL;
+    xfer->engine = engine;
+    xfer->sg = sg;
+    xfer->nents = nents;
+    xfer->buf = NULL;
+    xfer->dir = map_dir;
+    xfer->bytes = 0;
+    for_each_sg(sg, s, mapped, i) {
+        xfer->bytes += sg_dma_len(s);
+    }
+    xfer->done = done;
+    xfer->param = param;
     
-    // Submit transaction
-    engine->cookie = dmaengine_submit(engine->tx_desc);
-    if (dma_submit_error(engine->cookie)) {
+    ret = dma_submit(engine, desc, xfer);
+    if (ret) {
         pr_err("Failed to submit DMA transaction\n");
-        dma_unmap_sg(engine->chan->device->dev, sg, nents, DMA_BIDIRECTIONAL);
-        return -EIO;
+        goto err_unmap;
     }
     
-    // Start DMA
-    dma_async_issue_pending(engine->chan);
+    pr_debug("DMA transfer started for engine %d, bytes: %zu\n",
+             engine->channel_id, xfer->bytes);
+    
+    return 0;
+    
+err_unmap:
+    dma_unmap_sg(dma_engine_dev(engine), sg, nents, map_dir);
+err_xfer:
+    dma_xfer_put(engine, xfer);
+    return ret;
+}
+
+/**
+ * Take a premapped buffer for data going in direction dir
+ * (DMA_TO_DEVICE or DMA_FROM_DEVICE); NULL when all are in use
+ */
+static struct dma_pool_buf *dma_buf_get(struct dma_engine *engine, enum dma_data_direction dir)
+{
+    int d = dma_pool_index(dir), i;
+    unsigned long flags;
     
-    atomic_inc(&engine->active_transfers);
-    engine->total_bytes_transferred += sg->length;
+    if (dir != DMA_TO_DEVICE && dir != DMA_FROM_DEVICE) {
+        return NULL;
+    }
+    
+    spin_lock_irqsave(&engine->lock, flags);
+    i = find_first_zero_bit(engine->pool_used[d], DMA_POOL_BUFS);
+    if (i < DMA_POOL_BUFS) {
+        __set_bit(i, engine->pool_used[d]);
+    }
+    spin_unlock_irqrestore(&engine->lock, flags);
     
-    pr_debug("DMA transfer started for engine %d, bytes: %u\n", 
-             engine->channel_id, sg->length);
+    return i < DMA_POOL_BUFS ? &engine->pool[d][i] : NULL;
+}
+
+static void dma_buf_put(struct dma_engine *engine, struct dma_pool_buf *buf)
+{
+    unsigned long flags;
     
+    spin_lock_irqsave(&engine->lock, flags);
+    __clear_bit(buf->index, engine->pool_used[dma_pool_index(buf->dir)]);
+    spin_unlock_irqrestore(&engine->lock, flags);
+}
+
+/**
+ * Transfer len bytes of a pool buffer, from it for a to-device buffer
+ * and into it otherwise; only the cache sync for len bytes is done per
+ * transfer. The buffer stays the caller's until dma_buf_put().
+ */
+static int dma_buf_transfer(struct dma_engine *engine, struct dma_pool_buf *buf, size_t len,
+                            dma_done_fn done, void *param)
+{
+    struct dma_async_tx_descriptor *desc;
+    struct dma_xfer *xfer;
+    int ret;
+    
+    if (!engine || !buf || !len || len > DMA_BUFFER_SIZE) {
+        return -EINVAL;
+    }
+    
+    xfer = dma_xfer_get(engine);
+    if (!xfer) {
+        return -EBUSY;
+    }
+    
+    dma_sync_single_for_device(dma_engine_dev(engine), buf->dma, len, buf->dir);
+    desc = dmaengine_prep_slave_single(engine->chan, buf->dma, len,
+                                       buf->dir == DMA_TO_DEVICE ? DMA_MEM_TO_DEV : DMA_DEV_TO_MEM,
+                                       DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+    if (!desc) {
+        ret = -EIO;
+        goto err_xfer;
+    }
+    
+    xfer->engine = engine;
+    xfer->sg = NULL;
+    xfer->nents = 0;
+    xfer->buf = buf;
+    xfer->dir = buf->dir;
+    xfer->bytes = len;
+    xfer->done = done;
+    xfer->param = param;
+    
+    ret = dma_submit(engine, desc, xfer);
+    if (ret) {
+        goto err_xfer;
+    }
     return 0;
+    
+err_xfer:
+    dma_xfer_put(engine, xfer);
+    return ret;
 }
 
+/*
+ * A dispatched job and its parts. The job holds one reference for the
+ * submitter and one per part handed to a channel, so it cannot finish
+ * while parts are still being cut.
+ */
+struct dma_job {
+    atomic_t refs;
+    int err;
+    dma_done_fn done;
+    void *param;
+};
+
+static struct dma_job dma_jobs[DMA_MAX_JOBS];
+static DECLARE_BITMAP(dma_jobs_used, DMA_MAX_JOBS);
+static DEFINE_SPINLOCK(dma_jobs_lock);
+static atomic_t dma_next_channel = ATOMIC_INIT(0);
+
+static atomic64_t dispatch_jobs = ATOMIC64_INIT(0);
+static atomic64_t dispatch_split_jobs = ATOMIC64_INIT(0);
+static atomic64_t dispatch_parts = ATOMIC64_INIT(0);
+static u64 stats_last_bytes;
+static u64 stats_last_ns;
+
+static struct dma_job *dma_job_get(void)
+{
+    unsigned long flags;
+    int i;
+    
+    spin_lock_irqsave(&dma_jobs_lock, flags);
+    i = find_first_zero_bit(dma_jobs_used, DMA_MAX_JOBS);
+    if (i < DMA_MAX_JOBS) {
+        __set_bit(i, dma_jobs_used);
+    }
+    spin_unlock_irqrestore(&dma_jobs_lock, flags);
+    
+    return i < DMA_MAX_JOBS ? &dma_jobs[i] : NULL;
+}
+
+static void dma_job_put(struct dma_job *job)
+{
+    dma_done_fn done = job->done;
+    void *param = job->param;
+    int err = job->err;
+    unsigned long flags;
+    
+    if (!atomic_dec_and_test(&job->refs)) {
+        return;
+    }
+    
+    spin_lock_irqsave(&dma_jobs_lock, flags);
+    __clear_bit(job - dma_jobs, dma_jobs_used);
+    spin_unlock_irqrestore(&dma_jobs_lock, flags);
+    
+    if (done) {
+        done(param, err);
+    }
+}
+
+static void dma_job_part_done(void *param, int err)
+{
+    struct dma_job *job = param;
+    
+    if (err) {
+        cmpxchg(&job->err, 0, err);     // the first error is the one reported
+    }
+    dma_job_put(job);
+}
+
+/*
+ * Start from a rotating channel so ties spread out instead of all
+ * landing on channel 0
+ */
+static struct dma_engine *dma_pick_engine(void)
+{
+    struct dma_engine *best = NULL;
+    int start, i, depth, best_depth = INT_MAX;
+    
+    if (!dma_engine_count) {
+        return NULL;
+    }
+    
+    start = (unsigned int)atomic_inc_return(&dma_next_channel) % dma_engine_count;
+    for (i = 0; i < dma_engine_count; i++) {
+        struct dma_engine *engine = &dma_engines[(start + i) % dma_engine_count];
+        
+        depth = atomic_read(&engine->active_transfers);
+        if (depth < best_depth) {
+            best = engine;
+            best_depth = depth;
+        }
+    }
+    return best;
+}
+
+// The least loaded channel first; the others when its transfer table is full
+static int dma_dispatch_part(struct dma_job *job, struct scatterlist *sg, int nents,
+                             enum dma_transfer_direction dir)
+{
+    struct dma_engine *engine = dma_pick_engine();
+    int i, ret;
+    
+    atomic_inc(&job->refs);
+    ret = dma_zero_copy_transfer(engine, sg, nents, dir, dma_job_part_done, job);
+    for (i = 0; ret == -EBUSY && i < dma_engine_count; i++) {
+        if (&dma_engines[i] != engine) {
+            ret = dma_zero_copy_transfer(&dma_engines[i], sg, nents, dir, dma_job_part_done, job);
+        }
+    }
+    if (ret) {
+        atomic_dec(&job->refs);         // never the last: the submitter holds one
+        return ret;
+    }
+    atomic64_inc(&dispatch_parts);
+    return 0;
+}
+
+/**
+ * Submit a scatterlist to the least loaded channels, split into parallel
+ * parts when it is at least dma_split_bytes long
+ */
+int dma_dispatch(struct scatterlist *sg, int nents, enum dma_transfer_direction dir,
+                 dma_done_fn done, void *param)
+{
+    struct scatterlist *s, *part = sg;
+    struct dma_job *job;
+    size_t total = 0, target, acc = 0, cut;
+    int parts = 1, part_n = 0, submitted = 0, i, ret = 0;
+    
+    if (!sg || nents <= 0) {
+        return -EINVAL;
+    }
+    
+    job = dma_job_get();
+    if (!job) {
+        return -EBUSY;
+    }
+    atomic_set(&job->refs, 1);
+    job->err = 0;
+    job->done = done;
+    job->param = param;
+    
+    for_each_sg(sg, s, nents, i) {
+        total += s->length;
+    }
+    if (dma_split_bytes > 0 && total >= dma_split_bytes) {
+        parts = min3((size_t)dma_engine_count, (size_t)nents, total / dma_split_bytes);
+        parts = max(parts, 1);
+    }
+    target = DIV_ROUND_UP(total, parts);
+    cut = target;
+    
+    // Cut at entry boundaries, once a part has its share or is as long as a channel takes
+    for_each_sg(sg, s, nents, i) {
+        acc += s->length;
+        part_n++;
+        if (i + 1 < nents && acc < cut && part_n < DMA_MAX_SG_ENTRIES) {
+            continue;
+        }
+        ret = dma_dispatch_part(job, part, part_n, dir);
+        if (ret) {
+            break;
+        }
+        submitted++;
+        part = sg_next(s);
+        part_n = 0;
+        while (cut <= acc) {
+            cut += target;
+        }
+    }
+    
+    if (ret) {
+        job->err = job->err ? job->err : ret;
+        if (!submitted) {
+            job->done = NULL;           // nothing in flight: the error is returned instead
+        }
+    }
+    atomic64_inc(&dispatch_jobs);
+    if (submitted > 1) {
+        atomic64_inc(&dispatch_split_jobs);
+    }
+    dma_job_put(job);
+    
+    return submitted ? 0 : ret;
+}
+EXPORT_SYMBOL_GPL(dma_dispatch);
+
+/**
+ * Aggregate statistics over all channels
+ */
+void dma_dispatch_get_stats(struct dma_dispatch_stats *stats)
+{
+    u64 now = ktime_get_ns();
+    unsigned long flags;
+    int i;
+    
+    memset(stats, 0, sizeof(*stats));
+    stats->jobs = atomic64_read(&dispatch_jobs);
+    stats->split_jobs = atomic64_read(&dispatch_split_jobs);
+    stats->parts = atomic64_read(&dispatch_parts);
+    stats->channels = dma_engine_count;
+    
+    for (i = 0; i < dma_engine_count; i++) {
+        struct dma_engine *engine = &dma_engines[i];
+        
+        stats->bytes += READ_ONCE(engine->total_bytes_transferred);
+        stats->errors += READ_ONCE(engine->error_count);
+        stats->channel_depth[i] = atomic_read(&engine->active_transfers);
+        stats->channel_max_depth[i] = READ_ONCE(engine->max_depth);
+        stats->queue_depth += stats->channel_depth[i];
+    }
+    
+    spin_lock_irqsave(&dma_jobs_lock, flags);
+    if (stats_last_ns && now > stats_last_ns) {
+        stats->bytes_per_sec = div64_u64((stats->bytes - stats_last_bytes) * NSEC_PER_SEC,
+                                         now - stats_last_ns);
+    }
+    stats_last_bytes = stats->bytes;
+    stats_last_ns = now;
+    spin_unlock_irqrestore(&dma_jobs_lock, flags);
+}
+EXPORT_SYMBOL_GPL(dma_dispatch_get_stats);
+
 /**
  * Cleanup DMA engine
  */
 static void dma_engine_cleanup(struct dma_engine *engine)
 {
+    struct dma_xfer *xfer;
+    int i;
+    
     if (!engine) {
         return;
     }
     
     if (engine->chan) {
+        // Callbacks of terminated descriptors never run: finish those by hand
+        dmaengine_terminate_sync(engine->chan);
+        flush_work(&engine->complete_work);
+        for_each_set_bit(i, engine->xfer_used, DMA_MAX_INFLIGHT) {
+            xfer = &engine->xfers[i];
+            xfer->result = -ECANCELED;
+            dma_xfer_finish(engine, xfer);
+        }
+        
+        dma_pool_free(engine);
+        if (engine->virt_addr) {
+            dma_free_coherent(dma_engine_dev(engine), engine->buffer_size,
+                              engine->virt_addr, engine->dma_addr);
+        }
         dma_release_channel(engine->chan);
     }
     
-    if (engine->virt_addr) {
-        dma_free_coherent(NULL, engine->buffer_size, 
-                          engine->virt_addr, engine->dma_addr);
-    }
-    
-    pr_info("DMA engine %d cleaned up\n", engine->channel_id);
+    pr_info("DMA engine %d cleaned up, %u completion batches\n", engine->channel_id, engine->batches);
 }
 
 /**
@@ -173,10 +763,10 @@ static int __init dma_engine_init_module(void)
         dma_engine_count++;
     }
     
-    pr_info("Zero-Copy DMA Engine loaded successfully with %d channels\n", 
+    pr_info("Zero-Copy DMA Engine loaded successfully with %d channels\n",
             dma_engine_count);
     return 0;
-
+    
 cleanup:
     for (i = 0; i < dma_engine_count; i++) {
         dma_engine_cleanup(&dma_engines[i]);
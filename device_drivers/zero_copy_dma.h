@@ -0,0 +1,42 @@
+/**
+ * Zero-copy DMA dispatcher interface
+ *
+ * Submissions go to whichever channel has the fewest transfers in flight,
+ * so one busy channel no longer holds up work the others could take.
+ * A scatterlist of at least the split size is cut at entry boundaries
+ * into parts of about equal length that run on separate channels at
+ * once; only use that for devices that accept parallel access, memory
+ * windows and the like, never a FIFO. done is called once, when every
+ * part has finished; normally from process context, but from within
+ * dma_dispatch() itself should the parts all finish before it returns.
+ */
+
+#ifndef ZERO_COPY_DMA_H
+#define ZERO_COPY_DMA_H
+
+#include <linux/types.h>
+#include <linux/dmaengine.h>
+#include <linux/scatterlist.h>
+
+#define DMA_DISPATCH_CHANNELS 8
+
+typedef void (*dma_done_fn)(void *param, int err);
+
+struct dma_dispatch_stats {
+    u64 jobs;
+    u64 split_jobs;
+    u64 parts;
+    u64 bytes;                          // completed, all channels
+    u64 bytes_per_sec;                  // since the previous call
+    u32 errors;
+    u32 channels;
+    u32 queue_depth;                    // transfers in flight now
+    u32 channel_depth[DMA_DISPATCH_CHANNELS];
+    u32 channel_max_depth[DMA_DISPATCH_CHANNELS];
+};
+
+int dma_dispatch(struct scatterlist *sg, int nents, enum dma_transfer_direction dir,
+                 dma_done_fn done, void *param);
+void dma_dispatch_get_stats(struct dma_dispatch_stats *stats);
+
+#endif /* ZERO_COPY_DMA_H */
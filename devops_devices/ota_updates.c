@@ -5,6 +5,33 @@
  * 
  * Advanced OTA update system with secure delivery
  * Research breakthrough: 99.9% update success rate
+ *
+ * Fleet campaigns: one package to up to ota_fleet_max devices, kept as
+ * 16-byte records indexed by device id rather than full ota_device
+ * entries. Devices fall into waves by a hash of their id, and a wave
+ * only opens once the one before it finished with a failure rate under
+ * ota_halt_permille; inside a wave at most max_inflight devices are
+ * updating at once, admitted as others finish. Chunks go one at a time
+ * per device and their size follows the link: doubled (up to 256 KiB)
+ * while sending the chunk takes less time than the link's latency, so
+ * the latency stops dominating, and halved when acks slow down well
+ * past it or time out. The transport calls back with
+ * ota_campaign_chunk_acked() and ota_campaign_device_done(); a 250 ms
+ * tick only admits devices and expires the ones that went quiet.
+ *
+ * On a gateway (ota_cache_mode=1) packages are cached by their hash, so
+ * the devices behind it fetch each package over the WAN once rather
+ * than once each; with ota_cache_mode=2 the cache also tracks which
+ * devices on the LAN already hold which parts, and offers them as the
+ * source. Either way every 1 KiB block is checked against the package
+ * manifest, the list of block SHA-256s whose own SHA-256 is the package
+ * hash, before it is stored or counted as held, so a cache or a peer
+ * can serve nothing the origin did not sign for.
+ *
+ * The origin goes through the same cache: ota_create_package() computes
+ * the manifest and hash from the package data and keeps the data as a
+ * cache entry of its own, never evicted, which campaign chunks are
+ * served from.
  */
 
 #include <linux/module.h>
@@ -15,13 +42,40 @@
 #include <linux/timer.h>
 #include <linux/workqueue.h>
 #include <linux/crypto.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/random.h>
+#include <linux/moduleparam.h>
+#include <linux/hashtable.h>
+#include <linux/bitmap.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <crypto/sha2.h>
+#include <linux/unaligned.h>
 
-#define OTA_VERSION "2.0.0"
+#define OTA_VERSION "2.2.0"
 #define MAX_OTA_DEVICES 1024
 #define MAX_OTA_PACKAGES 64
 #define MAX_OTA_CHUNKS 256
 #define OTA_UPDATE_TIMEOUT_MS 300000  // 5 minutes
 
+#define OTA_MAX_WAVES 8
+#define OTA_MAX_INFLIGHT 8192
+#define OTA_CHUNK_SHIFT_MIN 10              // 1 KiB
+#define OTA_CHUNK_SHIFT_INIT 12
+#define OTA_CHUNK_SHIFT_MAX 18              // 256 KiB
+#define OTA_CAMPAIGN_TICK_MS 250
+#define OTA_ADMIT_SCAN 16384                // records looked at per tick
+#define OTA_SEND_BATCH 64
+#define OTA_RTO_MIN_MS 1000
+#define OTA_RTO_MAX_MS 30000
+#define OTA_CHUNK_RETRIES 5
+
+#define OTA_CACHE_BLOCK 1024                // manifest granularity, as ota_create_package
+#define OTA_CACHE_HASH_BITS 6
+#define OTA_CACHE_MAX_PEERS 64
+
 enum ota_update_status {
     OTA_STATUS_IDLE = 0,
     OTA_STATUS_DOWNLOADING = 1,
@@ -54,6 +108,8 @@ struct ota_device {
     u32 max_retries;
 };
 
+struct ota_cache_entry;
+
 struct ota_package {
     u32 package_id;
     char name[128];
@@ -68,7 +124,8 @@ struct ota_package {
     u32 error_count;
     u64 timestamp;
     u8 signature[256];
-    u8 hash[32];
+    u8 hash[32];                        // SHA-256 of the manifest
+    struct ota_cache_entry *cache;      // the data, for serving chunks
 };
 
 struct ota_chunk {
@@ -102,6 +159,98 @@ struct ota_updates {
 
 static struct ota_updates global_ota_updates;
 
+/* Per-device campaign state, 16 bytes so a large fleet stays small */
+struct ota_fleet_rec {
+    u32 next_offset;                    // bytes acked
+    u32 sent_at;                        // jiffies of the outstanding chunk
+    u16 srtt_ms;
+    u16 min_rtt_ms;                     // the link's latency, roughly
+    u16 slot;                           // index in inflight[] while updating
+    u8 status : 4;                      // enum ota_update_status
+    u8 retries : 4;
+    u8 chunk_shift;
+};
+
+struct ota_campaign {
+    spinlock_t lock;
+    bool running;
+    u32 package_id;
+    u32 package_size;
+    u32 fleet_size;
+    struct ota_fleet_rec *recs;
+    u32 seed;                           // wave assignment, fixed per campaign
+    u16 wave_permille[OTA_MAX_WAVES];   // cumulative share of the fleet
+    int wave_count;
+    int wave;
+    u32 admit_cursor;
+    u32 wave_done;
+    u32 wave_failed;
+    u32 *inflight;
+    u32 inflight_count;
+    u32 max_inflight;
+    u32 completed;
+    u32 failed;
+    struct workqueue_struct *wq;
+    struct delayed_work tick;
+};
+
+static struct ota_campaign ota_campaign;
+
+static unsigned int ota_fleet_max = 262144;
+module_param(ota_fleet_max, uint, 0444);
+MODULE_PARM_DESC(ota_fleet_max, "Largest fleet a campaign can address");
+
+static unsigned int ota_target_rtt_ms = 2000;
+module_param(ota_target_rtt_ms, uint, 0644);
+MODULE_PARM_DESC(ota_target_rtt_ms, "Chunk round trip the chunk size is steered to");
+
+static unsigned int ota_halt_permille = 20;
+module_param(ota_halt_permille, uint, 0644);
+MODULE_PARM_DESC(ota_halt_permille, "Failures per 1000 in a wave that halt the campaign");
+
+/* A package held for the LAN, keyed by its hash */
+struct ota_cache_entry {
+    struct hlist_node node;
+    struct list_head lru;
+    u8 hash[SHA256_DIGEST_SIZE];
+    u32 size;
+    u32 blocks;
+    u8 (*manifest)[SHA256_DIGEST_SIZE]; // per-block SHA-256, from the origin
+    u8 *data;
+    unsigned long *have;                // verified blocks in data
+    u32 peers[OTA_CACHE_MAX_PEERS];
+    unsigned long *peer_have[OTA_CACHE_MAX_PEERS];
+    int peer_count;
+    u32 peer_rr;                        // spreads requests over the peers
+    bool origin;                        // a package of ours: complete, never evicted
+};
+
+static DEFINE_HASHTABLE(ota_cache, OTA_CACHE_HASH_BITS);
+static LIST_HEAD(ota_cache_lru);
+static DEFINE_MUTEX(ota_cache_lock);
+static size_t ota_cache_bytes;
+
+static unsigned int ota_cache_mode;
+module_param(ota_cache_mode, uint, 0644);
+MODULE_PARM_DESC(ota_cache_mode, "0: off, 1: gateway cache, 2: gateway cache and LAN peers");
+
+static unsigned int ota_cache_max_mb = 256;
+module_param(ota_cache_max_mb, uint, 0644);
+MODULE_PARM_DESC(ota_cache_max_mb, "Package data the gateway cache holds");
+
+static void ota_update_timer(struct timer_list *t);
+static void ota_campaign_tick(struct work_struct *work);
+
+/* Transport hook: queue one chunk for a device, without sleeping */
+extern int ota_transport_send_chunk(u32 device_id, u32 package_id, u32 offset,
+                                    const u8 *data, u32 len);
+
+static int ota_cache_add(const u8 *hash, u32 size, const u8 *manifest, u32 blocks,
+                         bool origin, struct ota_cache_entry **entry);
+static const u8 *ota_cache_span(const struct ota_cache_entry *e, u32 offset, u32 len);
+int ota_cache_fill(const u8 *hash, u32 offset, const u8 *data, u32 len);
+static void ota_cache_free(struct ota_cache_entry *e);
+
 /**
  * Initialize OTA updates
  */
@@ -121,6 +270,13 @@ static int ota_updates_init(void)
     global_ota_updates.ota_active = false;
     global_ota_updates.update_timeout_ms = OTA_UPDATE_TIMEOUT_MS;
     
+    spin_lock_init(&ota_campaign.lock);
+    INIT_DELAYED_WORK(&ota_campaign.tick, ota_campaign_tick);
+    ota_campaign.wq = alloc_ordered_workqueue("ota_campaign", 0);
+    if (!ota_campaign.wq) {
+        return -ENOMEM;
+    }
+    
     // Initialize devices
     for (i = 0; i < MAX_OTA_DEVICES; i++) {
         global_ota_updates.devices[i].device_id = i;
@@ -153,6 +309,7 @@ static int ota_updates_init(void)
         global_ota_updates.packages[i].timestamp = 0;
         memset(global_ota_updates.packages[i].signature, 0, sizeof(global_ota_updates.packages[i].signature));
         memset(global_ota_updates.packages[i].hash, 0, sizeof(global_ota_updates.packages[i].hash));
+        global_ota_updates.packages[i].cache = NULL;
     }
     
     // Initialize chunks
@@ -209,11 +366,16 @@ static int ota_register_device(u32 device_id, const char *device_name, const cha
 /**
  * Create OTA package
  */
-static int ota_create_package(const char *name, const char *version, enum ota_package_type type, u32 size_bytes)
+static int ota_create_package(const char *name, const char *version, enum ota_package_type type,
+                              const u8 *data, u32 size_bytes)
 {
-    int i;
+    u8 (*manifest)[SHA256_DIGEST_SIZE];
+    u8 hash[SHA256_DIGEST_SIZE];
+    struct ota_cache_entry *cache;
+    u32 blocks, b;
+    int i, ret;
     
-    if (!name || !version || size_bytes == 0) {
+    if (!name || !version || !data || size_bytes == 0) {
         pr_err("Invalid OTA package parameters\n");
         return -EINVAL;
     }
@@ -230,11 +392,39 @@ static int ota_create_package(const char *name, const char *version, enum ota_pa
         return -ENOMEM;
     }
     
+    // Manifest: the SHA-256 of every 1 KiB block; its own SHA-256 is the
+    // package hash
+    blocks = DIV_ROUND_UP(size_bytes, OTA_CACHE_BLOCK);
+    manifest = kvmalloc_array(blocks, SHA256_DIGEST_SIZE, GFP_KERNEL);
+    if (!manifest) {
+        return -ENOMEM;
+    }
+    for (b = 0; b < blocks; b++) {
+        sha256(data + b * OTA_CACHE_BLOCK,
+               min_t(u32, OTA_CACHE_BLOCK, size_bytes - b * OTA_CACHE_BLOCK), manifest[b]);
+    }
+    sha256((const u8 *)manifest, blocks * SHA256_DIGEST_SIZE, hash);
+    
+    ret = ota_cache_add(hash, size_bytes, (const u8 *)manifest, blocks, true, &cache);
+    kvfree(manifest);
+    if (!ret) {
+        ret = ota_cache_fill(hash, 0, data, size_bytes);
+        if (ret) {
+            mutex_lock(&ota_cache_lock);
+            ota_cache_free(cache);
+            mutex_unlock(&ota_cache_lock);
+        }
+    }
+    if (ret) {
+        pr_err("OTA package %s: cannot hold its data (%d)\n", name, ret);
+        return ret;
+    }
+    
     strcpy(global_ota_updates.packages[i].name, name);
     strcpy(global_ota_updates.packages[i].version, version);
     global_ota_updates.packages[i].type = type;
     global_ota_updates.packages[i].size_bytes = size_bytes;
-    global_ota_updates.packages[i].chunk_count = (size_bytes + 1023) / 1024; // 1KB chunks
+    global_ota_updates.packages[i].chunk_count = blocks;
     global_ota_updates.packages[i].downloaded_chunks = 0;
     global_ota_updates.packages[i].verified_chunks = 0;
     global_ota_updates.packages[i].installed_chunks = 0;
@@ -242,8 +432,8 @@ static int ota_create_package(const char *name, const char *version, enum ota_pa
     global_ota_updates.packages[i].error_count = 0;
     global_ota_updates.packages[i].timestamp = jiffies;
     
-    // Generate package hash
-    get_random_bytes(global_ota_updates.packages[i].hash, sizeof(global_ota_updates.packages[i].hash));
+    memcpy(global_ota_updates.packages[i].hash, hash, sizeof(hash));
+    global_ota_updates.packages[i].cache = cache;
     
     global_ota_updates.package_count++;
     
@@ -352,6 +542,722 @@ static void ota_update_timer(struct timer_list *t)
     global_ota_updates.ota_active = false;
 }
 
+/**
+ * Which wave a device belongs to
+ */
+static int ota_campaign_wave_of(u32 device_id)
+{
+    u32 bucket = hash_32(device_id ^ ota_campaign.seed, 32) % 1000;
+    int w;
+    
+    for (w = 0; w < ota_campaign.wave_count; w++) {
+        if (bucket < ota_campaign.wave_permille[w]) {
+            return w;
+        }
+    }
+    
+    return ota_campaign.wave_count - 1;
+}
+
+struct ota_send {
+    u32 device_id;
+    u32 offset;
+    u32 len;
+};
+
+/**
+ * Prepare the next chunk for a device; lock held
+ */
+static void ota_campaign_next_chunk(u32 device_id, struct ota_send *send)
+{
+    struct ota_fleet_rec *rec = &ota_campaign.recs[device_id];
+    
+    send->device_id = device_id;
+    send->offset = rec->next_offset;
+    send->len = min_t(u32, 1U << rec->chunk_shift, ota_campaign.package_size - rec->next_offset);
+    rec->sent_at = jiffies;
+}
+
+static void ota_campaign_send(const struct ota_send *send, int count)
+{
+    const struct ota_cache_entry *cache = global_ota_updates.packages[ota_campaign.package_id].cache;
+    const u8 *data;
+    int i;
+    
+    // A refused send is a lost chunk: the timeout resends it smaller
+    for (i = 0; i < count; i++) {
+        data = ota_cache_span(cache, send[i].offset, send[i].len);
+        if (data) {
+            ota_transport_send_chunk(send[i].device_id, ota_campaign.package_id,
+                                     send[i].offset, data, send[i].len);
+        }
+    }
+}
+
+/**
+ * A device stopped updating, one way or the other; lock held
+ */
+static void ota_campaign_release(u32 device_id, bool success)
+{
+    struct ota_fleet_rec *rec = &ota_campaign.recs[device_id];
+    u32 last = ota_campaign.inflight[--ota_campaign.inflight_count];
+    
+    ota_campaign.inflight[rec->slot] = last;
+    ota_campaign.recs[last].slot = rec->slot;
+    
+    rec->status = success ? OTA_STATUS_COMPLETED : OTA_STATUS_FAILED;
+    ota_campaign.wave_done++;
+    if (success) {
+        ota_campaign.completed++;
+        global_ota_updates.successful_updates++;
+    } else {
+        ota_campaign.wave_failed++;
+        ota_campaign.failed++;
+        global_ota_updates.failed_updates++;
+    }
+    atomic_inc(&global_ota_updates.total_updates);
+}
+
+static bool ota_campaign_active(u32 device_id)
+{
+    if (!ota_campaign.running || device_id >= ota_campaign.fleet_size) {
+        return false;
+    }
+    
+    return ota_campaign.recs[device_id].status == OTA_STATUS_DOWNLOADING ||
+           ota_campaign.recs[device_id].status == OTA_STATUS_INSTALLING;
+}
+
+/**
+ * The transport got a chunk to a device
+ */
+void ota_campaign_chunk_acked(u32 device_id, u32 offset, u32 len)
+{
+    struct ota_fleet_rec *rec;
+    struct ota_send send;
+    bool more = false;
+    u32 rtt;
+    
+    spin_lock_bh(&ota_campaign.lock);
+    if (!ota_campaign_active(device_id)) {
+        goto out;
+    }
+    rec = &ota_campaign.recs[device_id];
+    
+    // Only the outstanding chunk counts; a late ack for a resent one does not
+    if (rec->status != OTA_STATUS_DOWNLOADING || offset != rec->next_offset || !len) {
+        goto out;
+    }
+    
+    // An ack for a resent chunk could answer either send: no sample (Karn)
+    if (!rec->retries) {
+        rtt = min_t(u32, jiffies_to_msecs(jiffies - rec->sent_at), U16_MAX);
+        rec->srtt_ms = rec->srtt_ms ? (7 * rec->srtt_ms + rtt) / 8 : rtt;
+        
+        // Latency estimate: the fastest ack, let drift up so a slower route is learnt
+        if (!rec->min_rtt_ms || rtt < rec->min_rtt_ms) {
+            rec->min_rtt_ms = max_t(u32, rtt, 1);
+        } else {
+            rec->min_rtt_ms = min_t(u32, rec->min_rtt_ms + rec->min_rtt_ms / 16 + 1, rtt);
+        }
+        
+        // Grow while transfer time is under the latency; shrink when acks drag
+        if (rtt < max_t(u32, 2 * rec->min_rtt_ms, ota_target_rtt_ms / 2) &&
+            rec->chunk_shift < OTA_CHUNK_SHIFT_MAX) {
+            rec->chunk_shift++;
+        } else if (rtt > max_t(u32, 4 * rec->min_rtt_ms, ota_target_rtt_ms) &&
+                   rec->chunk_shift > OTA_CHUNK_SHIFT_MIN) {
+            rec->chunk_shift--;
+        }
+    }
+    rec->retries = 0;
+    rec->next_offset += len;
+    
+    if (rec->next_offset >= ota_campaign.package_size) {
+        // All there: the device verifies and installs, then reports
+        rec->status = OTA_STATUS_INSTALLING;
+        rec->sent_at = jiffies;
+    } else {
+        ota_campaign_next_chunk(device_id, &send);
+        more = true;
+    }
+    
+out:
+    spin_unlock_bh(&ota_campaign.lock);
+    if (more) {
+        ota_campaign_send(&send, 1);
+    }
+}
+EXPORT_SYMBOL_GPL(ota_campaign_chunk_acked);
+
+/**
+ * A device reported the result of installing the package
+ */
+void ota_campaign_device_done(u32 device_id, bool success)
+{
+    spin_lock_bh(&ota_campaign.lock);
+    if (ota_campaign_active(device_id)) {
+        ota_campaign_release(device_id, success);
+        mod_delayed_work(ota_campaign.wq, &ota_campaign.tick, 0);
+    }
+    spin_unlock_bh(&ota_campaign.lock);
+}
+EXPORT_SYMBOL_GPL(ota_campaign_device_done);
+
+/**
+ * Campaign tick: expire quiet devices, move the waves on, admit devices
+ */
+static void ota_campaign_tick(struct work_struct *work)
+{
+    struct ota_send send[OTA_SEND_BATCH];
+    int n = 0;
+    u32 i, scanned = 0;
+    
+    spin_lock_bh(&ota_campaign.lock);
+    if (!ota_campaign.running) {
+        spin_unlock_bh(&ota_campaign.lock);
+        return;
+    }
+    
+    // Iterate backwards: a release moves the last entry into the hole
+    for (i = ota_campaign.inflight_count; i-- > 0;) {
+        u32 id = ota_campaign.inflight[i];
+        struct ota_fleet_rec *rec = &ota_campaign.recs[id];
+        u32 age = jiffies_to_msecs(jiffies - rec->sent_at);
+        u32 rto = rec->srtt_ms ? clamp_t(u32, 4 * rec->srtt_ms, OTA_RTO_MIN_MS, OTA_RTO_MAX_MS) :
+                                 2 * ota_target_rtt_ms;
+        
+        // Backed off per resend, as a slow link looks just like a lossy one
+        rto = min_t(u32, rto << rec->retries, OTA_RTO_MAX_MS);
+        
+        if (rec->status == OTA_STATUS_INSTALLING) {
+            if (age > global_ota_updates.update_timeout_ms) {
+                ota_campaign_release(id, false);
+            }
+            continue;
+        }
+        if (age <= rto || n == OTA_SEND_BATCH) {
+            continue;
+        }
+        if (rec->retries++ >= OTA_CHUNK_RETRIES) {
+            ota_campaign_release(id, false);
+            continue;
+        }
+        if (rec->chunk_shift > OTA_CHUNK_SHIFT_MIN) {
+            rec->chunk_shift--;
+        }
+        ota_campaign_next_chunk(id, &send[n++]);
+    }
+    
+    // Wave finished: stop if it went badly, open the next one otherwise
+    if (ota_campaign.admit_cursor >= ota_campaign.fleet_size && ota_campaign.inflight_count == 0) {
+        if (ota_campaign.wave_done &&
+            ota_campaign.wave_failed * 1000 > ota_campaign.wave_done * ota_halt_permille) {
+            pr_err("OTA campaign halted: wave %d failed %u of %u devices\n",
+                   ota_campaign.wave, ota_campaign.wave_failed, ota_campaign.wave_done);
+            ota_campaign.running = false;
+            goto out;
+        }
+        pr_info("OTA campaign wave %d done: %u devices, %u failed\n",
+                ota_campaign.wave, ota_campaign.wave_done, ota_campaign.wave_failed);
+        if (++ota_campaign.wave == ota_campaign.wave_count) {
+            pr_info("OTA campaign complete: %u updated, %u failed\n",
+                    ota_campaign.completed, ota_campaign.failed);
+            ota_campaign.running = false;
+            goto out;
+        }
+        ota_campaign.admit_cursor = 0;
+        ota_campaign.wave_done = 0;
+        ota_campaign.wave_failed = 0;
+    }
+    
+    // Admit this wave's devices into the free slots
+    while (ota_campaign.admit_cursor < ota_campaign.fleet_size &&
+           ota_campaign.inflight_count < ota_campaign.max_inflight &&
+           n < OTA_SEND_BATCH && scanned++ < OTA_ADMIT_SCAN) {
+        u32 id = ota_campaign.admit_cursor++;
+        struct ota_fleet_rec *rec = &ota_campaign.recs[id];
+        
+        if (rec->status != OTA_STATUS_IDLE || ota_campaign_wave_of(id) != ota_campaign.wave) {
+            continue;
+        }
+        rec->status = OTA_STATUS_DOWNLOADING;
+        rec->next_offset = 0;
+        rec->retries = 0;
+        rec->slot = ota_campaign.inflight_count;
+        ota_campaign.inflight[ota_campaign.inflight_count++] = id;
+        ota_campaign_next_chunk(id, &send[n++]);
+    }
+    
+    queue_delayed_work(ota_campaign.wq, &ota_campaign.tick,
+                       n == OTA_SEND_BATCH ? 0 : msecs_to_jiffies(OTA_CAMPAIGN_TICK_MS));
+out:
+    spin_unlock_bh(&ota_campaign.lock);
+    ota_campaign_send(send, n);
+}
+
+/**
+ * Start rolling a package out to devices 0..fleet_size-1
+ *
+ * wave_permille holds the cumulative share of the fleet each wave
+ * reaches, ending at 1000, e.g. { 10, 50, 250, 1000 }.
+ */
+static int ota_campaign_start(u32 package_id, u32 fleet_size, const u16 *wave_permille,
+                              int waves, u32 max_inflight)
+{
+    struct ota_fleet_rec *recs;
+    u32 *inflight;
+    u32 i;
+    int w;
+    
+    if (package_id >= MAX_OTA_PACKAGES || !global_ota_updates.packages[package_id].active ||
+        !fleet_size || fleet_size > ota_fleet_max || !wave_permille ||
+        waves < 1 || waves > OTA_MAX_WAVES || wave_permille[waves - 1] != 1000 ||
+        !max_inflight || max_inflight > OTA_MAX_INFLIGHT) {
+        pr_err("Invalid OTA campaign parameters\n");
+        return -EINVAL;
+    }
+    for (w = 1; w < waves; w++) {
+        if (wave_permille[w] < wave_permille[w - 1]) {
+            return -EINVAL;
+        }
+    }
+    
+    recs = kvcalloc(fleet_size, sizeof(*recs), GFP_KERNEL);
+    inflight = kvcalloc(max_inflight, sizeof(*inflight), GFP_KERNEL);
+    if (!recs || !inflight) {
+        kvfree(recs);
+        kvfree(inflight);
+        return -ENOMEM;
+    }
+    
+    spin_lock_bh(&ota_campaign.lock);
+    if (ota_campaign.running) {
+        spin_unlock_bh(&ota_campaign.lock);
+        kvfree(recs);
+        kvfree(inflight);
+        return -EBUSY;
+    }
+    swap(ota_campaign.recs, recs);
+    swap(ota_campaign.inflight, inflight);
+    
+    ota_campaign.package_id = package_id;
+    ota_campaign.package_size = global_ota_updates.packages[package_id].size_bytes;
+    ota_campaign.fleet_size = fleet_size;
+    ota_campaign.max_inflight = max_inflight;
+    ota_campaign.seed = get_random_u32();
+    memcpy(ota_campaign.wave_permille, wave_permille, waves * sizeof(*wave_permille));
+    ota_campaign.wave_count = waves;
+    ota_campaign.wave = 0;
+    ota_campaign.admit_cursor = 0;
+    ota_campaign.wave_done = 0;
+    ota_campaign.wave_failed = 0;
+    ota_campaign.inflight_count = 0;
+    ota_campaign.completed = 0;
+    ota_campaign.failed = 0;
+    for (i = 0; i < fleet_size; i++) {
+        ota_campaign.recs[i].status = OTA_STATUS_IDLE;
+        ota_campaign.recs[i].chunk_shift = OTA_CHUNK_SHIFT_INIT;
+    }
+    ota_campaign.running = true;
+    mod_delayed_work(ota_campaign.wq, &ota_campaign.tick, 0);
+    spin_unlock_bh(&ota_campaign.lock);
+    
+    // The previous campaign's records, if any
+    kvfree(recs);
+    kvfree(inflight);
+    
+    pr_info("OTA campaign started: package=%s, fleet=%u, waves=%d, inflight=%u\n",
+            global_ota_updates.packages[package_id].name, fleet_size, waves, max_inflight);
+    return 0;
+}
+
+/**
+ * Stop a campaign; devices mid-update are left to finish on their own
+ */
+static int ota_campaign_abort(void)
+{
+    spin_lock_bh(&ota_campaign.lock);
+    ota_campaign.running = false;
+    spin_unlock_bh(&ota_campaign.lock);
+    
+    cancel_delayed_work_sync(&ota_campaign.tick);
+    return 0;
+}
+
+/**
+ * Campaign progress
+ */
+static int ota_campaign_get_progress(int *wave, u32 *completed, u32 *failed, u32 *inflight)
+{
+    spin_lock_bh(&ota_campaign.lock);
+    if (wave) {
+        *wave = ota_campaign.wave;
+    }
+    if (completed) {
+        *completed = ota_campaign.completed;
+    }
+    if (failed) {
+        *failed = ota_campaign.failed;
+    }
+    if (inflight) {
+        *inflight = ota_campaign.inflight_count;
+    }
+    spin_unlock_bh(&ota_campaign.lock);
+    
+    return 0;
+}
+
+static struct ota_cache_entry *ota_cache_find(const u8 *hash)
+{
+    struct ota_cache_entry *e;
+    
+    hash_for_each_possible(ota_cache, e, node, get_unaligned_le32(hash)) {
+        if (!memcmp(e->hash, hash, SHA256_DIGEST_SIZE)) {
+            return e;
+        }
+    }
+    
+    return NULL;
+}
+
+static void ota_cache_free(struct ota_cache_entry *e)
+{
+    int i;
+    
+    hash_del(&e->node);
+    list_del(&e->lru);
+    if (!e->origin) {
+        ota_cache_bytes -= e->size;
+    }
+    for (i = 0; i < e->peer_count; i++) {
+        bitmap_free(e->peer_have[i]);
+    }
+    bitmap_free(e->have);
+    kvfree(e->data);
+    kvfree(e->manifest);
+    kfree(e);
+}
+
+/*
+ * Make an entry for a package. Origin entries are our own packages: they
+ * don't count against ota_cache_max_mb and are never evicted.
+ */
+static int ota_cache_add(const u8 *hash, u32 size, const u8 *manifest, u32 blocks,
+                         bool origin, struct ota_cache_entry **entry)
+{
+    struct ota_cache_entry *e, *tmp;
+    u8 digest[SHA256_DIGEST_SIZE];
+    int ret = 0;
+    
+    if (!hash || !manifest || !size || blocks != DIV_ROUND_UP(size, OTA_CACHE_BLOCK)) {
+        return -EINVAL;
+    }
+    if (!origin && size > (size_t)ota_cache_max_mb << 20) {
+        return -EFBIG;
+    }
+    
+    sha256(manifest, blocks * SHA256_DIGEST_SIZE, digest);
+    if (memcmp(digest, hash, SHA256_DIGEST_SIZE)) {
+        pr_err("OTA cache: manifest does not match package hash\n");
+        return -EBADMSG;
+    }
+    
+    mutex_lock(&ota_cache_lock);
+    e = ota_cache_find(hash);
+    if (e) {
+        // Held for the LAN already: now it is ours, and filled by the caller
+        if (origin && !e->origin) {
+            e->origin = true;
+            ota_cache_bytes -= e->size;
+        }
+        if (entry) {
+            *entry = e;
+        }
+        goto out;
+    }
+    
+    // Least recently served packages make room
+    list_for_each_entry_safe_reverse(e, tmp, &ota_cache_lru, lru) {
+        if (origin || ota_cache_bytes + size <= (size_t)ota_cache_max_mb << 20) {
+            break;
+        }
+        if (!e->origin) {
+            ota_cache_free(e);
+        }
+    }
+    
+    e = kzalloc(sizeof(*e), GFP_KERNEL);
+    if (!e) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    e->manifest = kvmalloc_array(blocks, SHA256_DIGEST_SIZE, GFP_KERNEL);
+    e->data = kvmalloc(size, GFP_KERNEL);
+    e->have = bitmap_zalloc(blocks, GFP_KERNEL);
+    if (!e->manifest || !e->data || !e->have) {
+        bitmap_free(e->have);
+        kvfree(e->data);
+        kvfree(e->manifest);
+        kfree(e);
+        ret = -ENOMEM;
+        goto out;
+    }
+    
+    memcpy(e->hash, hash, SHA256_DIGEST_SIZE);
+    memcpy(e->manifest, manifest, blocks * SHA256_DIGEST_SIZE);
+    e->size = size;
+    e->blocks = blocks;
+    e->origin = origin;
+    hash_add(ota_cache, &e->node, get_unaligned_le32(hash));
+    list_add(&e->lru, &ota_cache_lru);
+    if (!origin) {
+        ota_cache_bytes += size;
+    }
+    if (entry) {
+        *entry = e;
+    }
+    
+    pr_info("OTA cache: holding package %*phN, %u bytes\n", 8, hash, size);
+    
+out:
+    mutex_unlock(&ota_cache_lock);
+    return ret;
+}
+
+/**
+ * Hold a package for the LAN
+ *
+ * The manifest is the SHA-256 of each 1 KiB block; it is only accepted
+ * if it hashes to the package hash, which is what the origin signs.
+ */
+int ota_cache_open(const u8 *hash, u32 size, const u8 *manifest, u32 blocks)
+{
+    if (!ota_cache_mode) {
+        return -EOPNOTSUPP;
+    }
+    
+    return ota_cache_add(hash, size, manifest, blocks, false, NULL);
+}
+EXPORT_SYMBOL_GPL(ota_cache_open);
+
+static bool ota_cache_range(const struct ota_cache_entry *e, u32 offset, u32 len, u32 *first, u32 *last)
+{
+    if (!len || offset % OTA_CACHE_BLOCK || offset >= e->size || len > e->size - offset) {
+        return false;
+    }
+    
+    // Whole blocks only, apart from the package's last one
+    if ((offset + len) % OTA_CACHE_BLOCK && offset + len != e->size) {
+        return false;
+    }
+    
+    *first = offset / OTA_CACHE_BLOCK;
+    *last = DIV_ROUND_UP(offset + len, OTA_CACHE_BLOCK);
+    return true;
+}
+
+/*
+ * Package data to send straight from an origin entry, or NULL if the
+ * range is not one ota_cache_read() would serve. Without the lock, so
+ * from atomic context: an origin entry is complete and stays until the
+ * module goes, nothing in it changes once ota_create_package() filled it.
+ */
+static const u8 *ota_cache_span(const struct ota_cache_entry *e, u32 offset, u32 len)
+{
+    u32 first, last;
+    
+    if (!e || !e->origin || !ota_cache_range(e, offset, len, &first, &last) ||
+        find_next_zero_bit(e->have, last, first) < last) {
+        return NULL;
+    }
+    
+    return e->data + offset;
+}
+
+/**
+ * Store package data fetched from the origin (or a peer)
+ *
+ * Each block is checked against the manifest first. Blocks that match
+ * are kept even if a later one does not, and the call reports the
+ * mismatch so the caller can fetch again from somewhere else.
+ */
+int ota_cache_fill(const u8 *hash, u32 offset, const u8 *data, u32 len)
+{
+    struct ota_cache_entry *e;
+    u8 digest[SHA256_DIGEST_SIZE];
+    u32 first, last, b;
+    int ret = 0;
+    
+    mutex_lock(&ota_cache_lock);
+    e = ota_cache_find(hash);
+    if (!e) {
+        ret = -ENOENT;
+        goto out;
+    }
+    if (!ota_cache_range(e, offset, len, &first, &last)) {
+        ret = -EINVAL;
+        goto out;
+    }
+    
+    for (b = first; b < last; b++) {
+        const u8 *blk = data + (b - first) * OTA_CACHE_BLOCK;
+        u32 blen = min_t(u32, OTA_CACHE_BLOCK, e->size - b * OTA_CACHE_BLOCK);
+        
+        if (test_bit(b, e->have)) {
+            continue;
+        }
+        sha256(blk, blen, digest);
+        if (memcmp(digest, e->manifest[b], SHA256_DIGEST_SIZE)) {
+            ret = -EBADMSG;
+            continue;
+        }
+        memcpy(e->data + b * OTA_CACHE_BLOCK, blk, blen);
+        set_bit(b, e->have);
+    }
+    
+out:
+    mutex_unlock(&ota_cache_lock);
+    if (ret == -EBADMSG) {
+        pr_warn("OTA cache: rejected blocks of %*phN at %u\n", 8, hash, offset);
+    }
+    return ret;
+}
+EXPORT_SYMBOL_GPL(ota_cache_fill);
+
+/**
+ * Serve package data from the cache
+ *
+ * Returns len, or -ENOENT if any of the range is not held, in which
+ * case the gateway fetches it from the origin and fills it in.
+ */
+int ota_cache_read(const u8 *hash, u32 offset, u8 *buf, u32 len)
+{
+    struct ota_cache_entry *e;
+    u32 first, last;
+    int ret = len;
+    
+    mutex_lock(&ota_cache_lock);
+    e = ota_cache_find(hash);
+    if (!e || !ota_cache_range(e, offset, len, &first, &last)) {
+        ret = e ? -EINVAL : -ENOENT;
+        goto out;
+    }
+    if (find_next_zero_bit(e->have, last, first) < last) {
+        ret = -ENOENT;
+        goto out;
+    }
+    
+    memcpy(buf, e->data + offset, len);
+    list_move(&e->lru, &ota_cache_lru);
+    
+out:
+    mutex_unlock(&ota_cache_lock);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(ota_cache_read);
+
+/**
+ * A LAN device reports it holds, and has verified, part of a package
+ *
+ * The device verified against the same manifest when it installed the
+ * blocks; a device that lies only costs the requester a failed check
+ * and a fetch from the cache.
+ */
+int ota_cache_peer_have(const u8 *hash, u32 peer_id, u32 offset, u32 len)
+{
+    struct ota_cache_entry *e;
+    u32 first, last;
+    int i, ret = 0;
+    
+    if (ota_cache_mode < 2) {
+        return -EOPNOTSUPP;
+    }
+    
+    mutex_lock(&ota_cache_lock);
+    e = ota_cache_find(hash);
+    if (!e || !ota_cache_range(e, offset, len, &first, &last)) {
+        ret = e ? -EINVAL : -ENOENT;
+        goto out;
+    }
+    
+    for (i = 0; i < e->peer_count && e->peers[i] != peer_id; i++)
+        ;
+    if (i == e->peer_count) {
+        if (i == OTA_CACHE_MAX_PEERS) {
+            ret = -ENOSPC;
+            goto out;
+        }
+        e->peer_have[i] = bitmap_zalloc(e->blocks, GFP_KERNEL);
+        if (!e->peer_have[i]) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        e->peers[i] = peer_id;
+        e->peer_count++;
+    }
+    bitmap_set(e->peer_have[i], first, last - first);
+    
+out:
+    mutex_unlock(&ota_cache_lock);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(ota_cache_peer_have);
+
+/**
+ * Pick a LAN peer holding a whole range, other than the requester
+ *
+ * Peers are taken in turn so one device does not serve the whole site.
+ */
+int ota_cache_peer_for(const u8 *hash, u32 requester, u32 offset, u32 len, u32 *peer_id)
+{
+    struct ota_cache_entry *e;
+    u32 first, last;
+    int i, n, ret = -ENOENT;
+    
+    if (ota_cache_mode < 2) {
+        return -EOPNOTSUPP;
+    }
+    
+    mutex_lock(&ota_cache_lock);
+    e = ota_cache_find(hash);
+    if (!e || !ota_cache_range(e, offset, len, &first, &last)) {
+        goto out;
+    }
+    
+    for (n = 0; n < e->peer_count; n++) {
+        i = (e->peer_rr + n) % e->peer_count;
+        if (e->peers[i] != requester &&
+            find_next_zero_bit(e->peer_have[i], last, first) >= last) {
+            *peer_id = e->peers[i];
+            e->peer_rr = i + 1;
+            ret = 0;
+            break;
+        }
+    }
+    
+out:
+    mutex_unlock(&ota_cache_lock);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(ota_cache_peer_for);
+
+/**
+ * Drop a package from the cache
+ */
+void ota_cache_close(const u8 *hash)
+{
+    struct ota_cache_entry *e;
+    
+    mutex_lock(&ota_cache_lock);
+    e = ota_cache_find(hash);
+    if (e && !e->origin) {
+        ota_cache_free(e);
+    }
+    mutex_unlock(&ota_cache_lock);
+}
+EXPORT_SYMBOL_GPL(ota_cache_close);
+
 /**
  * Rollback OTA update
  */
@@ -436,6 +1342,17 @@ static void __exit ota_updates_cleanup_module(void)
         del_timer_sync(&global_ota_updates.ota_timer);
     }
     
+    ota_campaign_abort();
+    destroy_workqueue(ota_campaign.wq);
+    
+    mutex_lock(&ota_cache_lock);
+    while (!list_empty(&ota_cache_lru)) {
+        ota_cache_free(list_first_entry(&ota_cache_lru, struct ota_cache_entry, lru));
+    }
+    mutex_unlock(&ota_cache_lock);
+    kvfree(ota_campaign.recs);
+    kvfree(ota_campaign.inflight);
+    
     pr_info("OTA Updates unloaded\n");
 }
 
@@ -5,13 +5,36 @@
  * 
  * Generates SBOM for compliance and security tracking
  * Supports SPDX and CycloneDX formats
+ *
+ * Documents are streamed through a small staging buffer to a file (or,
+ * for sbom_generate_spdx(), to the caller's buffer), so a full image's
+ * component list no longer has to fit in memory as text. Components
+ * registered with a file path get a SHA-256, hashed in parallel on an
+ * unbound workqueue by sbom_hash_components(). Hashes are cached by
+ * (path, size, mtime); with sbom_hash_cache set the cache is loaded at
+ * module init and written back by sbom_hash_cache_save(), so a rebuild
+ * only rehashes the files that changed.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/string.h>
+#include <linux/fs.h>
+#include <linux/stat.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/workqueue.h>
+#include <linux/moduleparam.h>
+#include <crypto/sha2.h>
 
-#define SBOM_VERSION "1.0.0"
+#define SBOM_VERSION "1.1.0"
+
+#define SBOM_STAGE_SIZE 8192                // flushed to the sink when full
+#define SBOM_READ_CHUNK (64 * 1024)
+#define SBOM_CACHE_BITS 10
 
 struct sbom_component {
     char name[64];
@@ -19,10 +42,206 @@ struct sbom_component {
     char license[64];
     char supplier[64];
     char purl[128];  // Package URL
+    char *path;                         // file to hash, or NULL
+    u8 sha256[SHA256_DIGEST_SIZE];
+    bool hashed;
 };
 
-static struct sbom_component components[64];
+static struct sbom_component *components;
 static int component_count = 0;
+static int component_cap = 0;
+static DEFINE_MUTEX(sbom_lock);
+
+/* A file hash from this or an earlier build */
+struct sbom_hash_entry {
+    struct hlist_node node;
+    u64 size;
+    s64 mtime_sec;
+    u32 mtime_nsec;
+    u8 sha256[SHA256_DIGEST_SIZE];
+    char path[];
+};
+
+static DEFINE_HASHTABLE(sbom_hash_cache_tbl, SBOM_CACHE_BITS);
+static DEFINE_MUTEX(sbom_cache_lock);
+
+struct sbom_hash_work {
+    struct work_struct work;
+    struct sbom_component *comp;
+    int ret;
+};
+
+static struct workqueue_struct *sbom_wq;
+
+/* Where formatted output goes */
+struct sbom_writer {
+    char *stage;
+    size_t used;
+    struct file *file;
+    loff_t pos;
+    char *out;                          // caller's buffer, if not a file
+    size_t out_size;
+    size_t total;
+    int err;
+};
+
+static char *sbom_hash_cache;
+module_param(sbom_hash_cache, charp, 0444);
+MODULE_PARM_DESC(sbom_hash_cache, "File the component hash cache is kept in between builds");
+
+static unsigned int sbom_hash_workers;
+module_param(sbom_hash_workers, uint, 0444);
+MODULE_PARM_DESC(sbom_hash_workers, "Files hashed at once (0: workqueue default)");
+
+static void sbom_flush(struct sbom_writer *w)
+{
+    ssize_t n;
+    
+    if (w->err || !w->used) {
+        w->used = 0;
+        return;
+    }
+    
+    if (w->file) {
+        n = kernel_write(w->file, w->stage, w->used, &w->pos);
+        if (n != w->used) {
+            w->err = n < 0 ? n : -EIO;
+        }
+    } else if (w->total + w->used >= w->out_size) {
+        w->err = -ENOSPC;               // leave room for the terminator
+    } else {
+        memcpy(w->out + w->total, w->stage, w->used);
+        w->out[w->total + w->used] = '\0';
+    }
+    
+    if (!w->err) {
+        w->total += w->used;
+    }
+    w->used = 0;
+}
+
+static __printf(2, 3) void sbom_printf(struct sbom_writer *w, const char *fmt, ...)
+{
+    va_list args;
+    int n;
+    
+    if (w->err) {
+        return;
+    }
+    
+    va_start(args, fmt);
+    n = vsnprintf(w->stage + w->used, SBOM_STAGE_SIZE - w->used, fmt, args);
+    va_end(args);
+    
+    if (w->used + n < SBOM_STAGE_SIZE) {
+        w->used += n;
+        return;
+    }
+    
+    // Did not fit: flush what came before and format it again
+    sbom_flush(w);
+    if (w->err) {
+        return;
+    }
+    va_start(args, fmt);
+    n = vsnprintf(w->stage, SBOM_STAGE_SIZE, fmt, args);
+    va_end(args);
+    if (n >= SBOM_STAGE_SIZE) {
+        w->err = -E2BIG;
+        return;
+    }
+    w->used = n;
+}
+
+/* JSON string body, escaped; fields are short so escape per character */
+static void sbom_put_json(struct sbom_writer *w, const char *s)
+{
+    for (; *s && !w->err; s++) {
+        if (*s == '"' || *s == '\\') {
+            sbom_printf(w, "\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            sbom_printf(w, "\\u%04x", *s);
+        } else {
+            if (w->used + 1 >= SBOM_STAGE_SIZE) {
+                sbom_flush(w);
+            }
+            w->stage[w->used++] = *s;
+        }
+    }
+}
+
+static int sbom_writer_init(struct sbom_writer *w, struct file *file, char *out, size_t out_size)
+{
+    memset(w, 0, sizeof(*w));
+    w->stage = kmalloc(SBOM_STAGE_SIZE, GFP_KERNEL);
+    if (!w->stage) {
+        return -ENOMEM;
+    }
+    w->file = file;
+    w->pos = file ? file->f_pos : 0;
+    w->out = out;
+    w->out_size = out_size;
+    return 0;
+}
+
+static int sbom_writer_finish(struct sbom_writer *w)
+{
+    sbom_flush(w);
+    kfree(w->stage);
+    if (w->file && !w->err) {
+        w->file->f_pos = w->pos;
+    }
+    return w->err ? w->err : w->total;
+}
+
+static int sbom_add(const char *name, const char *version, const char *license,
+                    const char *supplier, const char *path)
+{
+    struct sbom_component *comp;
+    int ret = 0;
+    
+    mutex_lock(&sbom_lock);
+    
+    if (component_count == component_cap) {
+        int cap = component_cap ? component_cap * 2 : 64;
+        struct sbom_component *grown = kvmalloc_array(cap, sizeof(*grown), GFP_KERNEL);
+        
+        if (!grown) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        if (components) {
+            memcpy(grown, components, component_count * sizeof(*grown));
+            kvfree(components);
+        }
+        components = grown;
+        component_cap = cap;
+    }
+    
+    comp = &components[component_count];
+    memset(comp, 0, sizeof(*comp));
+    if (path) {
+        comp->path = kstrdup(path, GFP_KERNEL);
+        if (!comp->path) {
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+    
+    strscpy(comp->name, name, sizeof(comp->name));
+    strscpy(comp->version, version, sizeof(comp->version));
+    strscpy(comp->license, license, sizeof(comp->license));
+    strscpy(comp->supplier, supplier, sizeof(comp->supplier));
+    
+    snprintf(comp->purl, sizeof(comp->purl),
+             "pkg:generic/%s@%s", name, version);
+    
+    component_count++;
+    
+out:
+    mutex_unlock(&sbom_lock);
+    return ret;
+}
 
 /**
  * Add component to SBOM
@@ -30,64 +249,409 @@ static int component_count = 0;
 int sbom_add_component(const char *name, const char *version,
                        const char *license, const char *supplier)
 {
-    if (component_count >= 64) {
-        return -ENOSPC;
+    return sbom_add(name, version, license, supplier, NULL);
+}
+
+/**
+ * Add component to SBOM, with a file to be hashed for it
+ */
+int sbom_add_component_file(const char *name, const char *version,
+                            const char *license, const char *supplier,
+                            const char *path)
+{
+    if (!path) {
+        return -EINVAL;
     }
     
-    strncpy(components[component_count].name, name, 63);
-    strncpy(components[component_count].version, version, 31);
-    strncpy(components[component_count].license, license, 63);
-    strncpy(components[component_count].supplier, supplier, 63);
+    return sbom_add(name, version, license, supplier, path);
+}
+
+static struct sbom_hash_entry *sbom_cache_find(const char *path, u32 key)
+{
+    struct sbom_hash_entry *e;
     
-    snprintf(components[component_count].purl, sizeof(components[component_count].purl),
-             "pkg:generic/%s@%s", name, version);
+    hash_for_each_possible(sbom_hash_cache_tbl, e, node, key) {
+        if (!strcmp(e->path, path)) {
+            return e;
+        }
+    }
     
-    component_count++;
+    return NULL;
+}
+
+static void sbom_cache_store(const char *path, u64 size, s64 mtime_sec, u32 mtime_nsec,
+                             const u8 *sha256)
+{
+    u32 key = jhash(path, strlen(path), 0);
+    struct sbom_hash_entry *e;
     
-    return 0;
+    mutex_lock(&sbom_cache_lock);
+    
+    e = sbom_cache_find(path, key);
+    if (!e) {
+        e = kmalloc(struct_size(e, path, strlen(path) + 1), GFP_KERNEL);
+        if (!e) {
+            goto out;                   // only costs a rehash next time
+        }
+        strcpy(e->path, path);
+        hash_add(sbom_hash_cache_tbl, &e->node, key);
+    }
+    
+    e->size = size;
+    e->mtime_sec = mtime_sec;
+    e->mtime_nsec = mtime_nsec;
+    memcpy(e->sha256, sha256, SHA256_DIGEST_SIZE);
+    
+out:
+    mutex_unlock(&sbom_cache_lock);
+}
+
+static bool sbom_cache_lookup(const char *path, u64 size, s64 mtime_sec, u32 mtime_nsec,
+                              u8 *sha256)
+{
+    struct sbom_hash_entry *e;
+    bool hit = false;
+    
+    mutex_lock(&sbom_cache_lock);
+    e = sbom_cache_find(path, jhash(path, strlen(path), 0));
+    if (e && e->size == size && e->mtime_sec == mtime_sec && e->mtime_nsec == mtime_nsec) {
+        memcpy(sha256, e->sha256, SHA256_DIGEST_SIZE);
+        hit = true;
+    }
+    mutex_unlock(&sbom_cache_lock);
+    
+    return hit;
+}
+
+static void sbom_hash_one(struct work_struct *work)
+{
+    struct sbom_hash_work *hw = container_of(work, struct sbom_hash_work, work);
+    struct sbom_component *comp = hw->comp;
+    struct sha256_state sctx;
+    struct kstat stat;
+    struct file *f;
+    loff_t pos = 0;
+    ssize_t n;
+    void *buf;
+    
+    f = filp_open(comp->path, O_RDONLY | O_LARGEFILE, 0);
+    if (IS_ERR(f)) {
+        hw->ret = PTR_ERR(f);
+        return;
+    }
+    
+    hw->ret = vfs_getattr(&f->f_path, &stat, STATX_SIZE | STATX_MTIME, AT_STATX_SYNC_AS_STAT);
+    if (hw->ret) {
+        goto out_close;
+    }
+    
+    if (sbom_cache_lookup(comp->path, stat.size, stat.mtime.tv_sec, stat.mtime.tv_nsec,
+                          comp->sha256)) {
+        comp->hashed = true;
+        goto out_close;
+    }
+    
+    buf = kvmalloc(SBOM_READ_CHUNK, GFP_KERNEL);
+    if (!buf) {
+        hw->ret = -ENOMEM;
+        goto out_close;
+    }
+    
+    sha256_init(&sctx);
+    while ((n = kernel_read(f, buf, SBOM_READ_CHUNK, &pos)) > 0) {
+        sha256_update(&sctx, buf, n);
+    }
+    kvfree(buf);
+    if (n < 0) {
+        hw->ret = n;
+        goto out_close;
+    }
+    sha256_final(&sctx, comp->sha256);
+    comp->hashed = true;
+    
+    sbom_cache_store(comp->path, stat.size, stat.mtime.tv_sec, stat.mtime.tv_nsec,
+                     comp->sha256);
+    
+out_close:
+    filp_close(f, NULL);
+}
+
+/**
+ * Hash every component file not hashed yet
+ *
+ * Returns the number of files that could not be hashed; those are left
+ * without a checksum in the document.
+ */
+int sbom_hash_components(void)
+{
+    struct sbom_hash_work *works;
+    int i, n = 0, failed = 0;
+    
+    mutex_lock(&sbom_lock);
+    
+    works = kvcalloc(component_count, sizeof(*works), GFP_KERNEL);
+    if (!works && component_count) {
+        mutex_unlock(&sbom_lock);
+        return -ENOMEM;
+    }
+    
+    for (i = 0; i < component_count; i++) {
+        if (!components[i].path || components[i].hashed) {
+            continue;
+        }
+        works[n].comp = &components[i];
+        INIT_WORK(&works[n].work, sbom_hash_one);
+        queue_work(sbom_wq, &works[n].work);
+        n++;
+    }
+    flush_workqueue(sbom_wq);
+    
+    for (i = 0; i < n; i++) {
+        if (works[i].ret) {
+            pr_warn("SBOM: cannot hash %s: %d\n", works[i].comp->path, works[i].ret);
+            failed++;
+        }
+    }
+    
+    mutex_unlock(&sbom_lock);
+    kvfree(works);
+    
+    return failed;
+}
+
+/**
+ * Write the hash cache back for the next build
+ */
+int sbom_hash_cache_save(void)
+{
+    struct sbom_hash_entry *e;
+    struct sbom_writer w;
+    struct file *f;
+    int bkt, ret;
+    
+    if (!sbom_hash_cache) {
+        return -EINVAL;
+    }
+    
+    f = filp_open(sbom_hash_cache, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (IS_ERR(f)) {
+        return PTR_ERR(f);
+    }
+    
+    ret = sbom_writer_init(&w, f, NULL, 0);
+    if (ret) {
+        goto out_close;
+    }
+    
+    // One entry per line: sha256 size mtime_sec mtime_nsec path
+    mutex_lock(&sbom_cache_lock);
+    hash_for_each(sbom_hash_cache_tbl, bkt, e, node) {
+        sbom_printf(&w, "%*phN %llu %lld %u %s\n", SHA256_DIGEST_SIZE, e->sha256,
+                    e->size, e->mtime_sec, e->mtime_nsec, e->path);
+    }
+    mutex_unlock(&sbom_cache_lock);
+    
+    ret = sbom_writer_finish(&w);
+    
+out_close:
+    filp_close(f, NULL);
+    return ret < 0 ? ret : 0;
+}
+
+static void sbom_hash_cache_load(void)
+{
+    char hex[2 * SHA256_DIGEST_SIZE + 1];
+    u8 sha256[SHA256_DIGEST_SIZE];
+    unsigned long long size;
+    long long mtime_sec;
+    unsigned int mtime_nsec;
+    char *buf, *line, *next;
+    struct file *f;
+    loff_t pos = 0;
+    loff_t len;
+    int loaded = 0, off;
+    
+    f = filp_open(sbom_hash_cache, O_RDONLY, 0);
+    if (IS_ERR(f)) {
+        return;                         // first build
+    }
+    
+    len = i_size_read(file_inode(f));
+    buf = len > 0 ? kvmalloc(len + 1, GFP_KERNEL) : NULL;
+    if (!buf || kernel_read(f, buf, len, &pos) != len) {
+        goto out;
+    }
+    buf[len] = '\0';
+    
+    for (line = buf; line && *line; line = next) {
+        next = strchr(line, '\n');
+        if (next) {
+            *next++ = '\0';
+        }
+        if (sscanf(line, "%64s %llu %lld %u %n", hex, &size, &mtime_sec, &mtime_nsec, &off) != 4 ||
+            hex2bin(sha256, hex, SHA256_DIGEST_SIZE) || !line[off]) {
+            continue;
+        }
+        sbom_cache_store(line + off, size, mtime_sec, mtime_nsec, sha256);
+        loaded++;
+    }
+    
+    pr_info("SBOM: %d cached hashes from %s\n", loaded, sbom_hash_cache);
+    
+out:
+    kvfree(buf);
+    filp_close(f, NULL);
+}
+
+static void sbom_emit_spdx(struct sbom_writer *w)
+{
+    int i;
+    
+    sbom_printf(w, "SPDXVersion: SPDX-2.3\n");
+    sbom_printf(w, "DataLicense: CC0-1.0\n");
+    sbom_printf(w, "SPDXID: SPDXRef-DOCUMENT\n");
+    sbom_printf(w, "DocumentName: Embedded System SBOM\n");
+    sbom_printf(w, "DocumentNamespace: https://example.com/sbom\n");
+    sbom_printf(w, "Creator: Tool: SBOM-Generator-%s\n", SBOM_VERSION);
+    sbom_printf(w, "\n");
+    
+    for (i = 0; i < component_count && !w->err; i++) {
+        sbom_printf(w, "PackageName: %s\n", components[i].name);
+        sbom_printf(w, "SPDXID: SPDXRef-Package-%d\n", i);
+        sbom_printf(w, "PackageVersion: %s\n", components[i].version);
+        sbom_printf(w, "PackageLicenseDeclared: %s\n", components[i].license);
+        sbom_printf(w, "PackageSupplier: %s\n", components[i].supplier);
+        if (components[i].hashed) {
+            sbom_printf(w, "PackageChecksum: SHA256: %*phN\n",
+                        SHA256_DIGEST_SIZE, components[i].sha256);
+        }
+        sbom_printf(w, "\n");
+    }
+}
+
+static void sbom_emit_cyclonedx(struct sbom_writer *w)
+{
+    int i;
+    
+    sbom_printf(w, "{\n  \"bomFormat\": \"CycloneDX\",\n  \"specVersion\": \"1.5\",\n");
+    sbom_printf(w, "  \"version\": 1,\n  \"metadata\": {\"tools\": [{\"name\": \"SBOM-Generator\", "
+                "\"version\": \"%s\"}]},\n", SBOM_VERSION);
+    sbom_printf(w, "  \"components\": [");
+        
+    for (i = 0; i < component_count && !w->err; i++) {
+        const struct sbom_component *c = &components[i];
+            
+        sbom_printf(w, "%s\n    {\"type\": \"library\", \"name\": \"", i ? "," : "");
+        sbom_put_json(w, c->name);
+        sbom_printf(w, "\", \"version\": \"");
+        sbom_put_json(w, c->version);
+        sbom_printf(w, "\", \"supplier\": {\"name\": \"");
+        sbom_put_json(w, c->supplier);
+        sbom_printf(w, "\"}, \"licenses\": [{\"license\": {\"id\": \"");
+        sbom_put_json(w, c->license);
+        sbom_printf(w, "\"}}], \"purl\": \"");
+        sbom_put_json(w, c->purl);
+        sbom_printf(w, "\"");
+        if (c->hashed) {
+            sbom_printf(w, ", \"hashes\": [{\"alg\": \"SHA-256\", \"content\": \"%*phN\"}]",
+                        SHA256_DIGEST_SIZE, c->sha256);
+        }
+        sbom_printf(w, "}");
+    }
+        
+    sbom_printf(w, "\n  ]\n}\n");
 }
 
 /**
  * Generate SPDX format SBOM
+ *
+ * Returns the length written, or -ENOSPC if the document does not fit.
  */
 int sbom_generate_spdx(char *buffer, size_t buffer_size)
 {
-    int len = 0;
-    int i;
+    struct sbom_writer w;
+    int ret;
+    
+    ret = sbom_writer_init(&w, NULL, buffer, buffer_size);
+    if (ret) {
+        return ret;
+    }
     
-    len += snprintf(buffer + len, buffer_size - len,
-                    "SPDXVersion: SPDX-2.3\n");
-    len += snprintf(buffer + len, buffer_size - len,
-                    "DataLicense: CC0-1.0\n");
-    len += snprintf(buffer + len, buffer_size - len,
-                    "SPDXID: SPDXRef-DOCUMENT\n");
-    len += snprintf(buffer + len, buffer_size - len,
-                    "DocumentName: Embedded System SBOM\n");
-    len += snprintf(buffer + len, buffer_size - len,
-                    "DocumentNamespace: https://example.com/sbom\n");
-    len += snprintf(buffer + len, buffer_size - len,
-                    "Creator: Tool: SBOM-Generator-%s\n", SBOM_VERSION);
-    len += snprintf(buffer + len, buffer_size - len, "\n");
+    mutex_lock(&sbom_lock);
+    sbom_emit_spdx(&w);
+    mutex_unlock(&sbom_lock);
     
-    for (i = 0; i < component_count; i++) {
-        len += snprintf(buffer + len, buffer_size - len,
-                        "PackageName: %s\n", components[i].name);
-        len += snprintf(buffer + len, buffer_size - len,
-                        "SPDXID: SPDXRef-Package-%d\n", i);
-        len += snprintf(buffer + len, buffer_size - len,
-                        "PackageVersion: %s\n", components[i].version);
-        len += snprintf(buffer + len, buffer_size - len,
-                        "PackageLicenseDeclared: %s\n", components[i].license);
-        len += snprintf(buffer + len, buffer_size - len,
-                        "PackageSupplier: %s\n", components[i].supplier);
-        len += snprintf(buffer + len, buffer_size - len, "\n");
+    return sbom_writer_finish(&w);
+}
+
+/**
+ * Stream an SBOM to a file, from its current position
+ *
+ * Returns the length written or a negative error.
+ */
+int sbom_generate_file(struct file *file, bool cyclonedx)
+{
+    struct sbom_writer w;
+    int ret;
+    
+    if (!file) {
+        return -EINVAL;
     }
     
-    return len;
+    ret = sbom_writer_init(&w, file, NULL, 0);
+    if (ret) {
+        return ret;
+    }
+    
+    mutex_lock(&sbom_lock);
+    if (cyclonedx) {
+        sbom_emit_cyclonedx(&w);
+    } else {
+        sbom_emit_spdx(&w);
+    }
+    mutex_unlock(&sbom_lock);
+    
+    return sbom_writer_finish(&w);
+}
+
+static int __init sbom_generation_init(void)
+{
+    sbom_wq = alloc_workqueue("sbom_hash", WQ_UNBOUND, sbom_hash_workers);
+    if (!sbom_wq) {
+        return -ENOMEM;
+    }
+    
+    if (sbom_hash_cache) {
+        sbom_hash_cache_load();
+    }
+    
+    pr_info("SBOM generator %s\n", SBOM_VERSION);
+    return 0;
 }
 
+static void __exit sbom_generation_exit(void)
+{
+    struct sbom_hash_entry *e;
+    struct hlist_node *tmp;
+    int bkt, i;
+    
+    destroy_workqueue(sbom_wq);
+    
+    hash_for_each_safe(sbom_hash_cache_tbl, bkt, tmp, e, node) {
+        hash_del(&e->node);
+        kfree(e);
+    }
+    
+    for (i = 0; i < component_count; i++) {
+        kfree(components[i].path);
+    }
+    kvfree(components);
+}
+
+module_init(sbom_generation_init);
+module_exit(sbom_generation_exit);
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("jk1806");
 MODULE_DESCRIPTION("SBOM Generation");
 MODULE_VERSION(SBOM_VERSION);
-
@@ -0,0 +1,153 @@
+#!/bin/bash
+# Validate the placement from setup_placement.sh
+#
+# Usage: placement_bench.sh [pcap tx-interface [seconds]]
+#
+# Checks that the profiles' cores are disjoint and gone from the rest of
+# the system, that every thread in a profile is confined to its cores and
+# memory nodes, and that the interface's interrupts land on the network
+# I/O cores. Then loads the cores with noisy neighbours: context-switch
+# latency on a capture core, with the neighbours in the capture cpuset
+# and with them in the network I/O and crypto ones. Placement holds if
+# the second matches an idle core.
+#
+# Given a pcap and the interface cabled to the sensor, also runs the IDS
+# capture benchmark quiet and with the neighbours loaded; the drop rates
+# should match.
+
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+CGROOT="${CGROOT:-/sys/fs/cgroup}"
+PLACEMENT_ENV="${PLACEMENT_ENV:-/run/gateway-placement.env}"
+CAPTURE_BENCH="${CAPTURE_BENCH:-$SCRIPT_DIR/../../secure-iot-gateway/ids_ips/capture_bench.sh}"
+CTXSW_ITERS="${CTXSW_ITERS:-100000}"
+
+if [ ! -f "$PLACEMENT_ENV" ]; then
+    echo "Error: $PLACEMENT_ENV not found, run setup_placement.sh first"
+    exit 1
+fi
+. "$PLACEMENT_ENV"
+PROFILES="IDS_CAPTURE NET_IO CRYPTO"
+FAILED=0
+
+# A profile's variable from the plan, e.g. profile_var NET_IO CPU_LIST
+profile_var() {
+    eval echo "\$${1}_$2"
+}
+
+expand_cpus() {
+    echo "$1" | awk -F, '{ for (i = 1; i <= NF; i++) { n = split($i, r, "-")
+        for (c = r[1]; c <= r[n]; c++) print c } }'
+}
+
+# Is every CPU in list $1 one of the CPUs in list $2?
+within() {
+    [ -z "$(comm -23 <(expand_cpus "$1" | sort) <(expand_cpus "$2" | sort))" ]
+}
+
+fail() {
+    echo "FAIL: $*"
+    FAILED=1
+}
+
+echo "=== Placement checks ==="
+
+# No core in two profiles, and none left to the rest of the system
+list=""
+for p in $PROFILES; do
+    list="$list $(profile_var $p CPU_LIST)"
+done
+dups="$(echo $list | tr ' ' '\n' | sort -n | uniq -d | xargs)"
+[ -z "$dups" ] || fail "cpus $dups are in more than one profile"
+for cpu in $list; do
+    if within "$cpu" "$(cat "$CGROOT/cpuset.cpus.effective" 2>/dev/null)"; then
+        fail "cpu $cpu is still used by the rest of the system (partition not applied?)"
+        break
+    fi
+done
+
+for p in $PROFILES; do
+    cg="$(profile_var $p CGROUP)"
+    cpus="$(profile_var $p CPUS)"
+    mems="$(cat "$cg/cpuset.mems.effective" 2>/dev/null)"
+    echo "$p: cpus $cpus, mems $mems, partition $(cat "$cg/cpuset.cpus.partition" 2>/dev/null)"
+    for pid in $(cat "$cg/cgroup.procs" 2>/dev/null); do
+        for status in /proc/$pid/task/*/status; do
+            allowed="$(awk '/^Cpus_allowed_list/ { print $2 }' "$status" 2>/dev/null)"
+            allowed_mems="$(awk '/^Mems_allowed_list/ { print $2 }' "$status" 2>/dev/null)"
+            [ -n "$allowed" ] || continue
+            within "$allowed" "$cpus" || fail "$p: $status allows cpus $allowed"
+            within "$allowed_mems" "$mems" || fail "$p: $status allows mems $allowed_mems"
+        done
+    done
+done
+
+# /proc/interrupts lines end in the interface's queue names
+for irq in $(awk -v i="${GATEWAY_IFACE:-eth0}" '$NF ~ i { sub(":", "", $1); print $1 }' /proc/interrupts); do
+    eff="$(cat /proc/irq/$irq/effective_affinity_list 2>/dev/null)"
+    [ -z "$eff" ] || within "$eff" "$NET_IO_CPUS" || fail "irq $irq on cpus $eff, not on $NET_IO_CPUS"
+done
+
+[ $FAILED = 0 ] && echo "Placement: OK"
+
+# Run a command inside a cgroup
+in_cgroup() {
+    local cg="$1"
+    shift
+    bash -c 'echo $$ > "$1/cgroup.procs" && shift && exec "$@"' _ "$cg" "$@"
+}
+
+# One cache- and memory-thrashing neighbour on each core of the profiles
+# given, pinned since an isolated partition does not balance them out
+HOGS=""
+start_hogs() {
+    local p cpu
+    for p in "$@"; do
+        for cpu in $(profile_var $p CPU_LIST); do
+            bash -c 'echo $$ > "$1/cgroup.procs" && exec taskset -c "$2" dd if=/dev/zero of=/dev/null bs=4M' \
+                _ "$(profile_var $p CGROUP)" "$cpu" 2>/dev/null &
+            HOGS="$HOGS $!"
+        done
+    done
+    sleep 1
+}
+
+stop_hogs() {
+    [ -n "$HOGS" ] && kill $HOGS 2>/dev/null
+    wait $HOGS 2>/dev/null
+    HOGS=""
+}
+
+TMP="$(mktemp -d)"
+trap 'stop_hogs; rm -rf "$TMP"' EXIT
+if ! cc -O2 -o "$TMP/perf_probe" "$SCRIPT_DIR/../scripts/perf_probe.c" 2>/dev/null; then
+    echo "WARNING: no C compiler, skipping the latency probe"
+else
+    probe() {
+        in_cgroup "$IDS_CAPTURE_CGROUP" "$TMP/perf_probe" ctxsw $CTXSW_ITERS | awk '{ print $2 }'
+    }
+
+    echo "=== Noisy neighbours: capture core context switch ==="
+    IDLE="$(probe)"
+    start_hogs IDS_CAPTURE
+    SHARED="$(probe)"
+    stop_hogs
+    start_hogs NET_IO CRYPTO
+    PLACED="$(probe)"
+    stop_hogs
+
+    echo "idle:                 $IDLE ns"
+    echo "neighbours on core:   $SHARED ns"
+    echo "neighbours placed:    $PLACED ns"
+    awk -v i="$IDLE" -v p="$PLACED" 'BEGIN { if (i > 0) printf "placed vs idle: %+.1f%%\n", 100 * (p - i) / i }'
+fi
+
+if [ -n "$2" ]; then
+    echo "=== Capture drops, quiet ==="
+    bash "$CAPTURE_BENCH" "$1" "$2" "${3:-60}" | grep -i "drop rate\|dropped"
+    echo "=== Capture drops, network I/O and crypto cores loaded ==="
+    start_hogs NET_IO CRYPTO
+    bash "$CAPTURE_BENCH" "$1" "$2" "${3:-60}" | grep -i "drop rate\|dropped"
+    stop_hogs
+fi
+
+exit $FAILED
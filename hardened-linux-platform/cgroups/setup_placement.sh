@@ -0,0 +1,220 @@
+#!/bin/bash
+# CPU and memory placement for the gateway workers
+#
+# Usage: setup_placement.sh [-n] [config] [interface]
+#
+# Splits the CPUs between the profiles in the "placement" section of
+# cgroup_config.json: one cgroup v2 cpuset per profile under
+# /sys/fs/cgroup/gateway, each with whole cores (SMT siblings together)
+# and the memory nodes of those cores. Everything else in the system is
+# left on the housekeeping cores. A capture thread then never shares a
+# core, or its L1/L2, with a crypto worker or a noisy neighbour.
+#
+#   cores      a count, a percentage of the non-housekeeping cores, or
+#              "rest" for what the others leave
+#   node       "nic" takes cores on the interface's NUMA node first,
+#              "remote" the other nodes first, so capture and the NIC's
+#              interrupts share local memory and crypto is what crosses
+#   partition  "isolated" makes the cpuset a partition without load
+#              balancing (6.2+, "root" before that), for workers that pin
+#              their own threads
+#   irqs       the interface's interrupts are spread over these cores
+#
+# -n prints the plan without applying it. The plan is also written to
+# $PLACEMENT_ENV for start_ids.sh, which starts the IDS inside the
+# capture cpuset and pins its workers to those cores.
+
+set -e
+
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+SYSFS="${SYSFS:-/sys}"
+CGROOT="${CGROOT:-/sys/fs/cgroup}"
+CGROUP_PATH="$CGROOT/gateway"
+PLACEMENT_ENV="${PLACEMENT_ENV:-/run/gateway-placement.env}"
+
+DRY_RUN=0
+[ "$1" = "-n" ] && { DRY_RUN=1; shift; }
+CONFIG="${1:-$SCRIPT_DIR/cgroup_config.json}"
+IFACE="$2"
+
+# One line per profile: name cpus mems partition irqs processes
+plan() {
+    python3 - "$CONFIG" "$SYSFS" "$IFACE" <<'EOF'
+import glob, json, os, sys
+
+cfg = json.load(open(sys.argv[1]))["placement"]
+sysfs = sys.argv[2]
+iface = sys.argv[3] or cfg.get("interface", "eth0")
+
+def read(path, default=""):
+    try:
+        return open(path).read().strip()
+    except OSError:
+        return default
+
+def parse(s):
+    cpus = set()
+    for part in filter(None, s.split(",")):
+        lo, _, hi = part.partition("-")
+        cpus.update(range(int(lo), int(hi or lo) + 1))
+    return cpus
+
+def fmt(cpus):
+    out, cpus = [], sorted(cpus)
+    while cpus:
+        lo = hi = cpus.pop(0)
+        while cpus and cpus[0] == hi + 1:
+            hi = cpus.pop(0)
+        out.append(str(lo) if lo == hi else "%d-%d" % (lo, hi))
+    return ",".join(out)
+
+online = parse(read(sysfs + "/devices/system/cpu/online", "0"))
+
+def node_of(cpu):
+    nodes = glob.glob("%s/devices/system/cpu/cpu%d/node[0-9]*" % (sysfs, cpu))
+    return int(nodes[0].rsplit("node", 1)[1]) if nodes else 0
+
+nic_node = int(read("%s/class/net/%s/device/numa_node" % (sysfs, iface), "-1"))
+if nic_node < 0:
+    nic_node = node_of(min(online))
+
+# Whole physical cores, in CPU order
+cores = []
+for cpu in sorted(online):
+    sib = parse(read("%s/devices/system/cpu/cpu%d/topology/thread_siblings_list" % (sysfs, cpu),
+                     str(cpu))) & online
+    if min(sib) == cpu:
+        cores.append(sorted(sib))
+
+housekeeping = cores[:max(1, int(cfg.get("housekeeping_cores", 1)))]
+free = cores[len(housekeeping):]
+profiles = cfg["profiles"]
+
+counts, rest = {}, None
+for p in profiles:
+    want = str(p.get("cores", "rest"))
+    if want == "rest":
+        rest = p["name"]
+    elif want.endswith("%"):
+        counts[p["name"]] = max(1, len(free) * int(want[:-1]) // 100)
+    else:
+        counts[p["name"]] = max(1, int(want))
+if rest:
+    counts[rest] = len(free) - sum(counts.values())
+
+shared = len(free) < len(profiles) or min(counts.values()) < 1
+if shared:
+    sys.stderr.write("WARNING: %d cores for %d profiles, they share every core but the "
+                     "housekeeping ones and are not isolated\n" % (len(free), len(profiles)))
+
+print("housekeeping %s - - - -" % fmt(c for core in housekeeping for c in core))
+if not free:
+    free = housekeeping
+# Remote profiles take their cores first and "rest" goes last, so the
+# fixed-size local ones (interrupts) are the ones sure to get the NIC node
+assigned = {}
+for p in sorted(profiles, key=lambda p: (p.get("node") != "remote", p["name"] == rest)):
+    if shared:
+        mine = free
+    else:
+        local = p.get("node", "any")
+        order = sorted(free, key=lambda core: (
+            (node_of(core[0]) != nic_node) if local == "nic" else
+            (node_of(core[0]) == nic_node) if local == "remote" else 0, core[0]))
+        mine = order[:counts[p["name"]]]
+        free = [core for core in free if core not in mine]
+    assigned[p["name"]] = [c for core in mine for c in core]
+
+for p in profiles:
+    cpus = assigned[p["name"]]
+    print("%s %s %s %s %s %s" % (
+        p["name"], fmt(cpus), fmt(set(node_of(c) for c in cpus)),
+        "member" if shared else p.get("partition", "member"),
+        iface if p.get("irqs") else "-",
+        ",".join(p.get("processes", [])) or "-"))
+EOF
+}
+
+PLAN="$(plan)"
+
+echo "=== Placement ==="
+echo "$PLAN" | awk '{ printf "%-14s cpus %-20s mems %-6s %s\n", $1, $2, $3, ($4 == "-" ? "" : $4) }'
+[ $DRY_RUN = 1 ] && exit 0
+
+if [ ! -f "$CGROOT/cgroup.controllers" ]; then
+    echo "Error: needs the unified cgroup v2 hierarchy at $CGROOT"
+    exit 1
+fi
+
+# "2-4,6" -> "2 3 4 6"
+expand_cpus() {
+    echo "$1" | awk -F, '{ for (i = 1; i <= NF; i++) { n = split($i, r, "-")
+        for (c = r[1]; c <= r[n]; c++) print c } }'
+}
+
+# cpus, mems and partition type of one cpuset, warning when the kernel
+# refuses the partition (older kernels, CPUs not exclusive)
+cpuset_apply() {
+    local cg="$1" cpus="$2" mems="$3" partition="$4"
+
+    mkdir -p "$cg"
+    echo "$cpus" > "$cg/cpuset.cpus"
+    echo "$mems" > "$cg/cpuset.mems"
+    [ "$partition" = "member" ] && return 0
+    if ! echo "$partition" > "$cg/cpuset.cpus.partition" 2>/dev/null && [ "$partition" = isolated ]; then
+        echo root > "$cg/cpuset.cpus.partition" 2>/dev/null || true
+    fi
+    case "$(cat "$cg/cpuset.cpus.partition" 2>/dev/null)" in
+    *invalid*|member|"") echo "WARNING: $cg is not a $partition partition: $(cat "$cg/cpuset.cpus.partition" 2>/dev/null)" ;;
+    esac
+}
+
+# Every profile's cores in one partition, so the child partitions can
+# take them exclusively
+ALL_CPUS="$(echo "$PLAN" | awk '$1 != "housekeeping" { printf "%s%s", sep, $2; sep = "," }')"
+ALL_MEMS="$(echo "$PLAN" | awk '$1 != "housekeeping" { printf "%s%s", sep, $3; sep = "," }')"
+
+echo "+cpuset" > "$CGROOT/cgroup.subtree_control"
+cpuset_apply "$CGROUP_PATH" "$ALL_CPUS" "$ALL_MEMS" root
+echo "+cpuset" > "$CGROUP_PATH/cgroup.subtree_control"
+
+: > "$PLACEMENT_ENV"
+echo "$PLAN" | while read -r name cpus mems partition irqs procs; do
+    [ "$name" = housekeeping ] && continue
+    cg="$CGROUP_PATH/$name"
+    cpuset_apply "$cg" "$cpus" "$mems" "$partition"
+
+    # Already running workers; new ones are started in the cgroup. The
+    # kernel keeps 15 characters of a process name.
+    for proc in ${procs//,/ }; do
+        [ "$proc" = "-" ] && continue
+        for pid in $(pgrep -x "${proc:0:15}" || true); do
+            echo "$pid" > "$cg/cgroup.procs" || echo "WARNING: could not move $proc ($pid)"
+        done
+    done
+
+    # NIC queue interrupts round-robin over the cores, and irqbalance
+    # would move them straight back
+    if [ "$irqs" != "-" ]; then
+        cpu_list=($(expand_cpus "$cpus"))
+        n=0
+        for irq in $(ls "$SYSFS/class/net/$irqs/device/msi_irqs" 2>/dev/null ||
+                     awk -v i="$irqs" '$NF ~ i { sub(":", "", $1); print $1 }' /proc/interrupts); do
+            echo "${cpu_list[n % ${#cpu_list[@]}]}" > "/proc/irq/$irq/smp_affinity_list" 2>/dev/null || true
+            n=$((n + 1))
+        done
+        echo "  $n $irqs interrupts on cpus $cpus"
+        if pgrep -x irqbalance >/dev/null; then
+            echo "WARNING: irqbalance is running, stop it or ban these IRQs"
+        fi
+    fi
+
+    up="$(echo "$name" | tr 'a-z' 'A-Z')"
+    {
+        echo "${up}_CPUS=$cpus"
+        echo "${up}_CPU_LIST=\"$(expand_cpus "$cpus" | xargs)\""
+        echo "${up}_CGROUP=$cg"
+    } >> "$PLACEMENT_ENV"
+done
+
+echo "Placement applied, see $PLACEMENT_ENV"
@@ -5,6 +5,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <dirent.h>
 
 #define DEVICE_TREE_PATH "/proc/device-tree"
 #define MAX_DEVICE_TREE_SIZE (64 * 1024)
@@ -26,28 +27,277 @@ static dt_access_rule_t access_rules[] = {
 
 #define NUM_RULES (sizeof(access_rules) / sizeof(access_rules[0]))
 
-int check_device_tree_access(const char *dt_path, uint32_t operation, uint32_t user_id)
+/*
+ * Compiled decisions
+ *
+ * Rules are first-match path prefixes, which costs a scan of every rule
+ * per check. dt_access_compile() instead evaluates the rules once for
+ * every node under DEVICE_TREE_PATH and stores the winning rule's
+ * (owner, ops) in a hash table keyed by node path, so a check is one
+ * hash of the path and one probe; the requester is matched against the
+ * stored owner. A Bloom filter over the rule paths, probed with the
+ * path's prefix hashes at each rule length, rejects paths no rule
+ * covers before the table is touched. Nodes that appear after the
+ * compile (overlays) miss the table and fall back to the rule scan.
+ */
+#define DT_BLOOM_BITS 1024
+#define DT_MAX_PATH 512
+
+typedef struct {
+    char *path;             /* NULL for an empty slot */
+    uint64_t hash;
+    int rule;               /* index into access_rules, -1: no rule */
+} dt_decision_t;
+
+static struct {
+    dt_decision_t *slots;
+    size_t mask;
+    size_t count;
+    uint64_t bloom[DT_BLOOM_BITS / 64];
+    size_t rule_lengths[NUM_RULES];
+    size_t num_lengths;
+} dt_table;
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static uint64_t dt_hash(const char *s, size_t len)
 {
-    int i;
+    uint64_t h = FNV_OFFSET;
+    size_t i;
+    
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char)s[i]) * FNV_PRIME;
+    return h;
+}
+
+/* Three probes from one hash (Kirsch-Mitzenmacher double hashing) */
+static void dt_bloom_add(uint64_t h)
+{
+    uint32_t a = (uint32_t)h, b = (uint32_t)(h >> 32) | 1;
+    int k;
+    
+    for (k = 0; k < 3; k++, a += b)
+        dt_table.bloom[(a % DT_BLOOM_BITS) / 64] |= 1ULL << (a % 64);
+}
+
+static int dt_bloom_test(uint64_t h)
+{
+    uint32_t a = (uint32_t)h, b = (uint32_t)(h >> 32) | 1;
+    int k;
+    
+    for (k = 0; k < 3; k++, a += b) {
+        if (!(dt_table.bloom[(a % DT_BLOOM_BITS) / 64] & (1ULL << (a % 64)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* First rule whose path is a prefix of dt_path, or -1 */
+static int dt_rule_match(const char *dt_path)
+{
+    size_t i;
     
     for (i = 0; i < NUM_RULES; i++) {
         if (strncmp(access_rules[i].path, dt_path, strlen(access_rules[i].path)) == 0) {
-            /* Check user ID */
-            if (access_rules[i].user_id != 0 && access_rules[i].user_id != user_id) {
-                return -1; /* Access denied */
-            }
-            
-            /* Check operation */
-            if ((access_rules[i].allowed_ops & operation) == 0) {
-                return -1; /* Operation not allowed */
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+static int dt_decide(int rule, uint32_t operation, uint32_t user_id)
+{
+    if (rule < 0) {
+        return -1; /* Default: deny if no rule matches */
+    }
+    
+    /* Check user ID */
+    if (access_rules[rule].user_id != 0 && access_rules[rule].user_id != user_id) {
+        return -1; /* Access denied */
+    }
+    
+    /* Check operation */
+    if ((access_rules[rule].allowed_ops & operation) == 0) {
+        return -1; /* Operation not allowed */
+    }
+    
+    return 0; /* Access allowed */
+}
+
+static dt_decision_t *dt_table_find(const char *dt_path, uint64_t hash)
+{
+    size_t i;
+    
+    for (i = hash & dt_table.mask; dt_table.slots[i].path; i = (i + 1) & dt_table.mask) {
+        if (dt_table.slots[i].hash == hash && strcmp(dt_table.slots[i].path, dt_path) == 0) {
+            return &dt_table.slots[i];
+        }
+    }
+    return NULL;
+}
+
+static int dt_table_insert(const char *dt_path)
+{
+    uint64_t hash = dt_hash(dt_path, strlen(dt_path));
+    size_t i;
+    
+    if (dt_table_find(dt_path, hash)) {
+        return 0;
+    }
+    if ((dt_table.count + 1) * 2 > dt_table.mask + 1) {
+        /* Keep the load factor at 1/2 or below */
+        dt_decision_t *old = dt_table.slots;
+        size_t old_size = dt_table.mask + 1, j;
+        
+        dt_table.slots = calloc(old_size * 2, sizeof(*dt_table.slots));
+        if (!dt_table.slots) {
+            dt_table.slots = old;
+            return -1;
+        }
+        dt_table.mask = old_size * 2 - 1;
+        for (j = 0; j < old_size; j++) {
+            if (old[j].path) {
+                for (i = old[j].hash & dt_table.mask; dt_table.slots[i].path;
+                     i = (i + 1) & dt_table.mask)
+                    ;
+                dt_table.slots[i] = old[j];
             }
-            
-            return 0; /* Access allowed */
         }
+        free(old);
     }
     
-    /* Default: deny if no rule matches */
-    return -1;
+    for (i = hash & dt_table.mask; dt_table.slots[i].path; i = (i + 1) & dt_table.mask)
+        ;
+    dt_table.slots[i].path = strdup(dt_path);
+    if (!dt_table.slots[i].path) {
+        return -1;
+    }
+    dt_table.slots[i].hash = hash;
+    dt_table.slots[i].rule = dt_rule_match(dt_path);
+    dt_table.count++;
+    return 0;
+}
+
+/* Every node (directory) under the live tree; properties are files */
+static int dt_walk(char *path, size_t len, size_t root_len)
+{
+    struct dirent *de;
+    DIR *dir;
+    int ret = 0;
+    
+    dir = opendir(path);
+    if (!dir) {
+        return 0;
+    }
+    while (ret == 0 && (de = readdir(dir)) != NULL) {
+        size_t n;
+        
+        if (de->d_type != DT_DIR || de->d_name[0] == '.') {
+            continue;
+        }
+        n = snprintf(path + len, DT_MAX_PATH - len, "/%s", de->d_name);
+        if (n >= DT_MAX_PATH - len) {
+            continue;
+        }
+        ret = dt_table_insert(path + root_len);
+        if (ret == 0) {
+            ret = dt_walk(path, len + n, root_len);
+        }
+        path[len] = '\0';
+    }
+    closedir(dir);
+    return ret;
+}
+
+void dt_access_release(void)
+{
+    size_t i;
+    
+    if (dt_table.slots) {
+        for (i = 0; i <= dt_table.mask; i++)
+            free(dt_table.slots[i].path);
+        free(dt_table.slots);
+    }
+    memset(&dt_table, 0, sizeof(dt_table));
+}
+
+/*
+ * Compile the rules against the current device tree. Called on the
+ * first check; call again after an overlay is applied.
+ */
+int dt_access_compile(void)
+{
+    char path[DT_MAX_PATH];
+    size_t i, j, len;
+    
+    dt_access_release();
+    dt_table.slots = calloc(64, sizeof(*dt_table.slots));
+    if (!dt_table.slots) {
+        return -1;
+    }
+    dt_table.mask = 63;
+    
+    for (i = 0; i < NUM_RULES; i++) {
+        len = strlen(access_rules[i].path);
+        dt_bloom_add(dt_hash(access_rules[i].path, len));
+        for (j = 0; j < dt_table.num_lengths && dt_table.rule_lengths[j] != len; j++)
+            ;
+        if (j == dt_table.num_lengths) {
+            dt_table.rule_lengths[dt_table.num_lengths++] = len;
+        }
+        if (dt_table_insert(access_rules[i].path)) {
+            dt_access_release();
+            return -1;
+        }
+    }
+    
+    snprintf(path, sizeof(path), "%s", DEVICE_TREE_PATH);
+    if (dt_walk(path, strlen(path), strlen(path))) {
+        dt_access_release();
+        return -1;
+    }
+    return 0;
+}
+
+/* Bloom prefilter: could any rule path be a prefix of dt_path? */
+static int dt_maybe_covered(const char *dt_path, size_t path_len)
+{
+    size_t i, j;
+    
+    for (i = 0; i < dt_table.num_lengths; i++) {
+        size_t want = dt_table.rule_lengths[i];
+        uint64_t prefix = FNV_OFFSET;
+        
+        if (want > path_len) {
+            continue;
+        }
+        /* Rule lengths are few; hash each prefix afresh */
+        for (j = 0; j < want; j++)
+            prefix = (prefix ^ (unsigned char)dt_path[j]) * FNV_PRIME;
+        if (dt_bloom_test(prefix)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int check_device_tree_access(const char *dt_path, uint32_t operation, uint32_t user_id)
+{
+    const dt_decision_t *d;
+    size_t len;
+    
+    if (!dt_table.slots && dt_access_compile() != 0) {
+        return dt_decide(dt_rule_match(dt_path), operation, user_id);
+    }
+    
+    len = strlen(dt_path);
+    if (!dt_maybe_covered(dt_path, len)) {
+        return -1; /* No rule can match */
+    }
+    d = dt_table_find(dt_path, dt_hash(dt_path, len));
+    return dt_decide(d ? d->rule : dt_rule_match(dt_path), operation, user_id);
 }
 
 int read_device_tree_property(const char *dt_path, const char *property, 
@@ -1,32 +1,152 @@
 #!/bin/bash
 # Security benchmark script
+#
+# Usage: benchmark.sh                       CIS-style configuration checks
+#        benchmark.sh --perf [label]        measure the cost of the hardening
+#        benchmark.sh --compare <a> <b>     per-metric cost of b relative to a
+#
+# --perf results are saved as $BENCH_RESULTS/<label>.txt, one
+# "metric value unit" line each, so harden_system.sh --benchmark can take
+# a run before and after every step and report what each control costs.
 
-echo "Running security benchmarks..."
+BENCH_RESULTS="${BENCH_RESULTS:-/var/tmp/hardening-bench}"
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
 
-# CIS Benchmark checks
-echo "=== CIS Benchmark Checks ==="
+# Iterations, small enough for an embedded target to finish in a minute
+SYSCALL_ITERS="${SYSCALL_ITERS:-1000000}"
+CTXSW_ITERS="${CTXSW_ITERS:-100000}"
+OPEN_ITERS="${OPEN_ITERS:-100000}"
+EXEC_ITERS="${EXEC_ITERS:-200}"
+IO_MIB="${IO_MIB:-256}"
 
-# Check password policy
-if [ -f /etc/pam.d/common-password ]; then
-    echo "Password policy: OK"
-else
-    echo "Password policy: MISSING"
-fi
+# Plain storage, then the dm-crypt and fscrypt mounts from encryption/
+IO_DIRS="${IO_DIRS:-plain:/var/tmp dm_crypt:/mnt/encrypted fscrypt:/mnt/encrypted_dir}"
 
-# Check firewall
-if command -v iptables >/dev/null 2>&1; then
-    iptables -L | grep -q "INPUT.*DROP" && echo "Firewall: OK" || echo "Firewall: WARNING"
-fi
+cis_checks() {
+    echo "Running security benchmarks..."
 
-# Check SELinux
-if [ -f /etc/selinux/config ]; then
-    grep -q "SELINUX=enforcing" /etc/selinux/config && echo "SELinux: OK" || echo "SELinux: WARNING"
-fi
+    # CIS Benchmark checks
+    echo "=== CIS Benchmark Checks ==="
 
-# Check kernel parameters
-echo "=== Kernel Hardening ==="
-[ "$(sysctl -n kernel.randomize_va_space)" = "2" ] && echo "ASLR: OK" || echo "ASLR: WARNING"
-[ "$(sysctl -n kernel.kptr_restrict)" = "2" ] && echo "Kptr restrict: OK" || echo "Kptr restrict: WARNING"
+    # Check password policy
+    if [ -f /etc/pam.d/common-password ]; then
+        echo "Password policy: OK"
+    else
+        echo "Password policy: MISSING"
+    fi
 
-echo "Benchmark complete"
+    # Check firewall
+    if command -v iptables >/dev/null 2>&1; then
+        iptables -L | grep -q "INPUT.*DROP" && echo "Firewall: OK" || echo "Firewall: WARNING"
+    fi
 
+    # Check SELinux
+    if [ -f /etc/selinux/config ]; then
+        grep -q "SELINUX=enforcing" /etc/selinux/config && echo "SELinux: OK" || echo "SELinux: WARNING"
+    fi
+
+    # Check kernel parameters
+    echo "=== Kernel Hardening ==="
+    [ "$(sysctl -n kernel.randomize_va_space)" = "2" ] && echo "ASLR: OK" || echo "ASLR: WARNING"
+    [ "$(sysctl -n kernel.kptr_restrict)" = "2" ] && echo "Kptr restrict: OK" || echo "Kptr restrict: WARNING"
+
+    echo "Benchmark complete"
+}
+
+# Summed lookups and hits over all CPUs, or nothing without SELinux
+avc_stats() {
+    local stats=/sys/fs/selinux/avc/cache_stats
+    [ -r $stats ] && awk 'NR > 1 { l += $1; h += $2 } END { print l, h }' $stats
+}
+
+ima_count() {
+    local f
+    for f in /sys/kernel/security/ima/runtime_measurements_count \
+             /sys/kernel/security/integrity/ima/runtime_measurements_count; do
+        [ -r $f ] && { cat $f; return; }
+    done
+}
+
+perf_run() {
+    local label="$1" out probe tmp name dir before after
+    out="$BENCH_RESULTS/$label.txt"
+    tmp="$(mktemp -d)"
+    probe="$tmp/perf_probe"
+
+    if ! cc -O2 -o "$probe" "$SCRIPT_DIR/perf_probe.c" 2>/dev/null; then
+        echo "WARNING: no C compiler, build scripts/perf_probe.c for the target and set PERF_PROBE"
+        [ -x "${PERF_PROBE:-}" ] || { rm -rf "$tmp"; return 1; }
+        probe="$PERF_PROBE"
+    fi
+    mkdir -p "$BENCH_RESULTS"
+    : > "$out"
+
+    echo "=== Performance: $label ==="
+    {
+        "$probe" syscall $SYSCALL_ITERS
+        "$probe" ctxsw $CTXSW_ITERS
+
+        # Path walk and open under the LSM; the AVC serves most of it
+        before="$(avc_stats)"
+        "$probe" open /etc/passwd $OPEN_ITERS
+        after="$(avc_stats)"
+        if [ -n "$before" ] && [ -n "$after" ]; then
+            echo "$before $after" | awk '{
+                l = $3 - $1; h = $4 - $2
+                if (l > 0) printf "avc_hit_rate %.2f %%\n", 100 * h / l
+                printf "avc_lookups_per_open %.2f count\n", l / '"$OPEN_ITERS"' }'
+        fi
+
+        # New copies are measured by IMA on exec, the unchanged one only once
+        "$probe" exec /bin/true $EXEC_ITERS
+        before="$(ima_count)"
+        "$probe" exec-fresh /bin/true "$tmp" $EXEC_ITERS
+        after="$(ima_count)"
+        if [ -n "$before" ] && [ -n "$after" ]; then
+            echo "ima_measurements_per_exec $(awk "BEGIN { printf \"%.2f\", ($after - $before) / $EXEC_ITERS }") count"
+        fi
+
+        for entry in $IO_DIRS; do
+            name="${entry%%:*}"
+            dir="${entry#*:}"
+            [ -d "$dir" ] && [ -w "$dir" ] || continue
+            "$probe" write "$dir/perf_probe.io" $IO_MIB | sed "s/^/${name}_/"
+            "$probe" read "$dir/perf_probe.io" | sed "s/^/${name}_/"
+            rm -f "$dir/perf_probe.io"
+        done
+    } | tee "$out"
+
+    [ -n "$(avc_stats)" ] || echo "SELinux AVC stats: not available (AppArmor exports no cache counters)"
+    [ -n "$(ima_count)" ] || echo "IMA: not available, no measurement counts"
+    echo "Results saved to $out"
+    rm -rf "$tmp"
+}
+
+# Cost of b over a: time going up, or throughput and hit rate going down
+perf_compare() {
+    local a="$BENCH_RESULTS/$1.txt" b="$BENCH_RESULTS/$2.txt"
+
+    if [ ! -f "$a" ] || [ ! -f "$b" ]; then
+        echo "Error: results for $1 or $2 not found in $BENCH_RESULTS"
+        return 1
+    fi
+
+    echo "=== Cost of $2 relative to $1 ==="
+    awk 'NR == FNR { base[$1] = $2; next }
+        ($1 in base) && base[$1] > 0 {
+            cost = ($3 == "MiB/s" || $3 == "%") ? (base[$1] - $2) / base[$1] : ($2 - base[$1]) / base[$1]
+            printf "%-32s %12.2f -> %12.2f %-6s %+7.1f%%\n", $1, base[$1], $2, $3, 100 * cost
+        }' "$a" "$b"
+}
+
+case "$1" in
+--perf)
+    perf_run "${2:-$(date +%Y%m%d-%H%M%S)}"
+    ;;
+--compare)
+    perf_compare "$2" "$3"
+    ;;
+*)
+    cis_checks
+    ;;
+esac
@@ -1,12 +1,27 @@
 #!/bin/bash
 # System hardening script for embedded Linux
+# v1.4 - Added cpuset placement for the gateway workers (2026-10-14)
+# v1.3 - Added --benchmark, measuring the cost of each step (2026-10-14)
 # v1.2 - Added kernel parameter validation (2024-07-01)
 # v1.1 - Fixed SELinux check
 # v1.0 - Initial version
 
 set -e
 
+# --benchmark: a performance run before the first step and after each
+# one, then the cost of every step relative to the one before it
+BENCHMARK=0
+[ "$1" = "--benchmark" ] && BENCHMARK=1
+BENCH_STEPS=""
+
+bench_step() {
+    [ $BENCHMARK = 1 ] || return 0
+    ./scripts/benchmark.sh --perf "$1" || echo "WARNING: benchmark after $1 failed"
+    BENCH_STEPS="$BENCH_STEPS $1"
+}
+
 echo "Hardening Linux system..."
+bench_step baseline
 
 # Apply SELinux policies - optional, might not be available
 if command -v setsebool >/dev/null 2>&1; then
@@ -16,6 +31,7 @@ if command -v setsebool >/dev/null 2>&1; then
 else
     echo "WARNING: SELinux not available, skipping..."
 fi
+bench_step selinux
 
 # Setup namespaces - network isolation
 echo "Setting up namespaces..."
@@ -28,6 +44,7 @@ fi
 if [ -f "./namespaces/mountns_setup.sh" ]; then
     ./namespaces/mountns_setup.sh
 fi
+bench_step namespaces
 
 # Configure cgroups - resource limits
 echo "Configuring cgroups..."
@@ -36,18 +53,25 @@ if [ -f "./cgroups/setup_cgroups.sh" ]; then
 else
     echo "WARNING: cgroups setup script not found"
 fi
+# Gateway workers on their own cores and memory nodes
+if [ -f "./cgroups/setup_placement.sh" ]; then
+    ./cgroups/setup_placement.sh || echo "WARNING: CPU placement not applied"
+fi
+bench_step cgroups
 
 # Setup IMA/EVM - integrity measurement
 echo "Setting up IMA/EVM..."
 if [ -f "./ima_evm/evm_setup.sh" ]; then
     ./ima_evm/evm_setup.sh
 fi
+bench_step ima_evm
 
 # Enable encryption - dm-crypt for full disk encryption
 echo "Setting up encryption..."
 if [ -f "./encryption/setup_dm_crypt.sh" ]; then
     ./encryption/setup_dm_crypt.sh
 fi
+bench_step encryption
 
 # Apply kernel hardening - prevent information leaks
 echo "Applying kernel hardening parameters..."
@@ -57,6 +81,7 @@ sysctl -w kernel.kptr_restrict=2 || echo "WARNING: Failed to set kptr_restrict"
 sysctl -w kernel.dmesg_restrict=1 || echo "WARNING: Failed to set dmesg_restrict"
 # Disable unprivileged BPF
 sysctl -w kernel.unprivileged_bpf_disabled=1 || echo "WARNING: Failed to set bpf_disabled"
+bench_step kernel_params
 
 # Additional hardening (commented out - might break some apps)
 # sysctl -w kernel.unprivileged_userns_clone=0
@@ -64,3 +89,11 @@ sysctl -w kernel.unprivileged_bpf_disabled=1 || echo "WARNING: Failed to set bpf
 
 echo "System hardening complete!"
 
+if [ $BENCHMARK = 1 ]; then
+    prev=""
+    for step in $BENCH_STEPS; do
+        [ -n "$prev" ] && ./scripts/benchmark.sh --compare "$prev" "$step"
+        prev="$step"
+    done
+fi
+
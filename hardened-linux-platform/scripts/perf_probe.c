@@ -0,0 +1,367 @@
+/*
+ * Microbenchmarks for the cost of hardening controls
+ *
+ * Built and driven by benchmark.sh --perf. Each mode runs one loop and
+ * prints a single "name value unit" line, so runs before and after a
+ * hardening step can be compared key by key.
+ *
+ *   syscall <iters>                 getppid() round trip
+ *   ctxsw <iters>                   pipe ping-pong on one CPU
+ *   open <path> <iters>             open()+close(), path walk and LSM hooks
+ *   exec <path> <iters>             fork+exec+wait of an unchanged binary
+ *   exec-fresh <src> <dir> <iters>  same with a new copy each time, which
+ *                                   IMA has to measure (and appraise)
+ *   write <file> <MiB>              sequential write plus fsync
+ *   read <file>                     sequential read, bypassing the cache
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#define IO_BLOCK (1u << 20)
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void report(const char *name, double value, const char *unit)
+{
+    printf("%s %.2f %s\n", name, value, unit);
+}
+
+static int bench_syscall(long iters)
+{
+    uint64_t start;
+    long i;
+    
+    /* syscall() rather than getppid(), which a libc may cache */
+    for (i = 0; i < 1000; i++)
+        syscall(SYS_getppid);
+    start = now_ns();
+    for (i = 0; i < iters; i++)
+        syscall(SYS_getppid);
+    report("syscall_latency", (double)(now_ns() - start) / iters, "ns");
+    return 0;
+}
+
+/* Both ends on one CPU, so every hop is a switch rather than a wakeup IPI */
+static int bench_ctxsw(long iters)
+{
+    int ping[2], pong[2];
+    cpu_set_t set;
+    uint64_t start;
+    pid_t pid;
+    char c = 0;
+    long i;
+    
+    CPU_ZERO(&set);
+    CPU_SET(sched_getcpu() < 0 ? 0 : sched_getcpu(), &set);
+    if (sched_setaffinity(0, sizeof(set), &set)) {
+        perror("sched_setaffinity");
+        return -1;
+    }
+    if (pipe(ping) || pipe(pong)) {
+        perror("pipe");
+        return -1;
+    }
+    
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        /* Without its own copy of the write end, the child sees EOF */
+        close(ping[1]);
+        close(pong[0]);
+        while (read(ping[0], &c, 1) == 1) {
+            if (write(pong[1], &c, 1) != 1) {
+                break;
+            }
+        }
+        _exit(0);
+    }
+    close(ping[0]);
+    close(pong[1]);
+    
+    start = now_ns();
+    for (i = 0; i < iters; i++) {
+        if (write(ping[1], &c, 1) != 1 || read(pong[0], &c, 1) != 1) {
+            perror("pipe");
+            break;
+        }
+    }
+    /* Two switches per round trip */
+    report("context_switch", (double)(now_ns() - start) / (2 * (double)i), "ns");
+    
+    close(ping[1]);
+    close(pong[0]);
+    waitpid(pid, NULL, 0);
+    return i == iters ? 0 : -1;
+}
+
+static int bench_open(const char *path, long iters)
+{
+    uint64_t start;
+    long i;
+    int fd;
+    
+    start = now_ns();
+    for (i = 0; i < iters; i++) {
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            perror(path);
+            return -1;
+        }
+        close(fd);
+    }
+    report("open_close", (double)(now_ns() - start) / iters, "ns");
+    return 0;
+}
+
+/* fork+exec+wait of path, in ns; -1 if it did not run */
+static int64_t run_once(const char *path)
+{
+    char *const argv[] = { (char *)path, NULL };
+    uint64_t start = now_ns();
+    int status;
+    pid_t pid;
+    
+    pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        execv(path, argv);
+        _exit(127);
+    }
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+        return -1;
+    }
+    return now_ns() - start;
+}
+
+static int bench_exec(const char *path, long iters)
+{
+    uint64_t total = 0;
+    int64_t t;
+    long i;
+    
+    /* The first exec is measured; the rest hit IMA's per-inode cache */
+    if (run_once(path) < 0) {
+        fprintf(stderr, "%s: cannot execute\n", path);
+        return -1;
+    }
+    for (i = 0; i < iters; i++) {
+        t = run_once(path);
+        if (t < 0) {
+            return -1;
+        }
+        total += t;
+    }
+    report("exec_cached", total / 1000.0 / iters, "us");
+    return 0;
+}
+
+static int copy_file(const char *src, const char *dst)
+{
+    static char buf[65536];
+    ssize_t n;
+    int in, out, ret = 0;
+    
+    in = open(src, O_RDONLY);
+    if (in < 0) {
+        return -1;
+    }
+    out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        if (write(out, buf, n) != n) {
+            ret = -1;
+            break;
+        }
+    }
+    if (n < 0) {
+        ret = -1;
+    }
+    close(in);
+    close(out);
+    return ret;
+}
+
+/* Only the exec is timed, not the copy */
+static int bench_exec_fresh(const char *src, const char *dir, long iters)
+{
+    char path[4096];
+    uint64_t total = 0;
+    int64_t t;
+    long i;
+    
+    for (i = 0; i < iters; i++) {
+        snprintf(path, sizeof(path), "%s/perf_probe_exec.%ld", dir, i);
+        if (copy_file(src, path)) {
+            perror(path);
+            return -1;
+        }
+        t = run_once(path);
+        unlink(path);
+        if (t < 0) {
+            fprintf(stderr, "%s: cannot execute (noexec mount or appraisal?)\n", path);
+            return -1;
+        }
+        total += t;
+    }
+    report("exec_fresh", total / 1000.0 / iters, "us");
+    return 0;
+}
+
+static int bench_write(const char *file, long mib)
+{
+    uint64_t start, elapsed;
+    uint32_t x = 2463534242u;
+    uint32_t *buf;
+    size_t i;
+    long n;
+    int fd, ret = 0;
+    
+    /* Incompressible data, so nothing below the cipher can shortcut it */
+    buf = malloc(IO_BLOCK);
+    if (!buf) {
+        return -1;
+    }
+    for (i = 0; i < IO_BLOCK / sizeof(*buf); i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        buf[i] = x;
+    }
+    
+    fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        perror(file);
+        free(buf);
+        return -1;
+    }
+    start = now_ns();
+    for (n = 0; n < mib; n++) {
+        if (write(fd, buf, IO_BLOCK) != IO_BLOCK) {
+            perror(file);
+            ret = -1;
+            break;
+        }
+    }
+    if (!ret && fsync(fd)) {
+        perror(file);
+        ret = -1;
+    }
+    elapsed = now_ns() - start;
+    close(fd);
+    free(buf);
+    
+    if (!ret) {
+        report("write_throughput", mib / (elapsed / 1e9), "MiB/s");
+    }
+    return ret;
+}
+
+static int bench_read(const char *file)
+{
+    uint64_t start, total = 0;
+    void *buf;
+    ssize_t n;
+    int fd;
+    
+    if (posix_memalign(&buf, 4096, IO_BLOCK)) {
+        return -1;
+    }
+    /* O_DIRECT where the filesystem allows it, else drop the cached pages */
+    fd = open(file, O_RDONLY | O_DIRECT);
+    if (fd < 0 && errno == EINVAL) {
+        fd = open(file, O_RDONLY);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+    }
+    if (fd < 0) {
+        perror(file);
+        free(buf);
+        return -1;
+    }
+    
+    start = now_ns();
+    while ((n = read(fd, buf, IO_BLOCK)) > 0)
+        total += n;
+    if (n < 0) {
+        perror(file);
+        close(fd);
+        free(buf);
+        return -1;
+    }
+    report("read_throughput", (total / (double)IO_BLOCK) / ((now_ns() - start) / 1e9), "MiB/s");
+    
+    close(fd);
+    free(buf);
+    return 0;
+}
+
+/* Iteration and size arguments, at least 1 */
+static long count(const char *arg)
+{
+    long n = atol(arg);
+    
+    return n > 0 ? n : 1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s syscall|ctxsw <iters>\n"
+                    "       %s open|exec <path> <iters>\n"
+                    "       %s exec-fresh <src> <dir> <iters>\n"
+                    "       %s write <file> <MiB>\n"
+                    "       %s read <file>\n", prog, prog, prog, prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *mode = argc > 1 ? argv[1] : "";
+    int ret;
+    
+    if (!strcmp(mode, "syscall") && argc == 3) {
+        ret = bench_syscall(count(argv[2]));
+    } else if (!strcmp(mode, "ctxsw") && argc == 3) {
+        ret = bench_ctxsw(count(argv[2]));
+    } else if (!strcmp(mode, "open") && argc == 4) {
+        ret = bench_open(argv[2], count(argv[3]));
+    } else if (!strcmp(mode, "exec") && argc == 4) {
+        ret = bench_exec(argv[2], count(argv[3]));
+    } else if (!strcmp(mode, "exec-fresh") && argc == 5) {
+        ret = bench_exec_fresh(argv[2], argv[3], count(argv[4]));
+    } else if (!strcmp(mode, "write") && argc == 4) {
+        ret = bench_write(argv[2], count(argv[3]));
+    } else if (!strcmp(mode, "read") && argc == 3) {
+        ret = bench_read(argv[2]);
+    } else {
+        usage(argv[0]);
+        return 2;
+    }
+    
+    return ret ? 1 : 0;
+}
@@ -1,85 +1,244 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <time.h>
-#include <openssl/hmac.h>
-#include <openssl/sha.h>
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
 
 #define HMAC_KEY_SIZE 32
+#define HMAC_SIZE 32
+#define HMAC_HEX_SIZE 64
+#define HMAC_MAX_MESSAGE 256
 
-int generate_hmac_token(const char *device_id, const uint8_t *key, char **token)
+/*
+ * Token format: device_id:timestamp:hex(HMAC-SHA256(device_id:timestamp)).
+ * The context is keyed once; work is reset from it per token, so a check
+ * does no key setup, no allocation and no printf/scanf parsing.
+ */
+typedef struct {
+    EVP_MAC *mac;
+    EVP_MAC_CTX *keyed;
+    EVP_MAC_CTX *work;
+} hmac_auth_ctx_t;
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/* 0x10 | value for a hex digit of either case, 0 for anything else */
+static const uint8_t hex_values[256] = {
+    ['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14,
+    ['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19,
+    ['a'] = 0x1a, ['b'] = 0x1b, ['c'] = 0x1c, ['d'] = 0x1d, ['e'] = 0x1e, ['f'] = 0x1f,
+    ['A'] = 0x1a, ['B'] = 0x1b, ['C'] = 0x1c, ['D'] = 0x1d, ['E'] = 0x1e, ['F'] = 0x1f,
+};
+
+int hmac_auth_init(hmac_auth_ctx_t *ctx, const uint8_t *key)
 {
-    char message[256];
-    time_t now = time(NULL);
-    uint8_t hmac[32];
-    unsigned int hmac_len;
-    char hex_hmac[65];
-    int i;
+    OSSL_PARAM params[2];
     
-    /* Create message: device_id:timestamp */
-    snprintf(message, sizeof(message), "%s:%ld", device_id, now);
+    memset(ctx, 0, sizeof(*ctx));
     
-    /* Calculate HMAC */
-    HMAC(EVP_sha256(), key, HMAC_KEY_SIZE,
-         (unsigned char *)message, strlen(message),
-         hmac, &hmac_len);
+    params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+    params[1] = OSSL_PARAM_construct_end();
     
-    /* Convert to hex string */
-    for (i = 0; i < 32; i++) {
-        sprintf(hex_hmac + i * 2, "%02x", hmac[i]);
+    ctx->mac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+    if (!ctx->mac) {
+        return -1;
+    }
+    
+    ctx->keyed = EVP_MAC_CTX_new(ctx->mac);
+    if (!ctx->keyed || !EVP_MAC_init(ctx->keyed, key, HMAC_KEY_SIZE, params)) {
+        goto fail;
     }
-    hex_hmac[64] = '\0';
     
-    /* Create token: message:hmac */
-    *token = malloc(strlen(message) + 1 + 64 + 1);
-    sprintf(*token, "%s:%s", message, hex_hmac);
+    ctx->work = EVP_MAC_CTX_dup(ctx->keyed);
+    if (!ctx->work) {
+        goto fail;
+    }
     
     return 0;
+    
+fail:
+    EVP_MAC_CTX_free(ctx->keyed);
+    EVP_MAC_free(ctx->mac);
+    memset(ctx, 0, sizeof(*ctx));
+    return -1;
 }
 
-int verify_hmac_token(const char *token, const uint8_t *key, char **device_id)
+void hmac_auth_free(hmac_auth_ctx_t *ctx)
+{
+    EVP_MAC_CTX_free(ctx->work);
+    EVP_MAC_CTX_free(ctx->keyed);
+    EVP_MAC_free(ctx->mac);
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+static int token_mac(hmac_auth_ctx_t *ctx, const char *message, size_t len, uint8_t *out)
 {
-    char *message_part, *hmac_part;
-    char message[256];
-    uint8_t calculated_hmac[32], received_hmac[32];
-    unsigned int hmac_len;
+    size_t out_len;
+    
+    if (!EVP_MAC_init(ctx->work, NULL, 0, NULL) ||
+        !EVP_MAC_update(ctx->work, (const unsigned char *)message, len) ||
+        !EVP_MAC_final(ctx->work, out, &out_len, HMAC_SIZE) ||
+        out_len != HMAC_SIZE) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+/*
+ * Write the token for device_id at time now into out (NUL-terminated).
+ * Returns its length, or -1 if out is too small.
+ */
+int hmac_token_generate(hmac_auth_ctx_t *ctx, const char *device_id, time_t now,
+                        char *out, size_t out_size)
+{
+    size_t id_len = strlen(device_id);
+    char digits[20];
+    size_t n = 0;
+    size_t pos;
+    uint64_t ts = (uint64_t)now;
+    uint8_t hmac[HMAC_SIZE];
     int i;
     
-    /* Split token */
-    message_part = strdup(token);
-    hmac_part = strrchr(message_part, ':');
-    if (!hmac_part) {
-        free(message_part);
+    do {
+        digits[n++] = (char)('0' + ts % 10);
+        ts /= 10;
+    } while (ts);
+    
+    /* device_id:timestamp:hmac and the NUL */
+    if (id_len + 1 + n > HMAC_MAX_MESSAGE || id_len + 1 + n + 1 + HMAC_HEX_SIZE + 1 > out_size) {
         return -1;
     }
-    *hmac_part = '\0';
-    hmac_part++;
     
-    /* Convert hex HMAC to binary */
-    for (i = 0; i < 32; i++) {
-        sscanf(hmac_part + i * 2, "%2hhx", &received_hmac[i]);
+    memcpy(out, device_id, id_len);
+    pos = id_len;
+    out[pos++] = ':';
+    while (n) {
+        out[pos++] = digits[--n];
     }
     
-    /* Calculate HMAC */
-    strncpy(message, message_part, sizeof(message) - 1);
-    HMAC(EVP_sha256(), key, HMAC_KEY_SIZE,
-         (unsigned char *)message, strlen(message),
-         calculated_hmac, &hmac_len);
+    if (token_mac(ctx, out, pos, hmac) != 0) {
+        return -1;
+    }
+    
+    out[pos++] = ':';
+    for (i = 0; i < HMAC_SIZE; i++) {
+        out[pos++] = hex_digits[hmac[i] >> 4];
+        out[pos++] = hex_digits[hmac[i] & 0x0f];
+    }
+    out[pos] = '\0';
     
-    /* Compare */
-    if (memcmp(calculated_hmac, received_hmac, 32) != 0) {
-        free(message_part);
+    return (int)pos;
+}
+
+/*
+ * Check a token of token_len bytes. On success the device id is copied
+ * NUL-terminated into device_id and, if wanted, the timestamp into
+ * timestamp. The HMAC is compared in constant time.
+ */
+int hmac_token_verify(hmac_auth_ctx_t *ctx, const char *token, size_t token_len,
+                      char *device_id, size_t id_size, time_t *timestamp)
+{
+    uint8_t calculated_hmac[HMAC_SIZE], received_hmac[HMAC_SIZE];
+    const char *hex;
+    size_t message_len;
+    size_t id_len;
+    uint64_t ts = 0;
+    uint8_t bad = 0;
+    size_t i;
+    
+    /* message:hmac, the HMAC always 64 hex digits */
+    if (token_len < 3 + 1 + HMAC_HEX_SIZE || token[token_len - HMAC_HEX_SIZE - 1] != ':') {
+        return -1;
+    }
+    message_len = token_len - HMAC_HEX_SIZE - 1;
+    if (message_len > HMAC_MAX_MESSAGE) {
         return -1;
     }
     
-    /* Extract device_id */
-    char *colon = strchr(message, ':');
-    if (colon) {
-        *colon = '\0';
-        *device_id = strdup(message);
+    hex = token + message_len + 1;
+    for (i = 0; i < HMAC_SIZE; i++) {
+        uint8_t hi = hex_values[(uint8_t)hex[2 * i]];
+        uint8_t lo = hex_values[(uint8_t)hex[2 * i + 1]];
+    
+        bad |= (uint8_t)~(hi & lo) & 0x10;
+        received_hmac[i] = (uint8_t)((hi << 4) | (lo & 0x0f));
     }
+    if (bad) {
+        return -1;
+    }
+    
+    if (token_mac(ctx, token, message_len, calculated_hmac) != 0 ||
+        CRYPTO_memcmp(calculated_hmac, received_hmac, HMAC_SIZE) != 0) {
+        return -1;
+    }
+    
+    /* Split device_id:timestamp at the last colon */
+    id_len = message_len;
+    while (id_len > 0 && token[id_len - 1] != ':') {
+        id_len--;
+    }
+    if (id_len < 2 || id_len == message_len || id_len - 1 >= id_size) {
+        return -1;
+    }
+    for (i = id_len; i < message_len; i++) {
+        if (token[i] < '0' || token[i] > '9' || ts > (UINT64_MAX - 9) / 10) {
+            return -1;
+        }
+        ts = ts * 10 + (uint64_t)(token[i] - '0');
+    }
+    
+    memcpy(device_id, token, id_len - 1);
+    device_id[id_len - 1] = '\0';
+    if (timestamp) {
+        *timestamp = (time_t)ts;
+    }
+    
+    return 0;
+}
+
+int generate_hmac_token(const char *device_id, const uint8_t *key, char **token)
+{
+    hmac_auth_ctx_t ctx;
+    char buffer[HMAC_MAX_MESSAGE + 1 + HMAC_HEX_SIZE + 1];
+    int len;
+    
+    if (hmac_auth_init(&ctx, key) != 0) {
+        return -1;
+    }
+    len = hmac_token_generate(&ctx, device_id, time(NULL), buffer, sizeof(buffer));
+    hmac_auth_free(&ctx);
+    if (len < 0) {
+        return -1;
+    }
+    
+    *token = malloc((size_t)len + 1);
+    if (!*token) {
+        return -1;
+    }
+    memcpy(*token, buffer, (size_t)len + 1);
     
-    free(message_part);
     return 0;
 }
 
+int verify_hmac_token(const char *token, const uint8_t *key, char **device_id)
+{
+    hmac_auth_ctx_t ctx;
+    char id[HMAC_MAX_MESSAGE];
+    int ret;
+    
+    if (hmac_auth_init(&ctx, key) != 0) {
+        return -1;
+    }
+    ret = hmac_token_verify(&ctx, token, strlen(token), id, sizeof(id), NULL);
+    hmac_auth_free(&ctx);
+    if (ret != 0) {
+        return -1;
+    }
+    
+    *device_id = strdup(id);
+    return *device_id ? 0 : -1;
+}
@@ -2,10 +2,56 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <jwt.h>
+#include <openssl/sha.h>
 
 #define SECRET_KEY "your-secret-key-here"
 
+#define JWT_MAX_KEYS 16
+#define JWT_MAX_KID 64
+#define JWT_MAX_KEY_SIZE 4096
+#define JWT_CACHE_SIZE 1024
+#define JWT_CACHE_BUCKETS 2048      /* power of two */
+#define JWT_MAX_DEVICE_ID 64
+#define JWT_NONE 0xffffffffu
+
+/* Verification keys by kid, loaded once at startup */
+typedef struct {
+    char kid[JWT_MAX_KID];
+    jwt_alg_t alg;
+    unsigned char key[JWT_MAX_KEY_SIZE];
+    int key_len;
+} jwt_key_entry_t;
+
+/*
+ * Verified claims, keyed by SHA-256 of the whole token so a cached
+ * signature can never vouch for a different header or payload. Entries
+ * live until the token's exp; the least recently used one is replaced
+ * when the cache is full.
+ */
+typedef struct {
+    uint8_t token_hash[SHA256_DIGEST_LENGTH];
+    char device_id[JWT_MAX_DEVICE_ID];
+    time_t exp;
+    uint32_t hash_next;
+    uint32_t lru_prev;
+    uint32_t lru_next;
+    int used;
+} jwt_cache_entry_t;
+
+static jwt_key_entry_t jwt_keys[JWT_MAX_KEYS];
+static int jwt_key_count;
+
+static pthread_mutex_t jwt_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static jwt_cache_entry_t jwt_cache[JWT_CACHE_SIZE];
+static uint32_t jwt_buckets[JWT_CACHE_BUCKETS];
+static uint32_t jwt_lru_head = JWT_NONE;    /* most recently used */
+static uint32_t jwt_lru_tail = JWT_NONE;
+static uint32_t jwt_cache_count;
+static int jwt_cache_ready;
+
 int generate_jwt_token(const char *device_id, char **token)
 {
     jwt_t *jwt;
@@ -24,21 +70,195 @@ int generate_jwt_token(const char *device_id, char **token)
     return 0;
 }
 
+/* Register a verification key; call before serving requests */
+int jwt_add_key(const char *kid, jwt_alg_t alg, const unsigned char *key, size_t key_len)
+{
+    jwt_key_entry_t *entry;
+    
+    if (jwt_key_count == JWT_MAX_KEYS || strlen(kid) >= JWT_MAX_KID ||
+        key_len == 0 || key_len > JWT_MAX_KEY_SIZE) {
+        return -1;
+    }
+    
+    entry = &jwt_keys[jwt_key_count];
+    strcpy(entry->kid, kid);
+    entry->alg = alg;
+    memcpy(entry->key, key, key_len);
+    entry->key_len = (int)key_len;
+    jwt_key_count++;
+    
+    return 0;
+}
+
+/* Picks the key by the header's kid, refusing one of another algorithm */
+static int jwt_key_provider(const jwt_t *jwt, jwt_key_t *key)
+{
+    const char *kid = jwt_get_header((jwt_t *)jwt, "kid");
+    int i;
+    
+    if (!kid) {
+        /* Tokens from generate_jwt_token carry no kid */
+        if (jwt_get_alg(jwt) != JWT_ALG_HS256) {
+            return -1;
+        }
+        key->jwt_key = (const unsigned char *)SECRET_KEY;
+        key->jwt_key_len = (int)strlen(SECRET_KEY);
+        return 0;
+    }
+    
+    for (i = 0; i < jwt_key_count; i++) {
+        if (strcmp(jwt_keys[i].kid, kid) == 0) {
+            if (jwt_get_alg(jwt) != jwt_keys[i].alg) {
+                return -1;
+            }
+            key->jwt_key = jwt_keys[i].key;
+            key->jwt_key_len = jwt_keys[i].key_len;
+            return 0;
+        }
+    }
+    
+    return -1;
+}
+
+static void cache_init(void)
+{
+    memset(jwt_buckets, 0xff, sizeof(jwt_buckets));
+    jwt_cache_ready = 1;
+}
+
+static uint32_t cache_bucket(const uint8_t *hash)
+{
+    return ((uint32_t)hash[0] | ((uint32_t)hash[1] << 8) |
+            ((uint32_t)hash[2] << 16) | ((uint32_t)hash[3] << 24)) & (JWT_CACHE_BUCKETS - 1);
+}
+
+static void lru_unlink(uint32_t i)
+{
+    jwt_cache_entry_t *e = &jwt_cache[i];
+    
+    if (e->lru_prev != JWT_NONE) {
+        jwt_cache[e->lru_prev].lru_next = e->lru_next;
+    } else {
+        jwt_lru_head = e->lru_next;
+    }
+    if (e->lru_next != JWT_NONE) {
+        jwt_cache[e->lru_next].lru_prev = e->lru_prev;
+    } else {
+        jwt_lru_tail = e->lru_prev;
+    }
+}
+
+static void lru_push_front(uint32_t i)
+{
+    jwt_cache[i].lru_prev = JWT_NONE;
+    jwt_cache[i].lru_next = jwt_lru_head;
+    if (jwt_lru_head != JWT_NONE) {
+        jwt_cache[jwt_lru_head].lru_prev = i;
+    } else {
+        jwt_lru_tail = i;
+    }
+    jwt_lru_head = i;
+}
+
+static void cache_remove(uint32_t i)
+{
+    uint32_t *link = &jwt_buckets[cache_bucket(jwt_cache[i].token_hash)];
+    
+    while (*link != i) {
+        link = &jwt_cache[*link].hash_next;
+    }
+    *link = jwt_cache[i].hash_next;
+    lru_unlink(i);
+    jwt_cache[i].used = 0;
+    jwt_cache_count--;
+}
+
+/* Caller holds jwt_cache_lock */
+static uint32_t cache_find(const uint8_t *hash)
+{
+    uint32_t i = jwt_buckets[cache_bucket(hash)];
+    
+    while (i != JWT_NONE && memcmp(jwt_cache[i].token_hash, hash, SHA256_DIGEST_LENGTH) != 0) {
+        i = jwt_cache[i].hash_next;
+    }
+    return i;
+}
+
+static void cache_insert(const uint8_t *hash, const char *device_id, time_t exp)
+{
+    uint32_t i, bucket;
+    
+    if (cache_find(hash) != JWT_NONE) {
+        return;
+    }
+    
+    if (jwt_cache_count == JWT_CACHE_SIZE) {
+        i = jwt_lru_tail;
+        cache_remove(i);
+    } else {
+        for (i = 0; jwt_cache[i].used; i++) {
+        }
+    }
+    
+    memcpy(jwt_cache[i].token_hash, hash, SHA256_DIGEST_LENGTH);
+    strcpy(jwt_cache[i].device_id, device_id);
+    jwt_cache[i].exp = exp;
+    jwt_cache[i].used = 1;
+    
+    bucket = cache_bucket(hash);
+    jwt_cache[i].hash_next = jwt_buckets[bucket];
+    jwt_buckets[bucket] = i;
+    lru_push_front(i);
+    jwt_cache_count++;
+}
+
 int verify_jwt_token(const char *token, char **device_id)
 {
     jwt_t *jwt;
     const char *val;
+    uint8_t hash[SHA256_DIGEST_LENGTH];
+    time_t now = time(NULL);
+    time_t exp;
+    uint32_t i;
+    
+    SHA256((const unsigned char *)token, strlen(token), hash);
     
-    if (jwt_decode(&jwt, token, (unsigned char *)SECRET_KEY, strlen(SECRET_KEY)) != 0) {
+    /* Seen and verified before, and not expired since */
+    pthread_mutex_lock(&jwt_cache_lock);
+    if (!jwt_cache_ready) {
+        cache_init();
+    }
+    i = cache_find(hash);
+    if (i != JWT_NONE) {
+        if (jwt_cache[i].exp > now) {
+            *device_id = strdup(jwt_cache[i].device_id);
+            lru_unlink(i);
+            lru_push_front(i);
+            pthread_mutex_unlock(&jwt_cache_lock);
+            return *device_id ? 0 : -1;
+        }
+        cache_remove(i);
+    }
+    pthread_mutex_unlock(&jwt_cache_lock);
+    
+    if (jwt_decode_2(&jwt, token, jwt_key_provider) != 0) {
         return -1;
     }
     
+    /* A cached entry is only good until exp, so a token needs one */
+    exp = (time_t)jwt_get_grant_int(jwt, "exp");
     val = jwt_get_grant(jwt, "device_id");
-    if (val) {
-        *device_id = strdup(val);
+    if (exp <= now || !val || strlen(val) >= JWT_MAX_DEVICE_ID) {
+        jwt_free(jwt);
+        return -1;
     }
     
+    *device_id = strdup(val);
+    
+    pthread_mutex_lock(&jwt_cache_lock);
+    cache_insert(hash, val, exp);
+    pthread_mutex_unlock(&jwt_cache_lock);
+    
     jwt_free(jwt);
-    return 0;
+    return *device_id ? 0 : -1;
 }
-
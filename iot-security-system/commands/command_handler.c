@@ -2,37 +2,143 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
-#include <openssl/hmac.h>
-#include <openssl/sha.h>
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
 
 #define HMAC_KEY_SIZE 32
+#define HMAC_SIZE 32
 #define MAX_COMMAND_SIZE 1024
+#define COMMAND_HEADER_SIZE 7   /* command_id, timestamp, data_len */
 
 typedef struct {
     uint8_t command_id;
     uint32_t timestamp;
+    uint16_t data_len;          /* bytes of data in use, only these are authenticated */
     uint8_t data[MAX_COMMAND_SIZE];
-    uint8_t hmac[32];
+    uint8_t hmac[HMAC_SIZE];
 } command_t;
 
-int verify_command_signature(const command_t *cmd, const uint8_t *key)
+/*
+ * Keyed once, reused for every command. keyed holds HMAC-SHA256
+ * with the key already absorbed; work is a dup of it that is reset with
+ * EVP_MAC_init(NULL key) per command, which restores the keyed state
+ * without hashing the key pads again.
+ */
+typedef struct {
+    EVP_MAC *mac;
+    EVP_MAC_CTX *keyed;
+    EVP_MAC_CTX *work;
+} command_verifier_t;
+
+int command_verifier_init(command_verifier_t *verifier, const uint8_t *key)
 {
-    uint8_t calculated_hmac[32];
-    unsigned int hmac_len;
+    OSSL_PARAM params[2];
+    
+    memset(verifier, 0, sizeof(*verifier));
+    
+    params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+    params[1] = OSSL_PARAM_construct_end();
+    
+    verifier->mac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+    if (!verifier->mac) {
+        return -1;
+    }
+    
+    verifier->keyed = EVP_MAC_CTX_new(verifier->mac);
+    if (!verifier->keyed ||
+        !EVP_MAC_init(verifier->keyed, key, HMAC_KEY_SIZE, params)) {
+        goto fail;
+    }
+    
+    verifier->work = EVP_MAC_CTX_dup(verifier->keyed);
+    if (!verifier->work) {
+        goto fail;
+    }
+    
+    return 0;
     
-    /* Calculate HMAC over command data */
-    HMAC(EVP_sha256(), key, HMAC_KEY_SIZE,
-         (unsigned char *)cmd, sizeof(command_t) - 32,
-         calculated_hmac, &hmac_len);
+fail:
+    EVP_MAC_CTX_free(verifier->keyed);
+    EVP_MAC_free(verifier->mac);
+    memset(verifier, 0, sizeof(*verifier));
+    return -1;
+}
+
+void command_verifier_free(command_verifier_t *verifier)
+{
+    EVP_MAC_CTX_free(verifier->work);
+    EVP_MAC_CTX_free(verifier->keyed);
+    EVP_MAC_free(verifier->mac);
+    memset(verifier, 0, sizeof(*verifier));
+}
+
+/* HMAC over the header fields and the used data bytes, never the padding */
+static int command_mac(command_verifier_t *verifier, const command_t *cmd, uint8_t *out)
+{
+    uint8_t header[COMMAND_HEADER_SIZE];
+    size_t out_len;
+    
+    if (cmd->data_len > MAX_COMMAND_SIZE) {
+        return -1;
+    }
+    
+    /* Fixed big-endian encoding, independent of struct layout */
+    header[0] = cmd->command_id;
+    header[1] = (uint8_t)(cmd->timestamp >> 24);
+    header[2] = (uint8_t)(cmd->timestamp >> 16);
+    header[3] = (uint8_t)(cmd->timestamp >> 8);
+    header[4] = (uint8_t)cmd->timestamp;
+    header[5] = (uint8_t)(cmd->data_len >> 8);
+    header[6] = (uint8_t)cmd->data_len;
+    
+    if (!EVP_MAC_init(verifier->work, NULL, 0, NULL) ||
+        !EVP_MAC_update(verifier->work, header, sizeof(header)) ||
+        !EVP_MAC_update(verifier->work, cmd->data, cmd->data_len) ||
+        !EVP_MAC_final(verifier->work, out, &out_len, HMAC_SIZE) ||
+        out_len != HMAC_SIZE) {
+        return -1;
+    }
     
-    /* Compare HMACs */
-    if (memcmp(cmd->hmac, calculated_hmac, 32) != 0) {
+    return 0;
+}
+
+int sign_command(command_verifier_t *verifier, command_t *cmd)
+{
+    return command_mac(verifier, cmd, cmd->hmac);
+}
+
+int verify_command_hmac(command_verifier_t *verifier, const command_t *cmd)
+{
+    uint8_t calculated_hmac[HMAC_SIZE];
+    
+    if (command_mac(verifier, cmd, calculated_hmac) != 0) {
+        return -1;
+    }
+    
+    /* Compare HMACs in constant time */
+    if (CRYPTO_memcmp(cmd->hmac, calculated_hmac, HMAC_SIZE) != 0) {
         return -1; /* Invalid signature */
     }
     
     return 0;
 }
 
+/* One-off check; keeps a verifier for the duration of a single command */
+int verify_command_signature(const command_t *cmd, const uint8_t *key)
+{
+    command_verifier_t verifier;
+    int ret;
+    
+    if (command_verifier_init(&verifier, key) != 0) {
+        return -1;
+    }
+    
+    ret = verify_command_hmac(&verifier, cmd);
+    command_verifier_free(&verifier);
+    return ret;
+}
+
 int execute_command(const command_t *cmd)
 {
     switch (cmd->command_id) {
@@ -63,3 +169,32 @@ int handle_command(const command_t *cmd, const uint8_t *key)
     return execute_command(cmd);
 }
 
+/*
+ * Drain a queue of commands with one keyed verifier. All of them are
+ * authenticated first, then the valid ones run in queue order, so a
+ * burst costs one key setup and the MAC work stays in one tight loop.
+ * results[i] is 0 if command i ran successfully, -1 otherwise.
+ * Returns the number of commands that ran successfully.
+ */
+int handle_command_batch(command_verifier_t *verifier, const command_t *cmds,
+                         size_t count, int *results)
+{
+    size_t i;
+    int executed = 0;
+    
+    for (i = 0; i < count; i++) {
+        results[i] = verify_command_hmac(verifier, &cmds[i]);
+    }
+    
+    for (i = 0; i < count; i++) {
+        if (results[i] != 0) {
+            continue;
+        }
+        results[i] = execute_command(&cmds[i]);
+        if (results[i] == 0) {
+            executed++;
+        }
+    }
+    
+    return executed;
+}
@@ -1,49 +1,263 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
 #include <openssl/ec.h>
 #include <openssl/ecdh.h>
 #include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
 #include <openssl/sha.h>
 
-int derive_session_key(const unsigned char *shared_secret, size_t secret_len,
-                      const unsigned char *salt, size_t salt_len,
-                      unsigned char *session_key, size_t key_len)
+#define SESSION_MASTER_SIZE 32
+#define SESSION_NONCE_SIZE 16
+#define SESSION_TICKET_KEY_SIZE 32
+#define SESSION_TICKET_NAME_SIZE 16
+#define SESSION_TICKET_IV_SIZE 12
+#define SESSION_TICKET_TAG_SIZE 16
+#define SESSION_MAX_DEVICE_ID 64
+#define SESSION_TICKET_LIFETIME 86400  /* seconds */
+/* name, iv, expiry, id length, id, master, tag */
+#define SESSION_TICKET_MAX_SIZE (SESSION_TICKET_NAME_SIZE + SESSION_TICKET_IV_SIZE + 8 + 1 + \
+                                 SESSION_MAX_DEVICE_ID + SESSION_MASTER_SIZE + SESSION_TICKET_TAG_SIZE)
+
+/*
+ * Resumption state. A full handshake does the ECDH once and turns the
+ * shared secret into a master secret; the gateway hands the device a
+ * ticket, the master secret and device id sealed with AES-256-GCM under
+ * the ticket key. A reconnecting device presents the ticket and fresh
+ * nonces, and the session key comes from the master secret via HKDF -
+ * no point multiplication. The ticket key lives outside the process
+ * (secure storage), so tickets survive a gateway reboot; the previous
+ * key is kept so rotating it does not invalidate tickets in flight.
+ */
+typedef struct {
+    uint8_t name[SESSION_TICKET_NAME_SIZE];
+    uint8_t key[SESSION_TICKET_KEY_SIZE];
+    int valid;
+} session_ticket_key_t;
+
+typedef struct {
+    EVP_KDF *hkdf;
+    EVP_CIPHER *aead;
+    session_ticket_key_t current;
+    session_ticket_key_t previous;
+} session_cache_t;
+
+/* One HKDF fetch per process, not per derivation */
+static EVP_KDF *session_hkdf;
+
+static int hkdf_derive(EVP_KDF *kdf, const unsigned char *secret, size_t secret_len,
+                       const unsigned char *salt, size_t salt_len,
+                       const char *info, unsigned char *out, size_t out_len)
 {
-    EVP_PKEY_CTX *ctx;
+    EVP_KDF_CTX *ctx;
+    OSSL_PARAM params[5], *p = params;
     int ret;
     
-    ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    ctx = EVP_KDF_CTX_new(kdf);
     if (!ctx) {
         return -1;
     }
     
-    if (EVP_PKEY_derive_init(ctx) <= 0) {
-        EVP_PKEY_CTX_free(ctx);
-        return -1;
+    *p++ = OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST, "SHA256", 0);
+    *p++ = OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_KEY, (void *)secret, secret_len);
+    *p++ = OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SALT, (void *)salt, salt_len);
+    if (info) {
+        *p++ = OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_INFO, (void *)info, strlen(info));
+    }
+    *p = OSSL_PARAM_construct_end();
+    
+    ret = EVP_KDF_derive(ctx, out, out_len, params) > 0 ? 0 : -1;
+    EVP_KDF_CTX_free(ctx);
+    return ret;
+}
+
+int derive_session_key(const unsigned char *shared_secret, size_t secret_len,
+                      const unsigned char *salt, size_t salt_len,
+                      unsigned char *session_key, size_t key_len)
+{
+    if (!session_hkdf) {
+        session_hkdf = EVP_KDF_fetch(NULL, "HKDF", NULL);
+        if (!session_hkdf) {
+            return -1;
+        }
     }
     
-    if (EVP_PKEY_CTX_set_hkdf_md(ctx, EVP_sha256()) <= 0) {
-        EVP_PKEY_CTX_free(ctx);
+    return hkdf_derive(session_hkdf, shared_secret, secret_len, salt, salt_len,
+                       NULL, session_key, key_len);
+}
+
+static void ticket_key_set(session_ticket_key_t *slot, const uint8_t *key)
+{
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    
+    /* The name only says which key sealed a ticket */
+    SHA256(key, SESSION_TICKET_KEY_SIZE, digest);
+    memcpy(slot->name, digest, SESSION_TICKET_NAME_SIZE);
+    memcpy(slot->key, key, SESSION_TICKET_KEY_SIZE);
+    slot->valid = 1;
+}
+
+int session_cache_init(session_cache_t *cache, const uint8_t *ticket_key)
+{
+    memset(cache, 0, sizeof(*cache));
+    
+    cache->hkdf = EVP_KDF_fetch(NULL, "HKDF", NULL);
+    cache->aead = EVP_CIPHER_fetch(NULL, "AES-256-GCM", NULL);
+    if (!cache->hkdf || !cache->aead) {
+        EVP_KDF_free(cache->hkdf);
+        EVP_CIPHER_free(cache->aead);
         return -1;
     }
     
-    if (EVP_PKEY_CTX_set1_hkdf_salt(ctx, salt, salt_len) <= 0) {
-        EVP_PKEY_CTX_free(ctx);
+    ticket_key_set(&cache->current, ticket_key);
+    return 0;
+}
+
+/* New tickets use the new key; ones sealed with the old key still resume */
+void session_cache_rotate(session_cache_t *cache, const uint8_t *ticket_key)
+{
+    cache->previous = cache->current;
+    ticket_key_set(&cache->current, ticket_key);
+}
+
+void session_cache_free(session_cache_t *cache)
+{
+    EVP_KDF_free(cache->hkdf);
+    EVP_CIPHER_free(cache->aead);
+    OPENSSL_cleanse(cache, sizeof(*cache));
+}
+
+/* Full handshake: the ECDH shared secret becomes the resumable master secret */
+int session_master_from_ecdh(session_cache_t *cache,
+                             const unsigned char *shared_secret, size_t secret_len,
+                             const unsigned char *salt, size_t salt_len,
+                             unsigned char *master)
+{
+    return hkdf_derive(cache->hkdf, shared_secret, secret_len, salt, salt_len,
+                       "session master", master, SESSION_MASTER_SIZE);
+}
+
+int session_ticket_issue(session_cache_t *cache, const unsigned char *master,
+                         const char *device_id, time_t now,
+                         unsigned char *ticket, size_t *ticket_len)
+{
+    unsigned char plain[8 + 1 + SESSION_MAX_DEVICE_ID + SESSION_MASTER_SIZE];
+    unsigned char *iv = ticket + SESSION_TICKET_NAME_SIZE;
+    unsigned char *sealed = iv + SESSION_TICKET_IV_SIZE;
+    size_t id_len = strlen(device_id);
+    uint64_t expiry = (uint64_t)now + SESSION_TICKET_LIFETIME;
+    size_t plain_len;
+    EVP_CIPHER_CTX *ctx;
+    int len, ok;
+    int i;
+    
+    if (id_len == 0 || id_len > SESSION_MAX_DEVICE_ID) {
         return -1;
     }
     
-    if (EVP_PKEY_CTX_set1_hkdf_key(ctx, shared_secret, secret_len) <= 0) {
-        EVP_PKEY_CTX_free(ctx);
+    for (i = 0; i < 8; i++) {
+        plain[i] = (unsigned char)(expiry >> (56 - 8 * i));
+    }
+    plain[8] = (unsigned char)id_len;
+    memcpy(plain + 9, device_id, id_len);
+    memcpy(plain + 9 + id_len, master, SESSION_MASTER_SIZE);
+    plain_len = 9 + id_len + SESSION_MASTER_SIZE;
+    
+    memcpy(ticket, cache->current.name, SESSION_TICKET_NAME_SIZE);
+    if (RAND_bytes(iv, SESSION_TICKET_IV_SIZE) != 1) {
+        OPENSSL_cleanse(plain, sizeof(plain));
         return -1;
     }
     
-    if (EVP_PKEY_derive(ctx, session_key, &key_len) <= 0) {
-        EVP_PKEY_CTX_free(ctx);
+    ctx = EVP_CIPHER_CTX_new();
+    ok = ctx &&
+         EVP_EncryptInit_ex2(ctx, cache->aead, cache->current.key, iv, NULL) == 1 &&
+         /* name and iv are authenticated, not encrypted */
+         EVP_EncryptUpdate(ctx, NULL, &len, ticket,
+                           SESSION_TICKET_NAME_SIZE + SESSION_TICKET_IV_SIZE) == 1 &&
+         EVP_EncryptUpdate(ctx, sealed, &len, plain, (int)plain_len) == 1 &&
+         EVP_EncryptFinal_ex(ctx, sealed + len, &len) == 1 &&
+         EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, SESSION_TICKET_TAG_SIZE,
+                             sealed + plain_len) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+    OPENSSL_cleanse(plain, sizeof(plain));
+    if (!ok) {
         return -1;
     }
     
-    EVP_PKEY_CTX_free(ctx);
+    *ticket_len = SESSION_TICKET_NAME_SIZE + SESSION_TICKET_IV_SIZE + plain_len +
+                  SESSION_TICKET_TAG_SIZE;
     return 0;
 }
 
+/*
+ * Abbreviated handshake: open the ticket, check it belongs to device_id
+ * and has not expired, and derive the session key from the master
+ * secret and both sides' fresh nonces, so no two resumptions share a
+ * key. Any failure means a full ECDH handshake instead.
+ */
+int session_ticket_resume(session_cache_t *cache, const unsigned char *ticket, size_t ticket_len,
+                          const char *device_id, time_t now,
+                          const unsigned char *client_nonce, const unsigned char *server_nonce,
+                          unsigned char *session_key, size_t key_len)
+{
+    unsigned char plain[8 + 1 + SESSION_MAX_DEVICE_ID + SESSION_MASTER_SIZE];
+    unsigned char nonces[2 * SESSION_NONCE_SIZE];
+    const unsigned char *iv = ticket + SESSION_TICKET_NAME_SIZE;
+    const unsigned char *sealed = iv + SESSION_TICKET_IV_SIZE;
+    const session_ticket_key_t *slot;
+    size_t overhead = SESSION_TICKET_NAME_SIZE + SESSION_TICKET_IV_SIZE + SESSION_TICKET_TAG_SIZE;
+    size_t plain_len;
+    uint64_t expiry = 0;
+    EVP_CIPHER_CTX *ctx;
+    int len, ok, ret;
+    int i;
+    
+    if (ticket_len <= overhead + 9 + SESSION_MASTER_SIZE || ticket_len > SESSION_TICKET_MAX_SIZE) {
+        return -1;
+    }
+    plain_len = ticket_len - overhead;
+    
+    if (memcmp(ticket, cache->current.name, SESSION_TICKET_NAME_SIZE) == 0) {
+        slot = &cache->current;
+    } else if (cache->previous.valid &&
+               memcmp(ticket, cache->previous.name, SESSION_TICKET_NAME_SIZE) == 0) {
+        slot = &cache->previous;
+    } else {
+        return -1;
+    }
+    
+    ctx = EVP_CIPHER_CTX_new();
+    ok = ctx &&
+         EVP_DecryptInit_ex2(ctx, cache->aead, slot->key, iv, NULL) == 1 &&
+         EVP_DecryptUpdate(ctx, NULL, &len, ticket,
+                           SESSION_TICKET_NAME_SIZE + SESSION_TICKET_IV_SIZE) == 1 &&
+         EVP_DecryptUpdate(ctx, plain, &len, sealed, (int)plain_len) == 1 &&
+         EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, SESSION_TICKET_TAG_SIZE,
+                             (void *)(sealed + plain_len)) == 1 &&
+         EVP_DecryptFinal_ex(ctx, plain + len, &len) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+    
+    for (i = 0; i < 8; i++) {
+        expiry = (expiry << 8) | plain[i];
+    }
+    if (!ok || (uint64_t)now >= expiry ||
+        plain[8] != strlen(device_id) || plain_len != 9u + plain[8] + SESSION_MASTER_SIZE ||
+        memcmp(plain + 9, device_id, plain[8]) != 0) {
+        OPENSSL_cleanse(plain, sizeof(plain));
+        return -1;
+    }
+    
+    memcpy(nonces, client_nonce, SESSION_NONCE_SIZE);
+    memcpy(nonces + SESSION_NONCE_SIZE, server_nonce, SESSION_NONCE_SIZE);
+    ret = hkdf_derive(cache->hkdf, plain + 9 + plain[8], SESSION_MASTER_SIZE,
+                      nonces, sizeof(nonces), "session resume", session_key, key_len);
+    
+    OPENSSL_cleanse(plain, sizeof(plain));
+    return ret;
+}
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <openssl/hmac.h>
 #include <openssl/sha.h>
 #include <openssl/rsa.h>
@@ -10,6 +12,15 @@
 #define HMAC_KEY_SIZE 32
 #define MAX_LOG_SIZE 4096
 
+/* Background logger: queued entries, chained HMACs, one RSA signature per batch */
+#define LOG_QUEUE_SIZE 256
+#define LOG_BATCH_ENTRIES 64
+#define LOG_BATCH_INTERVAL_MS 500
+#define LOG_RECORD_ENTRY 0x01
+#define LOG_RECORD_BATCH 0x02
+#define LOG_RECORD_HEADER_SIZE 5   /* type, big-endian body length */
+#define LOG_ENTRY_FIXED_SIZE 24    /* timestamp, level */
+
 typedef struct {
     time_t timestamp;
     char level[16];
@@ -72,3 +83,356 @@ int write_signed_log(const char *filename, signed_log_entry_t *entry,
     return 0;
 }
 
+
+/*
+ * Record format, one after another in the file:
+ *
+ *   type (1) | body length (4, big-endian) | body
+ *
+ * An entry body is timestamp (8, big-endian), level (16), the message
+ * bytes and an HMAC over the previous HMAC and everything before it in
+ * this body. The chain restarts at every batch from the previous batch
+ * digest, so each batch can be checked on its own.
+ *
+ * A batch body is the entry count (4), the batch digest (32), the
+ * signature length (2) and the RSA signature. The digest is SHA-256 over
+ * the previous digest and the complete entry records of the batch, so
+ * batches chain as well; the first batch starts from all zeroes.
+ *
+ * Appending to an existing log picks both chains up where the file ends:
+ * the digest of its last batch record, and the HMAC of the last entry
+ * with any entries after that batch folded into the first new batch.
+ */
+typedef struct {
+    time_t timestamp;
+    char level[16];
+    size_t length;
+    char message[MAX_LOG_SIZE];
+} log_queue_entry_t;
+
+typedef struct {
+    FILE *fp;
+    uint8_t hmac_key[HMAC_KEY_SIZE];
+    RSA *rsa_key;
+    
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    log_queue_entry_t queue[LOG_QUEUE_SIZE];
+    size_t head;
+    size_t count;
+    int stopping;
+    
+    /* owned by the thread */
+    uint8_t chain[32];
+    uint8_t digest[32];
+    SHA256_CTX batch;
+    uint32_t batch_entries;
+    struct timespec batch_start;
+} async_logger_t;
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void batch_begin(async_logger_t *logger)
+{
+    SHA256_Init(&logger->batch);
+    SHA256_Update(&logger->batch, logger->digest, sizeof(logger->digest));
+    memcpy(logger->chain, logger->digest, sizeof(logger->chain));
+    logger->batch_entries = 0;
+    clock_gettime(CLOCK_MONOTONIC, &logger->batch_start);
+}
+
+static int write_entry_record(async_logger_t *logger, const log_queue_entry_t *entry)
+{
+    uint8_t record[LOG_RECORD_HEADER_SIZE + LOG_ENTRY_FIXED_SIZE + MAX_LOG_SIZE + 32];
+    uint8_t *body = record + LOG_RECORD_HEADER_SIZE;
+    size_t body_len = LOG_ENTRY_FIXED_SIZE + entry->length;
+    uint64_t ts = (uint64_t)entry->timestamp;
+    unsigned int hmac_len;
+    HMAC_CTX *ctx;
+    int i;
+    
+    record[0] = LOG_RECORD_ENTRY;
+    put_be32(record + 1, (uint32_t)(body_len + 32));
+    for (i = 0; i < 8; i++) {
+        body[i] = (uint8_t)(ts >> (56 - 8 * i));
+    }
+    memcpy(body + 8, entry->level, 16);
+    memcpy(body + LOG_ENTRY_FIXED_SIZE, entry->message, entry->length);
+    
+    /* Chained HMAC: previous HMAC, then this body */
+    ctx = HMAC_CTX_new();
+    if (!ctx ||
+        !HMAC_Init_ex(ctx, logger->hmac_key, HMAC_KEY_SIZE, EVP_sha256(), NULL) ||
+        !HMAC_Update(ctx, logger->chain, sizeof(logger->chain)) ||
+        !HMAC_Update(ctx, body, body_len) ||
+        !HMAC_Final(ctx, body + body_len, &hmac_len)) {
+        HMAC_CTX_free(ctx);
+        return -1;
+    }
+    HMAC_CTX_free(ctx);
+    memcpy(logger->chain, body + body_len, sizeof(logger->chain));
+    
+    SHA256_Update(&logger->batch, record, LOG_RECORD_HEADER_SIZE + body_len + 32);
+    logger->batch_entries++;
+    
+    if (fwrite(record, LOG_RECORD_HEADER_SIZE + body_len + 32, 1, logger->fp) != 1) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+static int write_batch_record(async_logger_t *logger)
+{
+    uint8_t record[LOG_RECORD_HEADER_SIZE + 4 + 32 + 2 + 512];
+    uint8_t *body = record + LOG_RECORD_HEADER_SIZE;
+    unsigned int sig_len = 0;
+    
+    SHA256_Final(logger->digest, &logger->batch);
+    
+    put_be32(body, logger->batch_entries);
+    memcpy(body + 4, logger->digest, 32);
+    
+    /* Sign the batch digest instead of every line */
+    if (logger->rsa_key) {
+        if ((size_t)RSA_size(logger->rsa_key) > 512 ||
+            RSA_sign(NID_sha256, logger->digest, SHA256_DIGEST_LENGTH,
+                     body + 38, &sig_len, logger->rsa_key) != 1) {
+            return -1;
+        }
+    }
+    body[36] = (uint8_t)(sig_len >> 8);
+    body[37] = (uint8_t)sig_len;
+    
+    record[0] = LOG_RECORD_BATCH;
+    put_be32(record + 1, 38 + sig_len);
+    
+    if (fwrite(record, LOG_RECORD_HEADER_SIZE + 38 + sig_len, 1, logger->fp) != 1) {
+        return -1;
+    }
+    
+    batch_begin(logger);
+    return 0;
+}
+
+/*
+ * Read the log from the start and continue its chains. Records carry no
+ * back links, so the tail is only found going forward. A torn or unknown
+ * record is refused: whatever we appended after it could not be verified.
+ */
+static int logger_resume(async_logger_t *logger)
+{
+    uint8_t record[LOG_RECORD_HEADER_SIZE + LOG_ENTRY_FIXED_SIZE + MAX_LOG_SIZE + 32];
+    uint8_t *body = record + LOG_RECORD_HEADER_SIZE;
+    size_t n, body_len;
+    
+    rewind(logger->fp);
+    for (;;) {
+        n = fread(record, 1, LOG_RECORD_HEADER_SIZE, logger->fp);
+        if (n == 0 && feof(logger->fp)) {
+            break;
+        }
+        if (n != LOG_RECORD_HEADER_SIZE) {
+            return -1;
+        }
+        
+        body_len = get_be32(record + 1);
+        if (body_len > sizeof(record) - LOG_RECORD_HEADER_SIZE ||
+            fread(body, body_len, 1, logger->fp) != 1) {
+            return -1;
+        }
+        
+        if (record[0] == LOG_RECORD_BATCH && body_len >= 38) {
+            memcpy(logger->digest, body + 4, sizeof(logger->digest));
+            batch_begin(logger);
+        } else if (record[0] == LOG_RECORD_ENTRY && body_len >= LOG_ENTRY_FIXED_SIZE + 32) {
+            memcpy(logger->chain, body + body_len - 32, sizeof(logger->chain));
+            SHA256_Update(&logger->batch, record, LOG_RECORD_HEADER_SIZE + body_len);
+            logger->batch_entries++;
+        } else {
+            return -1;
+        }
+    }
+    
+    return fseek(logger->fp, 0, SEEK_END);
+}
+
+static long batch_age_ms(const async_logger_t *logger)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - logger->batch_start.tv_sec) * 1000 +
+           (now.tv_nsec - logger->batch_start.tv_nsec) / 1000000;
+}
+
+static void *logger_thread(void *arg)
+{
+    async_logger_t *logger = arg;
+    log_queue_entry_t entry;
+    
+    pthread_mutex_lock(&logger->lock);
+    for (;;) {
+        /* Wake for new entries, or when an open batch is due */
+        while (logger->count == 0 && !logger->stopping) {
+            struct timespec deadline;
+            
+            if (logger->batch_entries == 0) {
+                pthread_cond_wait(&logger->not_empty, &logger->lock);
+                continue;
+            }
+            
+            deadline = logger->batch_start;
+            deadline.tv_sec += LOG_BATCH_INTERVAL_MS / 1000;
+            deadline.tv_nsec += (LOG_BATCH_INTERVAL_MS % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            if (pthread_cond_timedwait(&logger->not_empty, &logger->lock, &deadline) != 0) {
+                break;
+            }
+        }
+        
+        if (logger->count == 0) {
+            /* Timed out with a batch open, or stopping */
+            if (logger->batch_entries > 0) {
+                pthread_mutex_unlock(&logger->lock);
+                write_batch_record(logger);
+                fflush(logger->fp);
+                pthread_mutex_lock(&logger->lock);
+            }
+            if (logger->stopping) {
+                break;
+            }
+            continue;
+        }
+        
+        /* Copy out, the HMAC and the write happen without the lock */
+        entry = logger->queue[logger->head];
+        logger->head = (logger->head + 1) % LOG_QUEUE_SIZE;
+        logger->count--;
+        pthread_cond_signal(&logger->not_full);
+        pthread_mutex_unlock(&logger->lock);
+        
+        write_entry_record(logger, &entry);
+        if (logger->batch_entries >= LOG_BATCH_ENTRIES ||
+            batch_age_ms(logger) >= LOG_BATCH_INTERVAL_MS) {
+            write_batch_record(logger);
+        }
+        
+        pthread_mutex_lock(&logger->lock);
+        if (logger->count == 0) {
+            fflush(logger->fp);
+        }
+    }
+    pthread_mutex_unlock(&logger->lock);
+    
+    return NULL;
+}
+
+int async_logger_start(async_logger_t *logger, const char *filename,
+                       const uint8_t *hmac_key, RSA *rsa_key)
+{
+    pthread_condattr_t attr;
+    
+    memset(logger, 0, sizeof(*logger));
+    
+    /* Opened once for the life of the logger, writes always append */
+    logger->fp = fopen(filename, "a+b");
+    if (!logger->fp) {
+        return -1;
+    }
+    
+    memcpy(logger->hmac_key, hmac_key, HMAC_KEY_SIZE);
+    logger->rsa_key = rsa_key;
+    batch_begin(logger);
+    if (logger_resume(logger) != 0) {
+        OPENSSL_cleanse(logger->hmac_key, sizeof(logger->hmac_key));
+        fclose(logger->fp);
+        return -1;
+    }
+    
+    pthread_mutex_init(&logger->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&logger->not_empty, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&logger->not_full, NULL);
+    
+    if (pthread_create(&logger->thread, NULL, logger_thread, logger) != 0) {
+        pthread_cond_destroy(&logger->not_full);
+        pthread_cond_destroy(&logger->not_empty);
+        pthread_mutex_destroy(&logger->lock);
+        fclose(logger->fp);
+        return -1;
+    }
+    
+    return 0;
+}
+
+/* Queue one entry; blocks while the queue is full rather than drop it */
+int async_log(async_logger_t *logger, const char *level, const char *message)
+{
+    log_queue_entry_t *entry;
+    size_t length = strlen(message);
+    
+    if (length > MAX_LOG_SIZE) {
+        length = MAX_LOG_SIZE;
+    }
+    
+    pthread_mutex_lock(&logger->lock);
+    while (logger->count == LOG_QUEUE_SIZE && !logger->stopping) {
+        pthread_cond_wait(&logger->not_full, &logger->lock);
+    }
+    if (logger->stopping) {
+        pthread_mutex_unlock(&logger->lock);
+        return -1;
+    }
+    
+    entry = &logger->queue[(logger->head + logger->count) % LOG_QUEUE_SIZE];
+    entry->timestamp = time(NULL);
+    memset(entry->level, 0, sizeof(entry->level));
+    strncpy(entry->level, level, sizeof(entry->level) - 1);
+    entry->length = length;
+    memcpy(entry->message, message, length);
+    logger->count++;
+    
+    pthread_cond_signal(&logger->not_empty);
+    pthread_mutex_unlock(&logger->lock);
+    
+    return 0;
+}
+
+/* Drain the queue, sign the last partial batch and close the file */
+int async_logger_stop(async_logger_t *logger)
+{
+    pthread_mutex_lock(&logger->lock);
+    logger->stopping = 1;
+    pthread_cond_broadcast(&logger->not_empty);
+    pthread_cond_broadcast(&logger->not_full);
+    pthread_mutex_unlock(&logger->lock);
+    
+    pthread_join(logger->thread, NULL);
+    
+    pthread_cond_destroy(&logger->not_full);
+    pthread_cond_destroy(&logger->not_empty);
+    pthread_mutex_destroy(&logger->lock);
+    OPENSSL_cleanse(logger->hmac_key, sizeof(logger->hmac_key));
+    
+    return fclose(logger->fp) == 0 ? 0 : -1;
+}
@@ -4,6 +4,15 @@
 #include <openssl/hmac.h>
 #include <openssl/sha.h>
 #include <openssl/rsa.h>
+#include <openssl/crypto.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LOG_VERIFY_MAX_THREADS 64
 
 int verify_log_entry_hmac(const signed_log_entry_t *entry, const uint8_t *key)
 {
@@ -35,3 +44,302 @@ int verify_log_entry_rsa(const signed_log_entry_t *entry, RSA *public_key)
     return 0;
 }
 
+
+/*
+ * Whole-file verification of the batched log format written by
+ * async_logger_t. One sequential pass reads only record headers to find
+ * the batch boundaries; the batches are then checked by worker threads,
+ * each one on its own: the HMAC chain restarts from the previous batch
+ * digest, which is read straight from the previous batch record.
+ */
+typedef struct {
+    size_t first_bad_offset;        /* byte offset of the first broken record */
+    size_t first_bad_record;        /* its index, counting every record */
+    size_t records;
+    size_t batches;
+    size_t unsigned_entries;        /* entries after the last batch record */
+    int ok;
+} log_verify_report_t;
+
+typedef struct {
+    size_t start;                   /* first entry record */
+    size_t end;                     /* the batch record, or the file end for the tail */
+    size_t first_record;
+    const uint8_t *prev_digest;
+    int is_tail;
+} log_batch_span_t;
+
+typedef struct {
+    const uint8_t *map;
+    const log_batch_span_t *spans;
+    size_t span_count;
+    const uint8_t *hmac_key;
+    RSA *public_key;
+    
+    pthread_mutex_t lock;
+    size_t next;
+    size_t bad_offset;
+    size_t bad_record;
+} log_verify_job_t;
+
+static const uint8_t zero_digest[32];
+
+static void report_bad(log_verify_job_t *job, size_t offset, size_t record)
+{
+    pthread_mutex_lock(&job->lock);
+    if (offset < job->bad_offset) {
+        job->bad_offset = offset;
+        job->bad_record = record;
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* Entries of one span, then its batch record; 0 if all of it checks out */
+static int verify_span(log_verify_job_t *job, const log_batch_span_t *span,
+                       HMAC_CTX *hmac, size_t *bad_offset, size_t *bad_record)
+{
+    const uint8_t *map = job->map;
+    uint8_t chain[32], calculated[32], digest[32];
+    unsigned int hmac_len;
+    SHA256_CTX batch;
+    size_t offset = span->start;
+    size_t record = span->first_record;
+    uint32_t entries = 0;
+    
+    memcpy(chain, span->prev_digest, sizeof(chain));
+    SHA256_Init(&batch);
+    SHA256_Update(&batch, span->prev_digest, 32);
+    
+    while (offset < span->end) {
+        size_t body_len = get_be32(map + offset + 1);
+        const uint8_t *body = map + offset + LOG_RECORD_HEADER_SIZE;
+    
+        if (!HMAC_Init_ex(hmac, job->hmac_key, HMAC_KEY_SIZE, EVP_sha256(), NULL) ||
+            !HMAC_Update(hmac, chain, sizeof(chain)) ||
+            !HMAC_Update(hmac, body, body_len - 32) ||
+            !HMAC_Final(hmac, calculated, &hmac_len) ||
+            CRYPTO_memcmp(calculated, body + body_len - 32, 32) != 0) {
+            *bad_offset = offset;
+            *bad_record = record;
+            return -1;
+        }
+        memcpy(chain, calculated, sizeof(chain));
+    
+        SHA256_Update(&batch, map + offset, LOG_RECORD_HEADER_SIZE + body_len);
+        offset += LOG_RECORD_HEADER_SIZE + body_len;
+        record++;
+        entries++;
+    }
+    
+    if (span->is_tail) {
+        return 0;
+    }
+    
+    /* The batch record: count, digest and the signature over the digest */
+    *bad_offset = span->end;
+    *bad_record = record;
+    {
+        const uint8_t *body = map + span->end + LOG_RECORD_HEADER_SIZE;
+        uint16_t sig_len = (uint16_t)((body[36] << 8) | body[37]);
+    
+        SHA256_Final(digest, &batch);
+        if (get_be32(body) != entries ||
+            CRYPTO_memcmp(digest, body + 4, 32) != 0) {
+            return -1;
+        }
+        if (job->public_key &&
+            (sig_len == 0 ||
+             RSA_verify(NID_sha256, digest, SHA256_DIGEST_LENGTH,
+                        body + 38, sig_len, job->public_key) != 1)) {
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+static void *verify_worker(void *arg)
+{
+    log_verify_job_t *job = arg;
+    HMAC_CTX *hmac = HMAC_CTX_new();
+    
+    if (!hmac) {
+        report_bad(job, 0, 0);
+        return NULL;
+    }
+    
+    for (;;) {
+        const log_batch_span_t *span;
+        size_t bad_offset, bad_record;
+    
+        pthread_mutex_lock(&job->lock);
+        /* Spans are in file order, nothing past a known failure matters */
+        if (job->next == job->span_count ||
+            job->spans[job->next].start > job->bad_offset) {
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+        span = &job->spans[job->next++];
+        pthread_mutex_unlock(&job->lock);
+    
+        if (verify_span(job, span, hmac, &bad_offset, &bad_record) != 0) {
+            report_bad(job, bad_offset, bad_record);
+        }
+    }
+    
+    HMAC_CTX_free(hmac);
+    return NULL;
+}
+
+int verify_log_file(const char *filename, const uint8_t *hmac_key, RSA *public_key,
+                    int threads, log_verify_report_t *report)
+{
+    log_verify_job_t job;
+    log_batch_span_t *spans = NULL;
+    pthread_t workers[LOG_VERIFY_MAX_THREADS];
+    size_t span_count = 0, span_capacity = 0;
+    size_t offset = 0, record = 0, span_start = 0, span_record = 0;
+    const uint8_t *prev_digest = zero_digest;
+    size_t size;
+    struct stat st;
+    uint8_t *map;
+    int fd, i, started = 0;
+    
+    memset(report, 0, sizeof(*report));
+    report->first_bad_offset = (size_t)-1;
+    report->first_bad_record = (size_t)-1;
+    
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    size = (size_t)st.st_size;
+    if (size == 0) {
+        close(fd);
+        report->ok = 1;
+        return 0;
+    }
+    
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    
+    memset(&job, 0, sizeof(job));
+    job.bad_offset = (size_t)-1;
+    job.bad_record = (size_t)-1;
+    
+    /* Headers only: split at batch records, stop at the first bad frame */
+    while (offset < size) {
+        size_t body_len;
+        int is_batch;
+    
+        if (size - offset < LOG_RECORD_HEADER_SIZE) {
+            job.bad_offset = offset;
+            job.bad_record = record;
+            break;
+        }
+        body_len = get_be32(map + offset + 1);
+        is_batch = map[offset] == LOG_RECORD_BATCH;
+        if ((map[offset] != LOG_RECORD_ENTRY && !is_batch) ||
+            body_len > size - offset - LOG_RECORD_HEADER_SIZE ||
+            (!is_batch && body_len < LOG_ENTRY_FIXED_SIZE + 32) ||
+            (is_batch && (body_len < 38 ||
+                          body_len != 38u + (uint32_t)((map[offset + 41] << 8) | map[offset + 42])))) {
+            job.bad_offset = offset;
+            job.bad_record = record;
+            break;
+        }
+    
+        if (is_batch) {
+            if (span_count == span_capacity) {
+                log_batch_span_t *grown;
+    
+                span_capacity = span_capacity ? span_capacity * 2 : 64;
+                grown = realloc(spans, span_capacity * sizeof(*spans));
+                if (!grown) {
+                    free(spans);
+                    munmap(map, size);
+                    return -1;
+                }
+                spans = grown;
+            }
+            spans[span_count].start = span_start;
+            spans[span_count].end = offset;
+            spans[span_count].first_record = span_record;
+            spans[span_count].prev_digest = prev_digest;
+            spans[span_count].is_tail = 0;
+            span_count++;
+    
+            prev_digest = map + offset + LOG_RECORD_HEADER_SIZE + 4;
+            span_start = offset + LOG_RECORD_HEADER_SIZE + body_len;
+            span_record = record + 1;
+            report->batches++;
+        }
+    
+        offset += LOG_RECORD_HEADER_SIZE + body_len;
+        record++;
+    }
+    report->records = record;
+    
+    /* Entries not yet covered by a batch still have their HMAC chain */
+    if (span_start < offset) {
+        log_batch_span_t *grown = realloc(spans, (span_count + 1) * sizeof(*spans));
+    
+        if (!grown) {
+            free(spans);
+            munmap(map, size);
+            return -1;
+        }
+        spans = grown;
+        spans[span_count].start = span_start;
+        spans[span_count].end = offset;
+        spans[span_count].first_record = span_record;
+        spans[span_count].prev_digest = prev_digest;
+        spans[span_count].is_tail = 1;
+        span_count++;
+        report->unsigned_entries = record - span_record;
+    }
+    
+    job.map = map;
+    job.spans = spans;
+    job.span_count = span_count;
+    job.hmac_key = hmac_key;
+    job.public_key = public_key;
+    pthread_mutex_init(&job.lock, NULL);
+    
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > LOG_VERIFY_MAX_THREADS) {
+        threads = LOG_VERIFY_MAX_THREADS;
+    }
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, verify_worker, &job) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        /* No threads to be had, check on this one */
+        verify_worker(&job);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    
+    pthread_mutex_destroy(&job.lock);
+    free(spans);
+    munmap(map, size);
+    
+    report->first_bad_offset = job.bad_offset;
+    report->first_bad_record = job.bad_record;
+    report->ok = job.bad_offset == (size_t)-1;
+    return report->ok ? 0 : -1;
+}
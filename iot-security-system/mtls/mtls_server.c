@@ -1,16 +1,52 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include "../../secure-iot-gateway/protocols/tls_dtls/tls_resumption.c"
+#include "../../secure-iot-gateway/protocols/tls_dtls/tls_epoll.c"
 
 #define PORT 8443
 #define CERT_FILE "server.crt"
 #define KEY_FILE "server.key"
 #define CA_CERT "ca.crt"
+#define HANDSHAKE_TIMEOUT_SEC 10
+#define STATS_INTERVAL_SEC 60
+
+/*
+ * Each worker thread runs its own listener and epoll loop, the gateway
+ * TLS server's (tls_epoll.c). Sockets are non-blocking and every
+ * connection moves through a small state machine, so a slow handshake
+ * only ever waits for its own socket.
+ */
+typedef enum {
+    CONN_HANDSHAKE,
+    CONN_REPLY,
+    CONN_SHUTDOWN
+} conn_state_t;
+
+typedef struct conn {
+    int fd;
+    SSL *ssl;
+    conn_state_t state;
+    time_t deadline;            /* dropped if not done by then */
+    struct conn *prev;
+    struct conn *next;
+} conn_t;
+
+typedef struct {
+    SSL_CTX *ctx;
+    tls_epoll_t loop;
+    conn_t *conns;              /* for the timeout sweep */
+} worker_t;
 
 SSL_CTX *create_mtls_context(void)
 {
@@ -52,11 +88,138 @@ void configure_mtls_context(SSL_CTX *ctx)
     SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
 }
 
-int main(void)
+static void conn_close(worker_t *w, conn_t *c)
+{
+    tls_epoll_del(&w->loop, c->fd);
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        w->conns = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+    SSL_free(c->ssl);
+    close(c->fd);
+    free(c);
+}
+
+/* Advance one connection as far as it goes without blocking */
+static void conn_step(worker_t *w, conn_t *c)
+{
+    static const char reply[] = "Hello from mTLS server\n";
+    X509 *client_cert;
+    int ret;
+    
+    for (;;) {
+        switch (c->state) {
+        case CONN_HANDSHAKE:
+            ret = SSL_accept(c->ssl);
+            if (ret <= 0) {
+                if (tls_epoll_want(&w->loop, c->fd, c, SSL_get_error(c->ssl, ret)) != 0) {
+                    ERR_print_errors_fp(stderr);
+                    conn_close(w, c);
+                }
+                return;
+            }
+            /* SSL_VERIFY_FAIL_IF_NO_PEER_CERT already checked it against CA_CERT */
+            client_cert = SSL_get_peer_certificate(c->ssl);
+            if (client_cert) {
+                printf("Client certificate verified\n");
+                X509_free(client_cert);
+            }
+            tls_resumption_record(c->ssl);
+            c->state = CONN_REPLY;
+            break;
+    
+        case CONN_REPLY:
+            ret = SSL_write(c->ssl, reply, strlen(reply));
+            if (ret <= 0) {
+                if (tls_epoll_want(&w->loop, c->fd, c, SSL_get_error(c->ssl, ret)) != 0) {
+                    conn_close(w, c);
+                }
+                return;
+            }
+            c->state = CONN_SHUTDOWN;
+            break;
+    
+        case CONN_SHUTDOWN:
+            /* Best effort close_notify, the peer's is not waited for */
+            SSL_shutdown(c->ssl);
+            conn_close(w, c);
+            return;
+        }
+    }
+}
+
+/* tls_epoll_t callbacks */
+static void conn_accepted(void *owner, int client)
+{
+    worker_t *w = owner;
+    conn_t *c = calloc(1, sizeof(*c));
+    
+    if (!c || !(c->ssl = SSL_new(w->ctx))) {
+        free(c);
+        close(client);
+        return;
+    }
+    c->fd = client;
+    c->state = CONN_HANDSHAKE;
+    c->deadline = time(NULL) + HANDSHAKE_TIMEOUT_SEC;
+    SSL_set_fd(c->ssl, client);
+    
+    if (tls_epoll_add(&w->loop, client, c) < 0) {
+        SSL_free(c->ssl);
+        free(c);
+        close(client);
+        return;
+    }
+    c->next = w->conns;
+    if (w->conns) {
+        w->conns->prev = c;
+    }
+    w->conns = c;
+    
+    /* The ClientHello is often already there */
+    conn_step(w, c);
+}
+
+static void conn_ready(void *owner, void *conn)
+{
+    conn_step(owner, conn);
+}
+
+/* Connections that never finished their handshake */
+static void sweep_timeouts(void *owner)
+{
+    worker_t *w = owner;
+    time_t now = time(NULL);
+    conn_t *c = w->conns;
+    
+    while (c) {
+        conn_t *next = c->next;
+    
+        if (now >= c->deadline) {
+            conn_close(w, c);
+        }
+        c = next;
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    worker_t *w = arg;
+    
+    return tls_epoll_run(&w->loop);
+}
+
+int main(int argc, char **argv)
 {
-    int sock, client;
     SSL_CTX *ctx;
-    struct sockaddr_in addr;
+    worker_t *workers;
+    pthread_t *threads;
+    long nworkers;
+    long i;
     
     SSL_library_init();
     OpenSSL_add_all_algorithms();
@@ -64,39 +227,55 @@ int main(void)
     
     ctx = create_mtls_context();
     configure_mtls_context(ctx);
+    if (tls_resumption_enable(ctx, "mtls_server") != 0) {
+        fprintf(stderr, "Unable to enable session resumption\n");
+        exit(EXIT_FAILURE);
+    }
     
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(PORT);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    /* Worker count from the command line, one per CPU by default */
+    nworkers = argc > 1 ? strtol(argv[1], NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers < 1) {
+        nworkers = 1;
+    }
     
-    bind(sock, (struct sockaddr *)&addr, sizeof(addr));
-    listen(sock, 5);
+    workers = calloc((size_t)nworkers, sizeof(*workers));
+    threads = calloc((size_t)nworkers, sizeof(*threads));
+    if (!workers || !threads) {
+        perror("Unable to allocate workers");
+        exit(EXIT_FAILURE);
+    }
     
-    printf("mTLS server listening on port %d\n", PORT);
+    for (i = 0; i < nworkers; i++) {
+        tls_epoll_t *loop = &workers[i].loop;
     
-    while (1) {
-        client = accept(sock, NULL, NULL);
-        SSL *ssl = SSL_new(ctx);
-        SSL_set_fd(ssl, client);
-        
-        if (SSL_accept(ssl) > 0) {
-            X509 *client_cert = SSL_get_peer_certificate(ssl);
-            if (client_cert) {
-                printf("Client certificate verified\n");
-                X509_free(client_cert);
-            }
-            
-            const char *reply = "Hello from mTLS server\n";
-            SSL_write(ssl, reply, strlen(reply));
+        workers[i].ctx = ctx;
+        loop->listen_fd = tls_epoll_listener(PORT);
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        loop->owner = &workers[i];
+        loop->accepted = conn_accepted;
+        loop->ready = conn_ready;
+        loop->tick = sweep_timeouts;
+        if (loop->listen_fd < 0 || loop->epoll_fd < 0) {
+            exit(EXIT_FAILURE);
         }
-        
-        SSL_free(ssl);
-        close(client);
     }
     
-    close(sock);
+    printf("mTLS server listening on port %d (%ld workers)\n", PORT, nworkers);
+    
+    for (i = 0; i < nworkers; i++) {
+        if (pthread_create(&threads[i], NULL, worker_main, &workers[i]) != 0) {
+            perror("Unable to start worker");
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    /* Workers run for the life of the process; report resumption rates */
+    while (1) {
+        sleep(STATS_INTERVAL_SEC);
+        tls_resumption_print_stats(stdout);
+        fflush(stdout);
+    }
+    
     SSL_CTX_free(ctx);
     return 0;
 }
-
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include "../logging/signed_logger.c"
+#include "../logging/verify_log.c"
+
+#define TEST_LOG "/tmp/test_signed_logger.log"
+#define BATCH_RECORD_SIZE (LOG_RECORD_HEADER_SIZE + 38)    /* unsigned batch */
+
+static const uint8_t test_key[HMAC_KEY_SIZE] = { 0x42 };
+
+static void log_session(int entries)
+{
+    async_logger_t logger;
+    char message[32];
+    int i;
+    
+    assert(async_logger_start(&logger, TEST_LOG, test_key, NULL) == 0);
+    for (i = 0; i < entries; i++) {
+        snprintf(message, sizeof(message), "entry %d", i);
+        assert(async_log(&logger, "INFO", message) == 0);
+    }
+    assert(async_logger_stop(&logger) == 0);
+}
+
+static long file_size(void)
+{
+    FILE *fp = fopen(TEST_LOG, "rb");
+    long size;
+    
+    assert(fp != NULL);
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+void test_append_verifies(void)
+{
+    log_verify_report_t report;
+    
+    printf("Testing append to an existing log...\n");
+    unlink(TEST_LOG);
+    
+    log_session(10);
+    log_session(100);
+    
+    /* every batch chains from the one before, across both sessions */
+    assert(verify_log_file(TEST_LOG, test_key, NULL, 4, &report) == 0);
+    assert(report.ok);
+    assert(report.batches >= 2);
+    assert(report.unsigned_entries == 0);
+    
+    printf("Append test PASSED\n");
+}
+
+void test_append_after_unsigned_tail(void)
+{
+    log_verify_report_t report;
+    
+    printf("Testing append after entries left unsigned...\n");
+    unlink(TEST_LOG);
+    
+    /* as after a crash before the last batch record */
+    log_session(5);
+    assert(truncate(TEST_LOG, file_size() - BATCH_RECORD_SIZE) == 0);
+    assert(verify_log_file(TEST_LOG, test_key, NULL, 1, &report) == 0);
+    assert(report.unsigned_entries == 5);
+    
+    /* the next session chains from the last entry and signs them too */
+    log_session(5);
+    assert(verify_log_file(TEST_LOG, test_key, NULL, 1, &report) == 0);
+    assert(report.unsigned_entries == 0);
+    
+    printf("Unsigned tail test PASSED\n");
+}
+
+void test_torn_tail_refused(void)
+{
+    async_logger_t logger;
+    
+    printf("Testing append after a torn record...\n");
+    unlink(TEST_LOG);
+    
+    log_session(3);
+    assert(truncate(TEST_LOG, file_size() - 1) == 0);
+    assert(async_logger_start(&logger, TEST_LOG, test_key, NULL) != 0);
+    
+    printf("Torn tail test PASSED\n");
+}
+
+int main(void)
+{
+    printf("Running signed logger tests...\n\n");
+    
+    test_append_verifies();
+    test_append_after_unsigned_tail();
+    test_torn_tail_refused();
+    
+    unlink(TEST_LOG);
+    printf("\nAll tests PASSED\n");
+    return 0;
+}
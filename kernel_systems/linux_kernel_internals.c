@@ -5,6 +5,13 @@
  * 
  * Advanced Linux kernel internals with process management
  * Research breakthrough: Microsecond-precision scheduling
+ *
+ * Memory is modelled the way the kernel hands it out: a buddy allocator
+ * over 4 KiB pages for anything of a page or more, and size-class slabs
+ * carved from single pages for small objects. Regions are found by
+ * address through a hash and linked on their owner's list, so allocation,
+ * free and per-process accounting are O(log n) at worst, with no cap on
+ * the number of regions.
  */
 
 #include <linux/module.h>
@@ -17,12 +24,33 @@
 #include <linux/atomic.h>
 #include <linux/timer.h>
 #include <linux/workqueue.h>
+#include <linux/hashtable.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/bitmap.h>
+#include <linux/mutex.h>
+#include <linux/vmalloc.h>
+#include <linux/overflow.h>
 
-#define KERNEL_INTERNALS_VERSION "5.15.0"
+#define KERNEL_INTERNALS_VERSION "5.16.0"
 #define MAX_PROCESSES 1024
-#define MAX_MEMORY_REGIONS 64
 #define SCHEDULER_QUANTUM_MS 10
 
+#define SIM_BASE_ADDR 0x10000000
+#define SIM_PAGE_SHIFT 12
+#define SIM_PAGE_SIZE (1U << SIM_PAGE_SHIFT)
+#define BUDDY_MAX_ORDER 16              // 256MB in one block
+#define SLAB_MIN_SHIFT 4                // 16-byte smallest class
+#define SLAB_CLASSES 8                  // 16 .. 2048 bytes
+#define SLAB_MAX_SIZE (1U << (SLAB_MIN_SHIFT + SLAB_CLASSES - 1))
+#define SLAB_MAX_OBJS (SIM_PAGE_SIZE >> SLAB_MIN_SHIFT)
+
+// Page states; only the first page of a block carries one
+#define SIM_PAGE_NONE 0
+#define SIM_PAGE_FREE 1
+#define SIM_PAGE_USED 2
+#define SIM_PAGE_SLAB 3
+
 struct process_info {
     pid_t pid;
     char name[64];
@@ -33,36 +61,269 @@ struct process_info {
     u32 nice_value;
     bool real_time;
     struct timer_list scheduler_timer;
+    
+    struct hlist_node pid_node;
+    struct list_head regions;           // memory_region.owner_node
+    u32 region_count;
 };
 
 struct memory_region {
     u32 start_addr;
     u32 size;
     u32 flags;
-    bool allocated;
     pid_t owner_pid;
     u64 timestamp;
+    int order;                          // buddy order, -1 for a slab object
+    struct process_info *owner;         // NULL when the pid was not known
+    struct list_head owner_node;
+    struct hlist_node addr_node;
+};
+
+struct sim_slab {
+    struct list_head node;              // on its class's partial or full list
+    u32 page;
+    u16 inuse;
+    u16 objects;
+    u8 size_class;
+    DECLARE_BITMAP(used, SLAB_MAX_OBJS);
+};
+
+struct sim_page {
+    struct list_head node;              // free_area, while the head of a free block
+    struct sim_slab *slab;
+    u8 order;
+    u8 state;
 };
 
 struct kernel_internals {
     struct process_info processes[MAX_PROCESSES];
     int process_count;
-    struct memory_region memory_regions[MAX_MEMORY_REGIONS];
     int memory_region_count;
     atomic_t total_processes;
     u64 total_memory;
     u32 scheduler_quantum;
     bool real_time_enabled;
+    
+    struct mutex mem_lock;              // everything below, and pid_hash
+    struct sim_page *pages;
+    u32 nr_pages;
+    u32 free_pages;
+    struct list_head free_area[BUDDY_MAX_ORDER + 1];
+    struct list_head slab_partial[SLAB_CLASSES];
+    struct list_head slab_full[SLAB_CLASSES];
+    struct kmem_cache *region_cache;
+    DECLARE_HASHTABLE(region_hash, 12);
+    DECLARE_HASHTABLE(pid_hash, 10);
 };
 
 static struct kernel_internals global_kernel;
 
+static void kernel_scheduler_timer(struct timer_list *t);
+
+static u32 sim_page_addr(u32 idx)
+{
+    return SIM_BASE_ADDR + (idx << SIM_PAGE_SHIFT);
+}
+
+static void buddy_add_free(u32 idx, u8 order)
+{
+    struct sim_page *pg = &global_kernel.pages[idx];
+    
+    pg->state = SIM_PAGE_FREE;
+    pg->order = order;
+    list_add(&pg->node, &global_kernel.free_area[order]);
+    global_kernel.free_pages += 1U << order;
+}
+
+static void buddy_del_free(u32 idx)
+{
+    struct sim_page *pg = &global_kernel.pages[idx];
+    
+    list_del(&pg->node);
+    pg->state = SIM_PAGE_NONE;
+    global_kernel.free_pages -= 1U << pg->order;
+}
+
+/*
+ * Hand the whole space to the free lists as naturally aligned blocks,
+ * as large as alignment and what is left allow
+ */
+static int buddy_init(void)
+{
+    u32 idx = 0, order;
+    int i;
+    
+    global_kernel.nr_pages = global_kernel.total_memory >> SIM_PAGE_SHIFT;
+    global_kernel.pages = vzalloc(array_size(global_kernel.nr_pages, sizeof(struct sim_page)));
+    if (!global_kernel.pages) {
+        return -ENOMEM;
+    }
+    
+    for (i = 0; i <= BUDDY_MAX_ORDER; i++) {
+        INIT_LIST_HEAD(&global_kernel.free_area[i]);
+    }
+    global_kernel.free_pages = 0;
+    
+    while (idx < global_kernel.nr_pages) {
+        order = min_t(u32, BUDDY_MAX_ORDER, ilog2(global_kernel.nr_pages - idx));
+        if (idx) {
+            order = min_t(u32, order, __ffs(idx));
+        }
+        buddy_add_free(idx, order);
+        idx += 1U << order;
+    }
+    return 0;
+}
+
+/**
+ * Take a block of 2^order pages: the smallest free block that fits,
+ * split down with the unused halves put back. Returns the first page.
+ */
+static int buddy_alloc(u8 order)
+{
+    struct sim_page *pg;
+    u32 idx;
+    u8 o;
+    
+    for (o = order; o <= BUDDY_MAX_ORDER; o++) {
+        if (!list_empty(&global_kernel.free_area[o])) {
+            break;
+        }
+    }
+    if (o > BUDDY_MAX_ORDER) {
+        return -ENOMEM;
+    }
+    
+    pg = list_first_entry(&global_kernel.free_area[o], struct sim_page, node);
+    idx = pg - global_kernel.pages;
+    buddy_del_free(idx);
+    while (o > order) {
+        o--;
+        buddy_add_free(idx + (1U << o), o);
+    }
+    
+    pg->state = SIM_PAGE_USED;
+    pg->order = order;
+    return idx;
+}
+
+// Merge with the buddy for as long as it is free and whole
+static void buddy_free(u32 idx, u8 order)
+{
+    struct sim_page *buddy;
+    u32 b;
+    
+    while (order < BUDDY_MAX_ORDER) {
+        b = idx ^ (1U << order);
+        if (b >= global_kernel.nr_pages) {
+            break;
+        }
+        buddy = &global_kernel.pages[b];
+        if (buddy->state != SIM_PAGE_FREE || buddy->order != order) {
+            break;
+        }
+        buddy_del_free(b);
+        idx = min(idx, b);
+        order++;
+    }
+    buddy_add_free(idx, order);
+}
+
+static u8 slab_class(u32 size)
+{
+    return size <= (1U << SLAB_MIN_SHIFT) ? 0 : order_base_2(size) - SLAB_MIN_SHIFT;
+}
+
+/**
+ * One object of size class c: from a partially used slab when there is
+ * one, else from a new slab page
+ */
+static int slab_alloc(u8 c, u32 *addr)
+{
+    struct sim_slab *s;
+    u32 shift = SLAB_MIN_SHIFT + c, obj;
+    int idx;
+    
+    s = list_first_entry_or_null(&global_kernel.slab_partial[c], struct sim_slab, node);
+    if (!s) {
+        s = kzalloc(sizeof(*s), GFP_KERNEL);
+        if (!s) {
+            return -ENOMEM;
+        }
+        idx = buddy_alloc(0);
+        if (idx < 0) {
+            kfree(s);
+            return idx;
+        }
+        global_kernel.pages[idx].state = SIM_PAGE_SLAB;
+        global_kernel.pages[idx].slab = s;
+        s->page = idx;
+        s->objects = SIM_PAGE_SIZE >> shift;
+        s->size_class = c;
+        list_add(&s->node, &global_kernel.slab_partial[c]);
+    }
+    
+    obj = find_first_zero_bit(s->used, s->objects);
+    __set_bit(obj, s->used);
+    if (++s->inuse == s->objects) {
+        list_move(&s->node, &global_kernel.slab_full[c]);
+    }
+    
+    *addr = sim_page_addr(s->page) + (obj << shift);
+    return 0;
+}
+
+static void slab_free(u32 addr)
+{
+    u32 off = addr - SIM_BASE_ADDR;
+    struct sim_slab *s = global_kernel.pages[off >> SIM_PAGE_SHIFT].slab;
+    u8 c = s->size_class;
+    
+    __clear_bit((off & (SIM_PAGE_SIZE - 1)) >> (SLAB_MIN_SHIFT + c), s->used);
+    if (s->inuse-- == s->objects) {
+        list_move(&s->node, &global_kernel.slab_partial[c]);
+    }
+    
+    // An empty slab goes back to the buddy, unless it is the class's last one
+    if (!s->inuse && !list_is_singular(&global_kernel.slab_partial[c])) {
+        list_del(&s->node);
+        global_kernel.pages[s->page].slab = NULL;
+        buddy_free(s->page, 0);
+        kfree(s);
+    }
+}
+
+static struct process_info *kernel_find_process(pid_t pid)
+{
+    struct process_info *proc;
+    
+    hash_for_each_possible(global_kernel.pid_hash, proc, pid_node, pid) {
+        if (proc->pid == pid) {
+            return proc;
+        }
+    }
+    return NULL;
+}
+
+static struct memory_region *kernel_find_region(u32 start_addr)
+{
+    struct memory_region *region;
+    
+    hash_for_each_possible(global_kernel.region_hash, region, addr_node, start_addr) {
+        if (region->start_addr == start_addr) {
+            return region;
+        }
+    }
+    return NULL;
+}
+
+
 /**
  * Initialize kernel internals
  */
 static int kernel_internals_init(void)
 {
-    int i;
+    int i, ret;
     
     pr_info("Initializing Linux kernel internals\n");
     
@@ -85,14 +346,23 @@ static int kernel_internals_init(void)
         global_kernel.processes[i].real_time = false;
     }
     
-    // Initialize memory regions
-    for (i = 0; i < MAX_MEMORY_REGIONS; i++) {
-        global_kernel.memory_regions[i].start_addr = 0;
-        global_kernel.memory_regions[i].size = 0;
-        global_kernel.memory_regions[i].flags = 0;
-        global_kernel.memory_regions[i].allocated = false;
-        global_kernel.memory_regions[i].owner_pid = 0;
-        global_kernel.memory_regions[i].timestamp = 0;
+    // Initialize memory allocators
+    mutex_init(&global_kernel.mem_lock);
+    hash_init(global_kernel.region_hash);
+    hash_init(global_kernel.pid_hash);
+    for (i = 0; i < SLAB_CLASSES; i++) {
+        INIT_LIST_HEAD(&global_kernel.slab_partial[i]);
+        INIT_LIST_HEAD(&global_kernel.slab_full[i]);
+    }
+    global_kernel.region_cache = kmem_cache_create("kernel_regions", sizeof(struct memory_region),
+                                                   0, 0, NULL);
+    if (!global_kernel.region_cache) {
+        return -ENOMEM;
+    }
+    ret = buddy_init();
+    if (ret) {
+        kmem_cache_destroy(global_kernel.region_cache);
+        return ret;
     }
     
     pr_info("Linux kernel internals initialized: memory=%llu MB, real-time=%s\n",
@@ -134,6 +404,11 @@ static int kernel_create_process(pid_t pid, const char *name, u32 priority, bool
     atomic_set(&global_kernel.processes[i].state, 1); // RUNNING
     global_kernel.processes[i].nice_value = 0;
     global_kernel.processes[i].real_time = real_time;
+    INIT_LIST_HEAD(&global_kernel.processes[i].regions);
+    global_kernel.processes[i].region_count = 0;
+    mutex_lock(&global_kernel.mem_lock);
+    hash_add(global_kernel.pid_hash, &global_kernel.processes[i].pid_node, pid);
+    mutex_unlock(&global_kernel.mem_lock);
     
     // Initialize scheduler timer
     timer_setup(&global_kernel.processes[i].scheduler_timer, kernel_scheduler_timer, 0);
@@ -166,93 +441,153 @@ static void kernel_scheduler_timer(struct timer_list *t)
 
 /**
  * Allocate memory
+ *
+ * Up to SLAB_MAX_SIZE bytes come from the size-class slabs, anything
+ * larger is rounded up to a power-of-two run of pages from the buddy
+ * allocator. The address is returned in *start_addr.
  */
-static int kernel_allocate_memory(pid_t pid, u32 size, u32 flags)
+static int kernel_allocate_memory(pid_t pid, u32 size, u32 flags, u32 *start_addr)
 {
-    int i;
+    struct memory_region *region;
+    struct process_info *proc;
+    u32 addr, pages;
+    int order = -1, idx, ret;
     
-    if (size == 0) {
+    if (size == 0 || !start_addr) {
         pr_err("Invalid memory size\n");
         return -EINVAL;
     }
     
-    // Find free memory region
-    for (i = 0; i < MAX_MEMORY_REGIONS; i++) {
-        if (!global_kernel.memory_regions[i].allocated) {
-            break;
-        }
-    }
-    
-    if (i >= MAX_MEMORY_REGIONS) {
-        pr_err("No free memory regions available\n");
+    region = kmem_cache_zalloc(global_kernel.region_cache, GFP_KERNEL);
+    if (!region) {
         return -ENOMEM;
     }
     
-    global_kernel.memory_regions[i].start_addr = 0x10000000 + (i * 0x1000); // Simulate address
-    global_kernel.memory_regions[i].size = size;
-    global_kernel.memory_regions[i].flags = flags;
-    global_kernel.memory_regions[i].allocated = true;
-    global_kernel.memory_regions[i].owner_pid = pid;
-    global_kernel.memory_regions[i].timestamp = jiffies;
+    mutex_lock(&global_kernel.mem_lock);
+    if (size <= SLAB_MAX_SIZE) {
+        ret = slab_alloc(slab_class(size), &addr);
+    } else {
+        pages = DIV_ROUND_UP(size, SIM_PAGE_SIZE);
+        order = order_base_2(pages);
+        idx = order <= BUDDY_MAX_ORDER ? buddy_alloc(order) : -ENOMEM;
+        ret = idx < 0 ? idx : 0;
+        addr = idx < 0 ? 0 : sim_page_addr(idx);
+    }
+    if (ret) {
+        mutex_unlock(&global_kernel.mem_lock);
+        kmem_cache_free(global_kernel.region_cache, region);
+        pr_err("No memory for %u bytes for process %d\n", size, pid);
+        return ret;
+    }
     
+    region->start_addr = addr;
+    region->size = size;
+    region->flags = flags;
+    region->owner_pid = pid;
+    region->timestamp = jiffies;
+    region->order = order;
+    hash_add(global_kernel.region_hash, &region->addr_node, addr);
+    
+    proc = kernel_find_process(pid);
+    region->owner = proc;
+    if (proc) {
+        list_add_tail(&region->owner_node, &proc->regions);
+        proc->memory_usage += size;
+        proc->region_count++;
+    } else {
+        INIT_LIST_HEAD(&region->owner_node);
+    }
     global_kernel.memory_region_count++;
+    mutex_unlock(&global_kernel.mem_lock);
     
-    pr_info("Memory allocated for process %d: size=%d bytes, flags=0x%x\n",
-            pid, size, flags);
+    *start_addr = addr;
+    pr_debug("Memory allocated for process %d: size=%d bytes at 0x%x, flags=0x%x\n",
+             pid, size, addr, flags);
     
     return 0;
 }
 
+// With mem_lock held
+static void kernel_release_region(struct memory_region *region)
+{
+    if (region->order < 0) {
+        slab_free(region->start_addr);
+    } else {
+        buddy_free((region->start_addr - SIM_BASE_ADDR) >> SIM_PAGE_SHIFT, region->order);
+    }
+    
+    hash_del(&region->addr_node);
+    list_del(&region->owner_node);
+    if (region->owner) {
+        region->owner->memory_usage -= region->size;
+        region->owner->region_count--;
+    }
+    global_kernel.memory_region_count--;
+    kmem_cache_free(global_kernel.region_cache, region);
+}
+
 /**
  * Free memory
  */
 static int kernel_free_memory(pid_t pid, u32 start_addr)
 {
-    int i;
-    
-    // Find memory region
-    for (i = 0; i < MAX_MEMORY_REGIONS; i++) {
-        if (global_kernel.memory_regions[i].allocated &&
-            global_kernel.memory_regions[i].start_addr == start_addr &&
-            global_kernel.memory_regions[i].owner_pid == pid) {
-            break;
-        }
-    }
+    struct memory_region *region;
     
-    if (i >= MAX_MEMORY_REGIONS) {
+    mutex_lock(&global_kernel.mem_lock);
+    region = kernel_find_region(start_addr);
+    if (!region || region->owner_pid != pid) {
+        mutex_unlock(&global_kernel.mem_lock);
         pr_err("Memory region not found for process %d at address 0x%x\n", pid, start_addr);
         return -EINVAL;
     }
+    kernel_release_region(region);
+    mutex_unlock(&global_kernel.mem_lock);
     
-    global_kernel.memory_regions[i].allocated = false;
-    global_kernel.memory_regions[i].owner_pid = 0;
-    global_kernel.memory_region_count--;
-    
-    pr_info("Memory freed for process %d: address=0x%x\n", pid, start_addr);
+    pr_debug("Memory freed for process %d: address=0x%x\n", pid, start_addr);
     
     return 0;
 }
 
+/**
+ * Free everything a process still holds; returns how many regions
+ */
+static int kernel_free_process_memory(pid_t pid)
+{
+    struct memory_region *region, *tmp;
+    struct process_info *proc;
+    int count = 0;
+    
+    mutex_lock(&global_kernel.mem_lock);
+    proc = kernel_find_process(pid);
+    if (proc) {
+        list_for_each_entry_safe(region, tmp, &proc->regions, owner_node) {
+            kernel_release_region(region);
+            count++;
+        }
+    }
+    mutex_unlock(&global_kernel.mem_lock);
+    
+    return proc ? count : -EINVAL;
+}
+
 /**
  * Process scheduling
  */
 static int kernel_schedule_process(pid_t pid, u32 new_priority)
 {
-    int i;
+    struct process_info *proc;
     
     // Find process
-    for (i = 0; i < MAX_PROCESSES; i++) {
-        if (global_kernel.processes[i].pid == pid) {
-            break;
-        }
-    }
+    mutex_lock(&global_kernel.mem_lock);
+    proc = kernel_find_process(pid);
+    mutex_unlock(&global_kernel.mem_lock);
     
-    if (i >= MAX_PROCESSES) {
+    if (!proc) {
         pr_err("Process %d not found\n", pid);
         return -EINVAL;
     }
     
-    global_kernel.processes[i].priority = new_priority;
+    proc->priority = new_priority;
     
     pr_info("Process %d scheduled with priority %d\n", pid, new_priority);
     
@@ -262,7 +597,8 @@ static int kernel_schedule_process(pid_t pid, u32 new_priority)
 /**
  * Get kernel statistics
  */
-static int kernel_get_stats(u32 *process_count, u32 *memory_region_count, u64 *total_memory)
+static int kernel_get_stats(u32 *process_count, u32 *memory_region_count, u64 *total_memory,
+                            u64 *free_memory)
 {
     if (process_count) {
         *process_count = global_kernel.process_count;
@@ -273,6 +609,9 @@ static int kernel_get_stats(u32 *process_count, u32 *memory_region_count, u64 *t
     if (total_memory) {
         *total_memory = global_kernel.total_memory;
     }
+    if (free_memory) {
+        *free_memory = (u64)global_kernel.free_pages << SIM_PAGE_SHIFT;
+    }
     
     return 0;
 }
@@ -301,6 +640,9 @@ static int __init kernel_internals_init_module(void)
  */
 static void __exit kernel_internals_cleanup_module(void)
 {
+    struct memory_region *region;
+    struct sim_slab *slab, *tmp;
+    struct hlist_node *next;
     int i;
     
     // Cleanup process timers
@@ -310,6 +652,20 @@ static void __exit kernel_internals_cleanup_module(void)
         }
     }
     
+    // Whatever is still allocated, then the slab pages each class kept
+    mutex_lock(&global_kernel.mem_lock);
+    hash_for_each_safe(global_kernel.region_hash, i, next, region, addr_node) {
+        kernel_release_region(region);
+    }
+    for (i = 0; i < SLAB_CLASSES; i++) {
+        list_for_each_entry_safe(slab, tmp, &global_kernel.slab_partial[i], node) {
+            kfree(slab);
+        }
+    }
+    mutex_unlock(&global_kernel.mem_lock);
+    kmem_cache_destroy(global_kernel.region_cache);
+    vfree(global_kernel.pages);
+    
     pr_info("Linux Kernel Internals unloaded\n");
 }
 
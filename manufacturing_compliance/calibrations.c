@@ -10,8 +10,9 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/mutex.h>
 
-#define CALIBRATION_VERSION "1.0.0"
+#define CALIBRATION_VERSION "1.0.1"
 #define MAX_CALIBRATIONS 32
 
 struct calibration_data {
@@ -25,6 +26,7 @@ struct calibration_data {
 
 static struct calibration_data calibrations[MAX_CALIBRATIONS];
 static int calibration_count = 0;
+static DEFINE_MUTEX(calibration_lock);     // panel steps calibrate concurrently
 
 /**
  * Set calibration data
@@ -33,9 +35,7 @@ int calibration_set(const char *sensor, float offset, float gain, float temp_coe
 {
     int i;
     
-    if (calibration_count >= MAX_CALIBRATIONS) {
-        return -ENOSPC;
-    }
+    mutex_lock(&calibration_lock);
     
     for (i = 0; i < calibration_count; i++) {
         if (strcmp(calibrations[i].sensor_name, sensor) == 0) {
@@ -44,6 +44,10 @@ int calibration_set(const char *sensor, float offset, float gain, float temp_coe
     }
     
     if (i == calibration_count) {
+        if (calibration_count >= MAX_CALIBRATIONS) {
+            mutex_unlock(&calibration_lock);
+            return -ENOSPC;
+        }
         calibration_count++;
     }
     
@@ -54,6 +58,8 @@ int calibration_set(const char *sensor, float offset, float gain, float temp_coe
     calibrations[i].timestamp = jiffies;
     calibrations[i].valid = true;
     
+    mutex_unlock(&calibration_lock);
+    
     pr_info("Calibration: Set for %s (offset=%.3f, gain=%.3f)\n",
             sensor, offset, gain);
     
@@ -66,17 +72,23 @@ int calibration_set(const char *sensor, float offset, float gain, float temp_coe
 int calibration_get(const char *sensor, float *offset, float *gain, float *temp_coeff)
 {
     int i;
+    int ret = -ENOENT;
+    
+    mutex_lock(&calibration_lock);
     
     for (i = 0; i < calibration_count; i++) {
         if (strcmp(calibrations[i].sensor_name, sensor) == 0 && calibrations[i].valid) {
             if (offset) *offset = calibrations[i].offset;
             if (gain) *gain = calibrations[i].gain;
             if (temp_coeff) *temp_coeff = calibrations[i].temperature_coeff;
-            return 0;
+            ret = 0;
+            break;
         }
     }
     
-    return -ENOENT;
+    mutex_unlock(&calibration_lock);
+    
+    return ret;
 }
 
 MODULE_LICENSE("GPL");
@@ -5,6 +5,23 @@
  * 
  * Advanced DFT with manufacturing test optimization
  * Research breakthrough: 99.9% test coverage achieved
+ *
+ * Word c of a pattern's vectors is what scan chain c holds, one bit per
+ * shift cycle, LSB first. All chains shift at once, so a load costs
+ * DFT_PATTERN_BITS cycles however many chains there are, and
+ * dft_run_all() overlaps each pattern's unload with the next one's load.
+ * Patterns added with their care bits are EDT-compressed: the tester
+ * drives DFT_EDT_CHANNELS channels into an on-chip ring generator and
+ * phase shifter that expands them into every chain, and the responses
+ * come back through an XOR compactor, one channel per chains c with
+ * c % DFT_EDT_CHANNELS equal. dft_edt_expand() is the model the DFT IP
+ * implements; patterns whose care bits it cannot produce fall back to
+ * bypass and are loaded chain by chain.
+ *
+ * Faults from ATPG go into a dictionary indexed by observation point
+ * (chain, bit), together with the patterns that detect them. Coverage
+ * is kept up to date as patterns are applied instead of recounted, and
+ * a failing pattern is diagnosed by looking its failing bits up.
  */
 
 #include <linux/module.h>
@@ -14,12 +31,26 @@
 #include <linux/atomic.h>
 #include <linux/timer.h>
 #include <linux/workqueue.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/bitops.h>
+#include <linux/hashtable.h>
+#include <linux/ktime.h>
 
-#define DFT_VERSION "1.0.0"
+#define DFT_VERSION "1.1.0"
 #define MAX_TEST_PATTERNS 1024
 #define MAX_SCAN_CHAINS 32
 #define MAX_BOUNDARY_SCAN_CELLS 256
 #define DFT_TEST_TIMEOUT_MS 10000
+#define DFT_PATTERN_BITS 32                 // shift cycles per load
+#define DFT_EDT_CHANNELS 4
+#define DFT_EDT_INIT_CYCLES 8               // ring fills before the chains shift
+#define DFT_EDT_CYCLES (DFT_EDT_INIT_CYCLES + DFT_PATTERN_BITS)
+#define DFT_EDT_VARS (DFT_EDT_CHANNELS * DFT_EDT_CYCLES)
+#define DFT_EDT_WORDS DIV_ROUND_UP(DFT_EDT_VARS, 32)
+#define DFT_EDT_POLY 0x80200003             // ring generator feedback
+#define DFT_MAX_FAULTS 4096
+#define DFT_FAULT_HASH_BITS 9
 
 enum dft_test_type {
     DFT_TEST_SCAN = 0,
@@ -47,6 +78,13 @@ struct dft_test_pattern {
     u32 fault_count;
     u32 test_time_ms;
     u64 timestamp;
+    bool valid;
+    bool compressed;
+    bool applied;                       // counted in coverage
+    u32 edt_data[DFT_EDT_WORDS];        // tester channel data
+    u32 expected_edt[DFT_EDT_CHANNELS]; // compacted expected response
+    u32 *detects;                       // fault IDs, from ATPG
+    u32 detect_count;
 };
 
 struct dft_scan_chain {
@@ -75,6 +113,14 @@ struct dft_boundary_scan_cell {
     u64 timestamp;
 };
 
+struct dft_fault {
+    struct hlist_node node;             // in dft_fault_index, by observation point
+    enum dft_fault_type type;
+    u16 chain;
+    u16 bit;
+    u32 detect_patterns;                // applied patterns that detect it
+};
+
 struct dft_implementation {
     struct dft_test_pattern test_patterns[MAX_TEST_PATTERNS];
     int test_pattern_count;
@@ -87,6 +133,8 @@ struct dft_implementation {
     u32 detected_faults;
     float fault_coverage;
     float test_coverage;
+    u32 applied_patterns;
+    u32 passed_patterns;
     bool dft_active;
     u32 test_timeout_ms;
     struct timer_list dft_timer;
@@ -94,6 +142,181 @@ struct dft_implementation {
 
 static struct dft_implementation global_dft_implementation;
 
+static struct dft_fault dft_faults[DFT_MAX_FAULTS];
+static DEFINE_HASHTABLE(dft_fault_index, DFT_FAULT_HASH_BITS);
+static DEFINE_MUTEX(dft_mutex);
+
+/*
+ * Tester hooks. Scan data is packed by channel: the bit for channel k
+ * at cycle t is bit k * cycles + t. The chains shift during the last
+ * DFT_PATTERN_BITS cycles, and unload gets what they shift out then.
+ */
+extern int dft_platform_edt_bypass(bool bypass);
+extern int dft_platform_scan(const u32 *load, u32 *unload, u32 channels, u32 cycles);
+extern int dft_platform_capture(u32 cycles);
+
+static u32 dft_phase_out(u32 state, int chain)
+{
+    // Three distinct taps per chain, so no chain is a copy of another
+    u32 v = (state >> ((chain * 7) % 32)) ^ (state >> ((chain * 13 + 5) % 32)) ^
+            (state >> ((chain * 17 + 11) % 32));
+    
+    return v & 1;
+}
+
+/**
+ * Expand tester channel data into chain data, as the decompressor does
+ *
+ * Each cycle the channel bits are injected into the ring generator,
+ * every chain takes its phase shifter output, and the ring clocks.
+ */
+static void dft_edt_expand(const u32 *load, u32 *chains)
+{
+    u32 state = 0;
+    int t, k, c, v;
+    
+    memset(chains, 0, MAX_SCAN_CHAINS * sizeof(u32));
+    
+    for (t = 0; t < DFT_EDT_CYCLES; t++) {
+        for (k = 0; k < DFT_EDT_CHANNELS; k++) {
+            v = k * DFT_EDT_CYCLES + t;
+            state ^= ((load[v / 32] >> (v % 32)) & 1) << (k * 8);
+        }
+        for (c = 0; t >= DFT_EDT_INIT_CYCLES && c < MAX_SCAN_CHAINS; c++) {
+            chains[c] |= dft_phase_out(state, c) << (t - DFT_EDT_INIT_CYCLES);
+        }
+        state = (state >> 1) ^ ((state & 1) ? DFT_EDT_POLY : 0);
+    }
+}
+
+struct dft_edt_solver {
+    u32 state[32][DFT_EDT_WORDS];       // each ring bit as a sum of channel bits
+    u32 pivot[DFT_EDT_VARS][DFT_EDT_WORDS];
+    u8 pivot_rhs[DFT_EDT_VARS];
+    bool have_pivot[DFT_EDT_VARS];
+};
+
+/* Add one care bit's equation; false if it contradicts the ones before */
+static bool dft_edt_equation(struct dft_edt_solver *sv, u32 *row, u8 rhs)
+{
+    int v, w;
+    
+    for (v = 0; v < DFT_EDT_VARS; v++) {
+        if (!(row[v / 32] & BIT(v % 32))) {
+            continue;
+        }
+        if (!sv->have_pivot[v]) {
+            memcpy(sv->pivot[v], row, sizeof(sv->pivot[v]));
+            sv->pivot_rhs[v] = rhs;
+            sv->have_pivot[v] = true;
+            return true;
+        }
+        // Pivot v has no bits below v, so earlier bits stay clear
+        for (w = 0; w < DFT_EDT_WORDS; w++) {
+            row[w] ^= sv->pivot[v][w];
+        }
+        rhs ^= sv->pivot_rhs[v];
+    }
+    
+    return rhs == 0;
+}
+
+/**
+ * Find channel data that produces the care bits of a pattern
+ *
+ * The decompressor is linear, so each care bit is one equation over the
+ * DFT_EDT_VARS channel bits, solved by elimination as they come; bits
+ * no care bit depends on are left 0. The ring is loaded for
+ * DFT_EDT_INIT_CYCLES first, or care bits in the first shifts would
+ * only depend on a few channel bits.
+ */
+static int dft_edt_encode(const u32 *chains, const u32 *care, u32 *load)
+{
+    struct dft_edt_solver *sv;
+    u32 row[DFT_EDT_WORDS];
+    u32 check[MAX_SCAN_CHAINS];
+    u32 x[DFT_EDT_WORDS] = { 0 };
+    int t, k, c, i, w, v, bit;
+    int ret = 0;
+    
+    sv = kzalloc(sizeof(*sv), GFP_KERNEL);
+    if (!sv) {
+        return -ENOMEM;
+    }
+    
+    for (t = 0; t < DFT_EDT_CYCLES; t++) {
+        bit = t - DFT_EDT_INIT_CYCLES;
+        for (k = 0; k < DFT_EDT_CHANNELS; k++) {
+            v = k * DFT_EDT_CYCLES + t;
+            sv->state[k * 8][v / 32] ^= BIT(v % 32);
+        }
+        for (c = 0; bit >= 0 && c < MAX_SCAN_CHAINS; c++) {
+            if (!(care[c] & BIT(bit))) {
+                continue;
+            }
+            for (w = 0; w < DFT_EDT_WORDS; w++) {
+                row[w] = sv->state[(c * 7) % 32][w] ^ sv->state[(c * 13 + 5) % 32][w] ^
+                         sv->state[(c * 17 + 11) % 32][w];
+            }
+            if (!dft_edt_equation(sv, row, (chains[c] >> bit) & 1)) {
+                ret = -ERANGE;
+                goto out;
+            }
+        }
+        // Clock the ring: bit 0 leaves and feeds back into the taps
+        memcpy(row, sv->state[0], sizeof(row));
+        memmove(sv->state[0], sv->state[1], sizeof(sv->state[0]) * 31);
+        memset(sv->state[31], 0, sizeof(sv->state[31]));
+        for (i = 0; i < 32; i++) {
+            if (DFT_EDT_POLY & BIT(i)) {
+                for (w = 0; w < DFT_EDT_WORDS; w++) {
+                    sv->state[i][w] ^= row[w];
+                }
+            }
+        }
+    }
+    
+    // Back substitution; pivot v only involves variables above v
+    for (v = DFT_EDT_VARS - 1; v >= 0; v--) {
+        u32 par = sv->pivot_rhs[v];
+        
+        if (!sv->have_pivot[v]) {
+            continue;
+        }
+        for (w = 0; w < DFT_EDT_WORDS; w++) {
+            par ^= hweight32(sv->pivot[v][w] & x[w]);
+        }
+        if (par & 1) {
+            x[v / 32] |= BIT(v % 32);
+        }
+    }
+    
+    // Variables are numbered the way the tester packs channel data
+    memcpy(load, x, sizeof(x));
+    
+    dft_edt_expand(load, check);
+    for (c = 0; c < MAX_SCAN_CHAINS; c++) {
+        if ((check[c] ^ chains[c]) & care[c]) {
+            ret = -EIO;
+            break;
+        }
+    }
+    
+out:
+    kfree(sv);
+    return ret;
+}
+
+static void dft_edt_compact(const u32 *chains, u32 *channels)
+{
+    int c;
+    
+    memset(channels, 0, DFT_EDT_CHANNELS * sizeof(u32));
+    for (c = 0; c < MAX_SCAN_CHAINS; c++) {
+        channels[c % DFT_EDT_CHANNELS] ^= chains[c];
+    }
+}
+
 /**
  * Initialize DFT implementation
  */
@@ -172,19 +395,23 @@ static int dft_add_test_pattern(enum dft_test_type type, const u32 *input_vector
         return -EINVAL;
     }
     
+    mutex_lock(&dft_mutex);
+    
     // Find free test pattern slot
     for (i = 0; i < MAX_TEST_PATTERNS; i++) {
-        if (global_dft_implementation.test_patterns[i].pattern_id == i && 
-            global_dft_implementation.test_patterns[i].test_time_ms == 0) {
+        if (!global_dft_implementation.test_patterns[i].valid) {
             break;
         }
     }
     
     if (i >= MAX_TEST_PATTERNS) {
+        mutex_unlock(&dft_mutex);
         pr_err("No free DFT test pattern slots available\n");
         return -ENOMEM;
     }
     
+    global_dft_implementation.test_patterns[i].valid = true;
+    global_dft_implementation.test_patterns[i].compressed = false;
     global_dft_implementation.test_patterns[i].type = type;
     memcpy(global_dft_implementation.test_patterns[i].input_vector, input_vector, sizeof(global_dft_implementation.test_patterns[i].input_vector));
     memcpy(global_dft_implementation.test_patterns[i].expected_output, expected_output, sizeof(global_dft_implementation.test_patterns[i].expected_output));
@@ -193,11 +420,130 @@ static int dft_add_test_pattern(enum dft_test_type type, const u32 *input_vector
     
     global_dft_implementation.test_pattern_count++;
     
+    mutex_unlock(&dft_mutex);
+    
     pr_info("DFT test pattern %d added: type=%d\n", i, type);
     
     return i;
 }
 
+/**
+ * Add DFT test pattern with its care bits, EDT-compressed
+ *
+ * Bits outside care are don't-cares the decompressor fills as it likes.
+ * If the care bits are more than the channels can produce the pattern
+ * is kept uncompressed and applied in bypass.
+ */
+static int dft_add_compressed_pattern(enum dft_test_type type, const u32 *input_vector,
+                                      const u32 *care_mask, const u32 *expected_output)
+{
+    struct dft_test_pattern *pattern;
+    u32 load[DFT_EDT_WORDS];
+    int id, ret;
+    
+    if (!care_mask) {
+        return -EINVAL;
+    }
+    
+    id = dft_add_test_pattern(type, input_vector, expected_output);
+    if (id < 0) {
+        return id;
+    }
+    
+    ret = dft_edt_encode(input_vector, care_mask, load);
+    if (ret == -ENOMEM) {
+        return ret;
+    }
+    if (ret) {
+        pr_info("DFT test pattern %d: care bits exceed EDT capacity, using bypass\n", id);
+        return id;
+    }
+    
+    mutex_lock(&dft_mutex);
+    pattern = &global_dft_implementation.test_patterns[id];
+    memcpy(pattern->edt_data, load, sizeof(load));
+    dft_edt_compact(pattern->expected_output, pattern->expected_edt);
+    pattern->compressed = true;
+    mutex_unlock(&dft_mutex);
+    
+    return id;
+}
+
+/**
+ * Add a modeled fault, observed at one bit of one scan chain
+ */
+static int dft_add_fault(enum dft_fault_type type, u32 chain, u32 bit)
+{
+    struct dft_fault *fault;
+    int id;
+    
+    if (chain >= MAX_SCAN_CHAINS || bit >= DFT_PATTERN_BITS) {
+        return -EINVAL;
+    }
+    
+    mutex_lock(&dft_mutex);
+    
+    id = global_dft_implementation.total_faults;
+    if (id >= DFT_MAX_FAULTS) {
+        mutex_unlock(&dft_mutex);
+        return -ENOSPC;
+    }
+    
+    fault = &dft_faults[id];
+    fault->type = type;
+    fault->chain = chain;
+    fault->bit = bit;
+    fault->detect_patterns = 0;
+    hash_add(dft_fault_index, &fault->node, chain * DFT_PATTERN_BITS + bit);
+    global_dft_implementation.total_faults++;
+    
+    mutex_unlock(&dft_mutex);
+    
+    return id;
+}
+
+/**
+ * Record which faults a pattern detects, from ATPG fault simulation
+ */
+static int dft_set_pattern_faults(int pattern_id, const u32 *fault_ids, u32 count)
+{
+    struct dft_test_pattern *pattern;
+    u32 *ids;
+    u32 i;
+    
+    if (pattern_id < 0 || pattern_id >= MAX_TEST_PATTERNS || (count && !fault_ids)) {
+        return -EINVAL;
+    }
+    
+    ids = kmemdup(fault_ids, count * sizeof(u32), GFP_KERNEL);
+    if (count && !ids) {
+        return -ENOMEM;
+    }
+    
+    mutex_lock(&dft_mutex);
+    
+    pattern = &global_dft_implementation.test_patterns[pattern_id];
+    for (i = 0; i < count; i++) {
+        if (ids[i] >= global_dft_implementation.total_faults) {
+            break;
+        }
+    }
+    if (!pattern->valid || pattern->applied || i < count) {
+        // Changing an applied pattern's faults would skew the coverage counts
+        mutex_unlock(&dft_mutex);
+        kfree(ids);
+        return -EINVAL;
+    }
+    
+    kfree(pattern->detects);
+    pattern->detects = ids;
+    pattern->detect_count = count;
+    
+    mutex_unlock(&dft_mutex);
+    
+    return 0;
+}
+
 /**
  * Add DFT scan chain
  */
@@ -280,54 +626,123 @@ static int dft_add_boundary_scan_cell(const char *name, bool input_cell, bool ou
     return i;
 }
 
+static void dft_update_coverage(void)
+{
+    struct dft_implementation *dft = &global_dft_implementation;
+    
+    dft->test_coverage = dft->applied_patterns ?
+                         (float)dft->passed_patterns / dft->applied_patterns * 100.0 : 0.0;
+    dft->fault_coverage = dft->total_faults ?
+                          (float)dft->detected_faults / dft->total_faults * 100.0 : 0.0;
+}
+
+/* Check an unloaded response and fold it into the coverage counts */
+static void dft_record_result(struct dft_test_pattern *pattern, const u32 *unload)
+{
+    struct dft_implementation *dft = &global_dft_implementation;
+    const u32 *expected = pattern->compressed ? pattern->expected_edt : pattern->expected_output;
+    u32 words = pattern->compressed ? DFT_EDT_CHANNELS : MAX_SCAN_CHAINS;
+    bool was_passed = pattern->applied && pattern->passed;
+    u32 i;
+    
+    memset(pattern->actual_output, 0, sizeof(pattern->actual_output));
+    memcpy(pattern->actual_output, unload, words * sizeof(u32));
+    
+    pattern->fault_count = 0;
+    for (i = 0; i < words; i++) {
+        pattern->fault_count += hweight32(unload[i] ^ expected[i]);
+    }
+    pattern->passed = pattern->fault_count == 0;
+    pattern->timestamp = jiffies;
+    
+    // A fault counts as covered once any pattern that detects it has run
+    if (!pattern->applied) {
+        pattern->applied = true;
+        dft->applied_patterns++;
+        for (i = 0; i < pattern->detect_count; i++) {
+            if (dft_faults[pattern->detects[i]].detect_patterns++ == 0) {
+                dft->detected_faults++;
+            }
+        }
+    }
+    if (pattern->passed != was_passed) {
+        if (pattern->passed) {
+            dft->passed_patterns++;
+        } else {
+            dft->passed_patterns--;
+        }
+    }
+    
+    atomic_inc(&dft->total_tests);
+    dft_update_coverage();
+}
+
+static u32 dft_capture_cycles(void)
+{
+    u32 cycles = 1;
+    int i;
+    
+    for (i = 0; i < MAX_SCAN_CHAINS; i++) {
+        if (global_dft_implementation.scan_chains[i].active) {
+            cycles = max(cycles, global_dft_implementation.scan_chains[i].capture_cycles);
+        }
+    }
+    
+    return cycles;
+}
+
 /**
  * Run DFT test
  */
 static int dft_run_test(int pattern_id)
 {
-    u32 start_time, end_time;
+    u32 unload[MAX_SCAN_CHAINS];
+    struct dft_test_pattern *pattern;
+    ktime_t start;
+    u32 channels;
+    int ret;
     
-    if (pattern_id >= MAX_TEST_PATTERNS) {
+    if (pattern_id < 0 || pattern_id >= MAX_TEST_PATTERNS) {
         pr_err("Invalid DFT test pattern ID\n");
         return -EINVAL;
     }
     
-    struct dft_test_pattern *pattern = &global_dft_implementation.test_patterns[pattern_id];
+    mutex_lock(&dft_mutex);
+    
+    pattern = &global_dft_implementation.test_patterns[pattern_id];
     
-    if (pattern->test_time_ms == 0) {
+    if (!pattern->valid) {
+        mutex_unlock(&dft_mutex);
         pr_err("DFT test pattern %d is not initialized\n", pattern_id);
         return -EINVAL;
     }
     
     pr_info("Running DFT test pattern %d\n", pattern_id);
     
-    start_time = jiffies;
-    
-    // Simulate DFT test execution
-    udelay(1000); // 1ms delay
+    start = ktime_get();
+    channels = pattern->compressed ? DFT_EDT_CHANNELS : MAX_SCAN_CHAINS;
     
-    // Simulate test results
-    pattern->actual_output[0] = pattern->expected_output[0];
-    pattern->actual_output[1] = pattern->expected_output[1];
-    pattern->actual_output[2] = pattern->expected_output[2];
-    pattern->actual_output[3] = pattern->expected_output[3];
-    
-    // Check if test passed
-    if (memcmp(pattern->actual_output, pattern->expected_output, sizeof(pattern->actual_output)) == 0) {
-        pattern->passed = true;
-        pattern->fault_count = 0;
-    } else {
-        pattern->passed = false;
-        pattern->fault_count = 1;
-        global_dft_implementation.detected_faults++;
+    ret = dft_platform_edt_bypass(!pattern->compressed);
+    if (!ret) {
+        ret = dft_platform_scan(pattern->compressed ? pattern->edt_data : pattern->input_vector,
+                                NULL, channels, pattern->compressed ? DFT_EDT_CYCLES : DFT_PATTERN_BITS);
+    }
+    if (!ret) {
+        ret = dft_platform_capture(dft_capture_cycles());
+    }
+    if (!ret) {
+        ret = dft_platform_scan(NULL, unload, channels, DFT_PATTERN_BITS);
+    }
+    if (ret) {
+        mutex_unlock(&dft_mutex);
+        pr_err("DFT test pattern %d: tester error %d\n", pattern_id, ret);
+        return ret;
     }
     
-    end_time = jiffies;
-    pattern->test_time_ms = jiffies_to_msecs(end_time - start_time);
-    pattern->timestamp = jiffies;
+    dft_record_result(pattern, unload);
+    pattern->test_time_ms = ktime_ms_delta(ktime_get(), start);
     
-    global_dft_implementation.total_faults++;
-    atomic_inc(&global_dft_implementation.total_tests);
+    mutex_unlock(&dft_mutex);
     
     pr_info("DFT test pattern %d completed: passed=%s, faults=%d, time=%d ms\n",
             pattern_id, pattern->passed ? "yes" : "no", pattern->fault_count, pattern->test_time_ms);
@@ -335,41 +750,157 @@ static int dft_run_test(int pattern_id)
     return 0;
 }
 
+/* Apply every pattern of one mode, unloading each while the next loads */
+static int dft_run_mode(bool compressed, u32 *failed)
+{
+    struct dft_test_pattern *prev = NULL;
+    u32 channels = compressed ? DFT_EDT_CHANNELS : MAX_SCAN_CHAINS;
+    u32 cycles = compressed ? DFT_EDT_CYCLES : DFT_PATTERN_BITS;
+    u32 capture = dft_capture_cycles();
+    u32 unload[MAX_SCAN_CHAINS];
+    int i, ret;
+    
+    ret = dft_platform_edt_bypass(!compressed);
+    if (ret) {
+        return ret;
+    }
+    
+    for (i = 0; i < MAX_TEST_PATTERNS; i++) {
+        struct dft_test_pattern *pattern = &global_dft_implementation.test_patterns[i];
+        
+        if (!pattern->valid || pattern->compressed != compressed) {
+            continue;
+        }
+        
+        ret = dft_platform_scan(compressed ? pattern->edt_data : pattern->input_vector,
+                                prev ? unload : NULL, channels, cycles);
+        if (ret) {
+            return ret;
+        }
+        if (prev) {
+            dft_record_result(prev, unload);
+            *failed += !prev->passed;
+        }
+        
+        ret = dft_platform_capture(capture);
+        if (ret) {
+            return ret;
+        }
+        prev = pattern;
+    }
+    
+    if (prev) {
+        ret = dft_platform_scan(NULL, unload, channels, DFT_PATTERN_BITS);
+        if (ret) {
+            return ret;
+        }
+        dft_record_result(prev, unload);
+        *failed += !prev->passed;
+    }
+    
+    return 0;
+}
+
 /**
- * Calculate DFT coverage
+ * Run every DFT test pattern
+ *
+ * Compressed patterns go first, then the bypass ones. Returns the
+ * number of failing patterns, or a tester error.
  */
-static int dft_calculate_coverage(void)
+static int dft_run_all(void)
 {
-    int i;
-    u32 total_tests = 0;
-    u32 passed_tests = 0;
-    u32 total_faults = 0;
-    u32 detected_faults = 0;
-    
-    pr_info("Calculating DFT coverage\n");
-    
-    // Calculate test coverage
-    for (i = 0; i < global_dft_implementation.test_pattern_count; i++) {
-        if (global_dft_implementation.test_patterns[i].test_time_ms > 0) {
-            total_tests++;
-            if (global_dft_implementation.test_patterns[i].passed) {
-                passed_tests++;
-            }
-        }
+    u32 failed = 0;
+    ktime_t start;
+    int ret;
+    
+    mutex_lock(&dft_mutex);
+    
+    start = ktime_get();
+    ret = dft_run_mode(true, &failed);
+    if (!ret) {
+        ret = dft_run_mode(false, &failed);
     }
     
-    // Calculate fault coverage
-    for (i = 0; i < global_dft_implementation.test_pattern_count; i++) {
-        if (global_dft_implementation.test_patterns[i].test_time_ms > 0) {
-            total_faults += global_dft_implementation.test_patterns[i].fault_count;
-            if (global_dft_implementation.test_patterns[i].fault_count > 0) {
-                detected_faults++;
+    mutex_unlock(&dft_mutex);
+    
+    if (ret) {
+        pr_err("DFT run aborted: tester error %d\n", ret);
+        return ret;
+    }
+    
+    pr_info("DFT run completed: %u failing patterns, %lld us\n",
+            failed, ktime_us_delta(ktime_get(), start));
+    
+    return failed;
+}
+
+/**
+ * Diagnose a failing pattern from the fault dictionary
+ *
+ * Each failing bit of the response names the chain bits it could have
+ * come from; the candidates are the faults observed there that the
+ * pattern detects. Returns how many were written to fault_ids.
+ */
+static int dft_diagnose(int pattern_id, u32 *fault_ids, u32 max)
+{
+    struct dft_test_pattern *pattern;
+    struct dft_fault *fault;
+    u32 words, diff, id, i, j, n = 0;
+    int c, t;
+    
+    if (pattern_id < 0 || pattern_id >= MAX_TEST_PATTERNS || !fault_ids) {
+        return -EINVAL;
+    }
+    
+    mutex_lock(&dft_mutex);
+    
+    pattern = &global_dft_implementation.test_patterns[pattern_id];
+    if (!pattern->applied) {
+        mutex_unlock(&dft_mutex);
+        return -ENODATA;
+    }
+    
+    words = pattern->compressed ? DFT_EDT_CHANNELS : MAX_SCAN_CHAINS;
+    for (i = 0; i < words && n < max; i++) {
+        diff = pattern->actual_output[i] ^
+               (pattern->compressed ? pattern->expected_edt[i] : pattern->expected_output[i]);
+        
+        for (t = 0; diff && t < DFT_PATTERN_BITS; t++) {
+            if (!(diff & BIT(t))) {
+                continue;
+            }
+            // Through the compactor, a channel bit is any of its chains
+            for (c = i; c < MAX_SCAN_CHAINS; c += pattern->compressed ? DFT_EDT_CHANNELS : MAX_SCAN_CHAINS) {
+                hash_for_each_possible(dft_fault_index, fault, node, c * DFT_PATTERN_BITS + t) {
+                    if (fault->chain != c || fault->bit != t) {
+                        continue;
+                    }
+                    id = fault - dft_faults;
+                    for (j = 0; j < pattern->detect_count && pattern->detects[j] != id; j++)
+                        ;
+                    if (j < pattern->detect_count && n < max) {
+                        fault_ids[n++] = id;
+                    }
+                }
             }
         }
     }
     
-    global_dft_implementation.test_coverage = (float)passed_tests / total_tests * 100.0;
-    global_dft_implementation.fault_coverage = (float)detected_faults / total_faults * 100.0;
+    mutex_unlock(&dft_mutex);
+    
+    return n;
+}
+
+/**
+ * Calculate DFT coverage
+ *
+ * The counts behind it are kept as patterns are applied.
+ */
+static int dft_calculate_coverage(void)
+{
+    mutex_lock(&dft_mutex);
+    dft_update_coverage();
+    mutex_unlock(&dft_mutex);
     
     pr_info("DFT coverage calculated: test_coverage=%.2f%%, fault_coverage=%.2f%%\n",
             global_dft_implementation.test_coverage, global_dft_implementation.fault_coverage);
@@ -425,6 +956,12 @@ static int __init dft_implementation_init_module(void)
  */
 static void __exit dft_implementation_cleanup_module(void)
 {
+    int i;
+    
+    for (i = 0; i < MAX_TEST_PATTERNS; i++) {
+        kfree(global_dft_implementation.test_patterns[i].detects);
+    }
+    
     pr_info("DFT Implementation unloaded\n");
 }
 
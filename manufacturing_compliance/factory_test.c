@@ -5,12 +5,25 @@
  * 
  * Factory test and validation framework
  * Performs comprehensive device testing during manufacturing
+ *
+ * factory_panel_run() runs a whole panel of units through a test plan
+ * concurrently (see factory_test.h). Each step runs as a work item on
+ * an unbound workqueue, and a dispatcher hands out fixture resources
+ * as steps finish. It ranks ready steps by critical path, which keeps
+ * the scarce instruments busy and finishes the panel sooner than
+ * testing the units one after another.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/jiffies.h>
+#include "factory_test.h"
 
-#define FACTORY_TEST_VERSION "1.0.0"
+#define FACTORY_TEST_VERSION "1.1.0"
 
 struct factory_test {
     char test_name[64];
@@ -32,6 +45,30 @@ static struct factory_test tests[] = {
 
 #define NUM_TESTS (sizeof(tests) / sizeof(tests[0]))
 
+struct factory_job {
+    struct work_struct work;
+    struct factory_panel *panel;
+    u32 dut;
+    u32 step;
+};
+
+struct factory_panel {
+    const struct factory_plan *plan;
+    u32 dut_count;
+    struct mutex lock;
+    u32 done[FACTORY_MAX_DUTS];         // steps passed
+    u32 started[FACTORY_MAX_DUTS];
+    u32 failed;                         // units that failed a step
+    u32 busy[FACTORY_MAX_RESOURCES];
+    u32 running;
+    u32 path_ms[FACTORY_MAX_STEPS];     // longest expected time to plan end
+    u32 step_ms[FACTORY_MAX_STEPS];     // total time spent in each step
+    struct factory_job *jobs;
+    struct completion finished;
+};
+
+static struct workqueue_struct *factory_wq;
+
 /**
  * Run factory tests
  */
@@ -68,6 +105,232 @@ int factory_test_run_all(void)
     return (failed == 0) ? 0 : -1;
 }
 
+/*
+ * Longest expected time from each step to the end of the plan. Steps
+ * are settled once every step depending on them is, which also finds
+ * dependency cycles.
+ */
+static int factory_plan_paths(const struct factory_plan *plan, u32 *path_ms)
+{
+    u32 settled = 0;
+    u32 all = plan->step_count == 32 ? ~0u : BIT(plan->step_count) - 1;
+    u32 s, d, longest;
+    bool progress;
+    
+    do {
+        progress = false;
+        for (s = 0; s < plan->step_count; s++) {
+            if (settled & BIT(s)) {
+                continue;
+            }
+            longest = 0;
+            for (d = 0; d < plan->step_count; d++) {
+                if (!(plan->steps[d].depends & BIT(s))) {
+                    continue;
+                }
+                if (!(settled & BIT(d))) {
+                    break;
+                }
+                longest = max(longest, path_ms[d]);
+            }
+            if (d < plan->step_count) {
+                continue;
+            }
+            path_ms[s] = plan->steps[s].est_ms + longest;
+            settled |= BIT(s);
+            progress = true;
+        }
+    } while (progress);
+    
+    return settled == all ? 0 : -ELOOP;
+}
+
+static void factory_panel_dispatch(struct factory_panel *panel);
+
+static void factory_job_run(struct work_struct *work)
+{
+    struct factory_job *job = container_of(work, struct factory_job, work);
+    struct factory_panel *panel = job->panel;
+    const struct factory_step *step = &panel->plan->steps[job->step];
+    unsigned long start = jiffies;
+    int ret;
+    
+    ret = step->run(job->dut, panel->plan->ctx);
+    
+    mutex_lock(&panel->lock);
+    
+    panel->busy[step->resource]--;
+    panel->running--;
+    panel->step_ms[job->step] += jiffies_to_msecs(jiffies - start);
+    
+    if (ret) {
+        pr_err("Factory Test: unit %u %s FAILED (%d)\n", job->dut, step->name, ret);
+        panel->failed |= BIT(job->dut);
+    } else {
+        panel->done[job->dut] |= BIT(job->step);
+    }
+    
+    factory_panel_dispatch(panel);
+    
+    mutex_unlock(&panel->lock);
+}
+
+/* Start every step that can run now, highest critical path first */
+static void factory_panel_dispatch(struct factory_panel *panel)
+{
+    const struct factory_plan *plan = panel->plan;
+    const struct factory_step *step;
+    u32 dut, s, best_dut, best_step;
+    struct factory_job *job;
+    bool found;
+    
+    lockdep_assert_held(&panel->lock);
+    
+    for (;;) {
+        found = false;
+        best_dut = 0;
+        best_step = 0;
+        
+        for (s = 0; s < plan->step_count; s++) {
+            step = &plan->steps[s];
+            if (step->resource && panel->busy[step->resource] >= plan->resource_capacity[step->resource]) {
+                continue;
+            }
+            if (found && panel->path_ms[s] <= panel->path_ms[best_step]) {
+                continue;
+            }
+            // Lowest unit first, so units finish in order and leave the panel early
+            for (dut = 0; dut < panel->dut_count; dut++) {
+                if (!(panel->failed & BIT(dut)) && !(panel->started[dut] & BIT(s)) &&
+                    (step->depends & ~panel->done[dut]) == 0) {
+                    found = true;
+                    best_dut = dut;
+                    best_step = s;
+                    break;
+                }
+            }
+        }
+        
+        if (!found) {
+            break;
+        }
+        
+        step = &plan->steps[best_step];
+        panel->started[best_dut] |= BIT(best_step);
+        panel->busy[step->resource]++;
+        panel->running++;
+        
+        job = &panel->jobs[best_dut * plan->step_count + best_step];
+        job->panel = panel;
+        job->dut = best_dut;
+        job->step = best_step;
+        INIT_WORK(&job->work, factory_job_run);
+        queue_work(factory_wq, &job->work);
+    }
+    
+    if (!panel->running) {
+        complete(&panel->finished);
+    }
+}
+
+/**
+ * Run a panel of units through a test plan, concurrently
+ *
+ * Returns 0 if every unit passed every step, -EIO if any failed (with
+ * the failing units in failed_duts), or -EINVAL for a bad plan.
+ */
+int factory_panel_run(const struct factory_plan *plan, u32 dut_count, u32 *failed_duts)
+{
+    struct factory_panel *panel;
+    unsigned long start = jiffies;
+    u32 s, serial_ms = 0;
+    int ret;
+    
+    if (!plan || !plan->steps || !plan->step_count || plan->step_count > FACTORY_MAX_STEPS ||
+        !dut_count || dut_count > FACTORY_MAX_DUTS) {
+        return -EINVAL;
+    }
+    
+    for (s = 0; s < plan->step_count; s++) {
+        const struct factory_step *step = &plan->steps[s];
+        
+        if (!step->run || step->resource >= FACTORY_MAX_RESOURCES ||
+            (step->resource && !plan->resource_capacity[step->resource]) ||
+            (step->depends & BIT(s)) || (step->depends >> plan->step_count)) {
+            pr_err("Factory Test: step %u of the plan is invalid\n", s);
+            return -EINVAL;
+        }
+    }
+    
+    panel = kzalloc(sizeof(*panel), GFP_KERNEL);
+    if (!panel) {
+        return -ENOMEM;
+    }
+    panel->jobs = kcalloc(dut_count * plan->step_count, sizeof(*panel->jobs), GFP_KERNEL);
+    if (!panel->jobs) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    
+    ret = factory_plan_paths(plan, panel->path_ms);
+    if (ret) {
+        pr_err("Factory Test: plan has a dependency cycle\n");
+        goto out;
+    }
+    
+    panel->plan = plan;
+    panel->dut_count = dut_count;
+    mutex_init(&panel->lock);
+    init_completion(&panel->finished);
+    
+    pr_info("Factory Test: Starting panel of %u units, %u steps\n", dut_count, plan->step_count);
+    
+    mutex_lock(&panel->lock);
+    factory_panel_dispatch(panel);
+    mutex_unlock(&panel->lock);
+    
+    wait_for_completion(&panel->finished);
+    
+    // The last job signals while it still holds the lock
+    mutex_lock(&panel->lock);
+    mutex_unlock(&panel->lock);
+    
+    for (s = 0; s < plan->step_count; s++) {
+        serial_ms += panel->step_ms[s];
+    }
+    pr_info("Factory Test: Panel complete in %u ms (%u ms of steps) - Failed units: %u\n",
+            jiffies_to_msecs(jiffies - start), serial_ms, hweight32(panel->failed));
+    
+    if (failed_duts) {
+        *failed_duts = panel->failed;
+    }
+    ret = panel->failed ? -EIO : 0;
+    
+out:
+    kfree(panel->jobs);
+    kfree(panel);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(factory_panel_run);
+
+static int __init factory_test_init(void)
+{
+    factory_wq = alloc_workqueue("factory_test", WQ_UNBOUND, FACTORY_MAX_DUTS);
+    if (!factory_wq) {
+        return -ENOMEM;
+    }
+    
+    return 0;
+}
+
+static void __exit factory_test_exit(void)
+{
+    destroy_workqueue(factory_wq);
+}
+
+module_init(factory_test_init);
+module_exit(factory_test_exit);
+
 /**
  * Memory test
  */
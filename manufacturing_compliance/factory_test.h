@@ -0,0 +1,41 @@
+/**
+ * Factory panel sequencer interface
+ *
+ * A test plan is a set of steps, each naming the steps that must pass
+ * on a unit before it can run and the fixture resource it holds while
+ * it runs (an RF analyzer, a programmer channel, or none). The plan's
+ * resource_capacity says how many of each the fixture has; resource 0
+ * is per unit and never contended. factory_panel_run() drives every
+ * unit on the panel through the plan at once: whenever a step finishes,
+ * the ready step with the longest expected path to the end of the plan
+ * gets the next free resource, so slow steps on one unit overlap with
+ * other units' work. A unit that fails a step runs nothing more.
+ */
+
+#ifndef FACTORY_TEST_H
+#define FACTORY_TEST_H
+
+#include <linux/types.h>
+
+#define FACTORY_MAX_DUTS 32
+#define FACTORY_MAX_STEPS 32
+#define FACTORY_MAX_RESOURCES 8
+
+struct factory_step {
+    const char *name;
+    int (*run)(u32 dut, void *ctx);     // may sleep; 0 on pass
+    u32 depends;                        // mask of step indices
+    u8 resource;
+    u32 est_ms;                         // expected duration, for ordering
+};
+
+struct factory_plan {
+    const struct factory_step *steps;
+    u32 step_count;
+    u8 resource_capacity[FACTORY_MAX_RESOURCES];
+    void *ctx;
+};
+
+int factory_panel_run(const struct factory_plan *plan, u32 dut_count, u32 *failed_duts);
+
+#endif /* FACTORY_TEST_H */
@@ -10,8 +10,9 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/crypto.h>
+#include <linux/mutex.h>
 
-#define FUSE_KEY_VERSION "1.0.0"
+#define FUSE_KEY_VERSION "1.0.1"
 #define MAX_FUSE_KEYS 16
 
 struct fuse_key {
@@ -24,6 +25,7 @@ struct fuse_key {
 
 static struct fuse_key fuse_keys[MAX_FUSE_KEYS];
 static int fuse_key_count = 0;
+static DEFINE_MUTEX(fuse_key_lock);        // panel steps program concurrently
 
 /**
  * Program fuse key
@@ -32,20 +34,18 @@ int fuse_key_program(const char *name, const u8 *key_data, size_t key_len)
 {
     int i;
     
-    if (fuse_key_count >= MAX_FUSE_KEYS) {
-        pr_err("Fuse Key: Maximum keys reached\n");
-        return -ENOSPC;
-    }
-    
     if (key_len > 32) {
         pr_err("Fuse Key: Key too large\n");
         return -EINVAL;
     }
     
+    mutex_lock(&fuse_key_lock);
+    
     // Check if already exists
     for (i = 0; i < fuse_key_count; i++) {
         if (strcmp(fuse_keys[i].name, name) == 0) {
             if (fuse_keys[i].programmed) {
+                mutex_unlock(&fuse_key_lock);
                 pr_warn("Fuse Key: '%s' already programmed\n", name);
                 return -EEXIST;
             }
@@ -54,6 +54,11 @@ int fuse_key_program(const char *name, const u8 *key_data, size_t key_len)
     }
     
     if (i == fuse_key_count) {
+        if (fuse_key_count >= MAX_FUSE_KEYS) {
+            mutex_unlock(&fuse_key_lock);
+            pr_err("Fuse Key: Maximum keys reached\n");
+            return -ENOSPC;
+        }
         fuse_key_count++;
     }
     
@@ -62,6 +67,8 @@ int fuse_key_program(const char *name, const u8 *key_data, size_t key_len)
     fuse_keys[i].key_len = key_len;
     fuse_keys[i].programmed = true;
     
+    mutex_unlock(&fuse_key_lock);
+    
     pr_info("Fuse Key: Programmed '%s', len: %zu\n", name, key_len);
     
     return 0;
@@ -73,11 +80,14 @@ int fuse_key_program(const char *name, const u8 *key_data, size_t key_len)
 int fuse_key_get(const char *name, u8 *key_data, size_t *key_len)
 {
     int i;
+    int ret = -ENOENT;
+    
+    mutex_lock(&fuse_key_lock);
     
     for (i = 0; i < fuse_key_count; i++) {
         if (strcmp(fuse_keys[i].name, name) == 0) {
             if (!fuse_keys[i].programmed) {
-                return -ENOENT;
+                break;
             }
             
             if (key_data && key_len) {
@@ -86,11 +96,14 @@ int fuse_key_get(const char *name, u8 *key_data, size_t *key_len)
                 *key_len = copy_len;
             }
             
-            return 0;
+            ret = 0;
+            break;
         }
     }
     
-    return -ENOENT;
+    mutex_unlock(&fuse_key_lock);
+    
+    return ret;
 }
 
 MODULE_LICENSE("GPL");
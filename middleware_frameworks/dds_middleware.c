@@ -5,6 +5,11 @@
  * 
  * Advanced DDS (Data Distribution Service) middleware
  * Research breakthrough: Real-time data distribution
+ *
+ * The name based front end of the DDS core in automotive_protocols
+ * (dds_core.h). Topic names are interned by the core when a topic is
+ * created; dds_get_topic() hands out the resolved handle, and the
+ * dds_*_topic() calls through it never look at a string again.
  */
 
 #include <linux/module.h>
@@ -15,48 +20,19 @@
 #include <linux/atomic.h>
 #include <linux/timer.h>
 #include <linux/workqueue.h>
+#include <linux/err.h>
 
-#define DDS_VERSION "1.0.0"
-#define DDS_MAX_PARTICIPANTS 32
-#define DDS_MAX_TOPICS 64
-#define DDS_MAX_SAMPLES 1024
-#define DDS_DEADLINE_MS 100
+#include "../automotive_protocols/dds_core.h"
 
-enum dds_reliability {
-    DDS_RELIABILITY_BEST_EFFORT = 0,
-    DDS_RELIABILITY_RELIABLE = 1
-};
-
-enum dds_durability {
-    DDS_DURABILITY_VOLATILE = 0,
-    DDS_DURABILITY_TRANSIENT_LOCAL = 1,
-    DDS_DURABILITY_TRANSIENT = 2,
-    DDS_DURABILITY_PERSISTENT = 3
-};
-
-struct dds_topic {
-    char name[256];
-    char type[256];
-    enum dds_reliability reliability;
-    enum dds_durability durability;
-    u32 deadline_ms;
-    bool active;
-    atomic_t sample_count;
-    u32 error_count;
-};
+#define DDS_VERSION "1.1.0"
 
 struct dds_participant {
-    int participant_id;
-    char name[64];
-    bool active;
-    struct dds_topic topics[DDS_MAX_TOPICS];
-    int topic_count;
     atomic_t total_samples;
     u32 participant_errors;
 };
 
 struct dds_middleware {
-    struct dds_participant participants[DDS_MAX_PARTICIPANTS];
+    struct dds_participant participants[MAX_DDS_PARTICIPANTS];
     int participant_count;
     atomic_t total_samples;
     u32 middleware_errors;
@@ -71,7 +47,7 @@ static struct dds_middleware global_dds_middleware;
  */
 static int dds_middleware_init(void)
 {
-    int i, j;
+    int i;
     
     pr_info("Initializing DDS middleware\n");
     
@@ -81,26 +57,10 @@ static int dds_middleware_init(void)
     global_dds_middleware.middleware_active = true;
     global_dds_middleware.default_deadline_ms = DDS_DEADLINE_MS;
     
-    // Initialize participants
-    for (i = 0; i < DDS_MAX_PARTICIPANTS; i++) {
-        global_dds_middleware.participants[i].participant_id = i;
-        strcpy(global_dds_middleware.participants[i].name, "");
-        global_dds_middleware.participants[i].active = false;
-        global_dds_middleware.participants[i].topic_count = 0;
+    // Initialize participants; their topics live in the core
+    for (i = 0; i < MAX_DDS_PARTICIPANTS; i++) {
         atomic_set(&global_dds_middleware.participants[i].total_samples, 0);
         global_dds_middleware.participants[i].participant_errors = 0;
-        
-        // Initialize topics
-        for (j = 0; j < DDS_MAX_TOPICS; j++) {
-            strcpy(global_dds_middleware.participants[i].topics[j].name, "");
-            strcpy(global_dds_middleware.participants[i].topics[j].type, "");
-            global_dds_middleware.participants[i].topics[j].reliability = DDS_RELIABILITY_BEST_EFFORT;
-            global_dds_middleware.participants[i].topics[j].durability = DDS_DURABILITY_VOLATILE;
-            global_dds_middleware.participants[i].topics[j].deadline_ms = DDS_DEADLINE_MS;
-            global_dds_middleware.participants[i].topics[j].active = false;
-            atomic_set(&global_dds_middleware.participants[i].topics[j].sample_count, 0);
-            global_dds_middleware.participants[i].topics[j].error_count = 0;
-        }
     }
     
     pr_info("DDS middleware initialized\n");
@@ -113,196 +73,151 @@ static int dds_middleware_init(void)
  */
 static int dds_create_participant(int participant_id, const char *name)
 {
-    if (participant_id >= DDS_MAX_PARTICIPANTS || !name) {
+    int ret;
+    
+    if (participant_id < 0 || participant_id >= MAX_DDS_PARTICIPANTS || !name) {
         pr_err("Invalid DDS participant parameters\n");
         return -EINVAL;
     }
     
-    struct dds_participant *participant = &global_dds_middleware.participants[participant_id];
-    
-    participant->participant_id = participant_id;
-    strcpy(participant->name, name);
-    participant->active = true;
+    ret = dds_core_create_participant(participant_id, name);
+    if (ret) {
+        global_dds_middleware.middleware_errors++;
+        return ret;
+    }
     
     global_dds_middleware.participant_count++;
     
-    pr_info("DDS participant %d created: name=%s\n", participant_id, name);
-    
     return 0;
 }
 
 /**
- * Create DDS topic
+ * Create DDS topic in the first free slot of the participant
  */
 static int dds_create_topic(int participant_id, const char *topic_name, const char *type_name,
-                            enum dds_reliability reliability, enum dds_durability durability)
+                            enum dds_reliability_kind reliability, enum dds_durability_kind durability)
 {
-    int i;
+    struct dds_topic *topic;
     
-    if (participant_id >= DDS_MAX_PARTICIPANTS || !topic_name || !type_name) {
+    if (participant_id < 0 || participant_id >= MAX_DDS_PARTICIPANTS || !topic_name || !type_name) {
         pr_err("Invalid DDS topic parameters\n");
         return -EINVAL;
     }
     
-    struct dds_participant *participant = &global_dds_middleware.participants[participant_id];
-    
-    if (!participant->active) {
-        pr_err("DDS participant %d is not active\n", participant_id);
-        return -EINVAL;
+    topic = dds_core_create_topic(participant_id, DDS_ANY_TOPIC, topic_name, type_name, reliability,
+                                  durability, DDS_HISTORY_KEEP_LAST, 1,
+                                  global_dds_middleware.default_deadline_ms);
+    if (IS_ERR(topic)) {
+        global_dds_middleware.participants[participant_id].participant_errors++;
+        return PTR_ERR(topic);
     }
     
-    // Find free topic slot
-    for (i = 0; i < DDS_MAX_TOPICS; i++) {
-        if (!participant->topics[i].active) {
-            break;
-        }
-    }
-    
-    if (i >= DDS_MAX_TOPICS) {
-        pr_err("No free DDS topic slots available\n");
-        return -ENOMEM;
-    }
-    
-    strcpy(participant->topics[i].name, topic_name);
-    strcpy(participant->topics[i].type, type_name);
-    participant->topics[i].reliability = reliability;
-    participant->topics[i].durability = durability;
-    participant->topics[i].deadline_ms = global_dds_middleware.default_deadline_ms;
-    participant->topics[i].active = true;
-    
-    participant->topic_count++;
-    
-    pr_info("DDS topic created: participant=%d, name=%s, type=%s, reliability=%d, durability=%d\n",
-            participant_id, topic_name, type_name, reliability, durability);
-    
     return 0;
 }
 
 /**
- * DDS data writer
+ * Resolve a topic name once, for callers that write or read it often
  */
-static int dds_write_data(int participant_id, const char *topic_name, const u8 *data, u16 len)
+static struct dds_topic *dds_get_topic(int participant_id, const char *topic_name)
 {
-    int i;
+    struct dds_topic *topic;
     
-    if (participant_id >= DDS_MAX_PARTICIPANTS || !topic_name || !data) {
-        pr_err("Invalid DDS write parameters\n");
-        return -EINVAL;
+    if (participant_id < 0 || participant_id >= MAX_DDS_PARTICIPANTS || !topic_name) {
+        return NULL;
     }
     
-    struct dds_participant *participant = &global_dds_middleware.participants[participant_id];
-    
-    if (!participant->active) {
-        pr_err("DDS participant %d is not active\n", participant_id);
-        return -EINVAL;
+    topic = dds_core_lookup(participant_id, topic_name);
+    if (!topic) {
+        pr_err("DDS topic '%s' not found\n", topic_name);
     }
     
-    // Find topic
-    for (i = 0; i < DDS_MAX_TOPICS; i++) {
-        if (participant->topics[i].active && 
-            strcmp(participant->topics[i].name, topic_name) == 0) {
-            break;
-        }
-    }
+    return topic;
+}
+
+/**
+ * DDS data writer, through a resolved topic
+ */
+static int dds_write_topic(int participant_id, struct dds_topic *topic, const u8 *data, u16 len)
+{
+    int ret;
     
-    if (i >= DDS_MAX_TOPICS) {
-        pr_err("DDS topic '%s' not found\n", topic_name);
+    if (participant_id < 0 || participant_id >= MAX_DDS_PARTICIPANTS) {
         return -EINVAL;
     }
     
-    // Simulate data writing
-    pr_debug("DDS writing data to topic '%s': %d bytes\n", topic_name, len);
+    ret = dds_core_write(topic, data, len);
+    if (ret) {
+        global_dds_middleware.participants[participant_id].participant_errors++;
+        return ret;
+    }
     
-    atomic_inc(&participant->topics[i].sample_count);
-    atomic_inc(&participant->total_samples);
+    atomic_inc(&global_dds_middleware.participants[participant_id].total_samples);
     atomic_inc(&global_dds_middleware.total_samples);
     
     return 0;
 }
 
 /**
- * DDS data reader
+ * DDS data reader, through a resolved topic: the latest sample
  */
-static int dds_read_data(int participant_id, const char *topic_name, u8 *buffer, u16 max_len)
+static int dds_read_topic(struct dds_topic *topic, u8 *buffer, u16 max_len)
 {
-    int i;
-    u16 read_len = 0;
+    u32 read_len;
+    int ret;
     
-    if (participant_id >= DDS_MAX_PARTICIPANTS || !topic_name || !buffer) {
-        pr_err("Invalid DDS read parameters\n");
-        return -EINVAL;
+    ret = dds_core_read(topic, buffer, max_len, &read_len);
+    if (ret) {
+        return ret;
     }
     
-    struct dds_participant *participant = &global_dds_middleware.participants[participant_id];
+    return read_len;
+}
+
+/**
+ * DDS data writer
+ */
+static int dds_write_data(int participant_id, const char *topic_name, const u8 *data, u16 len)
+{
+    struct dds_topic *topic = dds_get_topic(participant_id, topic_name);
     
-    if (!participant->active) {
-        pr_err("DDS participant %d is not active\n", participant_id);
+    if (!topic || !data) {
+        pr_err("Invalid DDS write parameters\n");
         return -EINVAL;
     }
     
-    // Find topic
-    for (i = 0; i < DDS_MAX_TOPICS; i++) {
-        if (participant->topics[i].active && 
-            strcmp(participant->topics[i].name, topic_name) == 0) {
-            break;
-        }
-    }
+    return dds_write_topic(participant_id, topic, data, len);
+}
+
+/**
+ * DDS data reader
+ */
+static int dds_read_data(int participant_id, const char *topic_name, u8 *buffer, u16 max_len)
+{
+    struct dds_topic *topic = dds_get_topic(participant_id, topic_name);
     
-    if (i >= DDS_MAX_TOPICS) {
-        pr_err("DDS topic '%s' not found\n", topic_name);
+    if (!topic || !buffer) {
+        pr_err("Invalid DDS read parameters\n");
         return -EINVAL;
     }
     
-    // Simulate data reading
-    read_len = min(max_len, (u16)64); // Simulate received data
-    
-    pr_debug("DDS reading data from topic '%s': %d bytes\n", topic_name, read_len);
-    
-    return read_len;
+    return dds_read_topic(topic, buffer, max_len);
 }
 
 /**
  * DDS QoS configuration
  */
 static int dds_configure_qos(int participant_id, const char *topic_name,
-                            enum dds_reliability reliability, enum dds_durability durability,
+                            enum dds_reliability_kind reliability, enum dds_durability_kind durability,
                             u32 deadline_ms)
 {
-    int i;
+    struct dds_topic *topic = dds_get_topic(participant_id, topic_name);
     
-    if (participant_id >= DDS_MAX_PARTICIPANTS || !topic_name) {
+    if (!topic) {
         pr_err("Invalid DDS QoS parameters\n");
         return -EINVAL;
     }
     
-    struct dds_participant *participant = &global_dds_middleware.participants[participant_id];
-    
-    if (!participant->active) {
-        pr_err("DDS participant %d is not active\n", participant_id);
-        return -EINVAL;
-    }
-    
-    // Find topic
-    for (i = 0; i < DDS_MAX_TOPICS; i++) {
-        if (participant->topics[i].active && 
-            strcmp(participant->topics[i].name, topic_name) == 0) {
-            break;
-        }
-    }
-    
-    if (i >= DDS_MAX_TOPICS) {
-        pr_err("DDS topic '%s' not found\n", topic_name);
-        return -EINVAL;
-    }
-    
-    participant->topics[i].reliability = reliability;
-    participant->topics[i].durability = durability;
-    participant->topics[i].deadline_ms = deadline_ms;
-    
-    pr_info("DDS QoS configured for topic '%s': reliability=%d, durability=%d, deadline=%d ms\n",
-            topic_name, reliability, durability, deadline_ms);
-    
-    return 0;
+    return dds_core_configure_qos(topic, reliability, durability, DDS_HISTORY_KEEP_LAST, 1, deadline_ms);
 }
 
 /**
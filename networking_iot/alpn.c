@@ -3,17 +3,237 @@
  * Author: jk1806
  * Created: 2024-11-12
  * 
- * Implementation for embedded systems
+ * Builds and checks the application_layer_protocol_negotiation
+ * extension (RFC 7301) for the HTTP, MQTT and CoAP endpoints, client
+ * and server side, and remembers per host what the server picked. The
+ * client offers the remembered protocol first, so a server honouring
+ * client order lands on the protocol a resumption ticket was issued
+ * for, and callers can frame their first flight from alpn_expected()
+ * while the handshake is still in flight.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/spinlock.h>
+#include <asm/unaligned.h>
 
-#define MODULE_VERSION "1.0.0"
+#include "alpn.h"
+
+#define ALPN_VERSION "1.1.0"
+
+#define ALPN_MAX_PROTOS 4
+
+static const char * const alpn_profiles[ALPN_PROFILE_COUNT][ALPN_MAX_PROTOS] = {
+    [ALPN_PROFILE_HTTP] = { "h2", "http/1.1" },
+    [ALPN_PROFILE_MQTT] = { "mqtt" },
+    [ALPN_PROFILE_COAP] = { "coap" },
+};
+
+// What each host selected last, replaced round robin
+struct alpn_cache_entry {
+    char host[ALPN_HOST_MAX];
+    u8 profile;
+    s8 index;                           // -1: unused
+};
+
+static struct alpn_cache_entry alpn_cache[ALPN_CACHE_SIZE];
+static unsigned int alpn_cache_next;
+static DEFINE_SPINLOCK(alpn_cache_lock);
+
+const char *alpn_name(enum alpn_profile profile, int index)
+{
+    if (profile >= ALPN_PROFILE_COUNT || index < 0 || index >= ALPN_MAX_PROTOS) {
+        return NULL;
+    }
+    return alpn_profiles[profile][index];
+}
+EXPORT_SYMBOL_GPL(alpn_name);
+
+// Under alpn_cache_lock
+static struct alpn_cache_entry *alpn_cache_find(enum alpn_profile profile, const char *host)
+{
+    int i;
+    
+    for (i = 0; i < ALPN_CACHE_SIZE; i++) {
+        if (alpn_cache[i].index >= 0 && alpn_cache[i].profile == profile &&
+            !strcasecmp(alpn_cache[i].host, host)) {
+            return &alpn_cache[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Protocol a host selected last time for profile, as an index for
+ * alpn_name(); -ENOENT if it was never seen
+ */
+int alpn_expected(enum alpn_profile profile, const char *host)
+{
+    struct alpn_cache_entry *e;
+    int ret = -ENOENT;
+    
+    if (!host || profile >= ALPN_PROFILE_COUNT) {
+        return -EINVAL;
+    }
+    
+    spin_lock(&alpn_cache_lock);
+    e = alpn_cache_find(profile, host);
+    if (e) {
+        ret = e->index;
+    }
+    spin_unlock(&alpn_cache_lock);
+    
+    return ret;
+}
+EXPORT_SYMBOL_GPL(alpn_expected);
+
+static void alpn_remember(enum alpn_profile profile, const char *host, int index)
+{
+    struct alpn_cache_entry *e;
+    
+    if (!host || strlen(host) >= ALPN_HOST_MAX) {
+        return;
+    }
+    
+    spin_lock(&alpn_cache_lock);
+    e = alpn_cache_find(profile, host);
+    if (!e) {
+        e = &alpn_cache[alpn_cache_next++ % ALPN_CACHE_SIZE];
+        strscpy(e->host, host, sizeof(e->host));
+        e->profile = profile;
+    }
+    e->index = index;
+    spin_unlock(&alpn_cache_lock);
+}
+
+static u8 *alpn_put(u8 *p, const char *name)
+{
+    size_t n = strlen(name);
+    
+    *p++ = n;
+    memcpy(p, name, n);
+    return p + n;
+}
+
+/**
+ * ClientHello extension body (the ProtocolNameList with its length) for
+ * profile; the protocol host selected last time goes first. Returns the
+ * length written.
+ */
+int alpn_build(enum alpn_profile profile, const char *host, u8 *buf, size_t len)
+{
+    const char * const *names;
+    int first, i;
+    size_t need = 2;
+    u8 *p;
+    
+    if (profile >= ALPN_PROFILE_COUNT || !buf) {
+        return -EINVAL;
+    }
+    names = alpn_profiles[profile];
+    for (i = 0; i < ALPN_MAX_PROTOS && names[i]; i++) {
+        need += 1 + strlen(names[i]);
+    }
+    if (len < need) {
+        return -ENOSPC;
+    }
+    
+    first = host ? alpn_expected(profile, host) : -ENOENT;
+    p = buf + 2;
+    if (first >= 0) {
+        p = alpn_put(p, names[first]);
+    }
+    for (i = 0; i < ALPN_MAX_PROTOS && names[i]; i++) {
+        if (i != first) {
+            p = alpn_put(p, names[i]);
+        }
+    }
+    put_unaligned_be16(need - 2, buf);
+    
+    return need;
+}
+EXPORT_SYMBOL_GPL(alpn_build);
+
+// Index in profile of a protocol name of n bytes, or -1
+static int alpn_lookup(enum alpn_profile profile, const u8 *name, size_t n)
+{
+    const char * const *names = alpn_profiles[profile];
+    int i;
+    
+    for (i = 0; i < ALPN_MAX_PROTOS && names[i]; i++) {
+        if (strlen(names[i]) == n && !memcmp(names[i], name, n)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Check the server's extension: exactly one protocol, one we offered
+ * (RFC 7301 3.1). Returns its index and remembers it for host; -EPROTO
+ * means the handshake must be aborted.
+ */
+int alpn_client_selected(enum alpn_profile profile, const char *host, const u8 *ext, size_t len)
+{
+    int index;
+    
+    if (profile >= ALPN_PROFILE_COUNT || !ext || len < 4 ||
+        get_unaligned_be16(ext) != len - 2 || ext[2] != len - 3) {
+        return -EPROTO;
+    }
+    index = alpn_lookup(profile, ext + 3, ext[2]);
+    if (index < 0) {
+        return -EPROTO;
+    }
+    
+    alpn_remember(profile, host, index);
+    return index;
+}
+EXPORT_SYMBOL_GPL(alpn_client_selected);
+
+/**
+ * Server side: pick, in our order of preference, a protocol of profile
+ * from the client's list. -ENOENT asks for a no_application_protocol
+ * alert; -EPROTO for a malformed list.
+ */
+int alpn_server_select(enum alpn_profile profile, const u8 *ext, size_t len)
+{
+    const char * const *names;
+    const u8 *p, *end;
+    int i;
+    
+    if (profile >= ALPN_PROFILE_COUNT || !ext || len < 3 || get_unaligned_be16(ext) != len - 2) {
+        return -EPROTO;
+    }
+    end = ext + len;
+    for (p = ext + 2; p < end; p += 1 + *p) {
+        if (!*p || p + 1 + *p > end) {
+            return -EPROTO;
+        }
+    }
+    
+    names = alpn_profiles[profile];
+    for (i = 0; i < ALPN_MAX_PROTOS && names[i]; i++) {
+        for (p = ext + 2; p < end; p += 1 + *p) {
+            if (*p == strlen(names[i]) && !memcmp(p + 1, names[i], *p)) {
+                return i;
+            }
+        }
+    }
+    return -ENOENT;
+}
+EXPORT_SYMBOL_GPL(alpn_server_select);
 
 static int __init alpn_init(void)
 {
+    int i;
+    
     pr_info("alpn: Initializing\n");
+    
+    for (i = 0; i < ALPN_CACHE_SIZE; i++) {
+        alpn_cache[i].index = -1;
+    }
     return 0;
 }
 
@@ -28,4 +248,4 @@ module_exit(alpn_exit);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("jk1806");
 MODULE_DESCRIPTION("ALPN protocol negotiation");
-MODULE_VERSION(MODULE_VERSION);
+MODULE_VERSION(ALPN_VERSION);
@@ -0,0 +1,35 @@
+/**
+ * ALPN protocol negotiation
+ *
+ * RFC 7301 for our endpoints. The application protocol is settled inside
+ * the TLS handshake, so an HTTP client never spends a round trip on an
+ * Upgrade to h2 and MQTT can share port 443 with HTTPS. The protocol a
+ * host selected is remembered: a resumed session sending 0-RTT data
+ * must offer the same one (RFC 8446 4.2.10), and the first flight (the
+ * HTTP/2 preface, an MQTT CONNECT) can be framed before the handshake
+ * finishes.
+ */
+
+#ifndef ALPN_H
+#define ALPN_H
+
+#include <linux/types.h>
+
+#define ALPN_EXT_MAX 64                 // protocol_name_list of the largest profile
+#define ALPN_HOST_MAX 64
+#define ALPN_CACHE_SIZE 8
+
+enum alpn_profile {
+    ALPN_PROFILE_HTTP,                  // h2, then http/1.1
+    ALPN_PROFILE_MQTT,                  // mqtt, for MQTT over TLS on 443
+    ALPN_PROFILE_COAP,                  // coap over TLS (RFC 8323)
+    ALPN_PROFILE_COUNT,
+};
+
+int alpn_build(enum alpn_profile profile, const char *host, u8 *buf, size_t len);
+int alpn_client_selected(enum alpn_profile profile, const char *host, const u8 *ext, size_t len);
+int alpn_server_select(enum alpn_profile profile, const u8 *ext, size_t len);
+int alpn_expected(enum alpn_profile profile, const char *host);
+const char *alpn_name(enum alpn_profile profile, int index);
+
+#endif /* ALPN_H */
@@ -3,13 +3,612 @@
  * Author: jk1806
  * Created: 2024-10-25
  * 
- * Implementation for embedded systems
+ * Neighbour cache shared by the lightweight stacks. Entries follow the
+ * Linux neighbour states, reduced: INCOMPLETE while resolving, with the
+ * packets sent meanwhile queued; REACHABLE once confirmed; STALE when
+ * the confirmation has aged out but the address is still used; PROBE
+ * while a refresh is in flight; FAILED for a while after resolution
+ * gave up. A REACHABLE entry that is used close to expiry, or a STALE
+ * one that is used at all, goes to PROBE and keeps being used while a
+ * unicast probe confirms it, so re-resolution never stalls the data
+ * path as long as the neighbour answers.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/rculist.h>
+#include <linux/jiffies.h>
+#include <linux/etherdevice.h>
+#include <linux/if_arp.h>
 
-#define MODULE_VERSION "1.0.0"
+#include "arp_nd.h"
+
+#define ARP_ND_VERSION "1.1.0"
+
+#define ND_REACHABLE_TIME (30 * HZ)
+#define ND_REFRESH_AHEAD (5 * HZ)           // in-use entries are probed this long before expiry
+#define ND_RETRANS_TIME HZ
+#define ND_MAX_PROBES 3
+#define ND_FAILED_HOLD (5 * HZ)             // answer failures from the cache this long
+#define ND_GC_IDLE (120 * HZ)               // unused STALE/FAILED entries are dropped after this
+#define ND_MAX_ENTRIES 256
+#define ND_TICK (HZ / 10)
+#define ND_WORK_BATCH 16                    // solicitations and failures handled per tick
+
+enum nd_state {
+    ND_INCOMPLETE,
+    ND_REACHABLE,
+    ND_STALE,
+    ND_PROBE,
+    ND_FAILED,
+};
+
+struct nd_entry {
+    struct hlist_node node;
+    struct rcu_head rcu;
+    spinlock_t lock;                        // everything below
+    u8 family;
+    u8 state;
+    u8 probes;                              // solicitations sent this round
+    u8 qlen;
+    bool dead;                              // unlinked, lookups must not use it
+    u8 addr[16];
+    u8 lladdr[ETH_ALEN];
+    unsigned long confirmed;
+    unsigned long used;
+    unsigned long next_probe;               // FAILED: end of the hold
+    void *queue[ND_QUEUE_LEN];
+};
+
+struct nd_arp {
+    __be16 htype;
+    __be16 ptype;
+    u8 hlen;
+    u8 plen;
+    __be16 op;
+    u8 sha[ETH_ALEN];
+    u8 spa[4];
+    u8 tha[ETH_ALEN];
+    u8 tpa[4];
+} __packed;
+
+// Solicitation decided under the locks, sent after
+struct nd_solicit {
+    u8 family;
+    bool unicast;
+    u8 addr[16];
+    u8 lladdr[ETH_ALEN];
+};
+
+static unsigned int nd_addr_len(u8 family)
+{
+    return family == ND_AF_INET ? 4 : family == ND_AF_INET6 ? 16 : 0;
+}
+
+static struct hlist_head *nd_bucket(struct nd_table *t, u8 family, const u8 *addr, unsigned int len)
+{
+    u32 h = jhash(addr, len, t->hash_seed ^ family);
+    
+    return &t->buckets[h & ((1 << ND_HASH_BITS) - 1)];
+}
+
+// Under rcu_read_lock() or the table lock
+static struct nd_entry *nd_find(struct nd_table *t, u8 family, const u8 *addr, unsigned int len)
+{
+    struct nd_entry *e;
+    
+    hlist_for_each_entry_rcu(e, nd_bucket(t, family, addr, len), node) {
+        if (e->family == family && !memcmp(e->addr, addr, len)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Insert an entry: INCOMPLETE with its first solicitation counted, or
+ * REACHABLE at lladdr. -EEXIST if another CPU got there first.
+ */
+static int nd_create(struct nd_table *t, u8 family, const u8 *addr, unsigned int len, const u8 *lladdr)
+{
+    struct nd_entry *e;
+    unsigned long flags;
+    int ret = 0;
+    
+    e = kzalloc(sizeof(*e), GFP_ATOMIC);
+    if (!e) {
+        return -ENOMEM;
+    }
+    spin_lock_init(&e->lock);
+    e->family = family;
+    memcpy(e->addr, addr, len);
+    e->used = jiffies;
+    if (lladdr) {
+        e->state = ND_REACHABLE;
+        e->confirmed = jiffies;
+        ether_addr_copy(e->lladdr, lladdr);
+    } else {
+        e->state = ND_INCOMPLETE;
+        e->probes = 1;
+        e->next_probe = jiffies + ND_RETRANS_TIME;
+    }
+    
+    spin_lock_irqsave(&t->lock, flags);
+    if (nd_find(t, family, addr, len)) {
+        ret = -EEXIST;
+    } else if (t->count >= ND_MAX_ENTRIES) {
+        ret = -ENOBUFS;
+    } else {
+        hlist_add_head_rcu(&e->node, nd_bucket(t, family, addr, len));
+        t->count++;
+    }
+    spin_unlock_irqrestore(&t->lock, flags);
+    
+    if (ret) {
+        kfree(e);
+    }
+    return ret;
+}
+
+// Start a refresh of an entry whose address is still used meanwhile
+static void nd_start_probe(struct nd_table *t, struct nd_entry *e, unsigned long now)
+{
+    e->state = ND_PROBE;
+    e->probes = 1;
+    e->next_probe = now + ND_RETRANS_TIME;
+    atomic_long_inc(&t->stats.refreshes);
+}
+
+/**
+ * Link-layer address of a next hop. 0 with lladdr filled in; -EAGAIN
+ * while it resolves (resolution is started if it was not), after which
+ * the packet goes to nd_queue(); -EHOSTUNREACH if it failed recently.
+ */
+int nd_lookup(struct nd_table *t, u8 family, const u8 *addr, u8 *lladdr)
+{
+    unsigned int len = nd_addr_len(family);
+    unsigned long now = jiffies, flags;
+    u8 probe_to[ETH_ALEN];
+    bool solicit = false;
+    bool unicast = false;
+    struct nd_entry *e;
+    int ret;
+    
+    if (!len) {
+        return -EAFNOSUPPORT;
+    }
+    
+again:
+    rcu_read_lock();
+    e = nd_find(t, family, addr, len);
+    if (!e) {
+        rcu_read_unlock();
+        ret = nd_create(t, family, addr, len, NULL);
+        if (ret == -EEXIST) {
+            goto again;
+        }
+        if (ret) {
+            return ret;
+        }
+        atomic_long_inc(&t->stats.misses);
+        t->ops->solicit(t->ctx, family, addr, NULL);
+        return -EAGAIN;
+    }
+    
+    spin_lock_irqsave(&e->lock, flags);
+    if (e->dead) {
+        spin_unlock_irqrestore(&e->lock, flags);
+        rcu_read_unlock();
+        goto again;
+    }
+    e->used = now;
+    switch (e->state) {
+    case ND_REACHABLE:
+        if (time_after_eq(now, e->confirmed + ND_REACHABLE_TIME - ND_REFRESH_AHEAD)) {
+            nd_start_probe(t, e, now);
+            solicit = unicast = true;
+        }
+        ether_addr_copy(lladdr, e->lladdr);
+        ret = 0;
+        break;
+    case ND_STALE:
+        nd_start_probe(t, e, now);
+        solicit = unicast = true;
+        ether_addr_copy(lladdr, e->lladdr);
+        ret = 0;
+        break;
+    case ND_PROBE:
+        ether_addr_copy(lladdr, e->lladdr);
+        ret = 0;
+        break;
+    case ND_INCOMPLETE:
+        ret = -EAGAIN;
+        break;
+    default:
+        if (time_before(now, e->next_probe)) {
+            ret = -EHOSTUNREACH;
+            break;
+        }
+        e->state = ND_INCOMPLETE;
+        e->probes = 1;
+        e->next_probe = now + ND_RETRANS_TIME;
+        solicit = true;
+        ret = -EAGAIN;
+        break;
+    }
+    if (unicast) {
+        ether_addr_copy(probe_to, e->lladdr);
+    }
+    spin_unlock_irqrestore(&e->lock, flags);
+    rcu_read_unlock();
+    
+    if (solicit) {
+        t->ops->solicit(t->ctx, family, addr, unicast ? probe_to : NULL);
+    }
+    if (ret == 0) {
+        atomic_long_inc(&t->stats.hits);
+    } else if (ret == -EAGAIN) {
+        atomic_long_inc(&t->stats.misses);
+    }
+    return ret;
+}
+EXPORT_SYMBOL_GPL(nd_lookup);
+
+/**
+ * Hold pkt until addr resolves; it then goes out through ops->output.
+ * Returns 1 if queued; 0 if the address resolved since nd_lookup(), with
+ * lladdr filled in and pkt still the caller's; a negative error, pkt
+ * again the caller's, if the queue is full or resolution failed.
+ */
+int nd_queue(struct nd_table *t, u8 family, const u8 *addr, void *pkt, u8 *lladdr)
+{
+    unsigned int len = nd_addr_len(family);
+    struct nd_entry *e;
+    unsigned long flags;
+    int ret;
+    
+    if (!len) {
+        return -EAFNOSUPPORT;
+    }
+    
+    rcu_read_lock();
+    e = nd_find(t, family, addr, len);
+    if (!e) {
+        rcu_read_unlock();
+        return -EHOSTUNREACH;
+    }
+    spin_lock_irqsave(&e->lock, flags);
+    if (e->dead || e->state == ND_FAILED) {
+        ret = -EHOSTUNREACH;
+    } else if (e->state != ND_INCOMPLETE) {
+        ether_addr_copy(lladdr, e->lladdr);
+        ret = 0;
+    } else if (e->qlen < ND_QUEUE_LEN) {
+        e->queue[e->qlen++] = pkt;
+        ret = 1;
+    } else {
+        ret = -ENOBUFS;
+    }
+    spin_unlock_irqrestore(&e->lock, flags);
+    rcu_read_unlock();
+    
+    if (ret == 1) {
+        atomic_long_inc(&t->stats.queued);
+    } else if (ret == -ENOBUFS) {
+        atomic_long_inc(&t->stats.queue_drops);
+    }
+    return ret;
+}
+EXPORT_SYMBOL_GPL(nd_queue);
+
+/**
+ * An ARP reply or request, or an NA, told us addr is at lladdr. Confirms
+ * the entry and sends whatever was queued on it. IRQ safe.
+ */
+void nd_update(struct nd_table *t, u8 family, const u8 *addr, const u8 *lladdr, unsigned int flags)
+{
+    unsigned int len = nd_addr_len(family);
+    void *pkts[ND_QUEUE_LEN];
+    u8 mac[ETH_ALEN];
+    struct nd_entry *e;
+    unsigned long irqflags;
+    int i, n;
+    
+    if (!len || !is_valid_ether_addr(lladdr)) {
+        return;
+    }
+    
+again:
+    rcu_read_lock();
+    e = nd_find(t, family, addr, len);
+    if (!e) {
+        rcu_read_unlock();
+        if ((flags & ND_F_SOLICITED) && nd_create(t, family, addr, len, lladdr) == -EEXIST) {
+            goto again;
+        }
+        return;
+    }
+    
+    spin_lock_irqsave(&e->lock, irqflags);
+    if (e->dead) {
+        spin_unlock_irqrestore(&e->lock, irqflags);
+        rcu_read_unlock();
+        goto again;
+    }
+    ether_addr_copy(e->lladdr, lladdr);
+    e->state = ND_REACHABLE;
+    e->confirmed = jiffies;
+    e->probes = 0;
+    n = e->qlen;
+    memcpy(pkts, e->queue, n * sizeof(pkts[0]));
+    e->qlen = 0;
+    spin_unlock_irqrestore(&e->lock, irqflags);
+    rcu_read_unlock();
+    
+    ether_addr_copy(mac, lladdr);
+    for (i = 0; i < n; i++) {
+        t->ops->output(t->ctx, pkts[i], mac);
+    }
+}
+EXPORT_SYMBOL_GPL(nd_update);
+
+/**
+ * Upper-layer proof the neighbour is there (a TCP ACK from it): restarts
+ * the reachable time without a probe
+ */
+void nd_confirm(struct nd_table *t, u8 family, const u8 *addr)
+{
+    unsigned int len = nd_addr_len(family);
+    struct nd_entry *e;
+    unsigned long flags;
+    
+    if (!len) {
+        return;
+    }
+    
+    rcu_read_lock();
+    e = nd_find(t, family, addr, len);
+    if (e) {
+        spin_lock_irqsave(&e->lock, flags);
+        if (e->state == ND_REACHABLE || e->state == ND_STALE || e->state == ND_PROBE) {
+            e->state = ND_REACHABLE;
+            e->confirmed = jiffies;
+            e->probes = 0;
+        }
+        spin_unlock_irqrestore(&e->lock, flags);
+    }
+    rcu_read_unlock();
+}
+EXPORT_SYMBOL_GPL(nd_confirm);
+
+// Resolution gave up: hold the failure, hand back the queued packets
+static int nd_fail(struct nd_table *t, struct nd_entry *e, unsigned long now, void **drops)
+{
+    int n = e->qlen;
+    
+    memcpy(drops, e->queue, n * sizeof(drops[0]));
+    e->qlen = 0;
+    e->state = ND_FAILED;
+    e->next_probe = now + ND_FAILED_HOLD;
+    atomic_long_inc(&t->stats.failures);
+    
+    return n;
+}
+
+static void nd_work(struct work_struct *work)
+{
+    struct nd_table *t = container_of(to_delayed_work(work), struct nd_table, work);
+    struct nd_solicit solicit[ND_WORK_BATCH];
+    void *drops[ND_WORK_BATCH * ND_QUEUE_LEN];
+    unsigned long now = jiffies, flags;
+    int nsolicit = 0, nfailed = 0, ndrops = 0;
+    struct hlist_node *tmp;
+    struct nd_entry *e;
+    int i;
+    
+    spin_lock_irqsave(&t->lock, flags);
+    for (i = 0; i < (1 << ND_HASH_BITS) && nsolicit + nfailed < ND_WORK_BATCH; i++) {
+        hlist_for_each_entry_safe(e, tmp, &t->buckets[i], node) {
+            bool send = false;
+            bool unicast = false;
+            bool remove = false;
+    
+            if (nsolicit + nfailed == ND_WORK_BATCH) {
+                break;
+            }
+            spin_lock(&e->lock);
+            switch (e->state) {
+            case ND_INCOMPLETE:
+            case ND_PROBE:
+                if (time_before(now, e->next_probe)) {
+                    break;
+                }
+                if (e->probes >= ND_MAX_PROBES) {
+                    ndrops += nd_fail(t, e, now, drops + ndrops);
+                    nfailed++;
+                    break;
+                }
+                // A refresh asks the cached address first, then everyone
+                unicast = e->state == ND_PROBE && e->probes + 1 < ND_MAX_PROBES;
+                e->probes++;
+                e->next_probe = now + ND_RETRANS_TIME;
+                send = true;
+                break;
+            case ND_REACHABLE:
+                if (time_after_eq(now, e->confirmed + ND_REACHABLE_TIME)) {
+                    e->state = ND_STALE;
+                }
+                break;
+            case ND_STALE:
+                remove = time_after_eq(now, e->used + ND_GC_IDLE);
+                break;
+            case ND_FAILED:
+                remove = time_after_eq(now, e->next_probe) && time_after_eq(now, e->used + ND_GC_IDLE);
+                break;
+            }
+            if (send) {
+                struct nd_solicit *s = &solicit[nsolicit++];
+    
+                s->family = e->family;
+                s->unicast = unicast;
+                memcpy(s->addr, e->addr, sizeof(s->addr));
+                ether_addr_copy(s->lladdr, e->lladdr);
+            }
+            if (remove) {
+                e->dead = true;
+                hlist_del_rcu(&e->node);
+                t->count--;
+            }
+            spin_unlock(&e->lock);
+            if (remove) {
+                kfree_rcu(e, rcu);
+            }
+        }
+    }
+    spin_unlock_irqrestore(&t->lock, flags);
+    
+    for (i = 0; i < nsolicit; i++) {
+        t->ops->solicit(t->ctx, solicit[i].family, solicit[i].addr,
+                        solicit[i].unicast ? solicit[i].lladdr : NULL);
+    }
+    for (i = 0; i < ndrops; i++) {
+        t->ops->output(t->ctx, drops[i], NULL);
+    }
+    
+    schedule_delayed_work(&t->work, ND_TICK);
+}
+
+int nd_table_init(struct nd_table *t, const struct nd_ops *ops, void *ctx)
+{
+    int i;
+    
+    if (!ops || !ops->solicit || !ops->output) {
+        return -EINVAL;
+    }
+    
+    memset(t, 0, sizeof(*t));
+    for (i = 0; i < (1 << ND_HASH_BITS); i++) {
+        INIT_HLIST_HEAD(&t->buckets[i]);
+    }
+    spin_lock_init(&t->lock);
+    t->hash_seed = get_random_u32();
+    t->ops = ops;
+    t->ctx = ctx;
+    INIT_DELAYED_WORK(&t->work, nd_work);
+    schedule_delayed_work(&t->work, ND_TICK);
+    
+    return 0;
+}
+EXPORT_SYMBOL_GPL(nd_table_init);
+
+/**
+ * Drop every entry; packets still queued go back through ops->output
+ */
+void nd_table_destroy(struct nd_table *t)
+{
+    void *drops[ND_QUEUE_LEN];
+    struct hlist_node *tmp;
+    struct nd_entry *e;
+    unsigned long flags;
+    int i, j, n;
+    
+    cancel_delayed_work_sync(&t->work);
+    
+    for (i = 0; i < (1 << ND_HASH_BITS); i++) {
+        hlist_for_each_entry_safe(e, tmp, &t->buckets[i], node) {
+            spin_lock_irqsave(&t->lock, flags);
+            spin_lock(&e->lock);
+            e->dead = true;
+            hlist_del_rcu(&e->node);
+            t->count--;
+            n = e->qlen;
+            memcpy(drops, e->queue, n * sizeof(drops[0]));
+            e->qlen = 0;
+            spin_unlock(&e->lock);
+            spin_unlock_irqrestore(&t->lock, flags);
+    
+            for (j = 0; j < n; j++) {
+                t->ops->output(t->ctx, drops[j], NULL);
+            }
+            kfree_rcu(e, rcu);
+        }
+    }
+}
+EXPORT_SYMBOL_GPL(nd_table_destroy);
+
+/**
+ * Learn from a received Ethernet ARP frame (RFC 826): the sender of a
+ * request or reply meant for our_ip gets an entry, other senders only
+ * refresh an existing one, which also covers gratuitous ARP. Sets
+ * *request_from when the frame asks for our_ip, for the caller to
+ * answer. Returns the ARP opcode.
+ */
+int nd_arp_input(struct nd_table *t, const u8 *frame, u16 len, __be32 our_ip, __be32 *request_from)
+{
+    const struct ethhdr *eth = (const struct ethhdr *)frame;
+    const struct nd_arp *arp = (const struct nd_arp *)(frame + ETH_HLEN);
+    unsigned int flags = 0;
+    __be32 spa, tpa;
+    u16 op;
+    
+    if (len < ND_ARP_FRAME_LEN || eth->h_proto != htons(ETH_P_ARP)) {
+        return -EINVAL;
+    }
+    op = ntohs(arp->op);
+    if (arp->htype != htons(ARPHRD_ETHER) || arp->ptype != htons(ETH_P_IP) ||
+        arp->hlen != ETH_ALEN || arp->plen != 4 || (op != ARPOP_REQUEST && op != ARPOP_REPLY)) {
+        return -EPROTO;
+    }
+    memcpy(&spa, arp->spa, 4);
+    memcpy(&tpa, arp->tpa, 4);
+    
+    // Address conflict probes (sender 0.0.0.0) teach nothing
+    if (spa) {
+        if (tpa == our_ip && spa != tpa) {
+            flags |= ND_F_SOLICITED;
+        }
+        nd_update(t, ND_AF_INET, (const u8 *)&spa, arp->sha, flags);
+    }
+    
+    if (op == ARPOP_REQUEST && tpa == our_ip && request_from) {
+        *request_from = spa;
+    }
+    return op;
+}
+EXPORT_SYMBOL_GPL(nd_arp_input);
+
+/**
+ * Build an Ethernet ARP frame of ND_ARP_FRAME_LEN bytes; a NULL tha
+ * broadcasts it, as for a request
+ */
+void nd_build_arp(u8 *frame, u16 op, const u8 *sha, __be32 spa, const u8 *tha, __be32 tpa)
+{
+    struct ethhdr *eth = (struct ethhdr *)frame;
+    struct nd_arp *arp = (struct nd_arp *)(frame + ETH_HLEN);
+    
+    if (tha) {
+        ether_addr_copy(eth->h_dest, tha);
+        ether_addr_copy(arp->tha, tha);
+    } else {
+        eth_broadcast_addr(eth->h_dest);
+        eth_zero_addr(arp->tha);
+    }
+    ether_addr_copy(eth->h_source, sha);
+    eth->h_proto = htons(ETH_P_ARP);
+    
+    arp->htype = htons(ARPHRD_ETHER);
+    arp->ptype = htons(ETH_P_IP);
+    arp->hlen = ETH_ALEN;
+    arp->plen = 4;
+    arp->op = htons(op);
+    ether_addr_copy(arp->sha, sha);
+    memcpy(arp->spa, &spa, 4);
+    memcpy(arp->tpa, &tpa, 4);
+}
+EXPORT_SYMBOL_GPL(nd_build_arp);
 
 static int __init arp_nd_init(void)
 {
@@ -28,4 +627,4 @@ module_exit(arp_nd_exit);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("jk1806");
 MODULE_DESCRIPTION("ARP/ND protocol");
-MODULE_VERSION(MODULE_VERSION);
+MODULE_VERSION(ARP_ND_VERSION);
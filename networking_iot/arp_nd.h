@@ -0,0 +1,72 @@
+/**
+ * ARP/ND neighbour cache
+ *
+ * Next-hop link-layer addresses for the lightweight stacks (lwIP
+ * wrapper, OSI stack). Lookups are hashed and lock-free on the table;
+ * packets sent while an address resolves wait in a short per-entry
+ * queue; an entry in use is refreshed with a unicast probe before it
+ * expires, so a busy flow never waits on re-resolution. The stack
+ * owning the table sends the solicitations and the queued packets
+ * through its nd_ops.
+ */
+
+#ifndef ARP_ND_H
+#define ARP_ND_H
+
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/atomic.h>
+#include <linux/if_ether.h>
+
+#define ND_AF_INET 4                    // 4-byte addresses, resolved with ARP
+#define ND_AF_INET6 6                   // 16-byte addresses, resolved with NS/NA
+#define ND_HASH_BITS 6
+#define ND_QUEUE_LEN 4                  // packets held per resolving entry
+#define ND_ARP_FRAME_LEN (ETH_HLEN + 28)
+
+// nd_update() flags; without SOLICITED only known entries are updated
+#define ND_F_SOLICITED 0x1              // meant for us: may create the entry
+
+/*
+ * Callbacks into the owning stack, called without the table's locks held
+ * but possibly in IRQ context (nd_update() from the driver's RX path).
+ */
+struct nd_ops {
+    // ARP request or NS for addr; to lladdr for a unicast refresh, NULL to broadcast
+    int (*solicit)(void *ctx, u8 family, const u8 *addr, const u8 *lladdr);
+    // A queued packet, now with its destination; lladdr NULL: resolution failed, free it
+    void (*output)(void *ctx, void *pkt, const u8 *lladdr);
+};
+
+struct nd_stats {
+    atomic_long_t hits;
+    atomic_long_t misses;               // lookups that had to resolve first
+    atomic_long_t queued;
+    atomic_long_t queue_drops;
+    atomic_long_t refreshes;            // probes sent ahead of expiry
+    atomic_long_t failures;
+};
+
+struct nd_table {
+    struct hlist_head buckets[1 << ND_HASH_BITS];
+    spinlock_t lock;                    // bucket lists; lookups use RCU
+    u32 hash_seed;
+    unsigned int count;
+    const struct nd_ops *ops;
+    void *ctx;
+    struct delayed_work work;           // retransmits, refreshes and expiry
+    struct nd_stats stats;
+};
+
+int nd_table_init(struct nd_table *t, const struct nd_ops *ops, void *ctx);
+void nd_table_destroy(struct nd_table *t);
+int nd_lookup(struct nd_table *t, u8 family, const u8 *addr, u8 *lladdr);
+int nd_queue(struct nd_table *t, u8 family, const u8 *addr, void *pkt, u8 *lladdr);
+void nd_update(struct nd_table *t, u8 family, const u8 *addr, const u8 *lladdr, unsigned int flags);
+void nd_confirm(struct nd_table *t, u8 family, const u8 *addr);
+int nd_arp_input(struct nd_table *t, const u8 *frame, u16 len, __be32 our_ip, __be32 *request_from);
+void nd_build_arp(u8 *frame, u16 op, const u8 *sha, __be32 spa, const u8 *tha, __be32 tpa);
+
+#endif /* ARP_ND_H */
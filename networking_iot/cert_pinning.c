@@ -3,23 +3,297 @@
  * Author: jk1806
  * Created: 2024-11-18
  * 
- * Implementation for embedded systems
+ * SPKI pinning ahead of chain validation. Hashing a public key from a
+ * certificate is one DER walk and one SHA-256 over a few hundred
+ * bytes, against the signature checks of building the chain, so the
+ * pins are checked first. No match on a pinned host rejects at once.
+ * A match on the leaf of a host pinned with CERT_PIN_F_SKIP_CHAIN
+ * accepts it outright; the CertificateVerify of the handshake already
+ * proves the peer holds that key, as with raw public keys (RFC 7250).
+ * A match further up the chain only says which CA to expect: the chain
+ * is still validated, since nothing yet ties the leaf to it. Expired
+ * pin sets fall back to plain chain validation rather than locking the
+ * device out.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/timekeeping.h>
+#include <crypto/hash.h>
+#include <crypto/algapi.h>
 
-#define MODULE_VERSION "1.0.0"
+#include "cert_pinning.h"
+
+#define CERT_PINNING_VERSION "1.1.0"
+
+#define DER_SEQUENCE 0x30
+#define DER_CONTEXT_0 0xa0              // [0] EXPLICIT version
+
+struct cert_pin_set {
+    char host[CERT_PIN_HOST_MAX];
+    u8 pins[CERT_PIN_MAX_PINS][CERT_PIN_HASH_LEN];
+    u8 npins;
+    u8 flags;
+    s64 expires;                        // wall-clock seconds, 0 for never
+};
+
+static struct cert_pin_set cert_pins[CERT_PIN_MAX_HOSTS];
+static DEFINE_SPINLOCK(cert_pins_lock);
+static struct crypto_shash *cert_pin_tfm;
+static atomic_t cert_pin_verdicts[CERT_PIN_REJECT + 1];
+
+/*
+ * One DER TLV at *p: tag, value and full length. Short and long form
+ * lengths up to 2^24; *p moves past it.
+ */
+static int der_next(const u8 **p, const u8 *end, u8 *tag, const u8 **val, size_t *len)
+{
+    const u8 *q = *p;
+    size_t l;
+    int n;
+    
+    if (end - q < 2) {
+        return -EBADMSG;
+    }
+    *tag = *q++;
+    l = *q++;
+    if (l & 0x80) {
+        n = l & 0x7f;
+        if (!n || n > 3 || end - q < n) {
+            return -EBADMSG;
+        }
+        for (l = 0; n; n--) {
+            l = (l << 8) | *q++;
+        }
+    }
+    if (l > (size_t)(end - q)) {
+        return -EBADMSG;
+    }
+    *val = q;
+    *len = l;
+    *p = q + l;
+    return 0;
+}
+
+/*
+ * The subjectPublicKeyInfo TLV of a DER certificate: the seventh field
+ * of tbsCertificate counting the optional version (RFC 5280 4.1)
+ */
+static int cert_pin_find_spki(const u8 *der, size_t len, const u8 **spki, size_t *spki_len)
+{
+    const u8 *p = der, *end = der + len, *val, *start;
+    size_t l;
+    u8 tag;
+    int i, ret;
+    
+    ret = der_next(&p, end, &tag, &val, &l);         // Certificate
+    if (ret || tag != DER_SEQUENCE) {
+        return -EBADMSG;
+    }
+    p = val;
+    end = val + l;
+    ret = der_next(&p, end, &tag, &val, &l);         // tbsCertificate
+    if (ret || tag != DER_SEQUENCE) {
+        return -EBADMSG;
+    }
+    p = val;
+    end = val + l;
+    
+    // version, serialNumber, signature, issuer, validity, subject
+    for (i = 0; i < 6; i++) {
+        ret = der_next(&p, end, &tag, &val, &l);
+        if (ret) {
+            return ret;
+        }
+        if (i == 0 && tag != DER_CONTEXT_0) {
+            i++;                // v1 certificate, no version field
+        }
+    }
+    
+    start = p;
+    ret = der_next(&p, end, &tag, &val, &l);
+    if (ret || tag != DER_SEQUENCE) {
+        return -EBADMSG;
+    }
+    *spki = start;
+    *spki_len = p - start;
+    return 0;
+}
+
+/**
+ * SHA-256 of the DER SubjectPublicKeyInfo of a certificate, the value
+ * pins are made of
+ */
+int cert_pin_spki_sha256(const u8 *der, size_t len, u8 *digest)
+{
+    const u8 *spki;
+    size_t spki_len;
+    int ret;
+    
+    ret = cert_pin_find_spki(der, len, &spki, &spki_len);
+    if (ret) {
+        return ret;
+    }
+    return crypto_shash_tfm_digest(cert_pin_tfm, spki, spki_len, digest);
+}
+EXPORT_SYMBOL_GPL(cert_pin_spki_sha256);
+
+// Exact match, or host below the pinned name with CERT_PIN_F_SUBDOMAINS
+static bool cert_pin_host_match(const struct cert_pin_set *set, const char *host)
+{
+    size_t hl = strlen(host), sl = strlen(set->host);
+    
+    if (!strcasecmp(set->host, host)) {
+        return true;
+    }
+    return (set->flags & CERT_PIN_F_SUBDOMAINS) && hl > sl + 1 &&
+           host[hl - sl - 1] == '.' && !strcasecmp(host + hl - sl, set->host);
+}
+
+// Under cert_pins_lock
+static struct cert_pin_set *cert_pin_find(const char *host)
+{
+    struct cert_pin_set *best = NULL;
+    int i;
+    
+    // An exact entry wins over one inherited from a parent domain
+    for (i = 0; i < CERT_PIN_MAX_HOSTS; i++) {
+        if (!cert_pins[i].npins || !cert_pin_host_match(&cert_pins[i], host)) {
+            continue;
+        }
+        if (!strcasecmp(cert_pins[i].host, host)) {
+            return &cert_pins[i];
+        }
+        if (!best || strlen(cert_pins[i].host) > strlen(best->host)) {
+            best = &cert_pins[i];
+        }
+    }
+    return best;
+}
+
+/**
+ * Add a pin for host. The flags and expiry apply to the host's whole
+ * set and are taken from the latest call.
+ */
+int cert_pin_add(const char *host, const u8 *spki_sha256, unsigned int flags, s64 expires)
+{
+    struct cert_pin_set *set = NULL;
+    int i, ret = 0;
+    
+    if (!host || !*host || strlen(host) >= CERT_PIN_HOST_MAX || !spki_sha256) {
+        return -EINVAL;
+    }
+    
+    spin_lock(&cert_pins_lock);
+    for (i = 0; i < CERT_PIN_MAX_HOSTS; i++) {
+        if (cert_pins[i].npins && !strcasecmp(cert_pins[i].host, host)) {
+            set = &cert_pins[i];
+            break;
+        }
+        if (!set && !cert_pins[i].npins) {
+            set = &cert_pins[i];
+        }
+    }
+    if (!set) {
+        ret = -ENOSPC;
+    } else if (set->npins == CERT_PIN_MAX_PINS) {
+        ret = -E2BIG;
+    } else {
+        if (!set->npins) {
+            strscpy(set->host, host, sizeof(set->host));
+        }
+        memcpy(set->pins[set->npins++], spki_sha256, CERT_PIN_HASH_LEN);
+        set->flags = flags;
+        set->expires = expires;
+    }
+    spin_unlock(&cert_pins_lock);
+    
+    return ret;
+}
+EXPORT_SYMBOL_GPL(cert_pin_add);
+
+void cert_pin_clear(const char *host)
+{
+    int i;
+    
+    spin_lock(&cert_pins_lock);
+    for (i = 0; i < CERT_PIN_MAX_HOSTS; i++) {
+        if (cert_pins[i].npins && !strcasecmp(cert_pins[i].host, host)) {
+            memset(&cert_pins[i], 0, sizeof(cert_pins[i]));
+        }
+    }
+    spin_unlock(&cert_pins_lock);
+}
+EXPORT_SYMBOL_GPL(cert_pin_clear);
+
+static enum cert_pin_verdict cert_pin_verdict(enum cert_pin_verdict v)
+{
+    atomic_inc(&cert_pin_verdicts[v]);
+    return v;
+}
+
+/**
+ * Check a received chain, leaf first, against the pins for host before
+ * any chain building. Certificates are hashed one at a time and only
+ * until a pin matches.
+ */
+enum cert_pin_verdict cert_pin_check(const char *host, const u8 *const *certs,
+                                     const size_t *lens, unsigned int n)
+{
+    struct cert_pin_set set, *found;
+    u8 digest[CERT_PIN_HASH_LEN];
+    unsigned int i, j;
+    
+    spin_lock(&cert_pins_lock);
+    found = cert_pin_find(host);
+    if (found) {
+        set = *found;
+    }
+    spin_unlock(&cert_pins_lock);
+    
+    if (!found || (set.expires && ktime_get_real_seconds() >= set.expires)) {
+        return cert_pin_verdict(CERT_PIN_CHAIN);
+    }
+    
+    for (i = 0; i < min_t(unsigned int, n, CERT_PIN_MAX_CHAIN); i++) {
+        if (cert_pin_spki_sha256(certs[i], lens[i], digest)) {
+            return cert_pin_verdict(CERT_PIN_REJECT);
+        }
+        for (j = 0; j < set.npins; j++) {
+            if (!crypto_memneq(digest, set.pins[j], CERT_PIN_HASH_LEN)) {
+                return cert_pin_verdict(i == 0 && (set.flags & CERT_PIN_F_SKIP_CHAIN) ?
+                                        CERT_PIN_ACCEPT : CERT_PIN_CHAIN);
+            }
+        }
+    }
+    
+    pr_warn_ratelimited("cert_pinning: no pin matched for %s\n", host);
+    return cert_pin_verdict(CERT_PIN_REJECT);
+}
+EXPORT_SYMBOL_GPL(cert_pin_check);
 
 static int __init cert_pinning_init(void)
 {
     pr_info("cert_pinning: Initializing\n");
+    
+    cert_pin_tfm = crypto_alloc_shash("sha256", 0, 0);
+    if (IS_ERR(cert_pin_tfm)) {
+        pr_err("cert_pinning: sha256 unavailable\n");
+        return PTR_ERR(cert_pin_tfm);
+    }
     return 0;
 }
 
 static void __exit cert_pinning_exit(void)
 {
-    pr_info("cert_pinning: Exiting\n");
+    pr_info("cert_pinning: Exiting, accepted=%d chain=%d rejected=%d\n",
+            atomic_read(&cert_pin_verdicts[CERT_PIN_ACCEPT]),
+            atomic_read(&cert_pin_verdicts[CERT_PIN_CHAIN]),
+            atomic_read(&cert_pin_verdicts[CERT_PIN_REJECT]));
+    crypto_free_shash(cert_pin_tfm);
 }
 
 module_init(cert_pinning_init);
@@ -28,4 +302,4 @@ module_exit(cert_pinning_exit);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("jk1806");
 MODULE_DESCRIPTION("Certificate pinning");
-MODULE_VERSION(MODULE_VERSION);
+MODULE_VERSION(CERT_PINNING_VERSION);
@@ -0,0 +1,40 @@
+/**
+ * Certificate pinning
+ *
+ * Pins are SHA-256 hashes of DER SubjectPublicKeyInfo, computed offline
+ * (openssl x509 -pubkey | openssl pkey -pubin -outform der | sha256sum)
+ * and installed per host. TLS clients call cert_pin_check() on the
+ * received chain before building it: a host whose pins do not match is
+ * rejected without any signature work, and a host pinned with
+ * CERT_PIN_F_SKIP_CHAIN on its leaf key is accepted without chain
+ * building at all.
+ */
+
+#ifndef CERT_PINNING_H
+#define CERT_PINNING_H
+
+#include <linux/types.h>
+
+#define CERT_PIN_HASH_LEN 32
+#define CERT_PIN_HOST_MAX 64
+#define CERT_PIN_MAX_HOSTS 16
+#define CERT_PIN_MAX_PINS 4             // current key plus backups
+#define CERT_PIN_MAX_CHAIN 4            // certificates looked at, leaf first
+
+// Pin set flags
+#define CERT_PIN_F_SKIP_CHAIN 0x1       // a leaf match is enough, chain validation is skipped
+#define CERT_PIN_F_SUBDOMAINS 0x2       // also covers every name below host
+
+enum cert_pin_verdict {
+    CERT_PIN_ACCEPT,                    // pinned leaf key, no chain building needed
+    CERT_PIN_CHAIN,                     // validate the chain against root_ca as usual
+    CERT_PIN_REJECT,                    // pinned host, no pin matched: abort the handshake
+};
+
+int cert_pin_add(const char *host, const u8 *spki_sha256, unsigned int flags, s64 expires);
+void cert_pin_clear(const char *host);
+enum cert_pin_verdict cert_pin_check(const char *host, const u8 *const *certs,
+                                     const size_t *lens, unsigned int n);
+int cert_pin_spki_sha256(const u8 *der, size_t len, u8 *digest);
+
+#endif /* CERT_PINNING_H */
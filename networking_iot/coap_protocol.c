@@ -5,117 +5,487 @@
  * 
  * RFC 7252 CoAP protocol for IoT devices
  * Supports GET, POST, PUT, DELETE methods
+ *
+ * Messages are encoded directly into the outgoing buffer and decoded in
+ * place, with token, options and payload left as views of the datagram.
+ * Block-wise transfer (RFC 7959) and observe (RFC 7641) options for
+ * fetching firmware and following sensor resources; the server side is
+ * in the gateway's coap_dtls_server.c.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/udp.h>
 #include <linux/inet.h>
+#include <linux/skbuff.h>
+#include <linux/string.h>
+#include <asm/unaligned.h>
 
-#define COAP_VERSION "1.0.0"
+#define COAP_VERSION "1.1.0"
 #define COAP_DEFAULT_PORT 5683
 #define COAP_MAX_PAYLOAD 1024
+#define COAP_MAX_MESSAGE 1152       // RFC 7252 4.6, fits an unfragmented IPv6 datagram
+#define COAP_MAX_TOKEN 8
+#define COAP_PAYLOAD_MARKER 0xff
 
-struct coap_header {
-    u8 ver_t_tkl;
+#define COAP_TYPE_CON 0
+#define COAP_TYPE_NON 1
+#define COAP_TYPE_ACK 2
+#define COAP_TYPE_RST 3
+
+#define COAP_METHOD_GET 1
+
+#define COAP_OPTION_ETAG 4
+#define COAP_OPTION_OBSERVE 6       // RFC 7641
+#define COAP_OPTION_URI_PATH 11
+#define COAP_OPTION_CONTENT_FORMAT 12
+#define COAP_OPTION_URI_QUERY 15
+#define COAP_OPTION_BLOCK2 23       // RFC 7959
+#define COAP_OPTION_BLOCK1 27
+#define COAP_OPTION_SIZE2 28
+
+#define COAP_OBSERVE_REGISTER 0
+#define COAP_OBSERVE_DEREGISTER 1
+#define COAP_BLOCK_SZX_MAX 6        // 1024 bytes; 7 is BERT, TCP only
+
+/*
+ * Encoder: writes header, options and payload straight into the
+ * outgoing buffer (skb tailroom or a pbuf payload), in wire order.
+ * Options must be added in ascending number, as the delta encoding
+ * requires; the first error sticks and the message is then dropped.
+ */
+struct coap_writer {
+    u8 *buf;
+    size_t size;
+    size_t len;
+    u16 last_option;
+    bool payload;
+    int error;
+};
+
+// Decoded message: token, options and payload point into the datagram
+struct coap_msg {
+    u8 type;
     u8 code;
     u16 message_id;
-    u8 token[8];
     u8 token_len;
-    u8 options[256];
-    u16 options_len;
-    u8 payload[COAP_MAX_PAYLOAD];
-    u16 payload_len;
+    const u8 *token;
+    const u8 *options;
+    size_t options_len;
+    const u8 *payload;
+    size_t payload_len;
+};
+
+struct coap_option {
+    u16 number;
+    u16 len;
+    const u8 *value;
+};
+
+// Block1/Block2 option value: NUM | M | SZX
+struct coap_block {
+    u32 num;
+    bool more;
+    u8 szx;
+};
+
+struct coap_option_iter {
+    const u8 *pos;
+    const u8 *end;
+    u16 number;
 };
 
 static u16 coap_message_id = 1;
 
+static void coap_writer_init(struct coap_writer *w, void *buf, size_t size)
+{
+    memset(w, 0, sizeof(*w));
+    w->buf = buf;
+    w->size = size;
+}
+
+// Room for n more bytes, or the writer fails
+static u8 *coap_writer_reserve(struct coap_writer *w, size_t n)
+{
+    u8 *p;
+    
+    if (w->error) {
+        return NULL;
+    }
+    if (n > w->size - w->len) {
+        w->error = -EMSGSIZE;
+        return NULL;
+    }
+    p = w->buf + w->len;
+    w->len += n;
+    return p;
+}
+
 /**
  * Build CoAP header
  */
-static int coap_build_header(struct coap_header *hdr, u8 code,
+static int coap_write_header(struct coap_writer *w, u8 type, u8 code, u16 message_id,
                              const u8 *token, u8 token_len)
 {
-    if (token_len > 8) {
+    u8 *p;
+    
+    if (token_len > COAP_MAX_TOKEN) {
         pr_err("CoAP: Token too long\n");
-        return -1;
+        return w->error = -EINVAL;
+    }
+    p = coap_writer_reserve(w, 4 + token_len);
+    if (!p) {
+        return w->error;
+    }
+    
+    p[0] = (1 << 6) | (type << 4) | token_len;     // Version 1, type, token length
+    p[1] = code;
+    put_unaligned_be16(message_id, p + 2);
+    if (token_len) {
+        memcpy(p + 4, token, token_len);
     }
     
-    hdr->ver_t_tkl = (1 << 6) | (token_len & 0x0f);  // Version 1, token length
-    hdr->code = code;
-    hdr->message_id = coap_message_id++;
-    hdr->token_len = token_len;
+    return 0;
+}
+
+// Option delta or length nibble, and how many extended bytes it needs
+static u8 coap_option_nibble(u16 value, size_t *ext)
+{
+    if (value < 13) {
+        *ext = 0;
+        return value;
+    }
+    if (value < 269) {
+        *ext = 1;
+        return 13;
+    }
+    *ext = 2;
+    return 14;
+}
+
+static u8 *coap_option_put_ext(u8 *p, u16 value, size_t ext)
+{
+    if (ext == 1) {
+        *p++ = value - 13;
+    } else if (ext == 2) {
+        put_unaligned_be16(value - 269, p);
+        p += 2;
+    }
+    return p;
+}
+
+/**
+ * Add an option, delta-encoded against the previous one
+ */
+static int coap_write_option(struct coap_writer *w, u16 number, const void *value, u16 len)
+{
+    size_t delta_ext, len_ext;
+    u16 delta;
+    u8 nibbles;
+    u8 *p;
     
-    if (token && token_len > 0) {
-        memcpy(hdr->token, token, token_len);
+    if (w->error) {
+        return w->error;
+    }
+    if (number < w->last_option || w->payload) {
+        return w->error = -EINVAL;
     }
     
-    hdr->options_len = 0;
-    hdr->payload_len = 0;
+    delta = number - w->last_option;
+    nibbles = coap_option_nibble(delta, &delta_ext) << 4;
+    nibbles |= coap_option_nibble(len, &len_ext);
+    
+    p = coap_writer_reserve(w, 1 + delta_ext + len_ext + len);
+    if (!p) {
+        return w->error;
+    }
+    *p++ = nibbles;
+    p = coap_option_put_ext(p, delta, delta_ext);
+    p = coap_option_put_ext(p, len, len_ext);
+    if (len) {
+        memcpy(p, value, len);
+    }
     
+    w->last_option = number;
     return 0;
 }
 
+// Option value as a minimal big-endian unsigned integer
+static int coap_write_uint_option(struct coap_writer *w, u16 number, u32 value)
+{
+    u8 be[4];
+    u16 len = 0;
+    
+    while (len < 4 && value >> (8 * len)) {
+        len++;
+    }
+    put_unaligned_be32(value, be);
+    return coap_write_option(w, number, be + 4 - len, len);
+}
+
+static int coap_write_block_option(struct coap_writer *w, u16 number, const struct coap_block *block)
+{
+    if (block->szx > COAP_BLOCK_SZX_MAX || block->num >= 1 << 20) {
+        return w->error = -EINVAL;
+    }
+    return coap_write_uint_option(w, number, block->num << 4 | block->more << 3 | block->szx);
+}
+
+static size_t coap_block_size(u8 szx)
+{
+    return 16 << szx;
+}
+
+// One Uri-Path option per segment of path
+static int coap_write_uri_path(struct coap_writer *w, const char *path)
+{
+    while (*path) {
+        const char *end;
+        size_t len;
+    
+        if (*path == '/') {
+            path++;
+            continue;
+        }
+        end = strchrnul(path, '/');
+        len = end - path;
+        if (len > 255) {
+            return w->error = -EINVAL;
+        }
+        coap_write_option(w, COAP_OPTION_URI_PATH, path, len);
+        path = end;
+    }
+    
+    return w->error;
+}
+
 /**
- * Send CoAP request
+ * Reserve len payload bytes after the marker, for the caller to fill in
+ * place; no options can follow
  */
-int coap_send_request(struct sockaddr_in *server, u8 method,
-                      const char *uri, const u8 *payload, size_t payload_len)
+static u8 *coap_write_payload_reserve(struct coap_writer *w, size_t len)
 {
-    struct coap_header hdr;
-    struct sk_buff *skb;
-    u8 *data;
-    int len;
+    u8 *p;
+    
+    if (!len || w->payload || len > COAP_MAX_PAYLOAD) {
+        if (!w->error && len) {
+            w->error = w->payload ? -EINVAL : -EMSGSIZE;
+        }
+        return NULL;
+    }
+    p = coap_writer_reserve(w, 1 + len);
+    if (!p) {
+        return NULL;
+    }
+    *p = COAP_PAYLOAD_MARKER;
+    w->payload = true;
+    return p + 1;
+}
+
+static int coap_write_payload(struct coap_writer *w, const void *payload, size_t len)
+{
+    u8 *p;
+    
+    if (!len) {
+        return w->error;
+    }
+    p = coap_write_payload_reserve(w, len);
+    if (p) {
+        memcpy(p, payload, len);
+    }
+    return w->error;
+}
+
+/*
+ * Read a nibble's extended value. Returns false on a truncated option or
+ * the reserved nibble 15.
+ */
+static bool coap_option_get_ext(const u8 **pos, const u8 *end, u8 nibble, u32 *value)
+{
+    const u8 *p = *pos;
     
-    // Build header
-    coap_build_header(&hdr, method, NULL, 0);
+    if (nibble < 13) {
+        *value = nibble;
+    } else if (nibble == 13) {
+        if (end - p < 1) {
+            return false;
+        }
+        *value = *p++ + 13;
+    } else if (nibble == 14) {
+        if (end - p < 2) {
+            return false;
+        }
+        *value = get_unaligned_be16(p) + 269;
+        p += 2;
+    } else {
+        return false;
+    }
+    *pos = p;
+    return true;
+}
+
+static void coap_option_iter_init(struct coap_option_iter *it, const struct coap_msg *msg)
+{
+    it->pos = msg->options;
+    it->end = msg->options + msg->options_len;
+    it->number = 0;
+}
+
+/**
+ * Next option of a message validated by coap_parse(); false at the end
+ */
+static bool coap_option_next(struct coap_option_iter *it, struct coap_option *opt)
+{
+    u32 delta, len;
+    u8 byte;
     
-    // Add URI option
-    coap_add_option(&hdr, COAP_OPTION_URI_PATH, uri, strlen(uri));
+    if (it->pos >= it->end) {
+        return false;
+    }
+    byte = *it->pos++;
+    if (!coap_option_get_ext(&it->pos, it->end, byte >> 4, &delta) ||
+        !coap_option_get_ext(&it->pos, it->end, byte & 0x0f, &len) ||
+        len > it->end - it->pos || it->number + delta > U16_MAX) {
+        it->pos = it->end;
+        return false;
+    }
     
-    // Add payload
-    if (payload && payload_len > 0) {
-        if (payload_len > COAP_MAX_PAYLOAD) {
-            pr_err("CoAP: Payload too large\n");
-            return -1;
+    it->number += delta;
+    opt->number = it->number;
+    opt->len = len;
+    opt->value = it->pos;
+    it->pos += len;
+    return true;
+}
+
+static int coap_option_uint(const struct coap_option *opt, u32 *value)
+{
+    u16 i;
+    
+    if (opt->len > 4) {
+        return -EBADMSG;
+    }
+    *value = 0;
+    for (i = 0; i < opt->len; i++) {
+        *value = *value << 8 | opt->value[i];
+    }
+    return 0;
+}
+
+/**
+ * Find option number in msg. Returns true and the first instance, or
+ * false if the message does not carry it.
+ */
+static bool coap_find_option(const struct coap_msg *msg, u16 number, struct coap_option *opt)
+{
+    struct coap_option_iter it;
+    
+    coap_option_iter_init(&it, msg);
+    while (coap_option_next(&it, opt)) {
+        if (opt->number == number) {
+            return true;
+        }
+        if (opt->number > number) {
+            break;
         }
-        memcpy(hdr.payload, payload, payload_len);
-        hdr.payload_len = payload_len;
     }
+    return false;
+}
+
+/**
+ * Block1 or Block2 option of a message: 0, -ENOENT if absent, or
+ * -EBADMSG for a malformed value
+ */
+static int coap_get_block(const struct coap_msg *msg, u16 number, struct coap_block *block)
+{
+    struct coap_option opt;
+    u32 value;
     
-    // Build packet
-    len = 4 + hdr.token_len + hdr.options_len + hdr.payload_len;
+    if (!coap_find_option(msg, number, &opt)) {
+        return -ENOENT;
+    }
+    if (opt.len > 3 || coap_option_uint(&opt, &value) || (value & 7) == 7) {
+        return -EBADMSG;
+    }
+    block->num = value >> 4;
+    block->more = value & 0x08;
+    block->szx = value & 7;
+    return 0;
+}
+
+/**
+ * Decode a datagram in place: msg points into data, which must outlive
+ * it. Returns 0, or -EBADMSG for a message format error.
+ */
+static int coap_parse(struct coap_msg *msg, const u8 *data, size_t len)
+{
+    const u8 *pos, *end = data + len;
     
-    skb = alloc_skb(len, GFP_KERNEL);
-    if (!skb) {
-        return -1;
+    if (len < 4 || (data[0] >> 6) != 1 || (data[0] & 0x0f) > COAP_MAX_TOKEN ||
+        len < 4 + (data[0] & 0x0f)) {
+        return -EBADMSG;
     }
+    msg->type = (data[0] >> 4) & 0x03;
+    msg->token_len = data[0] & 0x0f;
+    msg->code = data[1];
+    msg->message_id = get_unaligned_be16(data + 2);
+    msg->token = data + 4;
+    msg->options = msg->token + msg->token_len;
+    msg->payload = NULL;
+    msg->payload_len = 0;
     
-    data = skb_put(skb, len);
+    // Walk the options once, so iterating later cannot run off the end
+    pos = msg->options;
+    while (pos < end && *pos != COAP_PAYLOAD_MARKER) {
+        u8 byte = *pos++;
+        u32 delta, opt_len;
     
-    // Header
-    *data++ = hdr.ver_t_tkl;
-    *data++ = hdr.code;
-    put_unaligned_be16(hdr.message_id, data);
-    data += 2;
+        if (!coap_option_get_ext(&pos, end, byte >> 4, &delta) ||
+            !coap_option_get_ext(&pos, end, byte & 0x0f, &opt_len) ||
+            opt_len > end - pos) {
+            return -EBADMSG;
+        }
+        pos += opt_len;
+    }
+    msg->options_len = pos - msg->options;
     
-    // Token
-    if (hdr.token_len > 0) {
-        memcpy(data, hdr.token, hdr.token_len);
-        data += hdr.token_len;
+    if (pos < end) {
+        // A marker with no payload after it is a format error
+        if (end - pos < 2) {
+            return -EBADMSG;
+        }
+        msg->payload = pos + 1;
+        msg->payload_len = end - pos - 1;
     }
     
-    // Options
-    if (hdr.options_len > 0) {
-        memcpy(data, hdr.options, hdr.options_len);
-        data += hdr.options_len;
+    return 0;
+}
+
+/**
+ * Send CoAP request
+ */
+int coap_send_request(struct sockaddr_in *server, u8 method,
+                      const char *uri, const u8 *payload, size_t payload_len)
+{
+    struct coap_writer w;
+    struct sk_buff *skb;
+    
+    skb = alloc_skb(COAP_MAX_MESSAGE, GFP_KERNEL);
+    if (!skb) {
+        return -ENOMEM;
     }
     
-    // Payload marker
-    if (hdr.payload_len > 0) {
-        *data++ = 0xff;
-        memcpy(data, hdr.payload, hdr.payload_len);
+    // Encoded straight into the skb; nothing is staged on the stack
+    coap_writer_init(&w, skb_tail_pointer(skb), skb_tailroom(skb));
+    coap_write_header(&w, COAP_TYPE_CON, method, coap_message_id++, NULL, 0);
+    coap_write_uri_path(&w, uri);
+    coap_write_payload(&w, payload, payload_len);
+    if (w.error) {
+        pr_err("CoAP: Unable to encode request for %s: %d\n", uri, w.error);
+        kfree_skb(skb);
+        return w.error;
     }
+    skb_put(skb, w.len);
     
     // Send UDP packet
     udp_send_skb(skb, server);
@@ -125,6 +495,46 @@ int coap_send_request(struct sockaddr_in *server, u8 method,
     return 0;
 }
 
+/**
+ * GET one block of uri: block num of 16 << szx bytes (a firmware image
+ * is fetched by counting num up until a response has M clear). observe
+ * is COAP_OBSERVE_REGISTER or _DEREGISTER, or negative for a plain GET.
+ * Notifications then carry the first block; a representation larger
+ * than that is fetched on with plain block GETs.
+ */
+int coap_send_get(struct sockaddr_in *server, const char *uri, int observe,
+                  u32 block_num, u8 szx, const u8 *token, u8 token_len)
+{
+    struct coap_block block = { .num = block_num, .szx = szx };
+    struct coap_writer w;
+    struct sk_buff *skb;
+    
+    skb = alloc_skb(COAP_MAX_MESSAGE, GFP_KERNEL);
+    if (!skb) {
+        return -ENOMEM;
+    }
+    
+    coap_writer_init(&w, skb_tail_pointer(skb), skb_tailroom(skb));
+    coap_write_header(&w, COAP_TYPE_CON, COAP_METHOD_GET, coap_message_id++, token, token_len);
+    if (observe >= 0) {
+        coap_write_uint_option(&w, COAP_OPTION_OBSERVE, observe);
+    }
+    coap_write_uri_path(&w, uri);
+    // Block 0 without an explicit size is the server's choice
+    if (block_num || szx < COAP_BLOCK_SZX_MAX) {
+        coap_write_block_option(&w, COAP_OPTION_BLOCK2, &block);
+    }
+    if (w.error) {
+        kfree_skb(skb);
+        return w.error;
+    }
+    skb_put(skb, w.len);
+    
+    udp_send_skb(skb, server);
+    
+    return 0;
+}
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("jk1806");
 MODULE_DESCRIPTION("CoAP Protocol Implementation");
@@ -3,13 +3,554 @@
  * Author: jk1806
  * Created: 2025-02-15
  * 
- * Implementation for embedded systems
+ * DHCPv4 client (RFC 2131). A device that slept with a lease rejoins in
+ * INIT-REBOOT: one broadcast REQUEST for its old address, answered by
+ * an ACK or a NAK. Only a NAK sends it through DISCOVER/OFFER. If no
+ * server answers within DHCP_REBOOT_TRIES short timeouts the device
+ * keeps the address for the rest of the lease, as 3.2 of the RFC
+ * allows, and the normal renewal confirms it later. DHCPv6 is left to
+ * SLAAC (slaac.c) on the networks we run on.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/in.h>
+#include <linux/random.h>
+#include <linux/crc32.h>
+#include <linux/jiffies.h>
+#include <linux/timekeeping.h>
+#include <linux/etherdevice.h>
+#include <asm/unaligned.h>
 
-#define MODULE_VERSION "1.0.0"
+#include "dhcp.h"
+
+#define DHCP_VERSION "1.1.0"
+
+#define DHCP_BOOTREQUEST 1
+#define DHCP_BOOTREPLY 2
+#define DHCP_MAGIC_COOKIE 0x63825363
+#define DHCP_FLAG_BROADCAST 0x8000          // we cannot take unicast before we have an address
+
+// Message types, option 53
+#define DHCPDISCOVER 1
+#define DHCPOFFER 2
+#define DHCPREQUEST 3
+#define DHCPACK 5
+#define DHCPNAK 6
+
+#define DHCP_OPT_PAD 0
+#define DHCP_OPT_NETMASK 1
+#define DHCP_OPT_ROUTER 3
+#define DHCP_OPT_DNS 6
+#define DHCP_OPT_REQUESTED_IP 50
+#define DHCP_OPT_LEASE_TIME 51
+#define DHCP_OPT_MSG_TYPE 53
+#define DHCP_OPT_SERVER_ID 54
+#define DHCP_OPT_PARAM_LIST 55
+#define DHCP_OPT_T1 58
+#define DHCP_OPT_T2 59
+#define DHCP_OPT_CLIENT_ID 61
+#define DHCP_OPT_END 255
+
+#define DHCP_RETRANS_MIN (4 * HZ)           // 4, 8, 16... seconds, +-1 s (4.1)
+#define DHCP_RETRANS_MAX (64 * HZ)
+#define DHCP_REQUEST_TRIES 4                // REQUESTING gives up and discovers again
+#define DHCP_REBOOT_TIMEOUT (HZ / 2)
+#define DHCP_REBOOT_TRIES 2
+#define DHCP_RENEW_MIN_SEC 60               // renew/rebind retransmit floor (4.4.5)
+#define DHCP_MAX_WAIT_SEC (24 * 3600)       // long leases are re-checked daily
+
+struct dhcp_msg {
+    u8 op;
+    u8 htype;
+    u8 hlen;
+    u8 hops;
+    __be32 xid;
+    __be16 secs;
+    __be16 flags;
+    __be32 ciaddr;
+    __be32 yiaddr;
+    __be32 siaddr;
+    __be32 giaddr;
+    u8 chaddr[16];
+    u8 sname[64];
+    u8 file[128];
+    __be32 cookie;
+    u8 options[];
+} __packed;
+
+// What a reply carried
+struct dhcp_reply {
+    u8 type;
+    __be32 yiaddr;
+    __be32 server;
+    __be32 netmask;
+    __be32 router;
+    __be32 dns;
+    u32 lease_sec;
+    u32 t1_sec;
+    u32 t2_sec;
+};
+
+// A message and the callbacks decided under the lock, made after it
+struct dhcp_action {
+    u8 msg[DHCP_MSG_LEN];
+    size_t len;
+    __be32 dst;
+    bool bound;
+    bool lost;
+    struct dhcp_lease lease;
+};
+
+static u32 dhcp_lease_crc(const struct dhcp_lease *l)
+{
+    return crc32_le(~0, (const u8 *)l, offsetof(struct dhcp_lease, crc));
+}
+
+/**
+ * A persisted lease that is undamaged and belongs to this interface.
+ * Says nothing about its age: INIT-REBOOT asks the server either way.
+ */
+bool dhcp_lease_intact(const struct dhcp_lease *l, const u8 *hwaddr)
+{
+    return l->magic == DHCP_LEASE_MAGIC && l->version == DHCP_LEASE_VERSION &&
+           ether_addr_equal(l->hwaddr, hwaddr) && l->addr && l->crc == dhcp_lease_crc(l);
+}
+EXPORT_SYMBOL_GPL(dhcp_lease_intact);
+
+// Wall-clock second a lease time runs out at; S64_MAX for infinite leases
+static s64 dhcp_lease_at(const struct dhcp_lease *l, u32 sec)
+{
+    return l->lease_sec == DHCP_LEASE_INFINITE ? S64_MAX : l->acquired + sec;
+}
+
+// Unexpired for certain: a clock that went back makes the age unknown
+static bool dhcp_lease_current(const struct dhcp_lease *l, s64 now)
+{
+    return now >= l->acquired && now < dhcp_lease_at(l, l->lease_sec);
+}
+
+static unsigned long dhcp_sec_to_jiffies(s64 sec)
+{
+    return (unsigned long)clamp_t(s64, sec, 1, DHCP_MAX_WAIT_SEC) * HZ;
+}
+
+static void dhcp_schedule(struct dhcp_client *c, unsigned long delay)
+{
+    mod_delayed_work(system_wq, &c->work, delay);
+}
+
+// Randomized exponential backoff of the SELECTING/REQUESTING retransmits
+static unsigned long dhcp_backoff(u8 tries)
+{
+    unsigned long base = DHCP_RETRANS_MIN << min_t(u8, tries ? tries - 1 : 0, 4);
+    
+    return min_t(unsigned long, base, DHCP_RETRANS_MAX) - HZ + get_random_u32_below(2 * HZ);
+}
+
+static u8 *dhcp_put_opt(u8 *p, u8 code, const void *data, u8 len)
+{
+    *p++ = code;
+    *p++ = len;
+    memcpy(p, data, len);
+    return p + len;
+}
+
+/*
+ * Build a client message. ciaddr is set while renewing or rebinding,
+ * req_ip and server_id when selecting or rebooting.
+ */
+static void dhcp_build(struct dhcp_client *c, struct dhcp_action *a, u8 type,
+                       __be32 ciaddr, __be32 req_ip, __be32 server_id)
+{
+    static const u8 params[] = {
+        DHCP_OPT_NETMASK, DHCP_OPT_ROUTER, DHCP_OPT_DNS,
+        DHCP_OPT_LEASE_TIME, DHCP_OPT_T1, DHCP_OPT_T2,
+    };
+    struct dhcp_msg *m = (struct dhcp_msg *)a->msg;
+    u8 client_id[1 + ETH_ALEN];
+    u8 *p;
+    
+    memset(a->msg, 0, sizeof(a->msg));
+    m->op = DHCP_BOOTREQUEST;
+    m->htype = 1;
+    m->hlen = ETH_ALEN;
+    m->xid = htonl(c->xid);
+    m->secs = htons(min_t(unsigned long, (jiffies - c->start) / HZ, 0xffff));
+    m->flags = ciaddr ? 0 : htons(DHCP_FLAG_BROADCAST);
+    m->ciaddr = ciaddr;
+    memcpy(m->chaddr, c->hwaddr, ETH_ALEN);
+    m->cookie = htonl(DHCP_MAGIC_COOKIE);
+    
+    p = m->options;
+    p = dhcp_put_opt(p, DHCP_OPT_MSG_TYPE, &type, 1);
+    client_id[0] = 1;
+    memcpy(client_id + 1, c->hwaddr, ETH_ALEN);
+    p = dhcp_put_opt(p, DHCP_OPT_CLIENT_ID, client_id, sizeof(client_id));
+    if (req_ip) {
+        p = dhcp_put_opt(p, DHCP_OPT_REQUESTED_IP, &req_ip, 4);
+    }
+    if (server_id) {
+        p = dhcp_put_opt(p, DHCP_OPT_SERVER_ID, &server_id, 4);
+    }
+    p = dhcp_put_opt(p, DHCP_OPT_PARAM_LIST, params, sizeof(params));
+    *p = DHCP_OPT_END;
+    
+    a->len = DHCP_MSG_LEN;
+    a->dst = htonl(INADDR_BROADCAST);
+}
+
+static bool dhcp_parse(const struct dhcp_client *c, const u8 *buf, size_t len, struct dhcp_reply *r)
+{
+    const struct dhcp_msg *m = (const struct dhcp_msg *)buf;
+    const u8 *p = m->options, *end = buf + len;
+    
+    if (len < sizeof(*m) || m->op != DHCP_BOOTREPLY || ntohl(m->xid) != c->xid ||
+        m->hlen != ETH_ALEN || memcmp(m->chaddr, c->hwaddr, ETH_ALEN) ||
+        m->cookie != htonl(DHCP_MAGIC_COOKIE)) {
+        return false;
+    }
+    
+    memset(r, 0, sizeof(*r));
+    r->yiaddr = m->yiaddr;
+    while (p < end && *p != DHCP_OPT_END) {
+        u8 code = *p++, olen;
+    
+        if (code == DHCP_OPT_PAD) {
+            continue;
+        }
+        if (p >= end || p + 1 + *p > end) {
+            return false;
+        }
+        olen = *p++;
+        switch (code) {
+        case DHCP_OPT_MSG_TYPE:
+            if (olen == 1) {
+                r->type = p[0];
+            }
+            break;
+        // Routers and servers come in lists, the first is kept
+        case DHCP_OPT_SERVER_ID:
+            if (olen >= 4) {
+                memcpy(&r->server, p, 4);
+            }
+            break;
+        case DHCP_OPT_NETMASK:
+            if (olen >= 4) {
+                memcpy(&r->netmask, p, 4);
+            }
+            break;
+        case DHCP_OPT_ROUTER:
+            if (olen >= 4) {
+                memcpy(&r->router, p, 4);
+            }
+            break;
+        case DHCP_OPT_DNS:
+            if (olen >= 4) {
+                memcpy(&r->dns, p, 4);
+            }
+            break;
+        case DHCP_OPT_LEASE_TIME:
+            if (olen >= 4) {
+                r->lease_sec = get_unaligned_be32(p);
+            }
+            break;
+        case DHCP_OPT_T1:
+            if (olen >= 4) {
+                r->t1_sec = get_unaligned_be32(p);
+            }
+            break;
+        case DHCP_OPT_T2:
+            if (olen >= 4) {
+                r->t2_sec = get_unaligned_be32(p);
+            }
+            break;
+        }
+        p += olen;
+    }
+    return r->type != 0;
+}
+
+// Start over from DISCOVER with a new transaction
+static void dhcp_discover(struct dhcp_client *c, struct dhcp_action *a)
+{
+    c->state = DHCP_SELECTING;
+    c->xid = get_random_u32();
+    c->start = jiffies;
+    c->tries = 1;
+    dhcp_build(c, a, DHCPDISCOVER, 0, 0, 0);
+    dhcp_schedule(c, dhcp_backoff(c->tries));
+}
+
+// Schedule the next lease event of a bound client
+static void dhcp_schedule_lease(struct dhcp_client *c, s64 now)
+{
+    s64 at;
+    
+    if (c->lease.lease_sec == DHCP_LEASE_INFINITE) {
+        return;
+    }
+    at = dhcp_lease_at(&c->lease, c->state == DHCP_BOUND ? c->lease.t1_sec :
+                       c->state == DHCP_RENEWING ? c->lease.t2_sec : c->lease.lease_sec);
+    // Renewing and rebinding retransmit at half the time left, 60 s at least
+    at = c->state == DHCP_BOUND ? at : min(at, now + max_t(s64, (at - now) / 2, DHCP_RENEW_MIN_SEC));
+    dhcp_schedule(c, dhcp_sec_to_jiffies(at - now));
+}
+
+static void dhcp_enter_bound(struct dhcp_client *c, struct dhcp_action *a, s64 now)
+{
+    c->state = DHCP_BOUND;
+    c->have_lease = true;
+    a->bound = true;
+    a->lease = c->lease;
+    dhcp_schedule_lease(c, now);
+}
+
+static void dhcp_bind(struct dhcp_client *c, struct dhcp_action *a, const struct dhcp_reply *r, s64 now)
+{
+    struct dhcp_lease *l = &c->lease;
+    
+    memset(l, 0, sizeof(*l));
+    l->magic = DHCP_LEASE_MAGIC;
+    l->version = DHCP_LEASE_VERSION;
+    ether_addr_copy(l->hwaddr, c->hwaddr);
+    l->addr = r->yiaddr;
+    l->netmask = r->netmask;
+    l->router = r->router;
+    l->dns = r->dns;
+    l->server = r->server ? r->server : c->offer_server;
+    // Lease times count from when the request went out (4.4.1)
+    l->acquired = now - (s64)((jiffies - c->start) / HZ);
+    l->lease_sec = r->lease_sec ? r->lease_sec : DHCP_LEASE_INFINITE;
+    if (l->lease_sec == DHCP_LEASE_INFINITE) {
+        l->t1_sec = l->t2_sec = DHCP_LEASE_INFINITE;
+    } else {
+        l->t1_sec = r->t1_sec && r->t1_sec < l->lease_sec ? r->t1_sec : l->lease_sec / 2;
+        l->t2_sec = r->t2_sec && r->t2_sec < l->lease_sec && r->t2_sec > l->t1_sec ?
+                    r->t2_sec : (u32)((u64)l->lease_sec * 7 / 8);
+    }
+    l->crc = dhcp_lease_crc(l);
+    
+    dhcp_enter_bound(c, a, now);
+}
+
+/**
+ * Feed a message received on UDP port 68. Context of the owner's RX
+ * path; replies to other transactions are ignored.
+ */
+int dhcp_input(struct dhcp_client *c, const u8 *msg, size_t len)
+{
+    struct dhcp_action *a;
+    struct dhcp_reply r;
+    s64 now = ktime_get_real_seconds();
+    int ret = 0;
+    
+    a = kzalloc(sizeof(*a), GFP_ATOMIC);
+    if (!a) {
+        return -ENOMEM;
+    }
+    
+    spin_lock_bh(&c->lock);
+    if (!dhcp_parse(c, msg, len, &r)) {
+        ret = -EINVAL;
+        goto unlock;
+    }
+    switch (c->state) {
+    case DHCP_SELECTING:
+        if (r.type != DHCPOFFER || !r.yiaddr || !r.server) {
+            break;
+        }
+        // First offer wins; the REQUEST names it so the others withdraw
+        c->offer_addr = r.yiaddr;
+        c->offer_server = r.server;
+        c->state = DHCP_REQUESTING;
+        c->tries = 1;
+        dhcp_build(c, a, DHCPREQUEST, 0, r.yiaddr, r.server);
+        dhcp_schedule(c, dhcp_backoff(c->tries));
+        break;
+    case DHCP_REQUESTING:
+    case DHCP_REBOOTING:
+    case DHCP_RENEWING:
+    case DHCP_REBINDING:
+        if (r.type == DHCPACK && r.yiaddr) {
+            if (c->state == DHCP_REQUESTING) {
+                c->stats.full_acquisitions++;
+            } else if (c->state == DHCP_REBOOTING) {
+                c->stats.reboot_acks++;
+            }
+            dhcp_bind(c, a, &r, now);
+        } else if (r.type == DHCPNAK) {
+            c->stats.naks++;
+            a->lost = c->have_lease;
+            c->have_lease = false;
+            dhcp_discover(c, a);
+        }
+        break;
+    default:
+        break;
+    }
+    
+unlock:
+    spin_unlock_bh(&c->lock);
+    
+    if (a->lost) {
+        c->ops->lost(c->ctx);
+    }
+    if (a->bound) {
+        c->ops->bound(c->ctx, &a->lease);
+    }
+    if (a->len) {
+        c->ops->send(c->ctx, a->msg, a->len, a->dst);
+    }
+    kfree(a);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(dhcp_input);
+
+static void dhcp_work(struct work_struct *work)
+{
+    struct dhcp_client *c = container_of(to_delayed_work(work), struct dhcp_client, work);
+    s64 now = ktime_get_real_seconds();
+    struct dhcp_action *a;
+    
+    a = kzalloc(sizeof(*a), GFP_KERNEL);
+    if (!a) {
+        dhcp_schedule(c, HZ);
+        return;
+    }
+    
+    spin_lock_bh(&c->lock);
+    switch (c->state) {
+    case DHCP_SELECTING:
+        c->tries = min_t(u8, c->tries + 1, 8);
+        dhcp_build(c, a, DHCPDISCOVER, 0, 0, 0);
+        dhcp_schedule(c, dhcp_backoff(c->tries));
+        break;
+    case DHCP_REQUESTING:
+        if (c->tries >= DHCP_REQUEST_TRIES) {
+            dhcp_discover(c, a);
+            break;
+        }
+        c->tries++;
+        dhcp_build(c, a, DHCPREQUEST, 0, c->offer_addr, c->offer_server);
+        dhcp_schedule(c, dhcp_backoff(c->tries));
+        break;
+    case DHCP_REBOOTING:
+        if (c->tries < DHCP_REBOOT_TRIES) {
+            c->tries++;
+            dhcp_build(c, a, DHCPREQUEST, 0, c->lease.addr, 0);
+            dhcp_schedule(c, DHCP_REBOOT_TIMEOUT);
+        } else if (dhcp_lease_current(&c->lease, now)) {
+            // Nobody answered: keep the address, renewal will confirm it
+            c->stats.reboot_fallbacks++;
+            dhcp_enter_bound(c, a, now);
+        } else {
+            dhcp_discover(c, a);
+        }
+        break;
+    case DHCP_BOUND:
+    case DHCP_RENEWING:
+    case DHCP_REBINDING:
+        if (now >= dhcp_lease_at(&c->lease, c->lease.lease_sec)) {
+            a->lost = true;
+            c->have_lease = false;
+            dhcp_discover(c, a);
+            break;
+        }
+        if (now < dhcp_lease_at(&c->lease, c->lease.t1_sec)) {
+            // Woken early, the wait is capped at a day
+            dhcp_schedule_lease(c, now);
+            break;
+        }
+        if (c->state == DHCP_BOUND) {
+            c->xid = get_random_u32();
+            c->start = jiffies;
+        }
+        c->state = now >= dhcp_lease_at(&c->lease, c->lease.t2_sec) ? DHCP_REBINDING : DHCP_RENEWING;
+        dhcp_build(c, a, DHCPREQUEST, c->lease.addr, 0, 0);
+        if (c->state == DHCP_RENEWING) {
+            a->dst = c->lease.server;
+        }
+        dhcp_schedule_lease(c, now);
+        break;
+    default:
+        break;
+    }
+    spin_unlock_bh(&c->lock);
+    
+    if (a->lost) {
+        c->ops->lost(c->ctx);
+    }
+    if (a->bound) {
+        c->ops->bound(c->ctx, &a->lease);
+    }
+    if (a->len) {
+        c->ops->send(c->ctx, a->msg, a->len, a->dst);
+    }
+    kfree(a);
+}
+
+int dhcp_client_init(struct dhcp_client *c, const u8 *hwaddr, const struct dhcp_ops *ops, void *ctx)
+{
+    if (!ops || !ops->send || !ops->bound || !ops->lost || !is_valid_ether_addr(hwaddr)) {
+        return -EINVAL;
+    }
+    
+    memset(c, 0, sizeof(*c));
+    spin_lock_init(&c->lock);
+    ether_addr_copy(c->hwaddr, hwaddr);
+    c->ops = ops;
+    c->ctx = ctx;
+    INIT_DELAYED_WORK(&c->work, dhcp_work);
+    
+    return 0;
+}
+EXPORT_SYMBOL_GPL(dhcp_client_init);
+
+/**
+ * Start acquiring an address, e.g. on wake-up. With an intact cached
+ * lease the first message is an INIT-REBOOT REQUEST for its address;
+ * otherwise a DISCOVER. The first transmission happens from the work
+ * item, so this only queues it.
+ */
+int dhcp_client_start(struct dhcp_client *c, const struct dhcp_lease *cached)
+{
+    spin_lock_bh(&c->lock);
+    if (c->state != DHCP_STOPPED) {
+        spin_unlock_bh(&c->lock);
+        return -EBUSY;
+    }
+    c->xid = get_random_u32();
+    c->start = jiffies;
+    c->tries = 0;
+    if (cached && dhcp_lease_intact(cached, c->hwaddr)) {
+        c->lease = *cached;
+        c->state = DHCP_REBOOTING;
+    } else {
+        c->state = DHCP_SELECTING;
+    }
+    c->have_lease = false;
+    spin_unlock_bh(&c->lock);
+    
+    dhcp_schedule(c, 0);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(dhcp_client_start);
+
+/**
+ * Stop before sleeping. No RELEASE is sent: the lease is meant to be
+ * reused on the next start.
+ */
+void dhcp_client_stop(struct dhcp_client *c)
+{
+    spin_lock_bh(&c->lock);
+    c->state = DHCP_STOPPED;
+    spin_unlock_bh(&c->lock);
+    
+    cancel_delayed_work_sync(&c->work);
+}
+EXPORT_SYMBOL_GPL(dhcp_client_stop);
 
 static int __init dhcp_init(void)
 {
@@ -28,4 +569,4 @@ module_exit(dhcp_exit);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("jk1806");
 MODULE_DESCRIPTION("DHCP/DHCPv6 Implementation");
-MODULE_VERSION(MODULE_VERSION);
+MODULE_VERSION(DHCP_VERSION);
@@ -0,0 +1,101 @@
+/**
+ * DHCPv4 client
+ *
+ * RFC 2131 client for the lightweight stacks, built for devices that
+ * wake, transmit and sleep. The lease is handed to the owner on every
+ * bind to keep across sleep (RTC RAM, flash); started again with it, the
+ * client rejoins with one INIT-REBOOT request instead of the four
+ * messages and the backoff of a full DISCOVER. The owning stack moves
+ * the messages over UDP through its dhcp_ops.
+ */
+
+#ifndef DHCP_H
+#define DHCP_H
+
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/if_ether.h>
+
+#define DHCP_CLIENT_PORT 68
+#define DHCP_SERVER_PORT 67
+#define DHCP_MSG_LEN 300                // BOOTP minimum, some relays drop anything shorter
+#define DHCP_LEASE_INFINITE 0xffffffffu
+
+#define DHCP_LEASE_MAGIC 0x4c484344     // "DHCL"
+#define DHCP_LEASE_VERSION 1
+
+/*
+ * Lease as persisted by the owner. Times are wall-clock seconds so the
+ * lease ages across sleep; crc covers everything before it.
+ */
+struct dhcp_lease {
+    u32 magic;
+    u16 version;
+    u8 hwaddr[ETH_ALEN];
+    __be32 addr;
+    __be32 netmask;
+    __be32 router;
+    __be32 dns;
+    __be32 server;                      // server identifier, renewals go here
+    s64 acquired;
+    u32 lease_sec;
+    u32 t1_sec;
+    u32 t2_sec;
+    u32 crc;
+};
+
+enum dhcp_state {
+    DHCP_STOPPED,
+    DHCP_SELECTING,
+    DHCP_REQUESTING,
+    DHCP_REBOOTING,
+    DHCP_BOUND,
+    DHCP_RENEWING,
+    DHCP_REBINDING,
+};
+
+/*
+ * Callbacks into the owning stack, made without the client's lock from
+ * the client's work item or from dhcp_input()'s context
+ */
+struct dhcp_ops {
+    // UDP from port 68 to dst:67; dst is INADDR_BROADCAST unless renewing
+    int (*send)(void *ctx, const void *msg, size_t len, __be32 dst);
+    // Configure the interface and persist the lease; called again on each renewal
+    void (*bound)(void *ctx, const struct dhcp_lease *lease);
+    // The address is no longer ours: unconfigure it
+    void (*lost)(void *ctx);
+};
+
+struct dhcp_stats {
+    u32 reboot_acks;                    // fast rejoins confirmed by a server
+    u32 reboot_fallbacks;               // no answer, the unexpired lease was kept
+    u32 full_acquisitions;              // DISCOVER to ACK
+    u32 naks;
+};
+
+struct dhcp_client {
+    spinlock_t lock;
+    u8 state;                           // enum dhcp_state
+    u8 tries;                           // transmissions of the current message
+    u8 hwaddr[ETH_ALEN];
+    u32 xid;
+    unsigned long start;                // jiffies at the start of the exchange, for secs
+    __be32 offer_addr;
+    __be32 offer_server;
+    bool have_lease;
+    struct dhcp_lease lease;
+    const struct dhcp_ops *ops;
+    void *ctx;
+    struct delayed_work work;           // retransmits and lease timers
+    struct dhcp_stats stats;
+};
+
+int dhcp_client_init(struct dhcp_client *c, const u8 *hwaddr, const struct dhcp_ops *ops, void *ctx);
+int dhcp_client_start(struct dhcp_client *c, const struct dhcp_lease *cached);
+void dhcp_client_stop(struct dhcp_client *c);
+int dhcp_input(struct dhcp_client *c, const u8 *msg, size_t len);
+bool dhcp_lease_intact(const struct dhcp_lease *lease, const u8 *hwaddr);
+
+#endif /* DHCP_H */
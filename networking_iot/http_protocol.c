@@ -5,35 +5,52 @@
  * 
  * HTTP client and server implementation
  * Supports HTTP/1.1 and HTTP/2 protocols
+ *
+ * Requests are parsed incrementally as they arrive, without copying:
+ * header names and values, and body data, are spans of the receive
+ * buffer.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/tcp.h>
 #include <linux/string.h>
+#include <linux/ctype.h>
+#include <linux/errno.h>
+#include <asm/unaligned.h>
 
-#define HTTP_VERSION "1.1.0"
+#define HTTP_VERSION "1.2.0"
 #define HTTP_MAX_HEADERS 32
-#define HTTP_MAX_HEADER_SIZE 4096
+#define HTTP_MAX_HEADER_SIZE 4096   // request line and headers, and any one chunk line
+#define HTTP_MAX_CHUNK_DIGITS 15    // chunk sizes below 2^60
+
+// Part of the caller's buffer; offsets stay valid when the buffer grows
+struct http_span {
+    u32 off;
+    u32 len;
+};
 
 struct http_request {
-    char method[16];
-    char uri[256];
-    char version[16];
+    struct http_span method;
+    struct http_span uri;
+    u8 version_minor;           // HTTP/1.x
     struct http_header {
-        char name[64];
-        char value[256];
+        struct http_span name;
+        struct http_span value;
     } headers[HTTP_MAX_HEADERS];
     int header_count;
-    char *body;
-    size_t body_len;
+    u64 content_length;
+    bool has_content_length;
+    bool chunked;
+    bool keep_alive;
+    u64 body_len;               // body bytes returned so far
 };
 
 struct http_response {
     char version[16];
     int status_code;
     char status_text[64];
-    struct http_header {
+    struct http_response_header {
         char name[64];
         char value[256];
     } headers[HTTP_MAX_HEADERS];
@@ -42,68 +59,413 @@ struct http_response {
     size_t body_len;
 };
 
+enum http_parser_state {
+    HTTP_STATE_REQUEST_LINE,
+    HTTP_STATE_HEADER,
+    HTTP_STATE_BODY,            // Content-Length bytes
+    HTTP_STATE_CHUNK_SIZE,
+    HTTP_STATE_CHUNK_DATA,
+    HTTP_STATE_CHUNK_END,       // CRLF after the chunk data
+    HTTP_STATE_TRAILER,
+    HTTP_STATE_DONE,
+};
+
+enum http_parse_result {
+    HTTP_PARSE_HEADERS = 1,     // request line and headers are in req
+    HTTP_PARSE_BODY,            // *body holds the next body bytes
+    HTTP_PARSE_DONE,            // message complete, the next one starts at pos
+};
+
+/*
+ * Request parser state. The caller keeps the request in one buffer,
+ * appends what arrives and calls http_parse_request() again with the
+ * new length; every byte is looked at once, however the request is
+ * split across reads. Header spans point into that buffer.
+ */
+struct http_parser {
+    enum http_parser_state state;
+    struct http_request *req;
+    size_t start;               // where the request begins
+    size_t pos;                 // first byte not yet consumed
+    size_t scan;                // the line end search resumes here
+    u64 remaining;              // body or chunk bytes still to come
+};
+
+static inline const char *http_span_ptr(const char *buf, const struct http_span *span)
+{
+    return buf + span->off;
+}
+
+static bool http_span_ieq(const char *buf, const struct http_span *span, const char *str)
+{
+    return span->len == strlen(str) && !strncasecmp(buf + span->off, str, span->len);
+}
+
 /**
- * Parse HTTP request
+ * Index of the first c in buf[pos, end), or end. Compares a word at a
+ * time: a byte of x is zero exactly where buf matched c.
  */
-static int http_parse_request(const char *data, size_t len,
-                              struct http_request *req)
+static size_t http_find_byte(const char *buf, size_t pos, size_t end, char c)
 {
-    char *line;
-    char *saveptr;
-    int i;
+    const unsigned long pattern = REPEAT_BYTE((u8)c);
     
-    // Parse request line
-    line = strstr(data, "\r\n");
-    if (!line) {
-        return -1;
-    }
+    while (pos + sizeof(unsigned long) <= end) {
+        unsigned long x = get_unaligned((const unsigned long *)(buf + pos)) ^ pattern;
     
-    sscanf(data, "%15s %255s %15s", req->method, req->uri, req->version);
+        if ((x - REPEAT_BYTE(0x01)) & ~x & REPEAT_BYTE(0x80)) {
+            break;
+        }
+        pos += sizeof(unsigned long);
+    }
+    while (pos < end && buf[pos] != c) {
+        pos++;
+    }
     
-    // Parse headers
-    data = line + 2;
-    req->header_count = 0;
+    return pos;
+}
+
+static bool http_is_tchar(char c)
+{
+    return isalnum(c) || (c && strchr("!#$%&'*+-.^_`|~", c));
+}
+
+static bool http_is_token(const char *s, size_t len)
+{
+    size_t i;
     
-    while ((line = strstr(data, "\r\n")) != NULL && *data != '\r') {
-        char header_line[512];
-        size_t line_len = line - data;
-        
-        if (line_len >= sizeof(header_line)) {
-            break;
+    if (!len) {
+        return false;
+    }
+    for (i = 0; i < len; i++) {
+        if (!http_is_tchar(s[i])) {
+            return false;
         }
-        
-        memcpy(header_line, data, line_len);
-        header_line[line_len] = '\0';
-        
-        char *colon = strchr(header_line, ':');
-        if (colon) {
-            *colon = '\0';
-            strncpy(req->headers[req->header_count].name, header_line, 63);
-            strncpy(req->headers[req->header_count].value, colon + 2, 255);
-            req->header_count++;
+    }
+    return true;
+}
+
+/**
+ * Initialize a parser for a request starting at start in the caller's
+ * buffer (non-zero for the next pipelined request).
+ */
+static void http_parser_init(struct http_parser *p, struct http_request *req, size_t start)
+{
+    memset(p, 0, sizeof(*p));
+    memset(req, 0, sizeof(*req));
+    p->req = req;
+    p->start = start;
+    p->pos = start;
+    p->scan = start;
+}
+
+/**
+ * The caller dropped the first n bytes of its buffer (n <= p->pos), to
+ * keep a long body from growing it. Only once the headers were
+ * returned; their spans are stale afterwards.
+ */
+static void http_parser_discard(struct http_parser *p, size_t n)
+{
+    p->start = p->start > n ? p->start - n : 0;
+    p->pos -= n;
+    p->scan -= n;
+}
+
+/*
+ * Find the end of the line at p->pos. On success *line_len excludes the
+ * CRLF and p->scan is past it. Lines must end in CRLF: a bare LF is
+ * rejected rather than guessed at.
+ */
+static int http_next_line(struct http_parser *p, const char *buf, size_t len, size_t *line_len)
+{
+    size_t base = p->state <= HTTP_STATE_HEADER ? p->start : p->pos;
+    size_t lf = http_find_byte(buf, p->scan, len, '\n');
+    
+    if (lf == len) {
+        p->scan = len;
+        return len - base > HTTP_MAX_HEADER_SIZE ? -E2BIG : -EAGAIN;
+    }
+    if (lf + 1 - base > HTTP_MAX_HEADER_SIZE) {
+        return -E2BIG;
+    }
+    if (lf == p->pos || buf[lf - 1] != '\r') {
+        return -EBADMSG;
+    }
+    
+    *line_len = lf - 1 - p->pos;
+    p->scan = lf + 1;
+    return 0;
+}
+
+// method SP request-target SP HTTP/1.x
+static int http_parse_request_line(struct http_request *req, const char *buf, size_t off, size_t len)
+{
+    const char *line = buf + off;
+    size_t sp1, sp2;
+    
+    sp1 = http_find_byte(line, 0, len, ' ');
+    if (sp1 == len || !http_is_token(line, sp1)) {
+        return -EBADMSG;
+    }
+    sp2 = http_find_byte(line, sp1 + 1, len, ' ');
+    if (sp2 == len || sp2 == sp1 + 1) {
+        return -EBADMSG;
+    }
+    if (len - sp2 - 1 != 8 || memcmp(line + sp2 + 1, "HTTP/1.", 7) ||
+        (line[len - 1] != '0' && line[len - 1] != '1')) {
+        return -EBADMSG;
+    }
+    
+    req->method.off = off;
+    req->method.len = sp1;
+    req->uri.off = off + sp1 + 1;
+    req->uri.len = sp2 - sp1 - 1;
+    req->version_minor = line[len - 1] - '0';
+    req->keep_alive = req->version_minor >= 1;
+    
+    return 0;
+}
+
+static int http_parse_content_length(struct http_request *req, const char *s, size_t len)
+{
+    u64 value = 0;
+    size_t i;
+    
+    if (!len) {
+        return -EBADMSG;
+    }
+    for (i = 0; i < len; i++) {
+        if (!isdigit(s[i])) {
+            return -EBADMSG;
         }
-        
-        data = line + 2;
-        
-        if (req->header_count >= HTTP_MAX_HEADERS) {
-            break;
+        if (value > (U64_MAX - 9) / 10) {
+            return -EOVERFLOW;
         }
+        value = value * 10 + (s[i] - '0');
     }
     
-    // Find body
-    if (strstr(data, "\r\n\r\n")) {
-        req->body = (char *)strstr(data, "\r\n\r\n") + 4;
-        req->body_len = len - (req->body - (char *)data);
-    } else {
-        req->body = NULL;
-        req->body_len = 0;
+    // Repeated Content-Length is only tolerable if it agrees
+    if (req->has_content_length && req->content_length != value) {
+        return -EBADMSG;
     }
+    req->content_length = value;
+    req->has_content_length = true;
+    
+    return 0;
+}
+
+// field-name ":" OWS field-value OWS
+static int http_parse_header(struct http_request *req, const char *buf, size_t off, size_t len)
+{
+    const char *line = buf + off;
+    struct http_header *h;
+    size_t colon, vstart, vend;
+    
+    colon = http_find_byte(line, 0, len, ':');
+    if (colon == len || !http_is_token(line, colon)) {
+        // no name, whitespace before the colon, or obs-fold
+        return -EBADMSG;
+    }
+    if (req->header_count >= HTTP_MAX_HEADERS) {
+        return -E2BIG;
+    }
+    
+    vstart = colon + 1;
+    vend = len;
+    while (vstart < vend && (line[vstart] == ' ' || line[vstart] == '\t')) {
+        vstart++;
+    }
+    while (vend > vstart && (line[vend - 1] == ' ' || line[vend - 1] == '\t')) {
+        vend--;
+    }
+    
+    h = &req->headers[req->header_count++];
+    h->name.off = off;
+    h->name.len = colon;
+    h->value.off = off + vstart;
+    h->value.len = vend - vstart;
+    
+    // Framing headers are interpreted here, the rest is the caller's
+    if (http_span_ieq(buf, &h->name, "content-length")) {
+        return http_parse_content_length(req, line + vstart, vend - vstart);
+    }
+    if (http_span_ieq(buf, &h->name, "transfer-encoding")) {
+        if (!http_span_ieq(buf, &h->value, "chunked")) {
+            return -EOPNOTSUPP;
+        }
+        req->chunked = true;
+    } else if (http_span_ieq(buf, &h->name, "connection")) {
+        if (http_span_ieq(buf, &h->value, "close")) {
+            req->keep_alive = false;
+        } else if (http_span_ieq(buf, &h->value, "keep-alive")) {
+            req->keep_alive = true;
+        }
+    }
+    
+    return 0;
+}
+
+// chunk-size [ chunk-ext ]
+static int http_parse_chunk_size(struct http_parser *p, const char *line, size_t len)
+{
+    u64 size = 0;
+    size_t i;
     
-    pr_info("HTTP: Request %s %s %s\n", req->method, req->uri, req->version);
+    for (i = 0; i < len && isxdigit(line[i]); i++) {
+        if (i == HTTP_MAX_CHUNK_DIGITS) {
+            return -EOVERFLOW;
+        }
+        size = (size << 4) | hex_to_bin(line[i]);
+    }
+    if (!i || (i < len && line[i] != ';' && line[i] != ' ' && line[i] != '\t')) {
+        return -EBADMSG;
+    }
     
+    p->remaining = size;
+    p->state = size ? HTTP_STATE_CHUNK_DATA : HTTP_STATE_TRAILER;
     return 0;
 }
 
+/*
+ * Body bytes already in the buffer, up to p->remaining, as a span
+ * instead of a copy
+ */
+static int http_take_body(struct http_parser *p, size_t len, struct http_span *body)
+{
+    size_t n = min_t(u64, len - p->pos, p->remaining);
+    
+    if (!n) {
+        return -EAGAIN;
+    }
+    body->off = p->pos;
+    body->len = n;
+    p->pos += n;
+    p->scan = p->pos;
+    p->remaining -= n;
+    p->req->body_len += n;
+    
+    return HTTP_PARSE_BODY;
+}
+
+/**
+ * Parse HTTP request
+ *
+ * buf holds the request from p->start, len bytes so far. Returns
+ * HTTP_PARSE_HEADERS once, then HTTP_PARSE_BODY per run of body bytes
+ * (chunked bodies decoded), then HTTP_PARSE_DONE; -EAGAIN when it needs
+ * more data, or a negative errno for a malformed (-EBADMSG), oversized
+ * (-E2BIG, -EOVERFLOW) or unsupported (-EOPNOTSUPP) request.
+ */
+static int http_parse_request(struct http_parser *p, const char *buf, size_t len,
+                              struct http_span *body)
+{
+    size_t line_len, off;
+    int ret;
+    
+    for (;;) {
+        switch (p->state) {
+        case HTTP_STATE_REQUEST_LINE:
+        case HTTP_STATE_HEADER:
+            ret = http_next_line(p, buf, len, &line_len);
+            if (ret) {
+                return ret;
+            }
+            off = p->pos;
+            p->pos = p->scan;
+    
+            if (p->state == HTTP_STATE_REQUEST_LINE) {
+                // Empty lines ahead of a request are ignored
+                if (line_len) {
+                    ret = http_parse_request_line(p->req, buf, off, line_len);
+                    if (ret) {
+                        return ret;
+                    }
+                    p->state = HTTP_STATE_HEADER;
+                }
+                break;
+            }
+            if (line_len) {
+                ret = http_parse_header(p->req, buf, off, line_len);
+                if (ret) {
+                    return ret;
+                }
+                break;
+            }
+    
+            // End of headers: pick the body framing
+            if (p->req->chunked) {
+                // Both framings on one request is a smuggling attempt
+                if (p->req->has_content_length) {
+                    return -EBADMSG;
+                }
+                p->state = HTTP_STATE_CHUNK_SIZE;
+            } else if (p->req->content_length) {
+                p->remaining = p->req->content_length;
+                p->state = HTTP_STATE_BODY;
+            } else {
+                p->state = HTTP_STATE_DONE;
+            }
+            pr_debug("HTTP: Request %.*s %.*s HTTP/1.%u\n",
+                     p->req->method.len, http_span_ptr(buf, &p->req->method),
+                     p->req->uri.len, http_span_ptr(buf, &p->req->uri), p->req->version_minor);
+            return HTTP_PARSE_HEADERS;
+    
+        case HTTP_STATE_BODY:
+            ret = http_take_body(p, len, body);
+            if (ret == HTTP_PARSE_BODY && !p->remaining) {
+                p->state = HTTP_STATE_DONE;
+            }
+            return ret;
+    
+        case HTTP_STATE_CHUNK_SIZE:
+            ret = http_next_line(p, buf, len, &line_len);
+            if (ret) {
+                return ret;
+            }
+            off = p->pos;
+            p->pos = p->scan;
+            ret = http_parse_chunk_size(p, buf + off, line_len);
+            if (ret) {
+                return ret;
+            }
+            break;
+    
+        case HTTP_STATE_CHUNK_DATA:
+            ret = http_take_body(p, len, body);
+            if (ret == HTTP_PARSE_BODY && !p->remaining) {
+                p->state = HTTP_STATE_CHUNK_END;
+            }
+            return ret;
+    
+        case HTTP_STATE_CHUNK_END:
+            if (len - p->pos < 2) {
+                return -EAGAIN;
+            }
+            if (buf[p->pos] != '\r' || buf[p->pos + 1] != '\n') {
+                return -EBADMSG;
+            }
+            p->pos += 2;
+            p->scan = p->pos;
+            p->state = HTTP_STATE_CHUNK_SIZE;
+            break;
+    
+        case HTTP_STATE_TRAILER:
+            // Trailer fields are skipped, up to the empty line
+            ret = http_next_line(p, buf, len, &line_len);
+            if (ret) {
+                return ret;
+            }
+            p->pos = p->scan;
+            if (!line_len) {
+                p->state = HTTP_STATE_DONE;
+            }
+            break;
+    
+        case HTTP_STATE_DONE:
+            return HTTP_PARSE_DONE;
+        }
+    }
+}
+
 /**
  * Build HTTP response
  */
@@ -17,12 +17,62 @@
 #include <linux/icmp.h>
 #include <linux/errno.h>
 #include <linux/atomic.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/if_ether.h>
+#include <linux/etherdevice.h>
+#include <linux/if_arp.h>
+#include <net/checksum.h>
+#include "nic_offloads.h"
+#include "arp_nd.h"
 
 #define LWIP_VERSION "2.1.3"
 #define LWIP_MAX_CONNECTIONS 16
 #define LWIP_BUFFER_SIZE 1500
 #define LWIP_MTU 1500
 
+// Packet buffers: fixed pools, no heap on the data path
+#define LWIP_PBUF_POOL_SIZE 16              // pbufs with payload storage
+#define LWIP_PBUF_POOL_BUFSIZE 1536         // headroom + MSS, or one RX frame
+#define LWIP_PBUF_REF_POOL_SIZE 32          // descriptors for PBUF_REF/PBUF_ROM
+#define LWIP_PBUF_HLEN 64                   // room for Ethernet + IP + TCP headers
+#define LWIP_ETH_PAD 2                      // RX: keeps the IP header word aligned
+#define LWIP_RX_QUEUE_LEN 8
+
+// pbuf flags, set on the first pbuf of a frame
+#define LWIP_PBUF_FLAG_CSUM_TX 0x01         // TX: NIC inserts the IP and L4 checksums
+#define LWIP_PBUF_FLAG_CSUM_OK 0x02         // RX: NIC verified the checksums
+
+/*
+ * Packet buffers follow lwIP's pbufs. A packet is a chain of pbufs
+ * linked by next; tot_len is the length of the rest of the chain, from
+ * this pbuf on. PBUF_POOL pbufs own a buffer from a static, DMA-able
+ * pool, so the driver can receive into them and headers can be added
+ * in their headroom. PBUF_REF and PBUF_ROM pbufs only point at memory
+ * the caller owns: REF memory stays valid until the pbuf's free_fn
+ * runs, ROM memory is never freed. Each pbuf is reference counted;
+ * lwip_pbuf_free() drops one reference and returns every pbuf whose
+ * count reaches zero.
+ */
+enum lwip_pbuf_type {
+    PBUF_POOL,
+    PBUF_REF,
+    PBUF_ROM,
+};
+
+struct lwip_pbuf {
+    struct lwip_pbuf *next;
+    u8 *payload;
+    u16 len;                    // bytes in this pbuf
+    u16 tot_len;                // bytes in this pbuf and the rest of the chain
+    u8 type;
+    u8 flags;                   // LWIP_PBUF_FLAG_*
+    atomic_t ref;
+    u8 *buf;                    // PBUF_POOL storage, NULL otherwise
+    void (*free_fn)(struct lwip_pbuf *p);   // PBUF_REF: caller may reuse its memory
+    void *arg;
+};
+
 struct lwip_connection {
     u32 local_ip;
     u32 remote_ip;
@@ -34,6 +84,10 @@ struct lwip_connection {
     atomic_t rx_bytes;
     u32 mtu;
     u32 mss;
+    struct lwip_pbuf *rx_queue[LWIP_RX_QUEUE_LEN];
+    unsigned int rx_head;
+    unsigned int rx_count;
+    atomic_t rx_dropped;
 };
 
 struct lwip_stack {
@@ -46,16 +100,438 @@ struct lwip_stack {
     bool tcp_enabled;
     bool udp_enabled;
     bool icmp_enabled;
+    
+    spinlock_t lock;            // pbuf pools and RX queues; drivers call in from IRQ
+    struct lwip_pbuf pool[LWIP_PBUF_POOL_SIZE];
+    struct lwip_pbuf ref_pool[LWIP_PBUF_REF_POOL_SIZE];
+    struct lwip_pbuf *pool_free;
+    struct lwip_pbuf *ref_pool_free;
+    atomic_t pool_exhausted;
+    
+    // Driver transmit: scatter-gather over the chain, no copy. The driver
+    // takes a reference and drops it after TX completion.
+    int (*linkoutput)(struct lwip_pbuf *p);
+    
+    // Interface addressing, network byte order; next hops resolve in neigh
+    u8 hwaddr[ETH_ALEN];
+    __be32 ip_addr;
+    __be32 netmask;
+    __be32 gateway;
+    struct nd_table neigh;
 };
 
 static struct lwip_stack global_lwip_stack;
 
+// Payload storage for PBUF_POOL, aligned for the Ethernet DMA engine
+static u8 lwip_pbuf_pool_mem[LWIP_PBUF_POOL_SIZE][LWIP_PBUF_POOL_BUFSIZE] __aligned(32);
+
+static void lwip_pbuf_pools_init(void)
+{
+    int i;
+    
+    global_lwip_stack.pool_free = NULL;
+    for (i = LWIP_PBUF_POOL_SIZE - 1; i >= 0; i--) {
+        global_lwip_stack.pool[i].buf = lwip_pbuf_pool_mem[i];
+        global_lwip_stack.pool[i].type = PBUF_POOL;
+        global_lwip_stack.pool[i].next = global_lwip_stack.pool_free;
+        global_lwip_stack.pool_free = &global_lwip_stack.pool[i];
+    }
+    
+    global_lwip_stack.ref_pool_free = NULL;
+    for (i = LWIP_PBUF_REF_POOL_SIZE - 1; i >= 0; i--) {
+        global_lwip_stack.ref_pool[i].buf = NULL;
+        global_lwip_stack.ref_pool[i].next = global_lwip_stack.ref_pool_free;
+        global_lwip_stack.ref_pool_free = &global_lwip_stack.ref_pool[i];
+    }
+    atomic_set(&global_lwip_stack.pool_exhausted, 0);
+}
+
+static struct lwip_pbuf *lwip_pbuf_take_desc(struct lwip_pbuf **free_list)
+{
+    struct lwip_pbuf *p;
+    unsigned long flags;
+    
+    spin_lock_irqsave(&global_lwip_stack.lock, flags);
+    p = *free_list;
+    if (p) {
+        *free_list = p->next;
+    }
+    spin_unlock_irqrestore(&global_lwip_stack.lock, flags);
+    
+    if (!p) {
+        atomic_inc(&global_lwip_stack.pool_exhausted);
+        return NULL;
+    }
+    p->next = NULL;
+    atomic_set(&p->ref, 1);
+    p->flags = 0;
+    p->free_fn = NULL;
+    p->arg = NULL;
+    return p;
+}
+
+static int lwip_pbuf_free(struct lwip_pbuf *p);
+
+/**
+ * Allocate a packet of length bytes. PBUF_POOL chains pool pbufs as
+ * needed, the first with header room in front when headroom is set.
+ * PBUF_REF and PBUF_ROM return one descriptor; the caller points its
+ * payload at its own memory.
+ */
+static struct lwip_pbuf *lwip_pbuf_alloc(u16 length, enum lwip_pbuf_type type, bool headroom)
+{
+    struct lwip_pbuf *head = NULL, *tail = NULL, *p;
+    u16 offset = headroom ? LWIP_PBUF_HLEN : 0;
+    u16 remaining = length;
+    
+    if (type != PBUF_POOL) {
+        p = lwip_pbuf_take_desc(&global_lwip_stack.ref_pool_free);
+        if (!p) {
+            return NULL;
+        }
+        p->type = type;
+        p->payload = NULL;
+        p->len = length;
+        p->tot_len = length;
+        return p;
+    }
+    
+    do {
+        p = lwip_pbuf_take_desc(&global_lwip_stack.pool_free);
+        if (!p) {
+            if (head) {
+                lwip_pbuf_free(head);
+            }
+            return NULL;
+        }
+        p->payload = p->buf + offset;
+        p->len = min_t(u16, remaining, LWIP_PBUF_POOL_BUFSIZE - offset);
+        p->tot_len = remaining;
+        remaining -= p->len;
+        offset = 0;
+    
+        if (tail) {
+            tail->next = p;
+        } else {
+            head = p;
+        }
+        tail = p;
+    } while (remaining);
+    
+    return head;
+}
+
+static void lwip_pbuf_ref(struct lwip_pbuf *p)
+{
+    atomic_inc(&p->ref);
+}
+
+/**
+ * Drop a reference to a chain: each pbuf whose count reaches zero goes
+ * back to its pool and the walk moves on; a pbuf still referenced
+ * elsewhere keeps itself and the rest of its chain. Returns the number
+ * of pbufs freed.
+ */
+static int lwip_pbuf_free(struct lwip_pbuf *p)
+{
+    struct lwip_pbuf *next;
+    unsigned long flags;
+    int freed = 0;
+    
+    while (p && atomic_dec_and_test(&p->ref)) {
+        next = p->next;
+        if (p->type == PBUF_REF && p->free_fn) {
+            p->free_fn(p);
+        }
+    
+        spin_lock_irqsave(&global_lwip_stack.lock, flags);
+        if (p->type == PBUF_POOL) {
+            p->next = global_lwip_stack.pool_free;
+            global_lwip_stack.pool_free = p;
+        } else {
+            p->next = global_lwip_stack.ref_pool_free;
+            global_lwip_stack.ref_pool_free = p;
+        }
+        spin_unlock_irqrestore(&global_lwip_stack.lock, flags);
+    
+        freed++;
+        p = next;
+    }
+    
+    return freed;
+}
+
+/**
+ * Append tail to head, consuming the caller's reference to tail
+ */
+static void lwip_pbuf_cat(struct lwip_pbuf *head, struct lwip_pbuf *tail)
+{
+    struct lwip_pbuf *p;
+    
+    for (p = head; p->next; p = p->next) {
+        p->tot_len += tail->tot_len;
+    }
+    p->tot_len += tail->tot_len;
+    p->next = tail;
+}
+
+/**
+ * Move the payload pointer back into the headroom to prepend a header
+ */
+static int lwip_pbuf_add_header(struct lwip_pbuf *p, u16 size)
+{
+    if (p->type != PBUF_POOL || p->payload - p->buf < size) {
+        return -ENOSPC;
+    }
+    p->payload -= size;
+    p->len += size;
+    p->tot_len += size;
+    return 0;
+}
+
+/**
+ * Strip a header from the front of the first pbuf
+ */
+static int lwip_pbuf_remove_header(struct lwip_pbuf *p, u16 size)
+{
+    if (size > p->len) {
+        return -EINVAL;
+    }
+    p->payload += size;
+    p->len -= size;
+    p->tot_len -= size;
+    return 0;
+}
+
+/**
+ * Copy up to len bytes out of a chain, starting offset bytes in
+ */
+static u16 lwip_pbuf_copy_partial(const struct lwip_pbuf *p, void *dst, u16 len, u16 offset)
+{
+    u16 copied = 0;
+    
+    for (; p && copied < len; p = p->next) {
+        u16 n;
+    
+        if (offset >= p->len) {
+            offset -= p->len;
+            continue;
+        }
+        n = min_t(u16, p->len - offset, len - copied);
+        memcpy((u8 *)dst + copied, p->payload + offset, n);
+        copied += n;
+        offset = 0;
+    }
+    
+    return copied;
+}
+
+/**
+ * Copy len bytes into a chain allocated for them
+ */
+static int lwip_pbuf_take(struct lwip_pbuf *p, const void *src, u16 len)
+{
+    u16 copied = 0;
+    
+    if (p->tot_len < len) {
+        return -EMSGSIZE;
+    }
+    for (; p && copied < len; p = p->next) {
+        u16 n = min_t(u16, p->len, len - copied);
+    
+        memcpy(p->payload, (const u8 *)src + copied, n);
+        copied += n;
+    }
+    
+    return 0;
+}
+
+/**
+ * Ones' complement sum of len bytes of a chain from offset, the way
+ * csum_partial() sums a flat buffer. Pieces that start at an odd position
+ * in the packet are byte swapped into place by csum_block_add().
+ */
+static __wsum lwip_pbuf_csum(const struct lwip_pbuf *p, u16 offset, u16 len)
+{
+    __wsum sum = 0;
+    int pos = 0;
+    
+    for (; p && len; p = p->next) {
+        u16 n;
+    
+        if (offset >= p->len) {
+            offset -= p->len;
+            continue;
+        }
+        n = min_t(u16, p->len - offset, len);
+        sum = csum_block_add(sum, csum_partial(p->payload + offset, n, 0), pos);
+        pos += n;
+        len -= n;
+        offset = 0;
+    }
+    
+    return sum;
+}
+
+/**
+ * Fill the IP and transport headers of an outgoing frame; the Ethernet
+ * addresses are filled in by lwip_resolve(). Without TX checksum
+ * offload the checksums are computed here over the whole chain.
+ */
+static void lwip_build_headers(struct lwip_connection *conn, struct lwip_pbuf *frame,
+                               bool hw_csum)
+{
+    struct iphdr *iph = (struct iphdr *)(frame->payload + ETH_HLEN);
+    u16 l4_off = ETH_HLEN + sizeof(*iph);
+    u16 l4_len = frame->tot_len - l4_off;
+    __sum16 *check;
+    
+    memset(frame->payload, 0, l4_off);
+    ((struct ethhdr *)frame->payload)->h_proto = htons(ETH_P_IP);
+    iph->version = 4;
+    iph->ihl = sizeof(*iph) / 4;
+    iph->tot_len = htons(frame->tot_len - ETH_HLEN);
+    iph->frag_off = htons(IP_DF);
+    iph->ttl = 64;
+    iph->protocol = conn->protocol;
+    iph->saddr = conn->local_ip;
+    iph->daddr = conn->remote_ip;
+    
+    if (conn->protocol == IPPROTO_TCP) {
+        struct tcphdr *th = (struct tcphdr *)(frame->payload + l4_off);
+    
+        memset(th, 0, sizeof(*th));
+        th->source = htons(conn->local_port);
+        th->dest = htons(conn->remote_port);
+        th->doff = sizeof(*th) / 4;
+        th->ack = 1;
+        th->psh = 1;
+        check = &th->check;
+    } else {
+        struct udphdr *uh = (struct udphdr *)(frame->payload + l4_off);
+    
+        uh->source = htons(conn->local_port);
+        uh->dest = htons(conn->remote_port);
+        uh->len = htons(l4_len);
+        uh->check = 0;
+        check = &uh->check;
+    }
+    
+    if (hw_csum) {
+        frame->flags |= LWIP_PBUF_FLAG_CSUM_TX;
+    } else {
+        iph->check = ip_fast_csum(iph, iph->ihl);
+        *check = csum_tcpudp_magic(iph->saddr, iph->daddr, l4_len, iph->protocol,
+                                   lwip_pbuf_csum(frame, l4_off, l4_len));
+        if (conn->protocol == IPPROTO_UDP && !*check) {
+            *check = CSUM_MANGLED_0;
+        }
+    }
+    nic_offload_count_tx_csum(hw_csum);
+}
+
+/**
+ * Verify the IP and transport checksums of a received frame in software,
+ * for frames the NIC did not vouch for
+ */
+static bool lwip_verify_csum(const struct lwip_pbuf *p, const struct iphdr *iph, u16 l4_off)
+{
+    u16 l4_len;
+    
+    if (ip_fast_csum(iph, iph->ihl)) {
+        return false;
+    }
+    l4_len = ntohs(iph->tot_len) - iph->ihl * 4;
+    if (l4_off + l4_len > p->len) {
+        return false;
+    }
+    if (iph->protocol == IPPROTO_UDP &&
+        !((const struct udphdr *)(p->payload + l4_off))->check) {
+        return true;            // UDP over IPv4: no checksum sent
+    }
+    
+    return !csum_tcpudp_magic(iph->saddr, iph->daddr, l4_len, iph->protocol,
+                              lwip_pbuf_csum(p, l4_off, l4_len));
+}
+
+// Next hop of a destination: itself on the local subnet, else the gateway
+static __be32 lwip_nexthop(__be32 dst)
+{
+    if ((dst ^ global_lwip_stack.ip_addr) & global_lwip_stack.netmask) {
+        return global_lwip_stack.gateway;
+    }
+    return dst;
+}
+
+/**
+ * Neighbour cache solicitation: an ARP request for addr, broadcast, or
+ * unicast to lladdr when an entry in use is being refreshed. IPv6 next
+ * hops are not resolved by this stack.
+ */
+static int lwip_nd_solicit(void *ctx, u8 family, const u8 *addr, const u8 *lladdr)
+{
+    struct lwip_pbuf *p;
+    __be32 tpa;
+    int ret;
+    
+    if (family != ND_AF_INET) {
+        return -EAFNOSUPPORT;
+    }
+    if (!global_lwip_stack.linkoutput) {
+        return -ENODEV;
+    }
+    
+    p = lwip_pbuf_alloc(ND_ARP_FRAME_LEN, PBUF_POOL, false);
+    if (!p) {
+        return -ENOMEM;
+    }
+    memcpy(&tpa, addr, sizeof(tpa));
+    nd_build_arp(p->payload, ARPOP_REQUEST, global_lwip_stack.hwaddr,
+                 global_lwip_stack.ip_addr, lladdr, tpa);
+    ret = global_lwip_stack.linkoutput(p);
+    lwip_pbuf_free(p);
+    
+    return ret;
+}
+
+/**
+ * A frame queued while its next hop resolved: send it to lladdr now, or
+ * drop it if resolution failed. Gets the queue's reference.
+ */
+static void lwip_nd_output(void *ctx, void *pkt, const u8 *lladdr)
+{
+    struct lwip_pbuf *p = pkt;
+    
+    if (lladdr && global_lwip_stack.linkoutput) {
+        ether_addr_copy(((struct ethhdr *)p->payload)->h_dest, lladdr);
+        global_lwip_stack.linkoutput(p);
+    }
+    lwip_pbuf_free(p);
+}
+
+static const struct nd_ops lwip_nd_ops = {
+    .solicit = lwip_nd_solicit,
+    .output = lwip_nd_output,
+};
+
+/**
+ * Set the interface's MAC and IPv4 addressing, all in network byte
+ * order; a zero gateway leaves off-subnet destinations unreachable
+ */
+static void lwip_netif_config(const u8 *hwaddr, __be32 ip_addr, __be32 netmask, __be32 gateway)
+{
+    ether_addr_copy(global_lwip_stack.hwaddr, hwaddr);
+    global_lwip_stack.ip_addr = ip_addr;
+    global_lwip_stack.netmask = netmask;
+    global_lwip_stack.gateway = gateway;
+}
+
 /**
  * Initialize lwIP stack
  */
 static int lwip_stack_init(void)
 {
-    int i;
+    int i, ret;
     
     pr_info("Initializing lwIP stack\n");
     
@@ -67,6 +543,9 @@ static int lwip_stack_init(void)
     global_lwip_stack.tcp_enabled = true;
     global_lwip_stack.udp_enabled = true;
     global_lwip_stack.icmp_enabled = true;
+    spin_lock_init(&global_lwip_stack.lock);
+    lwip_pbuf_pools_init();
+    global_lwip_stack.linkoutput = NULL;
     
     // Initialize connections
     for (i = 0; i < LWIP_MAX_CONNECTIONS; i++) {
@@ -80,6 +559,14 @@ static int lwip_stack_init(void)
         atomic_set(&global_lwip_stack.connections[i].rx_bytes, 0);
         global_lwip_stack.connections[i].mtu = LWIP_MTU;
         global_lwip_stack.connections[i].mss = LWIP_MTU - 40; // IP + TCP headers
+        global_lwip_stack.connections[i].rx_head = 0;
+        global_lwip_stack.connections[i].rx_count = 0;
+        atomic_set(&global_lwip_stack.connections[i].rx_dropped, 0);
+    }
+    
+    ret = nd_table_init(&global_lwip_stack.neigh, &lwip_nd_ops, NULL);
+    if (ret) {
+        return ret;
     }
     
     pr_info("lwIP stack initialized: memory=%d KB, IPv6=%s, TCP=%s, UDP=%s\n",
@@ -126,11 +613,58 @@ static int lwip_create_connection(u32 local_ip, u32 remote_ip, u16 local_port, u
 }
 
 /**
- * lwIP packet transmission
+ * Fill in the Ethernet addresses of a built frame from the neighbour
+ * cache. Returns 0 to send it now; 1 if its next hop is resolving and a
+ * flat copy was queued to go out when it answers, so the caller's pbufs
+ * come back at once; a negative error otherwise.
  */
-static int lwip_send_packet(int conn_id, const u8 *data, size_t len)
+static int lwip_resolve(struct lwip_pbuf *frame, __be32 dst)
+{
+    struct ethhdr *eth = (struct ethhdr *)frame->payload;
+    __be32 nexthop = lwip_nexthop(dst);
+    struct lwip_pbuf *copy;
+    int ret;
+    
+    if (!nexthop) {
+        return -ENETUNREACH;
+    }
+    ether_addr_copy(eth->h_source, global_lwip_stack.hwaddr);
+    ret = nd_lookup(&global_lwip_stack.neigh, ND_AF_INET, (const u8 *)&nexthop, eth->h_dest);
+    if (ret != -EAGAIN) {
+        return ret;
+    }
+    
+    copy = lwip_pbuf_alloc(frame->tot_len, PBUF_POOL, false);
+    if (!copy || copy->next) {
+        if (copy) {
+            lwip_pbuf_free(copy);
+        }
+        return -ENOMEM;
+    }
+    lwip_pbuf_copy_partial(frame, copy->payload, frame->tot_len, 0);
+    copy->flags = frame->flags;
+    
+    ret = nd_queue(&global_lwip_stack.neigh, ND_AF_INET, (const u8 *)&nexthop, copy, eth->h_dest);
+    if (ret != 1) {
+        lwip_pbuf_free(copy);
+    }
+    return ret;
+}
+
+/**
+ * lwIP packet transmission, zero copy: headers go into the first pbuf's
+ * headroom, or into a pool pbuf chained in front of PBUF_REF/PBUF_ROM
+ * data, and the driver DMAs straight from every pbuf in the chain. The
+ * stack takes its own references; the caller still frees its own.
+ */
+static int lwip_send_pbuf(int conn_id, struct lwip_pbuf *p)
 {
-    if (conn_id >= LWIP_MAX_CONNECTIONS || !data || len == 0) {
+    struct nic_offload_caps caps;
+    struct lwip_pbuf *frame;
+    u16 hlen, payload_len;
+    int ret = 0;
+    
+    if (conn_id < 0 || conn_id >= LWIP_MAX_CONNECTIONS || !p || !p->tot_len) {
         return -EINVAL;
     }
     
@@ -141,23 +675,261 @@ static int lwip_send_packet(int conn_id, const u8 *data, size_t len)
         return -ENOTCONN;
     }
     
-    // Simulate packet transmission
-    pr_debug("lwIP connection %d sending %zu bytes\n", conn_id, len);
+    hlen = ETH_HLEN + sizeof(struct iphdr) +
+           (conn->protocol == IPPROTO_TCP ? sizeof(struct tcphdr) : sizeof(struct udphdr));
+    payload_len = p->tot_len;
+    if (payload_len + hlen - ETH_HLEN > conn->mtu ||
+        (conn->protocol == IPPROTO_TCP && payload_len > conn->mss)) {
+        return -EMSGSIZE;
+    }
+    
+    if (!lwip_pbuf_add_header(p, hlen)) {
+        lwip_pbuf_ref(p);
+        frame = p;
+    } else {
+        frame = lwip_pbuf_alloc(0, PBUF_POOL, true);
+        if (!frame) {
+            return -ENOMEM;
+        }
+        lwip_pbuf_add_header(frame, hlen);
+        lwip_pbuf_ref(p);
+        lwip_pbuf_cat(frame, p);
+    }
+    
+    nic_offload_get_caps(&caps);
+    if (frame->next && !caps.sg) {
+        // The NIC cannot gather: flatten the frame into one pool pbuf
+        struct lwip_pbuf *flat = lwip_pbuf_alloc(frame->tot_len, PBUF_POOL, false);
+    
+        if (!flat || flat->next) {
+            if (flat) {
+                lwip_pbuf_free(flat);
+            }
+            ret = -ENOMEM;
+            goto out;
+        }
+        lwip_pbuf_copy_partial(frame, flat->payload, frame->tot_len, 0);
+        if (frame == p) {
+            lwip_pbuf_remove_header(p, hlen);
+        }
+        lwip_pbuf_free(frame);
+        frame = flat;
+    }
+    lwip_build_headers(conn, frame, caps.tx_csum);
     
-    atomic_add(len, &conn->tx_bytes);
-    atomic_add(len, &global_lwip_stack.total_tx_bytes);
+    ret = lwip_resolve(frame, conn->remote_ip);
+    if (ret) {
+        goto out;               // queued until the next hop answers, or unreachable
+    }
+    
+    pr_debug("lwIP connection %d sending %u bytes\n", conn_id, payload_len);
+    
+    if (global_lwip_stack.linkoutput) {
+        ret = global_lwip_stack.linkoutput(frame);
+    }
+    
+out:
+    // As in lwIP, the caller gets its pbuf back as passed in; the driver's
+    // descriptors already point at the frame. A pbuf must not be written
+    // while the driver still holds a reference to it.
+    if (frame == p) {
+        lwip_pbuf_remove_header(p, hlen);
+    }
+    lwip_pbuf_free(frame);
+    if (ret < 0) {
+        return ret;
+    }
+    
+    atomic_add(payload_len, &conn->tx_bytes);
+    atomic_add(payload_len, &global_lwip_stack.total_tx_bytes);
     
     return 0;
 }
 
 /**
- * lwIP packet reception
+ * lwIP packet transmission from caller memory: one copy into pool pbufs,
+ * so the caller may reuse data on return. Zero-copy callers use
+ * lwip_send_pbuf() with a PBUF_REF or PBUF_ROM pbuf instead.
  */
-static int lwip_receive_packet(int conn_id, u8 *buffer, size_t max_len)
+static int lwip_send_packet(int conn_id, const u8 *data, size_t len)
 {
-    size_t received = 0;
+    struct lwip_pbuf *p;
+    int ret;
     
-    if (conn_id >= LWIP_MAX_CONNECTIONS || !buffer || max_len == 0) {
+    if (conn_id < 0 || conn_id >= LWIP_MAX_CONNECTIONS || !data || len == 0 ||
+        len > LWIP_BUFFER_SIZE) {
+        return -EINVAL;
+    }
+    
+    p = lwip_pbuf_alloc(len, PBUF_POOL, true);
+    if (!p) {
+        return -ENOMEM;
+    }
+    lwip_pbuf_take(p, data, len);
+    
+    ret = lwip_send_pbuf(conn_id, p);
+    lwip_pbuf_free(p);
+    
+    return ret;
+}
+
+/**
+ * Driver RX: a pool pbuf sized for a whole frame, for the driver's DMA
+ * descriptor ring. The frame lands at payload; report it with
+ * lwip_netif_input().
+ */
+static struct lwip_pbuf *lwip_netif_rx_alloc(void)
+{
+    struct lwip_pbuf *p = lwip_pbuf_take_desc(&global_lwip_stack.pool_free);
+    
+    if (!p) {
+        return NULL;
+    }
+    p->payload = p->buf + LWIP_ETH_PAD;
+    p->len = LWIP_PBUF_POOL_BUFSIZE - LWIP_ETH_PAD;
+    p->tot_len = p->len;
+    
+    return p;
+}
+
+/**
+ * A received ARP frame: learn the sender, and answer requests for our
+ * address. The frame stays the caller's.
+ */
+static void lwip_arp_input(const struct lwip_pbuf *p, u16 frame_len)
+{
+    const struct ethhdr *eth = (const struct ethhdr *)p->payload;
+    struct lwip_pbuf *reply;
+    __be32 from = 0;
+    
+    if (!global_lwip_stack.ip_addr) {
+        return;
+    }
+    if (nd_arp_input(&global_lwip_stack.neigh, p->payload, frame_len,
+                     global_lwip_stack.ip_addr, &from) != ARPOP_REQUEST || !from) {
+        return;
+    }
+    if (!global_lwip_stack.linkoutput) {
+        return;
+    }
+    
+    reply = lwip_pbuf_alloc(ND_ARP_FRAME_LEN, PBUF_POOL, false);
+    if (!reply) {
+        return;
+    }
+    nd_build_arp(reply->payload, ARPOP_REPLY, global_lwip_stack.hwaddr,
+                 global_lwip_stack.ip_addr, eth->h_source, from);
+    global_lwip_stack.linkoutput(reply);
+    lwip_pbuf_free(reply);
+}
+
+/**
+ * Driver RX completion, IRQ safe: demultiplex a received frame to its
+ * connection and queue it there, headers stripped in place. Consumes
+ * the driver's reference.
+ */
+static int lwip_netif_input(struct lwip_pbuf *p, u16 frame_len)
+{
+    struct lwip_connection *conn;
+    struct iphdr *iph;
+    u16 sport, dport, hlen;
+    bool hw_ok, csum_ok;
+    unsigned long flags;
+    int i, ret = -ENOENT;
+    
+    if (!p || frame_len > p->len || frame_len < ETH_HLEN + sizeof(*iph)) {
+        ret = -EINVAL;
+        goto drop;
+    }
+    p->len = frame_len;
+    p->tot_len = frame_len;
+    
+    if (((struct ethhdr *)p->payload)->h_proto == htons(ETH_P_ARP)) {
+        lwip_arp_input(p, frame_len);
+        lwip_pbuf_free(p);
+        return 0;
+    }
+    
+    iph = (struct iphdr *)(p->payload + ETH_HLEN);
+    hlen = ETH_HLEN + iph->ihl * 4;
+    if (iph->protocol == IPPROTO_TCP) {
+        struct tcphdr *th = (struct tcphdr *)(p->payload + hlen);
+    
+        if (hlen + sizeof(*th) > frame_len) {
+            ret = -EINVAL;
+            goto drop;
+        }
+        sport = ntohs(th->source);
+        dport = ntohs(th->dest);
+        hlen += th->doff * 4;
+    } else if (iph->protocol == IPPROTO_UDP) {
+        struct udphdr *uh = (struct udphdr *)(p->payload + hlen);
+    
+        sport = ntohs(uh->source);
+        dport = ntohs(uh->dest);
+        hlen += sizeof(*uh);
+    } else {
+        goto drop;
+    }
+    if (hlen > frame_len) {
+        ret = -EINVAL;
+        goto drop;
+    }
+    
+    // The driver sets CSUM_OK when the NIC checked the frame (RX checksum
+    // offload); anything else is checked here before it is delivered
+    hw_ok = p->flags & LWIP_PBUF_FLAG_CSUM_OK;
+    csum_ok = hw_ok || lwip_verify_csum(p, iph, ETH_HLEN + iph->ihl * 4);
+    nic_offload_count_rx_csum(hw_ok, csum_ok);
+    if (!csum_ok) {
+        ret = -EBADMSG;
+        goto drop;
+    }
+    
+    for (i = 0; i < LWIP_MAX_CONNECTIONS; i++) {
+        conn = &global_lwip_stack.connections[i];
+        if (conn->connected && conn->protocol == iph->protocol &&
+            conn->remote_ip == iph->saddr && conn->remote_port == sport &&
+            (!conn->local_port || conn->local_port == dport)) {
+            break;
+        }
+    }
+    if (i >= LWIP_MAX_CONNECTIONS) {
+        goto drop;
+    }
+    
+    lwip_pbuf_remove_header(p, hlen);
+    
+    spin_lock_irqsave(&global_lwip_stack.lock, flags);
+    if (conn->rx_count >= LWIP_RX_QUEUE_LEN) {
+        spin_unlock_irqrestore(&global_lwip_stack.lock, flags);
+        atomic_inc(&conn->rx_dropped);
+        ret = -ENOBUFS;
+        goto drop;
+    }
+    conn->rx_queue[(conn->rx_head + conn->rx_count) % LWIP_RX_QUEUE_LEN] = p;
+    conn->rx_count++;
+    spin_unlock_irqrestore(&global_lwip_stack.lock, flags);
+    
+    return 0;
+    
+drop:
+    if (p) {
+        lwip_pbuf_free(p);
+    }
+    return ret;
+}
+
+/**
+ * lwIP packet reception, zero copy: hand the caller the next received
+ * chain as it was DMA'd. The caller owns the reference and frees it.
+ */
+static int lwip_receive_pbuf(int conn_id, struct lwip_pbuf **out)
+{
+    struct lwip_pbuf *p = NULL;
+    unsigned long flags;
+    
+    if (conn_id < 0 || conn_id >= LWIP_MAX_CONNECTIONS || !out) {
         return -EINVAL;
     }
     
@@ -168,13 +940,50 @@ static int lwip_receive_packet(int conn_id, u8 *buffer, size_t max_len)
         return -ENOTCONN;
     }
     
-    // Simulate packet reception
-    received = min(max_len, (size_t)conn->mss);
+    spin_lock_irqsave(&global_lwip_stack.lock, flags);
+    if (conn->rx_count) {
+        p = conn->rx_queue[conn->rx_head];
+        conn->rx_head = (conn->rx_head + 1) % LWIP_RX_QUEUE_LEN;
+        conn->rx_count--;
+    }
+    spin_unlock_irqrestore(&global_lwip_stack.lock, flags);
+    
+    if (!p) {
+        return -EAGAIN;
+    }
+    
+    atomic_add(p->tot_len, &conn->rx_bytes);
+    atomic_add(p->tot_len, &global_lwip_stack.total_rx_bytes);
+    
+    pr_debug("lwIP connection %d received %u bytes\n", conn_id, p->tot_len);
+    
+    *out = p;
+    return p->tot_len;
+}
+
+/**
+ * lwIP packet reception into caller memory: copies out of the next
+ * received chain. Returns 0 when nothing is queued.
+ */
+static int lwip_receive_packet(int conn_id, u8 *buffer, size_t max_len)
+{
+    struct lwip_pbuf *p;
+    int received;
+    
+    if (conn_id < 0 || conn_id >= LWIP_MAX_CONNECTIONS || !buffer || max_len == 0) {
+        return -EINVAL;
+    }
     
-    atomic_add(received, &conn->rx_bytes);
-    atomic_add(received, &global_lwip_stack.total_rx_bytes);
+    received = lwip_receive_pbuf(conn_id, &p);
+    if (received == -EAGAIN) {
+        return 0;
+    }
+    if (received < 0) {
+        return received;
+    }
     
-    pr_debug("lwIP connection %d received %zu bytes\n", conn_id, received);
+    received = lwip_pbuf_copy_partial(p, buffer, min_t(size_t, max_len, p->tot_len), 0);
+    lwip_pbuf_free(p);
     
     return received;
 }
@@ -270,6 +1079,22 @@ static int __init lwip_stack_init_module(void)
  */
 static void __exit lwip_stack_cleanup_module(void)
 {
+    struct lwip_connection *conn;
+    int i;
+    
+    // Frames still waiting on a neighbour are dropped with it
+    nd_table_destroy(&global_lwip_stack.neigh);
+    
+    // Drop frames nobody collected
+    for (i = 0; i < LWIP_MAX_CONNECTIONS; i++) {
+        conn = &global_lwip_stack.connections[i];
+        while (conn->rx_count) {
+            lwip_pbuf_free(conn->rx_queue[conn->rx_head]);
+            conn->rx_head = (conn->rx_head + 1) % LWIP_RX_QUEUE_LEN;
+            conn->rx_count--;
+        }
+    }
+    
     pr_info("lwIP Stack unloaded\n");
 }
 
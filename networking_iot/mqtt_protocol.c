@@ -16,6 +16,8 @@
 #include <linux/timer.h>
 #include <linux/workqueue.h>
 
+#include "../networking_stacks/timer_wheel.h"
+
 #define MQTT_VERSION "3.1.1"
 #define MQTT_MAX_CLIENTS 8
 #define MQTT_MAX_TOPICS 64
@@ -48,7 +50,7 @@ struct mqtt_client {
     enum mqtt_qos default_qos;
     atomic_t message_count;
     u32 error_count;
-    struct timer_list keepalive_timer;
+    struct tw_timer keepalive_timer;
     struct work_struct message_work;
 };
 
@@ -58,10 +60,13 @@ struct mqtt_broker {
     atomic_t total_messages;
     u32 broker_errors;
     bool broker_active;
+    struct timer_wheel keepalive_wheel;    // one kernel timer for every client
 };
 
 static struct mqtt_broker global_mqtt_broker;
 
+static void mqtt_keepalive_timeout(struct tw_timer *t);
+
 /**
  * Initialize MQTT broker
  */
@@ -75,6 +80,7 @@ static int mqtt_broker_init(void)
     atomic_set(&global_mqtt_broker.total_messages, 0);
     global_mqtt_broker.broker_errors = 0;
     global_mqtt_broker.broker_active = true;
+    timer_wheel_init(&global_mqtt_broker.keepalive_wheel, -1);
     
     // Initialize clients
     for (i = 0; i < MQTT_MAX_CLIENTS; i++) {
@@ -87,6 +93,7 @@ static int mqtt_broker_init(void)
         global_mqtt_broker.clients[i].default_qos = MQTT_QOS_0;
         atomic_set(&global_mqtt_broker.clients[i].message_count, 0);
         global_mqtt_broker.clients[i].error_count = 0;
+        tw_timer_init(&global_mqtt_broker.clients[i].keepalive_timer, mqtt_keepalive_timeout);
     }
     
     pr_info("MQTT broker initialized\n");
@@ -111,9 +118,9 @@ static int mqtt_client_connect(int client_id, const char *broker_host, u16 broke
     strcpy(client->client_name, client_name);
     client->connected = true;
     
-    // Initialize keepalive timer
-    timer_setup(&client->keepalive_timer, mqtt_keepalive_timeout, 0);
-    mod_timer(&client->keepalive_timer, jiffies + msecs_to_jiffies(client->keepalive * 1000));
+    // Arm keepalive on the shared wheel
+    timer_wheel_mod(&global_mqtt_broker.keepalive_wheel, &client->keepalive_timer,
+                    jiffies + msecs_to_jiffies(client->keepalive * 1000));
     
     global_mqtt_broker.client_count++;
     
@@ -126,9 +133,14 @@ static int mqtt_client_connect(int client_id, const char *broker_host, u16 broke
 /**
  * MQTT keepalive timeout
  */
-static void mqtt_keepalive_timeout(struct timer_list *t)
+static void mqtt_keepalive_timeout(struct tw_timer *t)
 {
-    struct mqtt_client *client = from_timer(client, t, keepalive_timer);
+    struct mqtt_client *client = container_of(t, struct mqtt_client, keepalive_timer);
+    
+    // Raced with mqtt_disconnect(), which does not wait for us
+    if (!client->connected) {
+        return;
+    }
     
     pr_debug("MQTT client %d keepalive timeout\n", client->client_id);
     
@@ -136,7 +148,8 @@ static void mqtt_keepalive_timeout(struct timer_list *t)
     pr_debug("MQTT client %d sending keepalive ping\n", client->client_id);
     
     // Reschedule timer
-    mod_timer(&client->keepalive_timer, jiffies + msecs_to_jiffies(client->keepalive * 1000));
+    timer_wheel_mod(&global_mqtt_broker.keepalive_wheel, &client->keepalive_timer,
+                    jiffies + msecs_to_jiffies(client->keepalive * 1000));
 }
 
 /**
@@ -235,9 +248,9 @@ static int mqtt_disconnect(int client_id)
     }
     
     // Cancel keepalive timer
-    del_timer_sync(&client->keepalive_timer);
-    
     client->connected = false;
+    timer_wheel_del(&global_mqtt_broker.keepalive_wheel, &client->keepalive_timer);
+    
     global_mqtt_broker.client_count--;
     
     pr_info("MQTT client %d disconnected\n", client_id);
@@ -295,6 +308,7 @@ static void __exit mqtt_protocol_cleanup_module(void)
             mqtt_disconnect(i);
         }
     }
+    timer_wheel_destroy(&global_mqtt_broker.keepalive_wheel);
     
     pr_info("MQTT Protocol unloaded\n");
 }
@@ -3,22 +3,336 @@
  * Author: jk1806
  * Created: 2024-09-18
  * 
- * Implementation for embedded systems
+ * Negotiates checksum offload, TSO/GSO and LRO/GRO with the gateway's
+ * NIC and gives the TCP and lwIP stacks one way to use them: transmit
+ * super-packets marked CHECKSUM_PARTIAL with gso_size set, receive
+ * coalesced packets with the NIC's checksum verdict. Where the NIC
+ * lacks a feature the kernel core falls back to software (GSO
+ * segmentation, skb_checksum_help()), so callers never branch on it.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/netdevice.h>
+#include <linux/rtnetlink.h>
+#include <linux/inetdevice.h>
+#include <linux/skbuff.h>
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <linux/percpu.h>
+#include <linux/seqlock.h>
+#include <net/ip.h>
+#include <net/checksum.h>
 
-#define MODULE_VERSION "1.0.0"
+#include "nic_offloads.h"
+
+#define NIC_OFFLOADS_VERSION "1.1.0"
+
+#define NIC_WANTED_FEATURES (NETIF_F_SG | NETIF_F_IP_CSUM | NETIF_F_HW_CSUM | NETIF_F_RXCSUM | \
+                             NETIF_F_TSO | NETIF_F_GSO_UDP_L4 | NETIF_F_GRO | NETIF_F_GRO_HW | \
+                             NETIF_F_LRO)
+
+static char *ifname = "eth0";
+module_param(ifname, charp, 0444);
+MODULE_PARM_DESC(ifname, "Interface whose offloads are negotiated");
+
+static struct net_device __rcu *nic_dev;
+static struct nic_offload_caps nic_caps __read_mostly;
+static DEFINE_SEQLOCK(nic_caps_lock);
+
+// Per CPU: every core bumps these on every packet
+static DEFINE_PER_CPU(struct nic_offload_stats, nic_offload_pcpu_stats);
+
+#define NIC_STAT_ADD(field, n) this_cpu_add(nic_offload_pcpu_stats.field, n)
+#define NIC_STAT_INC(field) NIC_STAT_ADD(field, 1)
+
+/**
+ * Snapshot the features the device ended up with; called under RTNL
+ */
+static void nic_offload_refresh_caps(struct net_device *dev)
+{
+    netdev_features_t f = dev ? dev->features : 0;
+    
+    write_seqlock_bh(&nic_caps_lock);
+    nic_caps.tx_csum = !!(f & (NETIF_F_IP_CSUM | NETIF_F_HW_CSUM));
+    nic_caps.rx_csum = !!(f & NETIF_F_RXCSUM);
+    nic_caps.sg = !!(f & NETIF_F_SG);
+    nic_caps.tso = !!(f & NETIF_F_TSO);
+    nic_caps.gro = !!(f & NETIF_F_GRO);
+    nic_caps.gro_hw = !!(f & NETIF_F_GRO_HW);
+    nic_caps.lro = !!(f & NETIF_F_LRO);
+    nic_caps.gso_max_size = dev ? READ_ONCE(dev->gso_max_size) : GSO_LEGACY_MAX_SIZE;
+    nic_caps.gso_max_segs = dev ? READ_ONCE(dev->gso_max_segs) : GSO_MAX_SEGS;
+    write_sequnlock_bh(&nic_caps_lock);
+    
+    if (dev) {
+        pr_info("nic_offloads: %s csum tx=%d rx=%d sg=%d tso=%d gro=%d gro_hw=%d lro=%d gso_max=%u\n",
+                dev->name, nic_caps.tx_csum, nic_caps.rx_csum, nic_caps.sg, nic_caps.tso,
+                nic_caps.gro, nic_caps.gro_hw, nic_caps.lro, nic_caps.gso_max_size);
+    }
+}
+
+/**
+ * Ask for every offload we use that the hardware has; called under RTNL
+ */
+static void nic_offload_negotiate(struct net_device *dev)
+{
+    netdev_features_t want = NIC_WANTED_FEATURES;
+    
+    // LRO merges segments irreversibly, which breaks forwarding, and the
+    // kernel drops it while the host routes. The gateway routes, so rely
+    // on GRO (hardware GRO where offered) there instead.
+    if (IPV4_DEVCONF_ALL(dev_net(dev), FORWARDING)) {
+        want &= ~NETIF_F_LRO;
+    }
+    
+    dev->wanted_features |= want & dev->hw_features;
+    netdev_update_features(dev);
+    nic_offload_refresh_caps(dev);
+}
+
+void nic_offload_get_caps(struct nic_offload_caps *caps)
+{
+    unsigned int seq;
+    
+    do {
+        seq = read_seqbegin(&nic_caps_lock);
+        *caps = nic_caps;
+    } while (read_seqretry(&nic_caps_lock, seq));
+}
+EXPORT_SYMBOL_GPL(nic_offload_get_caps);
+
+void nic_offload_get_stats(struct nic_offload_stats *stats)
+{
+    int cpu;
+    
+    memset(stats, 0, sizeof(*stats));
+    for_each_possible_cpu(cpu) {
+        const struct nic_offload_stats *s = per_cpu_ptr(&nic_offload_pcpu_stats, cpu);
+    
+        stats->tx_csum_hw += s->tx_csum_hw;
+        stats->tx_csum_sw += s->tx_csum_sw;
+        stats->tx_tso += s->tx_tso;
+        stats->tx_gso_sw += s->tx_gso_sw;
+        stats->tx_segs += s->tx_segs;
+        stats->rx_csum_hw += s->rx_csum_hw;
+        stats->rx_csum_sw += s->rx_csum_sw;
+        stats->rx_csum_errors += s->rx_csum_errors;
+        stats->rx_coalesced += s->rx_coalesced;
+        stats->rx_segs += s->rx_segs;
+    }
+}
+EXPORT_SYMBOL_GPL(nic_offload_get_stats);
+
+/**
+ * Largest super-packet a stack should build. GSO is always there in
+ * software, so this is the device's limit even without TSO: segmenting
+ * once below the stack is still far cheaper than a pass per segment.
+ */
+unsigned int nic_offload_tx_max_bytes(void)
+{
+    return READ_ONCE(nic_caps.gso_max_size);
+}
+EXPORT_SYMBOL_GPL(nic_offload_tx_max_bytes);
+
+// For stacks that checksum outside an skb (lwIP pbuf chains)
+void nic_offload_count_tx_csum(bool hw)
+{
+    if (hw) {
+        NIC_STAT_INC(tx_csum_hw);
+    } else {
+        NIC_STAT_INC(tx_csum_sw);
+    }
+}
+EXPORT_SYMBOL_GPL(nic_offload_count_tx_csum);
+
+void nic_offload_count_rx_csum(bool hw, bool ok)
+{
+    if (hw) {
+        NIC_STAT_INC(rx_csum_hw);
+    } else {
+        NIC_STAT_INC(rx_csum_sw);
+    }
+    if (!ok) {
+        NIC_STAT_INC(rx_csum_errors);
+    }
+}
+EXPORT_SYMBOL_GPL(nic_offload_count_rx_csum);
+
+/**
+ * Transmit an IPv4 TCP or UDP packet with network and transport headers
+ * set. The L4 checksum is left CHECKSUM_PARTIAL from the pseudo-header
+ * sum; a payload over mss is marked for segmentation. Consumes skb.
+ */
+int nic_offload_xmit(struct sk_buff *skb, unsigned int mss)
+{
+    struct net_device *dev;
+    struct iphdr *iph = ip_hdr(skb);
+    bool tcp = iph->protocol == IPPROTO_TCP;
+    unsigned int l4len, thlen, payload;
+    netdev_features_t features;
+    __sum16 *check;
+    int ret;
+    
+    if (!tcp && iph->protocol != IPPROTO_UDP) {
+        kfree_skb(skb);
+        return -EPROTONOSUPPORT;
+    }
+    
+    rcu_read_lock_bh();
+    dev = rcu_dereference_bh(nic_dev);
+    if (!dev) {
+        rcu_read_unlock_bh();
+        kfree_skb(skb);
+        return -ENODEV;
+    }
+    skb->dev = dev;
+    skb->protocol = htons(ETH_P_IP);
+    features = dev->features;
+    
+    l4len = skb->len - skb_transport_offset(skb);
+    thlen = tcp ? tcp_hdrlen(skb) : sizeof(struct udphdr);
+    payload = l4len - thlen;
+    
+    // Pseudo-header sum now; the NIC, or skb_checksum_help() in
+    // validate_xmit_skb(), folds in the rest
+    check = tcp ? &tcp_hdr(skb)->check : &udp_hdr(skb)->check;
+    *check = ~csum_tcpudp_magic(iph->saddr, iph->daddr, l4len, iph->protocol, 0);
+    skb->ip_summed = CHECKSUM_PARTIAL;
+    skb->csum_start = skb_transport_header(skb) - skb->head;
+    skb->csum_offset = (u8 *)check - skb_transport_header(skb);
+    if (features & (NETIF_F_IP_CSUM | NETIF_F_HW_CSUM)) {
+        NIC_STAT_INC(tx_csum_hw);
+    } else {
+        NIC_STAT_INC(tx_csum_sw);
+    }
+    
+    if (mss && payload > mss) {
+        struct skb_shared_info *shinfo = skb_shinfo(skb);
+    
+        shinfo->gso_size = mss;
+        shinfo->gso_type = tcp ? SKB_GSO_TCPV4 : SKB_GSO_UDP_L4;
+        shinfo->gso_segs = DIV_ROUND_UP(payload, mss);
+    
+        // Without the feature, the core segments in validate_xmit_skb()
+        if (features & (tcp ? NETIF_F_TSO : NETIF_F_GSO_UDP_L4)) {
+            NIC_STAT_INC(tx_tso);
+        } else {
+            NIC_STAT_INC(tx_gso_sw);
+        }
+        NIC_STAT_ADD(tx_segs, shinfo->gso_segs);
+    } else {
+        NIC_STAT_INC(tx_segs);
+    }
+    
+    ret = dev_queue_xmit(skb);
+    rcu_read_unlock_bh();
+    
+    return net_xmit_errno(ret);
+}
+EXPORT_SYMBOL_GPL(nic_offload_xmit);
+
+/**
+ * Receive: accept the NIC's checksum verdict, otherwise verify in
+ * software. Also counts GRO/LRO coalescing, one packet carrying
+ * gso_segs wire segments.
+ */
+bool nic_offload_rx_csum_ok(struct sk_buff *skb)
+{
+    struct iphdr *iph = ip_hdr(skb);
+    bool hw, ok;
+    
+    if (skb_is_gso(skb)) {
+        NIC_STAT_INC(rx_coalesced);
+        NIC_STAT_ADD(rx_segs, skb_shinfo(skb)->gso_segs);
+    } else {
+        NIC_STAT_INC(rx_segs);
+    }
+    
+    if (skb_csum_unnecessary(skb)) {
+        NIC_STAT_INC(rx_csum_hw);
+        return true;
+    }
+    
+    // CHECKSUM_COMPLETE: the NIC summed the packet, we add the pseudo
+    // header. CHECKSUM_NONE: sum it all here.
+    hw = skb->ip_summed == CHECKSUM_COMPLETE;
+    if (iph->protocol == IPPROTO_UDP && !udp_hdr(skb)->check) {
+        ok = true;              // IPv4 UDP without a checksum
+    } else {
+        ok = !skb_checksum_validate(skb, iph->protocol, inet_compute_pseudo);
+    }
+    nic_offload_count_rx_csum(hw, ok);
+    
+    return ok;
+}
+EXPORT_SYMBOL_GPL(nic_offload_rx_csum_ok);
+
+/**
+ * Attach to ifname when it registers (registering the notifier replays
+ * existing devices), follow ethtool changes, let go when it goes away
+ */
+static int nic_offload_netdev_event(struct notifier_block *nb, unsigned long event, void *ptr)
+{
+    struct net_device *dev = netdev_notifier_info_to_dev(ptr);
+    
+    if (event == NETDEV_REGISTER && !rtnl_dereference(nic_dev) && !strcmp(dev->name, ifname)) {
+        dev_hold(dev);
+        nic_offload_negotiate(dev);
+        rcu_assign_pointer(nic_dev, dev);
+        return NOTIFY_DONE;
+    }
+    if (dev != rtnl_dereference(nic_dev)) {
+        return NOTIFY_DONE;
+    }
+    
+    switch (event) {
+    case NETDEV_FEAT_CHANGE:
+        nic_offload_refresh_caps(dev);
+        break;
+    case NETDEV_UNREGISTER:
+        RCU_INIT_POINTER(nic_dev, NULL);
+        synchronize_net();
+        nic_offload_refresh_caps(NULL);
+        dev_put(dev);
+        pr_info("nic_offloads: %s unregistered\n", dev->name);
+        break;
+    }
+    
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block nic_offload_notifier = {
+    .notifier_call = nic_offload_netdev_event,
+};
 
 static int __init nic_offloads_init(void)
 {
-    pr_info("nic_offloads: Initializing\n");
+    int ret;
+    
+    pr_info("nic_offloads: Initializing for %s\n", ifname);
+    
+    // Software-only limits until the device shows up
+    nic_offload_refresh_caps(NULL);
+    
+    ret = register_netdevice_notifier(&nic_offload_notifier);
+    if (ret) {
+        pr_err("nic_offloads: notifier registration failed: %d\n", ret);
+        return ret;
+    }
+    if (!rcu_access_pointer(nic_dev)) {
+        pr_info("nic_offloads: %s not present yet\n", ifname);
+    }
+    
     return 0;
 }
 
 static void __exit nic_offloads_exit(void)
 {
+    // Replays NETDEV_UNREGISTER, which releases the device
+    unregister_netdevice_notifier(&nic_offload_notifier);
+    
     pr_info("nic_offloads: Exiting\n");
 }
 
@@ -28,4 +342,4 @@ module_exit(nic_offloads_exit);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("jk1806");
 MODULE_DESCRIPTION("NIC offloading");
-MODULE_VERSION(MODULE_VERSION);
+MODULE_VERSION(NIC_OFFLOADS_VERSION);
@@ -0,0 +1,49 @@
+/**
+ * NIC offloading
+ *
+ * Checksum, TSO/GSO and LRO/GRO negotiated once per device by
+ * nic_offloads.c and used by the TCP and lwIP stacks. Every offload
+ * has a software fallback, so callers always mark packets the same way
+ * and the counters show which path did the work.
+ */
+
+#ifndef NIC_OFFLOADS_H
+#define NIC_OFFLOADS_H
+
+#include <linux/types.h>
+#include <linux/skbuff.h>
+
+struct nic_offload_caps {
+    bool tx_csum;               // NETIF_F_IP_CSUM / NETIF_F_HW_CSUM
+    bool rx_csum;               // NETIF_F_RXCSUM
+    bool sg;                    // scatter-gather, needed for TSO and zero-copy chains
+    bool tso;                   // NETIF_F_TSO, else GSO segments in software
+    bool gro;
+    bool gro_hw;
+    bool lro;                   // only while the host does not forward
+    unsigned int gso_max_size;
+    u16 gso_max_segs;
+};
+
+struct nic_offload_stats {
+    u64 tx_csum_hw;
+    u64 tx_csum_sw;
+    u64 tx_tso;                 // super-packets the NIC segmented
+    u64 tx_gso_sw;              // super-packets segmented by the kernel
+    u64 tx_segs;                // wire segments either way
+    u64 rx_csum_hw;
+    u64 rx_csum_sw;
+    u64 rx_csum_errors;
+    u64 rx_coalesced;           // GRO/LRO packets
+    u64 rx_segs;                // wire segments they carried
+};
+
+void nic_offload_get_caps(struct nic_offload_caps *caps);
+void nic_offload_get_stats(struct nic_offload_stats *stats);
+unsigned int nic_offload_tx_max_bytes(void);
+int nic_offload_xmit(struct sk_buff *skb, unsigned int mss);
+bool nic_offload_rx_csum_ok(struct sk_buff *skb);
+void nic_offload_count_tx_csum(bool hw);
+void nic_offload_count_rx_csum(bool hw, bool ok);
+
+#endif /* NIC_OFFLOADS_H */
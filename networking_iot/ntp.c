@@ -3,22 +3,371 @@
  * Author: jk1806
  * Created: 2025-03-05
  * 
- * Implementation for embedded systems
+ * SNTPv4 client (RFC 5905 client mode) disciplining a clock page: UTC
+ * as CLOCK_MONOTONIC_RAW plus a base offset and a frequency correction,
+ * published under a sequence count so readers never lock and never
+ * enter the kernel. Offsets under NTP_STEP_THRESHOLD_NS are slewed out
+ * over the next poll interval while the frequency error is integrated;
+ * larger ones step the clock. Samples whose round trip is well above
+ * the recent best are dropped as queued somewhere and not trusted.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/net.h>
+#include <linux/in.h>
+#include <linux/inet.h>
+#include <linux/mm.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/random.h>
+#include <linux/timekeeping.h>
+#include <linux/workqueue.h>
+#include <linux/spinlock.h>
+#include <net/sock.h>
+#include <asm/unaligned.h>
 
-#define MODULE_VERSION "1.0.0"
+#include "ntp_clock.h"
+
+#define NTP_VERSION "1.1.0"
+
+#define NTP_PORT 123
+#define NTP_PACKET_SIZE 48
+#define NTP_UNIX_EPOCH_DELTA 2208988800ULL      // 1900 to 1970, in seconds
+#define NTP_MODE_CLIENT 3
+#define NTP_MODE_SERVER 4
+#define NTP_LI_ALARM 3                          // server not synchronized
+#define NTP_STEP_THRESHOLD_NS (128 * NSEC_PER_MSEC)
+#define NTP_MAX_FREQ ((500LL << 32) / 1000000)  // 500 ppm
+#define NTP_FREQ_GAIN 4                         // integral term: 1/4 of the error per poll
+#define NTP_FILTER_SAMPLES 8
+#define NTP_RECV_TRIES 4
+
+static char *server = "";
+module_param(server, charp, 0444);
+MODULE_PARM_DESC(server, "NTP server, dotted IPv4; empty leaves the clock on CLOCK_REALTIME");
+
+static unsigned int poll_sec = 64;
+module_param(poll_sec, uint, 0444);
+MODULE_PARM_DESC(poll_sec, "Seconds between exchanges");
+
+// Round trips of the last few exchanges, for the delay filter
+static s64 ntp_delays[NTP_FILTER_SAMPLES];
+static unsigned int ntp_delay_next;
+
+static struct ntp_clock_page *ntp_page;
+static DEFINE_SPINLOCK(ntp_page_lock);
+static s64 ntp_freq_est;                        // long-term frequency, without the slew
+static struct socket *ntp_sock;
+static struct delayed_work ntp_work;
+
+struct ntp_sample {
+    s64 offset;
+    s64 delay;
+    u64 raw;                                    // when the answer arrived
+};
+
+static s64 ntp_clock_at(const struct ntp_clock_page *p, u64 raw)
+{
+    u64 d = raw - p->base_raw_ns;
+    
+    return p->base_utc_ns + (s64)d + ntp_clock_scale(d, p->freq);
+}
+
+/**
+ * Disciplined UTC in nanoseconds; CLOCK_REALTIME until the first sync.
+ * Lock-free, callable from any context but NMI.
+ */
+s64 ntp_clock_now_ns(void)
+{
+    const struct ntp_clock_page *p = ntp_page;
+    u32 seq;
+    s64 now;
+    
+    for (;;) {
+        seq = READ_ONCE(p->seq);
+        if (!(seq & 1)) {
+            smp_rmb();
+            if (!(p->flags & NTP_CLOCK_SYNCED)) {
+                return ktime_get_real_ns();
+            }
+            now = ntp_clock_at(p, ktime_get_raw_ns());
+            smp_rmb();
+            if (READ_ONCE(p->seq) == seq) {
+                return now;
+            }
+        }
+        cpu_relax();
+    }
+}
+EXPORT_SYMBOL_GPL(ntp_clock_now_ns);
+
+bool ntp_clock_synced(void)
+{
+    return READ_ONCE(ntp_page->flags) & NTP_CLOCK_SYNCED;
+}
+EXPORT_SYMBOL_GPL(ntp_clock_synced);
+
+// Only the poll work writes, the lock covers module init and exit too
+static void ntp_page_update(u64 raw, s64 utc, s64 freq, u64 error_ns, bool synced)
+{
+    struct ntp_clock_page *p = ntp_page;
+    
+    spin_lock_bh(&ntp_page_lock);
+    WRITE_ONCE(p->seq, p->seq + 1);
+    smp_wmb();
+    p->base_raw_ns = raw;
+    p->base_utc_ns = utc;
+    p->freq = freq;
+    if (synced) {
+        p->error_ns = error_ns;
+        p->last_sync_raw_ns = raw;
+        p->flags |= NTP_CLOCK_SYNCED;
+    }
+    smp_wmb();
+    WRITE_ONCE(p->seq, p->seq + 1);
+    spin_unlock_bh(&ntp_page_lock);
+}
+
+// 64-bit NTP timestamp to Unix nanoseconds; era 1 starts in 2036
+static s64 ntp_ts_to_ns(const u8 *ts)
+{
+    u64 secs = get_unaligned_be32(ts);
+    u64 frac = get_unaligned_be32(ts + 4);
+    
+    if (secs < 0x80000000u) {
+        secs += 1ULL << 32;
+    }
+    return (s64)(secs - NTP_UNIX_EPOCH_DELTA) * NSEC_PER_SEC + (s64)((frac * NSEC_PER_SEC) >> 32);
+}
+
+/*
+ * One client/server exchange. The transmit timestamp carries a random
+ * cookie instead of our time (RFC 5905 only needs it echoed back as the
+ * origin), so a reply is matched and forged ones are refused without
+ * exposing the local clock; T1 and T4 are taken locally on the raw clock.
+ */
+static int ntp_exchange(struct ntp_sample *s)
+{
+    u8 pkt[NTP_PACKET_SIZE];
+    struct kvec iov = { .iov_base = pkt, .iov_len = sizeof(pkt) };
+    struct msghdr msg = { .msg_flags = MSG_NOSIGNAL };
+    u64 cookie, raw1, raw4;
+    s64 t1, t2, t3, t4;
+    int tries, ret;
+    
+    memset(pkt, 0, sizeof(pkt));
+    pkt[0] = (4 << 3) | NTP_MODE_CLIENT;        // LI 0, version 4
+    get_random_bytes(&cookie, sizeof(cookie));
+    memcpy(pkt + 40, &cookie, sizeof(cookie));
+    
+    raw1 = ktime_get_raw_ns();
+    ret = kernel_sendmsg(ntp_sock, &msg, &iov, 1, sizeof(pkt));
+    if (ret < 0) {
+        return ret;
+    }
+    
+    for (tries = 0; ; tries++) {
+        if (tries == NTP_RECV_TRIES) {
+            return -EPROTO;
+        }
+        ret = kernel_recvmsg(ntp_sock, &msg, &iov, 1, sizeof(pkt), 0);
+        raw4 = ktime_get_raw_ns();
+        if (ret < 0) {
+            return ret;                         // -EAGAIN after sk_rcvtimeo
+        }
+        // Stale answers to an earlier query do not carry this cookie
+        if (ret == NTP_PACKET_SIZE && !memcmp(pkt + 24, &cookie, sizeof(cookie))) {
+            break;
+        }
+    }
+    
+    if ((pkt[0] & 7) != NTP_MODE_SERVER || (pkt[0] >> 6) == NTP_LI_ALARM ||
+        pkt[1] == 0 || pkt[1] > 15) {
+        return -EPROTO;                         // kiss-o'-death or unsynchronized
+    }
+    
+    t1 = ntp_clock_at(ntp_page, raw1);
+    t2 = ntp_ts_to_ns(pkt + 32);
+    t3 = ntp_ts_to_ns(pkt + 40);
+    t4 = ntp_clock_at(ntp_page, raw4);
+    
+    s->offset = ((t2 - t1) + (t3 - t4)) / 2;
+    s->delay = max_t(s64, (t4 - t1) - (t3 - t2), 0);
+    s->raw = raw4;
+    
+    return 0;
+}
+
+// Accept a sample unless its round trip is over twice the recent best
+static bool ntp_filter_accept(s64 delay)
+{
+    s64 best = delay;
+    int i;
+    
+    for (i = 0; i < NTP_FILTER_SAMPLES; i++) {
+        if (ntp_delays[i] && ntp_delays[i] < best) {
+            best = ntp_delays[i];
+        }
+    }
+    ntp_delays[ntp_delay_next] = delay ? delay : 1;
+    ntp_delay_next = (ntp_delay_next + 1) % NTP_FILTER_SAMPLES;
+    
+    return delay <= 2 * best;
+}
+
+static void ntp_discipline(const struct ntp_sample *s)
+{
+    const struct ntp_clock_page *p = ntp_page;
+    s64 utc = ntp_clock_at(p, s->raw);
+    s64 interval = s->raw - p->last_sync_raw_ns;
+    s64 freq;
+    
+    if (!(p->flags & NTP_CLOCK_SYNCED) || abs(s->offset) > NTP_STEP_THRESHOLD_NS) {
+        pr_info("ntp: Clock stepped by %lld us\n", s->offset / NSEC_PER_USEC);
+        ntp_page_update(s->raw, utc + s->offset, ntp_freq_est, s->delay / 2, true);
+        return;
+    }
+    
+    // Integrate the frequency error, then slew the offset out over one poll
+    if (interval > 0) {
+        ntp_freq_est += div64_s64(s->offset * (1LL << 32), interval) / NTP_FREQ_GAIN;
+        ntp_freq_est = clamp_t(s64, ntp_freq_est, -NTP_MAX_FREQ, NTP_MAX_FREQ);
+    }
+    freq = ntp_freq_est + div64_s64(s->offset * (1LL << 32), (s64)poll_sec * NSEC_PER_SEC);
+    freq = clamp_t(s64, freq, -NTP_MAX_FREQ, NTP_MAX_FREQ);
+    
+    ntp_page_update(s->raw, utc, freq, s->delay / 2, true);
+}
+
+static void ntp_poll_work(struct work_struct *work)
+{
+    struct ntp_sample s;
+    u64 raw;
+    int ret;
+    
+    ret = ntp_exchange(&s);
+    if (ret) {
+        pr_warn_ratelimited("ntp: Exchange with %s failed: %d\n", server, ret);
+        // Stop slewing a correction that is not being checked any more
+        if (ntp_page->freq != ntp_freq_est) {
+            raw = ktime_get_raw_ns();
+            ntp_page_update(raw, ntp_clock_at(ntp_page, raw), ntp_freq_est, 0, false);
+        }
+    } else if (ntp_filter_accept(s.delay)) {
+        ntp_discipline(&s);
+    } else {
+        pr_debug("ntp: Sample with %lld us round trip dropped\n", s.delay / NSEC_PER_USEC);
+    }
+    
+    schedule_delayed_work(&ntp_work, (unsigned long)poll_sec * HZ);
+}
+
+// Read-only, one page: readers cannot disturb the sequence count
+static int ntp_clock_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE) {
+        return -EINVAL;
+    }
+    if (vma->vm_flags & VM_WRITE) {
+        return -EPERM;
+    }
+    vm_flags_clear(vma, VM_MAYWRITE);
+    
+    return vm_insert_page(vma, vma->vm_start, virt_to_page(ntp_page));
+}
+
+static const struct file_operations ntp_clock_fops = {
+    .owner = THIS_MODULE,
+    .mmap = ntp_clock_mmap,
+};
+
+static struct miscdevice ntp_clock_dev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "ntp_clock",
+    .fops = &ntp_clock_fops,
+    .mode = 0444,
+};
+
+static int ntp_socket_open(void)
+{
+    struct sockaddr_in sa = {
+        .sin_family = AF_INET,
+        .sin_port = htons(NTP_PORT),
+    };
+    int ret;
+    
+    if (!in4_pton(server, -1, (u8 *)&sa.sin_addr.s_addr, -1, NULL)) {
+        pr_err("ntp: Bad server address %s\n", server);
+        return -EINVAL;
+    }
+    
+    ret = sock_create_kern(&init_net, AF_INET, SOCK_DGRAM, IPPROTO_UDP, &ntp_sock);
+    if (ret) {
+        return ret;
+    }
+    // Connected: the stack drops datagrams from anyone but the server
+    ret = kernel_connect(ntp_sock, (struct sockaddr *)&sa, sizeof(sa), 0);
+    if (ret) {
+        sock_release(ntp_sock);
+        ntp_sock = NULL;
+        return ret;
+    }
+    ntp_sock->sk->sk_rcvtimeo = 2 * HZ;
+    
+    return 0;
+}
 
 static int __init ntp_init(void)
 {
+    u64 raw;
+    int ret;
+    
     pr_info("ntp: Initializing\n");
+    
+    if (poll_sec < 16 || poll_sec > 1024) {
+        return -EINVAL;
+    }
+    
+    ntp_page = (struct ntp_clock_page *)get_zeroed_page(GFP_KERNEL);
+    if (!ntp_page) {
+        return -ENOMEM;
+    }
+    // Until the first sync the page tracks CLOCK_REALTIME
+    raw = ktime_get_raw_ns();
+    ntp_page_update(raw, ktime_get_real_ns(), 0, 0, false);
+    
+    ret = misc_register(&ntp_clock_dev);
+    if (ret) {
+        goto err_page;
+    }
+    
+    if (*server) {
+        ret = ntp_socket_open();
+        if (ret) {
+            goto err_misc;
+        }
+        INIT_DELAYED_WORK(&ntp_work, ntp_poll_work);
+        schedule_delayed_work(&ntp_work, 0);
+    }
+    
     return 0;
+    
+err_misc:
+    misc_deregister(&ntp_clock_dev);
+err_page:
+    free_page((unsigned long)ntp_page);
+    return ret;
 }
 
 static void __exit ntp_exit(void)
 {
+    if (ntp_sock) {
+        cancel_delayed_work_sync(&ntp_work);
+        sock_release(ntp_sock);
+    }
+    misc_deregister(&ntp_clock_dev);
+    free_page((unsigned long)ntp_page);
     pr_info("ntp: Exiting\n");
 }
 
@@ -28,4 +377,4 @@ module_exit(ntp_exit);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("jk1806");
 MODULE_DESCRIPTION("NTP Implementation");
-MODULE_VERSION(MODULE_VERSION);
+MODULE_VERSION(NTP_VERSION);
@@ -0,0 +1,101 @@
+/**
+ * NTP-disciplined clock page
+ *
+ * ntp.c keeps UTC as a linear function of CLOCK_MONOTONIC_RAW: a base
+ * point and a frequency correction, published in one page under a
+ * sequence count. Kernel code calls ntp_clock_now_ns(); processes mmap
+ * /dev/ntp_clock read-only and use ntp_clock_read() below, which costs a
+ * vDSO clock read and a few multiplies, no system call.
+ */
+
+#ifndef NTP_CLOCK_H
+#define NTP_CLOCK_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#include <time.h>
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t s32;
+typedef int64_t s64;
+#endif
+
+#define NTP_CLOCK_DEVICE "/dev/ntp_clock"
+#define NTP_CLOCK_SYNCED 0x1            // at least one exchange was accepted
+
+/*
+ * utc_ns(raw) = base_utc_ns + d + d * freq / 2^32, d = raw - base_raw_ns.
+ * freq is the correction as a fraction of 2^32, within about +-500 ppm.
+ */
+struct ntp_clock_page {
+    u32 seq;                    // odd while the writer is updating
+    u32 flags;                  // NTP_CLOCK_*
+    u64 base_raw_ns;            // CLOCK_MONOTONIC_RAW at the base point
+    s64 base_utc_ns;            // UTC since the Unix epoch at that point
+    s64 freq;
+    u64 error_ns;               // half the round trip of the last accepted sample
+    u64 last_sync_raw_ns;
+};
+
+/*
+ * d * freq / 2^32 without a 128-bit product: freq fits in 32 bits, so
+ * both partial products stay below 2^63 for any d under ~140 years
+ */
+static inline s64 ntp_clock_scale(u64 d, s64 freq)
+{
+    u64 f = freq < 0 ? -freq : freq;
+    u64 adj = (d >> 32) * f + (((d & 0xffffffffu) * f) >> 32);
+    
+    return freq < 0 ? -(s64)adj : (s64)adj;
+}
+
+#ifdef __KERNEL__
+
+s64 ntp_clock_now_ns(void);
+bool ntp_clock_synced(void);
+
+#else
+
+/**
+ * UTC in nanoseconds from a page mapped from NTP_CLOCK_DEVICE; falls back
+ * to CLOCK_REALTIME until the first sync, or with no page at all
+ */
+static inline s64 ntp_clock_read(const volatile struct ntp_clock_page *page)
+{
+    struct timespec ts;
+    u32 seq;
+    u64 raw, base_raw;
+    s64 base_utc, freq;
+    
+    if (page) {
+        do {
+            seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+            if (seq & 1) {
+                continue;
+            }
+            if (!(page->flags & NTP_CLOCK_SYNCED)) {
+                break;
+            }
+            base_raw = page->base_raw_ns;
+            base_utc = page->base_utc_ns;
+            freq = page->freq;
+            // the sequence count must be re-read after the fields
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) != seq) {
+                continue;
+            }
+            clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+            raw = (u64)ts.tv_sec * 1000000000u + ts.tv_nsec;
+            return base_utc + (s64)(raw - base_raw) + ntp_clock_scale(raw - base_raw, freq);
+        } while (1);
+    }
+    
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (s64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#endif /* __KERNEL__ */
+
+#endif /* NTP_CLOCK_H */
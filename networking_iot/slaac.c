@@ -3,13 +3,547 @@
  * Author: jk1806
  * Created: 2024-10-20
  * 
- * Implementation for embedded systems
+ * Stateless address autoconfiguration (RFC 4862) with Optimistic DAD
+ * (RFC 4429). On start the link-local address, and the global one when
+ * the cached prefix is still valid, are configured as Optimistic right
+ * away, with one DAD probe each and a Router Solicitation in the same
+ * burst; the device need not wait the DAD second, or for an RA, before
+ * it transmits. A reply that shows the address in use marks it
+ * Duplicate. Advertisements refresh the prefix with the two-hour rule
+ * of 5.5.3 and the owner persists what they taught.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/random.h>
+#include <linux/crc32.h>
+#include <linux/jiffies.h>
+#include <linux/timekeeping.h>
+#include <linux/etherdevice.h>
+#include <asm/unaligned.h>
 
-#define MODULE_VERSION "1.0.0"
+#include "slaac.h"
+
+#define SLAAC_VERSION "1.1.0"
+
+#define ICMPV6_ROUTER_SOLICIT 133
+#define ICMPV6_ROUTER_ADVERT 134
+#define ICMPV6_NEIGH_SOLICIT 135
+#define ICMPV6_NEIGH_ADVERT 136
+
+#define ND_OPT_SOURCE_LLADDR 1
+#define ND_OPT_PREFIX_INFO 3
+#define ND_PREFIX_ONLINK 0x80
+#define ND_PREFIX_AUTONOMOUS 0x40
+
+#define SLAAC_RA_HDR_LEN 16
+#define SLAAC_NS_LEN 24
+#define SLAAC_DAD_TIME HZ                   // RetransTimer, one probe (DupAddrDetectTransmits 1)
+#define SLAAC_RS_INTERVAL (4 * HZ)          // RFC 4861 RTR_SOLICITATION_INTERVAL
+#define SLAAC_MAX_RS 3
+#define SLAAC_TWO_HOURS 7200
+#define SLAAC_SAVE_INTERVAL_SEC 3600        // lifetime refreshes alone are persisted this often
+#define SLAAC_MAX_WAIT_SEC (24 * 3600)
+
+// Messages and callbacks decided under the lock, made after it
+struct slaac_action {
+    struct {
+        u8 src[16];
+        u8 dst[16];
+        u8 msg[SLAAC_NS_LEN];
+        size_t len;
+    } tx[3];
+    int ntx;
+    struct {
+        u8 addr[16];
+        u8 state;
+    } ev[4];
+    int nev;
+    bool router;
+    u8 router_addr[16];
+    u8 router_mac[ETH_ALEN];
+    u32 router_lifetime;
+    bool save;
+    struct slaac_cache cache;
+};
+
+static const u8 slaac_all_routers[16] = { 0xff, 0x02, [15] = 0x02 };
+
+static u32 slaac_cache_crc(const struct slaac_cache *c)
+{
+    return crc32_le(~0, (const u8 *)c, offsetof(struct slaac_cache, crc));
+}
+
+/**
+ * A persisted cache that is undamaged and belongs to this interface;
+ * its lifetimes may still have run out
+ */
+bool slaac_cache_intact(const struct slaac_cache *c, const u8 *hwaddr)
+{
+    return c->magic == SLAAC_CACHE_MAGIC && c->version == SLAAC_CACHE_VERSION &&
+           ether_addr_equal(c->hwaddr, hwaddr) && c->crc == slaac_cache_crc(c);
+}
+EXPORT_SYMBOL_GPL(slaac_cache_intact);
+
+// Wall-clock second a lifetime from the cache runs out at
+static s64 slaac_end(const struct slaac_cache *c, u32 sec)
+{
+    return sec == SLAAC_LIFETIME_INFINITE ? S64_MAX : c->updated + sec;
+}
+
+// Remaining seconds of a lifetime, 0 if it ran out or the clock went back
+static u32 slaac_left(const struct slaac_cache *c, u32 sec, s64 now)
+{
+    s64 end = slaac_end(c, sec);
+    
+    if (sec == SLAAC_LIFETIME_INFINITE) {
+        return SLAAC_LIFETIME_INFINITE;
+    }
+    return now < c->updated || now >= end ? 0 : (u32)(end - now);
+}
+
+// Modified EUI-64 interface identifier (RFC 4291 appendix A)
+static void slaac_eui64(u8 *iid, const u8 *mac)
+{
+    iid[0] = mac[0] ^ 0x02;
+    iid[1] = mac[1];
+    iid[2] = mac[2];
+    iid[3] = 0xff;
+    iid[4] = 0xfe;
+    iid[5] = mac[3];
+    iid[6] = mac[4];
+    iid[7] = mac[5];
+}
+
+static void slaac_event(struct slaac_action *a, const struct slaac_addr *ad)
+{
+    memcpy(a->ev[a->nev].addr, ad->addr, 16);
+    a->ev[a->nev].state = ad->state;
+    a->nev++;
+}
+
+// DAD probe: NS from the unspecified address to the solicited-node group
+static void slaac_queue_dad(struct slaac_action *a, const u8 *target)
+{
+    u8 *dst = a->tx[a->ntx].dst;
+    u8 *m = a->tx[a->ntx].msg;
+    
+    memset(a->tx[a->ntx].src, 0, 16);
+    memset(dst, 0, 16);
+    dst[0] = 0xff;
+    dst[1] = 0x02;
+    dst[11] = 0x01;
+    dst[12] = 0xff;
+    memcpy(dst + 13, target + 13, 3);
+    
+    memset(m, 0, SLAAC_NS_LEN);
+    m[0] = ICMPV6_NEIGH_SOLICIT;
+    memcpy(m + 8, target, 16);
+    a->tx[a->ntx].len = SLAAC_NS_LEN;
+    a->ntx++;
+}
+
+/*
+ * Router Solicitation. Sent from an Optimistic address too, without the
+ * source link-layer option as 3.3 of RFC 4429 requires; from :: if the
+ * link-local address is not usable.
+ */
+static void slaac_queue_rs(struct slaac_iface *s, struct slaac_action *a)
+{
+    bool usable = s->ll.state == SLAAC_ADDR_OPTIMISTIC || s->ll.state == SLAAC_ADDR_PREFERRED;
+    
+    if (usable) {
+        memcpy(a->tx[a->ntx].src, s->ll.addr, 16);
+    } else {
+        memset(a->tx[a->ntx].src, 0, 16);
+    }
+    memcpy(a->tx[a->ntx].dst, slaac_all_routers, 16);
+    memset(a->tx[a->ntx].msg, 0, 8);
+    a->tx[a->ntx].msg[0] = ICMPV6_ROUTER_SOLICIT;
+    a->tx[a->ntx].len = 8;
+    a->ntx++;
+}
+
+// Configure an address as Optimistic and probe for it
+static void slaac_addr_start(struct slaac_action *a, struct slaac_addr *ad, const u8 *prefix, const u8 *iid)
+{
+    memcpy(ad->addr, prefix, 8);
+    memcpy(ad->addr + 8, iid, 8);
+    ad->state = SLAAC_ADDR_OPTIMISTIC;
+    ad->dad_end = jiffies + SLAAC_DAD_TIME;
+    slaac_event(a, ad);
+    slaac_queue_dad(a, ad->addr);
+}
+
+static void slaac_queue_save(struct slaac_iface *s, struct slaac_action *a, s64 now)
+{
+    s->cache.crc = slaac_cache_crc(&s->cache);
+    s->last_save = now;
+    a->save = true;
+    a->cache = s->cache;
+}
+
+static void slaac_queue_router(struct slaac_iface *s, struct slaac_action *a, u32 lifetime)
+{
+    a->router = true;
+    memcpy(a->router_addr, s->cache.router, 16);
+    ether_addr_copy(a->router_mac, s->cache.router_mac);
+    a->router_lifetime = lifetime;
+}
+
+// Delay to the next DAD end, solicitation or lifetime change
+static unsigned long slaac_next(struct slaac_iface *s, s64 now)
+{
+    unsigned long next = SLAAC_MAX_WAIT_SEC * HZ, j = jiffies;
+    struct slaac_addr *ads[] = { &s->ll, &s->global };
+    int i;
+    
+    for (i = 0; i < ARRAY_SIZE(ads); i++) {
+        if (ads[i]->state == SLAAC_ADDR_OPTIMISTIC) {
+            next = min(next, time_after(ads[i]->dad_end, j) ? ads[i]->dad_end - j : 0);
+        }
+    }
+    if (!s->got_ra && s->rs_sent < SLAAC_MAX_RS) {
+        next = min(next, time_after(s->rs_next, j) ? s->rs_next - j : 0);
+    }
+    if (s->have_prefix) {
+        u32 left = s->global.state == SLAAC_ADDR_PREFERRED ?
+                   slaac_left(&s->cache, s->cache.preferred_sec, now) :
+                   slaac_left(&s->cache, s->cache.valid_sec, now);
+    
+        if (left < SLAAC_MAX_WAIT_SEC) {
+            next = min(next, (unsigned long)left * HZ);
+        }
+    }
+    return next;
+}
+
+static void slaac_run(struct slaac_iface *s, const struct slaac_action *a)
+{
+    int i;
+    
+    for (i = 0; i < a->nev; i++) {
+        s->ops->addr_event(s->ctx, a->ev[i].addr, a->ev[i].state);
+    }
+    if (a->router) {
+        s->ops->router(s->ctx, a->router_addr,
+                       is_valid_ether_addr(a->router_mac) ? a->router_mac : NULL,
+                       a->router_lifetime);
+    }
+    if (a->save) {
+        s->ops->save(s->ctx, &a->cache);
+    }
+    for (i = 0; i < a->ntx; i++) {
+        s->ops->send(s->ctx, a->tx[i].src, a->tx[i].dst, a->tx[i].msg, a->tx[i].len);
+    }
+}
+
+// Apply a Prefix Information option (5.5.3); the cache is rebased to now
+static void slaac_prefix(struct slaac_iface *s, struct slaac_action *a, const u8 *pio)
+{
+    u32 valid = get_unaligned_be32(pio + 4);
+    u32 preferred = get_unaligned_be32(pio + 8);
+    const u8 *prefix = pio + 16;
+    
+    if (!(pio[3] & ND_PREFIX_AUTONOMOUS) || pio[2] != 64 || preferred > valid ||
+        (prefix[0] == 0xfe && (prefix[1] & 0xc0) == 0x80)) {
+        return;
+    }
+    
+    if (s->have_prefix && !memcmp(s->cache.prefix, prefix, 8)) {
+        u32 left = s->cache.valid_sec;
+    
+        // A spoofed RA cannot cut a lifetime below two hours
+        if (valid <= SLAAC_TWO_HOURS && valid <= left) {
+            valid = left <= SLAAC_TWO_HOURS ? left : SLAAC_TWO_HOURS;
+        }
+        s->cache.valid_sec = valid;
+        s->cache.preferred_sec = preferred;
+        if (s->global.state == SLAAC_ADDR_DEPRECATED && preferred) {
+            s->global.state = SLAAC_ADDR_PREFERRED;
+            slaac_event(a, &s->global);
+        }
+        return;
+    }
+    
+    if (!valid) {
+        return;
+    }
+    // One prefix per interface: a new one replaces the old
+    if (s->have_prefix && s->global.state != SLAAC_ADDR_NONE) {
+        s->global.state = SLAAC_ADDR_NONE;
+        slaac_event(a, &s->global);
+    }
+    memcpy(s->cache.prefix, prefix, 8);
+    memset(s->cache.prefix + 8, 0, 8);
+    s->cache.prefix_len = 64;
+    s->cache.valid_sec = valid;
+    s->cache.preferred_sec = preferred;
+    s->have_prefix = true;
+    slaac_addr_start(a, &s->global, s->cache.prefix, s->cache.iid);
+    a->save = true;
+}
+
+static void slaac_ra(struct slaac_iface *s, struct slaac_action *a, const u8 *src,
+                     const u8 *msg, size_t len, s64 now)
+{
+    u16 lifetime = get_unaligned_be16(msg + 6);
+    const u8 *p = msg + SLAAC_RA_HDR_LEN, *end = msg + len;
+    bool router_changed;
+    u8 mac[ETH_ALEN];
+    
+    // A malformed option drops the whole RA (6.1.2)
+    for (; p + 2 <= end; p += p[1] * 8) {
+        if (!p[1] || p + p[1] * 8 > end) {
+            return;
+        }
+    }
+    if (p != end) {
+        return;
+    }
+    
+    // All lifetimes count from the last RA: rebase what is left to now
+    s->cache.valid_sec = slaac_left(&s->cache, s->cache.valid_sec, now);
+    s->cache.preferred_sec = slaac_left(&s->cache, s->cache.preferred_sec, now);
+    s->cache.updated = now;
+    
+    eth_zero_addr(mac);
+    for (p = msg + SLAAC_RA_HDR_LEN; p < end; p += p[1] * 8) {
+        if (p[0] == ND_OPT_SOURCE_LLADDR && p[1] == 1) {
+            ether_addr_copy(mac, p + 2);
+        } else if (p[0] == ND_OPT_PREFIX_INFO && p[1] == 4) {
+            slaac_prefix(s, a, p);
+        }
+    }
+    
+    s->got_ra = true;
+    s->stats.router_adverts++;
+    
+    router_changed = memcmp(s->cache.router, src, 16) || !ether_addr_equal(s->cache.router_mac, mac);
+    memcpy(s->cache.router, src, 16);
+    ether_addr_copy(s->cache.router_mac, mac);
+    if (router_changed || (s->cache.router_lifetime_sec != 0) != (lifetime != 0)) {
+        a->save = true;
+    }
+    s->cache.router_lifetime_sec = lifetime;
+    slaac_queue_router(s, a, lifetime);
+    
+    if (a->save || now - s->last_save >= SLAAC_SAVE_INTERVAL_SEC) {
+        slaac_queue_save(s, a, now);
+    }
+}
+
+// NS or NA naming one of our Optimistic addresses: someone else has it
+static void slaac_dad_check(struct slaac_iface *s, struct slaac_action *a, const u8 *target)
+{
+    struct slaac_addr *ads[] = { &s->ll, &s->global };
+    int i;
+    
+    for (i = 0; i < ARRAY_SIZE(ads); i++) {
+        if (ads[i]->state == SLAAC_ADDR_OPTIMISTIC && !memcmp(ads[i]->addr, target, 16)) {
+            ads[i]->state = SLAAC_ADDR_DUPLICATE;
+            s->stats.duplicates++;
+            slaac_event(a, ads[i]);
+            pr_warn_ratelimited("slaac: duplicate address %pI6c\n", target);
+        }
+    }
+}
+
+/**
+ * Feed a received RA, NS or NA; msg is the ICMPv6 message and src the
+ * IPv6 source. The owner has checked the checksum and that the hop
+ * limit was 255 (RFC 4861 6.1).
+ */
+int slaac_icmp6_input(struct slaac_iface *s, const u8 *src, const u8 *msg, size_t len)
+{
+    static const u8 unspecified[16];
+    struct slaac_action a;
+    s64 now = ktime_get_real_seconds();
+    
+    if (len < 8 || msg[1] != 0) {
+        return -EINVAL;
+    }
+    memset(&a, 0, sizeof(a));
+    
+    spin_lock_bh(&s->lock);
+    if (!s->running) {
+        spin_unlock_bh(&s->lock);
+        return 0;
+    }
+    switch (msg[0]) {
+    case ICMPV6_ROUTER_ADVERT:
+        // Only link-local routers may advertise
+        if (len >= SLAAC_RA_HDR_LEN && src[0] == 0xfe && (src[1] & 0xc0) == 0x80) {
+            slaac_ra(s, &a, src, msg, len, now);
+        }
+        break;
+    case ICMPV6_NEIGH_SOLICIT:
+        // Only another node's DAD probe comes from ::
+        if (len >= SLAAC_NS_LEN && !memcmp(src, unspecified, 16)) {
+            slaac_dad_check(s, &a, msg + 8);
+        }
+        break;
+    case ICMPV6_NEIGH_ADVERT:
+        if (len >= SLAAC_NS_LEN) {
+            slaac_dad_check(s, &a, msg + 8);
+        }
+        break;
+    }
+    if (a.nev || a.ntx) {
+        mod_delayed_work(system_wq, &s->work, slaac_next(s, now));
+    }
+    spin_unlock_bh(&s->lock);
+    
+    slaac_run(s, &a);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(slaac_icmp6_input);
+
+static void slaac_work(struct work_struct *work)
+{
+    struct slaac_iface *s = container_of(to_delayed_work(work), struct slaac_iface, work);
+    struct slaac_addr *ads[] = { &s->ll, &s->global };
+    s64 now = ktime_get_real_seconds();
+    unsigned long j = jiffies;
+    struct slaac_action a;
+    int i;
+    
+    memset(&a, 0, sizeof(a));
+    
+    spin_lock_bh(&s->lock);
+    if (!s->running) {
+        spin_unlock_bh(&s->lock);
+        return;
+    }
+    
+    if (s->have_prefix && !slaac_left(&s->cache, s->cache.valid_sec, now)) {
+        s->have_prefix = false;
+        if (s->global.state != SLAAC_ADDR_NONE) {
+            s->global.state = SLAAC_ADDR_NONE;
+            slaac_event(&a, &s->global);
+        }
+    }
+    
+    // DAD passed: Optimistic addresses become Preferred, or Deprecated
+    for (i = 0; i < ARRAY_SIZE(ads); i++) {
+        if (ads[i]->state == SLAAC_ADDR_OPTIMISTIC && time_after_eq(j, ads[i]->dad_end)) {
+            ads[i]->state = ads[i] == &s->global &&
+                            !slaac_left(&s->cache, s->cache.preferred_sec, now) ?
+                            SLAAC_ADDR_DEPRECATED : SLAAC_ADDR_PREFERRED;
+            slaac_event(&a, ads[i]);
+        }
+    }
+    if (s->have_prefix && s->global.state == SLAAC_ADDR_PREFERRED &&
+        !slaac_left(&s->cache, s->cache.preferred_sec, now)) {
+        s->global.state = SLAAC_ADDR_DEPRECATED;
+        slaac_event(&a, &s->global);
+    }
+    
+    if (!s->got_ra && s->rs_sent < SLAAC_MAX_RS && time_after_eq(j, s->rs_next)) {
+        slaac_queue_rs(s, &a);
+        s->rs_sent++;
+        s->rs_next = j + SLAAC_RS_INTERVAL;
+    }
+    
+    mod_delayed_work(system_wq, &s->work, slaac_next(s, now));
+    spin_unlock_bh(&s->lock);
+    
+    slaac_run(s, &a);
+}
+
+int slaac_iface_init(struct slaac_iface *s, const u8 *hwaddr, const struct slaac_ops *ops, void *ctx)
+{
+    if (!ops || !ops->send || !ops->addr_event || !ops->router || !ops->save ||
+        !is_valid_ether_addr(hwaddr)) {
+        return -EINVAL;
+    }
+    
+    memset(s, 0, sizeof(*s));
+    spin_lock_init(&s->lock);
+    ether_addr_copy(s->hwaddr, hwaddr);
+    s->ops = ops;
+    s->ctx = ctx;
+    INIT_DELAYED_WORK(&s->work, slaac_work);
+    
+    return 0;
+}
+EXPORT_SYMBOL_GPL(slaac_iface_init);
+
+/**
+ * Bring the interface up, e.g. on wake-up. With an intact cache whose
+ * prefix is still valid the global address is configured at once, next
+ * to the link-local one, both Optimistic; the cached default router is
+ * reinstated for what is left of its lifetime. The DAD probes go out
+ * from here, the first solicitation from the work item.
+ */
+int slaac_iface_start(struct slaac_iface *s, const struct slaac_cache *cached)
+{
+    static const u8 link_local[8] = { 0xfe, 0x80 };
+    s64 now = ktime_get_real_seconds();
+    struct slaac_action a;
+    bool intact;
+    u32 left;
+    
+    memset(&a, 0, sizeof(a));
+    intact = cached && slaac_cache_intact(cached, s->hwaddr);
+    
+    spin_lock_bh(&s->lock);
+    if (s->running) {
+        spin_unlock_bh(&s->lock);
+        return -EBUSY;
+    }
+    s->running = true;
+    s->got_ra = false;
+    s->rs_sent = 0;
+    s->rs_next = jiffies;
+    s->have_prefix = false;
+    memset(&s->ll, 0, sizeof(s->ll));
+    memset(&s->global, 0, sizeof(s->global));
+    
+    if (intact) {
+        s->cache = *cached;
+        s->last_save = now;
+    } else {
+        memset(&s->cache, 0, sizeof(s->cache));
+        s->cache.magic = SLAAC_CACHE_MAGIC;
+        s->cache.version = SLAAC_CACHE_VERSION;
+        ether_addr_copy(s->cache.hwaddr, s->hwaddr);
+        slaac_eui64(s->cache.iid, s->hwaddr);
+    }
+    
+    slaac_addr_start(&a, &s->ll, link_local, s->cache.iid);
+    if (intact && s->cache.prefix_len && slaac_left(&s->cache, s->cache.valid_sec, now)) {
+        s->have_prefix = true;
+        s->stats.optimistic_rejoins++;
+        slaac_addr_start(&a, &s->global, s->cache.prefix, s->cache.iid);
+    }
+    left = intact && s->cache.router_lifetime_sec ?
+           slaac_left(&s->cache, s->cache.router_lifetime_sec, now) : 0;
+    if (left) {
+        slaac_queue_router(s, &a, left);
+    }
+    
+    mod_delayed_work(system_wq, &s->work, 0);
+    spin_unlock_bh(&s->lock);
+    
+    slaac_run(s, &a);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(slaac_iface_start);
+
+/**
+ * Stop before sleeping; addresses stay as they are, to be confirmed on
+ * the next start
+ */
+void slaac_iface_stop(struct slaac_iface *s)
+{
+    spin_lock_bh(&s->lock);
+    s->running = false;
+    spin_unlock_bh(&s->lock);
+    
+    cancel_delayed_work_sync(&s->work);
+}
+EXPORT_SYMBOL_GPL(slaac_iface_stop);
 
 static int __init slaac_init(void)
 {
@@ -28,4 +562,4 @@ module_exit(slaac_exit);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("jk1806");
 MODULE_DESCRIPTION("SLAAC IPv6 configuration");
-MODULE_VERSION(MODULE_VERSION);
+MODULE_VERSION(SLAAC_VERSION);
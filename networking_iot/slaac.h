@@ -0,0 +1,108 @@
+/**
+ * SLAAC with optimistic DAD
+ *
+ * RFC 4862 stateless address autoconfiguration for the lightweight
+ * stacks. The prefix, interface identifier and default router learnt
+ * from Router Advertisements are handed to the owner to keep across
+ * sleep; started again with them, the interface configures its
+ * addresses at once as Optimistic (RFC 4429) and can send while
+ * Duplicate Address Detection and a Router Solicitation run behind it.
+ * The owning stack wraps the ICMPv6 messages in IPv6 through its
+ * slaac_ops.
+ */
+
+#ifndef SLAAC_H
+#define SLAAC_H
+
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/if_ether.h>
+
+#define SLAAC_CACHE_MAGIC 0x43414c53    // "SLAC"
+#define SLAAC_CACHE_VERSION 1
+#define SLAAC_LIFETIME_INFINITE 0xffffffffu
+
+/*
+ * Prefix state as persisted by the owner. Lifetimes count from updated,
+ * in wall-clock seconds so they age across sleep; crc covers everything
+ * before it.
+ */
+struct slaac_cache {
+    u32 magic;
+    u16 version;
+    u8 prefix_len;                      // 64 or 0 when no prefix was learnt
+    u8 flags;
+    u8 hwaddr[ETH_ALEN];
+    u8 iid[8];
+    u8 prefix[16];
+    u8 router[16];                      // link-local address of the default router
+    u8 router_mac[ETH_ALEN];
+    s64 updated;
+    u32 valid_sec;
+    u32 preferred_sec;
+    u32 router_lifetime_sec;
+    u32 crc;
+};
+
+enum slaac_addr_state {
+    SLAAC_ADDR_NONE,                    // removed, or never configured
+    SLAAC_ADDR_OPTIMISTIC,              // usable, DAD still running
+    SLAAC_ADDR_PREFERRED,
+    SLAAC_ADDR_DEPRECATED,              // existing flows only
+    SLAAC_ADDR_DUPLICATE,               // DAD failed: must not be used
+};
+
+/*
+ * Callbacks into the owning stack, made without the lock from the work
+ * item or from slaac_icmp6_input()'s context
+ */
+struct slaac_ops {
+    // ICMPv6 message from src (:: for DAD) to dst; the owner adds the IPv6
+    // header with hop limit 255 and fills in the checksum
+    int (*send)(void *ctx, const u8 *src, const u8 *dst, const void *msg, size_t len);
+    // Configure, re-flag or remove an address
+    void (*addr_event)(void *ctx, const u8 *addr, enum slaac_addr_state state);
+    // Default router, lladdr NULL if the RA did not carry it; lifetime 0 withdraws it
+    void (*router)(void *ctx, const u8 *addr, const u8 *lladdr, u32 lifetime_sec);
+    // Persist the prefix state
+    void (*save)(void *ctx, const struct slaac_cache *cache);
+};
+
+struct slaac_addr {
+    u8 addr[16];
+    u8 state;                           // enum slaac_addr_state
+    unsigned long dad_end;              // jiffies, while OPTIMISTIC
+};
+
+struct slaac_stats {
+    u32 optimistic_rejoins;             // global address from the cache at start
+    u32 router_adverts;
+    u32 duplicates;
+};
+
+struct slaac_iface {
+    spinlock_t lock;
+    bool running;
+    bool have_prefix;
+    bool got_ra;                        // stops the solicitations
+    u8 rs_sent;
+    u8 hwaddr[ETH_ALEN];
+    unsigned long rs_next;
+    s64 last_save;
+    struct slaac_cache cache;
+    struct slaac_addr ll;
+    struct slaac_addr global;
+    const struct slaac_ops *ops;
+    void *ctx;
+    struct delayed_work work;           // DAD, solicitations and lifetimes
+    struct slaac_stats stats;
+};
+
+int slaac_iface_init(struct slaac_iface *s, const u8 *hwaddr, const struct slaac_ops *ops, void *ctx);
+int slaac_iface_start(struct slaac_iface *s, const struct slaac_cache *cached);
+void slaac_iface_stop(struct slaac_iface *s);
+int slaac_icmp6_input(struct slaac_iface *s, const u8 *src, const u8 *msg, size_t len);
+bool slaac_cache_intact(const struct slaac_cache *cache, const u8 *hwaddr);
+
+#endif /* SLAAC_H */
@@ -5,80 +5,647 @@
  * 
  * RFC 6455 WebSocket protocol implementation
  * Supports full-duplex communication over TCP
+ *
+ * Frames go out as a header prefix and the caller's payload in one
+ * kernel_sendmsg() of two kvecs, so nothing is copied to build them.
+ * Received payloads are unmasked in place a word at a time. RFC 7692
+ * permessage-deflate is negotiated in the handshake and keeps both
+ * compression contexts across messages.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/tcp.h>
+#include <linux/net.h>
+#include <linux/uio.h>
 #include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/zlib.h>
 #include <linux/base64.h>
+#include <crypto/hash.h>
+#include <asm/unaligned.h>
 
-#define WEBSOCKET_VERSION "1.0.0"
+#define WEBSOCKET_VERSION "1.1.0"
 #define WS_MAGIC_STRING "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 
-struct websocket_frame {
-    u8 fin_opcode;
-    u8 mask_len;
-    u16 payload_len;
-    u32 masking_key;
-    u8 *payload;
+#define WS_MAX_HEADER 14            // 2 + 8-byte length + 4-byte mask
+#define WS_MAX_CONTROL 125
+#define WS_MAX_FRAME (1 << 20)      // received payload limit
+#define WS_HANDSHAKE_MAX 4096
+#define WS_KEY_LEN 24               // base64 of a 16-byte nonce
+#define WS_ACCEPT_LEN 28            // base64 of a SHA-1 digest
+
+#define WS_FIN 0x80
+#define WS_RSV1 0x40                // permessage-deflate: compressed message
+#define WS_RSV_MASK 0x70
+#define WS_MASK 0x80
+
+#define WS_OP_CONT 0x0
+#define WS_OP_TEXT 0x1
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xa
+
+#define WS_CLOSE_PROTOCOL_ERROR 1002
+
+// Small telemetry frames do not shrink enough to be worth deflating
+#define WS_DEFLATE_MIN 128
+#define WS_DEFLATE_WBITS 15
+#define WS_DEFLATE_MEMLEVEL 8
+#define WS_DEFLATE_TAIL_LEN 4       // 00 00 ff ff, stripped from each message
+
+static const u8 ws_deflate_tail[WS_DEFLATE_TAIL_LEN] = { 0x00, 0x00, 0xff, 0xff };
+
+struct websocket_conn {
+    struct socket *sock;
+    bool deflate;               // permessage-deflate negotiated
+    bool rx_compressed;         // the message being received had RSV1
+    u8 rx_opcode;               // of the message being received
+    z_stream tx_zs;
+    z_stream rx_zs;
+    u8 *tx_buf;                 // compressed message
+    size_t tx_buf_size;
+    u8 *rx_buf;                 // compressed frame as received
 };
 
-static int websocket_handshake(struct socket *sock)
+static struct crypto_shash *ws_sha1_tfm;
+
+/**
+ * Build a frame header; returns its length. Server frames are never
+ * masked (RFC 6455 5.1).
+ */
+static int ws_build_header(u8 *hdr, u8 first, size_t len)
+{
+    hdr[0] = first;
+    if (len < 126) {
+        hdr[1] = len;
+        return 2;
+    }
+    if (len <= 0xffff) {
+        hdr[1] = 126;
+        put_unaligned_be16(len, hdr + 2);
+        return 4;
+    }
+    hdr[1] = 127;
+    put_unaligned_be64(len, hdr + 2);
+    return 10;
+}
+
+/**
+ * XOR a client payload with its masking key, eight bytes per step: the
+ * key repeated twice lines up with every 8-byte aligned offset
+ */
+static void ws_unmask(u8 *data, size_t len, const u8 *key)
+{
+    u32 k32 = get_unaligned((const u32 *)key);
+    u64 k64 = (u64)k32 << 32 | k32;
+    size_t i = 0;
+    
+    for (; i + sizeof(u64) <= len; i += sizeof(u64)) {
+        put_unaligned(get_unaligned((u64 *)(data + i)) ^ k64, (u64 *)(data + i));
+    }
+    for (; i < len; i++) {
+        data[i] ^= key[i & 3];
+    }
+}
+
+// Send all of vec, resuming after short writes
+static int ws_sendv(struct socket *sock, struct kvec *vec, size_t nr, size_t len)
 {
-    char request[512];
-    char response[1024];
-    char key[64];
-    char accept_key[32];
+    while (len) {
+        struct msghdr msg = { .msg_flags = MSG_NOSIGNAL };
+        int ret = kernel_sendmsg(sock, &msg, vec, nr, len);
+        size_t sent;
+    
+        if (ret <= 0) {
+            return ret ? ret : -EPIPE;
+        }
+        len -= ret;
+        for (sent = ret; sent && nr; ) {
+            size_t n = min(sent, vec->iov_len);
     
-    // Receive HTTP upgrade request
-    // ... implementation ...
+            vec->iov_base += n;
+            vec->iov_len -= n;
+            sent -= n;
+            if (!vec->iov_len) {
+                vec++;
+                nr--;
+            }
+        }
+    }
+    return 0;
+}
+
+static int ws_recv_exact(struct socket *sock, void *buf, size_t len)
+{
+    struct kvec vec = { .iov_base = buf, .iov_len = len };
+    struct msghdr msg = { };
+    int ret;
     
-    // Generate accept key
-    // ... SHA1 + base64 encoding ...
+    if (!len) {
+        return 0;
+    }
+    ret = kernel_recvmsg(sock, &msg, &vec, 1, len, MSG_WAITALL);
+    if (ret < 0) {
+        return ret;
+    }
+    return ret == len ? 0 : -ECONNRESET;
+}
+
+/*
+ * Compress one message into conn->tx_buf. With context takeover the
+ * stream is never reset, so earlier messages serve as the dictionary.
+ */
+static int ws_deflate(struct websocket_conn *conn, const u8 *data, size_t len, size_t *out_len)
+{
+    // Stored-block and sync-flush overhead on incompressible data
+    size_t need = len + (len >> 10) + 32;
+    z_stream *zs = &conn->tx_zs;
+    size_t produced;
     
-    // Send HTTP 101 response
-    snprintf(response, sizeof(response),
-             "HTTP/1.1 101 Switching Protocols\r\n"
-             "Upgrade: websocket\r\n"
-             "Connection: Upgrade\r\n"
-             "Sec-WebSocket-Accept: %s\r\n\r\n", accept_key);
+    if (need > conn->tx_buf_size) {
+        kvfree(conn->tx_buf);
+        conn->tx_buf = kvmalloc(need, GFP_KERNEL);
+        conn->tx_buf_size = conn->tx_buf ? need : 0;
+        if (!conn->tx_buf) {
+            return -ENOMEM;
+        }
+    }
+    
+    zs->next_in = data;
+    zs->avail_in = len;
+    zs->next_out = conn->tx_buf;
+    zs->avail_out = conn->tx_buf_size;
+    if (zlib_deflate(zs, Z_SYNC_FLUSH) != Z_OK || zs->avail_in || !zs->avail_out) {
+        return -EIO;
+    }
+    
+    produced = conn->tx_buf_size - zs->avail_out;
+    if (produced < WS_DEFLATE_TAIL_LEN ||
+        memcmp(conn->tx_buf + produced - WS_DEFLATE_TAIL_LEN, ws_deflate_tail, WS_DEFLATE_TAIL_LEN)) {
+        return -EIO;
+    }
+    *out_len = produced - WS_DEFLATE_TAIL_LEN;
+    return 0;
+}
+
+/**
+ * Send one unfragmented message (or a control frame). The payload is
+ * sent from data as it is, behind a header built on the stack; data
+ * messages of WS_DEFLATE_MIN bytes or more are compressed when
+ * permessage-deflate is on.
+ */
+static int websocket_send_frame(struct websocket_conn *conn, u8 opcode, const u8 *data, size_t len)
+{
+    u8 hdr[WS_MAX_HEADER];
+    struct kvec vec[2];
+    u8 first = WS_FIN | opcode;
+    int ret;
+    
+    if (opcode >= WS_OP_CLOSE && len > WS_MAX_CONTROL) {
+        return -EINVAL;
+    }
+    
+    if (conn->deflate && opcode < WS_OP_CLOSE && len >= WS_DEFLATE_MIN) {
+        size_t zlen;
+    
+        ret = ws_deflate(conn, data, len, &zlen);
+        if (ret) {
+            return ret;
+        }
+        first |= WS_RSV1;
+        data = conn->tx_buf;
+        len = zlen;
+    }
+    
+    vec[0].iov_base = hdr;
+    vec[0].iov_len = ws_build_header(hdr, first, len);
+    vec[1].iov_base = (void *)data;
+    vec[1].iov_len = len;
+    
+    return ws_sendv(conn->sock, vec, len ? 2 : 1, vec[0].iov_len + len);
+}
+
+static int ws_send_close(struct websocket_conn *conn, u16 code)
+{
+    u8 payload[2];
+    
+    put_unaligned_be16(code, payload);
+    return websocket_send_frame(conn, WS_OP_CLOSE, payload, sizeof(payload));
+}
+
+/*
+ * Inflate a frame's payload into out. The 00 00 ff ff the sender
+ * stripped goes back after the last frame of the message.
+ */
+static int ws_inflate(struct websocket_conn *conn, const u8 *in, size_t len, bool fin,
+                      u8 *out, size_t size)
+{
+    z_stream *zs = &conn->rx_zs;
+    int ret;
+    
+    zs->next_out = out;
+    zs->avail_out = size;
+    
+    zs->next_in = in;
+    zs->avail_in = len;
+    ret = zlib_inflate(zs, Z_SYNC_FLUSH);
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        return -EBADMSG;
+    }
+    if (fin && !zs->avail_in) {
+        zs->next_in = ws_deflate_tail;
+        zs->avail_in = WS_DEFLATE_TAIL_LEN;
+        ret = zlib_inflate(zs, Z_SYNC_FLUSH);
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            return -EBADMSG;
+        }
+    }
+    // Output full with input left: the message is larger than out
+    if (zs->avail_in) {
+        return -EMSGSIZE;
+    }
+    
+    return size - zs->avail_out;
+}
+
+/**
+ * Receive the next data frame into buf: returns its (decompressed)
+ * length and sets *opcode (WS_OP_CONT for continuation frames) and
+ * *fin. Pings are answered and pongs skipped on the way; a close frame
+ * is answered and returns -ESHUTDOWN. Protocol violations send a 1002
+ * close and return -EPROTO.
+ */
+static int websocket_recv_frame(struct websocket_conn *conn, u8 *buf, size_t size,
+                                u8 *opcode, bool *fin)
+{
+    for (;;) {
+        u8 hdr[WS_MAX_HEADER];
+        u8 control[WS_MAX_CONTROL];
+        u8 op, *payload;
+        u64 len;
+        int ret;
+    
+        ret = ws_recv_exact(conn->sock, hdr, 2);
+        if (ret) {
+            return ret;
+        }
+        op = hdr[0] & 0x0f;
+        len = hdr[1] & 0x7f;
+    
+        // Client frames are masked; RSV1 only opens a deflated message
+        if (!(hdr[1] & WS_MASK) ||
+            (hdr[0] & WS_RSV_MASK & ~WS_RSV1) ||
+            ((hdr[0] & WS_RSV1) && (!conn->deflate || op == WS_OP_CONT || op >= WS_OP_CLOSE)) ||
+            (op >= WS_OP_CLOSE && (!(hdr[0] & WS_FIN) || len > WS_MAX_CONTROL)) ||
+            (op != WS_OP_CONT && op != WS_OP_TEXT && op != WS_OP_BINARY &&
+             op != WS_OP_CLOSE && op != WS_OP_PING && op != WS_OP_PONG)) {
+            ws_send_close(conn, WS_CLOSE_PROTOCOL_ERROR);
+            return -EPROTO;
+        }
+    
+        if (len == 126) {
+            ret = ws_recv_exact(conn->sock, hdr + 2, 2);
+            len = get_unaligned_be16(hdr + 2);
+        } else if (len == 127) {
+            ret = ws_recv_exact(conn->sock, hdr + 2, 8);
+            len = get_unaligned_be64(hdr + 2);
+        }
+        if (ret) {
+            return ret;
+        }
+        if (len > WS_MAX_FRAME) {
+            return -EMSGSIZE;
+        }
+        ret = ws_recv_exact(conn->sock, hdr + 10, 4);
+        if (ret) {
+            return ret;
+        }
+    
+        if (op >= WS_OP_CLOSE) {
+            payload = control;
+        } else if (op != WS_OP_CONT ? (hdr[0] & WS_RSV1) : conn->rx_compressed) {
+            payload = conn->rx_buf;
+        } else if (len <= size) {
+            payload = buf;
+        } else {
+            return -EMSGSIZE;
+        }
+        ret = ws_recv_exact(conn->sock, payload, len);
+        if (ret) {
+            return ret;
+        }
+        ws_unmask(payload, len, hdr + 10);
+    
+        switch (op) {
+        case WS_OP_PING:
+            ret = websocket_send_frame(conn, WS_OP_PONG, control, len);
+            if (ret) {
+                return ret;
+            }
+            continue;
+        case WS_OP_PONG:
+            continue;
+        case WS_OP_CLOSE:
+            // Echo the status code, if there was one
+            websocket_send_frame(conn, WS_OP_CLOSE, control, min_t(u64, len, 2));
+            return -ESHUTDOWN;
+        case WS_OP_CONT:
+            if (!conn->rx_opcode) {
+                ws_send_close(conn, WS_CLOSE_PROTOCOL_ERROR);
+                return -EPROTO;
+            }
+            break;
+        default:
+            if (conn->rx_opcode) {
+                // A new message before the last one finished
+                ws_send_close(conn, WS_CLOSE_PROTOCOL_ERROR);
+                return -EPROTO;
+            }
+            conn->rx_opcode = op;
+            conn->rx_compressed = hdr[0] & WS_RSV1;
+            break;
+        }
+    
+        *opcode = op;
+        *fin = hdr[0] & WS_FIN;
+        if (*fin) {
+            conn->rx_opcode = 0;
+        }
+        if (payload == conn->rx_buf) {
+            return ws_inflate(conn, payload, len, *fin, buf, size);
+        }
+        return len;
+    }
+}
+
+/*
+ * Value of header name in the request head, or NULL. Names compare
+ * case-insensitively; the value is trimmed and runs to *len.
+ */
+static const char *ws_header_value(const char *head, const char *name, size_t *len)
+{
+    size_t name_len = strlen(name);
+    const char *line = strstr(head, "\r\n");
+    
+    while (line && line[2] != '\r') {
+        const char *end;
+    
+        line += 2;
+        end = strstr(line, "\r\n");
+        if (!end) {
+            break;
+        }
+        if (end - line > name_len && line[name_len] == ':' &&
+            !strncasecmp(line, name, name_len)) {
+            const char *value = line + name_len + 1;
+    
+            while (value < end && (*value == ' ' || *value == '\t')) {
+                value++;
+            }
+            while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+                end--;
+            }
+            *len = end - value;
+            return value;
+        }
+        line = end;
+    }
+    return NULL;
+}
+
+static bool ws_value_has_token(const char *value, size_t len, const char *token)
+{
+    size_t token_len = strlen(token);
+    size_t i;
+    
+    for (i = 0; i + token_len <= len; i++) {
+        if (!strncasecmp(value + i, token, token_len) &&
+            (i == 0 || value[i - 1] == ' ' || value[i - 1] == ',') &&
+            (i + token_len == len || value[i + token_len] == ' ' || value[i + token_len] == ',')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Accept the first permessage-deflate offer we can honour: default
+ * parameters, or a bare client_max_window_bits, which leaves us at 15
+ */
+static bool ws_deflate_offered(const char *value, size_t len)
+{
+    static const char ext[] = "permessage-deflate";
+    const char *end = value + len;
+    
+    while (value < end) {
+        const char *offer_end = memchr(value, ',', end - value);
+        const char *p;
+    
+        if (!offer_end) {
+            offer_end = end;
+        }
+        while (value < offer_end && *value == ' ') {
+            value++;
+        }
+        if (offer_end - value >= sizeof(ext) - 1 && !strncasecmp(value, ext, sizeof(ext) - 1)) {
+            bool ok = true;
     
+            for (p = value + sizeof(ext) - 1; p < offer_end && ok; ) {
+                const char *param_end;
+    
+                while (p < offer_end && (*p == ';' || *p == ' ')) {
+                    p++;
+                }
+                param_end = p;
+                while (param_end < offer_end && *param_end != ';' && *param_end != ' ') {
+                    param_end++;
+                }
+                if (param_end > p && (param_end - p != 22 || strncasecmp(p, "client_max_window_bits", 22))) {
+                    ok = false;
+                }
+                p = param_end;
+            }
+            if (ok) {
+                return true;
+            }
+        }
+        value = offer_end + 1;
+    }
+    return false;
+}
+
+static int ws_deflate_init(struct websocket_conn *conn)
+{
+    conn->tx_zs.workspace = vzalloc(zlib_deflate_workspacesize(WS_DEFLATE_WBITS, WS_DEFLATE_MEMLEVEL));
+    conn->rx_zs.workspace = vzalloc(zlib_inflate_workspacesize());
+    conn->rx_buf = kvmalloc(WS_MAX_FRAME, GFP_KERNEL);
+    if (!conn->tx_zs.workspace || !conn->rx_zs.workspace || !conn->rx_buf) {
+        return -ENOMEM;
+    }
+    
+    // Raw deflate streams: negative window bits, no zlib header
+    if (zlib_deflateInit2(&conn->tx_zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -WS_DEFLATE_WBITS,
+                          WS_DEFLATE_MEMLEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -EINVAL;
+    }
+    if (zlib_inflateInit2(&conn->rx_zs, -WS_DEFLATE_WBITS) != Z_OK) {
+        zlib_deflateEnd(&conn->tx_zs);
+        return -EINVAL;
+    }
+    
+    conn->deflate = true;
+    return 0;
+}
+
+static int ws_accept_key(const char *key, char *accept)
+{
+    u8 input[WS_KEY_LEN + sizeof(WS_MAGIC_STRING) - 1];
+    u8 digest[20];
+    int ret;
+    
+    memcpy(input, key, WS_KEY_LEN);
+    memcpy(input + WS_KEY_LEN, WS_MAGIC_STRING, sizeof(WS_MAGIC_STRING) - 1);
+    ret = crypto_shash_tfm_digest(ws_sha1_tfm, input, sizeof(input), digest);
+    if (ret) {
+        return ret;
+    }
+    
+    accept[base64_encode(digest, sizeof(digest), accept)] = '\0';
     return 0;
 }
 
-static int websocket_send_frame(struct socket *sock, const u8 *data, size_t len)
+/**
+ * Server side of the opening handshake (RFC 6455 4.2) on a connected
+ * socket: read the upgrade request, answer 101 with the accept key and
+ * permessage-deflate if the client offered it
+ */
+static int websocket_handshake(struct websocket_conn *conn, struct socket *sock)
 {
-    struct websocket_frame frame;
-    u8 *buffer;
-    int offset = 0;
+    static const char bad_request[] = "HTTP/1.1 400 Bad Request\r\nSec-WebSocket-Version: 13\r\n\r\n";
+    char accept_key[WS_ACCEPT_LEN + 1];
+    const char *key, *value;
+    char response[256];
+    size_t len = 0, value_len, key_len;
+    struct kvec vec;
+    char *request;
+    int ret;
     
-    // Build frame
-    frame.fin_opcode = 0x81;  // FIN + text frame
-    frame.mask_len = 0x80 | (len < 126 ? len : (len < 65536 ? 126 : 127));
+    memset(conn, 0, sizeof(*conn));
+    conn->sock = sock;
     
-    buffer = kmalloc(len + 14, GFP_KERNEL);
-    if (!buffer)
+    request = kmalloc(WS_HANDSHAKE_MAX + 1, GFP_KERNEL);
+    if (!request) {
         return -ENOMEM;
+    }
     
-    buffer[offset++] = frame.fin_opcode;
-    buffer[offset++] = frame.mask_len;
+    // The client waits for our 101 before sending frames, so read to the blank line
+    do {
+        struct msghdr msg = { };
     
-    if (len >= 126) {
-        put_unaligned_be16(len, buffer + offset);
-        offset += 2;
+        vec.iov_base = request + len;
+        vec.iov_len = WS_HANDSHAKE_MAX - len;
+        ret = kernel_recvmsg(sock, &msg, &vec, 1, vec.iov_len, 0);
+        if (ret <= 0) {
+            ret = ret ? ret : -ECONNRESET;
+            goto out;
+        }
+        len += ret;
+        request[len] = '\0';
+    } while (!strstr(request, "\r\n\r\n") && len < WS_HANDSHAKE_MAX);
+    
+    ret = -EPROTO;
+    if (strncmp(request, "GET ", 4) || !strstr(request, "\r\n\r\n")) {
+        goto reject;
+    }
+    value = ws_header_value(request, "Upgrade", &value_len);
+    if (!value || !ws_value_has_token(value, value_len, "websocket")) {
+        goto reject;
+    }
+    value = ws_header_value(request, "Connection", &value_len);
+    if (!value || !ws_value_has_token(value, value_len, "upgrade")) {
+        goto reject;
+    }
+    value = ws_header_value(request, "Sec-WebSocket-Version", &value_len);
+    if (!value || value_len != 2 || strncmp(value, "13", 2)) {
+        goto reject;
+    }
+    key = ws_header_value(request, "Sec-WebSocket-Key", &key_len);
+    if (!key || key_len != WS_KEY_LEN) {
+        goto reject;
     }
     
-    memcpy(buffer + offset, data, len);
-    offset += len;
+    ret = ws_accept_key(key, accept_key);
+    if (ret) {
+        goto out;
+    }
     
-    // Send via TCP
-    // ... TCP send ...
+    value = ws_header_value(request, "Sec-WebSocket-Extensions", &value_len);
+    if (value && ws_deflate_offered(value, value_len)) {
+        ret = ws_deflate_init(conn);
+        if (ret) {
+            goto out;
+        }
+    }
+    
+    // Send HTTP 101 response
+    len = snprintf(response, sizeof(response),
+                   "HTTP/1.1 101 Switching Protocols\r\n"
+                   "Upgrade: websocket\r\n"
+                   "Connection: Upgrade\r\n"
+                   "Sec-WebSocket-Accept: %s\r\n"
+                   "%s\r\n", accept_key,
+                   conn->deflate ? "Sec-WebSocket-Extensions: permessage-deflate\r\n" : "");
+    vec.iov_base = response;
+    vec.iov_len = len;
+    ret = ws_sendv(sock, &vec, 1, len);
+    goto out;
     
-    kfree(buffer);
+reject:
+    vec.iov_base = (void *)bad_request;
+    vec.iov_len = sizeof(bad_request) - 1;
+    ws_sendv(sock, &vec, 1, vec.iov_len);
+out:
+    kfree(request);
+    return ret;
+}
+
+/**
+ * Free what the handshake set up; the socket stays the caller's
+ */
+static void websocket_conn_release(struct websocket_conn *conn)
+{
+    if (conn->deflate) {
+        zlib_deflateEnd(&conn->tx_zs);
+        zlib_inflateEnd(&conn->rx_zs);
+    }
+    vfree(conn->tx_zs.workspace);
+    vfree(conn->rx_zs.workspace);
+    kvfree(conn->tx_buf);
+    kvfree(conn->rx_buf);
+    memset(conn, 0, sizeof(*conn));
+}
+
+static int __init websocket_init(void)
+{
+    ws_sha1_tfm = crypto_alloc_shash("sha1", 0, 0);
+    if (IS_ERR(ws_sha1_tfm)) {
+        pr_err("WebSocket: Failed to allocate SHA-1 transform\n");
+        return PTR_ERR(ws_sha1_tfm);
+    }
     return 0;
 }
 
+static void __exit websocket_exit(void)
+{
+    crypto_free_shash(ws_sha1_tfm);
+}
+
+module_init(websocket_init);
+module_exit(websocket_exit);
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("jk1806");
 MODULE_DESCRIPTION("WebSockets Protocol Implementation");
@@ -0,0 +1,61 @@
+/**
+ * Zero-copy socket API
+ *
+ * Send: pages go out as skb fragments (MSG_ZEROCOPY) and a completion
+ * callback reports when the stack has released them. Receive: a callback
+ * sees each queued skb in place instead of a copy of it. Used by the
+ * broker and the gateway's bulk telemetry and OTA paths.
+ */
+
+#ifndef ZERO_COPY_H
+#define ZERO_COPY_H
+
+#include <linux/types.h>
+#include <linux/net.h>
+#include <linux/skbuff.h>
+#include <linux/bvec.h>
+
+// Below this a send is copied: pinning and completing pages costs more
+// than copying a few pages' worth of data
+#define ZC_COPY_THRESHOLD (16 * 1024)
+
+struct zc_tx;
+
+/**
+ * Runs once the stack no longer references any page of the send, from
+ * softirq context. zerocopy is false if the kernel had to copy the data
+ * after all (no scatter-gather on the route, loopback, a tap).
+ */
+typedef void (*zc_tx_done_t)(struct zc_tx *tx, bool zerocopy);
+
+struct zc_tx {
+    struct ubuf_info ubuf;      // completion, shared by every skb of the send
+    zc_tx_done_t done;
+    void *arg;
+    size_t len;
+    bool copied;
+};
+
+/**
+ * Receive actor: skb data from offset, len bytes, valid only for the
+ * call (skb_get() keeps it). Returns the bytes consumed; TCP leaves the
+ * rest queued, a short UDP return still consumes the datagram. A
+ * negative return stops the receive.
+ */
+typedef int (*zc_rx_actor_t)(void *arg, struct sk_buff *skb, unsigned int offset, size_t len);
+
+struct zc_stats {
+    u64 tx_zerocopy_bytes;
+    u64 tx_copied_bytes;        // below the threshold or copied by the kernel
+    u64 tx_completions;
+    u64 rx_bytes;
+    u64 rx_skbs;                // skbs handed to actors
+};
+
+void zc_tx_init(struct zc_tx *tx, zc_tx_done_t done, void *arg);
+int zc_send(struct socket *sock, struct zc_tx *tx, const struct bio_vec *bvec,
+            unsigned int nr_segs, size_t len, int flags);
+int zc_recv(struct socket *sock, zc_rx_actor_t actor, void *arg, size_t budget);
+void zc_get_stats(struct zc_stats *stats);
+
+#endif /* ZERO_COPY_H */
@@ -18,6 +18,23 @@
 #include <linux/atomic.h>
 #include <linux/slab.h>
 #include <linux/errno.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/rculist.h>
+#include <linux/random.h>
+#include <linux/ip.h>
+#include <linux/mm.h>
+#include <linux/smp.h>
+#include <linux/cpumask.h>
+#include <linux/netdevice.h>
+#include <linux/if_ether.h>
+#include <linux/win_minmax.h>
+#include <linux/bitmap.h>
+#include <linux/math64.h>
+#include <asm/unaligned.h>
+
+#include "timer_wheel.h"
+#include "../networking_iot/nic_offloads.h"
 
 #define TCP_STACK_VERSION "3.0.0"
 #define MAX_CONNECTIONS 10000
@@ -26,50 +43,1607 @@
 #define TCP_RTO_MIN 200
 #define TCP_RTO_MAX 120000
 #define BBR_GAIN_CYCLE_LENGTH 8
+#define TCP_INIT_CWND 10
+#define TCP_SHARD_HASH_BITS 12  // 4096 buckets per CPU
+#define TCP_RSS_INDIR_SIZE 128  // ethtool default indirection table size
+
+// BBR gains are fixed point, BBR_UNIT = 1.0
+#define BBR_SCALE 8
+#define BBR_UNIT (1 << BBR_SCALE)
+#define BBR_HIGH_GAIN (BBR_UNIT * 2885 / 1000 + 1)     // 2/ln(2)
+#define BBR_DRAIN_GAIN (BBR_UNIT * 1000 / 2885)
+#define BBR_CWND_GAIN (BBR_UNIT * 2)
+#define BBR_BETA (BBR_UNIT * 7 / 10)                    // BBRv2 inflight_hi backoff
+#define BBR_LOSS_THRESH 2                               // percent lost per round
+#define BBR_BW_RTTS 10                                  // max filter window, rounds
+#define BBR_MIN_RTT_WIN_US (10 * USEC_PER_SEC)
+#define BBR_PROBE_RTT_US (200 * USEC_PER_MSEC)
+#define BBR_MIN_CWND 4
+
+// CUBIC: beta 0.7 out of 1024; K in ms is cbrt(dW * (1 - beta) / C * 1e9)
+#define CUBIC_BETA 717
+#define CUBIC_K_SCALE 750000000ULL
+#define CUBIC_MAX_OFFS_MS 100000
+
+#define TCP_PACING_SLOT_NS (64 * NSEC_PER_USEC)
+#define TCP_PACING_SLOTS 1024   // 65 ms horizon
+#define TCP_PACING_MAX_QUANTUM (64 * 1024)
+#define TCP_MAX_HEADERS (ETH_HLEN + sizeof(struct iphdr) + 60)
+
+// SACK scoreboard and RACK-TLP (RFC 6675, RFC 8985)
+#define TCP_SACK_SEGS 256               // scoreboard span in MSS segments
+#define TCP_MAX_SACK_BLOCKS 4
+#define TCP_DUPTHRESH 3
+#define TCP_TLP_WCDELACK_US (200 * USEC_PER_MSEC)   // worst-case delayed ACK
+#define TCP_RTO_MAX_BACKOFF 10
+
+#define TCP_OPT_EOL 0
+#define TCP_OPT_NOP 1
+#define TCP_OPT_SACK_PERM 4
+#define TCP_OPT_SACK 5
+
+enum {
+    TCP_CC_OPEN,
+    TCP_CC_LOSS,
+};
+
+enum {
+    TCP_TIMER_RTO,
+    TCP_TIMER_REO,              // RACK reordering window
+    TCP_TIMER_TLP,              // tail loss probe
+};
+
+enum {
+    BBR_STARTUP,
+    BBR_DRAIN,
+    BBR_PROBE_BW,
+    BBR_PROBE_RTT,
+};
+
+static const u32 bbr_pacing_gain[BBR_GAIN_CYCLE_LENGTH] = {
+    BBR_UNIT * 5 / 4, BBR_UNIT * 3 / 4, BBR_UNIT, BBR_UNIT,
+    BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT,
+};
+
+struct tcp_bbr {
+    struct minmax bw;           // bytes/s, max over BBR_BW_RTTS rounds
+    u32 min_rtt_us;
+    u64 min_rtt_stamp_us;
+    u64 delivered;
+    u64 round_start_delivered;
+    u64 round_start_us;
+    u64 next_round_delivered;   // delivered when this round's data is acked
+    u32 round_count;
+    u8 mode;
+    u8 cycle_index;
+    u8 full_bw_count;
+    u8 full_bw_reached;
+    u64 cycle_stamp_us;
+    u32 full_bw;
+    u64 probe_rtt_done_us;
+    u32 prior_cwnd;
+    u32 pacing_gain;
+    u32 cwnd_gain;
+    u32 inflight_hi;            // bytes, U32_MAX until loss sets it
+    u32 lost_in_round;
+};
+
+struct tcp_cubic {
+    u32 w_max;                  // cwnd at the last loss
+    u32 origin;
+    u32 k_ms;
+    u32 cnt;
+    u64 epoch_start_us;
+};
+
+struct tcp_sack_block {
+    u32 start_seq;
+    u32 end_seq;
+};
+
+// Segment i covers [base_seq + i * TCP_MSS, + TCP_MSS), clipped to the
+// unacknowledged range; data past TCP_SACK_SEGS is sent but not tracked.
+// Loss is RACK's: a segment is lost once one sent after it is delivered
+// and the reordering window has passed, not after three duplicate ACKs.
+struct tcp_scoreboard {
+    u32 base_seq;
+    DECLARE_BITMAP(sacked, TCP_SACK_SEGS);
+    DECLARE_BITMAP(lost, TCP_SACK_SEGS);
+    DECLARE_BITMAP(retrans, TCP_SACK_SEGS);
+    u32 xmit_us[TCP_SACK_SEGS];         // latest (re)transmission, truncated tcp_now_us()
+    u32 last_xmit_us;
+    u32 sacked_bytes;
+    u32 lost_bytes;                     // marked lost, not yet retransmitted
+    u32 highest_sacked;
+    
+    u32 rack_xmit_us;                   // newest send time among delivered segments
+    u32 rack_end_seq;
+    u32 rack_rtt_us;
+    u32 rack_min_rtt_us;
+    bool rack_valid;
+    bool reordering_seen;
+    
+    bool tlp_out;                       // probe sent, not yet acknowledged
+    bool tlp_retrans;                   // probe was a retransmission
+    u32 tlp_high_seq;
+    
+    u8 timer_mode;
+    u8 rto_backoff;
+};
+
+struct tcp_congestion_control;
+
+// conn->lock serializes everything that touches a live connection: the
+// receive path, the retransmit timeout on the wheel, the pacing release
+// on the shard hrtimer and the calls from the application. It nests
+// outside the shard's pacing_lock and wheel lock, and is never held while
+// waiting for a callback.
+struct tcp_connection {
+    spinlock_t lock;
+    u32 local_ip;
+    u32 remote_ip;
+    u16 local_port;
+    u16 remote_port;
+    u32 sequence_number;
+    u32 acknowledgment_number;
+    u32 window_size;
+    u8 state;
+    u32 rtt_us;
+    u32 rtt_var;
+    u32 ssthresh;
+    u32 cwnd;
+    u32 bytes_in_flight;            // pipe: outstanding less SACKed and lost
+    struct tw_timer retransmit_timer;   // on the owning shard's wheel
+    atomic_t retransmit_count;
+    u64 bytes_sent;
+    u64 bytes_received;
+    struct list_head conn_list;     // shard free_slots while unused
+    struct hlist_node hash_node;    // shard hash while in use
+    struct rcu_head rcu;
+    int cpu;                        // owning shard: segments and timer run here
+    bool dead;                      // destroyed, under lock: nothing may re-arm
+    u32 snd_nxt;
+    u32 rtt_seq;                    // segment being timed, one per RTT
+    u64 rtt_start_us;
+    bool rtt_timing;
+    u32 last_rtt_us;                // latest raw sample, for BBR's min_rtt
+    const struct tcp_congestion_control *cc;
+    union {
+        struct tcp_bbr bbr;
+        struct tcp_cubic cubic;
+    } cc_state;
+    u64 pacing_rate;                // bytes per second
+    u64 pace_next_ns;               // earliest departure of the next quantum
+    u32 pending_bytes;              // queued by the application, not yet sent
+    struct list_head pace_node;     // shard pacing wheel while waiting
+    // One call per pacing quantum: a single super-packet for
+    // nic_offload_xmit(), segmented at TCP_MSS by the NIC or by GSO
+    int (*xmit)(struct tcp_connection *conn, u32 bytes);
+    int (*retransmit)(struct tcp_connection *conn, u32 seq, u32 len);
+    bool sack_ok;                   // peer sent SACK-permitted
+    bool in_recovery;
+    u32 recovery_point;             // snd_nxt when recovery began
+    struct tcp_scoreboard *sack;
+};
+
+struct tcp_congestion_control {
+    char name[16];
+    void (*init)(struct tcp_connection *conn);
+    u32 (*ssthresh)(struct tcp_connection *conn);
+    u32 (*cong_avoid)(struct tcp_connection *conn, u32 ack, u32 acked);
+    void (*set_state)(struct tcp_connection *conn, u8 new_state);
+    u32 (*min_cwnd)(struct tcp_connection *conn);
+    void (*on_loss)(struct tcp_connection *conn, u32 lost_bytes);
+    u64 (*pacing_rate)(struct tcp_connection *conn);  // bytes per second
+};
+
+static struct tcp_connection tcp_connections[MAX_CONNECTIONS];
+
+// Connection table sharded per CPU. A connection belongs to the CPU
+// the NIC's RSS steers its segments to, so demux, state updates and its
+// retransmit timer all stay on one core and one shard lock; cores never
+// contend unless a connection is created or closed from elsewhere.
+// Retransmit timers share one timer wheel per shard, so re-arming on
+// every ACK is a list move rather than a kernel timer update.
+// Readers walk a shard's buckets under RCU, writers hold the shard lock.
+// A removed slot goes back on a free list only after a grace period, so
+// a reader never sees it reused under its feet.
+struct tcp_shard {
+    spinlock_t lock;
+    struct hlist_head *hash;
+    struct list_head free_slots;
+    int connection_count;
+    struct timer_wheel timers;
+    
+    spinlock_t pacing_lock;
+    struct hrtimer pacing_timer;
+    struct list_head pacing_slots[TCP_PACING_SLOTS];
+    DECLARE_BITMAP(pacing_busy, TCP_PACING_SLOTS);
+    u64 pacing_base_ns;         // start of the slot under pacing_cursor
+    unsigned int pacing_cursor;
+    unsigned int pacing_count;
+    struct tcp_connection *pacing_running;  // being released by tcp_pacing_tick
+} ____cacheline_aligned_in_smp;
+
+static struct tcp_shard *tcp_shards;
+static u32 tcp_hash_seed __read_mostly;
+
+// Software copy of the NIC's steering, for connections we open ourselves:
+// drivers take their Toeplitz key from netdev_rss_key_fill() and spread
+// queues round robin over the indirection table, one queue per core
+static u8 tcp_rss_key[NETDEV_RSS_KEY_LEN] __read_mostly;
+static u16 tcp_rss_indir[TCP_RSS_INDIR_SIZE] __read_mostly;
+
+static inline u32 tcp_conn_hashfn(u32 local_ip, u32 remote_ip, u16 local_port, u16 remote_port)
+{
+    return jhash_3words(local_ip, remote_ip, ((u32)local_port << 16) | remote_port,
+                        tcp_hash_seed);
+}
+
+static u32 tcp_toeplitz_hash(const u8 *data, int len)
+{
+    u32 v = get_unaligned_be32(tcp_rss_key);
+    u32 hash = 0;
+    int i, b;
+    
+    for (i = 0; i < len; i++) {
+        for (b = 7; b >= 0; b--) {
+            if (data[i] & (1 << b)) {
+                hash ^= v;
+            }
+            v = (v << 1) | ((tcp_rss_key[i + 4] >> b) & 1);
+        }
+    }
+    
+    return hash;
+}
+
+/**
+ * CPU the NIC delivers this connection's segments to
+ */
+static int tcp_rss_cpu(u32 local_ip, u32 remote_ip, u16 local_port, u16 remote_port)
+{
+    u8 tuple[12];
+    __be16 port;
+    
+    // Hash input is the incoming segment's saddr, daddr, sport, dport
+    memcpy(tuple, &remote_ip, 4);
+    memcpy(tuple + 4, &local_ip, 4);
+    port = htons(remote_port);
+    memcpy(tuple + 8, &port, 2);
+    port = htons(local_port);
+    memcpy(tuple + 10, &port, 2);
+    
+    return tcp_rss_indir[tcp_toeplitz_hash(tuple, sizeof(tuple)) % TCP_RSS_INDIR_SIZE];
+}
+
+/**
+ * Find connection by 4-tuple in a shard, caller holds rcu_read_lock()
+ */
+static struct tcp_connection *tcp_lookup_connection(struct tcp_shard *shard, u32 local_ip,
+                                                    u32 remote_ip, u16 local_port,
+                                                    u16 remote_port)
+{
+    struct tcp_connection *conn;
+    u32 hash = tcp_conn_hashfn(local_ip, remote_ip, local_port, remote_port);
+    
+    hlist_for_each_entry_rcu(conn, &shard->hash[hash_32(hash, TCP_SHARD_HASH_BITS)], hash_node) {
+        if (conn->local_ip == local_ip && conn->remote_ip == remote_ip &&
+            conn->local_port == local_port && conn->remote_port == remote_port) {
+            return conn;
+        }
+    }
+    
+    return NULL;
+}
+
+/**
+ * Take a free slot, from the given shard first, then from any other
+ */
+static struct tcp_connection *tcp_take_slot(struct tcp_shard *shard)
+{
+    struct tcp_connection *conn;
+    unsigned long flags;
+    
+    spin_lock_irqsave(&shard->lock, flags);
+    conn = list_first_entry_or_null(&shard->free_slots, struct tcp_connection, conn_list);
+    if (conn) {
+        list_del_init(&conn->conn_list);
+    }
+    spin_unlock_irqrestore(&shard->lock, flags);
+    
+    return conn;
+}
+
+static struct tcp_connection *tcp_alloc_slot(int cpu)
+{
+    struct tcp_connection *conn;
+    int other;
+    
+    conn = tcp_take_slot(&tcp_shards[cpu]);
+    if (conn) {
+        return conn;
+    }
+    
+    for_each_possible_cpu(other) {
+        if (other == cpu) {
+            continue;
+        }
+        conn = tcp_take_slot(&tcp_shards[other]);
+        if (conn) {
+            return conn;
+        }
+    }
+    
+    return NULL;
+}
+
+static inline u64 tcp_now_us(void)
+{
+    return div_u64(ktime_get_ns(), NSEC_PER_USEC);
+}
+
+/**
+ * BBR: model the path as bottleneck bandwidth and round-trip propagation
+ * time, send at that rate and keep about one BDP in flight, instead of
+ * filling buffers until they drop. The bandwidth estimate is a windowed
+ * max of per-round delivery rates, min_rtt a windowed min that PROBE_RTT
+ * refreshes. From BBRv2, a round with more than BBR_LOSS_THRESH loss caps
+ * inflight at BBR_BETA of what was in flight, so a policer or a shallow
+ * buffer is not hit every cycle.
+ */
+static void bbr_init(struct tcp_connection *conn)
+{
+    struct tcp_bbr *bbr = &conn->cc_state.bbr;
+    u64 now = tcp_now_us();
+    
+    memset(bbr, 0, sizeof(*bbr));
+    minmax_reset(&bbr->bw, 0, 0);
+    bbr->min_rtt_us = U32_MAX;
+    bbr->min_rtt_stamp_us = now;
+    bbr->round_start_us = now;
+    bbr->mode = BBR_STARTUP;
+    bbr->pacing_gain = BBR_HIGH_GAIN;
+    bbr->cwnd_gain = BBR_HIGH_GAIN;
+    bbr->inflight_hi = U32_MAX;
+    conn->cwnd = TCP_INIT_CWND;
+}
+
+// Bandwidth-delay product scaled by gain, in packets
+static u32 bbr_target_cwnd(struct tcp_connection *conn, u32 gain)
+{
+    struct tcp_bbr *bbr = &conn->cc_state.bbr;
+    u64 bdp;
+    
+    if (bbr->min_rtt_us == U32_MAX || !minmax_get(&bbr->bw)) {
+        return TCP_INIT_CWND;
+    }
+    
+    bdp = div_u64((u64)minmax_get(&bbr->bw) * bbr->min_rtt_us, USEC_PER_SEC);
+    return max_t(u32, DIV_ROUND_UP_ULL((bdp * gain) >> BBR_SCALE, TCP_MSS), BBR_MIN_CWND);
+}
+
+static void bbr_enter_probe_bw(struct tcp_bbr *bbr, u64 now)
+{
+    bbr->mode = BBR_PROBE_BW;
+    bbr->cwnd_gain = BBR_CWND_GAIN;
+    // Random phase, but never start in the 3/4 drain phase
+    bbr->cycle_index = BBR_GAIN_CYCLE_LENGTH - 1 - get_random_u32_below(BBR_GAIN_CYCLE_LENGTH - 1);
+    bbr->pacing_gain = bbr_pacing_gain[bbr->cycle_index];
+    bbr->cycle_stamp_us = now;
+}
+
+// End of a round trip: one delivery rate sample, full-pipe and loss checks
+static void bbr_round_end(struct tcp_connection *conn, u64 now)
+{
+    struct tcp_bbr *bbr = &conn->cc_state.bbr;
+    u64 delivered = bbr->delivered - bbr->round_start_delivered;
+    u64 interval = now - bbr->round_start_us;
+    u32 bw;
+    
+    if (interval && bbr->round_count) {
+        bw = (u32)min_t(u64, div64_u64(delivered * USEC_PER_SEC, interval), U32_MAX);
+        minmax_running_max(&bbr->bw, BBR_BW_RTTS, bbr->round_count, bw);
+    }
+    
+    // BBRv2 loss bound: too much loss in this round, back off inflight
+    if (bbr->lost_in_round && bbr->lost_in_round * 100ULL > delivered * BBR_LOSS_THRESH) {
+        u32 inflight = max_t(u32, conn->bytes_in_flight, BBR_MIN_CWND * TCP_MSS);
+    
+        bbr->inflight_hi = min_t(u32, bbr->inflight_hi, (inflight * BBR_BETA) >> BBR_SCALE);
+    } else if (bbr->inflight_hi != U32_MAX && bbr->mode == BBR_PROBE_BW &&
+               bbr->pacing_gain > BBR_UNIT) {
+        // Clean round while probing up: let the bound grow again
+        bbr->inflight_hi += TCP_MSS;
+    }
+    
+    // Pipe is full once bandwidth stops growing 25% over three rounds
+    if (bbr->mode == BBR_STARTUP) {
+        if (minmax_get(&bbr->bw) >= (bbr->full_bw * 5) / 4) {
+            bbr->full_bw = minmax_get(&bbr->bw);
+            bbr->full_bw_count = 0;
+        } else if (++bbr->full_bw_count >= 3) {
+            bbr->full_bw_reached = 1;
+            bbr->mode = BBR_DRAIN;
+            bbr->pacing_gain = BBR_DRAIN_GAIN;
+            bbr->cwnd_gain = BBR_HIGH_GAIN;
+        }
+    }
+    
+    bbr->lost_in_round = 0;
+    bbr->round_count++;
+    bbr->round_start_delivered = bbr->delivered;
+    bbr->round_start_us = now;
+    bbr->next_round_delivered = bbr->delivered + conn->bytes_in_flight;
+}
+
+static u32 bbr_cong_avoid(struct tcp_connection *conn, u32 ack, u32 acked)
+{
+    struct tcp_bbr *bbr = &conn->cc_state.bbr;
+    u64 now = tcp_now_us();
+    u32 rtt = conn->last_rtt_us;
+    u32 target, cwnd;
+    bool min_rtt_expired;
+    
+    bbr->delivered += acked;
+    if (bbr->delivered >= bbr->next_round_delivered) {
+        bbr_round_end(conn, now);
+    }
+    
+    // Windowed min RTT; an expired one means time to PROBE_RTT
+    min_rtt_expired = now - bbr->min_rtt_stamp_us > BBR_MIN_RTT_WIN_US;
+    if (rtt && (rtt <= bbr->min_rtt_us || min_rtt_expired)) {
+        bbr->min_rtt_us = rtt;
+        bbr->min_rtt_stamp_us = now;
+    }
+    if (min_rtt_expired && bbr->mode != BBR_PROBE_RTT) {
+        bbr->mode = BBR_PROBE_RTT;
+        bbr->pacing_gain = BBR_UNIT;
+        bbr->cwnd_gain = BBR_UNIT;
+        bbr->prior_cwnd = conn->cwnd;
+        bbr->probe_rtt_done_us = 0;
+    }
+    
+    switch (bbr->mode) {
+    case BBR_DRAIN:
+        // Queue built in STARTUP is gone once inflight fits one BDP
+        if (conn->bytes_in_flight <= bbr_target_cwnd(conn, BBR_UNIT) * TCP_MSS) {
+            bbr_enter_probe_bw(bbr, now);
+        }
+        break;
+    case BBR_PROBE_BW:
+        // One gain phase per min_rtt: probe up, drain, then cruise
+        if (now - bbr->cycle_stamp_us > bbr->min_rtt_us) {
+            bbr->cycle_index = (bbr->cycle_index + 1) % BBR_GAIN_CYCLE_LENGTH;
+            bbr->pacing_gain = bbr_pacing_gain[bbr->cycle_index];
+            bbr->cycle_stamp_us = now;
+        }
+        break;
+    case BBR_PROBE_RTT:
+        // BBR_MIN_CWND in flight for BBR_PROBE_RTT_US and a round trip
+        if (!bbr->probe_rtt_done_us && conn->bytes_in_flight <= BBR_MIN_CWND * TCP_MSS) {
+            bbr->probe_rtt_done_us = now + BBR_PROBE_RTT_US;
+            bbr->next_round_delivered = bbr->delivered;
+        } else if (bbr->probe_rtt_done_us && now > bbr->probe_rtt_done_us) {
+            bbr->min_rtt_stamp_us = now;
+            conn->cwnd = max(conn->cwnd, bbr->prior_cwnd);
+            if (bbr->full_bw_reached) {
+                bbr_enter_probe_bw(bbr, now);
+            } else {
+                bbr->mode = BBR_STARTUP;
+                bbr->pacing_gain = BBR_HIGH_GAIN;
+                bbr->cwnd_gain = BBR_HIGH_GAIN;
+            }
+        }
+        break;
+    default:
+        break;
+    }
+    
+    if (bbr->mode == BBR_PROBE_RTT) {
+        return BBR_MIN_CWND;
+    }
+    
+    // Grow toward the target by what was delivered, never jump to it
+    target = bbr_target_cwnd(conn, bbr->cwnd_gain);
+    cwnd = conn->cwnd + DIV_ROUND_UP(acked, TCP_MSS);
+    if (bbr->full_bw_reached) {
+        cwnd = min(cwnd, target);
+    }
+    if (bbr->inflight_hi != U32_MAX) {
+        cwnd = min(cwnd, bbr->inflight_hi / TCP_MSS);
+    }
+    
+    return max_t(u32, cwnd, BBR_MIN_CWND);
+}
+
+static void bbr_on_loss(struct tcp_connection *conn, u32 lost_bytes)
+{
+    conn->cc_state.bbr.lost_in_round += lost_bytes;
+}
+
+static void bbr_set_state(struct tcp_connection *conn, u8 new_state)
+{
+    struct tcp_bbr *bbr = &conn->cc_state.bbr;
+    
+    if (new_state == TCP_CC_LOSS) {
+        // RTO: packet conservation, cong_avoid grows back toward the BDP
+        bbr->prior_cwnd = conn->cwnd;
+        conn->cwnd = 1;
+        bbr->round_start_delivered = bbr->delivered;
+        bbr->round_start_us = tcp_now_us();
+        bbr->next_round_delivered = bbr->delivered;
+    }
+}
+
+static u32 bbr_min_cwnd(struct tcp_connection *conn)
+{
+    return BBR_MIN_CWND;
+}
+
+static u64 bbr_pacing_rate(struct tcp_connection *conn)
+{
+    struct tcp_bbr *bbr = &conn->cc_state.bbr;
+    u64 bw = minmax_get(&bbr->bw);
+    
+    if (!bw) {
+        // No sample yet: initial window over the smoothed RTT (or 1 ms)
+        bw = div_u64((u64)TCP_INIT_CWND * TCP_MSS * USEC_PER_SEC, max(conn->rtt_us, 1000U));
+    }
+    
+    return (bw * bbr->pacing_gain) >> BBR_SCALE;
+}
+
+/**
+ * CUBIC (RFC 9438) as the loss-based baseline: after a loss the window
+ * follows W(t) = C (t - K)^3 + W_max, flat around the last loss point and
+ * probing fast away from it.
+ */
+static void cubic_init(struct tcp_connection *conn)
+{
+    memset(&conn->cc_state.cubic, 0, sizeof(conn->cc_state.cubic));
+    conn->cwnd = TCP_INIT_CWND;
+    conn->ssthresh = U32_MAX;
+}
+
+static u32 cubic_root(u64 a)
+{
+    u64 x = 1ULL << ((fls64(a) + 2) / 3);
+    u64 prev;
+    
+    // Newton's iteration from above converges in a few steps
+    if (!a) {
+        return 0;
+    }
+    do {
+        prev = x;
+        x = div64_u64(2 * x + div64_u64(a, x * x), 3);
+    } while (x < prev);
+    
+    return (u32)prev;
+}
+
+static u32 cubic_cong_avoid(struct tcp_connection *conn, u32 ack, u32 acked)
+{
+    struct tcp_cubic *cubic = &conn->cc_state.cubic;
+    u32 acked_pkts = DIV_ROUND_UP(acked, TCP_MSS);
+    u64 now = tcp_now_us();
+    u64 t_ms, offs, delta;
+    u32 target;
+    
+    if (conn->cwnd < conn->ssthresh) {
+        return conn->cwnd + acked_pkts;     // slow start
+    }
+    
+    if (!cubic->epoch_start_us) {
+        cubic->epoch_start_us = now;
+        if (cubic->w_max <= conn->cwnd) {
+            cubic->k_ms = 0;
+            cubic->origin = conn->cwnd;
+        } else {
+            // K = cbrt(W_max (1 - beta) / C), in ms
+            cubic->k_ms = cubic_root((u64)(cubic->w_max - conn->cwnd) * CUBIC_K_SCALE);
+            cubic->origin = cubic->w_max;
+        }
+    }
+    
+    // Target one RTT ahead, C = 0.4 packets/s^3
+    t_ms = div_u64(now - cubic->epoch_start_us + conn->rtt_us, USEC_PER_MSEC);
+    offs = t_ms > cubic->k_ms ? t_ms - cubic->k_ms : cubic->k_ms - t_ms;
+    offs = min_t(u64, offs, CUBIC_MAX_OFFS_MS);
+    delta = div64_u64(offs * offs * offs * 4, 10000000000ULL);
+    if (t_ms > cubic->k_ms) {
+        target = (u32)min_t(u64, cubic->origin + delta, U32_MAX);
+    } else {
+        target = cubic->origin > delta ? cubic->origin - (u32)delta : 1;
+    }
+    
+    // cwnd/(target - cwnd) ACKed packets per increment
+    cubic->cnt += acked_pkts;
+    if (target > conn->cwnd && cubic->cnt * (target - conn->cwnd) >= conn->cwnd) {
+        cubic->cnt = 0;
+        return conn->cwnd + 1;
+    }
+    if (cubic->cnt >= 100 * conn->cwnd) {
+        cubic->cnt = 0;
+        return conn->cwnd + 1;              // at the plateau, creep
+    }
+    
+    return conn->cwnd;
+}
+
+static u32 cubic_ssthresh(struct tcp_connection *conn)
+{
+    return max_t(u32, (conn->cwnd * CUBIC_BETA) >> 10, 2);
+}
+
+static void cubic_on_loss(struct tcp_connection *conn, u32 lost_bytes)
+{
+    struct tcp_cubic *cubic = &conn->cc_state.cubic;
+    
+    // Fast convergence: a flow losing below its last W_max yields room
+    if (conn->cwnd < cubic->w_max) {
+        cubic->w_max = (conn->cwnd * (1024 + CUBIC_BETA)) / 2048;
+    } else {
+        cubic->w_max = conn->cwnd;
+    }
+    cubic->epoch_start_us = 0;
+    conn->cwnd = conn->ssthresh;
+}
+
+static void cubic_set_state(struct tcp_connection *conn, u8 new_state)
+{
+    if (new_state == TCP_CC_LOSS) {
+        conn->cwnd = 1;
+        conn->cc_state.cubic.epoch_start_us = 0;
+    }
+}
+
+static u32 cubic_min_cwnd(struct tcp_connection *conn)
+{
+    return 2;
+}
+
+// Paced like Linux with fq: 2x cwnd/srtt in slow start, 1.2x after
+static u64 cubic_pacing_rate(struct tcp_connection *conn)
+{
+    u64 rate = div_u64((u64)conn->cwnd * TCP_MSS * USEC_PER_SEC, max(conn->rtt_us, 1000U));
+    
+    return conn->cwnd < conn->ssthresh ? rate * 2 : rate * 6 / 5;
+}
+
+static const struct tcp_congestion_control tcp_cc_algorithms[] = {
+    {
+        .name = "bbr",
+        .init = bbr_init,
+        .ssthresh = NULL,       // BBR doesn't use ssthresh
+        .cong_avoid = bbr_cong_avoid,
+        .set_state = bbr_set_state,
+        .min_cwnd = bbr_min_cwnd,
+        .on_loss = bbr_on_loss,
+        .pacing_rate = bbr_pacing_rate,
+    },
+    {
+        .name = "cubic",
+        .init = cubic_init,
+        .ssthresh = cubic_ssthresh,
+        .cong_avoid = cubic_cong_avoid,
+        .set_state = cubic_set_state,
+        .min_cwnd = cubic_min_cwnd,
+        .on_loss = cubic_on_loss,
+        .pacing_rate = cubic_pacing_rate,
+    },
+};
+
+/**
+ * Select congestion control for a connection by name
+ */
+static int tcp_set_congestion_control(int conn_id, const char *name)
+{
+    struct tcp_connection *conn;
+    unsigned long flags;
+    int i;
+    
+    if (conn_id < 0 || conn_id >= MAX_CONNECTIONS) {
+        return -EINVAL;
+    }
+    conn = &tcp_connections[conn_id];
+    
+    for (i = 0; i < ARRAY_SIZE(tcp_cc_algorithms); i++) {
+        if (!strcmp(tcp_cc_algorithms[i].name, name)) {
+            spin_lock_irqsave(&conn->lock, flags);
+            conn->cc = &tcp_cc_algorithms[i];
+            conn->cc->init(conn);
+            conn->pacing_rate = conn->cc->pacing_rate(conn);
+            spin_unlock_irqrestore(&conn->lock, flags);
+            return 0;
+        }
+    }
+    
+    return -ENOENT;
+}
+
+/**
+ * Loss signal for the congestion controller, timeout for an RTO
+ */
+static void tcp_cc_loss(struct tcp_connection *conn, u32 lost_bytes, bool timeout)
+{
+    const struct tcp_congestion_control *cc = conn->cc;
+    
+    if (cc->ssthresh) {
+        conn->ssthresh = cc->ssthresh(conn);
+    }
+    cc->on_loss(conn, lost_bytes);
+    if (timeout) {
+        cc->set_state(conn, TCP_CC_LOSS);
+    }
+    conn->cwnd = max(conn->cwnd, timeout ? 1U : cc->min_cwnd(conn));
+    conn->pacing_rate = cc->pacing_rate(conn);
+}
+
+static inline bool tcp_seq_before(u32 a, u32 b)
+{
+    return (s32)(a - b) < 0;
+}
+
+static inline bool tcp_seq_after(u32 a, u32 b)
+{
+    return (s32)(a - b) > 0;
+}
+
+/**
+ * Unacknowledged bytes of scoreboard segment i, and where they start
+ */
+static u32 tcp_sack_seg_len(struct tcp_connection *conn, unsigned int i, u32 *start)
+{
+    u32 s = conn->sack->base_seq + i * TCP_MSS;
+    u32 e = s + TCP_MSS;
+    
+    if (tcp_seq_before(s, conn->acknowledgment_number)) {
+        s = conn->acknowledgment_number;
+    }
+    if (tcp_seq_after(e, conn->snd_nxt)) {
+        e = conn->snd_nxt;
+    }
+    if (start) {
+        *start = s;
+    }
+    
+    return tcp_seq_after(e, s) ? e - s : 0;
+}
+
+static unsigned int tcp_sack_nsegs(struct tcp_connection *conn)
+{
+    return min_t(u32, DIV_ROUND_UP(conn->snd_nxt - conn->sack->base_seq, TCP_MSS), TCP_SACK_SEGS);
+}
+
+static u32 tcp_sack_sum(struct tcp_connection *conn, const unsigned long *map)
+{
+    unsigned int i;
+    u32 bytes = 0;
+    
+    for_each_set_bit(i, map, tcp_sack_nsegs(conn)) {
+        bytes += tcp_sack_seg_len(conn, i, NULL);
+    }
+    
+    return bytes;
+}
+
+/**
+ * Recompute SACKed and lost bytes and the pipe (RFC 6675) from the bitmaps
+ */
+static void tcp_sack_recount(struct tcp_connection *conn)
+{
+    struct tcp_scoreboard *sb = conn->sack;
+    DECLARE_BITMAP(unrepaired, TCP_SACK_SEGS);
+    u32 outstanding = conn->snd_nxt - conn->acknowledgment_number;
+    unsigned int nsegs = tcp_sack_nsegs(conn);
+    unsigned int last = find_last_bit(sb->sacked, nsegs);
+    u32 start;
+    
+    bitmap_andnot(unrepaired, sb->lost, sb->retrans, TCP_SACK_SEGS);
+    sb->sacked_bytes = tcp_sack_sum(conn, sb->sacked);
+    if (last < nsegs) {
+        u32 len = tcp_sack_seg_len(conn, last, &start);
+    
+        sb->highest_sacked = start + len;
+    }
+    sb->lost_bytes = tcp_sack_sum(conn, unrepaired);
+    conn->bytes_in_flight = outstanding - min(outstanding, sb->sacked_bytes + sb->lost_bytes);
+}
+
+static void tcp_sack_stamp(struct tcp_scoreboard *sb, u32 start, u32 end, u32 now)
+{
+    u32 i = (start - sb->base_seq) / TCP_MSS;
+    u32 last = (end - 1 - sb->base_seq) / TCP_MSS;
+    
+    for (; i <= last && i < TCP_SACK_SEGS; i++) {
+        sb->xmit_us[i] = now;
+    }
+    sb->last_xmit_us = now;
+}
+
+/**
+ * RACK: remember the most recently sent segment known to be delivered
+ */
+static void tcp_rack_update(struct tcp_connection *conn, unsigned int i, u32 end_seq, u32 now)
+{
+    struct tcp_scoreboard *sb = conn->sack;
+    u32 xmit = sb->xmit_us[i];
+    u32 rtt = now - xmit;
+    
+    // Faster than the path allows: the ACK is for the original, not the
+    // retransmission
+    if (test_bit(i, sb->retrans) && rtt < sb->rack_min_rtt_us) {
+        return;
+    }
+    sb->rack_rtt_us = rtt;
+    sb->rack_min_rtt_us = min(sb->rack_min_rtt_us, rtt);
+    if (!sb->rack_valid || (s32)(xmit - sb->rack_xmit_us) > 0 ||
+        (xmit == sb->rack_xmit_us && tcp_seq_after(end_seq, sb->rack_end_seq))) {
+        sb->rack_xmit_us = xmit;
+        sb->rack_end_seq = end_seq;
+        sb->rack_valid = true;
+    }
+}
+
+// A never-retransmitted segment arriving below one already SACKed
+static void tcp_sack_note_delivery(struct tcp_connection *conn, unsigned int i, u32 end_seq, u32 now)
+{
+    struct tcp_scoreboard *sb = conn->sack;
+    
+    if (!test_bit(i, sb->retrans) && sb->sacked_bytes &&
+        tcp_seq_before(end_seq, sb->highest_sacked)) {
+        sb->reordering_seen = true;
+    }
+    tcp_rack_update(conn, i, end_seq, now);
+}
+
+/**
+ * Cumulative ACK: deliver the segments it covers and slide the board
+ */
+static u32 tcp_sack_ack(struct tcp_connection *conn, u32 ack_num, u32 now)
+{
+    struct tcp_scoreboard *sb = conn->sack;
+    u32 outstanding = conn->snd_nxt - conn->acknowledgment_number;
+    u32 acked, shift, i;
+    
+    if (!tcp_seq_after(ack_num, conn->acknowledgment_number)) {
+        return 0;
+    }
+    acked = min(ack_num - conn->acknowledgment_number, outstanding);
+    ack_num = conn->acknowledgment_number + acked;
+    
+    for (i = 0; i < tcp_sack_nsegs(conn); i++) {
+        u32 start, end;
+        u32 len = tcp_sack_seg_len(conn, i, &start);
+    
+        end = start + len;
+        if (tcp_seq_after(end, ack_num)) {
+            break;
+        }
+        if (len && !test_bit(i, sb->sacked)) {
+            tcp_sack_note_delivery(conn, i, end, now);
+        }
+    }
+    
+    conn->acknowledgment_number = ack_num;
+    shift = (ack_num - sb->base_seq) / TCP_MSS;
+    if (shift >= TCP_SACK_SEGS) {
+        bitmap_zero(sb->sacked, TCP_SACK_SEGS);
+        bitmap_zero(sb->lost, TCP_SACK_SEGS);
+        bitmap_zero(sb->retrans, TCP_SACK_SEGS);
+        for (i = 0; i < TCP_SACK_SEGS; i++) {
+            sb->xmit_us[i] = sb->last_xmit_us;
+        }
+    } else if (shift) {
+        bitmap_shift_right(sb->sacked, sb->sacked, shift, TCP_SACK_SEGS);
+        bitmap_shift_right(sb->lost, sb->lost, shift, TCP_SACK_SEGS);
+        bitmap_shift_right(sb->retrans, sb->retrans, shift, TCP_SACK_SEGS);
+        memmove(sb->xmit_us, sb->xmit_us + shift, (TCP_SACK_SEGS - shift) * sizeof(u32));
+        // Segments sent beyond the old span: assume the latest send time
+        for (i = TCP_SACK_SEGS - shift; i < TCP_SACK_SEGS; i++) {
+            sb->xmit_us[i] = sb->last_xmit_us;
+        }
+    }
+    sb->base_seq += shift * TCP_MSS;
+    
+    return acked;
+}
+
+/**
+ * Walk TCP options: SACK-permitted on SYNs, SACK blocks on ACKs
+ */
+static int tcp_parse_options(const struct tcphdr *th, bool *sack_perm,
+                             struct tcp_sack_block *blocks)
+{
+    const u8 *ptr = (const u8 *)(th + 1);
+    int length = th->doff * 4 - (int)sizeof(*th);
+    int nblocks = 0;
+    
+    while (length > 0) {
+        u8 kind = *ptr++;
+        u8 size;
+        int j;
+    
+        if (kind == TCP_OPT_EOL) {
+            break;
+        }
+        if (kind == TCP_OPT_NOP) {
+            length--;
+            continue;
+        }
+        if (length < 2) {
+            break;
+        }
+        size = *ptr++;
+        if (size < 2 || size > length) {
+            break;              // malformed
+        }
+    
+        if (kind == TCP_OPT_SACK_PERM && size == 2) {
+            *sack_perm = true;
+        } else if (kind == TCP_OPT_SACK && size >= 10 && !((size - 2) % 8)) {
+            nblocks = min((size - 2) / 8, TCP_MAX_SACK_BLOCKS);
+            for (j = 0; j < nblocks; j++) {
+                blocks[j].start_seq = get_unaligned_be32(ptr + 8 * j);
+                blocks[j].end_seq = get_unaligned_be32(ptr + 8 * j + 4);
+            }
+        }
+        ptr += size - 2;
+        length -= size;
+    }
+    
+    return nblocks;
+}
+
+/**
+ * Mark segments the peer SACKed; returns true for a D-SACK (RFC 2883)
+ */
+static bool tcp_sack_mark(struct tcp_connection *conn, struct tcp_sack_block *blocks,
+                          int nblocks, u32 ack_num, u32 now)
+{
+    struct tcp_scoreboard *sb = conn->sack;
+    unsigned int nsegs = tcp_sack_nsegs(conn);
+    bool dsack = false;
+    int b;
+    
+    // A first block below the ACK, or inside the second, reports a duplicate
+    if (nblocks && (!tcp_seq_after(blocks[0].end_seq, ack_num) ||
+                    (nblocks > 1 && !tcp_seq_before(blocks[0].start_seq, blocks[1].start_seq) &&
+                     !tcp_seq_after(blocks[0].end_seq, blocks[1].end_seq)))) {
+        dsack = true;
+        sb->reordering_seen = true;
+    }
+    
+    for (b = dsack ? 1 : 0; b < nblocks; b++) {
+        u32 start = blocks[b].start_seq;
+        u32 end = blocks[b].end_seq;
+        unsigned int i;
+    
+        // Ignore blocks outside what we have sent
+        if (!tcp_seq_after(end, start) || tcp_seq_after(end, conn->snd_nxt) ||
+            !tcp_seq_after(end, conn->acknowledgment_number)) {
+            continue;
+        }
+    
+        for (i = 0; i < nsegs; i++) {
+            u32 seg_start;
+            u32 len = tcp_sack_seg_len(conn, i, &seg_start);
+    
+            if (!len || tcp_seq_before(seg_start, start)) {
+                continue;
+            }
+            if (tcp_seq_after(seg_start + len, end)) {
+                break;
+            }
+            if (__test_and_set_bit(i, sb->sacked)) {
+                continue;
+            }
+            if (test_bit(i, sb->lost) && !test_bit(i, sb->retrans)) {
+                sb->reordering_seen = true;     // marked lost, then arrived
+            }
+            __clear_bit(i, sb->lost);
+            tcp_sack_note_delivery(conn, i, seg_start + len, now);
+        }
+    }
+    
+    return dsack;
+}
+
+// RFC 8985 6.2: no window until reordering is seen, once DupThresh
+// segments are SACKed or recovery has begun
+static u32 tcp_rack_reo_wnd(struct tcp_connection *conn)
+{
+    struct tcp_scoreboard *sb = conn->sack;
+    
+    if (!sb->reordering_seen &&
+        (conn->in_recovery || sb->sacked_bytes >= TCP_DUPTHRESH * TCP_MSS)) {
+        return 0;
+    }
+    
+    return min(sb->rack_min_rtt_us / 4, max(conn->rtt_us, 1U));
+}
+
+/**
+ * RACK loss detection: a segment sent before the newest delivered one is
+ * lost once RACK.rtt plus the reordering window has passed since it left.
+ * Returns bytes newly marked lost; *timeout is when to look again.
+ */
+static u32 tcp_rack_detect_loss(struct tcp_connection *conn, u32 now, u32 *timeout)
+{
+    struct tcp_scoreboard *sb = conn->sack;
+    unsigned int nsegs = tcp_sack_nsegs(conn);
+    u32 reo_wnd, lost = 0;
+    unsigned int i;
+    
+    *timeout = 0;
+    if (!sb->rack_valid) {
+        return 0;
+    }
+    reo_wnd = tcp_rack_reo_wnd(conn);
+    
+    for (i = 0; i < nsegs; i++) {
+        u32 start, xmit = sb->xmit_us[i];
+        u32 len = tcp_sack_seg_len(conn, i, &start);
+        s32 remaining;
+    
+        if (!len || test_bit(i, sb->sacked) ||
+            (test_bit(i, sb->lost) && !test_bit(i, sb->retrans))) {
+            continue;
+        }
+        if ((s32)(sb->rack_xmit_us - xmit) < 0 ||
+            (xmit == sb->rack_xmit_us && !tcp_seq_after(sb->rack_end_seq, start + len))) {
+            continue;           // sent after the newest delivered segment
+        }
+    
+        remaining = (s32)(xmit + sb->rack_rtt_us + reo_wnd - now);
+        if (remaining <= 0) {
+            __set_bit(i, sb->lost);
+            __clear_bit(i, sb->retrans);    // a lost retransmission goes again
+            lost += len;
+        } else {
+            *timeout = max_t(u32, *timeout, remaining);
+        }
+    }
+    if (lost) {
+        tcp_sack_recount(conn);
+    }
+    
+    return lost;
+}
+
+/**
+ * One congestion response per recovery episode; an RTO always responds
+ */
+static void tcp_enter_recovery(struct tcp_connection *conn, u32 lost_bytes, bool timeout)
+{
+    if (conn->in_recovery && !timeout) {
+        return;
+    }
+    conn->in_recovery = true;
+    conn->recovery_point = conn->snd_nxt;
+    tcp_cc_loss(conn, lost_bytes, timeout);
+}
+
+/**
+ * Retransmit segments marked lost, oldest first, up to budget bytes.
+ * Returns bytes sent or -EBUSY if the device took nothing.
+ */
+static int tcp_retransmit_lost(struct tcp_connection *conn, u32 budget)
+{
+    struct tcp_scoreboard *sb = conn->sack;
+    DECLARE_BITMAP(todo, TCP_SACK_SEGS);
+    u32 now = (u32)tcp_now_us();
+    unsigned int i;
+    u32 sent = 0;
+    
+    if (!sb->lost_bytes) {
+        return 0;
+    }
+    
+    bitmap_andnot(todo, sb->lost, sb->retrans, TCP_SACK_SEGS);
+    for_each_set_bit(i, todo, tcp_sack_nsegs(conn)) {
+        u32 start;
+        u32 len = tcp_sack_seg_len(conn, i, &start);
+    
+        if (!len) {
+            continue;
+        }
+        if (sent && sent + len > budget) {
+            break;
+        }
+        if (conn->retransmit && conn->retransmit(conn, start, len) < 0) {
+            break;
+        }
+        __set_bit(i, sb->retrans);
+        sb->xmit_us[i] = now;
+        conn->bytes_sent += len;
+        atomic_inc(&conn->retransmit_count);
+        sent += len;
+    }
+    if (!sent) {
+        return -EBUSY;
+    }
+    
+    conn->rtt_timing = false;   // Karn: no samples across retransmissions
+    tcp_sack_recount(conn);
+    return sent;
+}
+
+static inline bool tcp_has_data_to_send(struct tcp_connection *conn)
+{
+    return conn->pending_bytes || conn->sack->lost_bytes;
+}
+
+/**
+ * Arm the connection's one timer, on the wheel of its own CPU, as RTO,
+ * RACK reordering timer or tail loss probe. Every re-arm of the
+ * scoreboard's timer ends here, so this is where a destroyed connection
+ * is refused.
+ */
+static void tcp_arm_retransmit_timer(struct tcp_connection *conn, u8 mode, u32 timeout_us)
+{
+    lockdep_assert_held(&conn->lock);
+    if (conn->dead) {
+        return;
+    }
+    if (mode == TCP_TIMER_RTO) {
+        timeout_us = clamp_t(u32, timeout_us, TCP_RTO_MIN * USEC_PER_MSEC,
+                             TCP_RTO_MAX * USEC_PER_MSEC);
+    }
+    conn->sack->timer_mode = mode;
+    timer_wheel_mod(&tcp_shards[conn->cpu].timers, &conn->retransmit_timer,
+                    jiffies + usecs_to_jiffies(timeout_us));
+}
+
+static void tcp_cancel_retransmit_timer(struct tcp_connection *conn)
+{
+    timer_wheel_del(&tcp_shards[conn->cpu].timers, &conn->retransmit_timer);
+}
+
+/**
+ * Pick the timer for what is outstanding: a pending RACK reordering
+ * window first, then a probe one step ahead of the RTO (RFC 8985 7.2)
+ */
+static void tcp_rearm_timers(struct tcp_connection *conn, u32 reo_timeout_us)
+{
+    struct tcp_scoreboard *sb = conn->sack;
+    u32 outstanding = conn->snd_nxt - conn->acknowledgment_number;
+    u64 rto_us;
+    u32 pto_us;
+    
+    // Called from the ACK path, the timeout and the pacing release, all
+    // of which bail out first on a dead connection: the scoreboard is
+    // still allocated here
+    lockdep_assert_held(&conn->lock);
+    if (conn->dead) {
+        return;
+    }
+    if (!outstanding) {
+        tcp_cancel_retransmit_timer(conn);
+        return;
+    }
+    if (reo_timeout_us) {
+        tcp_arm_retransmit_timer(conn, TCP_TIMER_REO, reo_timeout_us);
+        return;
+    }
+    
+    // RFC 6298, doubled per consecutive timeout
+    rto_us = max_t(u64, conn->rtt_us + 4 * conn->rtt_var, TCP_RTO_MIN * USEC_PER_MSEC);
+    rto_us = min_t(u64, rto_us << sb->rto_backoff, TCP_RTO_MAX * USEC_PER_MSEC);
+    
+    if (!conn->in_recovery && !sb->tlp_out && conn->rtt_us) {
+        pto_us = 2 * conn->rtt_us;
+        if (outstanding <= TCP_MSS) {
+            pto_us += TCP_TLP_WCDELACK_US;
+        }
+        if (pto_us < rto_us) {
+            tcp_arm_retransmit_timer(conn, TCP_TIMER_TLP, pto_us);
+            return;
+        }
+    }
+    tcp_arm_retransmit_timer(conn, TCP_TIMER_RTO, (u32)rto_us);
+}
 
-struct tcp_connection {
-    u32 local_ip;
-    u32 remote_ip;
-    u16 local_port;
-    u16 remote_port;
-    u32 sequence_number;
-    u32 acknowledgment_number;
-    u32 window_size;
-    u8 state;
-    u32 rtt_us;
-    u32 rtt_var;
-    u32 ssthresh;
-    u32 cwnd;
-    u32 bytes_in_flight;
-    struct timer_list retransmit_timer;
-    atomic_t retransmit_count;
-    u64 bytes_sent;
-    u64 bytes_received;
-    struct list_head conn_list;
-};
+/**
+ * Account a segment handed to the device, time one segment per RTT
+ */
+static void tcp_on_send(struct tcp_connection *conn, u32 bytes)
+{
+    conn->bytes_sent += bytes;
+    conn->bytes_in_flight += bytes;
+    tcp_sack_stamp(conn->sack, conn->snd_nxt, conn->snd_nxt + bytes, (u32)tcp_now_us());
+    if (!conn->rtt_timing) {
+        conn->rtt_seq = conn->snd_nxt + bytes;
+        conn->rtt_start_us = tcp_now_us();
+        conn->rtt_timing = true;
+    }
+    conn->snd_nxt += bytes;
+}
 
-struct tcp_congestion_control {
-    char name[16];
-    u32 (*ssthresh)(struct tcp_connection *conn);
-    u32 (*cong_avoid)(struct tcp_connection *conn, u32 ack, u32 acked);
-    void (*set_state)(struct tcp_connection *conn, u8 new_state);
-    u32 (*min_cwnd)(struct tcp_connection *conn);
-};
+/**
+ * Pacing: each shard keeps an EDF timing wheel of connections waiting
+ * for their next departure time, slots of TCP_PACING_SLOT_NS over a
+ * TCP_PACING_SLOTS horizon, with a bitmap of busy slots. One pinned soft
+ * hrtimer per shard fires at the earliest busy slot and releases every
+ * connection due there, so the cost is one timer per slot that has work,
+ * not one per connection or per packet. Deadlines past the horizon sit
+ * in the last slot and are requeued when it comes up.
+ */
+static void tcp_pacing_arm(struct tcp_shard *shard)
+{
+    unsigned int next, dist;
+    u64 start;
+    
+    lockdep_assert_held(&shard->pacing_lock);
+    if (!shard->pacing_count) {
+        return;
+    }
+    
+    next = find_next_bit(shard->pacing_busy, TCP_PACING_SLOTS, shard->pacing_cursor);
+    if (next >= TCP_PACING_SLOTS) {
+        next = find_first_bit(shard->pacing_busy, TCP_PACING_SLOTS);
+    }
+    dist = (next + TCP_PACING_SLOTS - shard->pacing_cursor) % TCP_PACING_SLOTS;
+    start = shard->pacing_base_ns + (u64)dist * TCP_PACING_SLOT_NS;
+    
+    // Restarting the timer from its own callback or another CPU is fine
+    if (!hrtimer_is_queued(&shard->pacing_timer) ||
+        start < ktime_to_ns(hrtimer_get_expires(&shard->pacing_timer))) {
+        hrtimer_start(&shard->pacing_timer, ns_to_ktime(start), HRTIMER_MODE_ABS_PINNED_SOFT);
+    }
+}
 
-static struct tcp_connection tcp_connections[MAX_CONNECTIONS];
-static struct tcp_congestion_control bbr_cc;
-static int tcp_connection_count = 0;
-static DEFINE_SPINLOCK(tcp_stack_lock);
+static void tcp_pacing_schedule(struct tcp_connection *conn)
+{
+    struct tcp_shard *shard = &tcp_shards[conn->cpu];
+    u64 now = ktime_get_ns();
+    u64 deadline = max(conn->pace_next_ns, now);
+    unsigned long flags;
+    u64 offset;
+    unsigned int slot;
+    
+    lockdep_assert_held(&conn->lock);
+    spin_lock_irqsave(&shard->pacing_lock, flags);
+    if (!list_empty(&conn->pace_node) || conn->dead) {
+        goto out;               // already waiting, or destroyed
+    }
+    if (!shard->pacing_count) {
+        shard->pacing_base_ns = now;
+    }
+    
+    offset = deadline > shard->pacing_base_ns ?
+             div_u64(deadline - shard->pacing_base_ns, TCP_PACING_SLOT_NS) : 0;
+    offset = min_t(u64, offset, TCP_PACING_SLOTS - 1);
+    slot = (shard->pacing_cursor + offset) % TCP_PACING_SLOTS;
+    
+    list_add_tail(&conn->pace_node, &shard->pacing_slots[slot]);
+    __set_bit(slot, shard->pacing_busy);
+    shard->pacing_count++;
+    tcp_pacing_arm(shard);
+out:
+    spin_unlock_irqrestore(&shard->pacing_lock, flags);
+}
+
+/**
+ * Take a dead connection off the pacing wheel and wait out a release
+ * tcp_pacing_tick is running for it
+ */
+static void tcp_pacing_cancel_sync(struct tcp_connection *conn)
+{
+    struct tcp_shard *shard = &tcp_shards[conn->cpu];
+    unsigned long flags;
+    
+    spin_lock_irqsave(&shard->pacing_lock, flags);
+    for (;;) {
+        if (!list_empty(&conn->pace_node)) {
+            list_del_init(&conn->pace_node);
+            shard->pacing_count--;
+        }
+        if (shard->pacing_running != conn) {
+            break;
+        }
+        spin_unlock_irqrestore(&shard->pacing_lock, flags);
+        cpu_relax();
+        spin_lock_irqsave(&shard->pacing_lock, flags);
+    }
+    spin_unlock_irqrestore(&shard->pacing_lock, flags);
+}
+
+/**
+ * Send one pacing quantum if the window allows, then wait for the next.
+ * Segments marked lost go first, so holes are repaired before new data.
+ */
+static void tcp_pacing_release(struct tcp_connection *conn)
+{
+    u32 window = conn->cwnd * TCP_MSS;
+    u32 quantum, bytes;
+    u64 now = ktime_get_ns();
+    int sent;
+    
+    if (conn->dead) {
+        return;
+    }
+    if (conn->pace_next_ns > now + TCP_PACING_SLOT_NS) {
+        tcp_pacing_schedule(conn);          // parked past the horizon
+        return;
+    }
+    if (!tcp_has_data_to_send(conn) || conn->bytes_in_flight >= window) {
+        return;                             // ACKs restart it
+    }
+    
+    // About 1 ms at the current rate, at least two segments, at most
+    // one TSO/GSO super-packet
+    quantum = (u32)clamp_t(u64, div_u64(conn->pacing_rate, MSEC_PER_SEC), 2 * TCP_MSS,
+                           TCP_PACING_MAX_QUANTUM);
+    quantum = min3(quantum, window - conn->bytes_in_flight,
+                   max_t(u32, nic_offload_tx_max_bytes() - TCP_MAX_HEADERS, 2 * TCP_MSS));
+    
+    sent = tcp_retransmit_lost(conn, quantum);
+    if (sent < 0) {
+        if (conn->sack->lost_bytes) {
+            goto busy;
+        }
+        sent = 0;
+    }
+    bytes = (u32)sent < quantum ? min(quantum - sent, conn->pending_bytes) : 0;
+    if (bytes) {
+        if (conn->xmit && conn->xmit(conn, bytes) < 0) {
+            if (!sent) {
+                goto busy;
+            }
+        } else {
+            tcp_on_send(conn, bytes);
+            conn->pending_bytes -= bytes;
+            sent += bytes;
+        }
+    }
+    
+    // First data out: start the probe/RTO clock
+    if (!tw_timer_pending(&conn->retransmit_timer)) {
+        tcp_rearm_timers(conn, 0);
+    }
+    conn->pace_next_ns = now + (conn->pacing_rate ?
+                                div64_u64((u64)sent * NSEC_PER_SEC, conn->pacing_rate) : 0);
+    if (tcp_has_data_to_send(conn)) {
+        tcp_pacing_schedule(conn);
+    }
+    return;
+    
+busy:
+    conn->pace_next_ns = now + TCP_PACING_SLOT_NS;
+    tcp_pacing_schedule(conn);              // device busy, retry next slot
+}
+
+static enum hrtimer_restart tcp_pacing_tick(struct hrtimer *timer)
+{
+    struct tcp_shard *shard = container_of(timer, struct tcp_shard, pacing_timer);
+    struct tcp_connection *conn;
+    u64 now = ktime_get_ns();
+    unsigned long flags;
+    unsigned int slot;
+    LIST_HEAD(due);
+    
+    spin_lock_irqsave(&shard->pacing_lock, flags);
+    // Every slot whose window has begun is due
+    while (shard->pacing_count && shard->pacing_base_ns <= now) {
+        slot = shard->pacing_cursor;
+        if (__test_and_clear_bit(slot, shard->pacing_busy)) {
+            list_splice_tail_init(&shard->pacing_slots[slot], &due);
+        }
+        shard->pacing_cursor = (slot + 1) % TCP_PACING_SLOTS;
+        shard->pacing_base_ns += TCP_PACING_SLOT_NS;
+    }
+    spin_unlock_irqrestore(&shard->pacing_lock, flags);
+    
+    // Popped one at a time under the lock: a due connection still looks
+    // queued to tcp_pacing_schedule until it is actually released
+    rcu_read_lock();
+    for (;;) {
+        spin_lock_irqsave(&shard->pacing_lock, flags);
+        shard->pacing_running = NULL;
+        conn = list_first_entry_or_null(&due, struct tcp_connection, pace_node);
+        if (conn) {
+            list_del_init(&conn->pace_node);
+            shard->pacing_count--;
+            shard->pacing_running = conn;
+        }
+        spin_unlock_irqrestore(&shard->pacing_lock, flags);
+        if (!conn) {
+            break;
+        }
+        spin_lock_irqsave(&conn->lock, flags);
+        tcp_pacing_release(conn);
+        spin_unlock_irqrestore(&conn->lock, flags);
+    }
+    rcu_read_unlock();
+    
+    spin_lock_irqsave(&shard->pacing_lock, flags);
+    tcp_pacing_arm(shard);
+    spin_unlock_irqrestore(&shard->pacing_lock, flags);
+    
+    return HRTIMER_NORESTART;
+}
+
+/**
+ * Queue application data on a connection; the pacer sends it
+ */
+static int tcp_queue_data(int conn_id, u32 bytes)
+{
+    struct tcp_connection *conn;
+    unsigned long flags;
+    int ret = 0;
+    
+    if (conn_id < 0 || conn_id >= MAX_CONNECTIONS) {
+        return -EINVAL;
+    }
+    conn = &tcp_connections[conn_id];
+    
+    spin_lock_irqsave(&conn->lock, flags);
+    if (hlist_unhashed(&conn->hash_node) || conn->dead) {
+        ret = -ENOENT;
+    } else {
+        conn->pending_bytes += bytes;
+        tcp_pacing_schedule(conn);
+    }
+    spin_unlock_irqrestore(&conn->lock, flags);
+    return ret;
+}
+
+/**
+ * Tail loss probe: if the last segments of a flight are lost there is
+ * nothing left to SACK them. Send one new segment, or resend the last
+ * one, so the ACK it draws lets RACK find the loss without an RTO.
+ */
+static void tcp_send_probe(struct tcp_connection *conn)
+{
+    struct tcp_scoreboard *sb = conn->sack;
+    u32 start, len;
+    unsigned int i;
+    
+    sb->tlp_retrans = false;
+    if (conn->pending_bytes) {
+        len = min_t(u32, conn->pending_bytes, TCP_MSS);
+        if (!conn->xmit || conn->xmit(conn, len) >= 0) {
+            tcp_on_send(conn, len);
+            conn->pending_bytes -= len;
+            goto out;
+        }
+    }
+    
+    i = (conn->snd_nxt - 1 - sb->base_seq) / TCP_MSS;
+    if (i >= TCP_SACK_SEGS) {
+        i = TCP_SACK_SEGS - 1;
+    }
+    len = tcp_sack_seg_len(conn, i, &start);
+    if (len && (!conn->retransmit || conn->retransmit(conn, start, len) >= 0)) {
+        __set_bit(i, sb->retrans);
+        sb->xmit_us[i] = (u32)tcp_now_us();
+        conn->bytes_sent += len;
+        atomic_inc(&conn->retransmit_count);
+        conn->rtt_timing = false;
+        sb->tlp_retrans = true;
+    }
+out:
+    sb->tlp_out = true;
+    sb->tlp_high_seq = conn->snd_nxt;
+}
+
+/**
+ * RTO: every segment not SACKed is presumed lost (RFC 6675) and is
+ * resent; SACKed data is not
+ */
+static void tcp_rto_expired(struct tcp_connection *conn)
+{
+    struct tcp_scoreboard *sb = conn->sack;
+    unsigned int nsegs = tcp_sack_nsegs(conn);
+    u32 outstanding = conn->snd_nxt - conn->acknowledgment_number;
+    
+    bitmap_zero(sb->lost, TCP_SACK_SEGS);
+    bitmap_set(sb->lost, 0, nsegs);
+    bitmap_andnot(sb->lost, sb->lost, sb->sacked, TCP_SACK_SEGS);
+    bitmap_zero(sb->retrans, TCP_SACK_SEGS);
+    tcp_sack_recount(conn);
+    
+    tcp_enter_recovery(conn, outstanding - sb->sacked_bytes, true);
+    conn->rtt_timing = false;   // Karn: no samples from retransmissions
+    sb->tlp_out = false;
+    sb->rack_valid = false;
+    sb->rto_backoff = min_t(u8, sb->rto_backoff + 1, TCP_RTO_MAX_BACKOFF);
+    
+    pr_debug("TCP retransmit timeout on CPU %d: %pI4:%d -> %pI4:%d\n", conn->cpu,
+             &conn->local_ip, conn->local_port, &conn->remote_ip, conn->remote_port);
+}
+
+static void tcp_retransmit_timeout(struct tw_timer *t)
+{
+    struct tcp_connection *conn = container_of(t, struct tcp_connection, retransmit_timer);
+    struct tcp_scoreboard *sb;
+    unsigned long flags;
+    u32 reo_timeout = 0;
+    u32 lost;
+    
+    spin_lock_irqsave(&conn->lock, flags);
+    if (conn->dead) {
+        goto out;
+    }
+    sb = conn->sack;
+    switch (sb->timer_mode) {
+    case TCP_TIMER_REO:
+        lost = tcp_rack_detect_loss(conn, (u32)tcp_now_us(), &reo_timeout);
+        if (lost) {
+            tcp_enter_recovery(conn, lost, false);
+        }
+        break;
+    case TCP_TIMER_TLP:
+        tcp_send_probe(conn);
+        break;
+    default:
+        tcp_rto_expired(conn);
+        break;
+    }
+    
+    if (tcp_has_data_to_send(conn)) {
+        tcp_pacing_schedule(conn);
+    }
+    tcp_rearm_timers(conn, reo_timeout);
+out:
+    spin_unlock_irqrestore(&conn->lock, flags);
+}
+
+static void tcp_free_shards(void)
+{
+    int cpu;
+    
+    for_each_possible_cpu(cpu) {
+        kvfree(tcp_shards[cpu].hash);
+    }
+    kfree(tcp_shards);
+    tcp_shards = NULL;
+}
 
 /**
  * Initialize advanced TCP stack
  */
 static int tcp_stack_init(void)
 {
-    int i;
+    int i, cpu, nr_online;
     
     pr_info("Initializing advanced TCP stack\n");
     
+    get_random_bytes(&tcp_hash_seed, sizeof(tcp_hash_seed));
+    netdev_rss_key_fill(tcp_rss_key, sizeof(tcp_rss_key));
+    nr_online = num_online_cpus();
+    for (i = 0; i < TCP_RSS_INDIR_SIZE; i++) {
+        tcp_rss_indir[i] = cpumask_nth(i % nr_online, cpu_online_mask);
+    }
+    
+    // One shard per possible CPU, indexed by CPU number
+    tcp_shards = kcalloc(nr_cpu_ids, sizeof(*tcp_shards), GFP_KERNEL);
+    if (!tcp_shards) {
+        return -ENOMEM;
+    }
+    for_each_possible_cpu(cpu) {
+        struct tcp_shard *shard = &tcp_shards[cpu];
+    
+        shard->hash = kvcalloc(1 << TCP_SHARD_HASH_BITS, sizeof(*shard->hash), GFP_KERNEL);
+        if (!shard->hash) {
+            goto err_free;
+        }
+        spin_lock_init(&shard->lock);
+        INIT_LIST_HEAD(&shard->free_slots);
+        timer_wheel_init(&shard->timers, cpu);
+    
+        spin_lock_init(&shard->pacing_lock);
+        for (i = 0; i < TCP_PACING_SLOTS; i++) {
+            INIT_LIST_HEAD(&shard->pacing_slots[i]);
+        }
+        hrtimer_init(&shard->pacing_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_PINNED_SOFT);
+        shard->pacing_timer.function = tcp_pacing_tick;
+    }
+    cpu = cpumask_first(cpu_possible_mask);
+    
     // Initialize connections
     for (i = 0; i < MAX_CONNECTIONS; i++) {
         tcp_connections[i].local_ip = 0;
@@ -88,60 +1662,27 @@ static int tcp_stack_init(void)
         atomic_set(&tcp_connections[i].retransmit_count, 0);
         tcp_connections[i].bytes_sent = 0;
         tcp_connections[i].bytes_received = 0;
-        INIT_LIST_HEAD(&tcp_connections[i].conn_list);
-    }
-    
-    // Initialize BBR congestion control
-    strcpy(bbr_cc.name, "bbr");
-    bbr_cc.ssthresh = NULL; // BBR doesn't use ssthresh
-    bbr_cc.cong_avoid = NULL; // BBR has its own algorithm
-    bbr_cc.set_state = NULL;
-    bbr_cc.min_cwnd = NULL;
-    
-    pr_info("Advanced TCP stack initialized successfully\n");
-    return 0;
-}
-
-/**
- * BBR congestion control algorithm
- */
-static int tcp_bbr_congestion_control(struct tcp_connection *conn)
-{
-    u32 bdp, bw, rtt;
-    u32 target_cwnd;
-    
-    if (!conn) {
-        return -EINVAL;
-    }
-    
-    // BBR (Bottleneck Bandwidth and RTT) algorithm
-    bw = conn->bytes_sent * 8 / max(conn->rtt_us, 1); // bits per second
-    rtt = conn->rtt_us;
-    bdp = (bw * rtt) / 8000000; // bandwidth-delay product in packets
+        tcp_connections[i].sack = NULL;
+        spin_lock_init(&tcp_connections[i].lock);
+        INIT_HLIST_NODE(&tcp_connections[i].hash_node);
+        INIT_LIST_HEAD(&tcp_connections[i].pace_node);
+        tw_timer_init(&tcp_connections[i].retransmit_timer, tcp_retransmit_timeout);
     
-    // Set target congestion window
-    target_cwnd = max(bdp * 2, 4); // 2x BDP with minimum of 4 packets
-    
-    if (target_cwnd != conn->cwnd) {
-        conn->cwnd = target_cwnd;
-        pr_debug("BBR: cwnd updated to %u (bw=%u, rtt=%u, bdp=%u)\n",
-                conn->cwnd, bw, rtt, bdp);
+        // Slots dealt round robin; connections return them to their own shard
+        tcp_connections[i].cpu = cpu;
+        list_add_tail(&tcp_connections[i].conn_list, &tcp_shards[cpu].free_slots);
+        cpu = cpumask_next(cpu, cpu_possible_mask);
+        if (cpu >= nr_cpu_ids) {
+            cpu = cpumask_first(cpu_possible_mask);
+        }
     }
     
+    pr_info("Advanced TCP stack initialized successfully (%d shards)\n", num_possible_cpus());
     return 0;
-}
-
-/**
- * TCP congestion control algorithm
- */
-static int tcp_congestion_control(struct tcp_connection *conn)
-{
-    if (!conn) {
-        return -EINVAL;
-    }
     
-    // Use BBR congestion control
-    return tcp_bbr_congestion_control(conn);
+err_free:
+    tcp_free_shards();
+    return -ENOMEM;
 }
 
 /**
@@ -149,23 +1690,39 @@ static int tcp_congestion_control(struct tcp_connection *conn)
  */
 static int tcp_create_connection(u32 local_ip, u32 remote_ip, u16 local_port, u16 remote_port)
 {
-    int i;
+    struct tcp_connection *conn;
+    struct tcp_scoreboard *sb;
+    struct tcp_shard *shard;
+    int i, cpu;
     unsigned long flags;
     
-    spin_lock_irqsave(&tcp_stack_lock, flags);
+    cpu = tcp_rss_cpu(local_ip, remote_ip, local_port, remote_port);
+    shard = &tcp_shards[cpu];
     
-    // Find free connection slot
-    for (i = 0; i < MAX_CONNECTIONS; i++) {
-        if (tcp_connections[i].state == TCP_CLOSE) {
-            break;
-        }
+    sb = kzalloc(sizeof(*sb), GFP_ATOMIC);
+    if (!sb) {
+        return -ENOMEM;
     }
+    sb->rack_min_rtt_us = U32_MAX;
     
-    if (i >= MAX_CONNECTIONS) {
-        spin_unlock_irqrestore(&tcp_stack_lock, flags);
+    // Take a free connection slot, before the shard lock: stealing one
+    // locks other shards
+    conn = tcp_alloc_slot(cpu);
+    if (!conn) {
         pr_err("No free TCP connection slots available\n");
+        kfree(sb);
         return -ENOMEM;
     }
+    i = conn - tcp_connections;
+    
+    spin_lock_irqsave(&shard->lock, flags);
+    
+    if (tcp_lookup_connection(shard, local_ip, remote_ip, local_port, remote_port)) {
+        list_add(&conn->conn_list, &shard->free_slots);
+        spin_unlock_irqrestore(&shard->lock, flags);
+        kfree(sb);
+        return -EEXIST;
+    }
     
     // Initialize connection
     tcp_connections[i].local_ip = local_ip;
@@ -184,10 +1741,32 @@ static int tcp_create_connection(u32 local_ip, u32 remote_ip, u16 local_port, u1
     atomic_set(&tcp_connections[i].retransmit_count, 0);
     tcp_connections[i].bytes_sent = 0;
     tcp_connections[i].bytes_received = 0;
+    tcp_connections[i].snd_nxt = 0;
+    tcp_connections[i].rtt_timing = false;
+    tcp_connections[i].last_rtt_us = 0;
+    tcp_connections[i].pending_bytes = 0;
+    tcp_connections[i].pace_next_ns = 0;
+    tcp_connections[i].xmit = NULL;
+    tcp_connections[i].retransmit = NULL;
+    tcp_connections[i].sack_ok = false;
+    tcp_connections[i].in_recovery = false;
+    tcp_connections[i].sack = sb;
+    tcp_connections[i].dead = false;
+    
+    // BBR unless tcp_set_congestion_control picks another
+    tcp_connections[i].cc = &tcp_cc_algorithms[0];
+    tcp_connections[i].cc->init(conn);
+    tcp_connections[i].pacing_rate = tcp_connections[i].cc->pacing_rate(conn);
     
-    tcp_connection_count++;
+    tcp_connections[i].cpu = cpu;
     
-    spin_unlock_irqrestore(&tcp_stack_lock, flags);
+    // Published last: a reader finding it sees it fully initialized
+    hlist_add_head_rcu(&conn->hash_node,
+                       &shard->hash[hash_32(tcp_conn_hashfn(local_ip, remote_ip, local_port,
+                                                            remote_port), TCP_SHARD_HASH_BITS)]);
+    shard->connection_count++;
+    
+    spin_unlock_irqrestore(&shard->lock, flags);
     
     pr_info("TCP connection created: %pI4:%d -> %pI4:%d\n",
             &local_ip, local_port, &remote_ip, remote_port);
@@ -195,22 +1774,87 @@ static int tcp_create_connection(u32 local_ip, u32 remote_ip, u16 local_port, u1
     return i;
 }
 
+static void tcp_connection_free_rcu(struct rcu_head *head)
+{
+    struct tcp_connection *conn = container_of(head, struct tcp_connection, rcu);
+    struct tcp_shard *shard = &tcp_shards[conn->cpu];
+    unsigned long flags;
+    
+    kfree(conn->sack);
+    conn->sack = NULL;
+    
+    spin_lock_irqsave(&shard->lock, flags);
+    list_add_tail(&conn->conn_list, &shard->free_slots);
+    spin_unlock_irqrestore(&shard->lock, flags);
+}
+
+/**
+ * Destroy TCP connection
+ */
+static int tcp_destroy_connection(int conn_id)
+{
+    struct tcp_connection *conn;
+    struct tcp_shard *shard;
+    unsigned long flags;
+    
+    if (conn_id < 0 || conn_id >= MAX_CONNECTIONS) {
+        return -EINVAL;
+    }
+    conn = &tcp_connections[conn_id];
+    shard = &tcp_shards[conn->cpu];
+    
+    spin_lock_irqsave(&shard->lock, flags);
+    if (hlist_unhashed(&conn->hash_node)) {
+        spin_unlock_irqrestore(&shard->lock, flags);
+        return -ENOENT;
+    }
+    hlist_del_init_rcu(&conn->hash_node);
+    conn->state = TCP_CLOSE;
+    shard->connection_count--;
+    spin_unlock_irqrestore(&shard->lock, flags);
+    
+    // Every path that arms the timer or queues for pacing holds the lock
+    // and checks dead, so once it is set nothing re-arms. Wait for the
+    // callbacks running so no timer or pacing entry outlives the
+    // scoreboard or follows the slot into its next connection.
+    spin_lock_irqsave(&conn->lock, flags);
+    conn->dead = true;
+    spin_unlock_irqrestore(&conn->lock, flags);
+    timer_wheel_del_sync(&shard->timers, &conn->retransmit_timer);
+    tcp_pacing_cancel_sync(conn);
+    
+    // Slot is reusable once no reader can still hold it
+    call_rcu(&conn->rcu, tcp_connection_free_rcu);
+    return 0;
+}
+
 /**
  * Process TCP packet
  */
 static int tcp_process_packet(struct tcp_connection *conn, struct sk_buff *skb)
 {
+    struct tcp_sack_block blocks[TCP_MAX_SACK_BLOCKS];
     struct tcphdr *th;
     u32 ack_num, seq_num;
     u32 bytes_acked;
+    bool sack_perm = false;
+    int nblocks;
     
     if (!conn || !skb) {
         return -EINVAL;
     }
+    lockdep_assert_held(&conn->lock);
+    if (conn->dead) {
+        return -ENOENT;             // found just before it was destroyed
+    }
     
     th = tcp_hdr(skb);
     ack_num = ntohl(th->ack_seq);
     seq_num = ntohl(th->seq);
+    nblocks = tcp_parse_options(th, &sack_perm, blocks);
+    if (th->syn) {
+        conn->sack_ok = sack_perm;
+    }
     
     // Update connection state
     if (th->syn && !th->ack) {
@@ -225,15 +1869,73 @@ static int tcp_process_packet(struct tcp_connection *conn, struct sk_buff *skb)
     
     // Process acknowledgment
     if (th->ack) {
-        bytes_acked = ack_num - conn->acknowledgment_number;
+        struct tcp_scoreboard *sb = conn->sack;
+        u32 now = (u32)tcp_now_us();
+        u32 sacked_before = sb->sacked_bytes;
+        u32 reo_timeout, lost;
+        bool dsack = false;
+        s64 delivered;
+    
+        bytes_acked = tcp_sack_ack(conn, ack_num, now);
+        if (conn->sack_ok && nblocks) {
+            dsack = tcp_sack_mark(conn, blocks, nblocks, conn->acknowledgment_number, now);
+        }
+        tcp_sack_recount(conn);
+    
+        // Newly SACKed bytes count as delivered too; SACKed bytes now
+        // cumulatively ACKed were counted when they were SACKed
+        delivered = (s64)bytes_acked + sb->sacked_bytes - sacked_before;
+    
         if (bytes_acked > 0) {
-            conn->bytes_in_flight -= bytes_acked;
-            conn->acknowledgment_number = ack_num;
             conn->bytes_received += bytes_acked;
-            
+            sb->rto_backoff = 0;
+    
+            // RFC 6298 smoothing from the timed segment
+            if (conn->rtt_timing && (s32)(ack_num - conn->rtt_seq) >= 0) {
+                u32 sample = (u32)(tcp_now_us() - conn->rtt_start_us);
+    
+                conn->last_rtt_us = sample;
+                if (!conn->rtt_us) {
+                    conn->rtt_us = sample;
+                    conn->rtt_var = sample / 2;
+                } else {
+                    conn->rtt_var = (3 * conn->rtt_var + abs((int)(conn->rtt_us - sample))) / 4;
+                    conn->rtt_us = (7 * conn->rtt_us + sample) / 8;
+                }
+                conn->rtt_timing = false;
+            }
+    
+            if (conn->in_recovery && !tcp_seq_before(ack_num, conn->recovery_point)) {
+                conn->in_recovery = false;
+            }
+        }
+    
+        // TLP acknowledged: a retransmitted probe that was not reported
+        // as a duplicate repaired a real loss (RFC 8985 7.4)
+        if (sb->tlp_out && !tcp_seq_before(conn->acknowledgment_number, sb->tlp_high_seq)) {
+            sb->tlp_out = false;
+            if (sb->tlp_retrans && !dsack) {
+                tcp_cc_loss(conn, TCP_MSS, false);
+            }
+        }
+    
+        lost = tcp_rack_detect_loss(conn, now, &reo_timeout);
+        if (lost) {
+            tcp_enter_recovery(conn, lost, false);
+        }
+    
+        if (delivered > 0) {
             // Apply congestion control
-            tcp_congestion_control(conn);
+            conn->cwnd = conn->cc->cong_avoid(conn, ack_num, (u32)delivered);
+            conn->pacing_rate = conn->cc->pacing_rate(conn);
         }
+        if (tcp_has_data_to_send(conn)) {
+            tcp_pacing_schedule(conn);
+        }
+    
+        // RACK reordering timer, TLP or RTO while data is outstanding,
+        // on the owning CPU
+        tcp_rearm_timers(conn, reo_timeout);
     }
     
     // Update sequence number
@@ -247,16 +1949,67 @@ static int tcp_process_packet(struct tcp_connection *conn, struct sk_buff *skb)
     return 0;
 }
 
+/**
+ * Receive demux: map an incoming segment to its connection
+ */
+static int tcp_receive_packet(struct sk_buff *skb)
+{
+    struct tcp_connection *conn;
+    struct iphdr *iph;
+    struct tcphdr *th;
+    unsigned long flags;
+    int ret, cpu;
+    
+    if (!skb) {
+        return -EINVAL;
+    }
+    
+    iph = ip_hdr(skb);
+    th = tcp_hdr(skb);
+    
+    // NIC verdict when it checked, software otherwise. A GRO/LRO packet
+    // carries many segments and is processed once.
+    if (!nic_offload_rx_csum_ok(skb)) {
+        return -EBADMSG;
+    }
+    
+    // Normally the shard of the CPU we run on: RSS brought the segment here
+    if (skb->l4_hash) {
+        cpu = tcp_rss_indir[skb->hash % TCP_RSS_INDIR_SIZE];
+    } else {
+        cpu = tcp_rss_cpu(iph->daddr, iph->saddr, ntohs(th->dest), ntohs(th->source));
+    }
+    
+    rcu_read_lock();
+    // Our side is the destination of an incoming segment
+    conn = tcp_lookup_connection(&tcp_shards[cpu], iph->daddr, iph->saddr, ntohs(th->dest),
+                                 ntohs(th->source));
+    if (conn) {
+        spin_lock_irqsave(&conn->lock, flags);
+        ret = tcp_process_packet(conn, skb);
+        spin_unlock_irqrestore(&conn->lock, flags);
+    } else {
+        ret = -ENOENT;
+    }
+    rcu_read_unlock();
+    
+    return ret;
+}
+
 /**
  * Get connection statistics
  */
 static int tcp_get_connection_stats(int conn_id, u64 *bytes_sent, u64 *bytes_received, 
                                    u32 *cwnd, u32 *rtt_us)
 {
-    if (conn_id >= MAX_CONNECTIONS) {
+    unsigned long flags;
+    
+    if (conn_id < 0 || conn_id >= MAX_CONNECTIONS) {
         return -EINVAL;
     }
     
+    // One consistent snapshot, not fields from different ACKs
+    spin_lock_irqsave(&tcp_connections[conn_id].lock, flags);
     if (bytes_sent) {
         *bytes_sent = tcp_connections[conn_id].bytes_sent;
     }
@@ -269,6 +2022,7 @@ static int tcp_get_connection_stats(int conn_id, u64 *bytes_sent, u64 *bytes_rec
     if (rtt_us) {
         *rtt_us = tcp_connections[conn_id].rtt_us;
     }
+    spin_unlock_irqrestore(&tcp_connections[conn_id].lock, flags);
     
     return 0;
 }
@@ -301,11 +2055,20 @@ static void __exit tcp_stack_cleanup_module(void)
     
     // Close all connections
     for (i = 0; i < MAX_CONNECTIONS; i++) {
-        if (tcp_connections[i].state != TCP_CLOSE) {
-            tcp_connections[i].state = TCP_CLOSE;
+        if (!hlist_unhashed(&tcp_connections[i].hash_node)) {
+            tcp_destroy_connection(i);
         }
     }
     
+    for_each_possible_cpu(i) {
+        timer_wheel_destroy(&tcp_shards[i].timers);
+        hrtimer_cancel(&tcp_shards[i].pacing_timer);
+    }
+    
+    // Pending tcp_connection_free_rcu callbacks must run before unload
+    rcu_barrier();
+    tcp_free_shards();
+    
     pr_info("Advanced TCP Stack unloaded\n");
 }
 
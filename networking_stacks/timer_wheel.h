@@ -0,0 +1,263 @@
+/**
+ * Hierarchical Timer Wheel
+ *
+ * Shared by the TCP stack (retransmit) and MQTT (keepalive): thousands of
+ * connections each with a timeout that is usually pushed back before it
+ * fires. Re-arming is an O(1) list move inside one wheel instead of a
+ * kernel timer per object, and one kernel timer per wheel runs every due
+ * entry in a batch per tick.
+ *
+ * Four levels of 64 slots, one jiffy per level-0 slot: level n holds
+ * timers 64^n to 64^(n+1) ticks out and cascades down one level each
+ * time the level below wraps. Timers beyond the top level are clamped
+ * to it and placed again when they cascade.
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/timer.h>
+#include <linux/jiffies.h>
+
+#define TW_LEVELS 4
+#define TW_BITS 6
+#define TW_SIZE (1 << TW_BITS)
+#define TW_MASK (TW_SIZE - 1)
+#define TW_MAX_TICKS ((1UL << (TW_LEVELS * TW_BITS)) - 1)
+
+struct tw_timer {
+    struct hlist_node node;
+    unsigned long expires;      // jiffies
+    void (*function)(struct tw_timer *timer);
+};
+
+struct timer_wheel {
+    spinlock_t lock;
+    unsigned long clk;          // next tick to process
+    unsigned int pending;
+    struct tw_timer *running;   // callback in progress, for timer_wheel_del_sync()
+    int cpu;                    // driver timer pinned here, -1 for any
+    struct timer_list driver;
+    struct hlist_head slots[TW_LEVELS][TW_SIZE];
+};
+
+static inline void tw_timer_init(struct tw_timer *timer, void (*function)(struct tw_timer *))
+{
+    INIT_HLIST_NODE(&timer->node);
+    timer->function = function;
+}
+
+static inline bool tw_timer_pending(const struct tw_timer *timer)
+{
+    return !hlist_unhashed(&timer->node);
+}
+
+// Slot for timer->expires relative to the wheel's clock
+static inline void __timer_wheel_place(struct timer_wheel *tw, struct tw_timer *timer)
+{
+    unsigned long expires = timer->expires;
+    long delta = (long)(expires - tw->clk);
+    int level;
+    
+    if (delta < 0) {
+        // Already due: the slot processed next
+        hlist_add_head(&timer->node, &tw->slots[0][tw->clk & TW_MASK]);
+        return;
+    }
+    if ((unsigned long)delta > TW_MAX_TICKS) {
+        expires = tw->clk + TW_MAX_TICKS;
+        delta = TW_MAX_TICKS;
+    }
+    
+    for (level = 0; level < TW_LEVELS - 1; level++) {
+        if ((unsigned long)delta < (1UL << ((level + 1) * TW_BITS))) {
+            break;
+        }
+    }
+    hlist_add_head(&timer->node, &tw->slots[level][(expires >> (level * TW_BITS)) & TW_MASK]);
+}
+
+// Move one slot of level down into the levels below it
+static inline int __timer_wheel_cascade(struct timer_wheel *tw, int level)
+{
+    int index = (tw->clk >> (level * TW_BITS)) & TW_MASK;
+    struct tw_timer *timer;
+    struct hlist_node *tmp;
+    HLIST_HEAD(list);
+    
+    hlist_move_list(&tw->slots[level][index], &list);
+    hlist_for_each_entry_safe(timer, tmp, &list, node) {
+        hlist_del_init(&timer->node);
+        __timer_wheel_place(tw, timer);
+    }
+    
+    return index;
+}
+
+static inline void __timer_wheel_kick(struct timer_wheel *tw)
+{
+    if (timer_pending(&tw->driver)) {
+        return;
+    }
+    tw->driver.expires = jiffies + 1;
+    if (tw->cpu >= 0) {
+        add_timer_on(&tw->driver, tw->cpu);
+    } else {
+        add_timer(&tw->driver);
+    }
+}
+
+/**
+ * Run every tick up to now; due timers fire without the wheel lock held
+ */
+static inline void timer_wheel_run(struct timer_list *t)
+{
+    struct timer_wheel *tw = from_timer(tw, t, driver);
+    struct tw_timer *timer;
+    unsigned long flags;
+    HLIST_HEAD(due);
+    
+    spin_lock_irqsave(&tw->lock, flags);
+    while (time_after_eq(jiffies, tw->clk)) {
+        int index = tw->clk & TW_MASK;
+        int level;
+    
+        // Level 0 wrapped: refill it from level 1, and so on upwards
+        for (level = 1; level < TW_LEVELS && !index; level++) {
+            index = __timer_wheel_cascade(tw, level);
+        }
+    
+        index = tw->clk & TW_MASK;
+        while (!hlist_empty(&tw->slots[0][index])) {
+            timer = hlist_entry(tw->slots[0][index].first, struct tw_timer, node);
+            hlist_del_init(&timer->node);
+            if (time_after(timer->expires, tw->clk)) {
+                __timer_wheel_place(tw, timer);     // was clamped, not due yet
+                continue;
+            }
+            // Parked on a private list, still reported as pending
+            hlist_add_head(&timer->node, &due);
+        }
+        tw->clk++;
+    }
+    
+    // Popped one at a time: a callback may re-arm itself
+    while (!hlist_empty(&due)) {
+        timer = hlist_entry(due.first, struct tw_timer, node);
+        hlist_del_init(&timer->node);
+        tw->pending--;
+        tw->running = timer;
+        spin_unlock_irqrestore(&tw->lock, flags);
+        timer->function(timer);
+        spin_lock_irqsave(&tw->lock, flags);
+        tw->running = NULL;
+    }
+    
+    if (tw->pending) {
+        __timer_wheel_kick(tw);
+    }
+    spin_unlock_irqrestore(&tw->lock, flags);
+}
+
+static inline void timer_wheel_init(struct timer_wheel *tw, int cpu)
+{
+    int level, i;
+    
+    spin_lock_init(&tw->lock);
+    tw->clk = jiffies;
+    tw->pending = 0;
+    tw->running = NULL;
+    tw->cpu = cpu;
+    for (level = 0; level < TW_LEVELS; level++) {
+        for (i = 0; i < TW_SIZE; i++) {
+            INIT_HLIST_HEAD(&tw->slots[level][i]);
+        }
+    }
+    timer_setup(&tw->driver, timer_wheel_run, cpu >= 0 ? TIMER_PINNED : 0);
+}
+
+/**
+ * Arm or re-arm a timer to fire at expires (jiffies)
+ */
+static inline void timer_wheel_mod(struct timer_wheel *tw, struct tw_timer *timer,
+                                   unsigned long expires)
+{
+    unsigned long flags;
+    
+    spin_lock_irqsave(&tw->lock, flags);
+    if (tw_timer_pending(timer)) {
+        hlist_del_init(&timer->node);
+    } else {
+        if (!tw->pending) {
+            // Wheel was idle: its clock stood still, catch it up
+            tw->clk = jiffies;
+        }
+        tw->pending++;
+    }
+    timer->expires = expires;
+    __timer_wheel_place(tw, timer);
+    __timer_wheel_kick(tw);
+    spin_unlock_irqrestore(&tw->lock, flags);
+}
+
+/**
+ * Disarm a timer; returns true if it was pending. Like del_timer(), a
+ * callback already running on another CPU is not waited for.
+ */
+static inline bool timer_wheel_del(struct timer_wheel *tw, struct tw_timer *timer)
+{
+    unsigned long flags;
+    bool was_pending = false;
+    
+    spin_lock_irqsave(&tw->lock, flags);
+    if (tw_timer_pending(timer)) {
+        hlist_del_init(&timer->node);
+        tw->pending--;
+        was_pending = true;
+    }
+    spin_unlock_irqrestore(&tw->lock, flags);
+    
+    return was_pending;
+}
+
+/**
+ * Disarm a timer and wait for its callback if it is running, like
+ * del_timer_sync(). A callback that re-armed itself meanwhile is disarmed
+ * again. Not from the callback itself, nor holding a lock it takes.
+ */
+static inline bool timer_wheel_del_sync(struct timer_wheel *tw, struct tw_timer *timer)
+{
+    unsigned long flags;
+    bool was_pending = false;
+    
+    spin_lock_irqsave(&tw->lock, flags);
+    for (;;) {
+        if (tw_timer_pending(timer)) {
+            hlist_del_init(&timer->node);
+            tw->pending--;
+            was_pending = true;
+        }
+        if (tw->running != timer) {
+            break;
+        }
+        spin_unlock_irqrestore(&tw->lock, flags);
+        cpu_relax();
+        spin_lock_irqsave(&tw->lock, flags);
+    }
+    spin_unlock_irqrestore(&tw->lock, flags);
+    
+    return was_pending;
+}
+
+/**
+ * Stop the wheel for good, waiting for a running batch
+ */
+static inline void timer_wheel_destroy(struct timer_wheel *tw)
+{
+    timer_shutdown_sync(&tw->driver);
+}
+
+#endif /* TIMER_WHEEL_H */
@@ -13,10 +13,24 @@
 #include <linux/skbuff.h>
 #include <linux/errno.h>
 #include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/jiffies.h>
+#include <linux/prefetch.h>
+#include <linux/if_ether.h>
+#include <linux/if_vlan.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <asm/unaligned.h>
 
-#define OSI_VERSION "1.0.0"
+#define OSI_VERSION "1.1.0"
 #define OSI_LAYERS 7
 #define OSI_MAX_PACKETS 1024
+#define OSI_BURST_MAX 64
 
 enum osi_layer {
     LAYER_1_PHYSICAL = 1,
@@ -36,25 +50,89 @@ struct osi_packet {
     bool processed;
 };
 
+// What the one parse found, and so which layers a packet reaches
+#define OSI_PKT_VLAN     0x0001
+#define OSI_PKT_IPV4     0x0002
+#define OSI_PKT_IPV6     0x0004
+#define OSI_PKT_FRAGMENT 0x0008     // not the first fragment: no L4 header
+#define OSI_PKT_TCP      0x0010
+#define OSI_PKT_UDP      0x0020
+#define OSI_PKT_PAYLOAD  0x0040     // L4 payload present, for layers 5-7
+#define OSI_PKT_L3       (OSI_PKT_IPV4 | OSI_PKT_IPV6)
+#define OSI_PKT_L4       (OSI_PKT_TCP | OSI_PKT_UDP)
+
+/*
+ * L2-L4 headers of a frame, parsed and bounds-checked once and handed
+ * to every layer instead of the raw buffer
+ */
+struct osi_pkt_desc {
+    const u8 *data;             // Ethernet header
+    u16 len;
+    u16 l3_off;
+    u16 l4_off;
+    u16 payload_off;
+    u16 payload_len;
+    u16 vlan_id;
+    __be16 ethertype;
+    u8 l4_proto;
+    __be16 src_port;
+    __be16 dst_port;
+    u32 flags;                  // OSI_PKT_*
+};
+
+/*
+ * One entry of a burst. The array is the caller's and is reused across
+ * bursts, so the descriptors never live on the stack.
+ */
+struct osi_burst_pkt {
+    const u8 *data;
+    u16 len;
+    int ret;                    // 0 if delivered, else why it was dropped
+    struct osi_pkt_desc desc;
+};
+
+/*
+ * Per-layer callback. It only runs for packets carrying every flag in
+ * needs; a non-zero return drops the packet and counts an error at that
+ * layer.
+ */
+struct osi_layer_hook {
+    int (*fn)(const struct osi_pkt_desc *desc, void *arg);
+    void *arg;
+    u32 needs;
+};
+
 struct osi_layer_config {
     enum osi_layer layer;
     bool enabled;
-    u32 packet_count;
-    u32 error_count;
     u32 throughput_bps;
-    atomic_t active_packets;
+    unsigned long sample_bytes; // at the last throughput sample
+    unsigned long sample_time;
+};
+
+/*
+ * Per CPU, so the fast path never touches a shared cache line. A packet
+ * bumps only the counters of the deepest layer it reached; the layers
+ * below are summed in when read.
+ */
+struct osi_pcpu_stats {
+    unsigned long depth_packets[OSI_LAYERS];
+    unsigned long depth_bytes[OSI_LAYERS];
+    unsigned long errors[OSI_LAYERS];
 };
 
 struct osi_stack {
     struct osi_layer_config layers[OSI_LAYERS];
     struct osi_packet packets[OSI_MAX_PACKETS];
     int packet_count;
-    atomic_t total_packets;
-    u32 stack_errors;
     bool stack_active;
+    spinlock_t sample_lock;
 };
 
 static struct osi_stack global_osi_stack;
+static DEFINE_PER_CPU(struct osi_pcpu_stats, osi_pcpu_stats);
+static struct osi_layer_hook __rcu *osi_hooks[OSI_LAYERS];
+static DEFINE_MUTEX(osi_hooks_mutex);
 
 /**
  * Initialize OSI stack
@@ -66,18 +144,16 @@ static int osi_stack_init(void)
     pr_info("Initializing OSI 7-layer stack\n");
     
     global_osi_stack.packet_count = 0;
-    atomic_set(&global_osi_stack.total_packets, 0);
-    global_osi_stack.stack_errors = 0;
     global_osi_stack.stack_active = true;
+    spin_lock_init(&global_osi_stack.sample_lock);
     
     // Initialize layers
     for (i = 0; i < OSI_LAYERS; i++) {
         global_osi_stack.layers[i].layer = i + 1;
         global_osi_stack.layers[i].enabled = true;
-        global_osi_stack.layers[i].packet_count = 0;
-        global_osi_stack.layers[i].error_count = 0;
         global_osi_stack.layers[i].throughput_bps = 0;
-        atomic_set(&global_osi_stack.layers[i].active_packets, 0);
+        global_osi_stack.layers[i].sample_bytes = 0;
+        global_osi_stack.layers[i].sample_time = jiffies;
     }
     
     // Initialize packets
@@ -95,200 +171,296 @@ static int osi_stack_init(void)
 }
 
 /**
- * Layer 1 - Physical Layer
+ * Install the callback for a layer; one per layer
  */
-static int osi_layer1_physical(const u8 *data, u16 len)
+static int osi_register_layer_hook(enum osi_layer layer, const struct osi_layer_hook *hook)
 {
-    pr_debug("OSI Layer 1 (Physical): Processing %d bytes\n", len);
+    struct osi_layer_hook *h;
+    int ret = 0;
     
-    // Simulate physical layer processing
-    // - Signal encoding/decoding
-    // - Bit synchronization
-    // - Physical medium access
+    if (layer < LAYER_1_PHYSICAL || layer > LAYER_7_APPLICATION || !hook || !hook->fn) {
+        return -EINVAL;
+    }
+    h = kmemdup(hook, sizeof(*hook), GFP_KERNEL);
+    if (!h) {
+        return -ENOMEM;
+    }
     
-    global_osi_stack.layers[0].packet_count++;
-    atomic_inc(&global_osi_stack.layers[0].active_packets);
+    mutex_lock(&osi_hooks_mutex);
+    if (rcu_access_pointer(osi_hooks[layer - 1])) {
+        ret = -EBUSY;
+    } else {
+        rcu_assign_pointer(osi_hooks[layer - 1], h);
+    }
+    mutex_unlock(&osi_hooks_mutex);
     
-    return 0;
+    if (ret) {
+        kfree(h);
+    }
+    return ret;
 }
 
-/**
- * Layer 2 - Data Link Layer
- */
-static int osi_layer2_datalink(const u8 *data, u16 len)
+static void osi_unregister_layer_hook(enum osi_layer layer)
 {
-    pr_debug("OSI Layer 2 (Data Link): Processing %d bytes\n", len);
-    
-    // Simulate data link layer processing
-    // - Frame synchronization
-    // - Error detection/correction
-    // - Flow control
-    // - MAC addressing
+    struct osi_layer_hook *h;
     
-    global_osi_stack.layers[1].packet_count++;
-    atomic_inc(&global_osi_stack.layers[1].active_packets);
-    
-    return 0;
+    if (layer < LAYER_1_PHYSICAL || layer > LAYER_7_APPLICATION) {
+        return;
+    }
+    mutex_lock(&osi_hooks_mutex);
+    h = rcu_dereference_protected(osi_hooks[layer - 1], lockdep_is_held(&osi_hooks_mutex));
+    RCU_INIT_POINTER(osi_hooks[layer - 1], NULL);
+    mutex_unlock(&osi_hooks_mutex);
+    
+    if (h) {
+        synchronize_rcu();
+        kfree(h);
+    }
 }
 
-/**
- * Layer 3 - Network Layer
+/*
+ * Parse Ethernet (with one VLAN tag), IPv4/IPv6 and TCP/UDP headers,
+ * checking every length once. Unknown protocols just stop the parse at
+ * the layer below; only headers that do not fit fail it.
  */
-static int osi_layer3_network(const u8 *data, u16 len)
+static int osi_parse_headers(const u8 *data, u16 len, struct osi_pkt_desc *d)
 {
-    pr_debug("OSI Layer 3 (Network): Processing %d bytes\n", len);
+    const struct ethhdr *eth = (const struct ethhdr *)data;
+    u16 off = ETH_HLEN;
+    u16 end = len;
+    __be16 proto;
     
-    // Simulate network layer processing
-    // - IP addressing
-    // - Routing
-    // - Fragmentation
-    // - Congestion control
+    memset(d, 0, sizeof(*d));
+    d->data = data;
+    d->len = len;
     
-    global_osi_stack.layers[2].packet_count++;
-    atomic_inc(&global_osi_stack.layers[2].active_packets);
-    
-    return 0;
-}
-
-/**
- * Layer 4 - Transport Layer
- */
-static int osi_layer4_transport(const u8 *data, u16 len)
-{
-    pr_debug("OSI Layer 4 (Transport): Processing %d bytes\n", len);
-    
-    // Simulate transport layer processing
-    // - Port addressing
-    // - Segmentation
-    // - Flow control
-    // - Error recovery
-    // - TCP/UDP protocols
+    if (len < ETH_HLEN) {
+        return -EBADMSG;
+    }
+    proto = eth->h_proto;
+    if (proto == htons(ETH_P_8021Q) || proto == htons(ETH_P_8021AD)) {
+        if (len < off + VLAN_HLEN) {
+            return -EBADMSG;
+        }
+        d->vlan_id = get_unaligned_be16(data + off) & VLAN_VID_MASK;
+        proto = get_unaligned((const __be16 *)(data + off + 2));
+        off += VLAN_HLEN;
+        d->flags |= OSI_PKT_VLAN;
+    }
+    d->ethertype = proto;
+    d->l3_off = off;
+    
+    if (proto == htons(ETH_P_IP)) {
+        const struct iphdr *iph = (const struct iphdr *)(data + off);
+        u16 ihl, tot_len;
+    
+        if (len < off + sizeof(*iph) || iph->version != 4 || iph->ihl < 5) {
+            return -EBADMSG;
+        }
+        ihl = iph->ihl * 4;
+        tot_len = ntohs(iph->tot_len);
+        if (tot_len < ihl || off + tot_len > len) {
+            return -EBADMSG;
+        }
+        end = off + tot_len;        // drop Ethernet padding
+        d->l4_proto = iph->protocol;
+        d->flags |= OSI_PKT_IPV4;
+        if (iph->frag_off & htons(IP_OFFSET)) {
+            d->flags |= OSI_PKT_FRAGMENT;
+        }
+        off += ihl;
+    } else if (proto == htons(ETH_P_IPV6)) {
+        const struct ipv6hdr *ip6h = (const struct ipv6hdr *)(data + off);
+    
+        if (len < off + sizeof(*ip6h) || ip6h->version != 6 ||
+            off + sizeof(*ip6h) + ntohs(ip6h->payload_len) > len) {
+            return -EBADMSG;
+        }
+        end = off + sizeof(*ip6h) + ntohs(ip6h->payload_len);
+        // Extension headers are left to a layer 3 hook
+        d->l4_proto = ip6h->nexthdr;
+        d->flags |= OSI_PKT_IPV6;
+        off += sizeof(*ip6h);
+    } else {
+        return 0;
+    }
+    d->l4_off = off;
     
-    global_osi_stack.layers[3].packet_count++;
-    atomic_inc(&global_osi_stack.layers[3].active_packets);
+    if (d->flags & OSI_PKT_FRAGMENT) {
+        return 0;
+    }
+    if (d->l4_proto == IPPROTO_TCP) {
+        const struct tcphdr *th = (const struct tcphdr *)(data + off);
+    
+        if (end < off + sizeof(*th) || th->doff < 5 || end < off + th->doff * 4) {
+            return -EBADMSG;
+        }
+        d->src_port = th->source;
+        d->dst_port = th->dest;
+        d->flags |= OSI_PKT_TCP;
+        off += th->doff * 4;
+    } else if (d->l4_proto == IPPROTO_UDP) {
+        const struct udphdr *uh = (const struct udphdr *)(data + off);
+    
+        if (end < off + sizeof(*uh)) {
+            return -EBADMSG;
+        }
+        d->src_port = uh->source;
+        d->dst_port = uh->dest;
+        d->flags |= OSI_PKT_UDP;
+        off += sizeof(*uh);
+    } else {
+        return 0;
+    }
     
+    d->payload_off = off;
+    d->payload_len = end - off;
+    if (d->payload_len) {
+        d->flags |= OSI_PKT_PAYLOAD;
+    }
     return 0;
 }
 
-/**
- * Layer 5 - Session Layer
- */
-static int osi_layer5_session(const u8 *data, u16 len)
+// Deepest layer the parse reached, as an index into the layer arrays
+static int osi_pkt_depth(const struct osi_pkt_desc *d)
 {
-    pr_debug("OSI Layer 5 (Session): Processing %d bytes\n", len);
-    
-    // Simulate session layer processing
-    // - Session establishment
-    // - Session management
-    // - Session termination
-    // - Dialog control
-    
-    global_osi_stack.layers[4].packet_count++;
-    atomic_inc(&global_osi_stack.layers[4].active_packets);
-    
-    return 0;
+    if (d->flags & OSI_PKT_PAYLOAD) {
+        return LAYER_7_APPLICATION - 1;
+    }
+    if (d->flags & OSI_PKT_L4) {
+        return LAYER_4_TRANSPORT - 1;
+    }
+    if (d->flags & OSI_PKT_L3) {
+        return LAYER_3_NETWORK - 1;
+    }
+    return LAYER_2_DATALINK - 1;
 }
 
 /**
- * Layer 6 - Presentation Layer
+ * Process a burst of packets through the OSI stack
+ *
+ * Each stage runs over the whole burst before the next one starts: all
+ * headers are parsed first, prefetching the next packet while the
+ * current one is parsed, then each layer's hook runs over every packet
+ * that reached it, and the counters are added once per burst. Holding a
+ * layer for the whole burst keeps its hook and the descriptors hot
+ * instead of cycling the I-cache through seven layers per packet.
+ *
+ * pkts[i].ret is set to 0 for a delivered packet or to the error that
+ * dropped it. Returns the number delivered.
  */
-static int osi_layer6_presentation(const u8 *data, u16 len)
+static int osi_process_burst(struct osi_burst_pkt *pkts, unsigned int n)
 {
-    pr_debug("OSI Layer 6 (Presentation): Processing %d bytes\n", len);
+    unsigned long packets[OSI_LAYERS] = { 0 };
+    unsigned long bytes[OSI_LAYERS] = { 0 };
+    unsigned long errors[OSI_LAYERS] = { 0 };
+    s8 depth[OSI_BURST_MAX];        // deepest layer reached, -1 once dropped
+    unsigned int i;
+    int layer, delivered = 0;
+    
+    if (!pkts || n > OSI_BURST_MAX) {
+        return -EINVAL;
+    }
     
-    // Simulate presentation layer processing
-    // - Data encryption/decryption
-    // - Data compression
-    // - Data format conversion
-    // - Character encoding
+    for (i = 0; i < n; i++) {
+        struct osi_burst_pkt *p = &pkts[i];
+    
+        if (i + 1 < n && pkts[i + 1].data) {
+            prefetch(pkts[i + 1].data);
+        }
+        depth[i] = -1;
+        if (!p->data || p->len == 0) {
+            pr_err_ratelimited("Invalid packet data\n");
+            p->ret = -EINVAL;
+            continue;
+        }
+        p->ret = osi_parse_headers(p->data, p->len, &p->desc);
+        if (p->ret) {
+            errors[LAYER_2_DATALINK - 1]++;
+            pr_debug_ratelimited("OSI: Malformed %u byte frame dropped\n", p->len);
+            continue;
+        }
+        depth[i] = osi_pkt_depth(&p->desc);
+    }
     
-    global_osi_stack.layers[5].packet_count++;
-    atomic_inc(&global_osi_stack.layers[5].active_packets);
+    rcu_read_lock();
+    for (layer = 0; layer < OSI_LAYERS; layer++) {
+        const struct osi_layer_hook *h = rcu_dereference(osi_hooks[layer]);
+    
+        if (!h) {
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            struct osi_burst_pkt *p = &pkts[i];
+    
+            if (depth[i] < layer || (p->desc.flags & h->needs) != h->needs) {
+                continue;
+            }
+            p->ret = h->fn(&p->desc, h->arg);
+            if (p->ret) {
+                depth[i] = -1;
+                errors[layer]++;
+                pr_debug_ratelimited("OSI: Layer %d dropped a packet: %d\n", layer + 1, p->ret);
+            }
+        }
+    }
+    rcu_read_unlock();
+    
+    for (i = 0; i < n; i++) {
+        if (depth[i] >= 0) {
+            packets[depth[i]]++;
+            bytes[depth[i]] += pkts[i].len;
+            delivered++;
+        }
+    }
+    for (layer = 0; layer < OSI_LAYERS; layer++) {
+        if (packets[layer]) {
+            this_cpu_add(osi_pcpu_stats.depth_packets[layer], packets[layer]);
+            this_cpu_add(osi_pcpu_stats.depth_bytes[layer], bytes[layer]);
+        }
+        if (errors[layer]) {
+            this_cpu_add(osi_pcpu_stats.errors[layer], errors[layer]);
+        }
+    }
     
-    return 0;
+    return delivered;
 }
 
 /**
- * Layer 7 - Application Layer
+ * Process packet through OSI stack: a burst of one
  */
-static int osi_layer7_application(const u8 *data, u16 len)
+static int osi_process_packet(const u8 *data, u16 len)
 {
-    pr_debug("OSI Layer 7 (Application): Processing %d bytes\n", len);
-    
-    // Simulate application layer processing
-    // - Application protocols
-    // - User interface
-    // - Network services
-    // - HTTP, FTP, SMTP, etc.
+    struct osi_burst_pkt pkt = {
+        .data = data,
+        .len = len,
+    };
     
-    global_osi_stack.layers[6].packet_count++;
-    atomic_inc(&global_osi_stack.layers[6].active_packets);
-    
-    return 0;
+    osi_process_burst(&pkt, 1);
+    return pkt.ret;
 }
 
-/**
- * Process packet through OSI stack
- */
-static int osi_process_packet(const u8 *data, u16 len)
+// Sum the per-CPU counters: a layer saw every packet reaching it or deeper
+static void osi_fold_stats(unsigned long *packets, unsigned long *bytes, unsigned long *errors)
 {
-    int ret;
-    
-    if (!data || len == 0) {
-        pr_err("Invalid packet data\n");
-        return -EINVAL;
-    }
-    
-    pr_info("Processing packet through OSI stack: %d bytes\n", len);
-    
-    // Process through all layers
-    ret = osi_layer1_physical(data, len);
-    if (ret) {
-        pr_err("Layer 1 processing failed\n");
-        return ret;
-    }
-    
-    ret = osi_layer2_datalink(data, len);
-    if (ret) {
-        pr_err("Layer 2 processing failed\n");
-        return ret;
-    }
-    
-    ret = osi_layer3_network(data, len);
-    if (ret) {
-        pr_err("Layer 3 processing failed\n");
-        return ret;
-    }
-    
-    ret = osi_layer4_transport(data, len);
-    if (ret) {
-        pr_err("Layer 4 processing failed\n");
-        return ret;
-    }
-    
-    ret = osi_layer5_session(data, len);
-    if (ret) {
-        pr_err("Layer 5 processing failed\n");
-        return ret;
-    }
-    
-    ret = osi_layer6_presentation(data, len);
-    if (ret) {
-        pr_err("Layer 6 processing failed\n");
-        return ret;
+    int cpu, i;
+    
+    memset(packets, 0, OSI_LAYERS * sizeof(*packets));
+    memset(bytes, 0, OSI_LAYERS * sizeof(*bytes));
+    memset(errors, 0, OSI_LAYERS * sizeof(*errors));
+    for_each_possible_cpu(cpu) {
+        const struct osi_pcpu_stats *s = per_cpu_ptr(&osi_pcpu_stats, cpu);
+    
+        for (i = 0; i < OSI_LAYERS; i++) {
+            packets[i] += s->depth_packets[i];
+            bytes[i] += s->depth_bytes[i];
+            errors[i] += s->errors[i];
+        }
     }
-    
-    ret = osi_layer7_application(data, len);
-    if (ret) {
-        pr_err("Layer 7 processing failed\n");
-        return ret;
+    for (i = OSI_LAYERS - 2; i >= 0; i--) {
+        packets[i] += packets[i + 1];
+        bytes[i] += bytes[i + 1];
     }
-    
-    atomic_inc(&global_osi_stack.total_packets);
-    
-    pr_info("Packet processed successfully through all OSI layers\n");
-    
-    return 0;
 }
 
 /**
@@ -296,11 +468,18 @@ static int osi_process_packet(const u8 *data, u16 len)
  */
 static int osi_get_stats(u32 *total_packets, u32 *stack_errors, bool *stack_active)
 {
+    unsigned long packets[OSI_LAYERS], bytes[OSI_LAYERS], errors[OSI_LAYERS];
+    int i;
+    
+    osi_fold_stats(packets, bytes, errors);
     if (total_packets) {
-        *total_packets = atomic_read(&global_osi_stack.total_packets);
+        *total_packets = packets[0];
     }
     if (stack_errors) {
-        *stack_errors = global_osi_stack.stack_errors;
+        *stack_errors = 0;
+        for (i = 0; i < OSI_LAYERS; i++) {
+            *stack_errors += errors[i];
+        }
     }
     if (stack_active) {
         *stack_active = global_osi_stack.stack_active;
@@ -311,23 +490,42 @@ static int osi_get_stats(u32 *total_packets, u32 *stack_errors, bool *stack_acti
 
 /**
  * Get layer statistics
+ *
+ * Throughput is the layer's byte rate since the previous call that was
+ * at least a second ago.
  */
 static int osi_get_layer_stats(enum osi_layer layer, u32 *packet_count, u32 *error_count, u32 *throughput_bps)
 {
+    unsigned long packets[OSI_LAYERS], bytes[OSI_LAYERS], errors[OSI_LAYERS];
+    struct osi_layer_config *cfg;
+    unsigned long now = jiffies;
+    int layer_idx;
+    
     if (layer < 1 || layer > 7) {
         return -EINVAL;
     }
+    layer_idx = layer - 1;
+    cfg = &global_osi_stack.layers[layer_idx];
+    
+    osi_fold_stats(packets, bytes, errors);
     
-    int layer_idx = layer - 1;
+    spin_lock_bh(&global_osi_stack.sample_lock);
+    if (time_after_eq(now, cfg->sample_time + HZ)) {
+        cfg->throughput_bps = div_u64((u64)(bytes[layer_idx] - cfg->sample_bytes) * 8 * HZ,
+                                      now - cfg->sample_time);
+        cfg->sample_bytes = bytes[layer_idx];
+        cfg->sample_time = now;
+    }
+    if (throughput_bps) {
+        *throughput_bps = cfg->throughput_bps;
+    }
+    spin_unlock_bh(&global_osi_stack.sample_lock);
     
     if (packet_count) {
-        *packet_count = global_osi_stack.layers[layer_idx].packet_count;
+        *packet_count = packets[layer_idx];
     }
     if (error_count) {
-        *error_count = global_osi_stack.layers[layer_idx].error_count;
-    }
-    if (throughput_bps) {
-        *throughput_bps = global_osi_stack.layers[layer_idx].throughput_bps;
+        *error_count = errors[layer_idx];
     }
     
     return 0;
@@ -357,6 +555,11 @@ static int __init osi_model_init_module(void)
  */
 static void __exit osi_model_cleanup_module(void)
 {
+    int i;
+    
+    for (i = LAYER_1_PHYSICAL; i <= LAYER_7_APPLICATION; i++) {
+        osi_unregister_layer_hook(i);
+    }
     pr_info("OSI Model unloaded\n");
 }
 
@@ -5,6 +5,11 @@
  * 
  * First-to-market PCIe 6.0 link training algorithm
  * Research breakthrough: 2ns latency achieved
+ *
+ * Equalization judges each preset on all lanes at once when the PHY can
+ * evaluate them in parallel, and remembers the best preset per lane: a
+ * retrain first tries what worked last time and sweeps only the lanes
+ * that no longer hold up. Every LTSSM phase is timed, last and worst.
  */
 
 #include <linux/module.h>
@@ -13,12 +18,18 @@
 #include <linux/delay.h>
 #include <linux/bitops.h>
 #include <linux/io.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
 
-#define PCIE6_VERSION "1.0.0"
-#define PCIE6_MAX_LANES 16
+#include "pcie6_link_training.h"
+
+#define PCIE6_VERSION "1.1.0"
 #define PCIE6_LINK_SPEED_64GT 6
 #define PCIE6_TRAINING_TIMEOUT_MS 1000
 #define PCIE6_EQUALIZATION_RETRIES 3
+#define PCIE6_EQ_EVAL_US 100            // receiver adaptation per preset
+#define PCIE6_EQ_MERIT_MIN 50
 
 struct pcie6_link {
     int link_id;
@@ -32,6 +43,15 @@ struct pcie6_link {
     u32 equalization_coeffs[PCIE6_MAX_LANES];
     u32 pre_emphasis[PCIE6_MAX_LANES];
     u32 vswing[PCIE6_MAX_LANES];
+    u32 de_emphasis[PCIE6_MAX_LANES];
+    
+    struct mutex lock;                  // training, and the PHY binding
+    const struct pcie6_phy_ops *ops;    // NULL: simulated PHY
+    void *ctx;
+    unsigned long cached_lanes;         // lanes whose cached preset is valid
+    u8 cached_preset[PCIE6_MAX_LANES];
+    u32 cached_merit[PCIE6_MAX_LANES];
+    struct pcie6_training_stats stats;
 };
 
 static struct pcie6_link pcie6_links[PCIE6_MAX_LANES];
@@ -42,7 +62,7 @@ static int pcie6_link_count = 0;
  */
 static int pcie6_link_init(struct pcie6_link *link, int link_id, u8 num_lanes)
 {
-    if (!link) {
+    if (!link || !num_lanes || num_lanes > PCIE6_MAX_LANES) {
         pr_err("PCIe6 link is NULL\n");
         return -EINVAL;
     }
@@ -60,47 +80,222 @@ static int pcie6_link_init(struct pcie6_link *link, int link_id, u8 num_lanes)
     memset(link->equalization_coeffs, 0, sizeof(link->equalization_coeffs));
     memset(link->pre_emphasis, 0, sizeof(link->pre_emphasis));
     memset(link->vswing, 0, sizeof(link->vswing));
+    memset(link->de_emphasis, 0, sizeof(link->de_emphasis));
+    mutex_init(&link->lock);
+    link->ops = NULL;
+    link->ctx = NULL;
+    link->cached_lanes = 0;
+    memset(&link->stats, 0, sizeof(link->stats));
     
     pr_info("PCIe6 link %d initialized with %d lanes\n", link_id, num_lanes);
     return 0;
 }
 
+/*
+ * Transmitter presets (PCIe 6.0 table 8-1), preshoot and de-emphasis in
+ * tenths of a dB
+ */
+static const struct { u8 preshoot; u8 de_emphasis; } pcie6_presets[PCIE6_NUM_PRESETS] = {
+    { 0, 60 }, { 0, 35 }, { 0, 44 }, { 0, 25 }, { 0, 0 }, { 19, 0 },
+    { 25, 0 }, { 35, 60 }, { 35, 35 }, { 35, 0 }, { 0, 95 },
+};
+
+// Simulated LTSSM phase times without a PHY driver
+static const unsigned int pcie6_sim_phase_ms[PCIE6_PHASES] = {
+    [PCIE6_PHASE_DETECT] = 10,
+    [PCIE6_PHASE_SPEED] = 5,
+    [PCIE6_PHASE_L0] = 2,
+};
+
+static const char * const pcie6_phase_names[PCIE6_PHASES] = {
+    "Detect", "Polling", "Configuration", "Recovery.Speed", "Recovery.Equalization", "L0",
+};
+
+// Stand-in channel: each lane has a preset it likes best
+static u32 pcie6_sim_merit(int lane, u8 preset)
+{
+    int best = (lane * 7 + 3) % PCIE6_NUM_PRESETS;
+    
+    return 100 - min(100, abs(best - preset) * 12);
+}
+
+/*
+ * Set preset on lanes and read back each one's figure of merit: in one
+ * call when the PHY evaluates lanes in parallel, else lane by lane
+ */
+static int pcie6_eq_evaluate(struct pcie6_link *link, unsigned long lanes, u8 preset, u32 *merit)
+{
+    int lane, ret = 0;
+    
+    link->stats.eq_evaluations++;
+    if (!link->ops) {
+        udelay(PCIE6_EQ_EVAL_US);       // all lanes at once
+        for_each_set_bit(lane, &lanes, PCIE6_MAX_LANES) {
+            merit[lane] = pcie6_sim_merit(lane, preset);
+        }
+        return 0;
+    }
+    if (link->ops->parallel_eval) {
+        return link->ops->eq_evaluate(link->ctx, (u32)lanes, preset, merit);
+    }
+    for_each_set_bit(lane, &lanes, PCIE6_MAX_LANES) {
+        ret = link->ops->eq_evaluate(link->ctx, BIT(lane), preset, merit);
+        if (ret) {
+            break;
+        }
+    }
+    return ret;
+}
+
+/*
+ * Leave each lane on its own preset: one evaluation per distinct preset,
+ * which also confirms the merit. Returns the lanes that did not hold up.
+ */
+static unsigned long pcie6_eq_settle(struct pcie6_link *link, unsigned long lanes, const u8 *preset,
+                           const u32 *min_merit, u32 *merit, int *err)
+{
+    unsigned long group, weak = 0;
+    int lane, p;
+    
+    for (p = 0; p < PCIE6_NUM_PRESETS; p++) {
+        group = 0;
+        for_each_set_bit(lane, &lanes, PCIE6_MAX_LANES) {
+            if (preset[lane] == p) {
+                group |= BIT(lane);
+            }
+        }
+        if (!group) {
+            continue;
+        }
+        *err = pcie6_eq_evaluate(link, group, p, merit);
+        if (*err) {
+            return lanes;
+        }
+        for_each_set_bit(lane, &group, PCIE6_MAX_LANES) {
+            if (merit[lane] < min_merit[lane]) {
+                weak |= BIT(lane);
+            }
+        }
+    }
+    return weak;
+}
+
+static void pcie6_eq_commit(struct pcie6_link *link, int lane, u8 preset, u32 merit)
+{
+    link->equalization_coeffs[lane] = preset;
+    link->pre_emphasis[lane] = pcie6_presets[preset].preshoot;
+    link->de_emphasis[lane] = pcie6_presets[preset].de_emphasis;
+    link->cached_preset[lane] = preset;
+    link->cached_merit[lane] = merit;
+}
+
 /**
  * Advanced equalization algorithm for PCIe 6.0
+ *
+ * Lanes with a cached preset try it first and keep it when it still
+ * reaches three quarters of the merit it had. The rest sweep all presets
+ * together, each preset judged on every such lane at once, and settle on
+ * their best; a lane that still falls short is swept again, up to
+ * PCIE6_EQUALIZATION_RETRIES times.
  */
 static int pcie6_advanced_equalization(struct pcie6_link *link)
 {
-    int lane, retry;
-    u32 eq_value;
+    unsigned long all = GENMASK(link->num_lanes - 1, 0), sweep, weak;
+    u32 merit[PCIE6_MAX_LANES], best[PCIE6_MAX_LANES], need[PCIE6_MAX_LANES];
+    u8 choice[PCIE6_MAX_LANES];
+    int lane, retry, p, ret = 0;
     
-    if (!link) {
-        return -EINVAL;
+    pr_debug("Starting advanced equalization for PCIe6 link %d\n", link->link_id);
+    
+    sweep = all & ~link->cached_lanes;
+    if (link->cached_lanes & all) {
+        for_each_set_bit(lane, &all, PCIE6_MAX_LANES) {
+            choice[lane] = link->cached_preset[lane];
+            need[lane] = max_t(u32, PCIE6_EQ_MERIT_MIN, link->cached_merit[lane] * 3 / 4);
+        }
+        sweep |= pcie6_eq_settle(link, all & link->cached_lanes, choice, need, merit, &ret);
+        if (ret) {
+            goto fail;
+        }
+        for_each_set_bit(lane, &all, PCIE6_MAX_LANES) {
+            if (!(sweep & BIT(lane))) {
+                pcie6_eq_commit(link, lane, choice[lane], merit[lane]);
+            }
+        }
+        if (!sweep) {
+            link->stats.cached_eq++;
+            return 0;
+        }
     }
     
-    pr_info("Starting advanced equalization for PCIe6 link %d\n", link->link_id);
+    link->stats.full_eq++;
+    for (retry = 0; sweep && retry < PCIE6_EQUALIZATION_RETRIES; retry++) {
+        for_each_set_bit(lane, &sweep, PCIE6_MAX_LANES) {
+            best[lane] = 0;
+            choice[lane] = 0;
+            need[lane] = PCIE6_EQ_MERIT_MIN;
+        }
+        for (p = 0; p < PCIE6_NUM_PRESETS; p++) {
+            ret = pcie6_eq_evaluate(link, sweep, p, merit);
+            if (ret) {
+                goto fail;
+            }
+            for_each_set_bit(lane, &sweep, PCIE6_MAX_LANES) {
+                if (merit[lane] > best[lane]) {
+                    best[lane] = merit[lane];
+                    choice[lane] = p;
+                }
+            }
+        }
+        
+        weak = pcie6_eq_settle(link, sweep, choice, need, merit, &ret);
+        if (ret) {
+            goto fail;
+        }
+        for_each_set_bit(lane, &sweep, PCIE6_MAX_LANES) {
+            if (!(weak & BIT(lane))) {
+                pcie6_eq_commit(link, lane, choice[lane], merit[lane]);
+                pr_debug("Lane %d equalization: preset P%d, merit %u\n", lane, choice[lane], merit[lane]);
+            }
+        }
+        link->cached_lanes |= sweep & ~weak;
+        sweep = weak;
+    }
     
-    for (lane = 0; lane < link->num_lanes; lane++) {
-        for (retry = 0; retry < PCIE6_EQUALIZATION_RETRIES; retry++) {
-            // Calculate optimal equalization coefficients
-            eq_value = (lane << 8) | (retry << 4) | 0x0F;
-            link->equalization_coeffs[lane] = eq_value;
-            
-            // Apply pre-emphasis settings
-            link->pre_emphasis[lane] = (eq_value >> 4) & 0x0F;
-            
-            // Apply voltage swing settings
-            link->vswing[lane] = eq_value & 0x0F;
-            
-            // Simulate equalization training
-            udelay(100); // 100us delay for training
-            
-            pr_debug("Lane %d equalization: coeff=0x%x, pre_emp=%d, vswing=%d\n",
-                     lane, eq_value, link->pre_emphasis[lane], link->vswing[lane]);
-        }
-    }
-    
-    pr_info("Advanced equalization completed for PCIe6 link %d\n", link->link_id);
+    if (sweep) {
+        pr_err("PCIe6 link %d: lanes 0x%lx failed equalization\n", link->link_id, sweep);
+        ret = -EIO;
+        goto fail;
+    }
+    pr_debug("Advanced equalization completed for PCIe6 link %d\n", link->link_id);
     return 0;
+    
+fail:
+    link->cached_lanes = 0;             // nothing learnt here is to be trusted
+    return ret;
+}
+
+static int pcie6_run_phase(struct pcie6_link *link, enum pcie6_ltssm_phase phase)
+{
+    u64 start = ktime_get_ns(), ns;
+    int ret = 0;
+    
+    if (phase == PCIE6_PHASE_EQ) {
+        ret = pcie6_advanced_equalization(link);
+    } else if (link->ops && link->ops->wait_phase) {
+        ret = link->ops->wait_phase(link->ctx, phase, PCIE6_TRAINING_TIMEOUT_MS);
+    } else if (!link->ops && pcie6_sim_phase_ms[phase]) {
+        msleep(pcie6_sim_phase_ms[phase]);
+    }
+    
+    ns = ktime_get_ns() - start;
+    link->stats.phase_ns[phase] = ns;
+    link->stats.phase_max_ns[phase] = max(link->stats.phase_max_ns[phase], ns);
+    if (ret) {
+        pr_err("PCIe6 link %d: %s failed after %llu us: %d\n", link->link_id,
+               pcie6_phase_names[phase], div_u64(ns, NSEC_PER_USEC), ret);
+    }
+    return ret;
 }
 
 /**
@@ -108,44 +303,36 @@ static int pcie6_advanced_equalization(struct pcie6_link *link)
  */
 static int pcie6_link_training(struct pcie6_link *link)
 {
-    u32 start_time, end_time;
-    int ret;
+    u64 start;
+    int phase, ret;
     
     if (!link) {
         pr_err("PCIe6 link is NULL\n");
         return -EINVAL;
     }
     
-    start_time = jiffies;
+    start = ktime_get_ns();
+    link->link_up = false;
+    memset(link->stats.phase_ns, 0, sizeof(link->stats.phase_ns));
     
     pr_info("Starting PCIe6 link training for link %d\n", link->link_id);
     
-    // Phase 1: Detect and initialize
-    pr_info("Phase 1: Link detection and initialization\n");
-    msleep(10); // Simulate detection time
-    
-    // Phase 2: Speed negotiation
-    pr_info("Phase 2: Speed negotiation to 64GT/s\n");
-    msleep(5); // Simulate speed negotiation
-    
-    // Phase 3: Advanced equalization
-    ret = pcie6_advanced_equalization(link);
-    if (ret) {
-        pr_err("Advanced equalization failed for link %d\n", link->link_id);
-        link->error_count++;
-        return ret;
+    for (phase = 0; phase < PCIE6_PHASES; phase++) {
+        ret = pcie6_run_phase(link, phase);
+        if (ret) {
+            link->error_count++;
+            return ret;
+        }
     }
     
-    // Phase 4: Link training completion
-    pr_info("Phase 4: Link training completion\n");
-    msleep(2); // Simulate final training
-    
-    end_time = jiffies;
-    link->training_time = jiffies_to_msecs(end_time - start_time);
+    link->stats.total_ns = ktime_get_ns() - start;
+    link->stats.trainings++;
+    link->training_time = div_u64(link->stats.total_ns, NSEC_PER_MSEC);
     link->link_up = true;
     
-    pr_info("PCIe6 link %d training completed in %d ms\n", 
-            link->link_id, link->training_time);
+    pr_info("PCIe6 link %d training completed in %llu us (equalization %llu us)\n",
+            link->link_id, div_u64(link->stats.total_ns, NSEC_PER_USEC),
+            div_u64(link->stats.phase_ns[PCIE6_PHASE_EQ], NSEC_PER_USEC));
     
     return 0;
 }
@@ -165,6 +352,86 @@ static int pcie6_get_link_status(struct pcie6_link *link, bool *is_up, u32 *spee
     return 0;
 }
 
+/**
+ * Bind a PHY driver to a link; its presets are learnt afresh
+ */
+int pcie6_register_phy(int link_id, const struct pcie6_phy_ops *ops, void *ctx)
+{
+    struct pcie6_link *link;
+    
+    if (link_id < 0 || link_id >= pcie6_link_count || !ops || !ops->eq_evaluate) {
+        return -EINVAL;
+    }
+    
+    link = &pcie6_links[link_id];
+    mutex_lock(&link->lock);
+    link->ops = ops;
+    link->ctx = ctx;
+    link->cached_lanes = 0;
+    link->link_up = false;
+    mutex_unlock(&link->lock);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(pcie6_register_phy);
+
+void pcie6_unregister_phy(int link_id)
+{
+    struct pcie6_link *link;
+    
+    if (link_id < 0 || link_id >= pcie6_link_count) {
+        return;
+    }
+    
+    link = &pcie6_links[link_id];
+    mutex_lock(&link->lock);
+    link->ops = NULL;
+    link->ctx = NULL;
+    link->cached_lanes = 0;
+    link->link_up = false;
+    mutex_unlock(&link->lock);
+}
+EXPORT_SYMBOL_GPL(pcie6_unregister_phy);
+
+/**
+ * Train or retrain a link, hot-plug recovery included
+ */
+int pcie6_train(int link_id)
+{
+    struct pcie6_link *link;
+    int ret;
+    
+    if (link_id < 0 || link_id >= pcie6_link_count) {
+        return -EINVAL;
+    }
+    
+    link = &pcie6_links[link_id];
+    mutex_lock(&link->lock);
+    ret = pcie6_link_training(link);
+    mutex_unlock(&link->lock);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(pcie6_train);
+
+int pcie6_get_training_stats(int link_id, struct pcie6_training_stats *stats)
+{
+    struct pcie6_link *link;
+    int lane;
+    
+    if (link_id < 0 || link_id >= pcie6_link_count || !stats) {
+        return -EINVAL;
+    }
+    
+    link = &pcie6_links[link_id];
+    mutex_lock(&link->lock);
+    *stats = link->stats;
+    for (lane = 0; lane < link->num_lanes; lane++) {
+        stats->preset[lane] = link->equalization_coeffs[lane];
+    }
+    mutex_unlock(&link->lock);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(pcie6_get_training_stats);
+
 /**
  * Module initialization
  */
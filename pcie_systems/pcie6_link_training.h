@@ -0,0 +1,58 @@
+/**
+ * PCIe 6.0 link training interface
+ *
+ * What a PHY driver gives pcie6_link_training.c. Equalization sweeps the
+ * eleven transmitter presets; a PHY whose lanes have their own receiver
+ * evaluators can set and judge a preset on many lanes with one call,
+ * and then a sweep costs eleven evaluations whatever the width. The best
+ * preset found per lane is kept and tried first on the next retrain, so
+ * a link that comes back the way it left skips the sweep altogether.
+ */
+
+#ifndef PCIE6_LINK_TRAINING_H
+#define PCIE6_LINK_TRAINING_H
+
+#include <linux/types.h>
+
+#define PCIE6_MAX_LANES 16
+#define PCIE6_NUM_PRESETS 11
+
+enum pcie6_ltssm_phase {
+    PCIE6_PHASE_DETECT,
+    PCIE6_PHASE_POLLING,
+    PCIE6_PHASE_CONFIG,
+    PCIE6_PHASE_SPEED,                  // Recovery.Speed to 64 GT/s
+    PCIE6_PHASE_EQ,                     // Recovery.Equalization
+    PCIE6_PHASE_L0,
+    PCIE6_PHASES,
+};
+
+/*
+ * eq_evaluate sets preset on every lane in lanes, lets the receivers
+ * adapt and fills merit[lane] (larger is better, 0 = no lock) for each
+ * of them. With parallel_eval clear it is only ever given one lane.
+ * wait_phase blocks until the LTSSM has finished phase; it is optional.
+ */
+struct pcie6_phy_ops {
+    int (*eq_evaluate)(void *ctx, u32 lanes, u8 preset, u32 *merit);
+    int (*wait_phase)(void *ctx, enum pcie6_ltssm_phase phase, unsigned int timeout_ms);
+    bool parallel_eval;
+};
+
+struct pcie6_training_stats {
+    u64 phase_ns[PCIE6_PHASES];         // last training
+    u64 phase_max_ns[PCIE6_PHASES];
+    u64 total_ns;
+    u32 trainings;
+    u32 full_eq;
+    u32 cached_eq;                      // retrains where every lane kept its cached preset
+    u32 eq_evaluations;
+    u8 preset[PCIE6_MAX_LANES];
+};
+
+int pcie6_register_phy(int link_id, const struct pcie6_phy_ops *ops, void *ctx);
+void pcie6_unregister_phy(int link_id);
+int pcie6_train(int link_id);
+int pcie6_get_training_stats(int link_id, struct pcie6_training_stats *stats);
+
+#endif /* PCIE6_LINK_TRAINING_H */
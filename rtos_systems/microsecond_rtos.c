@@ -5,6 +5,31 @@
  * 
  * Real-time kernel with lockless algorithms
  * Research breakthrough: Microsecond precision achieved
+ *
+ * The tick runs without a lock. Wakeups from any context are pushed on a
+ * lock-free list that the tick drains; only the tick touches the ready
+ * queues, and a bitmap with a bit per non-empty queue gives the highest
+ * ready priority with one fls() instead of a scan of all 32 queues.
+ *
+ * With sched_edf set the scheduler is Earliest-Deadline-First and
+ * tickless: a job released by rtos_wake_task() is due deadline_us later,
+ * ready jobs sit in a min-heap on their absolute deadlines, and the
+ * timer is one-shot, programmed for the next deadline only and left off
+ * when nothing is ready. Wakeups kick it to run at once.
+ *
+ * Every core has its own run queue and timer, so cores never wait on one
+ * another. A task is pinned to the core it was created on, or is best
+ * effort and placed on the least loaded core; an idle core asks the core
+ * with most best-effort tasks waiting for one, and that core's own tick
+ * hands it over through the idle core's wakeup list, which keeps every
+ * run queue single-owner.
+ *
+ * Each job's response time, release to done, goes into a log2 histogram
+ * of its task, and the scheduler records switches, releases, completions,
+ * misses and migrations in a ring per core that only that core's tick
+ * writes. /dev/rtos_trace reads out what has accumulated as a CTF 1.8
+ * stream, the cores merged in time order with each event tagged with its
+ * core, described by /dev/rtos_trace_metadata.
  */
 
 #include <linux/module.h>
@@ -14,14 +39,65 @@
 #include <linux/hrtimer.h>
 #include <linux/spinlock.h>
 #include <linux/atomic.h>
+#include <linux/bitops.h>
+#include <linux/llist.h>
 #include <linux/slab.h>
 #include <linux/errno.h>
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
+#include <linux/cpumask.h>
+#include <linux/irq_work.h>
+#include <linux/percpu.h>
+#include <linux/smp.h>
+#include <linux/fs.h>
+#include <linux/log2.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/uaccess.h>
+#include <asm/unaligned.h>
 
-#define RTOS_VERSION "2.0.0"
+#define RTOS_VERSION "2.4.0"
 #define MAX_TASKS 64
 #define TICK_RESOLUTION_US 1
 #define MAX_PRIORITY 32
 #define RTOS_TIMER_FREQ 1000000  // 1MHz for microsecond precision
+#define RTOS_ANY_CPU -1
+#define RTOS_HIST_BUCKETS 16     // log2 of the response time in us, the last open-ended
+#define RTOS_TRACE_EVENTS 4096   // per core, a power of 2
+#define RTOS_TRACE_NONE 0xff
+#define RTOS_CTF_MAGIC 0xc1fc1fc1
+
+// Task states
+#define RTOS_TASK_READY 0    // on its ready queue
+#define RTOS_TASK_RUNNING 1
+#define RTOS_TASK_IDLE 2     // on no queue
+#define RTOS_TASK_WAKING 3   // on the pending list, not yet seen by the tick
+
+// Trace event ids, as in the CTF metadata
+enum rtos_trace_id {
+    RTOS_EV_SWITCH,                  // task -> other, -1 for idle
+    RTOS_EV_RELEASE,                 // value: ns from wakeup to being queued
+    RTOS_EV_DONE,                    // value: response time in us
+    RTOS_EV_MISS,
+    RTOS_EV_MIGRATE                  // other: destination core
+};
+
+struct rtos_trace_event {
+    u64 ts_ns;
+    u32 value;
+    s16 task;
+    u8 other;
+    u8 id;
+};
+
+static bool sched_edf;
+module_param(sched_edf, bool, 0444);
+MODULE_PARM_DESC(sched_edf, "Earliest-Deadline-First on a tickless timer instead of fixed priority on a 1 us tick");
+
+static bool trace = true;
+module_param(trace, bool, 0644);
+MODULE_PARM_DESC(trace, "Record scheduling events for /dev/rtos_trace");
 
 struct rtos_task {
     int task_id;
@@ -34,71 +110,233 @@ struct rtos_task {
     void (*task_func)(void *data);
     void *task_data;
     struct list_head task_list;
+    struct llist_node wake_node;
+    u64 abs_deadline_ns;             // of the current job, EDF
+    int heap_index;
+    atomic_t job_done;
+    int cpu;                         // run queue it is on or woken to
+    bool pinned;                     // never migrates
+    u64 release_ns;                  // of the current job
+    u32 jobs;
+    u64 max_response_ns;
+    u32 response_hist[RTOS_HIST_BUCKETS];
     spinlock_t task_lock;
 };
 
+struct rtos_task_stats {
+    u32 jobs;
+    u32 missed_deadlines;
+    u64 max_response_ns;
+    u32 response_hist[RTOS_HIST_BUCKETS];    // bucket b: [2^b, 2^(b+1)) us, 0 from 0
+};
+
+/*
+ * One per core. ready_queue, ready_bitmap, edf_heap and current_task
+ * belong to the core's tick; other contexts hand tasks over through
+ * pending
+ */
 struct rtos_scheduler {
     struct list_head ready_queue[MAX_PRIORITY];
+    u32 ready_bitmap;                // bit p set while ready_queue[p] is non-empty
+    struct llist_head pending;
+    struct rtos_task *edf_heap[MAX_TASKS];   // min-heap on abs_deadline_ns
+    int edf_count;
     struct rtos_task *current_task;
+    int cpu;
+    int nr_stealable;                // ready and not pinned, read by idle cores
+    atomic_t steal_for;              // idle core asking for a task, -1 if none
+    struct irq_work kick;
     atomic_t task_count;
     struct hrtimer scheduler_timer;
-    spinlock_t scheduler_lock;
     u64 total_execution_time;
     u32 context_switches;
+    u32 migrations;
+    u64 now;                         // of the scheduling point in progress
+    struct rtos_trace_event *trace;
+    u32 trace_head;                  // written by the tick, released to readers
+    u32 trace_tail;                  // under rtos_trace_lock
+    u64 trace_discarded;
 };
 
 static struct rtos_task rtos_tasks[MAX_TASKS];
-static struct rtos_scheduler global_scheduler;
+static DEFINE_PER_CPU(struct rtos_scheduler, rtos_rq);
 static int rtos_task_count = 0;
+static DEFINE_MUTEX(rtos_trace_lock);
+static bool rtos_stopping;           // set once by rtos_stop_scheduler, nothing rearms after it
+
+static enum hrtimer_restart rtos_scheduler_callback(struct hrtimer *timer);
+
+static struct rtos_scheduler *rtos_cpu_rq(int cpu)
+{
+    return per_cpu_ptr(&rtos_rq, cpu);
+}
+
+// Only the core's own tick records, so this needs no lock or atomic
+static void rtos_trace(struct rtos_scheduler *rq, enum rtos_trace_id id, int task, u8 other, u32 value)
+{
+    struct rtos_trace_event *ev;
+    u32 head = rq->trace_head;
+    
+    if (!READ_ONCE(trace)) {
+        return;
+    }
+    
+    ev = &rq->trace[head & (RTOS_TRACE_EVENTS - 1)];
+    ev->ts_ns = rq->now;
+    ev->value = value;
+    ev->task = task;
+    ev->other = other;
+    ev->id = id;
+    smp_store_release(&rq->trace_head, head + 1);
+}
+
+// Run a tickless core's scheduler now, on that core
+static void rtos_kick_fn(struct irq_work *work)
+{
+    struct rtos_scheduler *rq = container_of(work, struct rtos_scheduler, kick);
+    
+    if (READ_ONCE(rtos_stopping)) {
+        return;
+    }
+    hrtimer_start(&rq->scheduler_timer, ktime_get(), HRTIMER_MODE_ABS_PINNED);
+}
+
+static void rtos_kick(struct rtos_scheduler *rq)
+{
+    if (sched_edf && !READ_ONCE(rtos_stopping)) {
+        irq_work_queue_on(&rq->kick, rq->cpu);
+    }
+}
 
 /**
  * Initialize microsecond-precision RTOS
  */
 static int rtos_init(void)
 {
-    int i;
+    struct rtos_scheduler *rq;
+    int cpu, i;
     
     pr_info("Initializing microsecond-precision RTOS\n");
     
-    // Initialize scheduler
-    for (i = 0; i < MAX_PRIORITY; i++) {
-        INIT_LIST_HEAD(&global_scheduler.ready_queue[i]);
+    // Initialize a scheduler per core
+    for_each_possible_cpu(cpu) {
+        rq = rtos_cpu_rq(cpu);
+        for (i = 0; i < MAX_PRIORITY; i++) {
+            INIT_LIST_HEAD(&rq->ready_queue[i]);
+        }
+        
+        rq->ready_bitmap = 0;
+        rq->edf_count = 0;
+        init_llist_head(&rq->pending);
+        rq->current_task = NULL;
+        rq->cpu = cpu;
+        rq->nr_stealable = 0;
+        atomic_set(&rq->steal_for, -1);
+        init_irq_work(&rq->kick, rtos_kick_fn);
+        atomic_set(&rq->task_count, 0);
+        rq->total_execution_time = 0;
+        rq->context_switches = 0;
+        rq->migrations = 0;
+        rq->trace_head = 0;
+        rq->trace_tail = 0;
+        rq->trace_discarded = 0;
+        rq->trace = kvcalloc(RTOS_TRACE_EVENTS, sizeof(*rq->trace), GFP_KERNEL);
+        if (!rq->trace) {
+            return -ENOMEM;
+        }
+        
+        // Initialize scheduler timer; it only ever runs on its own core
+        hrtimer_init(&rq->scheduler_timer, CLOCK_MONOTONIC,
+                     sched_edf ? HRTIMER_MODE_ABS_PINNED : HRTIMER_MODE_REL_PINNED);
+        rq->scheduler_timer.function = rtos_scheduler_callback;
     }
     
-    global_scheduler.current_task = NULL;
-    atomic_set(&global_scheduler.task_count, 0);
-    global_scheduler.total_execution_time = 0;
-    global_scheduler.context_switches = 0;
-    spin_lock_init(&global_scheduler.scheduler_lock);
+    pr_info("Microsecond-precision RTOS initialized successfully\n");
+    return 0;
+}
+
+/**
+ * Make a task ready; safe from any context, including other CPUs and
+ * interrupts, as it only pushes the task for the next tick to queue
+ */
+static int rtos_wake_task(struct rtos_task *task)
+{
+    struct rtos_scheduler *rq;
+    
+    if (atomic_cmpxchg(&task->state, RTOS_TASK_IDLE, RTOS_TASK_WAKING) != RTOS_TASK_IDLE) {
+        return -EALREADY;
+    }
     
-    // Initialize scheduler timer
-    hrtimer_init(&global_scheduler.scheduler_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    // The job is released now; its deadline moves with it if it migrates
+    task->release_ns = ktime_get_ns();
+    task->abs_deadline_ns = task->release_ns + (u64)task->deadline_us * NSEC_PER_USEC;
+    rq = rtos_cpu_rq(READ_ONCE(task->cpu));
     
-    pr_info("Microsecond-precision RTOS initialized successfully\n");
+    // The first wakeup after a drain kicks the tickless timer; later ones ride along
+    if (llist_add(&task->wake_node, &rq->pending)) {
+        rtos_kick(rq);
+    }
     return 0;
 }
 
 /**
- * Create a new RTOS task
+ * The task's current job has finished; it leaves the CPU at the next
+ * scheduling point and stays off every queue until woken again
+ */
+static void rtos_task_done(struct rtos_task *task)
+{
+    atomic_set(&task->job_done, 1);
+    rtos_kick(rtos_cpu_rq(READ_ONCE(task->cpu)));
+}
+
+// Core for a best-effort task: the online one with fewest tasks
+static int rtos_least_loaded_cpu(void)
+{
+    int cpu, best = -1, n, best_n = INT_MAX;
+    
+    for_each_online_cpu(cpu) {
+        n = atomic_read(&rtos_cpu_rq(cpu)->task_count);
+        if (n < best_n) {
+            best = cpu;
+            best_n = n;
+        }
+    }
+    return best;
+}
+
+/**
+ * Create a new RTOS task, pinned to cpu or, with RTOS_ANY_CPU, best
+ * effort: placed on the least loaded core and free to migrate
  */
-static int rtos_create_task(int task_id, u32 priority, u32 deadline_us,
+static int rtos_create_task(int task_id, u32 priority, u32 deadline_us, int cpu,
                             void (*task_func)(void *data), void *task_data)
 {
     struct rtos_task *task;
     
-    if (task_id >= MAX_TASKS || priority >= MAX_PRIORITY || !task_func) {
+    if (task_id >= MAX_TASKS || priority >= MAX_PRIORITY || !task_func || (sched_edf && !deadline_us)) {
         pr_err("Invalid parameters for task creation\n");
         return -EINVAL;
     }
+    if (cpu != RTOS_ANY_CPU && (cpu < 0 || cpu >= nr_cpu_ids || !cpu_online(cpu))) {
+        pr_err("Task %d pinned to CPU %d, which is not online\n", task_id, cpu);
+        return -EINVAL;
+    }
     
     task = &rtos_tasks[task_id];
     
     task->task_id = task_id;
     task->priority = priority;
     task->deadline_us = deadline_us;
-    atomic_set(&task->state, 0); // READY
+    atomic_set(&task->state, RTOS_TASK_IDLE);
+    atomic_set(&task->job_done, 0);
+    task->heap_index = -1;
+    task->pinned = cpu != RTOS_ANY_CPU;
+    task->cpu = task->pinned ? cpu : rtos_least_loaded_cpu();
     task->execution_time_us = 0;
     task->missed_deadlines = 0;
+    task->jobs = 0;
+    task->max_response_ns = 0;
+    memset(task->response_hist, 0, sizeof(task->response_hist));
     task->task_func = task_func;
     task->task_data = task_data;
     spin_lock_init(&task->task_lock);
@@ -108,115 +346,738 @@ static int rtos_create_task(int task_id, u32 priority, u32 deadline_us,
     hrtimer_init(&task->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
     
     rtos_task_count++;
-    atomic_inc(&global_scheduler.task_count);
+    atomic_inc(&rtos_cpu_rq(task->cpu)->task_count);
+    rtos_wake_task(task);
     
-    pr_info("RTOS task %d created with priority %d, deadline %d us\n",
-            task_id, priority, deadline_us);
+    pr_info("RTOS task %d created with priority %d, deadline %d us, %s CPU %d\n",
+            task_id, priority, deadline_us, task->pinned ? "pinned to" : "on", task->cpu);
     
     return 0;
 }
 
+static void edf_heap_swap(struct rtos_scheduler *rq, int a, int b)
+{
+    struct rtos_task **heap = rq->edf_heap;
+    struct rtos_task *t = heap[a];
+    
+    heap[a] = heap[b];
+    heap[b] = t;
+    heap[a]->heap_index = a;
+    heap[b]->heap_index = b;
+}
+
+static void edf_heap_fix(struct rtos_scheduler *rq, int i)
+{
+    struct rtos_task **heap = rq->edf_heap;
+    int n = rq->edf_count;
+    
+    while (i > 0 && heap[(i - 1) / 2]->abs_deadline_ns > heap[i]->abs_deadline_ns) {
+        edf_heap_swap(rq, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        int l = 2 * i + 1, r = l + 1, min = i;
+        
+        if (l < n && heap[l]->abs_deadline_ns < heap[min]->abs_deadline_ns) {
+            min = l;
+        }
+        if (r < n && heap[r]->abs_deadline_ns < heap[min]->abs_deadline_ns) {
+            min = r;
+        }
+        if (min == i) {
+            break;
+        }
+        edf_heap_swap(rq, i, min);
+        i = min;
+    }
+}
+
+static void edf_heap_remove(struct rtos_scheduler *rq, struct rtos_task *task)
+{
+    int i = task->heap_index, last = --rq->edf_count;
+    
+    if (i != last) {
+        edf_heap_swap(rq, i, last);
+        edf_heap_fix(rq, i);
+    }
+    task->heap_index = -1;
+}
+
+static void rtos_ready_add(struct rtos_scheduler *rq, struct rtos_task *task)
+{
+    atomic_set(&task->state, RTOS_TASK_READY);
+    if (!task->pinned) {
+        WRITE_ONCE(rq->nr_stealable, rq->nr_stealable + 1);
+    }
+    if (sched_edf) {
+        task->heap_index = rq->edf_count++;
+        rq->edf_heap[task->heap_index] = task;
+        edf_heap_fix(rq, task->heap_index);
+        return;
+    }
+    list_add_tail(&task->task_list, &rq->ready_queue[task->priority]);
+    rq->ready_bitmap |= BIT(task->priority);
+}
+
+static void rtos_ready_del(struct rtos_scheduler *rq, struct rtos_task *task)
+{
+    if (!task->pinned) {
+        WRITE_ONCE(rq->nr_stealable, rq->nr_stealable - 1);
+    }
+    if (sched_edf) {
+        edf_heap_remove(rq, task);
+        return;
+    }
+    list_del_init(&task->task_list);
+    if (list_empty(&rq->ready_queue[task->priority])) {
+        rq->ready_bitmap &= ~BIT(task->priority);
+    }
+}
+
 /**
- * Real-time task scheduling
+ * Real-time task scheduling, from the core's tick only
  */
-static int rtos_schedule_task(struct rtos_task *task)
+static int rtos_schedule_task(struct rtos_scheduler *rq, struct rtos_task *task)
 {
-    unsigned long flags;
     struct rtos_task *prev_task;
     
     if (!task) {
         return -EINVAL;
     }
     
-    spin_lock_irqsave(&global_scheduler.scheduler_lock, flags);
-    
-    prev_task = global_scheduler.current_task;
+    prev_task = rq->current_task;
     
     // Context switch if needed
     if (prev_task != task) {
         if (prev_task) {
             // Save previous task state
-            atomic_set(&prev_task->state, 0); // READY
-            list_add_tail(&prev_task->task_list, 
-                         &global_scheduler.ready_queue[prev_task->priority]);
+            rtos_ready_add(rq, prev_task);
         }
         
         // Set new current task
-        global_scheduler.current_task = task;
-        atomic_set(&task->state, 1); // RUNNING
-        list_del(&task->task_list);
+        rtos_ready_del(rq, task);
+        rq->current_task = task;
+        atomic_set(&task->state, RTOS_TASK_RUNNING);
         
-        global_scheduler.context_switches++;
+        WRITE_ONCE(rq->context_switches, rq->context_switches + 1);
+        rtos_trace(rq, RTOS_EV_SWITCH, prev_task ? prev_task->task_id : -1, task->task_id, 0);
         
-        pr_debug("Context switch: task %d -> task %d\n",
+        pr_debug("CPU %d context switch: task %d -> task %d\n", rq->cpu,
                 prev_task ? prev_task->task_id : -1, task->task_id);
     }
     
-    spin_unlock_irqrestore(&global_scheduler.scheduler_lock, flags);
-    
     return 0;
 }
 
+// Account a finished job's response time
+static void rtos_job_done(struct rtos_scheduler *rq, struct rtos_task *task)
+{
+    u64 response = rq->now > task->release_ns ? rq->now - task->release_ns : 0;
+    u64 us = div_u64(response, NSEC_PER_USEC);
+    
+    task->jobs++;
+    task->max_response_ns = max(task->max_response_ns, response);
+    task->response_hist[min_t(u32, us ? ilog2(us) : 0, RTOS_HIST_BUCKETS - 1)]++;
+    rtos_trace(rq, RTOS_EV_DONE, task->task_id, RTOS_TRACE_NONE, min_t(u64, us, U32_MAX));
+    
+    // EDF counted it when the deadline passed
+    if (!sched_edf && task->deadline_us && us > task->deadline_us) {
+        task->missed_deadlines++;
+        rtos_trace(rq, RTOS_EV_MISS, task->task_id, RTOS_TRACE_NONE, 0);
+    }
+}
+
+// Take the current task off the CPU if its job is done
+static void rtos_retire_current(struct rtos_scheduler *rq)
+{
+    struct rtos_task *task = rq->current_task;
+    
+    if (task && atomic_xchg(&task->job_done, 0)) {
+        rtos_job_done(rq, task);
+        atomic_set(&task->state, RTOS_TASK_IDLE);
+        rq->current_task = NULL;
+    }
+}
+
+// Queue tasks woken since the last scheduling point, in the order they were woken
+static void rtos_drain_pending(struct rtos_scheduler *rq)
+{
+    struct rtos_task *task, *tmp;
+    struct llist_node *woken;
+    
+    woken = llist_reverse_order(llist_del_all(&rq->pending));
+    llist_for_each_entry_safe(task, tmp, woken, wake_node) {
+        rtos_ready_add(rq, task);
+        rtos_trace(rq, RTOS_EV_RELEASE, task->task_id, RTOS_TRACE_NONE,
+                   min_t(u64, rq->now - min(task->release_ns, rq->now), U32_MAX));
+    }
+}
+
+static bool rtos_rq_idle(struct rtos_scheduler *rq)
+{
+    return !rq->current_task && (sched_edf ? !rq->edf_count : !rq->ready_bitmap);
+}
+
+/*
+ * An idle core asks the core with most best-effort tasks waiting to give
+ * it one. Only one request per victim is outstanding; it is answered at
+ * the victim's next scheduling point, which a tickless victim is kicked
+ * into now.
+ */
+static void rtos_steal_request(struct rtos_scheduler *rq)
+{
+    struct rtos_scheduler *victim = NULL, *other;
+    int cpu, n, best_n = 0;
+    
+    for_each_online_cpu(cpu) {
+        other = rtos_cpu_rq(cpu);
+        n = READ_ONCE(other->nr_stealable);
+        if (other != rq && n > best_n) {
+            victim = other;
+            best_n = n;
+        }
+    }
+    
+    if (victim && atomic_cmpxchg(&victim->steal_for, -1, rq->cpu) == -1) {
+        rtos_kick(victim);
+    }
+}
+
+// The best-effort task to give away: the one this core would run next
+static struct rtos_task *rtos_stealable_task(struct rtos_scheduler *rq)
+{
+    struct rtos_task *task, *best = NULL;
+    u32 bitmap = rq->ready_bitmap;
+    int i, prio;
+    
+    if (sched_edf) {
+        for (i = 0; i < rq->edf_count; i++) {
+            task = rq->edf_heap[i];
+            if (!task->pinned && (!best || task->abs_deadline_ns < best->abs_deadline_ns)) {
+                best = task;
+            }
+        }
+        return best;
+    }
+    
+    while (bitmap) {
+        prio = fls(bitmap) - 1;
+        list_for_each_entry(task, &rq->ready_queue[prio], task_list) {
+            if (!task->pinned) {
+                return task;
+            }
+        }
+        bitmap &= ~BIT(prio);
+    }
+    return NULL;
+}
+
+// Hand a waiting best-effort task to the idle core that asked for one
+static void rtos_steal_answer(struct rtos_scheduler *rq)
+{
+    struct rtos_scheduler *thief;
+    struct rtos_task *task;
+    int cpu = atomic_xchg(&rq->steal_for, -1);
+    
+    if (cpu < 0 || !cpu_online(cpu)) {
+        return;
+    }
+    task = rtos_stealable_task(rq);
+    if (!task) {
+        return;
+    }
+    
+    thief = rtos_cpu_rq(cpu);
+    rtos_ready_del(rq, task);
+    atomic_dec(&rq->task_count);
+    atomic_inc(&thief->task_count);
+    WRITE_ONCE(task->cpu, cpu);
+    atomic_set(&task->state, RTOS_TASK_WAKING);
+    WRITE_ONCE(rq->migrations, rq->migrations + 1);
+    rtos_trace(rq, RTOS_EV_MIGRATE, task->task_id, cpu, 0);
+    
+    if (llist_add(&task->wake_node, &thief->pending)) {
+        rtos_kick(thief);
+    }
+    
+    pr_debug("Task %d migrated: CPU %d -> CPU %d\n", task->task_id, rq->cpu, cpu);
+}
+
+// A job past its deadline is counted once and carries on due a period later
+static void edf_check_deadline(struct rtos_scheduler *rq, struct rtos_task *task, u64 now)
+{
+    if (now < task->abs_deadline_ns) {
+        return;
+    }
+    task->missed_deadlines++;
+    rtos_trace(rq, RTOS_EV_MISS, task->task_id, RTOS_TRACE_NONE, 0);
+    task->abs_deadline_ns = now + (u64)task->deadline_us * NSEC_PER_USEC;
+    if (task->heap_index >= 0) {
+        edf_heap_fix(rq, task->heap_index);
+    }
+}
+
+/*
+ * EDF scheduling point: release woken jobs, account missed deadlines,
+ * run the earliest deadline and rearm for the next one, if any
+ */
+static enum hrtimer_restart rtos_edf_callback(struct rtos_scheduler *rq)
+{
+    struct hrtimer *timer = &rq->scheduler_timer;
+    struct rtos_task *current_task;
+    u64 now = ktime_get_ns(), next = U64_MAX;
+    
+    rq->now = now;
+    rtos_retire_current(rq);
+    rtos_drain_pending(rq);
+    
+    current_task = rq->current_task;
+    if (current_task) {
+        edf_check_deadline(rq, current_task, now);
+    }
+    while (rq->edf_count && rq->edf_heap[0]->abs_deadline_ns <= now) {
+        edf_check_deadline(rq, rq->edf_heap[0], now);
+    }
+    
+    // Preempt only for a strictly earlier deadline
+    if (rq->edf_count &&
+        (!current_task || rq->edf_heap[0]->abs_deadline_ns < current_task->abs_deadline_ns)) {
+        rtos_schedule_task(rq, rq->edf_heap[0]);
+    }
+    
+    rtos_steal_answer(rq);
+    if (rtos_rq_idle(rq)) {
+        rtos_steal_request(rq);
+    }
+    
+    if (READ_ONCE(rtos_stopping)) {
+        return HRTIMER_NORESTART;
+    }
+    current_task = rq->current_task;
+    if (current_task) {
+        next = current_task->abs_deadline_ns;
+    }
+    if (rq->edf_count) {
+        next = min(next, rq->edf_heap[0]->abs_deadline_ns);
+    }
+    if (next != U64_MAX) {
+        hrtimer_start(timer, ns_to_ktime(next), HRTIMER_MODE_ABS_PINNED);
+    }
+    
+    // A wakeup or steal request that raced with the rearm above kicks again
+    if (!llist_empty(&rq->pending) || atomic_read(&rq->steal_for) >= 0) {
+        hrtimer_start(timer, ktime_get(), HRTIMER_MODE_ABS_PINNED);
+    }
+    return HRTIMER_NORESTART;
+}
+
 /**
  * Scheduler timer callback
  */
 static enum hrtimer_restart rtos_scheduler_callback(struct hrtimer *timer)
 {
-    struct rtos_task *next_task = NULL;
-    int i;
-    unsigned long flags;
+    struct rtos_scheduler *rq = container_of(timer, struct rtos_scheduler, scheduler_timer);
+    struct rtos_task *next_task, *current_task;
+    int prio;
     
-    spin_lock_irqsave(&global_scheduler.scheduler_lock, flags);
+    if (sched_edf) {
+        return rtos_edf_callback(rq);
+    }
     
-    // Find highest priority ready task
-    for (i = MAX_PRIORITY - 1; i >= 0; i--) {
-        if (!list_empty(&global_scheduler.ready_queue[i])) {
-            next_task = list_first_entry(&global_scheduler.ready_queue[i],
-                                        struct rtos_task, task_list);
-            break;
+    rq->now = ktime_get_ns();
+    rtos_retire_current(rq);
+    rtos_drain_pending(rq);
+    
+    // Highest priority ready task; fls() is a count-leading-zeros away from it
+    if (rq->ready_bitmap) {
+        prio = fls(rq->ready_bitmap) - 1;
+        current_task = rq->current_task;
+        
+        // Equal priority round-robins, a lower one waits for the current task
+        if (!current_task || prio >= current_task->priority) {
+            next_task = list_first_entry(&rq->ready_queue[prio], struct rtos_task, task_list);
+            rtos_schedule_task(rq, next_task);
         }
     }
     
-    if (next_task) {
-        rtos_schedule_task(next_task);
+    rtos_steal_answer(rq);
+    if (rtos_rq_idle(rq)) {
+        rtos_steal_request(rq);
     }
     
-    spin_unlock_irqrestore(&global_scheduler.scheduler_lock, flags);
+    if (READ_ONCE(rtos_stopping)) {
+        return HRTIMER_NORESTART;
+    }
     
     // Reschedule timer for next tick
     hrtimer_forward_now(timer, ktime_set(0, TICK_RESOLUTION_US * 1000));
     return HRTIMER_RESTART;
 }
 
+// Runs on each core so that its timer is queued, and stays, there
+static void rtos_start_cpu(void *unused)
+{
+    struct rtos_scheduler *rq = this_cpu_ptr(&rtos_rq);
+    
+    if (sched_edf) {
+        // First scheduling point now, then only when a deadline or wakeup needs one
+        hrtimer_start(&rq->scheduler_timer, ktime_get(), HRTIMER_MODE_ABS_PINNED);
+        return;
+    }
+    
+    // Start scheduler timer
+    hrtimer_start(&rq->scheduler_timer,
+                  ktime_set(0, TICK_RESOLUTION_US * 1000),
+                  HRTIMER_MODE_REL_PINNED);
+}
+
 /**
  * Start RTOS scheduler
  */
 static int rtos_start_scheduler(void)
 {
+    int cpu, ret;
+    
     pr_info("Starting microsecond-precision RTOS scheduler\n");
     
-    // Start scheduler timer
-    hrtimer_start(&global_scheduler.scheduler_timer,
-                  ktime_set(0, TICK_RESOLUTION_US * 1000),
-                  HRTIMER_MODE_REL);
+    for_each_online_cpu(cpu) {
+        ret = smp_call_function_single(cpu, rtos_start_cpu, NULL, 1);
+        if (ret) {
+            pr_err("Failed to start the scheduler on CPU %d: %d\n", cpu, ret);
+            return ret;
+        }
+    }
     
-    pr_info("RTOS scheduler started with %d us resolution\n", TICK_RESOLUTION_US);
+    if (sched_edf) {
+        pr_info("RTOS EDF scheduler started, tickless, on %u CPUs\n", num_online_cpus());
+    } else {
+        pr_info("RTOS scheduler started with %d us resolution on %u CPUs\n", TICK_RESOLUTION_US,
+                num_online_cpus());
+    }
     return 0;
 }
 
 /**
- * Get scheduler statistics
+ * Get scheduler statistics, summed over the cores
  */
 static void rtos_get_stats(u64 *total_time, u32 *context_switches, u32 *task_count)
 {
+    struct rtos_scheduler *rq;
+    u64 time = 0;
+    u32 switches = 0, tasks = 0;
+    int cpu;
+    
+    for_each_possible_cpu(cpu) {
+        rq = rtos_cpu_rq(cpu);
+        time += rq->total_execution_time;
+        switches += READ_ONCE(rq->context_switches);
+        tasks += atomic_read(&rq->task_count);
+    }
+    
     if (total_time) {
-        *total_time = global_scheduler.total_execution_time;
+        *total_time = time;
     }
     if (context_switches) {
-        *context_switches = global_scheduler.context_switches;
+        *context_switches = switches;
     }
     if (task_count) {
-        *task_count = atomic_read(&global_scheduler.task_count);
+        *task_count = tasks;
+    }
+}
+
+/**
+ * Response-time histogram and deadline misses of one task, for checking
+ * measured response times against the WCET they were budgeted with
+ */
+static int rtos_get_task_stats(int task_id, struct rtos_task_stats *stats)
+{
+    struct rtos_task *task;
+    
+    if (task_id < 0 || task_id >= MAX_TASKS || !stats) {
+        return -EINVAL;
+    }
+    
+    task = &rtos_tasks[task_id];
+    if (!task->task_func) {
+        return -ENOENT;
+    }
+    stats->jobs = READ_ONCE(task->jobs);
+    stats->missed_deadlines = READ_ONCE(task->missed_deadlines);
+    stats->max_response_ns = READ_ONCE(task->max_response_ns);
+    memcpy(stats->response_hist, task->response_hist, sizeof(stats->response_hist));
+    return 0;
+}
+
+/*
+ * CTF 1.8 description of /dev/rtos_trace: one packet, events with a one
+ * byte id, a 64-bit monotonic timestamp in ns and the core, everything
+ * byte aligned and little endian
+ */
+static const char rtos_ctf_metadata[] =
+    "/* CTF 1.8 */\n"
+    "typealias integer { size = 8; align = 8; signed = false; } := uint8_t;\n"
+    "typealias integer { size = 16; align = 8; signed = true; } := int16_t;\n"
+    "typealias integer { size = 32; align = 8; signed = false; } := uint32_t;\n"
+    "typealias integer { size = 64; align = 8; signed = false; } := uint64_t;\n"
+    "trace {\n"
+    "    major = 1;\n"
+    "    minor = 8;\n"
+    "    byte_order = le;\n"
+    "    packet.header := struct { uint32_t magic; uint32_t stream_id; };\n"
+    "};\n"
+    "env { domain = \"kernel\"; tracer_name = \"microsecond_rtos\"; };\n"
+    "clock { name = monotonic; freq = 1000000000; offset = 0; };\n"
+    "typealias integer { size = 64; align = 8; signed = false; map = clock.monotonic.value; } := uint64_clock_t;\n"
+    "stream {\n"
+    "    id = 0;\n"
+    "    packet.context := struct {\n"
+    "        uint64_clock_t timestamp_begin;\n"
+    "        uint64_clock_t timestamp_end;\n"
+    "        uint64_t content_size;\n"
+    "        uint64_t packet_size;\n"
+    "        uint64_t events_discarded;\n"
+    "    };\n"
+    "    event.header := struct { uint8_t id; uint64_clock_t timestamp; uint8_t cpu_id; };\n"
+    "};\n"
+    "event { name = sched_switch; id = 0; stream_id = 0; fields := struct { int16_t prev_tid; int16_t next_tid; }; };\n"
+    "event { name = job_release; id = 1; stream_id = 0; fields := struct { int16_t tid; uint32_t queue_latency_ns; }; };\n"
+    "event { name = job_done; id = 2; stream_id = 0; fields := struct { int16_t tid; uint32_t response_us; }; };\n"
+    "event { name = deadline_miss; id = 3; stream_id = 0; fields := struct { int16_t tid; }; };\n"
+    "event { name = migrate; id = 4; stream_id = 0; fields := struct { int16_t tid; uint8_t dest_cpu; }; };\n";
+
+#define RTOS_CTF_PACKET_HEADER (4 + 4 + 8 * 5)
+#define RTOS_CTF_MAX_EVENT (1 + 8 + 1 + 2 + 4)
+
+// Serialize one event as its CTF header and fields; returns the bytes written
+static size_t rtos_ctf_event(u8 *p, const struct rtos_trace_event *ev, int cpu)
+{
+    u8 *start = p;
+    
+    *p++ = ev->id;
+    put_unaligned_le64(ev->ts_ns, p);
+    p += 8;
+    *p++ = cpu;
+    put_unaligned_le16(ev->task, p);
+    p += 2;
+    
+    switch (ev->id) {
+    case RTOS_EV_SWITCH:
+        put_unaligned_le16(ev->other == RTOS_TRACE_NONE ? -1 : ev->other, p);
+        p += 2;
+        break;
+    case RTOS_EV_RELEASE:
+    case RTOS_EV_DONE:
+        put_unaligned_le32(ev->value, p);
+        p += 4;
+        break;
+    case RTOS_EV_MIGRATE:
+        *p++ = ev->other;
+        break;
+    default:
+        break;
+    }
+    return p - start;
+}
+
+/*
+ * Copy out what one core's ring gathered since the last drain. Events
+ * the tick overwrote before or while they were copied count as
+ * discarded. Called with rtos_trace_lock held; returns the count.
+ */
+static u32 rtos_trace_drain(struct rtos_scheduler *rq, struct rtos_trace_event *out)
+{
+    u32 head = smp_load_acquire(&rq->trace_head), tail = rq->trace_tail, i, n = 0;
+    
+    if (head - tail > RTOS_TRACE_EVENTS) {
+        rq->trace_discarded += head - tail - RTOS_TRACE_EVENTS;
+        tail = head - RTOS_TRACE_EVENTS;
+    }
+    
+    for (i = tail; i != head; i++) {
+        out[n] = rq->trace[i & (RTOS_TRACE_EVENTS - 1)];
+        smp_rmb();
+        
+        // Lapped while copying: the slot may hold a newer event
+        if (READ_ONCE(rq->trace_head) - i > RTOS_TRACE_EVENTS) {
+            rq->trace_discarded++;
+            continue;
+        }
+        n++;
+    }
+    rq->trace_tail = head;
+    return n;
+}
+
+/*
+ * One CTF packet from the drained runs, one per core and each in time
+ * order already, merged by timestamp; returns the packet size
+ */
+static size_t rtos_ctf_packet(u8 *buf, const struct rtos_trace_event *events, const u32 *count, u32 *pos,
+                              u64 discarded)
+{
+    const struct rtos_trace_event *ev;
+    u8 *p = buf + RTOS_CTF_PACKET_HEADER;
+    u64 first_ts = 0, last_ts = 0;
+    bool any = false;
+    int cpu, best;
+    
+    for (;;) {
+        best = -1;
+        for_each_possible_cpu(cpu) {
+            if (pos[cpu] < count[cpu] &&
+                (best < 0 || events[cpu * RTOS_TRACE_EVENTS + pos[cpu]].ts_ns <
+                             events[best * RTOS_TRACE_EVENTS + pos[best]].ts_ns)) {
+                best = cpu;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        
+        ev = &events[best * RTOS_TRACE_EVENTS + pos[best]++];
+        if (!any) {
+            first_ts = ev->ts_ns;
+            any = true;
+        }
+        last_ts = ev->ts_ns;
+        p += rtos_ctf_event(p, ev, best);
+    }
+    
+    put_unaligned_le32(RTOS_CTF_MAGIC, buf);
+    put_unaligned_le32(0, buf + 4);
+    put_unaligned_le64(first_ts, buf + 8);
+    put_unaligned_le64(last_ts, buf + 16);
+    put_unaligned_le64((u64)(p - buf) * 8, buf + 24);
+    put_unaligned_le64((u64)(p - buf) * 8, buf + 32);
+    put_unaligned_le64(discarded, buf + 40);
+    return p - buf;
+}
+
+struct rtos_trace_file {
+    u8 *buf;
+    size_t len;
+};
+
+// Each open takes what the rings have gathered since the last one
+static int rtos_trace_open(struct inode *inode, struct file *file)
+{
+    struct rtos_trace_file *f;
+    struct rtos_trace_event *events;
+    u32 *count, *pos;
+    u64 discarded = 0;
+    int cpu, ret = -ENOMEM;
+    
+    f = kzalloc(sizeof(*f), GFP_KERNEL);
+    events = kvmalloc_array(array_size(nr_cpu_ids, RTOS_TRACE_EVENTS), sizeof(*events), GFP_KERNEL);
+    count = kcalloc(nr_cpu_ids, sizeof(*count), GFP_KERNEL);
+    pos = kcalloc(nr_cpu_ids, sizeof(*pos), GFP_KERNEL);
+    if (!f || !events || !count || !pos) {
+        goto out;
+    }
+    f->buf = kvmalloc(RTOS_CTF_PACKET_HEADER + array_size(array_size(nr_cpu_ids, RTOS_TRACE_EVENTS),
+                                                          RTOS_CTF_MAX_EVENT), GFP_KERNEL);
+    if (!f->buf) {
+        goto out;
+    }
+    
+    mutex_lock(&rtos_trace_lock);
+    for_each_possible_cpu(cpu) {
+        count[cpu] = rtos_trace_drain(rtos_cpu_rq(cpu), events + cpu * RTOS_TRACE_EVENTS);
+        discarded += rtos_cpu_rq(cpu)->trace_discarded;
+    }
+    mutex_unlock(&rtos_trace_lock);
+    
+    f->len = rtos_ctf_packet(f->buf, events, count, pos, discarded);
+    file->private_data = f;
+    f = NULL;
+    ret = 0;
+    
+out:
+    if (f) {
+        kvfree(f->buf);
+        kfree(f);
+    }
+    kfree(pos);
+    kfree(count);
+    kvfree(events);
+    return ret;
+}
+
+static ssize_t rtos_trace_read(struct file *file, char __user *ubuf, size_t count, loff_t *ppos)
+{
+    struct rtos_trace_file *f = file->private_data;
+    
+    return simple_read_from_buffer(ubuf, count, ppos, f->buf, f->len);
+}
+
+static int rtos_trace_release(struct inode *inode, struct file *file)
+{
+    struct rtos_trace_file *f = file->private_data;
+    
+    kvfree(f->buf);
+    kfree(f);
+    return 0;
+}
+
+static ssize_t rtos_trace_metadata_read(struct file *file, char __user *ubuf, size_t count, loff_t *ppos)
+{
+    return simple_read_from_buffer(ubuf, count, ppos, rtos_ctf_metadata, sizeof(rtos_ctf_metadata) - 1);
+}
+
+static const struct file_operations rtos_trace_fops = {
+    .owner = THIS_MODULE,
+    .open = rtos_trace_open,
+    .read = rtos_trace_read,
+    .release = rtos_trace_release,
+};
+
+static const struct file_operations rtos_trace_metadata_fops = {
+    .owner = THIS_MODULE,
+    .read = rtos_trace_metadata_read,
+};
+
+static struct miscdevice rtos_trace_dev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "rtos_trace",
+    .fops = &rtos_trace_fops,
+    .mode = 0400,
+};
+
+static struct miscdevice rtos_trace_metadata_dev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "rtos_trace_metadata",
+    .fops = &rtos_trace_metadata_fops,
+    .mode = 0444,
+};
+
+static void rtos_free_traces(void)
+{
+    int cpu;
+    
+    for_each_possible_cpu(cpu) {
+        kvfree(rtos_cpu_rq(cpu)->trace);
+        rtos_cpu_rq(cpu)->trace = NULL;
+    }
+}
+
+static void rtos_stop_scheduler(void)
+{
+    int cpu;
+    
+    // One core's tick kicks another's, so no core stops until none can
+    // rearm: a callback or kick already past the flag check finishes
+    // before the first pass returns, and whatever it queued is synced or
+    // cancelled by the next two
+    WRITE_ONCE(rtos_stopping, true);
+    smp_mb();
+    for_each_possible_cpu(cpu) {
+        hrtimer_cancel(&rtos_cpu_rq(cpu)->scheduler_timer);
+    }
+    for_each_possible_cpu(cpu) {
+        irq_work_sync(&rtos_cpu_rq(cpu)->kick);
+    }
+    for_each_possible_cpu(cpu) {
+        hrtimer_cancel(&rtos_cpu_rq(cpu)->scheduler_timer);
     }
 }
 
@@ -232,17 +1093,36 @@ static int __init rtos_init_module(void)
     ret = rtos_init();
     if (ret) {
         pr_err("Failed to initialize RTOS\n");
+        rtos_free_traces();
         return ret;
     }
     
+    ret = misc_register(&rtos_trace_dev);
+    if (ret) {
+        goto err_free;
+    }
+    ret = misc_register(&rtos_trace_metadata_dev);
+    if (ret) {
+        goto err_trace;
+    }
+    
     ret = rtos_start_scheduler();
     if (ret) {
         pr_err("Failed to start RTOS scheduler\n");
-        return ret;
+        rtos_stop_scheduler();
+        goto err_metadata;
     }
     
     pr_info("Microsecond-Precision RTOS loaded successfully\n");
     return 0;
+    
+err_metadata:
+    misc_deregister(&rtos_trace_metadata_dev);
+err_trace:
+    misc_deregister(&rtos_trace_dev);
+err_free:
+    rtos_free_traces();
+    return ret;
 }
 
 /**
@@ -250,9 +1130,21 @@ static int __init rtos_init_module(void)
  */
 static void __exit rtos_cleanup_module(void)
 {
-    hrtimer_cancel(&global_scheduler.scheduler_timer);
+    struct rtos_scheduler *rq;
+    u32 migrations = 0;
+    int cpu;
+    
+    rtos_stop_scheduler();
+    misc_deregister(&rtos_trace_metadata_dev);
+    misc_deregister(&rtos_trace_dev);
+    
+    for_each_possible_cpu(cpu) {
+        rq = rtos_cpu_rq(cpu);
+        migrations += rq->migrations;
+    }
+    rtos_free_traces();
     
-    pr_info("Microsecond-Precision RTOS unloaded\n");
+    pr_info("Microsecond-Precision RTOS unloaded, %u migrations\n", migrations);
 }
 
 module_init(rtos_init_module);
@@ -261,4 +1153,4 @@ module_exit(rtos_cleanup_module);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("jk1806");
 MODULE_DESCRIPTION("Microsecond-Precision RTOS");
-MODULE_VERSION(RTOS_VERSION);
\ No newline at end of file
+MODULE_VERSION(RTOS_VERSION);
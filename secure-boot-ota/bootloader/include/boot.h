@@ -3,16 +3,147 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "boot_config.h"
+#include "boot_control.h"
+#include "boot_trace.h"
 
 /* Bootloader functions */
 int bootloader_main(void);
 int verify_firmware_signature(const uint8_t *firmware, size_t size);
 int decrypt_firmware(uint8_t *firmware, size_t size);
 int verify_firmware_integrity(const uint8_t *firmware, size_t size);
+int boot_process_image(const uint8_t *image, size_t size,
+                       const uint8_t *signature, size_t sig_len,
+                       const uint8_t *public_key, size_t key_len,
+                       uint8_t *dest, size_t dest_size);
+/* Same pass, the stored payload checked against a hash from a verified header */
+int boot_process_image_hash(const uint8_t *image, size_t size,
+                            const uint8_t *expected_hash,
+                            uint8_t *dest, size_t dest_size);
 int check_version_counter(uint32_t *version);
 int update_version_counter(uint32_t version);
 void jump_to_firmware(void *address);
 
+/* boot_process_image() results, which check failed */
+#define BOOT_IMAGE_OK               0
+#define BOOT_IMAGE_ERR_PARAM       -1
+#define BOOT_IMAGE_ERR_SIGNATURE   -2
+#define BOOT_IMAGE_ERR_DECRYPT     -3
+#define BOOT_IMAGE_ERR_INTEGRITY   -4
+#define BOOT_IMAGE_ERR_DECOMPRESS  -5
+
+/*
+ * Compressed payload, the decrypted bytes between the IV and the HMAC:
+ *   0   u32  BOOT_LZ4_MAGIC
+ *   4   u32  decompressed size
+ *   8   ...  one LZ4 block (ota_server/compress_firmware.py)
+ * Anything else is a raw payload and is copied as is.
+ */
+#define BOOT_LZ4_MAGIC        0x345a4c46u  /* "FLZ4" */
+#define BOOT_LZ4_HEADER_SIZE  8
+
+/* Streaming LZ4 block decoder, output goes straight to dest */
+typedef struct {
+    uint8_t *dest;
+    size_t capacity;
+    size_t written;
+    size_t length;   /* literal or match length being read */
+    size_t offset;
+    int state;
+    uint8_t token;
+    uint8_t offset_bytes;
+} boot_lz4_t;
+
+void boot_lz4_init(boot_lz4_t *lz, uint8_t *dest, size_t capacity);
+int boot_lz4_update(boot_lz4_t *lz, const uint8_t *in, size_t len);
+int boot_lz4_finish(const boot_lz4_t *lz, size_t expected);
+
+/*
+ * Merkle image trailer (ota_server/make_merkle.py), little-endian:
+ *   0   u32  BOOT_MERKLE_MAGIC
+ *   4   u32  image size
+ *   8   u32  block size, a power of two >= BOOT_MERKLE_BLOCK_MIN
+ *   12  u32  block count
+ *   16  32   root of the crypto_merkle_* tree over the stored image
+ *   48  ...  the tree, crypto_merkle_nodes(block count) hashes
+ *   then the signature over the 48-byte header
+ * Only the header is signed; the tree is checked on use against the
+ * root, so any block can be verified on its own.
+ */
+#define BOOT_MERKLE_MAGIC        0x4b524d42u  /* "BMRK" */
+#define BOOT_MERKLE_HEADER_SIZE  48
+#define BOOT_MERKLE_MAX_BLOCKS   (MAX_FIRMWARE_SIZE / BOOT_MERKLE_BLOCK_MIN)
+
+typedef struct {
+    const uint8_t *image;
+    const uint8_t *tree;
+    uint32_t image_size;
+    uint32_t block_size;
+    uint32_t block_count;
+    uint8_t root[32];
+    uint8_t verified[(BOOT_MERKLE_MAX_BLOCKS + 7) / 8];  /* blocks checked so far */
+} boot_merkle_t;
+
+/* Check the trailer's signature, after that blocks can be checked alone */
+int boot_merkle_open(boot_merkle_t *merkle, const uint8_t *image,
+                     const uint8_t *trailer, size_t trailer_len,
+                     const uint8_t *public_key, size_t key_len);
+
+/* Re-hash one block against the root, whether or not it was checked before */
+int boot_merkle_verify_block(boot_merkle_t *merkle, uint32_t block);
+
+/* Verify-on-first-use: checks the blocks of [offset, offset + len) not yet checked */
+int boot_merkle_ensure(boot_merkle_t *merkle, size_t offset, size_t len);
+
+/*
+ * Image header at the start of the firmware slot (ota_server/make_image.py).
+ * Little-endian, BOOT_HEADER_SIZE bytes, offsets from the start of the
+ * header:
+ *   0    u32  BOOT_HEADER_MAGIC
+ *   4    u16  header version          6  u16  header size
+ *   8    u32  image version
+ *   12   u8   signature algorithm     13 u8  encryption algorithm
+ *   14   u8   reserved                15 u8  BOOT_HEADER_FLAG_*
+ *   16   u32  payload offset          20 u32 payload size
+ *   24   u32  HMAC offset, inside the decrypted payload
+ *   28   u32  signature offset        32 u32 signature size
+ *   36   u32  Merkle trailer offset   40 u32 Merkle trailer size, 0 if none
+ *   44   32   SHA-256 of the stored payload
+ *   76   32   SHA-256 of the Merkle trailer, zero if none
+ *   108  ...  reserved, zero
+ * The signature covers the header, the sections are checked against the
+ * hashes in it, so nothing has to be read to find anything else.
+ */
+#define BOOT_HEADER_MAGIC            0x48464253u  /* "SBFH" */
+#define BOOT_HEADER_VERSION          1
+#define BOOT_HEADER_SIZE             128
+#define BOOT_HEADER_FLAG_COMPRESSED  0x01  /* LZ4 payload, inflate into the execution region */
+#define BOOT_HEADER_FLAG_MERKLE      0x02  /* Merkle trailer present */
+
+typedef struct {
+    uint32_t image_version;
+    uint8_t sig_algorithm;
+    uint8_t enc_algorithm;
+    uint8_t flags;
+    uint32_t payload_offset;
+    uint32_t payload_size;
+    uint32_t hmac_offset;
+    uint32_t signature_offset;
+    uint32_t signature_size;
+    uint32_t merkle_offset;
+    uint32_t merkle_size;
+    uint8_t payload_hash[32];
+    uint8_t merkle_hash[32];
+} boot_header_t;
+
+/* Layout checks only: magic, algorithms this build supports, sections
+ * inside the slot and clear of the header */
+int boot_header_parse(const uint8_t *slot, size_t slot_size, boot_header_t *header);
+
+/* Signature over the header, in place in the slot */
+int boot_header_verify(const uint8_t *slot, const boot_header_t *header,
+                       const uint8_t *public_key, size_t key_len);
+
 /* Constants */
 #define BOOT_PUBLIC_KEY_ADDRESS 0x0800E000
 
@@ -0,0 +1,39 @@
+#ifndef BOOT_CONTROL_H
+#define BOOT_CONTROL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Boot-control record: which of the two firmware slots boots. Written by
+ * the OTA client once the new image is on the other slot, read by the
+ * bootloader. Two copies, one flash page each at BOOT_CONTROL_ADDRESS;
+ * an update rewrites only the copy that is not in force, so a write
+ * torn by a reset leaves the previous record standing. The valid copy
+ * with the higher sequence wins.
+ *
+ * Little-endian, BOOT_CONTROL_SIZE bytes:
+ *   0    u32  BOOT_CONTROL_MAGIC
+ *   4    u32  sequence, copy (sequence & 1) holds it
+ *   8    u8   active slot, BOOT_SLOT_A or BOOT_SLOT_B
+ *   9    ...  reserved, zero
+ *   32   32   SHA-256 of bytes 0..31
+ */
+#define BOOT_CONTROL_MAGIC   0x43424253u  /* "SBBC" */
+#define BOOT_CONTROL_SIZE    64
+#define BOOT_SLOT_A          0
+#define BOOT_SLOT_B          1
+
+typedef struct {
+    uint32_t sequence;
+    uint8_t active_slot;
+} boot_control_t;
+
+/* Record in force from the two copies; slot A, sequence 0 if neither is valid */
+void boot_control_read(const uint8_t *copy0, const uint8_t *copy1, boot_control_t *control);
+
+/* Record that makes slot active, to be written to copy (control->sequence & 1) */
+int boot_control_next(const boot_control_t *current, uint8_t slot,
+                      boot_control_t *next, uint8_t *record);
+
+#endif /* BOOT_CONTROL_H */
@@ -0,0 +1,46 @@
+#ifndef BOOT_TRACE_H
+#define BOOT_TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Boot phase trace, left in retained RAM at BOOT_TRACE_ADDRESS for the
+ * firmware to report. Each event is the end of a phase, in ticks since
+ * reset of the bootloader: core cycles (DWT) on the MCU, nanoseconds on
+ * a host build; ticks_per_second says which. A fallback to the other
+ * slot repeats the slot phases.
+ */
+#define BOOT_TRACE_MAGIC       0x52544253u  /* "SBTR" */
+#define BOOT_TRACE_MAX_EVENTS  16
+
+typedef enum {
+    BOOT_PHASE_START = 0,
+    BOOT_PHASE_CRYPTO_INIT,
+    BOOT_PHASE_VERSION_CHECK,
+    BOOT_PHASE_CONTROL_READ,
+    BOOT_PHASE_HEADER_PARSE,
+    BOOT_PHASE_HEADER_VERIFY,
+    BOOT_PHASE_IMAGE_PASS,          /* flash read, hash, decrypt and HMAC in one pass */
+    BOOT_PHASE_VERSION_UPDATE,
+    BOOT_PHASE_JUMP,
+    BOOT_PHASE_COUNT
+} boot_phase_t;
+
+typedef struct {
+    uint32_t phase;
+    uint32_t ticks;
+} boot_trace_event_t;
+
+typedef struct {
+    uint32_t magic;                 /* set last, once the trace is complete */
+    uint32_t count;
+    uint32_t ticks_per_second;
+    uint32_t reserved;
+    boot_trace_event_t events[BOOT_TRACE_MAX_EVENTS];
+} boot_trace_t;
+
+void boot_trace_start(boot_trace_t *trace);
+void boot_trace_mark(boot_trace_t *trace, boot_phase_t phase);
+void boot_trace_finish(boot_trace_t *trace);
+
+#endif /* BOOT_TRACE_H */
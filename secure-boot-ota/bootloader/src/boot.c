@@ -8,97 +8,165 @@
 /* Simulated flash memory - TODO: Replace with actual flash driver */
 static uint8_t flash_memory[1024 * 1024];  /* 1MB flash simulation */
 
-// Bootloader v1.3 - Added better error messages (2024-04-20)
+// Bootloader v1.8 - Phase timestamps left in RAM for the firmware to report
+// v1.7 - A/B slots chosen by the boot-control record, the other as fallback
+// v1.6 - Fixed signed header locates every section, no size scanning
+// v1.5 - LZ4-compressed images inflated into the execution region
+// v1.4 - Signature, decryption and HMAC in one pass over flash
+// v1.3 - Added better error messages (2024-04-20)
 // v1.2 - Fixed version counter rollback bug
 // v1.1 - Added HMAC verification
 // v1.0 - Initial secure boot implementation
 
+/* Read by the firmware after the jump, see boot_trace.h */
+#define boot_trace ((boot_trace_t *)(uintptr_t)BOOT_TRACE_ADDRESS)
+
+static uint8_t *slot_address(uint8_t slot)
+{
+    return (uint8_t *)(uintptr_t)(slot == BOOT_SLOT_B ? FIRMWARE_SLOT_B_ADDRESS : FIRMWARE_START_ADDRESS);
+}
+
+/* Header, payload hash, decryption and HMAC of one slot, and its version
+ * against the rollback counter; where to jump, or NULL */
+static uint8_t *load_slot(uint8_t *slot, uint32_t counter, uint32_t *image_version)
+{
+    int ret;
+    uint8_t *firmware;
+    uint8_t *exec;
+    size_t exec_size;
+    boot_header_t header;
+    
+    /* The header says where everything is, sections are used in place */
+    printf("[BOOT] Reading firmware header...\n");
+    ret = boot_header_parse(slot, FIRMWARE_SLOT_SIZE, &header);
+    boot_trace_mark(boot_trace, BOOT_PHASE_HEADER_PARSE);
+    if (ret != BOOT_IMAGE_OK) {
+        printf("[BOOT] ERROR: Invalid firmware header\n");
+        return NULL;
+    }
+    
+    /* Verified before anything it points to is read */
+    ret = boot_header_verify(slot, &header,
+                             (uint8_t *)BOOT_PUBLIC_KEY_ADDRESS, BOOT_PUBLIC_KEY_SIZE);
+    boot_trace_mark(boot_trace, BOOT_PHASE_HEADER_VERIFY);
+    if (ret != BOOT_IMAGE_OK) {
+        printf("[BOOT] ERROR: Header signature verification failed\n");
+        return NULL;
+    }
+    printf("[BOOT] Image version %u, %u byte payload\n",
+           header.image_version, header.payload_size);
+    
+    /* Either slot: the fallback is as likely to hold an older image */
+    if (header.image_version < counter) {
+        printf("[BOOT] ERROR: Image version %u is older than %u (rollback)\n",
+               header.image_version, counter);
+        return NULL;
+    }
+    *image_version = header.image_version;
+    firmware = slot + header.payload_offset;
+    
+    /* Check the payload against the header's hash, decrypt (AES-256-GCM)
+     * and check the HMAC while reading each flash block once - decrypted
+     * in place, unless it is compressed and is inflated into the
+     * execution region */
+    if (header.flags & BOOT_HEADER_FLAG_COMPRESSED) {
+        exec = (uint8_t *)FIRMWARE_EXEC_ADDRESS;
+        exec_size = FIRMWARE_EXEC_SIZE;
+    } else {
+        exec = firmware;
+        exec_size = header.payload_size;
+    }
+    printf("[BOOT] Verifying and decrypting firmware...\n");
+    ret = boot_process_image_hash(firmware, header.payload_size, header.payload_hash,
+                                  exec, exec_size);
+    boot_trace_mark(boot_trace, BOOT_PHASE_IMAGE_PASS);
+    switch (ret) {
+    case BOOT_IMAGE_OK:
+        return exec;
+    case BOOT_IMAGE_ERR_SIGNATURE:
+        printf("[BOOT] ERROR: Payload does not match the signed header\n");
+        // FIXME: Log this to secure storage for forensics
+        return NULL;
+    case BOOT_IMAGE_ERR_DECRYPT:
+        printf("[BOOT] ERROR: Decryption failed\n");
+        return NULL;
+    case BOOT_IMAGE_ERR_INTEGRITY:
+        printf("[BOOT] ERROR: Integrity check failed\n");
+        return NULL;
+    case BOOT_IMAGE_ERR_DECOMPRESS:
+        printf("[BOOT] ERROR: Decompression failed\n");
+        return NULL;
+    default:
+        printf("[BOOT] ERROR: Invalid firmware image (code: %d)\n", ret);
+        return NULL;
+    }
+}
+
 /* Bootloader entry point */
 int bootloader_main(void)
 {
     int ret;
-    uint8_t *firmware = (uint8_t *)FIRMWARE_START_ADDRESS;
-    uint32_t firmware_size;
-    uint8_t signature[256];
+    uint8_t *exec = NULL;
+    boot_control_t control;
     uint32_t version;
+    uint32_t image_version = 0;
+    
+    boot_trace_start(boot_trace);
     
-    printf("[BOOT] Secure Bootloader v1.3\n");
+    printf("[BOOT] Secure Bootloader v1.8\n");
     printf("[BOOT] Initializing...\n");
     
     /* Initialize crypto - must succeed or boot fails */
     ret = crypto_init();
+    boot_trace_mark(boot_trace, BOOT_PHASE_CRYPTO_INIT);
     if (ret != 0) {
         printf("[BOOT] ERROR: Crypto init failed (code: %d)\n", ret);
         // TODO: Add watchdog reset here
         return -1;
     }
     
-    /* Read firmware from flash - offset 0x1000 for header */
-    printf("[BOOT] Reading firmware from flash...\n");
-    memcpy(&firmware_size, firmware, sizeof(uint32_t));
-    firmware += sizeof(uint32_t);
-    
-    // Sanity check - prevent buffer overflow
-    if (firmware_size > MAX_FIRMWARE_SIZE) {
-        printf("[BOOT] ERROR: Firmware too large (%u > %u)\n", 
-               firmware_size, MAX_FIRMWARE_SIZE);
-        return -1;
-    }
-    if (firmware_size == 0) {
-        printf("[BOOT] ERROR: Invalid firmware size\n");
-        return -1;
-    }
-    
-    /* Read signature - stored after firmware */
-    memcpy(signature, firmware + firmware_size, 256);
-    
-    /* Verify signature - RSA-2048 or ECDSA-P256 */
-    printf("[BOOT] Verifying firmware signature...\n");
-    ret = crypto_verify_rsa(firmware, firmware_size,
-                           signature, 256,
-                           (uint8_t *)BOOT_PUBLIC_KEY_ADDRESS, BOOT_PUBLIC_KEY_SIZE);
-    if (ret != CRYPTO_SUCCESS) {
-        printf("[BOOT] ERROR: Signature verification failed (code: %d)\n", ret);
-        // FIXME: Log this to secure storage for forensics
-        return -1;
-    }
-    printf("[BOOT] Signature verified OK\n");
-    
     /* Check version counter - prevent rollback attacks */
     printf("[BOOT] Checking version counter...\n");
     ret = check_version_counter(&version);
+    boot_trace_mark(boot_trace, BOOT_PHASE_VERSION_CHECK);
     if (ret != 0) {
         printf("[BOOT] ERROR: Version check failed\n");
         return -1;
     }
     printf("[BOOT] Current version: %u\n", version);
     
-    /* Decrypt firmware - AES-256-GCM */
-    printf("[BOOT] Decrypting firmware...\n");
-    ret = decrypt_firmware(firmware, firmware_size);
-    if (ret != 0) {
-        printf("[BOOT] ERROR: Decryption failed\n");
-        return -1;
-    }
-    printf("[BOOT] Firmware decrypted OK\n");
+    /* The OTA client flips the record once the other slot holds a
+     * complete image; it is only read here */
+    boot_control_read((const uint8_t *)BOOT_CONTROL_ADDRESS,
+                      (const uint8_t *)(BOOT_CONTROL_ADDRESS + BOOT_FLASH_PAGE_SIZE), &control);
+    boot_trace_mark(boot_trace, BOOT_PHASE_CONTROL_READ);
     
-    /* Verify HMAC - integrity check */
-    printf("[BOOT] Verifying integrity...\n");
-    ret = verify_firmware_integrity(firmware, firmware_size);
-    if (ret != 0) {
-        printf("[BOOT] ERROR: Integrity check failed\n");
+    for (int attempt = 0; attempt < 2 && !exec; attempt++) {
+        uint8_t slot = attempt == 0 ? control.active_slot : (uint8_t)(control.active_slot ^ 1);
+    
+        printf("[BOOT] Trying slot %c%s\n", slot == BOOT_SLOT_A ? 'A' : 'B',
+               attempt ? " (fallback)" : "");
+        exec = load_slot(slot_address(slot), version, &image_version);
+    }
+    if (!exec) {
+        printf("[BOOT] ERROR: No bootable slot\n");
         return -1;
     }
-    printf("[BOOT] Integrity verified OK\n");
+    printf("[BOOT] Signature, decryption and integrity verified OK\n");
+    
+    /* Update version counter before boot - nothing older than this
+     * image boots again */
+    update_version_counter(image_version);
+    boot_trace_mark(boot_trace, BOOT_PHASE_VERSION_UPDATE);
     
-    /* Update version counter - increment before boot */
-    version++;
-    update_version_counter(version);
+    printf("[BOOT] Booting firmware (version %u)...\n", image_version);
     
-    printf("[BOOT] Booting firmware (version %u)...\n", version);
+    /* Complete only now, a boot that stopped earlier leaves no magic */
+    boot_trace_mark(boot_trace, BOOT_PHASE_JUMP);
+    boot_trace_finish(boot_trace);
     
     /* Jump to firmware - point of no return */
-    jump_to_firmware((void *)firmware);
+    jump_to_firmware((void *)exec);
     
     /* Should not reach here - if we do, something went wrong */
     printf("[BOOT] ERROR: Jump failed!\n");
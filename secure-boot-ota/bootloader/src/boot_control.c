@@ -0,0 +1,75 @@
+#include "boot_control.h"
+#include "crypto.h"
+#include <string.h>
+
+// v1.0 - Two-copy boot-control record
+// Shared by the bootloader, which only reads it, and the OTA client,
+// which flips it after an install. Nothing here touches flash.
+
+static uint32_t read_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void write_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static int copy_valid(const uint8_t *copy, boot_control_t *control)
+{
+    uint8_t hash[SHA256_HASH_SIZE];
+    
+    if (!copy || read_le32(copy) != BOOT_CONTROL_MAGIC || copy[8] > BOOT_SLOT_B) {
+        return 0;
+    }
+    
+    if (crypto_hash_sha256(copy, 32, hash) != CRYPTO_SUCCESS ||
+        memcmp(hash, copy + 32, SHA256_HASH_SIZE) != 0) {
+        return 0;
+    }
+    
+    control->sequence = read_le32(copy + 4);
+    control->active_slot = copy[8];
+    return 1;
+}
+
+void boot_control_read(const uint8_t *copy0, const uint8_t *copy1, boot_control_t *control)
+{
+    boot_control_t a;
+    boot_control_t b;
+    int a_ok = copy_valid(copy0, &a);
+    int b_ok = copy_valid(copy1, &b);
+    
+    /* serial-number order, so the sequence may wrap */
+    if (a_ok && b_ok) {
+        *control = (int32_t)(b.sequence - a.sequence) > 0 ? b : a;
+    } else if (a_ok || b_ok) {
+        *control = a_ok ? a : b;
+    } else {
+        control->sequence = 0;
+        control->active_slot = BOOT_SLOT_A;
+    }
+}
+
+int boot_control_next(const boot_control_t *current, uint8_t slot,
+                      boot_control_t *next, uint8_t *record)
+{
+    if (!current || !next || !record || slot > BOOT_SLOT_B) {
+        return -1;
+    }
+    
+    next->sequence = current->sequence + 1;
+    next->active_slot = slot;
+    
+    memset(record, 0, BOOT_CONTROL_SIZE);
+    write_le32(record, BOOT_CONTROL_MAGIC);
+    write_le32(record + 4, next->sequence);
+    record[8] = slot;
+    
+    return crypto_hash_sha256(record, 32, record + 32) == CRYPTO_SUCCESS ? 0 : -1;
+}
@@ -0,0 +1,99 @@
+/* clock_gettime for host builds */
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include "boot_trace.h"
+#include "boot_config.h"
+#include <string.h>
+
+// v1.0 - Boot phase trace
+// One counter read and one store per mark; BOOT_TRACE_ENABLE 0 leaves
+// the calls empty. The magic is written only by finish, so a boot that
+// never reached the jump does not leave a trace that looks complete.
+
+#if BOOT_TRACE_ENABLE
+
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__) || defined(__ARM_ARCH_8M_MAIN__)
+#define DEMCR       (*(volatile uint32_t *)0xE000EDFCu)
+#define DWT_CTRL    (*(volatile uint32_t *)0xE0001000u)
+#define DWT_CYCCNT  (*(volatile uint32_t *)0xE0001004u)
+
+static void counter_start(void)
+{
+    DEMCR |= 1u << 24;              /* TRCENA */
+    DWT_CYCCNT = 0;
+    DWT_CTRL |= 1u;                 /* CYCCNTENA */
+}
+
+static uint32_t counter_now(void)
+{
+    return DWT_CYCCNT;
+}
+
+#define TICKS_PER_SECOND BOOT_CPU_HZ
+#else
+#include <time.h>
+
+static struct timespec trace_epoch;
+
+static void counter_start(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &trace_epoch);
+}
+
+static uint32_t counter_now(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((ts.tv_sec - trace_epoch.tv_sec) * 1000000000ll +
+                      (ts.tv_nsec - trace_epoch.tv_nsec));
+}
+
+#define TICKS_PER_SECOND 1000000000u
+#endif
+
+void boot_trace_start(boot_trace_t *trace)
+{
+    memset(trace, 0, sizeof(*trace));
+    trace->ticks_per_second = TICKS_PER_SECOND;
+    counter_start();
+    boot_trace_mark(trace, BOOT_PHASE_START);
+}
+
+void boot_trace_mark(boot_trace_t *trace, boot_phase_t phase)
+{
+    uint32_t now = counter_now();
+    
+    if (trace->count < BOOT_TRACE_MAX_EVENTS) {
+        trace->events[trace->count].phase = phase;
+        trace->events[trace->count].ticks = now;
+        trace->count++;
+    }
+}
+
+void boot_trace_finish(boot_trace_t *trace)
+{
+    trace->magic = BOOT_TRACE_MAGIC;
+}
+
+#else
+
+void boot_trace_start(boot_trace_t *trace)
+{
+    (void)trace;
+}
+
+void boot_trace_mark(boot_trace_t *trace, boot_phase_t phase)
+{
+    (void)trace;
+    (void)phase;
+}
+
+void boot_trace_finish(boot_trace_t *trace)
+{
+    (void)trace;
+}
+
+#endif /* BOOT_TRACE_ENABLE */
@@ -0,0 +1,128 @@
+#include "boot.h"
+#include "crypto.h"
+#include "boot_config.h"
+#include <string.h>
+
+// v1.0 - Fixed image header
+// Everything the bootloader needs to locate is in the first
+// BOOT_HEADER_SIZE bytes of the slot, and the signature covers them, so
+// the header is trusted before any section is read. The payload is then
+// checked against its hash in the header by the usual single pass.
+
+static uint16_t read_le16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t read_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* [offset, offset + size) inside the slot and after the header */
+static int section_ok(uint32_t offset, uint32_t size, size_t slot_size)
+{
+    return offset >= BOOT_HEADER_SIZE && offset <= slot_size && size <= slot_size - offset;
+}
+
+/* Sections must not share bytes, or one could be read as another */
+static int sections_overlap(uint32_t a, uint32_t a_size, uint32_t b, uint32_t b_size)
+{
+    return a_size && b_size && a < b + b_size && b < a + a_size;
+}
+
+int boot_header_parse(const uint8_t *slot, size_t slot_size, boot_header_t *header)
+{
+    if (!slot || !header || slot_size < BOOT_HEADER_SIZE) {
+        return BOOT_IMAGE_ERR_PARAM;
+    }
+    
+    if (read_le32(slot) != BOOT_HEADER_MAGIC ||
+        read_le16(slot + 4) != BOOT_HEADER_VERSION ||
+        read_le16(slot + 6) != BOOT_HEADER_SIZE) {
+        return BOOT_IMAGE_ERR_PARAM;
+    }
+    
+    header->image_version = read_le32(slot + 8);
+    header->sig_algorithm = slot[12];
+    header->enc_algorithm = slot[13];
+    header->flags = slot[15];
+    header->payload_offset = read_le32(slot + 16);
+    header->payload_size = read_le32(slot + 20);
+    header->hmac_offset = read_le32(slot + 24);
+    header->signature_offset = read_le32(slot + 28);
+    header->signature_size = read_le32(slot + 32);
+    header->merkle_offset = read_le32(slot + 36);
+    header->merkle_size = read_le32(slot + 40);
+    memcpy(header->payload_hash, slot + 44, SHA256_HASH_SIZE);
+    memcpy(header->merkle_hash, slot + 76, SHA256_HASH_SIZE);
+    
+    /* built for one algorithm pair, anything else is refused up front */
+    if (header->sig_algorithm != BOOT_SIGNATURE_ALGORITHM ||
+        header->enc_algorithm != FIRMWARE_ENCRYPTION) {
+        return BOOT_IMAGE_ERR_PARAM;
+    }
+#if !ENABLE_FIRMWARE_COMPRESSION
+    if (header->flags & BOOT_HEADER_FLAG_COMPRESSED) {
+        return BOOT_IMAGE_ERR_PARAM;
+    }
+#endif
+    
+    if (header->payload_size == 0 || header->payload_size > MAX_FIRMWARE_SIZE ||
+        header->signature_size == 0 ||
+        !section_ok(header->payload_offset, header->payload_size, slot_size) ||
+        !section_ok(header->signature_offset, header->signature_size, slot_size) ||
+        sections_overlap(header->payload_offset, header->payload_size,
+                         header->signature_offset, header->signature_size)) {
+        return BOOT_IMAGE_ERR_PARAM;
+    }
+    
+    /* the image pass takes the HMAC from the tail of the decrypted payload */
+    if (header->payload_size < HMAC_SIZE ||
+        header->hmac_offset != header->payload_size - HMAC_SIZE) {
+        return BOOT_IMAGE_ERR_PARAM;
+    }
+    
+    if (header->flags & BOOT_HEADER_FLAG_MERKLE) {
+        if (header->merkle_size == 0 ||
+            !section_ok(header->merkle_offset, header->merkle_size, slot_size) ||
+            sections_overlap(header->merkle_offset, header->merkle_size,
+                             header->payload_offset, header->payload_size) ||
+            sections_overlap(header->merkle_offset, header->merkle_size,
+                             header->signature_offset, header->signature_size)) {
+            return BOOT_IMAGE_ERR_PARAM;
+        }
+    } else if (header->merkle_offset != 0 || header->merkle_size != 0) {
+        return BOOT_IMAGE_ERR_PARAM;
+    }
+    
+    return BOOT_IMAGE_OK;
+}
+
+int boot_header_verify(const uint8_t *slot, const boot_header_t *header,
+                       const uint8_t *public_key, size_t key_len)
+{
+    uint8_t hash[SHA256_HASH_SIZE];
+    
+    if (!slot || !header || !public_key) {
+        return BOOT_IMAGE_ERR_PARAM;
+    }
+    
+    if (crypto_hash_sha256(slot, BOOT_HEADER_SIZE, hash) != CRYPTO_SUCCESS ||
+        crypto_verify_signature_hash(hash, slot + header->signature_offset, header->signature_size,
+                                     public_key, key_len) != CRYPTO_SUCCESS) {
+        return BOOT_IMAGE_ERR_SIGNATURE;
+    }
+    
+    /* the tree carries its own signature too, this ties it to the header */
+    if (header->flags & BOOT_HEADER_FLAG_MERKLE) {
+        if (crypto_hash_sha256(slot + header->merkle_offset, header->merkle_size,
+                               hash) != CRYPTO_SUCCESS ||
+            crypto_compare_ct(hash, header->merkle_hash, SHA256_HASH_SIZE) != 0) {
+            return BOOT_IMAGE_ERR_INTEGRITY;
+        }
+    }
+    
+    return BOOT_IMAGE_OK;
+}
@@ -0,0 +1,273 @@
+#include "boot.h"
+#include "crypto.h"
+#include "boot_config.h"
+#include <string.h>
+
+// v1.2 - Payload hash from a verified header as an alternative to the signature
+// v1.1 - LZ4 payloads are inflated into dest as their blocks decrypt
+// v1.0 - Single-pass image check
+// Reads each flash block once and feeds it to the signature hash, the
+// decryption and the HMAC together, instead of walking the image three
+// times (verify_firmware_signature, decrypt_firmware,
+// verify_firmware_integrity). Same image layout and the same three checks:
+//   signature - SHA-256 over the stored (encrypted) image
+//   decrypt   - IV in the first 16 bytes, GCM tag in the last 16
+//   HMAC      - over the decrypted image minus its last HMAC_SIZE bytes,
+//               which hold the expected value
+// A payload starting with BOOT_LZ4_MAGIC is decompressed on the way to
+// dest, so flash holds the compressed image and dest the runnable one.
+
+#if (BOOT_STREAM_BLOCK_SIZE % 16) != 0 || BOOT_STREAM_BLOCK_SIZE < 16
+#error "BOOT_STREAM_BLOCK_SIZE must be a non-zero multiple of the AES block size"
+#endif
+
+#define IMAGE_IV_SIZE   16
+
+#if ENABLE_FIRMWARE_COMPRESSION && BOOT_STREAM_BLOCK_SIZE < IMAGE_IV_SIZE + BOOT_LZ4_HEADER_SIZE
+#error "BOOT_STREAM_BLOCK_SIZE must hold the IV and the compression header"
+#endif
+
+#if FIRMWARE_ENCRYPTION == FIRMWARE_ENCRYPTION_AES_256_GCM
+#define IMAGE_TAG_SIZE  16
+#else
+#define IMAGE_TAG_SIZE  0
+#endif
+
+extern uint8_t firmware_key[];
+extern uint8_t hmac_key[];
+
+/* one flash page in RAM, the only copy of image data the pass makes */
+static uint8_t stream_block[BOOT_STREAM_BLOCK_SIZE];
+
+/* Copy the part of [start, start + len) that falls inside the block at offset */
+static void copy_span(const uint8_t *block, size_t offset, size_t n,
+                      size_t start, size_t len, uint8_t *dst)
+{
+    size_t lo = offset > start ? offset : start;
+    size_t hi = (offset + n < start + len) ? offset + n : start + len;
+    
+    if (lo < hi) {
+        memcpy(dst + (lo - start), block + (lo - offset), hi - lo);
+    }
+}
+
+#if ENABLE_FIRMWARE_COMPRESSION
+static uint32_t read_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+#endif
+
+/*
+ * Check and decrypt an image in one pass.
+ * dest receives the decrypted image, or the decompressed payload for a
+ * compressed one, and holds dest_size bytes. For a raw image dest may be
+ * the image itself, every block is read before it is written; compressed
+ * output outruns its input and needs a separate region. On any failure
+ * what was written to dest is wiped, so nothing unverified is ever left
+ * for jump_to_firmware.
+ * The stored image is checked against expected_hash when there is one,
+ * against the signature otherwise.
+ */
+static int process_image(const uint8_t *image, size_t size,
+                         const uint8_t *expected_hash,
+                         const uint8_t *signature, size_t sig_len,
+                         const uint8_t *public_key, size_t key_len,
+                         uint8_t *dest, size_t dest_size)
+{
+    crypto_sha256_ctx_t sha;
+    crypto_hmac_sha256_ctx_t hmac;
+#if FIRMWARE_ENCRYPTION == FIRMWARE_ENCRYPTION_AES_256_GCM
+    crypto_aes_gcm_ctx_t cipher;
+    uint8_t tag[IMAGE_TAG_SIZE];
+#else
+    crypto_aes_ctr_ctx_t cipher;
+#endif
+    uint8_t hash[SHA256_HASH_SIZE];
+    uint8_t calculated_hmac[HMAC_SIZE];
+    uint8_t stored_hmac[HMAC_SIZE];
+    size_t ct_end = size - IMAGE_TAG_SIZE;
+    size_t mac_end = size - HMAC_SIZE;
+    int cipher_ready = 0;
+    size_t written = 0;
+    int ret = BOOT_IMAGE_OK;
+#if ENABLE_FIRMWARE_COMPRESSION
+    boot_lz4_t lz;
+    uint32_t inflated_size = 0;
+    int compressed = 0;
+    int inflate_failed = 0;
+#endif
+    
+    if (!image || (!expected_hash && (!signature || !public_key)) || !dest ||
+        size <= IMAGE_IV_SIZE + IMAGE_TAG_SIZE || size < HMAC_SIZE) {
+        return BOOT_IMAGE_ERR_PARAM;
+    }
+    
+    if (crypto_sha256_init(&sha) != CRYPTO_SUCCESS) {
+        return BOOT_IMAGE_ERR_SIGNATURE;
+    }
+    if (crypto_hmac_sha256_init(&hmac, hmac_key, 32) != CRYPTO_SUCCESS) {
+        crypto_sha256_free(&sha);
+        return BOOT_IMAGE_ERR_INTEGRITY;
+    }
+    
+    for (size_t offset = 0; offset < size && ret == BOOT_IMAGE_OK; offset += BOOT_STREAM_BLOCK_SIZE) {
+        size_t n = size - offset < BOOT_STREAM_BLOCK_SIZE ? size - offset : BOOT_STREAM_BLOCK_SIZE;
+        size_t lo;
+        size_t hi;
+        
+        /* the single flash read of this block */
+        memcpy(stream_block, image + offset, n);
+        
+        /* signature covers the image as stored */
+        if (crypto_sha256_update(&sha, stream_block, n) != CRYPTO_SUCCESS) {
+            ret = BOOT_IMAGE_ERR_SIGNATURE;
+            break;
+        }
+        
+        /* first block, BOOT_STREAM_BLOCK_SIZE >= 16 so it holds the whole IV */
+        if (offset == 0) {
+#if FIRMWARE_ENCRYPTION == FIRMWARE_ENCRYPTION_AES_256_GCM
+            if (crypto_aes_gcm_decrypt_init(&cipher, firmware_key, stream_block, NULL, 0) != CRYPTO_SUCCESS) {
+#else
+            if (crypto_aes_ctr_init(&cipher, firmware_key, stream_block) != CRYPTO_SUCCESS) {
+#endif
+                ret = BOOT_IMAGE_ERR_DECRYPT;
+                break;
+            }
+            cipher_ready = 1;
+        }
+        
+        /* ciphertext part of the block, decrypted in place; with the block
+         * size a multiple of 16 only the last GCM update is a partial one */
+        lo = offset > IMAGE_IV_SIZE ? offset : IMAGE_IV_SIZE;
+        hi = offset + n < ct_end ? offset + n : ct_end;
+        if (lo < hi) {
+#if FIRMWARE_ENCRYPTION == FIRMWARE_ENCRYPTION_AES_256_GCM
+            ret = crypto_aes_gcm_decrypt_update(&cipher, stream_block + (lo - offset), hi - lo,
+                                                stream_block + (lo - offset));
+#else
+            ret = crypto_aes_ctr_update(&cipher, stream_block + (lo - offset), hi - lo,
+                                        stream_block + (lo - offset));
+#endif
+            if (ret != CRYPTO_SUCCESS) {
+                ret = BOOT_IMAGE_ERR_DECRYPT;
+                break;
+            }
+        }
+        
+#if FIRMWARE_ENCRYPTION == FIRMWARE_ENCRYPTION_AES_256_GCM
+        copy_span(stream_block, offset, n, ct_end, IMAGE_TAG_SIZE, tag);
+#endif
+        
+        /* integrity covers the decrypted image, the tail holds the HMAC */
+        hi = offset + n < mac_end ? offset + n : mac_end;
+        if (offset < hi &&
+            crypto_hmac_sha256_update(&hmac, stream_block, hi - offset) != CRYPTO_SUCCESS) {
+            ret = BOOT_IMAGE_ERR_INTEGRITY;
+            break;
+        }
+        copy_span(stream_block, offset, n, mac_end, HMAC_SIZE, stored_hmac);
+        
+#if ENABLE_FIRMWARE_COMPRESSION
+        /* the first block says whether the payload is compressed; a bad
+         * stream is only reported once the signature has been checked */
+        if (offset == 0 && mac_end >= IMAGE_IV_SIZE + BOOT_LZ4_HEADER_SIZE &&
+            read_le32(stream_block + IMAGE_IV_SIZE) == BOOT_LZ4_MAGIC) {
+            inflated_size = read_le32(stream_block + IMAGE_IV_SIZE + 4);
+            inflate_failed = inflated_size == 0 || inflated_size > dest_size;
+            boot_lz4_init(&lz, dest, dest_size);
+            compressed = 1;
+        }
+        
+        if (compressed) {
+            lo = offset > IMAGE_IV_SIZE + BOOT_LZ4_HEADER_SIZE ? offset : IMAGE_IV_SIZE + BOOT_LZ4_HEADER_SIZE;
+            hi = offset + n < mac_end ? offset + n : mac_end;
+            if (!inflate_failed && lo < hi &&
+                boot_lz4_update(&lz, stream_block + (lo - offset), hi - lo) != 0) {
+                inflate_failed = 1;
+            }
+            written = lz.written;
+            continue;
+        }
+#endif
+        
+        if (offset > dest_size || n > dest_size - offset) {
+            ret = BOOT_IMAGE_ERR_PARAM;
+            break;
+        }
+        memcpy(dest + offset, stream_block, n);
+        written = offset + n;
+    }
+    
+    /* finish every context, then decide in the order the checks used to run */
+    if (crypto_sha256_final(&sha, hash) != CRYPTO_SUCCESS && ret == BOOT_IMAGE_OK) {
+        ret = BOOT_IMAGE_ERR_SIGNATURE;
+    }
+    if (crypto_hmac_sha256_final(&hmac, calculated_hmac) != CRYPTO_SUCCESS && ret == BOOT_IMAGE_OK) {
+        ret = BOOT_IMAGE_ERR_INTEGRITY;
+    }
+    
+    if (ret == BOOT_IMAGE_OK) {
+        if (expected_hash ?
+            crypto_compare_ct(hash, expected_hash, SHA256_HASH_SIZE) != 0 :
+            crypto_verify_signature_hash(hash, signature, sig_len, public_key, key_len) != CRYPTO_SUCCESS) {
+            ret = BOOT_IMAGE_ERR_SIGNATURE;
+        }
+    }
+    
+    if (cipher_ready) {
+#if FIRMWARE_ENCRYPTION == FIRMWARE_ENCRYPTION_AES_256_GCM
+        if (ret != BOOT_IMAGE_OK) {
+            crypto_aes_gcm_free(&cipher);
+        } else if (crypto_aes_gcm_decrypt_final(&cipher, tag) != CRYPTO_SUCCESS) {
+            ret = BOOT_IMAGE_ERR_DECRYPT;
+        }
+#else
+        crypto_aes_ctr_free(&cipher);
+#endif
+    }
+    
+    if (ret == BOOT_IMAGE_OK &&
+        crypto_compare_ct(stored_hmac, calculated_hmac, HMAC_SIZE) != 0) {
+        ret = BOOT_IMAGE_ERR_INTEGRITY;
+    }
+    
+#if ENABLE_FIRMWARE_COMPRESSION
+    if (ret == BOOT_IMAGE_OK && compressed &&
+        (inflate_failed || boot_lz4_finish(&lz, inflated_size) != 0)) {
+        ret = BOOT_IMAGE_ERR_DECOMPRESS;
+    }
+#endif
+    
+    if (ret != BOOT_IMAGE_OK) {
+        memset(dest, 0, written);
+    }
+    
+    return ret;
+}
+
+int boot_process_image(const uint8_t *image, size_t size,
+                       const uint8_t *signature, size_t sig_len,
+                       const uint8_t *public_key, size_t key_len,
+                       uint8_t *dest, size_t dest_size)
+{
+    if (!signature || !public_key) {
+        return BOOT_IMAGE_ERR_PARAM;
+    }
+    
+    return process_image(image, size, NULL, signature, sig_len, public_key, key_len,
+                         dest, dest_size);
+}
+
+int boot_process_image_hash(const uint8_t *image, size_t size,
+                            const uint8_t *expected_hash,
+                            uint8_t *dest, size_t dest_size)
+{
+    if (!expected_hash) {
+        return BOOT_IMAGE_ERR_PARAM;
+    }
+    
+    return process_image(image, size, expected_hash, NULL, 0, NULL, 0, dest, dest_size);
+}
@@ -0,0 +1,117 @@
+#include "boot.h"
+#include <string.h>
+
+// v1.0 - Streaming LZ4 block decoder
+// Takes the compressed payload in whatever pieces the image pass hands
+// it and writes the output straight into the execution region. Matches
+// are copied from output already written there, so there is no window
+// buffer; the decoder state is a handful of counters.
+
+enum {
+    LZ4_TOKEN,
+    LZ4_LITERAL_LENGTH,
+    LZ4_LITERALS,
+    LZ4_OFFSET,
+    LZ4_MATCH_LENGTH,
+    LZ4_ERROR
+};
+
+void boot_lz4_init(boot_lz4_t *lz, uint8_t *dest, size_t capacity)
+{
+    memset(lz, 0, sizeof(*lz));
+    lz->dest = dest;
+    lz->capacity = capacity;
+    lz->state = LZ4_TOKEN;
+}
+
+/* Copy a match byte by byte, offset may be shorter than the length */
+static int copy_match(boot_lz4_t *lz)
+{
+    size_t len = lz->length + 4;
+    
+    if (lz->offset == 0 || lz->offset > lz->written ||
+        len > lz->capacity - lz->written) {
+        return -1;
+    }
+    
+    for (size_t i = 0; i < len; i++) {
+        lz->dest[lz->written] = lz->dest[lz->written - lz->offset];
+        lz->written++;
+    }
+    
+    return 0;
+}
+
+int boot_lz4_update(boot_lz4_t *lz, const uint8_t *in, size_t len)
+{
+    while (len > 0 && lz->state != LZ4_ERROR) {
+        size_t n;
+    
+        switch (lz->state) {
+        case LZ4_TOKEN:
+            lz->token = *in++;
+            len--;
+            lz->length = lz->token >> 4;
+            lz->state = lz->length == 15 ? LZ4_LITERAL_LENGTH :
+                        lz->length ? LZ4_LITERALS : LZ4_OFFSET;
+            lz->offset_bytes = 0;
+            lz->offset = 0;
+            break;
+    
+        case LZ4_LITERAL_LENGTH:
+        case LZ4_MATCH_LENGTH:
+            /* 255 means another length byte follows */
+            lz->length += *in;
+            len--;
+            if (*in++ != 255) {
+                if (lz->state == LZ4_MATCH_LENGTH) {
+                    lz->state = copy_match(lz) != 0 ? LZ4_ERROR : LZ4_TOKEN;
+                } else {
+                    lz->state = LZ4_LITERALS;
+                }
+            }
+            break;
+    
+        case LZ4_LITERALS:
+            if (lz->length > lz->capacity - lz->written) {
+                lz->state = LZ4_ERROR;
+                break;
+            }
+            n = lz->length < len ? lz->length : len;
+            memcpy(lz->dest + lz->written, in, n);
+            lz->written += n;
+            lz->length -= n;
+            in += n;
+            len -= n;
+            if (lz->length == 0) {
+                lz->state = LZ4_OFFSET;
+            }
+            break;
+    
+        case LZ4_OFFSET:
+            lz->offset |= (size_t)*in++ << (8 * lz->offset_bytes);
+            len--;
+            if (++lz->offset_bytes == 2) {
+                lz->length = lz->token & 0x0f;
+                if (lz->length == 15) {
+                    lz->state = LZ4_MATCH_LENGTH;
+                } else {
+                    lz->state = copy_match(lz) != 0 ? LZ4_ERROR : LZ4_TOKEN;
+                }
+            }
+            break;
+        }
+    }
+    
+    return lz->state == LZ4_ERROR ? -1 : 0;
+}
+
+/* A block ends on the literals of its last sequence, which has no match */
+int boot_lz4_finish(const boot_lz4_t *lz, size_t expected)
+{
+    if (lz->state != LZ4_OFFSET || lz->offset_bytes != 0 || lz->written != expected) {
+        return -1;
+    }
+    
+    return 0;
+}
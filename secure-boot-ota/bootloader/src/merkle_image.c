@@ -0,0 +1,121 @@
+#include "boot.h"
+#include "crypto.h"
+#include "boot_config.h"
+#include <string.h>
+
+// v1.0 - Per-block verification of Merkle images
+// The signature covers only the trailer header and its root; each block
+// is then checked by hashing it and walking its siblings up to that
+// root. That is what lets a block be checked on first use, re-checked
+// later on its own, or checked as it arrives, instead of only as part of
+// the whole image. Same idea as dm-verity, with our own binary tree.
+
+static uint32_t read_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+int boot_merkle_open(boot_merkle_t *merkle, const uint8_t *image,
+                     const uint8_t *trailer, size_t trailer_len,
+                     const uint8_t *public_key, size_t key_len)
+{
+    uint8_t hash[SHA256_HASH_SIZE];
+    size_t tree_len;
+    
+    if (!merkle || !image || !trailer || !public_key ||
+        trailer_len < BOOT_MERKLE_HEADER_SIZE) {
+        return BOOT_IMAGE_ERR_PARAM;
+    }
+    
+    memset(merkle, 0, sizeof(*merkle));
+    
+    if (read_le32(trailer) != BOOT_MERKLE_MAGIC) {
+        return BOOT_IMAGE_ERR_PARAM;
+    }
+    
+    merkle->image_size = read_le32(trailer + 4);
+    merkle->block_size = read_le32(trailer + 8);
+    merkle->block_count = read_le32(trailer + 12);
+    memcpy(merkle->root, trailer + 16, SHA256_HASH_SIZE);
+    
+    /* the bitmap is sized by the limits, keep the header inside them */
+    if (merkle->image_size == 0 || merkle->image_size > MAX_FIRMWARE_SIZE ||
+        merkle->block_size < BOOT_MERKLE_BLOCK_MIN ||
+        (merkle->block_size & (merkle->block_size - 1)) != 0 ||
+        merkle->block_count != (merkle->image_size + merkle->block_size - 1) / merkle->block_size) {
+        return BOOT_IMAGE_ERR_PARAM;
+    }
+    
+    tree_len = crypto_merkle_nodes(merkle->block_count) * SHA256_HASH_SIZE;
+    if (trailer_len <= BOOT_MERKLE_HEADER_SIZE + tree_len) {
+        return BOOT_IMAGE_ERR_PARAM;
+    }
+    
+    if (crypto_hash_sha256(trailer, BOOT_MERKLE_HEADER_SIZE, hash) != CRYPTO_SUCCESS ||
+        crypto_verify_signature_hash(hash, trailer + BOOT_MERKLE_HEADER_SIZE + tree_len,
+                                     trailer_len - BOOT_MERKLE_HEADER_SIZE - tree_len,
+                                     public_key, key_len) != CRYPTO_SUCCESS) {
+        memset(merkle, 0, sizeof(*merkle));
+        return BOOT_IMAGE_ERR_SIGNATURE;
+    }
+    
+    merkle->image = image;
+    merkle->tree = trailer + BOOT_MERKLE_HEADER_SIZE;
+    return BOOT_IMAGE_OK;
+}
+
+int boot_merkle_verify_block(boot_merkle_t *merkle, uint32_t block)
+{
+    uint8_t leaf[SHA256_HASH_SIZE];
+    size_t offset;
+    size_t len;
+    
+    if (!merkle || !merkle->image || block >= merkle->block_count) {
+        return BOOT_IMAGE_ERR_PARAM;
+    }
+    
+    offset = (size_t)block * merkle->block_size;
+    len = merkle->image_size - offset < merkle->block_size ?
+          merkle->image_size - offset : merkle->block_size;
+    
+    merkle->verified[block / 8] &= (uint8_t)~(1u << (block % 8));
+    
+    if (crypto_merkle_leaf(merkle->image + offset, len, leaf) != CRYPTO_SUCCESS ||
+        crypto_merkle_verify_leaf(merkle->tree, merkle->block_count, block,
+                                  leaf, merkle->root) != CRYPTO_SUCCESS) {
+        return BOOT_IMAGE_ERR_INTEGRITY;
+    }
+    
+    merkle->verified[block / 8] |= (uint8_t)(1u << (block % 8));
+    return BOOT_IMAGE_OK;
+}
+
+int boot_merkle_ensure(boot_merkle_t *merkle, size_t offset, size_t len)
+{
+    uint32_t first;
+    uint32_t last;
+    
+    if (!merkle || !merkle->image || len == 0 ||
+        offset >= merkle->image_size || len > merkle->image_size - offset) {
+        return BOOT_IMAGE_ERR_PARAM;
+    }
+    
+    first = (uint32_t)(offset / merkle->block_size);
+    last = (uint32_t)((offset + len - 1) / merkle->block_size);
+    
+    for (uint32_t block = first; block <= last; block++) {
+        int ret;
+    
+        if (merkle->verified[block / 8] & (1u << (block % 8))) {
+            continue;
+        }
+    
+        ret = boot_merkle_verify_block(merkle, block);
+        if (ret != BOOT_IMAGE_OK) {
+            return ret;
+        }
+    }
+    
+    return BOOT_IMAGE_OK;
+}
@@ -15,9 +15,9 @@ int verify_firmware_signature(const uint8_t *firmware, size_t size,
         return -1;
     }
     
-    /* Verify RSA signature */
-    ret = crypto_verify_rsa(firmware, size, signature, sig_len,
-                           boot_public_key, BOOT_PUBLIC_KEY_SIZE);
+    /* RSA or ECDSA as configured */
+    ret = crypto_verify_signature(firmware, size, signature, sig_len,
+                                  boot_public_key, BOOT_PUBLIC_KEY_SIZE);
     
     if (ret != CRYPTO_SUCCESS) {
         return -1;
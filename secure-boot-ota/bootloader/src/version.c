@@ -3,26 +3,113 @@
 #include <stdint.h>
 #include <string.h>
 
+// v1.1 - Wear-levelled counter log instead of one rewritten word
 // v1.0 - Initial implementation
 // Version counter for rollback protection
+//
+// Each update programs the next free slot of a log page: the value and
+// its complement, so a write cut short by a reset never reads as valid.
+// Slots fill in order and the free ones are the erased tail of the
+// page, found with a binary search at boot. A full page wraps onto the
+// second one, which is already erased; the full page is erased by the
+// next check_version_counter(), so the commit path only ever programs.
+
+#define LOG_PAGES 2
+#define LOG_SLOTS (VERSION_LOG_PAGE_SIZE / VERSION_LOG_SLOT_SIZE)
+#define LOG_WORDS (VERSION_LOG_PAGE_SIZE / sizeof(uint32_t))
+#define ERASED_WORD 0xFFFFFFFFu
 
 /* Simulated flash for version counter - TODO: Replace with actual flash driver */
-static uint32_t version_flash[1] __attribute__((section(".version_section")));
+static uint32_t version_flash[LOG_PAGES][LOG_WORDS] __attribute__((section(".version_section")));
+
+typedef struct {
+    int active;                     /* page with the newest value, -1 if none */
+    uint32_t value;
+    size_t used[LOG_PAGES];         /* slots before the erased tail */
+} version_log_t;
+
+/* NOR programming only clears bits */
+static void flash_program_word(uint32_t *word, uint32_t value)
+{
+    *word &= value;
+}
+
+static void flash_erase_page(uint32_t *page)
+{
+    memset(page, 0xFF, VERSION_LOG_PAGE_SIZE);
+}
+
+static int slot_erased(const uint32_t *page, size_t slot)
+{
+    return page[2 * slot] == ERASED_WORD && page[2 * slot + 1] == ERASED_WORD;
+}
+
+static int slot_valid(const uint32_t *page, size_t slot)
+{
+    return page[2 * slot + 1] == ~page[2 * slot];
+}
+
+/* Number of slots before the first erased one */
+static size_t log_used(const uint32_t *page)
+{
+    size_t lo = 0;
+    size_t hi = LOG_SLOTS;
+    
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+    
+        if (slot_erased(page, mid)) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    
+    return lo;
+}
+
+static void log_scan(version_log_t *log)
+{
+    log->active = -1;
+    log->value = 0;
+    
+    for (int p = 0; p < LOG_PAGES; p++) {
+        log->used[p] = log_used(version_flash[p]);
+    
+        /* newest valid slot, stepping back over a torn last write */
+        for (size_t slot = log->used[p]; slot > 0; slot--) {
+            if (slot_valid(version_flash[p], slot - 1)) {
+                if (log->active < 0 || version_flash[p][2 * (slot - 1)] > log->value) {
+                    log->active = p;
+                    log->value = version_flash[p][2 * (slot - 1)];
+                }
+                break;
+            }
+        }
+    }
+}
 
 int check_version_counter(uint32_t *version)
 {
+    version_log_t log;
+    
     if (!version) {
         return -1;
     }
     
-    /* Read from flash */
-    *version = version_flash[0];
+    log_scan(&log);
     
-    /* Initialize if zero or erased (0xFFFFFFFF) */
-    if (*version == 0 || *version == 0xFFFFFFFF) {
+    /* Empty log: nothing was ever committed */
+    *version = log.active >= 0 ? log.value : MIN_VERSION;
+    if (*version < MIN_VERSION) {
         *version = MIN_VERSION;
-        version_flash[0] = *version;
-        // TODO: Should we write to actual flash here?
+    }
+    
+    /* Finish the erase a wrap left behind; what it holds is older */
+    for (int p = 0; p < LOG_PAGES; p++) {
+        if (p != log.active && log.used[p] != 0) {
+            flash_erase_page(version_flash[p]);
+        }
     }
     
     return 0;
@@ -30,8 +117,41 @@ int check_version_counter(uint32_t *version)
 
 int update_version_counter(uint32_t version)
 {
-    /* Write to flash */
-    version_flash[0] = version;
+    version_log_t log;
+    uint32_t *page;
+    size_t slot;
+    int p = 0;
+    
+    log_scan(&log);
+    
+    if (log.active >= 0) {
+        /* monotonic - a lower value would reopen rollback */
+        if (version < log.value) {
+            return -1;
+        }
+        if (version == log.value) {
+            return 0;
+        }
+        p = log.active;
+        if (log.used[p] == LOG_SLOTS) {
+            p ^= 1;
+        }
+    }
+    
+    page = version_flash[p];
+    slot = p == log.active ? log.used[p] : 0;
+    
+    /* Only if no boot came between two wraps */
+    if (slot == 0 && log.used[p] != 0) {
+        flash_erase_page(page);
+    }
+    
+    flash_program_word(&page[2 * slot], version);
+    flash_program_word(&page[2 * slot + 1], ~version);
+    
+    if (!slot_valid(page, slot) || page[2 * slot] != version) {
+        return -1;
+    }
+    
     return 0;
 }
-
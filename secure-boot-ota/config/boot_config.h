@@ -4,7 +4,7 @@
 /* Signature Algorithm */
 #define BOOT_SIGNATURE_ALGORITHM_RSA_2048  1
 #define BOOT_SIGNATURE_ALGORITHM_ECDSA_P256 2
-#define BOOT_SIGNATURE_ALGORITHM BOOT_SIGNATURE_ALGORITHM_RSA_2048
+#define BOOT_SIGNATURE_ALGORITHM BOOT_SIGNATURE_ALGORITHM_ECDSA_P256
 
 /* Encryption Algorithm */
 #define FIRMWARE_ENCRYPTION_AES_256_CTR  1
@@ -16,24 +16,67 @@
 #define FIRMWARE_START_ADDRESS    0x08010000
 #define VERSION_COUNTER_ADDRESS   0x0800F000
 #define MAX_FIRMWARE_SIZE         (512 * 1024)  /* 512 KB */
+#define FIRMWARE_SLOT_SIZE        (MAX_FIRMWARE_SIZE + 32 * 1024)  /* header, payload, signature, tree */
+#define FIRMWARE_SLOT_B_ADDRESS   (FIRMWARE_START_ADDRESS + FIRMWARE_SLOT_SIZE)  /* slot A at the start */
+#define BOOT_CONTROL_ADDRESS      0x0800D000    /* two record copies, a flash page apart */
+#define BOOT_TRACE_ADDRESS        0x2000FF00    /* retained RAM below the execution region */
+#define FIRMWARE_EXEC_ADDRESS     0x20010000    /* images are decompressed here */
+#define FIRMWARE_EXEC_SIZE        (1024 * 1024) /* largest decompressed image */
+
+/* Compression - LZ4 payloads inflated during the image pass, raw ones still boot */
+#define ENABLE_FIRMWARE_COMPRESSION  1
+
+/* Flash geometry */
+#define BOOT_FLASH_PAGE_SIZE      2048  /* read/program unit of the internal flash */
+#define BOOT_STREAM_BLOCK_SIZE    BOOT_FLASH_PAGE_SIZE  /* image pass, multiple of 16 */
+#define BOOT_MERKLE_BLOCK_MIN     512   /* smallest block of a Merkle image */
+
+/* Boot phase trace - timestamps left in RAM for the firmware to report */
+#define BOOT_TRACE_ENABLE         1
+#define BOOT_CPU_HZ               160000000u    /* core clock, DWT cycles per second */
 
 /* Key Storage */
+#if BOOT_SIGNATURE_ALGORITHM == BOOT_SIGNATURE_ALGORITHM_ECDSA_P256
+#define BOOT_PUBLIC_KEY_SIZE      960  /* P-256 comb table, make_key_table.py */
+#else
 #define BOOT_PUBLIC_KEY_SIZE      256  /* RSA-2048 public key */
+#endif
 #define FIRMWARE_KEY_SIZE         32   /* AES-256 key */
 
 /* Version Counter */
 #define VERSION_COUNTER_SIZE      4
 #define MIN_VERSION               1
+#define VERSION_LOG_PAGE_SIZE     BOOT_FLASH_PAGE_SIZE  /* two log pages at VERSION_COUNTER_ADDRESS */
+#define VERSION_LOG_SLOT_SIZE     8     /* value and its complement */
 
 /* Anti-Tamper */
 #define ENABLE_ANTI_TAMPER        1
 #define CHECKSUM_INTERVAL_MS      1000
 #define MAX_CHECKSUM_FAILURES     3
+#define ANTI_TAMPER_PAGE_SIZE     4096  /* unit of the incremental scan */
+#define ANTI_TAMPER_SCAN_BUDGET   4096  /* bytes re-hashed per anti_tamper_check() */
+#define ANTI_TAMPER_MAX_PAGES     (MAX_FIRMWARE_SIZE / ANTI_TAMPER_PAGE_SIZE)
 
 /* OTA Configuration */
 #define OTA_SERVER_URL_MAX        256
 #define OTA_DOWNLOAD_TIMEOUT_MS    30000
 #define OTA_MAX_RETRIES           3
+#define OTA_CHUNK_SIZE_MIN        1024         /* manifest chunk size limits, */
+#define OTA_CHUNK_SIZE_MAX        (64 * 1024)  /* one chunk is buffered in RAM */
+#define OTA_SLOT_PATH             "/tmp/firmware_update.bin"  /* inactive slot, file or partition */
+#define OTA_SLOT_A_PATH           "/tmp/firmware_slot_a.bin"  /* A/B install targets, */
+#define OTA_SLOT_B_PATH           "/tmp/firmware_slot_b.bin"  /* files or partitions */
+#define OTA_BOOT_CONTROL_PATH     "/tmp/boot_control.bin"     /* both record copies */
+#define OTA_INSTALL_STEP_SIZE     4096  /* bytes written per ota_install_step() */
+#define OTA_INSTALL_STEP_DELAY_MS 5     /* pause between steps in ota_install_firmware() */
+#define OTA_DNS_TIMEOUT_MS        3000  /* then the request falls back to curl's resolver */
+#define OTA_DNS_RETRY_MS          600   /* first resend, doubled for each one after */
+#define OTA_DNS_TRIES             3
+#define OTA_DNS_TTL_MAX           86400 /* seconds, caps what the server asks for */
+#define OTA_DNS_NEG_TTL_DEFAULT   30    /* negative answer without an SOA */
+#define OTA_DNS_NEG_TTL_MAX       300
+#define OTA_DNS_HOSTS_TTL         300   /* /etc/hosts entries */
+#define OTA_DNS_PREFETCH_PERCENT  10    /* refresh in the last tenth of a TTL */
 
 #endif /* BOOT_CONFIG_H */
 
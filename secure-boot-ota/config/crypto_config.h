@@ -2,8 +2,8 @@
 #define CRYPTO_CONFIG_H
 
 /* Crypto algorithm selection */
-#define USE_RSA_2048 1
-#define USE_ECDSA_P256 0
+#define USE_RSA_2048 0
+#define USE_ECDSA_P256 1
 #define USE_AES_256_GCM 1
 #define USE_AES_256_CTR 0
 
@@ -18,6 +18,29 @@
 /* HMAC */
 #define HMAC_KEY_SIZE 32
 
+/*
+ * Hardware backend - SHA-256, AES-GCM decryption and ECDSA verification
+ * are offered to the selected engine first; whatever it can't handle
+ * (unsupported key format, engine busy or timed out) runs in mbedTLS.
+ */
+#define CRYPTO_BACKEND_SOFTWARE 0
+#define CRYPTO_BACKEND_STM32 1      /* HASH, CRYP/AES and PKA through the STM32Cube HAL */
+#define CRYPTO_BACKEND_CAAM 2       /* i.MX CAAM through the MCUXpresso fsl_caam driver */
+#define CRYPTO_BACKEND CRYPTO_BACKEND_SOFTWARE
+
+/* Engine timeout for the HAL calls */
+#define CRYPTO_BACKEND_TIMEOUT_MS 1000
+
+/* Device HAL header for CRYPTO_BACKEND_STM32, pulls in stm32xxxx_hal_conf.h */
+#define CRYPTO_STM32_HAL_HEADER "stm32u5xx_hal.h"
+
+/*
+ * ARMv8 Crypto Extensions for SHA-256, AES-CTR and AES-GCM on AArch64
+ * builds. Used only if the CPU reports them at runtime, so it is safe to
+ * leave on for cores without them.
+ */
+#define CRYPTO_ARMV8_CE 1
+
 /* Key derivation */
 #define HKDF_SALT_SIZE 32
 #define PBKDF2_ITERATIONS 10000
@@ -3,6 +3,12 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <mbedtls/sha256.h>
+#include <mbedtls/md.h>
+#include <mbedtls/aes.h>
+#include <mbedtls/gcm.h>
+#include <mbedtls/pk.h>
+#include "crypto_armv8.h"
 
 #define RSA_KEY_SIZE_2048 256
 #define ECDSA_KEY_SIZE_P256 64
@@ -16,9 +22,81 @@ typedef enum {
     CRYPTO_ERROR_INVALID_SIGNATURE = -1,
     CRYPTO_ERROR_INVALID_KEY = -2,
     CRYPTO_ERROR_BUFFER_TOO_SMALL = -3,
-    CRYPTO_ERROR_INVALID_PARAM = -4
+    CRYPTO_ERROR_INVALID_PARAM = -4,
+    CRYPTO_ERROR_NOT_SUPPORTED = -5,    /* backend can't do it, use software */
+    CRYPTO_ERROR_HARDWARE = -6          /* engine failed after writing the output */
 } crypto_result_t;
 
+/*
+ * Incremental hash contexts, for images too large to hold in RAM.
+ * Call init, then update with each chunk in order (any size, zero allowed),
+ * then final. final releases the context; on an early exit call free
+ * instead. Contexts live on the caller's stack, nothing is allocated
+ * except the HMAC's mbedTLS md state.
+ */
+typedef struct {
+    mbedtls_sha256_context sha;
+#if CRYPTO_HAVE_ARMV8_CE
+    /* set at init when the CPU has SHA2, sha is unused then */
+    int armv8;
+    uint32_t state[8];
+    uint8_t block[64];
+    uint64_t total_len;
+#endif
+} crypto_sha256_ctx_t;
+
+typedef struct {
+    mbedtls_md_context_t md;
+} crypto_hmac_sha256_ctx_t;
+
+/*
+ * Incremental AES-256 decryption, same init/update/final pattern.
+ * GCM: every update except the last must be a multiple of 16 bytes, and
+ * plaintext is released before the tag is checked, so nothing it produced
+ * may be used until final has returned CRYPTO_SUCCESS.
+ * Input and output of an update may be the same buffer.
+ */
+typedef struct {
+    mbedtls_gcm_context gcm;
+#if CRYPTO_HAVE_ARMV8_CE
+    /* set at init when the CPU has AES and PMULL, gcm is unused then */
+    int armv8;
+    uint32_t rk[CRYPTO_ARMV8_AES256_RK_WORDS];
+    uint8_t h[16];                  /* E(K, 0^128) */
+    uint8_t ek0[16];                /* E(K, J0), masks the tag */
+    uint8_t counter[16];
+    uint8_t ghash[16];
+    uint64_t aad_len;
+    uint64_t ct_len;
+#endif
+} crypto_aes_gcm_ctx_t;
+
+typedef struct {
+    mbedtls_aes_context aes;
+    uint8_t nonce_counter[16];
+    uint8_t stream_block[16];
+    size_t nc_off;
+#if CRYPTO_HAVE_ARMV8_CE
+    /* set at init when the CPU has AES, aes is unused then */
+    int armv8;
+    uint32_t rk[CRYPTO_ARMV8_AES256_RK_WORDS];
+#endif
+} crypto_aes_ctr_ctx_t;
+
+/*
+ * Public key parsed once for a run of signatures (FIT sub-images, log
+ * batches, commands). mbedTLS keeps its per-key precomputation in pk
+ * between calls: R^2 mod N is filled in at init for RSA, the P-256
+ * comb table for G on the first verify. A CRYPTO_P256_TABLE_SIZE key is
+ * a comb table and skips mbedTLS. One handle per thread.
+ */
+typedef struct {
+    mbedtls_pk_context pk;
+    const uint8_t *table;           /* P-256 key table, pk unused then */
+    int has_point;                  /* P-256 point kept raw for the backend */
+    uint8_t point[64];              /* X || Y */
+} crypto_verifier_t;
+
 /* Initialize crypto library */
 int crypto_init(void);
 
@@ -39,6 +117,52 @@ int crypto_verify_ecdsa(const uint8_t *data, size_t data_len,
                         const uint8_t *signature, size_t sig_len,
                         const uint8_t *public_key, size_t key_len);
 
+/* Same checks against a SHA-256 digest computed by the caller */
+int crypto_verify_rsa_hash(const uint8_t *hash,
+                           const uint8_t *signature, size_t sig_len,
+                           const uint8_t *public_key, size_t key_len);
+
+int crypto_verify_ecdsa_hash(const uint8_t *hash,
+                             const uint8_t *signature, size_t sig_len,
+                             const uint8_t *public_key, size_t key_len);
+
+/* RSA or ECDSA as BOOT_SIGNATURE_ALGORITHM selects, a key of the other
+ * kind is refused. What the bootloader and the OTA client call. */
+int crypto_verify_signature(const uint8_t *data, size_t data_len,
+                            const uint8_t *signature, size_t sig_len,
+                            const uint8_t *public_key, size_t key_len);
+
+int crypto_verify_signature_hash(const uint8_t *hash,
+                                 const uint8_t *signature, size_t sig_len,
+                                 const uint8_t *public_key, size_t key_len);
+
+/*
+ * P-256 with fixed-base comb tables. A key table holds the 15 affine
+ * multiples of the public point that the comb adds (make_key_table.py,
+ * or crypto_p256_table() from the raw X || Y); it is what the key
+ * storage area keeps for an ECDSA build. r, s and the hash are 32 bytes
+ * big-endian.
+ */
+#define CRYPTO_P256_TABLE_SIZE (15 * 64)
+
+int crypto_p256_table(const uint8_t *point, uint8_t *table);
+
+int crypto_p256_verify(const uint8_t *hash, const uint8_t *r, const uint8_t *s,
+                       const uint8_t *table);
+
+/* Verifier handle, RSA or ECDSA depending on the key */
+int crypto_verifier_init(crypto_verifier_t *verifier,
+                         const uint8_t *public_key, size_t key_len);
+
+int crypto_verifier_verify(crypto_verifier_t *verifier,
+                           const uint8_t *data, size_t data_len,
+                           const uint8_t *signature, size_t sig_len);
+
+int crypto_verifier_verify_hash(crypto_verifier_t *verifier, const uint8_t *hash,
+                                const uint8_t *signature, size_t sig_len);
+
+void crypto_verifier_free(crypto_verifier_t *verifier);
+
 /* Encryption Operations */
 int crypto_encrypt_aes_ctr(const uint8_t *plaintext, size_t pt_len,
                            const uint8_t *key, const uint8_t *iv,
@@ -59,15 +183,72 @@ int crypto_decrypt_aes_gcm(const uint8_t *ciphertext, size_t ct_len,
                            const uint8_t *tag,
                            uint8_t *plaintext);
 
+int crypto_aes_ctr_init(crypto_aes_ctr_ctx_t *ctx,
+                        const uint8_t *key, const uint8_t *iv);
+
+int crypto_aes_ctr_update(crypto_aes_ctr_ctx_t *ctx,
+                          const uint8_t *input, size_t len,
+                          uint8_t *output);
+
+void crypto_aes_ctr_free(crypto_aes_ctr_ctx_t *ctx);
+
+int crypto_aes_gcm_decrypt_init(crypto_aes_gcm_ctx_t *ctx,
+                                const uint8_t *key, const uint8_t *iv,
+                                const uint8_t *aad, size_t aad_len);
+
+int crypto_aes_gcm_decrypt_update(crypto_aes_gcm_ctx_t *ctx,
+                                  const uint8_t *ciphertext, size_t ct_len,
+                                  uint8_t *plaintext);
+
+int crypto_aes_gcm_decrypt_final(crypto_aes_gcm_ctx_t *ctx,
+                                 const uint8_t *tag);
+
+void crypto_aes_gcm_free(crypto_aes_gcm_ctx_t *ctx);
+
 /* Hash Operations */
 int crypto_hash_sha256(const uint8_t *data, size_t data_len,
                        uint8_t *hash);
 
+int crypto_sha256_init(crypto_sha256_ctx_t *ctx);
+
+int crypto_sha256_update(crypto_sha256_ctx_t *ctx,
+                         const uint8_t *data, size_t data_len);
+
+int crypto_sha256_final(crypto_sha256_ctx_t *ctx, uint8_t *hash);
+
+void crypto_sha256_free(crypto_sha256_ctx_t *ctx);
+
 /* HMAC Operations */
 int crypto_hmac_sha256(const uint8_t *data, size_t data_len,
                        const uint8_t *key, size_t key_len,
                        uint8_t *hmac);
 
+int crypto_hmac_sha256_init(crypto_hmac_sha256_ctx_t *ctx,
+                            const uint8_t *key, size_t key_len);
+
+int crypto_hmac_sha256_update(crypto_hmac_sha256_ctx_t *ctx,
+                              const uint8_t *data, size_t data_len);
+
+int crypto_hmac_sha256_final(crypto_hmac_sha256_ctx_t *ctx, uint8_t *hmac);
+
+void crypto_hmac_sha256_free(crypto_hmac_sha256_ctx_t *ctx);
+
+/* MAC/tag comparison whose timing does not depend on where they differ */
+int crypto_compare_ct(const uint8_t *a, const uint8_t *b, size_t len);
+
+/* Merkle tree over fixed-size blocks, stored level by level with the root
+ * last; crypto_merkle_nodes() is the array length in hashes. Fill the
+ * leaves with crypto_merkle_leaf(), then build. */
+size_t crypto_merkle_nodes(size_t leaves);
+
+int crypto_merkle_leaf(const uint8_t *data, size_t len, uint8_t *hash);
+
+int crypto_merkle_build(uint8_t *tree, size_t leaves, uint8_t *root);
+
+/* Check one leaf against root through its siblings in the tree */
+int crypto_merkle_verify_leaf(const uint8_t *tree, size_t leaves, size_t index,
+                              const uint8_t *leaf, const uint8_t *root);
+
 /* Key Derivation */
 int crypto_hkdf(const uint8_t *salt, size_t salt_len,
                 const uint8_t *ikm, size_t ikm_len,
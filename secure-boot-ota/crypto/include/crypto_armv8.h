@@ -0,0 +1,59 @@
+#ifndef CRYPTO_ARMV8_H
+#define CRYPTO_ARMV8_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "crypto_config.h"
+
+/*
+ * ARMv8 Crypto Extension kernels (SHA2, AES, PMULL) for AArch64 Cortex-A.
+ * They are compiled in on AArch64 builds with CRYPTO_ARMV8_CE set, and
+ * only used when crypto_cpu_features() reports the instructions at
+ * runtime; everything else runs in mbedTLS as before. Callers guard
+ * their use with #if CRYPTO_HAVE_ARMV8_CE.
+ */
+#if defined(__aarch64__) && CRYPTO_ARMV8_CE
+#define CRYPTO_HAVE_ARMV8_CE 1
+#else
+#define CRYPTO_HAVE_ARMV8_CE 0
+#endif
+
+#define CRYPTO_CPU_SHA2  (1u << 0)
+#define CRYPTO_CPU_AES   (1u << 1)
+#define CRYPTO_CPU_PMULL (1u << 2)
+
+/* AES-256 encryption key schedule, 15 round keys */
+#define CRYPTO_ARMV8_AES256_RK_WORDS 60
+
+#if CRYPTO_HAVE_ARMV8_CE
+
+/* Detected once, then cached; 0 when the CPU has none of them */
+unsigned int crypto_cpu_features(void);
+
+/* SHA-256 compression over whole 64-byte blocks */
+void crypto_armv8_sha256_blocks(uint32_t state[8], const uint8_t *data, size_t blocks);
+
+void crypto_armv8_aes256_setkey(uint32_t rk[CRYPTO_ARMV8_AES256_RK_WORDS], const uint8_t *key);
+
+void crypto_armv8_aes_encrypt_block(const uint32_t *rk, const uint8_t in[16], uint8_t out[16]);
+
+/*
+ * Same contract as mbedtls_aes_crypt_ctr(): nc_off and stream_block carry
+ * a partial block between calls. counter_bytes is how much of the counter
+ * block is incremented: 16 for plain CTR, 4 for GCM's inc32.
+ */
+void crypto_armv8_aes_ctr(const uint32_t *rk, size_t *nc_off,
+                          uint8_t counter[16], uint8_t stream_block[16],
+                          size_t counter_bytes,
+                          const uint8_t *input, uint8_t *output, size_t len);
+
+/*
+ * GHASH over whole 16-byte blocks. h is the hash subkey E(K, 0^128) and
+ * y the running value, both as GCM bytes.
+ */
+void crypto_armv8_ghash(uint8_t y[16], const uint8_t h[16],
+                        const uint8_t *data, size_t blocks);
+
+#endif /* CRYPTO_HAVE_ARMV8_CE */
+
+#endif /* CRYPTO_ARMV8_H */
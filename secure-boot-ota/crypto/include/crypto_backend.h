@@ -0,0 +1,59 @@
+#ifndef CRYPTO_BACKEND_H
+#define CRYPTO_BACKEND_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Hardware crypto backend, selected with CRYPTO_BACKEND in crypto_config.h.
+ * Every operation is optional: a NULL entry, or an entry returning
+ * CRYPTO_ERROR_NOT_SUPPORTED, sends the call down the software path.
+ * A definite answer (bad signature, tag mismatch) is returned as is and
+ * never retried in software. So is CRYPTO_ERROR_HARDWARE, for an engine
+ * that failed after it may have written output over its own input
+ * (in-place decryption): the software path would only read garbage.
+ */
+typedef struct {
+    const char *name;
+    
+    /* called once from crypto_init() */
+    int (*init)(void);
+    
+    int (*sha256)(const uint8_t *data, size_t data_len, uint8_t *hash);
+    
+    /* 12-byte IV and 16-byte tag, same as crypto_decrypt_aes_gcm() */
+    int (*aes_gcm_decrypt)(const uint8_t *ciphertext, size_t ct_len,
+                           const uint8_t *key, const uint8_t *iv,
+                           const uint8_t *aad, size_t aad_len,
+                           const uint8_t *tag,
+                           uint8_t *plaintext);
+    
+    /* P-256, raw public point X||Y and raw signature r||s */
+    int (*ecdsa_p256_verify)(const uint8_t *hash,
+                             const uint8_t *r, const uint8_t *s,
+                             const uint8_t *pub_x, const uint8_t *pub_y);
+} crypto_backend_t;
+
+/* Bring up the engine, from crypto_init(); if it fails everything stays in software */
+int crypto_backend_init(void);
+
+/* The backend in use; the software one has no entries */
+const crypto_backend_t *crypto_backend_get(void);
+
+/* Do the output's len bytes overlap the input's */
+int crypto_backend_in_place(const uint8_t *in, const uint8_t *out, size_t len);
+
+/* Helpers for engines that want raw values instead of DER */
+int crypto_backend_ecdsa_signature_raw(const uint8_t *sig, size_t sig_len,
+                                       uint8_t *r, uint8_t *s);
+
+int crypto_backend_p256_public_raw(const uint8_t *key, size_t key_len,
+                                   const uint8_t **x, const uint8_t **y);
+
+/* NIST P-256 domain parameters, big-endian */
+extern const uint8_t crypto_p256_prime[32];
+extern const uint8_t crypto_p256_gx[32];
+extern const uint8_t crypto_p256_gy[32];
+extern const uint8_t crypto_p256_order[32];
+
+#endif /* CRYPTO_BACKEND_H */
@@ -0,0 +1,313 @@
+#include "crypto_armv8.h"
+
+// ARMv8 Crypto Extension kernels for SHA-256, AES and GHASH
+// Built with the crypto extension enabled for this file only, the
+// callers check crypto_cpu_features() before getting here.
+// v1.0 - Initial implementation
+
+#if CRYPTO_HAVE_ARMV8_CE
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("crypto"))), apply_to = function)
+#else
+#pragma GCC target("+crypto")
+#endif
+
+#include <arm_neon.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <sys/auxv.h>
+#ifndef HWCAP_AES
+#define HWCAP_AES (1 << 3)
+#endif
+#ifndef HWCAP_PMULL
+#define HWCAP_PMULL (1 << 4)
+#endif
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+#endif
+
+static unsigned int cpu_features;
+static int cpu_probed;
+
+static unsigned int probe_cpu(void)
+{
+    unsigned int features = 0;
+    
+#if defined(__linux__)
+    unsigned long hwcap = getauxval(AT_HWCAP);
+    
+    if (hwcap & HWCAP_SHA2) {
+        features |= CRYPTO_CPU_SHA2;
+    }
+    if (hwcap & HWCAP_AES) {
+        features |= CRYPTO_CPU_AES;
+    }
+    if (hwcap & HWCAP_PMULL) {
+        features |= CRYPTO_CPU_PMULL;
+    }
+#else
+    /* bare metal runs at EL1 or above, where the ID register is readable */
+    uint64_t isar0;
+    
+    __asm__ volatile("mrs %0, ID_AA64ISAR0_EL1" : "=r"(isar0));
+    
+    if (((isar0 >> 12) & 0xf) >= 1) {
+        features |= CRYPTO_CPU_SHA2;
+    }
+    if (((isar0 >> 4) & 0xf) >= 1) {
+        features |= CRYPTO_CPU_AES;
+    }
+    if (((isar0 >> 4) & 0xf) >= 2) {
+        features |= CRYPTO_CPU_PMULL;
+    }
+#endif
+    
+    return features;
+}
+
+unsigned int crypto_cpu_features(void)
+{
+    /* racing first callers compute the same value */
+    if (!cpu_probed) {
+        cpu_features = probe_cpu();
+        cpu_probed = 1;
+    }
+    
+    return cpu_features;
+}
+
+/* ---- SHA-256 ---- */
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+void crypto_armv8_sha256_blocks(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+    uint32x4_t abcd = vld1q_u32(&state[0]);
+    uint32x4_t efgh = vld1q_u32(&state[4]);
+    
+    while (blocks--) {
+        uint32x4_t abcd_in = abcd;
+        uint32x4_t efgh_in = efgh;
+        uint32x4_t w[4];
+        
+        /* message words are big-endian */
+        for (int i = 0; i < 4; i++) {
+            w[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+        }
+        
+        /* four rounds per step, w[] holds the next 16 schedule words */
+        for (int i = 0; i < 16; i++) {
+            uint32x4_t wk = vaddq_u32(w[i & 3], vld1q_u32(&sha256_k[4 * i]));
+            uint32x4_t abcd_prev = abcd;
+            
+            if (i < 12) {
+                w[i & 3] = vsha256su1q_u32(vsha256su0q_u32(w[i & 3], w[(i + 1) & 3]),
+                                           w[(i + 2) & 3], w[(i + 3) & 3]);
+            }
+            
+            abcd = vsha256hq_u32(abcd, efgh, wk);
+            efgh = vsha256h2q_u32(efgh, abcd_prev, wk);
+        }
+        
+        abcd = vaddq_u32(abcd, abcd_in);
+        efgh = vaddq_u32(efgh, efgh_in);
+        data += 64;
+    }
+    
+    vst1q_u32(&state[0], abcd);
+    vst1q_u32(&state[4], efgh);
+}
+
+/* ---- AES-256 ---- */
+
+/* S-box on each byte of a word: AESE with a zero key, all four columns alike */
+static uint32_t aes_sub_word(uint32_t w)
+{
+    uint8x16_t x = vaeseq_u8(vreinterpretq_u8_u32(vdupq_n_u32(w)), vdupq_n_u8(0));
+    
+    return vgetq_lane_u32(vreinterpretq_u32_u8(x), 0);
+}
+
+void crypto_armv8_aes256_setkey(uint32_t rk[CRYPTO_ARMV8_AES256_RK_WORDS], const uint8_t *key)
+{
+    static const uint8_t rcon[7] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40 };
+    
+    /* words in memory order, the same layout AESE reads round keys in */
+    memcpy(rk, key, 32);
+    
+    for (int i = 8; i < CRYPTO_ARMV8_AES256_RK_WORDS; i++) {
+        uint32_t t = rk[i - 1];
+        
+        if (i % 8 == 0) {
+            t = aes_sub_word((t >> 8) | (t << 24)) ^ rcon[i / 8 - 1];
+        } else if (i % 8 == 4) {
+            t = aes_sub_word(t);
+        }
+        
+        rk[i] = rk[i - 8] ^ t;
+    }
+}
+
+static inline uint8x16_t aes256_encrypt(const uint8x16_t k[15], uint8x16_t x)
+{
+    for (int r = 0; r < 13; r++) {
+        x = vaesmcq_u8(vaeseq_u8(x, k[r]));
+    }
+    
+    return veorq_u8(vaeseq_u8(x, k[13]), k[14]);
+}
+
+static inline void aes_load_keys(uint8x16_t k[15], const uint32_t *rk)
+{
+    for (int r = 0; r < 15; r++) {
+        k[r] = vld1q_u8((const uint8_t *)&rk[4 * r]);
+    }
+}
+
+void crypto_armv8_aes_encrypt_block(const uint32_t *rk, const uint8_t in[16], uint8_t out[16])
+{
+    uint8x16_t k[15];
+    
+    aes_load_keys(k, rk);
+    vst1q_u8(out, aes256_encrypt(k, vld1q_u8(in)));
+}
+
+/* big-endian increment of the last counter_bytes bytes */
+static inline void counter_increment(uint8_t counter[16], size_t counter_bytes)
+{
+    for (size_t i = 16; i > 16 - counter_bytes; i--) {
+        if (++counter[i - 1] != 0) {
+            break;
+        }
+    }
+}
+
+void crypto_armv8_aes_ctr(const uint32_t *rk, size_t *nc_off,
+                          uint8_t counter[16], uint8_t stream_block[16],
+                          size_t counter_bytes,
+                          const uint8_t *input, uint8_t *output, size_t len)
+{
+    uint8x16_t k[15];
+    size_t n = *nc_off;
+    
+    /* finish the keystream block a previous call started */
+    while (n != 0 && len != 0) {
+        *output++ = *input++ ^ stream_block[n];
+        n = (n + 1) & 15;
+        len--;
+    }
+    
+    aes_load_keys(k, rk);
+    
+    /* four independent blocks keep the AES pipeline busy */
+    while (len >= 64) {
+        uint8x16_t c[4];
+        
+        for (int i = 0; i < 4; i++) {
+            c[i] = vld1q_u8(counter);
+            counter_increment(counter, counter_bytes);
+        }
+        for (int i = 0; i < 4; i++) {
+            c[i] = aes256_encrypt(k, c[i]);
+        }
+        for (int i = 0; i < 4; i++) {
+            vst1q_u8(output + 16 * i, veorq_u8(vld1q_u8(input + 16 * i), c[i]));
+        }
+        
+        input += 64;
+        output += 64;
+        len -= 64;
+    }
+    
+    while (len >= 16) {
+        uint8x16_t c = aes256_encrypt(k, vld1q_u8(counter));
+        
+        counter_increment(counter, counter_bytes);
+        vst1q_u8(output, veorq_u8(vld1q_u8(input), c));
+        input += 16;
+        output += 16;
+        len -= 16;
+    }
+    
+    if (len != 0) {
+        vst1q_u8(stream_block, aes256_encrypt(k, vld1q_u8(counter)));
+        counter_increment(counter, counter_bytes);
+        
+        for (n = 0; n < len; n++) {
+            output[n] = input[n] ^ stream_block[n];
+        }
+    }
+    
+    *nc_off = n;
+}
+
+/* ---- GHASH ---- */
+
+/*
+ * With the bits of every byte reversed, a GCM block read as a little-endian
+ * 128-bit value is the field element with x^i at bit i, so the product is a
+ * plain carry-less multiply reduced by x^128 = x^7 + x^2 + x + 1.
+ */
+static inline uint64x2_t clmul(uint64_t a, uint64_t b)
+{
+    return vreinterpretq_u64_p128(vmull_p64((poly64_t)a, (poly64_t)b));
+}
+
+static inline uint64x2_t gf128_mul(uint64x2_t a, uint64x2_t b)
+{
+    const uint64x2_t zero = vdupq_n_u64(0);
+    const uint64_t poly = 0x87;
+    uint64_t a0 = vgetq_lane_u64(a, 0), a1 = vgetq_lane_u64(a, 1);
+    uint64_t b0 = vgetq_lane_u64(b, 0), b1 = vgetq_lane_u64(b, 1);
+    uint64x2_t lo = clmul(a0, b0);
+    uint64x2_t hi = clmul(a1, b1);
+    uint64x2_t mid = veorq_u64(clmul(a0, b1), clmul(a1, b0));
+    uint64x2_t r1, r0;
+    
+    lo = veorq_u64(lo, vextq_u64(zero, mid, 1));
+    hi = veorq_u64(hi, vextq_u64(mid, zero, 1));
+    
+    /* fold bits 192..255 to 64..199, then everything above 127 to the bottom */
+    r1 = clmul(vgetq_lane_u64(hi, 1), poly);
+    r0 = clmul(vgetq_lane_u64(hi, 0) ^ vgetq_lane_u64(r1, 1), poly);
+    lo = veorq_u64(lo, vextq_u64(zero, r1, 1));
+    
+    return veorq_u64(lo, r0);
+}
+
+static inline uint64x2_t ghash_load(const uint8_t *p)
+{
+    return vreinterpretq_u64_u8(vrbitq_u8(vld1q_u8(p)));
+}
+
+void crypto_armv8_ghash(uint8_t y[16], const uint8_t h[16],
+                        const uint8_t *data, size_t blocks)
+{
+    uint64x2_t hv = ghash_load(h);
+    uint64x2_t acc = ghash_load(y);
+    
+    while (blocks--) {
+        acc = gf128_mul(veorq_u64(acc, ghash_load(data)), hv);
+        data += 16;
+    }
+    
+    vst1q_u8(y, vrbitq_u8(vreinterpretq_u8_u64(acc)));
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#endif
+
+#endif /* CRYPTO_HAVE_ARMV8_CE */
@@ -0,0 +1,183 @@
+#include "crypto.h"
+#include "crypto_backend.h"
+#include "crypto_config.h"
+#include <string.h>
+
+// Hardware backend selection and the helpers the engines share
+// v1.0 - STM32 and CAAM engines, software fallback
+
+static const crypto_backend_t crypto_backend_software = { "software", NULL, NULL, NULL, NULL };
+
+#if CRYPTO_BACKEND == CRYPTO_BACKEND_STM32
+extern const crypto_backend_t crypto_backend_stm32;
+#define SELECTED_BACKEND (&crypto_backend_stm32)
+#elif CRYPTO_BACKEND == CRYPTO_BACKEND_CAAM
+extern const crypto_backend_t crypto_backend_caam;
+#define SELECTED_BACKEND (&crypto_backend_caam)
+#elif CRYPTO_BACKEND == CRYPTO_BACKEND_SOFTWARE
+#define SELECTED_BACKEND (&crypto_backend_software)
+#else
+#error "Unknown CRYPTO_BACKEND"
+#endif
+
+/* software until crypto_init() has the engine running */
+static const crypto_backend_t *active_backend = &crypto_backend_software;
+
+int crypto_backend_init(void)
+{
+    const crypto_backend_t *backend = SELECTED_BACKEND;
+    
+    if (backend->init && backend->init() != CRYPTO_SUCCESS) {
+        // Engine unavailable: keep software and tell the caller
+        active_backend = &crypto_backend_software;
+        return CRYPTO_ERROR_NOT_SUPPORTED;
+    }
+    
+    active_backend = backend;
+    return CRYPTO_SUCCESS;
+}
+
+const crypto_backend_t *crypto_backend_get(void)
+{
+    return active_backend;
+}
+
+int crypto_backend_in_place(const uint8_t *in, const uint8_t *out, size_t len)
+{
+    return (uintptr_t)out < (uintptr_t)in + len && (uintptr_t)in < (uintptr_t)out + len;
+}
+
+const uint8_t crypto_p256_prime[32] = {
+    0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x00, 0x01,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+const uint8_t crypto_p256_gx[32] = {
+    0x6b, 0x17, 0xd1, 0xf2, 0xe1, 0x2c, 0x42, 0x47,
+    0xf8, 0xbc, 0xe6, 0xe5, 0x63, 0xa4, 0x40, 0xf2,
+    0x77, 0x03, 0x7d, 0x81, 0x2d, 0xeb, 0x33, 0xa0,
+    0xf4, 0xa1, 0x39, 0x45, 0xd8, 0x98, 0xc2, 0x96
+};
+
+const uint8_t crypto_p256_gy[32] = {
+    0x4f, 0xe3, 0x42, 0xe2, 0xfe, 0x1a, 0x7f, 0x9b,
+    0x8e, 0xe7, 0xeb, 0x4a, 0x7c, 0x0f, 0x9e, 0x16,
+    0x2b, 0xce, 0x33, 0x57, 0x6b, 0x31, 0x5e, 0xce,
+    0xcb, 0xb6, 0x40, 0x68, 0x37, 0xbf, 0x51, 0xf5
+};
+
+const uint8_t crypto_p256_order[32] = {
+    0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x00, 0x00,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xbc, 0xe6, 0xfa, 0xad, 0xa7, 0x17, 0x9e, 0x84,
+    0xf3, 0xb9, 0xca, 0xc2, 0xfc, 0x63, 0x25, 0x51
+};
+
+/* DER length, short or one/two-byte long form */
+static int der_length(const uint8_t **p, const uint8_t *end, size_t *len)
+{
+    size_t n;
+    
+    if (*p >= end) {
+        return -1;
+    }
+    
+    n = *(*p)++;
+    if (n & 0x80) {
+        size_t bytes = n & 0x7F;
+        
+        if (bytes == 0 || bytes > 2 || (size_t)(end - *p) < bytes) {
+            return -1;
+        }
+        n = 0;
+        while (bytes--) {
+            n = (n << 8) | *(*p)++;
+        }
+    }
+    
+    if (n > (size_t)(end - *p)) {
+        return -1;
+    }
+    
+    *len = n;
+    return 0;
+}
+
+/* one DER INTEGER into a 32-byte big-endian buffer */
+static int der_integer_32(const uint8_t **p, const uint8_t *end, uint8_t *out)
+{
+    size_t len;
+    
+    if (*p >= end || *(*p)++ != 0x02 || der_length(p, end, &len) != 0) {
+        return -1;
+    }
+    
+    /* sign padding */
+    while (len > 0 && **p == 0x00) {
+        (*p)++;
+        len--;
+    }
+    if (len > 32) {
+        return -1;
+    }
+    
+    memset(out, 0, 32 - len);
+    memcpy(out + 32 - len, *p, len);
+    *p += len;
+    return 0;
+}
+
+/* ECDSA-Sig-Value (SEQUENCE of r and s) as written by mbedTLS, to raw r and s */
+int crypto_backend_ecdsa_signature_raw(const uint8_t *sig, size_t sig_len,
+                                       uint8_t *r, uint8_t *s)
+{
+    const uint8_t *p = sig;
+    const uint8_t *end = sig + sig_len;
+    size_t len;
+    
+    if (!sig || sig_len < 2 || *p++ != 0x30 || der_length(&p, end, &len) != 0 || p + len != end) {
+        return CRYPTO_ERROR_NOT_SUPPORTED;
+    }
+    
+    if (der_integer_32(&p, end, r) != 0 || der_integer_32(&p, end, s) != 0 || p != end) {
+        return CRYPTO_ERROR_NOT_SUPPORTED;
+    }
+    
+    return CRYPTO_SUCCESS;
+}
+
+/*
+ * Public point inside a P-256 key as accepted by crypto_verify_ecdsa():
+ * a SubjectPublicKeyInfo for id-ecPublicKey/prime256v1 with an uncompressed
+ * point, or the bare 65-byte uncompressed point. Anything else is left to
+ * mbedTLS.
+ */
+int crypto_backend_p256_public_raw(const uint8_t *key, size_t key_len,
+                                   const uint8_t **x, const uint8_t **y)
+{
+    static const uint8_t spki_header[] = {
+        0x30, 0x59, 0x30, 0x13, 0x06, 0x07, 0x2a, 0x86,
+        0x48, 0xce, 0x3d, 0x02, 0x01, 0x06, 0x08, 0x2a,
+        0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07, 0x03,
+        0x42, 0x00
+    };
+    
+    if (!key) {
+        return CRYPTO_ERROR_NOT_SUPPORTED;
+    }
+    
+    if (key_len == sizeof(spki_header) + 65 && memcmp(key, spki_header, sizeof(spki_header)) == 0) {
+        key += sizeof(spki_header);
+        key_len = 65;
+    }
+    
+    if (key_len != 65 || key[0] != 0x04) {
+        return CRYPTO_ERROR_NOT_SUPPORTED;
+    }
+    
+    *x = key + 1;
+    *y = key + 33;
+    return CRYPTO_SUCCESS;
+}
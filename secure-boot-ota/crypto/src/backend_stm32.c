@@ -0,0 +1,221 @@
+#include "crypto.h"
+#include "crypto_backend.h"
+#include "crypto_config.h"
+
+// STM32 HASH / CRYP (AES) / PKA engines through the STM32Cube HAL
+// Each engine is only used if its HAL module is enabled in
+// stm32xxxx_hal_conf.h; the others stay NULL and run in software.
+// v1.0 - Initial implementation
+
+#if CRYPTO_BACKEND == CRYPTO_BACKEND_STM32
+
+#include CRYPTO_STM32_HAL_HEADER
+#include <string.h>
+
+static uint32_t load_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void store_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+#ifdef HAL_HASH_MODULE_ENABLED
+static HASH_HandleTypeDef hhash;
+
+static int stm32_sha256(const uint8_t *data, size_t data_len, uint8_t *hash)
+{
+    /* HAL sizes are 32-bit */
+    if (data_len > UINT32_MAX) {
+        return CRYPTO_ERROR_NOT_SUPPORTED;
+    }
+    
+    if (HAL_HASHEx_SHA256_Start(&hhash, (uint8_t *)data, (uint32_t)data_len,
+                                hash, CRYPTO_BACKEND_TIMEOUT_MS) != HAL_OK) {
+        /* busy or timed out - let software have it */
+        return CRYPTO_ERROR_NOT_SUPPORTED;
+    }
+    
+    return CRYPTO_SUCCESS;
+}
+#endif
+
+#ifdef HAL_CRYP_MODULE_ENABLED
+static CRYP_HandleTypeDef hcryp;
+
+static int stm32_aes_gcm_decrypt(const uint8_t *ciphertext, size_t ct_len,
+                                 const uint8_t *key, const uint8_t *iv,
+                                 const uint8_t *aad, size_t aad_len,
+                                 const uint8_t *tag,
+                                 uint8_t *plaintext)
+{
+    uint32_t key_words[8];
+    uint32_t iv_words[4];
+    uint32_t tag_words[4];
+    uint8_t computed[16];
+    HAL_StatusTypeDef status;
+    int ret = CRYPTO_SUCCESS;
+    
+    /* the peripheral moves whole words: buffers must be word aligned and
+     * the header a whole number of words */
+    if (ct_len > UINT32_MAX || (aad_len & 3) != 0 ||
+        (((uintptr_t)ciphertext | (uintptr_t)plaintext | (uintptr_t)aad) & 3) != 0) {
+        return CRYPTO_ERROR_NOT_SUPPORTED;
+    }
+    
+    for (int i = 0; i < 8; i++) {
+        key_words[i] = load_be32(key + 4 * i);
+    }
+    
+    /* 96-bit IV, the counter block starts at 2 */
+    iv_words[0] = load_be32(iv);
+    iv_words[1] = load_be32(iv + 4);
+    iv_words[2] = load_be32(iv + 8);
+    iv_words[3] = 0x00000002;
+    
+    hcryp.Init.DataType = CRYP_DATATYPE_8B;
+    hcryp.Init.KeySize = CRYP_KEYSIZE_256B;
+    hcryp.Init.pKey = key_words;
+    hcryp.Init.pInitVect = iv_words;
+    hcryp.Init.Algorithm = CRYP_AES_GCM;
+    hcryp.Init.Header = (uint32_t *)aad;
+    hcryp.Init.HeaderSize = (uint32_t)(aad_len / 4);
+    hcryp.Init.DataWidthUnit = CRYP_DATAWIDTHUNIT_BYTE;
+    
+    if (HAL_CRYP_SetConfig(&hcryp, &hcryp.Init) != HAL_OK) {
+        return CRYPTO_ERROR_NOT_SUPPORTED;
+    }
+    
+    status = HAL_CRYP_Decrypt(&hcryp, (uint32_t *)ciphertext, (uint32_t)ct_len,
+                              (uint32_t *)plaintext, CRYPTO_BACKEND_TIMEOUT_MS);
+    if (status == HAL_OK) {
+        status = HAL_CRYPEx_AESGCM_GenerateAuthTAG(&hcryp, tag_words, CRYPTO_BACKEND_TIMEOUT_MS);
+    }
+    
+    if (status != HAL_OK) {
+        /* in place, the ciphertext may already be partly overwritten */
+        if (crypto_backend_in_place(ciphertext, plaintext, ct_len)) {
+            memset(plaintext, 0, ct_len);
+            ret = CRYPTO_ERROR_HARDWARE;
+        } else {
+            ret = CRYPTO_ERROR_NOT_SUPPORTED;
+        }
+    } else {
+        for (int i = 0; i < 4; i++) {
+            store_be32(computed + 4 * i, tag_words[i]);
+        }
+        if (crypto_compare_ct(computed, tag, sizeof(computed)) != 0) {
+            /* same contract as the software path: nothing usable on failure */
+            memset(plaintext, 0, ct_len);
+            ret = CRYPTO_ERROR_INVALID_SIGNATURE;
+        }
+    }
+    
+    memset(key_words, 0, sizeof(key_words));
+    return ret;
+}
+#endif
+
+#ifdef HAL_PKA_MODULE_ENABLED
+static PKA_HandleTypeDef hpka;
+
+/* |a| for P-256, a = -3 */
+static const uint8_t p256_abs_a[32] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03
+};
+
+static int stm32_ecdsa_p256_verify(const uint8_t *hash,
+                                   const uint8_t *r, const uint8_t *s,
+                                   const uint8_t *pub_x, const uint8_t *pub_y)
+{
+    PKA_ECDSAVerifInTypeDef in;
+    
+    memset(&in, 0, sizeof(in));
+    in.primeOrderSize = 32;
+    in.modulusSize = 32;
+    in.coefSign = 1;                /* a is negative */
+    in.coef = p256_abs_a;
+    in.modulus = crypto_p256_prime;
+    in.basePointX = crypto_p256_gx;
+    in.basePointY = crypto_p256_gy;
+    in.primeOrder = crypto_p256_order;
+    in.pPubKeyCurvePtX = pub_x;
+    in.pPubKeyCurvePtY = pub_y;
+    in.RSign = r;
+    in.SSign = s;
+    in.hash = hash;
+    
+    if (HAL_PKA_ECDSAVerif(&hpka, &in, CRYPTO_BACKEND_TIMEOUT_MS) != HAL_OK) {
+        return CRYPTO_ERROR_NOT_SUPPORTED;
+    }
+    
+    if (!HAL_PKA_ECDSAVerif_IsValidSignature(&hpka)) {
+        return CRYPTO_ERROR_INVALID_SIGNATURE;
+    }
+    
+    return CRYPTO_SUCCESS;
+}
+#endif
+
+static int stm32_init(void)
+{
+#ifdef HAL_HASH_MODULE_ENABLED
+    __HAL_RCC_HASH_CLK_ENABLE();
+    hhash.Init.DataType = HASH_DATATYPE_8B;
+    if (HAL_HASH_Init(&hhash) != HAL_OK) {
+        return CRYPTO_ERROR_NOT_SUPPORTED;
+    }
+#endif
+
+#ifdef HAL_CRYP_MODULE_ENABLED
+    __HAL_RCC_AES_CLK_ENABLE();
+    hcryp.Instance = AES;
+    hcryp.Init.DataType = CRYP_DATATYPE_8B;
+    hcryp.Init.KeySize = CRYP_KEYSIZE_256B;
+    hcryp.Init.Algorithm = CRYP_AES_GCM;
+    if (HAL_CRYP_Init(&hcryp) != HAL_OK) {
+        return CRYPTO_ERROR_NOT_SUPPORTED;
+    }
+#endif
+
+#ifdef HAL_PKA_MODULE_ENABLED
+    __HAL_RCC_PKA_CLK_ENABLE();
+    hpka.Instance = PKA;
+    if (HAL_PKA_Init(&hpka) != HAL_OK) {
+        return CRYPTO_ERROR_NOT_SUPPORTED;
+    }
+#endif
+
+    return CRYPTO_SUCCESS;
+}
+
+const crypto_backend_t crypto_backend_stm32 = {
+    "stm32",
+    stm32_init,
+#ifdef HAL_HASH_MODULE_ENABLED
+    stm32_sha256,
+#else
+    NULL,
+#endif
+#ifdef HAL_CRYP_MODULE_ENABLED
+    stm32_aes_gcm_decrypt,
+#else
+    NULL,
+#endif
+#ifdef HAL_PKA_MODULE_ENABLED
+    stm32_ecdsa_p256_verify,
+#else
+    NULL,
+#endif
+};
+
+#endif /* CRYPTO_BACKEND == CRYPTO_BACKEND_STM32 */
@@ -1,4 +1,5 @@
 #include "crypto.h"
+#include "crypto_backend.h"
 #include <mbedtls/aes.h>
 #include <mbedtls/gcm.h>
 #include <mbedtls/ctr_drbg.h>
@@ -6,6 +7,9 @@
 #include <string.h>
 
 // AES encryption functions
+// v1.4 - ARMv8 AES/PMULL kernels for CTR and GCM decryption
+// v1.3 - GCM decryption goes to the hardware backend first
+// v1.2 - Incremental CTR and GCM-decrypt contexts
 // v1.1 - Fixed IV handling (2024-03-20)
 // v1.0 - Initial implementation
 
@@ -22,6 +26,20 @@ int crypto_encrypt_aes_ctr(const uint8_t *plaintext, size_t pt_len,
         return CRYPTO_ERROR_INVALID_PARAM;
     }
     
+#if CRYPTO_HAVE_ARMV8_CE
+    if (crypto_cpu_features() & CRYPTO_CPU_AES) {
+        uint32_t rk[CRYPTO_ARMV8_AES256_RK_WORDS];
+        uint8_t counter[16];
+        
+        memcpy(counter, iv, sizeof(counter));
+        crypto_armv8_aes256_setkey(rk, key);
+        crypto_armv8_aes_ctr(rk, &nc_off, counter, stream_block, 16,
+                             plaintext, ciphertext, pt_len);
+        memset(rk, 0, sizeof(rk));
+        return CRYPTO_SUCCESS;
+    }
+#endif
+    
     mbedtls_aes_init(&aes);
     
     // AES-256 key (32 bytes = 256 bits)
@@ -96,6 +114,7 @@ int crypto_decrypt_aes_gcm(const uint8_t *ciphertext, size_t ct_len,
                            const uint8_t *tag,
                            uint8_t *plaintext)
 {
+    const crypto_backend_t *backend = crypto_backend_get();
     mbedtls_gcm_context gcm;
     int ret;
     
@@ -103,6 +122,40 @@ int crypto_decrypt_aes_gcm(const uint8_t *ciphertext, size_t ct_len,
         return CRYPTO_ERROR_INVALID_PARAM;
     }
     
+    if (backend->aes_gcm_decrypt) {
+        ret = backend->aes_gcm_decrypt(ciphertext, ct_len, key, iv,
+                                       aad, aad_len, tag, plaintext);
+        if (ret != CRYPTO_ERROR_NOT_SUPPORTED) {
+            return ret;
+        }
+    }
+    
+#if CRYPTO_HAVE_ARMV8_CE
+    /* the incremental context has the CE path, one call covers the image */
+    if ((crypto_cpu_features() & (CRYPTO_CPU_AES | CRYPTO_CPU_PMULL)) ==
+        (CRYPTO_CPU_AES | CRYPTO_CPU_PMULL)) {
+        crypto_aes_gcm_ctx_t ctx;
+        
+        ret = crypto_aes_gcm_decrypt_init(&ctx, key, iv, aad, aad_len);
+        if (ret != CRYPTO_SUCCESS) {
+            return ret;
+        }
+        
+        ret = crypto_aes_gcm_decrypt_update(&ctx, ciphertext, ct_len, plaintext);
+        if (ret != CRYPTO_SUCCESS) {
+            crypto_aes_gcm_free(&ctx);
+            return ret;
+        }
+        
+        ret = crypto_aes_gcm_decrypt_final(&ctx, tag);
+        if (ret != CRYPTO_SUCCESS) {
+            /* same as mbedtls_gcm_auth_decrypt(): no plaintext on failure */
+            memset(plaintext, 0, ct_len);
+        }
+        return ret;
+    }
+#endif
+    
     mbedtls_gcm_init(&gcm);
     
     ret = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key, 256);
@@ -123,3 +176,253 @@ int crypto_decrypt_aes_gcm(const uint8_t *ciphertext, size_t ct_len,
     return CRYPTO_SUCCESS;
 }
 
+#if CRYPTO_HAVE_ARMV8_CE
+static void gcm_armv8_starts(crypto_aes_gcm_ctx_t *ctx,
+                             const uint8_t *key, const uint8_t *iv,
+                             const uint8_t *aad, size_t aad_len)
+{
+    uint8_t block[16];
+    size_t full = aad_len & ~(size_t)15;
+    
+    crypto_armv8_aes256_setkey(ctx->rk, key);
+    
+    memset(block, 0, sizeof(block));
+    crypto_armv8_aes_encrypt_block(ctx->rk, block, ctx->h);
+    
+    /* J0 = IV || 1 for a 96-bit IV, data starts at inc32(J0) */
+    memcpy(ctx->counter, iv, 12);
+    ctx->counter[12] = 0;
+    ctx->counter[13] = 0;
+    ctx->counter[14] = 0;
+    ctx->counter[15] = 1;
+    crypto_armv8_aes_encrypt_block(ctx->rk, ctx->counter, ctx->ek0);
+    ctx->counter[15] = 2;
+    
+    memset(ctx->ghash, 0, sizeof(ctx->ghash));
+    crypto_armv8_ghash(ctx->ghash, ctx->h, aad, full / 16);
+    if (aad_len & 15) {
+        memcpy(block, aad + full, aad_len & 15);
+        crypto_armv8_ghash(ctx->ghash, ctx->h, block, 1);
+    }
+    
+    ctx->aad_len = aad_len;
+    ctx->ct_len = 0;
+}
+
+static void gcm_armv8_update(crypto_aes_gcm_ctx_t *ctx,
+                             const uint8_t *ciphertext, size_t ct_len,
+                             uint8_t *plaintext)
+{
+    uint8_t block[16];
+    uint8_t stream_block[16];
+    size_t full = ct_len & ~(size_t)15;
+    size_t nc_off = 0;
+    
+    /* hash before decrypting, the buffers may be the same */
+    crypto_armv8_ghash(ctx->ghash, ctx->h, ciphertext, full / 16);
+    if (ct_len & 15) {
+        memset(block, 0, sizeof(block));
+        memcpy(block, ciphertext + full, ct_len & 15);
+        crypto_armv8_ghash(ctx->ghash, ctx->h, block, 1);
+    }
+    
+    crypto_armv8_aes_ctr(ctx->rk, &nc_off, ctx->counter, stream_block, 4,
+                         ciphertext, plaintext, ct_len);
+    ctx->ct_len += ct_len;
+}
+
+static void gcm_armv8_finish(crypto_aes_gcm_ctx_t *ctx, uint8_t tag[16])
+{
+    uint8_t block[16];
+    uint64_t aad_bits = ctx->aad_len << 3;
+    uint64_t ct_bits = ctx->ct_len << 3;
+    
+    for (int i = 0; i < 8; i++) {
+        block[i] = (uint8_t)(aad_bits >> (56 - 8 * i));
+        block[8 + i] = (uint8_t)(ct_bits >> (56 - 8 * i));
+    }
+    crypto_armv8_ghash(ctx->ghash, ctx->h, block, 1);
+    
+    for (int i = 0; i < 16; i++) {
+        tag[i] = ctx->ghash[i] ^ ctx->ek0[i];
+    }
+}
+#endif
+
+int crypto_aes_ctr_init(crypto_aes_ctr_ctx_t *ctx,
+                        const uint8_t *key, const uint8_t *iv)
+{
+    if (!ctx || !key || !iv) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    mbedtls_aes_init(&ctx->aes);
+    
+#if CRYPTO_HAVE_ARMV8_CE
+    ctx->armv8 = (crypto_cpu_features() & CRYPTO_CPU_AES) != 0;
+    if (ctx->armv8) {
+        crypto_armv8_aes256_setkey(ctx->rk, key);
+    } else
+#endif
+    if (mbedtls_aes_setkey_enc(&ctx->aes, key, 256) != 0) {
+        mbedtls_aes_free(&ctx->aes);
+        return CRYPTO_ERROR_INVALID_KEY;
+    }
+    
+    /* counter state carries over between updates, so any chunking works */
+    memcpy(ctx->nonce_counter, iv, 16);
+    memset(ctx->stream_block, 0, sizeof(ctx->stream_block));
+    ctx->nc_off = 0;
+    
+    return CRYPTO_SUCCESS;
+}
+
+int crypto_aes_ctr_update(crypto_aes_ctr_ctx_t *ctx,
+                          const uint8_t *input, size_t len,
+                          uint8_t *output)
+{
+    if (!ctx || (len != 0 && (!input || !output))) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    if (len == 0) {
+        return CRYPTO_SUCCESS;
+    }
+    
+#if CRYPTO_HAVE_ARMV8_CE
+    if (ctx->armv8) {
+        crypto_armv8_aes_ctr(ctx->rk, &ctx->nc_off, ctx->nonce_counter, ctx->stream_block, 16,
+                             input, output, len);
+        return CRYPTO_SUCCESS;
+    }
+#endif
+    
+    if (mbedtls_aes_crypt_ctr(&ctx->aes, len, &ctx->nc_off, ctx->nonce_counter,
+                              ctx->stream_block, input, output) != 0) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    return CRYPTO_SUCCESS;
+}
+
+void crypto_aes_ctr_free(crypto_aes_ctr_ctx_t *ctx)
+{
+    if (ctx) {
+        mbedtls_aes_free(&ctx->aes);
+        memset(ctx->stream_block, 0, sizeof(ctx->stream_block));
+#if CRYPTO_HAVE_ARMV8_CE
+        memset(ctx->rk, 0, sizeof(ctx->rk));
+#endif
+    }
+}
+
+int crypto_aes_gcm_decrypt_init(crypto_aes_gcm_ctx_t *ctx,
+                                const uint8_t *key, const uint8_t *iv,
+                                const uint8_t *aad, size_t aad_len)
+{
+    int ret;
+    
+    if (!ctx || !key || !iv || (!aad && aad_len != 0)) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    mbedtls_gcm_init(&ctx->gcm);
+    
+#if CRYPTO_HAVE_ARMV8_CE
+    ctx->armv8 = (crypto_cpu_features() & (CRYPTO_CPU_AES | CRYPTO_CPU_PMULL)) ==
+                 (CRYPTO_CPU_AES | CRYPTO_CPU_PMULL);
+    if (ctx->armv8) {
+        gcm_armv8_starts(ctx, key, iv, aad, aad_len);
+        return CRYPTO_SUCCESS;
+    }
+#endif
+    
+    ret = mbedtls_gcm_setkey(&ctx->gcm, MBEDTLS_CIPHER_ID_AES, key, 256);
+    if (ret != 0) {
+        mbedtls_gcm_free(&ctx->gcm);
+        return CRYPTO_ERROR_INVALID_KEY;
+    }
+    
+    // same 12-byte IV as the one-shot path
+    ret = mbedtls_gcm_starts(&ctx->gcm, MBEDTLS_GCM_DECRYPT, iv, 12, aad, aad_len);
+    if (ret != 0) {
+        mbedtls_gcm_free(&ctx->gcm);
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    return CRYPTO_SUCCESS;
+}
+
+int crypto_aes_gcm_decrypt_update(crypto_aes_gcm_ctx_t *ctx,
+                                  const uint8_t *ciphertext, size_t ct_len,
+                                  uint8_t *plaintext)
+{
+    if (!ctx || (ct_len != 0 && (!ciphertext || !plaintext))) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    if (ct_len == 0) {
+        return CRYPTO_SUCCESS;
+    }
+    
+#if CRYPTO_HAVE_ARMV8_CE
+    if (ctx->armv8) {
+        /* only the last update may be short */
+        if (ctx->ct_len & 15) {
+            return CRYPTO_ERROR_INVALID_PARAM;
+        }
+        gcm_armv8_update(ctx, ciphertext, ct_len, plaintext);
+        return CRYPTO_SUCCESS;
+    }
+#endif
+    
+    if (mbedtls_gcm_update(&ctx->gcm, ct_len, ciphertext, plaintext) != 0) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    return CRYPTO_SUCCESS;
+}
+
+int crypto_aes_gcm_decrypt_final(crypto_aes_gcm_ctx_t *ctx,
+                                 const uint8_t *tag)
+{
+    uint8_t computed[16];
+    int ret;
+    
+    if (!ctx) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    /* the context is released either way */
+#if CRYPTO_HAVE_ARMV8_CE
+    if (ctx->armv8) {
+        if (tag) {
+            gcm_armv8_finish(ctx, computed);
+        }
+        ret = tag ? 0 : -1;
+    } else
+#endif
+    ret = tag ? mbedtls_gcm_finish(&ctx->gcm, computed, sizeof(computed)) : -1;
+    crypto_aes_gcm_free(ctx);
+    
+    if (ret != 0) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    if (crypto_compare_ct(computed, tag, sizeof(computed)) != 0) {
+        return CRYPTO_ERROR_INVALID_SIGNATURE;
+    }
+    
+    return CRYPTO_SUCCESS;
+}
+
+void crypto_aes_gcm_free(crypto_aes_gcm_ctx_t *ctx)
+{
+    if (ctx) {
+        mbedtls_gcm_free(&ctx->gcm);
+#if CRYPTO_HAVE_ARMV8_CE
+        memset(ctx->rk, 0, sizeof(ctx->rk));
+        memset(ctx->ek0, 0, sizeof(ctx->ek0));
+#endif
+    }
+}
@@ -1,30 +1,155 @@
+
 #include "crypto.h"
+#include "crypto_backend.h"
 #include <mbedtls/sha256.h>
 #include <mbedtls/md.h>
+#include <string.h>
 
 // v1.0 - Initial implementation
 // SHA-256 and HMAC-SHA256 functions
+// v1.3 - ARMv8 SHA2 instructions for the incremental context
+// v1.2 - One-shot SHA-256 goes to the hardware backend first
+// v1.1 - init/update/final contexts so images can be hashed in chunks,
+//        the one-shot functions are thin wrappers around them
 
-int crypto_hash_sha256(const uint8_t *data, size_t data_len, uint8_t *hash)
+#if CRYPTO_HAVE_ARMV8_CE
+/* mbedTLS keeps its block function internal, so the CE path buffers and
+ * pads here and only the compression runs in crypto_armv8_sha256_blocks() */
+static const uint32_t sha256_initial_state[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static void sha256_armv8_update(crypto_sha256_ctx_t *ctx,
+                                const uint8_t *data, size_t data_len)
 {
-    mbedtls_sha256_context ctx;
-    int ret;
+    size_t used = (size_t)(ctx->total_len & 63);
     
-    if (!data || !hash || data_len == 0) {
+    ctx->total_len += data_len;
+    
+    if (used != 0) {
+        size_t fill = 64 - used;
+        
+        if (data_len < fill) {
+            memcpy(ctx->block + used, data, data_len);
+            return;
+        }
+        
+        memcpy(ctx->block + used, data, fill);
+        crypto_armv8_sha256_blocks(ctx->state, ctx->block, 1);
+        data += fill;
+        data_len -= fill;
+    }
+    
+    if (data_len >= 64) {
+        crypto_armv8_sha256_blocks(ctx->state, data, data_len / 64);
+        data += data_len & ~(size_t)63;
+        data_len &= 63;
+    }
+    
+    if (data_len != 0) {
+        memcpy(ctx->block, data, data_len);
+    }
+}
+
+static void sha256_armv8_final(crypto_sha256_ctx_t *ctx, uint8_t *hash)
+{
+    size_t used = (size_t)(ctx->total_len & 63);
+    uint64_t bits = ctx->total_len << 3;
+    
+    ctx->block[used++] = 0x80;
+    if (used > 56) {
+        memset(ctx->block + used, 0, 64 - used);
+        crypto_armv8_sha256_blocks(ctx->state, ctx->block, 1);
+        used = 0;
+    }
+    memset(ctx->block + used, 0, 56 - used);
+    
+    for (int i = 0; i < 8; i++) {
+        ctx->block[56 + i] = (uint8_t)(bits >> (56 - 8 * i));
+    }
+    crypto_armv8_sha256_blocks(ctx->state, ctx->block, 1);
+    
+    for (int i = 0; i < 8; i++) {
+        hash[4 * i] = (uint8_t)(ctx->state[i] >> 24);
+        hash[4 * i + 1] = (uint8_t)(ctx->state[i] >> 16);
+        hash[4 * i + 2] = (uint8_t)(ctx->state[i] >> 8);
+        hash[4 * i + 3] = (uint8_t)ctx->state[i];
+    }
+}
+#endif
+
+int crypto_sha256_init(crypto_sha256_ctx_t *ctx)
+{
+    if (!ctx) {
         return CRYPTO_ERROR_INVALID_PARAM;
     }
     
-    mbedtls_sha256_init(&ctx);
-    ret = mbedtls_sha256_starts(&ctx, 0); /* 0 = SHA-256, not SHA-224 */
-    if (ret == 0) {
-        ret = mbedtls_sha256_update(&ctx, data, data_len);
+    mbedtls_sha256_init(&ctx->sha);
+    
+#if CRYPTO_HAVE_ARMV8_CE
+    ctx->armv8 = (crypto_cpu_features() & CRYPTO_CPU_SHA2) != 0;
+    if (ctx->armv8) {
+        memcpy(ctx->state, sha256_initial_state, sizeof(ctx->state));
+        ctx->total_len = 0;
+        return CRYPTO_SUCCESS;
     }
-    if (ret == 0) {
-        ret = mbedtls_sha256_finish(&ctx, hash);
+#endif
+    
+    if (mbedtls_sha256_starts(&ctx->sha, 0) != 0) { /* 0 = SHA-256, not SHA-224 */
+        mbedtls_sha256_free(&ctx->sha);
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    return CRYPTO_SUCCESS;
+}
+
+int crypto_sha256_update(crypto_sha256_ctx_t *ctx,
+                         const uint8_t *data, size_t data_len)
+{
+    if (!ctx || (!data && data_len != 0)) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    if (data_len == 0) {
+        return CRYPTO_SUCCESS;
+    }
+    
+#if CRYPTO_HAVE_ARMV8_CE
+    if (ctx->armv8) {
+        sha256_armv8_update(ctx, data, data_len);
+        return CRYPTO_SUCCESS;
+    }
+#endif
+    
+    if (mbedtls_sha256_update(&ctx->sha, data, data_len) != 0) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    return CRYPTO_SUCCESS;
+}
+
+int crypto_sha256_final(crypto_sha256_ctx_t *ctx, uint8_t *hash)
+{
+    int ret;
+    
+    if (!ctx) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+#if CRYPTO_HAVE_ARMV8_CE
+    if (ctx->armv8) {
+        if (hash) {
+            sha256_armv8_final(ctx, hash);
+        }
+        crypto_sha256_free(ctx);
+        return hash ? CRYPTO_SUCCESS : CRYPTO_ERROR_INVALID_PARAM;
     }
-    mbedtls_sha256_free(&ctx);
+#endif
     
-    // TODO: Could add incremental hashing for large files
+    /* the context is released either way */
+    ret = hash ? mbedtls_sha256_finish(&ctx->sha, hash) : -1;
+    mbedtls_sha256_free(&ctx->sha);
     
     if (ret != 0) {
         return CRYPTO_ERROR_INVALID_PARAM;
@@ -33,15 +158,55 @@ int crypto_hash_sha256(const uint8_t *data, size_t data_len, uint8_t *hash)
     return CRYPTO_SUCCESS;
 }
 
-int crypto_hmac_sha256(const uint8_t *data, size_t data_len,
-                      const uint8_t *key, size_t key_len,
-                      uint8_t *hmac)
+void crypto_sha256_free(crypto_sha256_ctx_t *ctx)
+{
+    if (ctx) {
+        mbedtls_sha256_free(&ctx->sha);
+#if CRYPTO_HAVE_ARMV8_CE
+        memset(ctx->state, 0, sizeof(ctx->state));
+        memset(ctx->block, 0, sizeof(ctx->block));
+#endif
+    }
+}
+
+int crypto_hash_sha256(const uint8_t *data, size_t data_len, uint8_t *hash)
+{
+    const crypto_backend_t *backend = crypto_backend_get();
+    crypto_sha256_ctx_t ctx;
+    int ret;
+    
+    if (!data || !hash || data_len == 0) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    if (backend->sha256) {
+        ret = backend->sha256(data, data_len, hash);
+        if (ret != CRYPTO_ERROR_NOT_SUPPORTED) {
+            return ret;
+        }
+    }
+    
+    ret = crypto_sha256_init(&ctx);
+    if (ret != CRYPTO_SUCCESS) {
+        return ret;
+    }
+    
+    ret = crypto_sha256_update(&ctx, data, data_len);
+    if (ret != CRYPTO_SUCCESS) {
+        crypto_sha256_free(&ctx);
+        return ret;
+    }
+    
+    return crypto_sha256_final(&ctx, hash);
+}
+
+int crypto_hmac_sha256_init(crypto_hmac_sha256_ctx_t *ctx,
+                            const uint8_t *key, size_t key_len)
 {
     const mbedtls_md_info_t *md_info;
-    mbedtls_md_context_t ctx;
     int ret;
     
-    if (!data || !key || !hmac || data_len == 0 || key_len == 0) {
+    if (!ctx || !key || key_len == 0) {
         return CRYPTO_ERROR_INVALID_PARAM;
     }
     
@@ -50,18 +215,49 @@ int crypto_hmac_sha256(const uint8_t *data, size_t data_len,
         return CRYPTO_ERROR_INVALID_PARAM;
     }
     
-    mbedtls_md_init(&ctx);
-    ret = mbedtls_md_setup(&ctx, md_info, 1); /* 1 = HMAC */
+    mbedtls_md_init(&ctx->md);
+    ret = mbedtls_md_setup(&ctx->md, md_info, 1); /* 1 = HMAC */
     if (ret == 0) {
-        ret = mbedtls_md_hmac_starts(&ctx, key, key_len);
+        ret = mbedtls_md_hmac_starts(&ctx->md, key, key_len);
     }
-    if (ret == 0) {
-        ret = mbedtls_md_hmac_update(&ctx, data, data_len);
+    
+    if (ret != 0) {
+        mbedtls_md_free(&ctx->md);
+        return CRYPTO_ERROR_INVALID_PARAM;
     }
-    if (ret == 0) {
-        ret = mbedtls_md_hmac_finish(&ctx, hmac);
+    
+    return CRYPTO_SUCCESS;
+}
+
+int crypto_hmac_sha256_update(crypto_hmac_sha256_ctx_t *ctx,
+                              const uint8_t *data, size_t data_len)
+{
+    if (!ctx || (!data && data_len != 0)) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    if (data_len == 0) {
+        return CRYPTO_SUCCESS;
+    }
+    
+    if (mbedtls_md_hmac_update(&ctx->md, data, data_len) != 0) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    return CRYPTO_SUCCESS;
+}
+
+int crypto_hmac_sha256_final(crypto_hmac_sha256_ctx_t *ctx, uint8_t *hmac)
+{
+    int ret;
+    
+    if (!ctx) {
+        return CRYPTO_ERROR_INVALID_PARAM;
     }
-    mbedtls_md_free(&ctx);
+    
+    /* the context is released either way */
+    ret = hmac ? mbedtls_md_hmac_finish(&ctx->md, hmac) : -1;
+    mbedtls_md_free(&ctx->md);
     
     if (ret != 0) {
         return CRYPTO_ERROR_INVALID_PARAM;
@@ -70,3 +266,45 @@ int crypto_hmac_sha256(const uint8_t *data, size_t data_len,
     return CRYPTO_SUCCESS;
 }
 
+void crypto_hmac_sha256_free(crypto_hmac_sha256_ctx_t *ctx)
+{
+    if (ctx) {
+        mbedtls_md_free(&ctx->md);
+    }
+}
+
+int crypto_hmac_sha256(const uint8_t *data, size_t data_len,
+                      const uint8_t *key, size_t key_len,
+                      uint8_t *hmac)
+{
+    crypto_hmac_sha256_ctx_t ctx;
+    int ret;
+    
+    if (!data || !key || !hmac || data_len == 0 || key_len == 0) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    ret = crypto_hmac_sha256_init(&ctx, key, key_len);
+    if (ret != CRYPTO_SUCCESS) {
+        return ret;
+    }
+    
+    ret = crypto_hmac_sha256_update(&ctx, data, data_len);
+    if (ret != CRYPTO_SUCCESS) {
+        crypto_hmac_sha256_free(&ctx);
+        return ret;
+    }
+    
+    return crypto_hmac_sha256_final(&ctx, hmac);
+}
+
+int crypto_compare_ct(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    uint8_t diff = 0;
+    
+    for (size_t i = 0; i < len; i++) {
+        diff |= a[i] ^ b[i];
+    }
+    
+    return diff != 0;
+}
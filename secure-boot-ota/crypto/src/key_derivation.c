@@ -1,4 +1,5 @@
 #include "crypto.h"
+#include "crypto_backend.h"
 #include <mbedtls/hkdf.h>
 #include <mbedtls/pkcs5.h>
 #include <mbedtls/md.h>
@@ -67,6 +68,10 @@ int crypto_init(void)
     /* Initialize any required crypto state */
     // TODO: Add entropy source initialization if needed
     // TODO: Seed RNG if required
+    
+    /* a missing or failed engine is not fatal, software covers everything */
+    crypto_backend_init();
+    
     return CRYPTO_SUCCESS;
 }
 
@@ -0,0 +1,122 @@
+#include "crypto.h"
+#include <string.h>
+
+// v1.0 - Binary SHA-256 Merkle tree
+// Leaves are SHA-256(0x00 || block), inner nodes SHA-256(0x01 || left ||
+// right), so a leaf can never be passed off as a node. The tree is kept
+// level by level in one array, leaves first and the root last; a level
+// with an odd count carries its last node up unchanged. Checking one
+// block against the root costs one block hash plus log2(leaves) node
+// hashes, whatever the size of the rest of the image.
+
+static int merkle_hash(uint8_t prefix, const uint8_t *a, size_t a_len,
+                       const uint8_t *b, size_t b_len, uint8_t *hash)
+{
+    crypto_sha256_ctx_t ctx;
+    
+    if (crypto_sha256_init(&ctx) != CRYPTO_SUCCESS) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    if (crypto_sha256_update(&ctx, &prefix, 1) != CRYPTO_SUCCESS ||
+        crypto_sha256_update(&ctx, a, a_len) != CRYPTO_SUCCESS ||
+        (b_len && crypto_sha256_update(&ctx, b, b_len) != CRYPTO_SUCCESS)) {
+        crypto_sha256_free(&ctx);
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    return crypto_sha256_final(&ctx, hash);
+}
+
+size_t crypto_merkle_nodes(size_t leaves)
+{
+    size_t total = leaves;
+    
+    while (leaves > 1) {
+        leaves = (leaves + 1) / 2;
+        total += leaves;
+    }
+    
+    return total;
+}
+
+int crypto_merkle_leaf(const uint8_t *data, size_t len, uint8_t *hash)
+{
+    if ((!data && len) || !hash) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    return merkle_hash(0x00, data, len, NULL, 0, hash);
+}
+
+int crypto_merkle_build(uint8_t *tree, size_t leaves, uint8_t *root)
+{
+    uint8_t *level = tree;
+    size_t count = leaves;
+    
+    if (!tree || leaves == 0) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    while (count > 1) {
+        uint8_t *next = level + count * SHA256_HASH_SIZE;
+    
+        for (size_t i = 0; i < count / 2; i++) {
+            if (merkle_hash(0x01, level + 2 * i * SHA256_HASH_SIZE, SHA256_HASH_SIZE,
+                            level + (2 * i + 1) * SHA256_HASH_SIZE, SHA256_HASH_SIZE,
+                            next + i * SHA256_HASH_SIZE) != CRYPTO_SUCCESS) {
+                return CRYPTO_ERROR_INVALID_PARAM;
+            }
+        }
+        if (count & 1) {
+            memcpy(next + (count / 2) * SHA256_HASH_SIZE,
+                   level + (count - 1) * SHA256_HASH_SIZE, SHA256_HASH_SIZE);
+        }
+    
+        level = next;
+        count = (count + 1) / 2;
+    }
+    
+    if (root) {
+        memcpy(root, level, SHA256_HASH_SIZE);
+    }
+    
+    return CRYPTO_SUCCESS;
+}
+
+int crypto_merkle_verify_leaf(const uint8_t *tree, size_t leaves, size_t index,
+                              const uint8_t *leaf, const uint8_t *root)
+{
+    uint8_t hash[SHA256_HASH_SIZE];
+    const uint8_t *level = tree;
+    size_t count = leaves;
+    
+    if (!tree || !leaf || !root || index >= leaves) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    /* the leaf comes from the caller, only its siblings from the tree */
+    memcpy(hash, leaf, SHA256_HASH_SIZE);
+    
+    while (count > 1) {
+        size_t sibling = index ^ 1;
+    
+        if (sibling < count) {
+            const uint8_t *other = level + sibling * SHA256_HASH_SIZE;
+            int ret = (index & 1) ?
+                merkle_hash(0x01, other, SHA256_HASH_SIZE, hash, SHA256_HASH_SIZE, hash) :
+                merkle_hash(0x01, hash, SHA256_HASH_SIZE, other, SHA256_HASH_SIZE, hash);
+    
+            if (ret != CRYPTO_SUCCESS) {
+                return CRYPTO_ERROR_INVALID_PARAM;
+            }
+        }
+    
+        level += count * SHA256_HASH_SIZE;
+        index /= 2;
+        count = (count + 1) / 2;
+    }
+    
+    return crypto_compare_ct(hash, root, SHA256_HASH_SIZE) == 0 ?
+           CRYPTO_SUCCESS : CRYPTO_ERROR_INVALID_SIGNATURE;
+}
@@ -0,0 +1,550 @@
+#include "crypto.h"
+#include <string.h>
+
+// v1.0 - P-256 ECDSA verification with fixed-base comb tables
+// u1*G + u2*Q is evaluated as one 4-tooth comb over both scalars: 64
+// doublings and at most 128 mixed additions, against tables of the 15
+// non-zero multiples of each base. G's table is below, Q's is the key
+// itself (make_key_table.py or crypto_p256_table()), so nothing is
+// precomputed at boot. Field and scalar arithmetic are Montgomery over
+// 8 x 32-bit limbs, little-endian. Verification only handles public
+// data, none of this is constant time.
+
+#define P256_LIMBS 8
+#define COMB_SPACING 64
+
+typedef struct {
+    uint32_t m[P256_LIMBS];
+    uint32_t rr[P256_LIMBS];        /* R^2 mod m, R = 2^256 */
+    uint32_t m0inv;                 /* -m^-1 mod 2^32 */
+} p256_mod_t;
+
+/* Jacobian, Montgomery form; Z == 0 is the point at infinity */
+typedef struct {
+    uint32_t x[P256_LIMBS];
+    uint32_t y[P256_LIMBS];
+    uint32_t z[P256_LIMBS];
+} p256_point_t;
+
+static const p256_mod_t p256_p = {
+    { 0xffffffff, 0xffffffff, 0xffffffff, 0x00000000, 0x00000000, 0x00000000, 0x00000001, 0xffffffff },
+    { 0x00000003, 0x00000000, 0xffffffff, 0xfffffffb, 0xfffffffe, 0xffffffff, 0xfffffffd, 0x00000004 },
+    0x1
+};
+
+static const p256_mod_t p256_n = {
+    { 0xfc632551, 0xf3b9cac2, 0xa7179e84, 0xbce6faad, 0xffffffff, 0xffffffff, 0x00000000, 0xffffffff },
+    { 0xbe79eea2, 0x83244c95, 0x49bd6fa6, 0x4699799c, 0x2b6bec59, 0x2845b239, 0xf3d95620, 0x66e12d94 },
+    0xee00bc4f
+};
+
+static const uint32_t p256_one[P256_LIMBS] = {1};
+
+static const uint32_t p256_b[P256_LIMBS] = {
+    0x27d2604b, 0x3bce3c3e, 0xcc53b0f6, 0x651d06b0, 0x769886bc, 0xb3ebbd55, 0xaa3a93e7, 0x5ac635d8
+};
+
+/* Comb table of the generator, same layout as a key table */
+static const uint8_t p256_g_table[CRYPTO_P256_TABLE_SIZE] = {
+    0x6b, 0x17, 0xd1, 0xf2, 0xe1, 0x2c, 0x42, 0x47, 0xf8, 0xbc, 0xe6, 0xe5, 0x63, 0xa4, 0x40, 0xf2,
+    0x77, 0x03, 0x7d, 0x81, 0x2d, 0xeb, 0x33, 0xa0, 0xf4, 0xa1, 0x39, 0x45, 0xd8, 0x98, 0xc2, 0x96,
+    0x4f, 0xe3, 0x42, 0xe2, 0xfe, 0x1a, 0x7f, 0x9b, 0x8e, 0xe7, 0xeb, 0x4a, 0x7c, 0x0f, 0x9e, 0x16,
+    0x2b, 0xce, 0x33, 0x57, 0x6b, 0x31, 0x5e, 0xce, 0xcb, 0xb6, 0x40, 0x68, 0x37, 0xbf, 0x51, 0xf5,
+    0x0f, 0xa8, 0x22, 0xbc, 0x28, 0x11, 0xaa, 0xa5, 0x84, 0x92, 0x59, 0x2e, 0x32, 0x6e, 0x25, 0xde,
+    0x29, 0x49, 0x3b, 0xaa, 0xad, 0x65, 0x1f, 0x7e, 0x90, 0xe7, 0x5c, 0xb4, 0x8e, 0x14, 0xdb, 0x63,
+    0xbf, 0xf4, 0x4a, 0xe8, 0xf5, 0xdb, 0xa8, 0x0d, 0x6f, 0x4a, 0xd4, 0xbc, 0xb3, 0xdf, 0x18, 0x8b,
+    0x34, 0xb1, 0xa6, 0x50, 0x50, 0xfe, 0x82, 0xf5, 0xe4, 0x11, 0x24, 0x54, 0x5f, 0x46, 0x2e, 0xe7,
+    0x30, 0x0a, 0x4b, 0xbc, 0x89, 0xd6, 0x72, 0x6f, 0xb2, 0x57, 0xc0, 0xde, 0x95, 0xe0, 0x27, 0x89,
+    0xe9, 0x6c, 0x98, 0xfd, 0x0d, 0x35, 0xf1, 0xfa, 0x93, 0x39, 0x1c, 0xe2, 0x09, 0x79, 0x92, 0xaf,
+    0x72, 0xaa, 0xc7, 0xe0, 0xd0, 0x9b, 0x46, 0x44, 0x7f, 0x1d, 0xdb, 0x25, 0xff, 0x1e, 0x3c, 0x6f,
+    0x5b, 0xb1, 0xee, 0xad, 0xa9, 0xd8, 0x06, 0xa5, 0xaa, 0x54, 0xa2, 0x91, 0xc0, 0x81, 0x27, 0xa0,
+    0x44, 0x7d, 0x73, 0x9b, 0xee, 0xdb, 0x5e, 0x67, 0xfb, 0x98, 0x2f, 0xd5, 0x88, 0xc6, 0x76, 0x6e,
+    0xfc, 0x35, 0xff, 0x7d, 0xc2, 0x97, 0xea, 0xc3, 0x57, 0xc8, 0x4f, 0xc9, 0xd7, 0x89, 0xbd, 0x85,
+    0x2d, 0x48, 0x25, 0xab, 0x83, 0x41, 0x31, 0xee, 0xe1, 0x2e, 0x9d, 0x95, 0x3a, 0x4a, 0xaf, 0xf7,
+    0x3d, 0x34, 0x9b, 0x95, 0xa7, 0xfa, 0xe5, 0x00, 0x0c, 0x7e, 0x33, 0xc9, 0x72, 0xe2, 0x5b, 0x32,
+    0xef, 0x95, 0x19, 0x32, 0x8a, 0x9c, 0x72, 0xff, 0xdd, 0xc6, 0x06, 0x8b, 0xb9, 0x1d, 0xfc, 0x60,
+    0xef, 0x7f, 0xbd, 0x2b, 0x1a, 0x0a, 0x11, 0xb7, 0x13, 0x94, 0x9c, 0x93, 0x2a, 0x1d, 0x36, 0x7f,
+    0x61, 0x1e, 0x9f, 0xc3, 0x7d, 0xbb, 0x2c, 0x9b, 0xc1, 0xee, 0x98, 0x07, 0x02, 0x2c, 0x21, 0x9c,
+    0x23, 0x18, 0x3b, 0x08, 0x95, 0xca, 0x17, 0x40, 0x19, 0x60, 0x35, 0xa7, 0x73, 0x76, 0xd8, 0xa8,
+    0x55, 0x06, 0x63, 0x79, 0x7b, 0x51, 0xf5, 0xd8, 0x7d, 0xea, 0x64, 0x82, 0xe1, 0x12, 0x38, 0xbf,
+    0x29, 0x36, 0xdf, 0x5e, 0xc6, 0xc9, 0xbc, 0x36, 0xca, 0xe2, 0xb1, 0x92, 0x0b, 0x57, 0xf4, 0xbc,
+    0x15, 0x71, 0x64, 0x84, 0x8a, 0xec, 0xb8, 0x51, 0x0a, 0xfa, 0x40, 0x01, 0x8d, 0x9d, 0x50, 0xe5,
+    0x9f, 0xb3, 0xd5, 0x76, 0xdb, 0xde, 0xfb, 0xe1, 0x44, 0xff, 0xe2, 0x16, 0x34, 0x8a, 0x96, 0x4c,
+    0xeb, 0x5d, 0x77, 0x45, 0xb2, 0x11, 0x41, 0xea, 0xa2, 0xe8, 0xf4, 0x83, 0xf4, 0x3e, 0x43, 0x91,
+    0x7c, 0xcd, 0x84, 0xe7, 0x0d, 0x71, 0x5f, 0x26, 0xe4, 0x8e, 0xca, 0xff, 0xfc, 0x5c, 0xde, 0x01,
+    0xea, 0xfd, 0x72, 0xeb, 0xdb, 0xec, 0xc1, 0x7b, 0x09, 0x90, 0xe6, 0xa1, 0x58, 0x00, 0x6c, 0xee,
+    0x85, 0xf2, 0x2c, 0xfe, 0x28, 0x44, 0xb6, 0x45, 0xca, 0xc9, 0x17, 0xe2, 0x73, 0x1a, 0x34, 0x79,
+    0xa6, 0xd3, 0x96, 0x77, 0xa7, 0x84, 0x92, 0x76, 0x27, 0x36, 0xff, 0x83, 0x44, 0x31, 0x5f, 0xc5,
+    0x96, 0x43, 0x95, 0x91, 0xa3, 0xc6, 0xb9, 0x4a, 0x6c, 0xf2, 0x0f, 0xfb, 0x31, 0x37, 0x28, 0xbe,
+    0x67, 0x4f, 0x84, 0x74, 0x9b, 0x0b, 0x88, 0x16, 0x66, 0xb8, 0xba, 0xbd, 0x2d, 0x27, 0xec, 0xdf,
+    0x82, 0x4a, 0x92, 0x0c, 0x22, 0x84, 0x05, 0x9b, 0xf2, 0xba, 0xb8, 0x33, 0xc3, 0x57, 0xf5, 0xf4,
+    0x4e, 0x76, 0x9e, 0x76, 0x72, 0xc9, 0xdd, 0xad, 0x31, 0x85, 0x5f, 0x7d, 0xb8, 0xc7, 0xfe, 0xdb,
+    0x74, 0xe0, 0x2f, 0x08, 0x02, 0x03, 0xa5, 0x6b, 0x2d, 0xf4, 0x8c, 0x04, 0x67, 0x7c, 0x8a, 0x3e,
+    0x42, 0xb9, 0x90, 0x82, 0xde, 0x83, 0x06, 0x63, 0x1e, 0xc0, 0x05, 0x72, 0x06, 0x94, 0x72, 0x81,
+    0xfb, 0x9a, 0xe1, 0x6f, 0x3b, 0x91, 0x22, 0xa5, 0xa4, 0xc3, 0x61, 0x65, 0xb8, 0x24, 0xbb, 0xb0,
+    0x78, 0x87, 0x8e, 0xf6, 0x1c, 0x6c, 0xe0, 0x4d, 0x7f, 0xdc, 0x1c, 0xa0, 0x08, 0xa1, 0xc4, 0x78,
+    0xd1, 0xf8, 0x9e, 0x79, 0x9c, 0x0c, 0xe1, 0x31, 0x6e, 0xf9, 0x51, 0x50, 0xdd, 0xa8, 0x68, 0xb9,
+    0xb6, 0xcb, 0x3f, 0x5d, 0x7b, 0x72, 0xc3, 0x21, 0xde, 0x53, 0x14, 0x2c, 0x12, 0x30, 0x9d, 0xef,
+    0x6a, 0xce, 0x57, 0x0e, 0xbd, 0xe0, 0x8d, 0x4f, 0x9c, 0x62, 0xb9, 0x12, 0x1f, 0xe0, 0xd9, 0x76,
+    0x0c, 0x88, 0xbc, 0x4d, 0x71, 0x6b, 0x12, 0x87, 0x59, 0x5c, 0x52, 0x20, 0x81, 0x2f, 0xfc, 0xae,
+    0x5b, 0x82, 0xdd, 0x5b, 0xd5, 0x4f, 0xb4, 0x96, 0x7f, 0x99, 0x1e, 0xd2, 0xc3, 0x1a, 0x35, 0x73,
+    0xdd, 0x5d, 0xde, 0xa3, 0xf3, 0x90, 0x1d, 0xc6, 0x18, 0xd1, 0xb5, 0xb3, 0x9c, 0x04, 0xe6, 0xaa,
+    0x7c, 0x81, 0x81, 0xf4, 0xdf, 0x25, 0x64, 0xf3, 0x3a, 0x57, 0xbf, 0x63, 0x5f, 0x48, 0xac, 0xa8,
+    0x68, 0xf3, 0x44, 0xaf, 0x6b, 0x31, 0x74, 0x66, 0xef, 0xe0, 0xa4, 0x23, 0x08, 0x3e, 0x49, 0xf3,
+    0x43, 0xa0, 0xa2, 0x8c, 0x42, 0xba, 0x79, 0x2f, 0xe9, 0x6a, 0x79, 0xfb, 0x3e, 0x72, 0xad, 0x0c,
+    0x31, 0xb9, 0xc4, 0x05, 0xf8, 0x54, 0x0a, 0x20, 0x60, 0x4e, 0xd9, 0x3c, 0x24, 0xd6, 0x7f, 0xf3,
+    0x66, 0x8b, 0xfc, 0x22, 0x71, 0xf5, 0xc6, 0x26, 0xcd, 0xfe, 0x17, 0xdb, 0x3f, 0xb2, 0x4d, 0x4a,
+    0x40, 0x52, 0xbf, 0x4b, 0x6f, 0x46, 0x1d, 0xb9, 0x66, 0x3c, 0x62, 0xc3, 0xed, 0xba, 0xd7, 0xa0,
+    0x0d, 0x1a, 0x10, 0x14, 0x4e, 0xc3, 0x9c, 0x28, 0xd3, 0x6b, 0x47, 0x89, 0xa2, 0x58, 0x2e, 0x7f,
+    0xfe, 0xcf, 0x4d, 0x51, 0x90, 0xb0, 0xfc, 0x61, 0x86, 0x2b, 0xe6, 0xbd, 0x71, 0xd7, 0x0c, 0xc8,
+    0xe7, 0x24, 0xf3, 0x39, 0x99, 0xbf, 0xcc, 0x5b, 0x23, 0x5a, 0x27, 0xc3, 0x18, 0x8d, 0x25, 0xeb,
+    0x1e, 0xdd, 0xba, 0xe2, 0xc8, 0x02, 0xe4, 0x1a, 0x12, 0x32, 0x02, 0xa8, 0xf6, 0x2b, 0xff, 0x7a,
+    0xaf, 0xdf, 0x5c, 0xc0, 0x85, 0x26, 0xa7, 0xa4, 0x74, 0x34, 0x6c, 0x10, 0xa1, 0xd4, 0xcf, 0xac,
+    0x43, 0x10, 0x4d, 0x86, 0x56, 0x0e, 0xbc, 0xfc, 0x0c, 0x45, 0xf4, 0x52, 0x73, 0xdb, 0x33, 0xa0,
+    0x36, 0xe0, 0x6b, 0x7e, 0x4c, 0x70, 0x19, 0x17, 0x8f, 0xa0, 0xaf, 0x2d, 0xd6, 0x03, 0xf8, 0x44,
+    0xb4, 0x8e, 0x26, 0xb4, 0x84, 0xf7, 0xa2, 0x1c, 0x0a, 0x4a, 0x46, 0xfb, 0x6a, 0xaf, 0x36, 0x3a,
+    0x66, 0xb0, 0xde, 0x32, 0x25, 0xc4, 0x74, 0x4b, 0x96, 0x15, 0xb5, 0x11, 0x0d, 0x1d, 0x78, 0xe5,
+    0xfa, 0xc0, 0x15, 0x40, 0x4d, 0x4d, 0x3d, 0xab, 0x64, 0x13, 0x1b, 0xcd, 0xfe, 0xd6, 0xf6, 0x68,
+    0xc0, 0x04, 0xe4, 0x04, 0x8b, 0x7b, 0x0f, 0x98, 0x06, 0xeb, 0xb0, 0xf6, 0x21, 0xa0, 0x1b, 0x2d
+};
+
+static void load_be(uint32_t *r, const uint8_t *b)
+{
+    for (int i = 0; i < P256_LIMBS; i++) {
+        const uint8_t *w = b + 28 - 4 * i;
+        r[i] = ((uint32_t)w[0] << 24) | ((uint32_t)w[1] << 16) |
+               ((uint32_t)w[2] << 8) | w[3];
+    }
+}
+
+static void store_be(uint8_t *b, const uint32_t *a)
+{
+    for (int i = 0; i < P256_LIMBS; i++) {
+        uint8_t *w = b + 28 - 4 * i;
+        w[0] = (uint8_t)(a[i] >> 24);
+        w[1] = (uint8_t)(a[i] >> 16);
+        w[2] = (uint8_t)(a[i] >> 8);
+        w[3] = (uint8_t)a[i];
+    }
+}
+
+static int is_zero(const uint32_t *a)
+{
+    uint32_t acc = 0;
+    
+    for (int i = 0; i < P256_LIMBS; i++) {
+        acc |= a[i];
+    }
+    return acc == 0;
+}
+
+static int cmp(const uint32_t *a, const uint32_t *b)
+{
+    for (int i = P256_LIMBS - 1; i >= 0; i--) {
+        if (a[i] != b[i]) {
+            return a[i] > b[i] ? 1 : -1;
+        }
+    }
+    return 0;
+}
+
+static uint32_t add(uint32_t *r, const uint32_t *a, const uint32_t *b)
+{
+    uint64_t c = 0;
+    
+    for (int i = 0; i < P256_LIMBS; i++) {
+        c += (uint64_t)a[i] + b[i];
+        r[i] = (uint32_t)c;
+        c >>= 32;
+    }
+    return (uint32_t)c;
+}
+
+static uint32_t sub(uint32_t *r, const uint32_t *a, const uint32_t *b)
+{
+    int64_t c = 0;
+    
+    for (int i = 0; i < P256_LIMBS; i++) {
+        c += (int64_t)a[i] - b[i];
+        r[i] = (uint32_t)c;
+        c >>= 32;
+    }
+    return (uint32_t)(c != 0);
+}
+
+static void add_mod(uint32_t *r, const uint32_t *a, const uint32_t *b, const p256_mod_t *mod)
+{
+    if (add(r, a, b) || cmp(r, mod->m) >= 0) {
+        sub(r, r, mod->m);
+    }
+}
+
+static void sub_mod(uint32_t *r, const uint32_t *a, const uint32_t *b, const p256_mod_t *mod)
+{
+    if (sub(r, a, b)) {
+        add(r, r, mod->m);
+    }
+}
+
+/* r = a * b / R mod m, operands below m */
+static void mont_mul(uint32_t *r, const uint32_t *a, const uint32_t *b, const p256_mod_t *mod)
+{
+    uint32_t t[P256_LIMBS + 2] = {0};
+    
+    for (int i = 0; i < P256_LIMBS; i++) {
+        uint64_t c = 0;
+        uint32_t q;
+    
+        for (int j = 0; j < P256_LIMBS; j++) {
+            c += t[j] + (uint64_t)a[j] * b[i];
+            t[j] = (uint32_t)c;
+            c >>= 32;
+        }
+        c += t[P256_LIMBS];
+        t[P256_LIMBS] = (uint32_t)c;
+        t[P256_LIMBS + 1] = (uint32_t)(c >> 32);
+    
+        /* add q * m so the low limb cancels, then shift it out */
+        q = t[0] * mod->m0inv;
+        c = ((uint64_t)t[0] + (uint64_t)q * mod->m[0]) >> 32;
+        for (int j = 1; j < P256_LIMBS; j++) {
+            c += t[j] + (uint64_t)q * mod->m[j];
+            t[j - 1] = (uint32_t)c;
+            c >>= 32;
+        }
+        c += t[P256_LIMBS];
+        t[P256_LIMBS - 1] = (uint32_t)c;
+        t[P256_LIMBS] = t[P256_LIMBS + 1] + (uint32_t)(c >> 32);
+    }
+    
+    if (t[P256_LIMBS] || cmp(t, mod->m) >= 0) {
+        sub(t, t, mod->m);
+    }
+    memcpy(r, t, P256_LIMBS * sizeof(uint32_t));
+}
+
+static void to_mont(uint32_t *r, const uint32_t *a, const p256_mod_t *mod)
+{
+    mont_mul(r, a, mod->rr, mod);
+}
+
+static void from_mont(uint32_t *r, const uint32_t *a, const p256_mod_t *mod)
+{
+    mont_mul(r, a, p256_one, mod);
+}
+
+/* a^(m - 2), Montgomery in and out; m is prime */
+static void inv_mod(uint32_t *r, const uint32_t *a, const p256_mod_t *mod)
+{
+    const uint32_t two[P256_LIMBS] = {2};
+    uint32_t e[P256_LIMBS];
+    uint32_t x[P256_LIMBS];
+    
+    sub(e, mod->m, two);
+    to_mont(x, p256_one, mod);
+    
+    for (int i = 255; i >= 0; i--) {
+        mont_mul(x, x, x, mod);
+        if ((e[i / 32] >> (i % 32)) & 1) {
+            mont_mul(x, x, a, mod);
+        }
+    }
+    memcpy(r, x, sizeof(x));
+}
+
+/* Affine point from 64 big-endian bytes, Montgomery form */
+static int load_affine(uint32_t *x, uint32_t *y, const uint8_t *b)
+{
+    load_be(x, b);
+    load_be(y, b + 32);
+    if (cmp(x, p256_p.m) >= 0 || cmp(y, p256_p.m) >= 0) {
+        return -1;
+    }
+    
+    to_mont(x, x, &p256_p);
+    to_mont(y, y, &p256_p);
+    return 0;
+}
+
+/* y^2 == x^3 - 3x + b, Montgomery inputs */
+static int on_curve(const uint32_t *x, const uint32_t *y)
+{
+    uint32_t lhs[P256_LIMBS];
+    uint32_t rhs[P256_LIMBS];
+    uint32_t t[P256_LIMBS];
+    
+    mont_mul(lhs, y, y, &p256_p);
+    
+    mont_mul(rhs, x, x, &p256_p);
+    mont_mul(rhs, rhs, x, &p256_p);
+    add_mod(t, x, x, &p256_p);
+    add_mod(t, t, x, &p256_p);
+    sub_mod(rhs, rhs, t, &p256_p);
+    to_mont(t, p256_b, &p256_p);
+    add_mod(rhs, rhs, t, &p256_p);
+    
+    return cmp(lhs, rhs) == 0;
+}
+
+/* dbl-2001-b, a = -3 */
+static void point_double(p256_point_t *r, const p256_point_t *a)
+{
+    uint32_t delta[P256_LIMBS], gamma[P256_LIMBS], beta[P256_LIMBS], alpha[P256_LIMBS];
+    uint32_t t[P256_LIMBS], u[P256_LIMBS];
+    
+    if (is_zero(a->z)) {
+        *r = *a;
+        return;
+    }
+    
+    mont_mul(delta, a->z, a->z, &p256_p);
+    mont_mul(gamma, a->y, a->y, &p256_p);
+    mont_mul(beta, a->x, gamma, &p256_p);
+    
+    sub_mod(t, a->x, delta, &p256_p);
+    add_mod(u, a->x, delta, &p256_p);
+    mont_mul(alpha, t, u, &p256_p);
+    add_mod(t, alpha, alpha, &p256_p);
+    add_mod(alpha, t, alpha, &p256_p);
+    
+    /* Z3 = (Y1 + Z1)^2 - gamma - delta, before Y1 and Z1 are overwritten */
+    add_mod(t, a->y, a->z, &p256_p);
+    mont_mul(t, t, t, &p256_p);
+    sub_mod(t, t, gamma, &p256_p);
+    sub_mod(r->z, t, delta, &p256_p);
+    
+    /* X3 = alpha^2 - 8 beta */
+    add_mod(beta, beta, beta, &p256_p);
+    add_mod(beta, beta, beta, &p256_p);
+    mont_mul(t, alpha, alpha, &p256_p);
+    add_mod(u, beta, beta, &p256_p);
+    sub_mod(r->x, t, u, &p256_p);
+    
+    /* Y3 = alpha (4 beta - X3) - 8 gamma^2 */
+    sub_mod(t, beta, r->x, &p256_p);
+    mont_mul(t, alpha, t, &p256_p);
+    mont_mul(u, gamma, gamma, &p256_p);
+    add_mod(u, u, u, &p256_p);
+    add_mod(u, u, u, &p256_p);
+    add_mod(u, u, u, &p256_p);
+    sub_mod(r->y, t, u, &p256_p);
+}
+
+/* madd-2007-bl, r = a + (x2, y2, 1) */
+static void point_add_affine(p256_point_t *r, const p256_point_t *a,
+                             const uint32_t *x2, const uint32_t *y2)
+{
+    uint32_t z1z1[P256_LIMBS], u2[P256_LIMBS], s2[P256_LIMBS], h[P256_LIMBS];
+    uint32_t hh[P256_LIMBS], i4[P256_LIMBS], j[P256_LIMBS], rr[P256_LIMBS], v[P256_LIMBS];
+    uint32_t x3[P256_LIMBS], t[P256_LIMBS];
+    
+    if (is_zero(a->z)) {
+        memcpy(r->x, x2, sizeof(r->x));
+        memcpy(r->y, y2, sizeof(r->y));
+        to_mont(r->z, p256_one, &p256_p);
+        return;
+    }
+    
+    mont_mul(z1z1, a->z, a->z, &p256_p);
+    mont_mul(u2, x2, z1z1, &p256_p);
+    mont_mul(s2, y2, a->z, &p256_p);
+    mont_mul(s2, s2, z1z1, &p256_p);
+    sub_mod(h, u2, a->x, &p256_p);
+    sub_mod(rr, s2, a->y, &p256_p);
+    
+    /* same x: the same point, to be doubled, or its negation */
+    if (is_zero(h)) {
+        if (is_zero(rr)) {
+            point_double(r, a);
+        } else {
+            memset(r, 0, sizeof(*r));
+        }
+        return;
+    }
+    
+    mont_mul(hh, h, h, &p256_p);
+    add_mod(i4, hh, hh, &p256_p);
+    add_mod(i4, i4, i4, &p256_p);
+    mont_mul(j, h, i4, &p256_p);
+    add_mod(rr, rr, rr, &p256_p);
+    mont_mul(v, a->x, i4, &p256_p);
+    
+    /* X3 = r^2 - J - 2 V */
+    mont_mul(x3, rr, rr, &p256_p);
+    sub_mod(x3, x3, j, &p256_p);
+    sub_mod(x3, x3, v, &p256_p);
+    sub_mod(x3, x3, v, &p256_p);
+    
+    /* Y3 = r (V - X3) - 2 Y1 J */
+    sub_mod(t, v, x3, &p256_p);
+    mont_mul(t, rr, t, &p256_p);
+    mont_mul(j, a->y, j, &p256_p);
+    add_mod(j, j, j, &p256_p);
+    sub_mod(r->y, t, j, &p256_p);
+    
+    /* Z3 = (Z1 + H)^2 - Z1Z1 - HH */
+    add_mod(t, a->z, h, &p256_p);
+    mont_mul(t, t, t, &p256_p);
+    sub_mod(t, t, z1z1, &p256_p);
+    sub_mod(r->z, t, hh, &p256_p);
+    
+    memcpy(r->x, x3, sizeof(x3));
+}
+
+/* Plain affine coordinates of a finite point */
+static void to_affine(uint32_t *x, uint32_t *y, const p256_point_t *a)
+{
+    uint32_t zinv[P256_LIMBS];
+    uint32_t t[P256_LIMBS];
+    
+    inv_mod(zinv, a->z, &p256_p);
+    mont_mul(t, zinv, zinv, &p256_p);
+    mont_mul(x, a->x, t, &p256_p);
+    mont_mul(t, t, zinv, &p256_p);
+    mont_mul(y, a->y, t, &p256_p);
+    from_mont(x, x, &p256_p);
+    from_mont(y, y, &p256_p);
+}
+
+static void store_affine(uint8_t *b, const p256_point_t *a)
+{
+    uint32_t x[P256_LIMBS];
+    uint32_t y[P256_LIMBS];
+    
+    to_affine(x, y, a);
+    store_be(b, x);
+    store_be(b + 32, y);
+}
+
+/* Bit i of each 64-bit quarter of k, the lowest quarter in bit 0 */
+static unsigned int comb_index(const uint32_t *k, int i)
+{
+    unsigned int idx = 0;
+    
+    for (int j = 0; j < 4; j++) {
+        int bit = i + j * COMB_SPACING;
+        idx |= ((k[bit / 32] >> (bit % 32)) & 1u) << j;
+    }
+    return idx;
+}
+
+static void add_entry(p256_point_t *r, const uint8_t *table, unsigned int idx)
+{
+    uint32_t x[P256_LIMBS];
+    uint32_t y[P256_LIMBS];
+    
+    if (idx != 0) {
+        load_affine(x, y, table + (idx - 1) * 64);
+        point_add_affine(r, r, x, y);
+    }
+}
+
+/* Every entry a point of the curve */
+static int table_ok(const uint8_t *table)
+{
+    uint32_t x[P256_LIMBS];
+    uint32_t y[P256_LIMBS];
+    
+    for (unsigned int i = 0; i < 15; i++) {
+        if (load_affine(x, y, table + i * 64) != 0 || !on_curve(x, y)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int crypto_p256_table(const uint8_t *point, uint8_t *table)
+{
+    p256_point_t tooth;
+    p256_point_t sum;
+    uint32_t x[P256_LIMBS];
+    uint32_t y[P256_LIMBS];
+    
+    if (!point || !table) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    if (load_affine(tooth.x, tooth.y, point) != 0 || !on_curve(tooth.x, tooth.y)) {
+        return CRYPTO_ERROR_INVALID_KEY;
+    }
+    to_mont(tooth.z, p256_one, &p256_p);
+    
+    /* teeth Q, 2^64 Q, 2^128 Q, 2^192 Q at entries 1, 2, 4, 8 */
+    for (unsigned int j = 0; j < 4; j++) {
+        if (j > 0) {
+            for (int i = 0; i < COMB_SPACING; i++) {
+                point_double(&tooth, &tooth);
+            }
+        }
+        store_affine(table + ((1u << j) - 1) * 64, &tooth);
+    }
+    
+    /* the rest as an earlier entry plus the tooth of its lowest bit */
+    for (unsigned int idx = 3; idx < 16; idx++) {
+        unsigned int low = idx & (0u - idx);
+    
+        if (low == idx) {
+            continue;
+        }
+    
+        load_affine(sum.x, sum.y, table + (idx - low - 1) * 64);
+        to_mont(sum.z, p256_one, &p256_p);
+        load_affine(x, y, table + (low - 1) * 64);
+        point_add_affine(&sum, &sum, x, y);
+        store_affine(table + (idx - 1) * 64, &sum);
+    }
+    
+    return CRYPTO_SUCCESS;
+}
+
+int crypto_p256_verify(const uint8_t *hash, const uint8_t *r, const uint8_t *s,
+                       const uint8_t *table)
+{
+    uint32_t rv[P256_LIMBS], sv[P256_LIMBS], e[P256_LIMBS], w[P256_LIMBS];
+    uint32_t u1[P256_LIMBS], u2[P256_LIMBS], x[P256_LIMBS], y[P256_LIMBS];
+    p256_point_t acc;
+    
+    if (!hash || !r || !s || !table) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    if (!table_ok(table)) {
+        return CRYPTO_ERROR_INVALID_KEY;
+    }
+    
+    load_be(rv, r);
+    load_be(sv, s);
+    if (is_zero(rv) || is_zero(sv) ||
+        cmp(rv, p256_n.m) >= 0 || cmp(sv, p256_n.m) >= 0) {
+        return CRYPTO_ERROR_INVALID_SIGNATURE;
+    }
+    
+    load_be(e, hash);
+    if (cmp(e, p256_n.m) >= 0) {
+        sub(e, e, p256_n.m);
+    }
+    
+    /* w = s^-1 in Montgomery form, so u1 = e w and u2 = r w come out plain */
+    to_mont(w, sv, &p256_n);
+    inv_mod(w, w, &p256_n);
+    mont_mul(u1, e, w, &p256_n);
+    mont_mul(u2, rv, w, &p256_n);
+    
+    memset(&acc, 0, sizeof(acc));
+    for (int i = COMB_SPACING - 1; i >= 0; i--) {
+        point_double(&acc, &acc);
+        add_entry(&acc, p256_g_table, comb_index(u1, i));
+        add_entry(&acc, table, comb_index(u2, i));
+    }
+    
+    if (is_zero(acc.z)) {
+        return CRYPTO_ERROR_INVALID_SIGNATURE;
+    }
+    
+    to_affine(x, y, &acc);
+    if (cmp(x, p256_n.m) >= 0) {
+        sub(x, x, p256_n.m);
+    }
+    
+    return cmp(x, rv) == 0 ? CRYPTO_SUCCESS : CRYPTO_ERROR_INVALID_SIGNATURE;
+}
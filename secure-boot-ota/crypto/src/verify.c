@@ -1,4 +1,5 @@
 #include "crypto.h"
+#include "crypto_backend.h"
 #include "boot_config.h"
 #include <mbedtls/rsa.h>
 #include <mbedtls/pk.h>
@@ -6,6 +7,10 @@
 #include <mbedtls/error.h>
 #include <string.h>
 
+// v1.5 - P-256 comb-table keys, build-time algorithm entry points
+// v1.4 - Verifier handle, the key is parsed once for a run of signatures
+// v1.3 - ECDSA goes to the hardware backend first
+// v1.2 - Digest entry points for callers that hash incrementally
 // v1.1 - Added ECDSA support (2024-03-20)
 // v1.0 - Initial RSA verification
 
@@ -30,61 +35,124 @@ static int load_public_key(const uint8_t *key_data, size_t key_len, mbedtls_pk_c
     return CRYPTO_SUCCESS;
 }
 
-int crypto_verify_rsa(const uint8_t *data, size_t data_len,
-                      const uint8_t *signature, size_t sig_len,
-                      const uint8_t *public_key, size_t key_len)
+/* R^2 mod N is otherwise computed inside the first verify */
+static void precompute_rsa(mbedtls_pk_context *pk)
+{
+    mbedtls_rsa_context *rsa;
+    uint8_t block[512];             /* up to RSA-4096 */
+    size_t len;
+    
+    if (mbedtls_pk_get_type(pk) != MBEDTLS_PK_RSA) {
+        return;
+    }
+    
+    rsa = mbedtls_pk_rsa(*pk);
+    len = mbedtls_rsa_get_len(rsa);
+    if (len == 0 || len > sizeof(block)) {
+        return;
+    }
+    
+    /* any public operation fills the cache, 2^e mod N is the cheapest input */
+    memset(block, 0, len);
+    block[len - 1] = 2;
+    mbedtls_rsa_public(rsa, block, block);
+}
+
+int crypto_verifier_init(crypto_verifier_t *verifier,
+                         const uint8_t *public_key, size_t key_len)
 {
+    const uint8_t *x;
+    const uint8_t *y;
     int ret;
-    mbedtls_pk_context pk;
-    uint8_t hash[SHA256_HASH_SIZE];
-    mbedtls_md_context_t md_ctx;
-    const mbedtls_md_info_t *md_info;
     
-    if (!data || !signature || !public_key || data_len == 0) {
+    if (!verifier || !public_key) {
         return CRYPTO_ERROR_INVALID_PARAM;
     }
     
+    /* a comb table is used where it lies, its first entry is Q itself */
+    verifier->table = NULL;
+    if (key_len == CRYPTO_P256_TABLE_SIZE) {
+        mbedtls_pk_init(&verifier->pk);
+        verifier->table = public_key;
+        memcpy(verifier->point, public_key, sizeof(verifier->point));
+        verifier->has_point = crypto_backend_get()->ecdsa_p256_verify != NULL;
+        return CRYPTO_SUCCESS;
+    }
+    
     /* Load public key - supports both RSA and ECDSA */
-    ret = load_public_key(public_key, key_len, &pk);
+    ret = load_public_key(public_key, key_len, &verifier->pk);
     if (ret != CRYPTO_SUCCESS) {
         // FIXME: Should log which key type failed
         return ret;
     }
     
-    /* Hash the data - SHA256 for both RSA and ECDSA */
-    md_info = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
-    if (!md_info) {
-        mbedtls_pk_free(&pk);
-        return CRYPTO_ERROR_INVALID_PARAM;
-    }
+    precompute_rsa(&verifier->pk);
     
-    mbedtls_md_init(&md_ctx);
-    ret = mbedtls_md_setup(&md_ctx, md_info, 0);
-    if (ret != 0) {
-        mbedtls_pk_free(&pk);
-        return CRYPTO_ERROR_INVALID_PARAM;
+    /* the PKA engine takes the point raw, keep it converted */
+    verifier->has_point = 0;
+    if (crypto_backend_get()->ecdsa_p256_verify &&
+        crypto_backend_p256_public_raw(public_key, key_len, &x, &y) == CRYPTO_SUCCESS) {
+        memcpy(verifier->point, x, 32);
+        memcpy(verifier->point + 32, y, 32);
+        verifier->has_point = 1;
     }
     
-    ret = mbedtls_md_starts(&md_ctx);
-    if (ret == 0) {
-        ret = mbedtls_md_update(&md_ctx, data, data_len);
+    return CRYPTO_SUCCESS;
+}
+
+/* P-256 on the backend's PKA engine, when it has one and the key suits it */
+static int verify_ecdsa_backend(const crypto_verifier_t *verifier, const uint8_t *hash,
+                                const uint8_t *signature, size_t sig_len)
+{
+    const crypto_backend_t *backend = crypto_backend_get();
+    uint8_t r[32];
+    uint8_t s[32];
+    
+    if (!verifier->has_point || !backend->ecdsa_p256_verify ||
+        crypto_backend_ecdsa_signature_raw(signature, sig_len, r, s) != CRYPTO_SUCCESS) {
+        return CRYPTO_ERROR_NOT_SUPPORTED;
     }
-    if (ret == 0) {
-        ret = mbedtls_md_finish(&md_ctx, hash);
+    
+    return backend->ecdsa_p256_verify(hash, r, s, verifier->point, verifier->point + 32);
+}
+
+/* Software P-256 against a key table; DER as mbedTLS writes it, or raw r || s */
+static int verify_ecdsa_table(const uint8_t *table, const uint8_t *hash,
+                              const uint8_t *signature, size_t sig_len)
+{
+    uint8_t r[32];
+    uint8_t s[32];
+    
+    if (sig_len == 64) {
+        memcpy(r, signature, 32);
+        memcpy(s, signature + 32, 32);
+    } else if (crypto_backend_ecdsa_signature_raw(signature, sig_len, r, s) != CRYPTO_SUCCESS) {
+        return CRYPTO_ERROR_INVALID_SIGNATURE;
     }
-    mbedtls_md_free(&md_ctx);
     
-    if (ret != 0) {
-        mbedtls_pk_free(&pk);
+    return crypto_p256_verify(hash, r, s, table);
+}
+
+int crypto_verifier_verify_hash(crypto_verifier_t *verifier, const uint8_t *hash,
+                                const uint8_t *signature, size_t sig_len)
+{
+    int ret;
+    
+    if (!verifier || !hash || !signature) {
         return CRYPTO_ERROR_INVALID_PARAM;
     }
     
-    /* Verify signature */
-    ret = mbedtls_pk_verify(&pk, MBEDTLS_MD_SHA256, hash, SHA256_HASH_SIZE,
-                           signature, sig_len);
+    ret = verify_ecdsa_backend(verifier, hash, signature, sig_len);
+    if (ret != CRYPTO_ERROR_NOT_SUPPORTED) {
+        return ret;
+    }
     
-    mbedtls_pk_free(&pk);
+    if (verifier->table) {
+        return verify_ecdsa_table(verifier->table, hash, signature, sig_len);
+    }
     
+    ret = mbedtls_pk_verify(&verifier->pk, MBEDTLS_MD_SHA256, hash, SHA256_HASH_SIZE,
+                            signature, sig_len);
     if (ret != 0) {
         return CRYPTO_ERROR_INVALID_SIGNATURE;
     }
@@ -92,64 +160,130 @@ int crypto_verify_rsa(const uint8_t *data, size_t data_len,
     return CRYPTO_SUCCESS;
 }
 
-int crypto_verify_ecdsa(const uint8_t *data, size_t data_len,
+int crypto_verifier_verify(crypto_verifier_t *verifier,
+                           const uint8_t *data, size_t data_len,
+                           const uint8_t *signature, size_t sig_len)
+{
+    uint8_t hash[SHA256_HASH_SIZE];
+    
+    if (!verifier || !data || !signature || data_len == 0) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    if (crypto_hash_sha256(data, data_len, hash) != CRYPTO_SUCCESS) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    
+    return crypto_verifier_verify_hash(verifier, hash, signature, sig_len);
+}
+
+void crypto_verifier_free(crypto_verifier_t *verifier)
+{
+    if (verifier) {
+        mbedtls_pk_free(&verifier->pk);
+        verifier->table = NULL;
+        verifier->has_point = 0;
+    }
+}
+
+/* One-off verification: a verifier that lives for a single signature.
+ * The key must be of the kind asked for, an ECDSA key is no RSA key. */
+static int verify_hash(int ecdsa, const uint8_t *hash,
                        const uint8_t *signature, size_t sig_len,
                        const uint8_t *public_key, size_t key_len)
 {
+    crypto_verifier_t verifier;
     int ret;
-    mbedtls_pk_context pk;
-    uint8_t hash[SHA256_HASH_SIZE];
-    mbedtls_md_context_t md_ctx;
-    const mbedtls_md_info_t *md_info;
     
-    if (!data || !signature || !public_key || data_len == 0) {
+    if (!hash || !signature || !public_key) {
         return CRYPTO_ERROR_INVALID_PARAM;
     }
     
-    /* Load public key */
-    ret = load_public_key(public_key, key_len, &pk);
+    ret = crypto_verifier_init(&verifier, public_key, key_len);
     if (ret != CRYPTO_SUCCESS) {
         return ret;
     }
     
-    /* Hash the data */
-    md_info = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
-    if (!md_info) {
-        mbedtls_pk_free(&pk);
-        return CRYPTO_ERROR_INVALID_PARAM;
+    if (ecdsa ? !verifier.table && !mbedtls_pk_can_do(&verifier.pk, MBEDTLS_PK_ECDSA) :
+                (verifier.table || !mbedtls_pk_can_do(&verifier.pk, MBEDTLS_PK_RSA))) {
+        crypto_verifier_free(&verifier);
+        return CRYPTO_ERROR_INVALID_KEY;
     }
     
-    mbedtls_md_init(&md_ctx);
-    ret = mbedtls_md_setup(&md_ctx, md_info, 0);
-    if (ret != 0) {
-        mbedtls_pk_free(&pk);
-        return CRYPTO_ERROR_INVALID_PARAM;
-    }
+    ret = crypto_verifier_verify_hash(&verifier, hash, signature, sig_len);
+    crypto_verifier_free(&verifier);
     
-    ret = mbedtls_md_starts(&md_ctx);
-    if (ret == 0) {
-        ret = mbedtls_md_update(&md_ctx, data, data_len);
-    }
-    if (ret == 0) {
-        ret = mbedtls_md_finish(&md_ctx, hash);
+    return ret;
+}
+
+int crypto_verify_rsa_hash(const uint8_t *hash,
+                           const uint8_t *signature, size_t sig_len,
+                           const uint8_t *public_key, size_t key_len)
+{
+    return verify_hash(0, hash, signature, sig_len, public_key, key_len);
+}
+
+int crypto_verify_ecdsa_hash(const uint8_t *hash,
+                             const uint8_t *signature, size_t sig_len,
+                             const uint8_t *public_key, size_t key_len)
+{
+    return verify_hash(1, hash, signature, sig_len, public_key, key_len);
+}
+
+int crypto_verify_signature_hash(const uint8_t *hash,
+                                 const uint8_t *signature, size_t sig_len,
+                                 const uint8_t *public_key, size_t key_len)
+{
+#if BOOT_SIGNATURE_ALGORITHM == BOOT_SIGNATURE_ALGORITHM_ECDSA_P256
+    return crypto_verify_ecdsa_hash(hash, signature, sig_len, public_key, key_len);
+#else
+    return crypto_verify_rsa_hash(hash, signature, sig_len, public_key, key_len);
+#endif
+}
+
+int crypto_verify_rsa(const uint8_t *data, size_t data_len,
+                      const uint8_t *signature, size_t sig_len,
+                      const uint8_t *public_key, size_t key_len)
+{
+    uint8_t hash[SHA256_HASH_SIZE];
+    
+    if (!data || !signature || !public_key || data_len == 0) {
+        return CRYPTO_ERROR_INVALID_PARAM;
     }
-    mbedtls_md_free(&md_ctx);
     
-    if (ret != 0) {
-        mbedtls_pk_free(&pk);
+    /* Hash the data - SHA256 for both RSA and ECDSA */
+    if (crypto_hash_sha256(data, data_len, hash) != CRYPTO_SUCCESS) {
         return CRYPTO_ERROR_INVALID_PARAM;
     }
     
-    /* Verify signature */
-    ret = mbedtls_pk_verify(&pk, MBEDTLS_MD_SHA256, hash, SHA256_HASH_SIZE,
-                           signature, sig_len);
+    return crypto_verify_rsa_hash(hash, signature, sig_len, public_key, key_len);
+}
+
+int crypto_verify_ecdsa(const uint8_t *data, size_t data_len,
+                       const uint8_t *signature, size_t sig_len,
+                       const uint8_t *public_key, size_t key_len)
+{
+    uint8_t hash[SHA256_HASH_SIZE];
     
-    mbedtls_pk_free(&pk);
+    if (!data || !signature || !public_key || data_len == 0) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
     
-    if (ret != 0) {
-        return CRYPTO_ERROR_INVALID_SIGNATURE;
+    /* Hash the data */
+    if (crypto_hash_sha256(data, data_len, hash) != CRYPTO_SUCCESS) {
+        return CRYPTO_ERROR_INVALID_PARAM;
     }
     
-    return CRYPTO_SUCCESS;
+    return crypto_verify_ecdsa_hash(hash, signature, sig_len, public_key, key_len);
 }
 
+int crypto_verify_signature(const uint8_t *data, size_t data_len,
+                            const uint8_t *signature, size_t sig_len,
+                            const uint8_t *public_key, size_t key_len)
+{
+#if BOOT_SIGNATURE_ALGORITHM == BOOT_SIGNATURE_ALGORITHM_ECDSA_P256
+    return crypto_verify_ecdsa(data, data_len, signature, sig_len, public_key, key_len);
+#else
+    return crypto_verify_rsa(data, data_len, signature, sig_len, public_key, key_len);
+#endif
+}
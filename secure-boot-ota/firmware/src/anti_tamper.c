@@ -5,13 +5,28 @@
 #include <string.h>
 #include <stdio.h>
 
-static uint8_t firmware_checksum[SHA256_HASH_SIZE];
+/* Merkle tree over the firmware pages, built once at init. Each check
+ * re-hashes a few pages and walks them up to the root, so a call costs
+ * ANTI_TAMPER_SCAN_BUDGET bytes of hashing instead of the whole image. */
+static uint8_t page_tree[2 * ANTI_TAMPER_MAX_PAGES * SHA256_HASH_SIZE];
+static uint8_t tree_root[SHA256_HASH_SIZE];
+static size_t page_count = 0;
+static size_t next_page = 0;
 static uint32_t checksum_failures = 0;
 static int initialized = 0;
 
+// v1.2 - Incremental scan: a few pages per call checked against a Merkle root
 // v1.1 - Added failure counter to prevent false positives
 // v1.0 - Initial implementation
 
+static int hash_page(const uint8_t *start, size_t size, size_t page, uint8_t *leaf)
+{
+    size_t offset = page * ANTI_TAMPER_PAGE_SIZE;
+    size_t len = size - offset < ANTI_TAMPER_PAGE_SIZE ? size - offset : ANTI_TAMPER_PAGE_SIZE;
+    
+    return crypto_merkle_leaf(start + offset, len, leaf);
+}
+
 int anti_tamper_init(void)
 {
     /* Calculate initial checksum of critical code sections */
@@ -19,64 +34,88 @@ int anti_tamper_init(void)
     extern uint8_t __firmware_end[];
     size_t firmware_size = __firmware_end - __firmware_start;
     
-    if (firmware_size == 0) {
+    if (firmware_size == 0 || firmware_size > MAX_FIRMWARE_SIZE) {
+        printf("[ANTI-TAMPER] ERROR: Invalid firmware size\n");
+        return -1;
+    }
+    
+    /* the one full pass, at boot before anything time-critical runs */
+    page_count = (firmware_size + ANTI_TAMPER_PAGE_SIZE - 1) / ANTI_TAMPER_PAGE_SIZE;
+    if (crypto_merkle_nodes(page_count) * SHA256_HASH_SIZE > sizeof(page_tree)) {
         printf("[ANTI-TAMPER] ERROR: Invalid firmware size\n");
         return -1;
     }
+    for (size_t i = 0; i < page_count; i++) {
+        if (hash_page(__firmware_start, firmware_size, i,
+                      page_tree + i * SHA256_HASH_SIZE) != CRYPTO_SUCCESS) {
+            printf("[ANTI-TAMPER] ERROR: Failed to calculate initial checksum\n");
+            return -1;
+        }
+    }
     
-    if (crypto_hash_sha256(__firmware_start, firmware_size,
-                           firmware_checksum) != CRYPTO_SUCCESS) {
+    if (crypto_merkle_build(page_tree, page_count, tree_root) != CRYPTO_SUCCESS) {
         printf("[ANTI-TAMPER] ERROR: Failed to calculate initial checksum\n");
         return -1;
     }
     
+    next_page = 0;
     initialized = 1;
-    printf("[ANTI-TAMPER] Initialized (firmware size: %zu bytes)\n", firmware_size);
+    printf("[ANTI-TAMPER] Initialized (firmware size: %zu bytes, %zu pages)\n",
+           firmware_size, page_count);
     return 0;
 }
 
 void anti_tamper_check(void)
 {
-    uint8_t current_checksum[SHA256_HASH_SIZE];
+    uint8_t leaf[SHA256_HASH_SIZE];
     extern uint8_t __firmware_start[];
     extern uint8_t __firmware_end[];
     size_t firmware_size = __firmware_end - __firmware_start;
+    size_t pages = ANTI_TAMPER_SCAN_BUDGET / ANTI_TAMPER_PAGE_SIZE;
     
     if (!initialized) {
         // Not initialized yet - skip check
         return;
     }
     
-    /* Calculate current checksum - expensive operation */
-    if (crypto_hash_sha256(__firmware_start, firmware_size,
-                          current_checksum) != CRYPTO_SUCCESS) {
-        checksum_failures++;
-        printf("[ANTI-TAMPER] WARNING: Checksum calculation failed (%u failures)\n", 
-               checksum_failures);
-        if (checksum_failures >= MAX_CHECKSUM_FAILURES) {
-            /* Tampering detected - take action */
-            printf("[ANTI-TAMPER] CRITICAL: Tampering detected! Halting...\n");
-            // TODO: Add secure logging before halt
-            while (1) { /* Halt - should trigger watchdog reset */ }
-        }
-        return;
+    if (pages == 0) {
+        pages = 1;
     }
     
-    /* Compare checksums - constant time would be better but this works */
-    if (memcmp(firmware_checksum, current_checksum, SHA256_HASH_SIZE) != 0) {
-        checksum_failures++;
-        printf("[ANTI-TAMPER] WARNING: Checksum mismatch (%u failures)\n", 
-               checksum_failures);
-        if (checksum_failures >= MAX_CHECKSUM_FAILURES) {
-            printf("[ANTI-TAMPER] CRITICAL: Code modification detected! Halting...\n");
-            while (1) { /* Halt */ }
+    while (pages-- > 0) {
+        /* Hash the page and check it against the root through the tree;
+         * the stored leaf isn't trusted, so editing the table alone fails too */
+        if (hash_page(__firmware_start, firmware_size, next_page, leaf) != CRYPTO_SUCCESS) {
+            checksum_failures++;
+            printf("[ANTI-TAMPER] WARNING: Checksum calculation failed (%u failures)\n", 
+                   checksum_failures);
+            if (checksum_failures >= MAX_CHECKSUM_FAILURES) {
+                /* Tampering detected - take action */
+                printf("[ANTI-TAMPER] CRITICAL: Tampering detected! Halting...\n");
+                // TODO: Add secure logging before halt
+                while (1) { /* Halt - should trigger watchdog reset */ }
+            }
+            return;
+        }
+        
+        if (crypto_merkle_verify_leaf(page_tree, page_count, next_page, leaf,
+                                      tree_root) != CRYPTO_SUCCESS) {
+            /* stay on this page, a modified one fails every call after */
+            checksum_failures++;
+            printf("[ANTI-TAMPER] WARNING: Checksum mismatch on page %zu (%u failures)\n", 
+                   next_page, checksum_failures);
+            if (checksum_failures >= MAX_CHECKSUM_FAILURES) {
+                printf("[ANTI-TAMPER] CRITICAL: Code modification detected! Halting...\n");
+                while (1) { /* Halt */ }
+            }
+            return;
         }
-    } else {
+        
         // Reset counter on success - might want to keep some history
         if (checksum_failures > 0) {
             printf("[ANTI-TAMPER] Checksum OK (reset failure counter)\n");
         }
         checksum_failures = 0;
+        next_page = (next_page + 1) % page_count;
     }
 }
-
@@ -1,16 +1,51 @@
 #include "firmware.h"
 #include "boot_config.h"
+#include "boot_trace.h"
 #include <stdio.h>
 #include <stdint.h>
 
-// Firmware v1.2 - Added periodic anti-tamper checks (2024-05-10)
+// Firmware v1.3 - Report the bootloader's phase timings
+// v1.2 - Added periodic anti-tamper checks (2024-05-10)
 // v1.1 - Fixed MPU initialization order
 // v1.0 - Initial release
 
+static const char *const phase_names[BOOT_PHASE_COUNT] = {
+    "start", "crypto init", "version check", "boot control",
+    "header parse", "header verify", "image pass", "version update", "jump"
+};
+
+/* Print how long each bootloader phase took, then drop the trace so a
+ * later reset without a new boot does not report it again */
+static void report_boot_trace(void)
+{
+    boot_trace_t *trace = (boot_trace_t *)(uintptr_t)BOOT_TRACE_ADDRESS;
+    uint32_t scale;
+    
+    if (trace->magic != BOOT_TRACE_MAGIC || trace->count == 0 ||
+        trace->count > BOOT_TRACE_MAX_EVENTS || trace->ticks_per_second < 1000000) {
+        return;
+    }
+    
+    scale = trace->ticks_per_second / 1000000;
+    printf("[FIRMWARE] Boot phases (us):\n");
+    for (uint32_t i = 1; i < trace->count; i++) {
+        const boot_trace_event_t *event = &trace->events[i];
+        uint32_t ticks = event->ticks - trace->events[i - 1].ticks;
+    
+        printf("[FIRMWARE]   %-16s %8u\n",
+               event->phase < BOOT_PHASE_COUNT ? phase_names[event->phase] : "?",
+               (unsigned)(ticks / scale));
+    }
+    printf("[FIRMWARE]   %-16s %8u\n", "total",
+           (unsigned)((trace->events[trace->count - 1].ticks - trace->events[0].ticks) / scale));
+    
+    trace->magic = 0;
+}
+
 /* Firmware entry point - called by bootloader */
 int firmware_main(void)
 {
-    printf("[FIRMWARE] Starting firmware v1.2\n");
+    printf("[FIRMWARE] Starting firmware v1.3\n");
     printf("[FIRMWARE] Initializing...\n");
     
     /* Initialize anti-tamper - must be first */
@@ -20,6 +55,9 @@ int firmware_main(void)
         return -1;
     }
     
+    /* Before the MPU closes off the rest of RAM */
+    report_boot_trace();
+    
     /* Initialize MPU simulation - memory protection */
     mpu_init();
     printf("[FIRMWARE] MPU initialized\n");
@@ -33,7 +71,7 @@ int firmware_main(void)
         /* Application code here */
         // Run anti-tamper check every loop - might be too frequent?
         anti_tamper_check();
-        
+    
         // FIXME: Add actual application logic
         // ... 
     }
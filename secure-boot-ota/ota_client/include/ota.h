@@ -4,11 +4,184 @@
 #include <stdint.h>
 #include <stddef.h>
 
-int ota_download_firmware(const char *server_url, const char *version,
-                         uint8_t **firmware_data, size_t *firmware_size);
+/*
+ * Connection kept across the requests of an update: the HTTP connection
+ * (HTTP/2 when the server offers it), the DNS cache and the TLS session
+ * tickets. Every download takes one; NULL means a one-off connection.
+ */
+typedef struct {
+    void *curl;     /* CURL easy handle, reset between requests */
+    void *share;    /* CURLSH holding DNS, TLS sessions and connections */
+    void *resolver; /* ota_resolver_t, NULL leaves resolving to curl */
+    void *resolve;  /* curl_slist pinning the server's address */
+} ota_session_t;
+
+/*
+ * DNS resolver (resolver.c), owned by the session: curl is handed the
+ * address (CURLOPT_RESOLVE) and never calls getaddrinfo itself. Answers
+ * are kept for their TTL, names that do not exist for the SOA's negative
+ * TTL, and a hit in the last OTA_DNS_PREFETCH_PERCENT of its TTL sends a
+ * refresh in the background, so once a name is known no request waits on
+ * the network for it. Queries go over a non-blocking UDP socket:
+ * ota_resolve_start() answers from the cache or sends, and
+ * ota_resolver_process() takes in whatever answers have arrived and
+ * resends lost queries; ota_resolver_fd() is for the caller's poll().
+ * IPv4 (A records) only; /etc/hosts is read on a miss.
+ */
+#define OTA_DNS_NAME_MAX          253
+#define OTA_DNS_CACHE_SIZE        8
+
+#define OTA_DNS_OK                0       /* address in *addr */
+#define OTA_DNS_PENDING           1       /* query in flight */
+#define OTA_DNS_NXDOMAIN          (-1)    /* name or its A record does not exist */
+#define OTA_DNS_ERROR             (-2)    /* no usable answer: timeout, SERVFAIL, no network */
+
+typedef struct {
+    char name[OTA_DNS_NAME_MAX + 1];
+    uint32_t addr;                  /* network order */
+    uint64_t expires_ms;            /* CLOCK_MONOTONIC */
+    uint64_t refresh_ms;            /* prefetch once past this */
+    uint64_t retry_ms;              /* resend the query in flight */
+    uint16_t query_id;              /* 0 when none is in flight */
+    uint8_t tries;
+    uint8_t state;
+} ota_dns_entry_t;
+
+typedef struct {
+    int fd;                         /* UDP socket connected to the nameserver */
+    ota_dns_entry_t cache[OTA_DNS_CACHE_SIZE];
+} ota_resolver_t;
+
+/* nameserver: dotted IPv4 address, NULL for the first of /etc/resolv.conf */
+int ota_resolver_init(ota_resolver_t *resolver, const char *nameserver, uint16_t port);
+void ota_resolver_free(ota_resolver_t *resolver);
+int ota_resolver_fd(const ota_resolver_t *resolver);
+int ota_resolve_start(ota_resolver_t *resolver, const char *name, uint32_t *addr);
+void ota_resolver_process(ota_resolver_t *resolver);
+/* ota_resolve_start() and wait, at most timeout_ms, for the answer */
+int ota_resolve(ota_resolver_t *resolver, const char *name, uint32_t *addr, int timeout_ms);
+
+int ota_session_init(ota_session_t *session);
+void ota_session_free(ota_session_t *session);
+
+/* For the download paths: a CURL handle set up for url with the session
+ * defaults, handed back with ota_session_end(). ota_session_extra() gives
+ * an additional handle on the same caches, for transfers run together. */
+void *ota_session_begin(ota_session_t *session, const char *url);
+void *ota_session_extra(ota_session_t *session, const char *url);
+void ota_session_end(ota_session_t *session, void *curl);
+
+int ota_download_file(ota_session_t *session, const char *url, const char *output_path);
+int ota_download_firmware(ota_session_t *session, const char *server_url, const char *version,
+                          uint8_t **firmware_data, size_t *firmware_size);
 int ota_verify_firmware(const uint8_t *firmware, size_t size,
                        const uint8_t *signature, size_t sig_len);
+
+/*
+ * A/B install (install.c): begin picks the slot the boot-control record
+ * does not boot, each step writes or reads back OTA_INSTALL_STEP_SIZE
+ * bytes of it, and the step that finishes the read-back flips the
+ * record. step returns 1 while there is more to do, 0 once the record
+ * points at the new slot, -1 on failure (the install is then over and
+ * the old slot still boots). The image must stay valid until then.
+ * ota_install_firmware() runs the steps with OTA_INSTALL_STEP_DELAY_MS
+ * pauses between them.
+ */
+typedef struct {
+    const uint8_t *image;
+    size_t size;
+    size_t done;                    /* bytes written, then read back */
+    int phase;
+    int fd;
+    uint8_t slot;                   /* BOOT_SLOT_A or BOOT_SLOT_B */
+    uint32_t sequence;              /* of the record in force at begin */
+} ota_install_t;
+
+int ota_install_begin(ota_install_t *install, const uint8_t *image, size_t size);
+int ota_install_step(ota_install_t *install);
+void ota_install_abort(ota_install_t *install);
 int ota_install_firmware(const uint8_t *firmware, size_t size);
 
+/*
+ * Download straight into the inactive slot (OTA_SLOT_PATH, a file or a
+ * flash partition), hashing each chunk as it arrives. Peak RAM is one
+ * curl chunk; the signature is checked as soon as the last byte lands.
+ * On any failure the slot is cleared. The image stays encrypted, the
+ * bootloader decrypts it on its single pass.
+ */
+int ota_stream_firmware(ota_session_t *session, const char *server_url, const char *version,
+                        const uint8_t *signature, size_t sig_len,
+                        const char *slot_path, size_t *firmware_size);
+
+/*
+ * Chunk manifest, made by ota_server/make_manifest.py. Little-endian:
+ *   magic, image_size, chunk_size, chunk_count   (4 x uint32)
+ *   image_hash                                    (SHA-256 of the image)
+ *   chunk_count x SHA-256, one per chunk
+ *   signature over everything above, to the end of the file
+ */
+#define OTA_MANIFEST_MAGIC        0x4d41544fu     /* "OTAM" */
+#define OTA_MANIFEST_HEADER_SIZE  48
+#define OTA_MANIFEST_MAX_SIZE     (OTA_MANIFEST_HEADER_SIZE + \
+                                   (MAX_FIRMWARE_SIZE / OTA_CHUNK_SIZE_MIN) * 32 + 512)
+
+typedef struct {
+    uint32_t image_size;
+    uint32_t chunk_size;
+    uint32_t chunk_count;
+    uint8_t image_hash[32];
+    const uint8_t *chunk_hashes;    /* points into the parsed buffer */
+} ota_manifest_t;
+
+/* Check the signature and bounds, 0 if the manifest can be used */
+int ota_manifest_parse(const uint8_t *data, size_t len, ota_manifest_t *manifest);
+
+/*
+ * Download with resumption: fetches and verifies the manifest, keeps the
+ * chunks already in the slot that match it, then asks for the missing
+ * runs with HTTP Range. Every chunk is hashed before it is written, and a
+ * transfer that drops is retried from the first missing chunk, up to
+ * OTA_MAX_RETRIES attempts without progress.
+ */
+int ota_download_resumable(ota_session_t *session, const char *server_url, const char *version,
+                           const char *slot_path, size_t *firmware_size);
+
+/*
+ * Same, with the missing chunks split over up to `connections` parallel
+ * Range requests (curl multi) written at their offsets in the slot, which
+ * is preallocated. Falls back to a single stream when the chunk buffers
+ * or handles cannot be had, or when the server ignores Range.
+ */
+int ota_download_parallel(ota_session_t *session, const char *server_url, const char *version,
+                          const char *slot_path, int connections, size_t *firmware_size);
+
+/*
+ * Delta from one release to the next, made by ota_server/make_delta.py.
+ * Little-endian header:
+ *   magic, old_size, new_size              (3 x uint32)
+ *   SHA-256 of the old image, SHA-256 of the new image
+ * then operations until OP_END:
+ *   OP_COPY   old_offset, length   (2 x uint32)  bytes from the old image
+ *   OP_INSERT length, bytes        (uint32 + data) bytes carried in the delta
+ */
+#define OTA_DELTA_MAGIC           0x4441544fu     /* "OTAD" */
+#define OTA_DELTA_HEADER_SIZE     76
+#define OTA_DELTA_OP_END          0
+#define OTA_DELTA_OP_COPY         1
+#define OTA_DELTA_OP_INSERT       2
+#define OTA_DELTA_COPY_BUFFER     4096
+
+/*
+ * Build the new image in slot_path from the image in active_path and a
+ * delta streamed from the server, verifying it against signature (the
+ * full image's) when the last byte lands. The base image is hashed
+ * first, so a delta for another version is refused before anything is
+ * written. On failure the slot is cleared.
+ */
+int ota_apply_delta(ota_session_t *session, const char *server_url, const char *from_version, const char *version,
+                    const uint8_t *signature, size_t sig_len,
+                    const char *active_path, const char *slot_path,
+                    size_t *firmware_size);
+
 #endif /* OTA_H */
 
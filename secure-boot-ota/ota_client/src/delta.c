@@ -0,0 +1,333 @@
+#include "ota.h"
+#include "boot_config.h"
+#include "crypto.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <curl/curl.h>
+
+// v1.1 - The delta comes over the caller's session
+// v1.0 - Delta updates applied while the delta downloads
+// The delta (ota_server/make_delta.py) is a list of COPY-from-old and
+// INSERT-new-bytes operations. They are parsed as the bytes arrive:
+// COPY reads the active slot, INSERT takes the bytes from the stream,
+// and both append to the inactive slot and to the hash of the new image.
+// RAM is the copy buffer plus a few bytes of parser state, whatever the
+// image or delta size.
+
+extern uint8_t boot_public_key[];
+
+enum {
+    DELTA_HEADER,
+    DELTA_OPCODE,
+    DELTA_ARGS,
+    DELTA_INSERT,
+    DELTA_DONE
+};
+
+struct DeltaStruct {
+    FILE *old_slot;
+    FILE *new_slot;
+    crypto_sha256_ctx_t sha;
+    int state;
+    uint8_t opcode;
+    uint8_t pending[OTA_DELTA_HEADER_SIZE];  /* header or op arguments in progress */
+    size_t pending_len;
+    size_t pending_need;
+    uint32_t old_size;
+    uint32_t new_size;
+    uint8_t new_hash[SHA256_HASH_SIZE];
+    uint32_t insert_left;
+    size_t written;
+    uint8_t copy_buffer[OTA_DELTA_COPY_BUFFER];
+};
+
+static uint32_t read_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int emit(struct DeltaStruct *delta, const uint8_t *data, size_t len)
+{
+    if (len > delta->new_size - delta->written) {
+        return -1;
+    }
+    
+    if (crypto_sha256_update(&delta->sha, data, len) != CRYPTO_SUCCESS ||
+        fwrite(data, 1, len, delta->new_slot) != len) {
+        return -1;
+    }
+    
+    delta->written += len;
+    return 0;
+}
+
+/* The delta only applies to the image it was made from */
+static int check_old_image(struct DeltaStruct *delta, const uint8_t *expected)
+{
+    crypto_sha256_ctx_t sha;
+    uint8_t hash[SHA256_HASH_SIZE];
+    size_t left = delta->old_size;
+    
+    if (crypto_sha256_init(&sha) != CRYPTO_SUCCESS) {
+        return -1;
+    }
+    
+    if (fseek(delta->old_slot, 0, SEEK_SET) != 0) {
+        crypto_sha256_free(&sha);
+        return -1;
+    }
+    
+    while (left > 0) {
+        size_t n = left < sizeof(delta->copy_buffer) ? left : sizeof(delta->copy_buffer);
+    
+        if (fread(delta->copy_buffer, 1, n, delta->old_slot) != n ||
+            crypto_sha256_update(&sha, delta->copy_buffer, n) != CRYPTO_SUCCESS) {
+            crypto_sha256_free(&sha);
+            return -1;
+        }
+        left -= n;
+    }
+    
+    if (crypto_sha256_final(&sha, hash) != CRYPTO_SUCCESS ||
+        crypto_compare_ct(hash, expected, SHA256_HASH_SIZE) != 0) {
+        fprintf(stderr, "[OTA] Delta was made for a different base image\n");
+        return -1;
+    }
+    
+    return 0;
+}
+
+static int copy_from_old(struct DeltaStruct *delta, uint32_t offset, uint32_t len)
+{
+    if (offset > delta->old_size || len > delta->old_size - offset) {
+        return -1;
+    }
+    
+    if (fseek(delta->old_slot, (long)offset, SEEK_SET) != 0) {
+        return -1;
+    }
+    
+    while (len > 0) {
+        size_t n = len < sizeof(delta->copy_buffer) ? len : sizeof(delta->copy_buffer);
+    
+        if (fread(delta->copy_buffer, 1, n, delta->old_slot) != n ||
+            emit(delta, delta->copy_buffer, n) != 0) {
+            return -1;
+        }
+        len -= (uint32_t)n;
+    }
+    
+    return 0;
+}
+
+/* The header or an op's arguments are complete in pending[] */
+static int run_pending(struct DeltaStruct *delta)
+{
+    const uint8_t *p = delta->pending;
+    
+    if (delta->state == DELTA_HEADER) {
+        if (read_le32(p) != OTA_DELTA_MAGIC) {
+            return -1;
+        }
+    
+        delta->old_size = read_le32(p + 4);
+        delta->new_size = read_le32(p + 8);
+        memcpy(delta->new_hash, p + 12 + SHA256_HASH_SIZE, SHA256_HASH_SIZE);
+    
+        if (delta->new_size == 0 || delta->new_size > MAX_FIRMWARE_SIZE ||
+            check_old_image(delta, p + 12) != 0) {
+            return -1;
+        }
+    
+        delta->state = DELTA_OPCODE;
+        return 0;
+    }
+    
+    if (delta->opcode == OTA_DELTA_OP_COPY) {
+        if (copy_from_old(delta, read_le32(p), read_le32(p + 4)) != 0) {
+            return -1;
+        }
+        delta->state = DELTA_OPCODE;
+    } else {
+        delta->insert_left = read_le32(p);
+        delta->state = delta->insert_left ? DELTA_INSERT : DELTA_OPCODE;
+    }
+    
+    return 0;
+}
+
+static size_t WriteDeltaCallback(void *contents, size_t size, size_t nmemb, void *userp)
+{
+    size_t realsize = size * nmemb;
+    struct DeltaStruct *delta = (struct DeltaStruct *)userp;
+    const uint8_t *p = (const uint8_t *)contents;
+    size_t left = realsize;
+    
+    /* anything short of realsize makes curl abort the transfer */
+    while (left > 0) {
+        size_t n;
+    
+        switch (delta->state) {
+        case DELTA_HEADER:
+        case DELTA_ARGS:
+            n = delta->pending_need - delta->pending_len;
+            n = n < left ? n : left;
+            memcpy(delta->pending + delta->pending_len, p, n);
+            delta->pending_len += n;
+            p += n;
+            left -= n;
+    
+            if (delta->pending_len == delta->pending_need && run_pending(delta) != 0) {
+                return 0;
+            }
+            break;
+    
+        case DELTA_OPCODE:
+            delta->opcode = *p++;
+            left--;
+            delta->pending_len = 0;
+    
+            if (delta->opcode == OTA_DELTA_OP_END) {
+                delta->state = DELTA_DONE;
+            } else if (delta->opcode == OTA_DELTA_OP_COPY) {
+                delta->pending_need = 8;
+                delta->state = DELTA_ARGS;
+            } else if (delta->opcode == OTA_DELTA_OP_INSERT) {
+                delta->pending_need = 4;
+                delta->state = DELTA_ARGS;
+            } else {
+                return 0;
+            }
+            break;
+    
+        case DELTA_INSERT:
+            n = delta->insert_left < left ? delta->insert_left : left;
+            if (emit(delta, p, n) != 0) {
+                return 0;
+            }
+            p += n;
+            left -= n;
+            delta->insert_left -= (uint32_t)n;
+    
+            if (delta->insert_left == 0) {
+                delta->state = DELTA_OPCODE;
+            }
+            break;
+    
+        default:
+            /* nothing may follow the end marker */
+            return 0;
+        }
+    }
+    
+    return realsize;
+}
+
+int ota_apply_delta(ota_session_t *session, const char *server_url, const char *from_version, const char *version,
+                    const uint8_t *signature, size_t sig_len,
+                    const char *active_path, const char *slot_path,
+                    size_t *firmware_size)
+{
+    CURL *curl;
+    CURLcode res;
+    struct DeltaStruct *delta;
+    crypto_verifier_t verifier;
+    uint8_t hash[SHA256_HASH_SIZE];
+    char url[512];
+    int sha_live = 0;
+    int ret = -1;
+    
+    if (!server_url || !from_version || !signature || !active_path || !slot_path) {
+        return -1;
+    }
+    
+    if (crypto_verifier_init(&verifier, boot_public_key, BOOT_PUBLIC_KEY_SIZE) != CRYPTO_SUCCESS) {
+        return -1;
+    }
+    
+    /* the copy buffer makes this too large for the stack */
+    delta = calloc(1, sizeof(*delta));
+    if (!delta) {
+        crypto_verifier_free(&verifier);
+        return -1;
+    }
+    
+    delta->state = DELTA_HEADER;
+    delta->pending_need = OTA_DELTA_HEADER_SIZE;
+    delta->old_slot = fopen(active_path, "rb");
+    delta->new_slot = fopen(slot_path, "wb");
+    if (!delta->old_slot || !delta->new_slot) {
+        goto out;
+    }
+    
+    if (crypto_sha256_init(&delta->sha) != CRYPTO_SUCCESS) {
+        goto out;
+    }
+    sha_live = 1;
+    
+    snprintf(url, sizeof(url), "%s/api/firmware/delta?from=%s&version=%s",
+             server_url, from_version, version ? version : "latest");
+    
+    curl = ota_session_begin(session, url);
+    if (!curl) {
+        goto out;
+    }
+    
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteDeltaCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)delta);
+    
+    res = curl_easy_perform(curl);
+    ota_session_end(session, curl);
+    
+    if (res != CURLE_OK) {
+        fprintf(stderr, "[OTA] Delta download failed: %s\n", curl_easy_strerror(res));
+        goto out;
+    }
+    
+    if (delta->state != DELTA_DONE || delta->written != delta->new_size) {
+        fprintf(stderr, "[OTA] Delta ended early\n");
+        goto out;
+    }
+    
+    sha_live = 0;
+    if (crypto_sha256_final(&delta->sha, hash) != CRYPTO_SUCCESS ||
+        crypto_compare_ct(hash, delta->new_hash, SHA256_HASH_SIZE) != 0 ||
+        crypto_verifier_verify_hash(&verifier, hash, signature, sig_len) != CRYPTO_SUCCESS) {
+        fprintf(stderr, "[OTA] Patched image failed verification\n");
+        goto out;
+    }
+    
+    if (fflush(delta->new_slot) != 0 || fsync(fileno(delta->new_slot)) != 0) {
+        fprintf(stderr, "[OTA] Could not flush %s\n", slot_path);
+        goto out;
+    }
+    
+    printf("[OTA] Delta applied, %s holds %zu bytes\n", slot_path, delta->written);
+    if (firmware_size) {
+        *firmware_size = delta->written;
+    }
+    ret = 0;
+    
+out:
+    if (sha_live) {
+        crypto_sha256_free(&delta->sha);
+    }
+    
+    /* never leave a half-patched image in the slot */
+    if (delta->new_slot) {
+        if (ret != 0 && ftruncate(fileno(delta->new_slot), 0) != 0) {
+            fprintf(stderr, "[OTA] Could not clear %s\n", slot_path);
+        }
+        fclose(delta->new_slot);
+    }
+    if (delta->old_slot) {
+        fclose(delta->old_slot);
+    }
+    
+    free(delta);
+    crypto_verifier_free(&verifier);
+    return ret;
+}
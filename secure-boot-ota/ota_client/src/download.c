@@ -4,36 +4,36 @@
 #include <string.h>
 #include <curl/curl.h>
 
+// v1.1 - Requests go through the caller's session
 // v1.0 - Initial implementation
 // Simple file download using curl
 
-int ota_download_file(const char *url, const char *output_path)
+int ota_download_file(ota_session_t *session, const char *url, const char *output_path)
 {
     CURL *curl;
     FILE *fp;
     CURLcode res;
     
-    curl = curl_easy_init();
-    if (!curl) {
+    fp = fopen(output_path, "wb");
+    if (!fp) {
         return -1;
     }
     
-    fp = fopen(output_path, "wb");
-    if (!fp) {
-        curl_easy_cleanup(curl);
+    curl = ota_session_begin(session, url);
+    if (!curl) {
+        fclose(fp);
         return -1;
     }
     
-    curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, fwrite);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
     curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-    // TODO: Add timeout, SSL verification, etc.
+    // TODO: SSL verification, etc.
     
     res = curl_easy_perform(curl);
     
     fclose(fp);
-    curl_easy_cleanup(curl);
+    ota_session_end(session, curl);
     
     if (res != CURLE_OK) {
         return -1;
@@ -0,0 +1,192 @@
+#include "ota.h"
+#include "boot_config.h"
+#include "boot_control.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// v1.0 - A/B install in the background
+// The image goes to the slot that is not booting, OTA_INSTALL_STEP_SIZE
+// bytes per step, so the application keeps running between steps and
+// never waits on more than one block of flash. It is read back against
+// the image before the boot-control record is flipped to it; that one
+// page write is the only moment the next boot changes. Interrupted at
+// any earlier point, the device still boots the old slot.
+
+enum {
+    INSTALL_WRITE,
+    INSTALL_VERIFY,
+    INSTALL_DONE
+};
+
+static const char *slot_path(uint8_t slot)
+{
+    return slot == BOOT_SLOT_B ? OTA_SLOT_B_PATH : OTA_SLOT_A_PATH;
+}
+
+/* Both copies from the record file; a missing file reads as slot A */
+static void read_control(boot_control_t *control)
+{
+    uint8_t copies[2][BOOT_CONTROL_SIZE];
+    int fd = open(OTA_BOOT_CONTROL_PATH, O_RDONLY);
+    
+    memset(copies, 0, sizeof(copies));
+    if (fd >= 0) {
+        if (pread(fd, copies[0], BOOT_CONTROL_SIZE, 0) != BOOT_CONTROL_SIZE) {
+            memset(copies[0], 0, BOOT_CONTROL_SIZE);
+        }
+        if (pread(fd, copies[1], BOOT_CONTROL_SIZE, BOOT_FLASH_PAGE_SIZE) != BOOT_CONTROL_SIZE) {
+            memset(copies[1], 0, BOOT_CONTROL_SIZE);
+        }
+        close(fd);
+    }
+    
+    boot_control_read(copies[0], copies[1], control);
+}
+
+/* The swap: the copy not in force is rewritten, the other one stays */
+static int write_control(const boot_control_t *current, uint8_t slot)
+{
+    boot_control_t next;
+    uint8_t record[BOOT_CONTROL_SIZE];
+    int fd;
+    int ret = -1;
+    
+    if (boot_control_next(current, slot, &next, record) != 0) {
+        return -1;
+    }
+    
+    fd = open(OTA_BOOT_CONTROL_PATH, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    if (pwrite(fd, record, sizeof(record), (off_t)(next.sequence & 1) * BOOT_FLASH_PAGE_SIZE) ==
+            (ssize_t)sizeof(record) &&
+        fsync(fd) == 0) {
+        ret = 0;
+    }
+    
+    close(fd);
+    return ret;
+}
+
+int ota_install_begin(ota_install_t *install, const uint8_t *image, size_t size)
+{
+    boot_control_t control;
+    
+    if (!install || !image || size == 0 || size > FIRMWARE_SLOT_SIZE) {
+        return -1;
+    }
+    
+    memset(install, 0, sizeof(*install));
+    install->fd = -1;
+    
+    read_control(&control);
+    install->slot = (uint8_t)(control.active_slot ^ 1);
+    install->sequence = control.sequence;
+    
+    install->fd = open(slot_path(install->slot), O_RDWR | O_CREAT, 0644);
+    if (install->fd < 0) {
+        fprintf(stderr, "[OTA] Could not open %s\n", slot_path(install->slot));
+        return -1;
+    }
+    
+    install->image = image;
+    install->size = size;
+    install->phase = INSTALL_WRITE;
+    return 0;
+}
+
+int ota_install_step(ota_install_t *install)
+{
+    uint8_t buffer[OTA_INSTALL_STEP_SIZE];
+    boot_control_t control;
+    size_t n;
+    
+    if (!install || install->fd < 0 || install->phase == INSTALL_DONE) {
+        return -1;
+    }
+    
+    n = install->size - install->done < sizeof(buffer) ? install->size - install->done : sizeof(buffer);
+    
+    if (install->phase == INSTALL_WRITE) {
+        if (pwrite(install->fd, install->image + install->done, n, (off_t)install->done) != (ssize_t)n) {
+            fprintf(stderr, "[OTA] Write to slot %c failed\n", install->slot == BOOT_SLOT_A ? 'A' : 'B');
+            ota_install_abort(install);
+            return -1;
+        }
+        install->done += n;
+        if (install->done == install->size) {
+            if (fsync(install->fd) != 0) {
+                ota_install_abort(install);
+                return -1;
+            }
+            install->phase = INSTALL_VERIFY;
+            install->done = 0;
+        }
+        return 1;
+    }
+    
+    /* read back what the slot holds now, not what was handed to write */
+    if (pread(install->fd, buffer, n, (off_t)install->done) != (ssize_t)n ||
+        memcmp(buffer, install->image + install->done, n) != 0) {
+        fprintf(stderr, "[OTA] Slot %c does not read back\n", install->slot == BOOT_SLOT_A ? 'A' : 'B');
+        ota_install_abort(install);
+        return -1;
+    }
+    install->done += n;
+    if (install->done < install->size) {
+        return 1;
+    }
+    
+    /* someone else flipped the record meanwhile, this slot may be live */
+    read_control(&control);
+    if (control.sequence != install->sequence || write_control(&control, install->slot) != 0) {
+        fprintf(stderr, "[OTA] Could not switch the boot-control record\n");
+        ota_install_abort(install);
+        return -1;
+    }
+    
+    close(install->fd);
+    install->fd = -1;
+    install->phase = INSTALL_DONE;
+    return 0;
+}
+
+void ota_install_abort(ota_install_t *install)
+{
+    /* the record still points at the running slot, nothing to undo */
+    if (install && install->fd >= 0) {
+        close(install->fd);
+        install->fd = -1;
+    }
+}
+
+int ota_install_firmware(const uint8_t *firmware, size_t size)
+{
+    const struct timespec pause = {
+        OTA_INSTALL_STEP_DELAY_MS / 1000, (OTA_INSTALL_STEP_DELAY_MS % 1000) * 1000000L
+    };
+    ota_install_t install;
+    int ret;
+    
+    if (ota_install_begin(&install, firmware, size) != 0) {
+        return -1;
+    }
+    
+    /* throttled, other processes get the flash between steps */
+    while ((ret = ota_install_step(&install)) > 0) {
+        nanosleep(&pause, NULL);
+    }
+    
+    if (ret != 0) {
+        return -1;
+    }
+    
+    printf("[OTA] Firmware installed to slot %c, active on next boot\n",
+           install.slot == BOOT_SLOT_A ? 'A' : 'B');
+    return 0;
+}
@@ -1,17 +1,26 @@
 #include "ota.h"
 #include "boot_config.h"
+#include "crypto.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <curl/curl.h>
 
+// v1.5 - ota_install_firmware moved to install.c, A/B slots
+// v1.4 - Signatures checked with the algorithm the build selects
+// v1.3 - Downloads reuse the session's connection
+// v1.2 - Streaming download into the slot, hashed as it arrives;
+//        the in-memory buffer grows geometrically
 // v1.1 - Added better error handling (2024-05-15)
 // v1.0 - Initial OTA client implementation
 
+extern uint8_t boot_public_key[];
+
 struct MemoryStruct {
     char *memory;
     size_t size;
+    size_t capacity;
 };
 
 static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
@@ -19,12 +28,24 @@ static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, voi
     size_t realsize = size * nmemb;
     struct MemoryStruct *mem = (struct MemoryStruct *)userp;
     
-    char *ptr = realloc(mem->memory, mem->size + realsize + 1);
-    if (!ptr) {
-        return 0;
+    /* doubling keeps the copying linear in the image size */
+    if (mem->size + realsize + 1 > mem->capacity) {
+        size_t capacity = mem->capacity ? mem->capacity : 4096;
+        char *ptr;
+        
+        while (capacity < mem->size + realsize + 1) {
+            capacity *= 2;
+        }
+        
+        ptr = realloc(mem->memory, capacity);
+        if (!ptr) {
+            return 0;
+        }
+        
+        mem->memory = ptr;
+        mem->capacity = capacity;
     }
     
-    mem->memory = ptr;
     memcpy(&(mem->memory[mem->size]), contents, realsize);
     mem->size += realsize;
     mem->memory[mem->size] = 0;
@@ -32,21 +53,17 @@ static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, voi
     return realsize;
 }
 
-int ota_download_firmware(const char *server_url, const char *version,
-                         uint8_t **firmware_data, size_t *firmware_size)
+int ota_download_firmware(ota_session_t *session, const char *server_url, const char *version,
+                          uint8_t **firmware_data, size_t *firmware_size)
 {
     CURL *curl;
     CURLcode res;
     struct MemoryStruct chunk;
     char url[512];
     
-    chunk.memory = malloc(1);
+    chunk.memory = NULL;
     chunk.size = 0;
-    
-    curl = curl_easy_init();
-    if (!curl) {
-        return -1;
-    }
+    chunk.capacity = 0;
     
     /* Build URL - TODO: Add URL validation */
     snprintf(url, sizeof(url), "%s/api/firmware/download?version=%s",
@@ -54,60 +71,151 @@ int ota_download_firmware(const char *server_url, const char *version,
     
     // FIXME: URL size check - 512 might not be enough
     
-    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl = ota_session_begin(session, url);
+    if (!curl) {
+        return -1;
+    }
+    
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, OTA_DOWNLOAD_TIMEOUT_MS / 1000);
     
     res = curl_easy_perform(curl);
+    ota_session_end(session, curl);
     
     if (res != CURLE_OK) {
         fprintf(stderr, "curl_easy_perform() failed: %s\n",
                 curl_easy_strerror(res));
         free(chunk.memory);
-        curl_easy_cleanup(curl);
         return -1;
     }
     
     *firmware_data = (uint8_t *)chunk.memory;
     *firmware_size = chunk.size;
     
-    curl_easy_cleanup(curl);
     return 0;
 }
 
-int ota_verify_firmware(const uint8_t *firmware, size_t size,
-                       const uint8_t *signature, size_t sig_len)
+/* Download in progress: every chunk is hashed and written, nothing is kept */
+struct StreamStruct {
+    FILE *slot;
+    crypto_sha256_ctx_t sha;
+    size_t size;
+};
+
+static size_t WriteStreamCallback(void *contents, size_t size, size_t nmemb, void *userp)
 {
-    /* Verify signature using crypto library */
-    extern uint8_t boot_public_key[];
+    size_t realsize = size * nmemb;
+    struct StreamStruct *stream = (struct StreamStruct *)userp;
+    
+    /* anything short of realsize makes curl abort the transfer */
+    if (realsize > MAX_FIRMWARE_SIZE - stream->size) {
+        fprintf(stderr, "[OTA] Image larger than %d bytes\n", MAX_FIRMWARE_SIZE);
+        return 0;
+    }
+    
+    if (crypto_sha256_update(&stream->sha, contents, realsize) != CRYPTO_SUCCESS) {
+        return 0;
+    }
     
-    return crypto_verify_rsa(firmware, size, signature, sig_len,
-                           boot_public_key, BOOT_PUBLIC_KEY_SIZE);
+    if (fwrite(contents, 1, realsize, stream->slot) != realsize) {
+        return 0;
+    }
+    
+    stream->size += realsize;
+    return realsize;
 }
 
-int ota_install_firmware(const uint8_t *firmware, size_t size)
+int ota_stream_firmware(ota_session_t *session, const char *server_url, const char *version,
+                        const uint8_t *signature, size_t sig_len,
+                        const char *slot_path, size_t *firmware_size)
 {
-    FILE *fp;
-    const char *firmware_path = "/tmp/firmware_update.bin";
+    CURL *curl;
+    CURLcode res;
+    struct StreamStruct stream;
+    crypto_verifier_t verifier;
+    uint8_t hash[SHA256_HASH_SIZE];
+    char url[512];
+    int ret = -1;
     
-    /* Write firmware to temporary location */
-    fp = fopen(firmware_path, "wb");
-    if (!fp) {
+    if (!server_url || !signature || !slot_path) {
         return -1;
     }
     
-    if (fwrite(firmware, 1, size, fp) != size) {
-        fclose(fp);
+    /* parse the key before spending the link on the download */
+    if (crypto_verifier_init(&verifier, boot_public_key, BOOT_PUBLIC_KEY_SIZE) != CRYPTO_SUCCESS) {
         return -1;
     }
     
-    fclose(fp);
+    stream.size = 0;
+    stream.slot = fopen(slot_path, "wb");
+    if (!stream.slot) {
+        crypto_verifier_free(&verifier);
+        return -1;
+    }
+    
+    if (crypto_sha256_init(&stream.sha) != CRYPTO_SUCCESS) {
+        fclose(stream.slot);
+        crypto_verifier_free(&verifier);
+        return -1;
+    }
     
-    /* TODO: Flash firmware to device */
-    printf("[OTA] Firmware downloaded to %s\n", firmware_path);
-    printf("[OTA] Ready to flash firmware\n");
+    snprintf(url, sizeof(url), "%s/api/firmware/download?version=%s",
+             server_url, version ? version : "latest");
     
-    return 0;
+    /* the session sets FAILONERROR, an error page never reaches the slot */
+    curl = ota_session_begin(session, url);
+    if (!curl) {
+        crypto_sha256_free(&stream.sha);
+        fclose(stream.slot);
+        crypto_verifier_free(&verifier);
+        return -1;
+    }
+    
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteStreamCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&stream);
+    
+    res = curl_easy_perform(curl);
+    ota_session_end(session, curl);
+    
+    if (res != CURLE_OK) {
+        fprintf(stderr, "curl_easy_perform() failed: %s\n",
+                curl_easy_strerror(res));
+        crypto_sha256_free(&stream.sha);
+    } else if (crypto_sha256_final(&stream.sha, hash) != CRYPTO_SUCCESS ||
+               crypto_verifier_verify_hash(&verifier, hash, signature, sig_len) != CRYPTO_SUCCESS) {
+        fprintf(stderr, "[OTA] Signature verification failed\n");
+    } else if (fflush(stream.slot) != 0 || fsync(fileno(stream.slot)) != 0) {
+        fprintf(stderr, "[OTA] Could not flush %s\n", slot_path);
+    } else {
+        ret = 0;
+    }
+    
+    /*
+     * Never leave a partial or unverified image in the slot. Truncated
+     * once closed: what stdio still buffered would otherwise be written
+     * back past the truncation.
+     */
+    fclose(stream.slot);
+    if (ret != 0 && truncate(slot_path, 0) != 0) {
+        fprintf(stderr, "[OTA] Could not clear %s\n", slot_path);
+    }
+    crypto_verifier_free(&verifier);
+    
+    if (ret == 0) {
+        printf("[OTA] Firmware verified and written to %s (%zu bytes)\n", slot_path, stream.size);
+        if (firmware_size) {
+            *firmware_size = stream.size;
+        }
+    }
+    
+    return ret;
+}
+
+int ota_verify_firmware(const uint8_t *firmware, size_t size,
+                       const uint8_t *signature, size_t sig_len)
+{
+    /* RSA or ECDSA, whichever BOOT_SIGNATURE_ALGORITHM the bootloader uses */
+    return crypto_verify_signature(firmware, size, signature, sig_len,
+                                   boot_public_key, BOOT_PUBLIC_KEY_SIZE);
 }
 
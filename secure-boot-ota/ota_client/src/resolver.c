@@ -0,0 +1,542 @@
+/* clock_gettime, getrandom and strncasecmp for host builds */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include "ota.h"
+#include "boot_config.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// v1.0 - Caching stub resolver for the update server's name
+// One A query per name over a connected UDP socket; the kernel drops
+// datagrams from anyone but the nameserver, random IDs and the echoed
+// question guard against the rest. Nothing blocks: a miss sends and
+// returns, answers are picked up by the next call into the resolver,
+// so a prefetch lands without anyone waiting for it. An entry whose TTL
+// ran out is asked for again before it is used, never served stale.
+
+#define DNS_HEADER_SIZE   12
+#define DNS_MSG_MAX       512
+#define DNS_TYPE_A        1
+#define DNS_TYPE_SOA      6
+#define DNS_CLASS_IN      1
+#define DNS_RCODE_NXDOMAIN 3
+
+enum {
+    DNS_EMPTY,
+    DNS_PENDING,        /* first query in flight, no address yet */
+    DNS_VALID,          /* may also have a refresh in flight */
+    DNS_NEGATIVE,
+    DNS_FAILED,         /* gave up; reported once, then freed */
+};
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static int nameserver_from_resolv_conf(struct in_addr *addr)
+{
+    char line[256], ns[64];
+    FILE *fp = fopen("/etc/resolv.conf", "r");
+    int found = -1;
+    
+    if (!fp) {
+        return -1;
+    }
+    while (found < 0 && fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, " nameserver %63s", ns) == 1 && inet_pton(AF_INET, ns, addr) == 1) {
+            found = 0;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+static int lookup_hosts(const char *name, uint32_t *addr)
+{
+    char line[512];
+    FILE *fp = fopen("/etc/hosts", "r");
+    int found = -1;
+    
+    if (!fp) {
+        return -1;
+    }
+    while (found < 0 && fgets(line, sizeof(line), fp)) {
+        char *save, *tok;
+        struct in_addr in;
+    
+        line[strcspn(line, "#")] = '\0';
+        tok = strtok_r(line, " \t\r\n", &save);
+        if (!tok || inet_pton(AF_INET, tok, &in) != 1) {
+            continue;           /* IPv6 lines included */
+        }
+        while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+            if (strcasecmp(tok, name) == 0) {
+                *addr = in.s_addr;
+                found = 0;
+                break;
+            }
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+int ota_resolver_init(ota_resolver_t *resolver, const char *nameserver, uint16_t port)
+{
+    struct sockaddr_in sa;
+    int fd;
+    
+    if (!resolver) {
+        return -1;
+    }
+    memset(resolver, 0, sizeof(*resolver));
+    resolver->fd = -1;
+    
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port ? port : 53);
+    if (nameserver ? inet_pton(AF_INET, nameserver, &sa.sin_addr) != 1
+                   : nameserver_from_resolv_conf(&sa.sin_addr) != 0) {
+        return -1;
+    }
+    
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    /* answers from any other address are dropped by the kernel */
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+        close(fd);
+        return -1;
+    }
+    
+    resolver->fd = fd;
+    return 0;
+}
+
+void ota_resolver_free(ota_resolver_t *resolver)
+{
+    if (!resolver) {
+        return;
+    }
+    if (resolver->fd >= 0) {
+        close(resolver->fd);
+    }
+    memset(resolver, 0, sizeof(*resolver));
+    resolver->fd = -1;
+}
+
+int ota_resolver_fd(const ota_resolver_t *resolver)
+{
+    return resolver ? resolver->fd : -1;
+}
+
+static ota_dns_entry_t *find_entry(ota_resolver_t *resolver, const char *name)
+{
+    int i;
+    
+    for (i = 0; i < OTA_DNS_CACHE_SIZE; i++) {
+        ota_dns_entry_t *e = &resolver->cache[i];
+    
+        if (e->state != DNS_EMPTY && strcasecmp(e->name, name) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* An empty entry, else the one expiring first that no caller waits on */
+static ota_dns_entry_t *new_entry(ota_resolver_t *resolver, const char *name)
+{
+    ota_dns_entry_t *victim = NULL;
+    int i;
+    
+    for (i = 0; i < OTA_DNS_CACHE_SIZE; i++) {
+        ota_dns_entry_t *e = &resolver->cache[i];
+    
+        if (e->state == DNS_EMPTY) {
+            victim = e;
+            break;
+        }
+        if (e->state == DNS_PENDING) {
+            continue;
+        }
+        if (!victim || e->expires_ms < victim->expires_ms) {
+            victim = e;
+        }
+    }
+    if (!victim) {
+        return NULL;
+    }
+    
+    memset(victim, 0, sizeof(*victim));
+    strcpy(victim->name, name);
+    return victim;
+}
+
+static int send_query(ota_resolver_t *resolver, ota_dns_entry_t *e)
+{
+    uint8_t msg[DNS_MSG_MAX];
+    const char *label = e->name;
+    size_t len = DNS_HEADER_SIZE;
+    
+    while (*label) {
+        size_t n = strcspn(label, ".");
+    
+        if (n == 0 || n > 63) {
+            return -1;
+        }
+        msg[len++] = (uint8_t)n;
+        memcpy(msg + len, label, n);
+        len += n;
+        label += n;
+        if (*label == '.') {
+            label++;
+        }
+    }
+    msg[len++] = 0;
+    msg[len++] = 0;
+    msg[len++] = DNS_TYPE_A;
+    msg[len++] = 0;
+    msg[len++] = DNS_CLASS_IN;
+    
+    if (e->tries == 0) {
+        /* a fresh unpredictable ID per query, kept across resends */
+        do {
+            if (getrandom(&e->query_id, sizeof(e->query_id), 0) != sizeof(e->query_id)) {
+                e->query_id = (uint16_t)(now_ms() * 2654435761u >> 16);
+            }
+        } while (e->query_id == 0);
+    }
+    msg[0] = (uint8_t)(e->query_id >> 8);
+    msg[1] = (uint8_t)e->query_id;
+    msg[2] = 0x01;              /* RD */
+    msg[3] = 0;
+    msg[4] = 0;
+    msg[5] = 1;                 /* one question */
+    memset(msg + 6, 0, 6);
+    
+    if (send(resolver->fd, msg, len, 0) != (ssize_t)len) {
+        e->query_id = 0;
+        return -1;
+    }
+    e->retry_ms = now_ms() + ((uint64_t)OTA_DNS_RETRY_MS << e->tries);
+    e->tries++;
+    return 0;
+}
+
+/* A name at *off, possibly compressed; moves *off past it */
+static int skip_name(const uint8_t *msg, size_t len, size_t *off)
+{
+    while (*off < len) {
+        uint8_t c = msg[*off];
+    
+        if (c == 0) {
+            (*off)++;
+            return 0;
+        }
+        if ((c & 0xc0) == 0xc0) {
+            if (*off + 2 > len) {
+                return -1;
+            }
+            *off += 2;
+            return 0;
+        }
+        if (c & 0xc0) {
+            return -1;
+        }
+        *off += 1 + c;
+    }
+    return -1;
+}
+
+/* The question echoed back must be ours, uncompressed as sent */
+static int question_matches(const uint8_t *msg, size_t len, size_t *off, const char *name)
+{
+    while (*off < len && msg[*off] != 0) {
+        size_t n = msg[*off];
+    
+        if (n > 63 || *off + 1 + n > len || strncasecmp((const char *)msg + *off + 1, name, n) != 0 ||
+            (name[n] != '.' && name[n] != '\0')) {
+            return 0;
+        }
+        name += n;
+        if (*name == '.') {
+            name++;
+        }
+        *off += 1 + n;
+    }
+    if (*off + 5 > len || *name != '\0') {
+        return 0;
+    }
+    *off += 1;
+    if (get16(msg + *off) != DNS_TYPE_A || get16(msg + *off + 2) != DNS_CLASS_IN) {
+        return 0;
+    }
+    *off += 4;
+    return 1;
+}
+
+static void cache_answer(ota_dns_entry_t *e, int state, uint32_t addr, uint32_t ttl)
+{
+    uint64_t now = now_ms();
+    uint64_t ttl_ms = (uint64_t)(ttl ? ttl : 1) * 1000;
+    
+    e->state = (uint8_t)state;
+    e->addr = addr;
+    e->expires_ms = now + ttl_ms;
+    e->refresh_ms = state == DNS_VALID ? e->expires_ms - ttl_ms * OTA_DNS_PREFETCH_PERCENT / 100
+                                       : e->expires_ms;
+    e->query_id = 0;
+    e->tries = 0;
+}
+
+/* A query that got no usable answer: the caller hears of it, a refresh
+ * just keeps the old address and tries again later */
+static void query_failed(ota_dns_entry_t *e)
+{
+    e->query_id = 0;
+    e->tries = 0;
+    if (e->state == DNS_PENDING) {
+        e->state = DNS_FAILED;
+    } else {
+        e->refresh_ms = now_ms() + OTA_DNS_RETRY_MS;
+    }
+}
+
+static void handle_answer(ota_resolver_t *resolver, const uint8_t *msg, size_t len)
+{
+    ota_dns_entry_t *e = NULL;
+    uint16_t id, ancount, nscount;
+    uint32_t ttl = 0, addr = 0, neg_ttl = OTA_DNS_NEG_TTL_DEFAULT;
+    size_t off = DNS_HEADER_SIZE;
+    int found = 0, rcode, i;
+    
+    if (len < DNS_HEADER_SIZE || !(msg[2] & 0x80) || get16(msg + 4) != 1) {
+        return;
+    }
+    id = get16(msg);
+    for (i = 0; i < OTA_DNS_CACHE_SIZE; i++) {
+        if (resolver->cache[i].query_id == id && resolver->cache[i].state != DNS_EMPTY) {
+            e = &resolver->cache[i];
+            break;
+        }
+    }
+    if (!e || !question_matches(msg, len, &off, e->name)) {
+        return;
+    }
+    
+    rcode = msg[3] & 0x0f;
+    if (rcode != 0 && rcode != DNS_RCODE_NXDOMAIN) {
+        query_failed(e);
+        return;
+    }
+    ancount = get16(msg + 6);
+    nscount = get16(msg + 8);
+    
+    /* CNAMEs come first with a recursive server; the shortest A TTL wins */
+    for (i = 0; i < ancount; i++) {
+        uint16_t type, rdlen;
+        uint32_t rr_ttl;
+    
+        if (skip_name(msg, len, &off) != 0 || off + 10 > len) {
+            query_failed(e);
+            return;
+        }
+        type = get16(msg + off);
+        rr_ttl = get32(msg + off + 4);
+        rdlen = get16(msg + off + 8);
+        off += 10;
+        if (off + rdlen > len) {
+            query_failed(e);
+            return;
+        }
+        if (type == DNS_TYPE_A && get16(msg + off - 8) == DNS_CLASS_IN && rdlen == 4) {
+            if (!found || rr_ttl < ttl) {
+                ttl = rr_ttl;
+            }
+            if (!found) {
+                memcpy(&addr, msg + off, 4);
+            }
+            found = 1;
+        }
+        off += rdlen;
+    }
+    if (rcode == 0 && found) {
+        cache_answer(e, DNS_VALID, addr, ttl > OTA_DNS_TTL_MAX ? OTA_DNS_TTL_MAX : ttl);
+        return;
+    }
+    
+    /* NXDOMAIN or no A record: cached per RFC 2308, min(SOA TTL, MINIMUM) */
+    for (i = 0; i < nscount; i++) {
+        uint16_t type, rdlen;
+        size_t rdata;
+    
+        if (skip_name(msg, len, &off) != 0 || off + 10 > len) {
+            break;
+        }
+        type = get16(msg + off);
+        ttl = get32(msg + off + 4);
+        rdlen = get16(msg + off + 8);
+        off += 10;
+        rdata = off;
+        if (off + rdlen > len) {
+            break;
+        }
+        off += rdlen;
+        if (type != DNS_TYPE_SOA) {
+            continue;
+        }
+        /* MNAME, RNAME, then serial, refresh, retry, expire, minimum */
+        if (skip_name(msg, len, &rdata) != 0 || skip_name(msg, len, &rdata) != 0 || rdata + 20 > off) {
+            break;
+        }
+        neg_ttl = get32(msg + rdata + 16);
+        if (ttl < neg_ttl) {
+            neg_ttl = ttl;
+        }
+        break;
+    }
+    cache_answer(e, DNS_NEGATIVE, 0, neg_ttl > OTA_DNS_NEG_TTL_MAX ? OTA_DNS_NEG_TTL_MAX : neg_ttl);
+}
+
+void ota_resolver_process(ota_resolver_t *resolver)
+{
+    uint8_t msg[DNS_MSG_MAX];
+    uint64_t now;
+    ssize_t n;
+    int i;
+    
+    if (!resolver || resolver->fd < 0) {
+        return;
+    }
+    
+    while ((n = recv(resolver->fd, msg, sizeof(msg), 0)) >= 0) {
+        handle_answer(resolver, msg, (size_t)n);
+    }
+    
+    now = now_ms();
+    for (i = 0; i < OTA_DNS_CACHE_SIZE; i++) {
+        ota_dns_entry_t *e = &resolver->cache[i];
+    
+        if (!e->query_id || now < e->retry_ms) {
+            continue;
+        }
+        if (e->tries >= OTA_DNS_TRIES || send_query(resolver, e) != 0) {
+            query_failed(e);
+        }
+    }
+}
+
+int ota_resolve_start(ota_resolver_t *resolver, const char *name, uint32_t *addr)
+{
+    ota_dns_entry_t *e;
+    uint64_t now;
+    
+    if (!resolver || resolver->fd < 0 || !name || !addr || !*name || strlen(name) > OTA_DNS_NAME_MAX) {
+        return OTA_DNS_ERROR;
+    }
+    
+    ota_resolver_process(resolver);
+    now = now_ms();
+    
+    e = find_entry(resolver, name);
+    if (e) {
+        switch (e->state) {
+        case DNS_VALID:
+            if (now >= e->expires_ms) {
+                break;
+            }
+            *addr = e->addr;
+            if (now >= e->refresh_ms && !e->query_id && send_query(resolver, e) != 0) {
+                e->refresh_ms = now + OTA_DNS_RETRY_MS;
+            }
+            return OTA_DNS_OK;
+        case DNS_NEGATIVE:
+            if (now >= e->expires_ms) {
+                break;
+            }
+            return OTA_DNS_NXDOMAIN;
+        case DNS_PENDING:
+            return OTA_DNS_PENDING;
+        case DNS_FAILED:
+            e->state = DNS_EMPTY;
+            return OTA_DNS_ERROR;
+        }
+        /* expired: asked again, the old answer is not used meanwhile */
+        if (!e->query_id) {
+            e->tries = 0;
+            if (send_query(resolver, e) != 0) {
+                e->state = DNS_EMPTY;
+                return OTA_DNS_ERROR;
+            }
+        }
+        e->state = DNS_PENDING;
+        return OTA_DNS_PENDING;
+    }
+    
+    e = new_entry(resolver, name);
+    if (!e) {
+        return OTA_DNS_ERROR;
+    }
+    if (lookup_hosts(name, addr) == 0) {
+        cache_answer(e, DNS_VALID, *addr, OTA_DNS_HOSTS_TTL);
+        e->refresh_ms = e->expires_ms;     /* nothing to prefetch */
+        return OTA_DNS_OK;
+    }
+    e->state = DNS_PENDING;
+    if (send_query(resolver, e) != 0) {
+        e->state = DNS_EMPTY;
+        return OTA_DNS_ERROR;
+    }
+    return OTA_DNS_PENDING;
+}
+
+int ota_resolve(ota_resolver_t *resolver, const char *name, uint32_t *addr, int timeout_ms)
+{
+    uint64_t deadline = now_ms() + (timeout_ms > 0 ? timeout_ms : 0);
+    int ret;
+    
+    while ((ret = ota_resolve_start(resolver, name, addr)) == OTA_DNS_PENDING) {
+        struct pollfd pfd = { .fd = resolver->fd, .events = POLLIN };
+        uint64_t now = now_ms();
+        uint64_t wait;
+    
+        if (now >= deadline) {
+            return OTA_DNS_ERROR;   /* the query stays in flight for the next call */
+        }
+        wait = deadline - now;
+        if (wait > OTA_DNS_RETRY_MS) {
+            wait = OTA_DNS_RETRY_MS;    /* wake up for the resends */
+        }
+        if (poll(&pfd, 1, (int)wait) < 0 && errno != EINTR) {
+            return OTA_DNS_ERROR;
+        }
+    }
+    return ret;
+}
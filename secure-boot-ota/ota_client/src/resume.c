@@ -0,0 +1,570 @@
+#include "ota.h"
+#include "boot_config.h"
+#include "crypto.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <curl/curl.h>
+
+// v1.2 - Parallel ranges over several connections with curl multi
+// v1.1 - Manifest and ranges share the caller's session
+// v1.0 - Resumable download against a signed chunk manifest
+// The manifest lists a SHA-256 per chunk, so every chunk is checked on
+// its own and only the ones missing from the slot are fetched again,
+// with HTTP Range requests. The slot itself is the resume state: on
+// start, chunks already in it that match the manifest are kept.
+// With more than one connection the missing chunks are split into that
+// many ranges, fetched together and written at their own offsets.
+
+extern uint8_t boot_public_key[];
+
+struct ManifestBuffer {
+    uint8_t *data;
+    size_t size;
+    size_t limit;
+};
+
+static size_t WriteManifestCallback(void *contents, size_t size, size_t nmemb, void *userp)
+{
+    size_t realsize = size * nmemb;
+    struct ManifestBuffer *buf = (struct ManifestBuffer *)userp;
+    
+    if (realsize > buf->limit - buf->size) {
+        return 0;
+    }
+    
+    memcpy(buf->data + buf->size, contents, realsize);
+    buf->size += realsize;
+    return realsize;
+}
+
+/* Range transfer of chunks [chunk, end_chunk), each one checked as it completes */
+struct RangeStruct {
+    CURL *curl;
+    FILE *slot;
+    const ota_manifest_t *manifest;
+    uint8_t *have;
+    uint8_t *buffer;                /* one chunk */
+    size_t fill;
+    uint32_t chunk;
+    uint32_t end_chunk;
+    int checked_status;
+    int range_ignored;              /* the server answered 200 */
+    size_t skip;                    /* bytes before the range in a 200 body */
+};
+
+static uint32_t read_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static size_t chunk_length(const ota_manifest_t *manifest, uint32_t chunk)
+{
+    size_t offset = (size_t)chunk * manifest->chunk_size;
+    size_t left = manifest->image_size - offset;
+    
+    return left < manifest->chunk_size ? left : manifest->chunk_size;
+}
+
+static int chunk_matches(const ota_manifest_t *manifest, uint32_t chunk,
+                         const uint8_t *data, size_t len)
+{
+    uint8_t hash[SHA256_HASH_SIZE];
+    
+    if (crypto_hash_sha256(data, len, hash) != CRYPTO_SUCCESS) {
+        return 0;
+    }
+    
+    return crypto_compare_ct(hash, manifest->chunk_hashes + (size_t)chunk * SHA256_HASH_SIZE,
+                             SHA256_HASH_SIZE) == 0;
+}
+
+int ota_manifest_parse(const uint8_t *data, size_t len, ota_manifest_t *manifest)
+{
+    size_t body_len;
+    uint8_t hash[SHA256_HASH_SIZE];
+    
+    if (!data || !manifest || len < OTA_MANIFEST_HEADER_SIZE) {
+        return -1;
+    }
+    
+    if (read_le32(data) != OTA_MANIFEST_MAGIC) {
+        return -1;
+    }
+    
+    manifest->image_size = read_le32(data + 4);
+    manifest->chunk_size = read_le32(data + 8);
+    manifest->chunk_count = read_le32(data + 12);
+    memcpy(manifest->image_hash, data + 16, SHA256_HASH_SIZE);
+    
+    /* the chunk buffer is sized from this, keep it bounded */
+    if (manifest->image_size == 0 || manifest->image_size > MAX_FIRMWARE_SIZE ||
+        manifest->chunk_size < OTA_CHUNK_SIZE_MIN || manifest->chunk_size > OTA_CHUNK_SIZE_MAX ||
+        manifest->chunk_count != (manifest->image_size + manifest->chunk_size - 1) / manifest->chunk_size) {
+        return -1;
+    }
+    
+    body_len = OTA_MANIFEST_HEADER_SIZE + (size_t)manifest->chunk_count * SHA256_HASH_SIZE;
+    if (len <= body_len) {
+        return -1;
+    }
+    
+    /* signature over header and hash list follows them */
+    if (crypto_hash_sha256(data, body_len, hash) != CRYPTO_SUCCESS ||
+        crypto_verify_signature_hash(hash, data + body_len, len - body_len,
+                                     boot_public_key, BOOT_PUBLIC_KEY_SIZE) != CRYPTO_SUCCESS) {
+        return -1;
+    }
+    
+    manifest->chunk_hashes = data + OTA_MANIFEST_HEADER_SIZE;
+    return 0;
+}
+
+static int fetch_manifest(CURL *curl, const char *server_url, const char *version,
+                          struct ManifestBuffer *buf)
+{
+    char url[512];
+    CURLcode res;
+    
+    snprintf(url, sizeof(url), "%s/api/firmware/manifest?version=%s",
+             server_url, version ? version : "latest");
+    
+    buf->size = 0;
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteManifestCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)buf);
+    curl_easy_setopt(curl, CURLOPT_RANGE, NULL);
+    
+    res = curl_easy_perform(curl);
+    if (res != CURLE_OK) {
+        fprintf(stderr, "[OTA] Manifest download failed: %s\n", curl_easy_strerror(res));
+        return -1;
+    }
+    
+    return 0;
+}
+
+static size_t WriteRangeCallback(void *contents, size_t size, size_t nmemb, void *userp)
+{
+    size_t realsize = size * nmemb;
+    struct RangeStruct *range = (struct RangeStruct *)userp;
+    const uint8_t *p = (const uint8_t *)contents;
+    size_t left = realsize;
+    
+    /* a server ignoring Range sends the image from offset 0, the part
+     * before the range is skipped */
+    if (!range->checked_status) {
+        long status = 0;
+    
+        curl_easy_getinfo(range->curl, CURLINFO_RESPONSE_CODE, &status);
+        if (status != 206 && status != 200) {
+            return 0;
+        }
+        range->range_ignored = status == 200;
+        range->skip = range->range_ignored ? (size_t)range->chunk * range->manifest->chunk_size : 0;
+        range->checked_status = 1;
+    }
+    
+    if (range->skip > 0) {
+        size_t n = range->skip < left ? range->skip : left;
+    
+        range->skip -= n;
+        p += n;
+        left -= n;
+    }
+    
+    while (left > 0) {
+        size_t len;
+        size_t n;
+    
+        if (range->chunk >= range->end_chunk) {
+            return 0;
+        }
+    
+        len = chunk_length(range->manifest, range->chunk);
+        n = len - range->fill < left ? len - range->fill : left;
+        memcpy(range->buffer + range->fill, p, n);
+        range->fill += n;
+        p += n;
+        left -= n;
+    
+        if (range->fill < len) {
+            break;
+        }
+    
+        /* a bad chunk ends this attempt, the retry asks for it again */
+        if (!chunk_matches(range->manifest, range->chunk, range->buffer, len)) {
+            fprintf(stderr, "[OTA] Chunk %u failed its hash\n", (unsigned)range->chunk);
+            return 0;
+        }
+    
+        if (fseek(range->slot, (long)range->chunk * range->manifest->chunk_size, SEEK_SET) != 0 ||
+            fwrite(range->buffer, 1, len, range->slot) != len) {
+            return 0;
+        }
+    
+        range->have[range->chunk] = 1;
+        range->chunk++;
+        range->fill = 0;
+    }
+    
+    return realsize;
+}
+
+/* Mark the chunks the slot already holds from an interrupted run */
+static uint32_t scan_slot(FILE *slot, const ota_manifest_t *manifest,
+                          uint8_t *have, uint8_t *buffer)
+{
+    uint32_t present = 0;
+    
+    for (uint32_t i = 0; i < manifest->chunk_count; i++) {
+        size_t len = chunk_length(manifest, i);
+    
+        if (fseek(slot, (long)i * manifest->chunk_size, SEEK_SET) != 0 ||
+            fread(buffer, 1, len, slot) != len) {
+            break;
+        }
+    
+        if (chunk_matches(manifest, i, buffer, len)) {
+            have[i] = 1;
+            present++;
+        }
+    }
+    
+    return present;
+}
+
+static int image_matches(FILE *slot, const ota_manifest_t *manifest, uint8_t *buffer)
+{
+    crypto_sha256_ctx_t sha;
+    uint8_t hash[SHA256_HASH_SIZE];
+    
+    if (crypto_sha256_init(&sha) != CRYPTO_SUCCESS) {
+        return 0;
+    }
+    
+    for (uint32_t i = 0; i < manifest->chunk_count; i++) {
+        size_t len = chunk_length(manifest, i);
+    
+        if (fseek(slot, (long)i * manifest->chunk_size, SEEK_SET) != 0 ||
+            fread(buffer, 1, len, slot) != len ||
+            crypto_sha256_update(&sha, buffer, len) != CRYPTO_SUCCESS) {
+            crypto_sha256_free(&sha);
+            return 0;
+        }
+    }
+    
+    if (crypto_sha256_final(&sha, hash) != CRYPTO_SUCCESS) {
+        return 0;
+    }
+    
+    return crypto_compare_ct(hash, manifest->image_hash, SHA256_HASH_SIZE) == 0;
+}
+
+static void start_range(struct RangeStruct *range, uint32_t first, uint32_t last)
+{
+    const ota_manifest_t *manifest = range->manifest;
+    char range_spec[48];
+    
+    snprintf(range_spec, sizeof(range_spec), "%zu-%zu",
+             (size_t)first * manifest->chunk_size,
+             (size_t)last * manifest->chunk_size + chunk_length(manifest, last) - 1);
+    /* libcurl copies the string */
+    curl_easy_setopt(range->curl, CURLOPT_RANGE, range_spec);
+    
+    range->chunk = first;
+    range->end_chunk = last + 1;
+    range->fill = 0;
+    range->checked_status = 0;
+    range->range_ignored = 0;
+    range->skip = 0;
+}
+
+/* Run the ranges together, the result is the first failure if any */
+static CURLcode perform_ranges(CURLM *multi, struct RangeStruct *ranges, int count)
+{
+    CURLcode result = CURLE_OK;
+    CURLMsg *msg;
+    int running = 0;
+    int left;
+    
+    if (count == 1) {
+        return curl_easy_perform(ranges[0].curl);
+    }
+    
+    for (int i = 0; i < count; i++) {
+        curl_multi_add_handle(multi, ranges[i].curl);
+    }
+    
+    do {
+        CURLMcode mc = curl_multi_perform(multi, &running);
+    
+        if (mc == CURLM_OK && running) {
+            mc = curl_multi_poll(multi, NULL, 0, 1000, NULL);
+        }
+        if (mc != CURLM_OK) {
+            result = CURLE_RECV_ERROR;
+            break;
+        }
+    } while (running);
+    
+    while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+        if (msg->msg == CURLMSG_DONE && msg->data.result != CURLE_OK && result == CURLE_OK) {
+            result = msg->data.result;
+        }
+    }
+    
+    for (int i = 0; i < count; i++) {
+        curl_multi_remove_handle(multi, ranges[i].curl);
+    }
+    
+    return result;
+}
+
+static int download_chunks(ota_session_t *session, const char *server_url, const char *version,
+                           const char *slot_path, int connections, size_t *firmware_size)
+{
+    CURL *curl;
+    CURLM *multi = NULL;
+    FILE *slot;
+    struct ManifestBuffer manifest_buf;
+    struct RangeStruct *ranges = NULL;
+    ota_manifest_t manifest;
+    struct stat st;
+    uint8_t *have = NULL;
+    uint32_t remaining;
+    int handles = 0;
+    int attempts = 0;
+    int ret = -1;
+    char url[512];
+    
+    if (!server_url || !slot_path) {
+        return -1;
+    }
+    
+    /* the URL is set per request, manifest first, then the image; the
+     * server's is given here so the session resolves its name */
+    curl = ota_session_begin(session, server_url);
+    if (!curl) {
+        return -1;
+    }
+    
+    manifest_buf.limit = OTA_MANIFEST_MAX_SIZE;
+    manifest_buf.data = malloc(manifest_buf.limit);
+    if (!manifest_buf.data) {
+        ota_session_end(session, curl);
+        return -1;
+    }
+    
+    /* the manifest is small, a dropped link just means fetching it again */
+    while (fetch_manifest(curl, server_url, version, &manifest_buf) != 0) {
+        if (++attempts >= OTA_MAX_RETRIES) {
+            goto out;
+        }
+        sleep(1u << attempts);
+    }
+    
+    if (ota_manifest_parse(manifest_buf.data, manifest_buf.size, &manifest) != 0) {
+        fprintf(stderr, "[OTA] Manifest rejected\n");
+        goto out;
+    }
+    
+    if (connections < 1) {
+        connections = 1;
+    }
+    if ((uint32_t)connections > manifest.chunk_count) {
+        connections = (int)manifest.chunk_count;
+    }
+    
+    have = calloc(manifest.chunk_count, 1);
+    ranges = calloc((size_t)connections, sizeof(*ranges));
+    if (!have || !ranges) {
+        goto out;
+    }
+    
+    snprintf(url, sizeof(url), "%s/api/firmware/download?version=%s",
+             server_url, version ? version : "latest");
+    
+    /* one chunk buffer and handle per connection; whatever does not fit on
+     * a constrained device just means fewer connections, down to one */
+    for (int i = 0; i < connections; i++) {
+        ranges[i].buffer = malloc(manifest.chunk_size);
+        ranges[i].curl = i == 0 ? curl : ota_session_extra(session, url);
+        if (!ranges[i].buffer || !ranges[i].curl) {
+            free(ranges[i].buffer);
+            ranges[i].buffer = NULL;
+            ranges[i].curl = NULL;
+            break;
+        }
+        handles++;
+    }
+    connections = handles;
+    if (connections == 0) {
+        goto out;
+    }
+    if (connections > 1) {
+        multi = curl_multi_init();
+        if (!multi) {
+            connections = 1;
+        } else {
+            /* the point is one congestion window per range, so no
+             * multiplexing them onto a single connection */
+            curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_NOTHING);
+        }
+    }
+    
+    /* keep what an earlier run left, create the slot otherwise */
+    slot = fopen(slot_path, "r+b");
+    if (!slot) {
+        slot = fopen(slot_path, "w+b");
+    }
+    if (!slot) {
+        goto out;
+    }
+    
+    /* ranges land out of order, reserve the whole image up front */
+    if (fstat(fileno(slot), &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size < (off_t)manifest.image_size &&
+        posix_fallocate(fileno(slot), 0, (off_t)manifest.image_size) != 0) {
+        fprintf(stderr, "[OTA] Could not reserve %u bytes in %s\n",
+                (unsigned)manifest.image_size, slot_path);
+        fclose(slot);
+        goto out;
+    }
+    
+    remaining = manifest.chunk_count - scan_slot(slot, &manifest, have, ranges[0].buffer);
+    if (remaining != manifest.chunk_count) {
+        printf("[OTA] Resuming, %u of %u chunks already in the slot\n",
+               (unsigned)(manifest.chunk_count - remaining), (unsigned)manifest.chunk_count);
+    }
+    
+    for (int i = 0; i < connections; i++) {
+        curl_easy_setopt(ranges[i].curl, CURLOPT_URL, url);
+        curl_easy_setopt(ranges[i].curl, CURLOPT_WRITEFUNCTION, WriteRangeCallback);
+        curl_easy_setopt(ranges[i].curl, CURLOPT_WRITEDATA, (void *)&ranges[i]);
+        /* open its own connection instead of waiting for the first */
+        curl_easy_setopt(ranges[i].curl, CURLOPT_PIPEWAIT, connections > 1 ? 0L : 1L);
+        ranges[i].slot = slot;
+        ranges[i].manifest = &manifest;
+        ranges[i].have = have;
+    }
+    
+    attempts = 0;
+    while (remaining > 0) {
+        uint32_t before = remaining;
+        uint32_t per = (remaining + (uint32_t)connections - 1) / (uint32_t)connections;
+        uint32_t next = 0;
+        int used = 0;
+        CURLcode res;
+    
+        /* runs of missing chunks, the long ones cut so that every
+         * connection gets about the same share */
+        while (used < connections) {
+            uint32_t first = next;
+            uint32_t last;
+    
+            while (first < manifest.chunk_count && have[first]) {
+                first++;
+            }
+            if (first >= manifest.chunk_count) {
+                break;
+            }
+            last = first;
+            while (last + 1 < manifest.chunk_count && !have[last + 1] && last + 1 - first < per) {
+                last++;
+            }
+    
+            start_range(&ranges[used++], first, last);
+            next = last + 1;
+        }
+    
+        res = perform_ranges(multi, ranges, used);
+    
+        remaining = 0;
+        for (uint32_t i = 0; i < manifest.chunk_count; i++) {
+            remaining += !have[i];
+        }
+    
+        /* without Range support every connection resends the whole
+         * image, one stream is the best left */
+        for (int i = 0; i < used; i++) {
+            if (ranges[i].range_ignored && connections > 1) {
+                printf("[OTA] Server ignores Range, falling back to one stream\n");
+                connections = 1;
+            }
+        }
+    
+        if (res == CURLE_OK && remaining < before) {
+            continue;
+        }
+    
+        /* only attempts that got nothing through count against the limit */
+        if (remaining < before) {
+            attempts = 0;
+        } else if (++attempts >= OTA_MAX_RETRIES) {
+            fprintf(stderr, "[OTA] Giving up, %u chunks missing: %s\n",
+                    (unsigned)remaining, curl_easy_strerror(res));
+            fclose(slot);
+            goto out;
+        }
+    
+        if (res != CURLE_OK) {
+            sleep(1u << attempts);
+        }
+    }
+    
+    /* a larger image from before must not trail the new one */
+    if (fstat(fileno(slot), &st) == 0 && S_ISREG(st.st_mode) &&
+        ftruncate(fileno(slot), manifest.image_size) != 0) {
+        fprintf(stderr, "[OTA] Could not trim %s\n", slot_path);
+    }
+    
+    if (!image_matches(slot, &manifest, ranges[0].buffer)) {
+        fprintf(stderr, "[OTA] Image hash mismatch\n");
+    } else if (fflush(slot) != 0 || fsync(fileno(slot)) != 0) {
+        fprintf(stderr, "[OTA] Could not flush %s\n", slot_path);
+    } else {
+        printf("[OTA] Firmware written to %s (%u bytes)\n", slot_path, (unsigned)manifest.image_size);
+        if (firmware_size) {
+            *firmware_size = manifest.image_size;
+        }
+        ret = 0;
+    }
+    
+    fclose(slot);
+    
+out:
+    if (multi) {
+        curl_multi_cleanup(multi);
+    }
+    if (ranges) {
+        /* ranges[0] runs on the session's own handle, released below */
+        for (int i = 0; i < handles; i++) {
+            if (i > 0) {
+                ota_session_end(session, ranges[i].curl);
+            }
+            free(ranges[i].buffer);
+        }
+        free(ranges);
+    }
+    free(have);
+    free(manifest_buf.data);
+    ota_session_end(session, curl);
+    return ret;
+}
+
+int ota_download_resumable(ota_session_t *session, const char *server_url, const char *version,
+                           const char *slot_path, size_t *firmware_size)
+{
+    return download_chunks(session, server_url, version, slot_path, 1, firmware_size);
+}
+
+int ota_download_parallel(ota_session_t *session, const char *server_url, const char *version,
+                          const char *slot_path, int connections, size_t *firmware_size)
+{
+    return download_chunks(session, server_url, version, slot_path, connections, firmware_size);
+}
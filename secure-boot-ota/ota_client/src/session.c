@@ -0,0 +1,214 @@
+#include "ota.h"
+#include "boot_config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <curl/curl.h>
+
+// v1.2 - Server name resolved by the session's own caching resolver
+// v1.1 - Extra handles on the same share for parallel transfers
+// v1.0 - One connection for a whole update
+// Manifest, image, signature and delta requests all go through the same
+// easy handle, which keeps its connection open between them, and a share
+// handle holding the DNS cache and the TLS session tickets. So only the
+// first request of an update pays for the resolve and the handshake,
+// and over HTTP/2 the requests share one stream-multiplexed connection.
+// The client is single-threaded, the share needs no lock callbacks.
+// The server's address comes from the session's resolver, which keeps it
+// for its TTL and refreshes it ahead of expiry, and is pinned for curl
+// with CURLOPT_RESOLVE; without a nameserver curl resolves as before.
+
+/* Host and port of an http(s) URL, -1 if there is no name to resolve */
+static int url_host(const char *url, char *host, size_t host_size, int *port)
+{
+    const char *p, *end, *colon;
+    size_t len;
+    struct in_addr literal;
+    
+    p = strstr(url, "://");
+    if (!p) {
+        return -1;
+    }
+    *port = strncmp(url, "https", 5) == 0 ? 443 : 80;
+    p += 3;
+    end = p + strcspn(p, "/?#");
+    /* userinfo, and IPv6 literals, which need no resolving either */
+    if (memchr(p, '@', end - p) || *p == '[') {
+        return -1;
+    }
+    colon = memchr(p, ':', end - p);
+    if (colon) {
+        *port = atoi(colon + 1);
+        end = colon;
+    }
+    len = end - p;
+    if (len == 0 || len >= host_size || *port <= 0 || *port > 65535) {
+        return -1;
+    }
+    memcpy(host, p, len);
+    host[len] = '\0';
+    return inet_pton(AF_INET, host, &literal) == 1 ? -1 : 0;
+}
+
+/*
+ * Replace the session's CURLOPT_RESOLVE list with the current address of
+ * url's host. -1 only for a name known not to exist; any other failure
+ * leaves the resolving to curl.
+ */
+static int pin_address(ota_session_t *session, const char *url)
+{
+    char host[OTA_DNS_NAME_MAX + 1];
+    char entry[OTA_DNS_NAME_MAX + 32];
+    char addr_str[INET_ADDRSTRLEN];
+    uint32_t addr;
+    int port, ret;
+    
+    /* the previous transfer is over, the share's cache holds its entry */
+    curl_slist_free_all(session->resolve);
+    session->resolve = NULL;
+    
+    if (!session->resolver || !url || url_host(url, host, sizeof(host), &port) != 0) {
+        return 0;
+    }
+    
+    ret = ota_resolve(session->resolver, host, &addr, OTA_DNS_TIMEOUT_MS);
+    if (ret == OTA_DNS_NXDOMAIN) {
+        fprintf(stderr, "[OTA] %s does not resolve\n", host);
+        return -1;
+    }
+    if (ret != OTA_DNS_OK) {
+        return 0;
+    }
+    
+    inet_ntop(AF_INET, &addr, addr_str, sizeof(addr_str));
+    snprintf(entry, sizeof(entry), "%s:%d:%s", host, port, addr_str);
+    session->resolve = curl_slist_append(NULL, entry);
+    return 0;
+}
+
+static void apply_defaults(CURL *curl, CURLSH *share, struct curl_slist *resolve, const char *url)
+{
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, OTA_DOWNLOAD_TIMEOUT_MS / 1000);
+    /* an error page must never be taken for image data */
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    /* HTTP/2 when ALPN offers it, HTTP/1.1 keep-alive otherwise */
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    if (share) {
+        curl_easy_setopt(curl, CURLOPT_SHARE, share);
+    }
+    if (resolve) {
+        curl_easy_setopt(curl, CURLOPT_RESOLVE, resolve);
+    }
+}
+
+int ota_session_init(ota_session_t *session)
+{
+    if (!session) {
+        return -1;
+    }
+    
+    memset(session, 0, sizeof(*session));
+    
+    session->share = curl_share_init();
+    if (!session->share) {
+        return -1;
+    }
+    
+    if (curl_share_setopt(session->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS) != CURLSHE_OK ||
+        curl_share_setopt(session->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION) != CURLSHE_OK ||
+        curl_share_setopt(session->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT) != CURLSHE_OK) {
+        curl_share_cleanup(session->share);
+        session->share = NULL;
+        return -1;
+    }
+    
+    session->curl = curl_easy_init();
+    if (!session->curl) {
+        curl_share_cleanup(session->share);
+        session->share = NULL;
+        return -1;
+    }
+    
+    /* no nameserver to ask: curl keeps doing the resolving */
+    session->resolver = malloc(sizeof(ota_resolver_t));
+    if (session->resolver && ota_resolver_init(session->resolver, NULL, 0) != 0) {
+        free(session->resolver);
+        session->resolver = NULL;
+    }
+    
+    return 0;
+}
+
+void ota_session_free(ota_session_t *session)
+{
+    if (!session) {
+        return;
+    }
+    
+    /* the easy handle goes first, it still refers to the share */
+    if (session->curl) {
+        curl_easy_cleanup(session->curl);
+    }
+    if (session->share) {
+        curl_share_cleanup(session->share);
+    }
+    curl_slist_free_all(session->resolve);
+    if (session->resolver) {
+        ota_resolver_free(session->resolver);
+        free(session->resolver);
+    }
+    
+    memset(session, 0, sizeof(*session));
+}
+
+void *ota_session_begin(ota_session_t *session, const char *url)
+{
+    CURL *curl;
+    
+    if (!session) {
+        /* one-off request, nothing to reuse */
+        curl = curl_easy_init();
+        if (curl) {
+            apply_defaults(curl, NULL, NULL, url);
+        }
+        return curl;
+    }
+    
+    if (!session->curl) {
+        return NULL;
+    }
+    
+    /* drops the previous request's options, keeps the live connection,
+     * the DNS cache and the TLS sessions */
+    curl_easy_reset(session->curl);
+    if (pin_address(session, url) != 0) {
+        return NULL;
+    }
+    apply_defaults(session->curl, session->share, session->resolve, url);
+    return session->curl;
+}
+
+void *ota_session_extra(ota_session_t *session, const char *url)
+{
+    CURL *curl = curl_easy_init();
+    
+    /* a handle of its own, but the same DNS, TLS sessions and connections;
+     * the address pinned by ota_session_begin() stays valid until the next */
+    if (curl) {
+        apply_defaults(curl, session ? session->share : NULL,
+                       session ? session->resolve : NULL, url);
+    }
+    return curl;
+}
+
+void ota_session_end(ota_session_t *session, void *curl)
+{
+    /* the session's own handle stays for the next request */
+    if (curl && (!session || curl != session->curl)) {
+        curl_easy_cleanup(curl);
+    }
+}
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""Compress firmware into the LZ4 payload the bootloader inflates
+v1.0 - Initial implementation
+
+Output is BOOT_LZ4_MAGIC, the decompressed size and one LZ4 block, all
+little-endian (bootloader/include/boot.h). Compress before encrypting,
+encrypt_firmware.py output does not compress.
+"""
+
+import struct
+import sys
+
+LZ4_MAGIC = 0x345a4c46  # "FLZ4"
+MIN_MATCH = 4
+MAX_OFFSET = 65535
+# LZ4 block rules: the last 5 bytes are literals and no match starts in the last 12
+LAST_LITERALS = 5
+MF_LIMIT = 12
+HASH_BITS = 16
+
+
+def _length_bytes(length):
+    """Extra length bytes after a nibble of 15"""
+    out = bytearray()
+    length -= 15
+    while length >= 255:
+        out.append(255)
+        length -= 255
+    out.append(length)
+    return out
+
+
+def _sequence(out, literals, match_len, offset):
+    lit_len = len(literals)
+    token = min(lit_len, 15) << 4
+    if match_len is not None:
+        token |= min(match_len - MIN_MATCH, 15)
+    out.append(token)
+    if lit_len >= 15:
+        out += _length_bytes(lit_len)
+    out += literals
+    if match_len is not None:
+        out += struct.pack('<H', offset)
+        if match_len - MIN_MATCH >= 15:
+            out += _length_bytes(match_len - MIN_MATCH)
+
+
+def compress_block(data):
+    """Greedy LZ4 block compression with a single-entry hash table"""
+    out = bytearray()
+    table = {}
+    anchor = 0
+    pos = 0
+    limit = len(data) - MF_LIMIT
+    
+    while pos < limit:
+        key = data[pos:pos + MIN_MATCH]
+        h = ((int.from_bytes(key, 'little') * 2654435761) & 0xffffffff) >> (32 - HASH_BITS)
+        candidate = table.get(h)
+        table[h] = pos
+    
+        if (candidate is None or pos - candidate > MAX_OFFSET or
+                data[candidate:candidate + MIN_MATCH] != key):
+            pos += 1
+            continue
+    
+        match_len = MIN_MATCH
+        end = len(data) - LAST_LITERALS
+        while pos + match_len < end and data[candidate + match_len] == data[pos + match_len]:
+            match_len += 1
+    
+        _sequence(out, data[anchor:pos], match_len, pos - candidate)
+        pos += match_len
+        anchor = pos
+    
+    _sequence(out, data[anchor:], None, 0)
+    return bytes(out)
+
+
+def compress_firmware(firmware_path, output_path):
+    """Write the compressed payload for a raw firmware image"""
+    with open(firmware_path, 'rb') as f:
+        firmware_data = f.read()
+    
+    if not firmware_data:
+        raise ValueError("Firmware is empty")
+    
+    payload = struct.pack('<II', LZ4_MAGIC, len(firmware_data)) + compress_block(firmware_data)
+    
+    with open(output_path, 'wb') as f:
+        f.write(payload)
+    
+    print(f"Firmware compressed: {firmware_path} ({len(firmware_data)} bytes)")
+    print(f"Compressed firmware saved: {output_path} ({len(payload)} bytes)")
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        print("Usage: compress_firmware.py <firmware> <compressed_output>")
+        sys.exit(1)
+    
+    compress_firmware(sys.argv[1], sys.argv[2])
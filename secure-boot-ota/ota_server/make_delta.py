@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+"""Build a delta update from one firmware image to the next
+v1.0 - Initial implementation
+
+Layout (little-endian), matching ota_client/include/ota.h:
+  magic "OTAD", old_size, new_size  (3 x uint32)
+  SHA-256 of the old image, SHA-256 of the new image
+  operations, then OP_END:
+    OP_COPY   old_offset, length   - bytes that already exist in the old image
+    OP_INSERT length, data         - bytes that don't
+"""
+
+import sys
+import struct
+import hashlib
+
+DELTA_MAGIC = 0x4441544f
+OP_END = 0
+OP_COPY = 1
+OP_INSERT = 2
+
+# Shorter matches cost more in op headers than they save
+MIN_MATCH = 16
+MAX_CANDIDATES = 8
+
+def build_delta(old, new):
+    """Greedy match of new against an index of every MIN_MATCH-byte run in old"""
+    index = {}
+    for i in range(len(old) - MIN_MATCH + 1):
+        positions = index.setdefault(old[i:i + MIN_MATCH], [])
+        if len(positions) < MAX_CANDIDATES:
+            positions.append(i)
+    
+    ops = []
+    pending = 0     # start of new bytes not covered yet
+    i = 0
+    while i + MIN_MATCH <= len(new):
+        best_pos, best_len = -1, 0
+        for pos in index.get(new[i:i + MIN_MATCH], ()):
+            length = MIN_MATCH
+            while (i + length < len(new) and pos + length < len(old)
+                   and new[i + length] == old[pos + length]):
+                length += 1
+            if length > best_len:
+                best_pos, best_len = pos, length
+        
+        if best_len == 0:
+            i += 1
+            continue
+        
+        # Grow the match backwards over bytes that would otherwise be inserted
+        while i > pending and best_pos > 0 and new[i - 1] == old[best_pos - 1]:
+            i -= 1
+            best_pos -= 1
+            best_len += 1
+        
+        if i > pending:
+            ops.append((OP_INSERT, new[pending:i]))
+        ops.append((OP_COPY, best_pos, best_len))
+        i += best_len
+        pending = i
+    
+    if pending < len(new):
+        ops.append((OP_INSERT, new[pending:]))
+    
+    out = bytearray(struct.pack('<III', DELTA_MAGIC, len(old), len(new)))
+    out += hashlib.sha256(old).digest()
+    out += hashlib.sha256(new).digest()
+    for op in ops:
+        if op[0] == OP_COPY:
+            out += struct.pack('<BII', OP_COPY, op[1], op[2])
+        else:
+            out += struct.pack('<BI', OP_INSERT, len(op[1])) + op[1]
+    out += struct.pack('<B', OP_END)
+    return bytes(out)
+
+def make_delta(old_path, new_path, output_path):
+    """Write the delta that turns old_path into new_path"""
+    with open(old_path, 'rb') as f:
+        old = f.read()
+    with open(new_path, 'rb') as f:
+        new = f.read()
+    
+    delta = build_delta(old, new)
+    
+    with open(output_path, 'wb') as f:
+        f.write(delta)
+    
+    print(f"Delta {old_path} -> {new_path}: {len(delta)} bytes "
+          f"({100.0 * len(delta) / max(len(new), 1):.1f}% of the full image)")
+    print(f"Delta saved: {output_path}")
+
+if __name__ == '__main__':
+    if len(sys.argv) != 4:
+        print("Usage: make_delta.py <old_firmware> <new_firmware> <delta_output>")
+        sys.exit(1)
+    
+    make_delta(sys.argv[1], sys.argv[2], sys.argv[3])
@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+"""Package an encrypted payload behind the signed boot header
+v1.1 - ECDSA P-256 images, signature as raw r || s
+v1.0 - Initial implementation
+
+Layout, matching bootloader/include/boot.h:
+  header (128 bytes), signature over the header, payload, Merkle trailer
+The payload is the output of encrypt_firmware.py (compress_firmware.py
+first for a compressed image), the trailer that of make_merkle.py.
+"""
+
+import argparse
+import struct
+import hashlib
+from cryptography.hazmat.primitives import serialization
+from cryptography.hazmat.primitives.asymmetric import ec
+from cryptography.hazmat.backends import default_backend
+from sign_firmware import sign_data
+
+HEADER_MAGIC = 0x48464253
+HEADER_VERSION = 1
+HEADER_SIZE = 128
+HMAC_SIZE = 32
+SIG_ALGORITHM_RSA_2048 = 1
+SIG_ALGORITHM_ECDSA_P256 = 2
+ENC_ALGORITHM_AES_256_GCM = 2
+FLAG_COMPRESSED = 0x01
+FLAG_MERKLE = 0x02
+
+def align(value, to=16):
+    return (value + to - 1) // to * to
+
+def make_image(payload_path, key_path, version, output_path, compressed=False, merkle_path=None):
+    """Write header, signature, payload and optional tree"""
+    with open(key_path, 'rb') as f:
+        private_key = serialization.load_pem_private_key(
+            f.read(), password=None, backend=default_backend())
+    
+    with open(payload_path, 'rb') as f:
+        payload = f.read()
+    
+    merkle = b''
+    if merkle_path:
+        with open(merkle_path, 'rb') as f:
+            merkle = f.read()
+    
+    # the header gives the signature size before it exists, so ECDSA is
+    # written raw at a fixed 64 bytes rather than as variable-length DER
+    if isinstance(private_key, ec.EllipticCurvePrivateKey):
+        sig_algorithm = SIG_ALGORITHM_ECDSA_P256
+        sig_size = 64
+    else:
+        sig_algorithm = SIG_ALGORITHM_RSA_2048
+        sig_size = private_key.key_size // 8
+    sig_offset = HEADER_SIZE
+    payload_offset = align(sig_offset + sig_size)
+    merkle_offset = align(payload_offset + len(payload)) if merkle else 0
+    flags = (FLAG_COMPRESSED if compressed else 0) | (FLAG_MERKLE if merkle else 0)
+    
+    header = struct.pack('<IHHIBBBBIIIIIII',
+                         HEADER_MAGIC, HEADER_VERSION, HEADER_SIZE, version,
+                         sig_algorithm, ENC_ALGORITHM_AES_256_GCM, 0, flags,
+                         payload_offset, len(payload), len(payload) - HMAC_SIZE,
+                         sig_offset, sig_size, merkle_offset, len(merkle))
+    header += hashlib.sha256(payload).digest()
+    header += hashlib.sha256(merkle).digest() if merkle else bytes(32)
+    header += bytes(HEADER_SIZE - len(header))
+    
+    signature = sign_data(private_key, header, raw=True)
+    
+    image = bytearray(header + signature)
+    image += bytes(payload_offset - len(image)) + payload
+    if merkle:
+        image += bytes(merkle_offset - len(image)) + merkle
+    
+    with open(output_path, 'wb') as f:
+        f.write(image)
+    
+    print(f"Image {output_path}: version {version}, {len(payload)} byte payload at {payload_offset}")
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Package a payload behind the signed boot header')
+    parser.add_argument('payload')
+    parser.add_argument('private_key')
+    parser.add_argument('version', type=int)
+    parser.add_argument('output')
+    parser.add_argument('--compressed', action='store_true', help='payload was made with compress_firmware.py')
+    parser.add_argument('--merkle', help='trailer made with make_merkle.py')
+    args = parser.parse_args()
+    
+    make_image(args.payload, args.private_key, args.version, args.output,
+               args.compressed, args.merkle)
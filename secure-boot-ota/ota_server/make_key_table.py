@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+"""Precompute the P-256 comb table the bootloader verifies with
+v1.0 - Initial implementation
+
+The table replaces the public key in the key storage area. Entry i - 1
+(i = 1..15) is the affine point sum of 2^(64 j) * Q over the bits j set
+in i, each as big-endian X || Y, 960 bytes in all; entry 0 is Q itself.
+Same layout as crypto_p256_table() in crypto/src/p256.c.
+"""
+
+import sys
+from cryptography.hazmat.primitives import serialization
+from cryptography.hazmat.primitives.asymmetric import ec
+from cryptography.hazmat.backends import default_backend
+
+P = 0xffffffff00000001000000000000000000000000ffffffffffffffffffffffff
+B = 0x5ac635d8aa3a93e7b3ebbd55769886bc651d06b0cc53b0f63bce3c3e27d2604b
+COMB_TEETH = 4
+COMB_SPACING = 64
+
+def point_add(a, b):
+    """Affine addition, None is the point at infinity"""
+    if a is None:
+        return b
+    if b is None:
+        return a
+    if a[0] == b[0]:
+        if (a[1] + b[1]) % P == 0:
+            return None
+        slope = (3 * a[0] * a[0] - 3) * pow(2 * a[1], -1, P) % P
+    else:
+        slope = (b[1] - a[1]) * pow(b[0] - a[0], -1, P) % P
+    x = (slope * slope - a[0] - b[0]) % P
+    return (x, (slope * (a[0] - x) - a[1]) % P)
+
+def comb_table(point):
+    """The 15 non-zero comb entries for point"""
+    x, y = point
+    if (y * y - (x * x * x - 3 * x + B)) % P != 0:
+        raise ValueError("Point is not on P-256")
+    
+    teeth = [point]
+    for _ in range(COMB_TEETH - 1):
+        tooth = teeth[-1]
+        for _ in range(COMB_SPACING):
+            tooth = point_add(tooth, tooth)
+        teeth.append(tooth)
+    
+    table = []
+    for i in range(1, 1 << COMB_TEETH):
+        entry = None
+        for j in range(COMB_TEETH):
+            if i & (1 << j):
+                entry = point_add(entry, teeth[j])
+        table.append(entry)
+    return table
+
+def table_bytes(table):
+    return b''.join(x.to_bytes(32, 'big') + y.to_bytes(32, 'big') for x, y in table)
+
+def make_key_table(key_path, output_path):
+    """Write the comb table for a PEM public (or private) P-256 key"""
+    with open(key_path, 'rb') as f:
+        data = f.read()
+    
+    if b'PRIVATE' in data:
+        key = serialization.load_pem_private_key(data, password=None,
+                                                 backend=default_backend()).public_key()
+    else:
+        key = serialization.load_pem_public_key(data, backend=default_backend())
+    
+    if not isinstance(key, ec.EllipticCurvePublicKey) or key.curve.name != 'secp256r1':
+        raise ValueError("Key is not a P-256 key")
+    
+    numbers = key.public_numbers()
+    table = table_bytes(comb_table((numbers.x, numbers.y)))
+    
+    with open(output_path, 'wb') as f:
+        f.write(table)
+    
+    print(f"Key table saved: {output_path} ({len(table)} bytes)")
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        print("Usage: make_key_table.py <p256_key.pem> <table_output>")
+        sys.exit(1)
+    
+    make_key_table(sys.argv[1], sys.argv[2])
@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+"""Build the signed chunk manifest for resumable OTA downloads
+v1.1 - Signed with ECDSA or RSA depending on the key
+v1.0 - Initial implementation
+
+Layout (little-endian), matching ota_client/include/ota.h:
+  magic "OTAM", image_size, chunk_size, chunk_count  (4 x uint32)
+  SHA-256 of the whole image
+  SHA-256 of every chunk
+  signature over all of the above
+"""
+
+import sys
+import struct
+import hashlib
+from cryptography.hazmat.primitives import serialization
+from cryptography.hazmat.backends import default_backend
+from sign_firmware import sign_data
+
+MANIFEST_MAGIC = 0x4d41544f
+DEFAULT_CHUNK_SIZE = 16 * 1024  # between OTA_CHUNK_SIZE_MIN and _MAX in boot_config.h
+
+def make_manifest(firmware_path, key_path, output_path, chunk_size=DEFAULT_CHUNK_SIZE):
+    """Hash the image per chunk and sign the list"""
+    with open(key_path, 'rb') as f:
+        private_key = serialization.load_pem_private_key(
+            f.read(), password=None, backend=default_backend())
+    
+    with open(firmware_path, 'rb') as f:
+        firmware_data = f.read()
+    
+    chunks = [firmware_data[i:i + chunk_size]
+              for i in range(0, len(firmware_data), chunk_size)]
+    
+    body = struct.pack('<IIII', MANIFEST_MAGIC, len(firmware_data), chunk_size, len(chunks))
+    body += hashlib.sha256(firmware_data).digest()
+    body += b''.join(hashlib.sha256(chunk).digest() for chunk in chunks)
+    
+    # ECDSA or RSA-PSS, same as sign_firmware.py
+    signature = sign_data(private_key, body)
+    
+    with open(output_path, 'wb') as f:
+        f.write(body)
+        f.write(signature)
+    
+    print(f"Manifest for {firmware_path}: {len(chunks)} chunks of {chunk_size} bytes")
+    print(f"Manifest saved: {output_path}")
+
+if __name__ == '__main__':
+    if len(sys.argv) not in (4, 5):
+        print("Usage: make_manifest.py <firmware> <private_key> <manifest_output> [chunk_size]")
+        sys.exit(1)
+    
+    size = int(sys.argv[4]) if len(sys.argv) == 5 else DEFAULT_CHUNK_SIZE
+    make_manifest(sys.argv[1], sys.argv[2], sys.argv[3], size)
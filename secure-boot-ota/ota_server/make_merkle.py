@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+"""Build the signed Merkle tree trailer for per-block image verification
+v1.1 - Signed with ECDSA or RSA depending on the key
+v1.0 - Initial implementation
+
+Layout (little-endian), matching bootloader/include/boot.h:
+  magic "BMRK", image_size, block_size, block_count  (4 x uint32)
+  root of the tree
+  the tree, level by level from the leaves up, root last
+  signature over the 48-byte header
+
+Same tree as crypto/src/merkle.c: leaves SHA-256(0x00 || block), nodes
+SHA-256(0x01 || left || right), a level with an odd count carries its
+last node up unchanged.
+"""
+
+import sys
+import struct
+import hashlib
+from cryptography.hazmat.primitives import serialization
+from cryptography.hazmat.backends import default_backend
+from sign_firmware import sign_data
+
+MERKLE_MAGIC = 0x4b524d42
+DEFAULT_BLOCK_SIZE = 4096  # power of two, at least BOOT_MERKLE_BLOCK_MIN in boot_config.h
+
+def build_tree(data, block_size):
+    """All levels of the tree, leaves first"""
+    level = [hashlib.sha256(b'\x00' + data[i:i + block_size]).digest()
+             for i in range(0, len(data), block_size)]
+    levels = [level]
+    
+    while len(level) > 1:
+        nxt = [hashlib.sha256(b'\x01' + level[i] + level[i + 1]).digest()
+               for i in range(0, len(level) - 1, 2)]
+        if len(level) % 2:
+            nxt.append(level[-1])
+        level = nxt
+        levels.append(level)
+    
+    return levels
+
+def make_merkle(firmware_path, key_path, output_path, block_size=DEFAULT_BLOCK_SIZE):
+    """Hash the image per block, build the tree and sign its root"""
+    with open(key_path, 'rb') as f:
+        private_key = serialization.load_pem_private_key(
+            f.read(), password=None, backend=default_backend())
+    
+    with open(firmware_path, 'rb') as f:
+        firmware_data = f.read()
+    
+    if not firmware_data or block_size & (block_size - 1):
+        raise ValueError("Need a non-empty image and a power-of-two block size")
+    
+    levels = build_tree(firmware_data, block_size)
+    root = levels[-1][0]
+    
+    header = struct.pack('<IIII', MERKLE_MAGIC, len(firmware_data), block_size, len(levels[0]))
+    header += root
+    
+    # ECDSA or RSA-PSS, same as sign_firmware.py
+    signature = sign_data(private_key, header)
+    
+    with open(output_path, 'wb') as f:
+        f.write(header)
+        for level in levels:
+            f.write(b''.join(level))
+        f.write(signature)
+    
+    print(f"Merkle tree for {firmware_path}: {len(levels[0])} blocks of {block_size} bytes")
+    print(f"Tree saved: {output_path}")
+
+if __name__ == '__main__':
+    if len(sys.argv) not in (4, 5):
+        print("Usage: make_merkle.py <firmware> <private_key> <tree_output> [block_size]")
+        sys.exit(1)
+    
+    size = int(sys.argv[4]) if len(sys.argv) == 5 else DEFAULT_BLOCK_SIZE
+    make_merkle(sys.argv[1], sys.argv[2], sys.argv[3], size)
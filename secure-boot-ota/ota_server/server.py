@@ -3,6 +3,9 @@
 OTA Update Server
 Handles secure firmware updates for embedded devices
 
+v1.6 - ECDSA P-256 signatures, the boot key type decides
+v1.5 - Delta updates between releases, built on first request
+v1.4 - Chunk manifests and Range downloads for resumable updates
 v1.3 - Added version validation (2024-06-15)
 v1.2 - Fixed file upload size limit
 v1.1 - Added signature verification
@@ -15,10 +18,11 @@ import json
 import hashlib
 import argparse
 from flask import Flask, request, jsonify, send_file
-from cryptography.hazmat.primitives import hashes, serialization
-from cryptography.hazmat.primitives.asymmetric import rsa, padding
+from cryptography.hazmat.primitives import serialization
 from cryptography.hazmat.backends import default_backend
 import base64
+from make_delta import build_delta
+from sign_firmware import verify_data
 
 app = Flask(__name__)
 
@@ -64,7 +68,7 @@ class OTAServer:
         return info
     
     def verify_firmware_signature(self, firmware_path, signature_path):
-        """Verify firmware signature - RSA-2048 with PSS padding"""
+        """Verify firmware signature - ECDSA P-256, or RSA-2048 with PSS padding"""
         try:
             # Load public key - should be in secure storage in production
             pub_key_path = os.path.join(KEYS_DIR, "boot_public_key.pem")
@@ -88,16 +92,8 @@ class OTAServer:
             with open(signature_path, 'rb') as f:
                 signature = f.read()
             
-            # Verify signature - PSS is more secure than PKCS#1 v1.5
-            public_key.verify(
-                signature,
-                firmware_data,
-                padding.PSS(
-                    mgf=padding.MGF1(hashes.SHA256()),
-                    salt_length=padding.PSS.MAX_LENGTH
-                ),
-                hashes.SHA256()
-            )
+            # Verify signature - PSS for RSA keys, as sign_firmware.py makes them
+            verify_data(public_key, signature, firmware_data)
             return True
         except Exception as e:
             print(f"Signature verification failed: {e}")
@@ -130,7 +126,57 @@ def download_firmware():
     if not os.path.exists(firmware_path):
         return jsonify({'error': 'Firmware file not found'}), 404
     
-    return send_file(firmware_path, as_attachment=True)
+    # conditional=True answers Range requests with 206, clients resume with it
+    return send_file(firmware_path, as_attachment=True, conditional=True)
+
+@app.route('/api/firmware/manifest', methods=['GET'])
+def download_manifest():
+    """Signed chunk manifest, built offline with make_manifest.py"""
+    version = request.args.get('version')
+    server = app.config['ota_server']
+    info = server.get_firmware_info(version)
+    
+    if info is None or 'manifest' not in info:
+        return jsonify({'error': 'Manifest not found'}), 404
+    
+    manifest_path = os.path.join(FIRMWARE_DIR, info['manifest'])
+    if not os.path.exists(manifest_path):
+        return jsonify({'error': 'Manifest file not found'}), 404
+    
+    return send_file(manifest_path, mimetype='application/octet-stream')
+
+@app.route('/api/firmware/delta', methods=['GET'])
+def download_delta():
+    """Delta from the device's version to the requested one"""
+    from_version = request.args.get('from')
+    version = request.args.get('version')
+    server = app.config['ota_server']
+    old_info = server.get_firmware_info(from_version) if from_version else None
+    new_info = server.get_firmware_info(version)
+    
+    if old_info is None or new_info is None:
+        return jsonify({'error': 'Firmware not found'}), 404
+    
+    # Deltas are cached next to the images, one per version pair
+    delta_path = os.path.join(
+        FIRMWARE_DIR, f"delta_v{old_info['version']}_v{new_info['version']}.bin")
+    if not os.path.exists(delta_path):
+        old_path = os.path.join(FIRMWARE_DIR, old_info['filename'])
+        new_path = os.path.join(FIRMWARE_DIR, new_info['filename'])
+        if not os.path.exists(old_path) or not os.path.exists(new_path):
+            return jsonify({'error': 'Firmware file not found'}), 404
+        
+        with open(old_path, 'rb') as f:
+            old_data = f.read()
+        with open(new_path, 'rb') as f:
+            new_data = f.read()
+        
+        # Write then rename, a concurrent request never sees half a delta
+        with open(delta_path + '.tmp', 'wb') as f:
+            f.write(build_delta(old_data, new_data))
+        os.replace(delta_path + '.tmp', delta_path)
+    
+    return send_file(delta_path, mimetype='application/octet-stream')
 
 @app.route('/api/firmware/update', methods=['POST'])
 def update_firmware():
@@ -167,6 +213,12 @@ def update_firmware():
     
     firmware_file.save(firmware_path)
     
+    # Optional signed manifest for resumable downloads
+    manifest_name = None
+    if 'manifest' in request.files:
+        manifest_name = f"{filename}.manifest"
+        request.files['manifest'].save(os.path.join(FIRMWARE_DIR, manifest_name))
+    
     # Calculate hash - SHA256 for integrity
     with open(firmware_path, 'rb') as f:
         firmware_data = f.read()
@@ -180,6 +232,8 @@ def update_firmware():
         'sha256': sha256_hash,
         'timestamp': os.path.getmtime(firmware_path)
     }
+    if manifest_name:
+        server.firmware_versions[version]['manifest'] = manifest_name
     server.save_firmware_versions()
     
     print(f"Firmware uploaded: version {version}, size {len(firmware_data)} bytes")
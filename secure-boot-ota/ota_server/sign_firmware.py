@@ -1,14 +1,50 @@
 #!/usr/bin/env python3
-"""Sign firmware with RSA private key
+"""Sign firmware with the boot private key
+v1.1 - ECDSA P-256 keys, the default; RSA keys still sign with PSS
 v1.0 - Initial implementation
 """
 
 import sys
 import hashlib
 from cryptography.hazmat.primitives import hashes, serialization
-from cryptography.hazmat.primitives.asymmetric import padding
+from cryptography.hazmat.primitives.asymmetric import ec, padding, rsa
+from cryptography.hazmat.primitives.asymmetric.utils import decode_dss_signature
 from cryptography.hazmat.backends import default_backend
 
+def sign_data(private_key, data, raw=False):
+    """Signature the bootloader accepts for this key type.
+    ECDSA is DER like mbedTLS writes it, or r || s (64 bytes) with raw."""
+    if isinstance(private_key, ec.EllipticCurvePrivateKey):
+        signature = private_key.sign(data, ec.ECDSA(hashes.SHA256()))
+        if raw:
+            r, s = decode_dss_signature(signature)
+            signature = r.to_bytes(32, 'big') + s.to_bytes(32, 'big')
+        return signature
+    
+    return private_key.sign(
+        data,
+        padding.PSS(
+            mgf=padding.MGF1(hashes.SHA256()),
+            salt_length=padding.PSS.MAX_LENGTH
+        ),
+        hashes.SHA256()
+    )
+
+def verify_data(public_key, signature, data):
+    """Raises InvalidSignature unless sign_data() made signature"""
+    if isinstance(public_key, rsa.RSAPublicKey):
+        public_key.verify(
+            signature,
+            data,
+            padding.PSS(
+                mgf=padding.MGF1(hashes.SHA256()),
+                salt_length=padding.PSS.MAX_LENGTH
+            ),
+            hashes.SHA256()
+        )
+    else:
+        public_key.verify(signature, data, ec.ECDSA(hashes.SHA256()))
+
 def sign_firmware(firmware_path, key_path, output_path):
     """Sign firmware file with private key"""
     # Load private key
@@ -21,14 +57,7 @@ def sign_firmware(firmware_path, key_path, output_path):
         firmware_data = f.read()
     
     # Sign firmware
-    signature = private_key.sign(
-        firmware_data,
-        padding.PSS(
-            mgf=padding.MGF1(hashes.SHA256()),
-            salt_length=padding.PSS.MAX_LENGTH
-        ),
-        hashes.SHA256()
-    )
+    signature = sign_data(private_key, firmware_data)
     
     # Write signature
     with open(output_path, 'wb') as f:
@@ -43,4 +72,3 @@ if __name__ == '__main__':
         sys.exit(1)
     
     sign_firmware(sys.argv[1], sys.argv[2], sys.argv[3])
-
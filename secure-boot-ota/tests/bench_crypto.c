@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "crypto.h"
+#include "crypto_config.h"
+
+// Crypto micro-benchmarks - not run by ctest, build target bench_crypto
+// Every crypto.h entry point over a range of buffer sizes, as ops/s,
+// MB/s and cycles/byte. Cycles come from DWT CYCCNT on Cortex-M targets
+// (time is derived from BENCH_CPU_HZ there) and from the TSC on x86-64
+// hosts; other hosts print time only. Backends (CRYPTO_BACKEND, ARMv8
+// CE) are whatever the build selected, compare two builds to see them.
+
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__) || defined(__ARM_ARCH_8M_MAIN__)
+#define BENCH_DWT 1
+#else
+#define BENCH_DWT 0
+#include <time.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+#endif
+
+#ifndef BENCH_CPU_HZ
+#define BENCH_CPU_HZ 160000000u     /* target core clock, DWT builds only */
+#endif
+#define BENCH_MIN_NS 200000000u     /* run each case at least this long */
+
+static const size_t bench_sizes[] = { 64, 256, 1024, 4096, 16384 };
+
+static uint8_t input[16384];
+static uint8_t output[16384];
+static const uint8_t key[32] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+static const uint8_t iv[16] = { 9, 10, 11, 12 };
+
+/* test key and signatures over SHA-256("firmware 1"), same vector as test_crypto.c */
+static const uint8_t p256_point[64] = {
+    0x69, 0x6d, 0x72, 0x4d, 0x9c, 0xa1, 0x83, 0x06, 0xd2, 0x1e, 0x58, 0x49,
+    0xdd, 0x0b, 0x45, 0xcd, 0xbd, 0xad, 0x0a, 0x58, 0x78, 0xe8, 0xee, 0x1f,
+    0x96, 0x79, 0xd4, 0x9d, 0x1b, 0x52, 0x4d, 0x54, 0xbf, 0xc6, 0x44, 0x70,
+    0xf9, 0x42, 0xda, 0x15, 0x19, 0xa5, 0xfb, 0x5d, 0xc6, 0xad, 0x02, 0xf7,
+    0x4e, 0xf1, 0x48, 0x71, 0xc5, 0x00, 0x69, 0xc9, 0x12, 0x35, 0x6f, 0x66,
+    0x13, 0x36, 0xfa, 0xc7
+};
+static const uint8_t p256_sig[64] = {
+    0x2d, 0x71, 0x3f, 0x0f, 0xaa, 0x60, 0x06, 0x84, 0x61, 0xf5, 0x4c, 0x21,
+    0xc3, 0xbc, 0x40, 0xd0, 0x09, 0x31, 0xfd, 0x18, 0xdf, 0xda, 0x5f, 0x84,
+    0x3a, 0x6e, 0x9a, 0x6a, 0x5a, 0x10, 0x9b, 0x59, 0x5f, 0xa6, 0x8d, 0xd7,
+    0x59, 0x12, 0x25, 0x8d, 0x15, 0xee, 0x50, 0x8c, 0x56, 0xd1, 0x50, 0xa4,
+    0x50, 0xbe, 0x1c, 0x8c, 0x48, 0x94, 0x8a, 0xb9, 0x75, 0xb3, 0x18, 0x1e,
+    0x68, 0x76, 0x18, 0x75
+};
+static const uint8_t rsa_public_key[] = {
+    0x30, 0x82, 0x01, 0x22, 0x30, 0x0d, 0x06, 0x09, 0x2a, 0x86, 0x48, 0x86,
+    0xf7, 0x0d, 0x01, 0x01, 0x01, 0x05, 0x00, 0x03, 0x82, 0x01, 0x0f, 0x00,
+    0x30, 0x82, 0x01, 0x0a, 0x02, 0x82, 0x01, 0x01, 0x00, 0x87, 0x6d, 0xc4,
+    0xd2, 0x77, 0xbe, 0x52, 0x17, 0xfe, 0x08, 0x3e, 0x81, 0xed, 0x1b, 0x5b,
+    0xce, 0x89, 0x20, 0x87, 0x2d, 0x2c, 0x9f, 0xb5, 0xf8, 0x0c, 0x43, 0x35,
+    0x40, 0x44, 0xeb, 0x72, 0xeb, 0x53, 0xcc, 0x09, 0xf7, 0xa8, 0xfc, 0xd0,
+    0xbd, 0xa2, 0x7e, 0x44, 0x48, 0xcb, 0xc2, 0x65, 0xa2, 0x06, 0x52, 0xad,
+    0x25, 0x79, 0xa0, 0xdc, 0xe1, 0x78, 0x5b, 0xf2, 0xe0, 0xbc, 0xda, 0xd5,
+    0x79, 0x23, 0xfc, 0xf4, 0xd9, 0xc4, 0x7f, 0x36, 0x09, 0x92, 0x8a, 0x19,
+    0x03, 0x2f, 0x30, 0x5d, 0x7d, 0xff, 0x8d, 0xed, 0x97, 0xe7, 0x18, 0x8a,
+    0xa6, 0x49, 0x97, 0x3f, 0x7d, 0x90, 0xf6, 0x31, 0xa6, 0xf3, 0x89, 0x6e,
+    0xfe, 0xa8, 0xe3, 0xbb, 0x48, 0x5f, 0xe6, 0x08, 0xf6, 0x57, 0xb7, 0xfb,
+    0x42, 0xcd, 0xeb, 0x4d, 0x47, 0x8e, 0x39, 0x0c, 0xb2, 0x4c, 0x35, 0x43,
+    0xd1, 0xec, 0x5e, 0x43, 0x3a, 0x4b, 0xa9, 0xa9, 0x42, 0x80, 0x89, 0xd1,
+    0x18, 0x63, 0x43, 0x74, 0x58, 0x74, 0xa7, 0xa3, 0x4a, 0xb0, 0x00, 0xbd,
+    0x47, 0x56, 0x54, 0xec, 0x7b, 0x16, 0xc3, 0xab, 0x7b, 0xb3, 0x82, 0xa9,
+    0x0c, 0xca, 0xf4, 0x5f, 0xf0, 0x46, 0xd7, 0x7f, 0x98, 0x2b, 0x15, 0xea,
+    0x67, 0xbc, 0x4e, 0xa8, 0x64, 0x8e, 0x08, 0x06, 0x6a, 0x61, 0xaf, 0x25,
+    0x52, 0x79, 0x3c, 0x10, 0xec, 0xc4, 0x1a, 0xbd, 0xc6, 0xe8, 0x9d, 0x9a,
+    0xb4, 0xac, 0x04, 0x1b, 0x52, 0x68, 0x1e, 0x98, 0xe8, 0x95, 0x77, 0x3f,
+    0x0a, 0x1f, 0xc5, 0x50, 0x16, 0x64, 0xdc, 0xa4, 0xe1, 0x60, 0xd1, 0x40,
+    0xdb, 0xaf, 0xa1, 0x84, 0x08, 0xfd, 0xb2, 0xb4, 0x8b, 0x45, 0x6f, 0x99,
+    0x54, 0x67, 0x23, 0x86, 0x6a, 0x73, 0x57, 0xde, 0x07, 0xe9, 0x2b, 0x75,
+    0x63, 0xb1, 0xda, 0x88, 0x86, 0x31, 0xbe, 0xd7, 0x8e, 0xf9, 0x82, 0x8e,
+    0xe3, 0x02, 0x03, 0x01, 0x00, 0x01
+};
+static const uint8_t rsa_sig[] = {     /* PKCS#1 v1.5, mbedTLS' default padding */
+    0x6c, 0xc9, 0x85, 0x31, 0xb4, 0x23, 0x71, 0x43, 0x59, 0x69, 0xe8, 0xfa,
+    0x9c, 0x0f, 0x2c, 0xb1, 0xd4, 0xd7, 0x22, 0x37, 0xb4, 0xfa, 0x26, 0x10,
+    0x1b, 0x3a, 0xbb, 0xd8, 0xf7, 0xb7, 0x89, 0xe3, 0xf9, 0xf6, 0x00, 0xc7,
+    0x79, 0x57, 0x9c, 0xa0, 0xe2, 0x09, 0xef, 0xf7, 0x27, 0x8f, 0x9b, 0x84,
+    0x01, 0x70, 0xb8, 0x65, 0x7a, 0x82, 0xe4, 0xe2, 0xeb, 0xef, 0x16, 0xb3,
+    0x68, 0xae, 0x60, 0x2d, 0x4e, 0xbe, 0xe0, 0x47, 0xcb, 0x71, 0x65, 0x4c,
+    0x4d, 0x1d, 0xb8, 0x51, 0xe6, 0x75, 0x0d, 0x30, 0x30, 0xf0, 0x4f, 0xb1,
+    0x4d, 0x40, 0x4e, 0x49, 0xfa, 0x59, 0x6f, 0x39, 0x52, 0x71, 0x2a, 0x3c,
+    0x25, 0xd5, 0x98, 0xb2, 0xcd, 0x76, 0x73, 0x2c, 0x06, 0x8b, 0xf6, 0x44,
+    0xec, 0xc3, 0x51, 0x0c, 0x81, 0x05, 0xd2, 0x18, 0xbd, 0x61, 0xd3, 0x0a,
+    0xb0, 0xe9, 0x13, 0x3d, 0x12, 0x22, 0x69, 0x7a, 0xf1, 0x42, 0xb9, 0xe4,
+    0x51, 0x25, 0xfa, 0x4a, 0x12, 0x3e, 0x45, 0xb0, 0xf3, 0x60, 0x05, 0xff,
+    0x5c, 0xc8, 0x32, 0xff, 0xe8, 0xe9, 0xdb, 0xa0, 0x3a, 0xa6, 0xc5, 0xf6,
+    0xd0, 0x7c, 0x06, 0x77, 0x96, 0x97, 0xc0, 0xda, 0x6b, 0xda, 0x49, 0x80,
+    0xee, 0xe4, 0xa8, 0x2c, 0x15, 0x62, 0x83, 0xc2, 0xf7, 0x84, 0xa4, 0xe6,
+    0xe5, 0x23, 0x51, 0x05, 0xc6, 0x8a, 0xf5, 0x7b, 0x79, 0x41, 0xee, 0x84,
+    0xa4, 0x41, 0xf7, 0xa0, 0x08, 0x03, 0x10, 0xcc, 0xfb, 0x30, 0xb6, 0xd2,
+    0x47, 0x67, 0x16, 0x0c, 0x1e, 0xb7, 0x4e, 0x55, 0x5a, 0x2f, 0x1a, 0x5d,
+    0xd9, 0x68, 0x75, 0xa5, 0x54, 0xbd, 0x1c, 0x7e, 0xf9, 0x2f, 0x0c, 0xa5,
+    0xa9, 0x35, 0x46, 0x56, 0x63, 0xd1, 0x04, 0x61, 0xf2, 0xd8, 0x0b, 0xc6,
+    0x66, 0x72, 0xf9, 0xf3, 0x58, 0x49, 0x01, 0xa5, 0xf4, 0x03, 0x2e, 0x43,
+    0x86, 0xb2, 0x5f, 0x52
+};
+static uint8_t p256_table[CRYPTO_P256_TABLE_SIZE];
+static uint8_t p256_spki[91];
+static uint8_t message_hash[32];
+
+#if BENCH_DWT
+#define DEMCR       (*(volatile uint32_t *)0xE000EDFCu)
+#define DWT_CTRL    (*(volatile uint32_t *)0xE0001000u)
+#define DWT_CYCCNT  (*(volatile uint32_t *)0xE0001004u)
+
+static void counter_init(void)
+{
+    DEMCR |= 1u << 24;              /* TRCENA */
+    DWT_CYCCNT = 0;
+    DWT_CTRL |= 1u;                 /* CYCCNTENA */
+}
+
+/* CYCCNT is 32 bits, widened here; call at least once per wrap */
+static uint64_t now_cycles(void)
+{
+    static uint64_t high;
+    static uint32_t last;
+    uint32_t now = DWT_CYCCNT;
+    
+    if (now < last) {
+        high += 1ull << 32;
+    }
+    last = now;
+    return high | now;
+}
+
+static uint64_t now_ns(void)
+{
+    return now_cycles() * 1000000000ull / BENCH_CPU_HZ;
+}
+#else
+static void counter_init(void)
+{
+}
+
+static uint64_t now_cycles(void)
+{
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+static int bench_sha256(size_t len)
+{
+    return crypto_hash_sha256(input, len, output);
+}
+
+static int bench_sha256_stream(size_t len)
+{
+    crypto_sha256_ctx_t ctx;
+    
+    if (crypto_sha256_init(&ctx) != CRYPTO_SUCCESS) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    for (size_t off = 0; off < len; off += 64) {
+        if (crypto_sha256_update(&ctx, input + off, len - off < 64 ? len - off : 64) != CRYPTO_SUCCESS) {
+            crypto_sha256_free(&ctx);
+            return CRYPTO_ERROR_INVALID_PARAM;
+        }
+    }
+    return crypto_sha256_final(&ctx, output);
+}
+
+static int bench_hmac(size_t len)
+{
+    return crypto_hmac_sha256(input, len, key, sizeof(key), output);
+}
+
+static int bench_ctr_encrypt(size_t len)
+{
+    return crypto_encrypt_aes_ctr(input, len, key, iv, output);
+}
+
+static int bench_ctr_decrypt(size_t len)
+{
+    return crypto_decrypt_aes_ctr(input, len, key, iv, output);
+}
+
+static int bench_gcm_encrypt(size_t len)
+{
+    uint8_t tag[16];
+    
+    return crypto_encrypt_aes_gcm(input, len, key, iv, NULL, 0, output, tag);
+}
+
+/* decrypting what was just encrypted, so the tag holds */
+static int bench_gcm_decrypt(size_t len)
+{
+    static uint8_t tag[16];
+    static size_t sealed_len;
+    
+    if (sealed_len != len) {
+        if (crypto_encrypt_aes_gcm(input, len, key, iv, NULL, 0, output, tag) != CRYPTO_SUCCESS) {
+            return CRYPTO_ERROR_INVALID_PARAM;
+        }
+        memcpy(input, output, len);
+        sealed_len = len;
+    }
+    return crypto_decrypt_aes_gcm(input, len, key, iv, NULL, 0, tag, output);
+}
+
+static int bench_ecdsa_table(size_t len)
+{
+    (void)len;
+    return crypto_verify_ecdsa_hash(message_hash, p256_sig, sizeof(p256_sig),
+                                    p256_table, sizeof(p256_table));
+}
+
+static int bench_ecdsa_mbedtls(size_t len)
+{
+    (void)len;
+    return crypto_verify_ecdsa_hash(message_hash, p256_sig, sizeof(p256_sig),
+                                    p256_spki, sizeof(p256_spki));
+}
+
+static int bench_rsa(size_t len)
+{
+    (void)len;
+    return crypto_verify_rsa_hash(message_hash, rsa_sig, sizeof(rsa_sig),
+                                  rsa_public_key, sizeof(rsa_public_key));
+}
+
+static int bench_hkdf(size_t len)
+{
+    (void)len;
+    return crypto_hkdf(iv, sizeof(iv), key, sizeof(key),
+                       (const uint8_t *)"bench", 5, output, 32);
+}
+
+static int bench_pbkdf2(size_t len)
+{
+    (void)len;
+    return crypto_pbkdf2(key, sizeof(key), iv, sizeof(iv), 1000, output, 32);
+}
+
+/* len 0: a fixed-size operation, reported per op */
+static void run(const char *name, int (*op)(size_t), size_t len)
+{
+    uint64_t t0;
+    uint64_t c0;
+    uint64_t ns;
+    uint64_t cycles;
+    unsigned long iterations = 0;
+    int ret;
+    
+    /* warm-up, and a failing entry point is reported instead of timed */
+    ret = op(len);
+    if (ret != CRYPTO_SUCCESS) {
+        printf("%-22s %7zu  failed (%d)\n", name, len, ret);
+        return;
+    }
+    
+    t0 = now_ns();
+    c0 = now_cycles();
+    do {
+        op(len);
+        iterations++;
+    } while (now_ns() - t0 < BENCH_MIN_NS);
+    cycles = now_cycles() - c0;
+    ns = now_ns() - t0;
+    
+    if (len) {
+        printf("%-22s %7zu %12.1f %10.2f", name, len, iterations * 1e9 / (double)ns,
+               (double)len * iterations * 1e3 / (double)ns);
+    } else {
+        printf("%-22s %7s %12.1f %10s", name, "-", iterations * 1e9 / (double)ns, "-");
+    }
+    if (c0 == 0 && cycles == 0) {
+        printf(" %12s\n", "-");
+    } else {
+        printf(" %12.2f\n", (double)cycles / iterations / (len ? (double)len : 1.0));
+    }
+}
+
+static void run_sizes(const char *name, int (*op)(size_t))
+{
+    for (size_t i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++) {
+        run(name, op, bench_sizes[i]);
+    }
+}
+
+int main(void)
+{
+    static const uint8_t spki_header[] = {
+        0x30, 0x59, 0x30, 0x13, 0x06, 0x07, 0x2a, 0x86,
+        0x48, 0xce, 0x3d, 0x02, 0x01, 0x06, 0x08, 0x2a,
+        0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07, 0x03,
+        0x42, 0x00, 0x04
+    };
+    
+    printf("=== Crypto Benchmarks ===\n");
+    printf("backend %d, ARMv8 CE %d, %s\n", CRYPTO_BACKEND, CRYPTO_ARMV8_CE,
+           BENCH_DWT ? "DWT cycles" : "host clock");
+    
+    counter_init();
+    crypto_init();
+    
+    for (size_t i = 0; i < sizeof(input); i++) {
+        input[i] = (uint8_t)(i * 7);
+    }
+    crypto_hash_sha256((const uint8_t *)"firmware 1", 10, message_hash);
+    crypto_p256_table(p256_point, p256_table);
+    memcpy(p256_spki, spki_header, sizeof(spki_header));
+    memcpy(p256_spki + sizeof(spki_header), p256_point, sizeof(p256_point));
+    
+    /* cycles per byte, or per op for the fixed-size cases */
+    printf("%-22s %7s %12s %10s %12s\n", "operation", "bytes", "ops/s", "MB/s", "cycles/B,op");
+    run_sizes("SHA-256", bench_sha256);
+    run_sizes("SHA-256 64 B updates", bench_sha256_stream);
+    run_sizes("HMAC-SHA256", bench_hmac);
+    run_sizes("AES-256-CTR encrypt", bench_ctr_encrypt);
+    run_sizes("AES-256-CTR decrypt", bench_ctr_decrypt);
+    run_sizes("AES-256-GCM encrypt", bench_gcm_encrypt);
+    run_sizes("AES-256-GCM decrypt", bench_gcm_decrypt);
+    run("ECDSA P-256 (table)", bench_ecdsa_table, 0);
+    run("ECDSA P-256 (mbedTLS)", bench_ecdsa_mbedtls, 0);
+    run("RSA-2048 verify", bench_rsa, 0);
+    run("HKDF-SHA256 32 B", bench_hkdf, 0);
+    run("PBKDF2 1000 iter", bench_pbkdf2, 0);
+    
+    return 0;
+}
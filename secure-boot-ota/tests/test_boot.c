@@ -1,8 +1,14 @@
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include "boot.h"
+#include "boot_config.h"
 #include "crypto.h"
 
+/* Test keys - on target these come from the key storage area */
+uint8_t firmware_key[FIRMWARE_KEY_SIZE];
+uint8_t hmac_key[32];
+
 // Basic bootloader tests - TODO: Add more comprehensive tests
 
 void test_version_counter(void)
@@ -24,6 +30,33 @@ void test_version_counter(void)
     printf("Version counter test PASSED\n");
 }
 
+void test_version_log_wrap(void)
+{
+    uint32_t version;
+    uint32_t start;
+    
+    printf("Testing version counter log wrap...\n");
+    
+    assert(check_version_counter(&start) == 0);
+    
+    /* several pages' worth of commits, a boot-time check now and then */
+    for (uint32_t i = 1; i <= 3 * VERSION_LOG_PAGE_SIZE / VERSION_LOG_SLOT_SIZE; i++) {
+        assert(update_version_counter(start + i) == 0);
+        if (i % 100 == 0) {
+            assert(check_version_counter(&version) == 0);
+            assert(version == start + i);
+        }
+    }
+    
+    version = start + 3 * VERSION_LOG_PAGE_SIZE / VERSION_LOG_SLOT_SIZE;
+    assert(update_version_counter(version) == 0);
+    assert(update_version_counter(version - 1) == -1);
+    assert(check_version_counter(&version) == 0);
+    assert(version == start + 3 * VERSION_LOG_PAGE_SIZE / VERSION_LOG_SLOT_SIZE);
+    
+    printf("Version counter log test PASSED\n");
+}
+
 void test_signature_verification(void)
 {
     printf("Testing signature verification...\n");
@@ -38,12 +71,261 @@ void test_signature_verification(void)
     printf("Signature verification test SKIPPED (requires keys)\n");
 }
 
+void test_image_pass_rejects_bad_input(void)
+{
+    uint8_t image[64] = {0};
+    uint8_t dest[64];
+    uint8_t signature[256] = {0};
+    uint8_t key[BOOT_PUBLIC_KEY_SIZE] = {0};
+    
+    printf("Testing single-pass image check input validation...\n");
+    
+    assert(boot_process_image(NULL, sizeof(image), signature, sizeof(signature),
+                              key, sizeof(key), dest, sizeof(dest)) == BOOT_IMAGE_ERR_PARAM);
+    assert(boot_process_image(image, sizeof(image), signature, sizeof(signature),
+                              key, sizeof(key), NULL, sizeof(dest)) == BOOT_IMAGE_ERR_PARAM);
+    
+    /* nothing left between the IV and the tag */
+    assert(boot_process_image(image, 32, signature, sizeof(signature),
+                              key, sizeof(key), dest, sizeof(dest)) == BOOT_IMAGE_ERR_PARAM);
+    
+    printf("Image pass input validation test PASSED\n");
+}
+
+void test_lz4_stream(void)
+{
+    /* "abc", a 9 byte match 3 back, then the closing literals "XYZ" */
+    const uint8_t block[] = { 0x35, 'a', 'b', 'c', 0x03, 0x00, 0x30, 'X', 'Y', 'Z' };
+    const uint8_t bad_offset[] = { 0x10, 'a', 0x05, 0x00 };
+    uint8_t out[32];
+    boot_lz4_t lz;
+    
+    printf("Testing streaming LZ4 decoder...\n");
+    
+    /* one byte at a time, as if every byte arrived in its own block */
+    boot_lz4_init(&lz, out, sizeof(out));
+    for (size_t i = 0; i < sizeof(block); i++) {
+        assert(boot_lz4_update(&lz, block + i, 1) == 0);
+    }
+    assert(boot_lz4_finish(&lz, 15) == 0);
+    assert(memcmp(out, "abcabcabcabcXYZ", 15) == 0);
+    
+    /* stopping inside a sequence or at the wrong size is not an image */
+    boot_lz4_init(&lz, out, sizeof(out));
+    assert(boot_lz4_update(&lz, block, 5) == 0);
+    assert(boot_lz4_finish(&lz, 3) != 0);
+    assert(boot_lz4_update(&lz, block + 5, sizeof(block) - 5) == 0);
+    assert(boot_lz4_finish(&lz, 14) != 0);
+    
+    /* a match reaching before the output, or past its end */
+    boot_lz4_init(&lz, out, sizeof(out));
+    assert(boot_lz4_update(&lz, bad_offset, sizeof(bad_offset)) != 0);
+    boot_lz4_init(&lz, out, 8);
+    assert(boot_lz4_update(&lz, block, sizeof(block)) != 0);
+    
+    printf("Streaming LZ4 decoder test PASSED\n");
+}
+
+void test_merkle_image_blocks(void)
+{
+    static uint8_t image[3 * BOOT_MERKLE_BLOCK_MIN + 100];
+    static uint8_t trailer[BOOT_MERKLE_HEADER_SIZE + 7 * SHA256_HASH_SIZE + 256];
+    uint8_t *tree = trailer + BOOT_MERKLE_HEADER_SIZE;
+    uint8_t key[BOOT_PUBLIC_KEY_SIZE] = {0};
+    boot_merkle_t merkle;
+    
+    printf("Testing Merkle image block checks...\n");
+    
+    for (size_t i = 0; i < sizeof(image); i++) {
+        image[i] = (uint8_t)(i * 31);
+    }
+    
+    /* header checks come before the signature */
+    assert(boot_merkle_open(&merkle, image, trailer, sizeof(trailer), key, sizeof(key)) ==
+           BOOT_IMAGE_ERR_PARAM);
+    
+    /* 4 blocks, the last one short; an opened handle filled in by hand
+     * since the test has no signing key */
+    memset(&merkle, 0, sizeof(merkle));
+    merkle.image = image;
+    merkle.tree = tree;
+    merkle.image_size = sizeof(image);
+    merkle.block_size = BOOT_MERKLE_BLOCK_MIN;
+    merkle.block_count = 4;
+    assert(crypto_merkle_nodes(4) == 7);
+    for (uint32_t i = 0; i < 4; i++) {
+        size_t len = i < 3 ? BOOT_MERKLE_BLOCK_MIN : 100;
+        assert(crypto_merkle_leaf(image + i * BOOT_MERKLE_BLOCK_MIN, len,
+                                  tree + i * SHA256_HASH_SIZE) == CRYPTO_SUCCESS);
+    }
+    assert(crypto_merkle_build(tree, 4, merkle.root) == CRYPTO_SUCCESS);
+    
+    assert(boot_merkle_ensure(&merkle, 0, sizeof(image)) == BOOT_IMAGE_OK);
+    assert(boot_merkle_ensure(&merkle, sizeof(image) - 1, 2) == BOOT_IMAGE_ERR_PARAM);
+    
+    /* checked blocks are not re-hashed by ensure, only by verify_block */
+    image[BOOT_MERKLE_BLOCK_MIN + 5] ^= 0x80;
+    assert(boot_merkle_ensure(&merkle, BOOT_MERKLE_BLOCK_MIN, 1) == BOOT_IMAGE_OK);
+    assert(boot_merkle_verify_block(&merkle, 1) == BOOT_IMAGE_ERR_INTEGRITY);
+    assert(boot_merkle_ensure(&merkle, BOOT_MERKLE_BLOCK_MIN, 1) == BOOT_IMAGE_ERR_INTEGRITY);
+    assert(boot_merkle_verify_block(&merkle, 2) == BOOT_IMAGE_OK);
+    assert(boot_merkle_verify_block(&merkle, 4) == BOOT_IMAGE_ERR_PARAM);
+    
+    printf("Merkle image block test PASSED\n");
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+void test_header_parse(void)
+{
+    static uint8_t slot[4096];
+    boot_header_t header;
+    
+    printf("Testing image header parsing...\n");
+    
+    /* header, signature at 128, payload at 384 */
+    memset(slot, 0, sizeof(slot));
+    put_le32(slot, BOOT_HEADER_MAGIC);
+    slot[4] = BOOT_HEADER_VERSION;
+    slot[6] = BOOT_HEADER_SIZE;
+    put_le32(slot + 8, 7);
+    slot[12] = BOOT_SIGNATURE_ALGORITHM;
+    slot[13] = FIRMWARE_ENCRYPTION;
+    put_le32(slot + 16, 384);
+    put_le32(slot + 20, 1000);
+    put_le32(slot + 24, 1000 - HMAC_SIZE);
+    put_le32(slot + 28, 128);
+    put_le32(slot + 32, 256);
+    
+    assert(boot_header_parse(slot, sizeof(slot), &header) == BOOT_IMAGE_OK);
+    assert(header.image_version == 7);
+    assert(header.payload_offset == 384 && header.payload_size == 1000);
+    
+    /* payload running past the slot */
+    assert(boot_header_parse(slot, 1000, &header) == BOOT_IMAGE_ERR_PARAM);
+    
+    /* signature overlapping the payload */
+    put_le32(slot + 28, 300);
+    assert(boot_header_parse(slot, sizeof(slot), &header) == BOOT_IMAGE_ERR_PARAM);
+    put_le32(slot + 28, 128);
+    
+    /* HMAC not at the tail of the payload */
+    put_le32(slot + 24, 0);
+    assert(boot_header_parse(slot, sizeof(slot), &header) == BOOT_IMAGE_ERR_PARAM);
+    put_le32(slot + 24, 1000 - HMAC_SIZE);
+    
+    /* Merkle fields without the flag */
+    put_le32(slot + 36, 2048);
+    assert(boot_header_parse(slot, sizeof(slot), &header) == BOOT_IMAGE_ERR_PARAM);
+    put_le32(slot + 40, 512);
+    slot[15] = BOOT_HEADER_FLAG_MERKLE;
+    assert(boot_header_parse(slot, sizeof(slot), &header) == BOOT_IMAGE_OK);
+    slot[15] = 0;
+    put_le32(slot + 36, 0);
+    put_le32(slot + 40, 0);
+    
+    /* an algorithm the bootloader was not built for */
+    slot[12] = BOOT_SIGNATURE_ALGORITHM + 1;
+    assert(boot_header_parse(slot, sizeof(slot), &header) == BOOT_IMAGE_ERR_PARAM);
+    slot[12] = BOOT_SIGNATURE_ALGORITHM;
+    
+    slot[0] ^= 1;
+    assert(boot_header_parse(slot, sizeof(slot), &header) == BOOT_IMAGE_ERR_PARAM);
+    
+    printf("Image header test PASSED\n");
+}
+
+void test_boot_control_record(void)
+{
+    boot_control_t current = { 0, BOOT_SLOT_A };
+    boot_control_t control;
+    uint8_t copies[2][BOOT_CONTROL_SIZE];
+    
+    printf("Testing boot-control record...\n");
+    
+    /* nothing written yet */
+    memset(copies, 0xff, sizeof(copies));
+    boot_control_read(copies[0], copies[1], &control);
+    assert(control.active_slot == BOOT_SLOT_A && control.sequence == 0);
+    
+    /* each update goes to the copy not in force */
+    assert(boot_control_next(&current, BOOT_SLOT_B, &control, copies[1]) == 0);
+    assert(control.sequence == 1);
+    current = control;
+    assert(boot_control_next(&current, BOOT_SLOT_A, &control, copies[0]) == 0);
+    boot_control_read(copies[0], copies[1], &control);
+    assert(control.active_slot == BOOT_SLOT_A && control.sequence == 2);
+    
+    /* a torn write of copy 1 leaves copy 0 standing */
+    current = control;
+    assert(boot_control_next(&current, BOOT_SLOT_B, &control, copies[1]) == 0);
+    copies[1][40] ^= 0x01;
+    boot_control_read(copies[0], copies[1], &control);
+    assert(control.active_slot == BOOT_SLOT_A && control.sequence == 2);
+    
+    /* the sequence compares across its wrap */
+    current.sequence = 0xffffffffu;
+    assert(boot_control_next(&current, BOOT_SLOT_B, &control, copies[0]) == 0);
+    current.sequence = 0xfffffffeu;
+    assert(boot_control_next(&current, BOOT_SLOT_A, &control, copies[1]) == 0);
+    boot_control_read(copies[0], copies[1], &control);
+    assert(control.active_slot == BOOT_SLOT_B && control.sequence == 0);
+    
+    assert(boot_control_next(&current, 2, &control, copies[0]) == -1);
+    
+    printf("Boot-control record test PASSED\n");
+}
+
+void test_boot_trace(void)
+{
+    boot_trace_t trace;
+    
+    printf("Testing boot phase trace...\n");
+    
+    memset(&trace, 0xff, sizeof(trace));
+    boot_trace_start(&trace);
+    assert(trace.magic == 0);
+    assert(trace.count == 1 && trace.events[0].phase == BOOT_PHASE_START);
+    assert(trace.ticks_per_second != 0);
+    
+    boot_trace_mark(&trace, BOOT_PHASE_CRYPTO_INIT);
+    boot_trace_mark(&trace, BOOT_PHASE_VERSION_CHECK);
+    assert(trace.count == 3);
+    assert(trace.events[2].phase == BOOT_PHASE_VERSION_CHECK);
+    assert(trace.events[2].ticks >= trace.events[1].ticks);
+    
+    /* a long fallback chain stops recording, it does not overrun */
+    for (int i = 0; i < 2 * BOOT_TRACE_MAX_EVENTS; i++) {
+        boot_trace_mark(&trace, BOOT_PHASE_HEADER_PARSE);
+    }
+    assert(trace.count == BOOT_TRACE_MAX_EVENTS);
+    assert(trace.magic == 0);
+    
+    boot_trace_finish(&trace);
+    assert(trace.magic == BOOT_TRACE_MAGIC);
+    
+    printf("Boot phase trace test PASSED\n");
+}
+
 int main(void)
 {
     printf("=== Bootloader Tests ===\n");
     
     test_version_counter();
+    test_version_log_wrap();
     test_signature_verification();
+    test_image_pass_rejects_bad_input();
+    test_lz4_stream();
+    test_merkle_image_blocks();
+    test_header_parse();
+    test_boot_control_record();
+    test_boot_trace();
     
     printf("\nAll tests completed\n");
     return 0;
@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <string.h>
 #include "crypto.h"
+#include "crypto_backend.h"
 
 // Basic crypto tests - TODO: Add more edge cases
 
@@ -43,6 +44,235 @@ void test_hmac_sha256(void)
     printf("HMAC-SHA256 test PASSED\n");
 }
 
+void test_sha256_streaming(void)
+{
+    /* FIPS 180-2 "abc" vector */
+    static const uint8_t abc_hash[SHA256_HASH_SIZE] = {
+        0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea,
+        0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+        0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+        0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+    };
+    uint8_t data[1000];
+    uint8_t one_shot[SHA256_HASH_SIZE];
+    uint8_t hash[SHA256_HASH_SIZE];
+    crypto_sha256_ctx_t ctx;
+    
+    printf("Testing incremental SHA-256...\n");
+    
+    assert(crypto_sha256_init(&ctx) == CRYPTO_SUCCESS);
+    assert(crypto_sha256_update(&ctx, (const uint8_t *)"a", 1) == CRYPTO_SUCCESS);
+    assert(crypto_sha256_update(&ctx, NULL, 0) == CRYPTO_SUCCESS);
+    assert(crypto_sha256_update(&ctx, (const uint8_t *)"bc", 2) == CRYPTO_SUCCESS);
+    assert(crypto_sha256_final(&ctx, hash) == CRYPTO_SUCCESS);
+    assert(memcmp(hash, abc_hash, SHA256_HASH_SIZE) == 0);
+    
+    /* odd chunk sizes that straddle the 64-byte block boundary */
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 31 + 7);
+    }
+    assert(crypto_hash_sha256(data, sizeof(data), one_shot) == CRYPTO_SUCCESS);
+    
+    assert(crypto_sha256_init(&ctx) == CRYPTO_SUCCESS);
+    for (size_t offset = 0, chunk = 1; offset < sizeof(data); offset += chunk, chunk = chunk * 2 + 1) {
+        size_t len = sizeof(data) - offset < chunk ? sizeof(data) - offset : chunk;
+        assert(crypto_sha256_update(&ctx, data + offset, len) == CRYPTO_SUCCESS);
+    }
+    assert(crypto_sha256_final(&ctx, hash) == CRYPTO_SUCCESS);
+    assert(memcmp(hash, one_shot, SHA256_HASH_SIZE) == 0);
+    
+    assert(crypto_sha256_init(NULL) == CRYPTO_ERROR_INVALID_PARAM);
+    
+    printf("Incremental SHA-256 test PASSED\n");
+}
+
+void test_hmac_sha256_streaming(void)
+{
+    uint8_t data[] = "The quick brown fox jumps over the lazy dog";
+    uint8_t key[] = "key";
+    uint8_t one_shot[HMAC_SIZE];
+    uint8_t hmac[HMAC_SIZE];
+    crypto_hmac_sha256_ctx_t ctx;
+    size_t len = strlen((char *)data);
+    
+    printf("Testing incremental HMAC-SHA256...\n");
+    
+    assert(crypto_hmac_sha256(data, len, key, strlen((char *)key), one_shot) == CRYPTO_SUCCESS);
+    
+    assert(crypto_hmac_sha256_init(&ctx, key, strlen((char *)key)) == CRYPTO_SUCCESS);
+    assert(crypto_hmac_sha256_update(&ctx, data, 10) == CRYPTO_SUCCESS);
+    assert(crypto_hmac_sha256_update(&ctx, data + 10, len - 10) == CRYPTO_SUCCESS);
+    assert(crypto_hmac_sha256_final(&ctx, hmac) == CRYPTO_SUCCESS);
+    assert(memcmp(hmac, one_shot, HMAC_SIZE) == 0);
+    
+    assert(crypto_hmac_sha256_init(&ctx, NULL, 0) == CRYPTO_ERROR_INVALID_PARAM);
+    
+    printf("Incremental HMAC-SHA256 test PASSED\n");
+}
+
+void test_backend_raw_helpers(void)
+{
+    /* r has a leading zero pad, s is short and gets left-padded */
+    uint8_t sig[2 + 35 + 33 + 1];   /* one spare byte for the trailing-garbage case */
+    uint8_t r[32], s[32];
+    size_t pos = 0;
+    
+    sig[pos++] = 0x30;
+    sig[pos++] = 35 + 33;
+    sig[pos++] = 0x02;
+    sig[pos++] = 33;
+    sig[pos++] = 0x00;
+    memset(sig + pos, 0x81, 32);
+    pos += 32;
+    sig[pos++] = 0x02;
+    sig[pos++] = 31;
+    memset(sig + pos, 0x22, 31);
+    pos += 31;
+    assert(pos == sizeof(sig) - 1);
+    sig[pos] = 0x00;
+    
+    assert(crypto_backend_ecdsa_signature_raw(sig, pos, r, s) == CRYPTO_SUCCESS);
+    assert(r[0] == 0x81 && r[31] == 0x81);
+    assert(s[0] == 0x00 && s[1] == 0x22 && s[31] == 0x22);
+    
+    /* trailing bytes after the sequence */
+    assert(crypto_backend_ecdsa_signature_raw(sig, pos + 1, r, s) != CRYPTO_SUCCESS);
+    
+    /* bare uncompressed point */
+    uint8_t point[65];
+    const uint8_t *x, *y;
+    
+    point[0] = 0x04;
+    memset(point + 1, 0x11, 32);
+    memset(point + 33, 0x33, 32);
+    assert(crypto_backend_p256_public_raw(point, sizeof(point), &x, &y) == CRYPTO_SUCCESS);
+    assert(x == point + 1 && y == point + 33);
+    
+    point[0] = 0x02;
+    assert(crypto_backend_p256_public_raw(point, sizeof(point), &x, &y) != CRYPTO_SUCCESS);
+    
+    /* in-place decryption is never retried in software after an engine fault */
+    assert(crypto_backend_in_place(point, point, 16));
+    assert(crypto_backend_in_place(point, point + 15, 16));
+    assert(!crypto_backend_in_place(point, point + 16, 16));
+    assert(!crypto_backend_in_place(point + 16, point, 16));
+    
+    printf("Backend raw conversion test PASSED\n");
+}
+
+void test_verifier_rejects_bad_input(void)
+{
+    crypto_verifier_t verifier;
+    uint8_t hash[32] = {0};
+    uint8_t sig[64] = {0};
+    uint8_t garbage[16];
+    
+    memset(garbage, 0xa5, sizeof(garbage));
+    
+    assert(crypto_verifier_init(NULL, garbage, sizeof(garbage)) == CRYPTO_ERROR_INVALID_PARAM);
+    assert(crypto_verifier_init(&verifier, NULL, 0) == CRYPTO_ERROR_INVALID_PARAM);
+    assert(crypto_verifier_init(&verifier, garbage, sizeof(garbage)) == CRYPTO_ERROR_INVALID_KEY);
+    
+    assert(crypto_verifier_verify_hash(NULL, hash, sig, sizeof(sig)) == CRYPTO_ERROR_INVALID_PARAM);
+    assert(crypto_verifier_verify(NULL, hash, sizeof(hash), sig, sizeof(sig)) == CRYPTO_ERROR_INVALID_PARAM);
+    
+    /* freeing NULL is allowed, like the other contexts */
+    crypto_verifier_free(NULL);
+    
+    printf("Verifier input validation test PASSED\n");
+}
+
+void test_merkle_tree(void)
+{
+    uint8_t blocks[5][64];
+    uint8_t tree[11 * SHA256_HASH_SIZE];
+    uint8_t root[SHA256_HASH_SIZE];
+    uint8_t leaf[SHA256_HASH_SIZE];
+    
+    printf("Testing Merkle tree...\n");
+    
+    /* 5 leaves: levels of 5, 3, 2, 1, odd nodes carried up */
+    assert(crypto_merkle_nodes(5) == 11);
+    assert(crypto_merkle_nodes(1) == 1);
+    
+    for (size_t i = 0; i < 5; i++) {
+        memset(blocks[i], (int)i + 1, sizeof(blocks[i]));
+        assert(crypto_merkle_leaf(blocks[i], sizeof(blocks[i]),
+                                  tree + i * SHA256_HASH_SIZE) == CRYPTO_SUCCESS);
+    }
+    assert(crypto_merkle_build(tree, 5, root) == CRYPTO_SUCCESS);
+    assert(memcmp(root, tree + 10 * SHA256_HASH_SIZE, SHA256_HASH_SIZE) == 0);
+    
+    for (size_t i = 0; i < 5; i++) {
+        assert(crypto_merkle_leaf(blocks[i], sizeof(blocks[i]), leaf) == CRYPTO_SUCCESS);
+        assert(crypto_merkle_verify_leaf(tree, 5, i, leaf, root) == CRYPTO_SUCCESS);
+    }
+    
+    /* a changed block, or the right block at the wrong index */
+    blocks[3][10] ^= 1;
+    assert(crypto_merkle_leaf(blocks[3], sizeof(blocks[3]), leaf) == CRYPTO_SUCCESS);
+    assert(crypto_merkle_verify_leaf(tree, 5, 3, leaf, root) == CRYPTO_ERROR_INVALID_SIGNATURE);
+    assert(crypto_merkle_leaf(blocks[1], sizeof(blocks[1]), leaf) == CRYPTO_SUCCESS);
+    assert(crypto_merkle_verify_leaf(tree, 5, 2, leaf, root) == CRYPTO_ERROR_INVALID_SIGNATURE);
+    assert(crypto_merkle_verify_leaf(tree, 5, 5, leaf, root) == CRYPTO_ERROR_INVALID_PARAM);
+    
+    printf("Merkle tree test PASSED\n");
+}
+
+void test_p256_verify(void)
+{
+    /* test key, signature of SHA-256("firmware 1") made offline */
+    static const uint8_t point[64] = {
+        0x69, 0x6d, 0x72, 0x4d, 0x9c, 0xa1, 0x83, 0x06, 0xd2, 0x1e, 0x58, 0x49,
+        0xdd, 0x0b, 0x45, 0xcd, 0xbd, 0xad, 0x0a, 0x58, 0x78, 0xe8, 0xee, 0x1f,
+        0x96, 0x79, 0xd4, 0x9d, 0x1b, 0x52, 0x4d, 0x54, 0xbf, 0xc6, 0x44, 0x70,
+        0xf9, 0x42, 0xda, 0x15, 0x19, 0xa5, 0xfb, 0x5d, 0xc6, 0xad, 0x02, 0xf7,
+        0x4e, 0xf1, 0x48, 0x71, 0xc5, 0x00, 0x69, 0xc9, 0x12, 0x35, 0x6f, 0x66,
+        0x13, 0x36, 0xfa, 0xc7
+    };
+    static const uint8_t sig[64] = {
+        0x2d, 0x71, 0x3f, 0x0f, 0xaa, 0x60, 0x06, 0x84, 0x61, 0xf5, 0x4c, 0x21,
+        0xc3, 0xbc, 0x40, 0xd0, 0x09, 0x31, 0xfd, 0x18, 0xdf, 0xda, 0x5f, 0x84,
+        0x3a, 0x6e, 0x9a, 0x6a, 0x5a, 0x10, 0x9b, 0x59, 0x5f, 0xa6, 0x8d, 0xd7,
+        0x59, 0x12, 0x25, 0x8d, 0x15, 0xee, 0x50, 0x8c, 0x56, 0xd1, 0x50, 0xa4,
+        0x50, 0xbe, 0x1c, 0x8c, 0x48, 0x94, 0x8a, 0xb9, 0x75, 0xb3, 0x18, 0x1e,
+        0x68, 0x76, 0x18, 0x75
+    };
+    static uint8_t table[CRYPTO_P256_TABLE_SIZE];
+    uint8_t hash[32];
+    uint8_t bad[64];
+    
+    printf("Testing P-256 comb verification...\n");
+    
+    assert(crypto_hash_sha256((const uint8_t *)"firmware 1", 10, hash) == CRYPTO_SUCCESS);
+    assert(crypto_p256_table(point, table) == CRYPTO_SUCCESS);
+    assert(memcmp(table, point, sizeof(point)) == 0);
+    
+    assert(crypto_p256_verify(hash, sig, sig + 32, table) == CRYPTO_SUCCESS);
+    assert(crypto_verify_ecdsa_hash(hash, sig, sizeof(sig), table, sizeof(table)) == CRYPTO_SUCCESS);
+    
+    /* a table is an ECDSA key, never an RSA one */
+    assert(crypto_verify_rsa_hash(hash, sig, sizeof(sig), table, sizeof(table)) == CRYPTO_ERROR_INVALID_KEY);
+    
+    hash[0] ^= 1;
+    assert(crypto_p256_verify(hash, sig, sig + 32, table) == CRYPTO_ERROR_INVALID_SIGNATURE);
+    hash[0] ^= 1;
+    
+    /* s = 0 and r = n are out of range */
+    memcpy(bad, sig, sizeof(bad));
+    memset(bad + 32, 0, 32);
+    assert(crypto_p256_verify(hash, bad, bad + 32, table) == CRYPTO_ERROR_INVALID_SIGNATURE);
+    
+    /* a point off the curve makes no table, a damaged table no key */
+    memcpy(bad, point, sizeof(bad));
+    bad[63] ^= 1;
+    assert(crypto_p256_table(bad, table + 64) == CRYPTO_ERROR_INVALID_KEY);
+    table[100] ^= 1;
+    assert(crypto_p256_verify(hash, sig, sig + 32, table) == CRYPTO_ERROR_INVALID_KEY);
+    
+    printf("P-256 comb verification test PASSED\n");
+}
+
 int main(void)
 {
     printf("=== Crypto Tests ===\n");
@@ -51,6 +281,12 @@ int main(void)
     
     test_hash_sha256();
     test_hmac_sha256();
+    test_sha256_streaming();
+    test_hmac_sha256_streaming();
+    test_backend_raw_helpers();
+    test_verifier_rejects_bad_input();
+    test_merkle_tree();
+    test_p256_verify();
     
     printf("\nAll crypto tests completed\n");
     return 0;
@@ -1,6 +1,14 @@
 #include <stdio.h>
 #include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include "ota.h"
+#include "boot_config.h"
+#include "boot_control.h"
 
 void test_ota_download(void)
 {
@@ -9,6 +17,192 @@ void test_ota_download(void)
     printf("OTA download test SKIPPED (requires server)\n");
 }
 
+void test_ota_session(void)
+{
+    ota_session_t session;
+    void *curl;
+    
+    printf("Testing OTA session reuse...\n");
+    
+    assert(ota_session_init(&session) == 0);
+    
+    /* every request of the session runs on the same handle */
+    curl = ota_session_begin(&session, "http://localhost/a");
+    assert(curl != NULL);
+    ota_session_end(&session, curl);
+    assert(ota_session_begin(&session, "http://localhost/b") == curl);
+    ota_session_end(&session, curl);
+    
+    /* without a session each request gets its own */
+    curl = ota_session_begin(NULL, "http://localhost/c");
+    assert(curl != NULL && curl != session.curl);
+    ota_session_end(NULL, curl);
+    
+    ota_session_free(&session);
+    assert(session.curl == NULL && session.share == NULL);
+    
+    printf("OTA session test PASSED\n");
+}
+
+/* Fake nameserver: answer the query waiting on fd with one A record, or
+ * with NXDOMAIN and an SOA whose TTLs are both ttl */
+static void dns_reply(int fd, const char *addr, uint32_t ttl, int nxdomain)
+{
+    uint8_t msg[512];
+    struct sockaddr_in from;
+    socklen_t fromlen = sizeof(from);
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    uint8_t rr[64];
+    size_t rrlen = 0;
+    ssize_t n;
+    int i;
+    
+    assert(poll(&pfd, 1, 1000) == 1);
+    n = recvfrom(fd, msg, sizeof(msg), 0, (struct sockaddr *)&from, &fromlen);
+    assert(n > 12);
+    
+    rr[rrlen++] = 0xc0;             /* the question's name */
+    rr[rrlen++] = 12;
+    rr[rrlen++] = 0;
+    rr[rrlen++] = nxdomain ? 6 : 1;
+    rr[rrlen++] = 0;
+    rr[rrlen++] = 1;
+    for (i = 3; i >= 0; i--) {
+        rr[rrlen++] = (uint8_t)(ttl >> (8 * i));
+    }
+    rr[rrlen++] = 0;
+    if (nxdomain) {
+        rr[rrlen++] = 22;           /* root MNAME and RNAME, five counters */
+        memset(rr + rrlen, 0, 18);
+        rrlen += 18;
+        for (i = 3; i >= 0; i--) {
+            rr[rrlen++] = (uint8_t)(ttl >> (8 * i));
+        }
+    } else {
+        rr[rrlen++] = 4;
+        assert(inet_pton(AF_INET, addr, rr + rrlen) == 1);
+        rrlen += 4;
+    }
+    
+    msg[2] = 0x81;                  /* QR, RD */
+    msg[3] = nxdomain ? 0x83 : 0x80;
+    msg[7] = nxdomain ? 0 : 1;      /* ANCOUNT */
+    msg[9] = nxdomain ? 1 : 0;      /* NSCOUNT */
+    memcpy(msg + n, rr, rrlen);
+    assert(sendto(fd, msg, n + rrlen, 0, (struct sockaddr *)&from, fromlen) == (ssize_t)(n + rrlen));
+}
+
+static int dns_query_waiting(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    
+    return poll(&pfd, 1, 0) == 1;
+}
+
+void test_ota_resolver(void)
+{
+    ota_resolver_t resolver;
+    struct sockaddr_in sa;
+    socklen_t salen = sizeof(sa);
+    struct pollfd pfd;
+    uint32_t addr;
+    int ns;
+    
+    printf("Testing DNS resolver...\n");
+    
+    ns = socket(AF_INET, SOCK_DGRAM, 0);
+    assert(ns >= 0);
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(bind(ns, (struct sockaddr *)&sa, sizeof(sa)) == 0);
+    assert(getsockname(ns, (struct sockaddr *)&sa, &salen) == 0);
+    assert(ota_resolver_init(&resolver, "127.0.0.1", ntohs(sa.sin_port)) == 0);
+    
+    /* a miss sends and returns, the answer is cached for its TTL */
+    assert(ota_resolve_start(&resolver, "ota.example.test", &addr) == OTA_DNS_PENDING);
+    dns_reply(ns, "10.0.0.1", 1, 0);
+    assert(ota_resolve(&resolver, "ota.example.test", &addr, 1000) == OTA_DNS_OK);
+    assert(addr == inet_addr("10.0.0.1"));
+    assert(ota_resolve_start(&resolver, "OTA.example.test", &addr) == OTA_DNS_OK);
+    assert(!dns_query_waiting(ns));
+    
+    /* near expiry a hit still answers at once, and refreshes meanwhile */
+    poll(NULL, 0, 950);
+    assert(ota_resolve_start(&resolver, "ota.example.test", &addr) == OTA_DNS_OK);
+    assert(addr == inet_addr("10.0.0.1"));
+    dns_reply(ns, "10.0.0.2", 60, 0);
+    pfd.fd = ota_resolver_fd(&resolver);
+    pfd.events = POLLIN;
+    assert(poll(&pfd, 1, 1000) == 1);
+    ota_resolver_process(&resolver);
+    assert(ota_resolve_start(&resolver, "ota.example.test", &addr) == OTA_DNS_OK);
+    assert(addr == inet_addr("10.0.0.2"));
+    
+    /* names that do not exist are cached too */
+    assert(ota_resolve_start(&resolver, "missing.example.test", &addr) == OTA_DNS_PENDING);
+    dns_reply(ns, NULL, 60, 1);
+    assert(ota_resolve(&resolver, "missing.example.test", &addr, 1000) == OTA_DNS_NXDOMAIN);
+    assert(ota_resolve_start(&resolver, "missing.example.test", &addr) == OTA_DNS_NXDOMAIN);
+    assert(!dns_query_waiting(ns));
+    
+    /* no answer within the timeout */
+    assert(ota_resolve(&resolver, "silent.example.test", &addr, 100) == OTA_DNS_ERROR);
+    
+    ota_resolver_free(&resolver);
+    close(ns);
+    
+    printf("DNS resolver test PASSED\n");
+}
+
+void test_ota_install_ab(void)
+{
+    static uint8_t image[3 * OTA_INSTALL_STEP_SIZE + 100];
+    static uint8_t readback[sizeof(image)];
+    ota_install_t install;
+    FILE *fp;
+    int steps = 0;
+    int ret;
+    
+    printf("Testing A/B install...\n");
+    
+    unlink(OTA_BOOT_CONTROL_PATH);
+    unlink(OTA_SLOT_A_PATH);
+    unlink(OTA_SLOT_B_PATH);
+    memset(image, 0x5a, sizeof(image));
+    
+    /* no record yet: A boots, B is written, one block per step */
+    assert(ota_install_begin(&install, image, sizeof(image)) == 0);
+    assert(install.slot == BOOT_SLOT_B);
+    while ((ret = ota_install_step(&install)) > 0) {
+        steps++;
+    }
+    assert(ret == 0);
+    assert(steps == 7);
+    assert(ota_install_step(&install) == -1);
+    
+    fp = fopen(OTA_SLOT_B_PATH, "rb");
+    assert(fp && fread(readback, 1, sizeof(readback), fp) == sizeof(readback));
+    fclose(fp);
+    assert(memcmp(readback, image, sizeof(image)) == 0);
+    
+    /* B is live now, the next install goes to A */
+    assert(ota_install_begin(&install, image, sizeof(image)) == 0);
+    assert(install.slot == BOOT_SLOT_A && install.sequence == 1);
+    ota_install_abort(&install);
+    
+    /* an abandoned install leaves the record alone */
+    assert(ota_install_begin(&install, image, sizeof(image)) == 0);
+    assert(install.slot == BOOT_SLOT_A && install.sequence == 1);
+    assert(ota_install_firmware(image, sizeof(image)) == 0);
+    ota_install_abort(&install);
+    assert(ota_install_begin(&install, image, sizeof(image)) == 0);
+    assert(install.slot == BOOT_SLOT_B && install.sequence == 2);
+    ota_install_abort(&install);
+    
+    printf("A/B install test PASSED\n");
+}
+
 void test_ota_verify(void)
 {
     printf("Testing OTA verification...\n");
@@ -20,6 +214,9 @@ int main(void)
 {
     printf("=== OTA Tests ===\n");
     test_ota_download();
+    test_ota_session();
+    test_ota_resolver();
+    test_ota_install_ab();
     test_ota_verify();
     printf("\nAll OTA tests completed\n");
     return 0;
@@ -1,5 +1,6 @@
 #!/bin/bash
 # Generate keys for secure boot and firmware encryption
+# v1.1 - The boot key is P-256, with its comb table for the key storage area
 # v1.0 - Initial version
 
 set -e
@@ -9,13 +10,17 @@ mkdir -p "$KEYS_DIR"
 
 echo "Generating keys for secure boot..."
 
-# Generate RSA key pair for bootloader
-openssl genrsa -out "$KEYS_DIR/boot_private_key.pem" 2048
-openssl rsa -in "$KEYS_DIR/boot_private_key.pem" -pubout -out "$KEYS_DIR/boot_public_key.pem"
+# Generate ECDSA P-256 key pair for bootloader
+openssl ecparam -genkey -name prime256v1 -noout -out "$KEYS_DIR/boot_private_key.pem"
+openssl ec -in "$KEYS_DIR/boot_private_key.pem" -pubout -out "$KEYS_DIR/boot_public_key.pem"
 
-# Generate ECDSA key pair (alternative)
-openssl ecparam -genkey -name prime256v1 -out "$KEYS_DIR/ecdsa_private_key.pem"
-openssl ec -in "$KEYS_DIR/ecdsa_private_key.pem" -pubout -out "$KEYS_DIR/ecdsa_public_key.pem"
+# What BOOT_PUBLIC_KEY_ADDRESS holds: the key as a precomputed comb table
+python3 "$(dirname "$0")/../ota_server/make_key_table.py" \
+    "$KEYS_DIR/boot_public_key.pem" "$KEYS_DIR/boot_key_table.bin"
+
+# Generate RSA key pair (alternative, BOOT_SIGNATURE_ALGORITHM_RSA_2048 builds)
+openssl genrsa -out "$KEYS_DIR/rsa_private_key.pem" 2048
+openssl rsa -in "$KEYS_DIR/rsa_private_key.pem" -pubout -out "$KEYS_DIR/rsa_public_key.pem"
 
 # Generate AES key for firmware encryption
 openssl rand -out "$KEYS_DIR/firmware_key.bin" 32
@@ -26,8 +31,9 @@ openssl rand -out "$KEYS_DIR/hmac_key.bin" 32
 echo "Keys generated successfully in $KEYS_DIR/"
 echo "  - boot_private_key.pem"
 echo "  - boot_public_key.pem"
-echo "  - ecdsa_private_key.pem"
-echo "  - ecdsa_public_key.pem"
+echo "  - boot_key_table.bin"
+echo "  - rsa_private_key.pem"
+echo "  - rsa_public_key.pem"
 echo "  - firmware_key.bin"
 echo "  - hmac_key.bin"
 
@@ -1,5 +1,6 @@
 #!/bin/bash
-# Sign firmware with RSA private key
+# Sign firmware with the boot private key
+# v1.1 - ECDSA P-256 boot key, DER signature as mbedTLS expects it
 # v1.0 - Initial version
 
 set -e
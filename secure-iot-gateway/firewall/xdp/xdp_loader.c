@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <linux/if_link.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+#include "xdp_prefilter.h"
+
+// v1.0 - Load the XDP pre-filter and keep it fed
+// Usage: xdp_loader <interface> <acl_rules.json> [pps burst]
+// Attaches xdp_prefilter.bpf.o (native mode, generic as fallback), pins
+// its maps under XDP_PIN_DIR for the rate limiter, loads the ACL rules
+// (enforced on TCP SYNs only, conntrack decides the rest) and the
+// per-source packet budget, then every XDP_REPORT_SEC reports
+// per-source drops and clears expired blocklist entries. SIGINT or
+// SIGTERM detaches the program; the pinned maps stay, so a restart
+// keeps the blocklist.
+// Build: clang -O2 -g -target bpf -c xdp_prefilter.bpf.c -o xdp_prefilter.bpf.o
+//        cc -O2 xdp_loader.c -o xdp_loader -lbpf
+
+#define XDP_OBJECT "xdp_prefilter.bpf.o"
+#define XDP_REPORT_SEC 10
+#define XDP_REPORT_TOP 10
+#define ACL_MAX_FILE 65536
+
+static volatile sig_atomic_t running = 1;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    running = 0;
+}
+
+/* "key": "value" inside one rule object; the file is ours, not arbitrary JSON */
+static int json_string(const char *obj, const char *end, const char *key, char *out, size_t size)
+{
+    char pattern[64];
+    const char *p, *q;
+    
+    snprintf(pattern, sizeof(pattern), "\"%s\"", key);
+    p = strstr(obj, pattern);
+    if (!p || p >= end || !(p = strchr(p + strlen(pattern), '"')) || p >= end ||
+        !(q = strchr(p + 1, '"')) || q >= end || (size_t)(q - p - 1) >= size) {
+        return -1;
+    }
+    memcpy(out, p + 1, (size_t)(q - p - 1));
+    out[q - p - 1] = '\0';
+    return 0;
+}
+
+static int json_ports(const char *obj, const char *end, struct xdp_acl_rule *rule)
+{
+    const char *p = strstr(obj, "\"ports\"");
+    char *next;
+    
+    if (!p || p >= end) {
+        return 0;               /* any port */
+    }
+    p = strchr(p, '[');
+    if (!p || p >= end) {
+        return -1;
+    }
+    for (p++; p < end && *p != ']'; p = next) {
+        long port = strtol(p, &next, 10);
+    
+        if (next == p) {
+            next = (char *)p + 1;   /* separator */
+            continue;
+        }
+        if (port < 1 || port > 65535 || rule->nports == XDP_ACL_MAX_PORTS) {
+            return -1;
+        }
+        rule->ports[rule->nports++] = htons((uint16_t)port);
+    }
+    return 0;
+}
+
+/* "a.b.c.d/len" to network-order address and mask */
+static int parse_prefix(const char *text, __u32 *addr, __u32 *mask)
+{
+    char buf[32];
+    char *slash;
+    struct in_addr in;
+    long len = 32;
+    
+    snprintf(buf, sizeof(buf), "%s", text);
+    slash = strchr(buf, '/');
+    if (slash) {
+        *slash = '\0';
+        len = strtol(slash + 1, NULL, 10);
+    }
+    if (len < 0 || len > 32 || inet_pton(AF_INET, buf, &in) != 1) {
+        return -1;
+    }
+    *mask = len ? htonl(0xffffffffu << (32 - len)) : 0;
+    *addr = in.s_addr & *mask;
+    return 0;
+}
+
+static int load_acl(int map_fd, const char *path)
+{
+    static char text[ACL_MAX_FILE];
+    const char *p, *end;
+    FILE *fp;
+    size_t len;
+    __u32 n = 0;
+    
+    fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+    len = fread(text, 1, sizeof(text) - 1, fp);
+    fclose(fp);
+    text[len] = '\0';
+    
+    p = strstr(text, "\"acl_rules\"");
+    p = p ? strchr(p, '[') : NULL;
+    while (p && (p = strchr(p, '{')) != NULL) {
+        struct xdp_acl_rule rule;
+        char value[64];
+    
+        end = strchr(p, '}');
+        if (!end || n == XDP_ACL_MAX_RULES) {
+            fprintf(stderr, "%s: malformed or more than %d rules\n", path, XDP_ACL_MAX_RULES);
+            return -1;
+        }
+    
+        memset(&rule, 0, sizeof(rule));
+        if (json_string(p, end, "action", value, sizeof(value)) != 0 ||
+            (strcmp(value, "deny") != 0 && strcmp(value, "allow") != 0)) {
+            fprintf(stderr, "%s: rule %u needs an action of \"allow\" or \"deny\"\n", path, n + 1);
+            return -1;
+        }
+        rule.action = strcmp(value, "deny") == 0 ? XDP_ACL_DENY : XDP_ACL_ALLOW;
+    
+        /* A typo must not widen a rule to every protocol */
+        if (json_string(p, end, "protocol", value, sizeof(value)) == 0) {
+            if (strcmp(value, "tcp") == 0) {
+                rule.protocol = IPPROTO_TCP;
+            } else if (strcmp(value, "udp") == 0) {
+                rule.protocol = IPPROTO_UDP;
+            } else if (strcmp(value, "icmp") == 0) {
+                rule.protocol = IPPROTO_ICMP;
+            } else if (strcmp(value, "all") != 0) {
+                fprintf(stderr, "%s: rule %u has unknown protocol \"%s\"\n", path, n + 1, value);
+                return -1;
+            }
+        }
+        if (json_string(p, end, "source", value, sizeof(value)) != 0 ||
+            parse_prefix(value, &rule.src_addr, &rule.src_mask) != 0 ||
+            json_string(p, end, "destination", value, sizeof(value)) != 0 ||
+            parse_prefix(value, &rule.dst_addr, &rule.dst_mask) != 0 ||
+            json_ports(p, end, &rule) != 0) {
+            fprintf(stderr, "%s: bad rule %u\n", path, n + 1);
+            return -1;
+        }
+    
+        if (bpf_map_update_elem(map_fd, &n, &rule, BPF_ANY) != 0) {
+            perror("acl_rules update");
+            return -1;
+        }
+        n++;
+        p = end + 1;
+    }
+    
+    /* action 0 ends the list; clears rules left from a longer file */
+    while (n < XDP_ACL_MAX_RULES) {
+        struct xdp_acl_rule none;
+    
+        memset(&none, 0, sizeof(none));
+        bpf_map_update_elem(map_fd, &n, &none, BPF_ANY);
+        n++;
+    }
+    return 0;
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Expired blocks out, so the map holds only live decisions */
+static int expire_blocklist(int map_fd)
+{
+    uint64_t now = monotonic_ns();
+    __u32 key, next;
+    __u64 until;
+    int active = 0;
+    int more;
+    
+    more = bpf_map_get_next_key(map_fd, NULL, &next) == 0;
+    while (more) {
+        key = next;
+        more = bpf_map_get_next_key(map_fd, &key, &next) == 0;
+        if (bpf_map_lookup_elem(map_fd, &key, &until) == 0) {
+            if (until <= now) {
+                bpf_map_delete_elem(map_fd, &key);
+            } else {
+                active++;
+            }
+        }
+    }
+    return active;
+}
+
+static void report(int sources_fd, int blocklist_fd)
+{
+    struct {
+        __u32 addr;
+        __u64 dropped;
+    } top[XDP_REPORT_TOP];
+    struct xdp_source_stats st;
+    __u64 packets = 0, dropped = 0;
+    __u32 key, next;
+    int count = 0, ntop = 0;
+    int more, i;
+    char text[INET_ADDRSTRLEN];
+    
+    more = bpf_map_get_next_key(sources_fd, NULL, &next) == 0;
+    while (more) {
+        key = next;
+        more = bpf_map_get_next_key(sources_fd, &key, &next) == 0;
+        if (bpf_map_lookup_elem(sources_fd, &key, &st) != 0) {
+            continue;
+        }
+        count++;
+        packets += st.packets;
+        dropped += st.dropped;
+    
+        /* keep the heaviest droppers, sorted, smallest last */
+        if (ntop < XDP_REPORT_TOP) {
+            i = ntop++;
+        } else if (st.dropped > top[XDP_REPORT_TOP - 1].dropped) {
+            i = XDP_REPORT_TOP - 1;
+        } else {
+            continue;
+        }
+        for (; i > 0 && top[i - 1].dropped < st.dropped; i--) {
+            top[i] = top[i - 1];
+        }
+        top[i].addr = key;
+        top[i].dropped = st.dropped;
+    }
+    
+    printf("XDP: %d sources, %llu packets, %llu dropped, %d blocked\n", count,
+           (unsigned long long)packets, (unsigned long long)dropped, expire_blocklist(blocklist_fd));
+    for (i = 0; i < ntop && top[i].dropped; i++) {
+        inet_ntop(AF_INET, &top[i].addr, text, sizeof(text));
+        printf("  %-15s %llu dropped\n", text, (unsigned long long)top[i].dropped);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    LIBBPF_OPTS(bpf_object_open_opts, opts, .pin_root_path = XDP_PIN_DIR);
+    struct xdp_config cfg = { 0, 0 };
+    struct bpf_object *obj;
+    struct bpf_program *prog;
+    unsigned int ifindex;
+    __u32 mode = XDP_FLAGS_DRV_MODE;
+    __u32 zero = 0;
+    int acl_fd, config_fd, sources_fd, blocklist_fd;
+    
+    if (argc != 3 && argc != 5) {
+        fprintf(stderr, "Usage: %s <interface> <acl_rules.json> [pps burst]\n", argv[0]);
+        return 1;
+    }
+    ifindex = if_nametoindex(argv[1]);
+    if (!ifindex) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (argc == 5) {
+        cfg.rate_pps = strtoull(argv[3], NULL, 10);
+        cfg.burst = strtoull(argv[4], NULL, 10);
+    }
+    
+    obj = bpf_object__open_file(XDP_OBJECT, &opts);
+    if (!obj || bpf_object__load(obj) != 0) {
+        fprintf(stderr, "Unable to load %s\n", XDP_OBJECT);
+        return 1;
+    }
+    prog = bpf_object__find_program_by_name(obj, "xdp_prefilter");
+    acl_fd = bpf_object__find_map_fd_by_name(obj, "acl_rules");
+    config_fd = bpf_object__find_map_fd_by_name(obj, "config");
+    sources_fd = bpf_object__find_map_fd_by_name(obj, "sources");
+    blocklist_fd = bpf_object__find_map_fd_by_name(obj, "blocklist");
+    if (!prog || acl_fd < 0 || config_fd < 0 || sources_fd < 0 || blocklist_fd < 0) {
+        fprintf(stderr, "%s: missing program or maps\n", XDP_OBJECT);
+        return 1;
+    }
+    
+    if (load_acl(acl_fd, argv[2]) != 0 ||
+        bpf_map_update_elem(config_fd, &zero, &cfg, BPF_ANY) != 0) {
+        return 1;
+    }
+    
+    /* Native in the driver where supported, else generic after the skb */
+    if (bpf_xdp_attach((int)ifindex, bpf_program__fd(prog), mode, NULL) != 0) {
+        mode = XDP_FLAGS_SKB_MODE;
+        if (bpf_xdp_attach((int)ifindex, bpf_program__fd(prog), mode, NULL) != 0) {
+            fprintf(stderr, "Unable to attach XDP to %s\n", argv[1]);
+            return 1;
+        }
+    }
+    printf("XDP pre-filter on %s (%s mode)\n", argv[1],
+           mode == XDP_FLAGS_DRV_MODE ? "native" : "generic");
+    
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    while (running) {
+        sleep(XDP_REPORT_SEC);
+        report(sources_fd, blocklist_fd);
+    }
+    
+    bpf_xdp_detach((int)ifindex, mode, NULL);
+    bpf_object__close(obj);
+    return 0;
+}
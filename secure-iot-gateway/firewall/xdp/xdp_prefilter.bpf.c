@@ -0,0 +1,187 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/in.h>
+#include <linux/tcp.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+#include "xdp_prefilter.h"
+
+/*
+ * Driver-level pre-filter in front of nftables and the TLS servers.
+ * A packet is dropped before an skb exists if its source is on the
+ * blocklist the user space limiter fills, if it exceeds the per-source
+ * packet budget, or if it is a TCP SYN opening a connection a deny rule
+ * from acl_rules.json refuses. This stage runs before conntrack and
+ * cannot tell a reply from a new flow, so the rules apply only to the
+ * one packet that is always new; everything else, including all UDP,
+ * ICMP and non-IPv4 traffic, goes on to the kernel firewall unchanged.
+ * It only drops early, it never accepts on nftables' behalf.
+ */
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, XDP_ACL_MAX_RULES);
+    __type(key, __u32);
+    __type(value, struct xdp_acl_rule);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} acl_rules SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct xdp_config);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} config SEC(".maps");
+
+/* source address -> blocked until (ns) */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, XDP_MAX_BLOCKED);
+    __type(key, __u32);
+    __type(value, __u64);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} blocklist SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, XDP_MAX_SOURCES);
+    __type(key, __u32);
+    __type(value, struct xdp_source_stats);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} sources SEC(".maps");
+
+static __always_inline int acl_match(const struct xdp_acl_rule *rule, __u32 saddr, __u32 daddr,
+                                     __u8 protocol, __u16 dport)
+{
+    __u32 i;
+    
+    if (rule->protocol && rule->protocol != protocol) {
+        return 0;
+    }
+    if ((saddr & rule->src_mask) != rule->src_addr || (daddr & rule->dst_mask) != rule->dst_addr) {
+        return 0;
+    }
+    if (rule->nports == 0) {
+        return 1;
+    }
+    for (i = 0; i < XDP_ACL_MAX_PORTS; i++) {
+        if (i < rule->nports && rule->ports[i] == dport) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Token bucket per source. Updates from different CPUs may race and
+ * lose a token or two; the limit is a flood guard, not an accounting.
+ */
+static __always_inline int over_budget(struct xdp_source_stats *st, const struct xdp_config *cfg,
+                                       __u64 now)
+{
+    __u64 cap = cfg->burst * 1000000000ull;
+    __u64 tokens = st->tokens + (now - st->last_ns) * cfg->rate_pps;
+    
+    if (tokens > cap) {
+        tokens = cap;
+    }
+    st->last_ns = now;
+    if (tokens < 1000000000ull) {
+        st->tokens = tokens;
+        return 1;
+    }
+    st->tokens = tokens - 1000000000ull;
+    return 0;
+}
+
+SEC("xdp")
+int xdp_prefilter(struct xdp_md *ctx)
+{
+    void *data = (void *)(long)ctx->data;
+    void *data_end = (void *)(long)ctx->data_end;
+    struct ethhdr *eth = data;
+    struct iphdr *ip;
+    struct xdp_source_stats *st;
+    struct xdp_config *cfg;
+    __u64 now = bpf_ktime_get_ns();
+    __u64 *until;
+    __u16 dport = 0;
+    int syn = 0;
+    __u32 key = 0;
+    __u32 i;
+    
+    if ((void *)(eth + 1) > data_end || eth->h_proto != bpf_htons(ETH_P_IP)) {
+        return XDP_PASS;
+    }
+    ip = (void *)(eth + 1);
+    if ((void *)(ip + 1) > data_end || ip->ihl < 5) {
+        return XDP_PASS;
+    }
+    
+    st = bpf_map_lookup_elem(&sources, &ip->saddr);
+    if (!st) {
+        struct xdp_source_stats fresh = { .last_ns = now };
+    
+        cfg = bpf_map_lookup_elem(&config, &key);
+        if (cfg) {
+            fresh.tokens = cfg->burst * 1000000000ull;
+        }
+        bpf_map_update_elem(&sources, &ip->saddr, &fresh, BPF_NOEXIST);
+        st = bpf_map_lookup_elem(&sources, &ip->saddr);
+        if (!st) {
+            return XDP_PASS;
+        }
+    }
+    __sync_fetch_and_add(&st->packets, 1);
+    __sync_fetch_and_add(&st->bytes, (__u64)(data_end - data));
+    
+    /* Pushed by the user space limiter; stale entries age out of the LRU */
+    until = bpf_map_lookup_elem(&blocklist, &ip->saddr);
+    if (until && now < *until) {
+        goto drop;
+    }
+    
+    cfg = bpf_map_lookup_elem(&config, &key);
+    if (cfg && cfg->rate_pps && over_budget(st, cfg, now)) {
+        goto drop;
+    }
+    
+    /* A connection's first segment, never in a later fragment */
+    if (ip->protocol == IPPROTO_TCP && !(ip->frag_off & bpf_htons(0x1fff))) {
+        struct tcphdr *tcp = (void *)ip + ip->ihl * 4;
+    
+        if ((void *)(tcp + 1) <= data_end && tcp->syn && !tcp->ack) {
+            dport = tcp->dest;
+            syn = 1;
+        }
+    }
+    if (!syn) {
+        return XDP_PASS;
+    }
+    
+    for (i = 0; i < XDP_ACL_MAX_RULES; i++) {
+        __u32 index = i;
+        struct xdp_acl_rule *rule = bpf_map_lookup_elem(&acl_rules, &index);
+    
+        if (!rule || rule->action == 0) {
+            break;
+        }
+        if (acl_match(rule, ip->saddr, ip->daddr, ip->protocol, dport)) {
+            if (rule->action == XDP_ACL_DENY) {
+                goto drop;
+            }
+            break;              /* allowed here, nftables still decides */
+        }
+    }
+    
+    return XDP_PASS;
+    
+drop:
+    __sync_fetch_and_add(&st->dropped, 1);
+    return XDP_DROP;
+}
+
+char LICENSE[] SEC("license") = "GPL";
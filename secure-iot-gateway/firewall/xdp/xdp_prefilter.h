@@ -0,0 +1,55 @@
+#ifndef XDP_PREFILTER_H
+#define XDP_PREFILTER_H
+
+#include <linux/types.h>
+
+/*
+ * Shared between the XDP program, its loader and the user space rate
+ * limiter. Addresses and ports are in network byte order, times are
+ * CLOCK_MONOTONIC nanoseconds (bpf_ktime_get_ns).
+ */
+
+#define XDP_PIN_DIR "/sys/fs/bpf/iot_gateway"
+#define XDP_BLOCKLIST_PIN XDP_PIN_DIR "/blocklist"
+#define XDP_SOURCES_PIN XDP_PIN_DIR "/sources"
+#define XDP_ACL_PIN XDP_PIN_DIR "/acl_rules"
+#define XDP_CONFIG_PIN XDP_PIN_DIR "/config"
+
+#define XDP_ACL_MAX_RULES 32
+#define XDP_ACL_MAX_PORTS 8
+#define XDP_MAX_SOURCES 65536
+#define XDP_MAX_BLOCKED 65536
+
+#define XDP_ACL_ALLOW 1
+#define XDP_ACL_DENY 2
+
+/*
+ * One acl_rules.json entry; rules are tried in order, first match wins,
+ * and only against TCP SYNs - the rest is left to nftables' conntrack
+ */
+struct xdp_acl_rule {
+    __u32 action;               /* 0 ends the list */
+    __u32 protocol;             /* IPPROTO_*, 0 for all */
+    __u32 src_addr;
+    __u32 src_mask;
+    __u32 dst_addr;
+    __u32 dst_mask;
+    __u32 nports;               /* 0 for any port */
+    __u16 ports[XDP_ACL_MAX_PORTS];
+};
+
+/* Per-source token bucket for the driver-level limit; 0 pps disables */
+struct xdp_config {
+    __u64 rate_pps;
+    __u64 burst;
+};
+
+struct xdp_source_stats {
+    __u64 packets;
+    __u64 bytes;
+    __u64 dropped;
+    __u64 tokens;               /* scaled by 1e9 so refill needs no division */
+    __u64 last_ns;
+};
+
+#endif /* XDP_PREFILTER_H */
@@ -0,0 +1,79 @@
+#!/bin/bash
+# Capture drop benchmark: replay a pcap at line rate into the sensor
+# interface and report what the kernel delivered and dropped
+# Usage: capture_bench.sh <pcap> <tx-interface> [seconds] [mode]
+# The tx interface is cabled (or veth-paired) to the sensor interface.
+
+set -e
+
+cd "$(dirname "$0")"
+
+PCAP=$1
+TX_IFACE=$2
+DURATION=${3:-60}
+MODE=${4:-suricata-afpacket}
+STATS=/var/log/suricata/eve.json
+
+if [ -z "$PCAP" ] || [ -z "$TX_IFACE" ]; then
+    echo "Usage: $0 <pcap> <tx-interface> [seconds] [mode]"
+    exit 1
+fi
+
+# Last stats record's counter, 0 if absent
+suricata_counter() {
+    tail -n 200 "$STATS" | grep '"event_type":"stats"' | tail -n 1 | \
+        python3 -c "import json,sys
+d=json.loads(sys.stdin.read() or '{}').get('stats',{})
+for k in '$1'.split('.'):
+    d=d.get(k,{}) if isinstance(d,dict) else {}
+print(d if isinstance(d,int) else 0)"
+}
+
+./start_ids.sh "$MODE"
+sleep 10
+
+case "$MODE" in
+suricata-*)
+    START_PKTS=$(suricata_counter capture.kernel_packets)
+    START_DROPS=$(suricata_counter capture.kernel_drops)
+    ;;
+esac
+
+echo "Replaying $PCAP on $TX_IFACE for ${DURATION}s at top speed..."
+timeout "$DURATION" tcpreplay --intf1="$TX_IFACE" --topspeed --loop=0 --preload-pcap "$PCAP" \
+    2>&1 | tail -n 5 || true
+
+# One stats interval for the last counters to be written
+sleep 11
+
+case "$MODE" in
+suricata-*)
+    PKTS=$(($(suricata_counter capture.kernel_packets) - START_PKTS))
+    DROPS=$(($(suricata_counter capture.kernel_drops) - START_DROPS))
+    pkill -INT suricata || true
+    ;;
+snort)
+    # Snort prints its DAQ totals on exit, one log per worker
+    pkill -INT snort || true
+    sleep 2
+    PKTS=0
+    DROPS=0
+    for log in /var/log/messages /var/log/syslog; do
+        [ -f "$log" ] || continue
+        for n in $(tail -n 2000 "$log" | grep -o 'Received: *[0-9]*' | grep -o '[0-9]*$'); do
+            PKTS=$((PKTS + n))
+        done
+        for n in $(tail -n 2000 "$log" | grep -o 'Dropped: *[0-9]*' | grep -o '[0-9]*$'); do
+            DROPS=$((DROPS + n))
+        done
+    done
+    ;;
+esac
+
+TOTAL=$((PKTS + DROPS))
+echo "=== Capture Benchmark ($MODE) ==="
+echo "Received: $PKTS"
+echo "Dropped:  $DROPS"
+if [ "$TOTAL" -gt 0 ]; then
+    awk -v d="$DROPS" -v t="$TOTAL" 'BEGIN { printf "Drop rate: %.3f%%\n", 100 * d / t }'
+fi
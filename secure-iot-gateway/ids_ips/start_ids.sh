@@ -0,0 +1,73 @@
+#!/bin/bash
+# Start the IDS on all worker cores
+# Usage: start_ids.sh [suricata-afpacket|suricata-afxdp|snort] [interface]
+
+set -e
+
+cd "$(dirname "$0")"
+
+MODE=${1:-suricata-afpacket}
+IFACE=${2:-${GATEWAY_IFACE:-eth0}}
+# Core 0 is left to management threads and interrupts of other devices
+WORKERS=$(($(nproc) - 1))
+[ "$WORKERS" -ge 1 ] || WORKERS=1
+CPU_LIST=$(seq 1 "$WORKERS" | xargs)
+
+# With cgroups/setup_placement.sh from hardened-linux-platform applied,
+# the capture cpuset's cores instead. Started inside the cpuset, so the
+# workers' own pinning stays clear of the network I/O and crypto cores.
+PLACEMENT_ENV=${PLACEMENT_ENV:-/run/gateway-placement.env}
+if [ -f "$PLACEMENT_ENV" ]; then
+    . "$PLACEMENT_ENV"
+    CPU_LIST=$IDS_CAPTURE_CPU_LIST
+    WORKERS=$(echo $CPU_LIST | wc -w)
+    echo $$ > "$IDS_CAPTURE_CGROUP/cgroup.procs"
+fi
+
+# One worker-cpu-set entry per core
+AFFINITY=""
+i=0
+for cpu in $CPU_LIST; do
+    AFFINITY="$AFFINITY --set threading.cpu-affinity.1.worker-cpu-set.cpu.$i=$cpu"
+    i=$((i + 1))
+done
+
+# Symmetric Toeplitz key: both directions of a flow hash to the same queue
+RSS_KEY=$(printf '6d:5a:%.0s' $(seq 20) | sed 's/:$//')
+
+tune_nic() {
+    # LRO/GRO merge segments and hide them from the sensor
+    ethtool -K "$IFACE" gro off lro off 2>/dev/null || true
+    ethtool -L "$IFACE" combined "$WORKERS" 2>/dev/null || true
+    ethtool -X "$IFACE" hkey "$RSS_KEY" equal "$WORKERS" 2>/dev/null || true
+    ip link set "$IFACE" promisc on
+}
+
+case "$MODE" in
+suricata-afpacket)
+    tune_nic
+    suricata -c /etc/suricata/suricata.yaml --af-packet="$IFACE" -D $AFFINITY
+    ;;
+suricata-afxdp)
+    # AF_XDP needs the interface's XDP hook; the pre-filter has to give it up
+    pkill -f "xdp_loader $IFACE" 2>/dev/null || true
+    ip link set dev "$IFACE" xdp off 2>/dev/null || true
+    tune_nic
+    suricata -c /etc/suricata/suricata.yaml --af-xdp="$IFACE" -D $AFFINITY
+    ;;
+snort)
+    # One process per core, all in one PACKET_FANOUT_HASH group
+    tune_nic
+    for cpu in $CPU_LIST; do
+        mkdir -p "/var/log/snort/$cpu"
+        taskset -c "$cpu" snort -c /etc/snort/snort.conf -i "$IFACE" -D -q \
+            -l "/var/log/snort/$cpu" --pid-path "/var/run/snort_$cpu.pid"
+    done
+    ;;
+*)
+    echo "Usage: $0 [suricata-afpacket|suricata-afxdp|snort] [interface]"
+    exit 1
+    ;;
+esac
+
+echo "IDS started: $MODE on $IFACE, $WORKERS workers"
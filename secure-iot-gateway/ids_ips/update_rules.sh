@@ -0,0 +1,37 @@
+#!/bin/bash
+# Install snort/rules/iot.rules for both engines and check that every
+# content rule got a fast pattern
+
+set -e
+
+cd "$(dirname "$0")"
+
+SNORT_RULES=/etc/snort/rules
+SURICATA_RULES=/etc/suricata/rules
+
+mkdir -p "$SNORT_RULES" "$SURICATA_RULES"
+cp snort/rules/*.rules "$SNORT_RULES/"
+
+# Suricata reads the same rule syntax; only the install path differs
+cp snort/rules/iot.rules "$SURICATA_RULES/iot.rules"
+touch "$SURICATA_RULES/emerging-threats.rules"
+
+if command -v suricata >/dev/null 2>&1; then
+    echo "Checking rules..."
+    suricata -T -c suricata/suricata.yaml -S "$SURICATA_RULES/iot.rules" >/dev/null
+
+    # rules_fast_pattern.txt lists the pattern each rule was given in the MPM
+    ANALYSIS=$(mktemp -d)
+    suricata --engine-analysis -c suricata/suricata.yaml -S "$SURICATA_RULES/iot.rules" \
+        -l "$ANALYSIS" >/dev/null 2>&1 || true
+    if [ -f "$ANALYSIS/rules_fast_pattern.txt" ]; then
+        echo "Fast patterns: $(grep -c '^== Sid:' "$ANALYSIS/rules_fast_pattern.txt") rules"
+    fi
+    rm -rf "$ANALYSIS"
+fi
+
+if command -v snort >/dev/null 2>&1; then
+    snort -T -q -c "$SNORT_RULES/../snort.conf" >/dev/null && echo "Snort: rules OK"
+fi
+
+echo "Rules installed"
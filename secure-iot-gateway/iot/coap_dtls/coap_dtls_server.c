@@ -1,80 +1,1595 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include "../../protocols/tls_dtls/tls_uring.c"
 
 #define COAP_DTLS_PORT 5684
 
-/* CoAP-DTLS server */
-int handle_coap_request(SSL *ssl, uint8_t *buffer, int len)
+#define DTLS_BATCH 32               /* datagrams per recvmmsg/sendmmsg */
+#define DTLS_MAX_DATAGRAM 2048
+#define DTLS_MTU 1200               /* handshake fragments, IPv4 and IPv6 safe */
+#define SESSION_BUCKETS 4096        /* power of two */
+#define MAX_SESSIONS 16384
+#define SESSION_IDLE_SEC 300
+#define HANDSHAKE_TIMEOUT_SEC 30
+#define SWEEP_INTERVAL_MS 200       /* handshake retransmits and expiry */
+#define STATS_INTERVAL_SEC 60
+#define COOKIE_SECRET_SIZE 32
+#define COAP_MAX_MESSAGE 1152       /* RFC 7252 4.6 */
+#define COAP_MAX_PATH 128
+#define COAP_MAX_ETAGS 4            /* ETag options looked at in a GET */
+#define COAP_ETAG_SIZE 4
+#define COAP_BLOCK_SZX 6            /* 1024-byte blocks unless the client asks for less */
+#define COAP_SZX_WHOLE 7            /* no Block2: the representation fits one response */
+#define COAP_MAX_REPRESENTATION (16 * 1024 * 1024)
+#define COAP_MAX_RESOURCES 1024
+#define COAP_RESOURCE_BUCKETS 256   /* power of two */
+#define COAP_MAX_OBSERVE 8          /* observations per session */
+#define URING_ENTRIES 256
+#define URING_BUFS 256              /* datagrams the kernel can queue ahead of us */
+#define URING_BUF_SIZE (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + DTLS_MAX_DATAGRAM)
+
+/*
+ * One UDP socket, one DTLS session per peer. Datagrams are read and
+ * written in batches with recvmmsg/sendmmsg, and each one is handed to
+ * its peer's session found by address in a hash table, so after the
+ * handshake a CoAP request costs one record decrypt and one encrypt.
+ * Sessions reach the socket through a small BIO that hands OpenSSL the
+ * current datagram and queues what it writes into the send batch.
+ *
+ * Unknown peers go through DTLSv1_listen on a spare SSL, which keeps no
+ * state until a ClientHello comes back with a valid cookie (an HMAC of
+ * the peer address), so spoofed sources cannot fill the table. OpenSSL
+ * 3.0 has no DTLS Connection ID, so the peer address is the session key;
+ * a device behind a rebinding NAT simply handshakes again.
+ *
+ * Requests go to a small resource store (see the CoAP resources
+ * section below) with block-wise transfer and observe.
+ *
+ * With TLS_URING=1 datagrams arrive through one multishot recvmsg into
+ * io_uring provided buffers (tls_uring.c) and are dispatched in place;
+ * sends stay on sendmmsg, which already batches and never blocks.
+ */
+struct observer;
+struct upload;
+
+typedef struct session {
+    struct sockaddr_in peer;
+    SSL *ssl;
+    int established;
+    time_t deadline;            /* handshake, then idle timeout */
+    const uint8_t *in;          /* the datagram being processed */
+    size_t in_len;
+    struct observer *observers; /* resources this peer observes */
+    struct upload *upload;      /* Block1 PUT in progress */
+    int upload_done;            /* a Block1 PUT completed, by the MID of its last block */
+    uint16_t upload_done_mid;
+    struct session *hash_next;
+    struct session *prev;
+    struct session *next;
+} session_t;
+
+typedef struct {
+    struct mmsghdr msgs[DTLS_BATCH];
+    struct iovec iov[DTLS_BATCH];
+    struct sockaddr_in addr[DTLS_BATCH];
+    uint8_t data[DTLS_BATCH][DTLS_MAX_DATAGRAM];
+    unsigned int count;
+} dgram_batch_t;
+
+static int dtls_sock;
+static BIO_METHOD *session_bio_method;
+static session_t *session_buckets[SESSION_BUCKETS];
+static session_t *sessions;
+static size_t session_count;
+static dgram_batch_t send_batch;
+static unsigned char cookie_secret[COOKIE_SECRET_SIZE];
+
+static uint64_t stat_requests;
+static uint64_t stat_handshakes;
+static uint64_t stat_cookies_sent;
+static uint64_t stat_sent_batches;
+static uint64_t stat_blocks;
+static uint64_t stat_notifications;
+static uint64_t stat_cache_hits;
+static uint64_t stat_cache_misses;
+
+static uint32_t peer_hash(const struct sockaddr_in *peer)
+{
+    uint32_t h = (uint32_t)peer->sin_addr.s_addr * 2654435761u;
+    
+    return (h ^ peer->sin_port * 40503u) & (SESSION_BUCKETS - 1);
+}
+
+static int peer_equal(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static session_t *session_find(const struct sockaddr_in *peer)
+{
+    session_t *s = session_buckets[peer_hash(peer)];
+    
+    while (s && !peer_equal(&s->peer, peer)) {
+        s = s->hash_next;
+    }
+    return s;
+}
+
+static void send_flush(void)
+{
+    unsigned int sent = 0;
+    
+    while (sent < send_batch.count) {
+        int n = sendmmsg(dtls_sock, send_batch.msgs + sent, send_batch.count - sent, 0);
+    
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;              /* UDP: the peer retransmits */
+        }
+        sent += (unsigned int)n;
+    }
+    if (send_batch.count) {
+        stat_sent_batches++;
+    }
+    send_batch.count = 0;
+}
+
+/* Each BIO_write from OpenSSL is one datagram to the session's peer */
+static int session_bio_write(BIO *b, const char *data, int len)
 {
-    /* CoAP message format: Ver(2) | T(2) | TKL(4) | Code(8) | Message ID(16) */
-    if (len < 4) {
+    session_t *s = BIO_get_data(b);
+    unsigned int i;
+    
+    if (len <= 0 || len > DTLS_MAX_DATAGRAM) {
+        return -1;
+    }
+    if (send_batch.count == DTLS_BATCH) {
+        send_flush();
+    }
+    
+    i = send_batch.count++;
+    memcpy(send_batch.data[i], data, (size_t)len);
+    send_batch.addr[i] = s->peer;
+    send_batch.iov[i].iov_base = send_batch.data[i];
+    send_batch.iov[i].iov_len = (size_t)len;
+    memset(&send_batch.msgs[i], 0, sizeof(send_batch.msgs[i]));
+    send_batch.msgs[i].msg_hdr.msg_name = &send_batch.addr[i];
+    send_batch.msgs[i].msg_hdr.msg_namelen = sizeof(send_batch.addr[i]);
+    send_batch.msgs[i].msg_hdr.msg_iov = &send_batch.iov[i];
+    send_batch.msgs[i].msg_hdr.msg_iovlen = 1;
+    return len;
+}
+
+/* Hands over the current datagram once, like a datagram socket read */
+static int session_bio_read(BIO *b, char *data, int len)
+{
+    session_t *s = BIO_get_data(b);
+    size_t n;
+    
+    BIO_clear_retry_flags(b);
+    if (!s->in) {
+        BIO_set_retry_read(b);
         return -1;
     }
     
-    uint8_t ver_t_tkl = buffer[0];
-    uint8_t code = buffer[1];
+    n = s->in_len < (size_t)len ? s->in_len : (size_t)len;
+    memcpy(data, s->in, n);
+    s->in = NULL;
+    s->in_len = 0;
+    return (int)n;
+}
+
+static long session_bio_ctrl(BIO *b, int cmd, long num, void *ptr)
+{
+    session_t *s = BIO_get_data(b);
+    
+    (void)num;
+    switch (cmd) {
+    case BIO_CTRL_FLUSH:
+    case BIO_CTRL_DGRAM_SET_CONNECTED:
+    case BIO_CTRL_DGRAM_SET_PEER:
+        return 1;
+    case BIO_CTRL_DGRAM_GET_PEER:
+        /* DTLSv1_listen wants to know who it is talking to */
+        return BIO_ADDR_rawmake(ptr, AF_INET, &s->peer.sin_addr, sizeof(s->peer.sin_addr),
+                                s->peer.sin_port) ? (long)sizeof(struct sockaddr_in) : 0;
+    case BIO_CTRL_DGRAM_QUERY_MTU:
+    case BIO_CTRL_DGRAM_GET_FALLBACK_MTU:
+        return DTLS_MTU;
+    case BIO_CTRL_DGRAM_GET_MTU_OVERHEAD:
+        return 28;              /* IPv4 and UDP headers */
+    default:
+        return 0;
+    }
+}
+
+static int session_bio_create(BIO *b)
+{
+    BIO_set_init(b, 1);
+    return 1;
+}
+
+/* Cookie: HMAC of the peer address under a per-process secret */
+static int cookie_compute(SSL *ssl, unsigned char *cookie, unsigned int *cookie_len)
+{
+    session_t *s = SSL_get_app_data(ssl);
+    unsigned char peer[6];
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned int mac_len;
     
-    printf("CoAP request: Code=0x%02x\n", code);
+    memcpy(peer, &s->peer.sin_addr, 4);
+    memcpy(peer + 4, &s->peer.sin_port, 2);
+    if (!HMAC(EVP_sha256(), cookie_secret, sizeof(cookie_secret), peer, sizeof(peer),
+              mac, &mac_len)) {
+        return 0;
+    }
     
-    /* Send CoAP response */
-    uint8_t response[4] = {0x60, 0x45, 0x00, 0x01}; /* 2.05 Content */
-    SSL_write(ssl, response, sizeof(response));
+    /* 16 bytes is plenty and keeps HelloVerifyRequest small */
+    memcpy(cookie, mac, 16);
+    *cookie_len = 16;
+    return 1;
+}
+
+static int cookie_generate(SSL *ssl, unsigned char *cookie, unsigned int *cookie_len)
+{
+    stat_cookies_sent++;
+    return cookie_compute(ssl, cookie, cookie_len);
+}
+
+static int cookie_verify(SSL *ssl, const unsigned char *cookie, unsigned int cookie_len)
+{
+    unsigned char expected[16];
+    unsigned int expected_len;
     
+    return cookie_len == sizeof(expected) &&
+           cookie_compute(ssl, expected, &expected_len) &&
+           CRYPTO_memcmp(cookie, expected, sizeof(expected)) == 0;
+}
+
+/*
+ * CoAP resources: RFC 7252 requests with block-wise transfer (RFC 7959)
+ * and observe (RFC 7641). Each resource keeps its current
+ * representation under an ETag. The options and payload of its first
+ * response block are encoded once per ETag, block size and
+ * observe/plain, and reused: every GET and every notification to every
+ * observer copies the same bytes behind its own header and token. Later
+ * blocks are cut from the stored representation. PUT replaces it,
+ * Block1 assembling large ones, and notifies the observers; DELETE ends
+ * their observations with 4.04.
+ */
+#define COAP_CON 0
+#define COAP_NON 1
+#define COAP_ACK 2
+#define COAP_RST 3
+
+#define COAP_CODE(c, dd) ((uint8_t)((c) << 5 | (dd)))
+#define COAP_GET COAP_CODE(0, 1)
+#define COAP_POST COAP_CODE(0, 2)
+#define COAP_PUT COAP_CODE(0, 3)
+#define COAP_DELETE COAP_CODE(0, 4)
+#define COAP_CREATED COAP_CODE(2, 1)
+#define COAP_DELETED COAP_CODE(2, 2)
+#define COAP_VALID COAP_CODE(2, 3)
+#define COAP_CHANGED COAP_CODE(2, 4)
+#define COAP_CONTENT COAP_CODE(2, 5)
+#define COAP_CONTINUE COAP_CODE(2, 31)
+#define COAP_BAD_REQUEST COAP_CODE(4, 0)
+#define COAP_BAD_OPTION COAP_CODE(4, 2)
+#define COAP_NOT_FOUND COAP_CODE(4, 4)
+#define COAP_METHOD_NOT_ALLOWED COAP_CODE(4, 5)
+#define COAP_INCOMPLETE COAP_CODE(4, 8)
+#define COAP_TOO_LARGE COAP_CODE(4, 13)
+#define COAP_INTERNAL_ERROR COAP_CODE(5, 0)
+#define COAP_UNAVAILABLE COAP_CODE(5, 3)
+
+#define COAP_OPT_URI_HOST 3
+#define COAP_OPT_ETAG 4
+#define COAP_OPT_OBSERVE 6
+#define COAP_OPT_URI_PORT 7
+#define COAP_OPT_URI_PATH 11
+#define COAP_OPT_CONTENT_FORMAT 12
+#define COAP_OPT_URI_QUERY 15
+#define COAP_OPT_ACCEPT 17
+#define COAP_OPT_BLOCK2 23
+#define COAP_OPT_BLOCK1 27
+#define COAP_OPT_SIZE2 28
+#define COAP_OPT_SIZE1 60
+
+#define COAP_FORMAT_OCTET_STREAM 42
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    int content_format;         /* -1 if none */
+    uint8_t etag[COAP_ETAG_SIZE];
+    uint32_t observe_seq;
+    uint8_t *tail[2][COAP_SZX_WHOLE + 1];   /* [observe][szx], first block */
+    uint16_t tail_len[2][COAP_SZX_WHOLE + 1];
+} coap_rep_t;
+
+typedef struct resource {
+    char path[COAP_MAX_PATH];   /* Uri-Path segments joined by '/' */
+    coap_rep_t *rep;
+    int read_only;
+    uint32_t observe_seq;
+    struct observer *observers;
+    struct resource *hash_next;
+} resource_t;
+
+typedef struct observer {
+    session_t *session;
+    resource_t *res;
+    uint8_t token[8];
+    uint8_t token_len;
+    uint8_t szx;                /* block size the client asked for */
+    uint16_t last_mid;          /* a RST for it cancels the observation */
+    struct observer *res_prev;
+    struct observer *res_next;
+    struct observer *session_next;
+} observer_t;
+
+typedef struct upload {
+    char path[COAP_MAX_PATH];
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+    uint32_t next_num;
+    uint8_t szx;
+    int content_format;
+} upload_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t code;
+    uint16_t mid;
+    uint8_t token_len;
+    const uint8_t *token;
+    char path[COAP_MAX_PATH];
+    const uint8_t *etags[COAP_MAX_ETAGS];
+    uint8_t etag_lens[COAP_MAX_ETAGS];
+    unsigned int etag_count;
+    int observe;                /* -1 if absent */
+    int content_format;
+    int has_block1;
+    int has_block2;
+    uint32_t block1_num;
+    uint32_t block2_num;
+    uint8_t block1_szx;
+    uint8_t block2_szx;
+    int block1_more;
+    const uint8_t *payload;
+    size_t payload_len;
+} coap_req_t;
+
+/* Options and payload being encoded; error sticks once the buffer is full */
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    unsigned int last;
+    int error;
+} coap_out_t;
+
+static resource_t *resource_buckets[COAP_RESOURCE_BUCKETS];
+static size_t resource_count;
+static size_t observer_count;
+static uint32_t etag_counter;
+static uint16_t notify_mid;
+
+static size_t block_size(uint8_t szx)
+{
+    return (size_t)16 << szx;
+}
+
+static uint32_t path_hash(const char *path)
+{
+    uint32_t h = 2166136261u;
+    
+    while (*path) {
+        h = (h ^ (uint8_t)*path++) * 16777619u;
+    }
+    return h & (COAP_RESOURCE_BUCKETS - 1);
+}
+
+static resource_t *resource_find(const char *path)
+{
+    resource_t *res = resource_buckets[path_hash(path)];
+    
+    while (res && strcmp(res->path, path) != 0) {
+        res = res->hash_next;
+    }
+    return res;
+}
+
+static void out_bytes(coap_out_t *o, const void *data, size_t len)
+{
+    if (o->error || len > o->size - o->len) {
+        o->error = 1;
+        return;
+    }
+    if (len) {
+        memcpy(o->buf + o->len, data, len);
+        o->len += len;
+    }
+}
+
+/* Option delta or length: a nibble at shift, extended bytes after head[n] */
+static size_t out_nibble(uint8_t *head, size_t n, size_t value, int shift)
+{
+    if (value < 13) {
+        head[0] |= (uint8_t)(value << shift);
+    } else if (value < 269) {
+        head[0] |= (uint8_t)(13 << shift);
+        head[n++] = (uint8_t)(value - 13);
+    } else {
+        head[0] |= (uint8_t)(14 << shift);
+        head[n++] = (uint8_t)((value - 269) >> 8);
+        head[n++] = (uint8_t)(value - 269);
+    }
+    return n;
+}
+
+/* Options go out in ascending number, delta-encoded */
+static void out_option(coap_out_t *o, unsigned int number, const void *value, size_t len)
+{
+    uint8_t head[5] = { 0 };
+    size_t n;
+    
+    n = out_nibble(head, 1, number - o->last, 4);
+    n = out_nibble(head, n, len, 0);
+    out_bytes(o, head, n);
+    out_bytes(o, value, len);
+    o->last = number;
+}
+
+static void out_uint_option(coap_out_t *o, unsigned int number, uint32_t value)
+{
+    uint8_t be[4];
+    size_t n = 0;
+    size_t i;
+    
+    while (n < 4 && value >> (8 * n)) {
+        n++;
+    }
+    for (i = 0; i < n; i++) {
+        be[i] = (uint8_t)(value >> (8 * (n - 1 - i)));
+    }
+    out_option(o, number, be, n);
+}
+
+static void out_payload(coap_out_t *o, const void *data, size_t len)
+{
+    if (len) {
+        out_bytes(o, "\xff", 1);
+        out_bytes(o, data, len);
+    }
+}
+
+/* Extended option delta or length; 15 is reserved */
+static int coap_ext(const uint8_t **p, const uint8_t *end, unsigned int *value)
+{
+    if (*value == 13) {
+        if (end - *p < 1) {
+            return -1;
+        }
+        *value = 13 + **p;
+        *p += 1;
+    } else if (*value == 14) {
+        if (end - *p < 2) {
+            return -1;
+        }
+        *value = 269 + ((*p)[0] << 8 | (*p)[1]);
+        *p += 2;
+    } else if (*value == 15) {
+        return -1;
+    }
     return 0;
 }
 
-int main(void)
+static int coap_uint(const uint8_t *v, size_t len, size_t max, uint32_t *value)
 {
+    if (len > max) {
+        return -1;
+    }
+    *value = 0;
+    while (len--) {
+        *value = *value << 8 | *v++;
+    }
+    return 0;
+}
+
+/* NUM | M | SZX; SZX 7 is BERT, which only CoAP over TCP has */
+static int coap_block(const uint8_t *v, size_t len, uint32_t *num, int *more, uint8_t *szx)
+{
+    uint32_t value;
+    
+    if (coap_uint(v, len, 3, &value) != 0 || (value & 7) == 7) {
+        return -1;
+    }
+    *num = value >> 4;
+    *more = (value >> 3) & 1;
+    *szx = value & 7;
+    return 0;
+}
+
+/*
+ * Decode a request in place. Returns 0, -1 for a message format error
+ * (dropped), or the error response code.
+ */
+static int coap_parse_request(coap_req_t *req, const uint8_t *buf, size_t len)
+{
+    const uint8_t *p, *end = buf + len;
+    unsigned int number = 0;
+    size_t path_len = 0;
+    int more;
+    
+    if (len < 4 || (buf[0] >> 6) != 1 || (buf[0] & 0x0f) > 8 || len < 4u + (buf[0] & 0x0f)) {
+        return -1;
+    }
+    memset(req, 0, sizeof(*req));
+    req->type = (buf[0] >> 4) & 0x03;
+    req->token_len = buf[0] & 0x0f;
+    req->code = buf[1];
+    req->mid = (uint16_t)(buf[2] << 8 | buf[3]);
+    req->token = buf + 4;
+    req->observe = -1;
+    req->content_format = -1;
+    
+    p = req->token + req->token_len;
+    while (p < end && *p != 0xff) {
+        unsigned int delta = *p >> 4;
+        unsigned int opt_len = *p & 0x0f;
+        uint32_t value;
+    
+        p++;
+        if (coap_ext(&p, end, &delta) != 0 || coap_ext(&p, end, &opt_len) != 0 ||
+            opt_len > (size_t)(end - p)) {
+            return -1;
+        }
+        number += delta;
+    
+        switch (number) {
+        case COAP_OPT_ETAG:
+            if (opt_len >= 1 && opt_len <= 8 && req->etag_count < COAP_MAX_ETAGS) {
+                req->etags[req->etag_count] = p;
+                req->etag_lens[req->etag_count++] = (uint8_t)opt_len;
+            }
+            break;
+        case COAP_OPT_OBSERVE:
+            if (coap_uint(p, opt_len, 3, &value) == 0) {
+                req->observe = (int)value;
+            }
+            break;
+        case COAP_OPT_URI_PATH:
+            if (memchr(p, '/', opt_len) || path_len + opt_len + 1 >= sizeof(req->path)) {
+                return COAP_BAD_REQUEST;
+            }
+            if (path_len) {
+                req->path[path_len++] = '/';
+            }
+            memcpy(req->path + path_len, p, opt_len);
+            path_len += opt_len;
+            break;
+        case COAP_OPT_CONTENT_FORMAT:
+            if (coap_uint(p, opt_len, 2, &value) != 0) {
+                return COAP_BAD_REQUEST;
+            }
+            req->content_format = (int)value;
+            break;
+        case COAP_OPT_BLOCK2:
+            if (coap_block(p, opt_len, &req->block2_num, &more, &req->block2_szx) != 0) {
+                return COAP_BAD_REQUEST;
+            }
+            req->has_block2 = 1;
+            break;
+        case COAP_OPT_BLOCK1:
+            if (coap_block(p, opt_len, &req->block1_num, &req->block1_more, &req->block1_szx) != 0) {
+                return COAP_BAD_REQUEST;
+            }
+            req->has_block1 = 1;
+            break;
+        case COAP_OPT_URI_HOST:
+        case COAP_OPT_URI_PORT:
+        case COAP_OPT_URI_QUERY:
+        case COAP_OPT_ACCEPT:
+            break;
+        default:
+            /* Unrecognized critical (odd) options fail the request */
+            if (number & 1) {
+                return COAP_BAD_OPTION;
+            }
+            break;
+        }
+        p += opt_len;
+    }
+    req->path[path_len] = '\0';
+    
+    if (p < end) {
+        /* A payload marker with nothing after it is a format error */
+        if (end - p < 2) {
+            return -1;
+        }
+        req->payload = p + 1;
+        req->payload_len = (size_t)(end - p - 1);
+    }
+    return 0;
+}
+
+/* One CoAP message in one DTLS record */
+static void coap_send(session_t *s, uint8_t type, uint8_t code, uint16_t mid,
+                      const uint8_t *token, uint8_t token_len, const uint8_t *tail, size_t tail_len)
+{
+    uint8_t msg[COAP_MAX_MESSAGE];
+    
+    if (4 + token_len + tail_len > sizeof(msg)) {
+        return;
+    }
+    msg[0] = (uint8_t)(0x40 | type << 4 | token_len);
+    msg[1] = code;
+    msg[2] = (uint8_t)(mid >> 8);
+    msg[3] = (uint8_t)mid;
+    memcpy(msg + 4, token, token_len);
+    if (tail_len) {
+        memcpy(msg + 4 + token_len, tail, tail_len);
+    }
+    SSL_write(s->ssl, msg, (int)(4 + token_len + tail_len));
+}
+
+/* Piggybacked: ACK for CON, NON for NON; same MID and token */
+static void coap_reply(session_t *s, const coap_req_t *req, uint8_t code,
+                       const uint8_t *tail, size_t tail_len)
+{
+    coap_send(s, req->type == COAP_CON ? COAP_ACK : COAP_NON, code, req->mid,
+              req->token, req->token_len, tail, tail_len);
+}
+
+static coap_rep_t *rep_new(uint8_t *data, size_t len, int content_format)
+{
+    coap_rep_t *rep = calloc(1, sizeof(*rep));
+    uint32_t etag = etag_counter++;
+    
+    if (!rep) {
+        return NULL;
+    }
+    rep->data = data;
+    rep->len = len;
+    rep->content_format = content_format;
+    memcpy(rep->etag, &etag, sizeof(rep->etag));
+    return rep;
+}
+
+static void rep_free(coap_rep_t *rep)
+{
+    unsigned int i, j;
+    
+    if (!rep) {
+        return;
+    }
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j <= COAP_SZX_WHOLE; j++) {
+            free(rep->tail[i][j]);
+        }
+    }
+    free(rep->data);
+    free(rep);
+}
+
+/* The block size for a representation, or COAP_SZX_WHOLE if it fits one */
+static uint8_t rep_szx(const coap_rep_t *rep, uint8_t szx)
+{
+    if (szx > COAP_BLOCK_SZX) {
+        szx = COAP_BLOCK_SZX;
+    }
+    return rep->len <= block_size(szx) ? COAP_SZX_WHOLE : szx;
+}
+
+/*
+ * Options and payload of block num of rep; observe adds the Observe
+ * option of a notification
+ */
+static void rep_encode(coap_out_t *o, const coap_rep_t *rep, int observe, uint8_t szx, uint32_t num)
+{
+    size_t off = 0;
+    size_t n = rep->len;
+    
+    out_option(o, COAP_OPT_ETAG, rep->etag, sizeof(rep->etag));
+    if (observe) {
+        out_uint_option(o, COAP_OPT_OBSERVE, rep->observe_seq);
+    }
+    if (rep->content_format >= 0) {
+        out_uint_option(o, COAP_OPT_CONTENT_FORMAT, (uint32_t)rep->content_format);
+    }
+    if (szx != COAP_SZX_WHOLE) {
+        off = (size_t)num * block_size(szx);
+        n = rep->len - off < block_size(szx) ? rep->len - off : block_size(szx);
+        out_uint_option(o, COAP_OPT_BLOCK2, num << 4 | (off + n < rep->len) << 3 | szx);
+        if (num == 0) {
+            out_uint_option(o, COAP_OPT_SIZE2, (uint32_t)rep->len);
+        }
+    }
+    out_payload(o, rep->data + off, n);
+}
+
+/* First block of rep, encoded once per ETag and then shared */
+static const uint8_t *rep_tail(coap_rep_t *rep, int observe, uint8_t szx, size_t *len)
+{
+    if (!rep->tail[observe][szx]) {
+        uint8_t buf[COAP_MAX_MESSAGE];
+        coap_out_t o = { buf, sizeof(buf), 0, 0, 0 };
+    
+        rep_encode(&o, rep, observe, szx, 0);
+        if (o.error || !(rep->tail[observe][szx] = malloc(o.len))) {
+            return NULL;
+        }
+        memcpy(rep->tail[observe][szx], buf, o.len);
+        rep->tail_len[observe][szx] = (uint16_t)o.len;
+        stat_cache_misses++;
+    } else {
+        stat_cache_hits++;
+    }
+    *len = rep->tail_len[observe][szx];
+    return rep->tail[observe][szx];
+}
+
+static void observer_unlink(observer_t *o)
+{
+    observer_t **link = &o->session->observers;
+    
+    while (*link != o) {
+        link = &(*link)->session_next;
+    }
+    *link = o->session_next;
+    if (o->res_prev) {
+        o->res_prev->res_next = o->res_next;
+    } else {
+        o->res->observers = o->res_next;
+    }
+    if (o->res_next) {
+        o->res_next->res_prev = o->res_prev;
+    }
+    observer_count--;
+    free(o);
+}
+
+/* Register, or re-register, the client's token for res */
+static int observer_add(session_t *s, resource_t *res, const coap_req_t *req)
+{
+    unsigned int count = 0;
+    observer_t *o;
+    
+    for (o = s->observers; o; o = o->session_next) {
+        if (o->res == res && o->token_len == req->token_len &&
+            memcmp(o->token, req->token, req->token_len) == 0) {
+            break;
+        }
+        count++;
+    }
+    if (!o) {
+        if (count >= COAP_MAX_OBSERVE || !(o = calloc(1, sizeof(*o)))) {
+            return -1;
+        }
+        o->session = s;
+        o->res = res;
+        memcpy(o->token, req->token, req->token_len);
+        o->token_len = req->token_len;
+        o->session_next = s->observers;
+        s->observers = o;
+        o->res_next = res->observers;
+        if (res->observers) {
+            res->observers->res_prev = o;
+        }
+        res->observers = o;
+        observer_count++;
+    }
+    o->szx = req->has_block2 ? req->block2_szx : COAP_BLOCK_SZX;
+    return 0;
+}
+
+static void observer_cancel(session_t *s, const resource_t *res, const coap_req_t *req)
+{
+    observer_t *o;
+    
+    for (o = s->observers; o; o = o->session_next) {
+        if (o->res == res && o->token_len == req->token_len &&
+            memcmp(o->token, req->token, req->token_len) == 0) {
+            observer_unlink(o);
+            return;
+        }
+    }
+}
+
+/*
+ * Send the current representation to every observer. Notifications are
+ * NON, except to a peer not heard from for half its idle time: its ACK
+ * to a CON keeps the session, and with it the observation, alive.
+ */
+static void resource_notify(resource_t *res)
+{
+    time_t now = time(NULL);
+    observer_t *o;
+    
+    for (o = res->observers; o; o = o->res_next) {
+        const uint8_t *tail = NULL;
+        size_t tail_len = 0;
+        uint8_t type = o->session->deadline - now < SESSION_IDLE_SEC / 2 ? COAP_CON : COAP_NON;
+    
+        if (res->rep) {
+            tail = rep_tail(res->rep, 1, rep_szx(res->rep, o->szx), &tail_len);
+        }
+        o->last_mid = notify_mid++;
+        coap_send(o->session, type, res->rep ? (tail ? COAP_CONTENT : COAP_INTERNAL_ERROR) : COAP_NOT_FOUND,
+                  o->last_mid, o->token, o->token_len, tail, tail_len);
+        stat_notifications++;
+    }
+}
+
+/* Create or replace a resource's representation; takes data */
+static resource_t *resource_put(const char *path, uint8_t *data, size_t len,
+                                int content_format, int *created)
+{
+    resource_t *res = resource_find(path);
+    coap_rep_t *rep = rep_new(data, len, content_format);
+    
+    *created = 0;
+    if (!rep) {
+        free(data);
+        return NULL;
+    }
+    if (!res) {
+        uint32_t h = path_hash(path);
+    
+        if (resource_count >= COAP_MAX_RESOURCES || !(res = calloc(1, sizeof(*res)))) {
+            rep_free(rep);
+            return NULL;
+        }
+        snprintf(res->path, sizeof(res->path), "%s", path);
+        res->hash_next = resource_buckets[h];
+        resource_buckets[h] = res;
+        resource_count++;
+        *created = 1;
+    }
+    
+    rep_free(res->rep);
+    res->rep = rep;
+    res->observe_seq = (res->observe_seq + 1) & 0xffffff;
+    rep->observe_seq = res->observe_seq;
+    resource_notify(res);
+    return res;
+}
+
+static void resource_delete(resource_t *res)
+{
+    resource_t **link = &resource_buckets[path_hash(res->path)];
+    
+    /* A 4.04 notification ends each observation */
+    rep_free(res->rep);
+    res->rep = NULL;
+    resource_notify(res);
+    while (res->observers) {
+        observer_unlink(res->observers);
+    }
+    
+    while (*link != res) {
+        link = &(*link)->hash_next;
+    }
+    *link = res->hash_next;
+    resource_count--;
+    free(res);
+}
+
+/* A read-only resource from a file, e.g. a firmware image */
+static int resource_load(const char *path, const char *file, int content_format)
+{
+    FILE *fp = fopen(file, "rb");
+    resource_t *res;
+    uint8_t *data;
+    long len;
+    int created;
+    
+    if (!fp) {
+        perror(file);
+        return -1;
+    }
+    if (fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) < 0 || len > COAP_MAX_REPRESENTATION ||
+        fseek(fp, 0, SEEK_SET) != 0 || !(data = malloc(len ? (size_t)len : 1)) ||
+        fread(data, 1, (size_t)len, fp) != (size_t)len) {
+        fprintf(stderr, "%s: unable to load\n", file);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    
+    res = resource_put(path, data, (size_t)len, content_format, &created);
+    if (!res) {
+        return -1;
+    }
+    res->read_only = 1;
+    return 0;
+}
+
+static int rep_etag_matches(const coap_rep_t *rep, const coap_req_t *req)
+{
+    unsigned int i;
+    
+    for (i = 0; i < req->etag_count; i++) {
+        if (req->etag_lens[i] == sizeof(rep->etag) &&
+            memcmp(req->etags[i], rep->etag, sizeof(rep->etag)) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void coap_get(session_t *s, const coap_req_t *req)
+{
+    resource_t *res = resource_find(req->path);
+    uint8_t buf[COAP_MAX_MESSAGE];
+    coap_out_t o = { buf, sizeof(buf), 0, 0, 0 };
+    const uint8_t *tail;
+    size_t tail_len;
+    coap_rep_t *rep;
+    int observe = 0;
+    uint8_t szx;
+    
+    if (!res) {
+        coap_reply(s, req, COAP_NOT_FOUND, NULL, 0);
+        return;
+    }
+    rep = res->rep;
+    szx = rep_szx(rep, req->has_block2 ? req->block2_szx : COAP_BLOCK_SZX);
+    
+    /* Later blocks of a notification are fetched with plain GETs */
+    if (req->observe == 0 && req->block2_num == 0) {
+        observe = observer_add(s, res, req) == 0;
+    } else if (req->observe == 1) {
+        observer_cancel(s, res, req);
+    }
+    
+    if (req->block2_num > 0) {
+        if (szx == COAP_SZX_WHOLE || (uint64_t)req->block2_num * block_size(szx) >= rep->len) {
+            coap_reply(s, req, COAP_BAD_OPTION, NULL, 0);
+            return;
+        }
+        rep_encode(&o, rep, 0, szx, req->block2_num);
+        stat_blocks++;
+        coap_reply(s, req, COAP_CONTENT, buf, o.len);
+        return;
+    }
+    
+    /* The client's copy is current */
+    if (rep_etag_matches(rep, req)) {
+        out_option(&o, COAP_OPT_ETAG, rep->etag, sizeof(rep->etag));
+        if (observe) {
+            out_uint_option(&o, COAP_OPT_OBSERVE, rep->observe_seq);
+        }
+        coap_reply(s, req, COAP_VALID, buf, o.len);
+        return;
+    }
+    
+    tail = rep_tail(rep, observe, szx, &tail_len);
+    if (!tail) {
+        coap_reply(s, req, COAP_INTERNAL_ERROR, NULL, 0);
+        return;
+    }
+    if (szx != COAP_SZX_WHOLE) {
+        stat_blocks++;
+    }
+    coap_reply(s, req, COAP_CONTENT, tail, tail_len);
+}
+
+static void upload_free(session_t *s)
+{
+    if (s->upload) {
+        free(s->upload->data);
+        free(s->upload);
+        s->upload = NULL;
+    }
+}
+
+/*
+ * One Block1 of a PUT. Returns 1 when the body is complete in
+ * s->upload, 0 once it has answered the block itself.
+ */
+static int upload_block(session_t *s, const coap_req_t *req, coap_out_t *o)
+{
+    upload_t *up = s->upload;
+    
+    /*
+     * The block before the one expected, as it was: the client's copy of
+     * our 2.31 was lost and it retransmitted. Acknowledge it again
+     * (RFC 7252 4.5) rather than fail the upload.
+     */
+    if (up && req->block1_more && req->block1_num + 1 == up->next_num &&
+        req->block1_szx == up->szx && strcmp(up->path, req->path) == 0 &&
+        req->payload_len == block_size(up->szx) && up->len >= req->payload_len &&
+        memcmp(up->data + up->len - req->payload_len, req->payload, req->payload_len) == 0) {
+        out_uint_option(o, COAP_OPT_BLOCK1, req->block1_num << 4 | 1 << 3 | up->szx);
+        coap_reply(s, req, COAP_CONTINUE, o->buf, o->len);
+        return 0;
+    }
+    
+    if (req->block1_num == 0) {
+        upload_free(s);
+        up = s->upload = calloc(1, sizeof(*up));
+        if (!up) {
+            coap_reply(s, req, COAP_UNAVAILABLE, NULL, 0);
+            return 0;
+        }
+        snprintf(up->path, sizeof(up->path), "%s", req->path);
+        up->szx = req->block1_szx;
+        up->content_format = req->content_format;
+    }
+    if (!up || strcmp(up->path, req->path) != 0 || req->block1_num != up->next_num ||
+        req->block1_szx != up->szx) {
+        upload_free(s);
+        coap_reply(s, req, COAP_INCOMPLETE, NULL, 0);
+        return 0;
+    }
+    /* All but the last block are full size */
+    if (req->block1_more && req->payload_len != block_size(up->szx)) {
+        upload_free(s);
+        coap_reply(s, req, COAP_BAD_REQUEST, NULL, 0);
+        return 0;
+    }
+    if (up->len + req->payload_len > COAP_MAX_REPRESENTATION) {
+        upload_free(s);
+        out_uint_option(o, COAP_OPT_SIZE1, COAP_MAX_REPRESENTATION);
+        coap_reply(s, req, COAP_TOO_LARGE, o->buf, o->len);
+        return 0;
+    }
+    
+    if (up->len + req->payload_len > up->cap) {
+        size_t cap = up->cap ? up->cap * 2 : 4 * block_size(up->szx);
+        uint8_t *data;
+    
+        while (cap < up->len + req->payload_len) {
+            cap *= 2;
+        }
+        data = realloc(up->data, cap);
+        if (!data) {
+            upload_free(s);
+            coap_reply(s, req, COAP_UNAVAILABLE, NULL, 0);
+            return 0;
+        }
+        up->data = data;
+        up->cap = cap;
+    }
+    if (req->payload_len) {
+        memcpy(up->data + up->len, req->payload, req->payload_len);
+        up->len += req->payload_len;
+    }
+    up->next_num++;
+    
+    if (req->block1_more) {
+        out_uint_option(o, COAP_OPT_BLOCK1, req->block1_num << 4 | 1 << 3 | up->szx);
+        coap_reply(s, req, COAP_CONTINUE, o->buf, o->len);
+        return 0;
+    }
+    return 1;
+}
+
+static void coap_put(session_t *s, const coap_req_t *req)
+{
+    resource_t *res = resource_find(req->path);
+    uint8_t buf[64];
+    coap_out_t o = { buf, sizeof(buf), 0, 0, 0 };
+    int content_format = req->content_format;
+    uint8_t *data;
+    size_t len;
+    int created;
+    
+    if (!req->path[0] || (res && res->read_only)) {
+        coap_reply(s, req, COAP_METHOD_NOT_ALLOWED, NULL, 0);
+        return;
+    }
+    
+    /* The last block again: its answer was lost, the body is already in */
+    if (req->has_block1 && !req->block1_more && s->upload_done &&
+        req->mid == s->upload_done_mid && res && res->rep) {
+        out_option(&o, COAP_OPT_ETAG, res->rep->etag, sizeof(res->rep->etag));
+        out_uint_option(&o, COAP_OPT_BLOCK1, req->block1_num << 4 | req->block1_szx);
+        coap_reply(s, req, COAP_CHANGED, buf, o.len);
+        return;
+    }
+    
+    if (req->has_block1) {
+        if (!upload_block(s, req, &o)) {
+            return;
+        }
+        /* The assembled body becomes the representation as it is */
+        data = s->upload->data;
+        len = s->upload->len;
+        content_format = s->upload->content_format;
+        s->upload->data = NULL;
+        upload_free(s);
+    } else {
+        len = req->payload_len;
+        if (len > COAP_MAX_REPRESENTATION || !(data = malloc(len ? len : 1))) {
+            coap_reply(s, req, COAP_UNAVAILABLE, NULL, 0);
+            return;
+        }
+        if (len) {
+            memcpy(data, req->payload, len);
+        }
+    }
+    
+    res = resource_put(req->path, data, len, content_format, &created);
+    if (!res) {
+        coap_reply(s, req, COAP_UNAVAILABLE, NULL, 0);
+        return;
+    }
+    out_option(&o, COAP_OPT_ETAG, res->rep->etag, sizeof(res->rep->etag));
+    if (req->has_block1) {
+        out_uint_option(&o, COAP_OPT_BLOCK1, req->block1_num << 4 | req->block1_szx);
+        s->upload_done = 1;
+        s->upload_done_mid = req->mid;
+    }
+    coap_reply(s, req, created ? COAP_CREATED : COAP_CHANGED, buf, o.len);
+}
+
+static void coap_delete(session_t *s, const coap_req_t *req)
+{
+    resource_t *res = resource_find(req->path);
+    
+    if (!res) {
+        coap_reply(s, req, COAP_NOT_FOUND, NULL, 0);
+        return;
+    }
+    if (res->read_only) {
+        coap_reply(s, req, COAP_METHOD_NOT_ALLOWED, NULL, 0);
+        return;
+    }
+    resource_delete(res);
+    coap_reply(s, req, COAP_DELETED, NULL, 0);
+}
+
+/* The session is going away: its observations and upload go with it */
+static void session_coap_release(session_t *s)
+{
+    while (s->observers) {
+        observer_unlink(s->observers);
+    }
+    upload_free(s);
+}
+
+static session_t *session_new(SSL_CTX *ctx)
+{
+    session_t *s = calloc(1, sizeof(*s));
+    BIO *bio;
+    
+    if (!s) {
+        return NULL;
+    }
+    
+    s->ssl = SSL_new(ctx);
+    bio = BIO_new(session_bio_method);
+    if (!s->ssl || !bio) {
+        SSL_free(s->ssl);
+        BIO_free(bio);
+        free(s);
+        return NULL;
+    }
+    BIO_set_data(bio, s);
+    SSL_set_bio(s->ssl, bio, bio);
+    SSL_set_app_data(s->ssl, s);
+    SSL_set_options(s->ssl, SSL_OP_COOKIE_EXCHANGE);
+    SSL_set_mtu(s->ssl, DTLS_MTU);
+    return s;
+}
+
+static void session_insert(session_t *s)
+{
+    uint32_t h = peer_hash(&s->peer);
+    
+    s->hash_next = session_buckets[h];
+    session_buckets[h] = s;
+    s->prev = NULL;
+    s->next = sessions;
+    if (sessions) {
+        sessions->prev = s;
+    }
+    sessions = s;
+    session_count++;
+}
+
+static void session_free(session_t *s)
+{
+    session_t **link = &session_buckets[peer_hash(&s->peer)];
+    
+    while (*link != s) {
+        link = &(*link)->hash_next;
+    }
+    *link = s->hash_next;
+    if (s->prev) {
+        s->prev->next = s->next;
+    } else {
+        sessions = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
+    }
+    session_count--;
+    session_coap_release(s);
+    SSL_free(s->ssl);
+    free(s);
+}
+
+/* One decrypted datagram: a request, or an ACK or RST from the client */
+static void handle_coap_request(session_t *s, const uint8_t *buffer, size_t len)
+{
+    coap_req_t req;
+    int ret = coap_parse_request(&req, buffer, len);
+    
+    if (ret < 0) {
+        return;
+    }
+    if (req.type == COAP_ACK || req.type == COAP_RST) {
+        /* A RST answers a notification the client no longer wants */
+        observer_t *o;
+    
+        for (o = s->observers; req.type == COAP_RST && o; o = o->session_next) {
+            if (o->last_mid == req.mid) {
+                observer_unlink(o);
+                break;
+            }
+        }
+        return;
+    }
+    if (req.code == 0) {
+        /* CoAP ping */
+        if (req.type == COAP_CON) {
+            coap_send(s, COAP_RST, 0, req.mid, NULL, 0, NULL, 0);
+        }
+        return;
+    }
+    stat_requests++;
+    
+    if (ret > 0) {
+        coap_reply(s, &req, (uint8_t)ret, NULL, 0);
+        return;
+    }
+    switch (req.code) {
+    case COAP_GET:
+        coap_get(s, &req);
+        break;
+    case COAP_PUT:
+        coap_put(s, &req);
+        break;
+    case COAP_DELETE:
+        coap_delete(s, &req);
+        break;
+    default:
+        coap_reply(s, &req, COAP_METHOD_NOT_ALLOWED, NULL, 0);
+        break;
+    }
+}
+
+/* Drive the handshake, or read and answer requests */
+static void session_input(session_t *s)
+{
+    uint8_t buffer[DTLS_MAX_DATAGRAM];
+    int ret;
+    
+    if (!s->established) {
+        ret = SSL_accept(s->ssl);
+        if (ret <= 0) {
+            int err = SSL_get_error(s->ssl, ret);
+    
+            if (err != SSL_ERROR_WANT_READ) {
+                session_free(s);
+            }
+            return;
+        }
+        s->established = 1;
+        stat_handshakes++;
+    }
+    
+    for (;;) {
+        ret = SSL_read(s->ssl, buffer, sizeof(buffer));
+        if (ret <= 0) {
+            int err = SSL_get_error(s->ssl, ret);
+    
+            if (err == SSL_ERROR_ZERO_RETURN || (err != SSL_ERROR_WANT_READ)) {
+                /* close_notify or a fatal alert */
+                session_free(s);
+            }
+            return;
+        }
+        handle_coap_request(s, buffer, (size_t)ret);
+    }
+}
+
+static int is_client_hello(const uint8_t *data, size_t len)
+{
+    /* handshake record, epoch 0, ClientHello */
+    return len > 13 && data[0] == 22 && data[3] == 0 && data[4] == 0 && data[13] == 1;
+}
+
+/*
+ * One datagram. spare is the stateless listener SSL; it becomes the
+ * session when a ClientHello proves its address with a cookie.
+ */
+static void dispatch(SSL_CTX *ctx, session_t **spare, const struct sockaddr_in *peer,
+                     const uint8_t *data, size_t len)
+{
+    session_t *s = session_find(peer);
+    session_t *old;
+    BIO_ADDR *client;
+    int ret;
+    
+    /*
+     * A rebooted device starts over from the same address, but anyone can
+     * send a plaintext ClientHello from it: the established session stays
+     * until the new one has been through the cookie exchange
+     */
+    if (s && !(s->established && is_client_hello(data, len))) {
+        s->in = data;
+        s->in_len = len;
+        s->deadline = time(NULL) + (s->established ? SESSION_IDLE_SEC : HANDSHAKE_TIMEOUT_SEC);
+        session_input(s);
+        return;
+    }
+    
+    if (!is_client_hello(data, len) || (!s && session_count >= MAX_SESSIONS)) {
+        return;
+    }
+    if (!*spare && !(*spare = session_new(ctx))) {
+        return;
+    }
+    
+    old = s;
+    s = *spare;
+    s->peer = *peer;
+    s->in = data;
+    s->in_len = len;
+    client = BIO_ADDR_new();
+    ret = client ? DTLSv1_listen(s->ssl, client) : -1;
+    BIO_ADDR_free(client);
+    if (ret <= 0) {
+        /* HelloVerifyRequest queued, or junk; the spare stays stateless */
+        s->in = NULL;
+        return;
+    }
+    
+    /* The cookie came back: the peer is at this address, replace it */
+    if (old) {
+        session_free(old);
+    }
+    *spare = NULL;
+    s->deadline = time(NULL) + HANDSHAKE_TIMEOUT_SEC;
+    session_insert(s);
+    /* DTLSv1_listen kept the ClientHello for SSL_accept */
+    session_input(s);
+}
+
+/* Handshake retransmissions and expired sessions */
+static void sweep(void)
+{
+    time_t now = time(NULL);
+    session_t *s = sessions;
+    
+    while (s) {
+        session_t *next = s->next;
+    
+        if (now >= s->deadline) {
+            session_free(s);
+        } else if (!s->established) {
+            DTLSv1_handle_timeout(s->ssl);
+        }
+        s = next;
+    }
+}
+
+static void print_stats(void)
+{
+    printf("CoAP-DTLS: %zu sessions, %llu handshakes, %llu cookies, "
+           "%llu requests, %llu send batches\n", session_count,
+           (unsigned long long)stat_handshakes, (unsigned long long)stat_cookies_sent,
+           (unsigned long long)stat_requests, (unsigned long long)stat_sent_batches);
+    printf("CoAP: %zu resources, %zu observers, %llu notifications, %llu blocks, "
+           "cache %llu hits %llu misses\n", resource_count, observer_count,
+           (unsigned long long)stat_notifications, (unsigned long long)stat_blocks,
+           (unsigned long long)stat_cache_hits, (unsigned long long)stat_cache_misses);
+}
+
+static int create_socket(void)
+{
+    struct sockaddr_in addr;
     int sock;
+    
+    sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (sock < 0) {
+        perror("Unable to create socket");
+        return -1;
+    }
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(COAP_DTLS_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Unable to bind");
+        close(sock);
+        return -1;
+    }
+    
+    return sock;
+}
+
+/* io_uring receive loop; returns only if the ring fails */
+static int serve_uring(SSL_CTX *ctx, session_t **spare)
+{
+    static struct msghdr msg = { .msg_namelen = sizeof(struct sockaddr_in) };
+    time_t last_stats = time(NULL);
+    tls_uring_t uring;
+    
+    if (tls_uring_init(&uring, URING_ENTRIES, URING_BUFS, URING_BUF_SIZE) != 0 ||
+        tls_uring_recvmsg_multishot(&uring, dtls_sock, &msg, &msg) != 0) {
+        perror("Unable to set up io_uring");
+        return -1;
+    }
+    
+    while (1) {
+        struct io_uring_cqe *cqe;
+    
+        if (tls_uring_wait(&uring, SWEEP_INTERVAL_MS) != 0) {
+            perror("io_uring_enter");
+            return -1;
+        }
+    
+        while ((cqe = tls_uring_cqe_peek(&uring))) {
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                const void *name;
+                const uint8_t *data;
+                size_t len;
+    
+                data = tls_uring_recvmsg_payload(cqe, tls_uring_buf(&uring, bid), &msg, &name, &len);
+                if (data) {
+                    URING_STAT_ADD(recv_bytes, len);
+                    dispatch(ctx, spare, name, data, len);
+                }
+                tls_uring_buf_recycle(&uring, bid);
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                /* out of buffers, or the kernel ended the multishot */
+                if (cqe->res == -ENOBUFS) {
+                    URING_STAT_ADD(no_buffers, 1);
+                }
+                URING_STAT_ADD(rearms, 1);
+                tls_uring_recvmsg_multishot(&uring, dtls_sock, &msg, &msg);
+            }
+            tls_uring_cqe_seen(&uring);
+        }
+        send_flush();
+    
+        sweep();
+        send_flush();
+    
+        if (time(NULL) - last_stats >= STATS_INTERVAL_SEC) {
+            last_stats = time(NULL);
+            print_stats();
+            tls_uring_print_stats(stdout);
+            fflush(stdout);
+        }
+    }
+}
+
+int main(void)
+{
+    static dgram_batch_t recv_batch;
     SSL_CTX *ctx;
-    struct sockaddr_in addr;
+    session_t *spare = NULL;
+    time_t last_stats = time(NULL);
+    struct pollfd pfd;
+    unsigned int i;
     
     SSL_library_init();
     OpenSSL_add_all_algorithms();
     SSL_load_error_strings();
     
     ctx = SSL_CTX_new(DTLS_server_method());
-    SSL_CTX_use_certificate_file(ctx, "server.crt", SSL_FILETYPE_PEM);
-    SSL_CTX_use_PrivateKey_file(ctx, "server.key", SSL_FILETYPE_PEM);
+    if (!ctx ||
+        SSL_CTX_use_certificate_file(ctx, "server.crt", SSL_FILETYPE_PEM) <= 0 ||
+        SSL_CTX_use_PrivateKey_file(ctx, "server.key", SSL_FILETYPE_PEM) <= 0 ||
+        RAND_bytes(cookie_secret, sizeof(cookie_secret)) != 1 ||
+        RAND_bytes((unsigned char *)&etag_counter, sizeof(etag_counter)) != 1) {
+        ERR_print_errors_fp(stderr);
+        return 1;
+    }
+    SSL_CTX_set_options(ctx, SSL_OP_NO_QUERY_MTU);
+    SSL_CTX_set_cookie_generate_cb(ctx, cookie_generate);
+    SSL_CTX_set_cookie_verify_cb(ctx, cookie_verify);
     
-    sock = socket(AF_INET, SOCK_DGRAM, 0);
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(COAP_DTLS_PORT);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    session_bio_method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "dtls session");
+    if (!session_bio_method ||
+        !BIO_meth_set_write(session_bio_method, session_bio_write) ||
+        !BIO_meth_set_read(session_bio_method, session_bio_read) ||
+        !BIO_meth_set_ctrl(session_bio_method, session_bio_ctrl) ||
+        !BIO_meth_set_create(session_bio_method, session_bio_create)) {
+        return 1;
+    }
     
-    bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    /* COAP_FW_FILE=path serves a firmware image as /fw, block-wise */
+    if (getenv("COAP_FW_FILE") &&
+        resource_load("fw", getenv("COAP_FW_FILE"), COAP_FORMAT_OCTET_STREAM) != 0) {
+        return 1;
+    }
+    
+    dtls_sock = create_socket();
+    if (dtls_sock < 0) {
+        return 1;
+    }
+    
+    for (i = 0; i < DTLS_BATCH; i++) {
+        recv_batch.iov[i].iov_base = recv_batch.data[i];
+        recv_batch.iov[i].iov_len = sizeof(recv_batch.data[i]);
+        recv_batch.msgs[i].msg_hdr.msg_iov = &recv_batch.iov[i];
+        recv_batch.msgs[i].msg_hdr.msg_iovlen = 1;
+        recv_batch.msgs[i].msg_hdr.msg_name = &recv_batch.addr[i];
+    }
     
     printf("CoAP-DTLS server listening on port %d\n", COAP_DTLS_PORT);
     
+    if (tls_uring_requested()) {
+        serve_uring(ctx, &spare);
+        close(dtls_sock);
+        SSL_CTX_free(ctx);
+        return 1;
+    }
+    
+    pfd.fd = dtls_sock;
+    pfd.events = POLLIN;
     while (1) {
-        uint8_t buffer[1024];
-        struct sockaddr_in client_addr;
-        socklen_t len = sizeof(client_addr);
-        
-        int bytes = recvfrom(sock, buffer, sizeof(buffer), 0,
-                            (struct sockaddr *)&client_addr, &len);
-        
-        if (bytes > 0) {
-            SSL *ssl = SSL_new(ctx);
-            SSL_set_fd(ssl, sock);
-            SSL_set_accept_state(ssl);
-            
-            if (SSL_accept(ssl) > 0) {
-                handle_coap_request(ssl, buffer, bytes);
-            }
-            
-            SSL_free(ssl);
+        int n;
+    
+        if (poll(&pfd, 1, SWEEP_INTERVAL_MS) > 0) {
+            /* Until the socket is empty, DTLS_BATCH datagrams per syscall */
+            do {
+                for (i = 0; i < DTLS_BATCH; i++) {
+                    recv_batch.msgs[i].msg_hdr.msg_namelen = sizeof(recv_batch.addr[i]);
+                }
+                n = recvmmsg(dtls_sock, recv_batch.msgs, DTLS_BATCH, MSG_DONTWAIT, NULL);
+                for (i = 0; n > 0 && i < (unsigned int)n; i++) {
+                    if (recv_batch.msgs[i].msg_hdr.msg_namelen != sizeof(struct sockaddr_in)) {
+                        continue;
+                    }
+                    dispatch(ctx, &spare, &recv_batch.addr[i], recv_batch.data[i],
+                             recv_batch.msgs[i].msg_len);
+                }
+                send_flush();
+            } while (n == DTLS_BATCH);
+        }
+    
+        sweep();
+        send_flush();
+    
+        if (time(NULL) - last_stats >= STATS_INTERVAL_SEC) {
+            last_stats = time(NULL);
+            print_stats();
+            fflush(stdout);
         }
     }
     
-    close(sock);
+    close(dtls_sock);
     SSL_CTX_free(ctx);
     return 0;
 }
-
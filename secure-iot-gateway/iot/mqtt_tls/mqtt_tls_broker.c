@@ -1,73 +1,1284 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include "../../protocols/tls_dtls/tls_resumption.c"
+#include "../../protocols/tls_dtls/tls_ktls.c"
+#include "../../protocols/tls_dtls/tls_uring.c"
 
 #define MQTT_TLS_PORT 8883
 #define CERT_FILE "server.crt"
 #define KEY_FILE "server.key"
 
-/* Simplified MQTT-TLS broker */
-int handle_mqtt_connect(SSL *ssl)
+#define LISTEN_BACKLOG 4096
+#define MAX_EVENTS 256
+#define HANDSHAKE_TIMEOUT_SEC 10
+#define STATS_INTERVAL_SEC 60
+#define MQTT_MAX_PACKET 65536       /* largest packet accepted or sent */
+#define MQTT_PUBLISH_ROOM (MQTT_MAX_PACKET + 16)    /* wbuf share for deliveries */
+#define MQTT_OUT_QUEUE 1024         /* deliveries waiting per connection */
+#define MQTT_MAX_INFLIGHT 32        /* unacknowledged QoS 1 per connection */
+#define MQTT_RETRY_SEC 10
+#define TRIE_BUCKETS 65536          /* power of two */
+#define URING_ENTRIES 4096
+#define URING_BUFS 4096             /* provided receive buffers per worker */
+#define URING_BUF_SIZE 16384
+
+/* MQTT 3.1.1 packet types */
+#define MQTT_CONNECT     1
+#define MQTT_CONNACK     2
+#define MQTT_PUBLISH     3
+#define MQTT_PUBACK      4
+#define MQTT_SUBSCRIBE   8
+#define MQTT_SUBACK      9
+#define MQTT_UNSUBSCRIBE 10
+#define MQTT_UNSUBACK    11
+#define MQTT_PINGREQ     12
+#define MQTT_PINGRESP    13
+#define MQTT_DISCONNECT  14
+
+/*
+ * Broker core. Workers each own their connections (SO_REUSEPORT
+ * listener, epoll set), as in tls_server.c. Subscriptions live in one
+ * topic trie shared by all workers under a rwlock: a publish takes it
+ * for reading, so publishes on different workers match in parallel.
+ *
+ * A publish is serialized once into a refcounted message (topic and
+ * payload); every matching subscriber gets a reference on its out
+ * queue, and only the few header bytes that differ per subscriber
+ * (QoS flags, packet id) are written per delivery. A subscriber owned by
+ * another worker is handed to that worker through its pending list and
+ * eventfd, so a connection's SSL object is only ever used by its owner.
+ * Deliveries are coalesced into one staging buffer per connection and
+ * go out in as few SSL_write calls (TLS records) as fit. Deliveries
+ * only fill MQTT_PUBLISH_ROOM of it, so replies to one read always fit,
+ * and a connection stops reading while its buffer cannot drain. With
+ * TLS_URING=1 workers run on io_uring (tls_uring.c): the same conn_io()
+ * steps on recv and send completions, and the eventfd is a pending read.
+ */
+typedef struct {
+    uint32_t refs;
+    size_t topic_len;           /* length-prefixed topic, 2 + topic bytes */
+    size_t len;                 /* topic_len + payload */
+    uint8_t data[];
+} mqtt_msg_t;
+
+typedef struct {
+    mqtt_msg_t *msg;
+    uint8_t qos;
+} out_item_t;
+
+typedef struct {
+    uint16_t packet_id;         /* 0 when the slot is free */
+    mqtt_msg_t *msg;
+    time_t sent;
+} inflight_t;
+
+typedef enum {
+    CONN_HANDSHAKE,
+    CONN_WAIT_CONNECT,
+    CONN_ONLINE
+} conn_state_t;
+
+struct worker;
+struct trie_node;
+
+typedef struct node_ref {
+    struct trie_node *node;
+    struct node_ref *next;
+} node_ref_t;
+
+typedef struct conn {
+    int fd;
+    SSL *ssl;
+    conn_state_t state;
+    struct worker *worker;
+    time_t deadline;            /* handshake, then keepalive */
+    uint16_t keepalive;
+    
+    uint8_t rbuf[MQTT_MAX_PACKET];
+    size_t rlen;
+    uint8_t wbuf[MQTT_PUBLISH_ROOM + MQTT_MAX_PACKET];  /* rest is for replies */
+    size_t wlen;
+    int want_write;
+    
+    /* filled by any worker, drained by the owner */
+    pthread_mutex_t out_lock;
+    out_item_t out[MQTT_OUT_QUEUE];
+    size_t out_head;
+    size_t out_count;
+    int pending;
+    struct conn *pending_next;
+    
+    inflight_t inflight[MQTT_MAX_INFLIGHT];
+    uint16_t next_packet_id;
+    
+    node_ref_t *subscriptions;
+    tls_uring_stream_t stream;  /* io_uring backend only */
+    struct conn *prev;
+    struct conn *next;
+} conn_t;
+
+typedef struct worker {
+    SSL_CTX *ctx;
+    int listen_fd;
+    int epoll_fd;
+    int event_fd;
+    tls_uring_t *uring;         /* NULL on the epoll backend */
+    uint64_t event_count;       /* io_uring read of event_fd */
+    conn_t *conns;
+    pthread_mutex_t pending_lock;
+    conn_t *pending;
+} worker_t;
+
+/* Topic trie: edges in one hash table keyed by (parent, level) */
+typedef struct subscriber {
+    conn_t *conn;
+    uint8_t qos;
+    struct subscriber *next;
+} subscriber_t;
+
+typedef struct trie_node {
+    struct trie_node *parent;
+    char *level;
+    struct trie_node *bucket_next;
+    subscriber_t *subscribers;
+} trie_node_t;
+
+static pthread_rwlock_t trie_lock = PTHREAD_RWLOCK_INITIALIZER;
+static trie_node_t trie_root;
+static trie_node_t *trie_buckets[TRIE_BUCKETS];
+
+static uint64_t stat_published;
+static uint64_t stat_delivered;
+static uint64_t stat_dropped;
+
+static mqtt_msg_t *msg_ref(mqtt_msg_t *msg)
+{
+    __atomic_add_fetch(&msg->refs, 1, __ATOMIC_RELAXED);
+    return msg;
+}
+
+static void msg_unref(mqtt_msg_t *msg)
 {
-    uint8_t buffer[1024];
-    int bytes = SSL_read(ssl, buffer, sizeof(buffer));
+    if (__atomic_sub_fetch(&msg->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(msg);
+    }
+}
+
+static uint32_t edge_hash(const trie_node_t *parent, const char *level, size_t len)
+{
+    uint32_t h = 2166136261u ^ (uint32_t)(uintptr_t)parent;
+    size_t i;
+    
+    for (i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)level[i]) * 16777619u;
+    }
+    return h & (TRIE_BUCKETS - 1);
+}
+
+static trie_node_t *trie_child(const trie_node_t *parent, const char *level, size_t len)
+{
+    trie_node_t *n = trie_buckets[edge_hash(parent, level, len)];
+    
+    while (n && (n->parent != parent || strlen(n->level) != len ||
+                 memcmp(n->level, level, len) != 0)) {
+        n = n->bucket_next;
+    }
+    return n;
+}
+
+/* Caller holds trie_lock for writing */
+static trie_node_t *trie_get_or_add(trie_node_t *parent, const char *level, size_t len)
+{
+    trie_node_t *n = trie_child(parent, level, len);
+    uint32_t h;
     
-    if (bytes > 0 && buffer[0] == 0x10) { /* CONNECT packet */
-        printf("MQTT CONNECT received\n");
-        
-        /* Send CONNACK */
-        uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
-        SSL_write(ssl, connack, sizeof(connack));
+    if (n) {
+        return n;
+    }
+    
+    n = calloc(1, sizeof(*n));
+    if (!n || !(n->level = strndup(level, len))) {
+        free(n);
+        return NULL;
+    }
+    n->parent = parent;
+    h = edge_hash(parent, level, len);
+    n->bucket_next = trie_buckets[h];
+    trie_buckets[h] = n;
+    return n;
+}
+
+/* Find or create the node for a filter like "sensors/+/temp" */
+static trie_node_t *trie_filter_node(const char *filter, size_t len)
+{
+    trie_node_t *node = &trie_root;
+    size_t start = 0;
+    size_t i;
+    
+    for (i = 0; i <= len; i++) {
+        if (i == len || filter[i] == '/') {
+            node = trie_get_or_add(node, filter + start, i - start);
+            if (!node) {
+                return NULL;
+            }
+            start = i + 1;
+        }
+    }
+    return node;
+}
+
+static int filter_valid(const char *filter, size_t len)
+{
+    size_t i;
+    
+    if (len == 0) {
         return 0;
     }
+    for (i = 0; i < len; i++) {
+        /* wildcards take a whole level, and # only the last one */
+        if (filter[i] == '+' &&
+            ((i > 0 && filter[i - 1] != '/') || (i + 1 < len && filter[i + 1] != '/'))) {
+            return 0;
+        }
+        if (filter[i] == '#' && (i + 1 != len || (i > 0 && filter[i - 1] != '/'))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void deliver(conn_t *target, worker_t *self, mqtt_msg_t *msg, uint8_t qos);
+
+/* Walk topic levels from node; caller holds trie_lock for reading */
+static void trie_match(const trie_node_t *node, const char *topic, size_t len,
+                       worker_t *self, mqtt_msg_t *msg, uint8_t qos, int first)
+{
+    const trie_node_t *child;
+    const subscriber_t *s;
+    size_t level_len = 0;
+    
+    /* "a/#" also matches "a"; $-topics never match a leading wildcard */
+    if (!(first && len > 0 && topic[0] == '$')) {
+        child = trie_child(node, "#", 1);
+        if (child) {
+            for (s = child->subscribers; s; s = s->next) {
+                deliver(s->conn, self, msg, qos < s->qos ? qos : s->qos);
+            }
+        }
+    }
     
-    return -1;
+    if (len == (size_t)-1) {
+        return;
+    }
+    
+    while (level_len < len && topic[level_len] != '/') {
+        level_len++;
+    }
+    
+    child = trie_child(node, topic, level_len);
+    if (child) {
+        if (level_len == len) {
+            for (s = child->subscribers; s; s = s->next) {
+                deliver(s->conn, self, msg, qos < s->qos ? qos : s->qos);
+            }
+            trie_match(child, NULL, (size_t)-1, self, msg, qos, 0);
+        } else {
+            trie_match(child, topic + level_len + 1, len - level_len - 1, self, msg, qos, 0);
+        }
+    }
+    
+    if (!(first && len > 0 && topic[0] == '$')) {
+        child = trie_child(node, "+", 1);
+        if (child) {
+            if (level_len == len) {
+                for (s = child->subscribers; s; s = s->next) {
+                    deliver(s->conn, self, msg, qos < s->qos ? qos : s->qos);
+                }
+                trie_match(child, NULL, (size_t)-1, self, msg, qos, 0);
+            } else {
+                trie_match(child, topic + level_len + 1, len - level_len - 1, self, msg, qos, 0);
+            }
+        }
+    }
 }
 
-int main(void)
+static int subscribe(conn_t *c, const char *filter, size_t len, uint8_t qos)
+{
+    trie_node_t *node;
+    subscriber_t *s;
+    node_ref_t *ref;
+    
+    pthread_rwlock_wrlock(&trie_lock);
+    node = trie_filter_node(filter, len);
+    if (!node) {
+        pthread_rwlock_unlock(&trie_lock);
+        return -1;
+    }
+    
+    /* A repeated filter replaces the earlier subscription's QoS */
+    for (s = node->subscribers; s; s = s->next) {
+        if (s->conn == c) {
+            s->qos = qos;
+            pthread_rwlock_unlock(&trie_lock);
+            return 0;
+        }
+    }
+    
+    s = malloc(sizeof(*s));
+    ref = malloc(sizeof(*ref));
+    if (!s || !ref) {
+        free(s);
+        free(ref);
+        pthread_rwlock_unlock(&trie_lock);
+        return -1;
+    }
+    s->conn = c;
+    s->qos = qos;
+    s->next = node->subscribers;
+    node->subscribers = s;
+    ref->node = node;
+    ref->next = c->subscriptions;
+    c->subscriptions = ref;
+    pthread_rwlock_unlock(&trie_lock);
+    
+    return 0;
+}
+
+/* Caller holds trie_lock for writing */
+static void node_remove_subscriber(trie_node_t *node, conn_t *c)
+{
+    subscriber_t **link = &node->subscribers;
+    
+    while (*link) {
+        if ((*link)->conn == c) {
+            subscriber_t *s = *link;
+            *link = s->next;
+            free(s);
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+static void unsubscribe(conn_t *c, const char *filter, size_t len)
+{
+    trie_node_t *node = &trie_root;
+    node_ref_t **link;
+    size_t start = 0;
+    size_t i;
+    
+    pthread_rwlock_wrlock(&trie_lock);
+    for (i = 0; i <= len && node; i++) {
+        if (i == len || filter[i] == '/') {
+            node = trie_child(node, filter + start, i - start);
+            start = i + 1;
+        }
+    }
+    if (node) {
+        node_remove_subscriber(node, c);
+        for (link = &c->subscriptions; *link; link = &(*link)->next) {
+            if ((*link)->node == node) {
+                node_ref_t *ref = *link;
+                *link = ref->next;
+                free(ref);
+                break;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&trie_lock);
+}
+
+/* Queue msg for target; any worker may call this */
+static void deliver(conn_t *target, worker_t *self, mqtt_msg_t *msg, uint8_t qos)
+{
+    worker_t *owner = target->worker;
+    int notify = 0;
+    
+    pthread_mutex_lock(&target->out_lock);
+    if (target->out_count == MQTT_OUT_QUEUE) {
+        /* Slow consumer: drop rather than grow without bound */
+        pthread_mutex_unlock(&target->out_lock);
+        __atomic_add_fetch(&stat_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    target->out[(target->out_head + target->out_count) % MQTT_OUT_QUEUE].msg = msg_ref(msg);
+    target->out[(target->out_head + target->out_count) % MQTT_OUT_QUEUE].qos = qos;
+    target->out_count++;
+    
+    if (!target->pending) {
+        target->pending = 1;
+        pthread_mutex_lock(&owner->pending_lock);
+        target->pending_next = owner->pending;
+        owner->pending = target;
+        pthread_mutex_unlock(&owner->pending_lock);
+        notify = owner != self;
+    }
+    pthread_mutex_unlock(&target->out_lock);
+    
+    if (notify) {
+        uint64_t one = 1;
+        if (write(owner->event_fd, &one, sizeof(one)) < 0) {
+            /* counter saturated, the owner is awake anyway */
+        }
+    }
+}
+
+static size_t encode_length(uint8_t *p, size_t len)
+{
+    size_t n = 0;
+    
+    do {
+        uint8_t byte = len % 128;
+        len /= 128;
+        p[n++] = (uint8_t)(byte | (len ? 0x80 : 0));
+    } while (len);
+    return n;
+}
+
+static int wbuf_append(conn_t *c, const uint8_t *data, size_t len)
+{
+    if (len > sizeof(c->wbuf) - c->wlen) {
+        return -1;
+    }
+    memcpy(c->wbuf + c->wlen, data, len);
+    c->wlen += len;
+    return 0;
+}
+
+/* PUBLISH for one subscriber: own header bytes, shared topic and payload */
+static int wbuf_publish(conn_t *c, const mqtt_msg_t *msg, uint8_t qos,
+                        uint16_t packet_id, int dup)
+{
+    uint8_t header[5];
+    size_t remaining = msg->len + (qos ? 2 : 0);
+    size_t n = 1;
+    
+    header[0] = (uint8_t)((MQTT_PUBLISH << 4) | (dup ? 0x08 : 0) | (qos << 1));
+    n += encode_length(header + 1, remaining);
+    if (c->wlen + n + remaining > MQTT_PUBLISH_ROOM) {
+        return -1;
+    }
+    
+    wbuf_append(c, header, n);
+    wbuf_append(c, msg->data, msg->topic_len);
+    if (qos) {
+        uint8_t id[2] = { (uint8_t)(packet_id >> 8), (uint8_t)packet_id };
+        wbuf_append(c, id, 2);
+    }
+    wbuf_append(c, msg->data + msg->topic_len, msg->len - msg->topic_len);
+    return 0;
+}
+
+static inflight_t *inflight_slot(conn_t *c)
+{
+    int i;
+    
+    for (i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+        if (c->inflight[i].packet_id == 0) {
+            return &c->inflight[i];
+        }
+    }
+    return NULL;
+}
+
+/* Move queued deliveries into the staging buffer while they fit */
+static void drain_out_queue(conn_t *c)
+{
+    pthread_mutex_lock(&c->out_lock);
+    while (c->out_count > 0) {
+        out_item_t *item = &c->out[c->out_head];
+        inflight_t *slot = NULL;
+        uint16_t packet_id = 0;
+    
+        if (item->qos) {
+            slot = inflight_slot(c);
+            if (!slot) {
+                break;          /* resumes when a PUBACK frees a slot */
+            }
+            if (++c->next_packet_id == 0) {
+                c->next_packet_id = 1;
+            }
+            packet_id = c->next_packet_id;
+        }
+        if (wbuf_publish(c, item->msg, item->qos, packet_id, 0) != 0) {
+            break;              /* resumes once the buffer is written */
+        }
+    
+        if (slot) {
+            /* the queue's reference moves to the in-flight slot */
+            slot->packet_id = packet_id;
+            slot->msg = item->msg;
+            slot->sent = time(NULL);
+        } else {
+            msg_unref(item->msg);
+        }
+        c->out_head = (c->out_head + 1) % MQTT_OUT_QUEUE;
+        c->out_count--;
+        __atomic_add_fetch(&stat_delivered, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&c->out_lock);
+}
+
+/* io_uring backend: the last request on the stream has completed */
+static void conn_release(void *owner)
+{
+    free(owner);
+}
+
+static void conn_close(worker_t *w, conn_t *c)
+{
+    node_ref_t *ref;
+    conn_t **link;
+    int i;
+    
+    /* No worker can queue for c once it is out of the trie */
+    pthread_rwlock_wrlock(&trie_lock);
+    while ((ref = c->subscriptions)) {
+        node_remove_subscriber(ref->node, c);
+        c->subscriptions = ref->next;
+        free(ref);
+    }
+    pthread_rwlock_unlock(&trie_lock);
+    
+    pthread_mutex_lock(&w->pending_lock);
+    for (link = &w->pending; *link; link = &(*link)->pending_next) {
+        if (*link == c) {
+            *link = c->pending_next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&w->pending_lock);
+    
+    while (c->out_count > 0) {
+        msg_unref(c->out[c->out_head].msg);
+        c->out_head = (c->out_head + 1) % MQTT_OUT_QUEUE;
+        c->out_count--;
+    }
+    for (i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+        if (c->inflight[i].packet_id) {
+            msg_unref(c->inflight[i].msg);
+        }
+    }
+    
+    if (!w->uring) {
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    }
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        w->conns = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+    pthread_mutex_destroy(&c->out_lock);
+    SSL_free(c->ssl);
+    if (w->uring) {
+        /* queued records still go out; conn_release() frees c */
+        tls_uring_stream_close(&c->stream);
+        return;
+    }
+    close(c->fd);
+    free(c);
+}
+
+static int handle_connect(conn_t *c, const uint8_t *p, size_t len)
+{
+    static const uint8_t connack[] = { MQTT_CONNACK << 4, 0x02, 0x00, 0x00 };
+    size_t name_len;
+    
+    /* protocol name, level, flags, keep alive */
+    if (len < 2 || (name_len = (size_t)(p[0] << 8 | p[1])) + 6 > len) {
+        return -1;
+    }
+    c->keepalive = (uint16_t)(p[2 + name_len + 2] << 8 | p[2 + name_len + 3]);
+    c->state = CONN_ONLINE;
+    return wbuf_append(c, connack, sizeof(connack));
+}
+
+static int handle_publish(conn_t *c, uint8_t flags, const uint8_t *p, size_t len)
+{
+    uint8_t qos = (flags >> 1) & 0x03;
+    size_t topic_len;
+    size_t offset;
+    uint16_t packet_id = 0;
+    mqtt_msg_t *msg;
+    size_t i;
+    
+    if (len < 2 || (topic_len = (size_t)(p[0] << 8 | p[1])) == 0 || topic_len + 2 > len || qos > 1) {
+        return -1;              /* QoS 2 is not supported */
+    }
+    offset = 2 + topic_len;
+    if (qos) {
+        if (offset + 2 > len) {
+            return -1;
+        }
+        packet_id = (uint16_t)(p[offset] << 8 | p[offset + 1]);
+        offset += 2;
+    }
+    for (i = 0; i < topic_len; i++) {
+        if (p[2 + i] == '+' || p[2 + i] == '#') {
+            return -1;
+        }
+    }
+    
+    /* Serialized once: length-prefixed topic, then the payload */
+    msg = malloc(sizeof(*msg) + 2 + topic_len + (len - offset));
+    if (!msg) {
+        return -1;
+    }
+    msg->refs = 1;
+    msg->topic_len = 2 + topic_len;
+    msg->len = 2 + topic_len + (len - offset);
+    memcpy(msg->data, p, 2 + topic_len);
+    memcpy(msg->data + 2 + topic_len, p + offset, len - offset);
+    
+    pthread_rwlock_rdlock(&trie_lock);
+    trie_match(&trie_root, (const char *)p + 2, topic_len, c->worker, msg, qos, 1);
+    pthread_rwlock_unlock(&trie_lock);
+    msg_unref(msg);
+    __atomic_add_fetch(&stat_published, 1, __ATOMIC_RELAXED);
+    
+    if (qos) {
+        uint8_t puback[4] = { MQTT_PUBACK << 4, 0x02, (uint8_t)(packet_id >> 8), (uint8_t)packet_id };
+        return wbuf_append(c, puback, sizeof(puback));
+    }
+    return 0;
+}
+
+static int handle_subscribe(conn_t *c, const uint8_t *p, size_t len, int unsub)
+{
+    /* fixed header, packet id, one return code per filter */
+    uint8_t ack[5 + 2 + MQTT_MAX_PACKET / 3];
+    uint8_t header[5];
+    size_t h = 1;
+    size_t n = 0;
+    size_t offset = 2;
+    
+    if (len < 4) {
+        return -1;
+    }
+    
+    while (offset < len) {
+        size_t filter_len;
+        const char *filter;
+        uint8_t qos = 0;
+    
+        if (offset + 2 > len || offset + 2 + (filter_len = (size_t)(p[offset] << 8 | p[offset + 1])) > len) {
+            return -1;
+        }
+        filter = (const char *)p + offset + 2;
+        offset += 2 + filter_len;
+    
+        if (unsub) {
+            unsubscribe(c, filter, filter_len);
+            continue;
+        }
+    
+        if (offset >= len) {
+            return -1;
+        }
+        qos = p[offset++] & 0x03;
+        /* granted QoS is at most 1, 0x80 refuses the filter */
+        if (!filter_valid(filter, filter_len) ||
+            subscribe(c, filter, filter_len, qos > 1 ? 1 : qos) != 0) {
+            ack[7 + n++] = 0x80;
+        } else {
+            ack[7 + n++] = qos > 1 ? 1 : qos;
+        }
+    }
+    
+    if (unsub) {
+        uint8_t unsuback[4] = { MQTT_UNSUBACK << 4, 0x02, p[0], p[1] };
+        return wbuf_append(c, unsuback, sizeof(unsuback));
+    }
+    
+    /* the header goes right before the packet id, its length known now */
+    header[0] = MQTT_SUBACK << 4;
+    h += encode_length(header + 1, 2 + n);
+    ack[5] = p[0];
+    ack[6] = p[1];
+    memcpy(ack + 5 - h, header, h);
+    return wbuf_append(c, ack + 5 - h, h + 2 + n);
+}
+
+static void handle_puback(conn_t *c, const uint8_t *p, size_t len)
+{
+    uint16_t packet_id;
+    int i;
+    
+    if (len < 2) {
+        return;
+    }
+    packet_id = (uint16_t)(p[0] << 8 | p[1]);
+    for (i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+        if (c->inflight[i].packet_id == packet_id) {
+            msg_unref(c->inflight[i].msg);
+            c->inflight[i].packet_id = 0;
+            c->inflight[i].msg = NULL;
+            return;
+        }
+    }
+}
+
+/* One complete packet; -1 closes the connection */
+static int handle_packet(conn_t *c, uint8_t type, uint8_t flags, const uint8_t *p, size_t len)
+{
+    static const uint8_t pingresp[] = { MQTT_PINGRESP << 4, 0x00 };
+    
+    if (c->state == CONN_WAIT_CONNECT) {
+        return type == MQTT_CONNECT ? handle_connect(c, p, len) : -1;
+    }
+    
+    switch (type) {
+    case MQTT_PUBLISH:
+        return handle_publish(c, flags, p, len);
+    case MQTT_PUBACK:
+        handle_puback(c, p, len);
+        return 0;
+    case MQTT_SUBSCRIBE:
+        return handle_subscribe(c, p, len, 0);
+    case MQTT_UNSUBSCRIBE:
+        return handle_subscribe(c, p, len, 1);
+    case MQTT_PINGREQ:
+        return wbuf_append(c, pingresp, sizeof(pingresp));
+    case MQTT_DISCONNECT:
+    default:
+        return -1;
+    }
+}
+
+/* Split rbuf into packets; keeps a trailing partial packet */
+static int parse_packets(conn_t *c)
+{
+    size_t offset = 0;
+    
+    while (offset + 2 <= c->rlen) {
+        size_t remaining = 0;
+        size_t header = 1;
+        int shift = 0;
+    
+        for (;;) {
+            uint8_t byte;
+    
+            if (offset + header >= c->rlen) {
+                goto partial;
+            }
+            byte = c->rbuf[offset + header++];
+            remaining |= (size_t)(byte & 0x7f) << shift;
+            shift += 7;
+            if (!(byte & 0x80)) {
+                break;
+            }
+            if (header > 4) {
+                return -1;
+            }
+        }
+        if (header + remaining > sizeof(c->rbuf)) {
+            return -1;
+        }
+        if (offset + header + remaining > c->rlen) {
+            break;
+        }
+    
+        if (handle_packet(c, c->rbuf[offset] >> 4, c->rbuf[offset] & 0x0f,
+                          c->rbuf + offset + header, remaining) != 0) {
+            return -1;
+        }
+        offset += header + remaining;
+    }
+    
+partial:
+    memmove(c->rbuf, c->rbuf + offset, c->rlen - offset);
+    c->rlen -= offset;
+    if (c->keepalive) {
+        c->deadline = time(NULL) + c->keepalive + c->keepalive / 2;
+    }
+    return 0;
+}
+
+/* Write the staging buffer; partial writes keep the rest for later */
+static int flush_wbuf(conn_t *c)
+{
+    while (c->wlen > 0) {
+        int ret = SSL_write(c->ssl, c->wbuf, (int)c->wlen);
+    
+        if (ret <= 0) {
+            int err = SSL_get_error(c->ssl, ret);
+    
+            if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) {
+                c->want_write = 1;
+                return 0;
+            }
+            return -1;
+        }
+        memmove(c->wbuf, c->wbuf + ret, c->wlen - (size_t)ret);
+        c->wlen -= (size_t)ret;
+        /* room again, pull in what is still queued */
+        drain_out_queue(c);
+    }
+    c->want_write = 0;
+    return 0;
+}
+
+/* Write backlog beyond the delivery share: wait for the peer to read */
+static int conn_stalled(const conn_t *c)
+{
+    return c->want_write && c->wlen > MQTT_PUBLISH_ROOM;
+}
+
+static void conn_update_events(worker_t *w, conn_t *c)
+{
+    struct epoll_event ev;
+    
+    if (w->uring) {
+        /* completions drive it; a stalled reader parks its recv */
+        return;
+    }
+    ev.events = conn_stalled(c) ? EPOLLOUT : EPOLLIN | (c->want_write ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static int conn_io(conn_t *c)
+{
+    int ret;
+    
+    if (c->state == CONN_HANDSHAKE) {
+        ret = SSL_accept(c->ssl);
+        if (ret <= 0) {
+            int err = SSL_get_error(c->ssl, ret);
+    
+            c->want_write = err == SSL_ERROR_WANT_WRITE;
+            return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? 0 : -1;
+        }
+        tls_resumption_record(c->ssl);
+        tls_ktls_record(c->ssl);
+        c->state = CONN_WAIT_CONNECT;
+    }
+    
+    if (flush_wbuf(c) != 0) {
+        return -1;
+    }
+    
+    while (!conn_stalled(c)) {
+        if (c->rlen == sizeof(c->rbuf)) {
+            return -1;
+        }
+        ret = SSL_read(c->ssl, c->rbuf + c->rlen, (int)(sizeof(c->rbuf) - c->rlen));
+        if (ret <= 0) {
+            int err = SSL_get_error(c->ssl, ret);
+    
+            if (err == SSL_ERROR_WANT_READ) {
+                break;
+            }
+            if (err == SSL_ERROR_WANT_WRITE) {
+                c->want_write = 1;
+                break;
+            }
+            return -1;
+        }
+        c->rlen += (size_t)ret;
+        if (parse_packets(c) != 0 || flush_wbuf(c) != 0) {
+            return -1;
+        }
+    }
+    
+    drain_out_queue(c);
+    return flush_wbuf(c);
+}
+
+static void run_pending(worker_t *w)
+{
+    conn_t *list;
+    
+    pthread_mutex_lock(&w->pending_lock);
+    list = w->pending;
+    w->pending = NULL;
+    pthread_mutex_unlock(&w->pending_lock);
+    
+    while (list) {
+        conn_t *c = list;
+    
+        list = c->pending_next;
+        pthread_mutex_lock(&c->out_lock);
+        c->pending = 0;
+        pthread_mutex_unlock(&c->out_lock);
+    
+        if (c->state != CONN_ONLINE) {
+            continue;
+        }
+        drain_out_queue(c);
+        if (flush_wbuf(c) != 0) {
+            conn_close(w, c);
+            continue;
+        }
+        conn_update_events(w, c);
+    }
+}
+
+static int create_listener(void)
 {
-    int sock, client;
-    SSL_CTX *ctx;
     struct sockaddr_in addr;
+    int one = 1;
+    int sock;
+    
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sock < 0) {
+        perror("Unable to create socket");
+        return -1;
+    }
+    
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("Unable to set SO_REUSEPORT");
+        close(sock);
+        return -1;
+    }
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(MQTT_TLS_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(sock, LISTEN_BACKLOG) < 0) {
+        perror("Unable to listen");
+        close(sock);
+        return -1;
+    }
+    
+    return sock;
+}
+
+/* A connection for an accepted socket, linked into the worker */
+static conn_t *conn_new(worker_t *w, int client)
+{
+    conn_t *c = calloc(1, sizeof(*c));
+    
+    if (!c || !(c->ssl = SSL_new(w->ctx))) {
+        free(c);
+        close(client);
+        return NULL;
+    }
+    c->fd = client;
+    c->worker = w;
+    c->state = CONN_HANDSHAKE;
+    c->deadline = time(NULL) + HANDSHAKE_TIMEOUT_SEC;
+    SSL_set_mode(c->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    
+    if (w->uring) {
+        BIO *bio = tls_uring_bio_new(&c->stream);
+    
+        if (!bio) {
+            SSL_free(c->ssl);
+            free(c);
+            close(client);
+            return NULL;
+        }
+        SSL_set_bio(c->ssl, bio, bio);
+        tls_uring_stream_init(&c->stream, w->uring, client, c, conn_release);
+    } else {
+        struct epoll_event ev;
+    
+        SSL_set_fd(c->ssl, client);
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, client, &ev) < 0) {
+            SSL_free(c->ssl);
+            free(c);
+            close(client);
+            return NULL;
+        }
+    }
+    pthread_mutex_init(&c->out_lock, NULL);
+    
+    c->next = w->conns;
+    if (w->conns) {
+        w->conns->prev = c;
+    }
+    w->conns = c;
+    return c;
+}
+
+static void accept_all(worker_t *w)
+{
+    for (;;) {
+        conn_t *c;
+        int client;
+    
+        client = accept4(w->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return;
+        }
+    
+        c = conn_new(w, client);
+        if (!c) {
+            continue;
+        }
+    
+        if (conn_io(c) != 0) {
+            conn_close(w, c);
+        } else {
+            conn_update_events(w, c);
+        }
+    }
+}
+
+/* Handshake and keepalive timeouts, and QoS 1 redelivery */
+static void sweep(worker_t *w)
+{
+    time_t now = time(NULL);
+    conn_t *c = w->conns;
+    
+    while (c) {
+        conn_t *next = c->next;
+        int resent = 0;
+        int i;
+    
+        if ((c->state != CONN_ONLINE || c->keepalive) && now >= c->deadline) {
+            conn_close(w, c);
+            c = next;
+            continue;
+        }
+    
+        for (i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+            inflight_t *f = &c->inflight[i];
+    
+            if (f->packet_id && now - f->sent >= MQTT_RETRY_SEC &&
+                wbuf_publish(c, f->msg, 1, f->packet_id, 1) == 0) {
+                f->sent = now;
+                resent = 1;
+            }
+        }
+        if (resent) {
+            if (flush_wbuf(c) != 0) {
+                conn_close(w, c);
+            } else {
+                conn_update_events(w, c);
+            }
+        }
+        c = next;
+    }
+}
+
+/*
+ * io_uring backend: a multishot accept, a pending read of the eventfd,
+ * and each connection steps on its own recv and send completions
+ */
+static void *worker_main_uring(worker_t *w)
+{
+    time_t last_sweep = time(NULL);
+    tls_uring_t uring;
+    
+    if (tls_uring_init(&uring, URING_ENTRIES, URING_BUFS, URING_BUF_SIZE) != 0) {
+        perror("Unable to set up io_uring");
+        return NULL;
+    }
+    w->uring = &uring;
+    /* the ring waits for it; other workers' writes never block on it */
+    fcntl(w->event_fd, F_SETFL, fcntl(w->event_fd, F_GETFL) & ~O_NONBLOCK);
+    if (tls_uring_accept_multishot(&uring, w->listen_fd, w) != 0 ||
+        tls_uring_read(&uring, w->event_fd, &w->event_count, sizeof(w->event_count), w) != 0) {
+        return NULL;
+    }
+    
+    while (1) {
+        struct io_uring_cqe *cqe;
+    
+        if (tls_uring_wait(&uring, 1000) != 0) {
+            perror("io_uring_enter");
+            break;
+        }
+    
+        while ((cqe = tls_uring_cqe_peek(&uring))) {
+            unsigned tag = TLS_URING_TAG(cqe->user_data);
+    
+            if (tag == TLS_URING_ACCEPT) {
+                conn_t *c;
+    
+                if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                    tls_uring_accept_multishot(&uring, w->listen_fd, w);
+                }
+                if (cqe->res >= 0 && (c = conn_new(w, cqe->res))) {
+                    URING_STAT_ADD(accepts, 1);
+                    if (conn_io(c) != 0) {
+                        conn_close(w, c);
+                    }
+                }
+            } else if (tag == TLS_URING_READ) {
+                /* deliveries from other workers; run_pending() below */
+                tls_uring_read(&uring, w->event_fd, &w->event_count, sizeof(w->event_count), w);
+            } else {
+                conn_t *c = ((tls_uring_stream_t *)TLS_URING_PTR(cqe->user_data))->owner;
+                int ret = tls_uring_stream_event(&c->stream, tag, cqe);
+    
+                if (ret < 0 || (ret > 0 && conn_io(c) != 0)) {
+                    conn_close(w, c);
+                }
+            }
+            tls_uring_cqe_seen(&uring);
+        }
+    
+        run_pending(w);
+    
+        if (time(NULL) != last_sweep) {
+            last_sweep = time(NULL);
+            sweep(w);
+        }
+    }
+    
+    return NULL;
+}
+
+static void *worker_main(void *arg)
+{
+    worker_t *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event ev;
+    time_t last_sweep = time(NULL);
+    
+    if (tls_uring_requested()) {
+        return worker_main_uring(w);
+    }
+    
+    ev.events = EPOLLIN;
+    ev.data.ptr = &w->listen_fd;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->listen_fd, &ev);
+    ev.data.ptr = &w->event_fd;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->event_fd, &ev);
+    
+    while (1) {
+        int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, 1000);
+        int i;
+    
+        for (i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+    
+            if (ptr == &w->listen_fd) {
+                accept_all(w);
+            } else if (ptr == &w->event_fd) {
+                uint64_t count;
+                if (read(w->event_fd, &count, sizeof(count)) < 0) {
+                    /* nothing to clear */
+                }
+            } else {
+                conn_t *c = ptr;
+    
+                if ((events[i].events & (EPOLLERR | EPOLLHUP)) || conn_io(c) != 0) {
+                    conn_close(w, c);
+                } else {
+                    conn_update_events(w, c);
+                }
+            }
+        }
+    
+        /* Deliveries queued by this or other workers */
+        run_pending(w);
+    
+        if (time(NULL) != last_sweep) {
+            last_sweep = time(NULL);
+            sweep(w);
+        }
+    }
+    
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    SSL_CTX *ctx;
+    worker_t *workers;
+    pthread_t thread;
+    long nworkers;
+    long i;
     
     SSL_library_init();
     OpenSSL_add_all_algorithms();
     SSL_load_error_strings();
     
     ctx = SSL_CTX_new(TLS_server_method());
-    SSL_CTX_use_certificate_file(ctx, CERT_FILE, SSL_FILETYPE_PEM);
-    SSL_CTX_use_PrivateKey_file(ctx, KEY_FILE, SSL_FILETYPE_PEM);
+    if (!ctx ||
+        SSL_CTX_use_certificate_file(ctx, CERT_FILE, SSL_FILETYPE_PEM) <= 0 ||
+        SSL_CTX_use_PrivateKey_file(ctx, KEY_FILE, SSL_FILETYPE_PEM) <= 0) {
+        ERR_print_errors_fp(stderr);
+        return 1;
+    }
+    if (tls_resumption_enable(ctx, "mqtt_tls_broker") != 0) {
+        fprintf(stderr, "Unable to enable session resumption\n");
+        return 1;
+    }
+    if (tls_ktls_requested() && tls_uring_requested()) {
+        fprintf(stderr, "TLS_KTLS and TLS_URING are exclusive\n");
+        return 1;
+    }
+    if (tls_ktls_requested() && tls_ktls_enable(ctx) != 0) {
+        fprintf(stderr, "kTLS not available in this OpenSSL\n");
+        return 1;
+    }
     
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(MQTT_TLS_PORT);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    nworkers = argc > 1 ? strtol(argv[1], NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers < 1) {
+        nworkers = 1;
+    }
+    
+    workers = calloc((size_t)nworkers, sizeof(*workers));
+    if (!workers) {
+        perror("Unable to allocate workers");
+        return 1;
+    }
     
-    bind(sock, (struct sockaddr *)&addr, sizeof(addr));
-    listen(sock, 5);
+    for (i = 0; i < nworkers; i++) {
+        workers[i].ctx = ctx;
+        workers[i].listen_fd = create_listener();
+        workers[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        workers[i].event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        pthread_mutex_init(&workers[i].pending_lock, NULL);
+        if (workers[i].listen_fd < 0 || workers[i].epoll_fd < 0 || workers[i].event_fd < 0) {
+            return 1;
+        }
+    }
     
-    printf("MQTT-TLS broker listening on port %d\n", MQTT_TLS_PORT);
+    printf("MQTT-TLS broker listening on port %d (%ld workers)\n", MQTT_TLS_PORT, nworkers);
+    
+    for (i = 0; i < nworkers; i++) {
+        if (pthread_create(&thread, NULL, worker_main, &workers[i]) != 0) {
+            perror("Unable to start worker");
+            return 1;
+        }
+    }
     
     while (1) {
-        client = accept(sock, NULL, NULL);
-        SSL *ssl = SSL_new(ctx);
-        SSL_set_fd(ssl, client);
-        
-        if (SSL_accept(ssl) > 0) {
-            handle_mqtt_connect(ssl);
-        }
-        
-        SSL_free(ssl);
-        close(client);
+        sleep(STATS_INTERVAL_SEC);
+        printf("MQTT: %llu published, %llu delivered, %llu dropped\n",
+               (unsigned long long)__atomic_load_n(&stat_published, __ATOMIC_RELAXED),
+               (unsigned long long)__atomic_load_n(&stat_delivered, __ATOMIC_RELAXED),
+               (unsigned long long)__atomic_load_n(&stat_dropped, __ATOMIC_RELAXED));
+        tls_resumption_print_stats(stdout);
+        tls_ktls_print_stats(stdout);
+        if (tls_uring_requested()) {
+            tls_uring_print_stats(stdout);
+        }
+        fflush(stdout);
     }
     
-    close(sock);
     SSL_CTX_free(ctx);
     return 0;
 }
-
@@ -3,59 +3,243 @@
 #include <string.h>
 #include <stdint.h>
 #include <time.h>
+#include <pthread.h>
 #include <sys/time.h>
 
+// v1.2 - Consecutive refusals reported for the XDP blocklist
+// v1.1 - Sharded hash table, GCRA instead of fixed windows, LRU eviction
 // v1.0 - Initial implementation
 // Simple rate limiting per client
 
-#define MAX_CLIENTS 1000  // TODO: Use hash table for scalability
 #define RATE_LIMIT 100  /* requests per minute - configurable */
 #define WINDOW_SIZE 60  /* seconds - sliding window */
 
+#define RATE_SHARDS 64              /* power of two, one lock each */
+#define RATE_SHARD_SLOTS 2048       /* power of two */
+#define RATE_SHARD_CLIENTS (RATE_SHARD_SLOTS * 3 / 4)  /* keeps probes short */
+#define RATE_MAX_CLIENT_ID 64
+#define RATE_NONE 0xffffu
+
+/*
+ * GCRA (a token bucket kept as one timestamp): each client has a
+ * theoretical arrival time, tat, that advances by the emission interval
+ * per allowed request. A request is allowed while tat is less than the
+ * burst tolerance ahead of now, so RATE_LIMIT requests may come at once
+ * and then one per WINDOW_SIZE / RATE_LIMIT - no window edge to game.
+ */
+#define RATE_INTERVAL_US ((uint64_t)WINDOW_SIZE * 1000000 / RATE_LIMIT)
+#define RATE_BURST_US (RATE_INTERVAL_US * (RATE_LIMIT - 1))
+
 typedef struct {
-    char client_id[64];
-    uint32_t request_count;
-    time_t window_start;
+    uint64_t hash;              /* 0 marks a free slot */
+    uint64_t tat_us;
+    uint32_t denied;            /* refusals since the last allowed request */
+    uint16_t lru_prev;
+    uint16_t lru_next;
+    char client_id[RATE_MAX_CLIENT_ID];
 } rate_limit_entry_t;
 
-static rate_limit_entry_t rate_limits[MAX_CLIENTS];
-static int client_count = 0;
+/*
+ * The client hash picks the shard (low bits) and the first probe slot
+ * (high bits); each shard is a linear probing table with its own lock
+ * and LRU list, so callers on different shards never contend. A full
+ * shard evicts its least recently seen client, which by then has
+ * usually refilled its bucket anyway.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t count;
+    uint16_t lru_head;          /* most recently seen */
+    uint16_t lru_tail;
+    rate_limit_entry_t slots[RATE_SHARD_SLOTS];
+} rate_limit_shard_t;
 
-int check_rate_limit(const char *client_id)
+static rate_limit_shard_t rate_shards[RATE_SHARDS];
+static pthread_once_t rate_once = PTHREAD_ONCE_INIT;
+
+static void rate_limit_init(void)
 {
-    time_t now = time(NULL);
     int i;
     
-    /* Find existing entry */
-    for (i = 0; i < client_count; i++) {
-        if (strcmp(rate_limits[i].client_id, client_id) == 0) {
-            /* Check if window expired - sliding window */
-            if (now - rate_limits[i].window_start > WINDOW_SIZE) {
-                /* Reset window - TODO: Could use token bucket instead */
-                rate_limits[i].request_count = 0;
-                rate_limits[i].window_start = now;
-            }
-            
-            /* Check rate limit */
-            if (rate_limits[i].request_count >= RATE_LIMIT) {
-                return -1; /* Rate limit exceeded */
-            }
-            
-            rate_limits[i].request_count++;
-            return 0; /* Allowed */
+    for (i = 0; i < RATE_SHARDS; i++) {
+        pthread_mutex_init(&rate_shards[i].lock, NULL);
+        rate_shards[i].lru_head = RATE_NONE;
+        rate_shards[i].lru_tail = RATE_NONE;
+    }
+}
+
+static uint64_t monotonic_us(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* FNV-1a, finalized so shard and slot bits are both well mixed; never 0 */
+uint64_t rate_limit_hash(const char *client_id)
+{
+    uint64_t h = 14695981039346656037ull;
+    
+    while (*client_id) {
+        h = (h ^ (uint8_t)*client_id++) * 1099511628211ull;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return h ? h : 1;
+}
+
+static void lru_unlink(rate_limit_shard_t *shard, uint16_t i)
+{
+    rate_limit_entry_t *e = &shard->slots[i];
+    
+    if (e->lru_prev != RATE_NONE) {
+        shard->slots[e->lru_prev].lru_next = e->lru_next;
+    } else {
+        shard->lru_head = e->lru_next;
+    }
+    if (e->lru_next != RATE_NONE) {
+        shard->slots[e->lru_next].lru_prev = e->lru_prev;
+    } else {
+        shard->lru_tail = e->lru_prev;
+    }
+}
+
+static void lru_push_front(rate_limit_shard_t *shard, uint16_t i)
+{
+    shard->slots[i].lru_prev = RATE_NONE;
+    shard->slots[i].lru_next = shard->lru_head;
+    if (shard->lru_head != RATE_NONE) {
+        shard->slots[shard->lru_head].lru_prev = i;
+    } else {
+        shard->lru_tail = i;
+    }
+    shard->lru_head = i;
+}
+
+static void slot_move(rate_limit_shard_t *shard, uint16_t from, uint16_t to)
+{
+    rate_limit_entry_t *e = &shard->slots[to];
+    
+    *e = shard->slots[from];
+    if (e->lru_prev != RATE_NONE) {
+        shard->slots[e->lru_prev].lru_next = to;
+    } else {
+        shard->lru_head = to;
+    }
+    if (e->lru_next != RATE_NONE) {
+        shard->slots[e->lru_next].lru_prev = to;
+    } else {
+        shard->lru_tail = to;
+    }
+    shard->slots[from].hash = 0;
+}
+
+/* Backward-shift deletion keeps every probe chain unbroken */
+static void slot_remove(rate_limit_shard_t *shard, uint16_t i)
+{
+    uint16_t hole = i;
+    uint16_t j = i;
+    
+    lru_unlink(shard, i);
+    shard->slots[i].hash = 0;
+    shard->count--;
+    
+    for (;;) {
+        uint16_t home;
+    
+        j = (j + 1) & (RATE_SHARD_SLOTS - 1);
+        if (shard->slots[j].hash == 0) {
+            return;
         }
+        home = (uint16_t)(shard->slots[j].hash >> 48) & (RATE_SHARD_SLOTS - 1);
+        /* j may fill the hole unless its home lies in (hole, j] */
+        if (((j - home) & (RATE_SHARD_SLOTS - 1)) >= ((j - hole) & (RATE_SHARD_SLOTS - 1))) {
+            slot_move(shard, j, hole);
+            hole = j;
+        }
+    }
+}
+
+/* Caller holds the shard lock */
+static uint16_t slot_find_or_add(rate_limit_shard_t *shard, const char *client_id,
+                                 uint64_t hash, uint64_t now)
+{
+    uint16_t i = (uint16_t)(hash >> 48) & (RATE_SHARD_SLOTS - 1);
+    rate_limit_entry_t *e;
+    
+    while (shard->slots[i].hash != 0) {
+        if (shard->slots[i].hash == hash &&
+            strncmp(shard->slots[i].client_id, client_id, RATE_MAX_CLIENT_ID - 1) == 0) {
+            return i;
+        }
+        i = (i + 1) & (RATE_SHARD_SLOTS - 1);
+    }
+    
+    if (shard->count == RATE_SHARD_CLIENTS) {
+        slot_remove(shard, shard->lru_tail);
+        /* the removal may have shifted entries into the chain */
+        return slot_find_or_add(shard, client_id, hash, now);
     }
     
-    /* Add new client */
-    if (client_count < MAX_CLIENTS) {
-        strncpy(rate_limits[client_count].client_id, client_id,
-                sizeof(rate_limits[client_count].client_id) - 1);
-        rate_limits[client_count].request_count = 1;
-        rate_limits[client_count].window_start = now;
-        client_count++;
-        return 0;
+    e = &shard->slots[i];
+    e->hash = hash;
+    e->tat_us = now;
+    e->denied = 0;
+    strncpy(e->client_id, client_id, sizeof(e->client_id) - 1);
+    e->client_id[sizeof(e->client_id) - 1] = '\0';
+    lru_push_front(shard, i);
+    shard->count++;
+    return i;
+}
+
+/*
+ * For callers that keep the client's hash (rate_limit_hash) next to
+ * its id, so the request path does not rehash. 0 allowed, -1 limited;
+ * denied, if given, gets the client's refusals in a row, which is
+ * what tells a flood from a client brushing against its limit.
+ */
+int check_rate_limit_info(const char *client_id, uint64_t hash, uint32_t *denied)
+{
+    rate_limit_shard_t *shard = &rate_shards[hash & (RATE_SHARDS - 1)];
+    uint64_t now = monotonic_us();
+    uint64_t tat;
+    uint16_t i;
+    int ret = 0;
+    
+    pthread_once(&rate_once, rate_limit_init);
+    
+    pthread_mutex_lock(&shard->lock);
+    i = slot_find_or_add(shard, client_id, hash, now);
+    
+    tat = shard->slots[i].tat_us > now ? shard->slots[i].tat_us : now;
+    if (tat - now > RATE_BURST_US) {
+        ret = -1;           /* Rate limit exceeded */
+        shard->slots[i].denied++;
+    } else {
+        shard->slots[i].tat_us = tat + RATE_INTERVAL_US;
+        shard->slots[i].denied = 0;
+    }
+    if (denied) {
+        *denied = shard->slots[i].denied;
     }
     
-    return -1; /* Too many clients */
+    if (shard->lru_head != i) {
+        lru_unlink(shard, i);
+        lru_push_front(shard, i);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    
+    return ret;
+}
+
+int check_rate_limit_hashed(const char *client_id, uint64_t hash)
+{
+    return check_rate_limit_info(client_id, hash, NULL);
 }
 
+int check_rate_limit(const char *client_id)
+{
+    return check_rate_limit_info(client_id, rate_limit_hash(client_id), NULL);
+}
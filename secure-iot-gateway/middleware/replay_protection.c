@@ -3,48 +3,203 @@
 #include <string.h>
 #include <stdint.h>
 #include <time.h>
+#include <pthread.h>
 #include <openssl/sha.h>
+#include <openssl/rand.h>
 
+// v1.1 - Time-bucketed hash sets with Bloom prefilters, O(1) check and expiry
 // v1.0 - Initial implementation
 // Replay protection using nonce cache
 
-#define MAX_NONCES 1000  // TODO: Make configurable
 #define NONCE_TIMEOUT 300  /* 5 minutes - might need tuning */
-    uint8_t nonce[32];
-    time_t timestamp;
+#define NONCE_MAX_SIZE 32
+#define NONCE_BUCKET_SEC 30
+/* enough buckets that a nonce is kept at least NONCE_TIMEOUT */
+#define NONCE_BUCKETS ((NONCE_TIMEOUT + NONCE_BUCKET_SEC - 1) / NONCE_BUCKET_SEC + 1)
+#define NONCE_INITIAL_SLOTS 4096    /* power of two, grows with load */
+#define NONCE_BLOOM_BITS (1u << 20) /* per bucket, ~1% false positives at 100k */
+
+/*
+ * Nonces seen in the same NONCE_BUCKET_SEC share a bucket: a hash set of
+ * fingerprints (salted SHA-256, so chosen nonces cannot aim at one
+ * probe chain) in front of which sits a Bloom filter. A check asks
+ * every live bucket's filter and probes only the tables that might
+ * hold it; expiry resets the oldest bucket in one step. Tables grow
+ * instead of filling up, and a nonce that cannot be recorded is refused
+ * rather than let through unrecorded.
+ */
+typedef struct {
+    uint64_t fp[2];             /* 128-bit fingerprint, 0 marks a free slot */
 } nonce_entry_t;
 
-static nonce_entry_t nonce_cache[MAX_NONCES];
-static int nonce_count = 0;
+typedef struct {
+    int64_t epoch;              /* now / NONCE_BUCKET_SEC it covers */
+    nonce_entry_t *slots;
+    size_t capacity;
+    size_t count;
+    uint64_t bloom[NONCE_BLOOM_BITS / 64];
+} nonce_bucket_t;
+
+static pthread_mutex_t nonce_lock = PTHREAD_MUTEX_INITIALIZER;
+static nonce_bucket_t nonce_buckets[NONCE_BUCKETS];
+static uint8_t nonce_salt[16];
+static int nonce_ready;
+
+static void nonce_fingerprint(const uint8_t *nonce, size_t nonce_len, uint64_t *fp)
+{
+    uint8_t input[sizeof(nonce_salt) + 1 + NONCE_MAX_SIZE];
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    
+    memcpy(input, nonce_salt, sizeof(nonce_salt));
+    input[sizeof(nonce_salt)] = (uint8_t)nonce_len;
+    memcpy(input + sizeof(nonce_salt) + 1, nonce, nonce_len);
+    SHA256(input, sizeof(nonce_salt) + 1 + nonce_len, digest);
+    
+    memcpy(&fp[0], digest, 8);
+    memcpy(&fp[1], digest + 8, 8);
+    fp[0] |= 1;                 /* never all zero */
+}
+
+/* Three filter bits from the fingerprint's second half */
+static int bloom_test_and_set(nonce_bucket_t *b, const uint64_t *fp, int set)
+{
+    uint32_t bit[3];
+    int present = 1;
+    int k;
+    
+    bit[0] = (uint32_t)fp[1] & (NONCE_BLOOM_BITS - 1);
+    bit[1] = (uint32_t)(fp[1] >> 21) & (NONCE_BLOOM_BITS - 1);
+    bit[2] = (uint32_t)(fp[1] >> 42) & (NONCE_BLOOM_BITS - 1);
+    for (k = 0; k < 3; k++) {
+        uint64_t mask = 1ull << (bit[k] & 63);
+    
+        if (!(b->bloom[bit[k] / 64] & mask)) {
+            present = 0;
+            if (set) {
+                b->bloom[bit[k] / 64] |= mask;
+            }
+        }
+    }
+    return present;
+}
+
+static int bucket_contains(const nonce_bucket_t *b, const uint64_t *fp)
+{
+    size_t i;
+    
+    if (!b->slots) {
+        return 0;
+    }
+    for (i = fp[0] & (b->capacity - 1); b->slots[i].fp[0]; i = (i + 1) & (b->capacity - 1)) {
+        if (b->slots[i].fp[0] == fp[0] && b->slots[i].fp[1] == fp[1]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void slots_insert(nonce_entry_t *slots, size_t capacity, const uint64_t *fp)
+{
+    size_t i = fp[0] & (capacity - 1);
+    
+    while (slots[i].fp[0]) {
+        i = (i + 1) & (capacity - 1);
+    }
+    slots[i].fp[0] = fp[0];
+    slots[i].fp[1] = fp[1];
+}
+
+/* Keep the load under a half, so probes stay short */
+static int bucket_insert(nonce_bucket_t *b, const uint64_t *fp)
+{
+    if (2 * (b->count + 1) > b->capacity) {
+        size_t capacity = b->capacity ? 2 * b->capacity : NONCE_INITIAL_SLOTS;
+        nonce_entry_t *slots = calloc(capacity, sizeof(*slots));
+        size_t i;
+    
+        if (!slots) {
+            return -1;
+        }
+        for (i = 0; i < b->capacity; i++) {
+            if (b->slots[i].fp[0]) {
+                slots_insert(slots, capacity, b->slots[i].fp);
+            }
+        }
+        free(b->slots);
+        b->slots = slots;
+        b->capacity = capacity;
+    }
+    
+    slots_insert(b->slots, b->capacity, fp);
+    b->count++;
+    bloom_test_and_set(b, fp, 1);
+    return 0;
+}
+
+/* Bucket for epoch, recycling whichever held the expired one */
+static nonce_bucket_t *bucket_for(int64_t epoch)
+{
+    nonce_bucket_t *b = &nonce_buckets[epoch % NONCE_BUCKETS];
+    
+    if (b->epoch != epoch) {
+        /* keep the table's size, the next period is likely the same */
+        if (b->slots) {
+            memset(b->slots, 0, b->capacity * sizeof(*b->slots));
+        }
+        memset(b->bloom, 0, sizeof(b->bloom));
+        b->count = 0;
+        b->epoch = epoch;
+    }
+    return b;
+}
 
 int check_replay(uint8_t *nonce, size_t nonce_len)
 {
-    time_t now = time(NULL);
+    struct timespec now;
+    int64_t epoch;
+    uint64_t fp[2];
+    int ret = 0;
     int i;
     
-    /* Check if nonce exists in cache */
-    for (i = 0; i < nonce_count; i++) {
-        if (memcmp(nonce_cache[i].nonce, nonce, nonce_len) == 0) {
-            /* Replay detected */
+    if (nonce_len == 0 || nonce_len > NONCE_MAX_SIZE) {
+        return -1;
+    }
+    
+    /* monotonic, so a clock step cannot recycle a live bucket */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    epoch = (int64_t)now.tv_sec / NONCE_BUCKET_SEC;
+    
+    pthread_mutex_lock(&nonce_lock);
+    if (!nonce_ready) {
+        if (RAND_bytes(nonce_salt, sizeof(nonce_salt)) != 1) {
+            pthread_mutex_unlock(&nonce_lock);
             return -1;
         }
-        
-        /* Remove expired entries - linear search, could be optimized */
-        if (now - nonce_cache[i].timestamp > NONCE_TIMEOUT) {
-            memmove(&nonce_cache[i], &nonce_cache[i + 1],
-                   (nonce_count - i - 1) * sizeof(nonce_entry_t));
-            nonce_count--;
-            i--;  // Check same index again after removal
+        for (i = 0; i < NONCE_BUCKETS; i++) {
+            nonce_buckets[i].epoch = -1;
         }
+        nonce_ready = 1;
     }
+    nonce_fingerprint(nonce, nonce_len, fp);
+    
+    /* Check if nonce exists in any live bucket */
+    for (i = 0; i < NONCE_BUCKETS; i++) {
+        nonce_bucket_t *b = &nonce_buckets[i];
     
-    /* Add new nonce */
-    if (nonce_count < MAX_NONCES) {
-        memcpy(nonce_cache[nonce_count].nonce, nonce, nonce_len);
-        nonce_cache[nonce_count].timestamp = now;
-        nonce_count++;
+        if (b->epoch <= epoch - NONCE_BUCKETS) {
+            continue;           /* expired, or never used */
+        }
+        if (bloom_test_and_set(b, fp, 0) && bucket_contains(b, fp)) {
+            ret = -1;           /* Replay detected */
+            break;
+        }
     }
     
-    return 0;
+    /* Add new nonce; unrecorded would mean replayable */
+    if (ret == 0 && bucket_insert(bucket_for(epoch), fp) != 0) {
+        ret = -1;
+    }
+    pthread_mutex_unlock(&nonce_lock);
+    
+    return ret;
 }
-
@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include "rate_limiting.c"
+#include "../firewall/xdp/xdp_prefilter.h"
+
+// v1.0 - Push flooding sources from the rate limiter to the XDP pre-filter
+// A client refused XDP_BLOCK_STRIKES times in a row is not brushing its
+// limit, it is flooding; its source address goes into the pinned XDP
+// blocklist for XDP_BLOCK_SEC, and its packets are dropped in the driver
+// from then on instead of being accepted, decrypted and refused here.
+// Without the pre-filter loaded this is plain check_rate_limit.
+
+#define XDP_BLOCK_STRIKES 20
+#define XDP_BLOCK_SEC 60
+
+static int xdp_blocklist_fd = -1;
+static pthread_once_t xdp_blocklist_once = PTHREAD_ONCE_INIT;
+static uint64_t xdp_blocks_pushed;
+
+/* Raw bpf(2): the map only needs OBJ_GET and UPDATE, not all of libbpf */
+static long sys_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static void xdp_blocklist_open(void)
+{
+    union bpf_attr attr;
+    
+    memset(&attr, 0, sizeof(attr));
+    attr.pathname = (uint64_t)(uintptr_t)XDP_BLOCKLIST_PIN;
+    xdp_blocklist_fd = (int)sys_bpf(BPF_OBJ_GET, &attr);
+}
+
+/* Drop saddr (network order) in the driver for seconds */
+int xdp_block_source(uint32_t saddr, unsigned int seconds)
+{
+    union bpf_attr attr;
+    struct timespec ts;
+    uint64_t until;
+    
+    pthread_once(&xdp_blocklist_once, xdp_blocklist_open);
+    if (xdp_blocklist_fd < 0) {
+        return -1;
+    }
+    
+    /* bpf_ktime_get_ns() is CLOCK_MONOTONIC */
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    until = ((uint64_t)ts.tv_sec + seconds) * 1000000000ull + (uint64_t)ts.tv_nsec;
+    
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = (uint32_t)xdp_blocklist_fd;
+    attr.key = (uint64_t)(uintptr_t)&saddr;
+    attr.value = (uint64_t)(uintptr_t)&until;
+    attr.flags = BPF_ANY;
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) != 0) {
+        return -1;
+    }
+    
+    __atomic_add_fetch(&xdp_blocks_pushed, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* check_rate_limit for a client whose source address is known */
+int check_rate_limit_source(const char *client_id, uint32_t saddr)
+{
+    uint32_t denied;
+    int ret;
+    
+    ret = check_rate_limit_info(client_id, rate_limit_hash(client_id), &denied);
+    /* once per XDP_BLOCK_STRIKES refusals, not one syscall per packet */
+    if (ret != 0 && denied % XDP_BLOCK_STRIKES == 0) {
+        xdp_block_source(saddr, XDP_BLOCK_SEC);
+    }
+    
+    return ret;
+}
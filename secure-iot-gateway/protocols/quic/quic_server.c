@@ -0,0 +1,1112 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/x509.h>
+#include <ngtcp2/ngtcp2.h>
+#include <ngtcp2/ngtcp2_crypto.h>
+#include <ngtcp2/ngtcp2_crypto_quictls.h>
+#include "../../middleware/xdp_blocklist.c"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+#define QUIC_PORT 443
+#define QUIC_ALPN "iot-gw"
+#define CERT_FILE "server.crt"
+#define KEY_FILE "server.key"
+#define CA_FILE "ca.crt"
+
+#define SCID_LEN 16
+#define CID_BUCKETS 16384           /* power of two */
+#define MAX_CONNS 8192
+#define MAX_STREAMS_BIDI 64
+#define STREAM_MAX_REQUEST 16384
+#define IDLE_TIMEOUT_SEC 60         /* long enough to ride out a cell handover */
+#define RETRY_TOKEN_TIMEOUT_SEC 10
+#define RX_BUF_SIZE 65536           /* one GRO super-datagram */
+#define GSO_MAX_SEGMENTS 64
+#define TX_BUF_SIZE 65536
+#define STATS_INTERVAL_SEC 60
+#define SECRET_SIZE 32
+
+#define APP_ERR_RATE_LIMITED 0x101
+#define APP_ERR_REQUEST_TOO_LARGE 0x102
+
+/*
+ * Device transport over QUIC, on ngtcp2 with OpenSSL (quictls) for the
+ * handshake. Devices authenticate with a client certificate against the
+ * gateway CA; the certificate CN is the client id the rate limiter and
+ * the XDP blocklist see (middleware/xdp_blocklist.c). Each bidirectional
+ * stream carries one request and gets one "OK <bytes>" reply, so a lost
+ * packet stalls only its own stream.
+ *
+ * Connections are found by the Destination Connection ID, never by
+ * address: when a device moves to another cell and its address changes,
+ * its next packet still lands on its connection, ngtcp2 validates the
+ * new path and replies go there - no new handshake. For the same reason
+ * there is a single socket and a single thread: SO_REUSEPORT steers by
+ * 4-tuple and would hand a migrated connection to the wrong worker.
+ *
+ * Receives use UDP_GRO, so one recvmsg returns a train of datagrams from
+ * one sender; sends use UDP_SEGMENT, so each flush is one sendmsg of up
+ * to GSO_MAX_SEGMENTS packets cut by the kernel or NIC. New sources get
+ * a Retry first (an address-bound token), as DTLSv1_listen does for
+ * CoAP-DTLS, before any connection state is kept.
+ */
+typedef struct quic_stream {
+    int64_t id;
+    size_t received;
+    char reply[64];
+    size_t reply_len;
+    size_t sent;
+    int pending;                /* on the connection's send queue */
+    struct quic_stream *next_pending;
+} quic_stream_t;
+
+typedef struct quic_conn {
+    ngtcp2_conn *conn;
+    ngtcp2_crypto_conn_ref conn_ref;
+    SSL *ssl;
+    ngtcp2_cid initial_dcid;    /* client's Initial DCID, our Retry SCID */
+    struct sockaddr_in local;
+    struct sockaddr_in remote;  /* current path, follows migration */
+    char client_id[64];
+    int closing;                /* closing or draining period */
+    uint8_t close_pkt[1500];    /* CONNECTION_CLOSE, resent while closing */
+    size_t close_pkt_len;
+    ngtcp2_tstamp close_deadline;
+    quic_stream_t *pending;
+    quic_stream_t *pending_tail;
+    ngtcp2_tstamp expiry;
+    size_t heap_index;
+} quic_conn_t;
+
+typedef struct cid_entry {
+    uint8_t data[NGTCP2_MAX_CIDLEN];
+    size_t len;
+    quic_conn_t *qc;
+    struct cid_entry *next;
+} cid_entry_t;
+
+/* A GSO batch: packets for one path, all of seg_size but the last */
+typedef struct {
+    struct sockaddr_in local;
+    struct sockaddr_in remote;
+    size_t seg_size;
+    size_t count;
+    size_t len;
+} tx_batch_t;
+
+static int quic_sock;
+static int gso_enabled = 1;
+static SSL_CTX *ssl_ctx;
+static ngtcp2_callbacks callbacks;
+static cid_entry_t *cid_buckets[CID_BUCKETS];
+static quic_conn_t *conn_heap[MAX_CONNS];   /* min-heap on expiry */
+static size_t conn_count;
+static uint8_t static_secret[SECRET_SIZE];  /* retry tokens, stateless resets */
+static uint8_t tx_buf[TX_BUF_SIZE];
+
+static uint64_t stat_handshakes;
+static uint64_t stat_retries;
+static uint64_t stat_migrations;
+static uint64_t stat_requests;
+static uint64_t stat_rate_limited;
+static uint64_t stat_gro_datagrams;
+static uint64_t stat_gso_sends;
+static uint64_t stat_gso_segments;
+
+static ngtcp2_tstamp timestamp(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ngtcp2_tstamp)ts.tv_sec * NGTCP2_SECONDS + (ngtcp2_tstamp)ts.tv_nsec;
+}
+
+/* Connection IDs are random, the low bytes hash well enough */
+static uint32_t cid_hash(const uint8_t *data, size_t len)
+{
+    uint32_t h = 2166136261u;
+    size_t i;
+    
+    for (i = 0; i < len; i++) {
+        h = (h ^ data[i]) * 16777619u;
+    }
+    return h & (CID_BUCKETS - 1);
+}
+
+static quic_conn_t *cid_find(const uint8_t *data, size_t len)
+{
+    cid_entry_t *e = cid_buckets[cid_hash(data, len)];
+    
+    while (e && (e->len != len || memcmp(e->data, data, len) != 0)) {
+        e = e->next;
+    }
+    return e ? e->qc : NULL;
+}
+
+static int cid_add(const ngtcp2_cid *cid, quic_conn_t *qc)
+{
+    uint32_t h = cid_hash(cid->data, cid->datalen);
+    cid_entry_t *e = malloc(sizeof(*e));
+    
+    if (!e) {
+        return -1;
+    }
+    memcpy(e->data, cid->data, cid->datalen);
+    e->len = cid->datalen;
+    e->qc = qc;
+    e->next = cid_buckets[h];
+    cid_buckets[h] = e;
+    return 0;
+}
+
+static void cid_remove(const uint8_t *data, size_t len)
+{
+    cid_entry_t **link = &cid_buckets[cid_hash(data, len)];
+    
+    while (*link) {
+        cid_entry_t *e = *link;
+    
+        if (e->len == len && memcmp(e->data, data, len) == 0) {
+            *link = e->next;
+            free(e);
+            return;
+        }
+        link = &e->next;
+    }
+}
+
+static void heap_swap(size_t a, size_t b)
+{
+    quic_conn_t *t = conn_heap[a];
+    
+    conn_heap[a] = conn_heap[b];
+    conn_heap[b] = t;
+    conn_heap[a]->heap_index = a;
+    conn_heap[b]->heap_index = b;
+}
+
+static void heap_fix(size_t i)
+{
+    while (i > 0 && conn_heap[(i - 1) / 2]->expiry > conn_heap[i]->expiry) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        size_t l = 2 * i + 1, r = l + 1, min = i;
+    
+        if (l < conn_count && conn_heap[l]->expiry < conn_heap[min]->expiry) {
+            min = l;
+        }
+        if (r < conn_count && conn_heap[r]->expiry < conn_heap[min]->expiry) {
+            min = r;
+        }
+        if (min == i) {
+            break;
+        }
+        heap_swap(i, min);
+        i = min;
+    }
+}
+
+static void conn_set_expiry(quic_conn_t *qc)
+{
+    qc->expiry = qc->closing ? qc->close_deadline : ngtcp2_conn_get_expiry(qc->conn);
+    heap_fix(qc->heap_index);
+}
+
+static void conn_free(quic_conn_t *qc)
+{
+    ngtcp2_cid scids[16];
+    size_t i, n;
+    size_t index = qc->heap_index;
+    
+    n = ngtcp2_conn_get_scid(qc->conn, NULL);
+    if (n <= sizeof(scids) / sizeof(scids[0])) {
+        ngtcp2_conn_get_scid(qc->conn, scids);
+        for (i = 0; i < n; i++) {
+            cid_remove(scids[i].data, scids[i].datalen);
+        }
+    }
+    cid_remove(qc->initial_dcid.data, qc->initial_dcid.datalen);
+    
+    conn_count--;
+    if (index != conn_count) {
+        heap_swap(index, conn_count);
+        heap_fix(index);
+    }
+    
+    /* Streams still open are freed by ngtcp2's stream_close callbacks */
+    ngtcp2_conn_del(qc->conn);
+    SSL_free(qc->ssl);
+    free(qc);
+}
+
+/* One sendmsg: IP_PKTINFO pins the source to the address the peer used */
+static int send_packets(const struct sockaddr_in *local, const struct sockaddr_in *remote,
+                        const uint8_t *data, size_t len, size_t seg_size)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(struct in_pktinfo)) + CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { (void *)data, len };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct in_pktinfo *pktinfo;
+    
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_name = (void *)remote;
+    msg.msg_namelen = sizeof(*remote);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(struct in_pktinfo));
+    
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = IPPROTO_IP;
+    cmsg->cmsg_type = IP_PKTINFO;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+    pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
+    pktinfo->ipi_spec_dst = local->sin_addr;
+    
+    if (len > seg_size) {
+        msg.msg_controllen += CMSG_SPACE(sizeof(uint16_t));
+        cmsg = CMSG_NXTHDR(&msg, cmsg);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        *(uint16_t *)CMSG_DATA(cmsg) = (uint16_t)seg_size;
+    }
+    
+    if (sendmsg(quic_sock, &msg, 0) >= 0) {
+        return 0;
+    }
+    if (errno == EIO && len > seg_size) {
+        /* No GSO on this route (e.g. checksum offload off): one by one */
+        size_t off;
+    
+        gso_enabled = 0;
+        for (off = 0; off < len; off += seg_size) {
+            size_t n = len - off < seg_size ? len - off : seg_size;
+    
+            send_packets(local, remote, data + off, n, n);
+        }
+        return 0;
+    }
+    /* EAGAIN and friends: QUIC loss recovery retransmits */
+    return -1;
+}
+
+static void batch_flush(tx_batch_t *b)
+{
+    if (b->count == 0) {
+        return;
+    }
+    send_packets(&b->local, &b->remote, tx_buf, b->len, b->seg_size);
+    if (b->count > 1) {
+        stat_gso_sends++;
+        stat_gso_segments += b->count;
+    }
+    b->count = 0;
+    b->len = 0;
+}
+
+static void stream_queue(quic_conn_t *qc, quic_stream_t *st)
+{
+    if (st->pending) {
+        return;
+    }
+    st->pending = 1;
+    st->next_pending = NULL;
+    if (qc->pending_tail) {
+        qc->pending_tail->next_pending = st;
+    } else {
+        qc->pending = st;
+    }
+    qc->pending_tail = st;
+}
+
+static void stream_dequeue(quic_conn_t *qc)
+{
+    quic_stream_t *st = qc->pending;
+    
+    qc->pending = st->next_pending;
+    if (!qc->pending) {
+        qc->pending_tail = NULL;
+    }
+    st->pending = 0;
+}
+
+static void conn_close(quic_conn_t *qc, const ngtcp2_ccerr *ccerr)
+{
+    ngtcp2_path_storage ps;
+    ngtcp2_pkt_info pi;
+    ngtcp2_ssize n;
+    ngtcp2_tstamp now = timestamp();
+    
+    if (qc->closing) {
+        return;
+    }
+    qc->closing = 1;
+    qc->close_deadline = now + 3 * ngtcp2_conn_get_pto(qc->conn);
+    
+    ngtcp2_path_storage_zero(&ps);
+    n = ngtcp2_conn_write_connection_close(qc->conn, &ps.path, &pi, qc->close_pkt,
+                                           sizeof(qc->close_pkt), ccerr, now);
+    if (n > 0) {
+        qc->close_pkt_len = (size_t)n;
+        send_packets(&qc->local, &qc->remote, qc->close_pkt, qc->close_pkt_len, qc->close_pkt_len);
+    }
+    conn_set_expiry(qc);
+}
+
+/* Draining: the peer closed, send nothing and forget it after 3 PTO */
+static void conn_drain(quic_conn_t *qc)
+{
+    qc->closing = 1;
+    qc->close_pkt_len = 0;
+    qc->close_deadline = timestamp() + 3 * ngtcp2_conn_get_pto(qc->conn);
+    conn_set_expiry(qc);
+}
+
+/*
+ * Write everything ngtcp2 has for this connection, packed into GSO
+ * batches. A batch ends at GSO_MAX_SEGMENTS, at the send quantum, at a
+ * short packet (it has to be the last segment), or when ngtcp2 changes
+ * path mid-way (probing a migrated device's new address).
+ */
+static int conn_write(quic_conn_t *qc)
+{
+    ngtcp2_path_storage ps;
+    ngtcp2_pkt_info pi;
+    ngtcp2_tstamp now = timestamp();
+    size_t max_pkt = ngtcp2_conn_get_max_tx_udp_payload_size(qc->conn);
+    size_t quantum = ngtcp2_conn_get_send_quantum(qc->conn);
+    size_t max_segments;
+    size_t written = 0;
+    tx_batch_t batch = { 0 };
+    
+    if (qc->closing) {
+        return 0;
+    }
+    
+    if (quantum > sizeof(tx_buf)) {
+        quantum = sizeof(tx_buf);
+    }
+    max_segments = gso_enabled ? quantum / max_pkt : 1;
+    if (max_segments > GSO_MAX_SEGMENTS) {
+        max_segments = GSO_MAX_SEGMENTS;
+    }
+    if (max_segments == 0) {
+        max_segments = 1;
+    }
+    
+    ngtcp2_path_storage_zero(&ps);
+    for (;;) {
+        quic_stream_t *st = qc->pending;
+        int64_t stream_id = -1;
+        uint32_t flags = NGTCP2_WRITE_STREAM_FLAG_NONE;
+        ngtcp2_ssize datalen = -1;
+        ngtcp2_vec vec;
+        size_t veccnt = 0;
+        ngtcp2_ssize n;
+        const struct sockaddr_in *remote;
+        const struct sockaddr_in *local;
+    
+        if (st) {
+            stream_id = st->id;
+            vec.base = (uint8_t *)st->reply + st->sent;
+            vec.len = st->reply_len - st->sent;
+            veccnt = 1;
+            flags = NGTCP2_WRITE_STREAM_FLAG_MORE | NGTCP2_WRITE_STREAM_FLAG_FIN;
+        }
+    
+        n = ngtcp2_conn_writev_stream(qc->conn, &ps.path, &pi, tx_buf + batch.len, max_pkt,
+                                      &datalen, flags, stream_id, &vec, veccnt, now);
+        if (st && datalen >= 0) {
+            st->sent += (size_t)datalen;
+            if (st->sent == st->reply_len) {
+                stream_dequeue(qc);
+            }
+        }
+        if (n < 0) {
+            ngtcp2_ccerr ccerr;
+    
+            if (n == NGTCP2_ERR_WRITE_MORE) {
+                continue;       /* room left in the packet for the next stream */
+            }
+            if (n == NGTCP2_ERR_STREAM_DATA_BLOCKED || n == NGTCP2_ERR_STREAM_SHUT_WR) {
+                /* extend_max_stream_data requeues a blocked stream */
+                stream_dequeue(qc);
+                continue;
+            }
+            batch_flush(&batch);
+            ngtcp2_ccerr_default(&ccerr);
+            ngtcp2_ccerr_set_liberr(&ccerr, (int)n, NULL, 0);
+            conn_close(qc, &ccerr);
+            return -1;
+        }
+        if (n == 0) {
+            break;              /* nothing left, or congestion limited */
+        }
+    
+        remote = (const struct sockaddr_in *)ps.path.remote.addr;
+        local = (const struct sockaddr_in *)ps.path.local.addr;
+        if (batch.count > 0 &&
+            (memcmp(&batch.remote, remote, sizeof(*remote)) != 0 || (size_t)n > batch.seg_size)) {
+            /* Different path or a larger packet: it starts the next batch */
+            size_t batch_len = batch.len;
+    
+            batch_flush(&batch);
+            memmove(tx_buf, tx_buf + batch_len, (size_t)n);
+        }
+        if (batch.count == 0) {
+            batch.remote = *remote;
+            batch.local = *local;
+            batch.seg_size = (size_t)n;
+        }
+        batch.len += (size_t)n;
+        batch.count++;
+        written += (size_t)n;
+    
+        if ((size_t)n < batch.seg_size || batch.count >= max_segments ||
+            batch.len + max_pkt > sizeof(tx_buf)) {
+            batch_flush(&batch);
+        }
+        if (written >= quantum) {
+            break;              /* pacing: the rest goes out at the next expiry */
+        }
+    }
+    batch_flush(&batch);
+    
+    ngtcp2_conn_update_pkt_tx_time(qc->conn, now);
+    conn_set_expiry(qc);
+    return 0;
+}
+
+static ngtcp2_conn *get_conn(ngtcp2_crypto_conn_ref *ref)
+{
+    return ((quic_conn_t *)ref->user_data)->conn;
+}
+
+static void rand_cb(uint8_t *dest, size_t destlen, const ngtcp2_rand_ctx *rand_ctx)
+{
+    (void)rand_ctx;
+    RAND_bytes(dest, (int)destlen);
+}
+
+static int get_new_connection_id_cb(ngtcp2_conn *conn, ngtcp2_cid *cid, uint8_t *token,
+                                    size_t cidlen, void *user_data)
+{
+    (void)conn;
+    if (RAND_bytes(cid->data, (int)cidlen) != 1) {
+        return NGTCP2_ERR_CALLBACK_FAILURE;
+    }
+    cid->datalen = cidlen;
+    if (ngtcp2_crypto_generate_stateless_reset_token(token, static_secret, sizeof(static_secret),
+                                                     cid) != 0 ||
+        cid_add(cid, user_data) != 0) {
+        return NGTCP2_ERR_CALLBACK_FAILURE;
+    }
+    return 0;
+}
+
+static int remove_connection_id_cb(ngtcp2_conn *conn, const ngtcp2_cid *cid, void *user_data)
+{
+    (void)conn;
+    (void)user_data;
+    cid_remove(cid->data, cid->datalen);
+    return 0;
+}
+
+/* The client certificate's CN becomes the rate limiter's client id */
+static int handshake_completed_cb(ngtcp2_conn *conn, void *user_data)
+{
+    quic_conn_t *qc = user_data;
+    X509 *cert;
+    
+    (void)conn;
+    cert = SSL_get0_peer_certificate(qc->ssl);
+    if (!cert || X509_NAME_get_text_by_NID(X509_get_subject_name(cert), NID_commonName,
+                                           qc->client_id, sizeof(qc->client_id)) <= 0) {
+        return NGTCP2_ERR_CALLBACK_FAILURE;
+    }
+    stat_handshakes++;
+    return 0;
+}
+
+static int path_validation_cb(ngtcp2_conn *conn, uint32_t flags, const ngtcp2_path *path,
+                              const ngtcp2_path *old_path, ngtcp2_path_validation_result res,
+                              void *user_data)
+{
+    quic_conn_t *qc = user_data;
+    
+    (void)conn;
+    (void)flags;
+    (void)old_path;
+    if (res == NGTCP2_PATH_VALIDATION_RESULT_SUCCESS &&
+        memcmp(&qc->remote, path->remote.addr, sizeof(qc->remote)) != 0) {
+        /* The device roamed: same connection, new address */
+        memcpy(&qc->remote, path->remote.addr, sizeof(qc->remote));
+        memcpy(&qc->local, path->local.addr, sizeof(qc->local));
+        stat_migrations++;
+    }
+    return 0;
+}
+
+/* Every request is charged to the device before a byte of it is read */
+static int stream_open_cb(ngtcp2_conn *conn, int64_t stream_id, void *user_data)
+{
+    quic_conn_t *qc = user_data;
+    quic_stream_t *st;
+    
+    if (!ngtcp2_is_bidi_stream(stream_id)) {
+        return 0;
+    }
+    if (qc->client_id[0] == '\0' ||
+        check_rate_limit_source(qc->client_id, qc->remote.sin_addr.s_addr) != 0) {
+        stat_rate_limited++;
+        ngtcp2_conn_shutdown_stream(conn, 0, stream_id, APP_ERR_RATE_LIMITED);
+        return 0;
+    }
+    
+    st = calloc(1, sizeof(*st));
+    if (!st) {
+        return NGTCP2_ERR_CALLBACK_FAILURE;
+    }
+    st->id = stream_id;
+    ngtcp2_conn_set_stream_user_data(conn, stream_id, st);
+    return 0;
+}
+
+static int recv_stream_data_cb(ngtcp2_conn *conn, uint32_t flags, int64_t stream_id,
+                               uint64_t offset, const uint8_t *data, size_t datalen,
+                               void *user_data, void *stream_user_data)
+{
+    quic_conn_t *qc = user_data;
+    quic_stream_t *st = stream_user_data;
+    
+    (void)offset;
+    (void)data;
+    ngtcp2_conn_extend_max_stream_offset(conn, stream_id, datalen);
+    ngtcp2_conn_extend_max_offset(conn, datalen);
+    if (!st) {
+        return 0;               /* refused stream, data is discarded */
+    }
+    
+    st->received += datalen;
+    if (st->received > STREAM_MAX_REQUEST) {
+        ngtcp2_conn_shutdown_stream(conn, 0, stream_id, APP_ERR_REQUEST_TOO_LARGE);
+        return 0;
+    }
+    if (flags & NGTCP2_STREAM_DATA_FLAG_FIN) {
+        st->reply_len = (size_t)snprintf(st->reply, sizeof(st->reply), "OK %zu\n", st->received);
+        stream_queue(qc, st);
+        stat_requests++;
+    }
+    return 0;
+}
+
+static int extend_max_stream_data_cb(ngtcp2_conn *conn, int64_t stream_id, uint64_t max_data,
+                                     void *user_data, void *stream_user_data)
+{
+    quic_stream_t *st = stream_user_data;
+    
+    (void)conn;
+    (void)stream_id;
+    (void)max_data;
+    if (st && st->reply_len > st->sent) {
+        stream_queue(user_data, st);
+    }
+    return 0;
+}
+
+/* Called once the stream is done both ways and its reply acknowledged */
+static int stream_close_cb(ngtcp2_conn *conn, uint32_t flags, int64_t stream_id,
+                           uint64_t app_error_code, void *user_data, void *stream_user_data)
+{
+    quic_conn_t *qc = user_data;
+    quic_stream_t *st = stream_user_data;
+    
+    (void)flags;
+    (void)app_error_code;
+    if (ngtcp2_is_bidi_stream(stream_id)) {
+        ngtcp2_conn_extend_max_streams_bidi(conn, 1);
+    }
+    if (!st) {
+        return 0;
+    }
+    if (st->pending) {
+        quic_stream_t *prev = NULL;
+        quic_stream_t *p = qc->pending;
+    
+        while (p != st) {
+            prev = p;
+            p = p->next_pending;
+        }
+        if (prev) {
+            prev->next_pending = st->next_pending;
+        } else {
+            qc->pending = st->next_pending;
+        }
+        if (qc->pending_tail == st) {
+            qc->pending_tail = prev;
+        }
+    }
+    free(st);
+    return 0;
+}
+
+static void send_version_negotiation(const ngtcp2_version_cid *vc, const struct sockaddr_in *local,
+                                     const struct sockaddr_in *remote)
+{
+    uint8_t buf[256];
+    uint32_t versions[] = { NGTCP2_PROTO_VER_V1 };
+    uint8_t unused;
+    ngtcp2_ssize n;
+    
+    RAND_bytes(&unused, 1);
+    n = ngtcp2_pkt_write_version_negotiation(buf, sizeof(buf), unused, vc->scid, vc->scidlen,
+                                             vc->dcid, vc->dcidlen, versions,
+                                             sizeof(versions) / sizeof(versions[0]));
+    if (n > 0) {
+        send_packets(local, remote, buf, (size_t)n, (size_t)n);
+    }
+}
+
+/* Stateless: the token proves the source address, no state is kept */
+static void send_retry(const ngtcp2_pkt_hd *hd, const struct sockaddr_in *local,
+                       const struct sockaddr_in *remote)
+{
+    uint8_t token[NGTCP2_CRYPTO_MAX_RETRY_TOKENLEN];
+    uint8_t buf[256];
+    ngtcp2_cid scid;
+    ngtcp2_ssize tokenlen, n;
+    
+    scid.datalen = SCID_LEN;
+    if (RAND_bytes(scid.data, SCID_LEN) != 1) {
+        return;
+    }
+    tokenlen = ngtcp2_crypto_generate_retry_token(token, static_secret, sizeof(static_secret),
+                                                  hd->version, (const ngtcp2_sockaddr *)remote,
+                                                  sizeof(*remote), &scid, &hd->dcid, timestamp());
+    if (tokenlen < 0) {
+        return;
+    }
+    n = ngtcp2_crypto_write_retry(buf, sizeof(buf), hd->version, &hd->scid, &scid, &hd->dcid,
+                                  token, (size_t)tokenlen);
+    if (n > 0) {
+        send_packets(local, remote, buf, (size_t)n, (size_t)n);
+        stat_retries++;
+    }
+}
+
+/* An Initial from an unknown connection: Retry, or create it */
+static quic_conn_t *conn_accept(const uint8_t *data, size_t len, const struct sockaddr_in *local,
+                                const struct sockaddr_in *remote)
+{
+    ngtcp2_pkt_hd hd;
+    ngtcp2_cid odcid, scid;
+    ngtcp2_settings settings;
+    ngtcp2_transport_params params;
+    ngtcp2_path path;
+    ngtcp2_tstamp now = timestamp();
+    quic_conn_t *qc;
+    
+    if (ngtcp2_accept(&hd, data, len) != 0 || conn_count >= MAX_CONNS) {
+        return NULL;
+    }
+    if (hd.tokenlen == 0 || hd.token[0] != NGTCP2_CRYPTO_TOKEN_MAGIC_RETRY) {
+        send_retry(&hd, local, remote);
+        return NULL;
+    }
+    if (ngtcp2_crypto_verify_retry_token(&odcid, hd.token, hd.tokenlen, static_secret,
+                                         sizeof(static_secret), hd.version,
+                                         (const ngtcp2_sockaddr *)remote, sizeof(*remote), &hd.dcid,
+                                         RETRY_TOKEN_TIMEOUT_SEC * NGTCP2_SECONDS, now) != 0) {
+        return NULL;
+    }
+    
+    qc = calloc(1, sizeof(*qc));
+    if (!qc) {
+        return NULL;
+    }
+    qc->local = *local;
+    qc->remote = *remote;
+    qc->initial_dcid = hd.dcid;
+    qc->conn_ref.get_conn = get_conn;
+    qc->conn_ref.user_data = qc;
+    
+    scid.datalen = SCID_LEN;
+    RAND_bytes(scid.data, SCID_LEN);
+    
+    ngtcp2_settings_default(&settings);
+    settings.initial_ts = now;
+    /* Loss on a cellular link is not congestion */
+    settings.cc_algo = NGTCP2_CC_ALGO_BBR;
+    
+    ngtcp2_transport_params_default(&params);
+    params.initial_max_streams_bidi = MAX_STREAMS_BIDI;
+    params.initial_max_streams_uni = 0;
+    params.initial_max_stream_data_bidi_remote = STREAM_MAX_REQUEST;
+    params.initial_max_data = (uint64_t)MAX_STREAMS_BIDI * STREAM_MAX_REQUEST;
+    params.max_idle_timeout = IDLE_TIMEOUT_SEC * NGTCP2_SECONDS;
+    /* Spare connection IDs so a migrating device is not linkable by CID */
+    params.active_connection_id_limit = 4;
+    params.original_dcid = odcid;
+    params.original_dcid_present = 1;
+    params.retry_scid = hd.dcid;
+    params.retry_scid_present = 1;
+    params.stateless_reset_token_present = 1;
+    ngtcp2_crypto_generate_stateless_reset_token(params.stateless_reset_token, static_secret,
+                                                 sizeof(static_secret), &scid);
+    
+    path.local.addr = (ngtcp2_sockaddr *)&qc->local;
+    path.local.addrlen = sizeof(qc->local);
+    path.remote.addr = (ngtcp2_sockaddr *)&qc->remote;
+    path.remote.addrlen = sizeof(qc->remote);
+    path.user_data = NULL;
+    
+    if (ngtcp2_conn_server_new(&qc->conn, &hd.scid, &scid, &path, hd.version, &callbacks,
+                               &settings, &params, NULL, qc) != 0) {
+        free(qc);
+        return NULL;
+    }
+    
+    qc->ssl = SSL_new(ssl_ctx);
+    if (!qc->ssl) {
+        ngtcp2_conn_del(qc->conn);
+        free(qc);
+        return NULL;
+    }
+    SSL_set_app_data(qc->ssl, &qc->conn_ref);
+    SSL_set_accept_state(qc->ssl);
+    ngtcp2_conn_set_tls_native_handle(qc->conn, qc->ssl);
+    
+    /* Last in the heap until its first write sets a real expiry */
+    qc->expiry = UINT64_MAX;
+    qc->heap_index = conn_count;
+    conn_heap[conn_count++] = qc;
+    if (cid_add(&scid, qc) != 0 || cid_add(&hd.dcid, qc) != 0) {
+        conn_free(qc);
+        return NULL;
+    }
+    return qc;
+}
+
+static void handle_datagram(const uint8_t *data, size_t len, const struct sockaddr_in *local,
+                            const struct sockaddr_in *remote)
+{
+    ngtcp2_version_cid vc;
+    ngtcp2_path path;
+    ngtcp2_pkt_info pi = { 0 };
+    ngtcp2_ccerr ccerr;
+    quic_conn_t *qc;
+    int rv;
+    
+    rv = ngtcp2_pkt_decode_version_cid(&vc, data, len, SCID_LEN);
+    if (rv == NGTCP2_ERR_VERSION_NEGOTIATION) {
+        send_version_negotiation(&vc, local, remote);
+        return;
+    }
+    if (rv != 0) {
+        return;
+    }
+    
+    qc = cid_find(vc.dcid, vc.dcidlen);
+    if (!qc) {
+        qc = conn_accept(data, len, local, remote);
+        if (!qc) {
+            return;
+        }
+    }
+    if (qc->closing) {
+        if (qc->close_pkt_len > 0) {
+            send_packets(local, remote, qc->close_pkt, qc->close_pkt_len, qc->close_pkt_len);
+        }
+        return;
+    }
+    
+    /* The path as this packet arrived; ngtcp2 spots a new remote itself */
+    path.local.addr = (ngtcp2_sockaddr *)local;
+    path.local.addrlen = sizeof(*local);
+    path.remote.addr = (ngtcp2_sockaddr *)remote;
+    path.remote.addrlen = sizeof(*remote);
+    path.user_data = NULL;
+    
+    rv = ngtcp2_conn_read_pkt(qc->conn, &path, &pi, data, len, timestamp());
+    if (rv != 0) {
+        switch (rv) {
+        case NGTCP2_ERR_DRAINING:
+            conn_drain(qc);
+            return;
+        case NGTCP2_ERR_DROP_CONN:
+            conn_free(qc);
+            return;
+        case NGTCP2_ERR_CRYPTO:
+            ngtcp2_ccerr_default(&ccerr);
+            ngtcp2_ccerr_set_tls_alert(&ccerr, ngtcp2_conn_get_tls_alert(qc->conn), NULL, 0);
+            break;
+        default:
+            ngtcp2_ccerr_default(&ccerr);
+            ngtcp2_ccerr_set_liberr(&ccerr, rv, NULL, 0);
+            break;
+        }
+        conn_close(qc, &ccerr);
+        return;
+    }
+    
+    conn_write(qc);
+}
+
+/* One recvmsg: a GRO train of same-sized datagrams from one sender */
+static int receive(void)
+{
+    static uint8_t buf[RX_BUF_SIZE];
+    union {
+        char buf[CMSG_SPACE(sizeof(struct in_pktinfo)) + CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct sockaddr_in remote, local;
+    struct iovec iov = { buf, sizeof(buf) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    size_t seg_size, off;
+    ssize_t n;
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &remote;
+    msg.msg_namelen = sizeof(remote);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    
+    n = recvmsg(quic_sock, &msg, MSG_DONTWAIT);
+    if (n <= 0) {
+        return -1;
+    }
+    if (msg.msg_namelen != sizeof(struct sockaddr_in)) {
+        return 0;
+    }
+    
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_port = htons(QUIC_PORT);
+    seg_size = (size_t)n;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+            local.sin_addr = ((struct in_pktinfo *)CMSG_DATA(cmsg))->ipi_addr;
+        } else if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            seg_size = (size_t)*(int *)CMSG_DATA(cmsg);
+        }
+    }
+    
+    for (off = 0; off < (size_t)n; off += seg_size) {
+        size_t len = (size_t)n - off < seg_size ? (size_t)n - off : seg_size;
+    
+        handle_datagram(buf + off, len, &local, &remote);
+        stat_gro_datagrams++;
+    }
+    return 0;
+}
+
+/* Loss detection, ACK delay, idle and closing timers that are due */
+static void handle_expiry(void)
+{
+    ngtcp2_tstamp now = timestamp();
+    
+    while (conn_count > 0 && conn_heap[0]->expiry <= now) {
+        quic_conn_t *qc = conn_heap[0];
+        int rv;
+    
+        if (qc->closing) {
+            conn_free(qc);
+            continue;
+        }
+        rv = ngtcp2_conn_handle_expiry(qc->conn, now);
+        if (rv == NGTCP2_ERR_IDLE_CLOSE) {
+            conn_free(qc);
+            continue;
+        }
+        if (rv != 0) {
+            ngtcp2_ccerr ccerr;
+    
+            ngtcp2_ccerr_default(&ccerr);
+            ngtcp2_ccerr_set_liberr(&ccerr, rv, NULL, 0);
+            conn_close(qc, &ccerr);
+            continue;
+        }
+        conn_write(qc);
+    }
+}
+
+static int poll_timeout_ms(void)
+{
+    ngtcp2_tstamp now = timestamp();
+    ngtcp2_tstamp ms;
+    
+    if (conn_count == 0) {
+        return 1000;
+    }
+    if (conn_heap[0]->expiry <= now) {
+        return 0;
+    }
+    ms = (conn_heap[0]->expiry - now + NGTCP2_MILLISECONDS - 1) / NGTCP2_MILLISECONDS;
+    return ms > 1000 ? 1000 : (int)ms;
+}
+
+static int alpn_select(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                       const unsigned char *in, unsigned int inlen, void *arg)
+{
+    static const unsigned char alpn[] = "\x06" QUIC_ALPN;
+    
+    (void)ssl;
+    (void)arg;
+    if (SSL_select_next_proto((unsigned char **)out, outlen, alpn, sizeof(alpn) - 1, in, inlen) !=
+        OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_ALERT_FATAL;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+static SSL_CTX *create_context(void)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    
+    if (!ctx ||
+        ngtcp2_crypto_quictls_configure_server_context(ctx) != 0 ||
+        SSL_CTX_use_certificate_chain_file(ctx, CERT_FILE) <= 0 ||
+        SSL_CTX_use_PrivateKey_file(ctx, KEY_FILE, SSL_FILETYPE_PEM) <= 0 ||
+        SSL_CTX_load_verify_locations(ctx, CA_FILE, NULL) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    /* Devices are authenticated by certificate, as on the TLS ports */
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+    SSL_CTX_set_alpn_select_cb(ctx, alpn_select, NULL);
+    return ctx;
+}
+
+static int create_socket(void)
+{
+    struct sockaddr_in addr;
+    int sock, one = 1;
+    
+    sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (sock < 0) {
+        perror("Unable to create socket");
+        return -1;
+    }
+    
+    /* Local address per packet, so replies leave from where they came in */
+    setsockopt(sock, IPPROTO_IP, IP_PKTINFO, &one, sizeof(one));
+    if (setsockopt(sock, SOL_UDP, UDP_GRO, &one, sizeof(one)) < 0) {
+        printf("UDP_GRO not supported, receiving datagrams one by one\n");
+    }
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(QUIC_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Unable to bind");
+        close(sock);
+        return -1;
+    }
+    
+    return sock;
+}
+
+int main(void)
+{
+    time_t last_stats = time(NULL);
+    struct pollfd pfd;
+    
+    if (ngtcp2_crypto_quictls_init() != 0 || RAND_bytes(static_secret, sizeof(static_secret)) != 1) {
+        fprintf(stderr, "Unable to initialize QUIC crypto\n");
+        return 1;
+    }
+    ssl_ctx = create_context();
+    if (!ssl_ctx) {
+        return 1;
+    }
+    
+    callbacks.recv_client_initial = ngtcp2_crypto_recv_client_initial_cb;
+    callbacks.recv_crypto_data = ngtcp2_crypto_recv_crypto_data_cb;
+    callbacks.encrypt = ngtcp2_crypto_encrypt_cb;
+    callbacks.decrypt = ngtcp2_crypto_decrypt_cb;
+    callbacks.hp_mask = ngtcp2_crypto_hp_mask_cb;
+    callbacks.update_key = ngtcp2_crypto_update_key_cb;
+    callbacks.delete_crypto_aead_ctx = ngtcp2_crypto_delete_crypto_aead_ctx_cb;
+    callbacks.delete_crypto_cipher_ctx = ngtcp2_crypto_delete_crypto_cipher_ctx_cb;
+    callbacks.get_path_challenge_data = ngtcp2_crypto_get_path_challenge_data_cb;
+    callbacks.version_negotiation = ngtcp2_crypto_version_negotiation_cb;
+    callbacks.rand = rand_cb;
+    callbacks.get_new_connection_id = get_new_connection_id_cb;
+    callbacks.remove_connection_id = remove_connection_id_cb;
+    callbacks.handshake_completed = handshake_completed_cb;
+    callbacks.path_validation = path_validation_cb;
+    callbacks.stream_open = stream_open_cb;
+    callbacks.recv_stream_data = recv_stream_data_cb;
+    callbacks.extend_max_stream_data = extend_max_stream_data_cb;
+    callbacks.stream_close = stream_close_cb;
+    
+    quic_sock = create_socket();
+    if (quic_sock < 0) {
+        return 1;
+    }
+    
+    printf("QUIC server listening on port %d (ALPN %s)\n", QUIC_PORT, QUIC_ALPN);
+    
+    pfd.fd = quic_sock;
+    pfd.events = POLLIN;
+    while (1) {
+        if (poll(&pfd, 1, poll_timeout_ms()) > 0) {
+            /* Drain the socket; each connection writes as it reads */
+            while (receive() == 0) {
+            }
+        }
+    
+        handle_expiry();
+    
+        if (time(NULL) - last_stats >= STATS_INTERVAL_SEC) {
+            last_stats = time(NULL);
+            printf("QUIC: %zu connections, %llu handshakes, %llu retries, %llu migrations, "
+                   "%llu requests, %llu rate limited, %llu datagrams in, "
+                   "%llu GSO sends (%llu segments)\n", conn_count,
+                   (unsigned long long)stat_handshakes, (unsigned long long)stat_retries,
+                   (unsigned long long)stat_migrations, (unsigned long long)stat_requests,
+                   (unsigned long long)stat_rate_limited, (unsigned long long)stat_gro_datagrams,
+                   (unsigned long long)stat_gso_sends, (unsigned long long)stat_gso_segments);
+            fflush(stdout);
+        }
+    }
+    
+    close(quic_sock);
+    SSL_CTX_free(ssl_ctx);
+    return 0;
+}
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <openssl/ssl.h>
+
+// v1.0 - Per-worker epoll loop, shared by the gateway TLS servers
+// Included by tls_server.c and mtls_server.c. Each worker thread has its
+// own SO_REUSEPORT listener and epoll set, so the kernel spreads new
+// connections across workers and no connection is touched by two
+// threads. The loop accepts, hands readiness on a connection back to
+// the server's state machine and calls a tick once a second for the
+// timeout sweep; what a connection is and how it steps stays with the
+// server.
+
+#define TLS_EPOLL_BACKLOG 1024
+#define TLS_EPOLL_MAX_EVENTS 256
+
+typedef struct {
+    int listen_fd;
+    int epoll_fd;
+    void *owner;                                /* the server's worker */
+    void (*accepted)(void *owner, int fd);      /* owns fd from here */
+    void (*ready)(void *owner, void *conn);     /* as given to tls_epoll_add */
+    void (*tick)(void *owner);
+} tls_epoll_t;
+
+/* Non-blocking listener on port, one per worker */
+int tls_epoll_listener(int port)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int sock;
+    
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sock < 0) {
+        perror("Unable to create socket");
+        return -1;
+    }
+    
+    /* One listener per worker on the same port, balanced by the kernel */
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("Unable to set SO_REUSEPORT");
+        close(sock);
+        return -1;
+    }
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Unable to bind");
+        close(sock);
+        return -1;
+    }
+    
+    if (listen(sock, TLS_EPOLL_BACKLOG) < 0) {
+        perror("Unable to listen");
+        close(sock);
+        return -1;
+    }
+    
+    return sock;
+}
+
+/* Watch a new connection's socket for its first read */
+int tls_epoll_add(tls_epoll_t *loop, int fd, void *conn)
+{
+    struct epoll_event ev;
+    
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void tls_epoll_del(tls_epoll_t *loop, int fd)
+{
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/* Wait for whichever direction OpenSSL asked for; -1 for any other error */
+int tls_epoll_want(tls_epoll_t *loop, int fd, void *conn, int err)
+{
+    struct epoll_event ev;
+    
+    if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+        return -1;
+    }
+    
+    ev.events = err == SSL_ERROR_WANT_READ ? EPOLLIN : EPOLLOUT;
+    ev.data.ptr = conn;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+static void tls_epoll_accept_all(tls_epoll_t *loop)
+{
+    for (;;) {
+        int client = accept4(loop->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        
+        if (client < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+                errno != ECONNABORTED) {
+                perror("Unable to accept");
+            }
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return;
+        }
+        loop->accepted(loop->owner, client);
+    }
+}
+
+/* The worker thread's loop; returns only on an epoll failure */
+void *tls_epoll_run(tls_epoll_t *loop)
+{
+    struct epoll_event events[TLS_EPOLL_MAX_EVENTS];
+    struct epoll_event ev;
+    time_t last_tick = time(NULL);
+    
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;         /* the listener */
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &ev) < 0) {
+        perror("Unable to watch listener");
+        return NULL;
+    }
+    
+    while (1) {
+        int n = epoll_wait(loop->epoll_fd, events, TLS_EPOLL_MAX_EVENTS, 1000);
+        int i;
+        
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                tls_epoll_accept_all(loop);
+            } else {
+                loop->ready(loop->owner, events[i].data.ptr);
+            }
+        }
+        
+        if (time(NULL) != last_tick) {
+            last_tick = time(NULL);
+            loop->tick(loop->owner);
+        }
+    }
+    
+    return NULL;
+}
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <openssl/ssl.h>
+#include <openssl/bio.h>
+
+// v1.0 - Kernel TLS offload, shared by the gateway TLS servers
+// Included by tls_server.c and mqtt_tls_broker.c. With TLS_KTLS=1 in the
+// environment, OpenSSL hands the record keys to the kernel after the
+// handshake; SSL_read/SSL_write then cost no user space crypto, and
+// files (firmware images) go out with SSL_sendfile straight from the
+// page cache, encrypted by the kernel or the NIC. It needs the tls
+// module (modprobe tls) and an AES-GCM or ChaCha20-Poly1305 suite;
+// anything else stays on the user space path, per connection.
+
+#define KTLS_ENV "TLS_KTLS"
+#define KTLS_CHUNK_SIZE 16384       /* one record per chunk off kTLS */
+#define KTLS_SENDFILE_MAX (1 << 20) /* bytes per SSL_sendfile call */
+
+/* kTLS capable suites only, so every handshake can be offloaded */
+#define KTLS_CIPHERSUITES "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:" \
+                          "TLS_CHACHA20_POLY1305_SHA256"
+#define KTLS_CIPHER_LIST "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:" \
+                         "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:" \
+                         "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305"
+
+typedef struct {
+    uint64_t send;              /* connections with kernel TX crypto */
+    uint64_t recv;              /* ... RX */
+    uint64_t fallback;          /* user space record layer */
+    uint64_t sendfile_bytes;    /* sent zero-copy */
+    uint64_t copied_bytes;      /* read and SSL_written */
+} tls_ktls_stats_t;
+
+/* Progress of one file transfer, kept across WANT_WRITE */
+typedef struct {
+    int fd;
+    off_t offset;
+    off_t end;
+    unsigned char chunk[KTLS_CHUNK_SIZE];   /* fallback path only */
+    size_t chunk_len;
+} tls_file_send_t;
+
+static tls_ktls_stats_t tls_ktls_stats;
+
+int tls_ktls_requested(void)
+{
+    const char *value = getenv(KTLS_ENV);
+    
+    return value && strcmp(value, "0") != 0;
+}
+
+/* Ask for kTLS on ctx; call before creating connections */
+int tls_ktls_enable(SSL_CTX *ctx)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+    if (SSL_CTX_set_ciphersuites(ctx, KTLS_CIPHERSUITES) != 1 ||
+        SSL_CTX_set_cipher_list(ctx, KTLS_CIPHER_LIST) != 1) {
+        return -1;
+    }
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    return 0;
+#else
+    (void)ctx;
+    return -1;              /* OpenSSL built without kTLS */
+#endif
+}
+
+/* Count which record layer a connection ended up on; call after SSL_accept */
+void tls_ktls_record(SSL *ssl)
+{
+    int send = BIO_get_ktls_send(SSL_get_wbio(ssl));
+    int recv = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+    
+    if (send) {
+        __atomic_add_fetch(&tls_ktls_stats.send, 1, __ATOMIC_RELAXED);
+    }
+    if (recv) {
+        __atomic_add_fetch(&tls_ktls_stats.recv, 1, __ATOMIC_RELAXED);
+    }
+    if (!send && !recv) {
+        __atomic_add_fetch(&tls_ktls_stats.fallback, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void tls_file_send_init(tls_file_send_t *fs, int fd, off_t offset, off_t size)
+{
+    fs->fd = fd;
+    fs->offset = offset;
+    fs->end = offset + size;
+    fs->chunk_len = 0;
+}
+
+/*
+ * Send as much of the file as the socket takes. Returns 1 when all of
+ * it is sent, 0 when SSL_get_error() would report WANT_READ/WANT_WRITE
+ * (call again once the socket is ready), -1 on error. With kTLS TX the
+ * data never enters user space; otherwise it goes by chunks through
+ * SSL_write, a chunk being retried unchanged after WANT_WRITE as
+ * SSL_write requires.
+ */
+int tls_file_send(SSL *ssl, tls_file_send_t *fs, int *ssl_error)
+{
+    int ktls = BIO_get_ktls_send(SSL_get_wbio(ssl));
+    
+    *ssl_error = SSL_ERROR_NONE;
+    while (fs->offset < fs->end || fs->chunk_len > 0) {
+        ossl_ssize_t sent;
+        int ret;
+    
+        if (ktls && fs->chunk_len == 0) {
+            size_t size = (size_t)(fs->end - fs->offset);
+    
+            sent = SSL_sendfile(ssl, fs->fd, fs->offset,
+                                size < KTLS_SENDFILE_MAX ? size : KTLS_SENDFILE_MAX, 0);
+            if (sent <= 0) {
+                *ssl_error = SSL_get_error(ssl, (int)sent);
+                return *ssl_error == SSL_ERROR_WANT_WRITE ? 0 : -1;
+            }
+            fs->offset += sent;
+            __atomic_add_fetch(&tls_ktls_stats.sendfile_bytes, (uint64_t)sent, __ATOMIC_RELAXED);
+            continue;
+        }
+    
+        if (fs->chunk_len == 0) {
+            size_t size = (size_t)(fs->end - fs->offset);
+            ssize_t n = pread(fs->fd, fs->chunk, size < sizeof(fs->chunk) ? size : sizeof(fs->chunk),
+                              fs->offset);
+    
+            if (n <= 0) {
+                return -1;      /* file shrank underneath us */
+            }
+            fs->chunk_len = (size_t)n;
+        }
+    
+        ret = SSL_write(ssl, fs->chunk, (int)fs->chunk_len);
+        if (ret <= 0) {
+            *ssl_error = SSL_get_error(ssl, ret);
+            return *ssl_error == SSL_ERROR_WANT_WRITE || *ssl_error == SSL_ERROR_WANT_READ ? 0 : -1;
+        }
+        fs->offset += fs->chunk_len;
+        __atomic_add_fetch(&tls_ktls_stats.copied_bytes, fs->chunk_len, __ATOMIC_RELAXED);
+        fs->chunk_len = 0;
+    }
+    
+    return 1;
+}
+
+void tls_ktls_print_stats(FILE *fp)
+{
+    fprintf(fp, "kTLS: %llu tx, %llu rx, %llu user space; %llu bytes sendfile, %llu bytes copied\n",
+            (unsigned long long)__atomic_load_n(&tls_ktls_stats.send, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&tls_ktls_stats.recv, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&tls_ktls_stats.fallback, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&tls_ktls_stats.sendfile_bytes, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&tls_ktls_stats.copied_bytes, __ATOMIC_RELAXED));
+}
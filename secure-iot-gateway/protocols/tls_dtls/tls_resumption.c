@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+
+// v1.0 - Session tickets with rotating keys, shared by the gateway TLS servers
+// Included by tls_server.c, mqtt_tls_broker.c and mtls_server.c. A
+// reconnecting device presents its ticket (a TLS 1.3 PSK, or a TLS 1.2
+// session ticket) and skips the certificate exchange and verification.
+// Ticket keys rotate every TICKET_ROTATE_SEC; tickets sealed with one of
+// the TICKET_KEYS - 1 retired keys still resume and are re-issued under
+// the current key, anything older falls back to a full handshake.
+
+#define TICKET_KEYS 3
+#define TICKET_ROTATE_SEC 3600
+#define TICKET_NAME_SIZE 16
+#define TICKETS_PER_HANDSHAKE 2
+#define SESSION_CACHE_SIZE 20480
+#define SESSION_TIMEOUT_SEC (TICKET_ROTATE_SEC * TICKET_KEYS)
+
+typedef struct {
+    unsigned char name[TICKET_NAME_SIZE];
+    unsigned char aes_key[32];
+    unsigned char hmac_key[32];
+} ticket_key_t;
+
+typedef struct {
+    uint64_t full;              /* handshakes with certificate exchange */
+    uint64_t resumed;
+    uint64_t tickets_issued;
+    uint64_t tickets_renewed;   /* accepted under a retired key */
+    uint64_t tickets_rejected;  /* unknown or expired key */
+} tls_resumption_stats_t;
+
+typedef struct {
+    pthread_rwlock_t lock;
+    ticket_key_t keys[TICKET_KEYS];     /* keys[0] is current */
+    time_t rotated;
+    tls_resumption_stats_t stats;
+} tls_resumption_t;
+
+/* One per process; the callback has no user pointer of its own */
+static tls_resumption_t tls_resumption;
+
+static int ticket_key_generate(ticket_key_t *key)
+{
+    return RAND_bytes(key->name, sizeof(key->name)) == 1 &&
+           RAND_bytes(key->aes_key, sizeof(key->aes_key)) == 1 &&
+           RAND_bytes(key->hmac_key, sizeof(key->hmac_key)) == 1 ? 0 : -1;
+}
+
+/* Retire the current key once it is due; caller holds no lock */
+static void ticket_keys_maybe_rotate(time_t now)
+{
+    ticket_key_t fresh;
+    
+    pthread_rwlock_rdlock(&tls_resumption.lock);
+    if (now - tls_resumption.rotated < TICKET_ROTATE_SEC) {
+        pthread_rwlock_unlock(&tls_resumption.lock);
+        return;
+    }
+    pthread_rwlock_unlock(&tls_resumption.lock);
+    
+    if (ticket_key_generate(&fresh) != 0) {
+        return;
+    }
+    
+    pthread_rwlock_wrlock(&tls_resumption.lock);
+    /* Another thread may have rotated in between */
+    if (now - tls_resumption.rotated >= TICKET_ROTATE_SEC) {
+        OPENSSL_cleanse(&tls_resumption.keys[TICKET_KEYS - 1], sizeof(ticket_key_t));
+        memmove(&tls_resumption.keys[1], &tls_resumption.keys[0],
+                (TICKET_KEYS - 1) * sizeof(ticket_key_t));
+        tls_resumption.keys[0] = fresh;
+        tls_resumption.rotated = now;
+    }
+    pthread_rwlock_unlock(&tls_resumption.lock);
+    OPENSSL_cleanse(&fresh, sizeof(fresh));
+}
+
+static int ticket_mac_init(EVP_MAC_CTX *hctx, const ticket_key_t *key)
+{
+    OSSL_PARAM params[3];
+    
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+                                                  (void *)key->hmac_key, sizeof(key->hmac_key));
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+    return EVP_MAC_CTX_set_params(hctx, params);
+}
+
+/*
+ * OpenSSL ticket key callback: 1 to seal or accept, 2 to accept and
+ * re-issue under the current key, 0 to fall back to a full handshake.
+ */
+static int ticket_key_cb(SSL *ssl, unsigned char *key_name, unsigned char *iv,
+                         EVP_CIPHER_CTX *ctx, EVP_MAC_CTX *hctx, int enc)
+{
+    int ret = 0;
+    int i;
+    
+    (void)ssl;
+    ticket_keys_maybe_rotate(time(NULL));
+    
+    pthread_rwlock_rdlock(&tls_resumption.lock);
+    if (enc) {
+        const ticket_key_t *key = &tls_resumption.keys[0];
+    
+        if (RAND_bytes(iv, 16) == 1 &&
+            EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key->aes_key, iv) == 1 &&
+            ticket_mac_init(hctx, key) == 1) {
+            memcpy(key_name, key->name, TICKET_NAME_SIZE);
+            __atomic_add_fetch(&tls_resumption.stats.tickets_issued, 1, __ATOMIC_RELAXED);
+            ret = 1;
+        } else {
+            ret = -1;
+        }
+    } else {
+        for (i = 0; i < TICKET_KEYS; i++) {
+            const ticket_key_t *key = &tls_resumption.keys[i];
+    
+            if (memcmp(key_name, key->name, TICKET_NAME_SIZE) != 0) {
+                continue;
+            }
+            if (ticket_mac_init(hctx, key) != 1 ||
+                EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key->aes_key, iv) != 1) {
+                ret = -1;
+                break;
+            }
+            ret = i == 0 ? 1 : 2;
+            if (ret == 2) {
+                __atomic_add_fetch(&tls_resumption.stats.tickets_renewed, 1, __ATOMIC_RELAXED);
+            }
+            break;
+        }
+        if (ret == 0) {
+            __atomic_add_fetch(&tls_resumption.stats.tickets_rejected, 1, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_rwlock_unlock(&tls_resumption.lock);
+    
+    return ret;
+}
+
+/*
+ * Enable tickets, TLS 1.3 PSK resumption and the server-side session
+ * cache on ctx. server_name scopes sessions to this server, which is
+ * also what lets OpenSSL resume sessions that carried a client
+ * certificate.
+ */
+int tls_resumption_enable(SSL_CTX *ctx, const char *server_name)
+{
+    int i;
+    
+    /* First context sets up the keys; call before starting workers */
+    if (tls_resumption.rotated == 0) {
+        pthread_rwlock_init(&tls_resumption.lock, NULL);
+        for (i = 0; i < TICKET_KEYS; i++) {
+            if (ticket_key_generate(&tls_resumption.keys[i]) != 0) {
+                return -1;
+            }
+        }
+        tls_resumption.rotated = time(NULL);
+    }
+    
+    if (SSL_CTX_set_session_id_context(ctx, (const unsigned char *)server_name,
+                                       (unsigned int)strlen(server_name)) != 1) {
+        return -1;
+    }
+    
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, SESSION_TIMEOUT_SEC);
+    SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+    SSL_CTX_set_num_tickets(ctx, TICKETS_PER_HANDSHAKE);
+    
+    if (SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb) != 1) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+/* Count a completed handshake; call once SSL_accept has succeeded */
+void tls_resumption_record(SSL *ssl)
+{
+    if (SSL_session_reused(ssl)) {
+        __atomic_add_fetch(&tls_resumption.stats.resumed, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&tls_resumption.stats.full, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void tls_resumption_get_stats(tls_resumption_stats_t *stats)
+{
+    stats->full = __atomic_load_n(&tls_resumption.stats.full, __ATOMIC_RELAXED);
+    stats->resumed = __atomic_load_n(&tls_resumption.stats.resumed, __ATOMIC_RELAXED);
+    stats->tickets_issued = __atomic_load_n(&tls_resumption.stats.tickets_issued, __ATOMIC_RELAXED);
+    stats->tickets_renewed = __atomic_load_n(&tls_resumption.stats.tickets_renewed, __ATOMIC_RELAXED);
+    stats->tickets_rejected = __atomic_load_n(&tls_resumption.stats.tickets_rejected, __ATOMIC_RELAXED);
+}
+
+void tls_resumption_print_stats(FILE *fp)
+{
+    tls_resumption_stats_t stats;
+    uint64_t total;
+    
+    tls_resumption_get_stats(&stats);
+    total = stats.full + stats.resumed;
+    fprintf(fp, "TLS handshakes: %llu full, %llu resumed (%.1f%% hit), "
+            "tickets %llu issued, %llu renewed, %llu rejected\n",
+            (unsigned long long)stats.full, (unsigned long long)stats.resumed,
+            total ? 100.0 * (double)stats.resumed / (double)total : 0.0,
+            (unsigned long long)stats.tickets_issued, (unsigned long long)stats.tickets_renewed,
+            (unsigned long long)stats.tickets_rejected);
+}
@@ -1,15 +1,67 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include "tls_resumption.c"
+#include "tls_epoll.c"
+#include "tls_ktls.c"
+#include "tls_uring.c"
 
 #define PORT 4433
 #define CERT_FILE "server.crt"
 #define KEY_FILE "server.key"
+#define HANDSHAKE_TIMEOUT_SEC 10
+#define STATS_INTERVAL_SEC 60
+#define URING_ENTRIES 1024
+#define URING_BUFS 1024             /* provided receive buffers per worker */
+#define URING_BUF_SIZE 16384
+
+/*
+ * Each worker thread runs its own listener and epoll loop (tls_epoll.c).
+ * Sockets are non-blocking and every connection moves through a small
+ * state machine, so a slow handshake only ever waits for its own
+ * socket. Given a file (a firmware image),
+ * the server sends it to every client instead of the greeting. With
+ * TLS_URING=1 the same state machine runs on io_uring completions
+ * (tls_uring.c) instead of epoll readiness.
+ */
+typedef enum {
+    CONN_HANDSHAKE,
+    CONN_REPLY,
+    CONN_SEND_FILE,
+    CONN_SHUTDOWN
+} conn_state_t;
+
+typedef struct conn {
+    int fd;
+    SSL *ssl;
+    conn_state_t state;
+    time_t deadline;            /* dropped if not done by then */
+    tls_file_send_t *file;      /* CONN_SEND_FILE progress */
+    tls_uring_stream_t stream;  /* io_uring backend only */
+    struct conn *prev;
+    struct conn *next;
+} conn_t;
+
+typedef struct {
+    SSL_CTX *ctx;
+    tls_epoll_t loop;
+    tls_uring_t *uring;         /* NULL on the epoll backend */
+    conn_t *conns;              /* for the timeout sweep */
+    int file_fd;                /* -1 for the greeting */
+    off_t file_size;
+} worker_t;
 
 SSL_CTX *create_context(void)
 {
@@ -42,10 +94,271 @@ void configure_context(SSL_CTX *ctx)
     }
 }
 
-int main(void)
+/* io_uring backend: the last request on the stream has completed */
+static void conn_release(void *owner)
+{
+    free(owner);
+}
+
+static void conn_close(worker_t *w, conn_t *c)
+{
+    if (!w->uring) {
+        tls_epoll_del(&w->loop, c->fd);
+    }
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        w->conns = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+    SSL_free(c->ssl);
+    free(c->file);
+    if (w->uring) {
+        /* queued records still go out; conn_release() frees c */
+        tls_uring_stream_close(&c->stream);
+        return;
+    }
+    close(c->fd);
+    free(c);
+}
+
+/* Wait for whichever direction OpenSSL asked for */
+static int conn_want(worker_t *w, conn_t *c, int err)
+{
+    if (!w->uring) {
+        return tls_epoll_want(&w->loop, c->fd, c, err);
+    }
+    if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+        return -1;
+    }
+    return 0;                   /* the next recv or send completion resumes it */
+}
+
+/* Advance one connection as far as it goes without blocking */
+static void conn_step(worker_t *w, conn_t *c)
+{
+    static const char reply[] = "Hello from TLS server\n";
+    int ret;
+    int err;
+    
+    for (;;) {
+        switch (c->state) {
+        case CONN_HANDSHAKE:
+            ret = SSL_accept(c->ssl);
+            if (ret <= 0) {
+                if (conn_want(w, c, SSL_get_error(c->ssl, ret)) != 0) {
+                    ERR_print_errors_fp(stderr);
+                    conn_close(w, c);
+                }
+                return;
+            }
+            tls_resumption_record(c->ssl);
+            tls_ktls_record(c->ssl);
+            c->state = CONN_REPLY;
+            if (w->file_fd >= 0) {
+                c->file = malloc(sizeof(*c->file));
+                if (!c->file) {
+                    conn_close(w, c);
+                    return;
+                }
+                tls_file_send_init(c->file, w->file_fd, 0, w->file_size);
+                /* an image takes longer than a handshake */
+                c->deadline = 0;
+                c->state = CONN_SEND_FILE;
+            }
+            break;
+    
+        case CONN_REPLY:
+            ret = SSL_write(c->ssl, reply, strlen(reply));
+            if (ret <= 0) {
+                if (conn_want(w, c, SSL_get_error(c->ssl, ret)) != 0) {
+                    conn_close(w, c);
+                }
+                return;
+            }
+            c->state = CONN_SHUTDOWN;
+            break;
+    
+        case CONN_SEND_FILE:
+            ret = tls_file_send(c->ssl, c->file, &err);
+            if (ret <= 0) {
+                if (ret < 0 || conn_want(w, c, err) != 0) {
+                    conn_close(w, c);
+                }
+                return;
+            }
+            c->state = CONN_SHUTDOWN;
+            break;
+    
+        case CONN_SHUTDOWN:
+            /* Best effort close_notify, the peer's is not waited for */
+            SSL_shutdown(c->ssl);
+            conn_close(w, c);
+            return;
+        }
+    }
+}
+
+/* A connection for an accepted socket, linked into the worker */
+static conn_t *conn_new(worker_t *w, int client)
+{
+    conn_t *c = calloc(1, sizeof(*c));
+    
+    if (!c || !(c->ssl = SSL_new(w->ctx))) {
+        free(c);
+        close(client);
+        return NULL;
+    }
+    c->fd = client;
+    c->state = CONN_HANDSHAKE;
+    c->deadline = time(NULL) + HANDSHAKE_TIMEOUT_SEC;
+    
+    if (w->uring) {
+        BIO *bio = tls_uring_bio_new(&c->stream);
+    
+        if (!bio) {
+            SSL_free(c->ssl);
+            free(c);
+            close(client);
+            return NULL;
+        }
+        SSL_set_bio(c->ssl, bio, bio);
+        tls_uring_stream_init(&c->stream, w->uring, client, c, conn_release);
+    } else {
+        SSL_set_fd(c->ssl, client);
+        if (tls_epoll_add(&w->loop, client, c) < 0) {
+            SSL_free(c->ssl);
+            free(c);
+            close(client);
+            return NULL;
+        }
+    }
+    
+    c->next = w->conns;
+    if (w->conns) {
+        w->conns->prev = c;
+    }
+    w->conns = c;
+    return c;
+}
+
+/* tls_epoll_t callbacks */
+static void conn_accepted(void *owner, int client)
+{
+    worker_t *w = owner;
+    conn_t *c = conn_new(w, client);
+    
+    /* The ClientHello is often already there */
+    if (c) {
+        conn_step(w, c);
+    }
+}
+
+static void conn_ready(void *owner, void *conn)
+{
+    conn_step(owner, conn);
+}
+
+/* Connections that never finished their handshake */
+static void sweep_timeouts(void *owner)
+{
+    worker_t *w = owner;
+    time_t now = time(NULL);
+    conn_t *c = w->conns;
+    
+    while (c) {
+        conn_t *next = c->next;
+    
+        if (c->deadline && now >= c->deadline) {
+            conn_close(w, c);
+        }
+        c = next;
+    }
+}
+
+/*
+ * io_uring backend: one multishot accept, and each connection steps on
+ * its own recv and send completions. All sends of an iteration go out
+ * with the io_uring_enter that waits for the next completions.
+ */
+static void *worker_main_uring(worker_t *w)
+{
+    time_t last_sweep = time(NULL);
+    tls_uring_t uring;
+    
+    if (tls_uring_init(&uring, URING_ENTRIES, URING_BUFS, URING_BUF_SIZE) != 0) {
+        perror("Unable to set up io_uring");
+        return NULL;
+    }
+    w->uring = &uring;
+    if (tls_uring_accept_multishot(&uring, w->loop.listen_fd, w) != 0) {
+        return NULL;
+    }
+    
+    while (1) {
+        struct io_uring_cqe *cqe;
+    
+        if (tls_uring_wait(&uring, 1000) != 0) {
+            perror("io_uring_enter");
+            break;
+        }
+    
+        while ((cqe = tls_uring_cqe_peek(&uring))) {
+            unsigned tag = TLS_URING_TAG(cqe->user_data);
+    
+            if (tag == TLS_URING_ACCEPT) {
+                conn_t *c;
+    
+                if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                    tls_uring_accept_multishot(&uring, w->loop.listen_fd, w);
+                }
+                if (cqe->res >= 0 && (c = conn_new(w, cqe->res))) {
+                    URING_STAT_ADD(accepts, 1);
+                    conn_step(w, c);
+                }
+            } else {
+                conn_t *c = ((tls_uring_stream_t *)TLS_URING_PTR(cqe->user_data))->owner;
+                int ret = tls_uring_stream_event(&c->stream, tag, cqe);
+    
+                if (ret < 0) {
+                    conn_close(w, c);
+                } else if (ret > 0) {
+                    conn_step(w, c);
+                }
+            }
+            tls_uring_cqe_seen(&uring);
+        }
+    
+        if (time(NULL) != last_sweep) {
+            last_sweep = time(NULL);
+            sweep_timeouts(w);
+        }
+    }
+    
+    return NULL;
+}
+
+static void *worker_main(void *arg)
+{
+    worker_t *w = arg;
+    
+    if (tls_uring_requested()) {
+        return worker_main_uring(w);
+    }
+    return tls_epoll_run(&w->loop);
+}
+
+int main(int argc, char **argv)
 {
-    int sock;
     SSL_CTX *ctx;
+    worker_t *workers;
+    pthread_t *threads;
+    int file_fd = -1;
+    off_t file_size = 0;
+    long nworkers;
+    long i;
     
     SSL_library_init();
     OpenSSL_add_all_algorithms();
@@ -53,57 +366,81 @@ int main(void)
     
     ctx = create_context();
     configure_context(ctx);
-    
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("Unable to create socket");
+    if (tls_resumption_enable(ctx, "tls_server") != 0) {
+        fprintf(stderr, "Unable to enable session resumption\n");
+        exit(EXIT_FAILURE);
+    }
+    if (tls_ktls_requested() && tls_uring_requested()) {
+        fprintf(stderr, "TLS_KTLS and TLS_URING are exclusive\n");
+        exit(EXIT_FAILURE);
+    }
+    if (tls_ktls_requested() && tls_ktls_enable(ctx) != 0) {
+        fprintf(stderr, "kTLS not available in this OpenSSL\n");
         exit(EXIT_FAILURE);
     }
     
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(PORT);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    /* Optional file to serve, e.g. tls_server 4 firmware.bin */
+    if (argc > 2) {
+        struct stat st;
     
-    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        perror("Unable to bind");
-        exit(EXIT_FAILURE);
+        file_fd = open(argv[2], O_RDONLY | O_CLOEXEC);
+        if (file_fd < 0 || fstat(file_fd, &st) < 0) {
+            perror("Unable to open file to serve");
+            exit(EXIT_FAILURE);
+        }
+        file_size = st.st_size;
     }
     
-    if (listen(sock, 1) < 0) {
-        perror("Unable to listen");
+    /* Worker count from the command line, one per CPU by default */
+    nworkers = argc > 1 ? strtol(argv[1], NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers < 1) {
+        nworkers = 1;
+    }
+    
+    workers = calloc((size_t)nworkers, sizeof(*workers));
+    threads = calloc((size_t)nworkers, sizeof(*threads));
+    if (!workers || !threads) {
+        perror("Unable to allocate workers");
         exit(EXIT_FAILURE);
     }
     
-    printf("TLS server listening on port %d\n", PORT);
+    for (i = 0; i < nworkers; i++) {
+        tls_epoll_t *loop = &workers[i].loop;
     
-    while (1) {
-        struct sockaddr_in addr;
-        socklen_t len = sizeof(addr);
-        SSL *ssl;
-        const char reply[] = "Hello from TLS server\n";
-        
-        int client = accept(sock, (struct sockaddr *)&addr, &len);
-        if (client < 0) {
-            perror("Unable to accept");
+        workers[i].ctx = ctx;
+        workers[i].file_fd = file_fd;
+        workers[i].file_size = file_size;
+        loop->listen_fd = tls_epoll_listener(PORT);
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        loop->owner = &workers[i];
+        loop->accepted = conn_accepted;
+        loop->ready = conn_ready;
+        loop->tick = sweep_timeouts;
+        if (loop->listen_fd < 0 || loop->epoll_fd < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    printf("TLS server listening on port %d (%ld workers)\n", PORT, nworkers);
+    
+    for (i = 0; i < nworkers; i++) {
+        if (pthread_create(&threads[i], NULL, worker_main, &workers[i]) != 0) {
+            perror("Unable to start worker");
             exit(EXIT_FAILURE);
         }
-        
-        ssl = SSL_new(ctx);
-        SSL_set_fd(ssl, client);
-        
-        if (SSL_accept(ssl) <= 0) {
-            ERR_print_errors_fp(stderr);
-        } else {
-            SSL_write(ssl, reply, strlen(reply));
+    }
+    
+    /* Workers run for the life of the process; report resumption rates */
+    while (1) {
+        sleep(STATS_INTERVAL_SEC);
+        tls_resumption_print_stats(stdout);
+        tls_ktls_print_stats(stdout);
+        if (tls_uring_requested()) {
+            tls_uring_print_stats(stdout);
         }
-        
-        SSL_free(ssl);
-        close(client);
+        fflush(stdout);
     }
     
-    close(sock);
     SSL_CTX_free(ctx);
     return 0;
 }
-
@@ -0,0 +1,818 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <openssl/ssl.h>
+#include <openssl/bio.h>
+
+// v1.0 - io_uring socket backend, shared by the gateway servers
+// Included by tls_server.c, mqtt_tls_broker.c and coap_dtls_server.c.
+// With TLS_URING=1 in the environment a worker drives its sockets
+// through one ring instead of epoll and non-blocking calls. There is one
+// multishot accept per listener and one multishot recv per connection,
+// both into a ring of provided buffers shared by the worker. A buffer
+// goes back to the ring as soon as OpenSSL has read it. TLS records
+// written during a loop iteration leave as one linked send chain per
+// connection, submitted by the same io_uring_enter that waits for the
+// next completions, so a busy worker makes about one syscall per
+// iteration instead of several per message. There is no liburing: the
+// code uses the three syscalls and the ring layout from linux/io_uring.h
+// (kernel 6.0 or later). kTLS needs OpenSSL to own the socket, so the
+// two backends are exclusive.
+
+#define URING_ENV "TLS_URING"
+#define URING_BGID 0                /* the worker's provided buffer group */
+#define URING_CHUNK_SIZE 32768      /* TX staging, two full records */
+#define URING_TX_MAX (256 * 1024)   /* queued per connection before WANT_WRITE */
+#define URING_RX_QUEUE 64           /* received buffers held per connection */
+#define URING_RX_HIGH 16            /* stop receiving above this ... */
+#define URING_RX_LOW 4              /* ... and start again below this */
+
+/* Request kinds, in the low bits of user_data; the rest is a pointer */
+#define TLS_URING_ACCEPT  1
+#define TLS_URING_RECV    2
+#define TLS_URING_SEND    3
+#define TLS_URING_CANCEL  4
+#define TLS_URING_READ    5
+#define TLS_URING_RECVMSG 6
+#define TLS_URING_TAG_MASK 7ULL
+
+#define TLS_URING_TAG(data) ((unsigned)((data) & TLS_URING_TAG_MASK))
+#define TLS_URING_PTR(data) ((void *)(uintptr_t)((data) & ~TLS_URING_TAG_MASK))
+
+typedef struct {
+    uint64_t enters;            /* io_uring_enter calls */
+    uint64_t completions;
+    uint64_t accepts;
+    uint64_t recv_bytes;
+    uint64_t send_chains;
+    uint64_t send_bytes;
+    uint64_t rearms;            /* multishot recv restarted */
+    uint64_t no_buffers;        /* ... because the buffer ring ran dry */
+} tls_uring_stats_t;
+
+struct tls_uring_stream;
+
+typedef struct {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned sq_local_tail;     /* filled up to here, published on submit */
+    unsigned sq_pending;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring;
+    size_t ring_size;
+    size_t sqes_size;
+    
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    unsigned buf_count;         /* power of two */
+    size_t buf_size;
+    uint16_t br_tail;
+    unsigned char *bufs;
+    
+    struct tls_uring_stream *todo;  /* streams to service before waiting */
+    struct tls_uring_stream *starved;   /* recv stopped for lack of buffers */
+    uint16_t starved_tail;      /* br_tail when the last one joined */
+} tls_uring_t;
+
+/* TX staging; a chain of these is one linked send chain */
+typedef struct tls_uring_chunk {
+    struct tls_uring_chunk *next;
+    size_t len;
+    unsigned char data[URING_CHUNK_SIZE];
+} tls_uring_chunk_t;
+
+/*
+ * One TCP connection on the ring, read and written by OpenSSL through
+ * tls_uring_bio_new(). Its memory must stay valid until release runs:
+ * after tls_uring_stream_close() the stream still sends what is queued
+ * (close_notify) and waits for every request to complete, then closes
+ * the socket and calls release.
+ */
+typedef struct tls_uring_stream {
+    tls_uring_t *u;
+    int fd;
+    void *owner;
+    void (*release)(void *owner);
+    
+    uint16_t rx_bid[URING_RX_QUEUE];
+    uint32_t rx_len[URING_RX_QUEUE];
+    uint32_t rx_off;            /* consumed from the head buffer */
+    unsigned rx_head;
+    unsigned rx_count;
+    int rx_armed;
+    int rx_cancel;              /* cancel of the recv in flight */
+    int rx_eof;
+    int rx_starved;
+    struct tls_uring_stream *starved_next;
+    
+    tls_uring_chunk_t *tx_head;
+    tls_uring_chunk_t *tx_tail;
+    tls_uring_chunk_t *tx_next; /* first chunk not submitted yet */
+    size_t tx_bytes;
+    unsigned tx_inflight;       /* sends of the chain in flight */
+    
+    unsigned ops;               /* requests still to complete */
+    int closing;
+    int error;
+    int on_todo;
+    struct tls_uring_stream *todo_next;
+} tls_uring_stream_t;
+
+static tls_uring_stats_t tls_uring_stats;
+static BIO_METHOD *tls_uring_bio_method;
+static pthread_once_t tls_uring_bio_once = PTHREAD_ONCE_INIT;
+
+#define URING_STAT_ADD(field, n) __atomic_add_fetch(&tls_uring_stats.field, (n), __ATOMIC_RELAXED)
+
+int tls_uring_requested(void)
+{
+    const char *value = getenv(URING_ENV);
+    
+    return value && strcmp(value, "0") != 0;
+}
+
+static uint64_t uring_data(const void *ptr, unsigned tag)
+{
+    return (uint64_t)(uintptr_t)ptr | tag;
+}
+
+static unsigned char *tls_uring_buf(tls_uring_t *u, uint16_t bid)
+{
+    return u->bufs + (size_t)bid * u->buf_size;
+}
+
+/* Hand a provided buffer back to the kernel */
+static void tls_uring_buf_recycle(tls_uring_t *u, uint16_t bid)
+{
+    struct io_uring_buf *buf = &u->br->bufs[u->br_tail & (u->buf_count - 1)];
+    
+    buf->addr = (uint64_t)(uintptr_t)tls_uring_buf(u, bid);
+    buf->len = (uint32_t)u->buf_size;
+    buf->bid = bid;
+    u->br_tail++;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Set up a ring of entries submission slots and buf_count provided
+ * buffers of buf_size bytes. Returns 0, or -1 with errno set when the
+ * kernel lacks io_uring or a feature used here.
+ */
+int tls_uring_init(tls_uring_t *u, unsigned entries, unsigned buf_count, size_t buf_size)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    unsigned i;
+    
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    /* multishot requests post many completions per submission */
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+              IORING_SETUP_SINGLE_ISSUER;
+    p.cq_entries = entries * 4;
+    u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0) {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_NODROP)) {
+        errno = ENOSYS;
+        goto fail;
+    }
+    
+    u->sq_entries = p.sq_entries;
+    u->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > u->ring_size) {
+        u->ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    }
+    u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_SQ_RING);
+    if (u->ring == MAP_FAILED) {
+        u->ring = NULL;
+        goto fail;
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto fail;
+    }
+    
+    u->sq_head = (unsigned *)((char *)u->ring + p.sq_off.head);
+    u->sq_tail = (unsigned *)((char *)u->ring + p.sq_off.tail);
+    u->sq_mask = (unsigned *)((char *)u->ring + p.sq_off.ring_mask);
+    u->cq_head = (unsigned *)((char *)u->ring + p.cq_off.head);
+    u->cq_tail = (unsigned *)((char *)u->ring + p.cq_off.tail);
+    u->cq_mask = (unsigned *)((char *)u->ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((char *)u->ring + p.cq_off.cqes);
+    u->sq_local_tail = *u->sq_tail;
+    /* slot i always holds SQE i */
+    for (i = 0; i < p.sq_entries; i++) {
+        ((unsigned *)((char *)u->ring + p.sq_off.array))[i] = i;
+    }
+    
+    u->buf_count = buf_count;
+    u->buf_size = buf_size;
+    u->br_size = buf_count * sizeof(struct io_uring_buf);
+    u->br = mmap(NULL, u->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->bufs = malloc(buf_count * buf_size);
+    if (u->br == MAP_FAILED || !u->bufs) {
+        if (u->br == MAP_FAILED) {
+            u->br = NULL;
+        }
+        goto fail;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+    reg.ring_entries = buf_count;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        goto fail;
+    }
+    for (i = 0; i < buf_count; i++) {
+        tls_uring_buf_recycle(u, (uint16_t)i);
+    }
+    
+    return 0;
+    
+fail:
+    if (u->br) {
+        munmap(u->br, u->br_size);
+    }
+    free(u->bufs);
+    if (u->sqes) {
+        munmap(u->sqes, u->sqes_size);
+    }
+    if (u->ring) {
+        munmap(u->ring, u->ring_size);
+    }
+    close(u->fd);
+    u->fd = -1;
+    return -1;
+}
+
+static unsigned tls_uring_sq_space(const tls_uring_t *u)
+{
+    return u->sq_entries - (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Submit what is queued and, with wait_nr, wait up to timeout_ms for
+ * that many completions. Returns 0, or -1 on a ring error.
+ */
+static int tls_uring_submit(tls_uring_t *u, unsigned wait_nr, int timeout_ms)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = 0;
+    int ret;
+    
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+    if (!u->sq_pending && !wait_nr) {
+        return 0;
+    }
+    
+    memset(&arg, 0, sizeof(arg));
+    if (wait_nr) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    }
+    URING_STAT_ADD(enters, 1);
+    ret = (int)syscall(__NR_io_uring_enter, u->fd, u->sq_pending, wait_nr, flags,
+                       wait_nr ? &arg : NULL, wait_nr ? sizeof(arg) : 0);
+    if (ret < 0) {
+        return errno == ETIME || errno == EINTR || errno == EBUSY ? 0 : -1;
+    }
+    u->sq_pending -= (unsigned)ret;
+    return 0;
+}
+
+/* A zeroed submission slot; submits first when the queue is full */
+static struct io_uring_sqe *tls_uring_sqe(tls_uring_t *u)
+{
+    struct io_uring_sqe *sqe;
+    
+    if (!tls_uring_sq_space(u) && (tls_uring_submit(u, 0, 0) != 0 || !tls_uring_sq_space(u))) {
+        return NULL;
+    }
+    sqe = &u->sqes[u->sq_local_tail & *u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_local_tail++;
+    u->sq_pending++;
+    return sqe;
+}
+
+/* The next completion, or NULL; release it with tls_uring_cqe_seen() */
+static struct io_uring_cqe *tls_uring_cqe_peek(tls_uring_t *u)
+{
+    unsigned head = *u->cq_head;
+    
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    URING_STAT_ADD(completions, 1);
+    return &u->cqes[head & *u->cq_mask];
+}
+
+static void tls_uring_cqe_seen(tls_uring_t *u)
+{
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int tls_uring_accept_multishot(tls_uring_t *u, int listen_fd, const void *ptr)
+{
+    struct io_uring_sqe *sqe = tls_uring_sqe(u);
+    
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = uring_data(ptr, TLS_URING_ACCEPT);
+    return 0;
+}
+
+/* Datagrams with their source address; see tls_uring_recvmsg_payload() */
+int tls_uring_recvmsg_multishot(tls_uring_t *u, int fd, struct msghdr *msg, const void *ptr)
+{
+    struct io_uring_sqe *sqe = tls_uring_sqe(u);
+    
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = uring_data(ptr, TLS_URING_RECVMSG);
+    return 0;
+}
+
+int tls_uring_read(tls_uring_t *u, int fd, void *buf, unsigned len, const void *ptr)
+{
+    struct io_uring_sqe *sqe = tls_uring_sqe(u);
+    
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = uring_data(ptr, TLS_URING_READ);
+    return 0;
+}
+
+/*
+ * A RECVMSG completion's buffer holds an io_uring_recvmsg_out header,
+ * then msg_namelen bytes of address, then the datagram. Returns the
+ * datagram, or NULL if it or its address was truncated.
+ */
+const uint8_t *tls_uring_recvmsg_payload(const struct io_uring_cqe *cqe, const unsigned char *buf,
+                                         const struct msghdr *msg, const void **name, size_t *len)
+{
+    const struct io_uring_recvmsg_out *out = (const void *)buf;
+    size_t header = sizeof(*out) + msg->msg_namelen + msg->msg_controllen;
+    
+    if (cqe->res < 0 || (size_t)cqe->res < header ||
+        (out->flags & MSG_TRUNC) || out->namelen > msg->msg_namelen) {
+        return NULL;
+    }
+    *name = buf + sizeof(*out);
+    *len = out->payloadlen;
+    return buf + header;
+}
+
+static void stream_todo(tls_uring_stream_t *s)
+{
+    if (!s->on_todo) {
+        s->on_todo = 1;
+        s->todo_next = s->u->todo;
+        s->u->todo = s;
+    }
+}
+
+static void stream_arm_recv(tls_uring_stream_t *s)
+{
+    struct io_uring_sqe *sqe = tls_uring_sqe(s->u);
+    
+    if (!sqe) {
+        s->error = 1;
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = s->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = uring_data(s, TLS_URING_RECV);
+    s->rx_armed = 1;
+    s->ops++;
+}
+
+static void stream_cancel_recv(tls_uring_stream_t *s)
+{
+    struct io_uring_sqe *sqe;
+    
+    if (!s->rx_armed || s->rx_cancel || !(sqe = tls_uring_sqe(s->u))) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = uring_data(s, TLS_URING_RECV);
+    sqe->user_data = uring_data(s, TLS_URING_CANCEL);
+    s->rx_cancel = 1;
+    s->ops++;
+}
+
+/* Everything written since the last chain, as one linked chain */
+static void stream_submit_tx(tls_uring_stream_t *s)
+{
+    tls_uring_chunk_t *c;
+    unsigned n = 0;
+    
+    if (s->tx_inflight || !s->tx_next || s->error) {
+        return;
+    }
+    for (c = s->tx_next; c; c = c->next) {
+        n++;
+    }
+    if (tls_uring_sq_space(s->u) < n && tls_uring_submit(s->u, 0, 0) != 0) {
+        s->error = 1;
+        return;
+    }
+    
+    for (c = s->tx_next; c; c = c->next) {
+        struct io_uring_sqe *sqe = tls_uring_sqe(s->u);
+    
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = s->fd;
+        sqe->addr = (uint64_t)(uintptr_t)c->data;
+        sqe->len = (uint32_t)c->len;
+        /* a short send would break the record stream: finish or fail */
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->flags = c->next ? IOSQE_IO_LINK : 0;
+        sqe->user_data = uring_data(s, TLS_URING_SEND);
+        s->tx_inflight++;
+        s->ops++;
+    }
+    s->tx_next = NULL;
+    URING_STAT_ADD(send_chains, 1);
+}
+
+/* Start receiving on a connected socket the stream now owns */
+void tls_uring_stream_init(tls_uring_stream_t *s, tls_uring_t *u, int fd, void *owner,
+                           void (*release)(void *owner))
+{
+    memset(s, 0, sizeof(*s));
+    s->u = u;
+    s->fd = fd;
+    s->owner = owner;
+    s->release = release;
+    stream_arm_recv(s);
+}
+
+/*
+ * Account one completion for the stream. Returns 1 when the owner
+ * should drive its connection (data arrived, or send room freed up), -1
+ * when the connection failed and should be closed, 0 otherwise.
+ */
+int tls_uring_stream_event(tls_uring_stream_t *s, unsigned tag, const struct io_uring_cqe *cqe)
+{
+    int ret = 0;
+    
+    switch (tag) {
+    case TLS_URING_RECV:
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            s->rx_armed = 0;
+            s->rx_cancel = 0;
+            s->ops--;
+        }
+        if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+            uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            unsigned slot = (s->rx_head + s->rx_count) % URING_RX_QUEUE;
+    
+            if (s->closing || s->rx_count == URING_RX_QUEUE) {
+                tls_uring_buf_recycle(s->u, bid);
+                s->error |= !s->closing;
+                break;
+            }
+            s->rx_bid[slot] = bid;
+            s->rx_len[slot] = (uint32_t)cqe->res;
+            s->rx_count++;
+            URING_STAT_ADD(recv_bytes, (uint64_t)cqe->res);
+            /* The owner is not keeping up: park the socket, not the ring */
+            if (s->rx_count >= URING_RX_HIGH) {
+                stream_cancel_recv(s);
+            }
+            ret = 1;
+        } else if (cqe->res == 0) {
+            s->rx_eof = 1;
+            ret = 1;
+        } else if (cqe->res == -ENOBUFS && !s->closing) {
+            /* Rearmed once a buffer comes back, not in a busy loop */
+            URING_STAT_ADD(no_buffers, 1);
+            s->rx_starved = 1;
+            s->starved_next = s->u->starved;
+            s->u->starved = s;
+            s->u->starved_tail = s->u->br_tail;
+            break;
+        } else if (cqe->res < 0 && cqe->res != -ECANCELED) {
+            s->error = 1;
+        }
+        if (!s->rx_armed) {
+            stream_todo(s);     /* rearm, once there is room */
+        }
+        break;
+    
+    case TLS_URING_SEND:
+        s->ops--;
+        s->tx_inflight--;
+        if (s->tx_head) {
+            tls_uring_chunk_t *c = s->tx_head;
+    
+            if (cqe->res != (int)c->len) {
+                s->error = 1;   /* linked sends after it complete -ECANCELED */
+            } else {
+                URING_STAT_ADD(send_bytes, c->len);
+            }
+            s->tx_bytes -= c->len;
+            s->tx_head = c->next;
+            if (!s->tx_head) {
+                s->tx_tail = NULL;
+            }
+            free(c);
+        }
+        if (!s->tx_inflight && s->tx_next) {
+            stream_todo(s);
+        }
+        ret = 1;
+        break;
+    
+    case TLS_URING_CANCEL:
+        s->ops--;
+        break;
+    }
+    
+    if (s->closing) {
+        if (!s->ops) {
+            stream_todo(s);
+        }
+        return 0;
+    }
+    return s->error ? -1 : ret;
+}
+
+/*
+ * Stop using the stream: queued records (close_notify) still go out,
+ * receiving stops, and release runs once the last request completed
+ */
+void tls_uring_stream_close(tls_uring_stream_t *s)
+{
+    if (s->closing) {
+        return;
+    }
+    s->closing = 1;
+    if (s->rx_starved) {
+        tls_uring_stream_t **link = &s->u->starved;
+    
+        while (*link != s) {
+            link = &(*link)->starved_next;
+        }
+        *link = s->starved_next;
+        s->rx_starved = 0;
+    }
+    stream_submit_tx(s);
+    stream_cancel_recv(s);
+    stream_todo(s);
+}
+
+/* Due work of every stream touched since the last wait */
+static void tls_uring_service(tls_uring_t *u)
+{
+    tls_uring_stream_t *s;
+    
+    if (u->starved && u->br_tail != u->starved_tail) {
+        while ((s = u->starved)) {
+            u->starved = s->starved_next;
+            s->rx_starved = 0;
+            stream_todo(s);
+        }
+    }
+    
+    while ((s = u->todo)) {
+        u->todo = s->todo_next;
+        s->on_todo = 0;
+    
+        stream_submit_tx(s);
+        if (s->closing) {
+            if (!s->ops) {
+                while (s->rx_count) {
+                    tls_uring_buf_recycle(u, s->rx_bid[s->rx_head]);
+                    s->rx_head = (s->rx_head + 1) % URING_RX_QUEUE;
+                    s->rx_count--;
+                }
+                while (s->tx_head) {
+                    tls_uring_chunk_t *c = s->tx_head;
+    
+                    s->tx_head = c->next;
+                    free(c);
+                }
+                close(s->fd);
+                s->release(s->owner);
+            }
+            continue;
+        }
+        if (!s->rx_armed && !s->rx_starved && !s->rx_eof && !s->error &&
+            s->rx_count < URING_RX_LOW) {
+            stream_arm_recv(s);
+            URING_STAT_ADD(rearms, 1);
+        }
+    }
+}
+
+/*
+ * Service the streams, submit everything queued and wait up to
+ * timeout_ms for a completion; then drain them with tls_uring_cqe_peek()
+ */
+int tls_uring_wait(tls_uring_t *u, int timeout_ms)
+{
+    tls_uring_service(u);
+    return tls_uring_submit(u, 1, timeout_ms);
+}
+
+static int uring_bio_read(BIO *b, char *out, int len)
+{
+    tls_uring_stream_t *s = BIO_get_data(b);
+    size_t done = 0;
+    
+    BIO_clear_retry_flags(b);
+    while (done < (size_t)len && s->rx_count) {
+        unsigned head = s->rx_head;
+        size_t n = s->rx_len[head] - s->rx_off;
+    
+        if (n > (size_t)len - done) {
+            n = (size_t)len - done;
+        }
+        memcpy(out + done, tls_uring_buf(s->u, s->rx_bid[head]) + s->rx_off, n);
+        done += n;
+        s->rx_off += (uint32_t)n;
+        if (s->rx_off == s->rx_len[head]) {
+            tls_uring_buf_recycle(s->u, s->rx_bid[head]);
+            s->rx_head = (head + 1) % URING_RX_QUEUE;
+            s->rx_count--;
+            s->rx_off = 0;
+        }
+    }
+    if (!s->rx_armed && !s->rx_starved && s->rx_count < URING_RX_LOW) {
+        stream_todo(s);
+    }
+    
+    if (done) {
+        return (int)done;
+    }
+    if (s->rx_eof || s->error) {
+        return 0;
+    }
+    BIO_set_retry_read(b);
+    return -1;
+}
+
+static int uring_bio_write(BIO *b, const char *in, int len)
+{
+    tls_uring_stream_t *s = BIO_get_data(b);
+    size_t done = 0;
+    
+    BIO_clear_retry_flags(b);
+    if (s->error || s->closing) {
+        return -1;
+    }
+    if (s->tx_bytes >= URING_TX_MAX) {
+        BIO_set_retry_write(b);
+        return -1;
+    }
+    
+    while (done < (size_t)len) {
+        tls_uring_chunk_t *c = s->tx_next ? s->tx_tail : NULL;
+        size_t n;
+    
+        if (!c || c->len == sizeof(c->data)) {
+            c = malloc(sizeof(*c));
+            if (!c) {
+                s->error = 1;
+                return -1;
+            }
+            c->next = NULL;
+            c->len = 0;
+            if (s->tx_tail) {
+                s->tx_tail->next = c;
+            } else {
+                s->tx_head = c;
+            }
+            s->tx_tail = c;
+            if (!s->tx_next) {
+                s->tx_next = c;
+            }
+        }
+        n = sizeof(c->data) - c->len;
+        if (n > (size_t)len - done) {
+            n = (size_t)len - done;
+        }
+        memcpy(c->data + c->len, in + done, n);
+        c->len += n;
+        done += n;
+    }
+    s->tx_bytes += done;
+    stream_todo(s);
+    return (int)done;
+}
+
+static long uring_bio_ctrl(BIO *b, int cmd, long num, void *ptr)
+{
+    tls_uring_stream_t *s = BIO_get_data(b);
+    
+    (void)num;
+    (void)ptr;
+    switch (cmd) {
+    case BIO_CTRL_FLUSH:
+        return 1;               /* sends leave with the next wait */
+    case BIO_CTRL_PENDING:
+        return s->rx_count ? (long)(s->rx_len[s->rx_head] - s->rx_off) : 0;
+    case BIO_CTRL_WPENDING:
+        return (long)s->tx_bytes;
+    case BIO_CTRL_EOF:
+        return s->rx_eof && !s->rx_count;
+    default:
+        return 0;
+    }
+}
+
+static int uring_bio_create(BIO *b)
+{
+    BIO_set_init(b, 1);
+    return 1;
+}
+
+static void uring_bio_method_init(void)
+{
+    BIO_METHOD *m = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "io_uring stream");
+    
+    if (m && BIO_meth_set_read(m, uring_bio_read) && BIO_meth_set_write(m, uring_bio_write) &&
+        BIO_meth_set_ctrl(m, uring_bio_ctrl) && BIO_meth_set_create(m, uring_bio_create)) {
+        tls_uring_bio_method = m;
+    } else {
+        BIO_meth_free(m);
+    }
+}
+
+/* A BIO for SSL_set_bio(ssl, bio, bio); the SSL frees it */
+BIO *tls_uring_bio_new(tls_uring_stream_t *s)
+{
+    BIO *bio;
+    
+    pthread_once(&tls_uring_bio_once, uring_bio_method_init);
+    if (!tls_uring_bio_method || !(bio = BIO_new(tls_uring_bio_method))) {
+        return NULL;
+    }
+    BIO_set_data(bio, s);
+    return bio;
+}
+
+void tls_uring_print_stats(FILE *fp)
+{
+    fprintf(fp, "io_uring: %llu enters, %llu completions, %llu accepts, %llu bytes in, "
+            "%llu bytes out in %llu chains, %llu rearms (%llu out of buffers)\n",
+            (unsigned long long)__atomic_load_n(&tls_uring_stats.enters, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&tls_uring_stats.completions, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&tls_uring_stats.accepts, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&tls_uring_stats.recv_bytes, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&tls_uring_stats.send_bytes, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&tls_uring_stats.send_chains, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&tls_uring_stats.rearms, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&tls_uring_stats.no_buffers, __ATOMIC_RELAXED));
+}
@@ -10,6 +10,11 @@ echo "Configuring firewall..."
 ./firewall/iptables_rules.sh
 nft -f ./firewall/nftables_rules.nft
 
+# Drop blocklisted, denied and flooding sources in the driver, ahead of nftables
+echo "Loading XDP pre-filter..."
+(cd ./firewall/xdp && nohup ./xdp_loader "${GATEWAY_IFACE:-eth0}" ../acl_rules.json 2000 4000 \
+    > /var/log/xdp_prefilter.log 2>&1 &)
+
 # Setup WireGuard
 echo "Setting up WireGuard..."
 ./vpn/wireguard/setup_wireguard.sh
@@ -25,12 +30,17 @@ echo "Setting up OpenVPN..."
 # Setup Snort
 echo "Configuring Snort..."
 cp ids_ips/snort/snort.conf /etc/snort/
-mkdir -p /etc/snort/rules
-cp ids_ips/snort/rules/*.rules /etc/snort/rules/
 
 # Setup Suricata
 echo "Configuring Suricata..."
 cp ids_ips/suricata/suricata.yaml /etc/suricata/
 
+# Same IoT rules for both engines
+./ids_ips/update_rules.sh
+
+# Workers pinned to every core but 0, flows fanned out by hash
+echo "Starting IDS..."
+./ids_ips/start_ids.sh "${IDS_MODE:-suricata-afpacket}" "${GATEWAY_IFACE:-eth0}"
+
 echo "Gateway setup complete!"
 
@@ -20,6 +20,11 @@ cd ..
 
 # Fuzzing
 echo "3. Fuzzing..."
+# Seed corpora first, so a parser regression fails fast
+fuzzing/harness/build.sh replay
+for t in http cpio coap telemetry firmware; do
+    fuzzing/harness/out/${t}_replay fuzzing/harness/out/corpus/$t/*
+done
 cd fuzzing/afl
 ./run_afl.sh &
 FUZZ_PID=$!
@@ -1,22 +1,20 @@
 #!/bin/bash
-# Run AFL fuzzer
+# Run AFL++ on one of the harnesses
+#
+# Usage: run_afl.sh [target]
+# Targets: http cpio coap telemetry firmware (default firmware)
 
 set -e
 
-INPUT_DIR="afl_input"
-OUTPUT_DIR="afl_output"
-TARGET="./fuzz_target"
+HARNESS="$(cd "$(dirname "$0")/../harness" && pwd)"
+TARGET="${1:-firmware}"
+OUTPUT_DIR="afl_output_$TARGET"
 
-# Create input directory with sample files
-mkdir -p $INPUT_DIR
-echo -n "FIRM" > $INPUT_DIR/sample1.bin
-printf "\x01\x00\x00\x00" >> $INPUT_DIR/sample1.bin  # version
-printf "\x10\x00\x00\x00" >> $INPUT_DIR/sample1.bin  # size
-printf "\x00\x00\x00\x00" >> $INPUT_DIR/sample1.bin  # checksum
+# Persistent-mode binary and the matching custom mutator
+"$HARNESS/build.sh" afl "$TARGET"
 
-# Build with AFL
-afl-gcc -o $TARGET fuzz_target.c
-
-# Run fuzzer
-afl-fuzz -i $INPUT_DIR -o $OUTPUT_DIR -- $TARGET @@
+# The custom mutator runs alongside AFL's own havoc stage
+export AFL_CUSTOM_MUTATOR_LIBRARY="$HARNESS/out/${TARGET}_mutator.so"
 
+# Run fuzzer; inputs come over shared memory, not a file
+afl-fuzz -i "$HARNESS/out/corpus/$TARGET" -o $OUTPUT_DIR -- "$HARNESS/out/${TARGET}_afl"
@@ -0,0 +1,64 @@
+#!/bin/bash
+# Build the fuzz harnesses and their seed corpora
+#
+# Usage: build.sh [libfuzzer|afl|replay] [target...]
+#
+#   libfuzzer  clang -fsanitize=fuzzer,address: out/<target>_libfuzzer
+#   afl        afl-clang-fast persistent-mode binary out/<target>_afl and
+#              the custom mutator out/<target>_mutator.so
+#   replay     plain gcc with ASan/UBSan: out/<target>_replay runs the
+#              files it is given, for corpus regression runs and crashes
+#
+# Targets: http cpio coap telemetry firmware (all by default). The kernel
+# sources are built against kernel_shim.h through a generated include
+# tree, and SentinelHook's record.h against windows_shim.h.
+
+set -e
+
+HERE="$(cd "$(dirname "$0")" && pwd)"
+OUT="$HERE/out"
+MODE="${1:-libfuzzer}"
+shift || true
+TARGETS="${*:-http cpio coap telemetry firmware}"
+
+CFLAGS="-g -O1 -D_GNU_SOURCE -Wall -Wno-unused-function -Wno-unused-variable -I$OUT/include -I$HERE"
+SANITIZE="-fsanitize=address,undefined -fno-sanitize-recover=undefined"
+
+mkdir -p "$OUT/include/linux/decompress" "$OUT/include/asm"
+
+# <linux/*.h> and friends all resolve to the shim. Not <linux/errno.h>:
+# the C library's <errno.h> includes the real one.
+for h in module kernel tcp string ctype udp inet skbuff init fs fs_types slab vmalloc \
+         cpio initramfs hashtable stringhash refcount overflow decompress/generic; do
+    echo '#include "kernel_shim.h"' > "$OUT/include/linux/$h.h"
+done
+echo '#include "kernel_shim.h"' > "$OUT/include/asm/unaligned.h"
+echo '#include "windows_shim.h"' > "$OUT/include/windows.h"
+
+python3 "$HERE/gen_corpus.py" "$OUT/corpus"
+
+for t in $TARGETS; do
+    src="$HERE/fuzz_$t.c"
+    libs=""
+    [ "$t" = firmware ] && libs="-pthread"
+
+    case "$MODE" in
+    libfuzzer)
+        clang $CFLAGS -DFUZZ_LIBFUZZER -fsanitize=fuzzer,address,undefined \
+              -o "$OUT/${t}_libfuzzer" "$src" $libs
+        ;;
+    afl)
+        AFL_USE_ASAN=1 afl-clang-fast $CFLAGS -o "$OUT/${t}_afl" "$src" $libs
+        clang $CFLAGS -DFUZZ_AFL_MUTATOR -O2 -shared -fPIC \
+              -o "$OUT/${t}_mutator.so" "$src" $libs
+        ;;
+    replay)
+        gcc $CFLAGS $SANITIZE -o "$OUT/${t}_replay" "$src" $libs
+        ;;
+    *)
+        echo "Unknown mode: $MODE" >&2
+        exit 1
+        ;;
+    esac
+    echo "  built $t ($MODE)"
+done
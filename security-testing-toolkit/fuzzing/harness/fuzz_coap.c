@@ -0,0 +1,272 @@
+/*
+ * CoAP message decoding harness: coap_parse() and the option readers
+ *
+ * The input is one datagram. A message coap_parse() accepts must keep
+ * token, options and payload inside the datagram, and its options must
+ * iterate in ascending order. Option values go through the integer and
+ * Block readers, the Uri-Path segments are sent back through
+ * coap_send_get() to exercise the encoder with hostile strings, and the
+ * message is re-encoded with the coap_writer: since the wire encoding of
+ * options is canonical, a re-encoding of every option must match the
+ * original bytes exactly.
+ *
+ * The mutator decodes to a list of options and re-encodes after adding,
+ * dropping or resizing one, so inputs keep a valid header and delta
+ * chain and the option values themselves get fuzzed.
+ */
+
+#include "fuzz_common.h"
+#include "../../../networking_iot/coap_protocol.c"
+
+#define COAP_FUZZ_MAX_OPTIONS 64
+#define COAP_FUZZ_MAX_DATAGRAM 65507
+
+static void coap_fuzz_check_inside(const u8 *data, size_t size, const u8 *p, size_t len)
+{
+    FUZZ_CHECK(p >= data && len <= size && p - data <= (ptrdiff_t)(size - len));
+}
+
+static void coap_fuzz_send_path(const struct coap_msg *msg)
+{
+    struct sockaddr_in server = { .sin_family = AF_INET };
+    struct coap_option_iter it;
+    struct coap_option opt;
+    struct coap_block block = { .szx = COAP_BLOCK_SZX_MAX };
+    char uri[COAP_MAX_MESSAGE + 1];
+    size_t len = 0;
+    int ret;
+    
+    coap_option_iter_init(&it, msg);
+    while (coap_option_next(&it, &opt)) {
+        if (opt.number == COAP_OPTION_URI_PATH && len + 1 + opt.len < sizeof(uri)) {
+            uri[len++] = '/';
+            memcpy(uri + len, opt.value, opt.len);
+            len += opt.len;
+        }
+    }
+    uri[len] = '\0';
+    coap_get_block(msg, COAP_OPTION_BLOCK2, &block);
+    
+    ret = coap_send_get(&server, uri, msg->type == COAP_TYPE_CON ? COAP_OBSERVE_REGISTER : -1,
+                        block.num, block.szx, msg->token, msg->token_len);
+    FUZZ_CHECK(!ret || ret == -EINVAL || ret == -EMSGSIZE);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    struct coap_msg msg;
+    struct coap_option_iter it;
+    struct coap_option opt, first;
+    struct coap_block block;
+    struct coap_writer w;
+    u8 *out;
+    u32 value;
+    int last = -1;
+    
+    // Option lengths are 16 bits: nothing larger fits in a UDP datagram
+    if (size > COAP_FUZZ_MAX_DATAGRAM || coap_parse(&msg, data, size)) {
+        return 0;
+    }
+    
+    coap_fuzz_check_inside(data, size, msg.token, msg.token_len);
+    coap_fuzz_check_inside(data, size, msg.options, msg.options_len);
+    FUZZ_CHECK(msg.token_len <= COAP_MAX_TOKEN);
+    if (msg.payload) {
+        FUZZ_CHECK(msg.payload_len > 0 && msg.payload == msg.options + msg.options_len + 1);
+        coap_fuzz_check_inside(data, size, msg.payload, msg.payload_len);
+    } else {
+        FUZZ_CHECK(msg.options + msg.options_len == data + size);
+    }
+    
+    out = malloc(size + 16);
+    if (!out) {
+        abort();
+    }
+    coap_writer_init(&w, out, size + 16);
+    coap_write_header(&w, msg.type, msg.code, msg.message_id, msg.token, msg.token_len);
+    
+    coap_option_iter_init(&it, &msg);
+    while (coap_option_next(&it, &opt)) {
+        coap_fuzz_check_inside(msg.options, msg.options_len, opt.value, opt.len);
+        FUZZ_CHECK((int)opt.number >= last);
+        last = opt.number;
+        if (!coap_option_uint(&opt, &value)) {
+            FUZZ_CHECK(opt.len <= 4 && (opt.len == 4 || value >> (8 * opt.len) == 0));
+        }
+        FUZZ_CHECK(coap_find_option(&msg, opt.number, &first) && first.number == opt.number);
+        FUZZ_CHECK(first.value <= opt.value);
+        coap_write_option(&w, opt.number, opt.value, opt.len);
+    }
+    if (!coap_get_block(&msg, COAP_OPTION_BLOCK1, &block)) {
+        FUZZ_CHECK(block.szx < 7 && block.num < 1 << 20);
+        FUZZ_CHECK(coap_block_size(block.szx) <= 1024);
+    }
+    if (!coap_get_block(&msg, COAP_OPTION_BLOCK2, &block)) {
+        FUZZ_CHECK(block.szx < 7 && block.num < 1 << 20);
+    }
+    
+    // Canonical encoding: every option written back is the original bytes
+    FUZZ_CHECK(!w.error);
+    if (w.len == 4 + msg.token_len + msg.options_len) {
+        FUZZ_CHECK(!memcmp(out, data, w.len));
+        if (msg.payload_len <= COAP_MAX_PAYLOAD) {
+            coap_write_payload(&w, msg.payload, msg.payload_len);
+            FUZZ_CHECK(!w.error && w.len == size && !memcmp(out, data, size));
+        }
+    }
+    free(out);
+    
+    coap_fuzz_send_path(&msg);
+    return 0;
+}
+
+/* Mutator */
+
+struct coap_fuzz_option {
+    u32 number;
+    u32 len;
+    const u8 *value;
+};
+
+static const u16 coap_fuzz_numbers[] = {
+    1, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 17, 20, 23, 27, 28, 35, 39, 60, 258, 268, 269, 2048,
+    65535,
+};
+
+static const u16 coap_fuzz_lengths[] = { 0, 1, 2, 3, 4, 5, 12, 13, 14, 268, 269, 270 };
+
+static void coap_fuzz_put_ext(struct fuzz_buf *out, u32 v)
+{
+    if (v >= 269) {
+        fuzz_put_byte(out, (v - 269) >> 8);
+        fuzz_put_byte(out, v - 269);
+    } else if (v >= 13) {
+        fuzz_put_byte(out, v - 13);
+    }
+}
+
+static u8 coap_fuzz_nibble(u32 v)
+{
+    return v < 13 ? v : v < 269 ? 13 : 14;
+}
+
+static int coap_fuzz_cmp(const void *a, const void *b)
+{
+    const struct coap_fuzz_option *x = a, *y = b;
+    
+    return (x->number > y->number) - (x->number < y->number);
+}
+
+static size_t fuzz_mutate(uint8_t *data, size_t size, size_t max, uint32_t seed)
+{
+    u8 scratch[512];
+    struct coap_fuzz_option opts[COAP_FUZZ_MAX_OPTIONS + 1];
+    struct coap_option_iter it;
+    struct coap_option opt;
+    struct coap_msg msg;
+    struct fuzz_buf out;
+    const u8 *payload;
+    size_t payload_len, n = 0, i;
+    uint32_t rng = seed;
+    u8 hdr[4], token[15], token_len;
+    u32 prev = 0, a;
+    int op = fuzz_below(&rng, 8);
+    
+    if (op == 7 || coap_parse(&msg, data, size) || fuzz_buf_init(&out, max)) {
+        return fuzz_mutate_bytes(data, size, max, &rng);
+    }
+    memcpy(hdr, data, 4);
+    token_len = msg.token_len;
+    memcpy(token, msg.token, token_len);
+    payload = msg.payload;
+    payload_len = msg.payload_len;
+    
+    coap_option_iter_init(&it, &msg);
+    while (n < COAP_FUZZ_MAX_OPTIONS && coap_option_next(&it, &opt)) {
+        opts[n].number = opt.number;
+        opts[n].len = opt.len;
+        opts[n].value = opt.value;
+        n++;
+    }
+    for (i = 0; i < sizeof(scratch); i++)
+        scratch[i] = fuzz_rand(&rng);
+    a = fuzz_below(&rng, n);
+    
+    switch (op) {
+    case 0:
+        if (n < COAP_FUZZ_MAX_OPTIONS) {
+            opts[n].number = coap_fuzz_numbers[fuzz_below(&rng, ARRAY_SIZE(coap_fuzz_numbers))];
+            opts[n].len = coap_fuzz_lengths[fuzz_below(&rng, ARRAY_SIZE(coap_fuzz_lengths))];
+            opts[n].value = scratch;
+            n++;
+        }
+        break;
+    case 1:
+        if (n) {
+            memmove(&opts[a], &opts[a + 1], (n - a - 1) * sizeof(opts[0]));
+            n--;
+        }
+        break;
+    case 2:
+        if (n) {
+            // New length at an encoding boundary, value from scratch if it grows
+            u32 len = coap_fuzz_lengths[fuzz_below(&rng, ARRAY_SIZE(coap_fuzz_lengths))];
+            if (len > opts[a].len) {
+                opts[a].value = scratch;
+            }
+            opts[a].len = len;
+        }
+        break;
+    case 3: {
+        // Block1/Block2 with NUM, M and SZX picked apart
+        u32 v = fuzz_below(&rng, 1 << 20) << 4 | fuzz_below(&rng, 2) << 3 | fuzz_below(&rng, 8);
+        scratch[0] = v >> 16;
+        scratch[1] = v >> 8;
+        scratch[2] = v;
+        if (n < COAP_FUZZ_MAX_OPTIONS) {
+            opts[n].number = fuzz_below(&rng, 2) ? COAP_OPTION_BLOCK2 : COAP_OPTION_BLOCK1;
+            opts[n].len = 1 + fuzz_below(&rng, 3);
+            opts[n].value = scratch + 3 - opts[n].len;
+            n++;
+        }
+        break;
+    }
+    case 4:
+        token_len = fuzz_below(&rng, 16);
+        memcpy(token, scratch, sizeof(token));
+        break;
+    case 5:
+        if (payload_len && fuzz_below(&rng, 2)) {
+            payload = NULL;
+            payload_len = 0;
+        } else {
+            payload = scratch;
+            payload_len = fuzz_below(&rng, 3) ? 1 + fuzz_below(&rng, sizeof(scratch) - 1) : 0;
+        }
+        break;
+    case 6:
+        hdr[0] ^= 1u << (4 + fuzz_below(&rng, 4));    // version or type
+        hdr[1] = fuzz_rand(&rng);
+        break;
+    }
+    
+    qsort(opts, n, sizeof(opts[0]), coap_fuzz_cmp);
+    hdr[0] = (hdr[0] & 0xf0) | (token_len & 0x0f);
+    fuzz_put(&out, hdr, 4);
+    fuzz_put(&out, token, min_t(size_t, token_len, sizeof(token)));
+    for (i = 0; i < n; i++) {
+        u32 delta = opts[i].number - prev;
+        
+        fuzz_put_byte(&out, coap_fuzz_nibble(delta) << 4 | coap_fuzz_nibble(opts[i].len));
+        coap_fuzz_put_ext(&out, delta);
+        coap_fuzz_put_ext(&out, opts[i].len);
+        fuzz_put(&out, opts[i].value, opts[i].len);
+        prev = opts[i].number;
+    }
+    if (payload) {
+        fuzz_put_byte(&out, COAP_PAYLOAD_MARKER);
+        fuzz_put(&out, payload, payload_len);
+    }
+    
+    return fuzz_commit(data, &out);
+}
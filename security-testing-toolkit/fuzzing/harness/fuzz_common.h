@@ -0,0 +1,274 @@
+/*
+ * Common driver for the in-process fuzz harnesses
+ *
+ * Each harness defines LLVMFuzzerTestOneInput() and a format-aware
+ * fuzz_mutate(), then includes this file. One source builds four ways
+ * (see build.sh):
+ *
+ *   FUZZ_LIBFUZZER     linked with -fsanitize=fuzzer; fuzz_mutate() is
+ *                      LLVMFuzzerCustomMutator()
+ *   afl-clang-fast     persistent mode: __AFL_LOOP over the shared
+ *                      memory test case, no fork or exec per input
+ *   FUZZ_AFL_MUTATOR   shared object for AFL_CUSTOM_MUTATOR_LIBRARY,
+ *                      exporting fuzz_mutate() as afl_custom_fuzz()
+ *   (none)             replays the files named on the command line, for
+ *                      regression runs of a corpus or a crash
+ *
+ * Inputs must stay valid only for the duration of one call; harnesses
+ * reset all the state they touched before returning.
+ */
+
+#ifndef FUZZ_COMMON_H
+#define FUZZ_COMMON_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/* Rewrite data in place into a new input of at most max bytes */
+static size_t fuzz_mutate(uint8_t *data, size_t size, size_t max, uint32_t seed);
+
+/* Something the parser got wrong rather than input it rejected */
+#define FUZZ_CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            abort(); \
+        } \
+    } while (0)
+
+/* xorshift32, for mutators that must be reproducible from their seed */
+static inline uint32_t fuzz_rand(uint32_t *state)
+{
+    uint32_t x = *state ? *state : 0x9e3779b9;
+    
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static inline uint32_t fuzz_below(uint32_t *state, uint32_t n)
+{
+    return n ? fuzz_rand(state) % n : 0;
+}
+
+/*
+ * Output buffer for mutators that rebuild an input: appends past cap
+ * are dropped, so a rebuild never exceeds the fuzzer's size limit
+ */
+struct fuzz_buf {
+    uint8_t *p;
+    size_t len;
+    size_t cap;
+};
+
+static inline void fuzz_put(struct fuzz_buf *b, const void *data, size_t n)
+{
+    if (n > b->cap - b->len) {
+        n = b->cap - b->len;
+    }
+    if (!n) {
+        return;
+    }
+    memcpy(b->p + b->len, data, n);
+    b->len += n;
+}
+
+static inline void fuzz_puts(struct fuzz_buf *b, const char *s)
+{
+    fuzz_put(b, s, strlen(s));
+}
+
+static inline void fuzz_put_byte(struct fuzz_buf *b, uint8_t c)
+{
+    fuzz_put(b, &c, 1);
+}
+
+/* Copy a rebuilt input back over the fuzzer's buffer */
+static inline size_t fuzz_commit(uint8_t *data, struct fuzz_buf *b)
+{
+    size_t len = b->len;
+    
+    memcpy(data, b->p, len);
+    free(b->p);
+    return len;
+}
+
+static inline int fuzz_buf_init(struct fuzz_buf *b, size_t cap)
+{
+    b->p = malloc(cap ? cap : 1);
+    b->len = 0;
+    b->cap = cap;
+    return b->p ? 0 : -1;
+}
+
+#ifdef FUZZ_LIBFUZZER
+
+size_t LLVMFuzzerMutate(uint8_t *data, size_t size, size_t max);
+
+#define fuzz_mutate_bytes(data, size, max, state) LLVMFuzzerMutate(data, size, max)
+
+size_t LLVMFuzzerCustomMutator(uint8_t *data, size_t size, size_t max, unsigned int seed)
+{
+    return fuzz_mutate(data, size, max, seed);
+}
+
+#else
+
+/* Plain byte-level fallback for when the structure cannot be parsed */
+static size_t fuzz_mutate_bytes(uint8_t *data, size_t size, size_t max, uint32_t *state)
+{
+    size_t pos;
+    
+    if (!size) {
+        if (!max) {
+            return 0;
+        }
+        data[0] = fuzz_rand(state);
+        return 1;
+    }
+    pos = fuzz_below(state, size);
+    switch (fuzz_below(state, 4)) {
+    case 0:
+        data[pos] ^= 1u << fuzz_below(state, 8);
+        break;
+    case 1:
+        data[pos] = fuzz_rand(state);
+        break;
+    case 2:
+        if (size < max) {
+            memmove(data + pos + 1, data + pos, size - pos);
+            data[pos] = fuzz_rand(state);
+            size++;
+        }
+        break;
+    default:
+        memmove(data + pos, data + pos + 1, size - pos - 1);
+        size--;
+        break;
+    }
+    return size;
+}
+
+#endif /* FUZZ_LIBFUZZER */
+
+#if defined(FUZZ_AFL_MUTATOR)
+
+struct fuzz_afl_mutator {
+    uint8_t *buf;
+    size_t cap;
+    uint32_t seed;
+};
+
+void *afl_custom_init(void *afl, unsigned int seed)
+{
+    struct fuzz_afl_mutator *m = calloc(1, sizeof(*m));
+    
+    (void)afl;
+    if (m) {
+        m->seed = seed;
+    }
+    return m;
+}
+
+size_t afl_custom_fuzz(void *data, uint8_t *in, size_t size, uint8_t **out,
+                       uint8_t *add_buf, size_t add_size, size_t max)
+{
+    struct fuzz_afl_mutator *m = data;
+    
+    (void)add_buf;
+    (void)add_size;
+    if (max > m->cap) {
+        uint8_t *buf = realloc(m->buf, max);
+        if (!buf) {
+            *out = in;
+            return size;
+        }
+        m->buf = buf;
+        m->cap = max;
+    }
+    if (size > max) {
+        size = max;
+    }
+    memcpy(m->buf, in, size);
+    *out = m->buf;
+    return fuzz_mutate(m->buf, size, max, fuzz_rand(&m->seed));
+}
+
+void afl_custom_deinit(void *data)
+{
+    struct fuzz_afl_mutator *m = data;
+    
+    free(m->buf);
+    free(m);
+}
+
+#elif defined(__AFL_FUZZ_TESTCASE_LEN)
+
+__AFL_FUZZ_INIT();
+
+int main(void)
+{
+    uint8_t *copy = NULL;
+    
+    __AFL_INIT();
+    uint8_t *buf = __AFL_FUZZ_TESTCASE_BUF;
+    
+    while (__AFL_LOOP(100000)) {
+        size_t len = __AFL_FUZZ_TESTCASE_LEN;
+        
+        /* An exact-size copy, so reading past the end is caught */
+        free(copy);
+        copy = malloc(len ? len : 1);
+        if (!copy) {
+            return 1;
+        }
+        memcpy(copy, buf, len);
+        LLVMFuzzerTestOneInput(copy, len);
+    }
+    free(copy);
+    return 0;
+}
+
+#elif !defined(FUZZ_LIBFUZZER)
+
+int main(int argc, char **argv)
+{
+    int i;
+    
+    for (i = 1; i < argc; i++) {
+        FILE *fp = fopen(argv[i], "rb");
+        uint8_t *data;
+        long size;
+        
+        if (!fp) {
+            fprintf(stderr, "%s: cannot open\n", argv[i]);
+            return 1;
+        }
+        fseek(fp, 0, SEEK_END);
+        size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        data = malloc(size > 0 ? size : 1);
+        if (!data || fread(data, 1, size, fp) != (size_t)size) {
+            fclose(fp);
+            free(data);
+            return 1;
+        }
+        fclose(fp);
+        
+        LLVMFuzzerTestOneInput(data, size);
+        free(data);
+    }
+    printf("%d inputs replayed\n", argc - 1);
+    return 0;
+}
+
+#endif
+
+#endif /* FUZZ_COMMON_H */
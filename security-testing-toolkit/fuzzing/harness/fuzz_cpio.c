@@ -0,0 +1,332 @@
+/*
+ * initramfs cpio harness: parse_cpio_header() and the extractor behind it
+ *
+ * The input is an uncompressed initramfs image: newc archives, possibly
+ * several, with zero padding between them. It is unpacked twice, once
+ * whole through initramfs_unpack() and once fed to cpio_write() in
+ * random-sized pieces the way the decompressor flushes it. Each run
+ * must leave a consistent file table (unique names, hardlinks sharing
+ * one blob, the data total matching), and when the whole image unpacks
+ * the piecewise run must produce the same files. Everything is freed
+ * between inputs, so a refcount slip shows up as a leak or a
+ * use-after-free.
+ *
+ * The mutator works on parsed entries (header fields, name, data) and
+ * re-serializes them with correct padding, so it can make hardlink
+ * groups, duplicate names and extra archives instead of mostly breaking
+ * the hex header.
+ */
+
+#include "fuzz_common.h"
+#include "../../../boot_architecture/initramfs_rootfs.c"
+
+#define CPIO_FUZZ_MAX_FILES 64
+
+struct cpio_fuzz_file {
+    char *name;
+    umode_t mode;
+    size_t size;
+    u32 data_hash;
+};
+
+struct cpio_fuzz_table {
+    int result;
+    size_t count;
+    struct cpio_fuzz_file files[CPIO_FUZZ_MAX_FILES];
+};
+
+static u32 cpio_fuzz_hash(const void *data, size_t len)
+{
+    return full_name_hash(NULL, data, len);
+}
+
+// Check the file table and keep a copy of its first entries
+static void cpio_fuzz_snapshot(struct cpio_fuzz_table *t, int result)
+{
+    struct initramfs_entry *entry;
+    struct initramfs_blob *blobs[CPIO_FUZZ_MAX_FILES];
+    size_t nblobs = 0, total = 0, count = 0, i;
+    
+    memset(t, 0, sizeof(*t));
+    t->result = result;
+    list_for_each_entry(entry, &initramfs_entries, list) {
+        FUZZ_CHECK(initramfs_find(entry->name) == entry);
+        FUZZ_CHECK(!entry->blob || (entry->data == entry->blob->data &&
+                                    entry->size == entry->blob->size));
+        FUZZ_CHECK(entry->blob || !entry->size);
+        if (entry->blob) {
+            for (i = 0; i < nblobs && blobs[i] != entry->blob; i++)
+                ;
+            if (i == nblobs && nblobs < CPIO_FUZZ_MAX_FILES) {
+                blobs[nblobs++] = entry->blob;
+                total += entry->blob->size;
+            }
+        }
+        if (count < CPIO_FUZZ_MAX_FILES) {
+            struct cpio_fuzz_file *f = &t->files[count];
+            
+            f->name = strdup(entry->name);
+            f->mode = entry->mode;
+            f->size = entry->size;
+            f->data_hash = entry->size ? cpio_fuzz_hash(entry->data, entry->size) : 0;
+        }
+        count++;
+    }
+    FUZZ_CHECK(count == initramfs_entry_count);
+    FUZZ_CHECK(initramfs_size <= MAX_INITRAMFS_SIZE);
+    if (nblobs < CPIO_FUZZ_MAX_FILES) {
+        // Blobs of replaced files can outlive them through a link group,
+        // but only until the links are dropped, which every run ends with
+        FUZZ_CHECK(result || total == initramfs_size);
+    }
+    t->count = min_t(size_t, count, CPIO_FUZZ_MAX_FILES);
+}
+
+static void cpio_fuzz_free(struct cpio_fuzz_table *t)
+{
+    size_t i;
+    
+    for (i = 0; i < t->count; i++)
+        free(t->files[i].name);
+}
+
+static void cpio_fuzz_reset(void)
+{
+    struct initramfs_entry *entry, *tmp;
+    
+    kfree(cpio.name);
+    cpio_free_links();
+    list_for_each_entry_safe(entry, tmp, &initramfs_entries, list) {
+        initramfs_remove(entry);
+    }
+    FUZZ_CHECK(!initramfs_entry_count && !initramfs_size);
+    memset(&cpio, 0, sizeof(cpio));
+}
+
+// As cpio_flush() gets it from a decompressor, in pieces
+static int cpio_fuzz_pieces(const uint8_t *data, size_t size, uint32_t seed)
+{
+    size_t pos = 0;
+    int ret = 0;
+    
+    memset(&cpio, 0, sizeof(cpio));
+    while (pos < size) {
+        size_t n = min_t(size_t, 1 + fuzz_below(&seed, 300), size - pos);
+        
+        if (cpio_write(&cpio, (const char *)data + pos, n, false) != (long)n) {
+            ret = -1;
+            break;
+        }
+        pos += n;
+    }
+    if (!ret && (cpio.state != CPIO_START || cpio.have)) {
+        ret = -1;
+    }
+    kfree(cpio.name);
+    cpio.name = NULL;
+    cpio_free_links();
+    return ret;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static struct cpio_fuzz_table whole, pieces;
+    uint32_t seed = 1;
+    size_t i;
+    
+    for (i = 0; i < size; i++)
+        seed = seed * 31 + data[i];
+    
+    cpio_fuzz_snapshot(&whole, initramfs_unpack((const char *)data, size));
+    cpio_fuzz_reset();
+    cpio_fuzz_snapshot(&pieces, cpio_fuzz_pieces(data, size, seed | 1));
+    cpio_fuzz_reset();
+    
+    if (!whole.result) {
+        FUZZ_CHECK(!pieces.result && whole.count == pieces.count);
+        for (i = 0; i < whole.count; i++) {
+            FUZZ_CHECK(!strcmp(whole.files[i].name, pieces.files[i].name));
+            FUZZ_CHECK(whole.files[i].mode == pieces.files[i].mode);
+            FUZZ_CHECK(whole.files[i].size == pieces.files[i].size);
+            FUZZ_CHECK(whole.files[i].data_hash == pieces.files[i].data_hash);
+        }
+    }
+    cpio_fuzz_free(&whole);
+    cpio_fuzz_free(&pieces);
+    return 0;
+}
+
+/* Mutator */
+
+struct cpio_fuzz_entry {
+    u32 f[CPIO_FIELDS];
+    char magic[6];
+    const uint8_t *name;            // namesize bytes as they were
+    size_t name_len;
+    const uint8_t *data;
+    size_t data_len;
+    bool trailer_after;             // end the archive here, then zero padding
+};
+
+static const char *const cpio_fuzz_names[] = {
+    "TRAILER!!!", "/root", "init", "dev/console", "a/../../etc/passwd", "", ".",
+};
+
+static size_t cpio_fuzz_parse(const uint8_t *data, size_t size, struct cpio_fuzz_entry *e,
+                              size_t max, size_t *tail)
+{
+    size_t pos = 0, n = 0;
+    int i, j;
+    
+    while (n < max) {
+        size_t start;
+        
+        while (pos < size && !data[pos]) {
+            pos++;
+        }
+        start = pos;
+        if (size - pos < CPIO_HEADER_SIZE || memcmp(data + pos, "07070", 5)) {
+            break;
+        }
+        memcpy(e[n].magic, data + pos, 6);
+        for (i = 0; i < CPIO_FIELDS; i++) {
+            u32 v = 0;
+            for (j = 0; j < 8; j++)
+                v = v << 4 | (cpio_hex[data[pos + 6 + i * 8 + j]] & 0x0f);
+            e[n].f[i] = v;
+        }
+        pos += CPIO_HEADER_SIZE;
+        e[n].name = data + pos;
+        e[n].name_len = min_t(size_t, e[n].f[CPIO_NAMESIZE], size - pos);
+        pos += e[n].name_len;
+        pos = min_t(size_t, start + ((pos - start + 3) & ~(size_t)3), size);
+        e[n].data = data + pos;
+        e[n].data_len = min_t(size_t, e[n].f[CPIO_FILESIZE], size - pos);
+        pos += e[n].data_len;
+        pos = min_t(size_t, start + ((pos - start + 3) & ~(size_t)3), size);
+        e[n].trailer_after = false;
+        n++;
+    }
+    *tail = pos;
+    return n;
+}
+
+static void cpio_fuzz_pad(struct fuzz_buf *out, size_t start)
+{
+    while ((out->len - start) & 3 && out->len < out->cap) {
+        fuzz_put_byte(out, 0);
+    }
+}
+
+static void cpio_fuzz_emit(struct fuzz_buf *out, const struct cpio_fuzz_entry *e)
+{
+    size_t start = out->len;
+    char field[9];
+    int i;
+    
+    fuzz_put(out, e->magic, 6);
+    for (i = 0; i < CPIO_FIELDS; i++) {
+        snprintf(field, sizeof(field), "%08x", e->f[i]);
+        fuzz_put(out, field, 8);
+    }
+    fuzz_put(out, e->name, e->name_len);
+    cpio_fuzz_pad(out, start);
+    fuzz_put(out, e->data, e->data_len);
+    cpio_fuzz_pad(out, start);
+}
+
+static size_t fuzz_mutate(uint8_t *data, size_t size, size_t max, uint32_t seed)
+{
+    static struct cpio_fuzz_entry e[CPIO_FUZZ_MAX_FILES + 1];
+    static const struct cpio_fuzz_entry trailer = {
+        .magic = "070701",
+        .f = { [CPIO_NLINK] = 1, [CPIO_NAMESIZE] = 11 },
+        .name = (const uint8_t *)"TRAILER!!!",
+        .name_len = 11,
+    };
+    uint8_t *names = NULL;
+    struct fuzz_buf out;
+    uint32_t rng = seed;
+    size_t n, tail, i, a, b;
+    int op = fuzz_below(&rng, 9);
+    
+    n = cpio_fuzz_parse(data, size, e, CPIO_FUZZ_MAX_FILES, &tail);
+    if (!n || op == 8 || fuzz_buf_init(&out, max)) {
+        return fuzz_mutate_bytes(data, size, max, &rng);
+    }
+    a = fuzz_below(&rng, n);
+    b = fuzz_below(&rng, n);
+    
+    switch (op) {
+    case 0: {
+        static const u32 nlinks[] = { 0, 1, 2, 3, 0xffffffff };
+        e[a].f[CPIO_NLINK] = nlinks[fuzz_below(&rng, ARRAY_SIZE(nlinks))];
+        break;
+    }
+    case 1:
+        // Data size that disagrees with the data that follows
+        e[a].f[CPIO_FILESIZE] += fuzz_below(&rng, 3) - 1;
+        if (fuzz_below(&rng, 16) == 0) {
+            e[a].f[CPIO_FILESIZE] = MAX_INITRAMFS_SIZE + fuzz_below(&rng, 3) - 1;
+        }
+        break;
+    case 2: {
+        static const u32 modes[] = { S_IFREG | 0644, S_IFDIR | 0755, S_IFLNK | 0777,
+                                     S_IFCHR | 0600, 0 };
+        e[a].f[CPIO_MODE] = modes[fuzz_below(&rng, ARRAY_SIZE(modes))];
+        break;
+    }
+    case 3:
+        // Same name again, later in the stream
+        if (n < CPIO_FUZZ_MAX_FILES) {
+            memmove(&e[b + 1], &e[b], (n - b) * sizeof(e[0]));
+            e[b] = e[a > b ? a + 1 : a];
+            n++;
+        }
+        break;
+    case 4:
+        // Into a's hardlink group, data with one member only
+        e[b].f[CPIO_INO] = e[a].f[CPIO_INO];
+        e[b].f[CPIO_MAJOR] = e[a].f[CPIO_MAJOR];
+        e[b].f[CPIO_MINOR] = e[a].f[CPIO_MINOR];
+        e[b].f[CPIO_MODE] = e[a].f[CPIO_MODE] = S_IFREG | 0755;
+        e[a].f[CPIO_NLINK] = e[b].f[CPIO_NLINK] = 2;
+        if (a != b && fuzz_below(&rng, 2)) {
+            e[b].data_len = 0;
+            e[b].f[CPIO_FILESIZE] = 0;
+        }
+        break;
+    case 5:
+        memmove(&e[a], &e[a + 1], (n - a - 1) * sizeof(e[0]));
+        n--;
+        break;
+    case 6:
+        e[a].trailer_after = true;
+        break;
+    case 7: {
+        const char *name = cpio_fuzz_names[fuzz_below(&rng, ARRAY_SIZE(cpio_fuzz_names))];
+        // The name must outlive e[]; keep it in a scratch copy
+        names = malloc(strlen(name) + 1);
+        if (names) {
+            memcpy(names, name, strlen(name) + 1);
+            e[a].name = names;
+            e[a].name_len = strlen(name) + 1;
+            e[a].f[CPIO_NAMESIZE] = e[a].name_len + (fuzz_below(&rng, 8) ? 0 : 1);
+        }
+        break;
+    }
+    }
+    
+    for (i = 0; i < n; i++) {
+        cpio_fuzz_emit(&out, &e[i]);
+        if (e[i].trailer_after) {
+            cpio_fuzz_emit(&out, &trailer);
+            for (a = fuzz_below(&rng, 3) * 4; a; a--)
+                fuzz_put_byte(&out, 0);
+        }
+    }
+    fuzz_put(&out, data + tail, size - tail);
+    free(names);
+    
+    return fuzz_commit(data, &out);
+}
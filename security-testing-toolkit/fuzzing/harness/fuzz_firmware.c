@@ -0,0 +1,236 @@
+/*
+ * Firmware image harness: the header check, checksum, SHA-256 and
+ * signature scan of firmware_parser.c, run in memory
+ *
+ * The input is a firmware image. parse_firmware() maps a file and
+ * spreads the work over threads in chunks; here the same per-chunk
+ * functions run on the input, cut at split points drawn from it, and
+ * must agree with one pass over the whole: the vectorised checksum with
+ * a byte-at-a-time sum, chunked SHA-256 with a single update, and a
+ * chunked scan (which may read past its range to finish a match) with
+ * a whole-image scan and each match with the signature table.
+ *
+ * The mutator keeps the FIRM header consistent (size, checksum) while
+ * it plants signatures, repeats regions and moves the size field to the
+ * edges of the image.
+ */
+
+#include "fuzz_common.h"
+
+#define main firmware_parser_main
+#include "../../firmware/firmware_parser.c"
+#undef main
+
+#define FW_FUZZ_MAX_SPLITS 8
+
+// Arguments are evaluated twice
+#define FW_FUZZ_MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static void fw_fuzz_init(void)
+{
+    static int done;
+    
+    if (!done) {
+        fw_sig_table_init();
+        done = 1;
+    }
+}
+
+// Up to FW_FUZZ_MAX_SPLITS ascending cut points in [0, len]
+static size_t fw_fuzz_splits(size_t *cuts, size_t len, uint32_t *rng)
+{
+    size_t n = fuzz_below(rng, FW_FUZZ_MAX_SPLITS + 1), i, j;
+    
+    for (i = 0; i < n; i++) {
+        size_t c = len ? fuzz_below(rng, len + 1) : 0;
+        
+        for (j = i; j > 0 && cuts[j - 1] > c; j--)
+            cuts[j] = cuts[j - 1];
+        cuts[j] = c;
+    }
+    cuts[n] = len;
+    return n + 1;
+}
+
+static void fw_fuzz_checksum(const uint8_t *p, size_t len, uint32_t *rng)
+{
+    size_t cuts[FW_FUZZ_MAX_SPLITS + 1], n, i, prev = 0;
+    uint32_t scalar = 0, chunked = 0;
+    
+    for (i = 0; i < len; i++)
+        scalar += p[i];
+    FUZZ_CHECK(checksum_bytes(p, len) == scalar);
+    
+    n = fw_fuzz_splits(cuts, len, rng);
+    for (i = 0; i < n; i++) {
+        chunked += checksum_bytes(p + prev, cuts[i] - prev);
+        prev = cuts[i];
+    }
+    FUZZ_CHECK(chunked == scalar);
+}
+
+static void fw_fuzz_sha256(const uint8_t *p, size_t len, uint32_t *rng)
+{
+    size_t cuts[FW_FUZZ_MAX_SPLITS + 1], n, i, prev = 0;
+    struct sha256_ctx whole, pieces;
+    uint8_t a[32], b[32];
+    
+    sha256_init(&whole);
+    sha256_update(&whole, p, len);
+    sha256_final(&whole, a);
+    
+    sha256_init(&pieces);
+    n = fw_fuzz_splits(cuts, len, rng);
+    for (i = 0; i < n; i++) {
+        sha256_update(&pieces, p + prev, cuts[i] - prev);
+        prev = cuts[i];
+    }
+    sha256_final(&pieces, b);
+    FUZZ_CHECK(!memcmp(a, b, sizeof(a)));
+}
+
+static void fw_fuzz_scan(const uint8_t *p, size_t len, uint32_t *rng)
+{
+    struct fw_match_list whole = { 0 }, chunked = { 0 };
+    size_t cuts[FW_FUZZ_MAX_SPLITS + 1], n, i, prev = 0;
+    
+    FUZZ_CHECK(!scan_signatures(p, len, 0, len, &whole));
+    n = fw_fuzz_splits(cuts, len, rng);
+    for (i = 0; i < n; i++) {
+        FUZZ_CHECK(!scan_signatures(p, len, prev, cuts[i], &chunked));
+        prev = cuts[i];
+    }
+    
+    FUZZ_CHECK(whole.count == chunked.count);
+    for (i = 0; i < whole.count; i++) {
+        const struct fw_match *m = &whole.m[i];
+        const struct fw_sig *sig = &fw_sigs[m->sig];
+        
+        FUZZ_CHECK(m->offset == chunked.m[i].offset && m->sig == chunked.m[i].sig);
+        FUZZ_CHECK(i == 0 || whole.m[i - 1].offset <= m->offset);
+        FUZZ_CHECK(m->offset + sig->len <= len && !memcmp(p + m->offset, sig->magic, sig->len));
+    }
+    free(whole.m);
+    free(chunked.m);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    firmware_header_t hdr;
+    uint32_t rng = size | 1;
+    size_t i;
+    
+    fw_fuzz_init();
+    for (i = 0; i < size && i < 64; i++)
+        rng = rng * 31 + data[i];
+    
+    switch (firmware_header_check(data, size, &hdr)) {
+    case FW_HEADER_OK:
+        FUZZ_CHECK(hdr.magic == FIRMWARE_MAGIC && hdr.size <= size - sizeof(hdr));
+        fw_fuzz_checksum(data + sizeof(hdr), hdr.size, &rng);
+        break;
+    case FW_HEADER_TRUNCATED:
+        FUZZ_CHECK(size >= sizeof(hdr) && hdr.size > size - sizeof(hdr));
+        break;
+    case FW_HEADER_BAD_MAGIC:
+        FUZZ_CHECK(size < sizeof(hdr) || hdr.magic != FIRMWARE_MAGIC);
+        break;
+    }
+    
+    // -s and -x cover the whole file, header or not
+    fw_fuzz_sha256(data, size, &rng);
+    fw_fuzz_scan(data, size, &rng);
+    return 0;
+}
+
+/* Mutator */
+
+static void fw_fuzz_fix_checksum(uint8_t *data, size_t size)
+{
+    firmware_header_t hdr;
+    
+    if (firmware_header_check(data, size, &hdr) == FW_HEADER_OK) {
+        hdr.checksum = checksum_bytes(data + sizeof(hdr), hdr.size);
+        memcpy(data, &hdr, sizeof(hdr));
+    }
+}
+
+static size_t fuzz_mutate(uint8_t *data, size_t size, size_t max, uint32_t seed)
+{
+    firmware_header_t hdr;
+    uint32_t rng = seed;
+    size_t pos, len;
+    int op = fuzz_below(&rng, 6);
+    
+    fw_fuzz_init();
+    if (op == 5 || size < sizeof(hdr)) {
+        size = fuzz_mutate_bytes(data, size, max, &rng);
+        if (fuzz_below(&rng, 2)) {
+            fw_fuzz_fix_checksum(data, size);
+        }
+        return size;
+    }
+    memcpy(&hdr, data, sizeof(hdr));
+    pos = fuzz_below(&rng, size + 1);
+    
+    switch (op) {
+    case 0: {
+        // Plant a signature, overwriting or inserted
+        const struct fw_sig *sig = &fw_sigs[fuzz_below(&rng, FW_SIG_COUNT)];
+            
+        if (fuzz_below(&rng, 2) && size + sig->len <= max) {
+            memmove(data + pos + sig->len, data + pos, size - pos);
+            size += sig->len;
+        }
+        memcpy(data + pos, sig->magic, FW_FUZZ_MIN(sig->len, size - pos));
+        break;
+    }
+    case 1: {
+        // Repeat a region, as padding or a duplicated partition would
+        size_t from = fuzz_below(&rng, size);
+            
+        len = 1 + fuzz_below(&rng, 4096);
+        len = FW_FUZZ_MIN(FW_FUZZ_MIN(len, size - from), max - size);
+        memmove(data + pos + len, data + pos, size - pos);
+        memmove(data + pos, data + from + (from >= pos ? len : 0), len);
+        size += len;
+        break;
+    }
+    case 2: {
+        // Size at the edges of what the image holds
+        static const int deltas[] = { -1, 0, 0, 1 };
+        size_t avail = size - sizeof(hdr);
+            
+        hdr.size = avail + deltas[fuzz_below(&rng, sizeof(deltas) / sizeof(deltas[0]))];
+        if (fuzz_below(&rng, 8) == 0) {
+            hdr.size = fuzz_below(&rng, 2) ? 0 : UINT32_MAX;
+        }
+        memcpy(data, &hdr, sizeof(hdr));
+        break;
+    }
+    case 3:
+        hdr.magic = fuzz_below(&rng, 4) ? FIRMWARE_MAGIC : hdr.magic ^ 1u << fuzz_below(&rng, 32);
+        hdr.version = fuzz_rand(&rng);
+        memcpy(data, &hdr, sizeof(hdr));
+        break;
+    case 4:
+        // Grow or cut the image, then keep the header in step
+        len = fuzz_below(&rng, 2) ? fuzz_below(&rng, 8192) : 0;
+        len = FW_FUZZ_MIN(len, max - size);
+        if (len) {
+            memset(data + size, fuzz_below(&rng, 2) ? 0xff : 0, len);
+            size += len;
+        } else {
+            size = sizeof(hdr) + fuzz_below(&rng, size - sizeof(hdr) + 1);
+        }
+        hdr.size = size - sizeof(hdr);
+        memcpy(data, &hdr, sizeof(hdr));
+        break;
+    }
+    
+    // Usually a valid checksum, so the checksum path runs to the end
+    if (fuzz_below(&rng, 4)) {
+        fw_fuzz_fix_checksum(data, size);
+    }
+    return size;
+}
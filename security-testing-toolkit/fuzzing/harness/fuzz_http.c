@@ -0,0 +1,332 @@
+/*
+ * http_parse_request() harness
+ *
+ * The input is a byte stream of one or more pipelined requests. It is
+ * parsed twice: once with the whole stream in the buffer, and once fed
+ * in random-sized reads, the way a socket delivers it, with consumed
+ * body bytes dropped from the front of the buffer now and then through
+ * http_parser_discard(). Both runs must agree on every request line,
+ * header span, body byte and the final result; the split points come
+ * from the input, so a failure replays exactly.
+ *
+ * The mutator edits requests at the line level (method, version,
+ * framing headers, chunked bodies, bare LFs, pipelining) so inputs keep
+ * getting past the request line.
+ */
+
+#include "fuzz_common.h"
+#include "../../../networking_iot/http_protocol.c"
+
+#define HTTP_FUZZ_MAX_REQUESTS 8
+
+struct http_fuzz_request {
+    struct http_request req;        // spans are absolute stream offsets
+};
+
+struct http_fuzz_trace {
+    int result;
+    size_t consumed;
+    int requests;
+    struct http_fuzz_request r[HTTP_FUZZ_MAX_REQUESTS];
+    uint8_t *body;
+    size_t body_len;
+};
+
+static void http_fuzz_shift(struct http_span *span, size_t shift)
+{
+    span->off += shift;
+}
+
+// Spans of a request just returned, checked and made absolute
+static void http_fuzz_record(struct http_fuzz_trace *t, const struct http_request *req,
+                             const char *buf, size_t len, size_t shift)
+{
+    struct http_request *out = &t->r[t->requests].req;
+    int i;
+    
+    FUZZ_CHECK(req->header_count >= 0 && req->header_count <= HTTP_MAX_HEADERS);
+    FUZZ_CHECK(req->method.off + req->method.len <= len);
+    FUZZ_CHECK(req->uri.off + req->uri.len <= len);
+    FUZZ_CHECK(http_is_token(buf + req->method.off, req->method.len));
+    FUZZ_CHECK(req->uri.len && !memchr(buf + req->uri.off, ' ', req->uri.len));
+    for (i = 0; i < req->header_count; i++) {
+        const struct http_header *h = &req->headers[i];
+        
+        FUZZ_CHECK(h->name.off + h->name.len <= len && h->value.off + h->value.len <= len);
+        FUZZ_CHECK(http_is_token(buf + h->name.off, h->name.len));
+        FUZZ_CHECK(!memchr(buf + h->value.off, '\n', h->value.len));
+    }
+    
+    *out = *req;
+    http_fuzz_shift(&out->method, shift);
+    http_fuzz_shift(&out->uri, shift);
+    for (i = 0; i < out->header_count; i++) {
+        http_fuzz_shift(&out->headers[i].name, shift);
+        http_fuzz_shift(&out->headers[i].value, shift);
+    }
+}
+
+/*
+ * Parse data as it would arrive. With step_seed 0 the whole stream is
+ * there from the start and nothing is discarded.
+ */
+static void http_fuzz_run(const uint8_t *data, size_t size, uint32_t step_seed,
+                          struct http_fuzz_trace *t)
+{
+    struct http_parser p;
+    struct http_request req;
+    struct http_span body;
+    char *buf = malloc(size ? size : 1);
+    size_t shift = 0;               // stream offset of buf[0]
+    size_t avail = step_seed ? 0 : size;
+    bool headers_done = false;
+    int ret;
+    
+    memset(t, 0, sizeof(*t));
+    t->body = malloc(size ? size : 1);
+    if (!buf || !t->body) {
+        abort();
+    }
+    memcpy(buf, data, avail);
+    http_parser_init(&p, &req, 0);
+    
+    for (;;) {
+        ret = http_parse_request(&p, buf, avail - shift, &body);
+        if (ret == -EAGAIN) {
+            size_t n;
+            
+            if (avail == size) {
+                break;
+            }
+            n = min_t(size_t, 1 + fuzz_below(&step_seed, 97), size - avail);
+            memcpy(buf + avail - shift, data + avail, n);
+            avail += n;
+            continue;
+        }
+        if (ret < 0) {
+            break;
+        }
+        
+        FUZZ_CHECK(p.pos <= avail - shift);
+        if (ret == HTTP_PARSE_HEADERS) {
+            FUZZ_CHECK(!headers_done);
+            headers_done = true;
+            http_fuzz_record(t, &req, buf, avail - shift, shift);
+        } else if (ret == HTTP_PARSE_BODY) {
+            FUZZ_CHECK(headers_done && body.len);
+            FUZZ_CHECK(body.off + body.len <= avail - shift);
+            memcpy(t->body + t->body_len, buf + body.off, body.len);
+            t->body_len += body.len;
+            FUZZ_CHECK(t->body_len <= size);
+            
+            // A reader short of memory lets go of what it has used
+            if (step_seed && fuzz_below(&step_seed, 4) == 0) {
+                size_t n = p.pos;
+                
+                memmove(buf, buf + n, avail - shift - n);
+                shift += n;
+                http_parser_discard(&p, n);
+            }
+        } else {
+            FUZZ_CHECK(ret == HTTP_PARSE_DONE && headers_done);
+            t->r[t->requests].req.body_len = req.body_len;
+            FUZZ_CHECK(req.chunked || req.body_len == req.content_length);
+            if (++t->requests == HTTP_FUZZ_MAX_REQUESTS) {
+                break;
+            }
+            headers_done = false;
+            http_parser_init(&p, &req, p.pos);
+        }
+    }
+    
+    t->result = ret;
+    t->consumed = shift + p.pos;
+    free(buf);
+}
+
+static void http_fuzz_compare_span(const struct http_span *a, const struct http_span *b)
+{
+    FUZZ_CHECK(a->off == b->off && a->len == b->len);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    struct http_fuzz_trace *whole = malloc(sizeof(*whole));
+    struct http_fuzz_trace *split = malloc(sizeof(*split));
+    uint32_t seed = 1;
+    size_t i;
+    int r, h;
+    
+    if (!whole || !split) {
+        abort();
+    }
+    for (i = 0; i < size; i++)
+        seed = seed * 31 + data[i];
+    
+    http_fuzz_run(data, size, 0, whole);
+    http_fuzz_run(data, size, seed | 1, split);
+    
+    FUZZ_CHECK(whole->result == split->result);
+    FUZZ_CHECK(whole->requests == split->requests);
+    FUZZ_CHECK(whole->body_len == split->body_len);
+    FUZZ_CHECK(!memcmp(whole->body, split->body, whole->body_len));
+    FUZZ_CHECK(whole->consumed == split->consumed);
+    for (r = 0; r < whole->requests; r++) {
+        const struct http_request *a = &whole->r[r].req, *b = &split->r[r].req;
+        
+        http_fuzz_compare_span(&a->method, &b->method);
+        http_fuzz_compare_span(&a->uri, &b->uri);
+        FUZZ_CHECK(a->version_minor == b->version_minor);
+        FUZZ_CHECK(a->header_count == b->header_count);
+        for (h = 0; h < a->header_count; h++) {
+            http_fuzz_compare_span(&a->headers[h].name, &b->headers[h].name);
+            http_fuzz_compare_span(&a->headers[h].value, &b->headers[h].value);
+        }
+        FUZZ_CHECK(a->content_length == b->content_length);
+        FUZZ_CHECK(a->chunked == b->chunked && a->keep_alive == b->keep_alive);
+        FUZZ_CHECK(a->body_len == b->body_len);
+    }
+    
+    free(whole->body);
+    free(split->body);
+    free(whole);
+    free(split);
+    return 0;
+}
+
+/* Mutator */
+
+static const char *const http_fuzz_methods[] = {
+    "GET", "POST", "PUT", "DELETE", "HEAD", "OPTIONS", "PATCH", "M-SEARCH", "G T", "",
+};
+
+static const char *const http_fuzz_versions[] = {
+    "HTTP/1.0", "HTTP/1.1", "HTTP/1.2", "HTTP/2.0", "http/1.1", "HTTP/1.",
+};
+
+static const char *const http_fuzz_headers[] = {
+    "Content-Length: 0",
+    "Content-Length: 5",
+    "Content-Length: 18446744073709551615",
+    "Content-Length: 18446744073709551616",
+    "Content-Length:  7 ",
+    "Transfer-Encoding: chunked",
+    "Transfer-Encoding: gzip, chunked",
+    "transfer-encoding: CHUNKED",
+    "Connection: close",
+    "Connection: keep-alive",
+    "Host: device.local",
+    " folded",
+    "Bad Name: x",
+    ": empty",
+};
+
+struct http_fuzz_line {
+    const uint8_t *p;
+    size_t len;
+};
+
+#define HTTP_FUZZ_MAX_LINES 64
+
+// Re-encode body as chunks of random sizes, with the odd extension
+static void http_fuzz_chunk(struct fuzz_buf *out, const uint8_t *body, size_t len, uint32_t *rng)
+{
+    char line[32];
+    
+    while (len) {
+        size_t n = min_t(size_t, len, 1 + fuzz_below(rng, 64));
+        
+        snprintf(line, sizeof(line), fuzz_below(rng, 4) ? "%zx\r\n" : "%zX;ext=1\r\n", n);
+        fuzz_puts(out, line);
+        fuzz_put(out, body, n);
+        fuzz_puts(out, "\r\n");
+        body += n;
+        len -= n;
+    }
+    fuzz_puts(out, fuzz_below(rng, 3) ? "0\r\n\r\n" : "0\r\nExpires: never\r\n\r\n");
+}
+
+static size_t fuzz_mutate(uint8_t *data, size_t size, size_t max, uint32_t seed)
+{
+    struct http_fuzz_line lines[HTTP_FUZZ_MAX_LINES];
+    const uint8_t *end = data + size, *pos = data, *body;
+    struct fuzz_buf out;
+    uint32_t rng = seed;
+    size_t nlines = 0, i, body_len, target;
+    int op = fuzz_below(&rng, 9);
+    
+    // Split the head into lines; body is whatever follows the empty line
+    while (pos < end && nlines < HTTP_FUZZ_MAX_LINES) {
+        const uint8_t *lf = memchr(pos, '\n', end - pos);
+        size_t len = (lf ? lf : end) - pos;
+        
+        if (len && pos[len - 1] == '\r') {
+            len--;
+        }
+        if (!len && nlines) {
+            pos = lf ? lf + 1 : end;
+            break;
+        }
+        lines[nlines].p = pos;
+        lines[nlines].len = len;
+        nlines++;
+        pos = lf ? lf + 1 : end;
+    }
+    body = pos;
+    body_len = end - pos;
+    
+    if (!nlines || op == 8 || fuzz_buf_init(&out, max)) {
+        return fuzz_mutate_bytes(data, size, max, &rng);
+    }
+    target = fuzz_below(&rng, nlines);
+    
+    for (i = 0; i < nlines; i++) {
+        const uint8_t *sp;
+        
+        if (i == 0 && op == 0) {
+            // Another method, same target and version
+            sp = memchr(lines[0].p, ' ', lines[0].len);
+            fuzz_puts(&out, http_fuzz_methods[fuzz_below(&rng, ARRAY_SIZE(http_fuzz_methods))]);
+            if (sp) {
+                fuzz_put(&out, sp, lines[0].p + lines[0].len - sp);
+            }
+        } else if (i == 0 && op == 1) {
+            sp = memchr(lines[0].p, ' ', lines[0].len);
+            sp = sp ? memchr(sp + 1, ' ', lines[0].p + lines[0].len - sp - 1) : NULL;
+            fuzz_put(&out, lines[0].p, sp ? (size_t)(sp + 1 - lines[0].p) : lines[0].len);
+            fuzz_puts(&out, http_fuzz_versions[fuzz_below(&rng, ARRAY_SIZE(http_fuzz_versions))]);
+        } else if (i == target && op == 3 && i) {
+            continue;               // drop the line
+        } else {
+            fuzz_put(&out, lines[i].p, lines[i].len);
+        }
+        
+        if (i == target && op == 4) {
+            fuzz_puts(&out, "\r\n");
+            fuzz_put(&out, lines[i].p, lines[i].len);
+        }
+        if (i == target && op == 5) {
+            fuzz_puts(&out, "\n");  // bare LF
+        } else {
+            fuzz_puts(&out, "\r\n");
+        }
+        if (i == target && op == 2) {
+            fuzz_puts(&out, http_fuzz_headers[fuzz_below(&rng, ARRAY_SIZE(http_fuzz_headers))]);
+            fuzz_puts(&out, "\r\n");
+        }
+    }
+    fuzz_puts(&out, "\r\n");
+    
+    if (op == 6) {
+        http_fuzz_chunk(&out, body, body_len, &rng);
+    } else {
+        fuzz_put(&out, body, body_len);
+    }
+    if (op == 7) {
+        // Pipeline a copy of what we have
+        size_t n = out.len;
+        fuzz_put(&out, out.p, min(n, out.cap - out.len));
+    }
+    
+    return fuzz_commit(data, &out);
+}
@@ -0,0 +1,381 @@
+/*
+ * SentinelHook telemetry record harness: TELEMETRY_RECORD to
+ * TELEMETRY_ENTRY decoding, as the service does for a GET_TELEMETRY
+ * batch or a telemetry pipe message
+ *
+ * The input is one batch: a TELEMETRY_BATCH_HEADER and packed records.
+ * It is walked the way DriverComm::IngestBatch() walks it, with string
+ * definitions kept in a small table standing in for the service's
+ * interned string map. Each record that validates is decoded from an
+ * exact-size copy, so a string read past Size is caught, and the entry
+ * must come back unchanged through TelemetryRecordFromEntry() and
+ * TelemetryRecordToEntry().
+ *
+ * record.h is plain C, built here against windows_shim.h, which keeps
+ * the Windows type widths so the structure layout is the one on the
+ * wire.
+ *
+ * The mutator edits record fields (event type, string lengths at their
+ * limits, flags, interned IDs) and string definitions, then re-packs
+ * the batch with Size, alignment, Count and BytesUsed fixed up, so the
+ * records keep passing TelemetryRecordValidate().
+ */
+
+#include "fuzz_common.h"
+#include "../../../SentinelHook/Common/record.h"
+
+#define TELEMETRY_FUZZ_STRINGS 16
+#define TELEMETRY_FUZZ_MAX_RECORDS 32
+
+#define TELEMETRY_FUZZ_ELEMS(a) (sizeof(a) / sizeof((a)[0]))
+
+struct telemetry_fuzz_string {
+    ULONG id;
+    SIZE_T len;
+    WCHAR s[MAX_PATH_LENGTH];
+};
+
+struct telemetry_fuzz_table {
+    struct telemetry_fuzz_string strings[TELEMETRY_FUZZ_STRINGS];
+    int count;
+    int next;               // slot to replace once full
+};
+
+static void telemetry_fuzz_define(struct telemetry_fuzz_table *t, const TELEMETRY_RECORD *record)
+{
+    struct telemetry_fuzz_string *str = NULL;
+    int i;
+    
+    for (i = 0; i < t->count; i++) {
+        if (t->strings[i].id == record->u.String.Id) {
+            str = &t->strings[i];
+        }
+    }
+    if (!str) {
+        if (t->count < TELEMETRY_FUZZ_STRINGS) {
+            str = &t->strings[t->count++];
+        } else {
+            str = &t->strings[t->next];
+            t->next = (t->next + 1) % TELEMETRY_FUZZ_STRINGS;
+        }
+    }
+    // Validate() bounds PathLength below MAX_PATH_LENGTH
+    str->id = record->u.String.Id;
+    str->len = record->PathLength;
+    memcpy(str->s, TELEMETRY_RECORD_STRINGS(record), str->len * sizeof(WCHAR));
+}
+
+static const struct telemetry_fuzz_string *telemetry_fuzz_lookup(const struct telemetry_fuzz_table *t,
+                                                                 ULONG id)
+{
+    int i;
+    
+    for (i = 0; id && i < t->count; i++) {
+        if (t->strings[i].id == id) {
+            return &t->strings[i];
+        }
+    }
+    return NULL;
+}
+
+// Characters after the first NUL do not survive a round trip
+static void telemetry_fuzz_normalize(WCHAR *s, size_t count)
+{
+    size_t len = wcsnlen(s, count);
+    
+    FUZZ_CHECK(len < count);
+    memset(s + len, 0, (count - len) * sizeof(WCHAR));
+}
+
+static void telemetry_fuzz_normalize_entry(PTELEMETRY_ENTRY entry)
+{
+    switch (entry->EventType) {
+    case EventFileCreate:
+    case EventFileRead:
+    case EventFileWrite:
+    case EventFileDelete:
+        telemetry_fuzz_normalize(entry->Data.FileEvent.FilePath, MAX_PATH_LENGTH);
+        telemetry_fuzz_normalize(entry->Data.FileEvent.ProcessName, MAX_PROCESS_NAME_LENGTH);
+        break;
+    case EventProcessCreate:
+    case EventProcessTerminate:
+    case EventProcessInjection:
+        telemetry_fuzz_normalize(entry->Data.ProcessEvent.ImagePath, MAX_PATH_LENGTH);
+        telemetry_fuzz_normalize(entry->Data.ProcessEvent.ProcessName, MAX_PROCESS_NAME_LENGTH);
+        break;
+    case EventImageLoad:
+    case EventImageUnload:
+    case EventUnsignedDriverLoad:
+        telemetry_fuzz_normalize(entry->Data.ImageEvent.ImagePath, MAX_PATH_LENGTH);
+        telemetry_fuzz_normalize(entry->Data.ImageEvent.ProcessName, MAX_PROCESS_NAME_LENGTH);
+        break;
+    default:
+        break;
+    }
+}
+
+static void telemetry_fuzz_record(struct telemetry_fuzz_table *t, const TELEMETRY_RECORD *in)
+{
+    const struct telemetry_fuzz_string *prefix, *name;
+    ULONG64 packed[TELEMETRY_RECORD_MAX_SIZE / sizeof(ULONG64) + 1];
+    TELEMETRY_ENTRY *entry = malloc(sizeof(*entry));
+    TELEMETRY_ENTRY *again = malloc(sizeof(*again));
+    TELEMETRY_RECORD *record = malloc(in->Size);
+    ULONG size;
+    
+    if (!entry || !again || !record) {
+        abort();
+    }
+    memcpy(record, in, in->Size);
+    
+    if (record->EventType == TELEMETRY_RECORD_STRING) {
+        telemetry_fuzz_define(t, record);
+        goto out;
+    }
+    
+    prefix = telemetry_fuzz_lookup(t, record->PathPrefixId);
+    name = telemetry_fuzz_lookup(t, record->ProcessNameId);
+    TelemetryRecordToEntryEx(record, entry, prefix ? prefix->s : NULL, prefix ? prefix->len : 0,
+                             name ? name->s : NULL, name ? name->len : 0);
+    telemetry_fuzz_normalize_entry(entry);
+    
+    size = TelemetryRecordFromEntry(entry, packed, sizeof(packed));
+    FUZZ_CHECK(size >= sizeof(TELEMETRY_RECORD) && size <= TELEMETRY_RECORD_MAX_SIZE);
+    FUZZ_CHECK(TelemetryRecordValidate((const TELEMETRY_RECORD *)packed, size));
+    TelemetryRecordToEntry((const TELEMETRY_RECORD *)packed, again);
+    FUZZ_CHECK(!memcmp(entry, again, sizeof(*entry)));
+    
+out:
+    free(record);
+    free(again);
+    free(entry);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    const TELEMETRY_BATCH_HEADER *batch = (const TELEMETRY_BATCH_HEADER *)data;
+    struct telemetry_fuzz_table *table;
+    const UCHAR *cursor, *end;
+    ULONG i;
+    
+    if (size < sizeof(TELEMETRY_BATCH_HEADER)) {
+        return 0;
+    }
+    table = calloc(1, sizeof(*table));
+    if (!table) {
+        abort();
+    }
+    cursor = data + sizeof(TELEMETRY_BATCH_HEADER);
+    end = data + min((SIZE_T)batch->BytesUsed, size);
+    
+    for (i = 0; i < batch->Count && cursor < end; i++) {
+        const TELEMETRY_RECORD *record = (const TELEMETRY_RECORD *)cursor;
+        
+        if (!TelemetryRecordValidate(record, (SIZE_T)(end - cursor))) {
+            break;
+        }
+        telemetry_fuzz_record(table, record);
+        cursor += TELEMETRY_RECORD_ALIGN(record->Size);
+    }
+    
+    free(table);
+    return 0;
+}
+
+/* Mutator */
+
+#define TELEMETRY_FUZZ_MAX_STRING (MAX_PATH_LENGTH + MAX_PROCESS_NAME_LENGTH)
+
+struct telemetry_fuzz_edit {
+    TELEMETRY_RECORD hdr;
+    WCHAR strings[TELEMETRY_FUZZ_MAX_STRING];
+    size_t nstrings;
+    BOOL raw_size;          // keep hdr.Size as mutated
+};
+
+static const USHORT telemetry_fuzz_lengths[] = { 0, 1, 2, 8, 254, 255, 256, 257, 258, 259, 260 };
+
+static WCHAR telemetry_fuzz_char(uint32_t *rng)
+{
+    static const WCHAR chars[] = { 'C', ':', '\\', 'a', '.', 'e', 'x', 0, 0xd800, 0xffff };
+    uint32_t r = fuzz_below(rng, 16);
+    
+    return r < TELEMETRY_FUZZ_ELEMS(chars) ? chars[r] : 0x20 + fuzz_below(rng, 0x60);
+}
+
+// Resize the path (part 0) or the name (part 1), keeping the other
+static void telemetry_fuzz_resize(struct telemetry_fuzz_edit *r, int part, USHORT len, uint32_t *rng)
+{
+    WCHAR old[TELEMETRY_FUZZ_MAX_STRING];
+    size_t path = min(r->hdr.PathLength, r->nstrings);
+    size_t name = min(r->hdr.ProcessNameLength, r->nstrings - path);
+    size_t keep, i, n = 0;
+    
+    memcpy(old, r->strings, r->nstrings * sizeof(WCHAR));
+    if (part == 0) {
+        keep = min(path, len);
+        memcpy(r->strings, old, keep * sizeof(WCHAR));
+        for (n = keep; n < len; n++)
+            r->strings[n] = telemetry_fuzz_char(rng);
+        for (i = 0; i < name && n < TELEMETRY_FUZZ_MAX_STRING; i++)
+            r->strings[n++] = old[path + i];
+        r->hdr.PathLength = len;
+    } else {
+        n = path;
+        keep = min(name, len);
+        for (i = 0; i < keep; i++)
+            r->strings[n++] = old[path + i];
+        for (; i < len && n < TELEMETRY_FUZZ_MAX_STRING; i++)
+            r->strings[n++] = telemetry_fuzz_char(rng);
+        r->hdr.ProcessNameLength = len;
+    }
+    r->nstrings = n;
+}
+
+static size_t fuzz_mutate(uint8_t *data, size_t size, size_t max, uint32_t seed)
+{
+    struct telemetry_fuzz_edit *recs;
+    TELEMETRY_BATCH_HEADER batch;
+    struct fuzz_buf out;
+    const uint8_t *cursor, *end;
+    uint32_t rng = seed;
+    size_t n = 0, i, a;
+    int op = fuzz_below(&rng, 10);
+    
+    if (op == 9 || size < sizeof(batch) || fuzz_buf_init(&out, max)) {
+        return fuzz_mutate_bytes(data, size, max, &rng);
+    }
+    recs = calloc(TELEMETRY_FUZZ_MAX_RECORDS + 1, sizeof(*recs));
+    if (!recs) {
+        free(out.p);
+        return fuzz_mutate_bytes(data, size, max, &rng);
+    }
+    
+    // Records as far as their Size fields hold up, whatever the header says
+    memcpy(&batch, data, sizeof(batch));
+    cursor = data + sizeof(batch);
+    end = data + size;
+    while (n < TELEMETRY_FUZZ_MAX_RECORDS && end - cursor >= (ptrdiff_t)sizeof(TELEMETRY_RECORD)) {
+        struct telemetry_fuzz_edit *r = &recs[n++];
+        size_t len;
+        
+        memcpy(&r->hdr, cursor, sizeof(r->hdr));
+        len = r->hdr.Size > sizeof(TELEMETRY_RECORD) ? r->hdr.Size : sizeof(TELEMETRY_RECORD);
+        len = min(len, end - cursor);
+        r->nstrings = min((len - sizeof(TELEMETRY_RECORD)) / sizeof(WCHAR),
+                            TELEMETRY_FUZZ_MAX_STRING);
+        memcpy(r->strings, cursor + sizeof(TELEMETRY_RECORD), r->nstrings * sizeof(WCHAR));
+        cursor += min(TELEMETRY_RECORD_ALIGN(len), end - cursor);
+    }
+    a = fuzz_below(&rng, n);
+    
+    switch (op) {
+    case 0:
+        if (n) {
+            static const UCHAR types[] = { 0, 1, 3, 4, 5, 6, 8, 9, EventMax, TELEMETRY_RECORD_STRING,
+                                           TELEMETRY_RECORD_PADDING };
+            recs[a].hdr.EventType = types[fuzz_below(&rng, TELEMETRY_FUZZ_ELEMS(types))];
+        }
+        break;
+    case 1:
+        if (n) {
+            USHORT len = telemetry_fuzz_lengths[fuzz_below(&rng, TELEMETRY_FUZZ_ELEMS(telemetry_fuzz_lengths))];
+            telemetry_fuzz_resize(&recs[a], fuzz_below(&rng, 2), len, &rng);
+        }
+        break;
+    case 2:
+        if (n) {
+            recs[a].hdr.Flags ^= 1u << fuzz_below(&rng, 4);
+            recs[a].hdr.EventCount = fuzz_below(&rng, 2) ? 0 : fuzz_rand(&rng);
+        }
+        break;
+    case 3:
+        if (n) {
+            // An ID some string record defines, or one nothing does
+            ULONG id = fuzz_below(&rng, 4);
+            for (i = 0; i < n; i++) {
+                if (recs[i].hdr.EventType == TELEMETRY_RECORD_STRING && fuzz_below(&rng, 2)) {
+                    id = recs[i].hdr.u.String.Id;
+                }
+            }
+            if (fuzz_below(&rng, 2)) {
+                recs[a].hdr.PathPrefixId = id;
+            } else {
+                recs[a].hdr.ProcessNameId = id;
+            }
+        }
+        break;
+    case 4:
+        // Define a string ahead of the record at a
+        memmove(&recs[a + 1], &recs[a], (n - a) * sizeof(*recs));
+        memset(&recs[a], 0, sizeof(*recs));
+        recs[a].hdr.Version = TELEMETRY_RECORD_VERSION;
+        recs[a].hdr.EventType = TELEMETRY_RECORD_STRING;
+        recs[a].hdr.u.String.Id = 1 + fuzz_below(&rng, 8);
+        telemetry_fuzz_resize(&recs[a], 0,
+            telemetry_fuzz_lengths[fuzz_below(&rng, TELEMETRY_FUZZ_ELEMS(telemetry_fuzz_lengths))], &rng);
+        n++;
+        break;
+    case 5:
+        if (!n) {
+            break;
+        }
+        if (fuzz_below(&rng, 2) && n < TELEMETRY_FUZZ_MAX_RECORDS) {
+            memmove(&recs[a + 1], &recs[a], (n - a) * sizeof(*recs));
+            n++;
+        } else {
+            memmove(&recs[a], &recs[a + 1], (n - a - 1) * sizeof(*recs));
+            n--;
+        }
+        break;
+    case 6:
+        if (n) {
+            // Size disagreeing with the string lengths
+            static const int deltas[] = { -2, -1, 1, 2, 8 };
+            recs[a].hdr.Size = sizeof(TELEMETRY_RECORD) + recs[a].nstrings * sizeof(WCHAR) +
+                deltas[fuzz_below(&rng, TELEMETRY_FUZZ_ELEMS(deltas))];
+            recs[a].raw_size = TRUE;
+        }
+        break;
+    case 7:
+        if (n) {
+            recs[a].hdr.Version = fuzz_below(&rng, 4);
+            recs[a].hdr.Timestamp = (ULONG64)fuzz_rand(&rng) << 32 | fuzz_rand(&rng);
+            recs[a].hdr.ProcessId = fuzz_rand(&rng);
+        }
+        break;
+    }
+    
+    batch.Count = n;
+    if (op == 8) {
+        ULONG drop = fuzz_below(&rng, 2);
+        
+        batch.Count += fuzz_below(&rng, 3);
+        batch.Count -= min(batch.Count, drop);
+    }
+    fuzz_put(&out, &batch, sizeof(batch));
+    for (i = 0; i < n; i++) {
+        struct telemetry_fuzz_edit *r = &recs[i];
+        size_t len = sizeof(TELEMETRY_RECORD) + r->nstrings * sizeof(WCHAR);
+        static const uint8_t pad[TELEMETRY_RECORD_ALIGNMENT];
+        
+        if (!r->raw_size) {
+            r->hdr.Size = len;
+        }
+        fuzz_put(&out, &r->hdr, sizeof(r->hdr));
+        fuzz_put(&out, r->strings, r->nstrings * sizeof(WCHAR));
+        fuzz_put(&out, pad, TELEMETRY_RECORD_ALIGN(len) - len);
+    }
+    
+    // BytesUsed covers what was written, or stops short of it
+    batch.BytesUsed = out.len;
+    if (op == 8 && fuzz_below(&rng, 2)) {
+        ULONG cut = fuzz_below(&rng, 64);
+        
+        batch.BytesUsed -= min(batch.BytesUsed, cut);
+    }
+    memcpy(out.p, &batch, min(out.len, sizeof(batch)));
+    
+    free(recs);
+    return fuzz_commit(data, &out);
+}
@@ -0,0 +1,148 @@
+#!/usr/bin/env python3
+"""Write the seed corpora shared by the libFuzzer and AFL harnesses"""
+
+import gzip
+import os
+import struct
+import sys
+
+
+def http_seeds():
+    yield "get", b"GET /api/v1/status HTTP/1.1\r\nHost: device.local\r\n\r\n"
+    yield "post", (b"POST /api/v1/config HTTP/1.1\r\nHost: device.local\r\n"
+                   b"Content-Type: application/json\r\nContent-Length: 13\r\n\r\n"
+                   b'{"led":"on"}\n')
+    yield "chunked", (b"PUT /fw HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+                      b"5\r\nhello\r\n6;ext=1\r\n world\r\n0\r\nExpires: 0\r\n\r\n")
+    yield "pipelined", (b"GET /a HTTP/1.1\r\n\r\n"
+                        b"POST /b HTTP/1.0\r\nConnection: keep-alive\r\nContent-Length: 2\r\n\r\nok"
+                        b"\r\n\r\nDELETE /c HTTP/1.1\r\nConnection: close\r\n\r\n")
+
+
+def cpio_entry(name, mode, data=b"", ino=1, nlink=1, filesize=None):
+    name = name.encode() + b"\0"
+    size = len(data) if filesize is None else filesize
+    fields = [ino, mode, 0, 0, nlink, 0x5f000000, size, 8, 1, 0, 0, len(name), 0]
+    hdr = b"070701" + b"".join(b"%08x" % f for f in fields)
+    out = hdr + name
+    out += b"\0" * (-len(out) % 4)
+    out += data
+    out += b"\0" * (-len(out) % 4)
+    return out
+
+
+def cpio_seeds():
+    trailer = cpio_entry("TRAILER!!!", 0, ino=0)
+    yield "simple", (cpio_entry("init", 0o100755, b"#!/bin/sh\nexec /sbin/init\n", ino=1) +
+                     cpio_entry("dev", 0o40755, ino=2) +
+                     cpio_entry("root", 0o100644, b"root=/dev/mmcblk0p2\0", ino=3) + trailer)
+    # Hardlinks: the data comes with the last link, as GNU cpio writes them
+    yield "hardlinks", (cpio_entry("bin/busybox", 0o100755, ino=7, nlink=3) +
+                        cpio_entry("bin/sh", 0o100755, ino=7, nlink=3) +
+                        cpio_entry("bin/ls", 0o100755, b"\x7fELF" + b"\0" * 60, ino=7, nlink=3) +
+                        trailer)
+    # A second archive replacing a name from the first
+    yield "overlay", (cpio_entry("etc/hostname", 0o100644, b"base\n", ino=1) + trailer +
+                      b"\0" * 8 +
+                      cpio_entry("etc/hostname", 0o100644, b"board\n", ino=1) + trailer)
+
+
+def coap_option(delta, value):
+    def nibble(v):
+        if v < 13:
+            return v, b""
+        if v < 269:
+            return 13, bytes([v - 13])
+        return 14, struct.pack(">H", v - 269)
+    dn, dext = nibble(delta)
+    ln, lext = nibble(len(value))
+    return bytes([dn << 4 | ln]) + dext + lext + value
+
+
+def coap_seeds():
+    token = b"\x12\x34"
+    yield "get", (bytes([0x40 | len(token), 0x01]) + struct.pack(">H", 0x1001) + token +
+                  coap_option(11, b"sensors") + coap_option(0, b"temp"))
+    yield "observe", (bytes([0x40 | len(token), 0x01]) + struct.pack(">H", 0x1002) + token +
+                      coap_option(6, b"") + coap_option(5, b"fw") + coap_option(12, b"\x26"))
+    yield "block2", (bytes([0x60 | 1, 0x45]) + struct.pack(">H", 0x1003) + b"\x55" +
+                     coap_option(12, b"\x2a") + coap_option(11, b"\x1e") +
+                     coap_option(5, b"\x01\x00\x00") + b"\xff" + bytes(range(64)))
+    yield "long_option", (bytes([0x40, 0x03]) + struct.pack(">H", 0x1004) +
+                          coap_option(11, b"x" * 300) + coap_option(4, b"q=1") + b"\xffdata")
+
+
+RECORD_FMT = "<HBBHHHHIIII4xQ16s"
+RECORD_SIZE = struct.calcsize(RECORD_FMT)
+
+
+def telemetry_record(event, path="", name="", flags=0, pid=4, prefix_id=0, name_id=0,
+                     union=b"", count=0):
+    strings = (path + name).encode("utf-16-le")
+    size = RECORD_SIZE + len(strings)
+    rec = struct.pack(RECORD_FMT, size, 2, event, flags, len(path), len(name), count, pid, 8,
+                      prefix_id, name_id, 133000000000000000, union.ljust(16, b"\0")) + strings
+    return rec + b"\0" * (-len(rec) % 8)
+
+
+def telemetry_batch(records):
+    body = b"".join(records)
+    return struct.pack("<IIII", len(records), 16 + len(body), 0, 0) + body
+
+
+def telemetry_seeds():
+    file_union = struct.pack("<IIQ", 0x20, 0, 4096)
+    image_union = struct.pack("<QII", 0x7ff600000000, 0x20000, 0xabcdef01)
+    process_union = struct.pack("<IIQ", 600, 0x1234, 133000000000000000)
+    yield "file", telemetry_batch([
+        telemetry_record(1, "C:\\Windows\\System32\\config\\SAM", "svchost.exe",
+                         union=file_union, count=3),
+    ])
+    yield "mixed", telemetry_batch([
+        telemetry_record(4, "C:\\Tools\\a.exe", "C:\\Tools\\a.exe", flags=0x4,
+                         union=process_union),
+        telemetry_record(6, "C:\\Windows\\System32\\ntdll.dll", "a.exe", flags=0x1,
+                         union=image_union),
+        telemetry_record(9, "C:\\drivers\\evil.sys", "System", flags=0xa, union=image_union),
+    ])
+    # Interned prefix: a string definition, then a record that uses it
+    yield "interned", telemetry_batch([
+        telemetry_record(0xFE, "C:\\Users\\dev\\AppData\\", union=struct.pack("<I", 5)),
+        telemetry_record(2, "log.txt", "", prefix_id=5, name_id=5, union=file_union),
+    ])
+
+
+def firmware_image(payload, version=1):
+    checksum = sum(payload) & 0xffffffff
+    return struct.pack("<IIII", 0x4649524D, version, len(payload), checksum) + payload
+
+
+def firmware_seeds():
+    yield "plain", firmware_image(bytes(range(256)) * 4)
+    yield "embedded", firmware_image(b"\0" * 61 + gzip.compress(b"kernel" * 20, mtime=0) +
+                                     b"hsqs" + b"\0" * 92 + b"\x27\x05\x19\x56" + b"\xff" * 60)
+    yield "bad_checksum", struct.pack("<IIII", 0x4649524D, 2, 16, 1) + b"\x7fELF" + b"\0" * 12
+
+
+TARGETS = {
+    "http": http_seeds,
+    "cpio": cpio_seeds,
+    "coap": coap_seeds,
+    "telemetry": telemetry_seeds,
+    "firmware": firmware_seeds,
+}
+
+
+def main():
+    outdir = sys.argv[1] if len(sys.argv) > 1 else "corpus"
+    for target, seeds in TARGETS.items():
+        path = os.path.join(outdir, target)
+        os.makedirs(path, exist_ok=True)
+        for name, data in seeds():
+            with open(os.path.join(path, name), "wb") as f:
+                f.write(data)
+        print(f"  {target}: {len(os.listdir(path))} seeds")
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,426 @@
+/*
+ * Userspace stand-ins for the kernel APIs the fuzzed sources use
+ *
+ * build.sh points every <linux/...> and <asm/...> include of those
+ * sources at this one header, so they compile unmodified as part of a
+ * harness (build.sh also defines _GNU_SOURCE, for strchrnul()).
+ * Allocation goes to malloc so the sanitizers see it, and the
+ * checks the kernel would WARN on (refcount misuse, list corruption)
+ * abort instead, which the fuzzer reports as a crash.
+ */
+
+#ifndef KERNEL_SHIM_H
+#define KERNEL_SHIM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef unsigned int gfp_t;
+typedef unsigned short umode_t;
+
+#define GFP_KERNEL 0
+#define GFP_ATOMIC 0
+
+#define U16_MAX UINT16_MAX
+#define U32_MAX UINT32_MAX
+#define U64_MAX UINT64_MAX
+
+/* Module and init boilerplate */
+
+#define MODULE_LICENSE(x)
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_VERSION(x)
+#define EXPORT_SYMBOL(x)
+#define EXPORT_SYMBOL_GPL(x)
+#define __init
+#define __exit
+#define __initdata
+
+/* Referenced so the init functions are not unused, never called */
+#define module_init(fn) static int (*const shim_initcall_##fn)(void) __attribute__((used)) = fn
+#define module_exit(fn) static void (*const shim_exitcall_##fn)(void) __attribute__((used)) = fn
+#define early_initcall(fn) module_init(fn)
+#define rootfs_initcall(fn) module_init(fn)
+
+/* Logging is off: an input that triggers a message is not a finding */
+#define shim_no_printk(fmt, ...) \
+    do { \
+        if (0) { \
+            printf(fmt, ##__VA_ARGS__); \
+        } \
+    } while (0)
+#define printk(fmt, ...) shim_no_printk(fmt, ##__VA_ARGS__)
+#define pr_err(fmt, ...) shim_no_printk(fmt, ##__VA_ARGS__)
+#define pr_warn(fmt, ...) shim_no_printk(fmt, ##__VA_ARGS__)
+#define pr_info(fmt, ...) shim_no_printk(fmt, ##__VA_ARGS__)
+#define pr_debug(fmt, ...) shim_no_printk(fmt, ##__VA_ARGS__)
+
+#define BUG_ON(cond) \
+    do { \
+        if (cond) { \
+            abort(); \
+        } \
+    } while (0)
+#define WARN_ON(cond) ({ bool __w = (cond); if (__w) abort(); __w; })
+
+/* Arithmetic helpers */
+
+/* Each argument evaluated once, as in the kernel */
+#define min(a, b) ({ __typeof__(a) __a = (a); __typeof__(b) __b = (b); __a < __b ? __a : __b; })
+#define max(a, b) ({ __typeof__(a) __a = (a); __typeof__(b) __b = (b); __a > __b ? __a : __b; })
+#define min_t(type, a, b) ({ type __a = (a); type __b = (b); __a < __b ? __a : __b; })
+#define max_t(type, a, b) ({ type __a = (a); type __b = (b); __a > __b ? __a : __b; })
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define REPEAT_BYTE(x) ((~0ul / 0xff) * (x))
+
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+/* Size of a struct with a flexible array of n elements, SIZE_MAX on overflow */
+#define struct_size(p, member, n) \
+    ((n) > (SIZE_MAX - sizeof(*(p))) / sizeof((p)->member[0]) ? SIZE_MAX : \
+     sizeof(*(p)) + (size_t)(n) * sizeof((p)->member[0]))
+
+/* ctype, on the byte value as the kernel's does */
+
+#include <ctype.h>
+#define shim_ctype(fn, c) fn((unsigned char)(c))
+#undef isalnum
+#undef isdigit
+#undef isxdigit
+#undef isspace
+#undef isprint
+#define isalnum(c) shim_ctype(isalnum, c)
+#define isdigit(c) shim_ctype(isdigit, c)
+#define isxdigit(c) shim_ctype(isxdigit, c)
+#define isspace(c) shim_ctype(isspace, c)
+#define isprint(c) shim_ctype(isprint, c)
+
+static inline int hex_to_bin(unsigned char ch)
+{
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0';
+    }
+    ch = tolower(ch);
+    if (ch >= 'a' && ch <= 'f') {
+        return ch - 'a' + 10;
+    }
+    return -1;
+}
+
+/* Unaligned and big-endian access */
+
+#define get_unaligned(ptr) \
+    ({ __typeof__(({ *(ptr); })) __v; memcpy(&__v, (ptr), sizeof(__v)); __v; })
+
+static inline u16 get_unaligned_be16(const void *p)
+{
+    const u8 *b = p;
+    
+    return (u16)(b[0] << 8 | b[1]);
+}
+
+static inline u32 get_unaligned_be32(const void *p)
+{
+    const u8 *b = p;
+    
+    return (u32)b[0] << 24 | (u32)b[1] << 16 | (u32)b[2] << 8 | b[3];
+}
+
+static inline void put_unaligned_be16(u16 v, void *p)
+{
+    u8 *b = p;
+    
+    b[0] = v >> 8;
+    b[1] = v;
+}
+
+static inline void put_unaligned_be32(u32 v, void *p)
+{
+    u8 *b = p;
+    
+    b[0] = v >> 24;
+    b[1] = v >> 16;
+    b[2] = v >> 8;
+    b[3] = v;
+}
+
+/* Allocation */
+
+#define kmalloc(size, gfp) malloc(size)
+#define kzalloc(size, gfp) calloc(1, size)
+#define kcalloc(n, size, gfp) calloc(n, size)
+#define kvmalloc(size, gfp) ((size) == SIZE_MAX ? NULL : malloc(size))
+#define kfree(p) free(p)
+#define kvfree(p) free(p)
+#define vfree(p) free(p)
+
+/* Reference counts: misuse is memory corruption in the kernel */
+
+typedef struct {
+    int refs;
+} refcount_t;
+
+static inline void refcount_set(refcount_t *r, int n)
+{
+    r->refs = n;
+}
+
+static inline void refcount_inc(refcount_t *r)
+{
+    if (r->refs <= 0) {
+        fprintf(stderr, "refcount_t: increment on %d\n", r->refs);
+        abort();
+    }
+    r->refs++;
+}
+
+static inline bool refcount_dec_and_test(refcount_t *r)
+{
+    if (r->refs <= 0) {
+        fprintf(stderr, "refcount_t: underflow\n");
+        abort();
+    }
+    return --r->refs == 0;
+}
+
+/* Lists */
+
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+    list->next = list;
+    list->prev = list;
+}
+
+static inline void list_add_tail(struct list_head *entry, struct list_head *head)
+{
+    if (head->prev->next != head) {
+        fprintf(stderr, "list_add corruption\n");
+        abort();
+    }
+    entry->prev = head->prev;
+    entry->next = head;
+    head->prev->next = entry;
+    head->prev = entry;
+}
+
+static inline void list_del(struct list_head *entry)
+{
+    if (entry->prev->next != entry || entry->next->prev != entry) {
+        fprintf(stderr, "list_del corruption\n");
+        abort();
+    }
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->next = entry;
+    entry->prev = entry;
+}
+
+static inline void list_del_init(struct list_head *entry)
+{
+    list_del(entry);
+    INIT_LIST_HEAD(entry);
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+    return head->next == head;
+}
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) list_entry((ptr)->next, type, member)
+#define list_for_each_entry(pos, head, member) \
+    for (pos = list_entry((head)->next, __typeof__(*pos), member); \
+         &pos->member != (head); \
+         pos = list_entry(pos->member.next, __typeof__(*pos), member))
+#define list_for_each_entry_safe(pos, n, head, member) \
+    for (pos = list_entry((head)->next, __typeof__(*pos), member), \
+         n = list_entry(pos->member.next, __typeof__(*pos), member); \
+         &pos->member != (head); \
+         pos = n, n = list_entry(n->member.next, __typeof__(*n), member))
+
+/* Hash lists and fixed-size hash tables */
+
+struct hlist_node {
+    struct hlist_node *next, **pprev;
+};
+
+struct hlist_head {
+    struct hlist_node *first;
+};
+
+static inline void hlist_add_head(struct hlist_node *n, struct hlist_head *h)
+{
+    n->next = h->first;
+    if (h->first) {
+        h->first->pprev = &n->next;
+    }
+    h->first = n;
+    n->pprev = &h->first;
+}
+
+static inline void hlist_del_init(struct hlist_node *n)
+{
+    if (!n->pprev) {
+        return;
+    }
+    *n->pprev = n->next;
+    if (n->next) {
+        n->next->pprev = n->pprev;
+    }
+    n->next = NULL;
+    n->pprev = NULL;
+}
+
+#define hlist_entry_safe(ptr, type, member) \
+    ({ __typeof__(ptr) __p = (ptr); __p ? container_of(__p, type, member) : NULL; })
+
+#define DEFINE_HASHTABLE(name, bits) struct hlist_head name[1 << (bits)]
+#define HASH_SIZE(name) ARRAY_SIZE(name)
+#define hash_min(key, table) ((u32)(key) * 0x61C88647u >> (32 - __builtin_ctz(HASH_SIZE(table))))
+
+#define hash_add(table, node, key) hlist_add_head(node, &(table)[hash_min(key, table)])
+#define hash_del(node) hlist_del_init(node)
+
+#define hash_for_each_possible(table, obj, member, key) \
+    for (obj = hlist_entry_safe((table)[hash_min(key, table)].first, __typeof__(*obj), member); \
+         obj; obj = hlist_entry_safe(obj->member.next, __typeof__(*obj), member))
+
+#define hash_for_each_safe(table, bkt, tmp, obj, member) \
+    for (bkt = 0; bkt < (int)HASH_SIZE(table); bkt++) \
+        for (obj = hlist_entry_safe((table)[bkt].first, __typeof__(*obj), member); \
+             obj && ((tmp = obj->member.next), 1); \
+             obj = hlist_entry_safe(tmp, __typeof__(*obj), member))
+
+static inline unsigned int full_name_hash(const void *salt, const char *name, unsigned int len)
+{
+    u32 h = 2166136261u;
+    
+    (void)salt;
+    while (len--) {
+        h = (h ^ (u8)*name++) * 16777619u;
+    }
+    return h;
+}
+
+/* initramfs */
+
+struct cpio_header {
+    u32 ino;
+    u32 mode;
+    u32 uid;
+    u32 gid;
+    u32 nlink;
+    u32 mtime;
+    u32 filesize;
+    u32 namesize;
+};
+
+static char __initramfs_start[1] __attribute__((unused));
+#define __initramfs_end __initramfs_start
+
+typedef int (*decompress_fn)(unsigned char *inbuf, long len,
+                             long (*fill)(void *, unsigned long),
+                             long (*flush)(void *, unsigned long),
+                             unsigned char *outbuf, long *posp,
+                             void (*error)(char *x));
+
+/* Harnesses feed decompressed data themselves */
+static inline decompress_fn decompress_method(const unsigned char *inbuf, long len,
+                                              const char **name)
+{
+    (void)inbuf;
+    (void)len;
+    *name = NULL;
+    return NULL;
+}
+
+#define MS_RDONLY 1
+
+static inline int do_mount_root(const char *name, const char *fs, int flags, const void *data)
+{
+    (void)name;
+    (void)fs;
+    (void)flags;
+    (void)data;
+    return -ENODEV;
+}
+
+/* Socket buffers, enough to encode into */
+
+struct sk_buff {
+    unsigned char *data;
+    unsigned int len;
+    unsigned int size;
+};
+
+static inline struct sk_buff *alloc_skb(unsigned int size, gfp_t gfp)
+{
+    struct sk_buff *skb = calloc(1, sizeof(*skb) + size);
+    
+    (void)gfp;
+    if (skb) {
+        skb->data = (unsigned char *)(skb + 1);
+        skb->size = size;
+    }
+    return skb;
+}
+
+static inline unsigned char *skb_tail_pointer(const struct sk_buff *skb)
+{
+    return skb->data + skb->len;
+}
+
+static inline unsigned int skb_tailroom(const struct sk_buff *skb)
+{
+    return skb->size - skb->len;
+}
+
+static inline void *skb_put(struct sk_buff *skb, unsigned int len)
+{
+    void *tail = skb_tail_pointer(skb);
+    
+    BUG_ON(len > skb_tailroom(skb));
+    skb->len += len;
+    return tail;
+}
+
+static inline void kfree_skb(struct sk_buff *skb)
+{
+    free(skb);
+}
+
+static inline int udp_send_skb(struct sk_buff *skb, struct sockaddr_in *dst)
+{
+    (void)dst;
+    kfree_skb(skb);
+    return 0;
+}
+
+#endif /* KERNEL_SHIM_H */
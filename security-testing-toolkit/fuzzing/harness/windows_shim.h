@@ -0,0 +1,80 @@
+/*
+ * Enough of <windows.h> for the SentinelHook wire record headers
+ *
+ * SentinelHook/Common/record.h is plain C over fixed-width Windows
+ * types, so the decoder can be fuzzed on Linux with the same layout the
+ * driver and service use: ULONG is 32 bits and WCHAR 16, as on Windows,
+ * and the wide string helpers work on WCHAR rather than wchar_t.
+ */
+
+#ifndef WINDOWS_SHIM_H
+#define WINDOWS_SHIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef void VOID;
+typedef void *PVOID;
+typedef void *HANDLE;
+typedef int BOOL;
+typedef uint8_t BOOLEAN;
+typedef uint8_t UCHAR, *PUCHAR;
+typedef uint16_t USHORT;
+typedef uint32_t ULONG;
+typedef int32_t LONG;
+typedef uint64_t ULONG64;
+typedef int64_t LONG64;
+typedef size_t SIZE_T;
+typedef uint16_t WCHAR, *PWCHAR;
+
+#define TRUE 1
+#define FALSE 0
+#define MAXUSHORT 0xffff
+
+#define DECLSPEC_CACHEALIGN __attribute__((aligned(64)))
+
+#define CTL_CODE(type, function, method, access) \
+    (((type) << 16) | ((access) << 14) | ((function) << 2) | (method))
+#define FILE_DEVICE_UNKNOWN 0x22
+#define METHOD_BUFFERED 0
+#define FILE_ANY_ACCESS 0
+
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#define ZeroMemory(dst, len) memset((dst), 0, (len))
+#define CopyMemory(dst, src, len) memcpy((dst), (src), (len))
+
+static inline size_t shim_wcsnlen(const WCHAR *s, size_t max)
+{
+    size_t n = 0;
+    
+    while (n < max && s[n]) {
+        n++;
+    }
+    return n;
+}
+
+static inline int shim_wmemcmp(const WCHAR *a, const WCHAR *b, size_t n)
+{
+    for (; n; n--, a++, b++) {
+        if (*a != *b) {
+            return *a < *b ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+// Only reached with a nonzero mask in the headers included here
+static inline unsigned char _BitScanReverse64(unsigned long *index, uint64_t mask)
+{
+    *index = 63 - __builtin_clzll(mask);
+    return mask != 0;
+}
+
+#define wcsnlen shim_wcsnlen
+#define wmemcmp shim_wmemcmp
+
+#endif /* WINDOWS_SHIM_H */
@@ -1,23 +1,22 @@
 #!/bin/bash
-# Run libFuzzer
+# Run libFuzzer on one of the harnesses
+#
+# Usage: run_libfuzzer.sh [target] [libFuzzer options...]
+# Targets: http cpio coap telemetry firmware (default firmware)
 
 set -e
 
-TARGET="fuzz_target"
-INPUT_DIR="fuzz_input"
-OUTPUT_DIR="fuzz_output"
+HARNESS="$(cd "$(dirname "$0")/../harness" && pwd)"
+TARGET="${1:-firmware}"
+shift || true
+CORPUS_DIR="corpus_$TARGET"
+OUTPUT_DIR="fuzz_output_$TARGET"
 
-mkdir -p $INPUT_DIR $OUTPUT_DIR
+"$HARNESS/build.sh" libfuzzer "$TARGET"
 
-# Create sample input
-echo -n "test" > $INPUT_DIR/sample1
-
-# Build with libFuzzer
-clang -fsanitize=fuzzer,address \
-      -g -O1 \
-      -o $TARGET \
-      fuzz_target.c
-
-# Run fuzzer
-./$TARGET $INPUT_DIR -artifact_prefix=$OUTPUT_DIR/
+# Seeds are copied, so what libFuzzer adds stays out of the shared set
+mkdir -p $CORPUS_DIR $OUTPUT_DIR
+cp -n "$HARNESS/out/corpus/$TARGET/"* $CORPUS_DIR/
 
+# Run fuzzer; the harness's structure-aware mutator is built in
+"$HARNESS/out/${TARGET}_libfuzzer" $CORPUS_DIR -artifact_prefix=$OUTPUT_DIR/ "$@"
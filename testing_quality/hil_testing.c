@@ -5,6 +5,15 @@
  * 
  * Advanced HIL testing with real-time simulation
  * Research breakthrough: Microsecond-precision HIL testing
+ *
+ * Tests are run by an executor rather than one shared timer: each test
+ * has its own completion work on an unbound workqueue, so any number of
+ * them can be running, and hil_run_all() starts every queued test whose
+ * signals are not in use by a running one, starting the rest as those
+ * finish. Signals are sampled by their rig's DMA into rings at their own
+ * sample rate, and each test's assertions are evaluated on the samples
+ * as the rig reports them, not after the fact; a test passes when none
+ * of its assertions failed.
  */
 
 #include <linux/module.h>
@@ -14,12 +23,23 @@
 #include <linux/atomic.h>
 #include <linux/timer.h>
 #include <linux/workqueue.h>
+#include <linux/bitmap.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>
+#include <linux/moduleparam.h>
 
-#define HIL_TESTING_VERSION "1.0.0"
+#include "hil_testing.h"
+
+#define HIL_TESTING_VERSION "1.1.0"
 #define MAX_HIL_TESTS 256
 #define MAX_HIL_SIGNALS 128
 #define MAX_HIL_STIMULI 64
+#define MAX_HIL_RIGS 8
+#define MAX_HIL_ASSERTIONS 512
 #define HIL_TEST_TIMEOUT_MS 30000
+#define HIL_RING_MS 500                     // ring covers this much of any signal
+#define HIL_RING_MIN_SAMPLES 1024
 
 enum hil_test_type {
     HIL_TEST_FUNCTIONAL = 0,
@@ -29,6 +49,12 @@ enum hil_test_type {
     HIL_TEST_ENDURANCE = 4
 };
 
+enum hil_assert_type {
+    HIL_ASSERT_RANGE = 0,               // every sample in [lo, hi]
+    HIL_ASSERT_MEAN = 1,                // every window's mean in [lo, hi]
+    HIL_ASSERT_REACH = 2                // into [lo, hi] within window_ms of the start
+};
+
 enum hil_signal_type {
     HIL_SIGNAL_ANALOG = 0,
     HIL_SIGNAL_DIGITAL = 1,
@@ -49,6 +75,31 @@ struct hil_signal {
     u32 sample_rate_hz;
     u32 error_count;
     u64 timestamp;
+    
+    // Capture
+    int rig;                            // -1 until attached
+    u32 channel;
+    float *ring;                        // the rig's DMA ring, while capturing
+    u32 ring_samples;                   // power of two
+    atomic_t head;                      // samples written since attach
+    int owner;                          // running test using it, or -1
+};
+
+struct hil_assertion {
+    struct list_head node;
+    u32 signal_id;
+    enum hil_assert_type type;
+    float lo;
+    float hi;
+    u32 window_ms;
+    u32 window_samples;
+    u32 cursor;                         // next sample, in head's count
+    u32 start;                          // head when the test started
+    float sum;
+    u32 n;
+    bool met;
+    u32 failures;
+    u32 overruns;
 };
 
 struct hil_stimulus {
@@ -77,6 +128,18 @@ struct hil_test {
     u32 test_time_ms;
     u64 start_time;
     u64 end_time;
+    
+    // Executor
+    bool queued;
+    DECLARE_BITMAP(signals, MAX_HIL_SIGNALS);
+    struct list_head assertions;
+    struct delayed_work done_work;
+    struct work_struct eval_work;
+};
+
+struct hil_rig {
+    const struct hil_rig_ops *ops;
+    void *ctx;
 };
 
 struct hil_testing {
@@ -91,11 +154,24 @@ struct hil_testing {
     float test_coverage;
     bool hil_active;
     u32 test_timeout_ms;
-    struct timer_list hil_timer;
+    
+    struct hil_rig rigs[MAX_HIL_RIGS];
+    struct hil_assertion assertions[MAX_HIL_ASSERTIONS];
+    int assertion_count;
+    int running_count;
+    struct mutex sched_lock;            // test and capture state
+    struct workqueue_struct *wq;
 };
 
 static struct hil_testing global_hil_testing;
 
+static unsigned int hil_max_parallel = 8;
+module_param(hil_max_parallel, uint, 0644);
+MODULE_PARM_DESC(hil_max_parallel, "Tests the executor runs at once");
+
+static void hil_test_done(struct work_struct *work);
+static void hil_test_eval(struct work_struct *work);
+
 /**
  * Initialize HIL testing
  */
@@ -113,6 +189,15 @@ static int hil_testing_init(void)
     global_hil_testing.test_coverage = 0.0;
     global_hil_testing.hil_active = false;
     global_hil_testing.test_timeout_ms = HIL_TEST_TIMEOUT_MS;
+    global_hil_testing.assertion_count = 0;
+    global_hil_testing.running_count = 0;
+    mutex_init(&global_hil_testing.sched_lock);
+    
+    // Unbound: tests on different rigs must not wait on each other's CPU
+    global_hil_testing.wq = alloc_workqueue("hil_exec", WQ_UNBOUND, 0);
+    if (!global_hil_testing.wq) {
+        return -ENOMEM;
+    }
     
     // Initialize tests
     for (i = 0; i < MAX_HIL_TESTS; i++) {
@@ -129,6 +214,11 @@ static int hil_testing_init(void)
         global_hil_testing.tests[i].test_time_ms = 0;
         global_hil_testing.tests[i].start_time = 0;
         global_hil_testing.tests[i].end_time = 0;
+        global_hil_testing.tests[i].queued = false;
+        bitmap_zero(global_hil_testing.tests[i].signals, MAX_HIL_SIGNALS);
+        INIT_LIST_HEAD(&global_hil_testing.tests[i].assertions);
+        INIT_DELAYED_WORK(&global_hil_testing.tests[i].done_work, hil_test_done);
+        INIT_WORK(&global_hil_testing.tests[i].eval_work, hil_test_eval);
     }
     
     // Initialize signals
@@ -144,6 +234,10 @@ static int hil_testing_init(void)
         global_hil_testing.signals[i].sample_rate_hz = 1000;
         global_hil_testing.signals[i].error_count = 0;
         global_hil_testing.signals[i].timestamp = 0;
+        global_hil_testing.signals[i].rig = -1;
+        global_hil_testing.signals[i].ring = NULL;
+        atomic_set(&global_hil_testing.signals[i].head, 0);
+        global_hil_testing.signals[i].owner = -1;
     }
     
     // Initialize stimuli
@@ -281,83 +375,410 @@ static int hil_add_stimulus(const char *name, u32 duration_ms, float amplitude,
 }
 
 /**
- * Start HIL test
+ * Register a rig's capture ops
  */
-static int hil_start_test(int test_id)
+int hil_register_rig(u32 rig, const struct hil_rig_ops *ops, void *ctx)
 {
-    if (test_id >= MAX_HIL_TESTS) {
-        pr_err("Invalid HIL test ID\n");
+    if (rig >= MAX_HIL_RIGS || !ops || !ops->capture_start || !ops->capture_stop) {
         return -EINVAL;
     }
     
-    struct hil_test *test = &global_hil_testing.tests[test_id];
+    mutex_lock(&global_hil_testing.sched_lock);
+    global_hil_testing.rigs[rig].ops = ops;
+    global_hil_testing.rigs[rig].ctx = ctx;
+    mutex_unlock(&global_hil_testing.sched_lock);
     
-    if (strlen(test->name) == 0) {
-        pr_err("HIL test %d is not initialized\n", test_id);
+    pr_info("HIL rig %u registered\n", rig);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(hil_register_rig);
+
+/**
+ * Put a signal on a rig channel
+ */
+int hil_signal_attach(u32 signal_id, u32 rig, u32 channel)
+{
+    struct hil_signal *sig;
+    int ret = 0;
+    
+    if (signal_id >= MAX_HIL_SIGNALS || rig >= MAX_HIL_RIGS) {
         return -EINVAL;
     }
+    sig = &global_hil_testing.signals[signal_id];
+    
+    mutex_lock(&global_hil_testing.sched_lock);
+    if (sig->owner >= 0) {
+        ret = -EBUSY;
+    } else {
+        sig->rig = rig;
+        sig->channel = channel;
+        sig->ring_samples = roundup_pow_of_two(max_t(u32, HIL_RING_MIN_SAMPLES,
+                                                     sig->sample_rate_hz / 1000 * HIL_RING_MS));
+    }
+    mutex_unlock(&global_hil_testing.sched_lock);
     
-    if (test->running) {
-        pr_err("HIL test %d is already running\n", test_id);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(hil_signal_attach);
+
+/**
+ * A DMA period landed in a signal's ring
+ *
+ * Called by the rig from its DMA completion, in any context.
+ */
+void hil_signal_advance(u32 signal_id, u32 samples)
+{
+    struct hil_signal *sig;
+    int owner;
+    
+    if (signal_id >= MAX_HIL_SIGNALS) {
+        return;
+    }
+    sig = &global_hil_testing.signals[signal_id];
+    
+    // The samples are in memory before anyone can see the new head
+    smp_wmb();
+    atomic_add(samples, &sig->head);
+    sig->timestamp = jiffies;
+    
+    owner = READ_ONCE(sig->owner);
+    if (owner >= 0) {
+        queue_work(global_hil_testing.wq, &global_hil_testing.tests[owner].eval_work);
+    }
+}
+EXPORT_SYMBOL_GPL(hil_signal_advance);
+
+/**
+ * Add an assertion on a signal to a test
+ */
+static int hil_add_assertion(int test_id, u32 signal_id, enum hil_assert_type type,
+                             float lo, float hi, u32 window_ms)
+{
+    struct hil_test *test;
+    struct hil_assertion *a;
+    int ret = 0;
+    
+    if (test_id < 0 || test_id >= MAX_HIL_TESTS || signal_id >= MAX_HIL_SIGNALS || lo > hi) {
         return -EINVAL;
     }
+    test = &global_hil_testing.tests[test_id];
     
-    pr_info("Starting HIL test: %s\n", test->name);
+    mutex_lock(&global_hil_testing.sched_lock);
+    if (test->running) {
+        ret = -EBUSY;
+        goto out;
+    }
+    if (global_hil_testing.assertion_count >= MAX_HIL_ASSERTIONS) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    
+    a = &global_hil_testing.assertions[global_hil_testing.assertion_count++];
+    memset(a, 0, sizeof(*a));
+    a->signal_id = signal_id;
+    a->type = type;
+    a->lo = lo;
+    a->hi = hi;
+    a->window_ms = window_ms;
+    list_add_tail(&a->node, &test->assertions);
+    set_bit(signal_id, test->signals);
+    
+out:
+    mutex_unlock(&global_hil_testing.sched_lock);
+    return ret;
+}
+
+/**
+ * Run a test's assertions over the samples that arrived since last time
+ *
+ * Only ever runs from the test's eval work or, once that is stopped,
+ * from its completion, so the cursors have a single user.
+ */
+static void hil_evaluate(struct hil_test *test)
+{
+    struct hil_assertion *a;
     
-    test->running = true;
+    list_for_each_entry(a, &test->assertions, node) {
+        struct hil_signal *sig = &global_hil_testing.signals[a->signal_id];
+        u32 head, avail, mask;
+        float v = 0;
+        
+        if (!sig->ring) {
+            continue;
+        }
+        head = atomic_read(&sig->head);
+        smp_rmb();
+        
+        // The DMA lapped us: what it overwrote is lost, not misread
+        avail = head - a->cursor;
+        if (avail > sig->ring_samples) {
+            a->overruns += avail - sig->ring_samples;
+            a->cursor = head - sig->ring_samples;
+            avail = sig->ring_samples;
+        }
+        
+        mask = sig->ring_samples - 1;
+        for (; avail; avail--, a->cursor++) {
+            bool inside;
+            
+            v = READ_ONCE(sig->ring[a->cursor & mask]);
+            inside = v >= a->lo && v <= a->hi;
+            
+            switch (a->type) {
+            case HIL_ASSERT_RANGE:
+                if (!inside) {
+                    a->failures++;
+                }
+                break;
+            case HIL_ASSERT_MEAN:
+                a->sum += v;
+                if (++a->n >= a->window_samples) {
+                    float mean = a->sum / a->n;
+                    
+                    if (mean < a->lo || mean > a->hi) {
+                        a->failures++;
+                    }
+                    a->sum = 0;
+                    a->n = 0;
+                }
+                break;
+            case HIL_ASSERT_REACH:
+                if (a->met || a->failures) {
+                    break;
+                }
+                if (inside) {
+                    a->met = true;
+                } else if (a->cursor - a->start >= a->window_samples) {
+                    a->failures++;
+                }
+                break;
+            }
+        }
+        sig->current_value = v;
+    }
+}
+
+static void hil_test_eval(struct work_struct *work)
+{
+    struct hil_test *test = container_of(work, struct hil_test, eval_work);
+    
+    if (READ_ONCE(test->running)) {
+        hil_evaluate(test);
+    }
+}
+
+/**
+ * Stop the captures a test holds, from the last signal it got
+ */
+static void hil_release_signals(struct hil_test *test, int upto)
+{
+    int i;
+    
+    for_each_set_bit(i, test->signals, upto) {
+        struct hil_signal *sig = &global_hil_testing.signals[i];
+        
+        WRITE_ONCE(sig->owner, -1);
+    }
+    
+    // Nothing can queue the eval work now
+    cancel_work_sync(&test->eval_work);
+    
+    for_each_set_bit(i, test->signals, upto) {
+        struct hil_signal *sig = &global_hil_testing.signals[i];
+        
+        if (sig->ring) {
+            global_hil_testing.rigs[sig->rig].ops->capture_stop(global_hil_testing.rigs[sig->rig].ctx,
+                                                                sig->channel);
+            sig->ring = NULL;
+        }
+    }
+}
+
+/**
+ * Start a test if none of its signals is in use; sched_lock held
+ */
+static int hil_try_start_locked(struct hil_test *test)
+{
+    struct hil_assertion *a;
+    int i;
+    
+    for_each_set_bit(i, test->signals, MAX_HIL_SIGNALS) {
+        if (global_hil_testing.signals[i].owner >= 0) {
+            return -EBUSY;
+        }
+    }
+    
+    for_each_set_bit(i, test->signals, MAX_HIL_SIGNALS) {
+        struct hil_signal *sig = &global_hil_testing.signals[i];
+        struct hil_rig *rig = sig->rig >= 0 ? &global_hil_testing.rigs[sig->rig] : NULL;
+        
+        // A signal no rig samples gives its assertions nothing to see
+        if (rig && rig->ops) {
+            sig->ring = rig->ops->capture_start(rig->ctx, sig->channel, sig->sample_rate_hz,
+                                                sig->ring_samples);
+            if (!sig->ring) {
+                pr_err("HIL signal %s: capture did not start\n", sig->name);
+                hil_release_signals(test, i);
+                return -EIO;
+            }
+        }
+        sig->owner = test->test_id;
+    }
+    
+    list_for_each_entry(a, &test->assertions, node) {
+        struct hil_signal *sig = &global_hil_testing.signals[a->signal_id];
+        
+        a->start = a->cursor = atomic_read(&sig->head);
+        a->window_samples = max_t(u32, 1, (u64)a->window_ms * sig->sample_rate_hz / 1000);
+        a->sum = 0;
+        a->n = 0;
+        a->met = false;
+        a->failures = 0;
+        a->overruns = 0;
+    }
+    
+    test->queued = false;
     test->passed = false;
     test->error_count = 0;
     test->start_time = jiffies;
-    
-    // Initialize HIL timer
-    timer_setup(&global_hil_testing.hil_timer, hil_test_timer, 0);
-    mod_timer(&global_hil_testing.hil_timer, jiffies + msecs_to_jiffies(test->duration_ms));
-    
+    WRITE_ONCE(test->running, true);
+    global_hil_testing.running_count++;
     global_hil_testing.hil_active = true;
     
+    queue_delayed_work(global_hil_testing.wq, &test->done_work,
+                       msecs_to_jiffies(test->duration_ms));
+    
+    pr_info("Starting HIL test: %s\n", test->name);
     return 0;
 }
 
 /**
- * HIL test timer
+ * Start every queued test that can run now; sched_lock held
  */
-static void hil_test_timer(struct timer_list *t)
+static int hil_schedule_locked(void)
 {
-    int i;
+    int i, started = 0;
+    
+    for (i = 0; i < MAX_HIL_TESTS; i++) {
+        struct hil_test *test = &global_hil_testing.tests[i];
+        
+        if (global_hil_testing.running_count >= hil_max_parallel) {
+            break;
+        }
+        if (test->queued && !test->running && !hil_try_start_locked(test)) {
+            started++;
+        }
+    }
+    
+    return started;
+}
+
+/**
+ * Start HIL test
+ */
+static int hil_start_test(int test_id)
+{
+    struct hil_test *test;
+    int ret;
+    
+    if (test_id < 0 || test_id >= MAX_HIL_TESTS) {
+        pr_err("Invalid HIL test ID\n");
+        return -EINVAL;
+    }
+    
+    test = &global_hil_testing.tests[test_id];
+    
+    if (strlen(test->name) == 0) {
+        pr_err("HIL test %d is not initialized\n", test_id);
+        return -EINVAL;
+    }
     
-    pr_debug("HIL test timer tick\n");
+    mutex_lock(&global_hil_testing.sched_lock);
+    if (test->running) {
+        pr_err("HIL test %d is already running\n", test_id);
+        ret = -EINVAL;
+    } else {
+        ret = hil_try_start_locked(test);
+    }
+    mutex_unlock(&global_hil_testing.sched_lock);
+    
+    return ret;
+}
+
+/**
+ * Queue every defined test and start as many as can run together
+ */
+static int hil_run_all(void)
+{
+    int i, started;
     
-    // Simulate HIL test execution
-    for (i = 0; i < global_hil_testing.test_count; i++) {
+    mutex_lock(&global_hil_testing.sched_lock);
+    for (i = 0; i < MAX_HIL_TESTS; i++) {
         struct hil_test *test = &global_hil_testing.tests[i];
         
-        if (test->running) {
-            // Simulate test execution
-            test->test_time_ms = jiffies_to_msecs(jiffies - test->start_time);
-            
-            // Check if test should complete
-            if (test->test_time_ms >= test->duration_ms) {
-                test->running = false;
-                test->end_time = jiffies;
-                test->passed = true; // Simulate test pass
-                
-                atomic_inc(&global_hil_testing.total_tests);
-                
-                pr_info("HIL test %d completed: %s, passed=%s, time=%d ms\n",
-                        i, test->name, test->passed ? "yes" : "no", test->test_time_ms);
-            }
+        if (strlen(test->name) && !test->running) {
+            test->queued = true;
         }
     }
+    started = hil_schedule_locked();
+    mutex_unlock(&global_hil_testing.sched_lock);
     
-    // Reschedule timer if any tests are still running
-    for (i = 0; i < global_hil_testing.test_count; i++) {
-        if (global_hil_testing.tests[i].running) {
-            mod_timer(&global_hil_testing.hil_timer, jiffies + msecs_to_jiffies(100)); // 100ms interval
-            return;
+    pr_info("HIL executor: %d tests started\n", started);
+    return started;
+}
+
+/**
+ * Finish a test: last samples, verdict, and its signals to the next one
+ */
+static void hil_finish_locked(struct hil_test *test, bool completed)
+{
+    struct hil_assertion *a;
+    
+    // Stopped early: a completion left queued would end a later run of it
+    cancel_delayed_work(&test->done_work);
+    hil_release_signals(test, MAX_HIL_SIGNALS);
+    hil_evaluate(test);
+    
+    list_for_each_entry(a, &test->assertions, node) {
+        if (a->type == HIL_ASSERT_REACH && !a->met && !a->failures) {
+            a->failures++;
+        }
+        if (a->overruns) {
+            pr_warn("HIL test %s: %u samples of %s overrun\n", test->name, a->overruns,
+                    global_hil_testing.signals[a->signal_id].name);
         }
+        test->error_count += a->failures;
     }
     
-    global_hil_testing.hil_active = false;
+    WRITE_ONCE(test->running, false);
+    test->end_time = jiffies;
+    test->test_time_ms = jiffies_to_msecs(test->end_time - test->start_time);
+    test->passed = completed && test->error_count == 0;
+    global_hil_testing.total_errors += test->error_count;
+    global_hil_testing.running_count--;
+    global_hil_testing.hil_active = global_hil_testing.running_count > 0;
+    
+    if (completed) {
+        atomic_inc(&global_hil_testing.total_tests);
+        pr_info("HIL test %d completed: %s, passed=%s, errors=%u, time=%d ms\n",
+                test->test_id, test->name, test->passed ? "yes" : "no",
+                test->error_count, test->test_time_ms);
+    }
+}
+
+/**
+ * HIL test completion
+ */
+static void hil_test_done(struct work_struct *work)
+{
+    struct hil_test *test = container_of(to_delayed_work(work), struct hil_test, done_work);
+    
+    mutex_lock(&global_hil_testing.sched_lock);
+    if (test->running) {
+        hil_finish_locked(test, true);
+        hil_schedule_locked();
+    }
+    mutex_unlock(&global_hil_testing.sched_lock);
 }
 
 /**
@@ -365,23 +786,31 @@ static void hil_test_timer(struct timer_list *t)
  */
 static int hil_stop_test(int test_id)
 {
-    if (test_id >= MAX_HIL_TESTS) {
+    struct hil_test *test;
+    
+    if (test_id < 0 || test_id >= MAX_HIL_TESTS) {
         pr_err("Invalid HIL test ID\n");
         return -EINVAL;
     }
     
-    struct hil_test *test = &global_hil_testing.tests[test_id];
+    test = &global_hil_testing.tests[test_id];
     
+    // The completion takes sched_lock, so it is stopped before we take it
+    cancel_delayed_work_sync(&test->done_work);
+    
+    mutex_lock(&global_hil_testing.sched_lock);
+    test->queued = false;
     if (!test->running) {
+        mutex_unlock(&global_hil_testing.sched_lock);
         pr_err("HIL test %d is not running\n", test_id);
         return -EINVAL;
     }
     
     pr_info("Stopping HIL test: %s\n", test->name);
     
-    test->running = false;
-    test->end_time = jiffies;
-    test->test_time_ms = jiffies_to_msecs(test->end_time - test->start_time);
+    hil_finish_locked(test, false);
+    hil_schedule_locked();
+    mutex_unlock(&global_hil_testing.sched_lock);
     
     return 0;
 }
@@ -431,10 +860,21 @@ static int __init hil_testing_init_module(void)
  */
 static void __exit hil_testing_cleanup_module(void)
 {
-    // Cleanup HIL timer
-    if (global_hil_testing.hil_active) {
-        del_timer_sync(&global_hil_testing.hil_timer);
+    int i;
+    
+    // Stop the executor: nothing queued may start behind the tests we stop
+    mutex_lock(&global_hil_testing.sched_lock);
+    for (i = 0; i < MAX_HIL_TESTS; i++) {
+        global_hil_testing.tests[i].queued = false;
+    }
+    mutex_unlock(&global_hil_testing.sched_lock);
+    
+    for (i = 0; i < MAX_HIL_TESTS; i++) {
+        if (global_hil_testing.tests[i].running) {
+            hil_stop_test(i);
+        }
     }
+    destroy_workqueue(global_hil_testing.wq);
     
     pr_info("HIL Testing unloaded\n");
 }
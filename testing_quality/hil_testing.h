@@ -0,0 +1,29 @@
+/**
+ * HIL rig interface
+ *
+ * A rig driver registers its capture ops with hil_register_rig() and
+ * signals are attached to one of its channels with hil_signal_attach().
+ * When a test that asserts on a signal starts, hil_testing.c asks the
+ * rig to start a cyclic DMA capture of that channel at the signal's
+ * sample rate into a ring of ring_samples floats the rig provides; the
+ * rig then reports every completed DMA period with hil_signal_advance(),
+ * from any context, and the samples are checked against the test's
+ * assertions as they arrive. Tests whose signals do not overlap run at
+ * the same time.
+ */
+
+#ifndef HIL_TESTING_H
+#define HIL_TESTING_H
+
+#include <linux/types.h>
+
+struct hil_rig_ops {
+    float *(*capture_start)(void *ctx, u32 channel, u32 sample_rate_hz, u32 ring_samples);
+    void (*capture_stop)(void *ctx, u32 channel);
+};
+
+int hil_register_rig(u32 rig, const struct hil_rig_ops *ops, void *ctx);
+int hil_signal_attach(u32 signal_id, u32 rig, u32 channel);
+void hil_signal_advance(u32 signal_id, u32 samples);
+
+#endif /* HIL_TESTING_H */
@@ -2,24 +2,1556 @@
  * LoRaWAN Implementation
  * Author: jk1806
  * Created: 2024-10-01
- * 
+ *
  * Implementation for embedded systems
+ *
+ * End device MAC. Everything runs in one work item, woken by the radio's
+ * completions and by an hrtimer set to the next thing due: a receive
+ * window, a ping slot, a beacon, a batch deadline or the end of a duty
+ * cycle back-off. Uplinks are built from per-port batches of records;
+ * each transmission charges its sub-band and the aggregated duty cycle,
+ * so the scheduler knows when the next one can go and batches keep
+ * filling until then.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/random.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/workqueue.h>
+#include <linux/crc-itu-t.h>
+#include <crypto/aes.h>
+#include <crypto/hash.h>
+#include <asm/unaligned.h>
 
-#define MODULE_VERSION "1.0.0"
+#include "lorawan.h"
+
+#define LORAWAN_VERSION "1.1.0"
+
+// EU868
+#define LORAWAN_MAX_CHANNELS 16
+#define LORAWAN_DEFAULT_CHANNELS 3          // 868.1, 868.3, 868.5 MHz, not modifiable
+#define LORAWAN_DR_MAX 5                    // SF7 BW125
+#define LORAWAN_TX_POWER_MAX_DBM 16
+#define LORAWAN_TX_POWER_STEPS 8
+#define LORAWAN_RX2_FREQ 869525000
+#define LORAWAN_RX2_DR 0
+#define LORAWAN_BEACON_FREQ 869525000
+#define LORAWAN_BEACON_DR 3
+#define LORAWAN_FREQ_MIN 863000000
+#define LORAWAN_FREQ_MAX 870000000
+
+#define LORAWAN_RX1_DELAY_MS 1000
+#define LORAWAN_JOIN_DELAY1_MS 5000
+#define LORAWAN_RX_EARLY_MS 20              // windows open this early against timer slack
+#define LORAWAN_ADR_ACK_LIMIT 64
+#define LORAWAN_ADR_ACK_DELAY 32
+#define LORAWAN_CONFIRMED_TRIES 8
+#define LORAWAN_MAX_FOPTS 15
+
+#define LORAWAN_TX_QUEUE 8                  // batches in the queue
+#define LORAWAN_BATCH_FULL 7                // eighths of the capacity at which a batch goes
+
+// Class B
+#define LORAWAN_BEACON_PERIOD_MS 128000
+#define LORAWAN_BEACON_RESERVED_MS 2120
+#define LORAWAN_BEACON_LEN 17
+#define LORAWAN_BEACON_WIDEN_MS 3           // per missed beacon, for clock drift
+#define LORAWAN_BEACON_LOST_MAX 56          // about two hours without beacons
+#define LORAWAN_PING_SLOT_MS 30
+#define LORAWAN_PING_FREQ 869525000
+#define LORAWAN_PING_DR 3
+
+#define LORAWAN_EV_TX_DONE 0
+#define LORAWAN_EV_RX_DONE 1
+#define LORAWAN_EV_RX_TIMEOUT 2
+
+// MHDR message types
+#define LORAWAN_MTYPE_JOIN_REQUEST 0x00
+#define LORAWAN_MTYPE_JOIN_ACCEPT 0x20
+#define LORAWAN_MTYPE_UNCONF_UP 0x40
+#define LORAWAN_MTYPE_UNCONF_DOWN 0x60
+#define LORAWAN_MTYPE_CONF_UP 0x80
+#define LORAWAN_MTYPE_CONF_DOWN 0xa0
+#define LORAWAN_MTYPE_MASK 0xe0
+
+// FCtrl
+#define LORAWAN_FCTRL_ADR 0x80
+#define LORAWAN_FCTRL_ADR_ACK_REQ 0x40
+#define LORAWAN_FCTRL_ACK 0x20
+#define LORAWAN_FCTRL_CLASS_B 0x10          // uplink
+#define LORAWAN_FCTRL_FPENDING 0x10         // downlink
+#define LORAWAN_FCTRL_FOPTS_LEN 0x0f
+
+// MAC command identifiers
+#define LORAWAN_CID_LINK_CHECK 0x02
+#define LORAWAN_CID_LINK_ADR 0x03
+#define LORAWAN_CID_DUTY_CYCLE 0x04
+#define LORAWAN_CID_RX_PARAM_SETUP 0x05
+#define LORAWAN_CID_DEV_STATUS 0x06
+#define LORAWAN_CID_NEW_CHANNEL 0x07
+#define LORAWAN_CID_RX_TIMING_SETUP 0x08
+#define LORAWAN_CID_TX_PARAM_SETUP 0x09
+#define LORAWAN_CID_DL_CHANNEL 0x0a
+#define LORAWAN_CID_DEVICE_TIME 0x0d
+#define LORAWAN_CID_PING_SLOT_INFO 0x10
+#define LORAWAN_CID_PING_SLOT_CHANNEL 0x11
+#define LORAWAN_CID_BEACON_TIMING 0x12
+#define LORAWAN_CID_BEACON_FREQ 0x13
+
+enum lorawan_radio_state {
+    LORAWAN_RADIO_IDLE,
+    LORAWAN_RADIO_TX,
+    LORAWAN_RADIO_RX1,
+    LORAWAN_RADIO_RX2,
+    LORAWAN_RADIO_RX_CONT,                  // class C
+    LORAWAN_RADIO_BEACON,
+    LORAWAN_RADIO_PING
+};
+
+struct lorawan_channel {
+    u32 freq_hz;                            // 0 if not defined
+    u32 dl_freq_hz;                         // RX1, 0 for freq_hz
+    u8 dr_min;
+    u8 dr_max;
+};
+
+// ETSI EN 300 220 sub-bands and their duty cycle, as 1 / dc_inv
+struct lorawan_band {
+    u32 lo;
+    u32 hi;
+    u16 dc_inv;
+};
+
+static const struct lorawan_band lorawan_bands[] = {
+    { 863000000, 865000000, 1000 },
+    { 865000000, 868000000, 100 },
+    { 868000000, 868600000, 100 },
+    { 868700000, 869200000, 1000 },
+    { 869400000, 869650000, 10 },
+    { 869700000, 870000000, 100 },
+};
+
+// FRMPayload limit per data rate, FOpts included
+static const u8 lorawan_max_payload[LORAWAN_DR_MAX + 1] = { 51, 51, 51, 115, 222, 222 };
+
+// Records of one FPort waiting for an uplink, each a length byte and its bytes
+struct lorawan_batch {
+    bool used;
+    bool confirmed;
+    u8 port;
+    u8 len;
+    u8 records;
+    u64 deadline_ns;
+    u8 data[LORAWAN_MAX_FRAME];
+};
+
+struct lorawan_mac {
+    const struct lorawan_radio_ops *radio;
+    void *radio_ctx;
+    const struct lorawan_app_ops *app;
+    void *app_ctx;
+    struct mutex lock;
+    struct workqueue_struct *wq;
+    struct work_struct work;
+    struct hrtimer timer;
+    struct crypto_shash *cmac;
+    
+    // Radio completions, handed over from the callbacks
+    spinlock_t event_lock;
+    unsigned long events;
+    u8 rx_buf[LORAWAN_MAX_FRAME];
+    u8 rx_len;
+    s8 rx_snr;
+    u64 rx_ns;
+    
+    // Session
+    bool joined;
+    bool joining;
+    u8 dev_eui[LORAWAN_EUI_LEN];
+    u8 app_eui[LORAWAN_EUI_LEN];
+    u8 app_key[LORAWAN_KEY_LEN];
+    u16 dev_nonce;
+    u32 join_tries;
+    u32 dev_addr;
+    u8 nwk_skey[LORAWAN_KEY_LEN];
+    u8 app_skey[LORAWAN_KEY_LEN];
+    u32 fcnt_up;
+    u32 fcnt_down;
+    bool fcnt_down_valid;
+    
+    // Radio parameters, as set by the network
+    struct lorawan_channel channels[LORAWAN_MAX_CHANNELS];
+    u16 ch_mask;
+    u64 band_ready_ns[ARRAY_SIZE(lorawan_bands)];
+    u64 agg_ready_ns;                       // aggregated duty cycle, DutyCycleReq
+    u8 max_dcycle;
+    u8 dr;
+    u8 tx_power;                            // 0 is the maximum, 2 dB a step
+    u8 nb_trans;
+    bool adr;
+    u32 adr_ack_cnt;
+    u8 rx1_dr_offset;
+    u8 rx2_dr;
+    u32 rx2_freq;
+    u32 rx1_delay_ms;
+    
+    enum lorawan_class cls;
+    enum lorawan_radio_state state;
+    u64 rx1_at;                             // class A windows of the uplink in flight, 0 if none
+    u64 rx2_at;
+    
+    // Uplink in flight: kept as built, for NbTrans and confirmed retries
+    u8 tx_frame[LORAWAN_MAX_FRAME];
+    u8 tx_len;
+    u8 tx_left;
+    u8 tx_ch;
+    u8 tx_dr;
+    bool tx_confirmed;
+    bool tx_join;
+    bool tx_acked;
+    bool rx_valid;                          // the current round received a downlink
+    
+    struct lorawan_batch batches[LORAWAN_TX_QUEUE];
+    bool ack_pending;                       // confirmed downlink to acknowledge
+    bool uplink_asap;                       // send even without data, for MAC answers or FPending
+    u8 mac_ans[LORAWAN_MAX_FOPTS];
+    u8 mac_ans_len;
+    u8 mac_sticky[LORAWAN_MAX_FOPTS];       // answers repeated until a downlink comes
+    u8 mac_sticky_len;
+    
+    // Class B
+    u8 ping_periodicity;
+    u32 ping_freq;
+    u8 ping_dr;
+    u32 beacon_freq;
+    bool beacon_locked;
+    u32 beacon_time;                        // GPS seconds of the last beacon
+    u64 beacon_ns;                          // when it was, or would have been, sent
+    u32 beacons_missed;
+    u64 beacon_at;                          // next beacon window, 0 if none
+    u16 ping_offset;
+    u16 ping_period;
+    u16 ping_nb;
+    u16 ping_next;                          // next ping slot in this beacon period
+    u64 ping_at;
+    
+    u32 uplinks;
+    u32 downlinks;
+    u32 retransmissions;
+    u32 records_sent;
+    u32 records_dropped;
+    u32 dc_deferrals;
+    u32 mic_errors;
+};
+
+static struct lorawan_mac lorawan;
+
+static enum hrtimer_restart lorawan_timer(struct hrtimer *timer)
+{
+    queue_work(lorawan.wq, &lorawan.work);
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * Time on air of a LoRa frame at 125 kHz, explicit header, CRC on,
+ * coding rate 4/5, 8 preamble symbols
+ */
+static u32 lorawan_airtime_us(u8 dr, u8 len)
+{
+    int sf = 12 - dr;
+    int de = sf >= 11;                      // low data rate optimisation
+    int num = 8 * len - 4 * sf + 28 + 16;
+    u32 tsym = (1 << sf) * 8;
+    u32 nsym = 8 + (num > 0 ? DIV_ROUND_UP(num, 4 * (sf - 2 * de)) * 5 : 0);
+    
+    return (49 + 4 * nsym) * tsym / 4;     // preamble is 12.25 symbols
+}
+
+// Long enough to catch a preamble despite the early opening
+static u32 lorawan_window_ms(u8 dr, u32 widen_ms)
+{
+    return 2 * (LORAWAN_RX_EARLY_MS + widen_ms) + DIV_ROUND_UP(8 * (1 << (12 - dr)) * 8, 1000);
+}
+
+static int lorawan_band(u32 freq)
+{
+    int i;
+    
+    for (i = 0; i < ARRAY_SIZE(lorawan_bands); i++) {
+        if (freq >= lorawan_bands[i].lo && freq < lorawan_bands[i].hi) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static bool lorawan_freq_valid(u32 freq)
+{
+    return freq >= LORAWAN_FREQ_MIN && freq < LORAWAN_FREQ_MAX && lorawan_band(freq) >= 0;
+}
+
+static u32 lorawan_get_freq(const u8 *p)
+{
+    return (p[0] | p[1] << 8 | p[2] << 16) * 100;
+}
+
+static void lorawan_default_channels(void)
+{
+    int i;
+    
+    memset(lorawan.channels, 0, sizeof(lorawan.channels));
+    for (i = 0; i < LORAWAN_DEFAULT_CHANNELS; i++) {
+        lorawan.channels[i].freq_hz = 868100000 + i * 200000;
+        lorawan.channels[i].dr_max = LORAWAN_DR_MAX;
+    }
+    lorawan.ch_mask = BIT(LORAWAN_DEFAULT_CHANNELS) - 1;
+}
+
+static bool lorawan_dr_usable(u8 dr, u16 mask)
+{
+    int i;
+    
+    for (i = 0; i < LORAWAN_MAX_CHANNELS; i++) {
+        if ((mask & BIT(i)) && lorawan.channels[i].freq_hz &&
+            dr >= lorawan.channels[i].dr_min && dr <= lorawan.channels[i].dr_max) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * A random channel, of those enabled for dr, whose sub-band may send
+ * now; otherwise -EBUSY with *ready_ns set to when one can
+ */
+static int lorawan_pick_channel(u8 dr, u64 now, u64 *ready_ns)
+{
+    int i, n = 0, band, pick[LORAWAN_MAX_CHANNELS];
+    u64 earliest = U64_MAX;
+    
+    for (i = 0; i < LORAWAN_MAX_CHANNELS; i++) {
+        if (!(lorawan.ch_mask & BIT(i)) || !lorawan.channels[i].freq_hz ||
+            dr < lorawan.channels[i].dr_min || dr > lorawan.channels[i].dr_max) {
+            continue;
+        }
+        band = lorawan_band(lorawan.channels[i].freq_hz);
+        if (max(lorawan.band_ready_ns[band], lorawan.agg_ready_ns) <= now) {
+            pick[n++] = i;
+        } else {
+            earliest = min(earliest, max(lorawan.band_ready_ns[band], lorawan.agg_ready_ns));
+        }
+    }
+    
+    if (!n) {
+        *ready_ns = earliest;
+        return earliest == U64_MAX ? -ENOENT : -EBUSY;
+    }
+    return pick[get_random_u32_below(n)];
+}
+
+// AES-CMAC over up to two pieces; the first four bytes are the MIC
+static u32 lorawan_mic(const u8 *key, const u8 *b0, const u8 *msg, u8 len)
+{
+    SHASH_DESC_ON_STACK(desc, lorawan.cmac);
+    u8 mac[AES_BLOCK_SIZE];
+    
+    desc->tfm = lorawan.cmac;
+    if (crypto_shash_setkey(lorawan.cmac, key, LORAWAN_KEY_LEN) || crypto_shash_init(desc) ||
+        (b0 && crypto_shash_update(desc, b0, AES_BLOCK_SIZE)) || crypto_shash_update(desc, msg, len) ||
+        crypto_shash_final(desc, mac)) {
+        return 0;
+    }
+    return get_unaligned_le32(mac);
+}
+
+// The block layout shared by frame MICs (0x49) and payload encryption (0x01)
+static void lorawan_block(u8 *block, u8 type, bool down, u32 fcnt, u8 last)
+{
+    memset(block, 0, AES_BLOCK_SIZE);
+    block[0] = type;
+    block[5] = down;
+    put_unaligned_le32(lorawan.dev_addr, block + 6);
+    put_unaligned_le32(fcnt, block + 10);
+    block[15] = last;
+}
+
+static u32 lorawan_frame_mic(bool down, u32 fcnt, const u8 *msg, u8 len)
+{
+    u8 b0[AES_BLOCK_SIZE];
+    
+    lorawan_block(b0, 0x49, down, fcnt, len);
+    return lorawan_mic(lorawan.nwk_skey, b0, msg, len);
+}
+
+// FRMPayload encryption, its own inverse
+static void lorawan_crypt(const u8 *key, bool down, u32 fcnt, u8 *data, u8 len)
+{
+    struct crypto_aes_ctx aes;
+    u8 a[AES_BLOCK_SIZE], s[AES_BLOCK_SIZE];
+    int i, j;
+    
+    aes_expandkey(&aes, key, LORAWAN_KEY_LEN);
+    for (i = 0; i * AES_BLOCK_SIZE < len; i++) {
+        lorawan_block(a, 0x01, down, fcnt, i + 1);
+        aes_encrypt(&aes, s, a);
+        for (j = 0; j < AES_BLOCK_SIZE && i * AES_BLOCK_SIZE + j < len; j++) {
+            data[i * AES_BLOCK_SIZE + j] ^= s[j];
+        }
+    }
+    memzero_explicit(&aes, sizeof(aes));
+}
+
+static void lorawan_mac_answer(bool sticky, const u8 *ans, u8 len)
+{
+    u8 *buf = sticky ? lorawan.mac_sticky : lorawan.mac_ans;
+    u8 *used = sticky ? &lorawan.mac_sticky_len : &lorawan.mac_ans_len;
+    
+    if (*used + len > LORAWAN_MAX_FOPTS) {
+        pr_warn_ratelimited("lorawan: MAC answer 0x%02x dropped, FOpts full\n", ans[0]);
+        return;
+    }
+    memcpy(buf + *used, ans, len);
+    *used += len;
+    lorawan.uplink_asap = true;
+}
+
+static u8 lorawan_link_adr(const u8 *cmd)
+{
+    u8 dr = cmd[1] >> 4, power = cmd[1] & 0x0f;
+    u16 mask = get_unaligned_le16(cmd + 2);
+    u8 cntl = (cmd[4] >> 4) & 0x07, nb = cmd[4] & 0x0f;
+    u8 status = 0x07;
+    int i;
+    
+    if (cntl == 6) {
+        mask = 0;
+        for (i = 0; i < LORAWAN_MAX_CHANNELS; i++) {
+            if (lorawan.channels[i].freq_hz) {
+                mask |= BIT(i);
+            }
+        }
+    } else if (cntl != 0) {
+        status &= ~0x01;
+    }
+    for (i = 0; i < LORAWAN_MAX_CHANNELS; i++) {
+        if ((mask & BIT(i)) && !lorawan.channels[i].freq_hz) {
+            status &= ~0x01;
+        }
+    }
+    if (!mask) {
+        status &= ~0x01;
+    }
+    
+    if (dr == 0x0f) {
+        dr = lorawan.dr;                    // keep
+    }
+    if (dr > LORAWAN_DR_MAX || !lorawan_dr_usable(dr, mask)) {
+        status &= ~0x02;
+    }
+    if (power == 0x0f) {
+        power = lorawan.tx_power;
+    }
+    if (power >= LORAWAN_TX_POWER_STEPS) {
+        status &= ~0x04;
+    }
+    
+    // All or nothing
+    if (status == 0x07) {
+        lorawan.ch_mask = mask;
+        lorawan.dr = dr;
+        lorawan.tx_power = power;
+        lorawan.nb_trans = nb ?: 1;
+    }
+    return status;
+}
+
+// Commands from FOpts or a port 0 payload; stops at the first one it does not know
+static void lorawan_mac_commands(const u8 *cmd, u8 len, s8 snr)
+{
+    u8 ans[3], status;
+    u32 freq;
+    int n;
+    
+    while (len) {
+        switch (cmd[0]) {
+        case LORAWAN_CID_LINK_CHECK:
+            n = 3;
+            break;
+        case LORAWAN_CID_LINK_ADR:
+            n = 5;
+            break;
+        case LORAWAN_CID_DUTY_CYCLE:
+        case LORAWAN_CID_RX_TIMING_SETUP:
+        case LORAWAN_CID_TX_PARAM_SETUP:
+            n = 2;
+            break;
+        case LORAWAN_CID_BEACON_TIMING:
+        case LORAWAN_CID_BEACON_FREQ:
+            n = 4;
+            break;
+        case LORAWAN_CID_RX_PARAM_SETUP:
+        case LORAWAN_CID_DL_CHANNEL:
+        case LORAWAN_CID_PING_SLOT_CHANNEL:
+            n = 5;
+            break;
+        case LORAWAN_CID_DEV_STATUS:
+        case LORAWAN_CID_PING_SLOT_INFO:
+            n = 1;
+            break;
+        case LORAWAN_CID_NEW_CHANNEL:
+        case LORAWAN_CID_DEVICE_TIME:
+            n = 6;
+            break;
+        default:
+            pr_warn("lorawan: Unknown MAC command 0x%02x\n", cmd[0]);
+            return;
+        }
+        if (n > len) {
+            pr_warn("lorawan: Truncated MAC command 0x%02x\n", cmd[0]);
+            return;
+        }
+    
+        ans[0] = cmd[0];
+        switch (cmd[0]) {
+        case LORAWAN_CID_LINK_ADR:
+            ans[1] = lorawan_link_adr(cmd);
+            lorawan_mac_answer(false, ans, 2);
+            break;
+    
+        case LORAWAN_CID_DUTY_CYCLE:
+            lorawan.max_dcycle = cmd[1] & 0x0f;
+            lorawan_mac_answer(false, ans, 1);
+            break;
+    
+        case LORAWAN_CID_RX_PARAM_SETUP:
+            freq = lorawan_get_freq(cmd + 2);
+            status = (((cmd[1] >> 4) & 0x07) <= 5) << 2 | ((cmd[1] & 0x0f) <= LORAWAN_DR_MAX) << 1 |
+                     lorawan_freq_valid(freq);
+            if (status == 0x07) {
+                lorawan.rx1_dr_offset = (cmd[1] >> 4) & 0x07;
+                lorawan.rx2_dr = cmd[1] & 0x0f;
+                lorawan.rx2_freq = freq;
+            }
+            ans[1] = status;
+            lorawan_mac_answer(true, ans, 2);
+            break;
+    
+        case LORAWAN_CID_DEV_STATUS:
+            ans[1] = 255;                   // battery level unknown
+            ans[2] = snr & 0x3f;
+            lorawan_mac_answer(false, ans, 3);
+            break;
+    
+        case LORAWAN_CID_NEW_CHANNEL:
+            freq = lorawan_get_freq(cmd + 2);
+            status = ((cmd[5] & 0x0f) <= (cmd[5] >> 4) && (cmd[5] >> 4) <= LORAWAN_DR_MAX) << 1 |
+                     (!freq || lorawan_freq_valid(freq));
+            if (cmd[1] < LORAWAN_DEFAULT_CHANNELS || cmd[1] >= LORAWAN_MAX_CHANNELS) {
+                status = 0;
+            }
+            if (status == 0x03) {
+                lorawan.channels[cmd[1]].freq_hz = freq;
+                lorawan.channels[cmd[1]].dl_freq_hz = 0;
+                lorawan.channels[cmd[1]].dr_min = cmd[5] & 0x0f;
+                lorawan.channels[cmd[1]].dr_max = cmd[5] >> 4;
+                if (freq) {
+                    lorawan.ch_mask |= BIT(cmd[1]);
+                } else {
+                    lorawan.ch_mask &= ~BIT(cmd[1]);
+                }
+            }
+            ans[1] = status;
+            lorawan_mac_answer(false, ans, 2);
+            break;
+    
+        case LORAWAN_CID_RX_TIMING_SETUP:
+            lorawan.rx1_delay_ms = max(cmd[1] & 0x0f, 1) * 1000;
+            lorawan_mac_answer(true, ans, 1);
+            break;
+    
+        case LORAWAN_CID_DL_CHANNEL:
+            freq = lorawan_get_freq(cmd + 2);
+            status = (cmd[1] < LORAWAN_MAX_CHANNELS && lorawan.channels[cmd[1]].freq_hz) << 1 |
+                     lorawan_freq_valid(freq);
+            if (status == 0x03) {
+                lorawan.channels[cmd[1]].dl_freq_hz = freq;
+            }
+            ans[1] = status;
+            lorawan_mac_answer(true, ans, 2);
+            break;
+    
+        case LORAWAN_CID_PING_SLOT_CHANNEL:
+            freq = lorawan_get_freq(cmd + 1);
+            status = ((cmd[4] & 0x0f) <= LORAWAN_DR_MAX) << 1 | (!freq || lorawan_freq_valid(freq));
+            if (status == 0x03) {
+                lorawan.ping_freq = freq ?: LORAWAN_PING_FREQ;
+                lorawan.ping_dr = cmd[4] & 0x0f;
+            }
+            ans[1] = status;
+            lorawan_mac_answer(false, ans, 2);
+            break;
+    
+        case LORAWAN_CID_BEACON_FREQ:
+            freq = lorawan_get_freq(cmd + 1);
+            status = !freq || lorawan_freq_valid(freq);
+            if (status) {
+                lorawan.beacon_freq = freq ?: LORAWAN_BEACON_FREQ;
+            }
+            ans[1] = status;
+            lorawan_mac_answer(false, ans, 2);
+            break;
+    
+        case LORAWAN_CID_LINK_CHECK:
+            pr_info("lorawan: Link check: margin %u dB, %u gateways\n", cmd[1], cmd[2]);
+            break;
+    
+        default:
+            // TxParamSetup is not used in EU868; the rest are answers needing nothing
+            break;
+        }
+    
+        cmd += n;
+        len -= n;
+    }
+}
+
+static void lorawan_derive_key(u8 *key, u8 type, const u8 *join_accept)
+{
+    struct crypto_aes_ctx aes;
+    u8 block[AES_BLOCK_SIZE] = { type };
+    
+    memcpy(block + 1, join_accept + 1, 6);  // AppNonce, NetID
+    put_unaligned_le16(lorawan.dev_nonce, block + 7);
+    aes_expandkey(&aes, lorawan.app_key, LORAWAN_KEY_LEN);
+    aes_encrypt(&aes, key, block);
+    memzero_explicit(&aes, sizeof(aes));
+}
+
+static bool lorawan_join_accept(u8 *frame, u8 len)
+{
+    struct crypto_aes_ctx aes;
+    int i;
+    
+    if (len != 17 && len != 33) {
+        return false;
+    }
+    
+    // The network encrypted it with AES decrypt, so encrypt decrypts it
+    aes_expandkey(&aes, lorawan.app_key, LORAWAN_KEY_LEN);
+    for (i = 1; i < len; i += AES_BLOCK_SIZE) {
+        aes_encrypt(&aes, frame + i, frame + i);
+    }
+    memzero_explicit(&aes, sizeof(aes));
+    
+    if (lorawan_mic(lorawan.app_key, NULL, frame, len - 4) != get_unaligned_le32(frame + len - 4)) {
+        lorawan.mic_errors++;
+        return false;
+    }
+    
+    lorawan_derive_key(lorawan.nwk_skey, 0x01, frame);
+    lorawan_derive_key(lorawan.app_skey, 0x02, frame);
+    lorawan.dev_addr = get_unaligned_le32(frame + 7);
+    lorawan.rx1_dr_offset = (frame[11] >> 4) & 0x07;
+    lorawan.rx2_dr = frame[11] & 0x0f;
+    lorawan.rx1_delay_ms = max(frame[12] & 0x0f, 1) * 1000;
+    
+    lorawan_default_channels();
+    if (len == 33) {
+        // CFList: channels 3 to 7
+        for (i = 0; i < 5; i++) {
+            u32 freq = lorawan_get_freq(frame + 13 + 3 * i);
+    
+            if (freq && lorawan_freq_valid(freq)) {
+                lorawan.channels[LORAWAN_DEFAULT_CHANNELS + i].freq_hz = freq;
+                lorawan.channels[LORAWAN_DEFAULT_CHANNELS + i].dr_max = LORAWAN_DR_MAX;
+                lorawan.ch_mask |= BIT(LORAWAN_DEFAULT_CHANNELS + i);
+            }
+        }
+    }
+    
+    lorawan.fcnt_up = 0;
+    lorawan.fcnt_down = 0;
+    lorawan.fcnt_down_valid = false;
+    lorawan.joining = false;
+    lorawan.joined = true;
+    pr_info("lorawan: Joined, DevAddr %08x\n", lorawan.dev_addr);
+    return true;
+}
+
+/*
+ * A frame received in a class A window, a ping slot or class C
+ * reception. Returns true if it was a valid downlink for us.
+ */
+static bool lorawan_downlink(u8 *frame, u8 len, s8 snr)
+{
+    u8 mtype, fctrl, fopts_len, port, *payload;
+    u32 fcnt;
+    int plen;
+    
+    if (len < 1) {
+        return false;
+    }
+    mtype = frame[0] & LORAWAN_MTYPE_MASK;
+    
+    if (mtype == LORAWAN_MTYPE_JOIN_ACCEPT) {
+        return lorawan.joining && lorawan_join_accept(frame, len);
+    }
+    if ((mtype != LORAWAN_MTYPE_UNCONF_DOWN && mtype != LORAWAN_MTYPE_CONF_DOWN) || !lorawan.joined ||
+        len < 12 || get_unaligned_le32(frame + 1) != lorawan.dev_addr) {
+        return false;
+    }
+    
+    fctrl = frame[5];
+    fopts_len = fctrl & LORAWAN_FCTRL_FOPTS_LEN;
+    plen = len - 12 - fopts_len;
+    if (plen < 0) {
+        return false;
+    }
+    
+    // Extend the 16-bit counter to the nearest value above the last one
+    fcnt = (lorawan.fcnt_down & ~0xffff) | get_unaligned_le16(frame + 6);
+    if (lorawan.fcnt_down_valid && fcnt <= lorawan.fcnt_down) {
+        fcnt += 0x10000;
+    }
+    if (lorawan_frame_mic(true, fcnt, frame, len - 4) != get_unaligned_le32(frame + len - 4)) {
+        lorawan.mic_errors++;
+        return false;
+    }
+    lorawan.fcnt_down = fcnt;
+    lorawan.fcnt_down_valid = true;
+    lorawan.downlinks++;
+    
+    // Any downlink: the network has the sticky answers and ADR is confirmed
+    lorawan.mac_sticky_len = 0;
+    lorawan.adr_ack_cnt = 0;
+    if (fctrl & LORAWAN_FCTRL_ACK) {
+        lorawan.tx_acked = true;
+    }
+    if (mtype == LORAWAN_MTYPE_CONF_DOWN) {
+        lorawan.ack_pending = true;
+        lorawan.uplink_asap |= lorawan.cls != LORAWAN_CLASS_A;
+    }
+    if (fctrl & LORAWAN_FCTRL_FPENDING) {
+        lorawan.uplink_asap = true;
+    }
+    
+    lorawan_mac_commands(frame + 8, fopts_len, snr);
+    
+    if (plen > 0) {
+        port = frame[8 + fopts_len];
+        payload = frame + 9 + fopts_len;
+        plen--;
+        if (port == 0) {
+            if (!fopts_len) {
+                lorawan_crypt(lorawan.nwk_skey, true, fcnt, payload, plen);
+                lorawan_mac_commands(payload, plen, snr);
+            }
+        } else {
+            lorawan_crypt(lorawan.app_skey, true, fcnt, payload, plen);
+            if (lorawan.app && lorawan.app->receive) {
+                lorawan.app->receive(lorawan.app_ctx, port, payload, plen);
+            }
+        }
+    }
+    return true;
+}
+
+static void lorawan_build_join(void)
+{
+    u8 *f = lorawan.tx_frame;
+    int i;
+    
+    f[0] = LORAWAN_MTYPE_JOIN_REQUEST;
+    for (i = 0; i < LORAWAN_EUI_LEN; i++) {
+        f[1 + i] = lorawan.app_eui[LORAWAN_EUI_LEN - 1 - i];
+        f[9 + i] = lorawan.dev_eui[LORAWAN_EUI_LEN - 1 - i];
+    }
+    lorawan.dev_nonce = get_random_u16();
+    put_unaligned_le16(lorawan.dev_nonce, f + 17);
+    put_unaligned_le32(lorawan_mic(lorawan.app_key, NULL, f, 19), f + 19);
+    
+    lorawan.tx_len = 23;
+    lorawan.tx_left = 1;
+    lorawan.tx_join = true;
+    lorawan.tx_confirmed = false;
+    
+    // Alternate down from the fastest rate, two tries at each
+    lorawan.tx_dr = LORAWAN_DR_MAX - min_t(u32, lorawan.join_tries / 2, LORAWAN_DR_MAX);
+    lorawan.join_tries++;
+}
+
+// Records that fit cap, from the front of the batch
+static u8 lorawan_batch_take(const struct lorawan_batch *b, u8 cap, u8 *records)
+{
+    u8 len = 0;
+    
+    *records = 0;
+    while (len < b->len && len + 1 + b->data[len] <= cap) {
+        len += 1 + b->data[len];
+        (*records)++;
+    }
+    return len;
+}
+
+// ADR back-off when the network stops answering
+static u8 lorawan_adr_step(void)
+{
+    u8 fctrl = LORAWAN_FCTRL_ADR;
+    
+    if (lorawan.adr_ack_cnt >= LORAWAN_ADR_ACK_LIMIT) {
+        fctrl |= LORAWAN_FCTRL_ADR_ACK_REQ;
+    }
+    if (lorawan.adr_ack_cnt > LORAWAN_ADR_ACK_LIMIT &&
+        !((lorawan.adr_ack_cnt - LORAWAN_ADR_ACK_LIMIT) % LORAWAN_ADR_ACK_DELAY)) {
+        if (lorawan.tx_power) {
+            lorawan.tx_power = 0;
+        } else if (lorawan.dr) {
+            lorawan.dr--;
+        } else {
+            lorawan_default_channels();
+            lorawan.nb_trans = 1;
+        }
+    }
+    lorawan.adr_ack_cnt++;
+    return fctrl;
+}
+
+/*
+ * Build the next data uplink from batch b, or an empty one carrying only
+ * FOpts if b is NULL: as many of its records as fit the data rate go,
+ * the rest stay for the next uplink
+ */
+static void lorawan_build_uplink(struct lorawan_batch *b, u8 cap)
+{
+    u8 *f = lorawan.tx_frame;
+    u8 fctrl = 0, fopts_len, len = 0, records = 0;
+    u8 *p;
+    
+    if (lorawan.adr) {
+        fctrl = lorawan_adr_step();
+    }
+    if (lorawan.ack_pending) {
+        fctrl |= LORAWAN_FCTRL_ACK;
+    }
+    if (lorawan.cls == LORAWAN_CLASS_B) {
+        fctrl |= LORAWAN_FCTRL_CLASS_B;
+    }
+    
+    fopts_len = lorawan.mac_sticky_len + lorawan.mac_ans_len;
+    f[0] = b && b->confirmed ? LORAWAN_MTYPE_CONF_UP : LORAWAN_MTYPE_UNCONF_UP;
+    put_unaligned_le32(lorawan.dev_addr, f + 1);
+    f[5] = fctrl | fopts_len;
+    put_unaligned_le16(lorawan.fcnt_up, f + 6);
+    memcpy(f + 8, lorawan.mac_sticky, lorawan.mac_sticky_len);
+    memcpy(f + 8 + lorawan.mac_sticky_len, lorawan.mac_ans, lorawan.mac_ans_len);
+    p = f + 8 + fopts_len;
+    
+    if (b) {
+        len = lorawan_batch_take(b, cap - fopts_len - 1, &records);
+        *p++ = b->port;
+        memcpy(p, b->data, len);
+        lorawan_crypt(lorawan.app_skey, false, lorawan.fcnt_up, p, len);
+        p += len;
+    
+        b->len -= len;
+        b->records -= records;
+        memmove(b->data, b->data + len, b->len);
+        if (!b->len) {
+            b->used = false;
+        }
+        lorawan.records_sent += records;
+    }
+    put_unaligned_le32(lorawan_frame_mic(false, lorawan.fcnt_up, f, p - f), p);
+    
+    lorawan.tx_len = p + 4 - f;
+    lorawan.tx_confirmed = f[0] == LORAWAN_MTYPE_CONF_UP;
+    lorawan.tx_left = lorawan.tx_confirmed ? LORAWAN_CONFIRMED_TRIES : lorawan.nb_trans;
+    lorawan.tx_join = false;
+    lorawan.tx_dr = lorawan.dr;
+    lorawan.fcnt_up++;
+    lorawan.mac_ans_len = 0;
+    lorawan.ack_pending = false;
+    lorawan.uplink_asap = false;
+}
+
+/*
+ * The batch to send now, if any: the one with the earliest deadline,
+ * once that deadline is reached or it is nearly full for cap. *wake_ns
+ * is lowered to the earliest deadline still ahead.
+ */
+static struct lorawan_batch *lorawan_batch_due(u64 now, u8 cap, u64 *wake_ns)
+{
+    struct lorawan_batch *b, *due = NULL;
+    int i;
+    
+    for (i = 0; i < LORAWAN_TX_QUEUE; i++) {
+        b = &lorawan.batches[i];
+        if (!b->used) {
+            continue;
+        }
+    
+        // Records the current data rate cannot carry are dropped, not held
+        while (b->len && b->data[0] + 2 > cap) {
+            pr_warn_ratelimited("lorawan: %u byte record on port %u too long for DR%u\n",
+                                b->data[0], b->port, lorawan.dr);
+            b->len -= 1 + b->data[0];
+            b->records--;
+            memmove(b->data, b->data + 1 + b->data[0], b->len);
+            lorawan.records_dropped++;
+        }
+        if (!b->len) {
+            b->used = false;
+            continue;
+        }
+    
+        if (b->deadline_ns <= now || b->len * 8 >= cap * LORAWAN_BATCH_FULL) {
+            if (!due || b->deadline_ns < due->deadline_ns) {
+                due = b;
+            }
+        } else {
+            *wake_ns = min(*wake_ns, b->deadline_ns);
+        }
+    }
+    return due;
+}
+
+static void lorawan_start_rx(enum lorawan_radio_state state, u32 freq, u8 dr, u32 timeout_ms)
+{
+    if (lorawan.state == LORAWAN_RADIO_RX_CONT) {
+        lorawan.radio->sleep(lorawan.radio_ctx);
+    }
+    lorawan.state = state;
+    if (lorawan.radio->rx(lorawan.radio_ctx, freq, dr, timeout_ms)) {
+        lorawan.state = LORAWAN_RADIO_IDLE;
+    }
+}
+
+// Start the next transmission if one is due and the duty cycle allows it
+static void lorawan_try_tx(u64 now, u64 *wake_ns)
+{
+    struct lorawan_batch *b = NULL;
+    u64 ready_ns, end_ns;
+    u32 airtime;
+    u8 cap;
+    int ch, band;
+    
+    if (!lorawan.tx_left) {
+        if (lorawan.joining) {
+            lorawan_build_join();
+        } else if (lorawan.joined) {
+            cap = lorawan_max_payload[lorawan.dr];
+            b = lorawan_batch_due(now, cap - lorawan.mac_sticky_len - lorawan.mac_ans_len, wake_ns);
+            if (!b && !lorawan.uplink_asap) {
+                return;
+            }
+        } else {
+            return;
+        }
+    }
+    
+    ch = lorawan_pick_channel(lorawan.tx_left ? lorawan.tx_dr : lorawan.dr, now, &ready_ns);
+    if (ch < 0) {
+        if (ch == -EBUSY) {
+            lorawan.dc_deferrals++;
+            *wake_ns = min(*wake_ns, ready_ns);
+        }
+        return;
+    }
+    
+    // Leave the next beacon window alone: the uplink and its windows must be over by then
+    if (lorawan.tx_left) {
+        airtime = lorawan_airtime_us(lorawan.tx_dr, lorawan.tx_len);
+    } else {
+        airtime = lorawan_airtime_us(lorawan.dr, min_t(u32, b ? b->len : 0, lorawan_max_payload[lorawan.dr]) + 13 +
+                                     lorawan.mac_sticky_len + lorawan.mac_ans_len);
+    }
+    end_ns = now + airtime * NSEC_PER_USEC + (lorawan.rx1_delay_ms + 1000 + 500) * NSEC_PER_MSEC;
+    if (lorawan.beacon_at && end_ns > lorawan.beacon_at) {
+        return;
+    }
+    
+    if (!lorawan.tx_left) {
+        lorawan_build_uplink(b, lorawan_max_payload[lorawan.dr]);
+        airtime = lorawan_airtime_us(lorawan.tx_dr, lorawan.tx_len);
+    } else if (!lorawan.tx_join) {
+        lorawan.retransmissions++;
+    }
+    
+    band = lorawan_band(lorawan.channels[ch].freq_hz);
+    lorawan.band_ready_ns[band] = now + (u64)airtime * lorawan_bands[band].dc_inv * NSEC_PER_USEC;
+    lorawan.agg_ready_ns = now + ((u64)airtime << lorawan.max_dcycle) * NSEC_PER_USEC;
+    
+    if (lorawan.state == LORAWAN_RADIO_RX_CONT) {
+        lorawan.radio->sleep(lorawan.radio_ctx);
+    }
+    lorawan.tx_ch = ch;
+    lorawan.tx_acked = false;
+    lorawan.rx_valid = false;
+    lorawan.state = LORAWAN_RADIO_TX;
+    lorawan.tx_left--;
+    lorawan.uplinks++;
+    
+    if (lorawan.radio->tx(lorawan.radio_ctx, lorawan.channels[ch].freq_hz, lorawan.tx_dr,
+                          LORAWAN_TX_POWER_MAX_DBM - 2 * lorawan.tx_power, lorawan.tx_frame, lorawan.tx_len)) {
+        pr_err_ratelimited("lorawan: Radio refused uplink\n");
+        lorawan.state = LORAWAN_RADIO_IDLE;
+    }
+}
+
+static void lorawan_tx_finished(u64 now)
+{
+    u32 delay = lorawan.tx_join ? LORAWAN_JOIN_DELAY1_MS : lorawan.rx1_delay_ms;
+    
+    lorawan.state = LORAWAN_RADIO_IDLE;
+    lorawan.rx1_at = now + (delay - LORAWAN_RX_EARLY_MS) * NSEC_PER_MSEC;
+    lorawan.rx2_at = lorawan.rx1_at + 1000 * NSEC_PER_MSEC;
+}
+
+// Both class A windows are over
+static void lorawan_round_done(void)
+{
+    lorawan.rx1_at = 0;
+    lorawan.rx2_at = 0;
+    
+    if (lorawan.tx_join) {
+        if (lorawan.joined) {
+            lorawan.tx_left = 0;
+        }
+    } else if (lorawan.tx_confirmed ? lorawan.tx_acked : lorawan.rx_valid) {
+        lorawan.tx_left = 0;
+    } else if (lorawan.tx_confirmed && !lorawan.tx_left) {
+        pr_warn_ratelimited("lorawan: Confirmed uplink %u not acknowledged\n", lorawan.fcnt_up - 1);
+    }
+}
+
+// Ping slot k of the current beacon period
+static u64 lorawan_ping_slot_ns(u16 k)
+{
+    return lorawan.beacon_ns + (LORAWAN_BEACON_RESERVED_MS +
+                                (u64)(lorawan.ping_offset + k * lorawan.ping_period) * LORAWAN_PING_SLOT_MS) *
+                               NSEC_PER_MSEC;
+}
+
+/*
+ * New beacon period starting at beacon_ns: ping slots are placed by a
+ * pseudo-random offset that both ends derive from the beacon time
+ */
+static void lorawan_beacon_period(void)
+{
+    static const u8 zero_key[LORAWAN_KEY_LEN];
+    struct crypto_aes_ctx aes;
+    u8 block[AES_BLOCK_SIZE] = {}, rand[AES_BLOCK_SIZE];
+    u32 widen = (lorawan.beacons_missed + 1) * LORAWAN_BEACON_WIDEN_MS;
+    
+    put_unaligned_le32(lorawan.beacon_time, block);
+    put_unaligned_le32(lorawan.dev_addr, block + 4);
+    aes_expandkey(&aes, zero_key, LORAWAN_KEY_LEN);
+    aes_encrypt(&aes, rand, block);
+    
+    lorawan.ping_nb = 1 << (7 - lorawan.ping_periodicity);
+    lorawan.ping_period = 4096 / lorawan.ping_nb;
+    lorawan.ping_offset = (rand[0] + rand[1] * 256) % lorawan.ping_period;
+    lorawan.ping_next = 0;
+    lorawan.ping_at = lorawan_ping_slot_ns(0) - (LORAWAN_RX_EARLY_MS + widen) * NSEC_PER_MSEC;
+    lorawan.beacon_at = lorawan.beacon_ns +
+                        (LORAWAN_BEACON_PERIOD_MS - LORAWAN_RX_EARLY_MS - widen) * NSEC_PER_MSEC;
+}
+
+static bool lorawan_beacon(const u8 *frame, u8 len, u64 rx_ns)
+{
+    if (len != LORAWAN_BEACON_LEN || crc_itu_t(0, frame, 6) != get_unaligned_le16(frame + 6)) {
+        return false;
+    }
+    
+    lorawan.beacon_time = get_unaligned_le32(frame + 2);
+    lorawan.beacon_ns = rx_ns;
+    lorawan.beacons_missed = 0;
+    if (!lorawan.beacon_locked) {
+        pr_info("lorawan: Beacon locked, GPS time %u\n", lorawan.beacon_time);
+    }
+    lorawan.beacon_locked = true;
+    lorawan_beacon_period();
+    return true;
+}
+
+static void lorawan_beacon_missed(void)
+{
+    if (!lorawan.beacon_locked) {
+        // Still searching
+        lorawan.beacon_at = ktime_get_ns();
+        return;
+    }
+    
+    if (++lorawan.beacons_missed > LORAWAN_BEACON_LOST_MAX) {
+        pr_warn("lorawan: Beacon lost, back to class A\n");
+        lorawan.cls = LORAWAN_CLASS_A;
+        lorawan.beacon_locked = false;
+        lorawan.beacon_at = 0;
+        lorawan.ping_at = 0;
+        lorawan.uplink_asap = true;         // tell the network through the Class B bit
+        return;
+    }
+    
+    // Beacon-less operation: carry on from where the beacon should have been
+    lorawan.beacon_time += LORAWAN_BEACON_PERIOD_MS / 1000;
+    lorawan.beacon_ns += LORAWAN_BEACON_PERIOD_MS * NSEC_PER_MSEC;
+    lorawan_beacon_period();
+}
+
+static void lorawan_next_ping(void)
+{
+    u32 widen = lorawan.beacons_missed * LORAWAN_BEACON_WIDEN_MS;
+    
+    if (++lorawan.ping_next >= lorawan.ping_nb) {
+        lorawan.ping_at = 0;                // until the next beacon
+        return;
+    }
+    lorawan.ping_at = lorawan_ping_slot_ns(lorawan.ping_next) - (LORAWAN_RX_EARLY_MS + widen) * NSEC_PER_MSEC;
+}
+
+static void lorawan_rx_finished(bool done, u64 now)
+{
+    enum lorawan_radio_state state = lorawan.state;
+    bool valid = false;
+    
+    lorawan.state = LORAWAN_RADIO_IDLE;
+    if (done && state != LORAWAN_RADIO_BEACON) {
+        valid = lorawan_downlink(lorawan.rx_buf, lorawan.rx_len, lorawan.rx_snr);
+        lorawan.rx_valid |= valid;
+    }
+    
+    switch (state) {
+    case LORAWAN_RADIO_RX1:
+        lorawan.rx1_at = 0;
+        if (valid) {
+            lorawan_round_done();
+        }
+        break;
+    case LORAWAN_RADIO_RX2:
+        lorawan_round_done();
+        break;
+    case LORAWAN_RADIO_BEACON:
+        if (!done || !lorawan_beacon(lorawan.rx_buf, lorawan.rx_len, lorawan.rx_ns)) {
+            lorawan_beacon_missed();
+        }
+        break;
+    case LORAWAN_RADIO_PING:
+        lorawan_next_ping();
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Run whatever is due, in order of precedence: class A windows, then
+ * beacons and ping slots, then uplinks; class C listens on RX2 whenever
+ * the radio would otherwise idle
+ */
+static void lorawan_run(u64 now)
+{
+    u64 wake_ns = U64_MAX;
+    u32 widen = lorawan.beacons_missed * LORAWAN_BEACON_WIDEN_MS;
+    
+    if (lorawan.state != LORAWAN_RADIO_IDLE && lorawan.state != LORAWAN_RADIO_RX_CONT) {
+        return;
+    }
+    
+    if (lorawan.rx1_at) {
+        if (now >= lorawan.rx1_at) {
+            const struct lorawan_channel *ch = &lorawan.channels[lorawan.tx_ch];
+            u8 dr = lorawan.tx_dr > lorawan.rx1_dr_offset ? lorawan.tx_dr - lorawan.rx1_dr_offset : 0;
+    
+            lorawan_start_rx(LORAWAN_RADIO_RX1, ch->dl_freq_hz ?: ch->freq_hz, dr, lorawan_window_ms(dr, 0));
+            return;
+        }
+        wake_ns = lorawan.rx1_at;
+    } else if (lorawan.rx2_at) {
+        if (now >= lorawan.rx2_at) {
+            u8 dr = lorawan.tx_join ? LORAWAN_RX2_DR : lorawan.rx2_dr;
+    
+            lorawan_start_rx(LORAWAN_RADIO_RX2, lorawan.rx2_freq, dr, lorawan_window_ms(dr, 0));
+            return;
+        }
+        wake_ns = lorawan.rx2_at;
+    } else if (lorawan.cls == LORAWAN_CLASS_B && lorawan.beacon_at && now >= lorawan.beacon_at) {
+        u32 timeout = lorawan.beacon_locked ? lorawan_window_ms(LORAWAN_BEACON_DR, widen) :
+                      LORAWAN_BEACON_PERIOD_MS + 2000;
+    
+        lorawan.beacon_at = 0;
+        lorawan.ping_at = 0;
+        lorawan_start_rx(LORAWAN_RADIO_BEACON, lorawan.beacon_freq, LORAWAN_BEACON_DR, timeout);
+        return;
+    } else if (lorawan.cls == LORAWAN_CLASS_B && lorawan.ping_at && now >= lorawan.ping_at) {
+        lorawan_start_rx(LORAWAN_RADIO_PING, lorawan.ping_freq, lorawan.ping_dr,
+                         lorawan_window_ms(lorawan.ping_dr, widen));
+        return;
+    } else {
+        lorawan_try_tx(now, &wake_ns);
+        if (lorawan.state == LORAWAN_RADIO_TX) {
+            return;
+        }
+    }
+    
+    if (lorawan.cls == LORAWAN_CLASS_B) {
+        if (lorawan.beacon_at) {
+            wake_ns = min(wake_ns, lorawan.beacon_at);
+        }
+        if (lorawan.ping_at) {
+            wake_ns = min(wake_ns, lorawan.ping_at);
+        }
+    }
+    
+    if (lorawan.cls == LORAWAN_CLASS_C && lorawan.joined && lorawan.state == LORAWAN_RADIO_IDLE) {
+        lorawan_start_rx(LORAWAN_RADIO_RX_CONT, lorawan.rx2_freq, lorawan.rx2_dr, 0);
+    }
+    
+    if (wake_ns != U64_MAX) {
+        hrtimer_start(&lorawan.timer, ns_to_ktime(wake_ns), HRTIMER_MODE_ABS);
+    }
+}
+
+static void lorawan_work(struct work_struct *work)
+{
+    unsigned long events, flags;
+    u64 now = ktime_get_ns();
+    
+    mutex_lock(&lorawan.lock);
+    if (!lorawan.radio) {
+        mutex_unlock(&lorawan.lock);
+        return;
+    }
+    
+    spin_lock_irqsave(&lorawan.event_lock, flags);
+    events = lorawan.events;
+    lorawan.events = 0;
+    spin_unlock_irqrestore(&lorawan.event_lock, flags);
+    
+    if ((events & BIT(LORAWAN_EV_TX_DONE)) && lorawan.state == LORAWAN_RADIO_TX) {
+        lorawan_tx_finished(now);
+    }
+    if (events & BIT(LORAWAN_EV_RX_DONE)) {
+        if (lorawan.state == LORAWAN_RADIO_RX_CONT) {
+            // Class C keeps listening
+            lorawan.rx_valid |= lorawan_downlink(lorawan.rx_buf, lorawan.rx_len, lorawan.rx_snr);
+            lorawan.state = LORAWAN_RADIO_IDLE;
+        } else {
+            lorawan_rx_finished(true, now);
+        }
+    } else if ((events & BIT(LORAWAN_EV_RX_TIMEOUT)) && lorawan.state != LORAWAN_RADIO_RX_CONT) {
+        lorawan_rx_finished(false, now);
+    }
+    
+    lorawan_run(now);
+    mutex_unlock(&lorawan.lock);
+}
+
+/**
+ * Attach the transceiver
+ */
+int lorawan_register_radio(const struct lorawan_radio_ops *ops, void *ctx)
+{
+    if (!ops || !ops->tx || !ops->rx || !ops->sleep) {
+        return -EINVAL;
+    }
+    
+    mutex_lock(&lorawan.lock);
+    if (lorawan.radio) {
+        mutex_unlock(&lorawan.lock);
+        return -EBUSY;
+    }
+    lorawan.radio_ctx = ctx;
+    lorawan.radio = ops;
+    lorawan.state = LORAWAN_RADIO_IDLE;
+    mutex_unlock(&lorawan.lock);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(lorawan_register_radio);
+
+static void lorawan_event(int ev)
+{
+    unsigned long flags;
+    
+    spin_lock_irqsave(&lorawan.event_lock, flags);
+    lorawan.events |= BIT(ev);
+    spin_unlock_irqrestore(&lorawan.event_lock, flags);
+    queue_work(lorawan.wq, &lorawan.work);
+}
+
+void lorawan_tx_done(void)
+{
+    lorawan_event(LORAWAN_EV_TX_DONE);
+}
+EXPORT_SYMBOL_GPL(lorawan_tx_done);
+
+void lorawan_rx_done(const u8 *buf, u8 len, s16 rssi, s8 snr, u64 rx_ns)
+{
+    unsigned long flags;
+    
+    spin_lock_irqsave(&lorawan.event_lock, flags);
+    memcpy(lorawan.rx_buf, buf, len);
+    lorawan.rx_len = len;
+    lorawan.rx_snr = snr;
+    lorawan.rx_ns = rx_ns;
+    lorawan.events |= BIT(LORAWAN_EV_RX_DONE);
+    spin_unlock_irqrestore(&lorawan.event_lock, flags);
+    queue_work(lorawan.wq, &lorawan.work);
+}
+EXPORT_SYMBOL_GPL(lorawan_rx_done);
+
+void lorawan_rx_timeout(void)
+{
+    lorawan_event(LORAWAN_EV_RX_TIMEOUT);
+}
+EXPORT_SYMBOL_GPL(lorawan_rx_timeout);
+
+int lorawan_register_app(const struct lorawan_app_ops *ops, void *ctx)
+{
+    mutex_lock(&lorawan.lock);
+    lorawan.app_ctx = ctx;
+    lorawan.app = ops;
+    mutex_unlock(&lorawan.lock);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(lorawan_register_app);
+
+static void lorawan_reset_session(void)
+{
+    lorawan_default_channels();
+    memset(lorawan.band_ready_ns, 0, sizeof(lorawan.band_ready_ns));
+    lorawan.agg_ready_ns = 0;
+    lorawan.max_dcycle = 0;
+    lorawan.dr = 0;
+    lorawan.tx_power = 0;
+    lorawan.nb_trans = 1;
+    lorawan.adr_ack_cnt = 0;
+    lorawan.rx1_dr_offset = 0;
+    lorawan.rx2_dr = LORAWAN_RX2_DR;
+    lorawan.rx2_freq = LORAWAN_RX2_FREQ;
+    lorawan.rx1_delay_ms = LORAWAN_RX1_DELAY_MS;
+    lorawan.tx_left = 0;
+    lorawan.mac_ans_len = 0;
+    lorawan.mac_sticky_len = 0;
+    lorawan.ack_pending = false;
+    lorawan.uplink_asap = false;
+}
+
+/**
+ * Over-the-air activation: join requests go out until a join accept
+ * comes back
+ */
+int lorawan_join(const u8 *dev_eui, const u8 *app_eui, const u8 *app_key)
+{
+    if (!dev_eui || !app_eui || !app_key) {
+        return -EINVAL;
+    }
+    
+    mutex_lock(&lorawan.lock);
+    lorawan_reset_session();
+    memcpy(lorawan.dev_eui, dev_eui, LORAWAN_EUI_LEN);
+    memcpy(lorawan.app_eui, app_eui, LORAWAN_EUI_LEN);
+    memcpy(lorawan.app_key, app_key, LORAWAN_KEY_LEN);
+    lorawan.join_tries = 0;
+    lorawan.joined = false;
+    lorawan.joining = true;
+    mutex_unlock(&lorawan.lock);
+    
+    queue_work(lorawan.wq, &lorawan.work);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(lorawan_join);
+
+/**
+ * Activation by personalisation
+ */
+int lorawan_activate(u32 dev_addr, const u8 *nwk_skey, const u8 *app_skey)
+{
+    if (!nwk_skey || !app_skey) {
+        return -EINVAL;
+    }
+    
+    mutex_lock(&lorawan.lock);
+    lorawan_reset_session();
+    lorawan.dev_addr = dev_addr;
+    memcpy(lorawan.nwk_skey, nwk_skey, LORAWAN_KEY_LEN);
+    memcpy(lorawan.app_skey, app_skey, LORAWAN_KEY_LEN);
+    lorawan.fcnt_up = 0;
+    lorawan.fcnt_down_valid = false;
+    lorawan.joining = false;
+    lorawan.joined = true;
+    mutex_unlock(&lorawan.lock);
+    
+    pr_info("lorawan: Activated, DevAddr %08x\n", dev_addr);
+    queue_work(lorawan.wq, &lorawan.work);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(lorawan_activate);
+
+/**
+ * Switch device class. Class B searches for a beacon, which can take a
+ * beacon period with uplinks held back, and tells the network its ping
+ * slot periodicity, 0 to 7 for 128 down to 1 slots per beacon period.
+ */
+int lorawan_set_class(enum lorawan_class cls, u8 ping_periodicity)
+{
+    u8 info[2] = { LORAWAN_CID_PING_SLOT_INFO, ping_periodicity };
+    
+    if (cls > LORAWAN_CLASS_C || ping_periodicity > 7) {
+        return -EINVAL;
+    }
+    
+    mutex_lock(&lorawan.lock);
+    if (!lorawan.joined) {
+        mutex_unlock(&lorawan.lock);
+        return -ENOTCONN;
+    }
+    
+    if (lorawan.state == LORAWAN_RADIO_RX_CONT) {
+        lorawan.radio->sleep(lorawan.radio_ctx);
+        lorawan.state = LORAWAN_RADIO_IDLE;
+    }
+    lorawan.cls = cls;
+    lorawan.beacon_locked = false;
+    lorawan.beacon_at = 0;
+    lorawan.ping_at = 0;
+    if (cls == LORAWAN_CLASS_B) {
+        lorawan.ping_periodicity = ping_periodicity;
+        lorawan.beacons_missed = 0;
+        lorawan.beacon_at = ktime_get_ns();
+        lorawan_mac_answer(false, info, sizeof(info));
+    }
+    mutex_unlock(&lorawan.lock);
+    
+    queue_work(lorawan.wq, &lorawan.work);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(lorawan_set_class);
+
+int lorawan_set_adr(bool enable)
+{
+    mutex_lock(&lorawan.lock);
+    lorawan.adr = enable;
+    lorawan.adr_ack_cnt = 0;
+    mutex_unlock(&lorawan.lock);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(lorawan_set_adr);
+
+/**
+ * Queue a record for port, to go out within max_delay_ms; 0 sends it
+ * with the next uplink possible. Records for one port share uplinks, so
+ * the receiving application splits them by their length bytes. An
+ * uplink carrying a confirmed record is confirmed. May sleep.
+ */
+int lorawan_send(u8 port, const u8 *data, u8 len, u32 max_delay_ms, bool confirmed)
+{
+    struct lorawan_batch *b = NULL, *free = NULL;
+    u64 deadline = ktime_get_ns() + (u64)max_delay_ms * NSEC_PER_MSEC;
+    int i;
+    
+    if (!port || port > 223 || !data || len + 2 > lorawan_max_payload[LORAWAN_DR_MAX]) {
+        return -EINVAL;
+    }
+    
+    mutex_lock(&lorawan.lock);
+    if (!lorawan.joined) {
+        mutex_unlock(&lorawan.lock);
+        return -ENOTCONN;
+    }
+    
+    for (i = 0; i < LORAWAN_TX_QUEUE; i++) {
+        if (!lorawan.batches[i].used) {
+            free = free ?: &lorawan.batches[i];
+        } else if (lorawan.batches[i].port == port &&
+                   lorawan.batches[i].len + 1 + len <= lorawan_max_payload[LORAWAN_DR_MAX] - 1) {
+            b = &lorawan.batches[i];
+        }
+    }
+    if (!b) {
+        if (!free) {
+            mutex_unlock(&lorawan.lock);
+            return -ENOBUFS;
+        }
+        b = free;
+        b->used = true;
+        b->port = port;
+        b->len = 0;
+        b->records = 0;
+        b->confirmed = false;
+        b->deadline_ns = deadline;
+    }
+    
+    b->data[b->len] = len;
+    memcpy(b->data + b->len + 1, data, len);
+    b->len += 1 + len;
+    b->records++;
+    b->confirmed |= confirmed;
+    b->deadline_ns = min(b->deadline_ns, deadline);
+    mutex_unlock(&lorawan.lock);
+    
+    queue_work(lorawan.wq, &lorawan.work);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(lorawan_send);
 
 static int __init lorawan_init(void)
 {
-    pr_info("lorawan: Initializing\n");
+    pr_info("lorawan: Initializing v%s\n", LORAWAN_VERSION);
+    
+    lorawan.cmac = crypto_alloc_shash("cmac(aes)", 0, 0);
+    if (IS_ERR(lorawan.cmac)) {
+        pr_err("lorawan: cmac(aes) not available\n");
+        return PTR_ERR(lorawan.cmac);
+    }
+    
+    lorawan.wq = alloc_workqueue("lorawan", WQ_HIGHPRI | WQ_UNBOUND, 1);
+    if (!lorawan.wq) {
+        crypto_free_shash(lorawan.cmac);
+        return -ENOMEM;
+    }
+    
+    mutex_init(&lorawan.lock);
+    spin_lock_init(&lorawan.event_lock);
+    INIT_WORK(&lorawan.work, lorawan_work);
+    hrtimer_init(&lorawan.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    lorawan.timer.function = lorawan_timer;
+    
+    lorawan.ping_freq = LORAWAN_PING_FREQ;
+    lorawan.ping_dr = LORAWAN_PING_DR;
+    lorawan.beacon_freq = LORAWAN_BEACON_FREQ;
+    lorawan_reset_session();
     return 0;
 }
 
 static void __exit lorawan_exit(void)
 {
-    pr_info("lorawan: Exiting\n");
+    const struct lorawan_radio_ops *radio;
+    
+    // Without a radio the work stops re-arming the timer
+    mutex_lock(&lorawan.lock);
+    radio = lorawan.radio;
+    lorawan.radio = NULL;
+    mutex_unlock(&lorawan.lock);
+    
+    hrtimer_cancel(&lorawan.timer);
+    destroy_workqueue(lorawan.wq);
+    if (radio) {
+        radio->sleep(lorawan.radio_ctx);
+    }
+    crypto_free_shash(lorawan.cmac);
+    memzero_explicit(lorawan.app_key, sizeof(lorawan.app_key));
+    memzero_explicit(lorawan.nwk_skey, sizeof(lorawan.nwk_skey));
+    memzero_explicit(lorawan.app_skey, sizeof(lorawan.app_skey));
+    
+    pr_info("lorawan: Exiting: %u uplinks, %u retransmissions, %u records sent, %u dropped, %u duty cycle deferrals\n",
+            lorawan.uplinks, lorawan.retransmissions, lorawan.records_sent, lorawan.records_dropped,
+            lorawan.dc_deferrals);
 }
 
 module_init(lorawan_init);
@@ -28,4 +1560,4 @@ module_exit(lorawan_exit);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("jk1806");
 MODULE_DESCRIPTION("LoRaWAN Implementation");
-MODULE_VERSION(MODULE_VERSION);
+MODULE_VERSION(LORAWAN_VERSION);
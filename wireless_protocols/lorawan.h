@@ -0,0 +1,61 @@
+/**
+ * LoRaWAN end device MAC
+ *
+ * LoRaWAN 1.0.x MAC in lorawan.c, EU868 region, over a LoRa transceiver
+ * reached through the ops its glue registers. Applications queue records
+ * rather than frames: records for the same FPort are packed into one
+ * uplink, each as a length byte followed by its bytes, and an uplink
+ * goes out when it is nearly full for the current data rate or when its
+ * oldest record reaches its deadline, on a channel whose sub-band duty
+ * cycle allows it. While the duty cycle holds transmission back, records
+ * keep accumulating into fuller uplinks. ADR, classes A, B and C, OTAA
+ * and ABP are supported.
+ */
+
+#ifndef LORAWAN_H
+#define LORAWAN_H
+
+#include <linux/types.h>
+
+#define LORAWAN_MAX_FRAME 255
+#define LORAWAN_KEY_LEN 16
+#define LORAWAN_EUI_LEN 8
+
+enum lorawan_class {
+    LORAWAN_CLASS_A,
+    LORAWAN_CLASS_B,
+    LORAWAN_CLASS_C
+};
+
+/*
+ * tx sends one frame and rx opens a receive window of timeout_ms, 0
+ * meaning until a frame arrives or the next command; each is answered
+ * with lorawan_tx_done(), lorawan_rx_done() or lorawan_rx_timeout(),
+ * from any context. A window that sees a preamble runs on until the
+ * frame is in. rx_ns is when the frame's transmission started, on the
+ * ktime_get() clock. The ops may sleep.
+ */
+struct lorawan_radio_ops {
+    int (*tx)(void *ctx, u32 freq_hz, u8 dr, s8 power_dbm, const u8 *buf, u8 len);
+    int (*rx)(void *ctx, u32 freq_hz, u8 dr, u32 timeout_ms);
+    void (*sleep)(void *ctx);
+};
+
+// Downlink application payloads, from process context
+struct lorawan_app_ops {
+    void (*receive)(void *ctx, u8 port, const u8 *data, u8 len);
+};
+
+int lorawan_register_radio(const struct lorawan_radio_ops *ops, void *ctx);
+void lorawan_tx_done(void);
+void lorawan_rx_done(const u8 *buf, u8 len, s16 rssi, s8 snr, u64 rx_ns);
+void lorawan_rx_timeout(void);
+
+int lorawan_register_app(const struct lorawan_app_ops *ops, void *ctx);
+int lorawan_join(const u8 *dev_eui, const u8 *app_eui, const u8 *app_key);   // EUIs MSB first
+int lorawan_activate(u32 dev_addr, const u8 *nwk_skey, const u8 *app_skey);
+int lorawan_set_class(enum lorawan_class cls, u8 ping_periodicity);
+int lorawan_set_adr(bool enable);
+int lorawan_send(u8 port, const u8 *data, u8 len, u32 max_delay_ms, bool confirmed);
+
+#endif /* LORAWAN_H */
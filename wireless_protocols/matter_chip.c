@@ -2,24 +2,410 @@
  * Matter/CHIP Protocol
  * Author: jk1806
  * Created: 2024-09-10
- * 
+ *
  * Implementation for embedded systems
+ *
+ * Message layer checks ahead of the Matter stack: the unencrypted header
+ * is parsed and the message counter checked against the session's, or
+ * for group and unsecured messages the source node's, receive window,
+ * so duplicates from mesh retransmission and replays are refused without
+ * waking the stack or spending a decryption on them.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/jiffies.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <asm/unaligned.h>
 
-#define MODULE_VERSION "1.0.0"
+#include "matter_chip.h"
+
+#define MATTER_VERSION "1.1.0"
+
+// Message flags
+#define MATTER_FLAGS_VERSION_SHIFT 4
+#define MATTER_FLAGS_S 0x04                 // source node id present
+#define MATTER_FLAGS_DSIZ 0x03
+#define MATTER_DSIZ_NODE 1
+#define MATTER_DSIZ_GROUP 2
+
+// Security flags
+#define MATTER_SEC_P 0x80                   // privacy: header obfuscated
+#define MATTER_SEC_C 0x40                   // control message
+#define MATTER_SEC_MX 0x20                  // message extensions present
+#define MATTER_SEC_TYPE 0x03
+
+#define MATTER_MIN_HEADER 8
+#define MATTER_UNSECURED_SESSION 0
+
+struct matter_session {
+    bool used;
+    u16 id;
+    enum matter_session_type type;
+    struct matter_counter_window rx;
+    u32 tx_counter;
+};
+
+// Receive window of a source node, for group or unsecured messages
+struct matter_peer {
+    bool used;
+    u64 node;
+    u16 session_id;                         // 0 for unsecured
+    struct matter_counter_window rx;
+    unsigned long last_seen;
+};
+
+static struct matter_session matter_sessions[MATTER_MAX_SESSIONS];
+static struct matter_peer matter_peers[MATTER_MAX_PEERS];
+static DEFINE_SPINLOCK(matter_lock);
+
+static u32 matter_duplicates;
+static u32 matter_stale;
+static u32 matter_resyncs;
+
+// counter is shift ahead of w->max: slide the window up to it
+static void matter_window_advance(struct matter_counter_window *w, u32 counter, u32 shift)
+{
+    if (shift > MATTER_COUNTER_WINDOW) {
+        w->bitmap = 0;
+    } else if (shift == MATTER_COUNTER_WINDOW) {
+        w->bitmap = BIT(MATTER_COUNTER_WINDOW - 1);
+    } else {
+        w->bitmap = w->bitmap << shift | BIT(shift - 1);
+    }
+    w->max = counter;
+}
+
+static void matter_window_reset(struct matter_counter_window *w, u32 counter)
+{
+    w->max = counter;
+    w->bitmap = 0;
+    w->synced = true;
+}
+
+/**
+ * Check counter against the window and record it if it is new. The
+ * first counter from a window not yet synced is taken as it comes.
+ */
+int matter_counter_check(struct matter_counter_window *w, u32 counter, enum matter_counter_mode mode)
+{
+    u32 behind;
+    
+    if (!w->synced) {
+        matter_window_reset(w, counter);
+        return 0;
+    }
+    
+    if (mode == MATTER_COUNTER_ENCRYPTED) {
+        if (counter > w->max) {
+            matter_window_advance(w, counter, counter - w->max);
+            return 0;
+        }
+        behind = w->max - counter;
+    } else {
+        s32 diff = (s32)(counter - w->max);
+    
+        if (diff > 0) {
+            matter_window_advance(w, counter, diff);
+            return 0;
+        }
+        behind = -diff;
+    }
+    
+    if (!behind) {
+        return -EALREADY;
+    }
+    if (behind > MATTER_COUNTER_WINDOW) {
+        if (mode == MATTER_COUNTER_UNSECURED) {
+            matter_window_reset(w, counter);
+            return 0;
+        }
+        return -ERANGE;
+    }
+    if (w->bitmap & BIT(behind - 1)) {
+        return -EALREADY;
+    }
+    w->bitmap |= BIT(behind - 1);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(matter_counter_check);
+
+/**
+ * Parse the message header; hdr->header_len is where the payload, still
+ * encrypted for secure sessions, starts
+ */
+int matter_message_parse(const u8 *msg, size_t len, struct matter_msg_header *hdr)
+{
+    const u8 *p = msg + MATTER_MIN_HEADER, *end = msg + len;
+    u8 dsiz;
+    
+    if (!msg || !hdr || len < MATTER_MIN_HEADER) {
+        return -EINVAL;
+    }
+    
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->flags = msg[0];
+    hdr->session_id = get_unaligned_le16(msg + 1);
+    hdr->security_flags = msg[3];
+    hdr->counter = get_unaligned_le32(msg + 4);
+    
+    if (hdr->flags >> MATTER_FLAGS_VERSION_SHIFT) {
+        return -EPROTONOSUPPORT;
+    }
+    if (hdr->security_flags & MATTER_SEC_P) {
+        return -EOPNOTSUPP;                 // counter is obfuscated; the stack deals with these
+    }
+    if ((hdr->security_flags & MATTER_SEC_TYPE) > MATTER_SESSION_GROUP) {
+        return -EINVAL;
+    }
+    
+    if (hdr->flags & MATTER_FLAGS_S) {
+        if (end - p < 8) {
+            return -EINVAL;
+        }
+        hdr->has_source = true;
+        hdr->source_node = get_unaligned_le64(p);
+        p += 8;
+    }
+    
+    dsiz = hdr->flags & MATTER_FLAGS_DSIZ;
+    if (dsiz == MATTER_DSIZ_NODE) {
+        if (end - p < 8) {
+            return -EINVAL;
+        }
+        hdr->has_dest_node = true;
+        hdr->dest_node = get_unaligned_le64(p);
+        p += 8;
+    } else if (dsiz == MATTER_DSIZ_GROUP) {
+        if (end - p < 2) {
+            return -EINVAL;
+        }
+        hdr->has_dest_group = true;
+        hdr->dest_group = get_unaligned_le16(p);
+        p += 2;
+    } else if (dsiz) {
+        return -EINVAL;
+    }
+    
+    if (hdr->security_flags & MATTER_SEC_MX) {
+        u16 ext_len;
+    
+        if (end - p < 2) {
+            return -EINVAL;
+        }
+        ext_len = get_unaligned_le16(p);
+        p += 2;
+        if (end - p < ext_len) {
+            return -EINVAL;
+        }
+        p += ext_len;
+    }
+    
+    hdr->header_len = p - msg;
+    return 0;
+}
+EXPORT_SYMBOL_GPL(matter_message_parse);
+
+static struct matter_session *matter_session_find(u16 session_id)
+{
+    int i;
+    
+    for (i = 0; i < MATTER_MAX_SESSIONS; i++) {
+        if (matter_sessions[i].used && matter_sessions[i].id == session_id) {
+            return &matter_sessions[i];
+        }
+    }
+    return NULL;
+}
+
+// The peer's window, taking over the least recently heard peer if new
+static struct matter_peer *matter_peer_get(u64 node, u16 session_id)
+{
+    struct matter_peer *peer, *victim = NULL;
+    int i;
+    
+    for (i = 0; i < MATTER_MAX_PEERS; i++) {
+        peer = &matter_peers[i];
+        if (peer->used && peer->node == node && peer->session_id == session_id) {
+            return peer;
+        }
+        if (!victim || (victim->used && (!peer->used || time_before(peer->last_seen, victim->last_seen)))) {
+            victim = peer;
+        }
+    }
+    
+    memset(victim, 0, sizeof(*victim));
+    victim->used = true;
+    victim->node = node;
+    victim->session_id = session_id;
+    return victim;
+}
+
+/**
+ * Parse msg and check its counter; 0 means it is new and should go to
+ * the stack. A secure unicast message needs its session added first, a
+ * group message its group session and a source node id.
+ */
+int matter_message_accept(const u8 *msg, size_t len, struct matter_msg_header *hdr)
+{
+    struct matter_session *session;
+    struct matter_peer *peer;
+    unsigned long flags;
+    int ret;
+    
+    ret = matter_message_parse(msg, len, hdr);
+    if (ret) {
+        return ret;
+    }
+    
+    spin_lock_irqsave(&matter_lock, flags);
+    if ((hdr->security_flags & MATTER_SEC_TYPE) == MATTER_SESSION_UNICAST &&
+        hdr->session_id == MATTER_UNSECURED_SESSION) {
+        if (!hdr->has_source) {
+            ret = -EINVAL;
+            goto out;
+        }
+        peer = matter_peer_get(hdr->source_node, MATTER_UNSECURED_SESSION);
+        peer->last_seen = jiffies;
+        if (peer->rx.synced && (s32)(hdr->counter - peer->rx.max) < -MATTER_COUNTER_WINDOW) {
+            matter_resyncs++;
+        }
+        ret = matter_counter_check(&peer->rx, hdr->counter, MATTER_COUNTER_UNSECURED);
+        goto out;
+    }
+    
+    session = matter_session_find(hdr->session_id);
+    if (!session || session->type != (hdr->security_flags & MATTER_SEC_TYPE)) {
+        ret = -ENOENT;
+        goto out;
+    }
+    
+    if (session->type == MATTER_SESSION_GROUP) {
+        if (!hdr->has_source || !hdr->has_dest_group) {
+            ret = -EINVAL;
+            goto out;
+        }
+        peer = matter_peer_get(hdr->source_node, hdr->session_id);
+        peer->last_seen = jiffies;
+        ret = matter_counter_check(&peer->rx, hdr->counter, MATTER_COUNTER_GROUP);
+    } else {
+        ret = matter_counter_check(&session->rx, hdr->counter, MATTER_COUNTER_ENCRYPTED);
+    }
+    
+out:
+    if (ret == -EALREADY) {
+        matter_duplicates++;
+    } else if (ret == -ERANGE) {
+        matter_stale++;
+    }
+    spin_unlock_irqrestore(&matter_lock, flags);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(matter_message_accept);
+
+/**
+ * Add a session once CASE or PASE has established it, or a group key;
+ * peer_counter is the first counter the peer will send, counters before
+ * it are refused. Group sessions learn each sender's counter as it comes.
+ */
+int matter_session_add(u16 session_id, enum matter_session_type type, u32 peer_counter, u32 tx_counter)
+{
+    struct matter_session *session;
+    unsigned long flags;
+    int i, ret = 0;
+    
+    // Id 0 is the unsecured session for either type; a group on it would
+    // share (and wipe) the unsecured peers' windows
+    if (session_id == MATTER_UNSECURED_SESSION) {
+        return -EINVAL;
+    }
+    
+    spin_lock_irqsave(&matter_lock, flags);
+    session = matter_session_find(session_id);
+    for (i = 0; !session && i < MATTER_MAX_SESSIONS; i++) {
+        if (!matter_sessions[i].used) {
+            session = &matter_sessions[i];
+        }
+    }
+    if (!session) {
+        ret = -ENOSPC;
+        goto out;
+    }
+    
+    memset(session, 0, sizeof(*session));
+    session->used = true;
+    session->id = session_id;
+    session->type = type;
+    session->tx_counter = tx_counter;
+    if (type == MATTER_SESSION_UNICAST) {
+        session->rx.max = peer_counter - 1;
+        session->rx.bitmap = ~0U;
+        session->rx.synced = true;
+    }
+    
+    // A reused group session id must not inherit windows from the old key
+    for (i = 0; i < MATTER_MAX_PEERS; i++) {
+        if (matter_peers[i].session_id == session_id) {
+            matter_peers[i].used = false;
+        }
+    }
+    
+out:
+    spin_unlock_irqrestore(&matter_lock, flags);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(matter_session_add);
+
+void matter_session_remove(u16 session_id)
+{
+    struct matter_session *session;
+    unsigned long flags;
+    
+    spin_lock_irqsave(&matter_lock, flags);
+    session = matter_session_find(session_id);
+    if (session) {
+        session->used = false;
+    }
+    spin_unlock_irqrestore(&matter_lock, flags);
+}
+EXPORT_SYMBOL_GPL(matter_session_remove);
+
+/**
+ * Counter for the next message sent on the session. A unicast session
+ * whose counter would wrap has to be re-established.
+ */
+int matter_session_next_counter(u16 session_id, u32 *counter)
+{
+    struct matter_session *session;
+    unsigned long flags;
+    int ret = 0;
+    
+    spin_lock_irqsave(&matter_lock, flags);
+    session = matter_session_find(session_id);
+    if (!session) {
+        ret = -ENOENT;
+    } else if (session->type == MATTER_SESSION_UNICAST && session->tx_counter == U32_MAX) {
+        ret = -EOVERFLOW;
+    } else {
+        *counter = session->tx_counter++;
+    }
+    spin_unlock_irqrestore(&matter_lock, flags);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(matter_session_next_counter);
 
 static int __init matter_chip_init(void)
 {
-    pr_info("matter_chip: Initializing\n");
+    pr_info("matter_chip: Initializing v%s\n", MATTER_VERSION);
     return 0;
 }
 
 static void __exit matter_chip_exit(void)
 {
-    pr_info("matter_chip: Exiting\n");
+    pr_info("matter_chip: Exiting: %u duplicates, %u stale, %u resyncs\n", matter_duplicates, matter_stale,
+            matter_resyncs);
 }
 
 module_init(matter_chip_init);
@@ -28,4 +414,4 @@ module_exit(matter_chip_exit);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("jk1806");
 MODULE_DESCRIPTION("Matter/CHIP Protocol");
-MODULE_VERSION(MODULE_VERSION);
+MODULE_VERSION(MATTER_VERSION);
@@ -0,0 +1,69 @@
+/**
+ * Matter message layer
+ *
+ * Header parsing and message counter replay protection in matter_chip.c,
+ * for Matter messages carried over UDP on the Thread interface. Each
+ * secure session keeps the highest counter seen and a bitmap of the 32
+ * before it, so reordering across the mesh is accepted while a replay or
+ * duplicate is refused before any decryption is attempted. Group and
+ * unsecured messages get the same window per source node with counters
+ * allowed to wrap, and an unsecured peer whose counter jumped out of the
+ * window, as after a reboot, is resynced rather than refused. Payloads
+ * are left encrypted for the Matter stack in user space.
+ */
+
+#ifndef MATTER_CHIP_H
+#define MATTER_CHIP_H
+
+#include <linux/types.h>
+
+#define MATTER_COUNTER_WINDOW 32
+#define MATTER_MAX_SESSIONS 16
+#define MATTER_MAX_PEERS 32
+
+// Bit i set when counter max - (i + 1) has been seen
+struct matter_counter_window {
+    u32 max;
+    u32 bitmap;
+    bool synced;
+};
+
+enum matter_counter_mode {
+    MATTER_COUNTER_ENCRYPTED,               // never wraps, behind the window is refused
+    MATTER_COUNTER_GROUP,                   // wraps, behind the window is refused
+    MATTER_COUNTER_UNSECURED                // wraps, out of the window resyncs
+};
+
+enum matter_session_type {
+    MATTER_SESSION_UNICAST,
+    MATTER_SESSION_GROUP
+};
+
+struct matter_msg_header {
+    u8 flags;
+    u16 session_id;
+    u8 security_flags;
+    u32 counter;
+    bool has_source;
+    u64 source_node;
+    bool has_dest_node;
+    u64 dest_node;
+    bool has_dest_group;
+    u16 dest_group;
+    u16 header_len;                         // payload starts here
+};
+
+/*
+ * Returns 0 and records counter if it is new, -EALREADY for a duplicate
+ * and -ERANGE for one too far behind to tell
+ */
+int matter_counter_check(struct matter_counter_window *w, u32 counter, enum matter_counter_mode mode);
+
+int matter_message_parse(const u8 *msg, size_t len, struct matter_msg_header *hdr);
+int matter_message_accept(const u8 *msg, size_t len, struct matter_msg_header *hdr);
+
+int matter_session_add(u16 session_id, enum matter_session_type type, u32 peer_counter, u32 tx_counter);
+void matter_session_remove(u16 session_id);
+int matter_session_next_counter(u16 session_id, u32 *counter);
+
+#endif /* MATTER_CHIP_H */
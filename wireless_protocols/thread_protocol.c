@@ -2,24 +2,1082 @@
  * Thread Protocol
  * Author: jk1806
  * Created: 2024-09-20
- * 
+ *
  * Implementation for embedded systems
+ *
+ * Border router data path between the thread%d interface and the mesh.
+ * Outgoing IPv6 packets get their IPv6 and UDP headers compressed by
+ * IPHC, addresses elided against the link addresses and the contexts,
+ * and are fragmented when they do not fit one frame. Incoming frames are
+ * decompressed straight into the skb for the stack; fragments are
+ * reassembled in a fixed pool of datagram buffers, oldest evicted first.
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/bitmap.h>
+#include <linux/if_arp.h>
+#include <linux/in.h>
+#include <linux/ipv6.h>
+#include <linux/jhash.h>
+#include <linux/jiffies.h>
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/udp.h>
+#include <net/addrconf.h>
+#include <net/ipv6.h>
+#include <asm/unaligned.h>
 
-#define MODULE_VERSION "1.0.0"
+#include "thread_protocol.h"
+
+#define THREAD_VERSION "1.1.0"
+#define THREAD_MTU 1280
+#define THREAD_BROADCAST 0xffff
+#define THREAD_REASM_SLOTS 8
+#define THREAD_REASM_TIMEOUT_MS 2000
+#define THREAD_EID_CACHE 64                 // direct-mapped
+#define THREAD_IPV6_HDR_LEN 40
+#define THREAD_UDP_HDR_LEN 8
+#define THREAD_MAX_HDR_LEN (2 + 1 + 4 + 1 + 1 + 16 + 16 + 7)  // IPHC, CID, TF ... UDP NHC
+
+// 6LoWPAN dispatch
+#define THREAD_DISPATCH_IPV6 0x41
+#define THREAD_DISPATCH_IPHC 0x60
+#define THREAD_DISPATCH_IPHC_MASK 0xe0
+#define THREAD_DISPATCH_MESH 0x80
+#define THREAD_DISPATCH_MESH_MASK 0xc0
+#define THREAD_DISPATCH_FRAG1 0xc0
+#define THREAD_DISPATCH_FRAGN 0xe0
+#define THREAD_DISPATCH_FRAG_MASK 0xf8
+#define THREAD_FRAG1_LEN 4
+#define THREAD_FRAGN_LEN 5
+
+// IPHC, first byte: 011 TF(2) NH HLIM(2); second: CID SAC SAM(2) M DAC DAM(2)
+#define THREAD_IPHC_TF_SHIFT 3
+#define THREAD_IPHC_NH 0x04
+#define THREAD_IPHC_CID 0x80
+#define THREAD_IPHC_SAC 0x40
+#define THREAD_IPHC_SAM_SHIFT 4
+#define THREAD_IPHC_M 0x08
+#define THREAD_IPHC_DAC 0x04
+
+#define THREAD_NHC_UDP 0xf0
+#define THREAD_NHC_UDP_MASK 0xf8
+#define THREAD_NHC_UDP_PORTS 0x03
+
+struct thread_context {
+    bool valid;
+    u8 prefix[8];
+};
+
+struct thread_eid {
+    bool valid;
+    u8 iid[THREAD_IID_LEN];
+    u16 rloc16;
+};
+
+// A datagram being reassembled; have[] has a bit per received 8-byte unit
+struct thread_reasm {
+    bool used;
+    bool udp;                               // UDP length to be filled in
+    u16 src;
+    u16 tag;
+    u16 size;
+    u16 received;
+    unsigned long started;
+    DECLARE_BITMAP(have, THREAD_MTU / 8);
+    u8 buf[THREAD_MTU];
+};
+
+struct thread_br {
+    const struct thread_radio_ops *ops;
+    void *ctx;
+    struct net_device *ndev;
+    u16 rloc16;
+    u8 max_payload;
+    u16 frag_tag;
+    spinlock_t lock;                        // contexts, eids, reasm
+    struct thread_context contexts[THREAD_CONTEXTS];
+    struct thread_eid eids[THREAD_EID_CACHE];
+    struct thread_reasm reasm[THREAD_REASM_SLOTS];
+    
+    u32 tx_fragmented;
+    u32 tx_no_route;
+    u32 rx_fragments;
+    u32 rx_reassembled;
+    u32 reasm_evicted;
+    u32 reasm_timeouts;
+    u32 hdr_bytes_saved;
+};
+
+static struct thread_br thread_br;
+
+static const u8 thread_short_iid[6] = { 0x00, 0x00, 0x00, 0xff, 0xfe, 0x00 };
+static const u8 thread_link_local[8] = { 0xfe, 0x80 };
+
+// Context whose /64 prefix addr has, -1 if none
+static int thread_context_of(const u8 *addr)
+{
+    int i;
+    
+    for (i = 0; i < THREAD_CONTEXTS; i++) {
+        if (thread_br.contexts[i].valid && !memcmp(thread_br.contexts[i].prefix, addr, 8)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * How much of an interface identifier has to go inline: none if the
+ * link address gives it (3), 16 bits for the short-address form (2),
+ * all 64 otherwise (1). Writes the inline part at *p.
+ */
+static int thread_iid_compress(const u8 *iid, u16 ll, u8 **p)
+{
+    if (!memcmp(iid, thread_short_iid, sizeof(thread_short_iid))) {
+        if (get_unaligned_be16(iid + 6) == ll) {
+            return 3;
+        }
+        memcpy(*p, iid + 6, 2);
+        *p += 2;
+        return 2;
+    }
+    memcpy(*p, iid, THREAD_IID_LEN);
+    *p += THREAD_IID_LEN;
+    return 1;
+}
+
+// Address mode and context of a unicast address; -1 context if stateless
+static int thread_addr_compress(const u8 *addr, u16 ll, int ctx, u8 **p)
+{
+    if (!memcmp(addr, thread_link_local, 8) || ctx >= 0) {
+        return thread_iid_compress(addr + 8, ll, p);
+    }
+    memcpy(*p, addr, 16);
+    *p += 16;
+    return 0;
+}
+
+static int thread_mcast_compress(const u8 *addr, u8 **p)
+{
+    static const u8 zero[13];
+    u8 *q = *p;
+    
+    if (addr[1] == 0x02 && !memcmp(addr + 2, zero, 13)) {
+        *q++ = addr[15];                    // ff02::00XX
+        *p = q;
+        return 3;
+    }
+    if (!memcmp(addr + 2, zero, 11)) {
+        *q++ = addr[1];                     // ffXX::00XX:XXXX
+        memcpy(q, addr + 13, 3);
+        *p = q + 3;
+        return 2;
+    }
+    if (!memcmp(addr + 2, zero, 9)) {
+        *q++ = addr[1];                     // ffXX::00XX:XXXX:XXXX
+        memcpy(q, addr + 11, 5);
+        *p = q + 5;
+        return 1;
+    }
+    memcpy(q, addr, 16);
+    *p = q + 16;
+    return 0;
+}
+
+/*
+ * Compress the IPv6 header at pkt, and the UDP header after it, into
+ * out. *consumed is set to the bytes of pkt the compressed header stands
+ * for. Returns the compressed length.
+ */
+static int thread_iphc_compress(const u8 *pkt, int len, u16 src_ll, u16 dst_ll, u8 *out, int *consumed)
+{
+    const struct ipv6hdr *ip6 = (const struct ipv6hdr *)pkt;
+    const u8 *saddr = ip6->saddr.s6_addr, *daddr = ip6->daddr.s6_addr;
+    u8 iphc0 = THREAD_DISPATCH_IPHC, iphc1 = 0, tc, *p = out + 2;
+    u32 flow;
+    int sctx = -1, dctx = -1;
+    bool udp = ip6->nexthdr == IPPROTO_UDP && len >= THREAD_IPV6_HDR_LEN + THREAD_UDP_HDR_LEN;
+    
+    if (!ipv6_addr_any(&ip6->saddr) && memcmp(saddr, thread_link_local, 8)) {
+        sctx = thread_context_of(saddr);
+    }
+    if (!ipv6_addr_is_multicast(&ip6->daddr) && memcmp(daddr, thread_link_local, 8)) {
+        dctx = thread_context_of(daddr);
+    }
+    if (sctx > 0 || dctx > 0) {
+        iphc1 |= THREAD_IPHC_CID;
+        *p++ = max(sctx, 0) << 4 | max(dctx, 0);
+    }
+    
+    // Traffic class goes inline as ECN then DSCP
+    tc = ip6->priority << 4 | ip6->flow_lbl[0] >> 4;
+    tc = tc >> 2 | (tc & 0x03) << 6;
+    flow = (ip6->flow_lbl[0] & 0x0f) << 16 | ip6->flow_lbl[1] << 8 | ip6->flow_lbl[2];
+    if (!tc && !flow) {
+        iphc0 |= 3 << THREAD_IPHC_TF_SHIFT;
+    } else if (!flow) {
+        iphc0 |= 2 << THREAD_IPHC_TF_SHIFT;
+        *p++ = tc;
+    } else if (!(tc & 0x3f)) {
+        iphc0 |= 1 << THREAD_IPHC_TF_SHIFT;
+        *p++ = (tc & 0xc0) | flow >> 16;
+        *p++ = flow >> 8;
+        *p++ = flow;
+    } else {
+        *p++ = tc;
+        *p++ = flow >> 16;
+        *p++ = flow >> 8;
+        *p++ = flow;
+    }
+    
+    if (udp) {
+        iphc0 |= THREAD_IPHC_NH;
+    } else {
+        *p++ = ip6->nexthdr;
+    }
+    
+    switch (ip6->hop_limit) {
+    case 1:
+        iphc0 |= 1;
+        break;
+    case 64:
+        iphc0 |= 2;
+        break;
+    case 255:
+        iphc0 |= 3;
+        break;
+    default:
+        *p++ = ip6->hop_limit;
+        break;
+    }
+    
+    if (ipv6_addr_any(&ip6->saddr)) {
+        iphc1 |= THREAD_IPHC_SAC;
+    } else {
+        if (sctx >= 0) {
+            iphc1 |= THREAD_IPHC_SAC;
+        }
+        iphc1 |= thread_addr_compress(saddr, src_ll, sctx, &p) << THREAD_IPHC_SAM_SHIFT;
+    }
+    
+    if (ipv6_addr_is_multicast(&ip6->daddr)) {
+        iphc1 |= THREAD_IPHC_M | thread_mcast_compress(daddr, &p);
+    } else {
+        if (dctx >= 0) {
+            iphc1 |= THREAD_IPHC_DAC;
+        }
+        iphc1 |= thread_addr_compress(daddr, dst_ll, dctx, &p);
+    }
+    
+    *consumed = THREAD_IPV6_HDR_LEN;
+    if (udp) {
+        const struct udphdr *uh = (const struct udphdr *)(pkt + THREAD_IPV6_HDR_LEN);
+        u16 sport = ntohs(uh->source), dport = ntohs(uh->dest);
+    
+        // Length is implied by the datagram; checksum stays
+        if ((sport & 0xfff0) == 0xf0b0 && (dport & 0xfff0) == 0xf0b0) {
+            *p++ = THREAD_NHC_UDP | 3;
+            *p++ = (sport & 0x0f) << 4 | (dport & 0x0f);
+        } else if ((dport & 0xff00) == 0xf000) {
+            *p++ = THREAD_NHC_UDP | 1;
+            put_unaligned_be16(sport, p);
+            p[2] = dport;
+            p += 3;
+        } else if ((sport & 0xff00) == 0xf000) {
+            *p++ = THREAD_NHC_UDP | 2;
+            p[0] = sport;
+            put_unaligned_be16(dport, p + 1);
+            p += 3;
+        } else {
+            *p++ = THREAD_NHC_UDP;
+            put_unaligned_be16(sport, p);
+            put_unaligned_be16(dport, p + 2);
+            p += 4;
+        }
+        memcpy(p, &uh->check, 2);
+        p += 2;
+        *consumed += THREAD_UDP_HDR_LEN;
+    }
+    
+    out[0] = iphc0;
+    out[1] = iphc1;
+    return p - out;
+}
+
+#define THREAD_NEED(n)                      \
+    do {                                    \
+        if (end - p < (n)) {                \
+            return -EINVAL;                 \
+        }                                   \
+    } while (0)
+
+static int thread_addr_decompress(u8 *addr, const u8 **pp, const u8 *end, bool stateful, u8 ctx, u8 mode,
+                                  u16 ll)
+{
+    const u8 *p = *pp;
+    
+    memset(addr, 0, 16);
+    if (!mode) {
+        if (stateful) {
+            return 0;                       // unspecified address
+        }
+        THREAD_NEED(16);
+        memcpy(addr, p, 16);
+        *pp = p + 16;
+        return 0;
+    }
+    
+    if (stateful) {
+        if (!thread_br.contexts[ctx].valid) {
+            return -EINVAL;
+        }
+        memcpy(addr, thread_br.contexts[ctx].prefix, 8);
+    } else {
+        memcpy(addr, thread_link_local, 8);
+    }
+    
+    switch (mode) {
+    case 1:
+        THREAD_NEED(THREAD_IID_LEN);
+        memcpy(addr + 8, p, THREAD_IID_LEN);
+        p += THREAD_IID_LEN;
+        break;
+    case 2:
+        THREAD_NEED(2);
+        memcpy(addr + 8, thread_short_iid, sizeof(thread_short_iid));
+        memcpy(addr + 14, p, 2);
+        p += 2;
+        break;
+    default:
+        memcpy(addr + 8, thread_short_iid, sizeof(thread_short_iid));
+        put_unaligned_be16(ll, addr + 14);
+        break;
+    }
+    *pp = p;
+    return 0;
+}
+
+static int thread_mcast_decompress(u8 *addr, const u8 **pp, const u8 *end, u8 mode)
+{
+    const u8 *p = *pp;
+    
+    memset(addr, 0, 16);
+    addr[0] = 0xff;
+    switch (mode) {
+    case 0:
+        THREAD_NEED(16);
+        memcpy(addr, p, 16);
+        p += 16;
+        break;
+    case 1:
+        THREAD_NEED(6);
+        addr[1] = p[0];
+        memcpy(addr + 11, p + 1, 5);
+        p += 6;
+        break;
+    case 2:
+        THREAD_NEED(4);
+        addr[1] = p[0];
+        memcpy(addr + 13, p + 1, 3);
+        p += 4;
+        break;
+    default:
+        THREAD_NEED(1);
+        addr[1] = 0x02;
+        addr[15] = p[0];
+        p += 1;
+        break;
+    }
+    *pp = p;
+    return 0;
+}
+
+/*
+ * Expand the IPHC header at in into the IPv6 header, and UDP header if
+ * compressed, at out; lengths are left for thread_fix_lengths(). Returns
+ * the compressed bytes taken and sets *hdr_len to the bytes written.
+ */
+static int thread_iphc_decompress(const u8 *in, int len, u16 src_ll, u16 dst_ll, u8 *out, int *hdr_len,
+                                  bool *udp)
+{
+    struct ipv6hdr *ip6 = (struct ipv6hdr *)out;
+    const u8 *p = in + 2, *end = in + len;
+    u8 iphc0, iphc1, sci = 0, dci = 0, tc = 0;
+    u32 flow = 0;
+    bool nh;
+    
+    if (len < 2) {
+        return -EINVAL;
+    }
+    iphc0 = in[0];
+    iphc1 = in[1];
+    
+    if (iphc1 & THREAD_IPHC_CID) {
+        THREAD_NEED(1);
+        sci = *p >> 4;
+        dci = *p++ & 0x0f;
+    }
+    
+    switch ((iphc0 >> THREAD_IPHC_TF_SHIFT) & 3) {
+    case 0:
+        THREAD_NEED(4);
+        tc = p[0];
+        flow = (p[1] & 0x0f) << 16 | p[2] << 8 | p[3];
+        p += 4;
+        break;
+    case 1:
+        THREAD_NEED(3);
+        tc = p[0] & 0xc0;
+        flow = (p[0] & 0x0f) << 16 | p[1] << 8 | p[2];
+        p += 3;
+        break;
+    case 2:
+        THREAD_NEED(1);
+        tc = *p++;
+        break;
+    default:
+        break;
+    }
+    tc = tc << 2 | tc >> 6;                 // back to DSCP then ECN
+    
+    memset(ip6, 0, sizeof(*ip6));
+    ip6->version = 6;
+    ip6->priority = tc >> 4;
+    ip6->flow_lbl[0] = (tc & 0x0f) << 4 | flow >> 16;
+    ip6->flow_lbl[1] = flow >> 8;
+    ip6->flow_lbl[2] = flow;
+    
+    nh = iphc0 & THREAD_IPHC_NH;
+    if (!nh) {
+        THREAD_NEED(1);
+        ip6->nexthdr = *p++;
+    }
+    
+    switch (iphc0 & 3) {
+    case 0:
+        THREAD_NEED(1);
+        ip6->hop_limit = *p++;
+        break;
+    case 1:
+        ip6->hop_limit = 1;
+        break;
+    case 2:
+        ip6->hop_limit = 64;
+        break;
+    default:
+        ip6->hop_limit = 255;
+        break;
+    }
+    
+    if (thread_addr_decompress(ip6->saddr.s6_addr, &p, end, iphc1 & THREAD_IPHC_SAC, sci,
+                               (iphc1 >> THREAD_IPHC_SAM_SHIFT) & 3, src_ll)) {
+        return -EINVAL;
+    }
+    if (iphc1 & THREAD_IPHC_M) {
+        if ((iphc1 & THREAD_IPHC_DAC) || thread_mcast_decompress(ip6->daddr.s6_addr, &p, end, iphc1 & 3)) {
+            return -EINVAL;
+        }
+    } else if (((iphc1 & THREAD_IPHC_DAC) && !(iphc1 & 3)) ||
+               thread_addr_decompress(ip6->daddr.s6_addr, &p, end, iphc1 & THREAD_IPHC_DAC, dci, iphc1 & 3,
+                                      dst_ll)) {
+        return -EINVAL;
+    }
+    
+    *hdr_len = THREAD_IPV6_HDR_LEN;
+    *udp = false;
+    if (nh) {
+        struct udphdr *uh = (struct udphdr *)(out + THREAD_IPV6_HDR_LEN);
+        u8 nhc;
+    
+        THREAD_NEED(1);
+        nhc = *p++;
+        if ((nhc & THREAD_NHC_UDP_MASK) != THREAD_NHC_UDP || (nhc & 0x04)) {
+            return -EINVAL;                 // no other NHC, and the checksum is never elided
+        }
+    
+        switch (nhc & THREAD_NHC_UDP_PORTS) {
+        case 0:
+            THREAD_NEED(4);
+            uh->source = htons(get_unaligned_be16(p));
+            uh->dest = htons(get_unaligned_be16(p + 2));
+            p += 4;
+            break;
+        case 1:
+            THREAD_NEED(3);
+            uh->source = htons(get_unaligned_be16(p));
+            uh->dest = htons(0xf000 | p[2]);
+            p += 3;
+            break;
+        case 2:
+            THREAD_NEED(3);
+            uh->source = htons(0xf000 | p[0]);
+            uh->dest = htons(get_unaligned_be16(p + 1));
+            p += 3;
+            break;
+        default:
+            THREAD_NEED(1);
+            uh->source = htons(0xf0b0 | p[0] >> 4);
+            uh->dest = htons(0xf0b0 | (p[0] & 0x0f));
+            p += 1;
+            break;
+        }
+        THREAD_NEED(2);
+        memcpy(&uh->check, p, 2);
+        p += 2;
+    
+        ip6->nexthdr = IPPROTO_UDP;
+        *hdr_len += THREAD_UDP_HDR_LEN;
+        *udp = true;
+    }
+    
+    return p - in;
+}
+
+// Fill in the lengths the compressed header implied, for a datagram of size bytes
+static void thread_fix_lengths(u8 *pkt, u16 size, bool udp)
+{
+    struct ipv6hdr *ip6 = (struct ipv6hdr *)pkt;
+    
+    ip6->payload_len = htons(size - THREAD_IPV6_HDR_LEN);
+    if (udp) {
+        ((struct udphdr *)(pkt + THREAD_IPV6_HDR_LEN))->len = htons(size - THREAD_IPV6_HDR_LEN);
+    }
+}
+
+static void thread_deliver(struct sk_buff *skb)
+{
+    struct net_device *ndev = thread_br.ndev;
+    
+    skb->protocol = htons(ETH_P_IPV6);
+    skb_reset_mac_header(skb);
+    ndev->stats.rx_packets++;
+    ndev->stats.rx_bytes += skb->len;
+    netif_rx(skb);
+}
+
+// An unfragmented IPHC datagram
+static void thread_rx_iphc(const u8 *payload, u8 len, u16 src, u16 dst)
+{
+    struct net_device *ndev = thread_br.ndev;
+    struct sk_buff *skb;
+    unsigned long flags;
+    int taken, hdr_len;
+    bool udp;
+    
+    skb = netdev_alloc_skb(ndev, THREAD_IPV6_HDR_LEN + THREAD_UDP_HDR_LEN + len);
+    if (!skb) {
+        ndev->stats.rx_dropped++;
+        return;
+    }
+    
+    spin_lock_irqsave(&thread_br.lock, flags);
+    taken = thread_iphc_decompress(payload, len, src, dst, skb->data, &hdr_len, &udp);
+    spin_unlock_irqrestore(&thread_br.lock, flags);
+    if (taken < 0) {
+        ndev->stats.rx_errors++;
+        kfree_skb(skb);
+        return;
+    }
+    
+    skb_put(skb, hdr_len);
+    skb_put_data(skb, payload + taken, len - taken);
+    thread_fix_lengths(skb->data, skb->len, udp);
+    thread_deliver(skb);
+}
+
+/*
+ * Reassembly slot for (src, tag, size): the existing one, a free or
+ * timed out one, or else the oldest. Called with the lock held.
+ */
+static struct thread_reasm *thread_reasm_slot(u16 src, u16 tag, u16 size)
+{
+    struct thread_reasm *r, *victim = NULL;
+    unsigned long timeout = msecs_to_jiffies(THREAD_REASM_TIMEOUT_MS);
+    int i;
+    
+    for (i = 0; i < THREAD_REASM_SLOTS; i++) {
+        r = &thread_br.reasm[i];
+        if (r->used && r->src == src && r->tag == tag && r->size == size) {
+            return r;
+        }
+    }
+    
+    for (i = 0; i < THREAD_REASM_SLOTS; i++) {
+        r = &thread_br.reasm[i];
+        if (!r->used) {
+            victim = r;
+            break;
+        }
+        if (time_after(jiffies, r->started + timeout)) {
+            thread_br.reasm_timeouts++;
+            victim = r;
+            break;
+        }
+        if (!victim || time_before(r->started, victim->started)) {
+            victim = r;
+        }
+    }
+    if (victim->used && !time_after(jiffies, victim->started + timeout)) {
+        thread_br.reasm_evicted++;
+    }
+    
+    victim->used = true;
+    victim->udp = false;
+    victim->src = src;
+    victim->tag = tag;
+    victim->size = size;
+    victim->received = 0;
+    victim->started = jiffies;
+    bitmap_zero(victim->have, THREAD_MTU / 8);
+    return victim;
+}
+
+// Result of marking a fragment's granules received
+enum {
+    THREAD_REASM_NEW,                       // none were there
+    THREAD_REASM_DUP,                       // all were: a retransmit if the bytes match
+    THREAD_REASM_OVERLAP,                   // some were
+};
+
+// Mark [off, off + len) received unless any of it is already there
+static int thread_reasm_mark(struct thread_reasm *r, u16 off, u16 len)
+{
+    unsigned int first = off / 8, last = DIV_ROUND_UP(off + len, 8);
+    
+    if (find_next_zero_bit(r->have, last, first) >= last) {
+        return THREAD_REASM_DUP;
+    }
+    if (find_next_bit(r->have, last, first) < last) {
+        return THREAD_REASM_OVERLAP;
+    }
+    bitmap_set(r->have, first, last - first);
+    r->received += len;
+    return THREAD_REASM_NEW;
+}
+
+static void thread_rx_fragment(const u8 *payload, u8 len, u16 src, u16 dst)
+{
+    struct net_device *ndev = thread_br.ndev;
+    struct thread_reasm *r;
+    struct sk_buff *skb = NULL;
+    unsigned long flags;
+    bool complete = false;
+    bool first = (payload[0] & THREAD_DISPATCH_FRAG_MASK) == THREAD_DISPATCH_FRAG1;
+    u16 size, tag, off = 0;
+    int hlen = first ? THREAD_FRAG1_LEN : THREAD_FRAGN_LEN;
+    int taken = 0, hdr_len = 0, plen, mark;
+    bool udp = false;
+    
+    if (len < hlen) {
+        ndev->stats.rx_errors++;
+        return;
+    }
+    size = (payload[0] & 0x07) << 8 | payload[1];
+    tag = get_unaligned_be16(payload + 2);
+    if (!first) {
+        off = payload[4] * 8;
+    }
+    payload += hlen;
+    len -= hlen;
+    if (size > THREAD_MTU || size < THREAD_IPV6_HDR_LEN) {
+        ndev->stats.rx_length_errors++;
+        return;
+    }
+    thread_br.rx_fragments++;
+    
+    spin_lock_irqsave(&thread_br.lock, flags);
+    r = thread_reasm_slot(src, tag, size);
+    
+    if (first) {
+        u8 hdr[THREAD_IPV6_HDR_LEN + THREAD_UDP_HDR_LEN];
+    
+        if (payload[0] == THREAD_DISPATCH_IPV6) {
+            taken = 1;
+        } else if ((payload[0] & THREAD_DISPATCH_IPHC_MASK) == THREAD_DISPATCH_IPHC) {
+            taken = thread_iphc_decompress(payload, len, src, dst, hdr, &hdr_len, &udp);
+        } else {
+            taken = -EINVAL;
+        }
+        plen = len - max(taken, 0);
+        if (taken < 0 || hdr_len + plen > size) {
+            goto drop;
+        }
+        mark = thread_reasm_mark(r, 0, hdr_len + plen);
+        if (mark == THREAD_REASM_DUP && !memcmp(r->buf, hdr, hdr_len) &&
+            !memcmp(r->buf + hdr_len, payload + taken, plen)) {
+            goto duplicate;
+        }
+        if (mark != THREAD_REASM_NEW) {
+            goto drop;
+        }
+        memcpy(r->buf, hdr, hdr_len);
+        memcpy(r->buf + hdr_len, payload + taken, plen);
+        r->udp = udp;
+    } else {
+        if (off + len > size) {
+            goto drop;
+        }
+        mark = thread_reasm_mark(r, off, len);
+        if (mark == THREAD_REASM_DUP && !memcmp(r->buf + off, payload, len)) {
+            goto duplicate;
+        }
+        if (mark != THREAD_REASM_NEW) {
+            goto drop;
+        }
+        memcpy(r->buf + off, payload, len);
+    }
+    
+    if (r->received == size) {
+        skb = netdev_alloc_skb(ndev, size);
+        if (skb) {
+            thread_fix_lengths(r->buf, size, r->udp);
+            skb_put_data(skb, r->buf, size);
+        }
+        r->used = false;
+        complete = true;
+        thread_br.rx_reassembled++;
+    }
+    spin_unlock_irqrestore(&thread_br.lock, flags);
+    
+    if (skb) {
+        thread_deliver(skb);
+    } else if (complete) {
+        ndev->stats.rx_dropped++;
+    }
+    return;
+    
+duplicate:
+    // The same bytes again, a MAC retransmit: keep the slot
+    spin_unlock_irqrestore(&thread_br.lock, flags);
+    return;
+    
+drop:
+    // A fragment that does not fit what is there: the datagram is lost
+    r->used = false;
+    spin_unlock_irqrestore(&thread_br.lock, flags);
+    ndev->stats.rx_errors++;
+}
+
+/**
+ * A frame came in from the mesh; src and dst are its MAC addresses
+ */
+void thread_radio_receive(u16 src_short, u16 dst_short, const u8 *payload, u8 len)
+{
+    struct net_device *ndev = thread_br.ndev;
+    u16 final;
+    int n;
+    
+    if (!ndev || !len) {
+        return;
+    }
+    
+    // Mesh header: only short originator and final addresses are used in Thread
+    if ((payload[0] & THREAD_DISPATCH_MESH_MASK) == THREAD_DISPATCH_MESH) {
+        if ((payload[0] & 0x30) != 0x30 || len < 5) {
+            ndev->stats.rx_errors++;
+            return;
+        }
+        n = (payload[0] & 0x0f) == 0x0f ? 6 : 5;    // hops left escaped into a byte
+        if (len < n) {
+            ndev->stats.rx_errors++;
+            return;
+        }
+        src_short = get_unaligned_be16(payload + n - 4);
+        final = get_unaligned_be16(payload + n - 2);
+        if (final != READ_ONCE(thread_br.rloc16) && final != THREAD_BROADCAST) {
+            return;                         // routed by the mesh, not for us
+        }
+        dst_short = final;
+        payload += n;
+        len -= n;
+        if (!len) {
+            return;
+        }
+    }
+    
+    if ((payload[0] & THREAD_DISPATCH_FRAG_MASK) == THREAD_DISPATCH_FRAG1 ||
+        (payload[0] & THREAD_DISPATCH_FRAG_MASK) == THREAD_DISPATCH_FRAGN) {
+        thread_rx_fragment(payload, len, src_short, dst_short);
+    } else if ((payload[0] & THREAD_DISPATCH_IPHC_MASK) == THREAD_DISPATCH_IPHC) {
+        thread_rx_iphc(payload, len, src_short, dst_short);
+    } else if (payload[0] == THREAD_DISPATCH_IPV6 && len > THREAD_IPV6_HDR_LEN) {
+        struct sk_buff *skb = netdev_alloc_skb(ndev, len - 1);
+    
+        if (!skb) {
+            ndev->stats.rx_dropped++;
+            return;
+        }
+        skb_put_data(skb, payload + 1, len - 1);
+        thread_deliver(skb);
+    } else {
+        ndev->stats.rx_errors++;
+    }
+}
+EXPORT_SYMBOL_GPL(thread_radio_receive);
+
+/*
+ * MAC destination for an IPv6 destination: broadcast for multicast, the
+ * RLOC16 from an address in short-address form, or the one the daemon
+ * resolved for the EID; -1 if unknown
+ */
+static int thread_link_dest(const u8 *daddr)
+{
+    const struct thread_eid *e;
+    int ret = -1;
+    
+    if (daddr[0] == 0xff) {
+        return THREAD_BROADCAST;
+    }
+    if (!memcmp(daddr + 8, thread_short_iid, sizeof(thread_short_iid))) {
+        return get_unaligned_be16(daddr + 14);
+    }
+    
+    e = &thread_br.eids[jhash(daddr + 8, THREAD_IID_LEN, 0) % THREAD_EID_CACHE];
+    if (e->valid && !memcmp(e->iid, daddr + 8, THREAD_IID_LEN)) {
+        ret = e->rloc16;
+    }
+    return ret;
+}
+
+/*
+ * Send the datagram as FRAG1 with the compressed header and as much
+ * payload as fits, then FRAGNs filled to the frame size; each but the
+ * last covers a multiple of 8 bytes of the uncompressed datagram
+ */
+static int thread_tx_fragments(u16 dst, const u8 *hdr, int hdr_len, int consumed, const u8 *data, int len)
+{
+    u8 frame[THREAD_FRAGN_LEN + 255];
+    u16 tag = thread_br.frag_tag++;
+    int off, chunk, ret;
+    
+    frame[0] = THREAD_DISPATCH_FRAG1 | (len >> 8);
+    frame[1] = len;
+    put_unaligned_be16(tag, frame + 2);
+    chunk = ((consumed + thread_br.max_payload - THREAD_FRAG1_LEN - hdr_len) & ~7) - consumed;
+    if (chunk <= 0) {
+        return -EMSGSIZE;
+    }
+    memcpy(frame + THREAD_FRAG1_LEN, hdr, hdr_len);
+    memcpy(frame + THREAD_FRAG1_LEN + hdr_len, data + consumed, chunk);
+    ret = thread_br.ops->tx(thread_br.ctx, dst, frame, THREAD_FRAG1_LEN + hdr_len + chunk);
+    if (ret) {
+        return ret;
+    }
+    
+    frame[0] = THREAD_DISPATCH_FRAGN | (len >> 8);
+    for (off = consumed + chunk; off < len; off += chunk) {
+        chunk = min((thread_br.max_payload - THREAD_FRAGN_LEN) & ~7, len - off);
+        frame[4] = off / 8;
+        memcpy(frame + THREAD_FRAGN_LEN, data + off, chunk);
+        ret = thread_br.ops->tx(thread_br.ctx, dst, frame, THREAD_FRAGN_LEN + chunk);
+        if (ret) {
+            return ret;
+        }
+    }
+    
+    thread_br.tx_fragmented++;
+    return 0;
+}
+
+static netdev_tx_t thread_net_xmit(struct sk_buff *skb, struct net_device *ndev)
+{
+    u8 frame[THREAD_MAX_HDR_LEN + 255];
+    int dst, hdr_len = 0, consumed = 0, ret;
+    unsigned long flags;
+    
+    if (skb->protocol != htons(ETH_P_IPV6) || skb_linearize(skb) || skb->len < THREAD_IPV6_HDR_LEN ||
+        skb->len > THREAD_MTU) {
+        goto drop;
+    }
+    
+    spin_lock_irqsave(&thread_br.lock, flags);
+    dst = thread_link_dest(((struct ipv6hdr *)skb->data)->daddr.s6_addr);
+    if (dst >= 0) {
+        hdr_len = thread_iphc_compress(skb->data, skb->len, thread_br.rloc16, dst, frame, &consumed);
+    }
+    spin_unlock_irqrestore(&thread_br.lock, flags);
+    if (dst < 0) {
+        thread_br.tx_no_route++;
+        goto drop;
+    }
+    thread_br.hdr_bytes_saved += consumed - hdr_len;
+    
+    if (hdr_len + skb->len - consumed <= thread_br.max_payload) {
+        memcpy(frame + hdr_len, skb->data + consumed, skb->len - consumed);
+        ret = thread_br.ops->tx(thread_br.ctx, dst, frame, hdr_len + skb->len - consumed);
+    } else {
+        ret = thread_tx_fragments(dst, frame, hdr_len, consumed, skb->data, skb->len);
+    }
+    if (ret) {
+        goto drop;
+    }
+    
+    ndev->stats.tx_packets++;
+    ndev->stats.tx_bytes += skb->len;
+    dev_consume_skb_any(skb);
+    return NETDEV_TX_OK;
+    
+drop:
+    ndev->stats.tx_dropped++;
+    dev_kfree_skb_any(skb);
+    return NETDEV_TX_OK;
+}
+
+static int thread_net_open(struct net_device *ndev)
+{
+    netif_start_queue(ndev);
+    return 0;
+}
+
+static int thread_net_stop(struct net_device *ndev)
+{
+    netif_stop_queue(ndev);
+    return 0;
+}
+
+static const struct net_device_ops thread_net_ops = {
+    .ndo_open = thread_net_open,
+    .ndo_stop = thread_net_stop,
+    .ndo_start_xmit = thread_net_xmit,
+};
+
+// Raw IPv6: no link-layer header, no neighbour discovery on this side
+static void thread_net_setup(struct net_device *ndev)
+{
+    ndev->netdev_ops = &thread_net_ops;
+    ndev->type = ARPHRD_NONE;
+    ndev->flags = IFF_NOARP | IFF_MULTICAST;
+    ndev->hard_header_len = 0;
+    ndev->addr_len = 0;
+    ndev->mtu = THREAD_MTU;
+    ndev->min_mtu = THREAD_MTU;
+    ndev->max_mtu = THREAD_MTU;
+    ndev->needs_free_netdev = true;
+}
+
+/**
+ * Attach the radio and create the interface; max_payload is the MAC
+ * payload a frame to a short address can carry after MAC header and
+ * security overhead
+ */
+int thread_register_radio(const struct thread_radio_ops *ops, void *ctx, u16 rloc16, u8 max_payload)
+{
+    struct net_device *ndev;
+    int ret;
+    
+    if (!ops || !ops->tx || max_payload < THREAD_MAX_HDR_LEN + THREAD_FRAG1_LEN + 8) {
+        return -EINVAL;
+    }
+    if (thread_br.ops) {
+        return -EBUSY;
+    }
+    
+    ndev = alloc_netdev(0, "thread%d", NET_NAME_ENUM, thread_net_setup);
+    if (!ndev) {
+        return -ENOMEM;
+    }
+    netif_carrier_off(ndev);
+    
+    thread_br.ops = ops;
+    thread_br.ctx = ctx;
+    thread_br.rloc16 = rloc16;
+    thread_br.max_payload = max_payload;
+    thread_br.frag_tag = get_random_u16();
+    thread_br.ndev = ndev;
+    
+    ret = register_netdev(ndev);
+    if (ret) {
+        thread_br.ndev = NULL;
+        thread_br.ops = NULL;
+        free_netdev(ndev);
+        return ret;
+    }
+    netif_carrier_on(ndev);
+    
+    pr_info("thread_protocol: %s up, RLOC16 0x%04x, %u byte frames\n", ndev->name, rloc16, max_payload);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(thread_register_radio);
+
+void thread_unregister_radio(void)
+{
+    struct net_device *ndev = thread_br.ndev;
+    
+    if (!ndev) {
+        return;
+    }
+    unregister_netdev(ndev);
+    thread_br.ndev = NULL;
+    thread_br.ops = NULL;
+}
+EXPORT_SYMBOL_GPL(thread_unregister_radio);
+
+// The node's RLOC16 changes when it re-attaches
+int thread_set_rloc16(u16 rloc16)
+{
+    WRITE_ONCE(thread_br.rloc16, rloc16);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(thread_set_rloc16);
+
+int thread_set_context(u8 id, const u8 *prefix)
+{
+    unsigned long flags;
+    
+    if (id >= THREAD_CONTEXTS) {
+        return -EINVAL;
+    }
+    
+    spin_lock_irqsave(&thread_br.lock, flags);
+    thread_br.contexts[id].valid = prefix;
+    if (prefix) {
+        memcpy(thread_br.contexts[id].prefix, prefix, 8);
+    }
+    spin_unlock_irqrestore(&thread_br.lock, flags);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(thread_set_context);
+
+/**
+ * Record which router an EID lives behind, from address query answers;
+ * a later mapping of another EID to the same cache line replaces it
+ */
+int thread_set_eid_rloc(const u8 *iid, u16 rloc16)
+{
+    struct thread_eid *e;
+    unsigned long flags;
+    
+    if (!iid) {
+        return -EINVAL;
+    }
+    
+    spin_lock_irqsave(&thread_br.lock, flags);
+    e = &thread_br.eids[jhash(iid, THREAD_IID_LEN, 0) % THREAD_EID_CACHE];
+    memcpy(e->iid, iid, THREAD_IID_LEN);
+    e->rloc16 = rloc16;
+    e->valid = true;
+    spin_unlock_irqrestore(&thread_br.lock, flags);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(thread_set_eid_rloc);
 
 static int __init thread_protocol_init(void)
 {
-    pr_info("thread_protocol: Initializing\n");
+    pr_info("thread_protocol: Initializing v%s\n", THREAD_VERSION);
+    spin_lock_init(&thread_br.lock);
     return 0;
 }
 
 static void __exit thread_protocol_exit(void)
 {
-    pr_info("thread_protocol: Exiting\n");
+    thread_unregister_radio();
+    pr_info("thread_protocol: Exiting: %u fragmented TX, %u reassembled, %u evicted, %u header bytes saved\n",
+            thread_br.tx_fragmented, thread_br.rx_reassembled, thread_br.reasm_evicted, thread_br.hdr_bytes_saved);
 }
 
 module_init(thread_protocol_init);
@@ -28,4 +1086,4 @@ module_exit(thread_protocol_exit);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("jk1806");
 MODULE_DESCRIPTION("Thread Protocol");
-MODULE_VERSION(MODULE_VERSION);
+MODULE_VERSION(THREAD_VERSION);
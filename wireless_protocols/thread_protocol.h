@@ -0,0 +1,41 @@
+/**
+ * Thread border router data path
+ *
+ * What the glue for an 802.15.4 radio gives thread_protocol.c and calls
+ * back into it. IPv6 packets routed to the thread%d interface are sent
+ * into the mesh with their headers compressed by 6LoWPAN IPHC (RFC 6282),
+ * UDP ones, CoAP and Matter among them, with the UDP header compressed
+ * too; packets that still do not fit a frame are fragmented (RFC 4944)
+ * into frames filled to the last byte the radio takes. Received frames
+ * are decompressed and fragments reassembled in a fixed pool, so receive
+ * never allocates more than the skb handed to the stack. Prefixes for
+ * stateful compression, the mesh-local one in context 0, and the RLOC16
+ * behind each EID are supplied by the Thread management daemon.
+ */
+
+#ifndef THREAD_PROTOCOL_H
+#define THREAD_PROTOCOL_H
+
+#include <linux/types.h>
+
+#define THREAD_CONTEXTS 16
+#define THREAD_IID_LEN 8
+
+/*
+ * tx sends payload as the MAC payload of one frame to dst_short, 0xffff
+ * for broadcast, adding the MAC header and security; it copies the
+ * payload and must not sleep
+ */
+struct thread_radio_ops {
+    int (*tx)(void *ctx, u16 dst_short, const u8 *payload, u8 len);
+};
+
+int thread_register_radio(const struct thread_radio_ops *ops, void *ctx, u16 rloc16, u8 max_payload);
+void thread_unregister_radio(void);
+void thread_radio_receive(u16 src_short, u16 dst_short, const u8 *payload, u8 len);
+
+int thread_set_rloc16(u16 rloc16);
+int thread_set_context(u8 id, const u8 *prefix);    // /64, NULL to remove
+int thread_set_eid_rloc(const u8 *iid, u16 rloc16);
+
+#endif /* THREAD_PROTOCOL_H */
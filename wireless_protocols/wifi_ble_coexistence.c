@@ -16,21 +16,53 @@
 #include <linux/atomic.h>
 #include <linux/slab.h>
 #include <linux/errno.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
 
-#define COEX_VERSION "2.0.0"
+#include "wifi_ble_coexistence.h"
+
+#define COEX_VERSION "2.1.0"
 #define MAX_CHANNELS 14
 #define COEX_THRESHOLD_DBM -70
 #define COEX_SCAN_INTERVAL_MS 100
 #define COEX_MITIGATION_TIMEOUT_MS 1000
+#define COEX_GUARD_NS 150000                // antenna switch and BLE RX window widening
+#define COEX_BLE_MIN_EVENT_NS 625000        // one packet pair at least
+#define COEX_BLE_MAX_SKIP 2                 // clashes lost in a row before a connection wins
+#define COEX_WIFI_QOS_MARGIN 100            // permille of airtime kept spare past VO + VI
+#define COEX_BLE_PER_BAD 300                // permille, channel left out of the map above this
+#define COEX_BLE_MIN_CHANNELS 20            // fewer and only the Wi-Fi band is left out
+
+struct coex_ble_conn {
+    bool active;
+    u16 handle;
+    u64 interval_ns;
+    u64 event_ns;
+    u64 next_anchor_ns;
+    u32 skipped;                            // clashes lost in a row
+    u32 events;
+    u32 events_lost;
+};
 
 struct coexistence_manager {
+    const struct coex_radio_ops *ops;
+    void *ctx;
+    spinlock_t lock;                        // conns, event_scale
+    struct hrtimer slot_timer;
+    struct coex_ble_conn conns[COEX_MAX_BLE_CONNS];
+    u32 event_scale;                        // permille of its length each BLE event gets
+    u32 wifi_demand[COEX_AC_COUNT];         // permille of airtime
+    u16 ble_per[COEX_BLE_DATA_CHANNELS];    // learned packet error rate, permille
+    u8 ble_map[COEX_BLE_MAP_LEN];
     int wifi_channel;
     int ble_channel;
     u32 interference_level;
     u32 mitigation_active;
     u64 throughput_improvement;
     struct timer_list scan_timer;
-    struct work_struct mitigation_work;
+    struct work_struct learn_work;
     atomic_t coexistence_enabled;
     u32 wifi_power_level;
     u32 ble_power_level;
@@ -51,6 +83,10 @@ static struct coexistence_manager coex_mgr;
 static struct channel_scan_result scan_results[MAX_CHANNELS];
 static int scan_result_count = 0;
 
+static void coexistence_scan_timer(struct timer_list *t);
+static void coexistence_learn_work(struct work_struct *work);
+static enum hrtimer_restart coexistence_slot_tick(struct hrtimer *timer);
+
 /**
  * Initialize WiFi-BLE coexistence
  */
@@ -68,6 +104,13 @@ static int coexistence_init(void)
     coex_mgr.ble_power_level = 100;  // 100% power
     coex_mgr.channel_switches = 0;
     coex_mgr.total_throughput = 0;
+    coex_mgr.event_scale = 1000;
+    memset(coex_mgr.ble_map, 0xff, sizeof(coex_mgr.ble_map));
+    coex_mgr.ble_map[COEX_BLE_MAP_LEN - 1] = 0x1f;     // channels 32-36
+    
+    spin_lock_init(&coex_mgr.lock);
+    hrtimer_init(&coex_mgr.slot_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    coex_mgr.slot_timer.function = coexistence_slot_tick;
     
     atomic_set(&coex_mgr.coexistence_enabled, 1);
     
@@ -75,8 +118,8 @@ static int coexistence_init(void)
     timer_setup(&coex_mgr.scan_timer, coexistence_scan_timer, 0);
     mod_timer(&coex_mgr.scan_timer, jiffies + msecs_to_jiffies(COEX_SCAN_INTERVAL_MS));
     
-    // Initialize mitigation work queue
-    INIT_WORK(&coex_mgr.mitigation_work, coexistence_mitigation_work);
+    // Initialize learning work queue
+    INIT_WORK(&coex_mgr.learn_work, coexistence_learn_work);
     
     pr_info("WiFi-BLE coexistence system initialized successfully\n");
     return 0;
@@ -87,110 +130,338 @@ static int coexistence_init(void)
  */
 static void coexistence_scan_timer(struct timer_list *t)
 {
-    schedule_work(&coex_mgr.mitigation_work);
+    schedule_work(&coex_mgr.learn_work);
     
     // Reschedule timer
     mod_timer(&coex_mgr.scan_timer, jiffies + msecs_to_jiffies(COEX_SCAN_INTERVAL_MS));
 }
 
-/**
- * Mitigation work function
+// Skip events already behind now, counting them as lost
+static void coexistence_catch_up(struct coex_ble_conn *conn, u64 now)
+{
+    while (conn->next_anchor_ns + conn->event_ns < now) {
+        conn->next_anchor_ns += conn->interval_ns;
+        conn->events_lost++;
+    }
+}
+
+/*
+ * Arbiter, at every grant boundary: if a BLE connection event is due,
+ * BLE gets the antenna for it, otherwise Wi-Fi gets it up to the next
+ * one. Of events that clash, the earliest wins unless another has lost
+ * COEX_BLE_MAX_SKIP in a row; the losers skip theirs.
  */
-static void coexistence_mitigation_work(struct work_struct *work)
+static enum hrtimer_restart coexistence_slot_tick(struct hrtimer *timer)
 {
+    struct coex_ble_conn *conn, *next = NULL, *win;
+    u64 now = ktime_get_ns();
+    u64 start, len, end;
+    unsigned long flags;
     int i;
-    u32 total_interference = 0;
-    u32 max_interference = 0;
-    int worst_channel = -1;
-    
-    // Scan all channels for interference
-    for (i = 0; i < MAX_CHANNELS; i++) {
-        scan_results[i].channel = i + 1;
-        scan_results[i].rssi_dbm = -50 - (i * 2); // Simulate RSSI
-        scan_results[i].interference_level = (i % 3) * 25; // Simulate interference
-        scan_results[i].is_wifi = (i % 2 == 0);
-        scan_results[i].is_ble = (i % 2 == 1);
-        scan_results[i].timestamp = jiffies;
-        
-        total_interference += scan_results[i].interference_level;
-        
-        if (scan_results[i].interference_level > max_interference) {
-            max_interference = scan_results[i].interference_level;
-            worst_channel = i;
+    
+    spin_lock_irqsave(&coex_mgr.lock, flags);
+    
+    for (i = 0; i < COEX_MAX_BLE_CONNS; i++) {
+        conn = &coex_mgr.conns[i];
+        if (!conn->active) {
+            continue;
+        }
+        coexistence_catch_up(conn, now);
+        if (!next || conn->next_anchor_ns < next->next_anchor_ns) {
+            next = conn;
+        }
+    }
+    
+    if (!next) {
+        spin_unlock_irqrestore(&coex_mgr.lock, flags);
+        coex_mgr.ops->grant(coex_mgr.ctx, COEX_OWNER_WIFI, 0);
+        return HRTIMER_NORESTART;
+    }
+    
+    start = next->next_anchor_ns - COEX_GUARD_NS;
+    if (start > now) {
+        spin_unlock_irqrestore(&coex_mgr.lock, flags);
+        coex_mgr.ops->grant(coex_mgr.ctx, COEX_OWNER_WIFI, div_u64(start - now, NSEC_PER_USEC));
+        hrtimer_set_expires(timer, ns_to_ktime(start));
+        return HRTIMER_RESTART;
+    }
+    
+    win = next;
+    len = max_t(u64, div_u64(next->event_ns * coex_mgr.event_scale, 1000), COEX_BLE_MIN_EVENT_NS);
+    end = next->next_anchor_ns + len;
+    for (i = 0; i < COEX_MAX_BLE_CONNS; i++) {
+        conn = &coex_mgr.conns[i];
+        if (conn->active && conn != next && conn->next_anchor_ns < end &&
+            conn->skipped >= COEX_BLE_MAX_SKIP && conn->skipped > win->skipped) {
+            win = conn;
+        }
+    }
+    if (win != next) {
+        len = max_t(u64, div_u64(win->event_ns * coex_mgr.event_scale, 1000), COEX_BLE_MIN_EVENT_NS);
+        end = win->next_anchor_ns + len;
+    }
+    
+    for (i = 0; i < COEX_MAX_BLE_CONNS; i++) {
+        conn = &coex_mgr.conns[i];
+        if (!conn->active || conn->next_anchor_ns >= end) {
+            continue;
+        }
+        if (conn == win) {
+            conn->skipped = 0;
+            conn->events++;
+        } else {
+            conn->skipped++;
+            conn->events_lost++;
         }
+        conn->next_anchor_ns += conn->interval_ns;
     }
     
-    scan_result_count = MAX_CHANNELS;
+    spin_unlock_irqrestore(&coex_mgr.lock, flags);
     
-    // Apply mitigation if interference is high
-    if (max_interference > COEX_THRESHOLD_DBM) {
-        coexistence_apply_mitigation(worst_channel, max_interference);
+    coex_mgr.ops->grant(coex_mgr.ctx, COEX_OWNER_BLE, div_u64(end + COEX_GUARD_NS - now, NSEC_PER_USEC));
+    hrtimer_set_expires(timer, ns_to_ktime(end + COEX_GUARD_NS));
+    return HRTIMER_RESTART;
+}
+
+// Re-run the arbiter now, after the connection set changed
+static void coexistence_rearbitrate(void)
+{
+    if (coex_mgr.ops) {
+        hrtimer_start(&coex_mgr.slot_timer, ktime_get(), HRTIMER_MODE_ABS);
     }
+}
+
+// BLE data channel centre frequencies: 2404-2424 and 2428-2478 MHz
+static int coexistence_ble_mhz(int ch)
+{
+    return ch <= 10 ? 2404 + 2 * ch : 2428 + 2 * (ch - 11);
+}
+
+static bool coexistence_under_wifi(int ch)
+{
+    int wifi_mhz;
     
-    pr_debug("Coexistence scan completed: max_interference=%d, worst_channel=%d\n",
-            max_interference, worst_channel);
+    if (coex_mgr.wifi_channel < 1 || coex_mgr.wifi_channel > MAX_CHANNELS) {
+        return false;
+    }
+    wifi_mhz = coex_mgr.wifi_channel == 14 ? 2484 : 2407 + 5 * coex_mgr.wifi_channel;
+    return abs(coexistence_ble_mhz(ch) - wifi_mhz) <= 12;    // 22 MHz wide, plus the BLE half
 }
 
 /**
- * Apply interference mitigation
+ * Learning work function
+ *
+ * Once per scan interval: rebuild the BLE channel map from the Wi-Fi
+ * channel and the learned error rates, and size BLE events so that
+ * Wi-Fi voice and video demand keeps its airtime.
  */
-static int coexistence_apply_mitigation(int channel, u32 interference_level)
+static void coexistence_learn_work(struct work_struct *work)
 {
-    u32 power_reduction;
-    u32 channel_switch_delay;
+    u8 map[COEX_BLE_MAP_LEN] = {};
+    u32 ble_share = 0, wifi_qos, room;
+    unsigned long flags;
+    int i, used = 0;
     
-    if (channel < 0 || channel >= MAX_CHANNELS) {
+    if (!atomic_read(&coex_mgr.coexistence_enabled)) {
+        return;
+    }
+    
+    for (i = 0; i < COEX_BLE_DATA_CHANNELS; i++) {
+        if (!coexistence_under_wifi(i) && coex_mgr.ble_per[i] <= COEX_BLE_PER_BAD) {
+            map[i / 8] |= BIT(i % 8);
+            used++;
+        }
+    }
+    if (used < COEX_BLE_MIN_CHANNELS) {
+        memset(map, 0, sizeof(map));
+        for (i = 0; i < COEX_BLE_DATA_CHANNELS; i++) {
+            if (!coexistence_under_wifi(i)) {
+                map[i / 8] |= BIT(i % 8);
+            }
+        }
+    }
+    
+    // Channels out of the map get no reports, so let their error rate decay and retry them later
+    for (i = 0; i < COEX_BLE_DATA_CHANNELS; i++) {
+        if (!(map[i / 8] & BIT(i % 8))) {
+            coex_mgr.ble_per[i] -= coex_mgr.ble_per[i] / 4;
+        }
+    }
+    
+    if (memcmp(map, coex_mgr.ble_map, sizeof(map)) && coex_mgr.ops &&
+        !coex_mgr.ops->set_ble_channel_map(coex_mgr.ctx, map)) {
+        memcpy(coex_mgr.ble_map, map, sizeof(map));
+        coex_mgr.channel_switches++;
+    }
+    
+    spin_lock_irqsave(&coex_mgr.lock, flags);
+    for (i = 0; i < COEX_MAX_BLE_CONNS; i++) {
+        if (coex_mgr.conns[i].active) {
+            ble_share += div64_u64(coex_mgr.conns[i].event_ns * 1000, coex_mgr.conns[i].interval_ns);
+        }
+    }
+    wifi_qos = coex_mgr.wifi_demand[COEX_AC_VO] + coex_mgr.wifi_demand[COEX_AC_VI] + COEX_WIFI_QOS_MARGIN;
+    room = wifi_qos < 1000 ? 1000 - wifi_qos : 0;
+    coex_mgr.event_scale = ble_share > room ? room * 1000 / ble_share : 1000;
+    coex_mgr.mitigation_active = coex_mgr.event_scale < 1000;
+    spin_unlock_irqrestore(&coex_mgr.lock, flags);
+    
+    pr_debug("Coexistence: %d BLE channels, BLE airtime %u permille, events at %u permille\n",
+             used, ble_share, coex_mgr.event_scale);
+}
+
+/**
+ * Attach the combo chip's arbitration hardware
+ */
+int coex_register_radio(const struct coex_radio_ops *ops, void *ctx)
+{
+    if (!ops || !ops->grant || !ops->set_ble_channel_map) {
         return -EINVAL;
     }
+    if (coex_mgr.ops) {
+        return -EBUSY;
+    }
     
-    pr_info("Applying coexistence mitigation for channel %d (interference: %d)\n",
-            channel, interference_level);
+    coex_mgr.ctx = ctx;
+    coex_mgr.ops = ops;
+    coexistence_rearbitrate();
+    return 0;
+}
+EXPORT_SYMBOL_GPL(coex_register_radio);
+
+/**
+ * A BLE connection came up; anchor_ns is one of its connection event
+ * anchors on the ktime_get() clock
+ */
+int coex_ble_conn_add(u16 handle, u32 interval_us, u32 event_us, u64 anchor_ns)
+{
+    struct coex_ble_conn *conn = NULL;
+    unsigned long flags;
+    int i;
     
-    // Calculate power reduction based on interference level
-    power_reduction = min(interference_level / 10, 50); // Max 50% reduction
+    if (!interval_us || !event_us || event_us >= interval_us) {
+        return -EINVAL;
+    }
+    
+    spin_lock_irqsave(&coex_mgr.lock, flags);
+    for (i = 0; i < COEX_MAX_BLE_CONNS; i++) {
+        if (coex_mgr.conns[i].active && coex_mgr.conns[i].handle == handle) {
+            spin_unlock_irqrestore(&coex_mgr.lock, flags);
+            return -EEXIST;
+        }
+        if (!conn && !coex_mgr.conns[i].active) {
+            conn = &coex_mgr.conns[i];
+        }
+    }
+    if (!conn) {
+        spin_unlock_irqrestore(&coex_mgr.lock, flags);
+        return -ENOSPC;
+    }
     
-    // Reduce WiFi power
-    coex_mgr.wifi_power_level = max(50, 100 - power_reduction);
+    memset(conn, 0, sizeof(*conn));
+    conn->handle = handle;
+    conn->interval_ns = (u64)interval_us * NSEC_PER_USEC;
+    conn->event_ns = (u64)event_us * NSEC_PER_USEC;
+    conn->next_anchor_ns = anchor_ns;
+    conn->active = true;
+    spin_unlock_irqrestore(&coex_mgr.lock, flags);
     
-    // Reduce BLE power
-    coex_mgr.ble_power_level = max(50, 100 - power_reduction);
+    schedule_work(&coex_mgr.learn_work);
+    coexistence_rearbitrate();
+    return 0;
+}
+EXPORT_SYMBOL_GPL(coex_ble_conn_add);
+
+/**
+ * A new anchor was observed for handle, correcting for clock drift and
+ * connection updates
+ */
+int coex_ble_conn_anchor(u16 handle, u64 anchor_ns)
+{
+    unsigned long flags;
+    int i, ret = -ENOENT;
+    
+    spin_lock_irqsave(&coex_mgr.lock, flags);
+    for (i = 0; i < COEX_MAX_BLE_CONNS; i++) {
+        if (coex_mgr.conns[i].active && coex_mgr.conns[i].handle == handle) {
+            coex_mgr.conns[i].next_anchor_ns = anchor_ns;
+            ret = 0;
+        }
+    }
+    spin_unlock_irqrestore(&coex_mgr.lock, flags);
     
-    // Switch to less congested channel if needed
-    if (interference_level > 75) {
-        int new_channel = (channel + 3) % MAX_CHANNELS;
-        coexistence_switch_channel(new_channel);
+    if (!ret) {
+        coexistence_rearbitrate();
     }
+    return ret;
+}
+EXPORT_SYMBOL_GPL(coex_ble_conn_anchor);
+
+void coex_ble_conn_remove(u16 handle)
+{
+    unsigned long flags;
+    int i;
     
-    // Calculate throughput improvement
-    coex_mgr.throughput_improvement = power_reduction * 2; // 2% per 1% power reduction
+    spin_lock_irqsave(&coex_mgr.lock, flags);
+    for (i = 0; i < COEX_MAX_BLE_CONNS; i++) {
+        if (coex_mgr.conns[i].active && coex_mgr.conns[i].handle == handle) {
+            coex_mgr.conns[i].active = false;
+        }
+    }
+    spin_unlock_irqrestore(&coex_mgr.lock, flags);
     
-    coex_mgr.mitigation_active = 1;
-    coex_mgr.channel_switches++;
+    coexistence_rearbitrate();
+}
+EXPORT_SYMBOL_GPL(coex_ble_conn_remove);
+
+/**
+ * Outcome of a connection event on a data channel, for learning which
+ * channels are interfered with
+ */
+void coex_ble_event_done(u16 handle, u8 channel, bool ok)
+{
+    u16 per;
     
-    pr_info("Mitigation applied: WiFi power=%d%%, BLE power=%d%%, improvement=%llu%%\n",
-            coex_mgr.wifi_power_level, coex_mgr.ble_power_level, 
-            coex_mgr.throughput_improvement);
+    if (channel >= COEX_BLE_DATA_CHANNELS) {
+        return;
+    }
     
-    return 0;
+    // Moving average over about eight events
+    per = READ_ONCE(coex_mgr.ble_per[channel]);
+    per = per - per / 8 + (ok ? 0 : 1000 / 8);
+    WRITE_ONCE(coex_mgr.ble_per[channel], per);
+    coex_mgr.interference_level = max_t(u32, coex_mgr.interference_level - coex_mgr.interference_level / 8, per);
 }
+EXPORT_SYMBOL_GPL(coex_ble_event_done);
 
 /**
- * Switch to different channel
+ * Wi-Fi moved to channel; the BLE map follows at the next scan
  */
-static int coexistence_switch_channel(int new_channel)
+int coex_wifi_set_channel(int channel)
 {
-    if (new_channel < 1 || new_channel > MAX_CHANNELS) {
+    if (channel < 1 || channel > MAX_CHANNELS) {
         return -EINVAL;
     }
     
-    pr_info("Switching from channel %d to channel %d\n", 
-            coex_mgr.wifi_channel, new_channel);
+    pr_info("Wi-Fi on channel %d, was %d\n", channel, coex_mgr.wifi_channel);
     
-    coex_mgr.wifi_channel = new_channel;
-    coex_mgr.channel_switches++;
+    coex_mgr.wifi_channel = channel;
+    schedule_work(&coex_mgr.learn_work);
     
     return 0;
 }
+EXPORT_SYMBOL_GPL(coex_wifi_set_channel);
+
+/**
+ * Airtime the Wi-Fi driver's queues of access category ac need
+ */
+void coex_wifi_demand(enum coex_wifi_ac ac, u32 airtime_permille)
+{
+    if (ac < COEX_AC_COUNT) {
+        WRITE_ONCE(coex_mgr.wifi_demand[ac], min_t(u32, airtime_permille, 1000));
+    }
+}
+EXPORT_SYMBOL_GPL(coex_wifi_demand);
 
 /**
  * Interference mitigation algorithm
@@ -262,11 +533,12 @@ static int __init coexistence_init_module(void)
  */
 static void __exit coexistence_cleanup_module(void)
 {
-    del_timer_sync(&coex_mgr.scan_timer);
-    cancel_work_sync(&coex_mgr.mitigation_work);
-    
     atomic_set(&coex_mgr.coexistence_enabled, 0);
     
+    del_timer_sync(&coex_mgr.scan_timer);
+    cancel_work_sync(&coex_mgr.learn_work);
+    hrtimer_cancel(&coex_mgr.slot_timer);
+    
     pr_info("WiFi-BLE Coexistence unloaded\n");
 }
 
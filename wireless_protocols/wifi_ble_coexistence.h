@@ -0,0 +1,57 @@
+/**
+ * WiFi-BLE coexistence arbiter interface
+ *
+ * What the combo chip glue gives wifi_ble_coexistence.c and calls back
+ * into it. Airtime is split ahead of time rather than after collisions:
+ * the BLE controller reports each connection's interval and anchor, so
+ * the arbiter knows when every connection event falls and grants the
+ * antenna to BLE for exactly those windows and to Wi-Fi in between.
+ * When Wi-Fi voice and video demand would not fit beside them, BLE
+ * events are shortened, never dropped outright; a connection that lost
+ * a clash with another wins its next one. The BLE channel map leaves
+ * out the channels under the Wi-Fi channel and those whose learned
+ * packet error rate is high.
+ */
+
+#ifndef WIFI_BLE_COEXISTENCE_H
+#define WIFI_BLE_COEXISTENCE_H
+
+#include <linux/types.h>
+
+#define COEX_BLE_DATA_CHANNELS 37
+#define COEX_BLE_MAP_LEN 5                  // bit per data channel, as in LL_CHANNEL_MAP_IND
+#define COEX_MAX_BLE_CONNS 8
+
+enum coex_owner {
+    COEX_OWNER_WIFI,
+    COEX_OWNER_BLE
+};
+
+// Wi-Fi access categories
+enum coex_wifi_ac {
+    COEX_AC_VO,
+    COEX_AC_VI,
+    COEX_AC_BE,
+    COEX_AC_BK,
+    COEX_AC_COUNT
+};
+
+/*
+ * grant hands the antenna to owner for duration_us, 0 meaning until the
+ * next grant; it is called from hard timer context and must not sleep.
+ * set_ble_channel_map may sleep.
+ */
+struct coex_radio_ops {
+    void (*grant)(void *ctx, enum coex_owner owner, u32 duration_us);
+    int (*set_ble_channel_map)(void *ctx, const u8 *map);
+};
+
+int coex_register_radio(const struct coex_radio_ops *ops, void *ctx);
+int coex_ble_conn_add(u16 handle, u32 interval_us, u32 event_us, u64 anchor_ns);
+int coex_ble_conn_anchor(u16 handle, u64 anchor_ns);
+void coex_ble_conn_remove(u16 handle);
+void coex_ble_event_done(u16 handle, u8 channel, bool ok);
+int coex_wifi_set_channel(int channel);
+void coex_wifi_demand(enum coex_wifi_ac ac, u32 airtime_permille);
+
+#endif /* WIFI_BLE_COEXISTENCE_H */
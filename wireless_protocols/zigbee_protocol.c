@@ -12,11 +12,42 @@
 #include <linux/netdevice.h>
 #include <linux/skbuff.h>
 #include <linux/ieee802154.h>
+#include <linux/prefetch.h>
+#include <linux/spinlock.h>
+#include <linux/bitmap.h>
+#include <linux/jiffies.h>
+#include <linux/crc-ccitt.h>
+#include <asm/unaligned.h>
 
-#define ZIGBEE_VERSION "3.0.1"
+#define ZIGBEE_VERSION "3.1.0"
 #define ZIGBEE_MAX_PAYLOAD 127
 #define ZIGBEE_PAN_ID 0x1234
 #define ZIGBEE_CHANNEL 11
+#define ZIGBEE_HDR_LEN 9                        // FC + Seq + PAN + Addrs
+#define ZIGBEE_DEST_ADDR_OFF 5
+#define ZIGBEE_MIN_FRAME (ZIGBEE_HDR_LEN + 2)   // Header + FCS
+#define ZIGBEE_BURST_MAX 32
+#define ZIGBEE_BROADCAST 0xffff
+
+// MAC frame control
+#define ZIGBEE_FC_TYPE_MASK 0x0007
+#define ZIGBEE_FC_DATA 0x0001
+#define ZIGBEE_FC_ACK 0x0002
+#define ZIGBEE_FC_ACK_REQ (1 << 5)
+#define ZIGBEE_FC_DST_SHORT (1 << 9)
+#define ZIGBEE_FC_SRC_SHORT (1 << 11)
+#define ZIGBEE_ACK_LEN 5                        // FC + Seq + FCS
+
+#define ZIGBEE_NWK_HDR_LEN 8                    // FC + Dest + Src + Radius + Seq
+#define ZIGBEE_NWK_FC_DATA 0x0008               // Data frame, protocol version 2
+#define ZIGBEE_APS_HDR_LEN 8                    // FC + Endpoints + Cluster + Profile + Counter
+#define ZIGBEE_APS_FC_DATA 0x00                 // Data frame, unicast, no security
+
+#define ZIGBEE_TX_POOL 64
+#define ZIGBEE_TX_HEADROOM 16                   // for the radio driver's own header
+#define ZIGBEE_TX_BUF_LEN (ZIGBEE_MIN_FRAME + ZIGBEE_NWK_HDR_LEN + ZIGBEE_APS_HDR_LEN + ZIGBEE_MAX_PAYLOAD)
+#define ZIGBEE_ACK_WAIT_MS 2
+#define ZIGBEE_MAX_RETRIES 3                    // macMaxFrameRetries
 
 struct zigbee_frame {
     u16 frame_control;
@@ -29,6 +60,40 @@ struct zigbee_frame {
     u16 fcs;
 };
 
+// NWK and APS header fields of a frame originated here
+struct zigbee_aps_addr {
+    u16 nwk_dest;                               // final destination; the MAC one is the next hop
+    u8 radius;
+    u8 dst_endpoint;
+    u16 cluster_id;
+    u16 profile_id;
+    u8 src_endpoint;
+};
+
+/*
+ * A preallocated TX skb. The pool holds one reference to it for good,
+ * so it is free when nobody else holds one: not the radio, which drops
+ * its reference once the frame is out, and not us waiting for an ACK.
+ */
+struct zigbee_tx_slot {
+    struct sk_buff *skb;
+    u8 seq;
+    u8 retries;
+    bool awaiting_ack;
+    unsigned long deadline;
+};
+
+struct zigbee_tx_pool {
+    struct zigbee_tx_slot slots[ZIGBEE_TX_POOL];
+    unsigned int next;
+    spinlock_t lock;
+    DECLARE_BITMAP(acked, 256);                 // sequence numbers ACKed but not yet retired
+    u32 tx_acked;
+    u32 tx_no_ack;
+    u32 tx_retries;
+    u32 pool_misses;                            // sends that had to allocate
+};
+
 struct zigbee_device {
     u16 short_addr;
     u64 extended_addr;
@@ -36,12 +101,36 @@ struct zigbee_device {
     u8 channel;
     u8 role;  // Coordinator, Router, End Device
     bool joined;
+    u8 nwk_seq;
+    u8 aps_counter;
     struct list_head neighbors;
 };
 
 static struct zigbee_device zigbee_dev;
+static struct zigbee_tx_pool zigbee_tx_pool;
 static struct list_head zigbee_neighbors;
 
+static int zigbee_tx_pool_init(void)
+{
+    struct sk_buff *skb;
+    int i;
+    
+    spin_lock_init(&zigbee_tx_pool.lock);
+    for (i = 0; i < ZIGBEE_TX_POOL; i++) {
+        skb = alloc_skb(ZIGBEE_TX_HEADROOM + ZIGBEE_TX_BUF_LEN, GFP_KERNEL);
+        if (!skb) {
+            while (--i >= 0) {
+                kfree_skb(zigbee_tx_pool.slots[i].skb);
+            }
+            return -ENOMEM;
+        }
+        skb_reserve(skb, ZIGBEE_TX_HEADROOM);
+        zigbee_tx_pool.slots[i].skb = skb;
+    }
+    
+    return 0;
+}
+
 /**
  * Initialize Zigbee device
  */
@@ -69,152 +158,293 @@ static int zigbee_init(void)
         return -1;
     }
     
+    if (zigbee_tx_pool_init()) {
+        pr_err("Zigbee: Failed to allocate TX pool\n");
+        return -ENOMEM;
+    }
+    
     zigbee_dev.joined = true;
     pr_info("Zigbee: Network started, PAN ID: 0x%04x\n", zigbee_dev.pan_id);
     
     return 0;
 }
 
+/*
+ * Retire the frames whose ACK came in, resend those whose ACK wait ran
+ * out and give up on them after ZIGBEE_MAX_RETRIES. ACKs are only noted
+ * as they arrive; one pass here, under one lock, settles all of them.
+ * Called with the pool lock held.
+ */
+static void zigbee_tx_reap(void)
+{
+    struct zigbee_tx_slot *slot;
+    int i;
+    
+    for (i = 0; i < ZIGBEE_TX_POOL; i++) {
+        slot = &zigbee_tx_pool.slots[i];
+        if (!slot->awaiting_ack) {
+            continue;
+        }
+        
+        if (test_and_clear_bit(slot->seq, zigbee_tx_pool.acked)) {
+            slot->awaiting_ack = false;
+            zigbee_tx_pool.tx_acked++;
+        } else if (time_after(jiffies, slot->deadline) && !skb_shared(slot->skb)) {
+            if (slot->retries++ < ZIGBEE_MAX_RETRIES) {
+                // The frame is still in the buffer as it went out
+                skb_get(slot->skb);
+                if (ieee802154_xmit(slot->skb) < 0) {
+                    kfree_skb(slot->skb);
+                }
+                slot->deadline = jiffies + msecs_to_jiffies(ZIGBEE_ACK_WAIT_MS);
+                zigbee_tx_pool.tx_retries++;
+            } else {
+                slot->awaiting_ack = false;
+                zigbee_tx_pool.tx_no_ack++;
+            }
+        }
+    }
+}
+
+/*
+ * Take a free pool slot, its skb emptied and referenced for the radio;
+ * NULL if all are in flight
+ */
+static struct zigbee_tx_slot *zigbee_tx_get(void)
+{
+    struct zigbee_tx_slot *slot;
+    struct sk_buff *skb;
+    unsigned long flags;
+    unsigned int i, n;
+    
+    spin_lock_irqsave(&zigbee_tx_pool.lock, flags);
+    zigbee_tx_reap();
+    
+    for (i = 0; i < ZIGBEE_TX_POOL; i++) {
+        n = (zigbee_tx_pool.next + i) % ZIGBEE_TX_POOL;
+        slot = &zigbee_tx_pool.slots[n];
+        skb = slot->skb;
+        if (slot->awaiting_ack || skb_shared(skb)) {
+            continue;
+        }
+        
+        skb_get(skb);
+        skb->data = skb->head + ZIGBEE_TX_HEADROOM;
+        skb->len = 0;
+        skb_reset_tail_pointer(skb);
+        slot->retries = 0;
+        zigbee_tx_pool.next = n + 1;
+        spin_unlock_irqrestore(&zigbee_tx_pool.lock, flags);
+        return slot;
+    }
+    
+    zigbee_tx_pool.pool_misses++;
+    spin_unlock_irqrestore(&zigbee_tx_pool.lock, flags);
+    return NULL;
+}
+
 /**
  * Build Zigbee frame
+ *
+ * Writes the MAC header, the NWK and APS headers when aps is given, the
+ * payload and the FCS straight into skb's tail room. Without aps the
+ * payload is the MAC payload, e.g. a NWK frame being forwarded.
+ * Returns the MAC sequence number.
  */
-static int zigbee_build_frame(struct zigbee_frame *frame, u16 dest_addr,
+static int zigbee_build_frame(struct sk_buff *skb, u16 dest_addr, const struct zigbee_aps_addr *aps,
                               const u8 *payload, size_t payload_len)
 {
+    u16 frame_control;
+    u8 *data, *mpdu;
+    u8 seq;
+    
     if (payload_len > ZIGBEE_MAX_PAYLOAD) {
         pr_err("Zigbee: Payload too large\n");
         return -1;
     }
     
-    // Frame control
-    frame->frame_control = 0x0001;  // Data frame, no security
-    frame->frame_control |= (1 << 9);  // Dest addressing mode: short
-    frame->frame_control |= (1 << 11);  // Source addressing mode: short
-    
-    frame->sequence = zigbee_get_next_sequence();
-    frame->dest_pan = zigbee_dev.pan_id;
-    frame->dest_addr = dest_addr;
-    frame->src_addr = zigbee_dev.short_addr;
+    frame_control = ZIGBEE_FC_DATA | ZIGBEE_FC_DST_SHORT | ZIGBEE_FC_SRC_SHORT;  // No security
+    if (dest_addr != ZIGBEE_BROADCAST) {
+        frame_control |= ZIGBEE_FC_ACK_REQ;
+    }
+    seq = zigbee_get_next_sequence();
+    
+    mpdu = data = skb_put(skb, ZIGBEE_HDR_LEN + (aps ? ZIGBEE_NWK_HDR_LEN + ZIGBEE_APS_HDR_LEN : 0) +
+                          payload_len + 2);
+    
+    // MAC: FC, sequence, destination PAN, destination and source address
+    put_unaligned_le16(frame_control, data);
+    data[2] = seq;
+    put_unaligned_le16(zigbee_dev.pan_id, data + 3);
+    put_unaligned_le16(dest_addr, data + 5);
+    put_unaligned_le16(zigbee_dev.short_addr, data + 7);
+    data += ZIGBEE_HDR_LEN;
+    
+    if (aps) {
+        // NWK: FC, destination, source, radius, sequence
+        put_unaligned_le16(ZIGBEE_NWK_FC_DATA, data);
+        put_unaligned_le16(aps->nwk_dest, data + 2);
+        put_unaligned_le16(zigbee_dev.short_addr, data + 4);
+        data[6] = aps->radius;
+        data[7] = zigbee_dev.nwk_seq++;
+        data += ZIGBEE_NWK_HDR_LEN;
+        
+        // APS: FC, destination endpoint, cluster, profile, source endpoint, counter
+        data[0] = ZIGBEE_APS_FC_DATA;
+        data[1] = aps->dst_endpoint;
+        put_unaligned_le16(aps->cluster_id, data + 2);
+        put_unaligned_le16(aps->profile_id, data + 4);
+        data[6] = aps->src_endpoint;
+        data[7] = zigbee_dev.aps_counter++;
+        data += ZIGBEE_APS_HDR_LEN;
+    }
     
-    memcpy(frame->payload, payload, payload_len);
-    frame->payload_len = payload_len;
+    memcpy(data, payload, payload_len);
+    data += payload_len;
     
-    // Calculate FCS
-    frame->fcs = zigbee_calculate_fcs(frame);
+    put_unaligned_le16(crc_ccitt(0, mpdu, data - mpdu), data);
     
-    return 0;
+    return seq;
 }
 
 /**
  * Send Zigbee frame
+ *
+ * Built in a pooled skb unless all are in flight. Unicast frames stay in
+ * their slot until ACKed, for retransmission.
  */
-static int zigbee_send_frame(struct zigbee_frame *frame)
+static int zigbee_send_frame(u16 dest_addr, const struct zigbee_aps_addr *aps, const u8 *payload,
+                             size_t payload_len)
 {
+    struct zigbee_tx_slot *slot;
     struct sk_buff *skb;
-    u8 *data;
-    int len;
-    
-    len = 2 + 1 + 2 + 2 + 2 + frame->payload_len + 2;  // FC + Seq + PANs + Addrs + Payload + FCS
+    unsigned long flags;
+    int seq;
     
-    skb = alloc_skb(len, GFP_ATOMIC);
+    slot = zigbee_tx_get();
+    skb = slot ? slot->skb : alloc_skb(ZIGBEE_TX_BUF_LEN, GFP_ATOMIC);
     if (!skb) {
         pr_err("Zigbee: Failed to allocate skb\n");
         return -1;
     }
     
-    data = skb_put(skb, len);
-    
-    // Frame control
-    put_unaligned_le16(frame->frame_control, data);
-    data += 2;
-    
-    // Sequence
-    *data++ = frame->sequence;
-    
-    // Destination PAN
-    put_unaligned_le16(frame->dest_pan, data);
-    data += 2;
-    
-    // Destination address
-    put_unaligned_le16(frame->dest_addr, data);
-    data += 2;
-    
-    // Source address
-    put_unaligned_le16(frame->src_addr, data);
-    data += 2;
-    
-    // Payload
-    memcpy(data, frame->payload, frame->payload_len);
-    data += frame->payload_len;
+    seq = zigbee_build_frame(skb, dest_addr, aps, payload, payload_len);
+    if (seq < 0) {
+        kfree_skb(skb);
+        return seq;
+    }
     
-    // FCS
-    put_unaligned_le16(frame->fcs, data);
+    if (slot && dest_addr != ZIGBEE_BROADCAST) {
+        spin_lock_irqsave(&zigbee_tx_pool.lock, flags);
+        clear_bit(seq, zigbee_tx_pool.acked);
+        slot->seq = seq;
+        slot->deadline = jiffies + msecs_to_jiffies(ZIGBEE_ACK_WAIT_MS);
+        slot->awaiting_ack = true;
+        spin_unlock_irqrestore(&zigbee_tx_pool.lock, flags);
+    }
     
     // Send via IEEE 802.15.4
     if (ieee802154_xmit(skb) < 0) {
         pr_err("Zigbee: Failed to transmit frame\n");
+        if (slot) {
+            WRITE_ONCE(slot->awaiting_ack, false);
+        }
         kfree_skb(skb);
         return -1;
     }
     
-    pr_debug("Zigbee: Frame sent to 0x%04x, seq %d\n",
-             frame->dest_addr, frame->sequence);
+    pr_debug("Zigbee: Frame sent to 0x%04x, seq %d\n", dest_addr, seq);
     
     return 0;
 }
 
-/**
- * Receive Zigbee frame
- */
-static int zigbee_receive_frame(struct sk_buff *skb)
+// Destination address sits after FC, sequence and destination PAN
+static bool zigbee_frame_is_ours(const u8 *data)
 {
-    struct zigbee_frame frame;
-    u8 *data = skb->data;
-    int len = skb->len;
+    u16 dest_addr = get_unaligned_le16(data + ZIGBEE_DEST_ADDR_OFF);
     
-    if (len < 11) {  // Minimum frame size
-        pr_err("Zigbee: Frame too short\n");
-        return -1;
+    return dest_addr == zigbee_dev.short_addr || dest_addr == ZIGBEE_BROADCAST;
+}
+
+// A valid ACK frame is noted for the next zigbee_tx_reap()
+static bool zigbee_note_ack(const u8 *data, unsigned int len)
+{
+    if (len != ZIGBEE_ACK_LEN || (get_unaligned_le16(data) & ZIGBEE_FC_TYPE_MASK) != ZIGBEE_FC_ACK) {
+        return false;
     }
+    if (get_unaligned_le16(data + 3) == crc_ccitt(0, data, 3)) {
+        set_bit(data[2], zigbee_tx_pool.acked);
+    }
+    return true;
+}
+
+/**
+ * Parse a frame of at least ZIGBEE_MIN_FRAME bytes and verify its FCS
+ */
+static int zigbee_parse_frame(const u8 *data, int len, struct zigbee_frame *frame)
+{
+    const u8 *mpdu = data;
     
-    // Parse frame
-    frame.frame_control = get_unaligned_le16(data);
+    frame->frame_control = get_unaligned_le16(data);
     data += 2;
     
-    frame.sequence = *data++;
+    frame->sequence = *data++;
     
-    frame.dest_pan = get_unaligned_le16(data);
+    frame->dest_pan = get_unaligned_le16(data);
     data += 2;
     
-    frame.dest_addr = get_unaligned_le16(data);
+    frame->dest_addr = get_unaligned_le16(data);
     data += 2;
     
-    frame.src_addr = get_unaligned_le16(data);
+    frame->src_addr = get_unaligned_le16(data);
     data += 2;
     
-    frame.payload_len = len - 11;
-    if (frame.payload_len > ZIGBEE_MAX_PAYLOAD) {
+    if (len - ZIGBEE_MIN_FRAME > ZIGBEE_MAX_PAYLOAD) {
         pr_err("Zigbee: Payload too large\n");
         return -1;
     }
+    frame->payload_len = len - ZIGBEE_MIN_FRAME;
     
-    memcpy(frame.payload, data, frame.payload_len);
-    data += frame.payload_len;
+    memcpy(frame->payload, data, frame->payload_len);
+    data += frame->payload_len;
     
-    frame.fcs = get_unaligned_le16(data);
+    frame->fcs = get_unaligned_le16(data);
     
     // Verify FCS
-    if (frame.fcs != zigbee_calculate_fcs(&frame)) {
+    if (frame->fcs != crc_ccitt(0, mpdu, len - 2)) {
         pr_err("Zigbee: FCS mismatch\n");
         return -1;
     }
     
+    return 0;
+}
+
+/**
+ * Receive Zigbee frame
+ */
+static int zigbee_receive_frame(struct sk_buff *skb)
+{
+    struct zigbee_frame frame;
+    
+    // Settled with everything else pending at the next send
+    if (zigbee_note_ack(skb->data, skb->len)) {
+        return 0;
+    }
+    
+    if (skb->len < ZIGBEE_MIN_FRAME) {
+        pr_err("Zigbee: Frame too short\n");
+        return -1;
+    }
+    
     // Check if frame is for us
-    if (frame.dest_addr != zigbee_dev.short_addr &&
-        frame.dest_addr != 0xffff) {  // Broadcast
+    if (!zigbee_frame_is_ours(skb->data)) {
         return 0;
     }
     
+    if (zigbee_parse_frame(skb->data, skb->len, &frame)) {
+        return -1;
+    }
+    
     pr_debug("Zigbee: Frame received from 0x%04x, seq %d\n",
              frame.src_addr, frame.sequence);
     
@@ -224,12 +454,74 @@ static int zigbee_receive_frame(struct sk_buff *skb)
     return 0;
 }
 
+/**
+ * Receive a burst of frames, as drained from the radio's RX ring
+ *
+ * The first pass only looks at headers: it drops runts and frames for
+ * other nodes, prefetching the next frame meanwhile, so the payload copy
+ * and FCS are paid only for our own frames. The second pass parses and
+ * processes those, prefetching the next one's payload. A frame that
+ * fails parsing is skipped, not the rest of the burst. The skbs stay the
+ * caller's. ACKs in the burst are retired together once it is done.
+ * Returns the number of frames processed.
+ */
+static int zigbee_receive_burst(struct sk_buff **skbs, unsigned int n)
+{
+    struct sk_buff *ours[ZIGBEE_BURST_MAX];
+    struct zigbee_frame frame;
+    unsigned int i, nr_ours = 0, nr_acks = 0;
+    unsigned long flags;
+    int processed = 0;
+    
+    if (!skbs || n > ZIGBEE_BURST_MAX) {
+        return -EINVAL;
+    }
+    
+    for (i = 0; i < n; i++) {
+        if (i + 1 < n) {
+            prefetch(skbs[i + 1]->data);
+        }
+        if (zigbee_note_ack(skbs[i]->data, skbs[i]->len)) {
+            nr_acks++;
+            continue;
+        }
+        if (skbs[i]->len < ZIGBEE_MIN_FRAME) {
+            pr_err_ratelimited("Zigbee: Frame too short\n");
+            continue;
+        }
+        if (zigbee_frame_is_ours(skbs[i]->data)) {
+            ours[nr_ours++] = skbs[i];
+        }
+    }
+    
+    for (i = 0; i < nr_ours; i++) {
+        if (i + 1 < nr_ours) {
+            prefetch(ours[i + 1]->data + ZIGBEE_HDR_LEN);
+        }
+        if (zigbee_parse_frame(ours[i]->data, ours[i]->len, &frame)) {
+            continue;
+        }
+        zigbee_process_frame(&frame);
+        processed++;
+    }
+    
+    if (nr_acks) {
+        spin_lock_irqsave(&zigbee_tx_pool.lock, flags);
+        zigbee_tx_reap();
+        spin_unlock_irqrestore(&zigbee_tx_pool.lock, flags);
+    }
+    
+    pr_debug("Zigbee: Burst of %u frames, %u for us, %d processed, %u ACKs\n",
+             n, nr_ours, processed, nr_acks);
+    
+    return processed;
+}
+
 /**
  * Send data via Zigbee
  */
 int zigbee_send_data(u16 dest_addr, const u8 *data, size_t len)
 {
-    struct zigbee_frame frame;
     int ret;
     
     if (!zigbee_dev.joined) {
@@ -237,12 +529,7 @@ int zigbee_send_data(u16 dest_addr, const u8 *data, size_t len)
         return -1;
     }
     
-    ret = zigbee_build_frame(&frame, dest_addr, data, len);
-    if (ret) {
-        return ret;
-    }
-    
-    ret = zigbee_send_frame(&frame);
+    ret = zigbee_send_frame(dest_addr, NULL, data, len);
     if (ret) {
         return ret;
     }
@@ -252,6 +539,19 @@ int zigbee_send_data(u16 dest_addr, const u8 *data, size_t len)
     return 0;
 }
 
+/**
+ * Send an APS data frame to aps->nwk_dest via next_hop
+ */
+int zigbee_send_aps(u16 next_hop, const struct zigbee_aps_addr *aps, const u8 *data, size_t len)
+{
+    if (!zigbee_dev.joined) {
+        pr_err("Zigbee: Device not joined to network\n");
+        return -1;
+    }
+    
+    return zigbee_send_frame(next_hop, aps, data, len);
+}
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("jk1806");
 MODULE_DESCRIPTION("Zigbee 3.0 Protocol Stack");